@@ -256,6 +256,13 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pg_autoctl_show_failover_timeline",
+        "pg_autoctl show failover-timeline",
+        "pg_autoctl show failover-timeline",
+        [author],
+        1,
+    ),
     (
         "ref/pg_autoctl_show_state",
         "pg_autoctl show state",
@@ -410,6 +417,13 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pg_autoctl_perform_rolling_maintenance",
+        "pg_autoctl perform rolling-maintenance",
+        "pg_autoctl perform rolling-maintenance",
+        [author],
+        1,
+    ),
     (
         "ref/pg_autoctl_run",
         "pg_autoctl run",
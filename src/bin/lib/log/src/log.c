@@ -20,6 +20,7 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -31,6 +32,23 @@
 
 #include "log.h"
 
+/*
+ * Log lines that fit in LOG_LINE_MAX bytes are written to stderr with a
+ * single write(2) call, which POSIX guarantees to be atomic on pipes up to
+ * PIPE_BUF bytes (4096 on Linux) and which O_APPEND files also honour. Lines
+ * from different processes sharing the same stderr can't then interleave,
+ * and we don't need the cross-process lock for them. Longer lines are still
+ * written while holding the lock.
+ *
+ * In buffered mode, complete lines are accumulated in a per-process buffer
+ * instead, and the buffer is drained in batches of whole lines, each batch
+ * being a single write(2) of at most LOG_LINE_MAX bytes. The buffer is
+ * drained when it's full, when a new second starts, when logging an ERROR
+ * or FATAL line, at exit, and when log_flush() is called.
+ */
+#define LOG_LINE_MAX 4096
+#define LOG_BUFFER_SIZE (64 * 1024)
+
 static struct {
   void *udata;
   log_LockFn lock;
@@ -38,6 +56,11 @@ static struct {
   int level;
   int quiet;
   int useColors;
+  int buffered;
+  pid_t bufferPid;
+  time_t bufferTime;
+  size_t bufferLen;
+  char buffer[LOG_BUFFER_SIZE];
 } L;
 
 
@@ -97,10 +120,141 @@ void log_use_colors(int enable) {
   L.useColors = enable ? 1 : 0;
 }
 
+
+/*
+ * write_all writes the whole given data to the given file descriptor. Errors
+ * are ignored: we have nowhere to report them anyway.
+ */
+static void write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (written <= 0) {
+      return;
+    }
+
+    data += written;
+    len -= written;
+  }
+}
+
+
+/*
+ * drain_buffer writes the buffered lines to stderr, in batches of whole lines
+ * of at most LOG_LINE_MAX bytes each.
+ */
+static void drain_buffer(void) {
+  size_t offset = 0;
+
+  while (offset < L.bufferLen) {
+    size_t batch = L.bufferLen - offset;
+
+    if (batch > LOG_LINE_MAX) {
+      /* find the last complete line that fits in the batch */
+      batch = LOG_LINE_MAX;
+
+      while (batch > 0 && L.buffer[offset + batch - 1] != '\n') {
+        --batch;
+      }
+
+      /* each line is at most LOG_LINE_MAX bytes, but let's be careful */
+      if (batch == 0) {
+        batch = LOG_LINE_MAX;
+      }
+    }
+
+    write_all(STDERR_FILENO, L.buffer + offset, batch);
+    offset += batch;
+  }
+
+  L.bufferLen = 0;
+}
+
+
+/*
+ * check_buffer_owner disables buffered mode in a child process that inherited
+ * the buffer from its parent with fork(). The parent is going to write the
+ * buffered lines, and the child is likely to call exec() soon, which would
+ * lose its own buffered lines.
+ */
+static void check_buffer_owner(void) {
+  if (L.buffered && L.bufferPid != getpid()) {
+    L.buffered = 0;
+    L.bufferLen = 0;
+  }
+}
+
+
+void log_flush(void) {
+  check_buffer_owner();
+
+  if (L.bufferLen > 0) {
+    drain_buffer();
+  }
+}
+
+
+static void log_flush_atexit(void) {
+  log_flush();
+}
+
+
+void log_set_buffered(int enable) {
+  static int atexitRegistered = 0;
+
+  log_flush();
+
+  if (enable && !atexitRegistered) {
+    atexit(log_flush_atexit);
+    atexitRegistered = 1;
+  }
+
+  L.buffered = enable ? 1 : 0;
+  L.bufferPid = getpid();
+  L.bufferTime = time(NULL);
+}
+
+
+/*
+ * format_prefix prepares the prefix of a stderr log line.
+ */
+static int format_prefix(char *str, size_t size, int level,
+                         const char *file, int line, struct tm *lt) {
+  char buf[16];
+  int showLineNumber = L.level <= 1;
+
+  buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
+
+  if (L.useColors) {
+    if (showLineNumber) {
+      return pg_snprintf(str, size, "%s %d %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+                         buf, getpid(), level_colors[level], level_names[level],
+                         file, line);
+    }
+
+    return pg_snprintf(str, size, "%s %d %s%-5s\x1b[0m ",
+                       buf, getpid(), level_colors[level], level_names[level]);
+  }
+
+  if (showLineNumber) {
+    return pg_snprintf(str, size, "%s %d %-5s %s:%d ",
+                       buf, getpid(), level_names[level], file, line);
+  }
+
+  return pg_snprintf(str, size, "%s %d %-5s ",
+                     buf, getpid(), level_names[level]);
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...)
 {
-	time_t t;
-	struct tm *lt;
+  time_t t;
+  struct tm *lt;
+  int savedErrno = errno;
 
   if (level < L.level) {
     return;
@@ -111,63 +265,81 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
 	  return;
   }
 
-  /* Acquire lock */
-  lock();
-
   /* Get current time */
   t = time(NULL);
   lt = localtime(&t);
 
-  /* Log to stderr */
+  /* Log to stderr, formatting the whole line in a single buffer */
   if (!L.quiet) {
     va_list args;
-    char buf[16];
-	int showLineNumber = L.level <= 1;
-
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-
-	if (L.useColors)
-	{
-		pg_fprintf(stderr, "%s %d %s%-5s\x1b[0m ",
-				   buf,
-				   getpid(),
-				   level_colors[level],
-				   level_names[level]);
-
-		if (showLineNumber)
-		{
-			pg_fprintf(stderr, "\x1b[90m%s:%d:\x1b[0m ", file, line);
-		}
-	}
-	else
-	{
-		pg_fprintf(stderr, "%s %d %-5s ", buf, getpid(), level_names[level]);
-
-		if (showLineNumber)
-		{
-			pg_fprintf(stderr, "%s:%d ", file, line);
-		}
-	}
-
-    va_start(args, fmt);
-    pg_vfprintf(stderr, fmt, args);
-    va_end(args);
-    pg_fprintf(stderr, "\n");
+    char str[LOG_LINE_MAX];
+    int prefixLen = format_prefix(str, sizeof(str), level, file, line, lt);
+    int len = -1;
+
+    if (prefixLen >= 0 && prefixLen < (int) sizeof(str) - 1) {
+      errno = savedErrno;
+      va_start(args, fmt);
+      len = pg_vsnprintf(str + prefixLen, sizeof(str) - prefixLen, fmt, args);
+      va_end(args);
+    }
+
+    /* keep room for the newline */
+    if (len >= 0 && prefixLen + len < (int) sizeof(str) - 1) {
+      len += prefixLen;
+      str[len++] = '\n';
+
+      check_buffer_owner();
+
+      if (L.buffered) {
+        if (L.bufferLen + len > sizeof(L.buffer) || t != L.bufferTime) {
+          drain_buffer();
+          L.bufferTime = t;
+        }
+
+        memcpy(L.buffer + L.bufferLen, str, len);
+        L.bufferLen += len;
+
+        /* errors are written synchronously */
+        if (level >= LOG_ERROR) {
+          drain_buffer();
+        }
+      } else {
+        write_all(STDERR_FILENO, str, len);
+      }
+    } else {
+      /* the line is too long to be written atomically, use the lock */
+      log_flush();
+      lock();
+
+      errno = savedErrno;
+      va_start(args, fmt);
+      pg_fprintf(stderr, "%s", str);
+      pg_vfprintf(stderr, fmt, args);
+      va_end(args);
+      pg_fprintf(stderr, "\n");
+
+      unlock();
+    }
   }
 
   /* Log to file */
   if (L.fp) {
     va_list args;
     char buf[32];
+
+    lock();
+
     buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
     pg_fprintf(L.fp, "%s %d %-5s %s:%d: ",
 			   buf, getpid(), level_names[level], file, line);
+    errno = savedErrno;
     va_start(args, fmt);
     pg_vfprintf(L.fp, fmt, args);
     va_end(args);
     pg_fprintf(L.fp, "\n");
+
+    unlock();
   }
 
-  /* Release lock */
-  unlock();
+  errno = savedErrno;
 }
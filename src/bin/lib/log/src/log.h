@@ -33,6 +33,8 @@ void log_set_level(int level);
 int log_get_level(void);
 void log_set_quiet(int enable);
 void log_use_colors(int enable);
+void log_set_buffered(int enable);
+void log_flush(void);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...)
  	__attribute__((format(printf, 4, 5)));
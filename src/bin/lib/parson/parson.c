@@ -71,6 +71,14 @@
 #define PARSON_NUM_BUF_SIZE 64 /* double printed with "%1.17g" shouldn't be longer than 25 bytes so let's be paranoid and use 64 */
 #endif
 
+#ifndef PARSON_STREAM_BUF_SIZE
+#define PARSON_STREAM_BUF_SIZE 1024 /* scratch buffer for scalar values when streaming, larger values are allocated */
+#endif
+
+#ifndef PARSON_ARENA_BLOCK_SIZE
+#define PARSON_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
 #define SIZEOF_TOKEN(a)       (sizeof(a) - 1)
 #define SKIP_CHAR(str)        ((*str)++)
 #define SKIP_WHITESPACES(str) while (isspace((unsigned char)(**str))) { SKIP_CHAR(str); }
@@ -194,6 +202,9 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
 static int json_serialize_string(const char *string, size_t len, char *buf);
 static int append_indent(char *buf, int level);
 static int append_string(char *buf, const char *string);
+static int json_serialize_scalar_to_stream(const JSON_Value *value, FILE *stream, char *num_buf);
+static int json_serialize_key_to_stream(const char *key, FILE *stream);
+static int json_serialize_to_stream_r(const JSON_Value *value, FILE *stream, int level, parson_bool_t is_pretty, char *num_buf);
 
 /* Various */
 static char * read_file(const char * filename) {
@@ -1328,6 +1339,151 @@ static int append_string(char *buf, const char *string) {
 #undef APPEND_STRING
 #undef APPEND_INDENT
 
+/* Streaming serialization: containers are written piece by piece to the
+   stream, and only scalar values go through a scratch buffer, so that the
+   whole document never has to be held in memory. */
+#define STREAM_STRING(str) do { if (fputs((str), stream) == EOF) { return -1; } } while(0)
+
+static int json_serialize_scalar_to_stream(const JSON_Value *value, FILE *stream, char *num_buf) {
+    char stack_buf[PARSON_STREAM_BUF_SIZE];
+    char *buf = stack_buf;
+    int res = -1;
+    int needed = json_serialize_to_buffer_r(value, NULL, 0, PARSON_FALSE, num_buf);
+    if (needed < 0) {
+        return -1;
+    }
+    if ((size_t)needed + 1 > sizeof(stack_buf)) {
+        buf = (char*)parson_malloc((size_t)needed + 1);
+        if (buf == NULL) {
+            return -1;
+        }
+    }
+    res = json_serialize_to_buffer_r(value, buf, 0, PARSON_FALSE, NULL);
+    if (res >= 0 && fwrite(buf, 1, (size_t)res, stream) != (size_t)res) {
+        res = -1;
+    }
+    if (buf != stack_buf) {
+        parson_free(buf);
+    }
+    return res;
+}
+
+static int json_serialize_key_to_stream(const char *key, FILE *stream) {
+    char stack_buf[PARSON_STREAM_BUF_SIZE];
+    char *buf = stack_buf;
+    size_t len = strlen(key);
+    int res = -1;
+    int needed = json_serialize_string(key, len, NULL);
+    if (needed < 0) {
+        return -1;
+    }
+    if ((size_t)needed + 1 > sizeof(stack_buf)) {
+        buf = (char*)parson_malloc((size_t)needed + 1);
+        if (buf == NULL) {
+            return -1;
+        }
+    }
+    res = json_serialize_string(key, len, buf);
+    if (res >= 0 && fwrite(buf, 1, (size_t)res, stream) != (size_t)res) {
+        res = -1;
+    }
+    if (buf != stack_buf) {
+        parson_free(buf);
+    }
+    return res;
+}
+
+static int json_serialize_to_stream_r(const JSON_Value *value, FILE *stream, int level, parson_bool_t is_pretty, char *num_buf) {
+    JSON_Array *array = NULL;
+    JSON_Object *object = NULL;
+    const char *key = NULL;
+    size_t i = 0, count = 0;
+    int j = 0;
+
+    switch (json_value_get_type(value)) {
+        case JSONArray:
+            array = json_value_get_array(value);
+            count = json_array_get_count(array);
+            STREAM_STRING("[");
+            if (count > 0 && is_pretty) {
+                STREAM_STRING("\n");
+            }
+            for (i = 0; i < count; i++) {
+                if (is_pretty) {
+                    for (j = 0; j < level + 1; j++) {
+                        STREAM_STRING("    ");
+                    }
+                }
+                if (json_serialize_to_stream_r(json_array_get_value(array, i), stream, level+1, is_pretty, num_buf) < 0) {
+                    return -1;
+                }
+                if (i < (count - 1)) {
+                    STREAM_STRING(",");
+                }
+                if (is_pretty) {
+                    STREAM_STRING("\n");
+                }
+            }
+            if (count > 0 && is_pretty) {
+                for (j = 0; j < level; j++) {
+                    STREAM_STRING("    ");
+                }
+            }
+            STREAM_STRING("]");
+            return 0;
+        case JSONObject:
+            object = json_value_get_object(value);
+            count  = json_object_get_count(object);
+            STREAM_STRING("{");
+            if (count > 0 && is_pretty) {
+                STREAM_STRING("\n");
+            }
+            for (i = 0; i < count; i++) {
+                key = json_object_get_name(object, i);
+                if (key == NULL) {
+                    return -1;
+                }
+                if (is_pretty) {
+                    for (j = 0; j < level + 1; j++) {
+                        STREAM_STRING("    ");
+                    }
+                }
+                /* We do not support key names with embedded \0 chars */
+                if (json_serialize_key_to_stream(key, stream) < 0) {
+                    return -1;
+                }
+                STREAM_STRING(is_pretty ? ": " : ":");
+                if (json_serialize_to_stream_r(json_object_get_value_at(object, i), stream, level+1, is_pretty, num_buf) < 0) {
+                    return -1;
+                }
+                if (i < (count - 1)) {
+                    STREAM_STRING(",");
+                }
+                if (is_pretty) {
+                    STREAM_STRING("\n");
+                }
+            }
+            if (count > 0 && is_pretty) {
+                for (j = 0; j < level; j++) {
+                    STREAM_STRING("    ");
+                }
+            }
+            STREAM_STRING("}");
+            return 0;
+        case JSONString:
+        case JSONBoolean:
+        case JSONNumber:
+        case JSONNull:
+            return json_serialize_scalar_to_stream(value, stream, num_buf) < 0 ? -1 : 0;
+        case JSONError:
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+#undef STREAM_STRING
+
 /* Parser API */
 JSON_Value * json_parse_file(const char *filename) {
     char *file_contents = read_file(filename);
@@ -2417,6 +2573,22 @@ size_t json_string_len(const JSON_Value *value) {
     return json_value_get_string_len(value);
 }
 
+JSON_Status json_serialize_to_file_stream(const JSON_Value *value, FILE *stream) {
+    char num_buf[PARSON_NUM_BUF_SIZE];
+    if (stream == NULL || json_serialize_to_stream_r(value, stream, 0, PARSON_FALSE, num_buf) < 0) {
+        return JSONFailure;
+    }
+    return JSONSuccess;
+}
+
+JSON_Status json_serialize_to_file_stream_pretty(const JSON_Value *value, FILE *stream) {
+    char num_buf[PARSON_NUM_BUF_SIZE];
+    if (stream == NULL || json_serialize_to_stream_r(value, stream, 0, PARSON_TRUE, num_buf) < 0) {
+        return JSONFailure;
+    }
+    return JSONSuccess;
+}
+
 double json_number(const JSON_Value *value) {
     return json_value_get_number(value);
 }
@@ -2430,6 +2602,79 @@ void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Fu
     parson_free = free_fun;
 }
 
+/* Arena allocation: blocks are chained and never freed one allocation at a
+   time, json_arena_end releases them all at once. */
+typedef struct json_arena_block_t {
+    struct json_arena_block_t *next;
+    size_t size;
+    size_t used;
+} JSON_Arena_Block;
+
+#define ARENA_ALIGN(size) (((size) + 15) & ~((size_t)15))
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(JSON_Arena_Block))
+
+static JSON_Arena_Block *parson_arena = NULL;
+static int parson_arena_depth = 0;
+static JSON_Malloc_Function parson_arena_saved_malloc = NULL;
+static JSON_Free_Function parson_arena_saved_free = NULL;
+
+static void * parson_arena_malloc(size_t size) {
+    JSON_Arena_Block *block = parson_arena;
+    size_t aligned = ARENA_ALIGN(size);
+    void *ptr = NULL;
+    if (block == NULL || block->size - block->used < aligned) {
+        size_t block_size = aligned > PARSON_ARENA_BLOCK_SIZE ? aligned : PARSON_ARENA_BLOCK_SIZE;
+        block = (JSON_Arena_Block*)parson_arena_saved_malloc(ARENA_HEADER_SIZE + block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        /* keep filling the current block when an oversize one is added */
+        if (parson_arena != NULL && aligned > PARSON_ARENA_BLOCK_SIZE) {
+            block->next = parson_arena->next;
+            parson_arena->next = block;
+        } else {
+            block->next = parson_arena;
+            parson_arena = block;
+        }
+    }
+    ptr = (char*)block + ARENA_HEADER_SIZE + block->used;
+    block->used += aligned;
+    return ptr;
+}
+
+static void parson_arena_free(void *ptr) {
+    (void)ptr;
+}
+
+#undef ARENA_ALIGN
+#undef ARENA_HEADER_SIZE
+
+void json_arena_begin(void) {
+    if (parson_arena_depth++ > 0) {
+        return;
+    }
+    parson_arena_saved_malloc = parson_malloc;
+    parson_arena_saved_free = parson_free;
+    parson_malloc = parson_arena_malloc;
+    parson_free = parson_arena_free;
+}
+
+void json_arena_end(void) {
+    JSON_Arena_Block *block = NULL;
+    if (parson_arena_depth == 0 || --parson_arena_depth > 0) {
+        return;
+    }
+    while (parson_arena != NULL) {
+        block = parson_arena;
+        parson_arena = block->next;
+        parson_arena_saved_free(block);
+    }
+    parson_malloc = parson_arena_saved_malloc;
+    parson_free = parson_arena_saved_free;
+}
+
 void json_set_escape_slashes(int escape_slashes) {
     parson_escape_slashes = escape_slashes;
 }
@@ -41,6 +41,7 @@ extern "C"
 #define PARSON_VERSION_STRING "1.3.0"
 
 #include <stddef.h>   /* size_t */
+#include <stdio.h>    /* FILE */
 
 /* Types and enums */
 typedef struct json_object_t JSON_Object;
@@ -71,6 +72,13 @@ typedef void   (*JSON_Free_Function)(void *);
    from stdlib will be used for all allocations */
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun);
 
+/* Between json_arena_begin and json_arena_end all allocations come from an arena, freeing values
+   is a no-op and json_arena_end releases the whole arena at once. Values and strings built in the
+   arena must not be used after json_arena_end. Calls can be nested, only the outermost
+   json_arena_end releases the memory. This is not thread safe. */
+void json_arena_begin(void);
+void json_arena_end(void);
+
 /* Sets if slashes should be escaped or not when serializing JSON. By default slashes are escaped.
  This function sets a global setting and is not thread safe. */
 void json_set_escape_slashes(int escape_slashes);
@@ -100,11 +108,15 @@ JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t
 JSON_Status json_serialize_to_file(const JSON_Value *value, const char *filename);
 char *      json_serialize_to_string(const JSON_Value *value);
 
+/* Writes to an already opened stream, without building the whole serialized string in memory */
+JSON_Status json_serialize_to_file_stream(const JSON_Value *value, FILE *stream);
+
 /* Pretty serialization */
 size_t      json_serialization_size_pretty(const JSON_Value *value); /* returns 0 on fail */
 JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf, size_t buf_size_in_bytes);
 JSON_Status json_serialize_to_file_pretty(const JSON_Value *value, const char *filename);
 char *      json_serialize_to_string_pretty(const JSON_Value *value);
+JSON_Status json_serialize_to_file_stream_pretty(const JSON_Value *value, FILE *stream);
 
 void        json_free_serialized_string(char *string); /* frees string from json_serialize_to_string and json_serialize_to_string_pretty */
 
@@ -7,6 +7,7 @@
  */
 
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -21,6 +22,9 @@
 #define BUFSIZE 1024
 #define ARGS_INCREMENT 12
 
+/* we read the sub-process output by chunks of that size */
+#define READ_BUFSIZE 8192
+
 #if defined(WIN32) && !defined(__CYGWIN__)
 #define DEV_NULL "NUL"
 #else
@@ -41,7 +45,10 @@ typedef struct
 	bool capture;               /* do we capture output, or redirect it? */
 	bool tty;					/* do we share our tty? */
 
-	/* register a function to process output as it appears */
+	/*
+	 * Register a function to process output as it appears, one line at a
+	 * time. The output is then not accumulated in stdOut and stdErr.
+	 */
 	void (*processBuffer)(const char *buffer, bool error);
 
 	int stdOutFd;               /* redirect stdout to file descriptor */
@@ -64,18 +71,38 @@ int snprintf_program_command_line(Program *prog, char *buffer, int size);
 static void exit_internal_error(void);
 static void dup2_or_exit(int fildes, int fildes2);
 static void close_or_exit(int fildes);
+static pid_t spawn_subprogram(Program *prog, int *outpipe, int *errpipe);
 static void read_from_pipes(Program *prog,
 							pid_t childPid, int *outpipe, int *errpipe);
-static size_t read_into_buf(Program *prog,
-							int filedes,
-							PQExpBuffer buffer,
-							bool error);
+static ssize_t read_into_buf(Program *prog,
+							 int filedes,
+							 PQExpBuffer buffer,
+							 bool error);
+static void process_lines(Program *prog, PQExpBuffer buffer, bool error,
+						  bool flush);
 static void waitprogram(Program *prog, pid_t childPid);
 
+extern char **environ;
+
 /*
- * Run a program using fork() and exec(), get the stdOut and stdErr output from
- * the run and then return a Program struct instance with the result of running
- * the program.
+ * posix_spawn() does not duplicate the memory mappings of the calling process,
+ * and is much faster than fork() for large processes. We use it unless we
+ * need setsid(), which not all the posix_spawn() implementations support.
+ */
+#if defined(POSIX_SPAWN_SETSID)
+#define RUN_PROGRAM_SPAWN_SETSID_FLAG POSIX_SPAWN_SETSID
+#elif defined(POSIX_SPAWN_SETSID_NP)
+#define RUN_PROGRAM_SPAWN_SETSID_FLAG POSIX_SPAWN_SETSID_NP
+#endif
+
+#if !defined(RUN_PROGRAM_SPAWN_SETSID_FLAG)
+static pid_t fork_subprogram(Program *prog, int *outpipe, int *errpipe);
+#endif
+
+/*
+ * Run a program using posix_spawn() or fork() and exec(), get the stdOut and
+ * stdErr output from the run and then return a Program struct instance with
+ * the result of running the program.
  */
 Program
 run_program(const char *program, ...)
@@ -172,9 +199,10 @@ initialize_program(Program *prog, char **args, bool setsid)
 
 
 /*
- * Run given program with its args, by doing the fork()/exec() dance, and also
- * capture the subprocess output by installing pipes. We accumulate the output
- * into a PQExpBuffer when prog->capture is true.
+ * Run given program with its args, using posix_spawn() or the fork()/exec()
+ * dance, and also capture the subprocess output by installing pipes. We
+ * accumulate the output into a PQExpBuffer when prog->capture is true, or
+ * pass it to prog->processBuffer one line at a time.
  */
 void
 execute_subprogram(Program *prog)
@@ -213,11 +241,151 @@ execute_subprogram(Program *prog)
 		{
 			prog->returnCode = -1;
 			prog->error = errno;
+
+			close(outpipe[0]);
+			close(outpipe[1]);
 			return;
 		}
 	}
 
-	pid = fork();
+#if defined(RUN_PROGRAM_SPAWN_SETSID_FLAG)
+	pid = spawn_subprogram(prog, outpipe, errpipe);
+#else
+	pid = prog->setsid
+		  ? fork_subprogram(prog, outpipe, errpipe)
+		  : spawn_subprogram(prog, outpipe, errpipe);
+#endif
+
+	if (pid == -1)
+	{
+		/* prog->returnCode and prog->error have been set already */
+		if (prog->capture)
+		{
+			close(outpipe[0]);
+			close(outpipe[1]);
+			close(errpipe[0]);
+			close(errpipe[1]);
+		}
+		return;
+	}
+
+	/* the sub-process has been started, in parent */
+	if (prog->capture)
+	{
+		read_from_pipes(prog, pid, outpipe, errpipe);
+	}
+	else
+	{
+		(void) waitprogram(prog, pid);
+	}
+}
+
+
+/*
+ * spawn_subprogram starts the given program using posix_spawn(), with the
+ * same redirections as fork_subprogram(), and returns its pid, or -1.
+ */
+static pid_t
+spawn_subprogram(Program *prog, int *outpipe, int *errpipe)
+{
+	pid_t pid = -1;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+
+	int err = posix_spawn_file_actions_init(&actions);
+
+	if (err != 0)
+	{
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	err = posix_spawnattr_init(&attr);
+
+	if (err != 0)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	if (prog->tty == false)
+	{
+		/* see fork_subprogram() for why we don't just close stdin */
+		err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+											   DEV_NULL, O_RDONLY, 0);
+
+		if (err == 0 && prog->capture)
+		{
+			if ((err = posix_spawn_file_actions_adddup2(
+					 &actions, outpipe[1], STDOUT_FILENO)) == 0 &&
+				(err = posix_spawn_file_actions_adddup2(
+					 &actions, errpipe[1], STDERR_FILENO)) == 0 &&
+				(err = posix_spawn_file_actions_addclose(
+					 &actions, outpipe[0])) == 0 &&
+				(err = posix_spawn_file_actions_addclose(
+					 &actions, outpipe[1])) == 0 &&
+				(err = posix_spawn_file_actions_addclose(
+					 &actions, errpipe[0])) == 0)
+			{
+				err = posix_spawn_file_actions_addclose(&actions, errpipe[1]);
+			}
+		}
+		else if (err == 0)
+		{
+			if ((err = posix_spawn_file_actions_adddup2(
+					 &actions, prog->stdOutFd, STDOUT_FILENO)) == 0)
+			{
+				err = posix_spawn_file_actions_adddup2(
+					&actions, prog->stdErrFd, STDERR_FILENO);
+			}
+		}
+	}
+
+#if defined(RUN_PROGRAM_SPAWN_SETSID_FLAG)
+	if (err == 0 && prog->setsid)
+	{
+		err = posix_spawnattr_setflags(&attr, RUN_PROGRAM_SPAWN_SETSID_FLAG);
+	}
+#endif
+
+	if (err == 0)
+	{
+		err = posix_spawn(&pid, prog->program, &actions, &attr,
+						  prog->args, environ);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (err != 0)
+	{
+		fprintf(stderr, "Failed to run program \"%s\": %s\n",
+				prog->program,
+				strerror(err));
+
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	return pid;
+}
+
+
+#if !defined(RUN_PROGRAM_SPAWN_SETSID_FLAG)
+
+/*
+ * fork_subprogram starts the given program by doing the fork()/exec() dance,
+ * and returns its pid, or -1.
+ */
+static pid_t
+fork_subprogram(Program *prog, int *outpipe, int *errpipe)
+{
+	pid_t pid = fork();
 
 	switch (pid)
 	{
@@ -226,7 +394,7 @@ execute_subprogram(Program *prog)
 			/* fork failed */
 			prog->returnCode = -1;
 			prog->error = errno;
-			return;
+			return -1;
 		}
 
 		case 0:
@@ -281,40 +449,29 @@ execute_subprogram(Program *prog)
 			{
 				if (setsid() == -1)
 				{
-					prog->returnCode = -1;
-					prog->error = errno;
-					return;
+					(void) exit_internal_error();
 				}
 			}
 
 			if (execv(prog->program, prog->args) == -1)
 			{
-				prog->returnCode = -1;
-				prog->error = errno;
-
-				fprintf(stdout, "%s\n", strerror(errno));
-				fprintf(stderr, "%s\n", strerror(errno));
-				exit(EXIT_CODE_INTERNAL_ERROR);
+				(void) exit_internal_error();
 			}
-			return;
+
+			/* unreachable */
+			return -1;
 		}
 
 		default:
 		{
 			/* fork succeeded, in parent */
-			if (prog->capture)
-			{
-				read_from_pipes(prog, pid, outpipe, errpipe);
-			}
-			else
-			{
-				(void) waitprogram(prog, pid);
-			}
-			return;
+			return pid;
 		}
 	}
 }
 
+#endif
+
 
 /*
  * Run given program with its args, by using exec().
@@ -466,15 +623,16 @@ close_or_exit(int fildes)
 
 /*
  * read_from_pipes reads the output from the child process and sets the Program
- * slots stdOut and stdErr with the accumulated output we read.
+ * slots stdOut and stdErr with the accumulated output we read, or passes the
+ * output to prog->processBuffer line by line.
  */
 static void
 read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 {
-	bool doneReading = false;
+	bool outEOF = false;
+	bool errEOF = false;
 	int countFdsReadyToRead, nfds; /* see man select(3) */
 	fd_set readFileDescriptorSet;
-	ssize_t bytes_out = BUFSIZE, bytes_err = BUFSIZE;
 	PQExpBuffer outbuf, errbuf;
 
 	/* We read from the other side of the pipe, close that part.  */
@@ -489,17 +647,17 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 	outbuf = createPQExpBuffer();
 	errbuf = createPQExpBuffer();
 
-	while (!doneReading)
+	while (!outEOF || !errEOF)
 	{
 		FD_ZERO(&readFileDescriptorSet);
 
-		/* if we read 0 bytes on the previous run, we've reached EOF */
-		if (bytes_out > 0)
+		/* once we have read 0 bytes, we've reached EOF */
+		if (!outEOF)
 		{
 			FD_SET(outpipe[0], &readFileDescriptorSet);
 		}
 
-		if (bytes_err > 0)
+		if (!errEOF)
 		{
 			FD_SET(errpipe[0], &readFileDescriptorSet);
 		}
@@ -526,7 +684,7 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 					/* that's unexpected, act as if doneReading */
 					log_error("Failed to read from command \"%s\": %s",
 							  prog->program, strerror(errno));
-					doneReading = true;
+					outEOF = errEOF = true;
 					break;
 				}
 			}
@@ -539,37 +697,51 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 		{
 			if (FD_ISSET(outpipe[0], &readFileDescriptorSet))
 			{
-				bytes_out = read_into_buf(prog, outpipe[0], outbuf, false);
+				ssize_t bytes = read_into_buf(prog, outpipe[0], outbuf, false);
 
-				if (bytes_out == -1 && errno != 0)
+				if (bytes == -1 && errno != EINTR && errno != EAGAIN)
 				{
 					prog->returnCode = -1;
 					prog->error = errno;
 				}
+
+				outEOF = bytes == 0 ||
+						 (bytes == -1 && errno != EINTR && errno != EAGAIN);
 			}
 
 			if (FD_ISSET(errpipe[0], &readFileDescriptorSet))
 			{
-				bytes_err = read_into_buf(prog, errpipe[0], errbuf, true);
+				ssize_t bytes = read_into_buf(prog, errpipe[0], errbuf, true);
 
-				if (bytes_err == -1 && errno != 0)
+				if (bytes == -1 && errno != EINTR && errno != EAGAIN)
 				{
 					prog->returnCode = -1;
 					prog->error = errno;
 				}
+
+				errEOF = bytes == 0 ||
+						 (bytes == -1 && errno != EINTR && errno != EAGAIN);
 			}
-			doneReading = (bytes_out < BUFSIZE && bytes_err < BUFSIZE);
 		}
 	}
 
-	if (outbuf->len > 0)
+	if (prog->processBuffer)
 	{
-		prog->stdOut = strndup(outbuf->data, outbuf->len);
+		/* process the last line, when it doesn't end with a newline */
+		(void) process_lines(prog, outbuf, false, true);
+		(void) process_lines(prog, errbuf, true, true);
 	}
-
-	if (errbuf->len > 0)
+	else
 	{
-		prog->stdErr = strndup(errbuf->data, errbuf->len);
+		if (outbuf->len > 0)
+		{
+			prog->stdOut = strndup(outbuf->data, outbuf->len);
+		}
+
+		if (errbuf->len > 0)
+		{
+			prog->stdErr = strndup(errbuf->data, errbuf->len);
+		}
 	}
 
 	destroyPQExpBuffer(outbuf);
@@ -628,30 +800,61 @@ waitprogram(Program *prog, pid_t childPid)
 
 
 /*
- * Read from a file descriptor and directly appends to our buffer string.
+ * Read from a file descriptor and directly appends to our buffer string. When
+ * prog->processBuffer is set, the complete lines are then passed to it and
+ * removed from the buffer.
  */
-static size_t
+static ssize_t
 read_into_buf(Program *prog, int filedes, PQExpBuffer buffer, bool error)
 {
-	char temp_buffer[BUFSIZE+1] = { 0 };
-	size_t bytes = read(filedes, temp_buffer, BUFSIZE);
+	char temp_buffer[READ_BUFSIZE + 1] = { 0 };
+	ssize_t bytes = read(filedes, temp_buffer, READ_BUFSIZE);
 
 	if (bytes > 0)
 	{
-		/* terminate the buffer after the length we read */
-		temp_buffer[bytes] = '\0';
-
-		appendPQExpBufferStr(buffer, temp_buffer);
+		appendBinaryPQExpBuffer(buffer, temp_buffer, bytes);
 
 		if (prog->processBuffer)
 		{
-			(*prog->processBuffer)(temp_buffer, error);
+			(void) process_lines(prog, buffer, error, false);
 		}
 	}
 	return bytes;
 }
 
 
+/*
+ * process_lines calls prog->processBuffer for each complete line found in the
+ * given buffer, and keeps the incomplete last line in the buffer, unless we
+ * are asked to flush it.
+ */
+static void
+process_lines(Program *prog, PQExpBuffer buffer, bool error, bool flush)
+{
+	char *line = buffer->data;
+	char *newline = NULL;
+
+	while ((newline = strchr(line, '\n')) != NULL)
+	{
+		*newline = '\0';
+		(*prog->processBuffer)(line, error);
+		line = newline + 1;
+	}
+
+	if (flush && *line != '\0')
+	{
+		(*prog->processBuffer)(line, error);
+		line += strlen(line);
+	}
+
+	/* keep the incomplete line for the next round */
+	size_t remaining = buffer->len - (line - buffer->data);
+
+	memmove(buffer->data, line, remaining + 1);
+	buffer->len = remaining;
+}
+
+
 /*
  * Writes the full command line of the given program into the given
  * pre-allocated buffer of given size, and returns how many bytes would have
@@ -16,6 +16,8 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
@@ -39,6 +41,37 @@
 
 char azureCLI[MAXPGPATH] = { 0 };
 
+/* the command that builds and installs pg_auto_failover on a target VM */
+#define AZURE_BUILD_COMMAND \
+	"make PG_CONFIG=/usr/lib/postgresql/11/bin/pg_config " \
+	"-C pg_auto_failover -s clean all " \
+	" && " \
+	"sudo make PG_CONFIG=/usr/lib/postgresql/11/bin/pg_config " \
+	"BINDIR=/usr/local/bin -C pg_auto_failover install"
+
+/*
+ * When creating a region, each VM goes through the following steps on its
+ * own, see azure_run_vm_pipelines. The last three steps are only needed when
+ * provisioning from sources.
+ */
+typedef enum
+{
+	AZURE_VM_STEP_CREATE = 0,
+	AZURE_VM_STEP_PROVISION,
+	AZURE_VM_STEP_ADDRESSES,
+	AZURE_VM_STEP_RSYNC,
+	AZURE_VM_STEP_BUILD,
+	AZURE_VM_STEP_DONE,
+	AZURE_VM_STEP_FAILED
+} AzureVMStep;
+
+typedef struct AzureVMPipeline
+{
+	int index;                  /* in azRegion->vmArray */
+	AzureVMStep step;
+	pid_t pid;                  /* of the command running the current step */
+} AzureVMPipeline;
+
 static int azure_run_command(Program *program);
 static pid_t azure_start_command(Program *program);
 static bool azure_wait_for_commands(int count, pid_t pidArray[]);
@@ -50,18 +83,28 @@ static bool run_ssh_command(const char *username,
 							bool tty,
 							const char *command);
 
-static bool start_ssh_command(const char *username,
-							  const char *ip,
-							  const char *command);
+static pid_t start_ssh_command(const char *username,
+							   const char *ip,
+							   const char *command);
 
 static bool azure_git_toplevel(char *srcDir, size_t size);
 
-static bool start_rsync_command(const char *username,
-								const char *ip,
-								const char *srcDir);
+static pid_t start_rsync_command(const char *username,
+								 const char *ip,
+								 const char *srcDir);
 
 static bool azure_rsync_vms(AzureRegionResources *azRegion);
 
+static bool azure_run_vm_pipelines(AzureRegionResources *azRegion,
+								   const char *image,
+								   const char *username);
+static void azure_vm_pipeline_next_step(AzureRegionResources *azRegion,
+										AzureVMPipeline *pipeline,
+										const char *image,
+										const char *username,
+										const char *srcDir);
+static const char * azure_vm_step_to_string(AzureVMStep step);
+
 static bool azure_fetch_resource_list(const char *group,
 									  AzureRegionResources *azRegion);
 
@@ -706,9 +749,10 @@ azure_node_index_from_name(const char *group, const char *name)
 
 
 /*
- * azure_create_vm creates a Virtual Machine in our azure resource group.
+ * azure_create_vm starts creating a Virtual Machine in our azure resource
+ * group, and returns the pid of the az command, see azure_start_command.
  */
-bool
+pid_t
 azure_create_vm(AzureRegionResources *azRegion,
 				const char *name,
 				const char *image,
@@ -898,7 +942,7 @@ azure_git_toplevel(char *srcDir, size_t size)
  * start_rsync_command is used to sync our local source directory with a remote
  * place on a target VM.
  */
-static bool
+static pid_t
 start_rsync_command(const char *username,
 					const char *ip,
 					const char *srcDir)
@@ -917,13 +961,13 @@ start_rsync_command(const char *username,
 	if (!search_path_first("rsync", rsync, LOG_ERROR))
 	{
 		log_fatal("Failed to find program rsync in PATH");
-		return false;
+		return -1;
 	}
 
 	if (!search_path_first("ssh", ssh, LOG_ERROR))
 	{
 		log_fatal("Failed to find program ssh in PATH");
-		return false;
+		return -1;
 	}
 
 	/* use our usual ssh options even when using it through rsync */
@@ -1054,12 +1098,7 @@ azure_build_pg_autoctl(AzureRegionResources *azRegion)
 	int pending = 0;
 	pid_t pidArray[MAX_VMS_PER_REGION] = { 0 };
 
-	char *buildCommand =
-		"make PG_CONFIG=/usr/lib/postgresql/11/bin/pg_config "
-		"-C pg_auto_failover -s clean all "
-		" && "
-		"sudo make PG_CONFIG=/usr/lib/postgresql/11/bin/pg_config "
-		"BINDIR=/usr/local/bin -C pg_auto_failover install";
+	char *buildCommand = AZURE_BUILD_COMMAND;
 
 	log_info("Building pg_auto_failover from sources on %d Azure VMs",
 			 azRegion->nodes +
@@ -1268,10 +1307,10 @@ azure_prepare_debian_build_dep_postgres_command(char *command, size_t size)
 
 
 /*
- * azure_provision_vm runs the command `az vm run-command invoke` with our
- * provisioning script.
+ * azure_provision_vm starts the command `az vm run-command invoke` with our
+ * provisioning script, and returns its pid, see azure_start_command.
  */
-bool
+pid_t
 azure_provision_vm(const char *group, const char *name, bool fromSource)
 {
 	char *args[26];
@@ -1314,21 +1353,21 @@ azure_provision_vm(const char *group, const char *name, bool fromSource)
 	if (!azure_prepare_debian_install_command(aptGetInstall, BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	if (!azure_prepare_debian_install_postgres_command(aptGetInstallPostgres,
 													   BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	if (!azure_prepare_debian_build_dep_postgres_command(aptGetBuildDepPostgres,
 														 BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	args[argsIndex++] = azureCLI;
@@ -1888,7 +1927,7 @@ run_ssh_command(const char *username,
  * start_ssh_command starts the given command on the remote machine given by ip
  * address, as the given username.
  */
-static bool
+static pid_t
 start_ssh_command(const char *username,
 				  const char *ip,
 				  const char *command)
@@ -1904,7 +1943,7 @@ start_ssh_command(const char *username,
 	if (!search_path_first("ssh", ssh, LOG_ERROR))
 	{
 		log_fatal("Failed to find program ssh in PATH");
-		return false;
+		return -1;
 	}
 
 	args[argsIndex++] = ssh;
@@ -1929,7 +1968,7 @@ start_ssh_command(const char *username,
 	{
 		appendPQExpBuffer(azureScript, "\n%s", ssh_command);
 
-		return true;
+		return 0;
 	}
 
 	return azure_start_command(&program);
@@ -2192,30 +2231,27 @@ azure_provision_nodes(AzureRegionResources *azRegion)
 		return false;
 	}
 
-	if (azRegion->monitor > 0 || azRegion->nodes > 0)
+	if (azRegion->monitor == 0 && azRegion->nodes == 0)
+	{
+		return true;
+	}
+
+	/*
+	 * In dry-run mode (--script), we produce the naive script that runs each
+	 * step for all the VMs in parallel and then waits, for lack of known
+	 * advanced control structures in the target shell (we don't require a
+	 * specific one):
+	 *
+	 *   $ az vm create --name a &
+	 *   $ az vm create --name b &
+	 *   $ wait
+	 *
+	 *   $ az vm run-command invoke --name a --scripts ... &
+	 *   $ az vm run-command invoke --name b --scripts ... &
+	 *   $ wait
+	 */
+	if (dryRun)
 	{
-		/*
-		 * Here we run the following commands:
-		 *
-		 *   $ az vm create --name a &
-		 *   $ az vm create --name b &
-		 *   $ wait
-		 *
-		 *   $ az vm run-command invoke --name a --scripts ... &
-		 *   $ az vm run-command invoke --name b --scripts ... &
-		 *   $ wait
-		 *
-		 * We could optimize our code so that we run the provisioning scripts
-		 * for a VM as soon as it's been created, without having to wait until
-		 * the other VMs are created. Two things to keep in mind, though:
-		 *
-		 * - overall, being cleverer here might not be a win as we're going to
-		 *   have to wait until all the VMs are provisioned anyway
-		 *
-		 * - in dry-run mode (--script), we still want to produce the more
-		 *   naive script as shown above, for lack of known advanced control
-		 *   structures in the target shell (we don't require a specific one).
-		 */
 		if (!azure_create_vms(azRegion, "debian", "ha-admin"))
 		{
 			/* errors have already been logged */
@@ -2230,9 +2266,9 @@ azure_provision_nodes(AzureRegionResources *azRegion)
 
 		/*
 		 * When provisioning from sources, after the OS related steps in
-		 * azure_provision_vms, we still need to upload our local sources (this
-		 * requires rsync to have been installed in the previous step), and to
-		 * build our software from same sources.
+		 * azure_provision_vms, we still need to upload our local sources
+		 * (this requires rsync to have been installed in the previous step),
+		 * and to build our software from same sources.
 		 */
 		if (azRegion->fromSource)
 		{
@@ -2244,12 +2280,324 @@ azure_provision_nodes(AzureRegionResources *azRegion)
 
 			return azure_build_pg_autoctl(azRegion);
 		}
+
+		return true;
+	}
+
+	/*
+	 * Otherwise each VM runs its own steps as soon as the previous one is
+	 * done, without waiting for the other VMs: the whole provisioning then
+	 * takes about as long as the slowest VM.
+	 */
+	return azure_run_vm_pipelines(azRegion, "debian", "ha-admin");
+}
+
+
+/*
+ * azure_run_vm_pipelines creates and provisions our VMs, each VM going
+ * through its steps independently of the other VMs: create, provision, and
+ * when provisioning from sources, fetch its IP addresses, rsync our sources,
+ * and build pg_auto_failover.
+ *
+ * A single process with WNOHANG waitpid() calls does the scheduling. When a
+ * step of a VM fails, that VM stops there, and the other VMs continue.
+ */
+static bool
+azure_run_vm_pipelines(AzureRegionResources *azRegion,
+					   const char *image,
+					   const char *username)
+{
+	AzureVMPipeline pipelines[MAX_VMS_PER_REGION] = { 0 };
+	int count = 0;
+	int running = 0;
+	int failed = 0;
+
+	char srcDir[MAXPGPATH] = { 0 };
+
+	/* we read from left to right, have the smaller number on the left */
+	if (26 < azRegion->nodes)
+	{
+		log_error("pg_autoctl only supports up to 26 VMs per region");
+		return false;
+	}
+
+	if (azRegion->fromSource && !azure_git_toplevel(srcDir, sizeof(srcDir)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* index == 0 for the monitor, 1..count for the nodes, then the app */
+	for (int index = 0; index < MAX_VMS_PER_REGION; index++)
+	{
+		AzureVMipAddresses *vm = &(azRegion->vmArray[index]);
+
+		if ((index == 0 && azRegion->monitor == 0) ||
+			(index > azRegion->nodes && index < MAX_VMS_PER_REGION - 1) ||
+			(index == MAX_VMS_PER_REGION - 1 && azRegion->appNodes == 0))
+		{
+			continue;
+		}
+
+		AzureVMPipeline *pipeline = &(pipelines[count++]);
+
+		pipeline->index = index;
+		pipeline->pid = -1;
+
+		/* skip creating VMs that already exist, still provision them */
+		if (!IS_EMPTY_STRING_BUFFER(vm->name) &&
+			!IS_EMPTY_STRING_BUFFER(vm->public) &&
+			!IS_EMPTY_STRING_BUFFER(vm->private))
+		{
+			log_info("Skipping creation of VM \"%s\", "
+					 "which already exists with public IP address %s",
+					 vm->name,
+					 vm->public);
+
+			pipeline->step = AZURE_VM_STEP_PROVISION;
+		}
+		else
+		{
+			(void) azure_prepare_node(azRegion, index);
+
+			pipeline->step = AZURE_VM_STEP_CREATE;
+		}
+	}
+
+	log_info("Creating and provisioning %d Virtual Machines, in parallel",
+			 count);
+
+	for (int i = 0; i < count; i++)
+	{
+		(void) azure_vm_pipeline_next_step(azRegion, &(pipelines[i]),
+										   image, username, srcDir);
+
+		if (pipelines[i].pid > 0)
+		{
+			++running;
+		}
+	}
+
+	while (running > 0)
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+
+		if (pid == -1 && errno == ECHILD)
+		{
+			log_error("BUG: %d VM steps are still running, "
+					  "but we have no child processes",
+					  running);
+			break;
+		}
+
+		if (pid <= 0)
+		{
+			pg_usleep(100 * 1000); /* 100 ms */
+			continue;
+		}
+
+		AzureVMPipeline *pipeline = NULL;
+
+		for (int i = 0; i < count; i++)
+		{
+			if (pipelines[i].pid == pid)
+			{
+				pipeline = &(pipelines[i]);
+				break;
+			}
+		}
+
+		if (pipeline == NULL)
+		{
+			log_debug("Process %d exited, which is not a VM step", pid);
+			continue;
+		}
+
+		--running;
+
+		const char *name = azRegion->vmArray[pipeline->index].name;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			log_error("Failed to %s VM \"%s\", see above for details",
+					  azure_vm_step_to_string(pipeline->step),
+					  name);
+
+			pipeline->pid = -1;
+			pipeline->step = AZURE_VM_STEP_FAILED;
+			continue;
+		}
+
+		log_info("VM \"%s\": %s step is done",
+				 name,
+				 azure_vm_step_to_string(pipeline->step));
+
+		++pipeline->step;
+
+		(void) azure_vm_pipeline_next_step(azRegion, pipeline,
+										   image, username, srcDir);
+
+		if (pipeline->pid > 0)
+		{
+			++running;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (pipelines[i].step != AZURE_VM_STEP_DONE)
+		{
+			++failed;
+		}
+	}
+
+	if (failed > 0)
+	{
+		log_fatal("Failed to provision %d of %d azure VMs, "
+				  "see above for details",
+				  failed, count);
+		return false;
 	}
 
 	return true;
 }
 
 
+/*
+ * azure_vm_pipeline_next_step starts the current step of the given VM
+ * pipeline, and sets pipeline->pid to the pid of the command that implements
+ * it. Fetching the IP addresses of the VM is done right away, as it only
+ * takes one az command that is quick enough.
+ */
+static void
+azure_vm_pipeline_next_step(AzureRegionResources *azRegion,
+							AzureVMPipeline *pipeline,
+							const char *image,
+							const char *username,
+							const char *srcDir)
+{
+	AzureVMipAddresses *vm = &(azRegion->vmArray[pipeline->index]);
+
+	pipeline->pid = -1;
+
+	switch (pipeline->step)
+	{
+		case AZURE_VM_STEP_CREATE:
+		{
+			pipeline->pid =
+				azure_create_vm(azRegion, vm->name, image, username);
+			break;
+		}
+
+		case AZURE_VM_STEP_PROVISION:
+		{
+			pipeline->pid = azure_provision_vm(azRegion->group,
+											   vm->name,
+											   azRegion->fromSource);
+			break;
+		}
+
+		case AZURE_VM_STEP_ADDRESSES:
+		{
+			if (!azRegion->fromSource)
+			{
+				pipeline->step = AZURE_VM_STEP_DONE;
+				return;
+			}
+
+			/* a VM that we just created has no known addresses yet */
+			if (IS_EMPTY_STRING_BUFFER(vm->public) &&
+				!azure_fetch_vm_addresses(azRegion->group, vm->name, vm))
+			{
+				/* errors have already been logged */
+				pipeline->step = AZURE_VM_STEP_FAILED;
+				return;
+			}
+
+			pipeline->step = AZURE_VM_STEP_RSYNC;
+			pipeline->pid = start_rsync_command(username, vm->public, srcDir);
+			break;
+		}
+
+		case AZURE_VM_STEP_RSYNC:
+		{
+			pipeline->pid = start_rsync_command(username, vm->public, srcDir);
+			break;
+		}
+
+		case AZURE_VM_STEP_BUILD:
+		{
+			pipeline->pid =
+				start_ssh_command(username, vm->public, AZURE_BUILD_COMMAND);
+			break;
+		}
+
+		case AZURE_VM_STEP_DONE:
+		case AZURE_VM_STEP_FAILED:
+		{
+			return;
+		}
+	}
+
+	if (pipeline->pid <= 0)
+	{
+		log_error("Failed to %s VM \"%s\"",
+				  azure_vm_step_to_string(pipeline->step),
+				  vm->name);
+		pipeline->step = AZURE_VM_STEP_FAILED;
+	}
+}
+
+
+/*
+ * azure_vm_step_to_string returns a verb for the given VM step, for logging.
+ */
+static const char *
+azure_vm_step_to_string(AzureVMStep step)
+{
+	switch (step)
+	{
+		case AZURE_VM_STEP_CREATE:
+		{
+			return "create";
+		}
+
+		case AZURE_VM_STEP_PROVISION:
+		{
+			return "provision";
+		}
+
+		case AZURE_VM_STEP_ADDRESSES:
+		{
+			return "fetch the IP addresses of";
+		}
+
+		case AZURE_VM_STEP_RSYNC:
+		{
+			return "rsync our sources to";
+		}
+
+		case AZURE_VM_STEP_BUILD:
+		{
+			return "build pg_auto_failover on";
+		}
+
+		case AZURE_VM_STEP_DONE:
+		{
+			return "be done with";
+		}
+
+		case AZURE_VM_STEP_FAILED:
+		{
+			return "recover from a failure of";
+		}
+	}
+
+	return "unknown step of";
+}
+
+
 /*
  * azure_deploy_monitor deploys pg_autoctl on a monitor node, running both the
  * pg_autoctl create monitor command and then the systemd integration commands.
@@ -0,0 +1,86 @@
+/*
+ * src/bin/pg_autoctl/bench/bench_alloc.c
+ *	 Count the allocations made while running the pg_autoctl microbenchmarks.
+ *
+ * This file is only linked into the pg_autoctl_bench binary that `make bench`
+ * builds, where it replaces malloc() and friends with versions that count the
+ * calls and the requested bytes before calling into the glibc allocator. As
+ * the glibc functions call malloc() through the dynamic symbol, allocations
+ * made from within the C library and libpq are counted too.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <stdlib.h>
+
+#include "postgres_fe.h"
+
+#include "parser_bench.h"
+
+#if defined(__GLIBC__)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static void bench_alloc_init(void) __attribute__((constructor));
+
+
+/*
+ * bench_alloc_init lets the benchmarks know that allocations are counted.
+ */
+static void
+bench_alloc_init(void)
+{
+	benchAllocStats.supported = true;
+}
+
+
+void *
+malloc(size_t size)
+{
+	if (benchAllocStats.counting)
+	{
+		++benchAllocStats.count;
+		benchAllocStats.bytes += size;
+	}
+
+	return __libc_malloc(size);
+}
+
+
+void *
+calloc(size_t count, size_t size)
+{
+	if (benchAllocStats.counting)
+	{
+		++benchAllocStats.count;
+		benchAllocStats.bytes += count * size;
+	}
+
+	return __libc_calloc(count, size);
+}
+
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (benchAllocStats.counting)
+	{
+		++benchAllocStats.count;
+		benchAllocStats.bytes += size;
+	}
+
+	return __libc_realloc(ptr, size);
+}
+
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+#endif   /* __GLIBC__ */
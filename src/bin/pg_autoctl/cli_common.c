@@ -27,9 +27,11 @@
 #include "parsing.h"
 #include "pgsetup.h"
 #include "pgsql.h"
+#include "pgtuning.h"
 #include "pidfile.h"
 #include "state.h"
 #include "string_utils.h"
+#include "trace.h"
 
 /* handle command line options for our setup. */
 KeeperConfig keeperOptions;
@@ -41,6 +43,10 @@ int ssl_flag = 0;
 /* stores --node-id, only used with --disable-monitor */
 int monitorDisabledNodeId = -1;
 
+/* stores the --pgdata options of pg_autoctl run, which may be repeated */
+char *runInstancesPgdata[PG_AUTOCTL_MAX_INSTANCES] = { 0 };
+int runInstancesCount = 0;
+
 /*
  * cli_common_keeper_getopts parses the CLI options for the pg_autoctl create
  * postgres command, and others such as pg_autoctl do discover. An example of a
@@ -74,6 +80,7 @@ int monitorDisabledNodeId = -1;
  *		{ "candidate-priority", required_argument, NULL, 'P'},
  *		{ "replication-quorum", required_argument, NULL, 'r'},
  *		{ "maximum-backup-rate", required_argument, NULL, 'R' },
+ *		{ "tuning-profile", required_argument, NULL, 'T' },
  *		{ "help", no_argument, NULL, 0 },
  *		{ "run", no_argument, NULL, 'x' },
  *      { "ssl-self-signed", no_argument, NULL, 's' },
@@ -500,6 +507,27 @@ cli_common_keeper_getopts(int argc, char **argv,
 				break;
 			}
 
+			case 'T':
+			{
+				/* { "tuning-profile", required_argument, NULL, 'T' } */
+				PgTuningProfile profile = pgtuning_parse_profile(optarg);
+
+				if (profile == PG_TUNING_PROFILE_UNKNOWN ||
+					profile == PG_TUNING_PROFILE_MONITOR)
+				{
+					log_fatal("--tuning-profile argument is not valid: \"%s\", "
+							  "expected one of oltp, mixed, analytics, "
+							  "write-heavy",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(LocalOptionConfig.pgSetup.tuningProfile, optarg,
+						NAMEDATALEN);
+				log_trace("--tuning-profile %s",
+						  LocalOptionConfig.pgSetup.tuningProfile);
+				break;
+			}
+
 			case 'x':
 			{
 				/* { "run", no_argument, NULL, 'x' }, */
@@ -508,6 +536,14 @@ cli_common_keeper_getopts(int argc, char **argv,
 				break;
 			}
 
+			case 'Y':
+			{
+				/* { "timing", no_argument, NULL, 'Y' }, */
+				(void) trace_timing_enable();
+				log_trace("--timing");
+				break;
+			}
+
 			case 's':
 			{
 				/* { "ssl-self-signed", no_argument, NULL, 's' }, */
@@ -1239,6 +1275,14 @@ monitor_init_from_pgsetup(Monitor *monitor, PostgresSetup *pgSetup)
 				return false;
 			}
 
+			if (!cli_monitor_setup_standbys(&(keeper.monitor),
+											config.monitor_standbys_pguri,
+											config.monitor_standby_max_lag))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
 			*monitor = keeper.monitor;
 			*pgSetup = config.pgSetup;
 			break;
@@ -1415,17 +1459,19 @@ keeper_cli_print_version(int argc, char **argv)
 
 /*
  * cli_pprint_json pretty prints the given JSON value to stdout and frees the
- * JSON related memory.
+ * JSON related memory. The output is streamed, so that large documents such
+ * as a long list of events are not copied into a single string first.
  */
 void
 cli_pprint_json(JSON_Value *js)
 {
 	/* output our nice JSON object, pretty printed please */
-	char *serialized_string = json_serialize_to_string_pretty(js);
-	fformat(stdout, "%s\n", serialized_string);
+	if (json_serialize_to_file_stream_pretty(js, stdout) != JSONSuccess)
+	{
+		log_error("Failed to write JSON output");
+	}
+	fformat(stdout, "\n");
 
-	/* free intermediate memory */
-	json_free_serialized_string(serialized_string);
 	json_value_free(js);
 }
 
@@ -1693,6 +1739,17 @@ cli_node_metadata_getopts(int argc, char **argv)
 			{
 				strlcpy(options.pgSetup.pgdata, optarg, MAXPGPATH);
 				log_trace("--pgdata %s", options.pgSetup.pgdata);
+
+				if (runInstancesCount == PG_AUTOCTL_MAX_INSTANCES)
+				{
+					log_error("pg_autoctl supports up to %d --pgdata options",
+							  PG_AUTOCTL_MAX_INSTANCES);
+					errors++;
+				}
+				else
+				{
+					runInstancesPgdata[runInstancesCount++] = optarg;
+				}
 				break;
 			}
 
@@ -1781,6 +1838,17 @@ cli_node_metadata_getopts(int argc, char **argv)
 	}
 
 
+	/* the node metadata options apply to a single node */
+	if (runInstancesCount > 1 &&
+		(!IS_EMPTY_STRING_BUFFER(options.name) ||
+		 !IS_EMPTY_STRING_BUFFER(options.hostname) ||
+		 options.pgSetup.pgport != 0))
+	{
+		log_error("Options --name, --hostname, and --pgport can not be used "
+				  "with more than one --pgdata option");
+		errors++;
+	}
+
 	if (errors > 0)
 	{
 		commandline_help(stderr);
@@ -2064,7 +2132,116 @@ cli_monitor_init_from_option_or_config(Monitor *monitor, KeeperConfig *kconfig)
 			/* errors have already been logged */
 			exit(EXIT_CODE_BAD_ARGS);
 		}
+
+		if (!cli_monitor_setup_standbys(monitor, "", MONITOR_STANDBY_MAX_LAG))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		/* the --monitor might be a seed monitor for the formation's shard */
+		if (!IS_EMPTY_STRING_BUFFER(kconfig->formation) &&
+			!cli_monitor_use_formation_shard(monitor,
+											 kconfig->formation,
+											 kconfig->monitor_pguri,
+											 sizeof(kconfig->monitor_pguri)))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+}
+
+
+/*
+ * cli_monitor_setup_standbys registers the monitor standby nodes to use for
+ * the read-only calls, from the given configuration setting or otherwise from
+ * the PG_AUTOCTL_MONITOR_STANDBYS environment variable. Without either, all
+ * the calls are sent to the monitor primary node.
+ */
+bool
+cli_monitor_setup_standbys(Monitor *monitor, char *standbysPguri, int maxLagMs)
+{
+	char pguri[MAXCONNINFO] = { 0 };
+
+	if (!IS_EMPTY_STRING_BUFFER(standbysPguri))
+	{
+		strlcpy(pguri, standbysPguri, sizeof(pguri));
+	}
+	else if (env_exists(PG_AUTOCTL_MONITOR_STANDBYS))
+	{
+		if (!get_env_copy(PG_AUTOCTL_MONITOR_STANDBYS, pguri, sizeof(pguri)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(pguri))
+	{
+		return true;
+	}
+
+	if (!validate_connection_string(pguri))
+	{
+		log_error("Failed to parse the monitor standbys connection string, "
+				  "see above for details.");
+		return false;
 	}
+
+	return monitor_setup_standbys(monitor, pguri, maxLagMs);
+}
+
+
+/*
+ * cli_monitor_use_formation_shard looks up the given formation in the monitor
+ * shards directory of the given (seed) monitor. When the formation belongs to
+ * another monitor shard, the monitor is re-initialized to connect to the shard
+ * directly, and its connection string is copied to monitorPguri.
+ *
+ * Failing to lookup the directory is not an error: the seed monitor is then
+ * used, as when the formation is not listed in the directory.
+ */
+bool
+cli_monitor_use_formation_shard(Monitor *monitor, char *formation,
+								char *monitorPguri, size_t size)
+{
+	char shardPguri[MAXCONNINFO] = { 0 };
+
+	if (!monitor_resolve_formation_shard(monitor, formation,
+										 shardPguri, sizeof(shardPguri)))
+	{
+		log_warn("Failed to lookup the monitor shard of formation \"%s\", "
+				 "using the given monitor", formation);
+		return true;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(shardPguri) ||
+		strcmp(shardPguri, monitor->pgsql.connectionString) == 0)
+	{
+		return true;
+	}
+
+	char scrubbedPguri[MAXCONNINFO] = { 0 };
+
+	(void) parse_and_scrub_connection_string(shardPguri, scrubbedPguri);
+
+	log_info("Formation \"%s\" belongs to monitor shard %s",
+			 formation, scrubbedPguri);
+
+	/* the monitor standbys belong to the seed monitor, forget about them */
+	Monitor shardMonitor = { 0 };
+
+	if (!monitor_init(&shardMonitor, shardPguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*monitor = shardMonitor;
+	strlcpy(monitorPguri, shardPguri, size);
+
+	return true;
 }
 
 
@@ -35,6 +35,9 @@ extern int ssl_flag;
 
 extern int monitorDisabledNodeId;
 
+extern char *runInstancesPgdata[PG_AUTOCTL_MAX_INSTANCES];
+extern int runInstancesCount;
+
 #define KEEPER_CLI_SSL_OPTIONS \
 	"  --ssl-self-signed setup network encryption using self signed certificates (does NOT protect against MITM)\n" \
 	"  --ssl-mode        use that sslmode in connection strings\n" \
@@ -122,6 +125,7 @@ extern CommandLine service_status_command;
 /* cli_show.c */
 extern CommandLine show_uri_command;
 extern CommandLine show_events_command;
+extern CommandLine show_failover_timeline_command;
 extern CommandLine show_state_command;
 extern CommandLine show_settings_command;
 extern CommandLine show_file_command;
@@ -201,6 +205,10 @@ int cli_get_name_getopts(int argc, char **argv);
 bool cli_use_monitor_option(KeeperConfig *options);
 void cli_monitor_init_from_option_or_config(Monitor *monitor,
 											KeeperConfig *kconfig);
+bool cli_monitor_setup_standbys(Monitor *monitor, char *standbysPguri,
+								int maxLagMs);
+bool cli_monitor_use_formation_shard(Monitor *monitor, char *formation,
+									 char *monitorPguri, size_t size);
 void cli_ensure_node_name(Keeper *keeper);
 
 bool discover_hostname(char *hostname, int size,
@@ -66,6 +66,7 @@ CommandLine create_monitor_command =
 		"  --auth            authentication method for connections from data nodes\n"
 		"  --skip-pg-hba     skip editing pg_hba.conf rules\n"
 		"  --run             create node then run pg_autoctl service\n"
+		"  --standby-of      create a standby of the monitor at this Postgres URL\n"
 		KEEPER_CLI_SSL_OPTIONS,
 		cli_create_monitor_getopts,
 		cli_create_monitor);
@@ -92,7 +93,9 @@ CommandLine create_postgres_command =
 		KEEPER_CLI_SSL_OPTIONS
 		"  --candidate-priority    priority of the node to be promoted to become primary\n"
 		"  --replication-quorum    true if node participates in write quorum\n"
-		"  --maximum-backup-rate   maximum transfer rate of data transferred from the server during initial sync\n",
+		"  --maximum-backup-rate   maximum transfer rate of data transferred from the server during initial sync\n"
+		"  --tuning-profile        workload profile: oltp, mixed, analytics, write-heavy\n"
+		"  --timing                print the duration of each phase of the setup\n",
 		cli_create_postgres_getopts,
 		cli_create_postgres);
 
@@ -214,6 +217,25 @@ cli_create_config(Keeper *keeper)
 								  missingPgdataIsOk,
 								  pgIsNotRunningIsOk);
 
+		/*
+		 * In monitor federation mode the --monitor might be a seed monitor,
+		 * then we register to and keep talking to the formation's shard.
+		 */
+		if (!config->monitorDisabled)
+		{
+			Monitor seedMonitor = { 0 };
+
+			if (!monitor_init(&seedMonitor, config->monitor_pguri) ||
+				!cli_monitor_use_formation_shard(&seedMonitor,
+												 config->formation,
+												 config->monitor_pguri,
+												 sizeof(config->monitor_pguri)))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_BAD_ARGS);
+			}
+		}
+
 		/* and write our brand new setup to file */
 		if (!keeper_config_write_file(config))
 		{
@@ -274,7 +296,9 @@ cli_create_postgres_getopts(int argc, char **argv)
 		{ "candidate-priority", required_argument, NULL, 'P' },
 		{ "replication-quorum", required_argument, NULL, 'r' },
 		{ "maximum-backup-rate", required_argument, NULL, 'R' },
+		{ "tuning-profile", required_argument, NULL, 'T' },
 		{ "run", no_argument, NULL, 'x' },
+		{ "timing", no_argument, NULL, 'Y' },
 		{ "no-ssl", no_argument, NULL, 'N' },
 		{ "ssl-self-signed", no_argument, NULL, 's' },
 		{ "ssl-mode", required_argument, &ssl_flag, SSL_MODE_FLAG },
@@ -287,7 +311,7 @@ cli_create_postgres_getopts(int argc, char **argv)
 
 	int optind =
 		cli_create_node_getopts(argc, argv, long_options,
-								"C:D:H:p:l:U:A:SLd:a:n:f:m:MI:RVvqhP:r:xsN",
+								"C:D:H:p:l:U:A:SLd:a:n:f:m:MI:RT:VvqhP:r:xsN",
 								&options);
 
 	/* publish our option parsing in the global variable */
@@ -364,6 +388,7 @@ cli_create_monitor_getopts(int argc, char **argv)
 		{ "quiet", no_argument, NULL, 'q' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "run", no_argument, NULL, 'x' },
+		{ "standby-of", required_argument, NULL, 'B' },
 		{ "no-ssl", no_argument, NULL, 'N' },
 		{ "ssl-self-signed", no_argument, NULL, 's' },
 		{ "ssl-mode", required_argument, &ssl_flag, SSL_MODE_FLAG },
@@ -380,7 +405,7 @@ cli_create_monitor_getopts(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "C:D:p:n:l:A:SVvqhxNs",
+	while ((c = getopt_long(argc, argv, "C:D:p:n:l:A:SVvqhxB:Ns",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -511,6 +536,20 @@ cli_create_monitor_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'B':
+			{
+				/* { "standby-of", required_argument, NULL, 'B' }, */
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --standby-of connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.standbyOf, optarg, MAXCONNINFO);
+				log_trace("--standby-of %s", options.standbyOf);
+				break;
+			}
+
 			case 's':
 			{
 				/* { "ssl-self-signed", no_argument, NULL, 's' }, */
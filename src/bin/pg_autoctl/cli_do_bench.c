@@ -0,0 +1,238 @@
+/*
+ * src/bin/pg_autoctl/cli_do_bench.c
+ *     Implementation of a CLI to run the pg_autoctl microbenchmarks.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "cli_do_root.h"
+#include "commandline.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "parser_bench.h"
+#include "string_utils.h"
+
+static ParserBenchOptions parserBenchOptions = { 0 };
+
+static int cli_do_bench_parsers_getopts(int argc, char **argv);
+static void cli_do_bench_parsers(int argc, char **argv);
+
+static CommandLine do_bench_parsers =
+	make_command("parsers",
+				 "Benchmark the parsing and formatting code on recorded inputs",
+				 "[option ...]",
+				 "  --inputs      Directory of the recorded inputs\n"
+				 "  --iterations  How many times to run each benchmark (1000)\n"
+				 "  --json        Output the results in JSON\n",
+				 cli_do_bench_parsers_getopts,
+				 cli_do_bench_parsers);
+
+CommandLine *do_bench_subcommands[] = {
+	&do_bench_parsers,
+	NULL
+};
+
+CommandLine do_bench_commands =
+	make_command_set("bench",
+					 "Run pg_autoctl microbenchmarks", NULL, NULL,
+					 NULL, do_bench_subcommands);
+
+
+/*
+ * cli_do_bench_parsers_getopts parses the command line options for the
+ * command `pg_autoctl do bench parsers`.
+ */
+static int
+cli_do_bench_parsers_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	ParserBenchOptions options = { 0 };
+
+	static struct option long_options[] = {
+		{ "inputs", required_argument, NULL, 'i' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* set our defaults */
+	options.iterations = 1000;
+
+	/*
+	 * The only command lines that are using cli_do_bench_parsers_getopts are
+	 * terminal ones: they don't accept subcommands. In that case our option
+	 * parsing can happen in any order and we don't need getopt_long to behave
+	 * in a POSIXLY_CORRECT way.
+	 *
+	 * The unsetenv() call allows getopt_long() to reorder arguments for us.
+	 */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "i:n:JVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'i':
+			{
+				/* { "inputs", required_argument, NULL, 'i' } */
+				strlcpy(options.inputs, optarg, MAXPGPATH);
+				log_trace("--inputs %s", options.inputs);
+				break;
+			}
+
+			case 'n':
+			{
+				/* { "iterations", required_argument, NULL, 'n' } */
+				if (!stringToInt(optarg, &options.iterations) ||
+					options.iterations <= 0)
+				{
+					log_error("Failed to parse --iterations number \"%s\"",
+							  optarg);
+					errors++;
+				}
+				log_trace("--iterations %d", options.iterations);
+				break;
+			}
+
+			case 'J':
+			{
+				/* { "json", no_argument, NULL, 'J' } */
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				keeper_cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.inputs))
+	{
+		log_fatal("Please provide --inputs");
+		errors++;
+	}
+	else if (!directory_exists(options.inputs))
+	{
+		log_fatal("Directory \"%s\" does not exist", options.inputs);
+		errors++;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish parsed options */
+	parserBenchOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_do_bench_parsers runs the parsers and formatters microbenchmarks over
+ * the recorded inputs, and reports ns/op and allocations.
+ */
+static void
+cli_do_bench_parsers(int argc, char **argv)
+{
+	ParserBenchOptions *options = &parserBenchOptions;
+	ParserBenchInputs inputs = { 0 };
+	ParserBenchResults results = { 0 };
+
+	if (!parser_bench_read_inputs(options, &inputs))
+	{
+		/* errors have already been logged */
+		parser_bench_free_inputs(&inputs);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	bool success = parser_bench_run(options, &inputs, &results);
+
+	parser_bench_free_inputs(&inputs);
+
+	if (!success)
+	{
+		log_fatal("Failed to run the parsers benchmark, "
+				  "see above for details");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (outputJSON)
+	{
+		(void) parser_bench_print_results_as_json(options, &results);
+	}
+	else
+	{
+		(void) parser_bench_print_results(options, &results);
+	}
+}
@@ -49,7 +49,17 @@ static CommandLine do_demo_run_command =
 				 "  --clients        How many client processes to use (1)\n"
 				 "  --duration       Duration of the demo app, in seconds (30)\n"
 				 "  --first-failover Timing of the first failover (10)\n"
-				 "  --failover-freq  Seconds between subsequent failovers (45)\n",
+				 "  --failover-freq  Seconds between subsequent failovers (45)\n"
+				 "  --no-failover    Do not inject any fault during the run\n"
+				 "  --read-ratio     Percentage of read-only transactions (0)\n"
+				 "  --update-ratio   Percentage of update transactions (0)\n"
+				 "  --pipeline       Send transactions in batches on one connection\n"
+				 "  --batch-size     Transactions per batch with --pipeline (10)\n"
+				 "  --prepared       Use prepared statements with --pipeline\n"
+				 "  --fault          Fault to inject: switchover, kill, partition\n"
+				 "  --fault-command  Shell command that injects the fault\n"
+				 "  --heal-command   Shell command that heals a partition\n"
+				 "  --json           Output the run report in JSON\n",
 				 cli_do_demoapp_getopts, cli_demo_run);
 
 static CommandLine do_demo_uri_command =
@@ -85,7 +95,8 @@ static CommandLine do_demo_summary_command =
 				 "  --group     Group Id to failover (0)\n" \
 				 "  --username  PostgreSQL's username\n"
 				 "  --clients   How many client processes to use (1)\n"
-				 "  --duration  Duration of the demo app, in seconds (30)\n",
+				 "  --duration  Duration of the demo app, in seconds (30)\n"
+				 "  --json      Output the run report in JSON\n",
 				 cli_do_demoapp_getopts, cli_demo_summary);
 
 CommandLine *do_demo_subcommands[] = {
@@ -125,6 +136,15 @@ cli_do_demoapp_getopts(int argc, char **argv)
 		{ "no-failover", no_argument, NULL, 'N' },
 		{ "first-failover", required_argument, NULL, 'F' },
 		{ "failover-freq", required_argument, NULL, 'Q' },
+		{ "read-ratio", required_argument, NULL, 'R' },
+		{ "update-ratio", required_argument, NULL, 'W' },
+		{ "pipeline", no_argument, NULL, 'P' },
+		{ "batch-size", required_argument, NULL, 'B' },
+		{ "prepared", no_argument, NULL, 'S' },
+		{ "fault", required_argument, NULL, 'I' },
+		{ "fault-command", required_argument, NULL, 'C' },
+		{ "heal-command", required_argument, NULL, 'H' },
+		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -141,6 +161,12 @@ cli_do_demoapp_getopts(int argc, char **argv)
 	options.firstFailover = 10;
 	options.failoverFreq = 45;
 	options.doFailover = true;
+	options.readRatio = 0;
+	options.updateRatio = 0;
+	options.pipeline = false;
+	options.batchSize = 10;
+	options.prepared = false;
+	options.faultKind = DEMO_FAULT_SWITCHOVER;
 	strlcpy(options.formation, "default", sizeof(options.formation));
 
 	/*
@@ -350,6 +376,110 @@ cli_do_demoapp_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'R':
+			{
+				/* { "read-ratio", required_argument, NULL, 'R' }, */
+				if (!stringToInt(optarg, &options.readRatio) ||
+					options.readRatio < 0 ||
+					options.readRatio > 100)
+				{
+					log_error("Failed to parse --read-ratio \"%s\", expected "
+							  "a percentage between 0 and 100",
+							  optarg);
+					errors++;
+				}
+				log_trace("--read-ratio %d", options.readRatio);
+				break;
+			}
+
+			case 'W':
+			{
+				/* { "update-ratio", required_argument, NULL, 'W' }, */
+				if (!stringToInt(optarg, &options.updateRatio) ||
+					options.updateRatio < 0 ||
+					options.updateRatio > 100)
+				{
+					log_error("Failed to parse --update-ratio \"%s\", expected "
+							  "a percentage between 0 and 100",
+							  optarg);
+					errors++;
+				}
+				log_trace("--update-ratio %d", options.updateRatio);
+				break;
+			}
+
+			case 'P':
+			{
+				/* { "pipeline", no_argument, NULL, 'P' }, */
+				options.pipeline = true;
+				log_trace("--pipeline");
+				break;
+			}
+
+			case 'B':
+			{
+				/* { "batch-size", required_argument, NULL, 'B' }, */
+				if (!stringToInt(optarg, &options.batchSize) ||
+					options.batchSize < 1 ||
+					options.batchSize > MAX_BATCH_SIZE)
+				{
+					log_error("Failed to parse --batch-size \"%s\", expected "
+							  "a number between 1 and %d",
+							  optarg, MAX_BATCH_SIZE);
+					errors++;
+				}
+				log_trace("--batch-size %d", options.batchSize);
+				break;
+			}
+
+			case 'S':
+			{
+				/* { "prepared", no_argument, NULL, 'S' }, */
+				options.prepared = true;
+				log_trace("--prepared");
+				break;
+			}
+
+			case 'I':
+			{
+				/* { "fault", required_argument, NULL, 'I' }, */
+				options.faultKind = demoapp_parse_fault_kind(optarg);
+
+				if (options.faultKind == DEMO_FAULT_UNKNOWN)
+				{
+					log_error("Unknown --fault \"%s\", expected one of "
+							  "switchover, kill, partition",
+							  optarg);
+					errors++;
+				}
+				log_trace("--fault %s", optarg);
+				break;
+			}
+
+			case 'C':
+			{
+				/* { "fault-command", required_argument, NULL, 'C' }, */
+				strlcpy(options.faultCommand, optarg, BUFSIZE);
+				log_trace("--fault-command %s", options.faultCommand);
+				break;
+			}
+
+			case 'H':
+			{
+				/* { "heal-command", required_argument, NULL, 'H' }, */
+				strlcpy(options.healCommand, optarg, BUFSIZE);
+				log_trace("--heal-command %s", options.healCommand);
+				break;
+			}
+
+			case 'J':
+			{
+				/* { "json", no_argument, NULL, 'J' }, */
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
 
 			case 'h':
 			{
@@ -437,6 +567,27 @@ cli_do_demoapp_getopts(int argc, char **argv)
 		}
 	}
 
+	if (options.readRatio + options.updateRatio > 100)
+	{
+		log_fatal("The sum of --read-ratio %d and --update-ratio %d "
+				  "must not exceed 100",
+				  options.readRatio, options.updateRatio);
+		errors++;
+	}
+
+	if (options.prepared && !options.pipeline)
+	{
+		log_fatal("Please use --prepared together with --pipeline");
+		errors++;
+	}
+
+	if (options.faultKind == DEMO_FAULT_PARTITION &&
+		IS_EMPTY_STRING_BUFFER(options.faultCommand))
+	{
+		log_fatal("Please provide --fault-command to use --fault partition");
+		errors++;
+	}
+
 	/* set our Postgres username as the PGUSER environment variable now */
 	setenv("PGUSER", options.username, 1);
 
@@ -514,6 +665,16 @@ cli_demo_run(int argc, char **argv)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
+	if (outputJSON)
+	{
+		if (!demoapp_print_report_as_json(pguri, &demoAppOptions))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+		return;
+	}
+
 	/* show the historgram now, avoid the fully detailed summary */
 	(void) demoapp_print_histogram(pguri, &demoAppOptions);
 }
@@ -612,6 +773,16 @@ cli_demo_summary(int argc, char **argv)
 	log_info("Using application connection string \"%s\"", pguri);
 	log_info("Using Postgres user PGUSER \"%s\"", demoAppOptions.username);
 
+	if (outputJSON)
+	{
+		if (!demoapp_print_report_as_json(pguri, &demoAppOptions))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+		return;
+	}
+
 	(void) demoapp_print_summary(pguri, &demoAppOptions);
 	(void) demoapp_print_histogram(pguri, &demoAppOptions);
 }
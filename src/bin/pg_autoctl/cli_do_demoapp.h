@@ -27,6 +27,16 @@
 #include "string_utils.h"
 
 #define MAX_CLIENTS_COUNT 128
+#define MAX_BATCH_SIZE 1000
+
+/* the faults that the demo application knows how to inject */
+typedef enum
+{
+	DEMO_FAULT_UNKNOWN = 0,
+	DEMO_FAULT_SWITCHOVER,
+	DEMO_FAULT_KILL,
+	DEMO_FAULT_PARTITION
+} DemoFaultKind;
 
 typedef struct DemoAppOptions
 {
@@ -40,6 +50,19 @@ typedef struct DemoAppOptions
 	int firstFailover;
 	int failoverFreq;
 	bool doFailover;
+
+	/* percentage of the client transactions that are reads, and updates */
+	int readRatio;
+	int updateRatio;
+
+	/* send batchSize transactions per round trip, maybe prepared */
+	bool pipeline;
+	int batchSize;
+	bool prepared;
+
+	DemoFaultKind faultKind;
+	char faultCommand[BUFSIZE];
+	char healCommand[BUFSIZE];
 } DemoAppOptions;
 
 extern DemoAppOptions demoAppOptions;
@@ -33,6 +33,7 @@
 #include "pgtuning.h"
 #include "primary_standby.h"
 #include "string_utils.h"
+#include "walprefetch.h"
 
 
 /*
@@ -377,14 +378,31 @@ keeper_cli_pgsetup_startup_logs(int argc, char **argv)
 
 
 /*
- * keeper_cli_pgsetup_tune compute some Postgres tuning for the local system.
+ * keeper_cli_pgsetup_tune compute some Postgres tuning for the local system,
+ * using the tuning profile given as an argument, or the default profile.
  */
 void
 keeper_cli_pgsetup_tune(int argc, char **argv)
 {
 	char config[BUFSIZE] = { 0 };
+	char *profile = DEFAULT_TUNING_PROFILE;
 
-	if (!pgtuning_prepare_guc_settings(postgres_tuning, config, BUFSIZE))
+	if (argc > 1)
+	{
+		commandline_print_usage(&do_pgsetup_tune, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (argc == 1)
+	{
+		profile = argv[0];
+	}
+
+	if (!pgtuning_prepare_guc_settings(postgres_tuning,
+									   keeperOptions.pgSetup.pgdata,
+									   profile,
+									   config,
+									   BUFSIZE))
 	{
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
@@ -446,6 +464,13 @@ keeper_cli_init_standby(int argc, char **argv)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
+	standby_init_basebackup_options(&postgres,
+									config.basebackupCompress,
+									config.basebackupWalMethod,
+									config.basebackupManifestChecksums,
+									config.minimum_backup_rate,
+									config.cloneStreams);
+
 	if (!standby_init_database(&postgres, config.hostname, skipBaseBackup))
 	{
 		log_fatal("Failed to grant access to the standby by adding "
@@ -569,6 +594,53 @@ keeper_cli_promote_standby(int argc, char **argv)
 }
 
 
+/*
+ * keeper_cli_restore_wal implements the restore_command that pg_autoctl
+ * installs when using replication.restore_command and replication.wal_prefetch:
+ * Postgres runs it with the %f %p %r arguments.
+ *
+ * The command only reads the configuration file, without probing the Postgres
+ * installation, because Postgres runs it for each WAL file to restore.
+ */
+void
+keeper_cli_restore_wal(int argc, char **argv)
+{
+	const bool monitorDisabledIsOk = true;
+	KeeperConfig config = keeperOptions;
+
+	if (argc != 2 && argc != 3)
+	{
+		commandline_print_usage(&do_standby_restore_wal, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!keeper_config_read_file_skip_pgsetup(&config, monitorDisabledIsOk))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(config.restoreCommand))
+	{
+		log_fatal("Failed to restore WAL file \"%s\": "
+				  "replication.restore_command is not set",
+				  argv[0]);
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (!wal_prefetch_restore(config.pgSetup.pgdata,
+							  config.restoreCommand,
+							  config.walPrefetch,
+							  argv[0],
+							  argv[1],
+							  argc == 3 ? argv[2] : ""))
+	{
+		/* not an error: Postgres expects that at the end of the archive */
+		exit(EXIT_CODE_PGCTL);
+	}
+}
+
+
 /*
  * keeper_cli_identify_system connects to a Postgres server using the
  * replication protocol to run the IDENTIFY_SYSTEM command.
@@ -614,7 +686,8 @@ keeper_cli_identify_system(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
-	strlcpy(replicationSource.applicationName, "pg_autoctl", MAXCONNINFO);
+	strlcpy(replicationSource.applicationName, "pg_autoctl",
+			sizeof(replicationSource.applicationName));
 	strlcpy(replicationSource.userName, PG_AUTOCTL_REPLICA_USERNAME, NAMEDATALEN);
 
 	if (!pgctl_identify_system(&replicationSource))
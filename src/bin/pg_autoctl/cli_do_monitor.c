@@ -28,15 +28,19 @@
 #include "cli_common.h"
 #include "commandline.h"
 #include "defaults.h"
+#include "env_utils.h"
 #include "keeper_config.h"
 #include "keeper.h"
 #include "monitor.h"
+#include "monitor_bench.h"
+#include "monitor_replay.h"
 #include "nodestate_utils.h"
 #include "parsing.h"
 #include "pgctl.h"
 #include "pgsetup.h"
 #include "pgsql.h"
 #include "state.h"
+#include "string_utils.h"
 
 static void cli_do_monitor_get_primary_node(int argc, char **argv);
 static void cli_do_monitor_get_other_nodes(int argc, char **argv);
@@ -46,6 +50,13 @@ static void cli_do_monitor_register_node(int argc, char **argv);
 static void cli_do_monitor_node_active(int argc, char **argv);
 static void cli_do_monitor_version(int argc, char **argv);
 static void cli_do_monitor_parse_notification(int argc, char **argv);
+static int cli_do_monitor_bench_getopts(int argc, char **argv);
+static void cli_do_monitor_bench(int argc, char **argv);
+static int cli_do_monitor_replay_getopts(int argc, char **argv);
+static void cli_do_monitor_replay(int argc, char **argv);
+
+static MonitorBenchOptions monitorBenchOptions = { 0 };
+static MonitorReplayOptions monitorReplayOptions = { 0 };
 
 
 static CommandLine monitor_get_primary_command =
@@ -127,12 +138,47 @@ static CommandLine monitor_parse_notification_command =
 				 NULL,
 				 cli_do_monitor_parse_notification);
 
+static CommandLine monitor_bench_command =
+	make_command("bench",
+				 "Benchmark the monitor decisions with synthetic nodes",
+				 "[option ...]",
+				 "  --monitor    Postgres URI of a scratch pg_auto_failover monitor\n"
+				 "  --formation  Formation name prefix to use (bench)\n"
+				 "  --host       Hostname of the synthetic nodes (localhost)\n"
+				 "  --port       Port of the first synthetic node (16000)\n"
+				 "  --nodes      How many synthetic nodes to register (6)\n"
+				 "  --groups     How many groups to spread the nodes into (2)\n"
+				 "  --clients    How many concurrent client processes (4)\n"
+				 "  --duration   Duration of the benchmark, in seconds (30)\n"
+				 "  --rate       Target node_active calls per second, 0 is max (0)\n"
+				 "  --keep       Keep the synthetic nodes at the end of the run\n"
+				 "  --json       Output the results in JSON\n",
+				 cli_do_monitor_bench_getopts,
+				 cli_do_monitor_bench);
+
+static CommandLine monitor_replay_command =
+	make_command("replay",
+				 "Replay a production events log against a scratch monitor",
+				 "[option ...]",
+				 "  --monitor    Postgres URI of a scratch pg_auto_failover monitor\n"
+				 "  --file       Events to replay, from pg_autoctl show events --json\n"
+				 "  --formation  Formation name prefix to use (replay)\n"
+				 "  --host       Hostname of the synthetic nodes (localhost)\n"
+				 "  --port       Port of the first synthetic node (17000)\n"
+				 "  --speed      How much faster than production to replay (10)\n"
+				 "  --keep       Keep the synthetic nodes at the end of the run\n"
+				 "  --json       Output the results in JSON\n",
+				 cli_do_monitor_replay_getopts,
+				 cli_do_monitor_replay);
+
 static CommandLine *monitor_subcommands[] = {
 	&monitor_get_command,
 	&monitor_register_command,
 	&monitor_node_active_command,
 	&monitor_version_command,
 	&monitor_parse_notification_command,
+	&monitor_bench_command,
+	&monitor_replay_command,
 	NULL
 };
 
@@ -575,6 +621,9 @@ cli_do_monitor_node_active(int argc, char **argv)
 							 keeper.postgres.postgresSetup.control.timeline_id,
 							 keeper.postgres.currentLSN,
 							 keeper.postgres.pgsrSyncState,
+							 0,
+							 keeper.postgres.replayLSN,
+							 keeper.postgres.applyRate,
 							 &assignedState))
 	{
 		log_fatal("Failed to get the goal state from the node with the monitor, "
@@ -665,8 +714,13 @@ cli_do_monitor_version(int argc, char **argv)
  *   {
  *     "type": "state", "formation": "default", "groupId": 0, "nodeId": 1,
  *     "name": "node_1", "host": "localhost", "port": 5001,
- *     "reportedState": "maintenance", "goalState": "maintenance"
+ *     "reportedState": "maintenance", "goalState": "maintenance",
+ *     "health": "good", "traceId": "4bf92f3577b34da6a3ce929d0e0e4736"
  *   }
+ *
+ * or, in the compact format:
+ *
+ *   S1|default|0|1|node_1|localhost|5001|maintenance|maintenance|good|4bf9...
  */
 static void
 cli_do_monitor_parse_notification(int argc, char **argv)
@@ -700,6 +754,637 @@ cli_do_monitor_parse_notification(int argc, char **argv)
 						   NodeStateToString(nodeState.reportedState));
 	json_object_set_string(root, "goalState",
 						   NodeStateToString(nodeState.goalState));
+	json_object_set_string(root, "traceId", nodeState.traceId);
 
 	(void) cli_pprint_json(js);
 }
+
+
+/*
+ * cli_do_monitor_bench_getopts parses the command line options for the
+ * command `pg_autoctl do monitor bench`.
+ */
+static int
+cli_do_monitor_bench_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	MonitorBenchOptions options = { 0 };
+
+	static struct option long_options[] = {
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "host", required_argument, NULL, 'n' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "nodes", required_argument, NULL, 'N' },
+		{ "groups", required_argument, NULL, 'g' },
+		{ "clients", required_argument, NULL, 'c' },
+		{ "duration", required_argument, NULL, 't' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "keep", no_argument, NULL, 'k' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* set our defaults */
+	strlcpy(options.formation, "bench", sizeof(options.formation));
+	strlcpy(options.host, "localhost", sizeof(options.host));
+	options.port = 16000;
+	options.nodesCount = 6;
+	options.groupsCount = 2;
+	options.clientsCount = 4;
+	options.duration = 30;
+	options.rate = 0;
+
+	/*
+	 * The only command lines that are using cli_do_monitor_bench_getopts are
+	 * terminal ones: they don't accept subcommands. In that case our option
+	 * parsing can happen in any order and we don't need getopt_long to behave
+	 * in a POSIXLY_CORRECT way.
+	 *
+	 * The unsetenv() call allows getopt_long() to reorder arguments for us.
+	 */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "m:f:n:p:N:g:c:t:r:kJVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'm':
+			{
+				/* { "monitor", required_argument, NULL, 'm' } */
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --monitor connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.monitor_pguri, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitor_pguri);
+				break;
+			}
+
+			case 'f':
+			{
+				/* { "formation", required_argument, NULL, 'f' } */
+				strlcpy(options.formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formation);
+				break;
+			}
+
+			case 'n':
+			{
+				/* { "host", required_argument, NULL, 'n' } */
+				strlcpy(options.host, optarg, _POSIX_HOST_NAME_MAX);
+				log_trace("--host %s", options.host);
+				break;
+			}
+
+			case 'p':
+			{
+				/* { "port", required_argument, NULL, 'p' } */
+				if (!stringToInt(optarg, &options.port) || options.port <= 0)
+				{
+					log_error("Failed to parse --port number \"%s\"", optarg);
+					errors++;
+				}
+				log_trace("--port %d", options.port);
+				break;
+			}
+
+			case 'N':
+			{
+				/* { "nodes", required_argument, NULL, 'N' } */
+				if (!stringToInt(optarg, &options.nodesCount) ||
+					options.nodesCount < 1 ||
+					options.nodesCount > MONITOR_BENCH_MAX_NODES)
+				{
+					log_error("Unsupported value for --nodes \"%s\": must be "
+							  "at least 1 and maximum %d",
+							  optarg, MONITOR_BENCH_MAX_NODES);
+					errors++;
+				}
+				log_trace("--nodes %d", options.nodesCount);
+				break;
+			}
+
+			case 'g':
+			{
+				/* { "groups", required_argument, NULL, 'g' } */
+				if (!stringToInt(optarg, &options.groupsCount) ||
+					options.groupsCount < 1)
+				{
+					log_error("Failed to parse --groups number \"%s\"", optarg);
+					errors++;
+				}
+				log_trace("--groups %d", options.groupsCount);
+				break;
+			}
+
+			case 'c':
+			{
+				/* { "clients", required_argument, NULL, 'c' } */
+				if (!stringToInt(optarg, &options.clientsCount) ||
+					options.clientsCount < 1 ||
+					options.clientsCount > MONITOR_BENCH_MAX_CLIENTS)
+				{
+					log_error("Unsupported value for --clients \"%s\": must be "
+							  "at least 1 and maximum %d",
+							  optarg, MONITOR_BENCH_MAX_CLIENTS);
+					errors++;
+				}
+				log_trace("--clients %d", options.clientsCount);
+				break;
+			}
+
+			case 't':
+			{
+				/* { "duration", required_argument, NULL, 't' } */
+				if (!stringToInt(optarg, &options.duration) ||
+					options.duration < 1)
+				{
+					log_error("Failed to parse --duration number \"%s\"",
+							  optarg);
+					errors++;
+				}
+				log_trace("--duration %d", options.duration);
+				break;
+			}
+
+			case 'r':
+			{
+				/* { "rate", required_argument, NULL, 'r' } */
+				if (!stringToInt(optarg, &options.rate) || options.rate < 0)
+				{
+					log_error("Failed to parse --rate number \"%s\"", optarg);
+					errors++;
+				}
+				log_trace("--rate %d", options.rate);
+				break;
+			}
+
+			case 'k':
+			{
+				/* { "keep", no_argument, NULL, 'k' } */
+				options.keep = true;
+				log_trace("--keep");
+				break;
+			}
+
+			case 'J':
+			{
+				/* { "json", no_argument, NULL, 'J' } */
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				keeper_cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.monitor_pguri))
+	{
+		if (env_exists(PG_AUTOCTL_MONITOR) &&
+			get_env_copy(PG_AUTOCTL_MONITOR,
+						 options.monitor_pguri,
+						 sizeof(options.monitor_pguri)))
+		{
+			log_debug("Using environment PG_AUTOCTL_MONITOR \"%s\"",
+					  options.monitor_pguri);
+		}
+		else
+		{
+			log_fatal("Please provide --monitor");
+			errors++;
+		}
+	}
+
+	if (options.groupsCount > options.nodesCount)
+	{
+		log_error("Using --groups %d requires at least as many --nodes",
+				  options.groupsCount);
+		errors++;
+	}
+
+	/* a client without any node to drive would just sit idle */
+	if (options.clientsCount > options.nodesCount)
+	{
+		log_warn("Using --clients %d instead of %d: that's how many nodes "
+				 "are registered",
+				 options.nodesCount, options.clientsCount);
+		options.clientsCount = options.nodesCount;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish parsed options */
+	monitorBenchOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_do_monitor_bench registers synthetic nodes on a scratch monitor, drives
+ * concurrent node_active calls for them, and reports throughput, latency
+ * percentiles, and lock waits.
+ */
+static void
+cli_do_monitor_bench(int argc, char **argv)
+{
+	MonitorBenchOptions *options = &monitorBenchOptions;
+	MonitorBenchResult result = { 0 };
+
+	MonitorBenchNode *nodes =
+		(MonitorBenchNode *) calloc(options->nodesCount,
+									sizeof(MonitorBenchNode));
+
+	if (nodes == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!monitor_bench_register_nodes(options, nodes))
+	{
+		/* errors have already been logged */
+		(void) monitor_bench_cleanup(options, nodes);
+		free(nodes);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	bool success = monitor_bench_run(options, nodes, &result);
+
+	if (!options->keep && !monitor_bench_cleanup(options, nodes))
+	{
+		log_warn("Failed to clean-up the synthetic nodes and formations, "
+				 "see above for details");
+	}
+
+	free(nodes);
+
+	if (!success)
+	{
+		log_fatal("Failed to run the monitor benchmark, "
+				  "see above for details");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (outputJSON)
+	{
+		(void) monitor_bench_print_result_as_json(options, &result);
+	}
+	else
+	{
+		(void) monitor_bench_print_result(options, &result);
+	}
+}
+
+
+/*
+ * cli_do_monitor_replay_getopts parses the command line options for the
+ * command `pg_autoctl do monitor replay`.
+ */
+static int
+cli_do_monitor_replay_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	MonitorReplayOptions options = { 0 };
+
+	static struct option long_options[] = {
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "file", required_argument, NULL, 'F' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "host", required_argument, NULL, 'n' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "keep", no_argument, NULL, 'k' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* set our defaults */
+	strlcpy(options.formation, "replay", sizeof(options.formation));
+	strlcpy(options.host, "localhost", sizeof(options.host));
+	options.port = 17000;
+	options.speed = 10.0;
+
+	/*
+	 * The only command lines that are using cli_do_monitor_replay_getopts
+	 * are terminal ones: they don't accept subcommands. In that case our
+	 * option parsing can happen in any order and we don't need getopt_long
+	 * to behave in a POSIXLY_CORRECT way.
+	 *
+	 * The unsetenv() call allows getopt_long() to reorder arguments for us.
+	 */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "m:F:f:n:p:s:kJVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'm':
+			{
+				/* { "monitor", required_argument, NULL, 'm' } */
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --monitor connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.monitor_pguri, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitor_pguri);
+				break;
+			}
+
+			case 'F':
+			{
+				/* { "file", required_argument, NULL, 'F' } */
+				strlcpy(options.filename, optarg, MAXPGPATH);
+				log_trace("--file %s", options.filename);
+				break;
+			}
+
+			case 'f':
+			{
+				/* { "formation", required_argument, NULL, 'f' } */
+				strlcpy(options.formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formation);
+				break;
+			}
+
+			case 'n':
+			{
+				/* { "host", required_argument, NULL, 'n' } */
+				strlcpy(options.host, optarg, _POSIX_HOST_NAME_MAX);
+				log_trace("--host %s", options.host);
+				break;
+			}
+
+			case 'p':
+			{
+				/* { "port", required_argument, NULL, 'p' } */
+				if (!stringToInt(optarg, &options.port) || options.port <= 0)
+				{
+					log_error("Failed to parse --port number \"%s\"", optarg);
+					errors++;
+				}
+				log_trace("--port %d", options.port);
+				break;
+			}
+
+			case 's':
+			{
+				/* { "speed", required_argument, NULL, 's' } */
+				if (!stringToDouble(optarg, &options.speed) ||
+					options.speed <= 0.0)
+				{
+					log_error("Failed to parse --speed \"%s\": must be a "
+							  "positive number",
+							  optarg);
+					errors++;
+				}
+				log_trace("--speed %g", options.speed);
+				break;
+			}
+
+			case 'k':
+			{
+				/* { "keep", no_argument, NULL, 'k' } */
+				options.keep = true;
+				log_trace("--keep");
+				break;
+			}
+
+			case 'J':
+			{
+				/* { "json", no_argument, NULL, 'J' } */
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				keeper_cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.monitor_pguri))
+	{
+		if (env_exists(PG_AUTOCTL_MONITOR) &&
+			get_env_copy(PG_AUTOCTL_MONITOR,
+						 options.monitor_pguri,
+						 sizeof(options.monitor_pguri)))
+		{
+			log_debug("Using environment PG_AUTOCTL_MONITOR \"%s\"",
+					  options.monitor_pguri);
+		}
+		else
+		{
+			log_fatal("Please provide --monitor");
+			errors++;
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.filename))
+	{
+		log_fatal("Please provide --file");
+		errors++;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish parsed options */
+	monitorReplayOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_do_monitor_replay replays a production events log against a scratch
+ * monitor, and reports how the decisions and failover times of the scratch
+ * monitor compare with the ones found in the events log.
+ */
+static void
+cli_do_monitor_replay(int argc, char **argv)
+{
+	MonitorReplayOptions *options = &monitorReplayOptions;
+	MonitorReplay replay = { 0 };
+	MonitorReplayResult result = { 0 };
+
+	if (!monitor_replay_load_events(options, &replay))
+	{
+		/* errors have already been logged */
+		monitor_replay_free(&replay);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!monitor_replay_register_nodes(options, &replay))
+	{
+		/* errors have already been logged */
+		(void) monitor_replay_cleanup(options, &replay);
+		monitor_replay_free(&replay);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	bool success = monitor_replay_scale_timeouts(options, &replay) &&
+				   monitor_replay_run(options, &replay, &result);
+
+	if (!monitor_replay_restore_timeouts(options, &replay))
+	{
+		log_warn("Failed to restore the monitor timeouts, "
+				 "see above for details");
+	}
+
+	if (!options->keep && !monitor_replay_cleanup(options, &replay))
+	{
+		log_warn("Failed to clean-up the synthetic nodes and formations, "
+				 "see above for details");
+	}
+
+	if (!success)
+	{
+		log_fatal("Failed to replay the events log, see above for details");
+		monitor_replay_free(&replay);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (outputJSON)
+	{
+		(void) monitor_replay_print_result_as_json(options, &replay, &result);
+	}
+	else
+	{
+		(void) monitor_replay_print_result(options, &replay, &result);
+	}
+
+	monitor_replay_free(&replay);
+}
@@ -145,11 +145,20 @@ CommandLine do_standby_promote =
 				 keeper_cli_keeper_setup_getopts,
 				 keeper_cli_promote_standby);
 
+CommandLine do_standby_restore_wal =
+	make_command("restore-wal",
+				 "Restore a WAL file from the archive, prefetching the next ones",
+				 " [ --pgdata ... ] <WAL file name> <WAL file path> [ <restart point> ]",
+				 KEEPER_CLI_WORKER_SETUP_OPTIONS,
+				 keeper_cli_keeper_setup_getopts,
+				 keeper_cli_restore_wal);
+
 CommandLine *do_standby[] = {
 	&do_standby_init,
 	&do_standby_rewind,
 	&do_standby_crash_recovery,
 	&do_standby_promote,
+	&do_standby_restore_wal,
 	NULL
 };
 
@@ -201,7 +210,7 @@ CommandLine do_pgsetup_startup_logs =
 CommandLine do_pgsetup_tune =
 	make_command("tune",
 				 "Compute and log some Postgres tuning options",
-				 "[option ...]",
+				 "[option ...] [ oltp | mixed | analytics | write-heavy | monitor ]",
 				 KEEPER_CLI_WORKER_SETUP_OPTIONS,
 				 keeper_cli_keeper_setup_getopts,
 				 keeper_cli_pgsetup_tune);
@@ -567,6 +576,7 @@ CommandLine *do_subcommands[] = {
 	&do_tmux_commands,
 	&do_azure_commands,
 	&do_demo_commands,
+	&do_bench_commands,
 	NULL
 };
 
@@ -19,6 +19,9 @@ extern CommandLine do_fsm_commands;
 /* src/bin/pg_autoctl/cli_do_monitor.c */
 extern CommandLine do_monitor_commands;
 
+/* src/bin/pg_autoctl/cli_do_bench.c */
+extern CommandLine do_bench_commands;
+
 /* src/bin/pg_autoctl/cli_do_service.c */
 extern CommandLine do_service_commands;
 extern CommandLine do_service_postgres_ctl_commands;
@@ -26,6 +29,7 @@ extern CommandLine do_service_postgres_ctl_commands;
 /* src/bin/pg_autoctl/cli_do_show.c */
 extern CommandLine do_show_commands;
 extern CommandLine do_pgsetup_commands;
+extern CommandLine do_pgsetup_tune;
 extern CommandLine do_service_postgres_ctl_commands;
 extern CommandLine do_service_commands;
 
@@ -63,6 +67,7 @@ extern CommandLine *do_standby[];
 extern CommandLine do_standby_init;
 extern CommandLine do_standby_rewind;
 extern CommandLine do_standby_promote;
+extern CommandLine do_standby_restore_wal;
 
 extern CommandLine do_discover;
 
@@ -98,6 +103,7 @@ void keeper_cli_init_standby(int argc, char **argv);
 void keeper_cli_rewind_old_primary(int argc, char **argv);
 void keeper_cli_maybe_do_crash_recovery(int argc, char **argv);
 void keeper_cli_promote_standby(int argc, char **argv);
+void keeper_cli_restore_wal(int argc, char **argv);
 void keeper_cli_receiwal(int argc, char **argv);
 void keeper_cli_identify_system(int argc, char **argv);
 
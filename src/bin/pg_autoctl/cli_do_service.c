@@ -25,6 +25,9 @@
 #include "monitor_config.h"
 #include "pidfile.h"
 #include "service_keeper.h"
+#include "service_control.h"
+#include "service_metrics.h"
+#include "service_monitor_metrics.h"
 #include "service_monitor.h"
 #include "service_postgres_ctl.h"
 #include "signals.h"
@@ -39,14 +42,20 @@ static void cli_do_service_getpid(const char *serviceName);
 static void cli_do_service_getpid_postgres(int argc, char **argv);
 static void cli_do_service_getpid_listener(int argc, char **argv);
 static void cli_do_service_getpid_node_active(int argc, char **argv);
+static void cli_do_service_getpid_metrics(int argc, char **argv);
+static void cli_do_service_getpid_control(int argc, char **argv);
 
 static void cli_do_service_restart(const char *serviceName);
 static void cli_do_service_restart_postgres(int argc, char **argv);
 static void cli_do_service_restart_listener(int argc, char **argv);
 static void cli_do_service_restart_node_active(int argc, char **argv);
+static void cli_do_service_restart_metrics(int argc, char **argv);
+static void cli_do_service_restart_control(int argc, char **argv);
 
 static void cli_do_service_monitor_listener(int argc, char **argv);
 static void cli_do_service_node_active(int argc, char **argv);
+static void cli_do_service_metrics(int argc, char **argv);
+static void cli_do_service_control(int argc, char **argv);
 
 CommandLine service_pgcontroller =
 	make_command("pgcontroller",
@@ -80,6 +89,22 @@ CommandLine service_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_node_active);
 
+CommandLine service_metrics =
+	make_command("metrics",
+				 "pg_autoctl service that serves the metrics",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_metrics);
+
+CommandLine service_control =
+	make_command("control",
+				 "pg_autoctl service that serves the local node state",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_control);
+
 CommandLine service_getpid_postgres =
 	make_command("postgres",
 				 "Get the pid of the pg_autoctl postgres controller service",
@@ -104,10 +129,28 @@ CommandLine service_getpid_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_getpid_node_active);
 
+CommandLine service_getpid_metrics =
+	make_command("metrics",
+				 "Get the pid of the pg_autoctl metrics service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_metrics);
+
+CommandLine service_getpid_control =
+	make_command("control",
+				 "Get the pid of the pg_autoctl control service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_control);
+
 static CommandLine *service_getpid[] = {
 	&service_getpid_postgres,
 	&service_getpid_listener,
 	&service_getpid_node_active,
+	&service_getpid_metrics,
+	&service_getpid_control,
 	NULL
 };
 
@@ -141,10 +184,28 @@ CommandLine service_restart_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_restart_node_active);
 
+CommandLine service_restart_metrics =
+	make_command("metrics",
+				 "Restart the pg_autoctl metrics service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_metrics);
+
+CommandLine service_restart_control =
+	make_command("control",
+				 "Restart the pg_autoctl control service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_control);
+
 static CommandLine *service_restart[] = {
 	&service_restart_postgres,
 	&service_restart_listener,
 	&service_restart_node_active,
+	&service_restart_metrics,
+	&service_restart_control,
 	NULL
 };
 
@@ -160,6 +221,8 @@ static CommandLine *service[] = {
 	&service_postgres,
 	&service_monitor_listener,
 	&service_node_active,
+	&service_metrics,
+	&service_control,
 	NULL
 };
 
@@ -255,6 +318,26 @@ cli_do_service_getpid_node_active(int argc, char **argv)
 }
 
 
+/*
+ * cli_do_service_getpid_metrics gets the metrics service pid.
+ */
+static void
+cli_do_service_getpid_metrics(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_METRICS);
+}
+
+
+/*
+ * cli_do_service_getpid_control gets the control service pid.
+ */
+static void
+cli_do_service_getpid_control(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_CONTROL);
+}
+
+
 /*
  * cli_do_service_restart sends the TERM signal to the given serviceName, which
  * is known to have the restart policy RP_PERMANENT (that's hard-coded). As a
@@ -352,6 +435,30 @@ cli_do_service_restart_node_active(int argc, char **argv)
 }
 
 
+/*
+ * cli_do_service_restart_metrics sends the TERM signal to the keeper metrics
+ * service, which is known to have the restart policy RP_PERMANENT (that's
+ * hard-coded). As a consequence the supervisor will restart the service.
+ */
+static void
+cli_do_service_restart_metrics(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_METRICS);
+}
+
+
+/*
+ * cli_do_service_restart_control sends the TERM signal to the keeper control
+ * service, which is known to have the restart policy RP_PERMANENT (that's
+ * hard-coded). As a consequence the supervisor will restart the service.
+ */
+static void
+cli_do_service_restart_control(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_CONTROL);
+}
+
+
 /*
  * cli_do_pgcontroller starts the process controller service within a supervision
  * tree. It is used for debug purposes only. When using this entry point we
@@ -588,3 +695,140 @@ cli_do_service_node_active(int argc, char **argv)
 	/* Start the node_active() protocol client */
 	(void) keeper_node_active_loop(&keeper, ppid);
 }
+
+
+/*
+ * cli_do_service_metrics starts the metrics service. On a monitor node it
+ * serves the monitor's view of the formations, on a keeper node it serves the
+ * keeper metrics.
+ */
+static void
+cli_do_service_metrics(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool exitOnQuit = true;
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_set_pathnames_from_pgdata(&(config.pathnames),
+												 config.pgSetup.pgdata))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (ProbeConfigurationFileRole(config.pathnames.config) ==
+		PG_AUTOCTL_ROLE_MONITOR)
+	{
+		Monitor monitor = { 0 };
+
+		if (!monitor_config_init_from_pgsetup(&(monitor.config),
+											  &config.pgSetup,
+											  missingPgdataIsOk,
+											  pgIsNotRunningIsOk))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_CONFIG);
+		}
+
+		/* display a user-friendly process name */
+		(void) set_ps_title("pg_autoctl: monitor metrics");
+
+		/* create the service pidfile */
+		if (!create_service_pidfile(monitor.config.pathnames.pid,
+									SERVICE_NAME_METRICS))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		if (!service_monitor_metrics_loop(&monitor))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		return;
+	}
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged. */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: metrics");
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid, SERVICE_NAME_METRICS))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_metrics_loop(&config))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
+/*
+ * cli_do_service_control starts the control service, which answers CLI
+ * requests about the local node on a Unix socket.
+ */
+static void
+cli_do_service_control(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool exitOnQuit = true;
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_set_pathnames_from_pgdata(&(config.pathnames),
+												 config.pgSetup.pgdata))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged. */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: control");
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid, SERVICE_NAME_CONTROL))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_control_loop(&config))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
@@ -890,6 +890,7 @@ tmux_start_server(const char *scriptName, const char *binpath)
 	 * sub-processes.
 	 */
 	unsetenv(PG_AUTOCTL_LOG_SEMAPHORE);
+	unsetenv(PG_AUTOCTL_LOG_MUTEX);
 
 	if (setenv("PG_AUTOCTL_DEBUG", "1", 1) != 0)
 	{
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 
@@ -48,6 +49,10 @@
 bool dropAndDestroy = false;
 static bool dropForce = false;
 
+/* --name may be repeated to drop several nodes at once */
+static char **dropNodeNames = NULL;
+static int dropNodeNamesCount = 0;
+
 static void cli_drop_monitor(int argc, char **argv);
 
 static void cli_drop_local_monitor(MonitorConfig *mconfig, bool dropAndDestroy);
@@ -59,6 +64,7 @@ static void stop_postgres_and_remove_pgdata_and_config(ConfigFilePaths *pathname
 													   PostgresSetup *pgSetup);
 
 static void cli_drop_node_from_monitor_and_wait(KeeperConfig *config);
+static void cli_drop_nodes_from_monitor_and_wait(KeeperConfig *config);
 
 CommandLine drop_monitor_command =
 	make_command("monitor",
@@ -78,7 +84,8 @@ CommandLine drop_node_command =
 		"  --pgdata      path to data directory\n"
 		"  --monitor     pg_auto_failover Monitor Postgres URL\n"
 		"  --formation   pg_auto_failover formation\n"
-		"  --name        drop the node with the given node name\n"
+		"  --name        drop the node with the given node name, "
+		"repeat to drop several nodes\n"
 		"  --hostname    drop the node with given hostname and pgport\n"
 		"  --pgport      drop the node with given hostname and pgport\n"
 		"  --destroy     also destroy Postgres database\n"
@@ -188,8 +195,25 @@ cli_drop_node_getopts(int argc, char **argv)
 			case 'a':
 			{
 				/* { "name", required_argument, NULL, 'a' }, */
-				strlcpy(options.name, optarg, _POSIX_HOST_NAME_MAX);
-				log_trace("--name %s", options.name);
+				char **names =
+					(char **) realloc(dropNodeNames,
+									  (dropNodeNamesCount + 1) * sizeof(char *));
+
+				if (names == NULL)
+				{
+					log_fatal(ALLOCATION_FAILED_ERROR);
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				dropNodeNames = names;
+				dropNodeNames[dropNodeNamesCount++] = optarg;
+
+				/* the first --name is the target of a single node drop */
+				if (dropNodeNamesCount == 1)
+				{
+					strlcpy(options.name, optarg, _POSIX_HOST_NAME_MAX);
+				}
+				log_trace("--name %s", optarg);
 				break;
 			}
 
@@ -410,7 +434,14 @@ cli_drop_node(int argc, char **argv)
 			exit(EXIT_CODE_BAD_ARGS);
 		}
 
-		(void) cli_drop_node_from_monitor_and_wait(&config);
+		if (dropNodeNamesCount > 1)
+		{
+			(void) cli_drop_nodes_from_monitor_and_wait(&config);
+		}
+		else
+		{
+			(void) cli_drop_node_from_monitor_and_wait(&config);
+		}
 	}
 }
 
@@ -991,6 +1022,8 @@ cli_drop_node_from_monitor_and_wait(KeeperConfig *config)
 
 		dropped = nodesArray.count == 0;
 
+		nodeAddressArrayFree(&nodesArray);
+
 		if (dropped)
 		{
 			log_info("Node with id %lld in group %d has been successfully "
@@ -999,3 +1032,174 @@ cli_drop_node_from_monitor_and_wait(KeeperConfig *config)
 		}
 	}
 }
+
+
+/*
+ * cli_drop_nodes_from_monitor_and_wait drops all the nodes given with a
+ * repeated --name option in a single call to pgautofailover.remove_nodes(),
+ * so that the monitor evaluates the state of each group only once, and then
+ * waits until all of the nodes have been dropped, rather than one at a time.
+ */
+static void
+cli_drop_nodes_from_monitor_and_wait(KeeperConfig *config)
+{
+	Monitor monitor = { 0 };
+	NodeAddressArray nodesArray = { 0 };
+	RemovedNodeArray removedArray = { 0 };
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, config);
+
+	if (!monitor_get_nodes(&monitor, config->formation, -1, &nodesArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	int64_t *nodeIds = (int64_t *) calloc(dropNodeNamesCount, sizeof(int64_t));
+
+	if (nodeIds == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* check all the names before removing any node */
+	for (int index = 0; index < dropNodeNamesCount; index++)
+	{
+		bool found = false;
+
+		for (int n = 0; n < nodesArray.count; n++)
+		{
+			if (strcmp(nodesArray.nodes[n].name, dropNodeNames[index]) == 0)
+			{
+				nodeIds[index] = nodesArray.nodes[n].nodeId;
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			log_fatal("Failed to find node \"%s\" in formation \"%s\"",
+					  dropNodeNames[index], config->formation);
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+
+	nodeAddressArrayFree(&nodesArray);
+
+	log_info("Removing %d nodes from formation \"%s\" in a single call "
+			 "to the monitor", dropNodeNamesCount, config->formation);
+
+	if (!monitor_remove_nodes(&monitor, nodeIds, dropNodeNamesCount,
+							  dropForce, &removedArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	free(nodeIds);
+
+	/* if the timeout is zero, just don't wait at all */
+	if (config->listen_notifications_timeout == 0)
+	{
+		monitor_removed_node_array_free(&removedArray);
+		return;
+	}
+
+	log_info("Waiting until the %d nodes have been dropped from the monitor, "
+			 "or for %ds, whichever comes first",
+			 removedArray.count, config->listen_notifications_timeout);
+
+	/* wake up as soon as any node of the formation changes state */
+	bool listening =
+		monitor_listen_state_changes(&monitor, config->formation, -1);
+
+	/* to log each node once when it's been dropped */
+	bool *removedBefore = (bool *) calloc(Max(removedArray.count, 1),
+										  sizeof(bool));
+
+	if (removedBefore == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	uint64_t start = time(NULL);
+
+	for (;;)
+	{
+		int remaining = 0;
+
+		for (int index = 0; index < removedArray.count; index++)
+		{
+			if (!removedArray.nodes[index].removed)
+			{
+				++remaining;
+			}
+		}
+
+		if (remaining == 0)
+		{
+			break;
+		}
+
+		uint64_t now = time(NULL);
+
+		if ((now - start) > config->listen_notifications_timeout)
+		{
+			log_error("Failed to wait until %d of the %d nodes have been "
+					  "dropped", remaining, removedArray.count);
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		int monitorSock = listening ? monitor_notification_socket(&monitor) : -1;
+		int timeoutMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+
+		if (monitorSock >= 0)
+		{
+			struct pollfd fds[1] = { { monitorSock, POLLIN, 0 } };
+			MonitorChangedNodes changes = { 0 };
+
+			if (poll(fds, 1, timeoutMs) > 0 &&
+				!monitor_consume_state_changes(&monitor, &changes))
+			{
+				/* we lost the connection, keep polling the monitor */
+				listening = false;
+			}
+		}
+		else
+		{
+			pg_usleep(timeoutMs * 1000L);
+		}
+
+		for (int index = 0; index < removedArray.count; index++)
+		{
+			removedBefore[index] = removedArray.nodes[index].removed;
+		}
+
+		if (!monitor_update_removed_nodes(&monitor, &removedArray))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		for (int index = 0; index < removedArray.count; index++)
+		{
+			RemovedNode *node = &(removedArray.nodes[index]);
+
+			if (node->removed && !removedBefore[index])
+			{
+				log_info("Node with id %lld in group %d has been successfully "
+						 "dropped from the monitor",
+						 (long long) node->nodeId, node->groupId);
+			}
+		}
+	}
+
+	log_info("All of the %d nodes have been successfully dropped from the "
+			 "monitor", removedArray.count);
+
+	free(removedBefore);
+	monitor_removed_node_array_free(&removedArray);
+}
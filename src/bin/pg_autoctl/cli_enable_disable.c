@@ -1747,6 +1747,8 @@ cli_disable_monitor(int argc, char **argv)
 		}
 	}
 
+	nodeAddressArrayFree(&nodesArray);
+
 	/*
 	 * Now either we didn't find the node on the monitor, or we just removed it
 	 * from there. In either case, we can proceed with disabling the monitor
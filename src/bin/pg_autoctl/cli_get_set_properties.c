@@ -20,6 +20,8 @@ static void cli_get_formation_number_sync_standbys(int argc, char **argv);
 
 static void cli_set_node_replication_quorum(int argc, char **argv);
 static void cli_set_node_candidate_priority(int argc, char **argv);
+static void cli_set_node_upstream(int argc, char **argv);
+static void cli_set_node_zone(int argc, char **argv);
 static void cli_set_node_metadata(int argc, char **argv);
 static void cli_set_formation_number_sync_standbys(int arc, char **argv);
 
@@ -133,6 +135,30 @@ static CommandLine set_node_candidate_priority_command =
 				 cli_get_name_getopts,
 				 cli_set_node_candidate_priority);
 
+static CommandLine set_node_upstream_command =
+	make_command("upstream",
+				 "set the standby node to stream from on the monitor",
+				 " [ --pgdata ] [ --json ] [ --formation ] [ --name ] "
+				 "<node name|primary>",
+				 "  --pgdata      path to data directory\n"
+				 "  --formation   pg_auto_failover formation\n"
+				 "  --name        pg_auto_failover node name\n"
+				 "  --json        output data in the JSON format\n",
+				 cli_get_name_getopts,
+				 cli_set_node_upstream);
+
+static CommandLine set_node_zone_command =
+	make_command("zone",
+				 "set the zone of the node on the monitor",
+				 " [ --pgdata ] [ --json ] [ --formation ] [ --name ] "
+				 "<zone>",
+				 "  --pgdata      path to data directory\n"
+				 "  --formation   pg_auto_failover formation\n"
+				 "  --name        pg_auto_failover node name\n"
+				 "  --json        output data in the JSON format\n",
+				 cli_get_name_getopts,
+				 cli_set_node_zone);
+
 static CommandLine set_node_metadata_command =
 	make_command("metadata",
 				 "set metadata on the monitor",
@@ -149,6 +175,8 @@ static CommandLine *set_node_subcommands[] = {
 	&set_node_metadata_command,
 	&set_node_replication_quorum_command,
 	&set_node_candidate_priority_command,
+	&set_node_upstream_command,
+	&set_node_zone_command,
 	NULL
 };
 
@@ -474,6 +502,119 @@ cli_set_node_candidate_priority(int argc, char **argv)
 }
 
 
+/*
+ * cli_set_node_upstream sets the upstream node property on the monitor for
+ * current pg_autoctl node: the other standby node that this node streams
+ * from, or "primary" to stream from the primary node again.
+ */
+static void
+cli_set_node_upstream(int argc, char **argv)
+{
+	Keeper keeper = { 0 };
+	Monitor *monitor = &(keeper.monitor);
+
+	keeper.config = keeperOptions;
+
+	if (argc != 1)
+	{
+		log_error("Failed to parse command line arguments: "
+				  "got %d when 1 is expected",
+				  argc);
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	char *upstreamName = streq(argv[0], "primary") ? NULL : argv[0];
+
+	(void) cli_monitor_init_from_option_or_config(monitor, &(keeper.config));
+
+	/* grab --name from either the command options or the configuration file */
+	(void) cli_ensure_node_name(&keeper);
+
+	if (!monitor_set_node_upstream(monitor,
+								   keeper.config.formation,
+								   keeper.config.name,
+								   upstreamName))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		json_object_set_string(jsObj, "upstream", argv[0]);
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stdout, "%s\n", argv[0]);
+	}
+}
+
+
+/*
+ * cli_set_node_zone sets the zone of the node on the monitor, which is used
+ * to prefer nearby nodes in synchronous_standby_names and for failover. An
+ * empty string resets the zone.
+ */
+static void
+cli_set_node_zone(int argc, char **argv)
+{
+	Keeper keeper = { 0 };
+	Monitor *monitor = &(keeper.monitor);
+
+	keeper.config = keeperOptions;
+
+	if (argc != 1)
+	{
+		log_error("Failed to parse command line arguments: "
+				  "got %d when 1 is expected",
+				  argc);
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (strlen(argv[0]) >= NAMEDATALEN)
+	{
+		log_error("Zone name \"%s\" is too long, the maximum is %d bytes",
+				  argv[0], NAMEDATALEN - 1);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	(void) cli_monitor_init_from_option_or_config(monitor, &(keeper.config));
+
+	/* grab --name from either the command options or the configuration file */
+	(void) cli_ensure_node_name(&keeper);
+
+	if (!monitor_set_node_zone(monitor,
+							   keeper.config.formation,
+							   keeper.config.name,
+							   argv[0]))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		json_object_set_string(jsObj, "zone", argv[0]);
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stdout, "%s\n", argv[0]);
+	}
+}
+
+
 /*
  * cli_set_node_metadata sets this pg_autoctl node name, hostname, and port on
  * the monitor. That's the hostname that is used by every other node in the
@@ -689,8 +830,13 @@ set_node_candidate_priority(Keeper *keeper, int candidatePriority)
 	/* ignore the result of the filtering, worst case we don't wait */
 	(void) nodestateFilterArrayGroup(&nodesArray, config->name);
 
+	/* we only need to know how many nodes are in the group */
+	int nodesCount = nodesArray.count;
+
+	currentNodeStateArrayFree(&nodesArray);
+
 	/* listen for state changes BEFORE we apply new settings */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		char *channels[] = { "state", NULL };
 
@@ -712,7 +858,7 @@ set_node_candidate_priority(Keeper *keeper, int candidatePriority)
 	}
 
 	/* now wait until the primary actually applied the new setting */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		if (!monitor_wait_until_primary_applied_settings(
 				&(keeper->monitor),
@@ -752,8 +898,13 @@ set_node_replication_quorum(Keeper *keeper, bool replicationQuorum)
 		log_warn("Failed to get_nodes() on the monitor");
 	}
 
+	/* we only need to know how many nodes are in the group */
+	int nodesCount = nodesArray.count;
+
+	nodeAddressArrayFree(&nodesArray);
+
 	/* listen for state changes BEFORE we apply new settings */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		char *channels[] = { "state", NULL };
 
@@ -775,7 +926,7 @@ set_node_replication_quorum(Keeper *keeper, bool replicationQuorum)
 	}
 
 	/* now wait until the primary actually applied the new setting */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		if (!monitor_wait_until_primary_applied_settings(
 				&(keeper->monitor),
@@ -814,8 +965,13 @@ set_formation_number_sync_standbys(Monitor *monitor,
 		log_warn("Failed to get_nodes() on the monitor");
 	}
 
+	/* we only need to know how many nodes are in the group */
+	int nodesCount = nodesArray.count;
+
+	nodeAddressArrayFree(&nodesArray);
+
 	/* listen for state changes BEFORE we apply new settings */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		char *channels[] = { "state", NULL };
 
@@ -839,7 +995,7 @@ set_formation_number_sync_standbys(Monitor *monitor,
 
 
 	/* now wait until the primary actually applied the new setting */
-	if (nodesArray.count > 1)
+	if (nodesCount > 1)
 	{
 		if (!monitor_wait_until_primary_applied_settings(
 				monitor,
@@ -8,6 +8,11 @@
  *
  */
 
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "cli_common.h"
 #include "commandline.h"
 #include "defaults.h"
@@ -18,6 +23,22 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "string_utils.h"
+#include "trace.h"
+
+#include "runprogram.h"
+
+/*
+ * pg_autoctl perform rolling-maintenance options: how many standby nodes we
+ * put to maintenance at the same time, and the command to run on each node
+ * while it's in maintenance.
+ */
+typedef struct RollingMaintenanceOptions
+{
+	int concurrency;
+	char hook[BUFSIZE];
+} RollingMaintenanceOptions;
+
+static RollingMaintenanceOptions rollingMaintenanceOptions = { 0 };
 
 static int cli_perform_failover_getopts(int argc, char **argv);
 static void cli_perform_failover(int argc, char **argv);
@@ -25,6 +46,24 @@ static void cli_perform_failover(int argc, char **argv);
 static int cli_perform_promotion_getopts(int argc, char **argv);
 static void cli_perform_promotion(int argc, char **argv);
 
+static int cli_perform_rolling_maintenance_getopts(int argc, char **argv);
+static void cli_perform_rolling_maintenance(int argc, char **argv);
+
+static bool rolling_maintenance_batch(Monitor *monitor,
+									  KeeperConfig *config,
+									  CurrentNodeState **batch,
+									  int count);
+static bool rolling_maintenance_set(Monitor *monitor,
+									CurrentNodeState *nodeState,
+									bool enable);
+static bool rolling_maintenance_wait(Monitor *monitor,
+									 KeeperConfig *config,
+									 CurrentNodeState **batch,
+									 int count,
+									 NodeState targetState);
+static pid_t rolling_maintenance_start_hook(CurrentNodeState *nodeState,
+											const char *hook);
+
 CommandLine perform_failover_command =
 	make_command("failover",
 				 "Perform a failover for given formation and group",
@@ -32,7 +71,8 @@ CommandLine perform_failover_command =
 				 "  --pgdata      path to data directory\n"
 				 "  --formation   formation to target, defaults to 'default'\n"
 				 "  --group       group to target, defaults to 0\n"
-				 "  --wait        how many seconds to wait, default to 60 \n",
+				 "  --wait        how many seconds to wait, default to 60 \n"
+				 "  --timing      print the duration of each phase\n",
 				 cli_perform_failover_getopts,
 				 cli_perform_failover);
 
@@ -43,7 +83,8 @@ CommandLine perform_switchover_command =
 				 "  --pgdata      path to data directory\n"
 				 "  --formation   formation to target, defaults to 'default'\n"
 				 "  --group       group to target, defaults to 0\n"
-				 "  --wait        how many seconds to wait, default to 60 \n",
+				 "  --wait        how many seconds to wait, default to 60 \n"
+				 "  --timing      print the duration of each phase\n",
 				 cli_perform_failover_getopts,
 				 cli_perform_failover);
 
@@ -54,14 +95,29 @@ CommandLine perform_promotion_command =
 				 "  --pgdata      path to data directory\n"
 				 "  --formation   formation to target, defaults to 'default' \n"
 				 "  --name        node name to target, defaults to current node\n"
-				 "  --wait        how many seconds to wait, default to 60 \n",
+				 "  --wait        how many seconds to wait, default to 60 \n"
+				 "  --timing      print the duration of each phase\n",
 				 cli_perform_promotion_getopts,
 				 cli_perform_promotion);
 
+CommandLine perform_rolling_maintenance_command =
+	make_command("rolling-maintenance",
+				 "Put every node of a group to maintenance, with a single switchover",
+				 " [ --pgdata --formation --group ] [ --concurrency --hook ] ",
+				 "  --pgdata      path to data directory\n"
+				 "  --formation   formation to target, defaults to 'default'\n"
+				 "  --group       group to target, defaults to 0\n"
+				 "  --concurrency how many standby nodes at a time, default to 1\n"
+				 "  --hook        command to run for each node in maintenance\n"
+				 "  --wait        how many seconds to wait, default to 60 \n",
+				 cli_perform_rolling_maintenance_getopts,
+				 cli_perform_rolling_maintenance);
+
 CommandLine *perform_subcommands[] = {
 	&perform_failover_command,
 	&perform_switchover_command,
 	&perform_promotion_command,
+	&perform_rolling_maintenance_command,
 	NULL,
 };
 
@@ -87,6 +143,7 @@ cli_perform_failover_getopts(int argc, char **argv)
 		{ "formation", required_argument, NULL, 'f' },
 		{ "group", required_argument, NULL, 'g' },
 		{ "wait", required_argument, NULL, 'w' },
+		{ "timing", no_argument, NULL, 'Y' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -164,6 +221,14 @@ cli_perform_failover_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'Y':
+			{
+				/* { "timing", no_argument, NULL, 'Y' }, */
+				(void) trace_timing_enable();
+				log_trace("--timing");
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -284,7 +349,14 @@ cli_perform_failover(int argc, char **argv)
 		exit(EXIT_CODE_MONITOR);
 	}
 
-	if (!monitor_perform_failover(&monitor, config.formation, config.groupId))
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "perform failover", NULL);
+	bool performed =
+		monitor_perform_failover(&monitor, config.formation, config.groupId);
+	trace_span_end(&span, performed);
+
+	if (!performed)
 	{
 		log_fatal("Failed to perform failover/switchover, "
 				  "see above for details");
@@ -292,13 +364,21 @@ cli_perform_failover(int argc, char **argv)
 	}
 
 	/* process state changes notification until we have a new primary */
-	if (!monitor_wait_until_some_node_reported_state(
-			&monitor,
-			config.formation,
-			config.groupId,
-			config.pgSetup.pgKind,
-			PRIMARY_STATE,
-			config.listen_notifications_timeout))
+	trace_span_start(&span, "wait until a new primary is reported", NULL);
+	bool reported = monitor_wait_until_some_node_reported_state(
+		&monitor,
+		config.formation,
+		config.groupId,
+		NULL,
+		config.pgSetup.pgKind,
+		PRIMARY_STATE,
+		config.listen_notifications_timeout);
+	trace_span_end(&span, reported);
+
+	/* pg_autoctl perform failover --timing */
+	(void) trace_timing_report();
+
+	if (!reported)
 	{
 		log_error("Failed to wait until a new primary has been notified");
 		exit(EXIT_CODE_INTERNAL_ERROR);
@@ -323,6 +403,7 @@ cli_perform_promotion_getopts(int argc, char **argv)
 		{ "formation", required_argument, NULL, 'f' },
 		{ "name", required_argument, NULL, 'a' },
 		{ "wait", required_argument, NULL, 'w' },
+		{ "timing", no_argument, NULL, 'Y' },
 		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -406,6 +487,14 @@ cli_perform_promotion_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'Y':
+			{
+				/* { "timing", no_argument, NULL, 'Y' }, */
+				(void) trace_timing_enable();
+				log_trace("--timing");
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -551,19 +640,795 @@ cli_perform_promotion(int argc, char **argv)
 	 * triggered, and false when none was necessary. When an error occurs, it
 	 * reports an error condition, which is logged about already.
 	 */
-	if (monitor_perform_promotion(monitor, config->formation, config->name))
-	{
-		/* process state changes notification until we have a new primary */
-		if (!monitor_wait_until_some_node_reported_state(
-				monitor,
-				config->formation,
-				groupId,
-				nodeKind,
-				PRIMARY_STATE,
-				config->listen_notifications_timeout))
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "perform promotion", NULL);
+	bool promoting =
+		monitor_perform_promotion(monitor, config->formation, config->name);
+	trace_span_end(&span, promoting);
+
+	if (promoting)
+	{
+		/*
+		 * Process state changes notification until our node is the primary.
+		 * The current primary goes through apply_settings and primary again
+		 * while our node catches up, so any primary node won't do.
+		 */
+		trace_span_start(&span, "wait until the node is reported primary",
+						 NULL);
+		bool reported = monitor_wait_until_some_node_reported_state(
+			monitor,
+			config->formation,
+			groupId,
+			config->name,
+			nodeKind,
+			PRIMARY_STATE,
+			config->listen_notifications_timeout);
+		trace_span_end(&span, reported);
+
+		if (!reported)
 		{
+			(void) trace_timing_report();
+
 			log_error("Failed to wait until a new primary has been notified");
 			exit(EXIT_CODE_INTERNAL_ERROR);
 		}
 	}
+
+	/* pg_autoctl perform promotion --timing */
+	(void) trace_timing_report();
+}
+
+
+/*
+ * cli_perform_rolling_maintenance_getopts parses the command line options for
+ * the command `pg_autoctl perform rolling-maintenance`.
+ */
+static int
+cli_perform_rolling_maintenance_getopts(int argc, char **argv)
+{
+	KeeperConfig options = { 0 };
+	RollingMaintenanceOptions rollingOptions = { 0 };
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "group", required_argument, NULL, 'g' },
+		{ "concurrency", required_argument, NULL, 'j' },
+		{ "hook", required_argument, NULL, 'x' },
+		{ "wait", required_argument, NULL, 'w' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	/* set default values for our options, when we have some */
+	options.groupId = -1;
+	options.network_partition_timeout = -1;
+	options.prepare_promotion_catchup = -1;
+	options.prepare_promotion_walreceiver = -1;
+	options.postgresql_restart_failure_timeout = -1;
+	options.postgresql_restart_failure_max_retries = -1;
+	options.listen_notifications_timeout =
+		PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT;
+
+	rollingOptions.concurrency = 1;
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "D:m:f:g:j:x:w:Vvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgSetup.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgSetup.pgdata);
+				break;
+			}
+
+			case 'm':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --monitor connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.monitor_pguri, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitor_pguri);
+				break;
+			}
+
+			case 'f':
+			{
+				strlcpy(options.formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formation);
+				break;
+			}
+
+			case 'g':
+			{
+				if (!stringToInt(optarg, &options.groupId))
+				{
+					log_fatal("--group argument is not a valid group ID: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--group %d", options.groupId);
+				break;
+			}
+
+			case 'j':
+			{
+				/* { "concurrency", required_argument, NULL, 'j' }, */
+				if (!stringToInt(optarg, &rollingOptions.concurrency) ||
+					rollingOptions.concurrency < 1)
+				{
+					log_fatal("--concurrency argument is not a valid "
+							  "number of nodes: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--concurrency %d", rollingOptions.concurrency);
+				break;
+			}
+
+			case 'x':
+			{
+				/* { "hook", required_argument, NULL, 'x' }, */
+				strlcpy(rollingOptions.hook, optarg, BUFSIZE);
+				log_trace("--hook %s", rollingOptions.hook);
+				break;
+			}
+
+			case 'w':
+			{
+				if (!stringToInt(optarg, &options.listen_notifications_timeout))
+				{
+					log_fatal("--wait argument is not a valid timeout: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--wait %d", options.listen_notifications_timeout);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				keeper_cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+			}
+		}
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* when we have a monitor URI we don't need PGDATA */
+	if (cli_use_monitor_option(&options))
+	{
+		if (!IS_EMPTY_STRING_BUFFER(options.pgSetup.pgdata))
+		{
+			log_warn("Given --monitor URI, the --pgdata option is ignored");
+			log_info("Connecting to monitor at \"%s\"", options.monitor_pguri);
+		}
+
+		/* the rest of the program needs pgdata actually empty */
+		bzero((void *) options.pgSetup.pgdata, sizeof(options.pgSetup.pgdata));
+	}
+	else
+	{
+		cli_common_get_set_pgdata_or_exit(&(options.pgSetup));
+
+		if (!keeper_config_set_pathnames_from_pgdata(&(options.pathnames),
+													 options.pgSetup.pgdata))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+
+	/* ensure --formation, or get it from the configuration file */
+	if (!cli_common_ensure_formation(&options))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	keeperOptions = options;
+	rollingMaintenanceOptions = rollingOptions;
+
+	return optind;
+}
+
+
+/*
+ * cli_perform_rolling_maintenance puts every node of a group to maintenance,
+ * using the monitor start_maintenance() and stop_maintenance() functions, in
+ * an order that implements a single switchover:
+ *
+ *  1. the standby nodes go to maintenance by batches of --concurrency nodes,
+ *     where a batch never takes more nodes away from the replication quorum
+ *     than number_sync_standbys allows,
+ *
+ *  2. then we perform a switchover, so that the old primary is now a
+ *     standby node,
+ *
+ *  3. and finally the old primary goes to maintenance too.
+ *
+ * While a node is in maintenance the keeper leaves Postgres alone, and the
+ * --hook command, when given, runs for each node of the batch in parallel.
+ * Leaving maintenance then restarts Postgres on the node.
+ */
+static void
+cli_perform_rolling_maintenance(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+
+	CurrentNodeStateArray nodesArray = { 0 };
+	CurrentNodeState *primary = NULL;
+	CurrentNodeState **standbys = NULL;
+
+	int standbyCount = 0;
+	int quorumCount = 0;
+	int candidateCount = 0;
+	int numberSyncStandbys = 0;
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+
+	(void) cli_set_groupId(&monitor, &config);
+
+	if (!monitor_get_current_state(&monitor,
+								   config.formation,
+								   config.groupId,
+								   &nodesArray))
+	{
+		log_fatal("Failed to get the current state of the nodes in "
+				  "formation \"%s\" group %d, see above for details",
+				  config.formation,
+				  config.groupId);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (!monitor_get_formation_number_sync_standbys(&monitor,
+													config.formation,
+													&numberSyncStandbys))
+	{
+		/* errors have already been logged */
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	standbys = (CurrentNodeState **) calloc(nodesArray.count,
+											sizeof(CurrentNodeState *));
+
+	if (standbys == NULL && nodesArray.count > 0)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* we only begin a rollout with a stable group: a primary and secondaries */
+	for (int i = 0; i < nodesArray.count; i++)
+	{
+		CurrentNodeState *nodeState = &(nodesArray.nodes[i]);
+
+		if (nodeState->reportedState == PRIMARY_STATE &&
+			nodeState->goalState == PRIMARY_STATE)
+		{
+			primary = nodeState;
+		}
+		else if (nodeState->reportedState == SECONDARY_STATE &&
+				 nodeState->goalState == SECONDARY_STATE)
+		{
+			standbys[standbyCount++] = nodeState;
+
+			if (nodeState->replicationQuorum)
+			{
+				++quorumCount;
+			}
+
+			if (nodeState->candidatePriority > 0)
+			{
+				++candidateCount;
+			}
+		}
+		else
+		{
+			log_fatal("Node %" PRId64 " \"%s\" (%s:%d) is in state \"%s\" "
+					  "with goal state \"%s\", rolling maintenance requires "
+					  "nodes in the primary or secondary state",
+					  nodeState->node.nodeId,
+					  nodeState->node.name,
+					  nodeState->node.host,
+					  nodeState->node.port,
+					  NodeStateToString(nodeState->reportedState),
+					  NodeStateToString(nodeState->goalState));
+			free(standbys);
+			currentNodeStateArrayFree(&nodesArray);
+			exit(EXIT_CODE_BAD_STATE);
+		}
+	}
+
+	if (primary == NULL || standbyCount == 0 || candidateCount == 0)
+	{
+		log_fatal("Formation \"%s\" group %d has %s primary node and %d "
+				  "standby nodes of which %d are failover candidates, "
+				  "rolling maintenance requires a primary node and at least "
+				  "one failover candidate",
+				  config.formation,
+				  config.groupId,
+				  primary == NULL ? "no" : "a",
+				  standbyCount,
+				  candidateCount);
+		free(standbys);
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_BAD_STATE);
+	}
+
+	/*
+	 * Writes on the primary are blocked when fewer than number_sync_standbys
+	 * quorum nodes are in the secondary state, so that's how many quorum
+	 * nodes we may put to maintenance at the same time. Standby nodes that
+	 * do not participate in the quorum are not limited that way.
+	 */
+	int quorumMaxInBatch = quorumCount - numberSyncStandbys;
+
+	if (quorumMaxInBatch < 1)
+	{
+		log_warn("Formation \"%s\" has number_sync_standbys %d and group %d "
+				 "has %d standby nodes participating in the replication "
+				 "quorum: writes are blocked on the primary while any of "
+				 "them is in maintenance",
+				 config.formation,
+				 numberSyncStandbys,
+				 config.groupId,
+				 quorumCount);
+
+		quorumMaxInBatch = 1;
+	}
+
+	log_info("Rolling maintenance of %d standby nodes then the primary "
+			 "node %" PRId64 " \"%s\" in formation \"%s\" group %d, "
+			 "with up to %d node(s) in maintenance at a time",
+			 standbyCount,
+			 primary->node.nodeId,
+			 primary->node.name,
+			 config.formation,
+			 config.groupId,
+			 rollingMaintenanceOptions.concurrency);
+
+	/* first, the standby nodes, by batches */
+	for (int next = 0; next < standbyCount;)
+	{
+		/* a batch is a slice of the standbys array */
+		CurrentNodeState **batch = &(standbys[next]);
+		int batchCount = 0;
+		int quorumInBatch = 0;
+
+		while (next < standbyCount &&
+			   batchCount < rollingMaintenanceOptions.concurrency)
+		{
+			CurrentNodeState *nodeState = standbys[next];
+
+			if (nodeState->replicationQuorum)
+			{
+				if (quorumInBatch >= quorumMaxInBatch)
+				{
+					break;
+				}
+				++quorumInBatch;
+			}
+
+			++batchCount;
+			++next;
+		}
+
+		if (!rolling_maintenance_batch(&monitor, &config, batch, batchCount))
+		{
+			/* errors have already been logged */
+			free(standbys);
+			currentNodeStateArrayFree(&nodesArray);
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+
+	/* now exactly one switchover, and the old primary is a standby node */
+	log_info("Performing a switchover away from node %" PRId64 " \"%s\"",
+			 primary->node.nodeId,
+			 primary->node.name);
+
+	if (!monitor_perform_failover(&monitor, config.formation, config.groupId))
+	{
+		log_fatal("Failed to perform a switchover, see above for details");
+		free(standbys);
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (!rolling_maintenance_wait(&monitor, &config, &primary, 1,
+								  SECONDARY_STATE))
+	{
+		log_fatal("Failed to wait until the old primary node %" PRId64
+				  " \"%s\" is a secondary node, see above for details",
+				  primary->node.nodeId,
+				  primary->node.name);
+		free(standbys);
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	/* and finally the old primary */
+	if (!rolling_maintenance_batch(&monitor, &config, &primary, 1))
+	{
+		/* errors have already been logged */
+		free(standbys);
+		currentNodeStateArrayFree(&nodesArray);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	log_info("Rolling maintenance of formation \"%s\" group %d is done",
+			 config.formation,
+			 config.groupId);
+
+	free(standbys);
+	currentNodeStateArrayFree(&nodesArray);
+}
+
+
+/*
+ * rolling_maintenance_batch puts the given nodes to maintenance, runs the
+ * --hook command for each of them in parallel, and then disables maintenance
+ * on all the nodes we could enable it for, even when the hook failed.
+ */
+static bool
+rolling_maintenance_batch(Monitor *monitor,
+						  KeeperConfig *config,
+						  CurrentNodeState **batch,
+						  int count)
+{
+	bool success = true;
+	int started = 0;
+
+	pid_t *pids = (pid_t *) calloc(count, sizeof(pid_t));
+
+	if (pids == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (; started < count; started++)
+	{
+		if (!rolling_maintenance_set(monitor, batch[started], true))
+		{
+			success = false;
+			break;
+		}
+	}
+
+	if (success &&
+		!rolling_maintenance_wait(monitor, config, batch, started,
+								  MAINTENANCE_STATE))
+	{
+		log_error("Failed to wait until the nodes reached the "
+				  "maintenance state");
+		success = false;
+	}
+
+	if (success && !IS_EMPTY_STRING_BUFFER(rollingMaintenanceOptions.hook))
+	{
+		for (int i = 0; i < started; i++)
+		{
+			pids[i] = rolling_maintenance_start_hook(
+				batch[i],
+				rollingMaintenanceOptions.hook);
+
+			if (pids[i] < 0)
+			{
+				success = false;
+			}
+		}
+
+		for (int i = 0; i < started; i++)
+		{
+			int status = 0;
+
+			if (pids[i] <= 0)
+			{
+				continue;
+			}
+
+			if (waitpid(pids[i], &status, 0) < 0 ||
+				!WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0)
+			{
+				log_error("Maintenance hook failed for node %" PRId64
+						  " \"%s\", see above for details",
+						  batch[i]->node.nodeId,
+						  batch[i]->node.name);
+				success = false;
+			}
+		}
+	}
+
+	/* always leave maintenance on the nodes where we've enabled it */
+	for (int i = 0; i < started; i++)
+	{
+		if (!rolling_maintenance_set(monitor, batch[i], false))
+		{
+			success = false;
+		}
+	}
+
+	if (!rolling_maintenance_wait(monitor, config, batch, started,
+								  SECONDARY_STATE))
+	{
+		log_error("Failed to wait until the nodes reached the "
+				  "secondary state");
+		success = false;
+	}
+
+	free(pids);
+
+	return success;
+}
+
+
+/*
+ * rolling_maintenance_set calls start_maintenance() or stop_maintenance() on
+ * the monitor for the given node, with a retry policy for transient errors.
+ */
+static bool
+rolling_maintenance_set(Monitor *monitor,
+						CurrentNodeState *nodeState,
+						bool enable)
+{
+	ConnectionRetryPolicy retryPolicy = { 0 };
+	int64_t nodeId = nodeState->node.nodeId;
+	const char *verb = enable ? "enable" : "disable";
+
+	log_info("%s maintenance of node %" PRId64 " \"%s\" (%s:%d)",
+			 enable ? "Enabling" : "Disabling",
+			 nodeId,
+			 nodeState->node.name,
+			 nodeState->node.host,
+			 nodeState->node.port);
+
+	(void) pgsql_set_monitor_interactive_retry_policy(&retryPolicy);
+
+	while (!pgsql_retry_policy_expired(&retryPolicy))
+	{
+		bool mayRetry = false;
+
+		bool success = enable
+					   ? monitor_start_maintenance(monitor, nodeId, &mayRetry)
+					   : monitor_stop_maintenance(monitor, nodeId, &mayRetry);
+
+		if (success)
+		{
+			return true;
+		}
+
+		if (!mayRetry)
+		{
+			break;
+		}
+
+		int sleepTimeMs = pgsql_compute_connection_retry_sleep_time(&retryPolicy);
+
+		log_warn("Failed to %s maintenance of node %" PRId64
+				 " on the monitor, retrying in %d ms.",
+				 verb, nodeId, sleepTimeMs);
+
+		/* we have milliseconds, pg_usleep() wants microseconds */
+		(void) pg_usleep(sleepTimeMs * 1000);
+	}
+
+	log_error("Failed to %s maintenance of node %" PRId64
+			  " on the monitor, see above for details",
+			  verb, nodeId);
+
+	return false;
+}
+
+
+/*
+ * rolling_maintenance_wait polls the monitor until all the given nodes have
+ * reported the target state, or until --wait seconds have passed, where zero
+ * means waiting forever. Several
+ * nodes reach the target state at about the same time, so instead of
+ * processing notifications one node at a time we poll the current state of
+ * the group every second.
+ */
+static bool
+rolling_maintenance_wait(Monitor *monitor,
+						 KeeperConfig *config,
+						 CurrentNodeState **batch,
+						 int count,
+						 NodeState targetState)
+{
+	uint64_t start = time(NULL);
+	int timeout = config->listen_notifications_timeout;
+
+	while (timeout == 0 || (time(NULL) - start) < (uint64_t) timeout)
+	{
+		CurrentNodeStateArray nodesArray = { 0 };
+		int doneCount = 0;
+
+		if (!monitor_get_current_state(monitor,
+									   config->formation,
+									   config->groupId,
+									   &nodesArray))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		for (int b = 0; b < count; b++)
+		{
+			for (int i = 0; i < nodesArray.count; i++)
+			{
+				CurrentNodeState *nodeState = &(nodesArray.nodes[i]);
+
+				if (nodeState->node.nodeId == batch[b]->node.nodeId &&
+					nodeState->reportedState == targetState &&
+					nodeState->goalState == targetState)
+				{
+					++doneCount;
+					break;
+				}
+			}
+		}
+
+		currentNodeStateArrayFree(&nodesArray);
+
+		if (doneCount == count)
+		{
+			return true;
+		}
+
+		pg_usleep(1000 * 1000); /* 1s */
+	}
+
+	log_error("Failed to see %d node(s) reach state \"%s\" "
+			  "within %d seconds",
+			  count,
+			  NodeStateToString(targetState),
+			  timeout);
+
+	return false;
+}
+
+
+/*
+ * rolling_maintenance_start_hook runs the --hook command with /bin/sh in a
+ * sub-process, with the environment variables PG_AUTOCTL_NODE_* set to the
+ * node in maintenance, and returns the pid of the sub-process.
+ */
+static pid_t
+rolling_maintenance_start_hook(CurrentNodeState *nodeState, const char *hook)
+{
+	NodeAddress *node = &(nodeState->node);
+
+	log_info("Running maintenance hook for node %" PRId64 " \"%s\": %s",
+			 node->nodeId,
+			 node->name,
+			 hook);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a process for the maintenance hook "
+					  "of node %" PRId64 ": %m",
+					  node->nodeId);
+			return -1;
+		}
+
+		case 0:
+		{
+			setenv("PG_AUTOCTL_NODE_ID", intToString(node->nodeId).strValue, 1);
+			setenv("PG_AUTOCTL_NODE_NAME", node->name, 1);
+			setenv("PG_AUTOCTL_NODE_HOST", node->host, 1);
+			setenv("PG_AUTOCTL_NODE_PORT", intToString(node->port).strValue, 1);
+
+			Program program = run_program("/bin/sh", "-c", hook, NULL);
+
+			if (program.returnCode != 0)
+			{
+				log_error("Maintenance hook for node %" PRId64 " \"%s\" "
+						  "failed with return code %d",
+						  node->nodeId,
+						  node->name,
+						  program.returnCode);
+
+				if (program.stdErr != NULL)
+				{
+					log_error("%s", program.stdErr);
+				}
+
+				free_program(&program);
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			if (program.stdOut != NULL)
+			{
+				log_info("%s", program.stdOut);
+			}
+
+			free_program(&program);
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			return fpid;
+		}
+	}
 }
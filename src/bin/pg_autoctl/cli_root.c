@@ -37,6 +37,7 @@ CommandLine create_commands =
 CommandLine *show_subcommands_with_debug[] = {
 	&show_uri_command,
 	&show_events_command,
+	&show_failover_timeline_command,
 	&show_state_command,
 	&show_settings_command,
 	&show_standby_names_command,
@@ -53,6 +54,7 @@ CommandLine show_commands_with_debug =
 CommandLine *show_subcommands[] = {
 	&show_uri_command,
 	&show_events_command,
+	&show_failover_timeline_command,
 	&show_state_command,
 	&show_settings_command,
 	&show_standby_names_command,
@@ -26,9 +26,12 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "pidfile.h"
+#include "service_control.h"
+#include "service_instances.h"
 #include "service_keeper.h"
 #include "service_monitor.h"
 #include "signals.h"
+#include "system_utils.h"
 
 static int stop_signal = SIGTERM;
 
@@ -41,12 +44,14 @@ static int cli_getopt_pgdata_and_mode(int argc, char **argv);
 static void cli_service_stop(int argc, char **argv);
 static void cli_service_reload(int argc, char **argv);
 static void cli_service_status(int argc, char **argv);
+static bool cli_service_status_from_control(ConfigFilePaths *pathnames);
+static void cli_service_status_log_memory(JSON_Object *jsPGAutoCtl);
 
 CommandLine service_run_command =
 	make_command("run",
 				 "Run the pg_autoctl service (monitor or keeper)",
 				 " [ --pgdata --nodename --hostname --pgport ] ",
-				 "  --pgdata      path to data directory\n"
+				 "  --pgdata      path to data directory, repeat to run several nodes\n"
 				 "  --nodename    pg_auto_failover node name\n"
 				 "  --hostname    hostname used to connect from other nodes\n"
 				 "  --pgport      PostgreSQL's port number\n",
@@ -90,6 +95,17 @@ cli_service_run(int argc, char **argv)
 {
 	KeeperConfig config = keeperOptions;
 
+	/* with several --pgdata options, supervise a pg_autoctl run for each */
+	if (runInstancesCount > 1)
+	{
+		if (!start_instances(runInstancesPgdata, runInstancesCount))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+		return;
+	}
+
 	if (!keeper_config_set_pathnames_from_pgdata(&config.pathnames,
 												 config.pgSetup.pgdata))
 	{
@@ -478,6 +494,13 @@ cli_service_status(int argc, char **argv)
 
 	keeper.config = keeperOptions;
 
+	/* when pg_autoctl is running, it already knows the answer */
+	if (keeper_config_set_pathnames_from_pgdata(pathnames, pgSetup->pgdata) &&
+		cli_service_status_from_control(pathnames))
+	{
+		return;
+	}
+
 	if (!cli_common_pgsetup_init(pathnames, pgSetup))
 	{
 		/* errors have already been logged */
@@ -528,28 +551,157 @@ cli_service_status(int argc, char **argv)
 		exit(EXIT_CODE_PGCTL);
 	}
 
+	JSON_Value *js = json_value_init_object();
+	JSON_Value *jsPGAutoCtl = json_value_init_object();
+	JSON_Value *jsPostgres = json_value_init_object();
+
+	JSON_Object *root = json_value_get_object(js);
+
+	bool includeStatus = true;
+
+	pidfile_as_json(jsPGAutoCtl, pathnames->pid, includeStatus);
+
+	if (!pg_setup_as_json(pgSetup, jsPostgres))
+	{
+		/* can't happen */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* concatenate JSON objects into a container object */
+	json_object_set_value(root, "postgres", jsPostgres);
+	json_object_set_value(root, "pg_autoctl", jsPGAutoCtl);
+
+	(void) cli_service_status_log_memory(json_value_get_object(jsPGAutoCtl));
+
+	if (outputJSON)
+	{
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		json_value_free(js);
+	}
+}
+
+
+/*
+ * cli_service_status_from_control implements pg_autoctl status from the
+ * answer of the running keeper control service, which spares us from probing
+ * the Postgres installation. It returns false when the control service could
+ * not answer.
+ */
+static bool
+cli_service_status_from_control(ConfigFilePaths *pathnames)
+{
+	JSON_Value *answer = NULL;
+
+	if (!keeper_control_request(pathnames, CONTROL_REQUEST_STATUS, &answer))
+	{
+		return false;
+	}
+
+	JSON_Object *jsAnswer = json_value_get_object(answer);
+	JSON_Object *jsPGAutoCtl = json_object_get_object(jsAnswer, "pg_autoctl");
+	JSON_Object *jsPostgres = json_object_get_object(jsAnswer, "postgres");
+
+	if (jsPGAutoCtl == NULL || jsPostgres == NULL)
+	{
+		log_debug("Failed to parse the control service answer");
+		json_value_free(answer);
+		return false;
+	}
+
+	const char *pgdata = json_object_get_string(jsPostgres, "pgdata");
+	const char *pmStatus =
+		json_object_dotget_string(jsPostgres, "postmaster.status");
+
+	log_info("pg_autoctl is running with pid %d",
+			 (int) json_object_get_number(jsPGAutoCtl, "pid"));
+
+	if (pmStatus == NULL || strcmp(pmStatus, "ready") != 0)
+	{
+		json_value_free(answer);
+		exit(EXIT_CODE_PGCTL);
+	}
+
+	log_info("Postgres is serving PGDATA \"%s\" on port %d with pid %d",
+			 pgdata == NULL ? "" : pgdata,
+			 (int) json_object_get_number(jsPostgres, "port"),
+			 (int) json_object_get_number(jsPostgres, "pid"));
+
+	(void) cli_service_status_log_memory(jsPGAutoCtl);
+
 	if (outputJSON)
 	{
-		JSON_Value *js = json_value_init_object();
-		JSON_Value *jsPGAutoCtl = json_value_init_object();
-		JSON_Value *jsPostgres = json_value_init_object();
+		(void) cli_pprint_json(answer);
+	}
+	else
+	{
+		json_value_free(answer);
+	}
 
-		JSON_Object *root = json_value_get_object(js);
+	return true;
+}
+
+
+/*
+ * cli_service_status_log_memory logs the memory used by the pg_autoctl
+ * supervisor and by each of its services, as found in the "memory" entries
+ * that pidfile_as_json adds. The private memory is what each process costs
+ * on its own, the resident memory also counts the shared libraries pages that
+ * all the processes share.
+ */
+static void
+cli_service_status_log_memory(JSON_Object *jsPGAutoCtl)
+{
+	JSON_Array *jsServices = json_object_get_array(jsPGAutoCtl, "services");
+	int count = jsServices == NULL ? 0 : json_array_get_count(jsServices);
+
+	/* index -1 is the supervisor itself, then the services */
+	for (int index = -1; index < count; index++)
+	{
+		JSON_Object *jsProcess =
+			index < 0
+			? jsPGAutoCtl
+			: json_array_get_object(jsServices, index);
 
-		bool includeStatus = true;
+		const char *name =
+			index < 0 ? "pg_autoctl" : json_object_get_string(jsProcess, "name");
 
-		pidfile_as_json(jsPGAutoCtl, pathnames->pid, includeStatus);
+		JSON_Object *jsMemory = json_object_get_object(jsProcess, "memory");
 
-		if (!pg_setup_as_json(pgSetup, jsPostgres))
+		if (jsMemory == NULL || name == NULL)
 		{
-			/* can't happen */
-			exit(EXIT_CODE_INTERNAL_ERROR);
+			continue;
 		}
 
-		/* concatenate JSON objects into a container object */
-		json_object_set_value(root, "postgres", jsPostgres);
-		json_object_set_value(root, "pg_autoctl", jsPGAutoCtl);
+		char rss[BUFSIZE] = { 0 };
+		char pss[BUFSIZE] = { 0 };
+		char private[BUFSIZE] = { 0 };
 
-		(void) cli_pprint_json(js);
+		pretty_print_bytes(rss, sizeof(rss),
+						   (uint64_t) json_object_get_number(jsMemory, "rss"));
+
+		if (json_object_has_value(jsMemory, "pss"))
+		{
+			pretty_print_bytes(pss, sizeof(pss),
+							   (uint64_t) json_object_get_number(jsMemory, "pss"));
+			pretty_print_bytes(private, sizeof(private),
+							   (uint64_t) json_object_get_number(jsMemory,
+																 "private"));
+
+			log_info("Service %s with pid %d uses %s of memory "
+					 "(rss %s, pss %s)",
+					 name,
+					 (int) json_object_get_number(jsProcess, "pid"),
+					 private, rss, pss);
+		}
+		else
+		{
+			log_info("Service %s with pid %d uses %s of memory (rss)",
+					 name,
+					 (int) json_object_get_number(jsProcess, "pid"),
+					 rss);
+		}
 	}
 }
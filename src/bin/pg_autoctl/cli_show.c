@@ -30,6 +30,7 @@
 #include "pgsetup.h"
 #include "pgsql.h"
 #include "pidfile.h"
+#include "service_control.h"
 #include "state.h"
 #include "string_utils.h"
 #include "watch.h"
@@ -37,11 +38,17 @@
 static int eventCount = 10;
 static bool localState = false;
 static bool watch = false;
+static bool allShards = false;
+static bool showFleet = false;
+static int64_t eventsSince = -1;
+static bool followEvents = false;
 
 static int cli_show_state_getopts(int argc, char **argv);
 static void cli_show_state(int argc, char **argv);
 static void cli_show_local_state(void);
+static bool cli_show_local_state_from_control(void);
 static void cli_show_events(int argc, char **argv);
+static void cli_show_failover_timeline(int argc, char **argv);
 
 static int cli_show_standby_names_getopts(int argc, char **argv);
 static void cli_show_standby_names(int argc, char **argv);
@@ -59,6 +66,9 @@ static void print_formation_uri(SSLOptions *ssl,
 								const char *formation,
 								const char *citusClusterName,
 								FILE *stream);
+static void print_formation_read_uri(SSLOptions *ssl,
+									 Monitor *monitor,
+									 FILE *stream);
 static void print_all_uri(SSLOptions *ssl,
 						  Monitor *monitor,
 						  FILE *stream);
@@ -67,35 +77,57 @@ static void print_all_uri(SSLOptions *ssl,
 CommandLine show_uri_command =
 	make_command("uri",
 				 "Show the postgres uri to use to connect to pg_auto_failover nodes",
-				 " [ --pgdata --formation --json ] ",
-				 "  --pgdata      path to data directory\n"
-				 "  --formation   show the coordinator uri of given formation\n"
-				 "  --json        output data in the JSON format\n",
+				 " [ --pgdata --formation --read --all --json ] ",
+				 "  --pgdata       path to data directory\n"
+				 "  --formation    show the coordinator uri of given formation\n"
+				 "  --all          show the uri of every formation of all monitor shards\n"
+				 "  --read         show a uri for read-only queries on standbys\n"
+				 "  --max-lag      skip standbys more than this many bytes behind\n"
+				 "  --zone         list the standbys of this zone first\n"
+				 "  --load-balance spread connections randomly (libpq 16)\n"
+				 "  --follow       print the uri again each time it changes\n"
+				 "  --json         output data in the JSON format\n",
 				 cli_show_uri_getopts,
 				 cli_show_uri);
 
 CommandLine show_events_command =
 	make_command("events",
 				 "Prints monitor's state of nodes in a given formation and group",
-				 " [ --pgdata --formation --group --count ] ",
+				 " [ --pgdata --formation --group --count --since --follow ] ",
 				 "  --pgdata      path to data directory	 \n"
 				 "  --monitor     pg_auto_failover Monitor Postgres URL\n" \
 				 "  --formation   formation to query, defaults to 'default' \n"
 				 "  --group       group to query formation, defaults to all \n"
 				 "  --count       how many events to fetch, defaults to 10 \n"
+				 "  --since       print all the events after the given event id\n"
+				 "  --follow      print new events as they happen\n"
 				 "  --watch       display an auto-updating dashboard\n"
 				 "  --json        output data in the JSON format\n",
 				 cli_show_state_getopts,
 				 cli_show_events);
 
+CommandLine show_failover_timeline_command =
+	make_command("failover-timeline",
+				 "Prints the phases and durations of the last failover of a group",
+				 " [ --pgdata --formation --group ] ",
+				 "  --pgdata      path to data directory	 \n"
+				 "  --monitor     pg_auto_failover Monitor Postgres URL\n"
+				 "  --formation   formation to query, defaults to 'default' \n"
+				 "  --group       group to query formation, defaults to 0 \n"
+				 "  --json        output data in the JSON format\n",
+				 cli_show_state_getopts,
+				 cli_show_failover_timeline);
+
 CommandLine show_state_command =
 	make_command("state",
 				 "Prints monitor's state of nodes in a given formation and group",
-				 " [ --pgdata --formation --group ] ",
+				 " [ --pgdata --formation --group --all --fleet ] ",
 				 "  --pgdata      path to data directory	 \n"
 				 "  --monitor     pg_auto_failover Monitor Postgres URL\n"
 				 "  --formation   formation to query, defaults to 'default' \n"
 				 "  --group       group to query formation, defaults to all \n"
+				 "  --all         show all formations of all the monitor shards\n"
+				 "  --fleet       show one line per group of all formations\n"
 				 "  --local       show local data, do not connect to the monitor\n"
 				 "  --watch       display an auto-updating dashboard\n"
 				 "  --json        output data in the JSON format\n",
@@ -160,8 +192,17 @@ static ShowFileOptions showFileOptions;
 typedef struct ShowUriOptions
 {
 	bool monitorOnly;
+	bool allShards;
 	char formation[NAMEDATALEN];
 	char citusClusterName[NAMEDATALEN];
+
+	/* pg_autoctl show uri --read */
+	bool readOnly;
+	bool maxLagOption;
+	int64_t maxLagBytes;
+	char zone[NAMEDATALEN];
+	bool loadBalance;
+	bool follow;
 } ShowUriOptions;
 
 static ShowUriOptions showUriOptions = { 0 };
@@ -186,6 +227,10 @@ cli_show_state_getopts(int argc, char **argv)
 		{ "count", required_argument, NULL, 'n' },
 		{ "local", no_argument, NULL, 'L' },
 		{ "watch", no_argument, NULL, 'W' },
+		{ "all", no_argument, NULL, 'a' },
+		{ "fleet", no_argument, NULL, 'O' },
+		{ "since", required_argument, NULL, 'S' },
+		{ "follow", no_argument, NULL, 'F' },
 		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -320,6 +365,39 @@ cli_show_state_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'a':
+			{
+				allShards = true;
+				log_trace("--all");
+				break;
+			}
+
+			case 'O':
+			{
+				showFleet = true;
+				log_trace("--fleet");
+				break;
+			}
+
+			case 'S':
+			{
+				if (!stringToInt64(optarg, &eventsSince) || eventsSince < 0)
+				{
+					log_fatal("--since argument is not a valid event id: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--since %" PRId64, eventsSince);
+				break;
+			}
+
+			case 'F':
+			{
+				followEvents = true;
+				log_trace("--follow");
+				break;
+			}
+
 			case 'J':
 			{
 				outputJSON = true;
@@ -353,6 +431,25 @@ cli_show_state_getopts(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
+	if (watch && (followEvents || eventsSince >= 0))
+	{
+		log_error("Please use either --since and --follow, or --watch");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (allShards && (localState || watch || outputJSON))
+	{
+		log_error("The --all option can't be used with --local, --watch, "
+				  "or --json");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (showFleet && (localState || allShards))
+	{
+		log_error("The --fleet option can't be used with --local or --all");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
 	if (localState)
 	{
 		cli_common_get_set_pgdata_or_exit(&(options.pgSetup));
@@ -416,6 +513,7 @@ cli_show_events(int argc, char **argv)
 
 		strlcpy(context.formation, config.formation, sizeof(context.formation));
 		context.groupId = config.groupId;
+		context.fleet = showFleet;
 
 		(void) cli_watch_main_loop(&context);
 
@@ -424,6 +522,49 @@ cli_show_events(int argc, char **argv)
 
 	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
 
+	if (followEvents || eventsSince >= 0)
+	{
+		int64_t lastEventId = eventsSince;
+
+		/* --follow without --since begins with the last --count events */
+		if (lastEventId < 0 &&
+			!monitor_get_last_events_start(&monitor,
+										   config.formation,
+										   config.groupId,
+										   eventCount,
+										   &lastEventId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		if (!outputJSON)
+		{
+			(void) monitor_print_events_since_header();
+		}
+
+		if (!monitor_print_events_since(&monitor,
+										config.formation,
+										config.groupId,
+										&lastEventId,
+										outputJSON))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		if (followEvents)
+		{
+			(void) monitor_follow_events(&monitor,
+										 config.formation,
+										 config.groupId,
+										 lastEventId,
+										 outputJSON);
+		}
+
+		exit(EXIT_CODE_QUIT);
+	}
+
 	if (outputJSON)
 	{
 		if (!monitor_print_last_events_as_json(&monitor,
@@ -450,6 +591,45 @@ cli_show_events(int argc, char **argv)
 }
 
 
+/*
+ * cli_show_failover_timeline prints the events of the last failover of a
+ * group, with the failover phase of each event and the time spent in it.
+ */
+static void
+cli_show_failover_timeline(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+
+	/* a failover happens within a group, default to the first one */
+	int groupId = config.groupId == -1 ? 0 : config.groupId;
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+
+	if (outputJSON)
+	{
+		if (!monitor_print_failover_timeline_as_json(&monitor,
+													 config.formation,
+													 groupId,
+													 stdout))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+	else
+	{
+		if (!monitor_print_failover_timeline(&monitor,
+											 config.formation,
+											 groupId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+}
+
+
 /*
  * keeper_cli_monitor_print_state prints the current state of given formation
  * and port from the monitor's point of view.
@@ -508,8 +688,49 @@ cli_show_state(int argc, char **argv)
 		exit(EXIT_CODE_QUIT);
 	}
 
+	if (allShards)
+	{
+		/* with --all, the --monitor is the seed of the shards directory */
+		if (!IS_EMPTY_STRING_BUFFER(config.monitor_pguri))
+		{
+			if (!monitor_init(&monitor, config.monitor_pguri))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_BAD_ARGS);
+			}
+		}
+		else
+		{
+			(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+		}
+
+		if (!monitor_print_state_all_shards(&monitor))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		exit(EXIT_CODE_QUIT);
+	}
+
 	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
 
+	if (showFleet)
+	{
+		bool success =
+			outputJSON
+			? monitor_print_fleet_state_as_json(&monitor)
+			: monitor_print_fleet_state(&monitor);
+
+		if (!success)
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		exit(EXIT_CODE_QUIT);
+	}
+
 	if (outputJSON)
 	{
 		if (!monitor_print_state_as_json(&monitor,
@@ -526,6 +747,13 @@ cli_show_state(int argc, char **argv)
 			/* errors have already been logged */
 			exit(EXIT_CODE_MONITOR);
 		}
+
+		if (!monitor_print_node_progress(&monitor,
+										 config.formation, config.groupId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
 	}
 }
 
@@ -541,6 +769,12 @@ cli_show_local_state()
 	KeeperConfig config = keeperOptions;
 	int optionGroupId = keeperOptions.groupId;
 
+	/* when pg_autoctl is running, it already knows the answer */
+	if (cli_show_local_state_from_control())
+	{
+		return;
+	}
+
 	switch (ProbeConfigurationFileRole(config.pathnames.config))
 	{
 		case PG_AUTOCTL_ROLE_MONITOR:
@@ -601,19 +835,17 @@ cli_show_local_state()
 						&(keeper.postgres.postgresSetup.is_in_recovery),
 						keeper.postgres.pgsrSyncState,
 						keeper.postgres.currentLSN,
+						keeper.postgres.replayLSN,
 						&(keeper.postgres.postgresSetup.control)))
 				{
 					log_warn("Failed to update the local Postgres metadata");
-
-					strlcpy(nodeState.node.lsn, "0/0", PG_LSN_MAXLENGTH);
 				}
 
 				nodeState.node.tli =
 					keeper.postgres.postgresSetup.control.timeline_id;
 
-				strlcpy(nodeState.node.lsn,
-						keeper.postgres.currentLSN,
-						PG_LSN_MAXLENGTH);
+				/* an unknown LSN is shown as 0/0 */
+				(void) parseLSN(keeper.postgres.currentLSN, &(nodeState.node.lsn));
 			}
 			else
 			{
@@ -624,9 +856,8 @@ cli_show_local_state()
 				}
 
 				nodeState.node.tli = config.pgSetup.control.timeline_id;
-				strlcpy(nodeState.node.lsn,
-						config.pgSetup.control.latestCheckpointLSN,
-						PG_LSN_MAXLENGTH);
+				(void) parseLSN(config.pgSetup.control.latestCheckpointLSN,
+								&(nodeState.node.lsn));
 			}
 
 			/* we have no idea, only the monitor knows, so report "unknown" */
@@ -675,6 +906,74 @@ cli_show_local_state()
 }
 
 
+/*
+ * cli_show_local_state_from_control implements pg_autoctl show state --local
+ * from the answer of the running keeper control service, which spares us
+ * reading the configuration and connecting to Postgres. It returns false
+ * when the control service could not answer.
+ */
+static bool
+cli_show_local_state_from_control()
+{
+	int optionGroupId = keeperOptions.groupId;
+	JSON_Value *answer = NULL;
+	CurrentNodeState nodeState = { 0 };
+
+	if (!keeper_control_request(&(keeperOptions.pathnames),
+								CONTROL_REQUEST_STATE,
+								&answer))
+	{
+		return false;
+	}
+
+	JSON_Object *jsAnswer = json_value_get_object(answer);
+	JSON_Value *jsState = json_object_get_value(jsAnswer, "state");
+	const char *nodeKind = json_object_get_string(jsAnswer, "nodekind");
+
+	if (jsState == NULL || !nodestateFromJSON(jsState, &nodeState))
+	{
+		log_debug("Failed to parse the control service answer");
+		json_value_free(answer);
+		return false;
+	}
+
+	/* let the usual code path complain about --group */
+	if (optionGroupId != -1 && nodeState.groupId != optionGroupId)
+	{
+		json_value_free(answer);
+		return false;
+	}
+
+	if (outputJSON)
+	{
+		(void) cli_pprint_json(json_value_deep_copy(jsState));
+	}
+	else
+	{
+		NodeAddressHeaders headers = { 0 };
+
+		headers.nodeKind =
+			nodeKind != NULL ? nodeKindFromString(nodeKind) : NODE_KIND_UNKNOWN;
+
+		(void) nodestateAdjustHeaders(&headers,
+									  &(nodeState.node),
+									  nodeState.groupId);
+
+		(void) prepareHeaderSeparators(&headers);
+
+		(void) nodestatePrintHeader(&headers);
+
+		(void) nodestatePrintNodeState(&headers, &nodeState);
+
+		fformat(stdout, "\n");
+	}
+
+	json_value_free(answer);
+
+	return true;
+}
+
+
 /*
  * cli_show_nodes_getopts parses the command line options for the
  * command `pg_autoctl show nodes`.
@@ -924,6 +1223,12 @@ cli_show_uri_getopts(int argc, char **argv)
 		{ "monitor", required_argument, NULL, 'm' },
 		{ "formation", required_argument, NULL, 'f' },
 		{ "citus-cluster", required_argument, NULL, 'Z' },
+		{ "read", no_argument, NULL, 'r' },
+		{ "max-lag", required_argument, NULL, 'l' },
+		{ "zone", required_argument, NULL, 'z' },
+		{ "load-balance", no_argument, NULL, 'b' },
+		{ "follow", no_argument, NULL, 'F' },
+		{ "all", no_argument, NULL, 'a' },
 		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -940,6 +1245,8 @@ cli_show_uri_getopts(int argc, char **argv)
 	options.postgresql_restart_failure_timeout = -1;
 	options.postgresql_restart_failure_max_retries = -1;
 
+	showUriOptions.maxLagBytes = FORMATION_READ_URI_MAX_LAG;
+
 	optind = 0;
 
 	while ((c = getopt_long(argc, argv, "D:Vvqh",
@@ -987,6 +1294,56 @@ cli_show_uri_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'r':
+			{
+				showUriOptions.readOnly = true;
+				log_trace("--read");
+				break;
+			}
+
+			case 'l':
+			{
+				if (!stringToInt64(optarg, &(showUriOptions.maxLagBytes)) ||
+					showUriOptions.maxLagBytes < 0)
+				{
+					log_fatal("--max-lag argument is not a valid number "
+							  "of bytes: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				showUriOptions.maxLagOption = true;
+				log_trace("--max-lag %" PRId64, showUriOptions.maxLagBytes);
+				break;
+			}
+
+			case 'z':
+			{
+				strlcpy(showUriOptions.zone, optarg, NAMEDATALEN);
+				log_trace("--zone %s", showUriOptions.zone);
+				break;
+			}
+
+			case 'b':
+			{
+				showUriOptions.loadBalance = true;
+				log_trace("--load-balance");
+				break;
+			}
+
+			case 'F':
+			{
+				showUriOptions.follow = true;
+				log_trace("--follow");
+				break;
+			}
+
+			case 'a':
+			{
+				showUriOptions.allShards = true;
+				log_trace("--all");
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -1085,6 +1442,46 @@ cli_show_uri_getopts(int argc, char **argv)
 		strlcpy(showUriOptions.formation, FORMATION_DEFAULT, NAMEDATALEN);
 	}
 
+	if (!showUriOptions.readOnly &&
+		(showUriOptions.maxLagOption ||
+		 showUriOptions.loadBalance ||
+		 showUriOptions.follow ||
+		 !IS_EMPTY_STRING_BUFFER(showUriOptions.zone)))
+	{
+		log_error("The --max-lag, --zone, --load-balance and --follow "
+				  "options require --read");
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (showUriOptions.readOnly &&
+		(showUriOptions.monitorOnly ||
+		 !IS_EMPTY_STRING_BUFFER(showUriOptions.citusClusterName)))
+	{
+		log_error("The --read option can't be used with --formation monitor "
+				  "or --citus-cluster");
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (showUriOptions.allShards &&
+		(showUriOptions.readOnly ||
+		 !IS_EMPTY_STRING_BUFFER(showUriOptions.formation) ||
+		 !IS_EMPTY_STRING_BUFFER(showUriOptions.citusClusterName)))
+	{
+		log_error("The --all option can't be used with --read, --formation "
+				  "or --citus-cluster");
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* --read without --formation is for the default formation */
+	if (showUriOptions.readOnly &&
+		IS_EMPTY_STRING_BUFFER(showUriOptions.formation))
+	{
+		strlcpy(showUriOptions.formation, FORMATION_DEFAULT, NAMEDATALEN);
+	}
+
 	/* use "default" citus cluster name when user didn't provide it */
 	if (IS_EMPTY_STRING_BUFFER(showUriOptions.citusClusterName))
 	{
@@ -1163,6 +1560,14 @@ cli_show_uri_monitor_init_from_config(KeeperConfig *kconfig,
 				exit(EXIT_CODE_BAD_CONFIG);
 			}
 
+			if (!cli_monitor_setup_standbys(monitor,
+											kconfig->monitor_standbys_pguri,
+											kconfig->monitor_standby_max_lag))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_BAD_CONFIG);
+			}
+
 			*ssl = kconfig->pgSetup.ssl;
 			break;
 		}
@@ -1200,6 +1605,12 @@ cli_show_uri(int argc, char **argv)
 			exit(EXIT_CODE_BAD_ARGS);
 		}
 
+		if (!cli_monitor_setup_standbys(&monitor, "", MONITOR_STANDBY_MAX_LAG))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
 		if (!parse_pguri_ssl_settings(kconfig.monitor_pguri, &ssl))
 		{
 			/* errors have already been logged */
@@ -1212,7 +1623,29 @@ cli_show_uri(int argc, char **argv)
 		(void) cli_show_uri_monitor_init_from_config(&kconfig, &monitor, &ssl);
 	}
 
-	if (showUriOptions.monitorOnly)
+	if (showUriOptions.readOnly && showUriOptions.follow)
+	{
+		(void) monitor_follow_formation_read_uri(&monitor,
+												 showUriOptions.formation,
+												 showUriOptions.maxLagBytes,
+												 showUriOptions.zone,
+												 showUriOptions.loadBalance,
+												 &ssl,
+												 outputJSON);
+	}
+	else if (showUriOptions.allShards)
+	{
+		if (!monitor_print_uri_all_shards(&monitor, &ssl, outputJSON))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+	else if (showUriOptions.readOnly)
+	{
+		(void) print_formation_read_uri(&ssl, &monitor, stdout);
+	}
+	else if (showUriOptions.monitorOnly)
 	{
 		(void) print_monitor_uri(&monitor, stdout);
 	}
@@ -1302,6 +1735,49 @@ print_formation_uri(SSLOptions *ssl,
 }
 
 
+/*
+ * print_formation_read_uri connects to given monitor to fetch the read-only
+ * connection string of the formation, using the --max-lag, --zone and
+ * --load-balance options, and prints it out on given stream.
+ */
+static void
+print_formation_read_uri(SSLOptions *ssl, Monitor *monitor, FILE *stream)
+{
+	char postgresUri[MAXCONNINFO];
+
+	if (!monitor_formation_read_uri(monitor,
+									showUriOptions.formation,
+									showUriOptions.maxLagBytes,
+									showUriOptions.zone,
+									showUriOptions.loadBalance,
+									ssl,
+									postgresUri,
+									MAXCONNINFO))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		json_object_set_string(jsObj,
+							   "monitor",
+							   monitor->pgsql.connectionString);
+
+		json_object_set_string(jsObj, showUriOptions.formation, postgresUri);
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stream, "%s\n", postgresUri);
+	}
+}
+
+
 /*
  * print_all_uri prints the connection strings for the monitor and all
  * formations managed by it
@@ -40,17 +40,20 @@
 #include "string_utils.h"
 #include "watch.h"
 
+static bool watchFleet = false;
+
 static int cli_watch_getopts(int argc, char **argv);
 static void cli_watch(int argc, char **argv);
 
 CommandLine watch_command =
 	make_command("watch",
 				 "Display a dashboard to watch monitor's events and state",
-				 " [ --pgdata --formation --group ] ",
+				 " [ --pgdata --formation --group --fleet ] ",
 				 "  --pgdata      path to data directory	 \n"
 				 "  --monitor     show the monitor uri\n"
 				 "  --formation   formation to query, defaults to 'default' \n"
 				 "  --group       group to query formation, defaults to all \n"
+				 "  --fleet       show one line per group of all formations\n"
 				 "  --json        output data in the JSON format\n",
 				 cli_watch_getopts,
 				 cli_watch);
@@ -67,6 +70,7 @@ cli_watch_getopts(int argc, char **argv)
 		{ "monitor", required_argument, NULL, 'm' },
 		{ "formation", required_argument, NULL, 'f' },
 		{ "group", required_argument, NULL, 'g' },
+		{ "fleet", no_argument, NULL, 'O' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -128,6 +132,13 @@ cli_watch_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'O':
+			{
+				watchFleet = true;
+				log_trace("--fleet");
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -240,6 +251,7 @@ cli_watch(int argc, char **argv)
 
 	strlcpy(context.formation, config.formation, sizeof(context.formation));
 	context.groupId = config.groupId;
+	context.fleet = watchFleet;
 
 	(void) cli_watch_main_loop(&context);
 }
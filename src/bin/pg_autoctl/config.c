@@ -8,6 +8,7 @@
  */
 
 #include <stdbool.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "postgres_fe.h"
@@ -399,3 +400,61 @@ config_accept_new_ssloptions(PostgresSetup *pgSetup, PostgresSetup *newPgSetup)
 
 	return true;
 }
+
+
+/*
+ * config_file_stamp computes the stamp of the given configuration file: its
+ * modification time, its size, and a FNV-1a hash of its contents.
+ */
+bool
+config_file_stamp(const char *filename, ConfigFileStamp *stamp)
+{
+	struct stat st;
+	char *contents = NULL;
+	long size = 0L;
+
+	stamp->valid = false;
+
+	if (stat(filename, &st) != 0)
+	{
+		log_error("Failed to stat file \"%s\": %m", filename);
+		return false;
+	}
+
+	if (!read_file(filename, &contents, &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	uint64_t hash = UINT64CONST(14695981039346656037);
+
+	for (long i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char) contents[i];
+		hash *= UINT64CONST(1099511628211);
+	}
+
+	free(contents);
+
+	stamp->mtime = (int64_t) st.st_mtime;
+	stamp->size = (int64_t) size;
+	stamp->hash = hash;
+	stamp->valid = true;
+
+	return true;
+}
+
+
+/*
+ * config_file_stamp_equals returns true when both stamps are valid and the
+ * same, meaning that the configuration file didn't change.
+ */
+bool
+config_file_stamp_equals(ConfigFileStamp *stamp, ConfigFileStamp *other)
+{
+	return stamp->valid && other->valid &&
+		   stamp->mtime == other->mtime &&
+		   stamp->size == other->size &&
+		   stamp->hash == other->hash;
+}
@@ -79,7 +79,22 @@ pgAutoCtlNodeRole ProbeConfigurationFileRole(const char *filename);
 #define strneq(x, y) \
 	((x != NULL) && (y != NULL) && (strcmp(x, y) != 0))
 
+/*
+ * A ConfigFileStamp identifies the contents of a configuration file, so that
+ * we can skip parsing the file again when reloading it unchanged.
+ */
+typedef struct ConfigFileStamp
+{
+	bool valid;
+	int64_t mtime;
+	int64_t size;
+	uint64_t hash;
+} ConfigFileStamp;
+
 bool config_accept_new_ssloptions(PostgresSetup *pgSetup,
 								  PostgresSetup *newPgSetup);
 
+bool config_file_stamp(const char *filename, ConfigFileStamp *stamp);
+bool config_file_stamp_equals(ConfigFileStamp *stamp, ConfigFileStamp *other);
+
 #endif /* CONFIG_H */
@@ -17,17 +17,22 @@
 #define PG_AUTOCTL_VERSION "1.6.4"
 
 /* version of the extension that we requite to talk to on the monitor */
-#define PG_AUTOCTL_EXTENSION_VERSION "1.6"
+#define PG_AUTOCTL_EXTENSION_VERSION "1.7"
 
 /* environment variable to use to make DEBUG facilities available */
 #define PG_AUTOCTL_DEBUG "PG_AUTOCTL_DEBUG"
 #define PG_AUTOCTL_EXTENSION_VERSION_VAR "PG_AUTOCTL_EXTENSION_VERSION"
+#define PG_AUTOCTL_KEEPER_SLEEP_TIME_VAR "PG_AUTOCTL_KEEPER_SLEEP_TIME_MS"
 
 /* environment variable for containing the id of the logging semaphore */
 #define PG_AUTOCTL_LOG_SEMAPHORE "PG_AUTOCTL_LOG_SEMAPHORE"
 
+/* environment variable for containing the fd of the logging shared mutex */
+#define PG_AUTOCTL_LOG_MUTEX "PG_AUTOCTL_LOG_MUTEX"
+
 /* environment variable for --monitor, when used instead of --pgdata */
 #define PG_AUTOCTL_MONITOR "PG_AUTOCTL_MONITOR"
+#define PG_AUTOCTL_MONITOR_STANDBYS "PG_AUTOCTL_MONITOR_STANDBYS"
 
 /* environment variable for --candidate-priority and --replication-quorum */
 #define PG_AUTOCTL_NODE_NAME "PG_AUTOCTL_NODE_NAME"
@@ -53,9 +58,43 @@
 #define FORMATION_DEFAULT "default"
 #define GROUP_ID_DEFAULT 0
 #define POSTGRES_CONNECT_TIMEOUT "2"
+
+/*
+ * TCP keepalives and user timeout of our connections to the monitor and to
+ * the other nodes, so that losing the network is noticed in about 10s rather
+ * than after the kernel retransmission timeout, which is many minutes.
+ */
+#define POSTGRES_KEEPALIVES_IDLE "5"        /* seconds */
+#define POSTGRES_KEEPALIVES_INTERVAL "2"    /* seconds */
+#define POSTGRES_KEEPALIVES_COUNT "3"
+#define POSTGRES_TCP_USER_TIMEOUT "10000"   /* milliseconds */
 #define MAXIMUM_BACKUP_RATE "100M"
 #define MAXIMUM_BACKUP_RATE_LEN 32
 
+/* pg_basebackup --max-rate bounds, in kB/s, see src/bin/pg_basebackup */
+#define MAX_RATE_LOWER 32
+#define MAX_RATE_UPPER 1048576
+
+/*
+ * With replication.minimum_backup_rate, the rate used for a base backup goes
+ * down from the maximum to the minimum rate as the replication lag of the
+ * other standby nodes grows to this value.
+ */
+#define ADAPTIVE_BACKUP_RATE_LAG_THRESHOLD 10000 /* milliseconds */
+
+#define DEFAULT_CLONE_SOURCE "primary"
+#define DEFAULT_WAL_PREFETCH 4
+#define DEFAULT_PREWARM_WORKERS 0
+#define DEFAULT_CLONE_STREAMS 1
+#define DEFAULT_SLOT_WAL_WARNING_SIZE 16384     /* MB */
+#define DEFAULT_INACTIVE_SLOT_DROP_TIMEOUT 0    /* disabled */
+#define DEFAULT_LOGICAL_SLOTS_FAILOVER 0        /* disabled */
+#define DEFAULT_BASEBACKUP_WAL_METHOD "stream"
+
+/* default workload profile used for Postgres tuning, see pgtuning.c */
+#define DEFAULT_TUNING_PROFILE "mixed"
+#define MONITOR_TUNING_PROFILE "monitor"
+
 
 /*
  * Microsoft approved cipher string.
@@ -78,23 +117,133 @@
 #define POSTGRES_PING_RETRY_CAP_SLEEP_TIME (2 * 1000) /* milliseconds */
 #define POSTGRES_PING_RETRY_BASE_SLEEP_TIME 5         /* milliseconds */
 
+/*
+ * After this many failed connections in a row to a monitor, we stop trying
+ * for a while: from 1s and then up to 30s, with decorrelated jitter.
+ */
+#define MONITOR_CIRCUIT_BREAKER_FAILURES 3
+#define MONITOR_CIRCUIT_BREAKER_BASE_TIME (1 * 1000) /* milliseconds */
+#define MONITOR_CIRCUIT_BREAKER_CAP_TIME (30 * 1000) /* milliseconds */
+
 #define PG_AUTOCTL_MONITOR_DISABLED "PG_AUTOCTL_DISABLED"
 
 #define NETWORK_PARTITION_TIMEOUT 20
+#define DEFAULT_PRIMARY_LEASE_TIMEOUT 0 /* seconds, disabled */
 #define PREPARE_PROMOTION_CATCHUP_TIMEOUT 30
 #define PREPARE_PROMOTION_WALRECEIVER_TIMEOUT 5
+#define PREPARE_PROMOTION_PREWARM_TIMEOUT 10
+#define PREPARE_DEMOTION_TIMEOUT 10
+#define DRAIN_SESSIONS_TIMEOUT 0 /* seconds, disabled */
+#define POOLER_COMMAND_TIMEOUT 10
+
+/* how far behind the sync standby may be when we stop a demoted primary */
+#define PG_AUTOCTL_DEMOTION_CATCHUP_LAG (1024 * 1024) /* bytes */
+
+/* how long cancelled queries have to end before we terminate their sessions */
+#define PG_AUTOCTL_DRAIN_CANCEL_WAIT 1 /* seconds */
 
 #define PG_AUTOCTL_KEEPER_SLEEP_TIME 1      /* seconds */
 #define PG_AUTOCTL_KEEPER_RETRY_TIME_MS 350 /* milliseconds */
+
+/* node-active pacing: slower when our group is stable, faster otherwise */
+#define PG_AUTOCTL_KEEPER_STABLE_SLEEP_TIME_MS 5000    /* milliseconds */
+#define PG_AUTOCTL_KEEPER_TRANSITION_SLEEP_TIME_MS 100 /* milliseconds */
+#define PG_AUTOCTL_KEEPER_TRANSITION_PACING_TIMEOUT 60 /* seconds */
 #define PG_AUTOCTL_MONITOR_SLEEP_TIME 10 /* seconds */
 #define PG_AUTOCTL_MONITOR_RETRY_TIME 1  /* seconds */
 
 #define PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT 60
 
+/* report pg_basebackup and pg_rewind progress to the monitor every 5s */
+#define PG_AUTOCTL_PROGRESS_REPORT_INTERVAL 5 /* seconds */
+
+/*
+ * A list of other nodes fetched less than 3s ago comes from the current
+ * keeper loop, and we use a list of up to 60s ago when the monitor fails.
+ */
+#define PG_AUTOCTL_OTHER_NODES_FRESH_AGE 3 /* seconds */
+#define PG_AUTOCTL_OTHER_NODES_MAX_AGE 60  /* seconds */
+
+/* maintain the standby replication slots every 60s even when idle */
+#define PG_AUTOCTL_SLOTS_MAINTAIN_INTERVAL 60 /* seconds */
+
+/* refresh the buffer cache pre-warm block list from the primary every 60s */
+#define PG_AUTOCTL_PREWARM_REFRESH_INTERVAL 60 /* seconds */
+
+/* a node back from maintenance is warm once it replays within 16MB of WAL */
+#define PG_AUTOCTL_WARMUP_MAX_REPLAY_LAG (16 * 1024 * 1024) /* bytes */
+
+/* synchronize the logical replication slots from the primary every 10s */
+#define PG_AUTOCTL_LOGICAL_SLOTS_SYNC_INTERVAL 10 /* seconds */
+
+/* creating a logical slot on a standby waits for a running xacts record */
+#define PG_AUTOCTL_LOGICAL_SLOT_CREATE_TIMEOUT 5000 /* milliseconds */
+
+/* measure the standby WAL apply rate over intervals of at least 5s */
+#define PG_AUTOCTL_APPLY_RATE_INTERVAL 5 /* seconds */
+
+/* report pg_stat_replication for the standby nodes to the monitor every 5s */
+#define PG_AUTOCTL_REPLICATION_REPORT_INTERVAL 5 /* seconds */
+
+/* report the CPU, memory, disk and WAL usage of the host every 30s */
+#define PG_AUTOCTL_RESOURCES_REPORT_INTERVAL 30 /* seconds */
+
+/* HBA changes are written and Postgres is reloaded at most every 2s */
+#define PG_AUTOCTL_HBA_DEBOUNCE_TIME 2 /* seconds */
+
+/* DNS lookups for HBA rules are cached, failures for a shorter time */
+#define PG_AUTOCTL_DNS_CACHE_TTL 60 /* seconds */
+#define PG_AUTOCTL_DNS_CACHE_NEGATIVE_TTL 10 /* seconds */
+
 #define COORDINATOR_IS_READY_TIMEOUT 300
 
 #define POSTGRESQL_FAILS_TO_START_TIMEOUT 20
 #define POSTGRESQL_FAILS_TO_START_RETRIES 3
+#define POSTGRESQL_CRASH_RECOVERY_TIMEOUT 300
+
+/* log the phases of keeper main loop iterations slower than this */
+#define KEEPER_SLOW_LOOP_THRESHOLD 5000 /* milliseconds */
+#define MONITOR_STANDBY_MAX_LAG 2000 /* milliseconds */
+#define MONITOR_STANDBY_CHECK_INTERVAL 5 /* seconds */
+
+/* a monitor standby promotes itself when its primary is lost that long */
+#define MONITOR_STANDBY_TAKEOVER_TIMEOUT 30 /* seconds */
+#define MONITOR_STANDBY_APPLICATION_NAME "pgautofailover_monitor_standby"
+
+/* how many other monitors a monitor cluster may have in cluster.peers */
+#define MONITOR_CLUSTER_MAX_PEERS 8
+
+/* keepers LISTEN to the monitor, or long-poll it from behind a pooler */
+#define MONITOR_NOTIFICATIONS_LISTEN "listen"
+#define MONITOR_NOTIFICATIONS_POLL "poll"
+#define DEFAULT_MONITOR_NOTIFICATIONS MONITOR_NOTIFICATIONS_LISTEN
+
+/* pg_autoctl watch refreshes the lags and progress of the nodes every 5s */
+#define PG_AUTOCTL_WATCH_REFRESH_INTERVAL 5 /* seconds */
+
+/* pg_autoctl watch redraws the screen at least once per second */
+#define PG_AUTOCTL_WATCH_POLL_TIMEOUT 1000 /* milliseconds */
+
+/* pg_autoctl show events --since fetches pages of 1000 events */
+#define MONITOR_EVENTS_PAGE_SIZE 1000
+
+/* pg_autoctl show events --follow polls for events every 10s at least */
+#define MONITOR_FOLLOW_EVENTS_POLL_INTERVAL 10 /* seconds */
+
+/* pg_autoctl show uri --read skips standbys that are further behind */
+#define FORMATION_READ_URI_MAX_LAG (16 * 1024 * 1024) /* bytes */
+
+/* cross-shard queries in monitor federation mode give up after 10s */
+#define MONITOR_SHARDS_QUERY_TIMEOUT 10 /* seconds */
+
+/*
+ * ALTER EXTENSION pgautofailover UPDATE waits for its locks for that long, so
+ * that node_active calls queued behind it are not blocked for more than that.
+ * We retry a number of times, and then wait for the locks as long as needed.
+ */
+#define MONITOR_EXTENSION_UPDATE_LOCK_TIMEOUT 1000 /* milliseconds */
+#define MONITOR_EXTENSION_UPDATE_ATTEMPTS 20
+#define MONITOR_EXTENSION_UPDATE_RETRY_SLEEP 500 /* milliseconds */
 
 #define DEFAULT_CITUS_ROLE "primary"
 #define DEFAULT_CITUS_CLUSTER_NAME "default"
@@ -120,12 +269,28 @@
 
 #define AWAIT_PROMOTION_SLEEP_TIME_MS 1000
 
+/* how many local nodes a single pg_autoctl run may supervise */
+#define PG_AUTOCTL_MAX_INSTANCES 16
+
+/* how long pg_promote() waits for the promotion to be done */
+#define AWAIT_PROMOTION_TIMEOUT_SECONDS 60
+
+/* waiting for a LSN or a promotion begins with a short sleep, then doubles */
+#define AWAIT_LSN_MIN_SLEEP_TIME_MS 1
+
 #define KEEPER_CONFIGURATION_FILENAME "pg_autoctl.cfg"
 #define KEEPER_STATE_FILENAME "pg_autoctl.state"
 #define KEEPER_PID_FILENAME "pg_autoctl.pid"
+#define KEEPER_INSTANCES_PID_FILENAME "pg_autoctl.instances.pid"
 #define KEEPER_INIT_STATE_FILENAME "pg_autoctl.init"
 #define KEEPER_POSTGRES_STATE_FILENAME "pg_autoctl.pg"
+#define KEEPER_POSTGRES_STATE_FIFO_SUFFIX ".fifo"
+#define KEEPER_CLONE_STATE_SUFFIX ".clone"
 #define KEEPER_NODES_FILENAME "nodes.json"
+#define KEEPER_PREWARM_FILENAME "prewarm.blocks"
+#define KEEPER_METRICS_FILENAME "pg_autoctl.metrics"
+#define KEEPER_CONTROL_FILENAME "pg_autoctl.control.json"
+#define KEEPER_CONTROL_SOCKET_FILENAME "pg_autoctl.sock"
 
 #define KEEPER_SYSTEMD_SERVICE "pgautofailover"
 #define KEEPER_SYSTEMD_FILENAME "pgautofailover.service"
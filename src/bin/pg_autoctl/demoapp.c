@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,12 +23,15 @@
 #include "common/pg_prng.h"
 #endif
 
+#include "cli_common.h"
 #include "cli_do_demoapp.h"
 #include "defaults.h"
 #include "demoapp.h"
 #include "env_utils.h"
+#include "file_utils.h"
 #include "log.h"
 #include "monitor.h"
+#include "parson.h"
 #include "pgsql.h"
 #include "signals.h"
 #include "string_utils.h"
@@ -39,24 +43,216 @@ static void demoapp_set_retry_policy(PGSQL *pgsql, int cap, int sleepTime);
 static bool demoapp_register_client(const char *pguri,
 									int clientId, int retrySleep, int retryCap);
 
-static bool demoapp_update_client_failovers(const char *pguri,
-											int clientId, int failovers);
+/*
+ * Latency histograms use 64 sub-buckets per power of two, which gives a 3%
+ * precision, and track latencies up to about an hour.
+ */
+#define DEMO_HISTOGRAM_SUB_BUCKETS 64
+#define DEMO_HISTOGRAM_MAX_SHIFT 36
+#define DEMO_HISTOGRAM_BUCKETS \
+	((DEMO_HISTOGRAM_MAX_SHIFT + 2) * (DEMO_HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct DemoHistogram
+{
+	uint64_t counts[DEMO_HISTOGRAM_BUCKETS];
+} DemoHistogram;
+
+typedef struct DemoClientStats
+{
+	int failovers;
+	int64_t reads;
+	int64_t writes;
+	int64_t updates;
+	int64_t errors;
+	double elapsed;             /* seconds */
+	DemoHistogram latency;
+} DemoClientStats;
+
+/* the transactions that the demo clients run, see --read-ratio */
+typedef enum
+{
+	DEMO_TXN_INSERT = 0,
+	DEMO_TXN_READ,
+	DEMO_TXN_UPDATE
+} DemoTransactionKind;
+
+static const char *demoReadSQL =
+	"select loop from demo.tracking where client = $1 "
+	"order by loop desc limit 1";
+
+static const char *demoInsertSQL =
+	"insert into demo.tracking(client, loop, retries, us, recovery) "
+	"values($1, $2, $3, $4, $5) "
+	"returning coalesce(host(inet_server_addr()), '') "
+	"|| ':' || coalesce(inet_server_port(), 0)";
+
+static const char *demoUpdateSQL =
+	"insert into demo.counter(client, value) values($1, 1) "
+	"on conflict (client) "
+	"do update set value = demo.counter.value + 1, updated_at = now()";
+
+static const Oid demoInsertParamTypes[5] = {
+	INT4OID, INT4OID, INT8OID, INT8OID, BOOLOID
+};
+
+/*
+ * A transaction sent by a pipelined client, with the storage for its
+ * parameters, and its result once the batch has been processed.
+ */
+typedef struct DemoTransaction
+{
+	DemoTransactionKind kind;
+	int loop;
+
+	IntString params[4];
+	const char *paramValues[5];
+
+	instr_time *batchStart;
+	DemoHistogram *latency;
+
+	bool done;
+	double ackedAt;
+	char server[BUFSIZE];
+} DemoTransaction;
+
+/*
+ * We keep track of the writes that have been acknowledged to the client, and
+ * compare them to the tracking table at the end of the run: any missing write
+ * has been lost in a failover.
+ */
+typedef struct DemoAckedWrite
+{
+	int loop;
+	double ackedAt;             /* seconds since epoch, client clock */
+	bool outage;                /* first write after an outage */
+} DemoAckedWrite;
+
+typedef struct DemoAckedWriteArray
+{
+	int count;
+	int capacity;
+	DemoAckedWrite *writes;
+} DemoAckedWriteArray;
+
+static bool demoapp_update_client_stats(const char *pguri, int clientId,
+										DemoClientStats *stats);
+
+static bool demoapp_insert_acked_writes(const char *pguri, int clientId,
+										DemoAckedWriteArray *ackedArray);
+
+static bool demoapp_acked_writes_append(DemoAckedWriteArray *ackedArray,
+										int loop, double ackedAt, bool outage);
+
+static void demoapp_histogram_record(DemoHistogram *histogram,
+									 instr_time duration);
+
+static void demoapp_histogram_to_json(DemoHistogram *histogram,
+									  PQExpBuffer buffer);
+
+static double demoapp_now(void);
+
+static DemoTransactionKind demoapp_transaction_kind(DemoAppOptions *options,
+													int dice);
 
 static void demoapp_start_client(const char *pguri,
 								 int clientId,
 								 DemoAppOptions *demoAppOptions);
 
+static void demoapp_start_pipeline_client(const char *pguri,
+										  int clientId,
+										  DemoAppOptions *demoAppOptions);
+
+static void demoapp_prepare_transaction(DemoTransaction *txn,
+										PGSQLQuery *query,
+										int clientId,
+										int retries,
+										int64_t connectionTimeUs,
+										bool is_in_recovery);
+
+static void demoapp_parse_transaction_result(void *ctx, PGresult *result);
+
 static bool demoapp_wait_for_clients(pid_t clientsPidArray[],
 									 int startedClientsCount);
 
 static void demoapp_terminate_clients(pid_t clientsPidArray[],
 									  int startedClientsCount);
 
-static void demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions);
+static void demoapp_process_inject_fault(const char *pguri,
+										 DemoAppOptions *demoAppOptions);
+
+static bool demoapp_inject_fault(const char *pguri, Monitor *monitor,
+								 DemoAppOptions *demoAppOptions);
+
+static bool demoapp_kill_primary(const char *pguri,
+								 DemoAppOptions *demoAppOptions);
+
+static bool demoapp_run_fault_command(const char *command);
+
+static bool demoapp_register_fault(const char *pguri, DemoFaultKind faultKind,
+								   NodeAddress *primary,
+								   double injected, double promoted,
+								   double healed);
+
+/*
+ * The summaries are printed in the same aligned format as psql uses, from
+ * tables of strings that we fill-in from query results or from statistics
+ * computed here.
+ */
+#define DEMO_TABLE_MAX_COLUMNS 16
+
+typedef struct DemoTable
+{
+	int columns;
+	const char *headers[DEMO_TABLE_MAX_COLUMNS];
+	bool alignRight[DEMO_TABLE_MAX_COLUMNS];
+
+	int rows;
+	int capacity;
+	char **cells;               /* rows * columns strings */
+} DemoTable;
+
+/* the context used to compute the workload summary from demo.client */
+typedef struct DemoWorkloadSummary
+{
+	DemoTable table;
+	DemoHistogram combined;
+	int64_t reads;
+	int64_t writes;
+	int64_t updates;
+	int64_t errors;
+	double tps;
+	bool parsedOk;
+} DemoWorkloadSummary;
 
 static int demoapp_get_terminal_columns(void);
 
-static void demoapp_psql(const char *pguri, const char *sql);
+static bool demoapp_table_add_row(DemoTable *table, const char **values);
+static void demoapp_table_print(DemoTable *table);
+static void demoapp_table_free(DemoTable *table);
+
+static bool demoapp_print_query(const char *pguri, const char *sql);
+static void demoapp_print_result(void *ctx, PGresult *result);
+
+static void demoapp_parse_workload_summary(void *ctx, PGresult *result);
+static bool demoapp_workload_summary_add_row(DemoWorkloadSummary *summary,
+											 const char *client,
+											 int64_t reads,
+											 int64_t writes,
+											 int64_t updates,
+											 int64_t errors,
+											 double tps,
+											 DemoHistogram *latency);
+
+static bool demoapp_histogram_from_json(const char *json,
+										DemoHistogram *histogram);
+static void demoapp_histogram_merge(DemoHistogram *target,
+									DemoHistogram *source);
+static uint64_t demoapp_histogram_count(DemoHistogram *histogram);
+static uint64_t demoapp_histogram_percentile(DemoHistogram *histogram,
+											 double quantile);
+static uint64_t demoapp_histogram_max(DemoHistogram *histogram);
+
+static void demoapp_print_faults(const char *pguri);
 
 
 /*
@@ -153,12 +349,75 @@ demoapp_prepare_schema(const char *pguri)
 
 		"create table demo.client(client integer primary key, pid integer, "
 		"retry_sleep_ms integer, retry_cap_ms integer, failover_count integer, "
+		"reads bigint, writes bigint, updates bigint, errors bigint, "
+		"duration_s float8, latency_histogram jsonb, "
 		"unique(pid))",
 
+		/*
+		 * Rows are identified by the client loop number, which is unique even
+		 * when a pipelined client inserts many rows per round trip.
+		 */
 		"create table demo.tracking(ts timestamptz default now(), "
 		"client integer, loop integer, retries integer, us bigint, recovery bool,"
-		"primary key(client, ts),"
+		"primary key(client, loop),"
+		"foreign key (client) references demo.client(client))",
+
+		"create table demo.counter(client integer primary key, value bigint, "
+		"updated_at timestamptz default now(), "
+		"foreign key (client) references demo.client(client))",
+
+		/*
+		 * Each client registers the writes for which it received a commit
+		 * acknowledgement, with the client clock, and whether the write is the
+		 * first one after an outage: connection retries, errors, or a change
+		 * of the server that accepts the writes.
+		 */
+		"create table demo.acked(client integer, loop integer, "
+		"acked_at timestamptz, outage bool, "
+		"primary key(client, loop), "
 		"foreign key (client) references demo.client(client))",
+
+		"create table demo.fault(id serial primary key, kind text, "
+		"primary_node text, injected timestamptz, promoted timestamptz, "
+		"healed timestamptz)",
+
+		/* RTO: from the fault injection to the first write after an outage */
+		"create view demo.fault_recovery as "
+		"select f.id, f.kind, f.primary_node, f.injected, "
+		"extract(epoch from f.promoted - f.injected) as failover_s, "
+		"extract(epoch from r.recovered - f.injected) as rto_s "
+		"from demo.fault f "
+		"left join lateral (select min(a.acked_at) as recovered "
+		"from demo.acked a "
+		"where a.outage and a.acked_at > f.injected "
+		"and a.acked_at < coalesce((select min(n.injected) from demo.fault n "
+		"where n.injected > f.injected), 'infinity')) r on true",
+
+		/* RPO: acknowledged writes that can't be found anymore */
+		"create view demo.lost_writes as "
+		"select a.client, a.loop, a.acked_at from demo.acked a "
+		"where not exists(select 1 from demo.tracking t "
+		"where t.client = a.client and t.loop = a.loop)",
+
+		/* latency histograms are arrays of [microseconds, count] buckets */
+		"create view demo.latency_histogram as "
+		"select (b->>0)::bigint as us, sum((b->>1)::bigint) as freq "
+		"from demo.client, jsonb_array_elements(latency_histogram) b "
+		"group by 1",
+
+		"create function demo.latency_summary(h jsonb) returns jsonb "
+		"language sql immutable as $$ "
+		"with b as (select (e->>0)::bigint as us, (e->>1)::bigint as freq "
+		"from jsonb_array_elements(h) e), "
+		"c as (select us, sum(freq) over(order by us) as cum, "
+		"sum(freq) over() as total from b) "
+		"select jsonb_build_object('count', max(total), "
+		"'min', round(min(us) / 1000.0, 3), "
+		"'p50', round(min(us) filter(where cum >= 0.50 * total) / 1000.0, 3), "
+		"'p90', round(min(us) filter(where cum >= 0.90 * total) / 1000.0, 3), "
+		"'p99', round(min(us) filter(where cum >= 0.99 * total) / 1000.0, 3), "
+		"'p999', round(min(us) filter(where cum >= 0.999 * total) / 1000.0, 3), "
+		"'max', round(max(us) / 1000.0, 3)) from c $$",
 		NULL
 	};
 
@@ -198,6 +457,13 @@ demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions)
 
 	log_info("Starting %d concurrent clients as sub-processes", clientsCount);
 
+	if (demoAppOptions->pipeline)
+	{
+		log_info("Clients send batches of %d transactions%s",
+				 demoAppOptions->batchSize,
+				 demoAppOptions->prepared ? ", using prepared statements" : "");
+	}
+
 
 	/* Flush stdio channels just before fork, to avoid double-output problems */
 	fflush(stdout);
@@ -235,7 +501,12 @@ demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions)
 
 				if (index == 0)
 				{
-					(void) demoapp_process_perform_switchover(demoAppOptions);
+					(void) demoapp_process_inject_fault(pguri, demoAppOptions);
+				}
+				else if (demoAppOptions->pipeline)
+				{
+					(void) demoapp_start_pipeline_client(pguri, index,
+														 demoAppOptions);
 				}
 				else
 				{
@@ -357,20 +628,18 @@ demoapp_terminate_clients(pid_t clientsPidArray[], int startedClientsCount)
 
 
 /*
- * demoapp_perform_switchover performs a switchover while the demo application
- * is running, once in a while
+ * demoapp_process_inject_fault injects a fault while the demo application is
+ * running, once in a while: either a switchover orchestrated by the monitor,
+ * a kill -9 of the primary Postgres instance, or a network partition.
  */
 static void
-demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
+demoapp_process_inject_fault(const char *pguri, DemoAppOptions *demoAppOptions)
 {
 	Monitor monitor = { 0 };
-	char *channels[] = { "state", NULL };
-
-	char *formation = demoAppOptions->formation;
-	int groupId = demoAppOptions->groupId;
 
 	bool durationElapsed = false;
 	uint64_t startTime = time(NULL);
+	int lastFaultSecond = -1;
 
 	if (!demoAppOptions->doFailover)
 	{
@@ -396,8 +665,9 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 		exit(EXIT_CODE_QUIT);
 	}
 
-	log_info("Failover client is started, will failover in %ds "
-			 "and every %ds after that",
+	log_info("Fault injection client is started, will inject a %s fault "
+			 "in %ds and every %ds after that",
+			 demoapp_fault_kind_to_string(demoAppOptions->faultKind),
 			 demoAppOptions->firstFailover,
 			 demoAppOptions->failoverFreq);
 
@@ -421,71 +691,186 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 		 *   multiple of the failover frequency (failover every failoverFreq
 		 *   seconds after the first failover).
 		 */
-		if (currentSecond != demoAppOptions->firstFailover ||
+		bool isFaultSecond =
+			currentSecond == demoAppOptions->firstFailover ||
 			(currentSecond > demoAppOptions->firstFailover &&
+			 demoAppOptions->failoverFreq > 0 &&
 			 ((currentSecond - demoAppOptions->firstFailover) %
-			  demoAppOptions->failoverFreq) != 0))
+			  demoAppOptions->failoverFreq) == 0);
+
+		if (!isFaultSecond || currentSecond == lastFaultSecond)
 		{
-			pg_usleep(500);
+			pg_usleep(100 * 1000); /* 100 ms */
 			continue;
 		}
 
-		log_info("pg_autoctl perform failover");
+		lastFaultSecond = currentSecond;
 
-		/* start listening to the state changes before we perform_failover */
-		if (!pgsql_listen(&(monitor.pgsql), channels))
+		if (!demoapp_inject_fault(pguri, &monitor, demoAppOptions))
 		{
-			log_error("Failed to listen to state changes from the monitor");
-			pgsql_finish(&(monitor.pgsql));
+			/* errors have already been logged, skip this round entirely */
+			log_error("Failed to inject a %s fault, see above for details",
+					  demoapp_fault_kind_to_string(demoAppOptions->faultKind));
 			continue;
 		}
+	}
+}
+
+
+/*
+ * demoapp_inject_fault injects a single fault and registers it in the
+ * demo.fault table, so that we can compute the RTO at the end of the run.
+ */
+static bool
+demoapp_inject_fault(const char *pguri, Monitor *monitor,
+					 DemoAppOptions *demoAppOptions)
+{
+	char *channels[] = { "state", NULL };
+
+	char *formation = demoAppOptions->formation;
+	int groupId = demoAppOptions->groupId;
+	DemoFaultKind faultKind = demoAppOptions->faultKind;
 
-		if (!monitor_perform_failover(&monitor, formation, groupId))
+	NodeAddress primary = { 0 };
+
+	double injected = 0;
+	double promoted = 0;
+	double healed = 0;
+
+	if (!monitor_get_primary(monitor, formation, groupId, &primary))
+	{
+		log_error("Failed to get the primary node of formation \"%s\" "
+				  "group %d from the monitor",
+				  formation, groupId);
+		return false;
+	}
+
+	/* user-provided fault commands can target the current primary */
+	setenv("PG_AUTOCTL_DEMO_PRIMARY_NAME", primary.name, 1);
+	setenv("PG_AUTOCTL_DEMO_PRIMARY_HOST", primary.host, 1);
+	setenv("PG_AUTOCTL_DEMO_PRIMARY_PORT", intToString(primary.port).strValue, 1);
+	setenv("PG_AUTOCTL_DEMO_PRIMARY_NODE_ID",
+		   intToString(primary.nodeId).strValue, 1);
+
+	/* start listening to the state changes before we inject the fault */
+	if (faultKind != DEMO_FAULT_KILL &&
+		!pgsql_listen(&(monitor->pgsql), channels))
+	{
+		log_error("Failed to listen to state changes from the monitor");
+		pgsql_finish(&(monitor->pgsql));
+		return false;
+	}
+
+	log_info("Injecting a %s fault on primary node %" PRId64 " \"%s\" (%s:%d)",
+			 demoapp_fault_kind_to_string(faultKind),
+			 primary.nodeId, primary.name, primary.host, primary.port);
+
+	injected = demoapp_now();
+
+	switch (faultKind)
+	{
+		case DEMO_FAULT_SWITCHOVER:
 		{
-			log_fatal("Failed to perform failover/switchover, "
-					  "see above for details");
+			if (!monitor_perform_failover(monitor, formation, groupId))
+			{
+				log_fatal("Failed to perform failover/switchover, "
+						  "see above for details");
 
-			/* skip this round entirely and continue */
-			sleep(1);
-			continue;
+				/* skip this round entirely and continue */
+				sleep(1);
+				return false;
+			}
+			break;
+		}
+
+		case DEMO_FAULT_KILL:
+		{
+			if (!demoapp_kill_primary(pguri, demoAppOptions))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+			break;
+		}
+
+		case DEMO_FAULT_PARTITION:
+		{
+			if (!demoapp_run_fault_command(demoAppOptions->faultCommand))
+			{
+				/* errors have already been logged */
+				pgsql_finish(&(monitor->pgsql));
+				return false;
+			}
+			break;
+		}
+
+		default:
+		{
+			log_error("BUG: unknown fault kind %d", faultKind);
+			return false;
 		}
+	}
 
+	/*
+	 * After a kill -9 the local keeper restarts Postgres right away, and a
+	 * failover may or may not happen: the client measures the RTO anyway.
+	 */
+	if (faultKind != DEMO_FAULT_KILL)
+	{
 		/* process state changes notification until we have a new primary */
-		if (!monitor_wait_until_some_node_reported_state(
-				&monitor,
+		if (monitor_wait_until_some_node_reported_state(
+				monitor,
 				formation,
 				groupId,
+				NULL,
 				NODE_KIND_UNKNOWN,
 				PRIMARY_STATE,
 				PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT))
+		{
+			promoted = demoapp_now();
+		}
+		else
 		{
 			log_error("Failed to wait until a new primary has been notified");
-			continue;
 		}
 	}
+
+	if (faultKind == DEMO_FAULT_PARTITION &&
+		!IS_EMPTY_STRING_BUFFER(demoAppOptions->healCommand))
+	{
+		if (demoapp_run_fault_command(demoAppOptions->healCommand))
+		{
+			healed = demoapp_now();
+		}
+	}
+
+	return demoapp_register_fault(pguri, faultKind, &primary,
+								  injected, promoted, healed);
 }
 
 
 /*
- * demoapp_register_client registers a client with its retry policy
+ * demoapp_kill_primary sends SIGKILL to the primary Postgres instance. Unless
+ * a --fault-command has been given, that only works when the primary runs on
+ * the same host as the demo application, which we check by comparing the
+ * postmaster.pid file contents as seen by the server and on-disk here.
  */
 static bool
-demoapp_register_client(const char *pguri,
-						int clientId, int retrySleep, int retryCap)
+demoapp_kill_primary(const char *pguri, DemoAppOptions *demoAppOptions)
 {
 	PGSQL pgsql = { 0 };
 
-	char *sql =
-		"insert into demo.client(client, pid, retry_sleep_ms, retry_cap_ms) "
-		"values($1, $2, $3, $4)";
+	SingleValueResultContext pidContext = { { 0 }, PGSQL_RESULT_STRING, false };
+	SingleValueResultContext dirContext = { { 0 }, PGSQL_RESULT_STRING, false };
 
-	const Oid paramTypes[4] = { INT4OID, INT4OID, INT4OID, INT4OID };
-	const char *paramValues[4] = { 0 };
+	char pidFilePath[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long fileSize = 0L;
 
-	paramValues[0] = intToString(clientId).strValue;
-	paramValues[1] = intToString(getpid()).strValue;
-	paramValues[2] = intToString(retrySleep).strValue;
-	paramValues[3] = intToString(retryCap).strValue;
+	if (!IS_EMPTY_STRING_BUFFER(demoAppOptions->faultCommand))
+	{
+		return demoapp_run_fault_command(demoAppOptions->faultCommand);
+	}
 
 	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
 
@@ -493,329 +878,1740 @@ demoapp_register_client(const char *pguri,
 							 DEMO_DEFAULT_RETRY_CAP_TIME,
 							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
 
-	if (!pgsql_execute_with_params(&pgsql, sql, 4, paramTypes, paramValues,
-								   NULL, NULL))
+	if (!pgsql_execute_with_params(&pgsql,
+								   "select current_setting('data_directory')",
+								   0, NULL, NULL,
+								   &dirContext, &parseSingleValueResult) ||
+		!dirContext.parsedOk ||
+		!pgsql_execute_with_params(&pgsql,
+								   "select pg_read_file('postmaster.pid')",
+								   0, NULL, NULL,
+								   &pidContext, &parseSingleValueResult) ||
+		!pidContext.parsedOk)
 	{
-		/* errors have already been logged */
+		log_error("Failed to read the primary postmaster.pid file, "
+				  "use --fault-command to kill the primary");
 		pgsql_finish(&pgsql);
 		return false;
 	}
 
 	pgsql_finish(&pgsql);
-	return true;
-}
 
+	sformat(pidFilePath, sizeof(pidFilePath), "%s/postmaster.pid",
+			dirContext.strVal);
 
-/*
- * demoapp_update_client_failovers registers how many failovers a client faced
- */
-static bool
-demoapp_update_client_failovers(const char *pguri, int clientId, int failovers)
-{
-	PGSQL pgsql = { 0 };
+	bool isLocal =
+		read_file_if_exists(pidFilePath, &contents, &fileSize) &&
+		strcmp(contents, pidContext.strVal) == 0;
 
-	char *sql = "update demo.client set failover_count = $2 where client = $1";
+	free(dirContext.strVal);
 
-	const Oid paramTypes[2] = { INT4OID, INT4OID };
-	const char *paramValues[2] = { 0 };
+	if (!isLocal)
+	{
+		log_error("The primary Postgres instance is not running on this host, "
+				  "use --fault-command to kill the primary");
 
-	paramValues[0] = intToString(clientId).strValue;
-	paramValues[1] = intToString(failovers).strValue;
+		free(pidContext.strVal);
 
-	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+		if (contents != NULL)
+		{
+			free(contents);
+		}
+		return false;
+	}
 
-	demoapp_set_retry_policy(&pgsql,
-							 DEMO_DEFAULT_RETRY_CAP_TIME,
-							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+	/* the first line of the postmaster.pid file is the postmaster pid */
+	int pid = 0;
 
-	if (!pgsql_execute_with_params(&pgsql, sql, 2, paramTypes, paramValues,
-								   NULL, NULL))
+	free(contents);
+
+	if (sscanf(pidContext.strVal, "%d", &pid) != 1)
 	{
-		/* errors have already been logged */
-		pgsql_finish(&pgsql);
+		log_error("Failed to parse the primary postmaster pid from \"%s\"",
+				  pidContext.strVal);
+		free(pidContext.strVal);
+		return false;
+	}
+
+	free(pidContext.strVal);
+
+	log_info("kill -9 %d", pid);
+
+	if (kill(pid, SIGKILL) != 0)
+	{
+		log_error("Failed to send SIGKILL to postmaster pid %d: %m", pid);
 		return false;
 	}
 
-	pgsql_finish(&pgsql);
 	return true;
 }
 
 
 /*
- * http://c-faq.com/lib/randrange.html
+ * demoapp_run_fault_command runs the given command with /bin/sh, with the
+ * environment variables PG_AUTOCTL_DEMO_PRIMARY_* set to the current primary.
  */
-#if PG_MAJORVERSION_NUM < 15
-#define random_between(M, N) \
-	((M) + pg_lrand48() / (RAND_MAX / ((N) -(M) +1) + 1))
-#else
-#define random_between(M, N) \
-	((M) + pg_prng_uint32(&prng_state) / (RAND_MAX / ((N) -(M) +1) + 1))
-#endif
+static bool
+demoapp_run_fault_command(const char *command)
+{
+	log_info("/bin/sh -c \"%s\"", command);
+
+	Program program = run_program("/bin/sh", "-c", command, NULL);
+
+	if (program.returnCode != 0)
+	{
+		log_error("Command \"%s\" failed with return code %d",
+				  command, program.returnCode);
+
+		if (program.stdErr != NULL)
+		{
+			log_error("%s", program.stdErr);
+		}
+
+		free_program(&program);
+		return false;
+	}
+
+	free_program(&program);
+	return true;
+}
+
 
 /*
- * demo_start_client starts a sub-process that implements our demo application:
- * the subprocess connects to Postgres and INSERT INTO our demo tracking table
- * some latency information.
+ * demoapp_register_fault inserts a row in the demo.fault table.
  */
-static void
-demoapp_start_client(const char *pguri, int clientId,
-					 DemoAppOptions *demoAppOptions)
+static bool
+demoapp_register_fault(const char *pguri, DemoFaultKind faultKind,
+					   NodeAddress *primary,
+					   double injected, double promoted, double healed)
 {
-	uint64_t startTime = time(NULL);
-	bool durationElapsed = false;
-	bool firstLoop = true;
+	PGSQL pgsql = { 0 };
 
-	uint64_t previousLogLineTime = 0;
+	char *sql =
+		"insert into demo.fault(kind, primary_node, injected, promoted, healed) "
+		"values($1, $2, to_timestamp($3::float8), "
+		"to_timestamp(nullif($4::float8, 0)), "
+		"to_timestamp(nullif($5::float8, 0)))";
 
-	int directs = 0;
-	int retries = 0;
-	int failovers = 0;
-	int maxConnectionTimeNoRetry = 0;
-	int maxConnectionTimeWithRetries = 0;
+	const Oid paramTypes[5] = {
+		TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID
+	};
+	const char *paramValues[5] = { 0 };
 
-	int retryCap = 200;         /* sleep up to 200ms between attempts */
-	int retrySleepTime = 500;   /* first retry happens after 500 ms */
+	char injectedStr[BUFSIZE] = { 0 };
+	char promotedStr[BUFSIZE] = { 0 };
+	char healedStr[BUFSIZE] = { 0 };
 
-	/* initialize a seed for our random number generator */
+	sformat(injectedStr, sizeof(injectedStr), "%.6f", injected);
+	sformat(promotedStr, sizeof(promotedStr), "%.6f", promoted);
+	sformat(healedStr, sizeof(healedStr), "%.6f", healed);
 
-#if PG_MAJORVERSION_NUM < 15
-	pg_srand48(((unsigned int) (getpid() ^ time(NULL))));
-#else
-	pg_prng_state prng_state;
+	paramValues[0] = demoapp_fault_kind_to_string(faultKind);
+	paramValues[1] = primary->name;
+	paramValues[2] = injectedStr;
+	paramValues[3] = promotedStr;
+	paramValues[4] = healedStr;
 
-	pg_prng_seed(&prng_state, (uint64) (getpid() ^ time(NULL)));
-#endif
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
 
-	/* pick a random retry policy for this client */
-	retryCap = random_between(50, 500);
-	retrySleepTime = random_between(500, 1500);
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
 
-	log_info("Client %d is using a retry policy with initial sleep time %d ms "
-			 "and a retry time capped at %d ms",
-			 clientId,
-			 retrySleepTime,
-			 retryCap);
+	bool success =
+		pgsql_execute_with_params(&pgsql, sql, 5, paramTypes, paramValues,
+								  NULL, NULL);
 
-	if (!demoapp_register_client(pguri, clientId, retrySleepTime, retryCap))
+	pgsql_finish(&pgsql);
+
+	/* errors have already been logged */
+	return success;
+}
+
+
+/*
+ * demoapp_parse_fault_kind parses the --fault option value.
+ */
+DemoFaultKind
+demoapp_parse_fault_kind(const char *kind)
+{
+	if (strcmp(kind, "switchover") == 0)
 	{
-		/* errors have already been logged */
-		exit(EXIT_CODE_INTERNAL_ERROR);
+		return DEMO_FAULT_SWITCHOVER;
 	}
-
-	for (int index = 0; !durationElapsed; index++)
+	else if (strcmp(kind, "kill") == 0)
 	{
-		PGSQL pgsql = { 0 };
-		bool is_in_recovery = false;
+		return DEMO_FAULT_KILL;
+	}
+	else if (strcmp(kind, "partition") == 0)
+	{
+		return DEMO_FAULT_PARTITION;
+	}
 
-		uint64_t now = time(NULL);
+	return DEMO_FAULT_UNKNOWN;
+}
 
-		if (firstLoop)
+
+/*
+ * demoapp_fault_kind_to_string returns the string representation of a fault
+ * kind, as used in the --fault option.
+ */
+const char *
+demoapp_fault_kind_to_string(DemoFaultKind kind)
+{
+	switch (kind)
+	{
+		case DEMO_FAULT_SWITCHOVER:
+		{
+			return "switchover";
+		}
+
+		case DEMO_FAULT_KILL:
+		{
+			return "kill";
+		}
+
+		case DEMO_FAULT_PARTITION:
+		{
+			return "partition";
+		}
+
+		default:
+		{
+			return "unknown";
+		}
+	}
+}
+
+
+/*
+ * demoapp_register_client registers a client with its retry policy
+ */
+static bool
+demoapp_register_client(const char *pguri,
+						int clientId, int retrySleep, int retryCap)
+{
+	PGSQL pgsql = { 0 };
+
+	char *sql =
+		"insert into demo.client(client, pid, retry_sleep_ms, retry_cap_ms) "
+		"values($1, $2, $3, $4)";
+
+	const Oid paramTypes[4] = { INT4OID, INT4OID, INT4OID, INT4OID };
+	const char *paramValues[4] = { 0 };
+
+	paramValues[0] = intToString(clientId).strValue;
+	paramValues[1] = intToString(getpid()).strValue;
+	paramValues[2] = intToString(retrySleep).strValue;
+	paramValues[3] = intToString(retryCap).strValue;
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	if (!pgsql_execute_with_params(&pgsql, sql, 4, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	pgsql_finish(&pgsql);
+	return true;
+}
+
+
+/*
+ * demoapp_update_client_stats registers how many failovers a client faced,
+ * how many transactions it ran, and its latency histogram.
+ */
+static bool
+demoapp_update_client_stats(const char *pguri, int clientId,
+							DemoClientStats *stats)
+{
+	PGSQL pgsql = { 0 };
+
+	char *sql =
+		"update demo.client "
+		"set failover_count = $2, reads = $3, writes = $4, errors = $5, "
+		"latency_histogram = $6, updates = $7, duration_s = $8 "
+		"where client = $1";
+
+	const Oid paramTypes[8] = {
+		INT4OID, INT4OID, INT8OID, INT8OID, INT8OID, TEXTOID, INT8OID, FLOAT8OID
+	};
+	const char *paramValues[8] = { 0 };
+	char elapsed[BUFSIZE] = { 0 };
+
+	PQExpBuffer histogram = createPQExpBuffer();
+
+	(void) demoapp_histogram_to_json(&(stats->latency), histogram);
+
+	if (PQExpBufferBroken(histogram))
+	{
+		log_error("Failed to prepare client %d latency histogram: "
+				  "out of memory", clientId);
+		destroyPQExpBuffer(histogram);
+		return false;
+	}
+
+	paramValues[0] = intToString(clientId).strValue;
+	paramValues[1] = intToString(stats->failovers).strValue;
+	paramValues[2] = intToString(stats->reads).strValue;
+	paramValues[3] = intToString(stats->writes).strValue;
+	paramValues[4] = intToString(stats->errors).strValue;
+	paramValues[5] = histogram->data;
+	paramValues[6] = intToString(stats->updates).strValue;
+
+	sformat(elapsed, sizeof(elapsed), "%.3f", stats->elapsed);
+	paramValues[7] = elapsed;
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	bool success =
+		pgsql_execute_with_params(&pgsql, sql, 8, paramTypes, paramValues,
+								  NULL, NULL);
+
+	pgsql_finish(&pgsql);
+	destroyPQExpBuffer(histogram);
+
+	/* errors have already been logged */
+	return success;
+}
+
+
+/*
+ * demoapp_insert_acked_writes registers the writes for which a client
+ * received a commit acknowledgement, in order to compute the RPO.
+ */
+static bool
+demoapp_insert_acked_writes(const char *pguri, int clientId,
+							DemoAckedWriteArray *ackedArray)
+{
+	PGSQL pgsql = { 0 };
+
+	char *sql =
+		"insert into demo.acked(client, loop, acked_at, outage) "
+		"select $1, loop, to_timestamp(acked_at), outage "
+		"from unnest($2::integer[], $3::float8[], $4::bool[]) "
+		"as t(loop, acked_at, outage)";
+
+	const Oid paramTypes[4] = { INT4OID, TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[4] = { 0 };
+
+	PQExpBuffer loops = createPQExpBuffer();
+	PQExpBuffer ackedAt = createPQExpBuffer();
+	PQExpBuffer outages = createPQExpBuffer();
+
+	appendPQExpBufferChar(loops, '{');
+	appendPQExpBufferChar(ackedAt, '{');
+	appendPQExpBufferChar(outages, '{');
+
+	for (int i = 0; i < ackedArray->count; i++)
+	{
+		DemoAckedWrite *acked = &(ackedArray->writes[i]);
+		const char *sep = i == 0 ? "" : ",";
+
+		appendPQExpBuffer(loops, "%s%d", sep, acked->loop);
+		appendPQExpBuffer(ackedAt, "%s%.6f", sep, acked->ackedAt);
+		appendPQExpBuffer(outages, "%s%s", sep, acked->outage ? "t" : "f");
+	}
+
+	appendPQExpBufferChar(loops, '}');
+	appendPQExpBufferChar(ackedAt, '}');
+	appendPQExpBufferChar(outages, '}');
+
+	if (PQExpBufferBroken(loops) ||
+		PQExpBufferBroken(ackedAt) ||
+		PQExpBufferBroken(outages))
+	{
+		log_error("Failed to prepare client %d acknowledged writes: "
+				  "out of memory", clientId);
+		destroyPQExpBuffer(loops);
+		destroyPQExpBuffer(ackedAt);
+		destroyPQExpBuffer(outages);
+		return false;
+	}
+
+	paramValues[0] = intToString(clientId).strValue;
+	paramValues[1] = loops->data;
+	paramValues[2] = ackedAt->data;
+	paramValues[3] = outages->data;
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	bool success =
+		pgsql_execute_with_params(&pgsql, sql, 4, paramTypes, paramValues,
+								  NULL, NULL);
+
+	pgsql_finish(&pgsql);
+
+	destroyPQExpBuffer(loops);
+	destroyPQExpBuffer(ackedAt);
+	destroyPQExpBuffer(outages);
+
+	/* errors have already been logged */
+	return success;
+}
+
+
+/*
+ * demoapp_acked_writes_append appends a write to the given array, growing the
+ * array as needed.
+ */
+static bool
+demoapp_acked_writes_append(DemoAckedWriteArray *ackedArray,
+							int loop, double ackedAt, bool outage)
+{
+	if (ackedArray->count == ackedArray->capacity)
+	{
+		int capacity = ackedArray->capacity == 0 ? 1024 : 2 * ackedArray->capacity;
+		DemoAckedWrite *writes =
+			(DemoAckedWrite *) realloc(ackedArray->writes,
+									   capacity * sizeof(DemoAckedWrite));
+
+		if (writes == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		ackedArray->writes = writes;
+		ackedArray->capacity = capacity;
+	}
+
+	DemoAckedWrite *acked = &(ackedArray->writes[ackedArray->count++]);
+
+	acked->loop = loop;
+	acked->ackedAt = ackedAt;
+	acked->outage = outage;
+
+	return true;
+}
+
+
+/*
+ * The latency histograms use the HDR histogram layout: values below
+ * DEMO_HISTOGRAM_SUB_BUCKETS microseconds have their own bucket, and then each
+ * power of two range is split in DEMO_HISTOGRAM_SUB_BUCKETS / 2 buckets, for
+ * a precision of about 3% whatever the magnitude of the latency.
+ */
+static int
+demoapp_histogram_index(uint64_t us)
+{
+	const uint64_t halfCount = DEMO_HISTOGRAM_SUB_BUCKETS / 2;
+	int shift = 0;
+
+	if (us >> DEMO_HISTOGRAM_MAX_SHIFT >= DEMO_HISTOGRAM_SUB_BUCKETS)
+	{
+		us = ((uint64_t) DEMO_HISTOGRAM_SUB_BUCKETS << DEMO_HISTOGRAM_MAX_SHIFT) - 1;
+	}
+
+	if (us < DEMO_HISTOGRAM_SUB_BUCKETS)
+	{
+		return (int) us;
+	}
+
+	while ((us >> shift) >= DEMO_HISTOGRAM_SUB_BUCKETS)
+	{
+		++shift;
+	}
+
+	return (int) ((shift + 1) * halfCount + (us >> shift) - halfCount);
+}
+
+
+/*
+ * demoapp_histogram_bucket_value returns the lowest value of the given
+ * histogram bucket, in microseconds.
+ */
+static uint64_t
+demoapp_histogram_bucket_value(int index)
+{
+	const int halfCount = DEMO_HISTOGRAM_SUB_BUCKETS / 2;
+
+	if (index < DEMO_HISTOGRAM_SUB_BUCKETS)
+	{
+		return (uint64_t) index;
+	}
+
+	int shift = index / halfCount - 1;
+	uint64_t subBucket = index % halfCount + halfCount;
+
+	return subBucket << shift;
+}
+
+
+/*
+ * demoapp_histogram_record records a latency in the given histogram.
+ */
+static void
+demoapp_histogram_record(DemoHistogram *histogram, instr_time duration)
+{
+	uint64_t us = (uint64_t) INSTR_TIME_GET_MICROSEC(duration);
+
+	++histogram->counts[demoapp_histogram_index(us)];
+}
+
+
+/*
+ * demoapp_histogram_to_json appends the non-empty buckets of the given
+ * histogram to the buffer, as a JSON array of [microseconds, count] arrays.
+ */
+static void
+demoapp_histogram_to_json(DemoHistogram *histogram, PQExpBuffer buffer)
+{
+	bool first = true;
+
+	appendPQExpBufferChar(buffer, '[');
+
+	for (int index = 0; index < DEMO_HISTOGRAM_BUCKETS; index++)
+	{
+		if (histogram->counts[index] == 0)
+		{
+			continue;
+		}
+
+		appendPQExpBuffer(buffer, "%s[%" PRIu64 ", %" PRIu64 "]",
+						  first ? "" : ", ",
+						  demoapp_histogram_bucket_value(index),
+						  histogram->counts[index]);
+		first = false;
+	}
+
+	appendPQExpBufferChar(buffer, ']');
+}
+
+
+/*
+ * demoapp_histogram_from_json parses a histogram in the format that
+ * demoapp_histogram_to_json() produces.
+ */
+static bool
+demoapp_histogram_from_json(const char *json, DemoHistogram *histogram)
+{
+	JSON_Value *js = json_parse_string(json);
+	JSON_Array *jsArray = json_value_get_array(js);
+
+	if (jsArray == NULL)
+	{
+		json_value_free(js);
+		return false;
+	}
+
+	for (size_t i = 0; i < json_array_get_count(jsArray); i++)
+	{
+		JSON_Array *bucket = json_array_get_array(jsArray, i);
+
+		if (bucket == NULL || json_array_get_count(bucket) != 2)
+		{
+			json_value_free(js);
+			return false;
+		}
+
+		uint64_t us = (uint64_t) json_array_get_number(bucket, 0);
+		uint64_t count = (uint64_t) json_array_get_number(bucket, 1);
+
+		histogram->counts[demoapp_histogram_index(us)] += count;
+	}
+
+	json_value_free(js);
+
+	return true;
+}
+
+
+/*
+ * demoapp_histogram_merge adds the counts of the source histogram to the
+ * target histogram.
+ */
+static void
+demoapp_histogram_merge(DemoHistogram *target, DemoHistogram *source)
+{
+	for (int index = 0; index < DEMO_HISTOGRAM_BUCKETS; index++)
+	{
+		target->counts[index] += source->counts[index];
+	}
+}
+
+
+/*
+ * demoapp_histogram_count returns how many latencies have been recorded in
+ * the given histogram.
+ */
+static uint64_t
+demoapp_histogram_count(DemoHistogram *histogram)
+{
+	uint64_t count = 0;
+
+	for (int index = 0; index < DEMO_HISTOGRAM_BUCKETS; index++)
+	{
+		count += histogram->counts[index];
+	}
+
+	return count;
+}
+
+
+/*
+ * demoapp_histogram_percentile returns the lowest value of the bucket where
+ * the given quantile of the recorded latencies is reached, in microseconds,
+ * as the demo.latency_summary() SQL function does.
+ */
+static uint64_t
+demoapp_histogram_percentile(DemoHistogram *histogram, double quantile)
+{
+	double threshold = quantile * demoapp_histogram_count(histogram);
+	uint64_t cumulative = 0;
+
+	for (int index = 0; index < DEMO_HISTOGRAM_BUCKETS; index++)
+	{
+		cumulative += histogram->counts[index];
+
+		if (histogram->counts[index] > 0 && cumulative >= threshold)
+		{
+			return demoapp_histogram_bucket_value(index);
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * demoapp_histogram_max returns the lowest value of the highest non-empty
+ * bucket of the given histogram, in microseconds.
+ */
+static uint64_t
+demoapp_histogram_max(DemoHistogram *histogram)
+{
+	for (int index = DEMO_HISTOGRAM_BUCKETS - 1; index >= 0; index--)
+	{
+		if (histogram->counts[index] > 0)
+		{
+			return demoapp_histogram_bucket_value(index);
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * demoapp_now returns the current time in seconds since the Unix epoch, with
+ * a microsecond precision. That's the client clock used for the RTO and RPO
+ * measurements.
+ */
+static double
+demoapp_now(void)
+{
+	struct timeval now = { 0 };
+
+	(void) gettimeofday(&now, NULL);
+
+	return (double) now.tv_sec + (double) now.tv_usec / 1000000.0;
+}
+
+
+/*
+ * http://c-faq.com/lib/randrange.html
+ */
+#if PG_MAJORVERSION_NUM < 15
+#define random_between(M, N) \
+	((M) + pg_lrand48() / (RAND_MAX / ((N) -(M) +1) + 1))
+#else
+#define random_between(M, N) \
+	((M) + pg_prng_uint32(&prng_state) / (RAND_MAX / ((N) -(M) +1) + 1))
+#endif
+
+/*
+ * demoapp_transaction_kind returns which transaction to run next, given a
+ * random number between 1 and 100 and the --read-ratio and --update-ratio
+ * options.
+ */
+static DemoTransactionKind
+demoapp_transaction_kind(DemoAppOptions *options, int dice)
+{
+	if (dice <= options->readRatio)
+	{
+		return DEMO_TXN_READ;
+	}
+
+	if (dice <= options->readRatio + options->updateRatio)
+	{
+		return DEMO_TXN_UPDATE;
+	}
+
+	return DEMO_TXN_INSERT;
+}
+
+
+/*
+ * demo_start_client starts a sub-process that implements our demo application:
+ * the subprocess connects to Postgres and either INSERT INTO our demo tracking
+ * table some latency information, or reads its latest entry from there.
+ */
+static void
+demoapp_start_client(const char *pguri, int clientId,
+					 DemoAppOptions *demoAppOptions)
+{
+	uint64_t startTime = time(NULL);
+	bool durationElapsed = false;
+	bool firstLoop = true;
+
+	uint64_t previousLogLineTime = 0;
+
+	int directs = 0;
+	int retries = 0;
+	int maxConnectionTimeNoRetry = 0;
+	int maxConnectionTimeWithRetries = 0;
+
+	int retryCap = 200;         /* sleep up to 200ms between attempts */
+	int retrySleepTime = 500;   /* first retry happens after 500 ms */
+
+	/* the next acknowledged write is the first one after an outage */
+	bool outage = false;
+	char lastServer[BUFSIZE] = { 0 };
+
+	DemoClientStats *stats = (DemoClientStats *) calloc(1, sizeof(DemoClientStats));
+	DemoAckedWriteArray ackedArray = { 0 };
+
+	if (stats == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* initialize a seed for our random number generator */
+
+#if PG_MAJORVERSION_NUM < 15
+	pg_srand48(((unsigned int) (getpid() ^ time(NULL))));
+#else
+	pg_prng_state prng_state;
+
+	pg_prng_seed(&prng_state, (uint64) (getpid() ^ time(NULL)));
+#endif
+
+	/* pick a random retry policy for this client */
+	retryCap = random_between(50, 500);
+	retrySleepTime = random_between(500, 1500);
+
+	log_info("Client %d is using a retry policy with initial sleep time %d ms "
+			 "and a retry time capped at %d ms",
+			 clientId,
+			 retrySleepTime,
+			 retryCap);
+
+	if (!demoapp_register_client(pguri, clientId, retrySleepTime, retryCap))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	instr_time runStart;
+
+	INSTR_TIME_SET_CURRENT(runStart);
+
+	for (int index = 0; !durationElapsed; index++)
+	{
+		PGSQL pgsql = { 0 };
+		bool is_in_recovery = false;
+
+		uint64_t now = time(NULL);
+
+		if (firstLoop)
 		{
 			firstLoop = false;
 		}
 		else
 		{
-			int sleepTimeMs = random_between(10, 200);
-			pg_usleep(sleepTimeMs * 1000);
+			int sleepTimeMs = random_between(10, 200);
+			pg_usleep(sleepTimeMs * 1000);
+		}
+
+		if ((now - startTime) > demoAppOptions->duration)
+		{
+			durationElapsed = true;
+			break;
+		}
+
+		DemoTransactionKind kind =
+			demoapp_transaction_kind(demoAppOptions, random_between(1, 100));
+
+		/* use the retry policy for a REMOTE node */
+		pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+		demoapp_set_retry_policy(&pgsql, retryCap, retrySleepTime);
+
+		if (!pgsql_is_in_recovery(&pgsql, &is_in_recovery))
+		{
+			/* errors have already been logged */
+			++stats->errors;
+			outage = true;
+			continue;
+		}
+
+		instr_time duration = pgsql.retryPolicy.connectTime;
+		INSTR_TIME_SUBTRACT(duration, pgsql.retryPolicy.startTime);
+
+		if (pgsql.retryPolicy.attempts == 0)
+		{
+			++directs;
+
+			/* we could connect without retries, everything is fine */
+			if (maxConnectionTimeNoRetry == 0 ||
+				INSTR_TIME_GET_MILLISEC(duration) > maxConnectionTimeNoRetry)
+			{
+				maxConnectionTimeNoRetry = INSTR_TIME_GET_MILLISEC(duration);
+			}
+
+			/* log every 2s max, to avoid filling in the logs */
+			if (previousLogLineTime == 0 ||
+				(now - previousLogLineTime) >= 10)
+			{
+				if (stats->failovers == 0)
+				{
+					log_info("Client %d connected %d times in less than %d ms, "
+							 "before first failover",
+							 clientId, directs, maxConnectionTimeNoRetry);
+				}
+				else
+				{
+					log_info("Client %d connected %d times in less than %d ms, "
+							 "after %d failover(s)",
+							 clientId,
+							 directs,
+							 maxConnectionTimeNoRetry,
+							 stats->failovers);
+				}
+
+				previousLogLineTime = now;
+			}
+		}
+		else
+		{
+			/* we had to retry connecting, a failover is in progress */
+			++stats->failovers;
+			retries += pgsql.retryPolicy.attempts;
+			outage = true;
+
+			if (maxConnectionTimeWithRetries == 0 ||
+				INSTR_TIME_GET_MILLISEC(duration) > maxConnectionTimeWithRetries)
+			{
+				maxConnectionTimeWithRetries = INSTR_TIME_GET_MILLISEC(duration);
+			}
+
+			log_info("Client %d attempted to connect during a failover, "
+					 "and had to attempt %d times which took %5.3f ms with "
+					 "the current retry policy",
+					 clientId,
+					 pgsql.retryPolicy.attempts,
+					 INSTR_TIME_GET_MILLISEC(duration));
+		}
+
+		if (kind == DEMO_TXN_READ || kind == DEMO_TXN_UPDATE)
+		{
+			const char *sql = kind == DEMO_TXN_READ ? demoReadSQL : demoUpdateSQL;
+
+			const Oid paramTypes[1] = { INT4OID };
+			const char *paramValues[1] = { 0 };
+
+			paramValues[0] = intToString(clientId).strValue;
+
+			if (pgsql_execute_with_params(&pgsql, sql, 1, paramTypes, paramValues,
+										  NULL, NULL))
+			{
+				instr_time latency;
+
+				INSTR_TIME_SET_CURRENT(latency);
+				INSTR_TIME_SUBTRACT(latency, pgsql.retryPolicy.startTime);
+
+				if (kind == DEMO_TXN_READ)
+				{
+					++stats->reads;
+				}
+				else
+				{
+					++stats->updates;
+				}
+				(void) demoapp_histogram_record(&(stats->latency), latency);
+			}
+			else
+			{
+				/* errors have already been logged */
+				++stats->errors;
+				outage = true;
+			}
+		}
+		else
+		{
+			SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+			const char *paramValues[5] = { 0 };
+
+			paramValues[0] = intToString(clientId).strValue;
+			paramValues[1] = intToString(index).strValue;
+			paramValues[2] = intToString(pgsql.retryPolicy.attempts).strValue;
+			paramValues[3] = intToString(INSTR_TIME_GET_MICROSEC(duration)).strValue;
+			paramValues[4] = is_in_recovery ? "true" : "false";
+
+			if (pgsql_execute_with_params(&pgsql, demoInsertSQL, 5,
+										  demoInsertParamTypes, paramValues,
+										  &context, &parseSingleValueResult) &&
+				context.parsedOk)
+			{
+				instr_time latency;
+
+				INSTR_TIME_SET_CURRENT(latency);
+				INSTR_TIME_SUBTRACT(latency, pgsql.retryPolicy.startTime);
+
+				++stats->writes;
+				(void) demoapp_histogram_record(&(stats->latency), latency);
+
+				/* writes going to another server means a failover happened */
+				if (!IS_EMPTY_STRING_BUFFER(lastServer) &&
+					strcmp(lastServer, context.strVal) != 0)
+				{
+					outage = true;
+				}
+
+				strlcpy(lastServer, context.strVal, sizeof(lastServer));
+
+				if (!demoapp_acked_writes_append(&ackedArray, index,
+												 demoapp_now(), outage))
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				outage = false;
+			}
+			else
+			{
+				/* errors have already been logged */
+				++stats->errors;
+				outage = true;
+			}
+
+			if (context.strVal != NULL)
+			{
+				free(context.strVal);
+			}
+		}
+
+		/* the idea is to reconnect every time */
+		pgsql_finish(&pgsql);
+	}
+
+	instr_time elapsed;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, runStart);
+	stats->elapsed = INSTR_TIME_GET_DOUBLE(elapsed);
+
+	if (!demoapp_update_client_stats(pguri, clientId, stats))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!demoapp_insert_acked_writes(pguri, clientId, &ackedArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	log_info("Client %d connected on first attempt %d times "
+			 "with a maximum connection time of %d ms",
+			 clientId, directs, maxConnectionTimeNoRetry);
+
+	log_info("Client %d is using a retry policy with initial sleep time %d ms "
+			 "and a retry time capped at %d ms",
+			 clientId,
+			 retrySleepTime,
+			 retryCap);
+
+	log_info("Client %d attempted to connect during a failover %d times "
+			 "with a maximum connection time of %d ms and a total number "
+			 "of %d retries",
+			 clientId, stats->failovers, maxConnectionTimeWithRetries, retries);
+
+	log_info("Client %d ran %" PRId64 " reads, %" PRId64 " writes "
+			 "and %" PRId64 " updates, and %" PRId64 " transactions failed",
+			 clientId, stats->reads, stats->writes, stats->updates,
+			 stats->errors);
+
+	free(ackedArray.writes);
+	free(stats);
+}
+
+
+/*
+ * demoapp_start_pipeline_client starts a sub-process that implements the
+ * pipelined variant of our demo application: the sub-process keeps a single
+ * connection open, and sends --batch-size transactions at a time without
+ * waiting for the results in between, in a single network round trip.
+ *
+ * When the connection is lost, the client connects again using its retry
+ * policy, and counts that as a failover, same as demoapp_start_client.
+ */
+static void
+demoapp_start_pipeline_client(const char *pguri, int clientId,
+							  DemoAppOptions *demoAppOptions)
+{
+	PGSQL pgsql = { 0 };
+	bool is_in_recovery = false;
+
+	uint64_t startTime = time(NULL);
+	int batchSize = demoAppOptions->batchSize;
+
+	int loop = 0;
+	int batches = 0;
+	int connections = 0;
+	int retries = 0;
+	int attempts = 0;
+	int64_t connectionTimeUs = 0;
+
+	/* the next acknowledged write is the first one after an outage */
+	bool outage = false;
+	char lastServer[BUFSIZE] = { 0 };
+
+	DemoClientStats *stats = (DemoClientStats *) calloc(1, sizeof(DemoClientStats));
+	DemoTransaction *txns =
+		(DemoTransaction *) calloc(batchSize, sizeof(DemoTransaction));
+	PGSQLQuery *queries = (PGSQLQuery *) calloc(batchSize, sizeof(PGSQLQuery));
+	DemoAckedWriteArray ackedArray = { 0 };
+
+	if (stats == NULL || txns == NULL || queries == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* initialize a seed for our random number generator */
+
+#if PG_MAJORVERSION_NUM < 15
+	pg_srand48(((unsigned int) (getpid() ^ time(NULL))));
+#else
+	pg_prng_state prng_state;
+
+	pg_prng_seed(&prng_state, (uint64) (getpid() ^ time(NULL)));
+#endif
+
+	/* pick a random retry policy for this client */
+	int retryCap = random_between(50, 500);
+	int retrySleepTime = random_between(500, 1500);
+
+	log_info("Client %d is using a retry policy with initial sleep time %d ms "
+			 "and a retry time capped at %d ms",
+			 clientId,
+			 retrySleepTime,
+			 retryCap);
+
+	if (!demoapp_register_client(pguri, clientId, retrySleepTime, retryCap))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	instr_time runStart;
+	instr_time batchStart;
+
+	INSTR_TIME_SET_CURRENT(runStart);
+
+	while ((uint64_t) time(NULL) - startTime <= demoAppOptions->duration)
+	{
+		if (pgsql.connection == NULL)
+		{
+			/* use the retry policy for a REMOTE node */
+			pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+			pgsql.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+			demoapp_set_retry_policy(&pgsql, retryCap, retrySleepTime);
+
+			if (!pgsql_is_in_recovery(&pgsql, &is_in_recovery))
+			{
+				/* errors have already been logged */
+				++stats->errors;
+				outage = true;
+				pgsql_finish(&pgsql);
+				continue;
+			}
+
+			instr_time duration = pgsql.retryPolicy.connectTime;
+			INSTR_TIME_SUBTRACT(duration, pgsql.retryPolicy.startTime);
+
+			++connections;
+			attempts = pgsql.retryPolicy.attempts;
+			connectionTimeUs = INSTR_TIME_GET_MICROSEC(duration);
+
+			if (attempts > 0)
+			{
+				/* we had to retry connecting, a failover is in progress */
+				++stats->failovers;
+				retries += attempts;
+				outage = true;
+
+				log_info("Client %d attempted to connect during a failover, "
+						 "and had to attempt %d times which took %5.3f ms with "
+						 "the current retry policy",
+						 clientId,
+						 attempts,
+						 INSTR_TIME_GET_MILLISEC(duration));
+			}
 		}
 
-		if ((now - startTime) > demoAppOptions->duration)
+		for (int i = 0; i < batchSize; i++)
 		{
-			durationElapsed = true;
-			break;
-		}
+			DemoTransaction *txn = &(txns[i]);
 
-		/* use the retry policy for a REMOTE node */
-		pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
-		demoapp_set_retry_policy(&pgsql, retryCap, retrySleepTime);
+			txn->kind =
+				demoapp_transaction_kind(demoAppOptions, random_between(1, 100));
+			txn->loop = loop++;
+			txn->batchStart = &batchStart;
+			txn->latency = &(stats->latency);
 
-		if (!pgsql_is_in_recovery(&pgsql, &is_in_recovery))
-		{
-			/* errors have already been logged */
-			continue;
+			(void) demoapp_prepare_transaction(txn, &(queries[i]), clientId,
+											   attempts, connectionTimeUs,
+											   is_in_recovery);
+
+			queries[i].prepare = demoAppOptions->prepared;
 		}
 
-		instr_time duration = pgsql.retryPolicy.connectTime;
-		INSTR_TIME_SUBTRACT(duration, pgsql.retryPolicy.startTime);
+		INSTR_TIME_SET_CURRENT(batchStart);
 
-		if (pgsql.retryPolicy.attempts == 0)
+		/* errors have already been logged, we count them below */
+		bool success = pgsql_execute_pipeline(&pgsql, queries, batchSize);
+
+		++batches;
+
+		for (int i = 0; i < batchSize; i++)
 		{
-			++directs;
+			DemoTransaction *txn = &(txns[i]);
 
-			/* we could connect without retries, everything is fine */
-			if (maxConnectionTimeNoRetry == 0 ||
-				INSTR_TIME_GET_MILLISEC(duration) > maxConnectionTimeNoRetry)
+			if (!txn->done)
 			{
-				maxConnectionTimeNoRetry = INSTR_TIME_GET_MILLISEC(duration);
+				++stats->errors;
+				outage = true;
+				continue;
 			}
 
-			/* log every 2s max, to avoid filling in the logs */
-			if (previousLogLineTime == 0 ||
-				(now - previousLogLineTime) >= 10)
+			switch (txn->kind)
 			{
-				if (failovers == 0)
+				case DEMO_TXN_READ:
 				{
-					log_info("Client %d connected %d times in less than %d ms, "
-							 "before first failover",
-							 clientId, directs, maxConnectionTimeNoRetry);
+					++stats->reads;
+					break;
 				}
-				else
+
+				case DEMO_TXN_UPDATE:
 				{
-					log_info("Client %d connected %d times in less than %d ms, "
-							 "after %d failover(s)",
-							 clientId,
-							 directs,
-							 maxConnectionTimeNoRetry,
-							 failovers);
+					++stats->updates;
+					break;
 				}
 
-				previousLogLineTime = now;
+				case DEMO_TXN_INSERT:
+				{
+					++stats->writes;
+
+					/* writes going to another server means a failover happened */
+					if (!IS_EMPTY_STRING_BUFFER(lastServer) &&
+						strcmp(lastServer, txn->server) != 0)
+					{
+						outage = true;
+					}
+
+					strlcpy(lastServer, txn->server, sizeof(lastServer));
+
+					if (!demoapp_acked_writes_append(&ackedArray, txn->loop,
+													 txn->ackedAt, outage))
+					{
+						/* errors have already been logged */
+						exit(EXIT_CODE_INTERNAL_ERROR);
+					}
+
+					outage = false;
+					break;
+				}
 			}
 		}
-		else
+
+		/*
+		 * After a failed batch we connect again, which gets us to the new
+		 * primary after a failover, rather than sending more transactions to
+		 * a node that can't accept them anymore.
+		 */
+		if (!success)
 		{
-			/* we had to retry connecting, a failover is in progress */
-			++failovers;
-			retries += pgsql.retryPolicy.attempts;
+			pgsql_finish(&pgsql);
+		}
+	}
 
-			if (maxConnectionTimeWithRetries == 0 ||
-				INSTR_TIME_GET_MILLISEC(duration) > maxConnectionTimeWithRetries)
-			{
-				maxConnectionTimeWithRetries = INSTR_TIME_GET_MILLISEC(duration);
-			}
+	pgsql_finish(&pgsql);
 
-			log_info("Client %d attempted to connect during a failover, "
-					 "and had to attempt %d times which took %5.3f ms with "
-					 "the current retry policy",
-					 clientId,
-					 pgsql.retryPolicy.attempts,
-					 INSTR_TIME_GET_MILLISEC(duration));
+	instr_time elapsed;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, runStart);
+	stats->elapsed = INSTR_TIME_GET_DOUBLE(elapsed);
+
+	if (!demoapp_update_client_stats(pguri, clientId, stats))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!demoapp_insert_acked_writes(pguri, clientId, &ackedArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	int64_t transactionsCount = stats->reads + stats->writes + stats->updates;
+
+	log_info("Client %d sent %d batches of %d transactions on %d connection(s), "
+			 "and connected during a failover %d times with a total number "
+			 "of %d retries",
+			 clientId, batches, batchSize, connections,
+			 stats->failovers, retries);
+
+	log_info("Client %d ran %" PRId64 " reads, %" PRId64 " writes "
+			 "and %" PRId64 " updates (%.1f tps), "
+			 "and %" PRId64 " transactions failed",
+			 clientId, stats->reads, stats->writes, stats->updates,
+			 stats->elapsed > 0 ? transactionsCount / stats->elapsed : 0.0,
+			 stats->errors);
+
+	free(ackedArray.writes);
+	free(queries);
+	free(txns);
+	free(stats);
+}
+
+
+/*
+ * demoapp_prepare_transaction fills-in the query to send for the given
+ * transaction, which kind and loop number have been set already.
+ */
+static void
+demoapp_prepare_transaction(DemoTransaction *txn, PGSQLQuery *query,
+							int clientId, int retries, int64_t connectionTimeUs,
+							bool is_in_recovery)
+{
+	static const Oid clientParamTypes[1] = { INT4OID };
+
+	txn->done = false;
+	txn->ackedAt = 0;
+	txn->server[0] = '\0';
+
+	txn->params[0] = intToString(clientId);
+	txn->paramValues[0] = txn->params[0].strValue;
+
+	switch (txn->kind)
+	{
+		case DEMO_TXN_READ:
+		case DEMO_TXN_UPDATE:
+		{
+			query->sql = txn->kind == DEMO_TXN_READ ? demoReadSQL : demoUpdateSQL;
+			query->paramCount = 1;
+			query->paramTypes = clientParamTypes;
+			break;
+		}
+
+		case DEMO_TXN_INSERT:
+		{
+			txn->params[1] = intToString(txn->loop);
+			txn->params[2] = intToString(retries);
+			txn->params[3] = intToString(connectionTimeUs);
+
+			txn->paramValues[1] = txn->params[1].strValue;
+			txn->paramValues[2] = txn->params[2].strValue;
+			txn->paramValues[3] = txn->params[3].strValue;
+			txn->paramValues[4] = is_in_recovery ? "true" : "false";
+
+			query->sql = demoInsertSQL;
+			query->paramCount = 5;
+			query->paramTypes = demoInsertParamTypes;
+			break;
+		}
+	}
+
+	query->paramValues = txn->paramValues;
+	query->context = txn;
+	query->parseFun = &demoapp_parse_transaction_result;
+}
+
+
+/*
+ * demoapp_parse_transaction_result is called when a pipelined transaction has
+ * been successful. The latency of each transaction of a batch is measured from
+ * the beginning of the batch, as that's what the application waits for.
+ */
+static void
+demoapp_parse_transaction_result(void *ctx, PGresult *result)
+{
+	DemoTransaction *txn = (DemoTransaction *) ctx;
+	instr_time latency;
+
+	INSTR_TIME_SET_CURRENT(latency);
+	INSTR_TIME_SUBTRACT(latency, *(txn->batchStart));
+
+	(void) demoapp_histogram_record(txn->latency, latency);
+
+	txn->done = true;
+	txn->ackedAt = demoapp_now();
+
+	if (txn->kind == DEMO_TXN_INSERT &&
+		PQntuples(result) == 1 &&
+		PQnfields(result) == 1)
+	{
+		strlcpy(txn->server, PQgetvalue(result, 0, 0), sizeof(txn->server));
+	}
+}
+
+
+/*
+ * demoapp_print_histogram prints an histogram of the distribution of the
+ * connection timings measured throughout the testing.
+ */
+void
+demoapp_print_histogram(const char *pguri, DemoAppOptions *demoAppOptions)
+{
+	const char *sqlFormatString =
+
+		/* *INDENT-OFF* */
+		"with minmax as ( select min(us), max(us) from demo.tracking ), "
+		"histogram as ( "
+		"select width_bucket(us, min, max, 18) as bucket, "
+		"round(min(us)/1000.0, 3) as min, "
+		"round(max(us)/1000.0, 3) as max, "
+		"count(*) as freq "
+		"from demo.tracking, minmax "
+		"group by bucket "
+		"order by bucket "
+		") "
+		"select min as \"Min Connect Time (ms)\", max, freq, "
+        "repeat('▒', "
+		"(freq::float / max(freq) over() * %d)::int "
+        ") as bar "
+		"from histogram; ";
+		/* *INDENT-ON* */
+
+		/* the first columns take up 45 columns already, use what's remaining */
+		int cols = demoapp_get_terminal_columns() - 45;
+
+	char sql[BUFSIZE] = { 0 };
+
+	sformat(sql, sizeof(sql), sqlFormatString, cols);
+
+	(void) demoapp_print_query(pguri, sql);
+}
+
+
+#define P95 "percentile_cont(0.95) within group (order by us::float8) / 1000.0"
+#define P99 "percentile_cont(0.99) within group (order by us::float8) / 1000.0"
+
+/*
+ * demoapp_print_summary prints a summar of what happened during the run.
+ */
+void
+demoapp_print_summary(const char *pguri, DemoAppOptions *demoAppOptions)
+{
+	const char *sql =
+
+		/* *INDENT-OFF* */
+		"with stats as( "
+		"select client, "
+		"count(*) as conn, "
+		"sum(retries), "
+		"round(min(us)/1000.0, 3) as min, "
+		"round(max(us)/1000.0, 3) as max, "
+		"round((" P95 ")::numeric, 3) as p95, "
+		"round((" P99 ")::numeric, 3) as p99 "
+		"from demo.tracking "
+		"group by rollup(client) "
+		") "
+		"select "
+		"case when client is not null then format('Client %s', client) "
+		"else ('All Clients Combined') end as \"Client\", "
+		"conn as \"Connections\", "
+		/* "failover_count as \"Failovers\", " */
+		/* "retry_sleep_ms as \"Retry Sleep (ms)\", " */
+		/* "retry_cap_ms as \"Retry Cap (ms)\", " */
+		"sum as \"Retries\", "
+		"min as \"Min Connect Time (ms)\", max, p95, p99 "
+		"from stats left join demo.client using(client) "
+		"order by client nulls last";
+		/* *INDENT-ON* */
+
+	const char *workloadSql =
+		"select client, reads, writes, updates, errors, duration_s, "
+		"latency_histogram::text "
+		"from demo.client "
+		"order by client";
+
+	log_info("Summary for the demo app running with %d clients for %ds",
+			 demoAppOptions->clientsCount, demoAppOptions->duration);
+
+	(void) demoapp_print_query(pguri, sql);
+
+	/*
+	 * The workload summary is computed here from the latency histograms and
+	 * transaction counts that each client registered.
+	 */
+	PGSQL pgsql = { 0 };
+	DemoWorkloadSummary summary = { 0 };
+
+	const char *headers[] = {
+		"Client", "Reads", "Writes", "Updates", "Errors", "TPS",
+		"p50 (ms)", "p99 (ms)", "max (ms)"
+	};
+
+	summary.table.columns = sizeof(headers) / sizeof(headers[0]);
+
+	for (int i = 0; i < summary.table.columns; i++)
+	{
+		summary.table.headers[i] = headers[i];
+		summary.table.alignRight[i] = i > 0;
+	}
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	if (pgsql_execute_with_params(&pgsql, workloadSql, 0, NULL, NULL,
+								  &summary, &demoapp_parse_workload_summary) &&
+		summary.parsedOk &&
+		demoapp_workload_summary_add_row(&summary, "All Clients Combined",
+										 summary.reads,
+										 summary.writes,
+										 summary.updates,
+										 summary.errors,
+										 summary.tps,
+										 &(summary.combined)))
+	{
+		(void) demoapp_table_print(&(summary.table));
+	}
+	else
+	{
+		log_error("Failed to compute the demo app workload summary");
+	}
+
+	pgsql_finish(&pgsql);
+	demoapp_table_free(&(summary.table));
+
+	(void) demoapp_print_faults(pguri);
+}
+
+
+/*
+ * demoapp_parse_workload_summary parses the demo.client rows, and adds a row
+ * per client to the summary table, with its throughput and latency
+ * percentiles. The totals are accumulated for the final row of the table.
+ */
+static void
+demoapp_parse_workload_summary(void *ctx, PGresult *result)
+{
+	DemoWorkloadSummary *summary = (DemoWorkloadSummary *) ctx;
+
+	if (PQnfields(result) != 7)
+	{
+		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		summary->parsedOk = false;
+		return;
+	}
+
+	for (int row = 0; row < PQntuples(result); row++)
+	{
+		int clientId = 0;
+		int64_t counts[4] = { 0 };  /* reads, writes, updates, errors */
+		double elapsed = 0;
+
+		DemoHistogram *latency = (DemoHistogram *) calloc(1, sizeof(DemoHistogram));
+
+		if (latency == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			summary->parsedOk = false;
+			return;
+		}
+
+		if (!stringToInt(PQgetvalue(result, row, 0), &clientId))
+		{
+			log_error("Invalid client id \"%s\"", PQgetvalue(result, row, 0));
+			free(latency);
+			summary->parsedOk = false;
+			return;
+		}
+
+		/* clients that failed to register their statistics have NULLs */
+		for (int i = 0; i < 4; i++)
+		{
+			if (!PQgetisnull(result, row, i + 1) &&
+				!stringToInt64(PQgetvalue(result, row, i + 1), &(counts[i])))
+			{
+				log_error("Invalid statistics for client %d: \"%s\"",
+						  clientId, PQgetvalue(result, row, i + 1));
+				free(latency);
+				summary->parsedOk = false;
+				return;
+			}
+		}
+
+		if (!PQgetisnull(result, row, 5) &&
+			!stringToDouble(PQgetvalue(result, row, 5), &elapsed))
+		{
+			log_error("Invalid duration for client %d: \"%s\"",
+					  clientId, PQgetvalue(result, row, 5));
+			free(latency);
+			summary->parsedOk = false;
+			return;
 		}
 
-		char *sql =
-			"insert into demo.tracking(client, loop, retries, us, recovery) "
-			"values($1, $2, $3, $4, $5)";
+		if (!PQgetisnull(result, row, 6) &&
+			!demoapp_histogram_from_json(PQgetvalue(result, row, 6), latency))
+		{
+			log_error("Invalid latency histogram for client %d", clientId);
+			free(latency);
+			summary->parsedOk = false;
+			return;
+		}
 
-		const Oid paramTypes[5] = { INT4OID, INT4OID, INT8OID, INT8OID, BOOLOID };
-		const char *paramValues[5] = { 0 };
+		char client[BUFSIZE] = { 0 };
+		double tps =
+			elapsed > 0 ? (counts[0] + counts[1] + counts[2]) / elapsed : 0;
 
-		paramValues[0] = intToString(clientId).strValue;
-		paramValues[1] = intToString(index).strValue;
-		paramValues[2] = intToString(pgsql.retryPolicy.attempts).strValue;
-		paramValues[3] = intToString(INSTR_TIME_GET_MICROSEC(duration)).strValue;
-		paramValues[4] = is_in_recovery ? "true" : "false";
+		sformat(client, sizeof(client), "Client %d", clientId);
 
-		if (!pgsql_execute_with_params(&pgsql, sql, 5, paramTypes, paramValues,
-									   NULL, NULL))
+		if (!demoapp_workload_summary_add_row(summary, client,
+											  counts[0], counts[1],
+											  counts[2], counts[3],
+											  tps, latency))
 		{
 			/* errors have already been logged */
+			free(latency);
+			summary->parsedOk = false;
+			return;
 		}
 
-		/* the idea is to reconnect every time */
-		pgsql_finish(&pgsql);
+		summary->reads += counts[0];
+		summary->writes += counts[1];
+		summary->updates += counts[2];
+		summary->errors += counts[3];
+
+		/* clients run concurrently, their throughput adds up */
+		summary->tps += tps;
+
+		(void) demoapp_histogram_merge(&(summary->combined), latency);
+
+		free(latency);
 	}
 
-	if (!demoapp_update_client_failovers(pguri, clientId, failovers))
+	summary->parsedOk = true;
+}
+
+
+/*
+ * demoapp_workload_summary_add_row adds a row to the workload summary table.
+ */
+static bool
+demoapp_workload_summary_add_row(DemoWorkloadSummary *summary,
+								 const char *client,
+								 int64_t reads,
+								 int64_t writes,
+								 int64_t updates,
+								 int64_t errors,
+								 double tps,
+								 DemoHistogram *latency)
+{
+	char values[9][BUFSIZE] = { 0 };
+	const char *row[9] = { 0 };
+
+	strlcpy(values[0], client, BUFSIZE);
+	sformat(values[1], BUFSIZE, "%" PRId64, reads);
+	sformat(values[2], BUFSIZE, "%" PRId64, writes);
+	sformat(values[3], BUFSIZE, "%" PRId64, updates);
+	sformat(values[4], BUFSIZE, "%" PRId64, errors);
+	sformat(values[5], BUFSIZE, "%.1f", tps);
+
+	/* leave the latency columns empty when there is nothing to report */
+	if (demoapp_histogram_count(latency) > 0)
 	{
-		/* errors have already been logged */
-		exit(EXIT_CODE_INTERNAL_ERROR);
+		sformat(values[6], BUFSIZE, "%.3f",
+				demoapp_histogram_percentile(latency, 0.50) / 1000.0);
+		sformat(values[7], BUFSIZE, "%.3f",
+				demoapp_histogram_percentile(latency, 0.99) / 1000.0);
+		sformat(values[8], BUFSIZE, "%.3f",
+				demoapp_histogram_max(latency) / 1000.0);
 	}
 
-	log_info("Client %d connected on first attempt %d times "
-			 "with a maximum connection time of %d ms",
-			 clientId, directs, maxConnectionTimeNoRetry);
-
-	log_info("Client %d is using a retry policy with initial sleep time %d ms "
-			 "and a retry time capped at %d ms",
-			 clientId,
-			 retrySleepTime,
-			 retryCap);
+	for (int i = 0; i < 9; i++)
+	{
+		row[i] = values[i];
+	}
 
-	log_info("Client %d attempted to connect during a failover %d times "
-			 "with a maximum connection time of %d ms and a total number "
-			 "of %d retries",
-			 clientId, failovers, maxConnectionTimeWithRetries, retries);
+	return demoapp_table_add_row(&(summary->table), row);
 }
 
 
 /*
- * demoapp_print_histogram prints an histogram of the distribution of the
- * connection timings measured throughout the testing.
+ * demoapp_print_faults prints the RTO and RPO measured for each fault that
+ * has been injected during the run.
  */
-void
-demoapp_print_histogram(const char *pguri, DemoAppOptions *demoAppOptions)
+static void
+demoapp_print_faults(const char *pguri)
 {
-	const char *sqlFormatString =
+	const char *faultsSql =
 
 		/* *INDENT-OFF* */
-		"with minmax as ( select min(us), max(us) from demo.tracking ), "
-		"histogram as ( "
-		"select width_bucket(us, min, max, 18) as bucket, "
-		"round(min(us)/1000.0, 3) as min, "
-		"round(max(us)/1000.0, 3) as max, "
-		"count(*) as freq "
-		"from demo.tracking, minmax "
-		"group by bucket "
-		"order by bucket "
-		") "
-		"select min as \"Min Connect Time (ms)\", max, freq, "
-        "repeat('▒', "
-		"(freq::float / max(freq) over() * %d)::int "
-        ") as bar "
-		"from histogram; ";
+		"select id as \"Fault\", kind as \"Kind\", "
+		"primary_node as \"Primary\", "
+		"round(failover_s::numeric, 3) as \"Failover (s)\", "
+		"round(rto_s::numeric, 3) as \"RTO (s)\" "
+		"from demo.fault_recovery "
+		"order by id";
 		/* *INDENT-ON* */
 
-		/* the first columns take up 45 columns already, use what's remaining */
-		int cols = demoapp_get_terminal_columns() - 45;
-
-	char sql[BUFSIZE] = { 0 };
+	const char *rpoSql =
 
-	sformat(sql, sizeof(sql), sqlFormatString, cols);
+		/* *INDENT-OFF* */
+		"select (select count(*) from demo.acked) as \"Acknowledged Writes\", "
+		"(select count(*) from demo.lost_writes) as \"Lost Writes (RPO)\"";
+		/* *INDENT-ON* */
 
-	(void) demoapp_psql(pguri, sql);
+	(void) demoapp_print_query(pguri, faultsSql);
+	(void) demoapp_print_query(pguri, rpoSql);
 }
 
 
-#define P95 "percentile_cont(0.95) within group (order by us::float8) / 1000.0"
-#define P99 "percentile_cont(0.99) within group (order by us::float8) / 1000.0"
-
 /*
- * demoapp_print_summary prints a summar of what happened during the run.
+ * demoapp_print_report_as_json prints the results of the run as a JSON
+ * document, for benchmark tooling to consume.
  */
-void
-demoapp_print_summary(const char *pguri, DemoAppOptions *demoAppOptions)
+bool
+demoapp_print_report_as_json(const char *pguri, DemoAppOptions *demoAppOptions)
 {
+	PGSQL pgsql = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
 	const char *sql =
 
 		/* *INDENT-OFF* */
-		"with stats as( "
-		"select client, "
-		"count(*) as conn, "
-		"sum(retries), "
-		"round(min(us)/1000.0, 3) as min, "
-		"round(max(us)/1000.0, 3) as max, "
-		"round((" P95 ")::numeric, 3) as p95, "
-		"round((" P99 ")::numeric, 3) as p99 "
-		"from demo.tracking "
-		"group by rollup(client) "
+		"with clients as ( "
+		"select client, failover_count, reads, writes, updates, errors, "
+		"duration_s, "
+		"round(((reads + writes + updates) / nullif(duration_s, 0))::numeric, "
+		"1) as tps, "
+		"demo.latency_summary(latency_histogram) as latency_ms "
+		"from demo.client "
+		"), "
+		"histogram as ( "
+		"select coalesce(jsonb_agg(jsonb_build_array(us, freq)), '[]') as h "
+		"from demo.latency_histogram "
 		") "
-		"select "
-		"case when client is not null then format('Client %s', client) "
-		"else ('All Clients Combined') end as \"Client\", "
-		"conn as \"Connections\", "
-		/* "failover_count as \"Failovers\", " */
-		/* "retry_sleep_ms as \"Retry Sleep (ms)\", " */
-		/* "retry_cap_ms as \"Retry Cap (ms)\", " */
-		"sum as \"Retries\", "
-		"min as \"Min Connect Time (ms)\", max, p95, p99 "
-		"from stats left join demo.client using(client) "
-		"order by client nulls last";
+		"select jsonb_build_object("
+		"'clients', (select count(*) from clients), "
+		"'transactions', jsonb_build_object("
+		"'reads', (select coalesce(sum(reads), 0) from clients), "
+		"'writes', (select coalesce(sum(writes), 0) from clients), "
+		"'updates', (select coalesce(sum(updates), 0) from clients), "
+		"'errors', (select coalesce(sum(errors), 0) from clients), "
+		"'tps', (select coalesce(sum(tps), 0) from clients)), "
+		"'latency_ms', (select demo.latency_summary(h) from histogram), "
+		"'per_client', (select coalesce(jsonb_agg(to_jsonb(clients) "
+		"order by client), '[]') from clients), "
+		"'faults', (select coalesce(jsonb_agg(jsonb_build_object("
+		"'id', id, 'kind', kind, 'primary', primary_node, "
+		"'injected', injected, "
+		"'failover_s', round(failover_s::numeric, 3), "
+		"'rto_s', round(rto_s::numeric, 3)) order by id), '[]') "
+		"from demo.fault_recovery), "
+		"'rpo', jsonb_build_object("
+		"'acknowledged_writes', (select count(*) from demo.acked), "
+		"'lost_writes', (select count(*) from demo.lost_writes)))::text";
 		/* *INDENT-ON* */
 
-		log_info("Summary for the demo app running with %d clients for %ds",
-				 demoAppOptions->clientsCount, demoAppOptions->duration);
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	if (!pgsql_execute_with_params(&pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to compute the demo app report");
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	pgsql_finish(&pgsql);
+
+	JSON_Value *js = json_parse_string(context.strVal);
+
+	free(context.strVal);
+
+	if (js == NULL)
+	{
+		log_error("Failed to parse the demo app report as JSON");
+		return false;
+	}
+
+	JSON_Object *jsObj = json_value_get_object(js);
+	JSON_Value *jsOptions = json_value_init_object();
+	JSON_Object *jsOptionsObj = json_value_get_object(jsOptions);
 
-	(void) demoapp_psql(pguri, sql);
+	json_object_set_string(jsOptionsObj, "formation", demoAppOptions->formation);
+	json_object_set_number(jsOptionsObj, "group", demoAppOptions->groupId);
+	json_object_set_number(jsOptionsObj, "clients", demoAppOptions->clientsCount);
+	json_object_set_number(jsOptionsObj, "duration", demoAppOptions->duration);
+	json_object_set_number(jsOptionsObj, "read_ratio", demoAppOptions->readRatio);
+	json_object_set_number(jsOptionsObj, "update_ratio",
+						   demoAppOptions->updateRatio);
+	json_object_set_boolean(jsOptionsObj, "pipeline", demoAppOptions->pipeline);
+
+	if (demoAppOptions->pipeline)
+	{
+		json_object_set_number(jsOptionsObj, "batch_size",
+							   demoAppOptions->batchSize);
+		json_object_set_boolean(jsOptionsObj, "prepared",
+								demoAppOptions->prepared);
+	}
+
+	if (demoAppOptions->doFailover)
+	{
+		json_object_set_string(jsOptionsObj, "fault",
+							   demoapp_fault_kind_to_string(
+								   demoAppOptions->faultKind));
+		json_object_set_number(jsOptionsObj, "first_failover",
+							   demoAppOptions->firstFailover);
+		json_object_set_number(jsOptionsObj, "failover_freq",
+							   demoAppOptions->failoverFreq);
+	}
+	else
+	{
+		json_object_set_null(jsOptionsObj, "fault");
+	}
+
+	json_object_set_string(jsOptionsObj, "version", PG_AUTOCTL_VERSION);
+
+	json_object_set_value(jsObj, "options", jsOptions);
+
+	(void) cli_pprint_json(js);
+
+	return true;
 }
 
 
@@ -840,52 +2636,274 @@ demoapp_get_terminal_columns()
 
 
 /*
- * demoapp_psql calls psql to display the results of a given SQL query, in a
- * way that we don't have to compute the headers for the output.
+ * demoapp_print_query runs the given SQL query and prints its result, in the
+ * same aligned format as psql does.
+ */
+static bool
+demoapp_print_query(const char *pguri, const char *sql)
+{
+	PGSQL pgsql = { 0 };
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	demoapp_set_retry_policy(&pgsql,
+							 DEMO_DEFAULT_RETRY_CAP_TIME,
+							 DEMO_DEFAULT_RETRY_SLEEP_TIME);
+
+	bool success =
+		pgsql_execute_with_params(&pgsql, sql, 0, NULL, NULL,
+								  NULL, &demoapp_print_result);
+
+	pgsql_finish(&pgsql);
+
+	/* errors have already been logged */
+	return success;
+}
+
+
+/*
+ * demoapp_print_result is a callback that prints a query result as a table.
+ * Numbers are aligned to the right, as psql does.
  */
 static void
-demoapp_psql(const char *pguri, const char *sql)
+demoapp_print_result(void *ctx, PGresult *result)
 {
-	char cat[MAXPGPATH] = { 0 };
-	char psql[MAXPGPATH] = { 0 };
+	DemoTable table = { 0 };
+	const char *values[DEMO_TABLE_MAX_COLUMNS] = { 0 };
 
-	char *args[16];
-	int argsIndex = 0;
+	table.columns = PQnfields(result);
 
-	/* we shell-out to psql so that we don't have to compute headers */
-	if (!search_path_first("psql", psql, LOG_ERROR))
+	if (table.columns > DEMO_TABLE_MAX_COLUMNS)
 	{
-		log_fatal("Failed to find program psql in PATH");
-		exit(EXIT_CODE_INTERNAL_ERROR);
+		log_error("BUG: demoapp_print_result supports up to %d columns, "
+				  "query returned %d columns",
+				  DEMO_TABLE_MAX_COLUMNS, table.columns);
+		return;
 	}
 
-	/* we use /bin/cat as our PAGER */
-	if (!search_path_first("cat", cat, LOG_ERROR))
+	for (int col = 0; col < table.columns; col++)
 	{
-		log_fatal("Failed to find program cat in PATH");
-		exit(EXIT_CODE_INTERNAL_ERROR);
+		Oid type = PQftype(result, col);
+
+		table.headers[col] = PQfname(result, col);
+		table.alignRight[col] =
+			type == INT2OID || type == INT4OID || type == INT8OID ||
+			type == FLOAT4OID || type == FLOAT8OID || type == NUMERICOID;
+	}
+
+	for (int row = 0; row < PQntuples(result); row++)
+	{
+		for (int col = 0; col < table.columns; col++)
+		{
+			values[col] = PQgetvalue(result, row, col);
+		}
+
+		if (!demoapp_table_add_row(&table, values))
+		{
+			/* errors have already been logged */
+			demoapp_table_free(&table);
+			return;
+		}
+	}
+
+	(void) demoapp_table_print(&table);
+	demoapp_table_free(&table);
+}
+
+
+/*
+ * demoapp_table_add_row adds a copy of the given values as a new row of the
+ * table, growing the table as needed.
+ */
+static bool
+demoapp_table_add_row(DemoTable *table, const char **values)
+{
+	if (table->rows == table->capacity)
+	{
+		int capacity = table->capacity == 0 ? 16 : 2 * table->capacity;
+		char **cells =
+			(char **) realloc(table->cells,
+							  capacity * table->columns * sizeof(char *));
+
+		if (cells == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		table->cells = cells;
+		table->capacity = capacity;
 	}
 
-	/* set our PAGER to be just cat */
-	setenv("PAGER", cat, 1);
+	char **row = &(table->cells[table->rows * table->columns]);
+
+	for (int col = 0; col < table->columns; col++)
+	{
+		row[col] = strdup(values[col] == NULL ? "" : values[col]);
+
+		if (row[col] == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+
+			for (int i = 0; i < col; i++)
+			{
+				free(row[i]);
+			}
+			return false;
+		}
+	}
 
-	args[argsIndex++] = psql;
-	args[argsIndex++] = "--no-psqlrc";
-	args[argsIndex++] = "-d";
-	args[argsIndex++] = (char *) pguri;
-	args[argsIndex++] = "-c";
-	args[argsIndex++] = (char *) sql;
-	args[argsIndex++] = NULL;
+	++table->rows;
 
-	/* we do not want to call setsid() when running this program. */
-	Program program = { 0 };
+	return true;
+}
 
-	(void) initialize_program(&program, args, false);
 
-	program.capture = false;    /* don't capture output */
-	program.tty = true;         /* allow sharing the parent's tty */
+/*
+ * demoapp_display_width returns how many characters are needed to display the
+ * given UTF-8 string, such as our histogram bars.
+ */
+static int
+demoapp_display_width(const char *str)
+{
+	int width = 0;
 
-	(void) execute_subprogram(&program);
+	for (const char *ptr = str; *ptr != '\0'; ptr++)
+	{
+		/* skip UTF-8 continuation bytes */
+		if ((*ptr & 0xC0) != 0x80)
+		{
+			++width;
+		}
+	}
 
-	free_program(&program);
+	return width;
+}
+
+
+/*
+ * demoapp_append_padded appends the given string to the buffer, padded with
+ * spaces to the given width, aligned to the left, the right, or centered.
+ */
+static void
+demoapp_append_padded(PQExpBuffer buffer, const char *str, int width,
+					  bool alignRight, bool center, bool last)
+{
+	int padding = width - demoapp_display_width(str);
+	int left = center ? padding / 2 : alignRight ? padding : 0;
+	int right = padding - left;
+
+	appendPQExpBuffer(buffer, "%*s%s", left, "", str);
+
+	/* as psql does, the last column is not padded on the right */
+	if (!last)
+	{
+		appendPQExpBuffer(buffer, "%*s", right, "");
+	}
+}
+
+
+/*
+ * demoapp_table_print prints the given table to stdout, in the same aligned
+ * format as psql uses.
+ */
+static void
+demoapp_table_print(DemoTable *table)
+{
+	int widths[DEMO_TABLE_MAX_COLUMNS] = { 0 };
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	for (int col = 0; col < table->columns; col++)
+	{
+		widths[col] = demoapp_display_width(table->headers[col]);
+
+		for (int row = 0; row < table->rows; row++)
+		{
+			char *cell = table->cells[row * table->columns + col];
+			int width = demoapp_display_width(cell);
+
+			if (width > widths[col])
+			{
+				widths[col] = width;
+			}
+		}
+	}
+
+	/* the headers are centered */
+	for (int col = 0; col < table->columns; col++)
+	{
+		bool last = col == table->columns - 1;
+
+		appendPQExpBufferStr(buffer, col == 0 ? " " : " | ");
+		demoapp_append_padded(buffer, table->headers[col], widths[col],
+							  false, true, last);
+	}
+	appendPQExpBufferChar(buffer, '\n');
+
+	for (int col = 0; col < table->columns; col++)
+	{
+		appendPQExpBufferStr(buffer, col == 0 ? "-" : "-+-");
+
+		for (int i = 0; i < widths[col]; i++)
+		{
+			appendPQExpBufferChar(buffer, '-');
+		}
+	}
+	appendPQExpBufferStr(buffer, "-\n");
+
+	for (int row = 0; row < table->rows; row++)
+	{
+		for (int col = 0; col < table->columns; col++)
+		{
+			char *cell = table->cells[row * table->columns + col];
+			bool alignRight = table->alignRight[col];
+			bool last = col == table->columns - 1 && !alignRight;
+
+			appendPQExpBufferStr(buffer, col == 0 ? " " : " | ");
+			demoapp_append_padded(buffer, cell, widths[col],
+								  alignRight, false, last);
+		}
+		appendPQExpBufferChar(buffer, '\n');
+	}
+
+	appendPQExpBuffer(buffer, "(%d %s)\n\n",
+					  table->rows, table->rows == 1 ? "row" : "rows");
+
+	if (PQExpBufferBroken(buffer))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+	}
+	else
+	{
+		fformat(stdout, "%s", buffer->data);
+		fflush(stdout);
+	}
+
+	destroyPQExpBuffer(buffer);
+}
+
+
+/*
+ * demoapp_table_free frees the memory used by the table cells.
+ */
+static void
+demoapp_table_free(DemoTable *table)
+{
+	for (int i = 0; i < table->rows * table->columns; i++)
+	{
+		free(table->cells[i]);
+	}
+
+	free(table->cells);
+
+	table->cells = NULL;
+	table->rows = 0;
+	table->capacity = 0;
 }
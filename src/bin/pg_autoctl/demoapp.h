@@ -25,5 +25,10 @@ bool demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions);
 
 void demoapp_print_histogram(const char *pguri, DemoAppOptions *demoAppOptions);
 void demoapp_print_summary(const char *pguri, DemoAppOptions *demoAppOptions);
+bool demoapp_print_report_as_json(const char *pguri,
+								  DemoAppOptions *demoAppOptions);
+
+DemoFaultKind demoapp_parse_fault_kind(const char *kind);
+const char * demoapp_fault_kind_to_string(DemoFaultKind kind);
 
 #endif /* DEMOAPP_H */
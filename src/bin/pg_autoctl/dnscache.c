@@ -0,0 +1,401 @@
+/*
+ * src/bin/pg_autoctl/dnscache.c
+ *     Cache the forward and reverse DNS lookups that pg_autoctl runs to
+ *     decide between hostnames and IP addresses in HBA rules.
+ *
+ * The keeper checks the DNS setup of the other nodes each time it edits HBA
+ * rules for them. With a slow or flapping resolver, those checks would stall
+ * the keeper main loop, sometimes in the middle of a failover. We keep the
+ * answers in memory for PG_AUTOCTL_DNS_CACHE_TTL seconds, and the failures
+ * for PG_AUTOCTL_DNS_CACHE_NEGATIVE_TTL seconds.
+ *
+ * Only the first lookup of a hostname blocks: when an entry has expired we
+ * keep using it, and a helper thread refreshes it in the background. The
+ * helper thread never logs, the main thread reports what it found when
+ * using the entry next.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "dnscache.h"
+#include "ipaddr.h"
+#include "log.h"
+#include "pgsetup.h"
+
+typedef struct DNSCacheEntry
+{
+	char hostname[_POSIX_HOST_NAME_MAX];
+	bool success;               /* false for negative entries */
+	bool foundHostnameFromAddress;
+	char ipaddr[BUFSIZE];
+	char error[BUFSIZE];        /* why the last background refresh failed */
+
+	uint64_t expiresAt;
+	uint64_t lastUsed;
+	bool refreshing;            /* the helper thread is on it */
+} DNSCacheEntry;
+
+typedef struct DNSCache
+{
+	pthread_mutex_t lock;
+	pthread_cond_t refresh;
+	bool workerStarted;
+
+	int count;
+	DNSCacheEntry entries[DNS_CACHE_MAX_ENTRIES];
+} DNSCache;
+
+static DNSCache Cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.refresh = PTHREAD_COND_INITIALIZER
+};
+
+static DNSCacheEntry * dns_cache_find(const char *hostname);
+static DNSCacheEntry * dns_cache_new_entry(const char *hostname);
+static void dns_cache_request_refresh(DNSCacheEntry *entry);
+static void * dns_cache_worker(void *arg);
+static bool dns_cache_lookup(const char *hostname,
+							 char *ipaddr, int size,
+							 bool *foundHostnameFromAddress,
+							 char *error, int errorSize);
+
+
+/*
+ * dns_cache_resolve_forward_and_reverse has the same API as
+ * resolveHostnameForwardAndReverse, and uses the cached answer when we have
+ * one.
+ */
+bool
+dns_cache_resolve_forward_and_reverse(const char *hostname,
+									  char *ipaddr, int size,
+									  bool *foundHostnameFromAddress)
+{
+	uint64_t now = time(NULL);
+	char error[BUFSIZE] = { 0 };
+
+	pthread_mutex_lock(&(Cache.lock));
+
+	DNSCacheEntry *entry = dns_cache_find(hostname);
+
+	if (entry != NULL)
+	{
+		bool success = entry->success;
+
+		strlcpy(ipaddr, entry->ipaddr, size);
+		*foundHostnameFromAddress = entry->foundHostnameFromAddress;
+
+		strlcpy(error, entry->error, sizeof(error));
+		entry->error[0] = '\0';
+		entry->lastUsed = now;
+
+		bool expired = entry->expiresAt <= now;
+
+		if (expired && !entry->refreshing)
+		{
+			dns_cache_request_refresh(entry);
+		}
+
+		pthread_mutex_unlock(&(Cache.lock));
+
+		if (!IS_EMPTY_STRING_BUFFER(error))
+		{
+			log_warn("Failed to refresh DNS lookup of \"%s\": %s",
+					 hostname, error);
+		}
+
+		log_debug("Using %s DNS lookup for \"%s\": %s",
+				  expired ? "expired" : "cached",
+				  hostname,
+				  success ? ipaddr : "failed");
+
+		return success;
+	}
+
+	pthread_mutex_unlock(&(Cache.lock));
+
+	/* first time we see this hostname, we have to wait for the answer */
+	bool success =
+		resolveHostnameForwardAndReverse(hostname, ipaddr, size,
+										 foundHostnameFromAddress);
+
+	pthread_mutex_lock(&(Cache.lock));
+
+	entry = dns_cache_find(hostname);
+
+	if (entry == NULL)
+	{
+		entry = dns_cache_new_entry(hostname);
+	}
+
+	entry->success = success;
+	entry->foundHostnameFromAddress = success && *foundHostnameFromAddress;
+	strlcpy(entry->ipaddr, success ? ipaddr : "", sizeof(entry->ipaddr));
+	entry->error[0] = '\0';
+	entry->lastUsed = now;
+	entry->expiresAt =
+		now + (success
+			   ? PG_AUTOCTL_DNS_CACHE_TTL
+			   : PG_AUTOCTL_DNS_CACHE_NEGATIVE_TTL);
+
+	pthread_mutex_unlock(&(Cache.lock));
+
+	return success;
+}
+
+
+/*
+ * dns_cache_find returns the cache entry for the given hostname, or NULL.
+ * The caller holds the lock.
+ */
+static DNSCacheEntry *
+dns_cache_find(const char *hostname)
+{
+	for (int i = 0; i < Cache.count; i++)
+	{
+		if (strcmp(Cache.entries[i].hostname, hostname) == 0)
+		{
+			return &(Cache.entries[i]);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * dns_cache_new_entry returns a new entry for the given hostname, evicting
+ * the least recently used entry when the cache is full. The caller holds the
+ * lock.
+ */
+static DNSCacheEntry *
+dns_cache_new_entry(const char *hostname)
+{
+	DNSCacheEntry *entry = NULL;
+
+	if (Cache.count < DNS_CACHE_MAX_ENTRIES)
+	{
+		entry = &(Cache.entries[Cache.count++]);
+	}
+	else
+	{
+		for (int i = 0; i < Cache.count; i++)
+		{
+			DNSCacheEntry *candidate = &(Cache.entries[i]);
+
+			/* the helper thread owns the hostname of the entries it refreshes */
+			if (candidate->refreshing)
+			{
+				continue;
+			}
+
+			if (entry == NULL || candidate->lastUsed < entry->lastUsed)
+			{
+				entry = candidate;
+			}
+		}
+
+		/* every entry is being refreshed: reuse the first one anyway */
+		if (entry == NULL)
+		{
+			entry = &(Cache.entries[0]);
+		}
+	}
+
+	bzero(entry, sizeof(DNSCacheEntry));
+	strlcpy(entry->hostname, hostname, sizeof(entry->hostname));
+
+	return entry;
+}
+
+
+/*
+ * dns_cache_request_refresh marks the entry for the helper thread to refresh,
+ * starting the helper thread when needed. The caller holds the lock.
+ */
+static void
+dns_cache_request_refresh(DNSCacheEntry *entry)
+{
+	if (!Cache.workerStarted)
+	{
+		pthread_t worker;
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pthread_create(&worker, &attr, dns_cache_worker, NULL) != 0)
+		{
+			pthread_attr_destroy(&attr);
+
+			/* keep using the expired entry, we'll try again next time */
+			log_debug("Failed to start the DNS cache refresh thread: %m");
+			return;
+		}
+
+		pthread_attr_destroy(&attr);
+		Cache.workerStarted = true;
+	}
+
+	entry->refreshing = true;
+	pthread_cond_signal(&(Cache.refresh));
+}
+
+
+/*
+ * dns_cache_worker is the helper thread main loop: it waits for entries that
+ * need a refresh and runs the DNS lookups without holding the lock.
+ */
+static void *
+dns_cache_worker(void *arg)
+{
+	pthread_mutex_lock(&(Cache.lock));
+
+	for (;;)
+	{
+		DNSCacheEntry *entry = NULL;
+
+		for (int i = 0; i < Cache.count; i++)
+		{
+			if (Cache.entries[i].refreshing)
+			{
+				entry = &(Cache.entries[i]);
+				break;
+			}
+		}
+
+		if (entry == NULL)
+		{
+			pthread_cond_wait(&(Cache.refresh), &(Cache.lock));
+			continue;
+		}
+
+		char hostname[_POSIX_HOST_NAME_MAX] = { 0 };
+		char ipaddr[BUFSIZE] = { 0 };
+		char error[BUFSIZE] = { 0 };
+		bool foundHostnameFromAddress = false;
+
+		strlcpy(hostname, entry->hostname, sizeof(hostname));
+
+		pthread_mutex_unlock(&(Cache.lock));
+
+		bool success = dns_cache_lookup(hostname, ipaddr, sizeof(ipaddr),
+										&foundHostnameFromAddress,
+										error, sizeof(error));
+
+		pthread_mutex_lock(&(Cache.lock));
+
+		uint64_t now = time(NULL);
+
+		/* the entry might have been evicted while we were not looking */
+		if (strcmp(entry->hostname, hostname) != 0)
+		{
+			continue;
+		}
+
+		/*
+		 * A failure to refresh the entry keeps the previous answer for
+		 * another negative TTL, so that a flapping resolver doesn't change
+		 * our HBA rules.
+		 */
+		if (success)
+		{
+			entry->success = true;
+			entry->foundHostnameFromAddress = foundHostnameFromAddress;
+			strlcpy(entry->ipaddr, ipaddr, sizeof(entry->ipaddr));
+			entry->expiresAt = now + PG_AUTOCTL_DNS_CACHE_TTL;
+		}
+		else
+		{
+			strlcpy(entry->error, error, sizeof(entry->error));
+			entry->expiresAt = now + PG_AUTOCTL_DNS_CACHE_NEGATIVE_TTL;
+		}
+
+		entry->refreshing = false;
+	}
+
+	/* keep compiler happy */
+	return NULL;
+}
+
+
+/*
+ * dns_cache_lookup implements the same forward and reverse DNS lookups as
+ * resolveHostnameForwardAndReverse, without logging and without retrying,
+ * so that it's safe to call from the helper thread.
+ */
+static bool
+dns_cache_lookup(const char *hostname,
+				 char *ipaddr, int size,
+				 bool *foundHostnameFromAddress,
+				 char *error, int errorSize)
+{
+	struct addrinfo *lookup = NULL;
+
+	*foundHostnameFromAddress = false;
+
+	int ret = getaddrinfo(hostname, NULL, NULL, &lookup);
+
+	if (ret != 0)
+	{
+		strlcpy(error, gai_strerror(ret), errorSize);
+		return false;
+	}
+
+	/* when everything fails, we return a proper empty string buffer */
+	bzero((void *) ipaddr, size);
+
+	for (struct addrinfo *ai = lookup; ai; ai = ai->ai_next)
+	{
+		char candidateIPAddr[BUFSIZE] = { 0 };
+		char hbuf[NI_MAXHOST] = { 0 };
+
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+		{
+			continue;
+		}
+
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+						candidateIPAddr, sizeof(candidateIPAddr),
+						NULL, 0, NI_NUMERICHOST) != 0)
+		{
+			continue;
+		}
+
+		/* keep the first IP address of the list */
+		if (IS_EMPTY_STRING_BUFFER(ipaddr))
+		{
+			strlcpy(ipaddr, candidateIPAddr, size);
+		}
+
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+						hbuf, sizeof(hbuf), NULL, 0, NI_NAMEREQD) != 0)
+		{
+			continue;
+		}
+
+		/* compare reverse-DNS lookup result with our hostname */
+		if (strcmp(hbuf, hostname) == 0)
+		{
+			*foundHostnameFromAddress = true;
+			break;
+		}
+	}
+
+	freeaddrinfo(lookup);
+
+	return true;
+}
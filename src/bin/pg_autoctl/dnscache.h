@@ -0,0 +1,22 @@
+/*
+ * src/bin/pg_autoctl/dnscache.h
+ *     Cache the forward and reverse DNS lookups that pg_autoctl runs to
+ *     decide between hostnames and IP addresses in HBA rules.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <stdbool.h>
+
+#define DNS_CACHE_MAX_ENTRIES 128
+
+bool dns_cache_resolve_forward_and_reverse(const char *hostname,
+										   char *ipaddr, int size,
+										   bool *foundHostnameFromAddress);
+
+#endif /* DNSCACHE_H */
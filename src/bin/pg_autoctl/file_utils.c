@@ -7,6 +7,7 @@
  *
  */
 
+#include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -15,6 +16,10 @@
 #include <mach-o/dyld.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
 #include "postgres_fe.h"
 
 #include "snprintf.h"
@@ -347,6 +352,116 @@ read_file_internal(FILE *fileStream,
 }
 
 
+/*
+ * read_file_tail reads the last lineCount lines of a file, reading the file
+ * backwards from its end by chunks until enough lines have been found, so
+ * that the cost depends on the size of the tail rather than the size of the
+ * file. A final newline does not count as an empty last line.
+ *
+ * If successful, the function returns true and fileSize points to the number
+ * of bytes that were read and contents points to a buffer containing the tail
+ * of the file. This buffer should be freed by the caller.
+ */
+bool
+read_file_tail(const char *filePath, int lineCount,
+			   char **contents, long *fileSize)
+{
+	char buffer[BUFSIZE * 8];
+	int newlines = 0;
+	bool foundStart = false;
+
+	FILE *fileStream = fopen_read_only(filePath);
+
+	if (fileStream == NULL)
+	{
+		log_error("Failed to open file \"%s\": %m", filePath);
+		return false;
+	}
+
+	if (fseek(fileStream, 0, SEEK_END) != 0)
+	{
+		log_error("Failed to read file \"%s\": %m", filePath);
+		fclose(fileStream);
+		return false;
+	}
+
+	long size = ftell(fileStream);
+
+	if (size < 0)
+	{
+		log_error("Failed to read file \"%s\": %m", filePath);
+		fclose(fileStream);
+		return false;
+	}
+
+	long start = size;
+
+	while (start > 0 && !foundStart)
+	{
+		long chunkSize = Min(start, (long) sizeof(buffer));
+
+		start -= chunkSize;
+
+		if (fseek(fileStream, start, SEEK_SET) != 0 ||
+			fread(buffer, sizeof(char), chunkSize, fileStream) < chunkSize)
+		{
+			log_error("Failed to read file \"%s\": %m", filePath);
+			fclose(fileStream);
+			return false;
+		}
+
+		for (long i = chunkSize - 1; i >= 0; i--)
+		{
+			/* skip the newline that terminates the last line */
+			if (buffer[i] != '\n' || start + i == size - 1)
+			{
+				continue;
+			}
+
+			if (++newlines == lineCount)
+			{
+				start += i + 1;
+				foundStart = true;
+				break;
+			}
+		}
+	}
+
+	*fileSize = size - start;
+
+	char *data = malloc(*fileSize + 1);
+
+	if (data == NULL)
+	{
+		log_error("Failed to allocate %ld bytes", *fileSize);
+		log_error(ALLOCATION_FAILED_ERROR);
+		fclose(fileStream);
+		return false;
+	}
+
+	if (fseek(fileStream, start, SEEK_SET) != 0 ||
+		fread(data, sizeof(char), *fileSize, fileStream) < *fileSize)
+	{
+		log_error("Failed to read file \"%s\": %m", filePath);
+		fclose(fileStream);
+		free(data);
+		return false;
+	}
+
+	if (fclose(fileStream) == EOF)
+	{
+		log_error("Failed to read file \"%s\"", filePath);
+		free(data);
+		return false;
+	}
+
+	data[*fileSize] = '\0';
+	*contents = data;
+
+	return true;
+}
+
+
 /*
  * move_file is a utility function to move a file from sourcePath to
  * destinationPath. It behaves like mv system command. First attempts to move
@@ -941,3 +1056,148 @@ set_ps_title(const char *title)
 		*(ps_buffer + i) = '\0';
 	}
 }
+
+
+/*
+ * file_watch_init initializes the given FileWatch and, when inotify(7) is
+ * available, its non-blocking file descriptor.
+ */
+void
+file_watch_init(FileWatch *watch)
+{
+	memset(watch, 0, sizeof(FileWatch));
+	watch->fd = -1;
+
+#if defined(__linux__)
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (watch->fd < 0)
+	{
+		log_debug("Failed to initialize inotify: %m");
+	}
+#endif
+}
+
+
+/*
+ * file_watch_add adds the given file to the watch, and returns its index in
+ * the watch, or -1 when the file can't be watched. The file itself doesn't
+ * need to exist yet, only its directory.
+ */
+int
+file_watch_add(FileWatch *watch, const char *filePath)
+{
+	if (watch->fd < 0 || watch->count >= FILE_WATCH_MAX_FILES)
+	{
+		return -1;
+	}
+
+#if defined(__linux__)
+	char directory[MAXPGPATH] = { 0 };
+	const char *basename = strrchr(filePath, '/');
+
+	if (basename == NULL)
+	{
+		strlcpy(directory, ".", MAXPGPATH);
+		basename = filePath;
+	}
+	else
+	{
+		int length = basename - filePath;
+
+		strlcpy(directory, filePath, Min(length + 1, MAXPGPATH));
+		basename++;
+	}
+
+	/* watching the same directory twice gives the same watch descriptor */
+	int wd = inotify_add_watch(watch->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	if (wd < 0)
+	{
+		log_debug("Failed to watch directory \"%s\": %m", directory);
+		return -1;
+	}
+
+	int index = watch->count++;
+
+	watch->wd[index] = wd;
+	strlcpy(watch->basename[index], basename, MAXPGPATH);
+
+	log_debug("Watching file \"%s\" for changes", filePath);
+
+	return index;
+#else
+	return -1;
+#endif
+}
+
+
+/*
+ * file_watch_read_changes reads the pending events from the watch file
+ * descriptor without blocking, and returns a bitmask where the bit (1 <<
+ * index) is set for each watched file that has changed.
+ */
+int
+file_watch_read_changes(FileWatch *watch)
+{
+	int changes = 0;
+
+	if (watch->fd < 0)
+	{
+		return 0;
+	}
+
+#if defined(__linux__)
+	char buffer[4096]
+	__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;)
+	{
+		ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+
+		if (length <= 0)
+		{
+			if (length < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				log_debug("Failed to read inotify events: %m");
+			}
+			break;
+		}
+
+		for (char *ptr = buffer; ptr < buffer + length;)
+		{
+			struct inotify_event *event = (struct inotify_event *) ptr;
+
+			for (int index = 0; index < watch->count; index++)
+			{
+				if (event->wd == watch->wd[index] &&
+					event->len > 0 &&
+					strcmp(event->name, watch->basename[index]) == 0)
+				{
+					changes |= (1 << index);
+				}
+			}
+
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+
+	return changes;
+}
+
+
+/*
+ * file_watch_close releases the watch file descriptor.
+ */
+void
+file_watch_close(FileWatch *watch)
+{
+	if (watch->fd >= 0)
+	{
+		close(watch->fd);
+	}
+
+	watch->fd = -1;
+	watch->count = 0;
+}
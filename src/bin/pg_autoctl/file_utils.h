@@ -46,6 +46,8 @@ bool write_file(char *data, long fileSize, const char *filePath);
 bool append_to_file(char *data, long fileSize, const char *filePath);
 bool read_file(const char *filePath, char **contents, long *fileSize);
 bool read_file_if_exists(const char *filePath, char **contents, long *fileSize);
+bool read_file_tail(const char *filePath, int lineCount,
+					char **contents, long *fileSize);
 bool move_file(char *sourcePath, char *destinationPath);
 bool duplicate_file(char *sourcePath, char *destinationPath);
 bool create_symbolic_link(char *sourcePath, char *targetPath);
@@ -54,6 +56,28 @@ void path_in_same_directory(const char *basePath,
 							const char *fileName,
 							char *destinationPath);
 
+/*
+ * A FileWatch tells us when some files have been written to, or replaced by
+ * renaming another file over them, using inotify(7) on Linux. We watch the
+ * directories of the files, so that the watch survives the files being
+ * replaced. On other systems the file descriptor is always -1, and callers
+ * have to rely on signals or polling.
+ */
+#define FILE_WATCH_MAX_FILES 4
+
+typedef struct FileWatch
+{
+	int fd;
+	int count;
+	int wd[FILE_WATCH_MAX_FILES];
+	char basename[FILE_WATCH_MAX_FILES][MAXPGPATH];
+} FileWatch;
+
+void file_watch_init(FileWatch *watch);
+int file_watch_add(FileWatch *watch, const char *filePath);
+int file_watch_read_changes(FileWatch *watch);
+void file_watch_close(FileWatch *watch);
+
 bool search_path_first(const char *filename, char *result, int logLevel);
 bool search_path(const char *filename, SearchPath *result);
 bool search_path_deduplicate_symlinks(SearchPath *results, SearchPath *dedup);
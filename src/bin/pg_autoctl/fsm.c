@@ -24,6 +24,7 @@
 #include "monitor.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "trace.h"
 
 
 /*
@@ -201,9 +202,9 @@ KeeperFSMTransition KeeperFSM[] = {
 	/*
 	 * Started as a single, no nothing
 	 */
-	{ INIT_STATE, SINGLE_STATE, COMMENT_INIT_TO_SINGLE, &fsm_init_primary },
-	{ DROPPED_STATE, SINGLE_STATE, COMMENT_INIT_TO_SINGLE, &fsm_init_primary },
-	{ DROPPED_STATE, REPORT_LSN_STATE, COMMENT_DROPPED_TO_REPORT_LSN, &fsm_init_from_standby },
+	{ INIT_STATE, SINGLE_STATE, COMMENT_INIT_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_init_primary) },
+	{ DROPPED_STATE, SINGLE_STATE, COMMENT_INIT_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_init_primary) },
+	{ DROPPED_STATE, REPORT_LSN_STATE, COMMENT_DROPPED_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_init_from_standby) },
 
 	/*
 	 * The previous implementation has a transition from any state to the INIT
@@ -216,112 +217,112 @@ KeeperFSMTransition KeeperFSM[] = {
 	/*
 	 * other node(s) was forcibly removed, now single
 	 */
-	{ PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, &fsm_disable_replication },
-	{ WAIT_PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, &fsm_disable_replication },
-	{ JOIN_PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, &fsm_disable_replication },
+	{ PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_disable_replication) },
+	{ WAIT_PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_disable_replication) },
+	{ JOIN_PRIMARY_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_disable_replication) },
 
 	/*
 	 * failover occurred, primary -> draining/demoted
 	 */
-	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
-	{ DRAINING_STATE, DEMOTED_STATE, COMMENT_DRAINING_TO_DEMOTED, &fsm_stop_postgres },
-	{ PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
-	{ PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
+	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, FSM_TRANSITION_FUNCTION(fsm_prepare_demotion_and_stop_postgres) },
+	{ DRAINING_STATE, DEMOTED_STATE, COMMENT_DRAINING_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
+	{ PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
+	{ PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
 
-	{ JOIN_PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
-	{ JOIN_PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
-	{ JOIN_PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
+	{ JOIN_PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, FSM_TRANSITION_FUNCTION(fsm_prepare_demotion_and_stop_postgres) },
+	{ JOIN_PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
+	{ JOIN_PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
 
-	{ APPLY_SETTINGS_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
-	{ APPLY_SETTINGS_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
-	{ APPLY_SETTINGS_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
+	{ APPLY_SETTINGS_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, FSM_TRANSITION_FUNCTION(fsm_prepare_demotion_and_stop_postgres) },
+	{ APPLY_SETTINGS_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
+	{ APPLY_SETTINGS_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
 
 	/*
 	 * primary is put to maintenance
 	 */
-	{ PRIMARY_STATE, PREPARE_MAINTENANCE_STATE, COMMENT_PRIMARY_TO_PREPARE_MAINTENANCE, &fsm_stop_postgres_for_primary_maintenance },
-	{ PREPARE_MAINTENANCE_STATE, MAINTENANCE_STATE, COMMENT_PRIMARY_TO_MAINTENANCE, &fsm_stop_postgres_and_setup_standby },
-	{ PRIMARY_STATE, MAINTENANCE_STATE, COMMENT_PRIMARY_TO_MAINTENANCE, &fsm_stop_postgres_for_primary_maintenance },
+	{ PRIMARY_STATE, PREPARE_MAINTENANCE_STATE, COMMENT_PRIMARY_TO_PREPARE_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_stop_postgres_for_primary_maintenance) },
+	{ PREPARE_MAINTENANCE_STATE, MAINTENANCE_STATE, COMMENT_PRIMARY_TO_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_stop_postgres_and_setup_standby) },
+	{ PRIMARY_STATE, MAINTENANCE_STATE, COMMENT_PRIMARY_TO_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_stop_postgres_for_primary_maintenance) },
 	/*
 	 * was demoted, need to be dead now.
 	 */
-	{ DRAINING_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_DRAINING_TO_DEMOTE_TIMEOUT, &fsm_stop_postgres },
-	{ DEMOTE_TIMEOUT_STATE, DEMOTED_STATE, COMMENT_DEMOTE_TIMEOUT_TO_DEMOTED,  &fsm_stop_postgres},
+	{ DRAINING_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_DRAINING_TO_DEMOTE_TIMEOUT, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
+	{ DEMOTE_TIMEOUT_STATE, DEMOTED_STATE, COMMENT_DEMOTE_TIMEOUT_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
 
 	/*
 	 * wait_primary stops reporting, is (supposed) dead now
 	 */
-	{ WAIT_PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
+	{ WAIT_PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, FSM_TRANSITION_FUNCTION(fsm_stop_postgres) },
 
 	/*
 	 * was demoted after a failure, but standby was forcibly removed
 	 */
-	{ DEMOTED_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, &fsm_resume_as_primary },
-	{ DEMOTE_TIMEOUT_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, &fsm_resume_as_primary },
-	{ DRAINING_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, &fsm_resume_as_primary },
+	{ DEMOTED_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_resume_as_primary) },
+	{ DEMOTE_TIMEOUT_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_resume_as_primary) },
+	{ DRAINING_STATE, SINGLE_STATE, COMMENT_DEMOTED_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_resume_as_primary) },
 
 	/*
 	 * primary was forcibly removed
 	 */
-	{ SECONDARY_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, &fsm_promote_standby },
-	{ CATCHINGUP_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, &fsm_promote_standby },
-	{ PREP_PROMOTION_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, &fsm_promote_standby },
+	{ SECONDARY_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
+	{ CATCHINGUP_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
+	{ PREP_PROMOTION_STATE, SINGLE_STATE, COMMENT_LOST_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
 
 	/*
 	 * went down to force the primary to time out, but then it was removed
 	 */
-	{ STOP_REPLICATION_STATE, SINGLE_STATE, COMMENT_REPLICATION_TO_SINGLE, &fsm_promote_standby },
+	{ STOP_REPLICATION_STATE, SINGLE_STATE, COMMENT_REPLICATION_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
 
 	/*
 	 * all states should lead to SINGLE, including REPORT_LSN
 	 */
-	{ REPORT_LSN_STATE, SINGLE_STATE, COMMENT_REPORT_LSN_TO_SINGLE, &fsm_promote_standby },
+	{ REPORT_LSN_STATE, SINGLE_STATE, COMMENT_REPORT_LSN_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
 
 
 	/*
 	 * On the Primary, wait for a standby to be ready: WAIT_PRIMARY
 	 */
-	{ SINGLE_STATE, WAIT_PRIMARY_STATE, COMMENT_SINGLE_TO_WAIT_PRIMARY, &fsm_prepare_replication },
-	{ PRIMARY_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, &fsm_prepare_replication },
-	{ PRIMARY_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, &fsm_disable_sync_rep },
-	{ JOIN_PRIMARY_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, &fsm_disable_sync_rep },
-	{ WAIT_PRIMARY_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, &fsm_prepare_replication },
+	{ SINGLE_STATE, WAIT_PRIMARY_STATE, COMMENT_SINGLE_TO_WAIT_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_prepare_replication) },
+	{ PRIMARY_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_prepare_replication) },
+	{ PRIMARY_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_disable_sync_rep) },
+	{ JOIN_PRIMARY_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_disable_sync_rep) },
+	{ WAIT_PRIMARY_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_prepare_replication) },
 
 	/*
 	 * Situation is getting back to normal on the primary
 	 */
-	{ WAIT_PRIMARY_STATE, PRIMARY_STATE, COMMENT_WAIT_PRIMARY_TO_PRIMARY, &fsm_enable_sync_rep },
-	{ JOIN_PRIMARY_STATE, PRIMARY_STATE, COMMENT_JOIN_PRIMARY_TO_PRIMARY, &fsm_enable_sync_rep },
-	{ DEMOTE_TIMEOUT_STATE, PRIMARY_STATE, COMMENT_DEMOTE_TO_PRIMARY, &fsm_start_postgres },
+	{ WAIT_PRIMARY_STATE, PRIMARY_STATE, COMMENT_WAIT_PRIMARY_TO_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_enable_sync_rep) },
+	{ JOIN_PRIMARY_STATE, PRIMARY_STATE, COMMENT_JOIN_PRIMARY_TO_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_enable_sync_rep) },
+	{ DEMOTE_TIMEOUT_STATE, PRIMARY_STATE, COMMENT_DEMOTE_TO_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_start_postgres) },
 
 	/*
 	 * The primary is now ready to accept a standby, we're the standby
 	 */
-	{ WAIT_STANDBY_STATE, CATCHINGUP_STATE, COMMENT_WAIT_STANDBY_TO_CATCHINGUP, &fsm_init_standby },
-	{ DEMOTED_STATE, CATCHINGUP_STATE, COMMENT_DEMOTED_TO_CATCHINGUP, &fsm_rewind_or_init },
-	{ SECONDARY_STATE, CATCHINGUP_STATE, COMMENT_SECONDARY_TO_CATCHINGUP, &fsm_follow_new_primary },
+	{ WAIT_STANDBY_STATE, CATCHINGUP_STATE, COMMENT_WAIT_STANDBY_TO_CATCHINGUP, FSM_TRANSITION_FUNCTION(fsm_init_standby) },
+	{ DEMOTED_STATE, CATCHINGUP_STATE, COMMENT_DEMOTED_TO_CATCHINGUP, FSM_TRANSITION_FUNCTION(fsm_rewind_or_init) },
+	{ SECONDARY_STATE, CATCHINGUP_STATE, COMMENT_SECONDARY_TO_CATCHINGUP, FSM_TRANSITION_FUNCTION(fsm_follow_new_primary) },
 
 	/*
 	 * We're asked to be a standby.
 	 */
-	{ CATCHINGUP_STATE, SECONDARY_STATE, COMMENT_CATCHINGUP_TO_SECONDARY, &fsm_prepare_for_secondary },
+	{ CATCHINGUP_STATE, SECONDARY_STATE, COMMENT_CATCHINGUP_TO_SECONDARY, FSM_TRANSITION_FUNCTION(fsm_prepare_for_secondary) },
 
 	/*
 	 * The standby is asked to prepare its own promotion
 	 */
-	{ SECONDARY_STATE, PREP_PROMOTION_STATE, COMMENT_SECONDARY_TO_PREP_PROMOTION, &fsm_prepare_standby_for_promotion },
-	{ CATCHINGUP_STATE, PREP_PROMOTION_STATE, COMMENT_SECONDARY_TO_PREP_PROMOTION, &fsm_prepare_standby_for_promotion },
+	{ SECONDARY_STATE, PREP_PROMOTION_STATE, COMMENT_SECONDARY_TO_PREP_PROMOTION, FSM_TRANSITION_FUNCTION(fsm_prepare_standby_for_promotion) },
+	{ CATCHINGUP_STATE, PREP_PROMOTION_STATE, COMMENT_SECONDARY_TO_PREP_PROMOTION, FSM_TRANSITION_FUNCTION(fsm_prepare_standby_for_promotion) },
 
 	/*
 	 * Forcefully stop replication by stopping the server.
 	 */
-	{ PREP_PROMOTION_STATE, STOP_REPLICATION_STATE, COMMENT_PROMOTION_TO_STOP_REPLICATION, &fsm_stop_replication },
+	{ PREP_PROMOTION_STATE, STOP_REPLICATION_STATE, COMMENT_PROMOTION_TO_STOP_REPLICATION, FSM_TRANSITION_FUNCTION(fsm_stop_replication) },
 
 	/*
 	 * finish the promotion
 	 */
-	{ STOP_REPLICATION_STATE, WAIT_PRIMARY_STATE, COMMENT_STOP_REPLICATION_TO_WAIT_PRIMARY, &fsm_promote_standby_to_primary },
-	{ PREP_PROMOTION_STATE, WAIT_PRIMARY_STATE, COMMENT_BLOCKED_WRITES, &fsm_promote_standby },
+	{ STOP_REPLICATION_STATE, WAIT_PRIMARY_STATE, COMMENT_STOP_REPLICATION_TO_WAIT_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_promote_standby_to_primary) },
+	{ PREP_PROMOTION_STATE, WAIT_PRIMARY_STATE, COMMENT_BLOCKED_WRITES, FSM_TRANSITION_FUNCTION(fsm_promote_standby) },
 
 	/*
 	 * Just wait until primary is ready
@@ -340,11 +341,11 @@ KeeperFSMTransition KeeperFSM[] = {
 	 */
 	{ SECONDARY_STATE, WAIT_MAINTENANCE_STATE, COMMENT_SECONDARY_TO_WAIT_MAINTENANCE, NULL },
 	{ CATCHINGUP_STATE, WAIT_MAINTENANCE_STATE, COMMENT_SECONDARY_TO_WAIT_MAINTENANCE, NULL },
-	{ SECONDARY_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, &fsm_start_maintenance_on_standby },
-	{ CATCHINGUP_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, &fsm_start_maintenance_on_standby },
-	{ WAIT_MAINTENANCE_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, &fsm_start_maintenance_on_standby },
-	{ MAINTENANCE_STATE, CATCHINGUP_STATE, COMMENT_MAINTENANCE_TO_CATCHINGUP, &fsm_restart_standby },
-	{ PREPARE_MAINTENANCE_STATE, CATCHINGUP_STATE, COMMENT_MAINTENANCE_TO_CATCHINGUP, &fsm_restart_standby },
+	{ SECONDARY_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_start_maintenance_on_standby) },
+	{ CATCHINGUP_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_start_maintenance_on_standby) },
+	{ WAIT_MAINTENANCE_STATE, MAINTENANCE_STATE, COMMENT_SECONDARY_TO_MAINTENANCE, FSM_TRANSITION_FUNCTION(fsm_start_maintenance_on_standby) },
+	{ MAINTENANCE_STATE, CATCHINGUP_STATE, COMMENT_MAINTENANCE_TO_CATCHINGUP, FSM_TRANSITION_FUNCTION(fsm_restart_standby) },
+	{ PREPARE_MAINTENANCE_STATE, CATCHINGUP_STATE, COMMENT_MAINTENANCE_TO_CATCHINGUP, FSM_TRANSITION_FUNCTION(fsm_restart_standby) },
 
 	/*
 	 * Applying new replication/cluster settings (per node replication quorum,
@@ -354,46 +355,46 @@ KeeperFSMTransition KeeperFSM[] = {
 	 */
 	{ PRIMARY_STATE, APPLY_SETTINGS_STATE, COMMENT_PRIMARY_TO_APPLY_SETTINGS, NULL },
 	{ WAIT_PRIMARY_STATE, APPLY_SETTINGS_STATE, COMMENT_PRIMARY_TO_APPLY_SETTINGS, NULL },
-	{ APPLY_SETTINGS_STATE, PRIMARY_STATE, COMMENT_APPLY_SETTINGS_TO_PRIMARY, &fsm_enable_sync_rep },
+	{ APPLY_SETTINGS_STATE, PRIMARY_STATE, COMMENT_APPLY_SETTINGS_TO_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_enable_sync_rep) },
 
-	{ APPLY_SETTINGS_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, &fsm_disable_replication },
-	{ APPLY_SETTINGS_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, &fsm_disable_sync_rep },
-	{ APPLY_SETTINGS_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, &fsm_prepare_replication },
+	{ APPLY_SETTINGS_STATE, SINGLE_STATE, COMMENT_PRIMARY_TO_SINGLE, FSM_TRANSITION_FUNCTION(fsm_disable_replication) },
+	{ APPLY_SETTINGS_STATE, WAIT_PRIMARY_STATE, COMMENT_PRIMARY_TO_WAIT_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_disable_sync_rep) },
+	{ APPLY_SETTINGS_STATE, JOIN_PRIMARY_STATE, COMMENT_PRIMARY_TO_JOIN_PRIMARY, FSM_TRANSITION_FUNCTION(fsm_prepare_replication) },
 
 	/*
 	 * In case of multiple standbys, failover begins with reporting current LSN
 	 */
-	{ SECONDARY_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
-	{ CATCHINGUP_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
-	{ MAINTENANCE_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
-	{ PREPARE_MAINTENANCE_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
+	{ SECONDARY_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn) },
+	{ CATCHINGUP_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn) },
+	{ MAINTENANCE_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn) },
+	{ PREPARE_MAINTENANCE_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn) },
 
-	{ REPORT_LSN_STATE, PREP_PROMOTION_STATE, COMMENT_REPORT_LSN_TO_PREP_PROMOTION, &fsm_prepare_standby_for_promotion },
+	{ REPORT_LSN_STATE, PREP_PROMOTION_STATE, COMMENT_REPORT_LSN_TO_PREP_PROMOTION, FSM_TRANSITION_FUNCTION(fsm_prepare_standby_for_promotion) },
 
-	{ REPORT_LSN_STATE, FAST_FORWARD_STATE, COMMENT_REPORT_LSN_TO_FAST_FORWARD, &fsm_fast_forward },
-	{ FAST_FORWARD_STATE, PREP_PROMOTION_STATE, COMMENT_FAST_FORWARD_TO_PREP_PROMOTION, &fsm_cleanup_as_primary },
+	{ REPORT_LSN_STATE, FAST_FORWARD_STATE, COMMENT_REPORT_LSN_TO_FAST_FORWARD, FSM_TRANSITION_FUNCTION(fsm_fast_forward) },
+	{ FAST_FORWARD_STATE, PREP_PROMOTION_STATE, COMMENT_FAST_FORWARD_TO_PREP_PROMOTION, FSM_TRANSITION_FUNCTION(fsm_cleanup_as_primary) },
 
-	{ REPORT_LSN_STATE, JOIN_SECONDARY_STATE, COMMENT_REPORT_LSN_TO_JOIN_SECONDARY, &fsm_checkpoint_and_stop_postgres },
-	{ REPORT_LSN_STATE, SECONDARY_STATE, COMMENT_REPORT_LSN_TO_JOIN_SECONDARY, &fsm_follow_new_primary },
-	{ JOIN_SECONDARY_STATE, SECONDARY_STATE, COMMENT_JOIN_SECONDARY_TO_SECONDARY, &fsm_follow_new_primary },
+	{ REPORT_LSN_STATE, JOIN_SECONDARY_STATE, COMMENT_REPORT_LSN_TO_JOIN_SECONDARY, FSM_TRANSITION_FUNCTION(fsm_checkpoint_and_stop_postgres) },
+	{ REPORT_LSN_STATE, SECONDARY_STATE, COMMENT_REPORT_LSN_TO_JOIN_SECONDARY, FSM_TRANSITION_FUNCTION(fsm_follow_new_primary) },
+	{ JOIN_SECONDARY_STATE, SECONDARY_STATE, COMMENT_JOIN_SECONDARY_TO_SECONDARY, FSM_TRANSITION_FUNCTION(fsm_follow_new_primary) },
 
 	/*
 	 * When an old primary gets back online and reaches draining/draining, if a
 	 * failover is on-going then have it join the selection process.
 	 */
-	{ DRAINING_STATE, REPORT_LSN_STATE, COMMENT_DRAINING_TO_REPORT_LSN, &fsm_report_lsn_and_drop_replication_slots },
-	{ DEMOTED_STATE, REPORT_LSN_STATE, COMMENT_DEMOTED_TO_REPORT_LSN, &fsm_report_lsn_and_drop_replication_slots },
+	{ DRAINING_STATE, REPORT_LSN_STATE, COMMENT_DRAINING_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn_and_drop_replication_slots) },
+	{ DEMOTED_STATE, REPORT_LSN_STATE, COMMENT_DEMOTED_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_report_lsn_and_drop_replication_slots) },
 
 	/*
 	 * When adding a new node and there is no primary, but there are existing
 	 * nodes that are not candidates for failover.
 	 */
-	{ INIT_STATE, REPORT_LSN_STATE, COMMENT_INIT_TO_REPORT_LSN, &fsm_init_from_standby },
+	{ INIT_STATE, REPORT_LSN_STATE, COMMENT_INIT_TO_REPORT_LSN, FSM_TRANSITION_FUNCTION(fsm_init_from_standby) },
 
 	/*
 	 * Dropping a node is a two-step process
 	 */
-	{ ANY_STATE, DROPPED_STATE, COMMENT_ANY_TO_DROPPED, &fsm_drop_node },
+	{ ANY_STATE, DROPPED_STATE, COMMENT_ANY_TO_DROPPED, FSM_TRANSITION_FUNCTION(fsm_drop_node) },
 
 	/*
 	 * This is the end, my friend.
@@ -446,6 +447,9 @@ keeper_fsm_step(Keeper *keeper)
 							 postgres->postgresSetup.control.timeline_id,
 							 postgres->currentLSN,
 							 postgres->pgsrSyncState,
+							 0,
+							 postgres->replayLSN,
+							 postgres->applyRate,
 							 &assignedState))
 	{
 		log_fatal("Failed to get the goal state from the monitor, "
@@ -495,6 +499,91 @@ keeper_fsm_step(Keeper *keeper)
 }
 
 
+/*
+ * The KeeperFSM array is the definition of our state machine, and what
+ * print_fsm_for_graphviz draws. To avoid a linear search of that array at
+ * each step, we index the first matching transition of every pair of
+ * (current, assigned) states in a dense table, built from KeeperFSM the
+ * first time we need it. Slots with no transition are set to -1.
+ */
+static int16_t KeeperFSMDispatch[NODE_STATE_COUNT][NODE_STATE_COUNT];
+static bool KeeperFSMDispatchReady = false;
+
+
+/*
+ * keeper_fsm_build_dispatch_table fills in KeeperFSMDispatch. The first
+ * matching transition in KeeperFSM order wins, as in a linear search.
+ */
+static void
+keeper_fsm_build_dispatch_table(void)
+{
+	for (int current = 0; current < NODE_STATE_COUNT; current++)
+	{
+		for (int assigned = 0; assigned < NODE_STATE_COUNT; assigned++)
+		{
+			KeeperFSMDispatch[current][assigned] = -1;
+		}
+	}
+
+	for (int index = 0; KeeperFSM[index].current != NO_STATE; index++)
+	{
+		KeeperFSMTransition *transition = &(KeeperFSM[index]);
+
+		for (int current = 0; current < NODE_STATE_COUNT; current++)
+		{
+			if (!state_matches(transition->current, (NodeState) current))
+			{
+				continue;
+			}
+
+			for (int assigned = 0; assigned < NODE_STATE_COUNT; assigned++)
+			{
+				if (state_matches(transition->assigned, (NodeState) assigned) &&
+					KeeperFSMDispatch[current][assigned] == -1)
+				{
+					KeeperFSMDispatch[current][assigned] = index;
+				}
+			}
+		}
+	}
+
+	KeeperFSMDispatchReady = true;
+}
+
+
+/*
+ * keeper_fsm_find_transition returns the KeeperFSM transition from the
+ * current state to the assigned state, or NULL when there is none.
+ */
+static const KeeperFSMTransition *
+keeper_fsm_find_transition(NodeState current, NodeState assigned)
+{
+	if (current >= NODE_STATE_COUNT || assigned >= NODE_STATE_COUNT)
+	{
+		/* ANY_STATE is not in the table, search for it */
+		for (int index = 0; KeeperFSM[index].current != NO_STATE; index++)
+		{
+			if (state_matches(KeeperFSM[index].current, current) &&
+				state_matches(KeeperFSM[index].assigned, assigned))
+			{
+				return &(KeeperFSM[index]);
+			}
+		}
+
+		return NULL;
+	}
+
+	if (!KeeperFSMDispatchReady)
+	{
+		(void) keeper_fsm_build_dispatch_table();
+	}
+
+	int index = KeeperFSMDispatch[current][assigned];
+
+	return index == -1 ? NULL : &(KeeperFSM[index]);
+}
+
+
 /*
  * keeper_fsm_reach_assigned_state uses the KeeperFSM to drive a transition
  * from keeper->state->current_role to keeper->state->assigned_role, when
@@ -503,9 +592,7 @@ keeper_fsm_step(Keeper *keeper)
 bool
 keeper_fsm_reach_assigned_state(Keeper *keeper)
 {
-	int transitionIndex = 0;
 	KeeperStateData *keeperState = &(keeper->state);
-	KeeperFSMTransition transition = KeeperFSM[0];
 
 	if (keeperState->current_role == keeperState->assigned_role)
 	{
@@ -515,80 +602,117 @@ keeper_fsm_reach_assigned_state(Keeper *keeper)
 		return true;
 	}
 
-	while (transition.current != NO_STATE)
-	{
-		if (state_matches(transition.current, keeperState->current_role) &&
-			state_matches(transition.assigned, keeperState->assigned_role))
-		{
-			bool ret = false;
+	const KeeperFSMTransition *transition =
+		keeper_fsm_find_transition(keeperState->current_role,
+								   keeperState->assigned_role);
 
-			/* avoid logging "#any state#" to the user */
-			if (transition.current != ANY_STATE)
-			{
-				log_info("FSM transition from \"%s\" to \"%s\"%s%s",
-						 NodeStateToString(transition.current),
-						 NodeStateToString(transition.assigned),
-						 transition.comment ? ": " : "",
-						 transition.comment ? transition.comment : "");
-			}
-			else
-			{
-				log_info("FSM transition to \"%s\"%s%s",
-						 NodeStateToString(transition.assigned),
-						 transition.comment ? ": " : "",
-						 transition.comment ? transition.comment : "");
-			}
+	if (transition == NULL)
+	{
+		log_fatal("pg_autoctl does not know how to reach state \"%s\" from \"%s\"",
+				  NodeStateToString(keeperState->assigned_role),
+				  NodeStateToString(keeperState->current_role));
 
-			if (transition.transitionFunction)
-			{
-				ret = (*transition.transitionFunction)(keeper);
+		return false;
+	}
 
-				log_debug("Transition function returned: %s",
-						  ret ? "true" : "false");
-			}
-			else
-			{
-				ret = true;
-				log_debug("No transition function, assigning new state");
-			}
+	bool ret = false;
 
-			if (ret)
-			{
-				keeperState->current_role = keeperState->assigned_role;
+	/* avoid logging "#any state#" to the user */
+	if (transition->current != ANY_STATE)
+	{
+		log_info("FSM transition from \"%s\" to \"%s\"%s%s",
+				 NodeStateToString(transition->current),
+				 NodeStateToString(transition->assigned),
+				 transition->comment ? ": " : "",
+				 transition->comment ? transition->comment : "");
+	}
+	else
+	{
+		log_info("FSM transition to \"%s\"%s%s",
+				 NodeStateToString(transition->assigned),
+				 transition->comment ? ": " : "",
+				 transition->comment ? transition->comment : "");
+	}
 
-				log_info("Transition complete: current state is now \"%s\"",
-						 NodeStateToString(keeperState->current_role));
-			}
-			else
-			{
-				/* avoid logging "#any state#" to the user */
-				if (transition.current != ANY_STATE)
-				{
-					log_error("Failed to transition from state \"%s\" "
-							  "to state \"%s\", see above.",
-							  NodeStateToString(transition.current),
-							  NodeStateToString(transition.assigned));
-				}
-				else
-				{
-					log_error("Failed to transition to state \"%s\", see above.",
-							  NodeStateToString(transition.assigned));
-				}
-			}
+	if (transition->transitionFunction)
+	{
+		TraceSpan span = { 0 };
 
-			return ret;
+		/*
+		 * Transitions to a standby state may run pg_basebackup or
+		 * pg_rewind, report their progress to the monitor.
+		 */
+		if (!keeper->config.monitorDisabled)
+		{
+			(void) pg_set_progress_hook(&keeper_report_progress, keeper);
 		}
-		transition = KeeperFSM[++transitionIndex];
+
+		/*
+		 * The transition is traced as a span of the monitor's trace
+		 * for the goal state, so that it shows up in the same flame
+		 * chart as the transitions of the other nodes.
+		 */
+		trace_span_start(&span,
+						 transition->transitionFunctionName,
+						 keeper->goalTraceId);
+		trace_span_set_attribute(&span, "pg_auto_failover.node.id",
+								 "%d",
+								 keeperState->current_node_id);
+		trace_span_set_attribute(&span, "pg_auto_failover.group.id",
+								 "%d",
+								 keeperState->current_group);
+		trace_span_set_attribute(&span, "pg_auto_failover.current_state",
+								 "%s",
+								 NodeStateToString(
+									 keeperState->current_role));
+		trace_span_set_attribute(&span, "pg_auto_failover.goal_state",
+								 "%s",
+								 NodeStateToString(
+									 keeperState->assigned_role));
+
+		ret = (*transition->transitionFunction)(keeper);
+
+		trace_span_end(&span, ret);
+
+		(void) pg_set_progress_hook(NULL, NULL);
+
+		log_debug("Transition function returned: %s",
+				  ret ? "true" : "false");
+	}
+	else
+	{
+		ret = true;
+		log_debug("No transition function, assigning new state");
 	}
 
-	/*
-	 * we didn't find a transition
-	 */
-	log_fatal("pg_autoctl does not know how to reach state \"%s\" from \"%s\"",
-			  NodeStateToString(keeperState->assigned_role),
-			  NodeStateToString(keeperState->current_role));
+	if (ret)
+	{
+		keeperState->current_role = keeperState->assigned_role;
+
+		/* the transition may have edited what we verified in the old state */
+		keeper->ensuredTime = 0;
+
+		log_info("Transition complete: current state is now \"%s\"",
+				 NodeStateToString(keeperState->current_role));
+	}
+	else
+	{
+		/* avoid logging "#any state#" to the user */
+		if (transition->current != ANY_STATE)
+		{
+			log_error("Failed to transition from state \"%s\" "
+					  "to state \"%s\", see above.",
+					  NodeStateToString(transition->current),
+					  NodeStateToString(transition->assigned));
+		}
+		else
+		{
+			log_error("Failed to transition to state \"%s\", see above.",
+					  NodeStateToString(transition->assigned));
+		}
+	}
 
-	return false;
+	return ret;
 }
 
 
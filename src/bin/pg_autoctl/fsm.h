@@ -31,8 +31,12 @@ typedef struct KeeperFSMTransition
 	NodeState assigned;
 	const char *comment;
 	ReachAssignedStateFunction transitionFunction;
+	const char *transitionFunctionName; /* names the trace span */
 } KeeperFSMTransition;
 
+/* fills in both the transitionFunction and transitionFunctionName fields */
+#define FSM_TRANSITION_FUNCTION(function) &function, #function
+
 /* src/bin/pg_autoctl/fsm.c */
 extern KeeperFSMTransition KeeperFSM[];
 
@@ -56,6 +60,7 @@ bool fsm_apply_settings(Keeper *keeper);
 
 bool fsm_start_postgres(Keeper *keeper);
 bool fsm_stop_postgres(Keeper *keeper);
+bool fsm_prepare_demotion_and_stop_postgres(Keeper *keeper);
 bool fsm_stop_postgres_for_primary_maintenance(Keeper *keeper);
 bool fsm_stop_postgres_and_setup_standby(Keeper *keeper);
 bool fsm_checkpoint_and_stop_postgres(Keeper *keeper);
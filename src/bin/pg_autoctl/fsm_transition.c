@@ -36,12 +36,18 @@
 #include "keeper_pg_init.h"
 #include "log.h"
 #include "monitor.h"
+#include "parsing.h"
 #include "pghba.h"
+#include "pooler.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "trace.h"
 
 
 static bool fsm_init_standby_from_upstream(Keeper *keeper);
+static bool fsm_init_standby_from_secondary(Keeper *keeper, bool *done);
+static void fsm_apply_role_settings(Keeper *keeper, bool standby);
+static void fsm_drain_sessions(Keeper *keeper);
 
 
 /*
@@ -180,8 +186,14 @@ fsm_init_primary(Keeper *keeper)
 	 */
 	if (pgInstanceIsOurs)
 	{
+		TraceSpan span = { 0 };
+
 		/* create the target database and install our extension there */
-		if (!create_database_and_extension(keeper))
+		trace_span_start(&span, "create database and extension", NULL);
+		bool created = create_database_and_extension(keeper);
+		trace_span_end(&span, created);
+
+		if (!created)
 		{
 			/* errors have already been logged */
 			return false;
@@ -239,9 +251,14 @@ fsm_init_primary(Keeper *keeper)
 	 * self-signed certificate for the server. We place the certificate and
 	 * private key in $PGDATA/server.key and $PGDATA/server.crt
 	 */
+	TraceSpan settingsSpan = { 0 };
+
+	trace_span_start(&settingsSpan, "configure postgres", NULL);
+
 	if (!keeper_create_self_signed_cert(keeper))
 	{
 		/* errors have already been logged */
+		trace_span_end(&settingsSpan, false);
 		return false;
 	}
 
@@ -249,52 +266,73 @@ fsm_init_primary(Keeper *keeper)
 	{
 		log_error("Failed to initialize postgres as primary because "
 				  "adding default settings failed, see above for details");
+		trace_span_end(&settingsSpan, false);
 		return false;
 	}
 
+	(void) fsm_apply_role_settings(keeper, false);
+
+	trace_span_end(&settingsSpan, true);
+
 	/*
 	 * Now add the role and HBA entries necessary for the monitor to run health
 	 * checks on the local Postgres node.
 	 */
 	if (!config->monitorDisabled)
 	{
-		char monitorHostname[_POSIX_HOST_NAME_MAX];
-		int monitorPort = 0;
 		int connlimit = 1;
 
-		if (!hostname_from_uri(config->monitor_pguri,
-							   monitorHostname, _POSIX_HOST_NAME_MAX,
-							   &monitorPort))
-		{
-			/* developer error, this should never happen */
-			log_fatal("BUG: monitor_pguri should be validated before calling "
-					  "fsm_init_primary");
-			return false;
-		}
-
 		/*
-		 * We need to add the monitor host:port in the HBA settings for the
-		 * node to enable the health checks.
-		 *
-		 * Node that we forcibly use the authentication method "trust" for the
-		 * pgautofailover_monitor user, which from the monitor also uses the
-		 * hard-coded password PG_AUTOCTL_HEALTH_PASSWORD. The idea is to avoid
-		 * leaking information from the passfile, environment variable, or
-		 * other places.
+		 * The monitor URI might be a multi-host connection string that lists
+		 * the monitor standby nodes too, which run health checks when they
+		 * take over: add an HBA entry for each of the monitor hosts.
 		 */
-		if (!primary_create_user_with_hba(postgres,
-										  PG_AUTOCTL_HEALTH_USERNAME,
-										  PG_AUTOCTL_HEALTH_PASSWORD,
-										  monitorHostname,
-										  "trust",
-										  pgSetup->hbaLevel,
-										  connlimit))
+		for (int index = 0;; index++)
 		{
-			log_error(
-				"Failed to initialise postgres as primary because "
-				"creating the database user that the pg_auto_failover monitor "
-				"uses for health checks failed, see above for details");
-			return false;
+			char monitorHostname[_POSIX_HOST_NAME_MAX];
+			int monitorPort = 0;
+			bool found = false;
+
+			if (!hostname_from_uri_at(config->monitor_pguri, index,
+									  monitorHostname, _POSIX_HOST_NAME_MAX,
+									  &monitorPort, &found))
+			{
+				/* developer error, this should never happen */
+				log_fatal("BUG: monitor_pguri should be validated before "
+						  "calling fsm_init_primary");
+				return false;
+			}
+
+			if (!found)
+			{
+				break;
+			}
+
+			/*
+			 * We need to add the monitor host:port in the HBA settings for
+			 * the node to enable the health checks.
+			 *
+			 * Node that we forcibly use the authentication method "trust"
+			 * for the pgautofailover_monitor user, which from the monitor
+			 * also uses the hard-coded password PG_AUTOCTL_HEALTH_PASSWORD.
+			 * The idea is to avoid leaking information from the passfile,
+			 * environment variable, or other places.
+			 */
+			if (!primary_create_user_with_hba(postgres,
+											  PG_AUTOCTL_HEALTH_USERNAME,
+											  PG_AUTOCTL_HEALTH_PASSWORD,
+											  monitorHostname,
+											  "trust",
+											  pgSetup->hbaLevel,
+											  connlimit))
+			{
+				log_error(
+					"Failed to initialise postgres as primary because "
+					"creating the database user that the pg_auto_failover "
+					"monitor uses for health checks failed, "
+					"see above for details");
+				return false;
+			}
 		}
 	}
 
@@ -434,6 +472,15 @@ fsm_resume_as_primary(Keeper *keeper)
 		return false;
 	}
 
+	/* we might have switched to read-only while draining */
+	if (!pgsql_set_default_transaction_mode_read_write(
+			&(keeper->postgres.sqlClient)))
+	{
+		log_error("Failed to set default_transaction_read_only to off "
+				  "in order to resume as a primary, see above for details");
+		return false;
+	}
+
 	return true;
 }
 
@@ -588,6 +635,7 @@ fsm_enable_sync_rep(Keeper *keeper)
 										 &pgSetup->is_in_recovery,
 										 postgres->pgsrSyncState,
 										 postgres->currentLSN,
+										 postgres->replayLSN,
 										 &(postgres->postgresSetup.control)))
 		{
 			log_error("Failed to update the local Postgres metadata");
@@ -692,6 +740,14 @@ fsm_start_postgres(Keeper *keeper)
 		return false;
 	}
 
+	/* we might have switched to read-only while draining */
+	if (!pgsql_set_default_transaction_mode_read_write(&(postgres->sqlClient)))
+	{
+		log_error("Failed to set default_transaction_read_only to off "
+				  "in order to resume as a primary, see above for details");
+		return false;
+	}
+
 	return true;
 }
 
@@ -708,6 +764,182 @@ fsm_stop_postgres(Keeper *keeper)
 }
 
 
+/*
+ * fsm_prepare_demotion_and_stop_postgres is used when the primary is being
+ * drained as part of a failover or a switchover. While the application is
+ * still connected, we run a CHECKPOINT and then wait until the synchronous
+ * standby has caught-up with our WAL, so that the shutdown checkpoint and the
+ * standby's own catch-up are both short once we stop Postgres.
+ *
+ * The preparation is bounded by timeout.prepare_demotion, and failing to
+ * prepare never prevents the demotion: in the worst case we stop Postgres
+ * like fsm_stop_postgres does. When timeout.drain_sessions is set, we first
+ * end the application transactions, see fsm_drain_sessions.
+ */
+bool
+fsm_prepare_demotion_and_stop_postgres(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	PGSQL *pgsql = &(postgres->sqlClient);
+
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "fsm_prepare_demotion_and_stop_postgres", NULL);
+
+	/* hold the application transactions in the poolers, if any */
+	if (!pooler_pause(config))
+	{
+		log_warn("Failed to pause the connection poolers, "
+				 "see above for details");
+	}
+
+	/* the new primary resumes the poolers, not us */
+	keeper->poolerResumed = false;
+
+	if (config->drain_sessions > 0 && pg_setup_is_running(pgSetup))
+	{
+		(void) fsm_drain_sessions(keeper);
+	}
+
+	if (config->prepare_demotion > 0 && pg_setup_is_running(pgSetup))
+	{
+		uint64_t startTime = time(NULL);
+		int timeoutMs = config->prepare_demotion * 1000;
+
+		log_info("Preparing Postgres shutdown: CHECKPOINT;");
+
+		if (!pgsql_checkpoint_with_timeout(pgsql, timeoutMs))
+		{
+			log_warn("Failed to checkpoint before stopping Postgres");
+		}
+
+		int64_t lagBytes = -1;
+
+		for (;;)
+		{
+			if (!pgsql_get_sync_standby_lag_bytes(pgsql, &lagBytes))
+			{
+				log_warn("Failed to get the replication lag of the "
+						 "synchronous standby nodes");
+				break;
+			}
+
+			if (lagBytes <= PG_AUTOCTL_DEMOTION_CATCHUP_LAG)
+			{
+				log_info("Synchronous standby nodes are %" PRId64 " bytes "
+						 "behind, stopping Postgres",
+						 lagBytes);
+				break;
+			}
+
+			if ((time(NULL) - startTime) >= config->prepare_demotion)
+			{
+				log_warn("Synchronous standby nodes are still %" PRId64 " "
+						 "bytes behind after timeout.prepare_demotion (%ds), "
+						 "stopping Postgres anyway",
+						 lagBytes,
+						 config->prepare_demotion);
+				break;
+			}
+
+			pg_usleep(100 * 1000); /* 100 ms */
+		}
+
+		pgsql_finish(pgsql);
+	}
+
+	log_info("Stopping Postgres at \"%s\"", pgSetup->pgdata);
+
+	bool success = ensure_postgres_service_is_stopped(postgres);
+
+	trace_span_end(&span, success);
+
+	return success;
+}
+
+
+/*
+ * fsm_drain_sessions ends the application transactions on a primary that is
+ * being drained, so that they don't generate WAL that the synchronous
+ * standby then has to catch-up with, and the time it takes to demote the
+ * primary doesn't depend on the longest transaction.
+ *
+ * We switch to read-only first, so that no new write transaction starts, and
+ * give the current transactions timeout.drain_sessions seconds to finish.
+ * Then we cancel the queries that are still running, and after another
+ * second, we terminate the sessions that are still in a transaction. Errors
+ * are only logged: Postgres is stopped next anyway.
+ */
+static void
+fsm_drain_sessions(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+
+	uint64_t startTime = time(NULL);
+	int count = 0;
+
+	if (!pgsql_set_default_transaction_mode_read_only(pgsql))
+	{
+		log_warn("Failed to switch to read-only mode before draining the "
+				 "application sessions");
+	}
+
+	for (;;)
+	{
+		if (!pgsql_count_sessions_in_transaction(pgsql, &count))
+		{
+			log_warn("Failed to count the sessions in a transaction, "
+					 "see above for details");
+			return;
+		}
+
+		if (count == 0)
+		{
+			log_info("All the application transactions are done");
+			return;
+		}
+
+		if ((time(NULL) - startTime) >= config->drain_sessions)
+		{
+			break;
+		}
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+
+	if (pgsql_signal_sessions_in_transaction(pgsql, false, &count) &&
+		count > 0)
+	{
+		log_warn("Cancelled the queries of %d sessions still in a "
+				 "transaction after timeout.drain_sessions (%ds)",
+				 count,
+				 config->drain_sessions);
+
+		startTime = time(NULL);
+
+		while ((time(NULL) - startTime) < PG_AUTOCTL_DRAIN_CANCEL_WAIT)
+		{
+			if (!pgsql_count_sessions_in_transaction(pgsql, &count) ||
+				count == 0)
+			{
+				break;
+			}
+
+			pg_usleep(100 * 1000); /* 100 ms */
+		}
+	}
+
+	if (pgsql_signal_sessions_in_transaction(pgsql, true, &count) &&
+		count > 0)
+	{
+		log_warn("Terminated %d sessions still in a transaction", count);
+	}
+}
+
+
 /*
  * fsm_stop_postgres_for_primary_maintenance is used when pg_autoctl enable
  * maintenance has been used on the primary server, we do a couple CHECKPOINT
@@ -716,7 +948,15 @@ fsm_stop_postgres(Keeper *keeper)
 bool
 fsm_stop_postgres_for_primary_maintenance(Keeper *keeper)
 {
-	return fsm_checkpoint_and_stop_postgres(keeper);
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "fsm_checkpoint_and_stop_postgres", NULL);
+
+	bool success = fsm_checkpoint_and_stop_postgres(keeper);
+
+	trace_span_end(&span, success);
+
+	return success;
 }
 
 
@@ -822,13 +1062,21 @@ fsm_checkpoint_and_stop_postgres(Keeper *keeper)
 		 */
 		log_info("Preparing Postgres shutdown: CHECKPOINT;");
 
+		TraceSpan span = { 0 };
+		bool checkpointed = true;
+
+		trace_span_start(&span, "CHECKPOINT", NULL);
+
 		for (int i = 0; i < 2; i++)
 		{
 			if (!pgsql_checkpoint(pgsql))
 			{
 				log_warn("Failed to checkpoint before stopping Postgres");
+				checkpointed = false;
 			}
 		}
+
+		trace_span_end(&span, checkpointed);
 	}
 
 	log_info("Stopping Postgres at \"%s\"", pgSetup->pgdata);
@@ -862,7 +1110,21 @@ fsm_init_standby_from_upstream(Keeper *keeper)
 	bool skipBaseBackup = file_exists(keeper->config.pathnames.init) &&
 						  keeper->initState.pgInitState == PRE_INIT_STATE_EXISTS;
 
-	if (!standby_init_database(postgres, config->hostname, skipBaseBackup))
+	standby_init_basebackup_options(postgres,
+									config->basebackupCompress,
+									config->basebackupWalMethod,
+									config->basebackupManifestChecksums,
+									config->minimum_backup_rate,
+									config->cloneStreams);
+
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "init standby database", NULL);
+	bool initialized =
+		standby_init_database(postgres, config->hostname, skipBaseBackup);
+	trace_span_end(&span, initialized);
+
+	if (!initialized)
 	{
 		log_error("Failed to initialize standby server, see above for details");
 		return false;
@@ -873,7 +1135,12 @@ fsm_init_standby_from_upstream(Keeper *keeper)
 		bool forceCacheInvalidation = true;
 
 		/* write our own HBA rules, pg_basebackup copies pg_hba.conf too */
-		if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
+		trace_span_start(&span, "refresh HBA rules", NULL);
+		bool refreshed =
+			keeper_refresh_other_nodes(keeper, forceCacheInvalidation);
+		trace_span_end(&span, refreshed);
+
+		if (!refreshed)
 		{
 			log_error("Failed to update HBA rules after a base backup");
 			return false;
@@ -943,7 +1210,157 @@ fsm_init_standby(Keeper *keeper)
 		return false;
 	}
 
-	return fsm_init_standby_from_upstream(keeper);
+	if (config->cloneSource == CLONE_SOURCE_STANDBY && !config->monitorDisabled)
+	{
+		bool done = false;
+
+		if (!fsm_init_standby_from_secondary(keeper, &done))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (done)
+		{
+			(void) fsm_apply_role_settings(keeper, true);
+			return true;
+		}
+	}
+
+	if (!fsm_init_standby_from_upstream(keeper))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* pg_basebackup copied the role settings of the primary */
+	(void) fsm_apply_role_settings(keeper, true);
+
+	return true;
+}
+
+
+/*
+ * fsm_init_standby_from_secondary implements replication.clone_source set to
+ * "standby": the data files of the new standby node are copied from a healthy
+ * secondary node rather than from the primary node, so that pg_basebackup
+ * does not compete with the production workload on the primary.
+ *
+ * Once the base backup is done, primary_conninfo is set to the primary node
+ * again and Postgres is restarted. The secondary node maintains a replication
+ * slot for our node, which pg_basebackup uses, and the primary has been
+ * retaining WAL for us in our replication slot there since we registered.
+ *
+ * When no secondary node is available for the copy, or when its replication
+ * slot for us has not been created yet, or when the base backup fails, done
+ * is set to false and the caller then copies the data files from the primary.
+ */
+static bool
+fsm_init_standby_from_secondary(Keeper *keeper, bool *done)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	NodeAddress primaryNode = upstream->primaryNode;
+	NodeAddress cloneSource = { 0 };
+	bool found = false;
+	bool hasReplicationSlot = false;
+
+	*done = false;
+
+	/*
+	 * The WAL produced during the copy is only retained by our slot on the
+	 * primary. At init time the primary might not have created it yet, then
+	 * pg_basebackup from the primary uses a temporary slot instead.
+	 */
+	if (!upstream_has_replication_slot(upstream, pgSetup, &hasReplicationSlot) ||
+		!hasReplicationSlot)
+	{
+		log_info("The replication slot \"%s\" has not been created yet "
+				 "on the primary node " NODE_FORMAT ", "
+				 "using the primary node instead",
+				 upstream->slotName,
+				 primaryNode.nodeId, primaryNode.name,
+				 primaryNode.host, primaryNode.port);
+		return true;
+	}
+
+	if (!monitor_get_clone_source(&(keeper->monitor),
+								  config->formation,
+								  keeper->state.current_group,
+								  &cloneSource,
+								  &found))
+	{
+		log_warn("Failed to get a secondary node to clone from, "
+				 "using the primary node instead");
+		return true;
+	}
+
+	if (!found)
+	{
+		log_info("No healthy secondary node to clone from, "
+				 "using the primary node instead");
+		return true;
+	}
+
+	upstream->primaryNode = cloneSource;
+
+	if (!upstream_has_replication_slot(upstream, pgSetup, &hasReplicationSlot) ||
+		!hasReplicationSlot)
+	{
+		log_info("The replication slot \"%s\" has not been created yet "
+				 "on secondary node " NODE_FORMAT ", "
+				 "using the primary node instead",
+				 upstream->slotName,
+				 cloneSource.nodeId, cloneSource.name,
+				 cloneSource.host, cloneSource.port);
+
+		upstream->primaryNode = primaryNode;
+		return true;
+	}
+
+	log_info("Initialising the standby from secondary node " NODE_FORMAT,
+			 cloneSource.nodeId, cloneSource.name,
+			 cloneSource.host, cloneSource.port);
+
+	if (!fsm_init_standby_from_upstream(keeper))
+	{
+		log_warn("Failed to initialise the standby from secondary node "
+				 NODE_FORMAT ", using the primary node instead",
+				 cloneSource.nodeId, cloneSource.name,
+				 cloneSource.host, cloneSource.port);
+
+		upstream->primaryNode = primaryNode;
+		return true;
+	}
+
+	/* now follow the primary node */
+	upstream->primaryNode = primaryNode;
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   upstream))
+	{
+		log_error("Failed to setup Postgres as a standby of the primary node "
+				  "after pg_basebackup from secondary node " NODE_FORMAT,
+				  cloneSource.nodeId, cloneSource.name,
+				  cloneSource.host, cloneSource.port);
+		return false;
+	}
+
+	if (!keeper_restart_postgres(keeper))
+	{
+		log_error("Failed to restart Postgres to follow the primary node, "
+				  "see above for details");
+		return false;
+	}
+
+	*done = true;
+
+	return true;
 }
 
 
@@ -1004,6 +1421,13 @@ fsm_rewind_or_init(Keeper *keeper)
 		log_warn("Failed to rewind demoted primary to standby, "
 				 "trying pg_basebackup instead");
 
+		standby_init_basebackup_options(postgres,
+										config->basebackupCompress,
+										config->basebackupWalMethod,
+										config->basebackupManifestChecksums,
+										config->minimum_backup_rate,
+										config->cloneStreams);
+
 		if (!standby_init_database(postgres, config->hostname, skipBaseBackup))
 		{
 			log_error("Failed to become standby server, see above for details");
@@ -1025,6 +1449,8 @@ fsm_rewind_or_init(Keeper *keeper)
 		}
 	}
 
+	(void) fsm_apply_role_settings(keeper, true);
+
 	/*
 	 * This node is now demoted: it used to be a primary node, it's not
 	 * anymore. The replication slots that used to be maintained by the
@@ -1057,15 +1483,16 @@ fsm_rewind_or_init(Keeper *keeper)
 bool
 fsm_prepare_for_secondary(Keeper *keeper)
 {
-	LocalPostgresServer *postgres = &(keeper->postgres);
-
 	/* first. check that we're on the same timeline as the new primary */
-	if (!standby_check_timeline_with_upstream(postgres))
+	if (!keeper_check_timeline_with_upstream(keeper))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
+	/* slots might have been dropped when following a new primary */
+	keeper->slotsMaintainedTime = 0;
+
 	return keeper_maintain_replication_slots(keeper);
 }
 
@@ -1094,6 +1521,17 @@ fsm_prepare_standby_for_promotion(Keeper *keeper)
 			  "prepare_promotion_walreceiver_timeout (%ds)",
 			  keeper->config.prepare_promotion_walreceiver);
 
+	/*
+	 * Load the primary's buffer cache contents into ours before we become the
+	 * new primary. This is bounded by timeout.prepare_promotion_prewarm and
+	 * failing to pre-warm the cache must not prevent the promotion.
+	 */
+	if (!keeper_prewarm_buffer_cache(keeper))
+	{
+		log_warn("Failed to pre-warm the buffer cache, "
+				 "continuing with the promotion");
+	}
+
 	return true;
 }
 
@@ -1132,13 +1570,28 @@ fsm_start_maintenance_on_standby(Keeper *keeper)
  * pg_rewind to make sure we're in a position to be a standby to the current
  * primary.
  *
- * So we're back to doing the exact same thing as fsm_rewind_or_init() now, and
- * that's why we just call that function.
+ * So we're back to doing the exact same thing as fsm_rewind_or_init() now.
+ * Once the node is a secondary again, the keeper warms it up before it
+ * becomes a preferred failover candidate again, see
+ * keeper_warm_up_after_maintenance.
  */
 bool
 fsm_restart_standby(Keeper *keeper)
 {
-	return fsm_rewind_or_init(keeper);
+	if (!fsm_rewind_or_init(keeper))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* pre-warm from a fresh block list of the current primary */
+	keeper->warmupPending = true;
+	keeper->warmupStartLSNKnown = false;
+	keeper->prewarmRefreshTime = 0;
+
+	keeper_report_progress(keeper, "warmup", 0, 0);
+
+	return true;
 }
 
 
@@ -1196,6 +1649,8 @@ fsm_promote_standby(Keeper *keeper)
 		return false;
 	}
 
+	(void) fsm_apply_role_settings(keeper, false);
+
 	if (!fsm_disable_replication(keeper))
 	{
 		log_error("Failed to disable synchronous replication after promotion, "
@@ -1273,6 +1728,7 @@ fsm_report_lsn(Keeper *keeper)
 									 &pgSetup->is_in_recovery,
 									 postgres->pgsrSyncState,
 									 postgres->currentLSN,
+									 postgres->replayLSN,
 									 &(postgres->postgresSetup.control)))
 	{
 		log_error("Failed to update the local Postgres metadata");
@@ -1320,6 +1776,7 @@ fsm_fast_forward(Keeper *keeper)
 	ReplicationSource *upstream = &(postgres->replicationSource);
 
 	NodeAddress upstreamNode = { 0 };
+	char upstreamLSN[PG_LSN_MAXLENGTH] = { 0 };
 
 	char slotName[MAXCONNINFO] = { 0 };
 
@@ -1331,6 +1788,8 @@ fsm_fast_forward(Keeper *keeper)
 		return false;
 	}
 
+	formatLSN(upstreamNode.lsn, upstreamLSN, sizeof(upstreamLSN));
+
 	/*
 	 * Postgres 10 does not have pg_replication_slot_advance(), so we don't
 	 * support replication slots on standby nodes there.
@@ -1347,7 +1806,7 @@ fsm_fast_forward(Keeper *keeper)
 										 slotName,
 										 config->maximum_backup_rate,
 										 config->backupDirectory,
-										 upstreamNode.lsn,
+										 upstreamLSN,
 										 config->pgSetup.ssl,
 										 keeper->state.current_node_id))
 	{
@@ -1438,6 +1897,8 @@ fsm_follow_new_primary(Keeper *keeper)
 		return false;
 	}
 
+	(void) fsm_apply_role_settings(keeper, true);
+
 	/* now, in case we have an init state file around, remove it */
 	if (!unlink_file(config->pathnames.init))
 	{
@@ -1453,7 +1914,7 @@ fsm_follow_new_primary(Keeper *keeper)
 	 */
 	if (keeper->state.assigned_role == SECONDARY_STATE)
 	{
-		return standby_check_timeline_with_upstream(postgres);
+		return keeper_check_timeline_with_upstream(keeper);
 	}
 
 	return true;
@@ -1471,6 +1932,7 @@ fsm_init_from_standby(Keeper *keeper)
 	LocalPostgresServer *postgres = &(keeper->postgres);
 
 	NodeAddress upstreamNode = { 0 };
+	char upstreamLSN[PG_LSN_MAXLENGTH] = { 0 };
 
 	/* get the primary node to follow */
 	if (!keeper_get_most_advanced_standby(keeper, &upstreamNode))
@@ -1480,6 +1942,8 @@ fsm_init_from_standby(Keeper *keeper)
 		return false;
 	}
 
+	formatLSN(upstreamNode.lsn, upstreamLSN, sizeof(upstreamLSN));
+
 	if (!standby_init_replication_source(postgres,
 										 &upstreamNode,
 										 PG_AUTOCTL_REPLICA_USERNAME,
@@ -1487,7 +1951,7 @@ fsm_init_from_standby(Keeper *keeper)
 										 "", /* no replication slot */
 										 config->maximum_backup_rate,
 										 config->backupDirectory,
-										 upstreamNode.lsn,
+										 upstreamLSN,
 										 config->pgSetup.ssl,
 										 keeper->state.current_node_id))
 	{
@@ -1518,3 +1982,22 @@ fsm_drop_node(Keeper *keeper)
 
 	return unlink_file(config->pathnames.init);
 }
+
+
+/*
+ * fsm_apply_role_settings applies the Postgres settings for the role that the
+ * node is taking, primary or standby, see postgres_add_role_settings. Those
+ * settings only tune the node for its role, so failing to apply them doesn't
+ * fail the transition.
+ */
+static void
+fsm_apply_role_settings(Keeper *keeper, bool standby)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (!postgres_add_role_settings(postgres, standby))
+	{
+		log_warn("Failed to apply the %s settings, continuing",
+				 standby ? "standby" : "primary");
+	}
+}
@@ -26,16 +26,49 @@
 #include "parsing.h"
 #include "pghba.h"
 #include "pgsetup.h"
+#include "pooler.h"
+#include "prewarm.h"
 #include "primary_standby.h"
+#include "service_isolation.h"
+#include "service_keeper.h"
 #include "signals.h"
 #include "state.h"
+#include "string_utils.h"
+#include "system_utils.h"
+#include "trace.h"
 
 #include "runprogram.h"
 
 static bool keeper_state_check_postgres(Keeper *keeper,
 										PostgresControlData *control);
 
-static void diff_nodesArray(NodeAddressArray *previousNodesArray,
+static bool keeper_apply_standby_settings(Keeper *keeper);
+static bool keeper_warn_settings_need_restart(Keeper *keeper);
+static void keeper_set_restore_command(Keeper *keeper);
+static void keeper_set_slot_sync_dbname(Keeper *keeper);
+static bool keeper_ssloptions_changed(SSLOptions *ssl, SSLOptions *newSSL);
+static bool keeper_add_pending_hba_nodes(Keeper *keeper,
+										 NodeAddressArray *nodesArray);
+static bool keeper_role_accepts_writes(NodeState role);
+static bool keeper_update_pg_crash_recovery(Keeper *keeper);
+static bool keeper_slots_nodes_unchanged(NodeAddressArray *previous,
+										 NodeAddressArray *current);
+static bool keeper_advance_cascaded_replication_slots(Keeper *keeper);
+static uint64_t keeper_state_fingerprint(Keeper *keeper);
+static uint64_t keeper_fingerprint_bytes(uint64_t hash,
+										 const void *data, size_t size);
+static void keeper_update_apply_rate(LocalPostgresServer *postgres);
+static void keeper_warm_up_after_maintenance(Keeper *keeper);
+static bool keeper_ensure_max_slot_wal_keep_size(Keeper *keeper);
+static void keeper_check_replication_slots(Keeper *keeper,
+										   StandbyReplicationArrays *report);
+static bool keeper_sync_database_logical_slots(Keeper *keeper,
+											   const char *dbname,
+											   LogicalSlotArray *upstreamSlots,
+											   LogicalSlotArray *localSlots);
+static LogicalSlot * keeper_find_logical_slot(LogicalSlotArray *slotsArray,
+											  const char *slotName);
+static bool diff_nodesArray(NodeAddressArray *previousNodesArray,
 							NodeAddressArray *currentNodesArray,
 							NodeAddressArray *diffNodesArray);
 
@@ -53,6 +86,8 @@ keeper_init(Keeper *keeper, KeeperConfig *config)
 	keeper->config = *config;
 
 	local_postgres_init(&keeper->postgres, pgSetup);
+	keeper_set_restore_command(keeper);
+	keeper_set_slot_sync_dbname(keeper);
 
 	if (!config->monitorDisabled)
 	{
@@ -223,6 +258,22 @@ keeper_ensure_current_state(Keeper *keeper)
 	log_debug("Ensuring current state: %s",
 			  NodeStateToString(keeperState->current_role));
 
+	/*
+	 * While Postgres replays WAL in crash recovery we can't connect to it,
+	 * and restarting it would only restart the replay. In the states where
+	 * Postgres must be stopped though, the code below stops it.
+	 */
+	if (postgres->pgCrashRecoveryStartTs > 0 &&
+		keeperState->current_role != DEMOTED_STATE &&
+		keeperState->current_role != DEMOTE_TIMEOUT_STATE &&
+		keeperState->current_role != DRAINING_STATE)
+	{
+		log_debug("Postgres is in crash recovery, waiting until it is "
+				  "ready to ensure current state \"%s\"",
+				  NodeStateToString(keeperState->current_role));
+		return true;
+	}
+
 	switch (keeperState->current_role)
 	{
 		/*
@@ -248,8 +299,47 @@ keeper_ensure_current_state(Keeper *keeper)
 				return false;
 			}
 
+			/* the WAL retention guardrail is only a hint, ignore errors */
+			(void) keeper_ensure_max_slot_wal_keep_size(keeper);
+
+			/* the replication report is only a hint, ignore errors here */
+			if (keeperState->current_role == PRIMARY_STATE ||
+				keeperState->current_role == WAIT_PRIMARY_STATE)
+			{
+				(void) keeper_report_replication(keeper);
+			}
+
+			/*
+			 * The replication slots only change with the list of the other
+			 * nodes, so we skip them when nothing changed since the last time
+			 * we verified them. We still check from time to time, in case the
+			 * slots have been edited behind our back, and we advance the
+			 * slots of the cascaded nodes at each loop.
+			 */
+			uint64_t fingerprint = keeper_state_fingerprint(keeper);
+			uint64_t now = time(NULL);
+
+			if (fingerprint == keeper->ensuredFingerprint &&
+				(now - keeper->ensuredTime) < PG_AUTOCTL_SLOTS_MAINTAIN_INTERVAL &&
+				keeper->cascadedNodesCount == 0)
+			{
+				log_trace("keeper_ensure_current_state: "
+						  "state \"%s\" already verified, skipping",
+						  NodeStateToString(keeperState->current_role));
+				return true;
+			}
+
 			/* when a standby has been removed, remove its replication slot */
-			return keeper_create_and_drop_replication_slots(keeper);
+			if (!keeper_create_and_drop_replication_slots(keeper))
+			{
+				keeper->ensuredTime = 0;
+				return false;
+			}
+
+			keeper->ensuredFingerprint = fingerprint;
+			keeper->ensuredTime = now;
+
+			return true;
 		}
 
 		/*
@@ -275,8 +365,25 @@ keeper_ensure_current_state(Keeper *keeper)
 				return false;
 			}
 
+			/* the WAL retention guardrail is only a hint, ignore errors */
+			(void) keeper_ensure_max_slot_wal_keep_size(keeper);
+
 			/* now ensure progress is made on the replication slots */
-			return keeper_maintain_replication_slots(keeper);
+			if (!keeper_maintain_replication_slots(keeper))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			/* the pre-warm block list is only a hint, ignore errors here */
+			if (keeperState->current_role == SECONDARY_STATE)
+			{
+				(void) keeper_refresh_prewarm_block_list(keeper);
+				(void) keeper_sync_logical_slots(keeper);
+				(void) keeper_warm_up_after_maintenance(keeper);
+			}
+
+			return true;
 		}
 
 		/*
@@ -298,7 +405,7 @@ keeper_ensure_current_state(Keeper *keeper)
 		case DEMOTE_TIMEOUT_STATE:
 		case DRAINING_STATE:
 		{
-			if (postgres->pgIsRunning)
+			if (postgres->pgIsRunning || postgres->pgCrashRecoveryStartTs > 0)
 			{
 				log_warn("PostgreSQL is running while in state \"%s\", "
 						 "stopping PostgreSQL.",
@@ -321,6 +428,60 @@ keeper_ensure_current_state(Keeper *keeper)
 }
 
 
+/*
+ * keeper_state_fingerprint computes a FNV-1a hash of what the replication
+ * slots on a primary depend on: our current state, the Postgres instance we
+ * run, our configuration, and the list of the other nodes. A restart, a
+ * reload, a state change, or a node added or removed gives another hash.
+ */
+static uint64_t
+keeper_state_fingerprint(Keeper *keeper)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+	PostgresSetup *pgSetup = &(keeper->postgres.postgresSetup);
+	NodeAddressArray *otherNodesArray = &(keeper->otherNodes);
+
+	uint64_t hash = UINT64CONST(14695981039346656037);
+
+	hash = keeper_fingerprint_bytes(hash, &(keeperState->current_role),
+									sizeof(keeperState->current_role));
+	hash = keeper_fingerprint_bytes(hash, &(pgSetup->pidFile.pid),
+									sizeof(pgSetup->pidFile.pid));
+	hash = keeper_fingerprint_bytes(hash, &(keeper->configStamp.hash),
+									sizeof(keeper->configStamp.hash));
+	hash = keeper_fingerprint_bytes(hash, &(otherNodesArray->count),
+									sizeof(otherNodesArray->count));
+
+	for (int i = 0; i < otherNodesArray->count; i++)
+	{
+		NodeAddress *node = &(otherNodesArray->nodes[i]);
+
+		hash = keeper_fingerprint_bytes(hash, &(node->nodeId),
+										sizeof(node->nodeId));
+	}
+
+	return hash;
+}
+
+
+/*
+ * keeper_fingerprint_bytes adds size bytes of data to the given FNV-1a hash.
+ */
+static uint64_t
+keeper_fingerprint_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= UINT64CONST(1099511628211);
+	}
+
+	return hash;
+}
+
+
 /*
  * reportPgIsRunning returns the boolean that we should use to report
  * pgIsRunning to the monitor. When the local PostgreSQL isn't running, we
@@ -341,6 +502,28 @@ ReportPgIsRunning(Keeper *keeper)
 	int timeout = config->postgresql_restart_failure_timeout;
 	uint64_t now = time(NULL);
 
+	/*
+	 * Postgres in crash recovery is going to be running soon, a failover
+	 * would most likely cost more than waiting for it. We report it running
+	 * for up to timeout.postgresql_crash_recovery_timeout, so that the
+	 * monitor waits for us, and then let the monitor decide.
+	 */
+	if (postgres->pgCrashRecoveryStartTs > 0)
+	{
+		uint64_t elapsed = now - postgres->pgCrashRecoveryStartTs;
+
+		if (elapsed < (uint64_t) config->postgresql_crash_recovery_timeout)
+		{
+			return true;
+		}
+
+		log_warn("Postgres has been in crash recovery for %" PRIu64 "s, "
+				 "reporting PostgreSQL not running to the monitor",
+				 elapsed);
+
+		return false;
+	}
+
 	if (keeperState->current_role != PRIMARY_STATE)
 	{
 		/*
@@ -410,6 +593,53 @@ ReportPgIsRunning(Keeper *keeper)
 }
 
 
+/*
+ * keeper_update_pg_crash_recovery is called when Postgres is starting, which
+ * is when it replays WAL in crash recovery. We keep track of when that
+ * started, and grab the checkpoint where the replay started from with
+ * pg_controldata, so that the current LSN we report to the monitor is not
+ * reset to 0/0 meanwhile.
+ */
+static bool
+keeper_update_pg_crash_recovery(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	const bool missingPgdataIsOk = false;
+
+	if (!pg_controldata(pgSetup, missingPgdataIsOk))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	strlcpy(postgres->currentLSN,
+			pgSetup->control.latestCheckpointLSN,
+			sizeof(postgres->currentLSN));
+
+	if (postgres->pgCrashRecoveryStartTs == 0)
+	{
+		postgres->pgCrashRecoveryStartTs = time(NULL);
+
+		log_info("Postgres pid %d is replaying WAL from checkpoint %s, "
+				 "reporting it running to the monitor for up to %ds",
+				 pgSetup->pidFile.pid,
+				 postgres->currentLSN,
+				 config->postgresql_crash_recovery_timeout);
+	}
+	else
+	{
+		log_debug("Postgres pid %d has been replaying WAL for %" PRIu64 "s",
+				  pgSetup->pidFile.pid,
+				  (uint64_t) time(NULL) - postgres->pgCrashRecoveryStartTs);
+	}
+
+	return true;
+}
+
+
 /*
  * keeper_update_pg_state updates our internal reflection of the PostgreSQL
  * state.
@@ -439,6 +669,7 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 	postgres->pgIsRunning = false;
 	memset(postgres->pgsrSyncState, 0, PGSR_SYNC_STATE_MAXLENGTH);
 	strlcpy(postgres->currentLSN, "0/0", sizeof(postgres->currentLSN));
+	strlcpy(postgres->replayLSN, "0/0", sizeof(postgres->replayLSN));
 
 	/* when running with --disable-monitor, we might get here early */
 	if (keeperState->current_role == INIT_STATE)
@@ -448,6 +679,25 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 
 	*pgSetup = config->pgSetup;
 
+	/*
+	 * When Postgres is replaying WAL in crash recovery, which might take a
+	 * long while after a host reboot, we can't connect to it yet. Don't wait
+	 * for it here: we want to keep reporting to the monitor in the meantime.
+	 */
+	if (pg_setup_is_starting(pgSetup))
+	{
+		return keeper_update_pg_crash_recovery(keeper);
+	}
+
+	if (postgres->pgCrashRecoveryStartTs > 0)
+	{
+		log_info("Postgres is not starting anymore, after %" PRIu64 "s "
+				 "of crash recovery",
+				 (uint64_t) time(NULL) - postgres->pgCrashRecoveryStartTs);
+
+		postgres->pgCrashRecoveryStartTs = 0;
+	}
+
 	/*
 	 * When PostgreSQL is running, do some extra checks that are going to be
 	 * helpful to drive the keeper's FSM decision making.
@@ -472,7 +722,21 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 		 * discovered.
 		 */
 		pg_setup_get_local_connection_string(pgSetup, connInfo);
-		pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+
+		if (pgsql->connection == NULL ||
+			strcmp(pgsql->connectionString, connInfo) != 0)
+		{
+			pgsql_finish(pgsql);
+			pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+		}
+
+		/*
+		 * Use the same connection for the metadata query here and the other
+		 * queries that the keeper runs on the local Postgres instance in the
+		 * same iteration, such as replication slot maintenance. The keeper
+		 * main loop decides when to close it.
+		 */
+		pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
 
 		/*
 		 * Update our Postgres metadata now.
@@ -493,6 +757,7 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 										 &pgSetup->is_in_recovery,
 										 postgres->pgsrSyncState,
 										 postgres->currentLSN,
+										 postgres->replayLSN,
 										 &(pgSetup->control)))
 		{
 			log_level(logLevel, "Failed to update the local Postgres metadata");
@@ -511,11 +776,15 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 		keeperState->pg_control_version = pgSetup->control.pg_control_version;
 		keeperState->catalog_version_no = pgSetup->control.catalog_version_no;
 		keeperState->system_identifier = pgSetup->control.system_identifier;
+
+		keeper_update_apply_rate(postgres);
 	}
 	else
 	{
 		/* Postgres is not running. */
 		postgres->pgIsRunning = false;
+		postgres->applyRate = 0;
+		postgres->applyRateSampleTime = 0;
 
 		/*
 		 * Cache invalidation: keep the current values we have for the Postgres
@@ -838,10 +1107,18 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 	 * At start-up we don't need to reload the configuration by calling the SQL
 	 * function pg_reload_conf() because Postgres is not running yet, it will
 	 * start with the new setup already.
+	 *
+	 * When none of our settings changed, we don't reload Postgres at all.
 	 */
-	if (pg_setup_is_running(pgSetup))
+	bool resetPrimaryConninfo =
+		state->pg_control_version >= 1200 &&
+		pg_auto_conf_has_primary_conninfo(pgSetup->pgdata);
+
+	bool settingsChanged = !IS_EMPTY_STRING_BUFFER(postgres->changedSettings);
+
+	if (pg_setup_is_running(pgSetup) && (resetPrimaryConninfo || settingsChanged))
 	{
-		if (state->pg_control_version >= 1200)
+		if (resetPrimaryConninfo)
 		{
 			/* errors are logged already, and non-fatal to this function */
 			(void) pgsql_reset_primary_conninfo(&(postgres->sqlClient));
@@ -854,6 +1131,8 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 					 "see above for details");
 			return false;
 		}
+
+		(void) keeper_warn_settings_need_restart(keeper);
 	}
 
 	if (!config->monitorDisabled)
@@ -878,25 +1157,10 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 	{
 		ReplicationSource *upstream = &(postgres->replicationSource);
 
-		/* either recovery.conf or AUTOCTL_STANDBY_CONF_FILENAME */
-		char *relativeConfPathName =
-			state->pg_control_version < 1200
-			? "recovery.conf"
-			: AUTOCTL_STANDBY_CONF_FILENAME;
-
-		char upstreamConfPath[MAXPGPATH] = { 0 };
-
-
-		char *currentConfContents = NULL;
-		long currentConfSize = 0L;
-
-		char *newConfContents = NULL;
-		long newConfSize = 0L;
-
 		/* do we have the primaryNode already? */
 		if (IS_EMPTY_STRING_BUFFER(upstream->primaryNode.host))
 		{
-			if (!keeper_get_primary(keeper, &(upstream->primaryNode)))
+			if (!keeper_get_upstream(keeper, &(upstream->primaryNode)))
 			{
 				log_error("Failed to update primary_conninfo, "
 						  "see above for details");
@@ -904,98 +1168,250 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 			}
 		}
 
-		/*
-		 * Read the contents of the standby configuration file now, so that we
-		 * only restart Postgres when it has been changed with the next step.
-		 */
-		join_path_components(upstreamConfPath,
-							 pgSetup->pgdata,
-							 relativeConfPathName);
+		return keeper_apply_standby_settings(keeper);
+	}
 
-		/* to check if replicationSettingsHaveChanged, read current file */
-		if (file_exists(upstreamConfPath))
-		{
-			if (!read_file(upstreamConfPath,
-						   &currentConfContents,
-						   &currentConfSize))
-			{
-				/* errors have already been logged */
-				return false;
-			}
-		}
+	return true;
+}
 
-		/* prepare a replicationSource from the primary and our SSL setup */
-		if (!standby_init_replication_source(postgres,
-											 NULL, /* primaryNode is done */
-											 PG_AUTOCTL_REPLICA_USERNAME,
-											 config->replication_password,
-											 config->replication_slot_name,
-											 config->maximum_backup_rate,
-											 config->backupDirectory,
-											 NULL, /* no targetLSN */
-											 config->pgSetup.ssl,
-											 state->current_node_id))
-		{
-			/* can't happen at the moment */
-			free(currentConfContents);
-			return false;
-		}
 
-		/* now setup the replication configuration (primary_conninfo etc) */
-		if (!pg_setup_standby_mode(state->pg_control_version,
-								   pgSetup->pgdata,
-								   pgSetup->pg_ctl,
-								   upstream))
-		{
-			log_error("Failed to setup Postgres as a standby after primary "
-					  "connection settings change");
-			free(currentConfContents);
-			return false;
-		}
+/*
+ * keeper_warn_settings_need_restart warns about the default settings that
+ * we changed and that Postgres only applies at restart. We don't restart the
+ * primary for those, the other settings have been reloaded already.
+ */
+static bool
+keeper_warn_settings_need_restart(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	char restartSettings[BUFSIZE] = { 0 };
+	bool needRestart = false;
+
+	if (IS_EMPTY_STRING_BUFFER(postgres->changedSettings))
+	{
+		return true;
+	}
+
+	if (!pgsql_settings_need_restart(&(postgres->sqlClient),
+									 postgres->changedSettings,
+									 &needRestart,
+									 restartSettings,
+									 sizeof(restartSettings)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (needRestart)
+	{
+		log_warn("Postgres settings %s have changed and are only applied "
+				 "when Postgres restarts", restartSettings);
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_set_restore_command prepares the restore_command that we install in
+ * the standby settings, from replication.restore_command. When
+ * replication.wal_prefetch is set, Postgres runs our own restore-wal command,
+ * which fetches WAL segments from the archive in parallel by running the
+ * given restore command.
+ */
+static void
+keeper_set_restore_command(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	ReplicationSource *upstream = &(keeper->postgres.replicationSource);
+
+	if (IS_EMPTY_STRING_BUFFER(config->restoreCommand) ||
+		config->walPrefetch == 0)
+	{
+		strlcpy(upstream->restoreCommand, config->restoreCommand, MAXCONNINFO);
+		return;
+	}
+
+	sformat(upstream->restoreCommand, MAXCONNINFO,
+			"\"%s\" do standby restore-wal --pgdata \"%s\" %%f %%p %%r",
+			pg_autoctl_program,
+			config->pgSetup.pgdata);
+}
+
+
+/*
+ * keeper_set_slot_sync_dbname adds the postgresql.dbname database to the
+ * primary_conninfo of a standby node when replication.logical_slots_failover
+ * is set on Postgres 17 and later, where the slot synchronization worker
+ * connects to the primary with it.
+ */
+static void
+keeper_set_slot_sync_dbname(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	ReplicationSource *upstream = &(keeper->postgres.replicationSource);
+	int pgVersion = 0;
+
+	(void) parse_pg_version_string(config->pgSetup.pg_version, &pgVersion);
+
+	if (config->logicalSlotsFailover && pgVersion >= 1700)
+	{
+		strlcpy(upstream->slotSyncDbname, config->pgSetup.dbname, NAMEDATALEN);
+	}
+	else
+	{
+		upstream->slotSyncDbname[0] = '\0';
+	}
+}
+
+
+/*
+ * keeper_apply_standby_settings writes the standby configuration file (either
+ * recovery.conf or postgresql-auto-failover-standby.conf) from the current
+ * replicationSource, and restarts Postgres when the file contents changed.
+ */
+static bool
+keeper_apply_standby_settings(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *state = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	/* either recovery.conf or AUTOCTL_STANDBY_CONF_FILENAME */
+	char *relativeConfPathName =
+		state->pg_control_version < 1200
+		? "recovery.conf"
+		: AUTOCTL_STANDBY_CONF_FILENAME;
 
-		/* restart Postgres only when the configuration file has changed */
-		if (!read_file(upstreamConfPath, &newConfContents, &newConfSize))
+	char upstreamConfPath[MAXPGPATH] = { 0 };
+
+	char *currentConfContents = NULL;
+	long currentConfSize = 0L;
+
+	char *newConfContents = NULL;
+	long newConfSize = 0L;
+
+	/* replication settings might have changed at reload */
+	keeper_set_restore_command(keeper);
+	keeper_set_slot_sync_dbname(keeper);
+
+	/*
+	 * Read the contents of the standby configuration file now, so that we
+	 * only restart Postgres when it has been changed with the next step.
+	 */
+	join_path_components(upstreamConfPath,
+						 pgSetup->pgdata,
+						 relativeConfPathName);
+
+	/* to check if replicationSettingsHaveChanged, read current file */
+	if (file_exists(upstreamConfPath))
+	{
+		if (!read_file(upstreamConfPath,
+					   &currentConfContents,
+					   &currentConfSize))
 		{
 			/* errors have already been logged */
-			free(currentConfContents);
 			return false;
 		}
+	}
+
+	/* prepare a replicationSource from the primary and our SSL setup */
+	if (!standby_init_replication_source(postgres,
+										 NULL, /* primaryNode is done */
+										 PG_AUTOCTL_REPLICA_USERNAME,
+										 config->replication_password,
+										 config->replication_slot_name,
+										 config->maximum_backup_rate,
+										 config->backupDirectory,
+										 NULL, /* no targetLSN */
+										 config->pgSetup.ssl,
+										 state->current_node_id))
+	{
+		/* can't happen at the moment */
+		free(currentConfContents);
+		return false;
+	}
 
-		bool replicationSettingsHaveChanged =
-			currentConfContents == NULL ||
-			strcmp(newConfContents, currentConfContents) != 0;
+	/* now setup the replication configuration (primary_conninfo etc) */
+	if (!pg_setup_standby_mode(state->pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   upstream))
+	{
+		log_error("Failed to setup Postgres as a standby after primary "
+				  "connection settings change");
+		free(currentConfContents);
+		return false;
+	}
 
+	/* restart Postgres only when the configuration file has changed */
+	if (!read_file(upstreamConfPath, &newConfContents, &newConfSize))
+	{
+		/* errors have already been logged */
 		free(currentConfContents);
-		free(newConfContents);
+		return false;
+	}
+
+	bool replicationSettingsHaveChanged =
+		currentConfContents == NULL ||
+		strcmp(newConfContents, currentConfContents) != 0;
+
+	/* a new upstream node doesn't need a restart on Postgres 13 and later */
+	bool reloadable =
+		replicationSettingsHaveChanged &&
+		!IS_EMPTY_STRING_BUFFER(upstream->primaryNode.host) &&
+		pg_setup_is_running(pgSetup) &&
+		pg_standby_settings_are_reloadable(&(postgres->sqlClient),
+										   state->pg_control_version,
+										   currentConfContents,
+										   newConfContents);
 
-		if (replicationSettingsHaveChanged)
+	free(currentConfContents);
+	free(newConfContents);
+
+	if (reloadable)
+	{
+		log_info("Replication settings at \"%s\" have changed, "
+				 "reloading Postgres", upstreamConfPath);
+
+		if (pgsql_reload_conf(&(postgres->sqlClient)))
 		{
-			log_info("Replication settings at \"%s\" have changed, "
-					 "restarting Postgres", upstreamConfPath);
+			return true;
+		}
+
+		log_warn("Failed to reload Postgres, restarting it instead");
+	}
+
+	if (replicationSettingsHaveChanged)
+	{
+		log_info("Replication settings at \"%s\" have changed, "
+				 "restarting Postgres", upstreamConfPath);
 
-			if (pg_setup_is_running(pgSetup))
+		if (pg_setup_is_running(pgSetup))
+		{
+			if (!pgsql_checkpoint(&(postgres->sqlClient)))
 			{
-				if (!pgsql_checkpoint(&(postgres->sqlClient)))
-				{
-					log_warn("Failed to CHECKPOINT before restart, "
-							 "see above for details");
-				}
+				log_warn("Failed to CHECKPOINT before restart, "
+						 "see above for details");
+			}
 
-				if (!keeper_restart_postgres(keeper))
-				{
-					log_error("Failed to restart Postgres to enable new "
-							  "replication settings, see above for details");
-					return false;
-				}
+			if (!keeper_restart_postgres(keeper))
+			{
+				log_error("Failed to restart Postgres to enable new "
+						  "replication settings, see above for details");
+				return false;
 			}
-			else
+		}
+		else
+		{
+			if (!ensure_postgres_service_is_running(postgres))
 			{
-				if (!ensure_postgres_service_is_running(postgres))
-				{
-					log_error("Failed to start Postgres with new "
-							  "replication settings, see above for details");
-					return false;
-				}
+				log_error("Failed to start Postgres with new "
+						  "replication settings, see above for details");
+				return false;
 			}
 		}
 	}
@@ -1020,6 +1436,9 @@ keeper_create_and_drop_replication_slots(Keeper *keeper)
 
 	log_trace("keeper_create_and_drop_replication_slots");
 
+	/* as a primary we edit the slots, the standby cache is now stale */
+	keeper->slotsMaintainedTime = 0;
+
 	if (!postgres_replication_slot_create_and_drop(postgres, otherNodesArray))
 	{
 		log_error("Failed to maintain replication slots on the local Postgres "
@@ -1027,13 +1446,79 @@ keeper_create_and_drop_replication_slots(Keeper *keeper)
 		return false;
 	}
 
-	return true;
+	return keeper_advance_cascaded_replication_slots(keeper);
 }
 
 
 /*
- * keeper_advance_replication_slots loops over the other standby nodes and
- * advance their replication slots up to the current LSN value known by the
+ * keeper_advance_cascaded_replication_slots advances the replication slots
+ * that the primary maintains for the cascaded standby nodes of its group.
+ *
+ * A cascaded standby node streams from another standby node rather than from
+ * the primary, so its replication slot on the primary is never used, and
+ * would retain WAL forever. We advance those slots to the LSN that the node
+ * reported to the monitor, in the same way as standby nodes maintain the
+ * replication slots of the other nodes.
+ *
+ * We only ask the monitor for the list of cascaded nodes when the group
+ * version changed, or when we know that some cascaded nodes exist.
+ */
+static bool
+keeper_advance_cascaded_replication_slots(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *state = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	/* pg_replication_slot_advance() is only available in Postgres 11+ */
+	if (config->monitorDisabled || state->pg_control_version < 1100)
+	{
+		return true;
+	}
+
+	if (keeper->cascadedNodesGroupVersion == keeper->otherNodesGroupVersion &&
+		keeper->cascadedNodesCount == 0)
+	{
+		return true;
+	}
+
+	NodeAddressArray cascadedNodesArray = { 0 };
+
+	if (!monitor_get_cascaded_nodes(&(keeper->monitor),
+									state->current_node_id,
+									&cascadedNodesArray))
+	{
+		log_error("Failed to get the list of cascaded nodes from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	keeper->cascadedNodesGroupVersion = keeper->otherNodesGroupVersion;
+	keeper->cascadedNodesCount = cascadedNodesArray.count;
+
+	bool success = true;
+
+	if (cascadedNodesArray.count > 0)
+	{
+		success =
+			postgres_replication_slot_advance(postgres, &cascadedNodesArray);
+
+		if (!success)
+		{
+			log_error("Failed to advance the replication slots of the "
+					  "cascaded nodes, see above for details");
+		}
+	}
+
+	nodeAddressArrayFree(&cascadedNodesArray);
+
+	return success;
+}
+
+
+/*
+ * keeper_advance_replication_slots loops over the other standby nodes and
+ * advance their replication slots up to the current LSN value known by the
  * monitor.
  */
 bool
@@ -1115,7 +1600,9 @@ keeper_maintain_replication_slots(Keeper *keeper)
 		return true;
 	}
 
-	if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
+	/* node_active might have fetched the list in the same round trip */
+	if (!keeper_other_nodes_are_fresh(keeper) &&
+		!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
 	{
 		log_error("Failed to maintain replication slots on the local Postgres "
 				  "instance, due to failure to refresh list of other nodes, "
@@ -1123,23 +1610,183 @@ keeper_maintain_replication_slots(Keeper *keeper)
 		return false;
 	}
 
+	/*
+	 * On an idle cluster, the other nodes and their LSN don't change, and
+	 * there's nothing to create, drop, or advance. We still run the query
+	 * from time to time, in case the slots have been edited behind our back,
+	 * and when Postgres has been restarted, maybe after pg_rewind.
+	 */
+	uint64_t now = time(NULL);
+
+	if ((now - keeper->slotsMaintainedTime) < PG_AUTOCTL_SLOTS_MAINTAIN_INTERVAL &&
+		keeper->slotsMaintainedPostgresPid == pgSetup->pidFile.pid &&
+		keeper_slots_nodes_unchanged(&(keeper->slotsMaintainedNodes),
+									 &(keeper->otherNodes)))
+	{
+		log_trace("keeper_maintain_replication_slots: "
+				  "no LSN has changed, skipping");
+		return true;
+	}
+
 	if (!postgres_replication_slot_maintain(postgres, &(keeper->otherNodes)))
 	{
 		log_error("Failed to maintain replication slots on the local Postgres "
 				  "instance, see above for details");
+
+		keeper->slotsMaintainedTime = 0;
+		return false;
+	}
+
+	if (nodeAddressArrayCopy(&(keeper->slotsMaintainedNodes),
+							 &(keeper->otherNodes)))
+	{
+		keeper->slotsMaintainedTime = now;
+		keeper->slotsMaintainedPostgresPid = pgSetup->pidFile.pid;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_check_timeline_with_upstream returns true when the current timeline
+ * on the local node (a standby) is the same as the timeline of its upstream
+ * node.
+ *
+ * The monitor knows about the system identifier and the timeline that the
+ * upstream node last reported when it is a primary, which saves opening a
+ * replication connection to the upstream node for IDENTIFY_SYSTEM. A report
+ * might be older than a promotion of the upstream node though, so we only
+ * trust the monitor when it tells us that we reached the same timeline as
+ * the upstream node, or that we are still behind. In other cases we fall back
+ * to asking the upstream node directly.
+ */
+bool
+keeper_check_timeline_with_upstream(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	NodeAddress *primaryNode = &(postgres->replicationSource.primaryNode);
+
+	uint64_t upstreamSysIdentifier = 0;
+	uint32_t upstreamTimeline = 0;
+	bool found = false;
+
+	if (config->monitorDisabled || primaryNode->nodeId <= 0)
+	{
+		return standby_check_timeline_with_upstream(postgres);
+	}
+
+	if (!monitor_get_node_timeline(&(keeper->monitor),
+								   primaryNode->nodeId,
+								   &upstreamSysIdentifier,
+								   &upstreamTimeline,
+								   &found))
+	{
+		log_warn("Failed to get the timeline of upstream node " NODE_FORMAT
+				 " from the monitor, using a replication connection instead",
+				 primaryNode->nodeId,
+				 primaryNode->name,
+				 primaryNode->host,
+				 primaryNode->port);
+
+		return standby_check_timeline_with_upstream(postgres);
+	}
+
+	if (!found || upstreamSysIdentifier == 0 || upstreamTimeline == 0)
+	{
+		return standby_check_timeline_with_upstream(postgres);
+	}
+
+	/* fetch most recent local metadata, including the timeline id. */
+	if (!pgsql_get_postgres_metadata(&(postgres->sqlClient),
+									 &(pgSetup->is_in_recovery),
+									 postgres->pgsrSyncState,
+									 postgres->currentLSN,
+									 postgres->replayLSN,
+									 &(pgSetup->control)))
+	{
+		log_error("Failed to update the local Postgres metadata");
+		return false;
+	}
+
+	uint32_t localTimeline = pgSetup->control.timeline_id;
+
+	if (localTimeline == 0 ||
+		upstreamSysIdentifier != pgSetup->control.system_identifier ||
+		upstreamTimeline < localTimeline)
+	{
+		return standby_check_timeline_with_upstream(postgres);
+	}
+
+	if (upstreamTimeline > localTimeline)
+	{
+		log_warn("Current timeline on upstream node " NODE_FORMAT
+				 " is %d, and current timeline on this standby node is still %d",
+				 primaryNode->nodeId,
+				 primaryNode->name,
+				 primaryNode->host,
+				 primaryNode->port,
+				 upstreamTimeline,
+				 localTimeline);
+
+		return false;
+	}
+
+	log_info("Reached timeline %d, same as upstream node " NODE_FORMAT
+			 " as reported to the monitor",
+			 localTimeline,
+			 primaryNode->nodeId,
+			 primaryNode->name,
+			 primaryNode->host,
+			 primaryNode->port);
+
+	return true;
+}
+
+
+/*
+ * keeper_slots_nodes_unchanged returns true when both arrays contain the same
+ * nodes with the same LSN, in the same order. The other nodes array is kept
+ * sorted by nodeId, see keeper_set_other_nodes.
+ */
+static bool
+keeper_slots_nodes_unchanged(NodeAddressArray *previous, NodeAddressArray *current)
+{
+	if (previous->count != current->count)
+	{
 		return false;
 	}
 
+	for (int i = 0; i < current->count; i++)
+	{
+		NodeAddress *previousNode = &(previous->nodes[i]);
+		NodeAddress *currentNode = &(current->nodes[i]);
+
+		if (previousNode->nodeId != currentNode->nodeId ||
+			previousNode->lsn != currentNode->lsn)
+		{
+			return false;
+		}
+	}
+
 	return true;
 }
 
 
 /*
  * keeper_node_active calls pgautofailover.node_active on the monitor.
+ *
+ * When otherNodes is not NULL, the list of the other nodes in the group is
+ * fetched from the monitor in the same round trip, and otherNodesFetched is
+ * set to whether that worked.
  */
 bool
 keeper_node_active(Keeper *keeper, bool doInit,
-				   MonitorAssignedState *assignedState)
+				   MonitorAssignedState *assignedState,
+				   NodeAddressArray *otherNodes,
+				   bool *otherNodesFetched)
 {
 	Monitor *monitor = &(keeper->monitor);
 	KeeperConfig *config = &(keeper->config);
@@ -1200,15 +1847,16 @@ keeper_node_active(Keeper *keeper, bool doInit,
 		 * is that the monitor got update: we're still running e.g. 1.4 and the
 		 * monitor is running 1.5.
 		 *
-		 * In that case we exit, and because the keeper node-active service is
-		 * RP_PERMANENT the supervisor is going to restart this process. The
-		 * restart happens with fork() and exec(), so it uses the current
-		 * version of pg_autoctl binary on disk, which has been updated to e.g.
-		 * 1.5 too.
+		 * In that case the node-active process re-executes itself with the
+		 * current version of pg_autoctl binary on disk, which has been updated
+		 * to e.g. 1.5 too. The process keeps its PID, so the supervisor does
+		 * not see it terminate, and the new binary calls node_active right
+		 * away. Postgres is managed by another process and is not touched.
 		 *
-		 * TL;DR: just exit now, have the service restarted by the supervisor
-		 * with the expected version of pg_autoctl that matches the monitor's
-		 * extension version.
+		 * In other cases we exit, and because the keeper node-active service
+		 * is RP_PERMANENT the supervisor is going to restart this process.
+		 * The restart happens with fork() and exec(), so it also uses the
+		 * current version of pg_autoctl binary on disk.
 		 */
 		KeeperVersion keeperVersion = { 0 };
 
@@ -1219,18 +1867,36 @@ keeper_node_active(Keeper *keeper, bool doInit,
 		}
 
 		/*
-		 * Only call exit() when the on-disk pg_autoctl required extension
-		 * version matches the current monitor extension version, ensuring that
-		 * the restart is going to be effective.
+		 * Only re-execute or exit() when the on-disk pg_autoctl required
+		 * extension version matches the current monitor extension version,
+		 * ensuring that the restart is going to be effective.
 		 */
 		if (strcmp(monitorVersion.installedVersion,
 				   keeperVersion.required_extension_version) == 0)
 		{
-			log_info("pg_autoctl version \"%s\" with compatibility with "
-					 "monitor extension \"%s\" has been found on-disk, "
-					 "exiting for a restart of the node-active process.",
-					 keeperVersion.pg_autoctl_version,
-					 keeperVersion.required_extension_version);
+			if (keeper->reexecOnUpgrade)
+			{
+				log_info("pg_autoctl version \"%s\" with compatibility with "
+						 "monitor extension \"%s\" has been found on-disk, "
+						 "re-executing the node-active process in place.",
+						 keeperVersion.pg_autoctl_version,
+						 keeperVersion.required_extension_version);
+
+				/* only returns when we failed to execv() the new binary */
+				(void) service_keeper_reexec(keeper);
+
+				log_info("Exiting for a restart of the node-active process "
+						 "instead");
+			}
+			else
+			{
+				log_info("pg_autoctl version \"%s\" with compatibility with "
+						 "monitor extension \"%s\" has been found on-disk, "
+						 "exiting for a restart of the node-active process.",
+						 keeperVersion.pg_autoctl_version,
+						 keeperVersion.required_extension_version);
+			}
+
 			exit(EXIT_CODE_MONITOR);
 		}
 
@@ -1303,6 +1969,26 @@ keeper_node_active(Keeper *keeper, bool doInit,
 	/*
 	 * Report the current state to the monitor and get the assigned state.
 	 */
+	if (otherNodes != NULL)
+	{
+		return monitor_node_active_and_get_other_nodes(
+			monitor,
+			config->formation,
+			keeperState->current_node_id,
+			keeperState->current_group,
+			keeperState->current_role,
+			reportPgIsRunning,
+			postgres->postgresSetup.control.timeline_id,
+			postgres->currentLSN,
+			postgres->pgsrSyncState,
+			keeper->otherNodesGroupVersion,
+			postgres->replayLSN,
+			postgres->applyRate,
+			assignedState,
+			otherNodes,
+			otherNodesFetched);
+	}
+
 	return monitor_node_active(monitor,
 							   config->formation,
 							   keeperState->current_node_id,
@@ -1312,6 +1998,9 @@ keeper_node_active(Keeper *keeper, bool doInit,
 							   postgres->postgresSetup.control.timeline_id,
 							   postgres->currentLSN,
 							   postgres->pgsrSyncState,
+							   keeper->otherNodesGroupVersion,
+							   postgres->replayLSN,
+							   postgres->applyRate,
 							   assignedState);
 }
 
@@ -1352,6 +2041,7 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 		log_error("Failed to query monitor to see if node id %d "
 				  "has been dropped already",
 				  keeperState->current_node_id);
+		nodeAddressArrayFree(&nodesArray);
 		return false;
 	}
 
@@ -1359,7 +2049,12 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 			  nodesArray.count,
 			  keeperState->current_node_id);
 
-	if (nodesArray.count == 0)
+	/* we only need to know how many nodes have been found */
+	int nodesCount = nodesArray.count;
+
+	nodeAddressArrayFree(&nodesArray);
+
+	if (nodesCount == 0)
 	{
 		/* no node found with our nodeid, the drop has been successfull */
 		*dropped = true;
@@ -1373,7 +2068,7 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 
 		return keeper_store_state(keeper);
 	}
-	else if (nodesArray.count == 1)
+	else if (nodesCount == 1)
 	{
 		bool doInit = false;
 		MonitorAssignedState assignedState = { 0 };
@@ -1381,7 +2076,8 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 		/* grab our assigned state from the monitor now */
 		(void) keeper_update_pg_state(keeper, LOG_DEBUG);
 
-		if (!keeper_node_active(keeper, doInit, &assignedState))
+		if (!keeper_node_active(keeper, doInit, &assignedState,
+								NULL, NULL))
 		{
 			/* errors have already been logged */
 			return false;
@@ -1424,7 +2120,8 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 				 */
 				(void) keeper_update_pg_state(keeper, LOG_DEBUG);
 
-				if (!keeper_node_active(keeper, doInit, &assignedState))
+				if (!keeper_node_active(keeper, doInit, &assignedState,
+										NULL, NULL))
 				{
 					/* errors have already been logged */
 					return false;
@@ -1439,7 +2136,7 @@ keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped)
 	else
 	{
 		log_error("BUG: monitor_find_node_by_nodeid returned %d nodes",
-				  nodesArray.count);
+				  nodesCount);
 		return false;
 	}
 
@@ -1683,6 +2380,9 @@ keeper_register_and_init(Keeper *keeper, NodeState initialState)
 
 		int sleepTimeMs = pgsql_compute_connection_retry_sleep_time(&retryPolicy);
 
+		/* a busy monitor tells us when to try again */
+		sleepTimeMs = Max(sleepTimeMs, monitor->pgsql.retryAfterMs);
+
 		log_warn("Failed to register node %s:%d in group %d of "
 				 "formation \"%s\" with initial state \"%s\" "
 				 "because the monitor is already registering another "
@@ -1838,6 +2538,7 @@ keeper_register_again(Keeper *keeper)
 									 &pgSetup->is_in_recovery,
 									 keeper->postgres.pgsrSyncState,
 									 keeper->postgres.currentLSN,
+									 keeper->postgres.replayLSN,
 									 &(pgSetup->control)))
 	{
 		log_error("Failed to get the local Postgres metadata");
@@ -1892,6 +2593,9 @@ keeper_register_again(Keeper *keeper)
 		int sleepTimeMs =
 			pgsql_compute_connection_retry_sleep_time(&retryPolicy);
 
+		/* a busy monitor tells us when to try again */
+		sleepTimeMs = Max(sleepTimeMs, monitor->pgsql.retryAfterMs);
+
 		log_warn("Failed to register node %s:%d in group %d of "
 				 "formation \"%s\" with initial state \"%s\" "
 				 "because the monitor is already registering another "
@@ -1956,6 +2660,7 @@ keeper_register_again(Keeper *keeper)
 										 &pgSetup->is_in_recovery,
 										 keeper->postgres.pgsrSyncState,
 										 keeper->postgres.currentLSN,
+										 keeper->postgres.replayLSN,
 										 &(pgSetup->control)))
 		{
 			log_error("Failed to get the local Postgres metadata");
@@ -1973,6 +2678,9 @@ keeper_register_again(Keeper *keeper)
 								 currentTLI,
 								 keeper->postgres.currentLSN,
 								 keeper->postgres.pgsrSyncState,
+								 0,
+								 keeper->postgres.replayLSN,
+								 keeper->postgres.applyRate,
 								 &assignedState))
 		{
 			++errors;
@@ -2017,11 +2725,15 @@ keeper_register_again(Keeper *keeper)
 
 /*
  * keeper_state_as_json prepares the current keeper state as a JSON object and
- * copy the string to the given pre-allocated memory area, of given size.
+ * copy the string to the given pre-allocated memory area, of given size. The
+ * JSON document only lives for the duration of the call, so it's built in a
+ * parson arena that we release all at once.
  */
 bool
 keeper_state_as_json(Keeper *keeper, char *json, int size)
 {
+	json_arena_begin();
+
 	JSON_Value *js = json_value_init_object();
 	JSON_Value *jsPostgres = json_value_init_object();
 	JSON_Value *jsKeeperState = json_value_init_object();
@@ -2039,8 +2751,7 @@ keeper_state_as_json(Keeper *keeper, char *json, int size)
 
 	int len = strlcpy(json, serialized_string, size);
 
-	json_free_serialized_string(serialized_string);
-	json_value_free(js);
+	json_arena_end();
 
 	/* strlcpy returns how many bytes where necessary */
 	return len < size;
@@ -2138,6 +2849,7 @@ keeper_refresh_other_nodes(Keeper *keeper, bool forceCacheInvalidation)
 		if (!keeper_read_nodes_from_file(keeper, &newNodesArray))
 		{
 			log_error("Failed to get other nodes, see above for details");
+			nodeAddressArrayFree(&newNodesArray);
 			return false;
 		}
 	}
@@ -2145,20 +2857,122 @@ keeper_refresh_other_nodes(Keeper *keeper, bool forceCacheInvalidation)
 	{
 		if (!monitor_get_other_nodes(monitor, nodeId, ANY_STATE, &newNodesArray))
 		{
-			log_error("Failed to get_other_nodes() on the monitor");
-			return false;
+			nodeAddressArrayFree(&newNodesArray);
+
+			if (!keeper_other_nodes_are_usable(keeper))
+			{
+				log_error("Failed to get_other_nodes() on the monitor");
+				return false;
+			}
+
+			/*
+			 * The monitor is slow or unreachable: our list of other nodes is
+			 * still the one for the current version of our group, use it
+			 * rather than failing, and fetch it again next time.
+			 */
+			log_warn("Failed to get_other_nodes() on the monitor, using our "
+					 "list of other nodes from %" PRIu64 "s ago",
+					 (uint64_t) time(NULL) - keeper->otherNodesRefreshTime);
+
+			if (!forceCacheInvalidation)
+			{
+				return true;
+			}
+
+			/* the hooks still have to process the whole list */
+			if (!nodeAddressArrayCopy(&newNodesArray, &(keeper->otherNodes)))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			bool success =
+				keeper_set_other_nodes(keeper, &newNodesArray, true);
+
+			nodeAddressArrayFree(&newNodesArray);
+
+			return success;
 		}
 	}
 
-	/*
-	 * In case of success, copy the current nodes array to the keeper's cache.
-	 */
 	bool success =
-		keeper_call_refresh_hooks(keeper, &newNodesArray, forceCacheInvalidation);
+		keeper_set_other_nodes(keeper, &newNodesArray, forceCacheInvalidation);
+
+	nodeAddressArrayFree(&newNodesArray);
+
+	if (success)
+	{
+		keeper->otherNodesRefreshTime = time(NULL);
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_other_nodes_are_fresh returns true when our list of other nodes has
+ * been fetched from the monitor in the current keeper loop, usually in the
+ * same round trip as node_active, so that we don't need to fetch it again.
+ * A list that the monitor told us is out of date is never fresh.
+ */
+bool
+keeper_other_nodes_are_fresh(Keeper *keeper)
+{
+	uint64_t now = time(NULL);
+
+	return keeper->otherNodesGroupVersion > 0 &&
+		   keeper->otherNodesRefreshTime > 0 &&
+		   (now - keeper->otherNodesRefreshTime) < PG_AUTOCTL_OTHER_NODES_FRESH_AGE;
+}
+
+
+/*
+ * keeper_other_nodes_are_usable returns true when our list of other nodes can
+ * be used in place of the monitor's answer, when the monitor fails. The list
+ * must match the version of our group that the monitor last told us about,
+ * which is only known when we fetched the list successfully for that
+ * version, and must be younger than PG_AUTOCTL_OTHER_NODES_MAX_AGE.
+ *
+ * The LSN of the other nodes might be behind, which only means that we don't
+ * advance their replication slots as far as we could.
+ */
+bool
+keeper_other_nodes_are_usable(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	uint64_t now = time(NULL);
+
+	return !config->monitorDisabled &&
+		   keeper->otherNodesGroupVersion > 0 &&
+		   keeper->otherNodesRefreshTime > 0 &&
+		   (now - keeper->otherNodesRefreshTime) < PG_AUTOCTL_OTHER_NODES_MAX_AGE;
+}
+
+
+/*
+ * keeper_set_other_nodes calls the refresh hooks with the given list of other
+ * nodes, and in case of success copies the list to the keeper's cache. The
+ * given list is sorted by nodeId first, as diff_nodesArray() expects.
+ */
+bool
+keeper_set_other_nodes(Keeper *keeper,
+					   NodeAddressArray *newNodesArray,
+					   bool forceCacheInvalidation)
+{
+	if (newNodesArray->count > 1)
+	{
+		(void) pg_qsort(newNodesArray->nodes,
+						newNodesArray->count,
+						sizeof(NodeAddress),
+						nodeAddressCmpByNodeId);
+	}
+
+	bool success =
+		keeper_call_refresh_hooks(keeper, newNodesArray, forceCacheInvalidation);
 
 	if (success)
 	{
-		keeper->otherNodes = newNodesArray;
+		success = nodeAddressArrayCopy(&(keeper->otherNodes), newNodesArray);
 	}
 
 	return success;
@@ -2202,37 +3016,52 @@ keeper_refresh_hba(Keeper *keeper,
 {
 	NodeAddressArray *otherNodesArray = &(keeper->otherNodes);
 	NodeAddressArray diffNodesArray = { 0 };
+	NodeAddressArray *hbaNodesArray = &diffNodesArray;
 
 	/* compute nodes that need an HBA change (new ones, new hostnames) */
 	if (forceCacheInvalidation)
 	{
-		diffNodesArray = *newNodesArray;
+		hbaNodesArray = newNodesArray;
 	}
-	else
+	else if (!diff_nodesArray(otherNodesArray, newNodesArray, &diffNodesArray))
 	{
-		(void) diff_nodesArray(otherNodesArray, newNodesArray, &diffNodesArray);
+		/* errors have already been logged */
+		nodeAddressArrayFree(&diffNodesArray);
+		return false;
 	}
 
 	/*
 	 * When we're alone in the group, and also when there's no change, then we
 	 * are done here already.
 	 */
-	if (newNodesArray->count == 0 || diffNodesArray.count == 0)
+	if (newNodesArray->count == 0 || hbaNodesArray->count == 0)
 	{
+		nodeAddressArrayFree(&diffNodesArray);
+
 		/* refresh the keeper's cache with the current other nodes array */
-		keeper->otherNodes = *newNodesArray;
-		return true;
+		return nodeAddressArrayCopy(&(keeper->otherNodes), newNodesArray);
 	}
 
 	log_info("Fetched current list of %d other nodes from the monitor "
 			 "to update HBA rules, including %d changes.",
-			 newNodesArray->count, diffNodesArray.count);
+			 newNodesArray->count, hbaNodesArray->count);
 
 	/*
 	 * We have a new list of other nodes, update the HBA file. We only update
 	 * the nodes that we didn't know before, or that have a new host property.
+	 *
+	 * When a whole group is being built, the list of other nodes changes at
+	 * each round, so we collect the changes and edit the HBA file and reload
+	 * Postgres only once per PG_AUTOCTL_HBA_DEBOUNCE_TIME. When the caller
+	 * forces the cache invalidation, it needs the HBA rules now.
 	 */
-	if (!keeper_update_group_hba(keeper, &diffNodesArray))
+	bool success =
+		keeper_add_pending_hba_nodes(keeper, hbaNodesArray) &&
+		keeper_flush_hba_changes(keeper, forceCacheInvalidation);
+
+	nodeAddressArrayFree(&diffNodesArray);
+
+	if (!success)
 	{
 		log_error("Failed to update the HBA entries for the new "
 				  "elements in the our formation \"%s\" and group %d",
@@ -2247,104 +3076,235 @@ keeper_refresh_hba(Keeper *keeper,
 
 
 /*
- * diff_nodesArray computes the array of nodes entries that should be added in
- * the HBA file in the given pre-allocated diffNodesArray parameter. The diff
- * is computed from the keeper's otherNodesArray on the previous round, and the
- * one we just got from the monitor.
+ * keeper_refresh_pooler is a KeeperNodesArrayRefreshFunction that resumes
+ * the connection poolers once this node has been promoted. The poolers have
+ * been paused by the previous primary when it was drained, see
+ * fsm_prepare_demotion_and_stop_postgres.
+ *
+ * Failing to resume the poolers doesn't prevent the keeper from using its new
+ * list of other nodes, we try again the next time the list changes.
  */
-static void
-diff_nodesArray(NodeAddressArray *previousNodesArray,
-				NodeAddressArray *currentNodesArray,
-				NodeAddressArray *diffNodesArray)
+bool
+keeper_refresh_pooler(Keeper *keeper,
+					  NodeAddressArray *newNodesArray,
+					  bool forceCacheInvalidation)
 {
-	int prevIndex = 0;
-	int currIndex = 0;
-	int diffIndex = 0;
+	KeeperStateData *keeperState = &(keeper->state);
 
-	if (previousNodesArray->count == 0)
+	if (!pooler_enabled(&(keeper->config)))
 	{
-		/* all the entries are new and we want them in diffNodesArray */
-		*diffNodesArray = *currentNodesArray;
-		return;
+		return true;
+	}
+
+	/* the other nodes are refreshed while being promoted, too */
+	bool isPrimary =
+		keeper_role_accepts_writes(keeperState->current_role) ||
+		keeper_role_accepts_writes(keeperState->assigned_role);
+
+	if (!isPrimary)
+	{
+		keeper->poolerResumed = false;
+		return true;
 	}
 
-	/* we only care about the nodes in the current nodes array */
-	for (currIndex = 0; currIndex < currentNodesArray->count; currIndex++)
+	if (!keeper->poolerResumed)
 	{
-		NodeAddress *currNode = &(currentNodesArray->nodes[currIndex]);
-		NodeAddress *prevNode = &(previousNodesArray->nodes[prevIndex]);
+		keeper->poolerResumed = pooler_resume(&(keeper->config));
 
-		/* remember, the input arrays are sorted on nodeId */
-		if (currNode->nodeId < prevNode->nodeId)
+		if (!keeper->poolerResumed)
 		{
-			diffNodesArray->count++;
-			diffNodesArray->nodes[diffIndex++] = *currNode;
+			log_warn("Failed to resume the connection poolers, "
+					 "see above for details");
 		}
-		else if (currNode->nodeId == prevNode->nodeId)
-		{
-			/*
-			 * We still have to update our HBA file when the host of a node
-			 * that we already have has changed on the monitor.
-			 */
-			if (!streq(currNode->host, prevNode->host))
-			{
-				log_debug("Node %" PRId64 " has a new hostname \"%s\"",
-						  currNode->nodeId, currNode->host);
+	}
 
-				diffNodesArray->count++;
-				diffNodesArray->nodes[diffIndex++] = *currNode;
-			}
+	return true;
+}
 
-			/*
-			 * In any case, if we have more elements in previousNodesArray,
-			 * advance our position there.
-			 */
-			if (prevIndex < previousNodesArray->count)
-			{
-				prevIndex++;
-			}
-		}
-		else if (currNode->nodeId > prevNode->nodeId)
-		{
-			/*
-			 * All the remaining entries of currentNodesArray are new.
-			 *
-			 * We might have entries in previousNodesArray that are not found
-			 * in currentNodesArray anymore, but we don't know how to clean-up
-			 * the HBA file entries at the moment anyway, so we just skip them.
-			 */
-			diffNodesArray->count++;
-			diffNodesArray->nodes[diffIndex++] = *currNode;
 
-			break;
-		}
-		else
-		{
-			log_error("BUG in diff_nodesArray!");
-			return;
-		}
-	}
+/*
+ * keeper_role_accepts_writes returns true when a node in the given role is
+ * the primary of its group and accepts writes.
+ */
+static bool
+keeper_role_accepts_writes(NodeState role)
+{
+	return role == SINGLE_STATE ||
+		   role == WAIT_PRIMARY_STATE ||
+		   role == PRIMARY_STATE ||
+		   role == JOIN_PRIMARY_STATE ||
+		   role == APPLY_SETTINGS_STATE;
 }
 
 
 /*
- * keeper_set_node_metadata sets a new nodename for the current pg_autoctl node
- * on the monitor. This node might be in an environment where you might get a
- * new IP at reboot, such as in Kubernetes.
+ * keeper_add_pending_hba_nodes adds the given nodes to the list of nodes that
+ * we need to edit HBA rules for, replacing the previous entry for the same
+ * node when we have one already.
  */
-bool
-keeper_set_node_metadata(Keeper *keeper, KeeperConfig *oldConfig)
+static bool
+keeper_add_pending_hba_nodes(Keeper *keeper, NodeAddressArray *nodesArray)
 {
-	KeeperConfig *config = &(keeper->config);
-	KeeperStateData keeperState = { 0 };
+	NodeAddressArray *pendingNodes = &(keeper->hbaPendingNodes);
 
-	if (!keeper_state_read(&keeperState, keeper->config.pathnames.state))
+	if (pendingNodes->count == 0)
 	{
-		/* errors have already been logged */
-		return false;
+		keeper->hbaPendingTime = time(NULL);
 	}
 
-	int64_t nodeId = keeperState.current_node_id;
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		NodeAddress *node = &(nodesArray->nodes[i]);
+		NodeAddress *pending = NULL;
+
+		for (int p = 0; p < pendingNodes->count; p++)
+		{
+			if (pendingNodes->nodes[p].nodeId == node->nodeId)
+			{
+				pending = &(pendingNodes->nodes[p]);
+				break;
+			}
+		}
+
+		if (pending == NULL)
+		{
+			pending = nodeAddressArrayAppend(pendingNodes);
+
+			if (pending == NULL)
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+
+		*pending = *node;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_flush_hba_changes edits the HBA file for all the pending nodes at
+ * once, with a single Postgres reload, when forced to or when the oldest
+ * pending change is PG_AUTOCTL_HBA_DEBOUNCE_TIME old. On failure the changes
+ * are kept, and we try again at the next call.
+ */
+bool
+keeper_flush_hba_changes(Keeper *keeper, bool force)
+{
+	NodeAddressArray *pendingNodes = &(keeper->hbaPendingNodes);
+	uint64_t now = time(NULL);
+
+	if (pendingNodes->count == 0)
+	{
+		return true;
+	}
+
+	if (!force && (now - keeper->hbaPendingTime) < PG_AUTOCTL_HBA_DEBOUNCE_TIME)
+	{
+		log_debug("Deferring HBA rules for %d nodes", pendingNodes->count);
+		return true;
+	}
+
+	if (!keeper_update_group_hba(keeper, pendingNodes))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	nodeAddressArrayFree(pendingNodes);
+	keeper->hbaPendingTime = 0;
+
+	return true;
+}
+
+
+/*
+ * diff_nodesArray computes the array of nodes entries that should be added in
+ * the HBA file in the given diffNodesArray parameter. The diff is computed from
+ * the keeper's otherNodesArray on the previous round, and the one we just got
+ * from the monitor.
+ *
+ * Both input arrays are sorted by nodeId, so we walk them in a single merge
+ * pass. We might have entries in previousNodesArray that are not found in
+ * currentNodesArray anymore, but we don't know how to clean-up the HBA file
+ * entries at the moment anyway, so we just skip them.
+ */
+static bool
+diff_nodesArray(NodeAddressArray *previousNodesArray,
+				NodeAddressArray *currentNodesArray,
+				NodeAddressArray *diffNodesArray)
+{
+	int prevIndex = 0;
+
+	diffNodesArray->count = 0;
+
+	for (int currIndex = 0; currIndex < currentNodesArray->count; currIndex++)
+	{
+		NodeAddress *currNode = &(currentNodesArray->nodes[currIndex]);
+
+		/* skip previous nodes that are not in the current array anymore */
+		while (prevIndex < previousNodesArray->count &&
+			   previousNodesArray->nodes[prevIndex].nodeId < currNode->nodeId)
+		{
+			prevIndex++;
+		}
+
+		bool knownNode =
+			prevIndex < previousNodesArray->count &&
+			previousNodesArray->nodes[prevIndex].nodeId == currNode->nodeId;
+
+		if (knownNode)
+		{
+			NodeAddress *prevNode = &(previousNodesArray->nodes[prevIndex]);
+
+			/*
+			 * We still have to update our HBA file when the host of a node
+			 * that we already have has changed on the monitor.
+			 */
+			if (streq(currNode->host, prevNode->host))
+			{
+				continue;
+			}
+
+			log_debug("Node %" PRId64 " has a new hostname \"%s\"",
+					  currNode->nodeId, currNode->host);
+		}
+
+		NodeAddress *diffNode = nodeAddressArrayAppend(diffNodesArray);
+
+		if (diffNode == NULL)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		*diffNode = *currNode;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_set_node_metadata sets a new nodename for the current pg_autoctl node
+ * on the monitor. This node might be in an environment where you might get a
+ * new IP at reboot, such as in Kubernetes.
+ */
+bool
+keeper_set_node_metadata(Keeper *keeper, KeeperConfig *oldConfig)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData keeperState = { 0 };
+
+	if (!keeper_state_read(&keeperState, keeper->config.pathnames.state))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int64_t nodeId = keeperState.current_node_id;
 
 	if (streq(oldConfig->name, config->name) &&
 		streq(oldConfig->hostname, config->hostname) &&
@@ -2435,9 +3395,12 @@ keeper_update_nodename_from_monitor(Keeper *keeper)
 	if (!monitor_get_nodes(monitor, formation, groupId, &nodesArray))
 	{
 		/* errors have already been logged */
+		nodeAddressArrayFree(&nodesArray);
 		return false;
 	}
 
+	bool success = true;
+
 	/*
 	 * We could also add a WHERE clause to the SQL query in monitor_get_nodes,
 	 * but we don't expect that many nodes anyway.
@@ -2452,32 +3415,52 @@ keeper_update_nodename_from_monitor(Keeper *keeper)
 
 			strlcpy(config->name, node->name, _POSIX_HOST_NAME_MAX);
 
-			if (!keeper_config_write_file(config))
-			{
-				/* errors have already been logged */
-				return false;
-			}
+			/* errors have already been logged */
+			success = keeper_config_write_file(config);
 
 			break;
 		}
 	}
 
-	return true;
+	nodeAddressArrayFree(&nodesArray);
+
+	return success;
+}
+
+
+/*
+ * keeper_ssloptions_changed returns true when any of the SSL options that
+ * config_accept_new_ssloptions installs is different in the new setup.
+ */
+static bool
+keeper_ssloptions_changed(SSLOptions *ssl, SSLOptions *newSSL)
+{
+	return ssl->active != newSSL->active ||
+		   ssl->sslMode != newSSL->sslMode ||
+		   strcmp(ssl->caFile, newSSL->caFile) != 0 ||
+		   strcmp(ssl->crlFile, newSSL->crlFile) != 0 ||
+		   strcmp(ssl->serverCert, newSSL->serverCert) != 0 ||
+		   strcmp(ssl->serverKey, newSSL->serverKey) != 0;
 }
 
 
 /*
  * keeper_config_accept_new returns true when we can accept to RELOAD our
- * current config into the new one that's been editing.
+ * current config into the new one that's been editing. The changes bitmask
+ * is set with the KEEPER_CONFIG_CHANGED_* parts of the configuration that
+ * have been changed.
  */
 bool
-keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
+keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig,
+						 int *changes)
 {
 	/* make a copy of the current values before changing them */
 	KeeperConfig oldConfig = keeper->config;
 	KeeperConfig *config = &(keeper->config);
 	bool monitorUpdateNeeded = false;
 
+	*changes = KEEPER_CONFIG_CHANGED_NONE;
+
 	/* some elements are not supposed to change on a reload */
 	if (strneq(newConfig->pgSetup.pgdata, config->pgSetup.pgdata))
 	{
@@ -2499,6 +3482,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	{
 		Monitor monitor = { 0 };
 
+		*changes |= KEEPER_CONFIG_CHANGED_MONITOR;
+
 		if (PG_AUTOCTL_MONITOR_IS_DISABLED(newConfig))
 		{
 			config->monitorDisabled = true;
@@ -2548,6 +3533,7 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	if (strneq(newConfig->name, config->name))
 	{
 		monitorUpdateNeeded = true;
+		*changes |= KEEPER_CONFIG_CHANGED_METADATA;
 
 		log_info("Reloading configuration: node name is now \"%s\"; "
 				 "used to be \"%s\"",
@@ -2568,6 +3554,10 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	{
 		monitorUpdateNeeded = true;
 
+		/* the hostname is also used in the Postgres default settings */
+		*changes |= KEEPER_CONFIG_CHANGED_METADATA;
+		*changes |= KEEPER_CONFIG_CHANGED_POSTGRES;
+
 		log_info("Reloading configuration: hostname is now \"%s\"; "
 				 "used to be \"%s\"",
 				 newConfig->hostname, config->hostname);
@@ -2592,6 +3582,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	 */
 	if (strneq(newConfig->replication_password, config->replication_password))
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_STANDBY;
+
 		log_info("Reloading configuration: replication password has changed");
 
 		/* note: strneq checks args are not NULL, it's safe to proceed */
@@ -2605,6 +3597,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	 */
 	if (strneq(newConfig->maximum_backup_rate, config->maximum_backup_rate))
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info("Reloading configuration: "
 				 "replication.maximum_backup_rate is now \"%s\"; "
 				 "used to be \"%s\"",
@@ -2615,11 +3609,189 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 				MAXIMUM_BACKUP_RATE_LEN);
 	}
 
+	/*
+	 * Changing replication.minimum_backup_rate.
+	 */
+	if (strneq(newConfig->minimum_backup_rate, config->minimum_backup_rate))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.minimum_backup_rate is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->minimum_backup_rate, config->minimum_backup_rate);
+
+		strlcpy(config->minimum_backup_rate,
+				newConfig->minimum_backup_rate,
+				MAXIMUM_BACKUP_RATE_LEN);
+	}
+
+	/*
+	 * Changing replication.clone_source.
+	 */
+	if (strneq(newConfig->cloneSourceStr, config->cloneSourceStr))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.clone_source is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->cloneSourceStr, config->cloneSourceStr);
+
+		strlcpy(config->cloneSourceStr,
+				newConfig->cloneSourceStr,
+				NAMEDATALEN);
+		config->cloneSource = newConfig->cloneSource;
+	}
+
+	/*
+	 * Changing the replication.basebackup_* options.
+	 */
+	if (strneq(newConfig->basebackupCompress, config->basebackupCompress))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.basebackup_compress is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->basebackupCompress, config->basebackupCompress);
+
+		strlcpy(config->basebackupCompress,
+				newConfig->basebackupCompress,
+				NAMEDATALEN);
+	}
+
+	if (strneq(newConfig->basebackupWalMethod, config->basebackupWalMethod))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.basebackup_wal_method is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->basebackupWalMethod, config->basebackupWalMethod);
+
+		strlcpy(config->basebackupWalMethod,
+				newConfig->basebackupWalMethod,
+				NAMEDATALEN);
+	}
+
+	if (strneq(newConfig->basebackupManifestChecksums,
+			   config->basebackupManifestChecksums))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.basebackup_manifest_checksums is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->basebackupManifestChecksums,
+				 config->basebackupManifestChecksums);
+
+		strlcpy(config->basebackupManifestChecksums,
+				newConfig->basebackupManifestChecksums,
+				NAMEDATALEN);
+	}
+
+	/*
+	 * Changing replication.restore_command and replication.wal_prefetch, the
+	 * standby settings are then updated in keeper_ensure_configuration.
+	 */
+	if (strneq(newConfig->restoreCommand, config->restoreCommand))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_STANDBY;
+
+		log_info("Reloading configuration: "
+				 "replication.restore_command is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->restoreCommand,
+				 config->restoreCommand);
+
+		strlcpy(config->restoreCommand,
+				newConfig->restoreCommand,
+				MAXCONNINFO);
+	}
+
+	if (newConfig->walPrefetch != config->walPrefetch)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_STANDBY;
+
+		log_info("Reloading configuration: replication.wal_prefetch "
+				 "is now %d; used to be %d",
+				 newConfig->walPrefetch,
+				 config->walPrefetch);
+
+		config->walPrefetch = newConfig->walPrefetch;
+	}
+
+	if (newConfig->prewarmWorkers != config->prewarmWorkers)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: replication.prewarm_workers "
+				 "is now %d; used to be %d",
+				 newConfig->prewarmWorkers,
+				 config->prewarmWorkers);
+
+		config->prewarmWorkers = newConfig->prewarmWorkers;
+	}
+
+	if (newConfig->cloneStreams != config->cloneStreams)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: replication.clone_streams "
+				 "is now %d; used to be %d",
+				 newConfig->cloneStreams,
+				 config->cloneStreams);
+
+		config->cloneStreams = newConfig->cloneStreams;
+	}
+
+	if (strneq(newConfig->maxSlotWalKeepSize, config->maxSlotWalKeepSize))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: "
+				 "replication.max_slot_wal_keep_size is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->maxSlotWalKeepSize,
+				 config->maxSlotWalKeepSize);
+
+		strlcpy(config->maxSlotWalKeepSize, newConfig->maxSlotWalKeepSize,
+				sizeof(config->maxSlotWalKeepSize));
+	}
+
+	if (newConfig->slotWalWarningSize != config->slotWalWarningSize)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: replication.slot_wal_warning_size "
+				 "is now %d; used to be %d",
+				 newConfig->slotWalWarningSize,
+				 config->slotWalWarningSize);
+
+		config->slotWalWarningSize = newConfig->slotWalWarningSize;
+	}
+
+	/* on Postgres 17 and later, primary_conninfo then includes a dbname */
+	if (newConfig->logicalSlotsFailover != config->logicalSlotsFailover)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_STANDBY;
+
+		log_info("Reloading configuration: replication.logical_slots_failover "
+				 "is now %d; used to be %d",
+				 newConfig->logicalSlotsFailover,
+				 config->logicalSlotsFailover);
+
+		config->logicalSlotsFailover = newConfig->logicalSlotsFailover;
+	}
+
 	/*
 	 * The backupDirectory can be changed online too.
 	 */
 	if (strneq(newConfig->backupDirectory, config->backupDirectory))
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info("Reloading configuration: "
 				 "replication.backup_directory is now \"%s\"; "
 				 "used to be \"%s\"",
@@ -2633,6 +3805,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	 */
 	if (newConfig->network_partition_timeout != config->network_partition_timeout)
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info("Reloading configuration: timeout.network_partition_timeout "
 				 "is now %d; used to be %d",
 				 newConfig->network_partition_timeout,
@@ -2644,6 +3818,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 
 	if (newConfig->prepare_promotion_catchup != config->prepare_promotion_catchup)
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info("Reloading configuration: timeout.prepare_promotion_catchup "
 				 "is now %d; used to be %d",
 				 newConfig->prepare_promotion_catchup,
@@ -2655,6 +3831,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 
 	if (newConfig->prepare_promotion_walreceiver != config->prepare_promotion_walreceiver)
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info(
 			"Reloading configuration: timeout.prepare_promotion_walreceiver "
 			"is now %d; used to be %d",
@@ -2665,9 +3843,48 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 			newConfig->prepare_promotion_walreceiver;
 	}
 
+	if (newConfig->prepare_promotion_prewarm != config->prepare_promotion_prewarm)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: timeout.prepare_promotion_prewarm "
+				 "is now %d; used to be %d",
+				 newConfig->prepare_promotion_prewarm,
+				 config->prepare_promotion_prewarm);
+
+		config->prepare_promotion_prewarm =
+			newConfig->prepare_promotion_prewarm;
+	}
+
+	if (newConfig->prepare_demotion != config->prepare_demotion)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: timeout.prepare_demotion "
+				 "is now %d; used to be %d",
+				 newConfig->prepare_demotion,
+				 config->prepare_demotion);
+
+		config->prepare_demotion = newConfig->prepare_demotion;
+	}
+
+	if (newConfig->drain_sessions != config->drain_sessions)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: timeout.drain_sessions "
+				 "is now %d; used to be %d",
+				 newConfig->drain_sessions,
+				 config->drain_sessions);
+
+		config->drain_sessions = newConfig->drain_sessions;
+	}
+
 	if (newConfig->postgresql_restart_failure_timeout !=
 		config->postgresql_restart_failure_timeout)
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info(
 			"Reloading configuration: timeout.postgresql_restart_failure_timeout "
 			"is now %d; used to be %d",
@@ -2681,6 +3898,8 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	if (newConfig->postgresql_restart_failure_max_retries !=
 		config->postgresql_restart_failure_max_retries)
 	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
 		log_info(
 			"Reloading configuration: retries.postgresql_restart_failure_max_retries "
 			"is now %d; used to be %d",
@@ -2691,23 +3910,252 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 			newConfig->postgresql_restart_failure_max_retries;
 	}
 
-	/* we can change any SSL related setup options at runtime */
-	return config_accept_new_ssloptions(&(config->pgSetup),
-										&(newConfig->pgSetup));
-}
+	if (newConfig->postgresql_crash_recovery_timeout !=
+		config->postgresql_crash_recovery_timeout)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
 
+		log_info(
+			"Reloading configuration: timeout.postgresql_crash_recovery_timeout "
+			"is now %d; used to be %d",
+			newConfig->postgresql_crash_recovery_timeout,
+			config->postgresql_crash_recovery_timeout);
 
-/*
- * reload_configuration reads the supposedly new configuration file and
- * integrates accepted new values into the current setup.
- */
-bool
-keeper_reload_configuration(Keeper *keeper, bool firstLoop, bool doInit)
-{
-	KeeperConfig *config = &(keeper->config);
-	bool postgresNotRunningIsOk = firstLoop;
+		config->postgresql_crash_recovery_timeout =
+			newConfig->postgresql_crash_recovery_timeout;
+	}
 
-	/*
+	if (newConfig->inactive_slot_drop_timeout !=
+		config->inactive_slot_drop_timeout)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info(
+			"Reloading configuration: timeout.inactive_slot_drop_timeout "
+			"is now %d; used to be %d",
+			newConfig->inactive_slot_drop_timeout,
+			config->inactive_slot_drop_timeout);
+
+		config->inactive_slot_drop_timeout =
+			newConfig->inactive_slot_drop_timeout;
+	}
+
+	if (newConfig->primary_lease_timeout != config->primary_lease_timeout)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: timeout.primary_lease_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->primary_lease_timeout,
+				 config->primary_lease_timeout);
+
+		config->primary_lease_timeout = newConfig->primary_lease_timeout;
+	}
+
+	if (strneq(newConfig->monitorNotifications, config->monitorNotifications))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: pg_autoctl.monitor_notifications "
+				 "is now \"%s\"; used to be \"%s\"",
+				 newConfig->monitorNotifications,
+				 config->monitorNotifications);
+
+		strlcpy(config->monitorNotifications,
+				newConfig->monitorNotifications,
+				NAMEDATALEN);
+	}
+
+	if (newConfig->slow_loop_threshold != config->slow_loop_threshold)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: timeout.slow_loop_threshold "
+				 "is now %d; used to be %d",
+				 newConfig->slow_loop_threshold,
+				 config->slow_loop_threshold);
+
+		config->slow_loop_threshold = newConfig->slow_loop_threshold;
+	}
+
+	if (newConfig->serviceNice != config->serviceNice)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: service.nice "
+				 "is now %d; used to be %d",
+				 newConfig->serviceNice,
+				 config->serviceNice);
+
+		config->serviceNice = newConfig->serviceNice;
+
+		(void) service_set_nice(config->serviceNice);
+	}
+
+	if (strneq(newConfig->serviceCpus, config->serviceCpus))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: service.cpus is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->serviceCpus,
+				 config->serviceCpus);
+
+		strlcpy(config->serviceCpus,
+				newConfig->serviceCpus,
+				sizeof(config->serviceCpus));
+
+		(void) service_set_cpu_affinity(config->serviceCpus);
+	}
+
+	if (newConfig->serviceLockMemory != config->serviceLockMemory)
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: service.lock_memory "
+				 "is now %d; used to be %d",
+				 newConfig->serviceLockMemory,
+				 config->serviceLockMemory);
+
+		config->serviceLockMemory = newConfig->serviceLockMemory;
+
+		(void) service_lock_memory(config->serviceLockMemory != 0);
+	}
+
+	/*
+	 * A process can't leave its cgroup on its own, it can only be moved to
+	 * another one: joining a new cgroup is fine, going back to the cgroup we
+	 * started in needs a restart.
+	 */
+	if (strneq(newConfig->serviceCgroup, config->serviceCgroup))
+	{
+		if (IS_EMPTY_STRING_BUFFER(newConfig->serviceCgroup))
+		{
+			log_warn("pg_autoctl doesn't know how to leave cgroup \"%s\" "
+					 "at run-time; restart pg_autoctl to run in its "
+					 "original cgroup",
+					 config->serviceCgroup);
+		}
+		else
+		{
+			log_info("Reloading configuration: service.cgroup is now \"%s\"; "
+					 "used to be \"%s\"",
+					 newConfig->serviceCgroup,
+					 config->serviceCgroup);
+
+			(void) service_join_cgroup(newConfig->serviceCgroup);
+		}
+
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		strlcpy(config->serviceCgroup,
+				newConfig->serviceCgroup,
+				sizeof(config->serviceCgroup));
+	}
+
+	/*
+	 * The metrics service is only started by pg_autoctl run when
+	 * metrics.listen is set, so we keep using the value we started with.
+	 */
+	if (strneq(newConfig->metricsListen, config->metricsListen))
+	{
+		log_warn("pg_autoctl doesn't know how to change metrics.listen "
+				 "at run-time, continuing with \"%s\"; restart pg_autoctl "
+				 "to use \"%s\"",
+				 config->metricsListen,
+				 newConfig->metricsListen);
+	}
+
+	if (strneq(newConfig->tracingOtlpFile, config->tracingOtlpFile))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: tracing.otlp_file is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->tracingOtlpFile,
+				 config->tracingOtlpFile);
+
+		strlcpy(config->tracingOtlpFile,
+				newConfig->tracingOtlpFile,
+				sizeof(config->tracingOtlpFile));
+
+		(void) trace_setup(config->tracingOtlpFile,
+						   config->formation,
+						   config->name,
+						   config->hostname);
+	}
+
+	if (strneq(newConfig->poolerAdminEndpoints, config->poolerAdminEndpoints))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: pooler.admin_endpoints changed");
+
+		strlcpy(config->poolerAdminEndpoints,
+				newConfig->poolerAdminEndpoints,
+				sizeof(config->poolerAdminEndpoints));
+	}
+
+	if (strneq(newConfig->poolerDatabase, config->poolerDatabase))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_OTHER;
+
+		log_info("Reloading configuration: pooler.database is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->poolerDatabase,
+				 config->poolerDatabase);
+
+		strlcpy(config->poolerDatabase,
+				newConfig->poolerDatabase,
+				sizeof(config->poolerDatabase));
+	}
+
+	/* the tuning profile is used in the Postgres default settings */
+	if (strneq(newConfig->pgSetup.tuningProfile, config->pgSetup.tuningProfile))
+	{
+		log_info("Reloading configuration: tuning profile is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->pgSetup.tuningProfile,
+				 config->pgSetup.tuningProfile);
+
+		strlcpy(config->pgSetup.tuningProfile,
+				newConfig->pgSetup.tuningProfile,
+				sizeof(config->pgSetup.tuningProfile));
+
+		*changes |= KEEPER_CONFIG_CHANGED_POSTGRES;
+	}
+
+	/*
+	 * We can change any SSL related setup options at runtime, they are used
+	 * in the Postgres settings and in the standby primary_conninfo.
+	 */
+	if (keeper_ssloptions_changed(&(config->pgSetup.ssl),
+								  &(newConfig->pgSetup.ssl)))
+	{
+		*changes |= KEEPER_CONFIG_CHANGED_POSTGRES;
+		*changes |= KEEPER_CONFIG_CHANGED_STANDBY;
+	}
+
+	return config_accept_new_ssloptions(&(config->pgSetup),
+										&(newConfig->pgSetup));
+}
+
+
+/*
+ * reload_configuration reads the supposedly new configuration file and
+ * integrates accepted new values into the current setup.
+ *
+ * When the configuration file has the same modification time and contents as
+ * when we last read it, we skip parsing it again. Otherwise only the parts of
+ * the setup that are affected by the changes are updated.
+ */
+bool
+keeper_reload_configuration(Keeper *keeper, bool firstLoop, bool doInit)
+{
+	KeeperConfig *config = &(keeper->config);
+	bool postgresNotRunningIsOk = firstLoop;
+
+	/*
 	 * This function implements changes that we want to see before calling the
 	 * monitor for the first time, when called as part as the firstLoop. The
 	 * function is called again at the end of the loop, once the monitor has
@@ -2722,26 +4170,38 @@ keeper_reload_configuration(Keeper *keeper, bool firstLoop, bool doInit)
 	if (file_exists(config->pathnames.config))
 	{
 		KeeperConfig newConfig = { 0 };
+		ConfigFileStamp stamp = { 0 };
+		int changes = KEEPER_CONFIG_CHANGED_NONE;
 
 		bool missingPgdataIsOk = true;
 		bool pgIsNotRunningIsOk = true;
 		bool monitorDisabledIsOk = true;
 
+		/*
+		 * At start-up we apply the configuration in full, later we skip
+		 * reading a file that didn't change since the last time.
+		 */
+		if (config_file_stamp(config->pathnames.config, &stamp) &&
+			config_file_stamp_equals(&stamp, &(keeper->configStamp)) &&
+			!firstLoop)
+		{
+			log_info("Configuration file \"%s\" has not changed, "
+					 "continuing with the same configuration.",
+					 config->pathnames.config);
+			return true;
+		}
+
 		/*
 		 * Set the same configuration and state file as the current config.
 		 */
 		strlcpy(newConfig.pathnames.config, config->pathnames.config, MAXPGPATH);
 		strlcpy(newConfig.pathnames.state, config->pathnames.state, MAXPGPATH);
 
-		/* disconnect to the current monitor if we're connected */
-		(void) pgsql_finish(&(keeper->monitor.pgsql));
-		(void) pgsql_finish(&(keeper->monitor.notificationClient));
-
 		if (keeper_config_read_file(&newConfig,
 									missingPgdataIsOk,
 									pgIsNotRunningIsOk,
 									monitorDisabledIsOk) &&
-			keeper_config_accept_new(keeper, &newConfig))
+			keeper_config_accept_new(keeper, &newConfig, &changes))
 		{
 			/*
 			 * The keeper->config changed, not the keeper->postgres, but the
@@ -2751,14 +4211,57 @@ keeper_reload_configuration(Keeper *keeper, bool firstLoop, bool doInit)
 			log_info("Reloaded the new configuration from \"%s\"",
 					 config->pathnames.config);
 
+			keeper->configStamp = stamp;
+
+			/* verify the current state again with the new configuration */
+			keeper->ensuredTime = 0;
+
+			/* at start-up, make sure Postgres uses the current setup */
+			if (firstLoop)
+			{
+				changes |= KEEPER_CONFIG_CHANGED_POSTGRES;
+			}
+
+			/*
+			 * Disconnect from the monitor if we're connected, when we're
+			 * going to initialize it again.
+			 */
+			if (changes & (KEEPER_CONFIG_CHANGED_MONITOR |
+						   KEEPER_CONFIG_CHANGED_POSTGRES |
+						   KEEPER_CONFIG_CHANGED_STANDBY))
+			{
+				(void) pgsql_finish(&(keeper->monitor.pgsql));
+				(void) pgsql_finish(&(keeper->monitor.notificationClient));
+			}
+
 			/*
 			 * The new configuration might impact the Postgres setup, such as
-			 * when changing the SSL file paths.
+			 * when changing the SSL file paths. That also initializes our
+			 * monitor again.
 			 */
-			if (!keeper_ensure_configuration(keeper, postgresNotRunningIsOk))
+			if (changes & (KEEPER_CONFIG_CHANGED_POSTGRES |
+						   KEEPER_CONFIG_CHANGED_STANDBY))
 			{
-				log_warn("Failed to reload pg_autoctl configuration, "
-						 "see above for details");
+				if (!keeper_ensure_configuration(keeper,
+												 postgresNotRunningIsOk))
+				{
+					log_warn("Failed to reload pg_autoctl configuration, "
+							 "see above for details");
+				}
+
+				/* keeper_ensure_configuration writes the configuration file */
+				(void) config_file_stamp(config->pathnames.config,
+										 &(keeper->configStamp));
+			}
+			else if ((changes & KEEPER_CONFIG_CHANGED_MONITOR) &&
+					 !config->monitorDisabled)
+			{
+				if (!monitor_init(&(keeper->monitor), config->monitor_pguri))
+				{
+					/* we tested already in keeper_config_accept_new, but... */
+					log_warn("Failed to contact the monitor because its "
+							 "URL is invalid, see above for details");
+				}
 			}
 		}
 		else
@@ -2864,17 +4367,36 @@ keeper_get_primary(Keeper *keeper, NodeAddress *primaryNode)
 	{
 		Monitor *monitor = &(keeper->monitor);
 
-		if (!monitor_get_primary(monitor,
-								 config->formation,
-								 keeper->state.current_group,
-								 primaryNode))
+		if (monitor_get_primary(monitor,
+								config->formation,
+								keeper->state.current_group,
+								primaryNode))
 		{
-			log_error("Failed to get the primary node from the monitor, "
-					  "see above for details");
-			return false;
+			return true;
 		}
 
-		return true;
+		if (keeper_other_nodes_are_usable(keeper))
+		{
+			for (int i = 0; i < keeper->otherNodes.count; i++)
+			{
+				NodeAddress *node = &(keeper->otherNodes.nodes[i]);
+
+				if (node->isPrimary)
+				{
+					log_warn("Failed to get the primary node from the "
+							 "monitor, using node %" PRId64 " \"%s\" (%s:%d) "
+							 "from our list of other nodes",
+							 node->nodeId, node->name, node->host, node->port);
+
+					*primaryNode = *node;
+					return true;
+				}
+			}
+		}
+
+		log_error("Failed to get the primary node from the monitor, "
+				  "see above for details");
+		return false;
 	}
 	else
 	{
@@ -2901,56 +4423,986 @@ keeper_get_primary(Keeper *keeper, NodeAddress *primaryNode)
 
 
 /*
- * keeper_get_most_advanced_standby fetches the current most advanded standby
- * node in the group, either by connecting to the monitor and using the
- * pgautofailover.get_most_advanced_standby() API there, or by scanning through
- * the keeper->otherNodes array.
+ * keeper_get_upstream fetches the node that we should stream from: either the
+ * upstream standby node that has been set for this node on the monitor, when
+ * both nodes are currently secondary, or the primary node of the group.
+ *
+ * Without a monitor, cascading replication is not supported and we return the
+ * primary node.
  */
 bool
-keeper_get_most_advanced_standby(Keeper *keeper, NodeAddress *upstreamNode)
+keeper_get_upstream(Keeper *keeper, NodeAddress *upstreamNode)
 {
 	KeeperConfig *config = &(keeper->config);
-	int groupId = keeper->state.current_group;
 
-	if (!config->monitorDisabled)
+	if (config->monitorDisabled)
 	{
-		Monitor *monitor = &(keeper->monitor);
+		return keeper_get_primary(keeper, upstreamNode);
+	}
 
-		if (!monitor_get_most_advanced_standby(monitor,
-											   config->formation,
-											   groupId,
-											   upstreamNode))
-		{
-			log_error("Failed to get the most advanced standby node "
-					  "from the monitor, see above for details");
-			return false;
-		}
+	NodeAddress node = { 0 };
+
+	if (!monitor_get_upstream(&(keeper->monitor),
+							  keeper->state.current_node_id,
+							  &node))
+	{
+		log_error("Failed to get the upstream node from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	*upstreamNode = node;
+
+	return true;
+}
+
+
+/*
+ * keeper_ensure_upstream makes sure that a secondary node streams from the
+ * upstream node registered on the monitor. When the upstream node changes,
+ * because it has been edited with pg_autoctl set node upstream or because the
+ * upstream node is not a secondary anymore, we edit primary_conninfo and
+ * restart Postgres.
+ */
+bool
+keeper_ensure_upstream(Keeper *keeper)
+{
+	ReplicationSource *replicationSource = &(keeper->postgres.replicationSource);
+	NodeAddress *currentNode = &(replicationSource->primaryNode);
+	NodeAddress upstreamNode = { 0 };
+
+	if (!keeper_get_upstream(keeper, &upstreamNode))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
+	if (upstreamNode.nodeId == currentNode->nodeId &&
+		upstreamNode.port == currentNode->port &&
+		strcmp(upstreamNode.host, currentNode->host) == 0)
+	{
 		return true;
 	}
-	else
+
+	log_info("Upstream node changed from " NODE_FORMAT " to " NODE_FORMAT
+			 ", updating replication settings",
+			 currentNode->nodeId, currentNode->name,
+			 currentNode->host, currentNode->port,
+			 upstreamNode.nodeId, upstreamNode.name,
+			 upstreamNode.host, upstreamNode.port);
+
+	*currentNode = upstreamNode;
+
+	return keeper_apply_standby_settings(keeper);
+}
+
+
+/*
+ * keeper_report_progress is a PgProgressHook that reports the progress of the
+ * pg_basebackup and pg_rewind operations to the monitor, so that pg_autoctl
+ * show state and pg_autoctl watch can display it. We only report every few
+ * seconds, and when the operation is done, the progress information on the
+ * monitor is removed.
+ *
+ * Failing to report progress is not a reason to fail the operation, so
+ * errors are ignored here.
+ */
+void
+keeper_report_progress(void *context, const char *operation,
+					   uint64_t doneBytes, uint64_t totalBytes)
+{
+	Keeper *keeper = (Keeper *) context;
+	Monitor *monitor = &(keeper->monitor);
+	int64_t nodeId = keeper->state.current_node_id;
+	uint64_t now = time(NULL);
+
+	if (keeper->config.monitorDisabled)
 	{
-		NodeAddress *mostAdvandedStandbyNode = NULL;
-		uint64_t mostAdvandedLSN = 0;
+		return;
+	}
 
-		for (int i = 0; i < keeper->otherNodes.count; i++)
+	if (operation == NULL)
+	{
+		keeper->progressReportTime = 0;
+
+		if (!monitor_clear_node_progress(monitor, nodeId))
 		{
-			NodeAddress *node = &(keeper->otherNodes.nodes[i]);
-			uint64_t nodeLSN = 0;
+			log_debug("Failed to clear progress information on the monitor");
+		}
 
-			if (!parseLSN(node->lsn, &nodeLSN))
-			{
-				log_error("Failed to parse node %" PRId64
-						  " \"%s\" LSN position \"%s\"",
-						  node->nodeId, node->name, node->lsn);
-				return false;
-			}
+		return;
+	}
+
+	if (doneBytes < totalBytes &&
+		(now - keeper->progressReportTime) < PG_AUTOCTL_PROGRESS_REPORT_INTERVAL)
+	{
+		return;
+	}
+
+	keeper->progressReportTime = now;
+
+	if (!monitor_set_node_progress(monitor, nodeId, operation,
+								   (int64_t) doneBytes,
+								   (int64_t) totalBytes))
+	{
+		log_debug("Failed to report %s progress to the monitor", operation);
+	}
+}
+
+
+/*
+ * keeper_update_apply_rate maintains an estimate of how many bytes of WAL per
+ * second the local standby is able to replay, which the monitor uses to
+ * estimate how long a failover candidate would need before being writable.
+ *
+ * The rate is only measured while the standby has WAL to replay both at the
+ * beginning and at the end of the sampling interval, otherwise we would be
+ * measuring the incoming WAL traffic rather than the apply rate.
+ */
+static void
+keeper_update_apply_rate(LocalPostgresServer *postgres)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	uint64_t receiveLSN = 0;
+	uint64_t replayLSN = 0;
+	uint64_t now = time(NULL);
+
+	if (!pgSetup->is_in_recovery ||
+		!parseLSN(postgres->currentLSN, &receiveLSN) ||
+		!parseLSN(postgres->replayLSN, &replayLSN))
+	{
+		postgres->applyRate = 0;
+		postgres->applyRateSampleTime = 0;
+		return;
+	}
+
+	bool backlog = receiveLSN > replayLSN;
+
+	if (postgres->applyRateSampleTime > 0 &&
+		(now - postgres->applyRateSampleTime) < PG_AUTOCTL_APPLY_RATE_INTERVAL)
+	{
+		return;
+	}
+
+	if (postgres->applyRateSampleTime > 0 &&
+		postgres->applyRateSampleBacklog &&
+		backlog &&
+		replayLSN >= postgres->applyRateSampleLSN)
+	{
+		int64_t rate =
+			(int64_t) ((replayLSN - postgres->applyRateSampleLSN) /
+					   (now - postgres->applyRateSampleTime));
+
+		/* smooth out the estimate with the previous one */
+		postgres->applyRate =
+			postgres->applyRate == 0 ? rate : (postgres->applyRate + rate) / 2;
+
+		log_trace("keeper_update_apply_rate: %" PRId64 " bytes/s",
+				  postgres->applyRate);
+	}
+
+	postgres->applyRateSampleLSN = replayLSN;
+	postgres->applyRateSampleTime = now;
+	postgres->applyRateSampleBacklog = backlog;
+}
+
+
+/*
+ * keeper_report_replication reports the pg_stat_replication view of our
+ * standby nodes to the monitor, in a single call for the whole group. The
+ * monitor then advances the reported LSN of the standby nodes that are
+ * behind what we know they have flushed, and may use the lags to order the
+ * list of synchronous standby names. We only report every few seconds, and
+ * also check how much WAL the replication slots retain at the same time.
+ *
+ * The monitor also uses the report to notice that a synchronous standby has
+ * disconnected, so we report right away when a walsender is gone since the
+ * previous loop, or when commits have been waiting on SyncRep for two loops
+ * in a row. We send how many commits wait on SyncRep along with the report,
+ * and the monitor records an event when they wait for too long.
+ */
+bool
+keeper_report_replication(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	StandbyReplicationArrays report = { 0 };
+	SyncRepStatus *previous = &(keeper->syncRepStatus);
+	SyncRepStatus status = { 0 };
+	uint64_t now = time(NULL);
+
+	if (pgsql_get_sync_rep_status(&(postgres->sqlClient), &status))
+	{
+		bool walSenderLost = status.walSenders < previous->walSenders;
+		bool syncRepStalled = status.waiting > 0 && previous->waiting > 0;
+
+		if (walSenderLost || syncRepStalled)
+		{
+			log_debug("Reporting replication now: %d walsenders (was %d), "
+					  "%d backends waiting on SyncRep for up to %" PRId64 " ms",
+					  status.walSenders, previous->walSenders,
+					  status.waiting, status.oldestWaitMs);
+
+			keeper->replicationReportTime = 0;
+		}
+
+		*previous = status;
+	}
+
+	if ((now - keeper->replicationReportTime) <
+		PG_AUTOCTL_REPLICATION_REPORT_INTERVAL)
+	{
+		return true;
+	}
+
+	keeper->replicationReportTime = now;
+
+	if (!pgsql_get_standby_replication(&(postgres->sqlClient), &report))
+	{
+		log_debug("Failed to get the replication status of the standby nodes");
+		return false;
+	}
+
+	keeper->replicationReport = report;
+
+	(void) keeper_check_replication_slots(keeper, &report);
+
+	if (config->monitorDisabled)
+	{
+		return true;
+	}
+
+	if (!monitor_set_replication_report(&(keeper->monitor),
+										keeper->state.current_node_id,
+										&report))
+	{
+		log_debug("Failed to report the replication status to the monitor");
+		return false;
+	}
+
+	if (!monitor_set_sync_rep_waits(&(keeper->monitor),
+									keeper->state.current_node_id,
+									&(keeper->syncRepStatus)))
+	{
+		log_debug("Failed to report the synchronous replication waits "
+				  "to the monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_report_resources samples the CPU, memory, and disk I/O usage of our
+ * host, and how much WAL the local Postgres writes or receives, and reports
+ * them to the monitor every PG_AUTOCTL_RESOURCES_REPORT_INTERVAL. Rates are
+ * computed from the previous sample, so the first report only has the CPU
+ * count, the memory, and the load average. That's enough to spot a standby
+ * that's undersized compared to its primary.
+ */
+bool
+keeper_report_resources(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	NodeResources *resources = &(keeper->resources);
+	SystemUsage *previous = &(keeper->resourcesUsage);
+	SystemInfo sysInfo = { 0 };
+	SystemUsage usage = { 0 };
+	uint64_t currentLSN = 0;
+	uint64_t now = time(NULL);
+
+	uint64_t elapsed = now - keeper->resourcesReportTime;
+
+	if (keeper->resourcesReportTime > 0 &&
+		elapsed < PG_AUTOCTL_RESOURCES_REPORT_INTERVAL)
+	{
+		return true;
+	}
+
+	/* don't retry at every loop when we can't sample our resources */
+	bool firstSample = keeper->resourcesReportTime == 0;
+	keeper->resourcesReportTime = now;
+
+	if (!get_system_info(&sysInfo) || !get_system_usage(&usage))
+	{
+		log_debug("Failed to get the resources of the local host");
+		return false;
+	}
+
+	/* on a standby, the current LSN is the receive LSN */
+	bool hasLSN =
+		postgres->pgIsRunning && parseLSN(postgres->currentLSN, &currentLSN);
+
+	resources->ncpu = sysInfo.ncpu;
+	resources->totalram = sysInfo.totalram;
+	resources->availableram = usage.availableram;
+	resources->loadAverage = usage.loadAverage;
+
+	if (!firstSample && elapsed > 0)
+	{
+		uint64_t totalTicks =
+			usage.cpuTotalTicks > previous->cpuTotalTicks
+			? usage.cpuTotalTicks - previous->cpuTotalTicks
+			: 0;
+		uint64_t busyTicks =
+			usage.cpuBusyTicks > previous->cpuBusyTicks
+			? usage.cpuBusyTicks - previous->cpuBusyTicks
+			: 0;
+
+		resources->cpuUsage =
+			totalTicks > 0 ? 100.0 * busyTicks / totalTicks : 0.0;
+
+		resources->diskReadRate =
+			usage.diskReadBytes > previous->diskReadBytes
+			? (usage.diskReadBytes - previous->diskReadBytes) / elapsed
+			: 0;
+
+		resources->diskWriteRate =
+			usage.diskWriteBytes > previous->diskWriteBytes
+			? (usage.diskWriteBytes - previous->diskWriteBytes) / elapsed
+			: 0;
+
+		resources->walRate =
+			hasLSN && keeper->resourcesLSN > 0 &&
+			currentLSN > keeper->resourcesLSN
+			? (currentLSN - keeper->resourcesLSN) / elapsed
+			: 0;
+	}
+
+	*previous = usage;
+	keeper->resourcesLSN = hasLSN ? currentLSN : 0;
+
+	if (config->monitorDisabled)
+	{
+		return true;
+	}
+
+	if (!monitor_set_node_resources(&(keeper->monitor),
+									keeper->state.current_node_id,
+									resources))
+	{
+		log_debug("Failed to report the resources of the local host "
+				  "to the monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_check_replication_slots warns when the replication slot of a
+ * standby node retains more than replication.slot_wal_warning_size of WAL,
+ * at most every PG_AUTOCTL_SLOTS_MAINTAIN_INTERVAL seconds.
+ *
+ * When timeout.inactive_slot_drop_timeout is set, it also drops the slots of
+ * the standby nodes that are not connected and whose restart_lsn hasn't moved
+ * for that long. The slot is then created again at the current LSN by
+ * keeper_create_and_drop_replication_slots, and the WAL that the standby node
+ * still needs might be recycled: it may then have to be rebuilt.
+ */
+static void
+keeper_check_replication_slots(Keeper *keeper, StandbyReplicationArrays *report)
+{
+	KeeperConfig *config = &(keeper->config);
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+
+	const char *nodeIds = report->nodeIds;
+	const char *sentLSNs = report->sentLSNs;
+	const char *retainedBytes = report->retainedBytes;
+	const char *restartLSNs = report->restartLSNs;
+
+	char nodeIdString[BUFSIZE] = { 0 };
+	char sentLSN[PG_LSN_MAXLENGTH] = { 0 };
+	char retained[BUFSIZE] = { 0 };
+	char restartLSN[PG_LSN_MAXLENGTH] = { 0 };
+
+	KeeperInactiveSlot inactiveSlots[KEEPER_INACTIVE_SLOTS_MAX] = { 0 };
+	int inactiveSlotsCount = 0;
+
+	uint64_t now = time(NULL);
+	int64_t warningBytes = (int64_t) config->slotWalWarningSize * 1024 * 1024;
+	bool warn = config->slotWalWarningSize > 0 &&
+				(now - keeper->slotWalWarningTime) >=
+				PG_AUTOCTL_SLOTS_MAINTAIN_INTERVAL;
+	bool warned = false;
+
+	while (nextArrayElement(&nodeIds, nodeIdString, sizeof(nodeIdString)) &&
+		   nextArrayElement(&sentLSNs, sentLSN, sizeof(sentLSN)) &&
+		   nextArrayElement(&retainedBytes, retained, sizeof(retained)) &&
+		   nextArrayElement(&restartLSNs, restartLSN, sizeof(restartLSN)))
+	{
+		int64_t nodeId = 0;
+		int64_t bytes = 0;
+		bool connected = strcmp(sentLSN, "NULL") != 0;
+
+		/* skip the standby nodes without a replication slot */
+		if (!stringToInt64(nodeIdString, &nodeId) ||
+			!stringToInt64(retained, &bytes))
+		{
+			continue;
+		}
+
+		if (warn && bytes > warningBytes)
+		{
+			char prettyBytes[BUFSIZE] = { 0 };
+
+			(void) BytesToString(bytes, prettyBytes, sizeof(prettyBytes));
+
+			log_warn("Replication slot of node %" PRId64 " retains %s of WAL, "
+					 "more than replication.slot_wal_warning_size (%dMB)%s",
+					 nodeId,
+					 prettyBytes,
+					 config->slotWalWarningSize,
+					 connected ? "" : ", and the node is not connected");
+
+			warned = true;
+		}
+
+		if (connected || inactiveSlotsCount >= KEEPER_INACTIVE_SLOTS_MAX)
+		{
+			continue;
+		}
+
+		/* track since when the restart_lsn of this inactive slot is stuck */
+		KeeperInactiveSlot *slot = &(inactiveSlots[inactiveSlotsCount++]);
+
+		slot->nodeId = nodeId;
+		slot->since = now;
+		strlcpy(slot->restartLSN, restartLSN, sizeof(slot->restartLSN));
+
+		for (int i = 0; i < keeper->inactiveSlotsCount; i++)
+		{
+			KeeperInactiveSlot *previous = &(keeper->inactiveSlots[i]);
+
+			if (previous->nodeId == nodeId &&
+				strcmp(previous->restartLSN, restartLSN) == 0)
+			{
+				slot->since = previous->since;
+				break;
+			}
+		}
+
+		if (config->inactive_slot_drop_timeout > 0 &&
+			(now - slot->since) >= config->inactive_slot_drop_timeout)
+		{
+			char slotName[BUFSIZE] = { 0 };
+
+			(void) postgres_sprintf_replicationSlotName(nodeId,
+														slotName,
+														sizeof(slotName));
+
+			log_warn("Node %" PRId64 " has not been connected for %" PRIu64
+					 "s and its replication slot \"%s\" retains WAL since LSN "
+					 "%s, dropping the slot as per "
+					 "timeout.inactive_slot_drop_timeout (%ds): the node "
+					 "might need to be rebuilt",
+					 nodeId,
+					 now - slot->since,
+					 slotName,
+					 restartLSN,
+					 config->inactive_slot_drop_timeout);
+
+			if (pgsql_drop_replication_slot(pgsql, slotName))
+			{
+				/* the slot is created again at the current LSN */
+				--inactiveSlotsCount;
+			}
+		}
+	}
+
+	if (warned)
+	{
+		keeper->slotWalWarningTime = now;
+	}
+
+	memcpy(keeper->inactiveSlots, inactiveSlots, sizeof(inactiveSlots));
+	keeper->inactiveSlotsCount = inactiveSlotsCount;
+}
+
+
+/*
+ * keeper_ensure_max_slot_wal_keep_size applies replication.max_slot_wal_keep_size
+ * to the local Postgres instance, once per value. An empty value means that
+ * pg_autoctl doesn't manage the setting.
+ */
+static bool
+keeper_ensure_max_slot_wal_keep_size(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+
+	if (IS_EMPTY_STRING_BUFFER(config->maxSlotWalKeepSize) ||
+		strcmp(config->maxSlotWalKeepSize,
+			   keeper->maxSlotWalKeepSizeApplied) == 0)
+	{
+		return true;
+	}
+
+	if (keeper->state.pg_control_version < 1300)
+	{
+		log_warn("Ignoring replication.max_slot_wal_keep_size \"%s\": "
+				 "the setting is only available in Postgres 13 and later",
+				 config->maxSlotWalKeepSize);
+
+		/* only warn once per value */
+		strlcpy(keeper->maxSlotWalKeepSizeApplied,
+				config->maxSlotWalKeepSize,
+				sizeof(keeper->maxSlotWalKeepSizeApplied));
+		return true;
+	}
+
+	if (!pgsql_set_max_slot_wal_keep_size(pgsql, config->maxSlotWalKeepSize))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	strlcpy(keeper->maxSlotWalKeepSizeApplied,
+			config->maxSlotWalKeepSize,
+			sizeof(keeper->maxSlotWalKeepSizeApplied));
+
+	return true;
+}
+
+
+/*
+ * keeper_refresh_prewarm_block_list saves the list of the blocks found in the
+ * buffer cache of our upstream node, when replication.prewarm_workers is set,
+ * at most every PG_AUTOCTL_PREWARM_REFRESH_INTERVAL seconds. The list is then
+ * used to pre-warm our own buffer cache when we're being promoted.
+ */
+bool
+keeper_refresh_prewarm_block_list(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+	char filename[MAXPGPATH] = { 0 };
+	uint64_t now = time(NULL);
+
+	if (config->prewarmWorkers == 0 ||
+		IS_EMPTY_STRING_BUFFER(upstream->primaryNode.host) ||
+		(now - keeper->prewarmRefreshTime) < PG_AUTOCTL_PREWARM_REFRESH_INTERVAL)
+	{
+		return true;
+	}
+
+	keeper->prewarmRefreshTime = now;
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_PREWARM_FILENAME,
+						   filename);
+
+	if (!upstream_save_prewarm_block_list(upstream,
+										  &(postgres->postgresSetup),
+										  !keeper->prewarmExtensionsCreated,
+										  filename))
+	{
+		log_warn("Failed to refresh the buffer cache pre-warm block list "
+				 "from node %" PRId64 " \"%s\" (%s:%d), see above for details",
+				 upstream->primaryNode.nodeId,
+				 upstream->primaryNode.name,
+				 upstream->primaryNode.host,
+				 upstream->primaryNode.port);
+		return false;
+	}
+
+	keeper->prewarmExtensionsCreated = true;
+
+	return true;
+}
+
+
+/*
+ * keeper_sync_logical_slots keeps the logical replication slots of a standby
+ * node in sync with those of its upstream node when
+ * replication.logical_slots_failover is set, so that the logical replication
+ * consumers such as CDC tools can continue from the new primary after a
+ * failover, rather than having to create their slot and snapshot their data
+ * again.
+ *
+ * On Postgres 17 and later, Postgres does that itself for the slots that
+ * have been created with the failover option, and we only enable its slot
+ * synchronization worker. On Postgres 16, we create the missing slots
+ * locally, advance them to the confirmed_flush_lsn of the upstream slots,
+ * and drop the slots that the upstream node doesn't have anymore. Logical
+ * replication slots on a standby node require Postgres 16.
+ */
+bool
+keeper_sync_logical_slots(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+	uint64_t now = time(NULL);
+	int pgVersion = 0;
+
+	if (!config->logicalSlotsFailover ||
+		IS_EMPTY_STRING_BUFFER(upstream->primaryNode.host) ||
+		(now - keeper->logicalSlotsSyncTime) <
+		PG_AUTOCTL_LOGICAL_SLOTS_SYNC_INTERVAL)
+	{
+		return true;
+	}
+
+	keeper->logicalSlotsSyncTime = now;
+
+	(void) parse_pg_version_string(config->pgSetup.pg_version, &pgVersion);
+
+	if (pgVersion < 1600)
+	{
+		if (!keeper->logicalSlotsVersionWarned)
+		{
+			log_warn("Ignoring replication.logical_slots_failover: logical "
+					 "replication slots on a standby node require "
+					 "Postgres 16 or later, and this is Postgres %s",
+					 config->pgSetup.pg_version);
+			keeper->logicalSlotsVersionWarned = true;
+		}
+		return true;
+	}
+
+	if (pgVersion >= 1700)
+	{
+		return pgsql_enable_logical_slots_sync(&(postgres->sqlClient), true);
+	}
+
+	if (!pgsql_enable_logical_slots_sync(&(postgres->sqlClient), false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	LogicalSlotArray upstreamSlots = { 0 };
+	LogicalSlotArray localSlots = { 0 };
+
+	if (!upstream_get_logical_slots(upstream,
+									&(postgres->postgresSetup),
+									&upstreamSlots))
+	{
+		log_warn("Failed to get the logical replication slots of node "
+				 "%" PRId64 " \"%s\" (%s:%d), see above for details",
+				 upstream->primaryNode.nodeId,
+				 upstream->primaryNode.name,
+				 upstream->primaryNode.host,
+				 upstream->primaryNode.port);
+		return false;
+	}
+
+	if (!pgsql_get_logical_slots(&(postgres->sqlClient), &localSlots))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* process each database once, with a connection to that database */
+	LogicalSlotArray *arrays[2] = { &upstreamSlots, &localSlots };
+	char databases[2 * LOGICAL_SLOTS_MAX_COUNT][NAMEDATALEN] = { 0 };
+	int databasesCount = 0;
+	bool success = true;
+
+	for (int a = 0; a < 2; a++)
+	{
+		for (int i = 0; i < arrays[a]->count; i++)
+		{
+			char *dbname = arrays[a]->slots[i].database;
+			bool found = false;
+
+			for (int d = 0; d < databasesCount; d++)
+			{
+				if (strcmp(databases[d], dbname) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
+
+			if (!found)
+			{
+				strlcpy(databases[databasesCount++], dbname, NAMEDATALEN);
+			}
+		}
+	}
+
+	for (int d = 0; d < databasesCount; d++)
+	{
+		if (!keeper_sync_database_logical_slots(keeper,
+												databases[d],
+												&upstreamSlots,
+												&localSlots))
+		{
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_sync_database_logical_slots synchronizes the logical replication
+ * slots of the given database, see keeper_sync_logical_slots. A slot that
+ * we create is advanced at the next round.
+ */
+static bool
+keeper_sync_database_logical_slots(Keeper *keeper,
+								   const char *dbname,
+								   LogicalSlotArray *upstreamSlots,
+								   LogicalSlotArray *localSlots)
+{
+	PGSQL client = { 0 };
+	bool success = true;
+
+	if (!local_postgres_init_database_client(&(keeper->postgres),
+											 dbname,
+											 &client))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* first drop the slots that are invalidated or gone upstream */
+	for (int i = 0; i < localSlots->count; i++)
+	{
+		LogicalSlot *localSlot = &(localSlots->slots[i]);
+
+		if (strcmp(localSlot->database, dbname) != 0)
+		{
+			continue;
+		}
+
+		LogicalSlot *upstreamSlot =
+			keeper_find_logical_slot(upstreamSlots, localSlot->slotName);
+
+		if (upstreamSlot != NULL &&
+			strcmp(upstreamSlot->database, dbname) == 0 &&
+			!localSlot->conflicting)
+		{
+			continue;
+		}
+
+		if (localSlot->conflicting)
+		{
+			log_warn("Logical replication slot \"%s\" has been invalidated, "
+					 "creating it again",
+					 localSlot->slotName);
+		}
+
+		if (!pgsql_drop_replication_slot(&client, localSlot->slotName))
+		{
+			success = false;
+			continue;
+		}
+
+		/* the slot is now gone */
+		localSlot->slotName[0] = '\0';
+	}
+
+	/* then create the missing slots and advance the existing ones */
+	for (int i = 0; i < upstreamSlots->count; i++)
+	{
+		LogicalSlot *upstreamSlot = &(upstreamSlots->slots[i]);
+
+		if (strcmp(upstreamSlot->database, dbname) != 0)
+		{
+			continue;
+		}
+
+		LogicalSlot *localSlot =
+			keeper_find_logical_slot(localSlots, upstreamSlot->slotName);
+
+		if (localSlot == NULL)
+		{
+			if (!pgsql_create_logical_slot(&client,
+										   upstreamSlot,
+										   PG_AUTOCTL_LOGICAL_SLOT_CREATE_TIMEOUT))
+			{
+				log_info("Failed to create logical replication slot \"%s\", "
+						 "retrying in %ds: on a standby node, Postgres waits "
+						 "until the primary logs a snapshot of its running "
+						 "transactions",
+						 upstreamSlot->slotName,
+						 PG_AUTOCTL_LOGICAL_SLOTS_SYNC_INTERVAL);
+				success = false;
+			}
+		}
+		else if (strcmp(localSlot->database, dbname) == 0 &&
+				 !IS_EMPTY_STRING_BUFFER(upstreamSlot->confirmedFlushLSN))
+		{
+			if (!pgsql_advance_logical_slot(&client, upstreamSlot))
+			{
+				success = false;
+			}
+		}
+	}
+
+	pgsql_finish(&client);
+
+	return success;
+}
+
+
+/*
+ * keeper_find_logical_slot returns the slot with the given name in the given
+ * array, or NULL when there is none.
+ */
+static LogicalSlot *
+keeper_find_logical_slot(LogicalSlotArray *slotsArray, const char *slotName)
+{
+	for (int i = 0; i < slotsArray->count; i++)
+	{
+		if (strcmp(slotsArray->slots[i].slotName, slotName) == 0)
+		{
+			return &(slotsArray->slots[i]);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * keeper_prewarm_buffer_cache loads the blocks found in the last saved block
+ * list into our local buffer cache, using replication.prewarm_workers
+ * connections, for up to timeout.prepare_promotion_prewarm seconds.
+ */
+bool
+keeper_prewarm_buffer_cache(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	char filename[MAXPGPATH] = { 0 };
+
+	if (config->prewarmWorkers == 0)
+	{
+		return true;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_PREWARM_FILENAME,
+						   filename);
+
+	return prewarm_load_block_list(postgres->sqlClient.connectionString,
+								   filename,
+								   config->prewarmWorkers,
+								   config->prepare_promotion_prewarm);
+}
+
+
+/*
+ * keeper_warm_up_after_maintenance reports a "warmup" operation to the
+ * monitor while a node that is back from maintenance replays the WAL that
+ * accumulated meanwhile, and then pre-warms its buffer cache from the block
+ * list of the primary. The monitor prefers other candidates with the same
+ * priority while a node is warming up, so that a failover doesn't target a
+ * standby with a large replay backlog and a cold cache.
+ *
+ * Progress is reported as the bytes of WAL replayed since the node left
+ * maintenance over the bytes of WAL received. Errors are ignored here: the
+ * monitor stops considering a node warming up when it stops reporting.
+ */
+static void
+keeper_warm_up_after_maintenance(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	uint64_t receiveLSN = 0;
+	uint64_t replayLSN = 0;
+
+	if (!keeper->warmupPending)
+	{
+		return;
+	}
+
+	if (!parseLSN(postgres->currentLSN, &receiveLSN) ||
+		!parseLSN(postgres->replayLSN, &replayLSN))
+	{
+		return;
+	}
+
+	if (!keeper->warmupStartLSNKnown)
+	{
+		keeper->warmupStartLSN = replayLSN;
+		keeper->warmupStartLSNKnown = true;
+	}
+
+	uint64_t startLSN =
+		keeper->warmupStartLSN < replayLSN ? keeper->warmupStartLSN : replayLSN;
+	uint64_t replayLag = receiveLSN > replayLSN ? receiveLSN - replayLSN : 0;
+
+	if (replayLag > PG_AUTOCTL_WARMUP_MAX_REPLAY_LAG)
+	{
+		keeper_report_progress(keeper, "warmup",
+							   replayLSN - startLSN,
+							   receiveLSN - startLSN);
+		return;
+	}
+
+	if (keeper->config.prewarmWorkers > 0)
+	{
+		log_info("Pre-warming the buffer cache after maintenance, "
+				 "for up to %ds",
+				 keeper->config.prepare_promotion_prewarm);
+
+		/* the buffer cache pre-warm is only a hint, ignore errors here */
+		(void) keeper_prewarm_buffer_cache(keeper);
+	}
+
+	log_info("Node is warm after maintenance, replaying within %" PRIu64
+			 " bytes of the received WAL",
+			 replayLag);
+
+	keeper_report_progress(keeper, NULL, 0, 0);
+
+	keeper->warmupPending = false;
+	keeper->warmupStartLSNKnown = false;
+}
+
+
+/*
+ * keeper_get_most_advanced_standby fetches the current most advanded standby
+ * node in the group, either by connecting to the monitor and using the
+ * pgautofailover.get_most_advanced_standby() API there, or by scanning through
+ * the keeper->otherNodes array.
+ */
+bool
+keeper_get_most_advanced_standby(Keeper *keeper, NodeAddress *upstreamNode)
+{
+	KeeperConfig *config = &(keeper->config);
+	int groupId = keeper->state.current_group;
+
+	if (!config->monitorDisabled)
+	{
+		Monitor *monitor = &(keeper->monitor);
+
+		if (!monitor_get_most_advanced_standby(monitor,
+											   config->formation,
+											   groupId,
+											   upstreamNode))
+		{
+			log_error("Failed to get the most advanced standby node "
+					  "from the monitor, see above for details");
+			return false;
+		}
+
+		return true;
+	}
+	else
+	{
+		NodeAddress *mostAdvandedStandbyNode = NULL;
+		uint64_t mostAdvandedLSN = 0;
+
+		for (int i = 0; i < keeper->otherNodes.count; i++)
+		{
+			NodeAddress *node = &(keeper->otherNodes.nodes[i]);
 
 			if (mostAdvandedStandbyNode == NULL ||
-				nodeLSN > mostAdvandedLSN)
+				node->lsn > mostAdvandedLSN)
 			{
 				mostAdvandedStandbyNode = node;
-				mostAdvandedLSN = nodeLSN;
+				mostAdvandedLSN = node->lsn;
 			}
 		}
 
@@ -16,6 +16,81 @@
 #include "monitor.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "system_utils.h"
+
+/*
+ * The phases of an iteration of the keeper main loop that we time.
+ */
+typedef enum
+{
+	KEEPER_LOOP_PHASE_LOAD_STATE = 0,
+	KEEPER_LOOP_PHASE_UPDATE_PG_STATE,
+	KEEPER_LOOP_PHASE_NODE_ACTIVE,
+	KEEPER_LOOP_PHASE_REFRESH_OTHER_NODES,
+	KEEPER_LOOP_PHASE_ENSURE_CURRENT_STATE,
+	KEEPER_LOOP_PHASE_FSM_TRANSITION,
+	KEEPER_LOOP_PHASE_STORE_STATE,
+	KEEPER_LOOP_PHASE_COUNT
+} KeeperLoopPhase;
+
+/*
+ * Durations are counted in buckets following a 1-2-5 series from 1ms to 50s,
+ * which keeps a constant relative precision over the whole range, and a last
+ * bucket for anything longer. The bucket counts are cumulative since the
+ * keeper started, and rates over a time window are computed by Prometheus.
+ */
+#define KEEPER_HISTOGRAM_BUCKETS 15
+
+typedef struct KeeperDurationHistogram
+{
+	uint64_t buckets[KEEPER_HISTOGRAM_BUCKETS + 1];
+	uint64_t count;
+	double sumMs;
+} KeeperDurationHistogram;
+
+/*
+ * The keeper counts and times what it does in its main loop, and exposes the
+ * result to the metrics service. Durations are in milliseconds.
+ */
+typedef struct KeeperMetrics
+{
+	uint64_t loopCount;
+	double loopDurationMs;          /* last iteration of the main loop */
+	double loopDurationSumMs;
+	KeeperDurationHistogram loopHistogram;
+
+	/* per-phase durations of the current iteration, and their histograms */
+	bool phaseDone[KEEPER_LOOP_PHASE_COUNT];
+	double phaseDurationMs[KEEPER_LOOP_PHASE_COUNT];
+	KeeperDurationHistogram phaseHistograms[KEEPER_LOOP_PHASE_COUNT];
+	uint64_t slowLoopCount;
+
+	uint64_t monitorCallCount;
+	uint64_t monitorCallFailures;
+	double monitorRoundTripMs;      /* last call to node_active */
+
+	uint64_t transitionCount;
+	uint64_t transitionFailures;
+	double transitionDurationMs;    /* last FSM transition */
+	NodeState transitionFromState;
+	NodeState transitionToState;
+} KeeperMetrics;
+
+
+/*
+ * The replication slots of the standby nodes that are not connected, and
+ * since when their restart_lsn hasn't moved, see
+ * keeper_check_replication_slots.
+ */
+#define KEEPER_INACTIVE_SLOTS_MAX 64
+
+typedef struct KeeperInactiveSlot
+{
+	int64_t nodeId;
+	char restartLSN[PG_LSN_MAXLENGTH];
+	uint64_t since;
+} KeeperInactiveSlot;
+
 
 /* the keeper manages a postgres server according to the given configuration */
 typedef struct Keeper
@@ -31,11 +106,120 @@ typedef struct Keeper
 	 */
 	NodeAddressArray otherNodes;
 
+	/* group version on the monitor and time when we last fetched otherNodes */
+	int64_t otherNodesGroupVersion;
+	uint64_t otherNodesRefreshTime;
+
+	/* group version and count when we last fetched our cascaded nodes */
+	int64_t cascadedNodesGroupVersion;
+	int cascadedNodesCount;
+
+	/* the other nodes and their LSN when we last maintained their slots */
+	NodeAddressArray slotsMaintainedNodes;
+	uint64_t slotsMaintainedTime;
+	pid_t slotsMaintainedPostgresPid;
+
+	/* what keeper_ensure_current_state last verified, see keeper_state_fingerprint */
+	uint64_t ensuredFingerprint;
+	uint64_t ensuredTime;
+
+	/* when we last reported pg_basebackup or pg_rewind progress */
+	uint64_t progressReportTime;
+
+	/* when and what we last reported about the replication of our standbys */
+	uint64_t replicationReportTime;
+	StandbyReplicationArrays replicationReport;
+
+	/* walsenders and SyncRep waiters seen at the previous keeper loop */
+	SyncRepStatus syncRepStatus;
+
+	/* the resources of our host, sampled at each report to the monitor */
+	uint64_t resourcesReportTime;
+	SystemUsage resourcesUsage;
+	uint64_t resourcesLSN;
+	NodeResources resources;
+
+	/* WAL retention of the replication slots of our standby nodes */
+	KeeperInactiveSlot inactiveSlots[KEEPER_INACTIVE_SLOTS_MAX];
+	int inactiveSlotsCount;
+	uint64_t slotWalWarningTime;
+
+	/* the max_slot_wal_keep_size value we last applied */
+	char maxSlotWalKeepSizeApplied[NAMEDATALEN];
+
+	/* when we last synchronized the logical slots from our upstream node */
+	uint64_t logicalSlotsSyncTime;
+	bool logicalSlotsVersionWarned;
+
+	/* HBA changes that we haven't written yet, see keeper_flush_hba_changes */
+	NodeAddressArray hbaPendingNodes;
+	uint64_t hbaPendingTime;
+
+	/* trace id of our current goal state, as assigned by the monitor */
+	char goalTraceId[TRACE_ID_HEX_LEN + 1];
+
+	/* main loop counters and timings, exposed to the metrics service */
+	KeeperMetrics metrics;
+
+	/* the configuration file as we last read it, see keeper_reload_configuration */
+	ConfigFileStamp configStamp;
+
+	/* when we last saved the buffer cache pre-warm block list */
+	uint64_t prewarmRefreshTime;
+	bool prewarmExtensionsCreated;
+
+	/* warming up after maintenance, see keeper_warm_up_after_maintenance */
+	bool warmupPending;
+	bool warmupStartLSNKnown;
+	uint64_t warmupStartLSN;
+
+	/* last reply_time of our standby nodes, see update_secondary_contact */
+	int64_t lastReplicaReplyTime;
+
+	/* whether we resumed the connection poolers since we became primary */
+	bool poolerResumed;
+
+	/* our primary lease on the monitor, see renew_primary_lease */
+	bool primaryLeaseHeld;
+	bool primaryLeaseFenced;
+	bool primaryLeaseChecked;
+	int primaryLeaseTimeoutMs;
+	instr_time primaryLeaseRenewTime;
+
+	/* the states of the nodes in our group, see keeper_node_active_sleep_time */
+	CurrentNodeStateArray groupStates;
+	bool groupStatesKnown;
+	uint64_t groupStatesChangeTime;
+
+	/* version of our group on the monitor, see monitor_poll_state_change */
+	int64_t groupStateVersion;
+
+	/* when a busy monitor asked us to wait, see keeper_node_active_sleep_time */
+	int nodeActiveRetryAfterMs;
+
+	/* the node-active process re-executes itself when pg_autoctl is upgraded */
+	bool reexecOnUpgrade;
+
 	/* Only useful during the initialization of the Keeper */
 	KeeperStateInit initState;
 } Keeper;
 
 
+/*
+ * When reloading the configuration, keeper_config_accept_new() registers which
+ * parts of the configuration have changed, so that we only reconfigure the
+ * affected subsystems. Settings that are only used from the in-memory
+ * configuration, such as the timeouts, don't need anything more than being
+ * accepted.
+ */
+#define KEEPER_CONFIG_CHANGED_NONE 0
+#define KEEPER_CONFIG_CHANGED_MONITOR (1 << 0)      /* pg_autoctl.monitor */
+#define KEEPER_CONFIG_CHANGED_METADATA (1 << 1)     /* name and hostname */
+#define KEEPER_CONFIG_CHANGED_POSTGRES (1 << 2)     /* Postgres settings, SSL */
+#define KEEPER_CONFIG_CHANGED_STANDBY (1 << 3)      /* standby settings */
+#define KEEPER_CONFIG_CHANGED_OTHER (1 << 4)        /* in-memory settings */
+
+
 typedef struct KeeperVersion
 {
 	char pg_autoctl_version[BUFSIZE];
@@ -57,12 +241,15 @@ bool keeper_should_ensure_current_state_before_transition(Keeper *keeper);
 bool keeper_ensure_postgres_is_running(Keeper *keeper, bool updateRetries);
 bool keeper_create_and_drop_replication_slots(Keeper *keeper);
 bool keeper_maintain_replication_slots(Keeper *keeper);
+bool keeper_check_timeline_with_upstream(Keeper *keeper);
 bool keeper_ensure_current_state(Keeper *keeper);
 bool keeper_create_self_signed_cert(Keeper *keeper);
 bool keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk);
 bool keeper_update_pg_state(Keeper *keeper, int logLevel);
 bool keeper_node_active(Keeper *keeper, bool doInit,
-						MonitorAssignedState *assignedState);
+						MonitorAssignedState *assignedState,
+						NodeAddressArray *otherNodes,
+						bool *otherNodesFetched);
 bool keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped);
 bool ReportPgIsRunning(Keeper *keeper);
 bool keeper_remove(Keeper *keeper, KeeperConfig *config);
@@ -70,11 +257,18 @@ bool keeper_check_monitor_extension_version(Keeper *keeper,
 											MonitorExtensionVersion *version);
 bool keeper_state_as_json(Keeper *keeper, char *json, int size);
 bool keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray);
+bool keeper_flush_hba_changes(Keeper *keeper, bool force);
 bool keeper_refresh_other_nodes(Keeper *keeper, bool forceCacheInvalidation);
+bool keeper_other_nodes_are_fresh(Keeper *keeper);
+bool keeper_other_nodes_are_usable(Keeper *keeper);
+bool keeper_set_other_nodes(Keeper *keeper,
+							NodeAddressArray *newNodesArray,
+							bool forceCacheInvalidation);
 
 bool keeper_set_node_metadata(Keeper *keeper, KeeperConfig *oldConfig);
 bool keeper_update_nodename_from_monitor(Keeper *keeper);
-bool keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig);
+bool keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig,
+							  int *changes);
 
 
 /*
@@ -111,9 +305,21 @@ bool keeper_call_refresh_hooks(Keeper *keeper,
 bool keeper_refresh_hba(Keeper *keeper,
 						NodeAddressArray *newNodesArray,
 						bool forceCacheInvalidation);
+bool keeper_refresh_pooler(Keeper *keeper,
+						   NodeAddressArray *newNodesArray,
+						   bool forceCacheInvalidation);
 
 bool keeper_read_nodes_from_file(Keeper *keeper, NodeAddressArray *nodesArray);
 bool keeper_get_primary(Keeper *keeper, NodeAddress *primaryNode);
+bool keeper_get_upstream(Keeper *keeper, NodeAddress *upstreamNode);
+bool keeper_ensure_upstream(Keeper *keeper);
+void keeper_report_progress(void *context, const char *operation,
+							uint64_t doneBytes, uint64_t totalBytes);
+bool keeper_refresh_prewarm_block_list(Keeper *keeper);
+bool keeper_sync_logical_slots(Keeper *keeper);
+bool keeper_report_replication(Keeper *keeper);
+bool keeper_report_resources(Keeper *keeper);
+bool keeper_prewarm_buffer_cache(Keeper *keeper);
 bool keeper_get_most_advanced_standby(Keeper *keeper, NodeAddress *primaryNode);
 
 
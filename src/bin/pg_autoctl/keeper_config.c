@@ -19,7 +19,12 @@
 #include "keeper_config.h"
 #include "log.h"
 #include "parsing.h"
+#include "pgclone.h"
 #include "pgctl.h"
+#include "pgtuning.h"
+#include "prewarm.h"
+#include "service_metrics.h"
+#include "walprefetch.h"
 
 #define OPTION_AUTOCTL_ROLE(config) \
 	make_strbuf_option_default("pg_autoctl", "role", NULL, true, NAMEDATALEN, \
@@ -29,6 +34,22 @@
 	make_strbuf_option("pg_autoctl", "monitor", "monitor", false, MAXCONNINFO, \
 					   config->monitor_pguri)
 
+#define OPTION_AUTOCTL_MONITOR_STANDBYS(config) \
+	make_strbuf_option("pg_autoctl", "monitor_standbys", NULL, false, \
+					   MAXCONNINFO, config->monitor_standbys_pguri)
+
+#define OPTION_AUTOCTL_MONITOR_STANDBY_MAX_LAG(config) \
+	make_int_option_default("pg_autoctl", "monitor_standby_max_lag", \
+							NULL, false, \
+							&(config->monitor_standby_max_lag), \
+							MONITOR_STANDBY_MAX_LAG)
+
+#define OPTION_AUTOCTL_MONITOR_NOTIFICATIONS(config) \
+	make_strbuf_option_default("pg_autoctl", "monitor_notifications", NULL, \
+							   false, NAMEDATALEN, \
+							   config->monitorNotifications, \
+							   DEFAULT_MONITOR_NOTIFICATIONS)
+
 #define OPTION_AUTOCTL_FORMATION(config) \
 	make_strbuf_option_default("pg_autoctl", "formation", "formation", \
 							   true, NAMEDATALEN, \
@@ -103,6 +124,12 @@
 	make_strbuf_option("postgresql", "hba_level", NULL, \
 					   false, MAXPGPATH, config->pgSetup.hbaLevelStr)
 
+#define OPTION_POSTGRESQL_TUNING_PROFILE(config) \
+	make_strbuf_option_default("postgresql", "tuning_profile", \
+							   "tuning-profile", false, NAMEDATALEN, \
+							   config->pgSetup.tuningProfile, \
+							   DEFAULT_TUNING_PROFILE)
+
 #define OPTION_SSL_ACTIVE(config) \
 	make_int_option_default("ssl", "active", NULL, \
 							false, &(config->pgSetup.ssl.active), 0)
@@ -139,16 +166,80 @@
 							   config->maximum_backup_rate, \
 							   MAXIMUM_BACKUP_RATE)
 
+#define OPTION_REPLICATION_MINIMUM_BACKUP_RATE(config) \
+	make_strbuf_option("replication", "minimum_backup_rate", NULL, \
+					   false, MAXIMUM_BACKUP_RATE_LEN, \
+					   config->minimum_backup_rate)
+
 #define OPTION_REPLICATION_BACKUP_DIR(config) \
 	make_strbuf_option("replication", "backup_directory", NULL, \
 					   false, MAXPGPATH, config->backupDirectory)
 
+#define OPTION_REPLICATION_CLONE_SOURCE(config) \
+	make_strbuf_option_default("replication", "clone_source", NULL, \
+							   false, NAMEDATALEN, \
+							   config->cloneSourceStr, DEFAULT_CLONE_SOURCE)
+
+#define OPTION_REPLICATION_BASEBACKUP_COMPRESS(config) \
+	make_strbuf_option("replication", "basebackup_compress", NULL, \
+					   false, NAMEDATALEN, config->basebackupCompress)
+
+#define OPTION_REPLICATION_BASEBACKUP_WAL_METHOD(config) \
+	make_strbuf_option_default("replication", "basebackup_wal_method", NULL, \
+							   false, NAMEDATALEN, \
+							   config->basebackupWalMethod, \
+							   DEFAULT_BASEBACKUP_WAL_METHOD)
+
+#define OPTION_REPLICATION_BASEBACKUP_MANIFEST_CHECKSUMS(config) \
+	make_strbuf_option("replication", "basebackup_manifest_checksums", NULL, \
+					   false, NAMEDATALEN, \
+					   config->basebackupManifestChecksums)
+
+#define OPTION_REPLICATION_RESTORE_COMMAND(config) \
+	make_strbuf_option("replication", "restore_command", NULL, \
+					   false, MAXCONNINFO, config->restoreCommand)
+
+#define OPTION_REPLICATION_WAL_PREFETCH(config) \
+	make_int_option_default("replication", "wal_prefetch", NULL, \
+							false, &(config->walPrefetch), \
+							DEFAULT_WAL_PREFETCH)
+
+#define OPTION_REPLICATION_PREWARM_WORKERS(config) \
+	make_int_option_default("replication", "prewarm_workers", NULL, \
+							false, &(config->prewarmWorkers), \
+							DEFAULT_PREWARM_WORKERS)
+
+#define OPTION_REPLICATION_CLONE_STREAMS(config) \
+	make_int_option_default("replication", "clone_streams", NULL, \
+							false, &(config->cloneStreams), \
+							DEFAULT_CLONE_STREAMS)
+
+#define OPTION_REPLICATION_MAX_SLOT_WAL_KEEP_SIZE(config) \
+	make_strbuf_option("replication", "max_slot_wal_keep_size", NULL, \
+					   false, NAMEDATALEN, config->maxSlotWalKeepSize)
+
+#define OPTION_REPLICATION_SLOT_WAL_WARNING_SIZE(config) \
+	make_int_option_default("replication", "slot_wal_warning_size", NULL, \
+							false, &(config->slotWalWarningSize), \
+							DEFAULT_SLOT_WAL_WARNING_SIZE)
+
+#define OPTION_REPLICATION_LOGICAL_SLOTS_FAILOVER(config) \
+	make_int_option_default("replication", "logical_slots_failover", NULL, \
+							false, &(config->logicalSlotsFailover), \
+							DEFAULT_LOGICAL_SLOTS_FAILOVER)
+
 #define OPTION_TIMEOUT_NETWORK_PARTITION(config) \
 	make_int_option_default("timeout", "network_partition_timeout", \
 							NULL, false, \
 							&(config->network_partition_timeout), \
 							NETWORK_PARTITION_TIMEOUT)
 
+#define OPTION_TIMEOUT_PRIMARY_LEASE(config) \
+	make_int_option_default("timeout", "primary_lease_timeout", \
+							NULL, false, \
+							&(config->primary_lease_timeout), \
+							DEFAULT_PRIMARY_LEASE_TIMEOUT)
+
 #define OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config) \
 	make_int_option_default("timeout", "prepare_promotion_catchup", \
 							NULL, \
@@ -163,6 +254,27 @@
 							&(config->prepare_promotion_walreceiver), \
 							PREPARE_PROMOTION_WALRECEIVER_TIMEOUT)
 
+#define OPTION_TIMEOUT_PREPARE_PROMOTION_PREWARM(config) \
+	make_int_option_default("timeout", "prepare_promotion_prewarm", \
+							NULL, \
+							false, \
+							&(config->prepare_promotion_prewarm), \
+							PREPARE_PROMOTION_PREWARM_TIMEOUT)
+
+#define OPTION_TIMEOUT_PREPARE_DEMOTION(config) \
+	make_int_option_default("timeout", "prepare_demotion", \
+							NULL, \
+							false, \
+							&(config->prepare_demotion), \
+							PREPARE_DEMOTION_TIMEOUT)
+
+#define OPTION_TIMEOUT_DRAIN_SESSIONS(config) \
+	make_int_option_default("timeout", "drain_sessions", \
+							NULL, \
+							false, \
+							&(config->drain_sessions), \
+							DRAIN_SESSIONS_TIMEOUT)
+
 #define OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_TIMEOUT(config) \
 	make_int_option_default("timeout", "postgresql_restart_failure_timeout", \
 							NULL, \
@@ -177,12 +289,64 @@
 							&(config->postgresql_restart_failure_max_retries), \
 							POSTGRESQL_FAILS_TO_START_RETRIES)
 
+#define OPTION_TIMEOUT_POSTGRESQL_CRASH_RECOVERY_TIMEOUT(config) \
+	make_int_option_default("timeout", "postgresql_crash_recovery_timeout", \
+							NULL, \
+							false, \
+							&(config->postgresql_crash_recovery_timeout), \
+							POSTGRESQL_CRASH_RECOVERY_TIMEOUT)
+
+#define OPTION_TIMEOUT_INACTIVE_SLOT_DROP(config) \
+	make_int_option_default("timeout", "inactive_slot_drop_timeout", \
+							NULL, \
+							false, \
+							&(config->inactive_slot_drop_timeout), \
+							DEFAULT_INACTIVE_SLOT_DROP_TIMEOUT)
+
 #define OPTION_TIMEOUT_LISTEN_NOTIFICATIONS(config) \
 	make_int_option_default("timeout", "listen_notifications_timeout", \
 							NULL, false, \
 							&(config->listen_notifications_timeout), \
 							PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT)
 
+#define OPTION_TIMEOUT_SLOW_LOOP_THRESHOLD(config) \
+	make_int_option_default("timeout", "slow_loop_threshold", \
+							NULL, false, \
+							&(config->slow_loop_threshold), \
+							KEEPER_SLOW_LOOP_THRESHOLD)
+
+#define OPTION_SERVICE_NICE(config) \
+	make_int_option_default("service", "nice", NULL, false, \
+							&(config->serviceNice), 0)
+
+#define OPTION_SERVICE_CPUS(config) \
+	make_strbuf_option("service", "cpus", NULL, \
+					   false, NAMEDATALEN, config->serviceCpus)
+
+#define OPTION_SERVICE_LOCK_MEMORY(config) \
+	make_int_option_default("service", "lock_memory", NULL, false, \
+							&(config->serviceLockMemory), 0)
+
+#define OPTION_SERVICE_CGROUP(config) \
+	make_strbuf_option("service", "cgroup", NULL, \
+					   false, MAXPGPATH, config->serviceCgroup)
+
+#define OPTION_METRICS_LISTEN(config) \
+	make_strbuf_option("metrics", "listen", NULL, \
+					   false, MAXPGPATH, config->metricsListen)
+
+#define OPTION_TRACING_OTLP_FILE(config) \
+	make_strbuf_option("tracing", "otlp_file", NULL, \
+					   false, MAXPGPATH, config->tracingOtlpFile)
+
+#define OPTION_POOLER_ADMIN_ENDPOINTS(config) \
+	make_strbuf_option("pooler", "admin_endpoints", NULL, \
+					   false, MAXCONNINFO, config->poolerAdminEndpoints)
+
+#define OPTION_POOLER_DATABASE(config) \
+	make_strbuf_option("pooler", "database", NULL, \
+					   false, NAMEDATALEN, config->poolerDatabase)
+
 #define OPTION_CITUS_ROLE(config) \
 	make_strbuf_option_default("citus", "role", NULL, false, NAMEDATALEN, \
 							   config->citusRoleStr, DEFAULT_CITUS_ROLE)
@@ -196,6 +360,9 @@
 	{ \
 		OPTION_AUTOCTL_ROLE(config), \
 		OPTION_AUTOCTL_MONITOR(config), \
+		OPTION_AUTOCTL_MONITOR_STANDBYS(config), \
+		OPTION_AUTOCTL_MONITOR_STANDBY_MAX_LAG(config), \
+		OPTION_AUTOCTL_MONITOR_NOTIFICATIONS(config), \
 		OPTION_AUTOCTL_FORMATION(config), \
 		OPTION_AUTOCTL_GROUPID(config), \
 		OPTION_AUTOCTL_NAME(config), \
@@ -212,6 +379,7 @@
 		OPTION_POSTGRESQL_LISTEN_ADDRESSES(config), \
 		OPTION_POSTGRESQL_AUTH_METHOD(config), \
 		OPTION_POSTGRESQL_HBA_LEVEL(config), \
+		OPTION_POSTGRESQL_TUNING_PROFILE(config), \
 		OPTION_SSL_ACTIVE(config), \
 		OPTION_SSL_MODE(config), \
 		OPTION_SSL_CA_FILE(config), \
@@ -219,14 +387,41 @@
 		OPTION_SSL_SERVER_CERT(config), \
 		OPTION_SSL_SERVER_KEY(config), \
 		OPTION_REPLICATION_MAXIMUM_BACKUP_RATE(config), \
+		OPTION_REPLICATION_MINIMUM_BACKUP_RATE(config), \
 		OPTION_REPLICATION_BACKUP_DIR(config), \
+		OPTION_REPLICATION_CLONE_SOURCE(config), \
+		OPTION_REPLICATION_BASEBACKUP_COMPRESS(config), \
+		OPTION_REPLICATION_BASEBACKUP_WAL_METHOD(config), \
+		OPTION_REPLICATION_BASEBACKUP_MANIFEST_CHECKSUMS(config), \
+		OPTION_REPLICATION_RESTORE_COMMAND(config), \
+		OPTION_REPLICATION_WAL_PREFETCH(config), \
+		OPTION_REPLICATION_PREWARM_WORKERS(config), \
+		OPTION_REPLICATION_CLONE_STREAMS(config), \
+		OPTION_REPLICATION_MAX_SLOT_WAL_KEEP_SIZE(config), \
+		OPTION_REPLICATION_SLOT_WAL_WARNING_SIZE(config), \
+		OPTION_REPLICATION_LOGICAL_SLOTS_FAILOVER(config), \
 		OPTION_REPLICATION_PASSWORD(config), \
 		OPTION_TIMEOUT_NETWORK_PARTITION(config), \
+		OPTION_TIMEOUT_PRIMARY_LEASE(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_WALRECEIVER(config), \
+		OPTION_TIMEOUT_PREPARE_PROMOTION_PREWARM(config), \
+		OPTION_TIMEOUT_PREPARE_DEMOTION(config), \
+		OPTION_TIMEOUT_DRAIN_SESSIONS(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_TIMEOUT(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_MAX_RETRIES(config), \
+		OPTION_TIMEOUT_POSTGRESQL_CRASH_RECOVERY_TIMEOUT(config), \
+		OPTION_TIMEOUT_INACTIVE_SLOT_DROP(config), \
 		OPTION_TIMEOUT_LISTEN_NOTIFICATIONS(config), \
+		OPTION_TIMEOUT_SLOW_LOOP_THRESHOLD(config), \
+		OPTION_SERVICE_NICE(config), \
+		OPTION_SERVICE_CPUS(config), \
+		OPTION_SERVICE_LOCK_MEMORY(config), \
+		OPTION_SERVICE_CGROUP(config), \
+		OPTION_METRICS_LISTEN(config), \
+		OPTION_TRACING_OTLP_FILE(config), \
+		OPTION_POOLER_ADMIN_ENDPOINTS(config), \
+		OPTION_POOLER_DATABASE(config), \
  \
 		OPTION_CITUS_ROLE(config), \
 		OPTION_CITUS_CLUSTER_NAME(config), \
@@ -234,6 +429,10 @@
 	}
 
 static bool keeper_config_init_nodekind(KeeperConfig *config);
+static bool keeper_config_init_clone_source(KeeperConfig *config);
+static bool keeper_config_init_monitor_notifications(KeeperConfig *config);
+static bool keeper_config_init_tuning_profile(KeeperConfig *config);
+static bool keeper_config_init_metrics(KeeperConfig *config);
 static bool keeper_config_init_hbalevel(KeeperConfig *config);
 static bool keeper_config_set_backup_directory(KeeperConfig *config,
 											   int64_t nodeId);
@@ -319,6 +518,34 @@ keeper_config_init(KeeperConfig *config,
 		exit(EXIT_CODE_BAD_CONFIG);
 	}
 
+	if (!keeper_config_init_clone_source(config))
+	{
+		/* errors have already been logged. */
+		log_error("Please review your setup options per above messages");
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (!keeper_config_init_monitor_notifications(config))
+	{
+		/* errors have already been logged. */
+		log_error("Please review your setup options per above messages");
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (!keeper_config_init_tuning_profile(config))
+	{
+		/* errors have already been logged. */
+		log_error("Please review your setup options per above messages");
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	if (!keeper_config_init_metrics(config))
+	{
+		/* errors have already been logged. */
+		log_error("Please review your setup options per above messages");
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
 	if (!pg_setup_init(&pgSetup,
 					   &(config->pgSetup),
 					   missingPgdataIsOk,
@@ -381,6 +608,22 @@ keeper_config_read_file(KeeperConfig *config,
 }
 
 
+/*
+ * keeper_config_parse_buffer overrides values in given KeeperConfig with the
+ * values found in the given configuration file contents, which are then
+ * free'd, as in parse_ini_buffer.
+ */
+bool
+keeper_config_parse_buffer(KeeperConfig *config,
+						   const char *filename,
+						   char *fileContents)
+{
+	IniOption keeperOptions[] = SET_INI_OPTIONS_ARRAY(config);
+
+	return parse_ini_buffer(filename, fileContents, keeperOptions);
+}
+
+
 /*
  * keeper_config_read_file_skip_pgsetup overrides values in given KeeperConfig
  * with whatever values are read from given configuration filename.
@@ -487,6 +730,30 @@ keeper_config_read_file_skip_pgsetup(KeeperConfig *config,
 		return false;
 	}
 
+	if (!keeper_config_init_clone_source(config))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	if (!keeper_config_init_monitor_notifications(config))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	if (!keeper_config_init_tuning_profile(config))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	if (!keeper_config_init_metrics(config))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
 	return true;
 }
 
@@ -587,6 +854,11 @@ void
 keeper_config_log_settings(KeeperConfig config)
 {
 	log_debug("pg_autoctl.monitor: %s", config.monitor_pguri);
+	log_debug("pg_autoctl.monitor_standbys: %s", config.monitor_standbys_pguri);
+	log_debug("pg_autoctl.monitor_standby_max_lag: %d",
+			  config.monitor_standby_max_lag);
+	log_debug("pg_autoctl.monitor_notifications: %s",
+			  config.monitorNotifications);
 	log_debug("pg_autoctl.formation: %s", config.formation);
 
 	log_debug("postgresql.hostname: %s", config.hostname);
@@ -603,6 +875,22 @@ keeper_config_log_settings(KeeperConfig config)
 			  config.replication_password);
 	log_debug("replication.maximum_backup_rate: %s",
 			  config.maximum_backup_rate);
+	log_debug("replication.minimum_backup_rate: %s",
+			  config.minimum_backup_rate);
+	log_debug("replication.restore_command: %s", config.restoreCommand);
+	log_debug("replication.wal_prefetch: %d", config.walPrefetch);
+	log_debug("replication.prewarm_workers: %d", config.prewarmWorkers);
+	log_debug("replication.clone_streams: %d", config.cloneStreams);
+	log_debug("replication.clone_source: %s",
+			  config.cloneSourceStr);
+	log_debug("replication.basebackup_compress: %s",
+			  config.basebackupCompress);
+	log_debug("replication.basebackup_wal_method: %s",
+			  config.basebackupWalMethod);
+	log_debug("replication.basebackup_manifest_checksums: %s",
+			  config.basebackupManifestChecksums);
+	log_debug("metrics.listen: %s", config.metricsListen);
+	log_debug("tracing.otlp_file: %s", config.tracingOtlpFile);
 }
 
 
@@ -778,6 +1066,218 @@ keeper_config_init_nodekind(KeeperConfig *config)
 }
 
 
+/*
+ * keeper_config_init_tuning_profile checks the postgresql.tuning_profile
+ * setting, used when computing the Postgres tuning for the local system.
+ */
+static bool
+keeper_config_init_tuning_profile(KeeperConfig *config)
+{
+	if (IS_EMPTY_STRING_BUFFER(config->pgSetup.tuningProfile))
+	{
+		strlcpy(config->pgSetup.tuningProfile,
+				DEFAULT_TUNING_PROFILE,
+				NAMEDATALEN);
+	}
+
+	PgTuningProfile profile =
+		pgtuning_parse_profile(config->pgSetup.tuningProfile);
+
+	/* the monitor profile only makes sense for the monitor's own Postgres */
+	if (profile == PG_TUNING_PROFILE_UNKNOWN ||
+		profile == PG_TUNING_PROFILE_MONITOR)
+	{
+		log_error("Failed to parse postgresql.tuning_profile \"%s\": "
+				  "expected one of \"oltp\", \"mixed\", \"analytics\", "
+				  "or \"write-heavy\"",
+				  config->pgSetup.tuningProfile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_config_init_monitor_notifications checks the
+ * pg_autoctl.monitor_notifications setting: the keeper either LISTENs to the
+ * monitor notifications, or long-polls the monitor with short transactions,
+ * which works through a connection pooler in transaction pooling mode.
+ */
+static bool
+keeper_config_init_monitor_notifications(KeeperConfig *config)
+{
+	if (IS_EMPTY_STRING_BUFFER(config->monitorNotifications))
+	{
+		strlcpy(config->monitorNotifications,
+				DEFAULT_MONITOR_NOTIFICATIONS,
+				NAMEDATALEN);
+	}
+
+	if (strcmp(config->monitorNotifications,
+			   MONITOR_NOTIFICATIONS_LISTEN) != 0 &&
+		strcmp(config->monitorNotifications,
+			   MONITOR_NOTIFICATIONS_POLL) != 0)
+	{
+		log_error("Failed to parse pg_autoctl.monitor_notifications \"%s\": "
+				  "expected either \"%s\" or \"%s\"",
+				  config->monitorNotifications,
+				  MONITOR_NOTIFICATIONS_LISTEN,
+				  MONITOR_NOTIFICATIONS_POLL);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_config_init_clone_source initializes the config->cloneSource enum
+ * value from the replication.clone_source configuration string, and checks
+ * the other settings used when running pg_basebackup.
+ */
+static bool
+keeper_config_init_clone_source(KeeperConfig *config)
+{
+	if (IS_EMPTY_STRING_BUFFER(config->cloneSourceStr))
+	{
+		strlcpy(config->cloneSourceStr, DEFAULT_CLONE_SOURCE, NAMEDATALEN);
+	}
+
+	if (strcmp(config->cloneSourceStr, "primary") == 0)
+	{
+		config->cloneSource = CLONE_SOURCE_PRIMARY;
+	}
+	else if (strcmp(config->cloneSourceStr, "standby") == 0)
+	{
+		config->cloneSource = CLONE_SOURCE_STANDBY;
+	}
+	else
+	{
+		log_error("Failed to parse replication.clone_source \"%s\": "
+				  "expected either \"primary\" or \"standby\"",
+				  config->cloneSourceStr);
+		return false;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(config->basebackupWalMethod))
+	{
+		strlcpy(config->basebackupWalMethod,
+				DEFAULT_BASEBACKUP_WAL_METHOD,
+				NAMEDATALEN);
+	}
+
+	if (strcmp(config->basebackupWalMethod, "stream") != 0 &&
+		strcmp(config->basebackupWalMethod, "fetch") != 0)
+	{
+		log_error("Failed to parse replication.basebackup_wal_method \"%s\": "
+				  "expected either \"stream\" or \"fetch\"",
+				  config->basebackupWalMethod);
+		return false;
+	}
+
+	if (config->walPrefetch < 0 || config->walPrefetch > WAL_PREFETCH_MAX)
+	{
+		log_error("Failed to validate replication.wal_prefetch %d: "
+				  "expected a number of WAL segments between 0 and %d",
+				  config->walPrefetch, WAL_PREFETCH_MAX);
+		return false;
+	}
+
+	if (config->prewarmWorkers < 0 ||
+		config->prewarmWorkers > PREWARM_WORKERS_MAX)
+	{
+		log_error("Failed to validate replication.prewarm_workers %d: "
+				  "expected a number of workers between 0 and %d",
+				  config->prewarmWorkers, PREWARM_WORKERS_MAX);
+		return false;
+	}
+
+	if (config->cloneStreams < 1 ||
+		config->cloneStreams > PGCLONE_STREAMS_MAX)
+	{
+		log_error("Failed to validate replication.clone_streams %d: "
+				  "expected a number of streams between 1 and %d",
+				  config->cloneStreams, PGCLONE_STREAMS_MAX);
+		return false;
+	}
+
+	if (config->slotWalWarningSize < 0)
+	{
+		log_error("Failed to validate replication.slot_wal_warning_size %d: "
+				  "expected a size in MB, or zero to disable the warning",
+				  config->slotWalWarningSize);
+		return false;
+	}
+
+	if (config->logicalSlotsFailover != 0 && config->logicalSlotsFailover != 1)
+	{
+		log_error("Failed to validate replication.logical_slots_failover %d: "
+				  "expected 0 or 1",
+				  config->logicalSlotsFailover);
+		return false;
+	}
+
+	/* the value is sent quoted to ALTER SYSTEM, such as '10GB' or '-1' */
+	if (strspn(config->maxSlotWalKeepSize,
+			   "0123456789-abcdefghijklmnopqrstuvwxyz"
+			   "ABCDEFGHIJKLMNOPQRSTUVWXYZ ") !=
+		strlen(config->maxSlotWalKeepSize))
+	{
+		log_error("Failed to validate replication.max_slot_wal_keep_size "
+				  "\"%s\": expected a size such as 10GB, or -1",
+				  config->maxSlotWalKeepSize);
+		return false;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(config->minimum_backup_rate))
+	{
+		int64_t minimumRate = 0;
+		int64_t maximumRate = 0;
+
+		if (!parse_backup_rate(config->minimum_backup_rate, &minimumRate))
+		{
+			log_error("Failed to parse replication.minimum_backup_rate \"%s\": "
+					  "expected a rate in kB/s such as \"32k\" or \"10M\"",
+					  config->minimum_backup_rate);
+			return false;
+		}
+
+		if (parse_backup_rate(config->maximum_backup_rate, &maximumRate) &&
+			minimumRate > maximumRate)
+		{
+			log_error("Failed to validate replication.minimum_backup_rate "
+					  "\"%s\": it must not be higher than "
+					  "replication.maximum_backup_rate \"%s\"",
+					  config->minimum_backup_rate,
+					  config->maximum_backup_rate);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_config_init_metrics checks the metrics.listen setting, so that a
+ * typo there fails pg_autoctl run early rather than having the supervisor
+ * restart the metrics service until it gives up.
+ */
+static bool
+keeper_config_init_metrics(KeeperConfig *config)
+{
+	MetricsListenAddress address = { 0 };
+
+	if (IS_EMPTY_STRING_BUFFER(config->metricsListen))
+	{
+		return true;
+	}
+
+	return service_metrics_parse_listen(config->metricsListen, &address);
+}
+
+
 /*
  * keeper_config_init_hbalevel initializes the config->pgSetup.hbaLevel and
  * hbaLevelStr when no command line option switch has been used that places a
@@ -852,10 +1352,25 @@ keeper_config_set_backup_directory(KeeperConfig *config, int64_t nodeId)
 
 	/*
 	 * The best way to make sure we are allowed to create the backup directory
-	 * is to just go ahead and create it now.
+	 * is to just go ahead and create it now. We keep the contents of a clone
+	 * that has been interrupted though, see pgclone.c.
 	 */
 	log_debug("mkdir -p \"%s\"", config->backupDirectory);
-	if (!ensure_empty_dir(config->backupDirectory, 0700))
+
+	if (pgclone_exists(config->backupDirectory))
+	{
+		char backupDirectoryCopy[MAXPGPATH] = { 0 };
+
+		strlcpy(backupDirectoryCopy, config->backupDirectory, MAXPGPATH);
+
+		if (pg_mkdir_p(backupDirectoryCopy, 0700) == -1)
+		{
+			log_fatal("Failed to create the backup directory \"%s\": %m",
+					  config->backupDirectory);
+			return false;
+		}
+	}
+	else if (!ensure_empty_dir(config->backupDirectory, 0700))
 	{
 		log_fatal("Failed to create the backup directory \"%s\", "
 				  "see above for details", config->backupDirectory);
@@ -29,6 +29,17 @@ typedef enum
 	CITUS_ROLE_SECONDARY
 } CitusRole;
 
+/*
+ * When building a new standby node with pg_basebackup, we can copy the data
+ * files either from the primary node or from a secondary node.
+ */
+typedef enum
+{
+	CLONE_SOURCE_UNKNOWN = 0,
+	CLONE_SOURCE_PRIMARY,
+	CLONE_SOURCE_STANDBY
+} CloneSource;
+
 
 typedef struct KeeperConfig
 {
@@ -41,6 +52,9 @@ typedef struct KeeperConfig
 	/* pg_autoctl setup */
 	char role[NAMEDATALEN];
 	char monitor_pguri[MAXCONNINFO];
+	char monitor_standbys_pguri[MAXCONNINFO];
+	int monitor_standby_max_lag;    /* milliseconds */
+	char monitorNotifications[NAMEDATALEN];
 	char formation[NAMEDATALEN];
 	int groupId;
 	char name[_POSIX_HOST_NAME_MAX];
@@ -54,7 +68,20 @@ typedef struct KeeperConfig
 	char replication_slot_name[MAXCONNINFO];
 	char replication_password[MAXCONNINFO];
 	char maximum_backup_rate[MAXIMUM_BACKUP_RATE_LEN];
+	char minimum_backup_rate[MAXIMUM_BACKUP_RATE_LEN];
 	char backupDirectory[MAXPGPATH];
+	char cloneSourceStr[NAMEDATALEN];
+	CloneSource cloneSource;
+	char basebackupCompress[NAMEDATALEN];
+	char basebackupWalMethod[NAMEDATALEN];
+	char basebackupManifestChecksums[NAMEDATALEN];
+	char restoreCommand[MAXCONNINFO];
+	int walPrefetch;
+	int prewarmWorkers;
+	int cloneStreams;
+	char maxSlotWalKeepSize[NAMEDATALEN];
+	int slotWalWarningSize;     /* MB */
+	int logicalSlotsFailover;
 
 	/* Citus specific options and settings */
 	char citusRoleStr[NAMEDATALEN];
@@ -62,16 +89,42 @@ typedef struct KeeperConfig
 
 	/* pg_autoctl timeouts */
 	int network_partition_timeout;
+	int primary_lease_timeout;
 	int prepare_promotion_catchup;
 	int prepare_promotion_walreceiver;
+	int prepare_promotion_prewarm;
+	int prepare_demotion;
+	int drain_sessions;
 	int postgresql_restart_failure_timeout;
 	int postgresql_restart_failure_max_retries;
+	int postgresql_crash_recovery_timeout;
+	int inactive_slot_drop_timeout;
 	int listen_notifications_timeout;
+	int slow_loop_threshold;    /* milliseconds */
+
+	/* isolation of the node-active process from the load of the host */
+	int serviceNice;
+	char serviceCpus[NAMEDATALEN];
+	int serviceLockMemory;
+	char serviceCgroup[MAXPGPATH];
+
+	/* where to serve the keeper metrics from, empty when disabled */
+	char metricsListen[MAXPGPATH];
+
+	/* where to export the FSM transitions trace spans, empty when disabled */
+	char tracingOtlpFile[MAXPGPATH];
+
+	/* connection poolers admin consoles, paused during switchovers */
+	char poolerAdminEndpoints[MAXCONNINFO];
+	char poolerDatabase[NAMEDATALEN];
 } KeeperConfig;
 
 #define PG_AUTOCTL_MONITOR_IS_DISABLED(config) \
 	(strcmp(config->monitor_pguri, PG_AUTOCTL_MONITOR_DISABLED) == 0)
 
+#define PG_AUTOCTL_MONITOR_LONG_POLL(config) \
+	(strcmp(config->monitorNotifications, MONITOR_NOTIFICATIONS_POLL) == 0)
+
 bool keeper_config_set_pathnames_from_pgdata(ConfigFilePaths *pathnames,
 											 const char *pgdata);
 
@@ -82,6 +135,9 @@ bool keeper_config_read_file(KeeperConfig *config,
 							 bool missingPgdataIsOk,
 							 bool pgIsNotRunningIsOk,
 							 bool monitorDisabledIsOk);
+bool keeper_config_parse_buffer(KeeperConfig *config,
+								const char *filename,
+								char *fileContents);
 bool keeper_config_read_file_skip_pgsetup(KeeperConfig *config,
 										  bool monitorDisabledIsOk);
 bool keeper_config_pgsetup_init(KeeperConfig *config,
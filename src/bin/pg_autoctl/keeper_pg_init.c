@@ -29,6 +29,7 @@
 #include "service_keeper_init.h"
 #include "signals.h"
 #include "state.h"
+#include "trace.h"
 
 
 /*
@@ -53,6 +54,7 @@ static bool wait_until_primary_has_created_our_replication_slot(Keeper *keeper,
 																MonitorAssignedState *
 																assignedState);
 static bool keeper_pg_init_node_active(Keeper *keeper);
+static bool keeper_pg_init_register(Keeper *keeper, NodeState initialState);
 
 /*
  * keeper_pg_init initializes a pg_autoctl keeper and its local PostgreSQL.
@@ -223,7 +225,7 @@ keeper_pg_init_and_register(Keeper *keeper)
 	 */
 	if (!postgresInstanceExists)
 	{
-		if (!keeper_register_and_init(keeper, INIT_STATE))
+		if (!keeper_pg_init_register(keeper, INIT_STATE))
 		{
 			log_error("Failed to register the existing local Postgres node "
 					  "\"%s:%d\" running at \"%s\""
@@ -293,7 +295,7 @@ keeper_pg_init_and_register(Keeper *keeper)
 				 pgSetup->control.system_identifier,
 				 pgSetup->pgdata);
 
-		if (!keeper_register_and_init(keeper, INIT_STATE))
+		if (!keeper_pg_init_register(keeper, INIT_STATE))
 		{
 			log_error("Failed to register the existing local Postgres node "
 					  "\"%s:%d\" running at \"%s\""
@@ -344,7 +346,7 @@ keeper_pg_init_and_register_primary(Keeper *keeper)
 			 realpath(pgSetup->pgdata, absolutePgdata));
 
 	/* register to the monitor in the expected state directly */
-	if (!keeper_register_and_init(keeper, SINGLE_STATE))
+	if (!keeper_pg_init_register(keeper, SINGLE_STATE))
 	{
 		log_error("Failed to register the existing local Postgres node "
 				  "\"%s:%d\" running at \"%s\""
@@ -501,9 +503,14 @@ reach_initial_state(Keeper *keeper)
 			 * the primary has updated its HBA setup with our hostname.
 			 */
 			MonitorAssignedState assignedState = { 0 };
+			TraceSpan span = { 0 };
 
 			/* busy loop until we are asked to be in CATCHINGUP_STATE */
-			if (!wait_until_primary_is_ready(keeper, &assignedState))
+			trace_span_start(&span, "wait until the primary is ready", NULL);
+			bool ready = wait_until_primary_is_ready(keeper, &assignedState);
+			trace_span_end(&span, ready);
+
+			if (!ready)
 			{
 				/* the node might have been dropped early */
 				return exit_if_dropped(keeper);
@@ -577,7 +584,13 @@ reach_initial_state(Keeper *keeper)
 	 * The initialization is done, publish the new current state to the
 	 * monitor.
 	 */
-	if (!keeper_pg_init_node_active(keeper))
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "report the initial state", NULL);
+	bool reported = keeper_pg_init_node_active(keeper);
+	trace_span_end(&span, reported);
+
+	if (!reported)
 	{
 		/* errors have been logged already */
 		return false;
@@ -678,6 +691,9 @@ wait_until_primary_is_ready(Keeper *keeper,
 								 currentTLI,
 								 currrentLSN,
 								 pgsrSyncState,
+								 0,
+								 "0/0",
+								 0,
 								 assignedState))
 		{
 			++errors;
@@ -731,9 +747,31 @@ wait_until_primary_is_ready(Keeper *keeper,
 		return false;
 	}
 
+	/*
+	 * When streaming the WAL, pg_basebackup starts with a temporary slot if
+	 * the primary has not created our replication slot yet, see
+	 * standby_init_database. With --wal-method=fetch, our slot is what keeps
+	 * the WAL around on the primary during the base backup.
+	 */
+	KeeperConfig *config = &(keeper->config);
+
+	if (IS_EMPTY_STRING_BUFFER(config->basebackupWalMethod) ||
+		strcmp(config->basebackupWalMethod, "stream") == 0)
+	{
+		return true;
+	}
+
 	/* Now make sure the replication slot has been created on the primary */
-	return wait_until_primary_has_created_our_replication_slot(keeper,
-															   assignedState);
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "wait until the primary has created our slot",
+					 NULL);
+	bool created =
+		wait_until_primary_has_created_our_replication_slot(keeper,
+															assignedState);
+	trace_span_end(&span, created);
+
+	return created;
 }
 
 
@@ -1186,6 +1224,9 @@ keeper_pg_init_node_active(Keeper *keeper)
 							 keeper->postgres.postgresSetup.control.timeline_id,
 							 keeper->postgres.currentLSN,
 							 keeper->postgres.pgsrSyncState,
+							 0,
+							 keeper->postgres.replayLSN,
+							 keeper->postgres.applyRate,
 							 &assignedState))
 	{
 		log_error("Failed to contact the monitor to publish our "
@@ -1220,3 +1261,23 @@ keeper_pg_init_node_active(Keeper *keeper)
 
 	return true;
 }
+
+
+/*
+ * keeper_pg_init_register registers the local node to the monitor, timing
+ * the registration: the monitor only registers one standby at a time in a
+ * given group, so we might have to wait for our turn.
+ */
+static bool
+keeper_pg_init_register(Keeper *keeper, NodeState initialState)
+{
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "register to the monitor", NULL);
+
+	bool registered = keeper_register_and_init(keeper, initialState);
+
+	trace_span_end(&span, registered);
+
+	return registered;
+}
@@ -7,9 +7,13 @@
  *
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
@@ -36,6 +40,19 @@ union semun
 };
 #endif
 
+#ifdef HAVE_SHARED_MUTEX
+
+/* a shared mutex file descriptor must have all those seals */
+#define SHARED_MUTEX_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static bool shared_mutex_create(Semaphore *semaphore);
+static bool shared_mutex_open(Semaphore *semaphore);
+static bool shared_mutex_map(Semaphore *semaphore);
+static bool shared_mutex_lock(Semaphore *semaphore);
+static bool shared_mutex_unlock(Semaphore *semaphore);
+#endif
+
+
 /*
  * semaphore_init creates or opens a named semaphore for the current process.
  *
@@ -47,12 +64,34 @@ union semun
 bool
 semaphore_init(Semaphore *semaphore)
 {
+#ifdef HAVE_SHARED_MUTEX
+	semaphore->mutex = NULL;
+
+	/*
+	 * When our parent process uses a shared mutex and we fail to map it, we
+	 * create our own lock rather than fail: only the interleaving of our log
+	 * lines is at stake.
+	 */
+	if (env_exists(PG_AUTOCTL_LOG_MUTEX) && shared_mutex_open(semaphore))
+	{
+		return true;
+	}
+#endif
+
 	if (env_exists(PG_AUTOCTL_LOG_SEMAPHORE))
 	{
 		return semaphore_open(semaphore);
 	}
 	else
 	{
+#ifdef HAVE_SHARED_MUTEX
+		if (shared_mutex_create(semaphore))
+		{
+			(void) semaphore_setenv(semaphore);
+			return true;
+		}
+#endif
+
 		bool success = semaphore_create(semaphore);
 
 		/*
@@ -85,9 +124,7 @@ semaphore_init(Semaphore *semaphore)
 		 */
 		if (success)
 		{
-			IntString semIdString = intToString(semaphore->semId);
-
-			setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+			(void) semaphore_setenv(semaphore);
 		}
 
 		return success;
@@ -95,6 +132,33 @@ semaphore_init(Semaphore *semaphore)
 }
 
 
+/*
+ * semaphore_setenv publishes our semaphore in the environment, so that our
+ * sub-processes use the same one.
+ */
+void
+semaphore_setenv(Semaphore *semaphore)
+{
+#ifdef HAVE_SHARED_MUTEX
+	if (semaphore->mutex != NULL)
+	{
+		IntString mutexFdString = intToString(semaphore->mutexFd);
+
+		setenv(PG_AUTOCTL_LOG_MUTEX, mutexFdString.strValue, 1);
+		unsetenv(PG_AUTOCTL_LOG_SEMAPHORE);
+
+		return;
+	}
+
+	unsetenv(PG_AUTOCTL_LOG_MUTEX);
+#endif
+
+	IntString semIdString = intToString(semaphore->semId);
+
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+}
+
+
 /*
  * semaphore_finish closes or unlinks given semaphore.
  */
@@ -198,6 +262,20 @@ semaphore_unlink(Semaphore *semaphore)
 {
 	union semun semun;
 
+#ifdef HAVE_SHARED_MUTEX
+
+	/* the kernel releases the memfd once every process has closed it */
+	if (semaphore->mutex != NULL)
+	{
+		(void) munmap(semaphore->mutex, sizeof(pthread_mutex_t));
+		(void) close(semaphore->mutexFd);
+
+		semaphore->mutex = NULL;
+
+		return true;
+	}
+#endif
+
 	semun.val = 0;              /* unused, but keep compiler quiet */
 
 	log_trace("ipcrm -s %d\n", semaphore->semId);
@@ -258,6 +336,16 @@ semaphore_cleanup(const char *pidfile)
 
 	free(fileContents);
 
+	/* a shared mutex leaves nothing behind */
+	if (semaphore.semId < 0)
+	{
+		return true;
+	}
+
+#ifdef HAVE_SHARED_MUTEX
+	semaphore.mutex = NULL;
+#endif
+
 	log_trace("Read semaphore id %d from stale pidfile", semaphore.semId);
 
 	return semaphore_unlink(&semaphore);
@@ -274,6 +362,13 @@ semaphore_lock(Semaphore *semaphore)
 	int errStatus;
 	struct sembuf sops;
 
+#ifdef HAVE_SHARED_MUTEX
+	if (semaphore->mutex != NULL)
+	{
+		return shared_mutex_lock(semaphore);
+	}
+#endif
+
 	sops.sem_op = -1;           /* decrement */
 	sops.sem_flg = SEM_UNDO;
 	sops.sem_num = 0;
@@ -313,6 +408,13 @@ semaphore_unlock(Semaphore *semaphore)
 	int errStatus;
 	struct sembuf sops;
 
+#ifdef HAVE_SHARED_MUTEX
+	if (semaphore->mutex != NULL)
+	{
+		return shared_mutex_unlock(semaphore);
+	}
+#endif
+
 	sops.sem_op = 1;            /* increment */
 	sops.sem_flg = SEM_UNDO;
 	sops.sem_num = 0;
@@ -380,3 +482,184 @@ semaphore_log_lock_function(void *udata, int mode)
 		}
 	}
 }
+
+
+#ifdef HAVE_SHARED_MUTEX
+
+/*
+ * shared_mutex_create creates a process-shared robust mutex in a new memfd
+ * mapping. The file descriptor is inherited by our sub-processes, across
+ * exec() too, and we seal its size so that they can check that the file
+ * descriptor they are given is one of ours.
+ */
+static bool
+shared_mutex_create(Semaphore *semaphore)
+{
+	pthread_mutexattr_t attr;
+
+	semaphore->owner = getpid();
+	semaphore->semId = -1;
+	semaphore->mutex = NULL;
+	semaphore->mutexFd = memfd_create("pg_autoctl log mutex", MFD_ALLOW_SEALING);
+
+	if (semaphore->mutexFd < 0)
+	{
+		/* fall back to a SysV semaphore */
+		log_trace("Failed to create memfd for the log mutex: %m");
+		return false;
+	}
+
+	if (ftruncate(semaphore->mutexFd, sizeof(pthread_mutex_t)) != 0 ||
+		fcntl(semaphore->mutexFd, F_ADD_SEALS, SHARED_MUTEX_SEALS) != 0 ||
+		!shared_mutex_map(semaphore))
+	{
+		log_trace("Failed to prepare memfd %d for the log mutex: %m",
+				  semaphore->mutexFd);
+		(void) close(semaphore->mutexFd);
+		return false;
+	}
+
+	if (pthread_mutexattr_init(&attr) != 0 ||
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0 ||
+		pthread_mutex_init(semaphore->mutex, &attr) != 0)
+	{
+		log_trace("Failed to initialize the log mutex");
+		(void) semaphore_unlink(semaphore);
+		return false;
+	}
+
+	(void) pthread_mutexattr_destroy(&attr);
+
+	/* to see this log line, change the default log level in set_logger() */
+	log_trace("Created shared mutex in memfd %d", semaphore->mutexFd);
+
+	return true;
+}
+
+
+/*
+ * shared_mutex_open maps the shared mutex of our parent process, which file
+ * descriptor we find in the environment.
+ */
+static bool
+shared_mutex_open(Semaphore *semaphore)
+{
+	char mutexFdString[BUFSIZE] = { 0 };
+	struct stat st;
+
+	/* ensure the owner is set to zero when we re-open an existing mutex */
+	semaphore->owner = 0;
+	semaphore->semId = -1;
+	semaphore->mutex = NULL;
+
+	if (!get_env_copy(PG_AUTOCTL_LOG_MUTEX, mutexFdString, BUFSIZE) ||
+		!stringToInt(mutexFdString, &semaphore->mutexFd))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * Our environment might have been passed down to another program that
+	 * did not keep our file descriptor open, or that opened something else
+	 * with the same number.
+	 */
+	int seals = fcntl(semaphore->mutexFd, F_GET_SEALS);
+
+	if (seals < 0 ||
+		(seals & SHARED_MUTEX_SEALS) != SHARED_MUTEX_SEALS ||
+		fstat(semaphore->mutexFd, &st) != 0 ||
+		st.st_size != sizeof(pthread_mutex_t))
+	{
+		log_trace("Failed to use fd %d from %s as the log mutex",
+				  semaphore->mutexFd, PG_AUTOCTL_LOG_MUTEX);
+		return false;
+	}
+
+	if (!shared_mutex_map(semaphore))
+	{
+		log_trace("Failed to map the log mutex from fd %d: %m",
+				  semaphore->mutexFd);
+		return false;
+	}
+
+	/* to see this log line, change the default log level in set_logger() */
+	log_trace("Using shared mutex in memfd %d", semaphore->mutexFd);
+
+	return true;
+}
+
+
+/*
+ * shared_mutex_map maps the shared mutex from its file descriptor.
+ */
+static bool
+shared_mutex_map(Semaphore *semaphore)
+{
+	void *mapping = mmap(NULL, sizeof(pthread_mutex_t),
+						 PROT_READ | PROT_WRITE, MAP_SHARED,
+						 semaphore->mutexFd, 0);
+
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+
+	semaphore->mutex = (pthread_mutex_t *) mapping;
+
+	return true;
+}
+
+
+/*
+ * shared_mutex_lock locks the shared mutex. When its previous owner died
+ * while holding it, which SEM_UNDO handles for SysV semaphores, the robust
+ * mutex is handed to us and we mark it consistent again.
+ */
+static bool
+shared_mutex_lock(Semaphore *semaphore)
+{
+	int errStatus = pthread_mutex_lock(semaphore->mutex);
+
+	if (errStatus == EOWNERDEAD)
+	{
+		errStatus = pthread_mutex_consistent(semaphore->mutex);
+	}
+
+	if (errStatus != 0)
+	{
+		fformat(stderr,
+				"%d Failed to acquire a lock with shared mutex %d: %s\n",
+				getpid(),
+				semaphore->mutexFd,
+				strerror(errStatus));
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * shared_mutex_unlock unlocks the shared mutex.
+ */
+static bool
+shared_mutex_unlock(Semaphore *semaphore)
+{
+	int errStatus = pthread_mutex_unlock(semaphore->mutex);
+
+	if (errStatus != 0)
+	{
+		fformat(stderr,
+				"Failed to release a lock with shared mutex %d: %s\n",
+				semaphore->mutexFd,
+				strerror(errStatus));
+		return false;
+	}
+
+	return true;
+}
+
+
+#endif
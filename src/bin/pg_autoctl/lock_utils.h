@@ -16,10 +16,29 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 
+/*
+ * On Linux we lock with a process-shared robust pthread mutex, which glibc
+ * implements with a futex: taking it costs no system call when there is no
+ * contention. The mutex lives in a memfd mapping that sub-processes inherit
+ * across exec(), and that the kernel releases when the last process of our
+ * process tree exits. SysV semaphores are the portable fallback.
+ */
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MFD_ALLOW_SEALING)
+#define HAVE_SHARED_MUTEX 1
+#include <pthread.h>
+#endif
+#endif
+
 typedef struct Semaphore
 {
 	int semId;
 	pid_t owner;
+#ifdef HAVE_SHARED_MUTEX
+	int mutexFd;
+	pthread_mutex_t *mutex;     /* NULL when using the SysV semaphore */
+#endif
 } Semaphore;
 
 
@@ -29,6 +48,7 @@ bool semaphore_finish(Semaphore *semaphore);
 bool semaphore_create(Semaphore *semaphore);
 bool semaphore_open(Semaphore *semaphore);
 bool semaphore_unlink(Semaphore *semaphore);
+void semaphore_setenv(Semaphore *semaphore);
 
 bool semaphore_cleanup(const char *pidfile);
 
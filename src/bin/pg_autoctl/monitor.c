@@ -19,10 +19,14 @@
 #include "monitor_config.h"
 #include "nodestate_utils.h"
 #include "parsing.h"
+#include "parson.h"
+#include "pgresult.h"
 #include "pgsql.h"
+#include "pqexpbuffer.h"
 #include "primary_standby.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "system_utils.h"
 
 #define STR_ERRCODE_OBJECT_IN_USE "55006"
 #define STR_ERRCODE_EXCLUSION_VIOLATION "23P01"
@@ -63,6 +67,14 @@ typedef struct MonitorAssignedStateParseContext
 	bool parsedOK;
 } MonitorAssignedStateParseContext;
 
+typedef struct MonitorAssignedStateArrayParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorAssignedState *assignedStates;
+	int count;
+	bool parsedOK;
+} MonitorAssignedStateArrayParseContext;
+
 typedef struct NodeReplicationSettingsParseContext
 {
 	char sqlstate[SQLSTATE_LENGTH];
@@ -71,6 +83,15 @@ typedef struct NodeReplicationSettingsParseContext
 	bool parsedOK;
 } NodeReplicationSettingsParseContext;
 
+typedef struct NodeTimelineParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	uint64_t sysIdentifier;
+	uint32_t timeline;
+	bool found;
+	bool parsedOK;
+} NodeTimelineParseContext;
+
 typedef struct CurrentNodeStateContext
 {
 	char sqlstate[SQLSTATE_LENGTH];
@@ -99,6 +120,13 @@ typedef struct FormationURIParseContext
 	bool parsedOK;
 } FormationURIParseContext;
 
+typedef struct NodeProgressArrayParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	NodeProgressArray *progressArray;
+	bool parsedOK;
+} NodeProgressArrayParseContext;
+
 typedef struct MonitorExtensionVersionParseContext
 {
 	char sqlstate[SQLSTATE_LENGTH];
@@ -106,29 +134,137 @@ typedef struct MonitorExtensionVersionParseContext
 	bool parsedOK;
 } MonitorExtensionVersionParseContext;
 
+typedef struct MonitorNodeMetricsParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorNodeMetricsArray *nodesArray;
+	bool parsedOK;
+} MonitorNodeMetricsParseContext;
+
+typedef struct MonitorGroupMetricsParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorGroupMetricsArray *groupsArray;
+	bool parsedOK;
+} MonitorGroupMetricsParseContext;
+
+typedef struct FleetStateParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	FleetGroupStateArray *fleetArray;
+	bool parsedOK;
+} FleetStateParseContext;
+
+typedef struct RemovedNodeArrayParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	RemovedNodeArray *removedArray;
+	bool parsedOK;
+} RemovedNodeArrayParseContext;
+
+typedef struct JSONStreamContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	FILE *stream;
+	bool jsonArray;
+	int rowCount;
+	bool parsedOK;
+} JSONStreamContext;
+
+typedef struct EventsSinceParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool json;
+	int64_t lastEventId;
+	int rowCount;
+	bool parsedOK;
+} EventsSinceParseContext;
+
+typedef struct LastEventsPrintContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	int rowCount;
+	bool parsedOK;
+} LastEventsPrintContext;
+
+typedef struct FollowEventsNotificationContext
+{
+	bool received;
+} FollowEventsNotificationContext;
+
+typedef struct FormationShardsParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorShardArray *shards;
+	bool parsedOK;
+} FormationShardsParseContext;
+
+/* the formation URIs of a monitor shard, see monitor_print_uri_all_shards */
+typedef struct FormationURI
+{
+	char type[NAMEDATALEN];
+	char name[BUFSIZE];
+	char uri[BUFSIZE];
+} FormationURI;
+
+typedef struct FormationURIArrayParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	int count;
+	FormationURI *uris;
+	bool parsedOK;
+} FormationURIArrayParseContext;
+
 
 static bool parseNode(PGresult *result, int rowNumber, NodeAddress *node);
 static void parseNodeResult(void *ctx, PGresult *result);
 static void parseNodeArray(void *ctx, PGresult *result);
 static void parseNodeState(void *ctx, PGresult *result);
+static int parseAssignedStateFields(PGresult *result, int rowNumber,
+									MonitorAssignedState *assignedState);
+static void parseNodeStateArray(void *ctx, PGresult *result);
 static void parseNodeReplicationSettings(void *ctx, PGresult *result);
+static void parseNodeTimeline(void *ctx, PGresult *result);
 static bool parseCurrentNodeState(PGresult *result, int rowNumber,
 								  CurrentNodeState *nodeState);
-static bool parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray,
-									   PGresult *result);
 static void parseRemoveNodeContext(void *ctx, PGresult *result);
+static PQExpBuffer nodeIdsArrayLiteral(int64_t *nodeIds, int count);
+static void parseRemovedNodeArray(void *ctx, PGresult *result);
+static void parseRemovedNodeUpdates(void *ctx, PGresult *result);
 static void getCurrentState(void *ctx, PGresult *result);
+static void printLastEventsHeader(void);
 static void printLastEvents(void *ctx, PGresult *result);
+static void printFailoverTimeline(void *ctx, PGresult *result);
 static void getLastEvents(void *ctx, PGresult *result);
 static void printFormationSettings(void *ctx, PGresult *result);
 static void printFormationURI(void *ctx, PGresult *result);
 static void parseCoordinatorNode(void *ctx, PGresult *result);
 static void parseExtensionVersion(void *ctx, PGresult *result);
+static void parseNodeProgressArray(void *ctx, PGresult *result);
+static void parseNodeMetricsArray(void *ctx, PGresult *result);
+static void parseGroupMetricsArray(void *ctx, PGresult *result);
+static void parseFleetStateArray(void *ctx, PGresult *result);
+static void parseFormationShards(void *ctx, PGresult *result);
+static void parseFormationURIArray(void *ctx, PGresult *result);
+static void printEventSince(void *ctx, PGresult *result);
+static void streamJSONRow(void *ctx, PGresult *result);
+static bool monitor_stream_json(PGSQL *pgsql, const char *sql,
+								int paramCount, const Oid *paramTypes,
+								const char **paramValues,
+								bool jsonArray, FILE *stream);
+static void monitor_print_shard_state(const char *pguri,
+									  CurrentNodeStateArray *nodesArray);
 
 static bool prepare_connection_to_current_system_user(Monitor *source,
 													  Monitor *target);
 
 
+/* the same query string is used to recognize a pending query */
+static const char *extensionVersionQuery =
+	"SELECT default_version, installed_version"
+	"  FROM pg_available_extensions WHERE name = $1";
+
+
 /*
  * We have several function that consume monitor notification in different
  * ways. They all have many things in common:
@@ -164,6 +300,7 @@ typedef struct WaitUntilStateNotificationContext
 {
 	char *formation;
 	int groupId;
+	char *nodeName;             /* NULL when any node will do */
 	NodeAddressHeaders *headers;
 	NodeState targetState;
 	bool failoverIsDone;
@@ -189,6 +326,7 @@ typedef struct WaitForStateChangeNotificationContext
 	char *formation;
 	int groupId;
 	int64_t nodeId;
+	CurrentNodeStateArray *groupStates;
 	bool stateHasChanged;
 } WaitForStateChangeNotificationContext;
 
@@ -197,6 +335,30 @@ static bool monitor_process_notifications(Monitor *monitor,
 										  char *channels[],
 										  void *NotificationContext,
 										  NotificationProcessingFunction processor);
+static bool monitor_process_events(Monitor *monitor,
+								   int timeoutMs,
+								   char *channels[],
+								   PGSQL *localClient,
+								   bool *localClientLost,
+								   int watchFd,
+								   bool *watchFdReady,
+								   void *notificationContext,
+								   NotificationProcessingFunction processor);
+
+static bool monitor_is_state_channel(const char *channel);
+static bool monitor_is_log_channel(const char *channel);
+static bool monitor_subscribe_log_notifications(Monitor *monitor,
+												const char *level,
+												const char *formation);
+static void monitor_group_state_channel(const char *formation, int groupId,
+										char *channel, size_t size);
+static void monitor_formation_state_channel(const char *formation,
+											char *channel, size_t size);
+static void monitor_notification_process_follow_events(void *context,
+													   CurrentNodeState *nodeState);
+
+static PGSQL * monitor_read_only_client(Monitor *monitor);
+static void parseStandbyFreshness(void *ctx, PGresult *result);
 
 
 /*
@@ -224,6 +386,159 @@ monitor_init(Monitor *monitor, char *url)
 }
 
 
+/*
+ * monitor_setup_standbys registers a connection string to monitor standby
+ * nodes, which may be a multi-host connection string. The read-only calls to
+ * the monitor are then sent to a standby node, as long as it is fresh enough:
+ * its replay lag must be at most maxLagMs milliseconds.
+ */
+bool
+monitor_setup_standbys(Monitor *monitor, char *url, int maxLagMs)
+{
+	log_trace("monitor_setup_standbys: %s", url);
+
+	if (!pgsql_init(&monitor->standbyClient, url, PGSQL_CONN_MONITOR))
+	{
+		/* URL must be invalid, pgsql_init logged an error */
+		return false;
+	}
+
+	/* when the standby is not available, quickly use the primary instead */
+	(void) pgsql_set_retry_policy(&(monitor->standbyClient.retryPolicy),
+								  0, 0, 0, 0);
+
+	monitor->hasStandbys = true;
+	monitor->standbyMaxLagMs = maxLagMs;
+	monitor->standbyIsFresh = false;
+	monitor->standbyCheckTime = 0;
+
+	return true;
+}
+
+
+typedef struct StandbyFreshnessContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool isInRecovery;
+	double lagMs;
+	bool parsedOk;
+} StandbyFreshnessContext;
+
+
+/*
+ * monitor_read_only_client returns the Postgres client to use for read-only
+ * calls to the monitor: a monitor standby node when one has been setup and is
+ * fresh enough, or the monitor primary node otherwise.
+ *
+ * The standby freshness is checked again every MONITOR_STANDBY_CHECK_INTERVAL
+ * seconds, so that long running commands such as pg_autoctl watch switch
+ * back and forth as needed.
+ */
+static PGSQL *
+monitor_read_only_client(Monitor *monitor)
+{
+	uint64_t now = time(NULL);
+
+	if (!monitor->hasStandbys)
+	{
+		return &(monitor->pgsql);
+	}
+
+	if (monitor->standbyCheckTime > 0 &&
+		(now - monitor->standbyCheckTime) < MONITOR_STANDBY_CHECK_INTERVAL)
+	{
+		return monitor->standbyIsFresh
+			   ? &(monitor->standbyClient)
+			   : &(monitor->pgsql);
+	}
+
+	/*
+	 * The monitor primary registers node_active calls all the time, so the
+	 * last replayed transaction timestamp is a good measure of the lag.
+	 */
+	const char *sql =
+		"SELECT pg_is_in_recovery(), "
+		"       extract(epoch from now() - pg_last_xact_replay_timestamp()) "
+		"       * 1000";
+
+	StandbyFreshnessContext context = { { 0 }, false, -1, false };
+
+	monitor->standbyCheckTime = now;
+	monitor->standbyIsFresh = false;
+
+	if (!pgsql_execute_with_params(&(monitor->standbyClient), sql,
+								   0, NULL, NULL,
+								   &context, &parseStandbyFreshness) ||
+		!context.parsedOk)
+	{
+		log_warn("Failed to check the monitor standby replication lag, "
+				 "using the monitor primary node for read-only queries");
+		return &(monitor->pgsql);
+	}
+
+	if (!context.isInRecovery)
+	{
+		log_warn("Monitor standby is not in recovery, "
+				 "using the monitor primary node for read-only queries");
+		return &(monitor->pgsql);
+	}
+
+	if (context.lagMs < 0 || context.lagMs > monitor->standbyMaxLagMs)
+	{
+		log_warn("Monitor standby replication lag is %.0f ms, more than the "
+				 "maximum allowed %d ms: using the monitor primary node "
+				 "for read-only queries",
+				 context.lagMs, monitor->standbyMaxLagMs);
+		return &(monitor->pgsql);
+	}
+
+	log_debug("Monitor standby replication lag is %.0f ms, "
+			  "using it for read-only queries",
+			  context.lagMs);
+
+	monitor->standbyIsFresh = true;
+
+	return &(monitor->standbyClient);
+}
+
+
+/*
+ * parseStandbyFreshness parses the result of the monitor standby freshness
+ * query. A NULL lag means that the standby has not replayed any transaction
+ * yet, we then use -1.
+ */
+static void
+parseStandbyFreshness(void *ctx, PGresult *result)
+{
+	StandbyFreshnessContext *context = (StandbyFreshnessContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows with %d columns, expected 1 row "
+				  "with 2 columns",
+				  PQntuples(result), PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	context->isInRecovery = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
+
+	if (PQgetisnull(result, 0, 1))
+	{
+		context->lagMs = -1;
+	}
+	else if (!stringToDouble(PQgetvalue(result, 0, 1), &(context->lagMs)))
+	{
+		log_error("Failed to parse the monitor standby lag \"%s\"",
+				  PQgetvalue(result, 0, 1));
+		context->parsedOk = false;
+		return;
+	}
+
+	context->parsedOk = true;
+}
+
+
 /*
  * monitor_setup_notifications sets the monitor Postgres client structure to
  * enable notification processing for a given groupId.
@@ -269,7 +584,16 @@ monitor_process_state_notification(int notificationGroupId,
 {
 	CurrentNodeState nodeState = { 0 };
 
-	if (strcmp(channel, "state") != 0)
+	if (!monitor_is_state_channel(channel))
+	{
+		return false;
+	}
+
+	/* compact notifications about other groups are skipped from the prefix */
+	int groupId = 0;
+
+	if (parse_state_notification_group(payload, &groupId) &&
+		groupId != notificationGroupId)
 	{
 		return false;
 	}
@@ -363,7 +687,7 @@ bool
 monitor_get_nodes(Monitor *monitor, char *formation, int groupId,
 				  NodeAddressArray *nodeArray)
 {
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	const char *sql =
 		groupId == -1
 		? "SELECT * FROM pgautofailover.get_nodes($1) ORDER BY node_id"
@@ -383,9 +707,9 @@ monitor_get_nodes(Monitor *monitor, char *formation, int groupId,
 		paramValues[1] = myGroupIdString.strValue;
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeArray))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
 	{
 		log_error("Failed to get other nodes from the monitor while running "
 				  "\"%s\" with formation %s and group %d",
@@ -414,7 +738,7 @@ monitor_get_nodes(Monitor *monitor, char *formation, int groupId,
 bool
 monitor_print_nodes_as_json(Monitor *monitor, char *formation, int groupId)
 {
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
 
 	const char *sql =
@@ -511,9 +835,9 @@ monitor_get_other_nodes(Monitor *monitor,
 		paramValues[1] = NodeStateToString(currentState);
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeArray))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
 	{
 		log_error("Failed to get other nodes from the monitor while running "
 				  "\"%s\" with node id %" PRId64,
@@ -536,6 +860,55 @@ monitor_get_other_nodes(Monitor *monitor,
 }
 
 
+/*
+ * monitor_get_cascaded_nodes gets the other nodes in the group that currently
+ * stream from another standby node rather than from the primary.
+ */
+bool
+monitor_get_cascaded_nodes(Monitor *monitor,
+						   int64_t myNodeId,
+						   NodeAddressArray *nodeArray)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.get_cascaded_nodes($1) "
+		"ORDER BY node_id";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1] = { 0 };
+
+	NodeAddressArrayParseContext parseContext = { { 0 }, nodeArray, false };
+
+	IntString myNodeIdString = intToString(myNodeId);
+
+	paramValues[0] = myNodeIdString.strValue;
+
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
+	{
+		log_error("Failed to get cascaded nodes from the monitor while "
+				  "running \"%s\" with node id %" PRId64,
+				  sql,
+				  myNodeId);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to get the cascaded nodes from the monitor while "
+				  "running \"%s\" with node id %" PRId64
+				  " because it returned an unexpected result. "
+				  "See previous line for details.",
+				  sql, myNodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_print_other_nodes gets the other nodes from the monitor and then
  * prints them to stdout in a human-friendly tabular format.
@@ -544,17 +917,20 @@ bool
 monitor_print_other_nodes(Monitor *monitor,
 						  int64_t myNodeId, NodeState currentState)
 {
-	NodeAddressArray otherNodesArray;
+	NodeAddressArray otherNodesArray = { 0 };
 
 	if (!monitor_get_other_nodes(monitor, myNodeId, currentState,
 								 &otherNodesArray))
 	{
 		/* errors have already been logged */
+		nodeAddressArrayFree(&otherNodesArray);
 		return false;
 	}
 
 	(void) printNodeArray(&otherNodesArray);
 
+	nodeAddressArrayFree(&otherNodesArray);
+
 	return true;
 }
 
@@ -645,9 +1021,9 @@ monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 	paramValues[0] = formation;
 	paramValues[1] = groupIdString.strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeResult))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeResult))
 	{
 		log_error(
 			"Failed to get the primary node in the HA group from the monitor "
@@ -677,122 +1053,282 @@ monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 
 
 /*
- * monitor_get_coordinator gets the coordinator node in a given formation.
+ * monitor_get_upstream gets the node that the given standby node should
+ * stream from, using the pgautofailover.get_upstream() API: either the
+ * upstream node that has been set for this node, when that node is a healthy
+ * secondary, or the primary node of the group.
  */
 bool
-monitor_get_coordinator(Monitor *monitor, char *formation,
-						CoordinatorNodeAddress *coordinatorNodeAddress)
+monitor_get_upstream(Monitor *monitor, int64_t nodeId, NodeAddress *node)
 {
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql = "SELECT * FROM pgautofailover.get_coordinator($1)";
-
+	const char *sql = "SELECT * FROM pgautofailover.get_upstream($1)";
 	int paramCount = 1;
-	Oid paramTypes[1] = { TEXTOID };
+	Oid paramTypes[1] = { INT8OID };
 	const char *paramValues[1];
+	NodeAddressParseContext parseContext = { { 0 }, node, false };
+	IntString nodeIdString = intToString(nodeId);
 
-	NodeAddressParseContext parseContext = {
-		{ 0 },
-		&(coordinatorNodeAddress->node),
-		false
-	};
-
-	paramValues[0] = formation;
+	paramValues[0] = nodeIdString.strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseCoordinatorNode))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeResult))
 	{
-		log_error("Failed to get the coordinator node from the monitor, "
-				  "while running \"%s\" with formation \"%s\".",
-				  sql, formation);
+		log_error(
+			"Failed to get the upstream node from the monitor "
+			"while running \"%s\" with node id %" PRId64,
+			sql, nodeId);
 		return false;
 	}
 
 	if (!parseContext.parsedOK)
 	{
-		log_error("Failed to get the coordinator node from the monitor "
-				  "while running \"%s\" with formation \"%s\" "
-				  "because it returned an unexpected result. "
-				  "See previous line for details.",
-				  sql, formation);
-		return false;
-	}
-
-	if (parseContext.node == NULL)
-	{
-		log_error("Failed to get the coordinator node from the monitor: "
-				  "the monitor returned an empty result set, there's no "
-				  "known available coordinator node at this time in "
-				  "formation \"%s\"", formation);
+		log_error(
+			"Failed to get the upstream node from the monitor while running "
+			"\"%s\" with node id %" PRId64 " because it returned an "
+			"unexpected result. See previous line for details.",
+			sql, nodeId);
 		return false;
 	}
 
-	coordinatorNodeAddress->found = true;
-
-	log_debug("The coordinator node returned by the monitor is %s:%d",
-			  coordinatorNodeAddress->node.host,
-			  coordinatorNodeAddress->node.port);
+	log_debug("The upstream node returned by the monitor is node " NODE_FORMAT,
+			  node->nodeId, node->name, node->host, node->port);
 
 	return true;
 }
 
 
 /*
- * monitor_get_most_advanced_standby finds the standby node in state REPORT_LSN
- * with the most advanced LSN position.
+ * monitor_get_node_timeline gets the system identifier and the timeline that
+ * the given node last reported to the monitor, using the
+ * pgautofailover.get_node_timeline() API. The monitor only knows about the
+ * timeline of nodes that have been reporting a primary state, otherwise
+ * found is set to false.
  */
 bool
-monitor_get_most_advanced_standby(Monitor *monitor,
-								  char *formation, int groupId,
-								  NodeAddress *node)
+monitor_get_node_timeline(Monitor *monitor, int64_t nodeId,
+						  uint64_t *sysIdentifier, uint32_t *timeline,
+						  bool *found)
 {
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql =
-		"SELECT * FROM pgautofailover.get_most_advanced_standby($1, $2)";
-	int paramCount = 2;
-	Oid paramTypes[2] = { TEXTOID, INT4OID };
-	const char *paramValues[2];
-
-	/* we expect a single entry */
-	NodeAddressArray nodeArray = { 0 };
-	NodeAddressArrayParseContext parseContext = { { 0 }, &nodeArray, false };
-
-	IntString groupIdString = intToString(groupId);
+	const char *sql = "SELECT * FROM pgautofailover.get_node_timeline($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+	NodeTimelineParseContext parseContext = { { 0 }, 0, 0, false, false };
+	IntString nodeIdString = intToString(nodeId);
 
-	paramValues[0] = formation;
-	paramValues[1] = groupIdString.strValue;
+	paramValues[0] = nodeIdString.strValue;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeArray))
+								   &parseContext, parseNodeTimeline))
 	{
-		log_error(
-			"Failed to get most advanced standby node in the HA group "
-			"from the monitor while running \"%s\" with "
-			"formation \"%s\" and group ID %d",
-			sql, formation, groupId);
+		log_error("Failed to get the timeline of node %" PRId64
+				  " from the monitor", nodeId);
 		return false;
 	}
 
-	if (!parseContext.parsedOK || nodeArray.count != 1)
+	if (!parseContext.parsedOK)
 	{
-		log_error(
-			"Failed to get the most advanced standby node from the monitor "
-			"while running \"%s\" with formation \"%s\" and group ID %d "
-			"because it returned an unexpected result. "
-			"See previous line for details.",
-			sql, formation, groupId);
+		log_error("Failed to get the timeline of node %" PRId64
+				  " from the monitor while running \"%s\" because it "
+				  "returned an unexpected result. "
+				  "See previous line for details.",
+				  nodeId, sql);
 		return false;
 	}
 
-	/* copy the node we retrieved in the expected place */
-	node->nodeId = nodeArray.nodes[0].nodeId;
+	*sysIdentifier = parseContext.sysIdentifier;
+	*timeline = parseContext.timeline;
+	*found = parseContext.found;
+
+	return true;
+}
+
+
+/*
+ * parseNodeTimeline parses the result of pgautofailover.get_node_timeline(),
+ * where NULL values mean that the monitor does not know the timeline of the
+ * node.
+ */
+static void
+parseNodeTimeline(void *ctx, PGresult *result)
+{
+	NodeTimelineParseContext *context = (NodeTimelineParseContext *) ctx;
+	int64_t sysIdentifier = 0;
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQntuples(result) == 0 ||
+		PQgetisnull(result, 0, 0) ||
+		PQgetisnull(result, 0, 1))
+	{
+		context->found = false;
+		context->parsedOK = true;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	/* the system identifier is stored in a bigint column on the monitor */
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt64(value, &sysIdentifier))
+	{
+		log_error("Invalid system identifier \"%s\" returned by monitor",
+				  value);
+		context->parsedOK = false;
+		return;
+	}
+
+	value = PQgetvalue(result, 0, 1);
+
+	if (!stringToUInt32(value, &(context->timeline)))
+	{
+		log_error("Invalid timeline \"%s\" returned by monitor", value);
+		context->parsedOK = false;
+		return;
+	}
+
+	context->sysIdentifier = (uint64_t) sysIdentifier;
+	context->found = true;
+	context->parsedOK = true;
+}
+
+
+/*
+ * monitor_get_coordinator gets the coordinator node in a given formation.
+ */
+bool
+monitor_get_coordinator(Monitor *monitor, char *formation,
+						CoordinatorNodeAddress *coordinatorNodeAddress)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT * FROM pgautofailover.get_coordinator($1)";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1];
+
+	NodeAddressParseContext parseContext = {
+		{ 0 },
+		&(coordinatorNodeAddress->node),
+		false
+	};
+
+	paramValues[0] = formation;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseCoordinatorNode))
+	{
+		log_error("Failed to get the coordinator node from the monitor, "
+				  "while running \"%s\" with formation \"%s\".",
+				  sql, formation);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to get the coordinator node from the monitor "
+				  "while running \"%s\" with formation \"%s\" "
+				  "because it returned an unexpected result. "
+				  "See previous line for details.",
+				  sql, formation);
+		return false;
+	}
+
+	if (parseContext.node == NULL)
+	{
+		log_error("Failed to get the coordinator node from the monitor: "
+				  "the monitor returned an empty result set, there's no "
+				  "known available coordinator node at this time in "
+				  "formation \"%s\"", formation);
+		return false;
+	}
+
+	coordinatorNodeAddress->found = true;
+
+	log_debug("The coordinator node returned by the monitor is %s:%d",
+			  coordinatorNodeAddress->node.host,
+			  coordinatorNodeAddress->node.port);
+
+	return true;
+}
+
+
+/*
+ * monitor_get_most_advanced_standby finds the standby node in state REPORT_LSN
+ * with the most advanced LSN position.
+ */
+bool
+monitor_get_most_advanced_standby(Monitor *monitor,
+								  char *formation, int groupId,
+								  NodeAddress *node)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.get_most_advanced_standby($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	/* we expect a single entry */
+	NodeAddressArray nodeArray = { 0 };
+	NodeAddressArrayParseContext parseContext = { { 0 }, &nodeArray, false };
+
+	IntString groupIdString = intToString(groupId);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupIdString.strValue;
+
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
+	{
+		log_error(
+			"Failed to get most advanced standby node in the HA group "
+			"from the monitor while running \"%s\" with "
+			"formation \"%s\" and group ID %d",
+			sql, formation, groupId);
+		nodeAddressArrayFree(&nodeArray);
+		return false;
+	}
+
+	if (!parseContext.parsedOK || nodeArray.count != 1)
+	{
+		log_error(
+			"Failed to get the most advanced standby node from the monitor "
+			"while running \"%s\" with formation \"%s\" and group ID %d "
+			"because it returned an unexpected result. "
+			"See previous line for details.",
+			sql, formation, groupId);
+		nodeAddressArrayFree(&nodeArray);
+		return false;
+	}
+
+	/* copy the node we retrieved in the expected place */
+	node->nodeId = nodeArray.nodes[0].nodeId;
 	strlcpy(node->name, nodeArray.nodes[0].name, _POSIX_HOST_NAME_MAX);
 	strlcpy(node->host, nodeArray.nodes[0].host, _POSIX_HOST_NAME_MAX);
 	node->port = nodeArray.nodes[0].port;
-	strlcpy(node->lsn, nodeArray.nodes[0].lsn, PG_LSN_MAXLENGTH);
+	node->lsn = nodeArray.nodes[0].lsn;
 	node->isPrimary = nodeArray.nodes[0].isPrimary;
 
+	nodeAddressArrayFree(&nodeArray);
+
 	log_debug("The most advanced standby node is node " NODE_FORMAT,
 			  node->nodeId, node->name, node->host, node->port);
 
@@ -800,6 +1336,70 @@ monitor_get_most_advanced_standby(Monitor *monitor,
 }
 
 
+/*
+ * monitor_get_clone_source finds a healthy secondary node in the given group
+ * from which to copy the data files of a new standby node. When the group has
+ * no such node, found is set to false and the function returns true.
+ */
+bool
+monitor_get_clone_source(Monitor *monitor, char *formation, int groupId,
+						 NodeAddress *node, bool *found)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.get_clone_source($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	/* we expect at most a single entry */
+	NodeAddressArray nodeArray = { 0 };
+	NodeAddressArrayParseContext parseContext = { { 0 }, &nodeArray, false };
+
+	IntString groupIdString = intToString(groupId);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupIdString.strValue;
+
+	*found = false;
+
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
+	{
+		log_error("Failed to get a secondary node to clone from "
+				  "while running \"%s\" with formation \"%s\" and group ID %d",
+				  sql, formation, groupId);
+		nodeAddressArrayFree(&nodeArray);
+		return false;
+	}
+
+	if (!parseContext.parsedOK || nodeArray.count > 1)
+	{
+		log_error("Failed to get a secondary node to clone from "
+				  "while running \"%s\" with formation \"%s\" and group ID %d "
+				  "because it returned an unexpected result. "
+				  "See previous line for details.",
+				  sql, formation, groupId);
+		nodeAddressArrayFree(&nodeArray);
+		return false;
+	}
+
+	if (nodeArray.count == 1)
+	{
+		*node = nodeArray.nodes[0];
+		*found = true;
+
+		log_debug("Found secondary node " NODE_FORMAT " to clone from",
+				  node->nodeId, node->name, node->host, node->port);
+	}
+
+	nodeAddressArrayFree(&nodeArray);
+
+	return true;
+}
+
+
 /*
  * monitor_register_node performs the initial registration of a node with the
  * monitor in the given formation.
@@ -919,6 +1519,48 @@ monitor_register_node(Monitor *monitor, char *formation,
 }
 
 
+/*
+ * monitor_register_nodes registers many nodes at once with the monitor, in a
+ * single call to pgautofailover.register_nodes(). The nodes are given as a
+ * JSON array of objects with the register_node() argument names as keys, and
+ * the assignedStates array, of count entries, receives the node ID, group
+ * ID, and goal state assigned to each node, in the same order.
+ */
+bool
+monitor_register_nodes(Monitor *monitor, const char *nodesJSON,
+					   MonitorAssignedState *assignedStates, int count)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT * FROM pgautofailover.register_nodes($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { nodesJSON };
+	MonitorAssignedStateArrayParseContext parseContext =
+	{ { 0 }, assignedStates, count, false };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeStateArray))
+	{
+		log_error("Failed to register %d nodes, see previous lines for details",
+				  count);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to register %d nodes because the monitor returned "
+				  "an unexpected result, see previous lines for details",
+				  count);
+		return false;
+	}
+
+	log_info("Registered %d nodes in a single call to the monitor", count);
+
+	return true;
+}
+
+
 /*
  * monitor_node_active communicates the current state of the node to the
  * monitor and puts the new goal state to assignedState, which must not
@@ -930,18 +1572,22 @@ monitor_node_active(Monitor *monitor,
 					int groupId, NodeState currentState,
 					bool pgIsRunning, int currentTLI,
 					char *currentLSN, char *pgsrSyncState,
+					int64_t knownGroupVersion,
+					char *replayLSN, int64_t applyRate,
 					MonitorAssignedState *assignedState)
 {
 	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
 		"SELECT * FROM pgautofailover.node_active($1, $2, $3, "
-		"$4::pgautofailover.replication_state, $5, $6, $7, $8)";
-	int paramCount = 8;
-	Oid paramTypes[8] = {
+		"$4::pgautofailover.replication_state, $5, $6, $7, $8, $9, $10, $11)";
+	int paramCount = 11;
+	Oid paramTypes[11] = {
 		TEXTOID, INT8OID, INT4OID, TEXTOID,
-		BOOLOID, INT4OID, LSNOID, TEXTOID
+		BOOLOID, INT4OID, LSNOID, TEXTOID, INT8OID,
+		LSNOID, INT8OID
 	};
-	const char *paramValues[8];
+	const char *paramValues[11];
+	IntString applyRateString = intToString(applyRate);
 	MonitorAssignedStateParseContext parseContext =
 	{ { 0 }, assignedState, false };
 	const char *nodeStateString = NodeStateToString(currentState);
@@ -954,6 +1600,9 @@ monitor_node_active(Monitor *monitor,
 	paramValues[5] = intToString(currentTLI).strValue;
 	paramValues[6] = currentLSN;
 	paramValues[7] = pgsrSyncState;
+	paramValues[8] = intToString(knownGroupVersion).strValue;
+	paramValues[9] = IS_EMPTY_STRING_BUFFER(replayLSN) ? "0/0" : replayLSN;
+	paramValues[10] = applyRateString.strValue;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
@@ -987,36 +1636,138 @@ monitor_node_active(Monitor *monitor,
 
 
 /*
- * monitor_set_node_candidate_priority updates the monitor on the changes
- * in the node candidate priority.
+ * monitor_node_active_and_get_other_nodes calls node_active just like
+ * monitor_node_active does, and also fetches the list of the other nodes in
+ * the group, in the same network round trip when libpq supports the pipeline
+ * mode.
+ *
+ * The list of other nodes reflects the changes made by the node_active call,
+ * which runs first. The function returns false when node_active failed, and
+ * otherwise sets otherNodesFetched to whether the list of other nodes could
+ * be fetched too.
  */
 bool
-monitor_set_node_candidate_priority(Monitor *monitor,
-									char *formation, char *name,
-									int candidate_priority)
+monitor_node_active_and_get_other_nodes(Monitor *monitor,
+										char *formation, int64_t nodeId,
+										int groupId, NodeState currentState,
+										bool pgIsRunning, int currentTLI,
+										char *currentLSN, char *pgsrSyncState,
+										int64_t knownGroupVersion,
+										char *replayLSN, int64_t applyRate,
+										MonitorAssignedState *assignedState,
+										NodeAddressArray *otherNodes,
+										bool *otherNodesFetched)
 {
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql =
-		"SELECT pgautofailover.set_node_candidate_priority($1, $2, $3)";
-	int paramCount = 3;
-	Oid paramTypes[3] = { TEXTOID, TEXTOID, INT4OID };
-	const char *paramValues[3];
-	char *candidatePriorityText = intToString(candidate_priority).strValue;
-	bool success = true;
 
-	paramValues[0] = formation;
-	paramValues[1] = name,
-	paramValues[2] = candidatePriorityText;
+	Oid nodeActiveParamTypes[11] = {
+		TEXTOID, INT8OID, INT4OID, TEXTOID,
+		BOOLOID, INT4OID, LSNOID, TEXTOID, INT8OID,
+		LSNOID, INT8OID
+	};
+	const char *nodeActiveParamValues[11];
+	MonitorAssignedStateParseContext nodeActiveContext =
+	{ { 0 }, assignedState, false };
+	const char *nodeStateString = NodeStateToString(currentState);
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   NULL, NULL))
-	{
-		log_error("Failed to update node candidate priority on node \"%s\""
-				  "in formation \"%s\" for candidate_priority: \"%s\"",
-				  name, formation, candidatePriorityText);
+	IntString nodeIdString = intToString(nodeId);
+	IntString groupIdString = intToString(groupId);
+	IntString currentTLIString = intToString(currentTLI);
+	IntString knownGroupVersionString = intToString(knownGroupVersion);
+	IntString applyRateString = intToString(applyRate);
+
+	nodeActiveParamValues[0] = formation;
+	nodeActiveParamValues[1] = nodeIdString.strValue;
+	nodeActiveParamValues[2] = groupIdString.strValue;
+	nodeActiveParamValues[3] = nodeStateString;
+	nodeActiveParamValues[4] = pgIsRunning ? "true" : "false";
+	nodeActiveParamValues[5] = currentTLIString.strValue;
+	nodeActiveParamValues[6] = currentLSN;
+	nodeActiveParamValues[7] = pgsrSyncState;
+	nodeActiveParamValues[8] = knownGroupVersionString.strValue;
+	nodeActiveParamValues[9] =
+		IS_EMPTY_STRING_BUFFER(replayLSN) ? "0/0" : replayLSN;
+	nodeActiveParamValues[10] = applyRateString.strValue;
+
+	Oid otherNodesParamTypes[1] = { INT8OID };
+	const char *otherNodesParamValues[1] = { nodeIdString.strValue };
+	NodeAddressArrayParseContext otherNodesContext =
+	{ { 0 }, otherNodes, false };
+
+	PGSQLQuery queries[2] = {
+		{
+			"SELECT * FROM pgautofailover.node_active($1, $2, $3, "
+			"$4::pgautofailover.replication_state, $5, $6, $7, $8, $9, "
+			"$10, $11)",
+			11, nodeActiveParamTypes, nodeActiveParamValues,
+			&nodeActiveContext, parseNodeState
+		},
+		{
+			"SELECT * FROM pgautofailover.get_other_nodes($1) "
+			"ORDER BY node_id",
+			1, otherNodesParamTypes, otherNodesParamValues,
+			&otherNodesContext, parseNodeArray
+		}
+	};
 
-		success = false;
+	(void) pgsql_execute_pipeline(pgsql, queries, 2);
+
+	if (!nodeActiveContext.parsedOK)
+	{
+		log_error("Failed to get node state for node %" PRId64
+				  " in group %d of formation \"%s\" with initial state "
+				  "\"%s\", replication state \"%s\", "
+				  "and current lsn \"%s\", "
+				  "see previous lines for details",
+				  nodeId, groupId, formation, nodeStateString,
+				  pgsrSyncState, currentLSN);
+		return false;
+	}
+
+	*otherNodesFetched = otherNodesContext.parsedOK;
+
+	if (!otherNodesContext.parsedOK)
+	{
+		log_error("Failed to get the other nodes from the monitor "
+				  "with node id %" PRId64 ", see previous lines for details",
+				  nodeId);
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_set_node_candidate_priority updates the monitor on the changes
+ * in the node candidate priority.
+ */
+bool
+monitor_set_node_candidate_priority(Monitor *monitor,
+									char *formation, char *name,
+									int candidate_priority)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_candidate_priority($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, TEXTOID, INT4OID };
+	const char *paramValues[3];
+	char *candidatePriorityText = intToString(candidate_priority).strValue;
+	bool success = true;
+
+	paramValues[0] = formation;
+	paramValues[1] = name,
+	paramValues[2] = candidatePriorityText;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to update node candidate priority on node \"%s\""
+				  "in formation \"%s\" for candidate_priority: \"%s\"",
+				  name, formation, candidatePriorityText);
+
+		success = false;
 	}
 
 	return success;
@@ -1059,6 +1810,82 @@ monitor_set_node_replication_quorum(Monitor *monitor,
 }
 
 
+/*
+ * monitor_set_node_upstream sets the upstream node of the given node on the
+ * monitor, or resets it when upstreamName is NULL.
+ */
+bool
+monitor_set_node_upstream(Monitor *monitor,
+						  char *formation, char *name,
+						  char *upstreamName)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_upstream($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[3];
+
+	paramValues[0] = formation;
+	paramValues[1] = name;
+	paramValues[2] = upstreamName;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes,
+								   paramValues, NULL, NULL))
+	{
+		log_error("Failed to update the upstream node of node \"%s\" "
+				  "in formation \"%s\" to \"%s\"",
+				  name, formation,
+				  upstreamName == NULL ? "primary" : upstreamName);
+
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_set_node_zone sets the zone of the given node on the monitor.
+ */
+bool
+monitor_set_node_zone(Monitor *monitor,
+					  char *formation, char *name, char *zone)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_zone($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[3];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	paramValues[0] = formation;
+	paramValues[1] = name;
+	paramValues[2] = zone;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes,
+								   paramValues, &parseContext,
+								   parseSingleValueResult))
+	{
+		log_error("Failed to update the zone of node \"%s\" "
+				  "in formation \"%s\" to \"%s\"",
+				  name, formation, zone);
+		return false;
+	}
+
+	if (!parseContext.parsedOk || !parseContext.boolVal)
+	{
+		log_error("Failed to update the zone of node \"%s\": "
+				  "node is not registered in formation \"%s\"",
+				  name, formation);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_get_node_replication_settings retrieves replication settings
  * from the monitor.
@@ -1350,176 +2177,465 @@ monitor_remove_by_nodename(Monitor *monitor,
 
 
 /*
- * parseRemoveNodeContext parses a nodeid and groupid, and the result of the
- * monitor's function call pgautofailover.remove_node which is a boolean.
+ * monitor_remove_nodes calls the pgautofailover.remove_nodes function on the
+ * monitor, to remove all the given nodes in a single transaction. The
+ * removedArray has an entry per node, where removed is true when the node has
+ * already been removed from the monitor, and false when it is being dropped.
  */
-static void
-parseRemoveNodeContext(void *ctx, PGresult *result)
+bool
+monitor_remove_nodes(Monitor *monitor, int64_t *nodeIds, int count, bool force,
+					 RemovedNodeArray *removedArray)
 {
-	int errors = 0;
-	RemoveNodeContext *context = (RemoveNodeContext *) ctx;
-
-	context->parsedOK = false;
+	RemovedNodeArrayParseContext context = { { 0 }, removedArray, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT node_id, group_id, removed "
+		"  FROM pgautofailover.remove_nodes($1::bigint[], $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, BOOLOID };
+	const char *paramValues[2];
 
-	if (PQntuples(result) == 0)
-	{
-		log_error("Failed to find the node to remove on the monitor");
-		context->parsedOK = false;
-		return;
-	}
-	else if (PQntuples(result) != 1)
-	{
-		log_error("Query returned %d rows, expected 1", PQntuples(result));
-		context->parsedOK = false;
-		return;
-	}
+	PQExpBuffer nodeIdsArray = nodeIdsArrayLiteral(nodeIds, count);
 
-	if (PQnfields(result) != 3)
+	if (nodeIdsArray == NULL)
 	{
-		log_error("Query returned %d columns, expected 3", PQnfields(result));
-		context->parsedOK = false;
-		return;
+		/* errors have already been logged */
+		return false;
 	}
 
-	char *value = PQgetvalue(result, 0, 0);
-
-	if (!stringToInt64(value, &context->nodeId))
-	{
-		log_error("Invalid node ID \"%s\" returned by monitor", value);
-		++errors;
-	}
+	paramValues[0] = nodeIdsArray->data;
+	paramValues[1] = force ? "true" : "false";
 
-	value = PQgetvalue(result, 0, 1);
+	bool success =
+		pgsql_execute_with_params(pgsql, sql,
+								  paramCount, paramTypes, paramValues,
+								  &context, &parseRemovedNodeArray);
 
-	if (!stringToInt(value, &context->groupId))
-	{
-		log_error("Invalid group ID \"%s\" returned by monitor", value);
-		++errors;
-	}
+	destroyPQExpBuffer(nodeIdsArray);
 
-	value = PQgetvalue(result, 0, 2);
-	if (value == NULL || ((*value != 't') && (*value != 'f')))
-	{
-		log_error("Invalid boolean value \"%s\" returned by monitor", value);
-		++errors;
-	}
-	else
+	if (!success)
 	{
-		context->removed = (*value) == 't';
+		log_error("Failed to remove %d nodes from the monitor", count);
+		return false;
 	}
 
-	if (errors > 0)
+	if (!context.parsedOK)
 	{
-		context->parsedOK = false;
-		return;
+		log_error("Failed to remove %d nodes from the monitor: "
+				  "could not parse monitor's result.", count);
+		return false;
 	}
 
-	/* if we reach this line, then we're good. */
-	context->parsedOK = true;
+	return true;
 }
 
 
 /*
- * monitor_count_groups counts how many groups we have in this formation, and
- * sets the obtained value in the groupsCount parameter.
+ * monitor_update_removed_nodes checks which of the nodes of the given array
+ * that were still being dropped have been removed from the monitor since, and
+ * sets their removed property.
  */
 bool
-monitor_count_groups(Monitor *monitor, char *formation, int *groupsCount)
+monitor_update_removed_nodes(Monitor *monitor, RemovedNodeArray *removedArray)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	RemovedNodeArrayParseContext context = { { 0 }, removedArray, false };
 	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
-		"SELECT count(distinct(groupid)) "
-		"FROM pgautofailover.node "
-		"WHERE formationid = $1";
+		"SELECT ids.id, node.nodeid IS NULL "
+		"  FROM unnest($1::bigint[]) AS ids(id) "
+		"       LEFT JOIN pgautofailover.node ON node.nodeid = ids.id";
 	int paramCount = 1;
 	Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { formation };
+	const char *paramValues[1];
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	int64_t *nodeIds = (int64_t *) calloc(Max(removedArray->count, 1),
+										  sizeof(int64_t));
+	int count = 0;
+
+	if (nodeIds == NULL)
 	{
-		log_error("Failed to get how many groups are in formation %s",
-				  formation);
+		log_error(ALLOCATION_FAILED_ERROR);
 		return false;
 	}
 
-	*groupsCount = context.intVal;
+	for (int index = 0; index < removedArray->count; index++)
+	{
+		if (!removedArray->nodes[index].removed)
+		{
+			nodeIds[count++] = removedArray->nodes[index].nodeId;
+		}
+	}
 
-	return true;
-}
+	if (count == 0)
+	{
+		free(nodeIds);
+		return true;
+	}
 
+	PQExpBuffer nodeIdsArray = nodeIdsArrayLiteral(nodeIds, count);
 
-/*
- * monitor_get_groupId_from_name returns the groupId that belongs to a node
- * identified by name.
- */
-bool
-monitor_get_groupId_from_name(Monitor *monitor, char *formation, char *name,
-							  int *groupId)
-{
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
-	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql =
-		"SELECT groupid FROM pgautofailover.node "
-		"WHERE formationid = $1 and nodename = $2";
-	int paramCount = 2;
-	Oid paramTypes[2] = { TEXTOID, TEXTOID };
-	const char *paramValues[2] = { formation, name };
+	free(nodeIds);
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (nodeIdsArray == NULL)
 	{
-		log_error("Failed to retrieve groupId for node \"%s\" in formation \"%s\"",
-				  name, formation);
+		/* errors have already been logged */
 		return false;
 	}
 
-	*groupId = context.intVal;
+	paramValues[0] = nodeIdsArray->data;
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql,
+								  paramCount, paramTypes, paramValues,
+								  &context, &parseRemovedNodeUpdates);
+
+	destroyPQExpBuffer(nodeIdsArray);
+
+	if (!success || !context.parsedOK)
+	{
+		log_error("Failed to check whether %d nodes have been removed "
+				  "from the monitor", count);
+		return false;
+	}
 
 	return true;
 }
 
 
 /*
- * monitor_perform_failover calls the pgautofailover.monitor_perform_failover
- * function on the monitor.
+ * monitor_removed_node_array_free frees the memory allocated for the nodes of
+ * the given array.
  */
-bool
-monitor_perform_failover(Monitor *monitor, char *formation, int group)
+void
+monitor_removed_node_array_free(RemovedNodeArray *removedArray)
 {
-	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql = "SELECT pgautofailover.perform_failover($1, $2)";
-	int paramCount = 2;
-	Oid paramTypes[2] = { TEXTOID, INT4OID };
-	const char *paramValues[2];
+	free(removedArray->nodes);
 
-	paramValues[0] = formation;
-	paramValues[1] = intToString(group).strValue;
+	removedArray->nodes = NULL;
+	removedArray->count = 0;
+	removedArray->capacity = 0;
+}
 
-	/*
-	 * pgautofailover.perform_failover() returns VOID.
-	 */
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   NULL, NULL))
+
+/*
+ * nodeIdsArrayLiteral returns a Postgres array literal of the given node ids,
+ * such as "{1,2,3}", in a PQExpBuffer that the caller must destroy.
+ */
+static PQExpBuffer
+nodeIdsArrayLiteral(int64_t *nodeIds, int count)
+{
+	PQExpBuffer nodeIdsArray = createPQExpBuffer();
+
+	if (nodeIdsArray == NULL)
 	{
-		log_error("Failed to perform failover for formation %s and group %d",
-				  formation, group);
-		return false;
+		log_error(ALLOCATION_FAILED_ERROR);
+		return NULL;
 	}
 
-	return true;
+	appendPQExpBufferStr(nodeIdsArray, "{");
+
+	for (int index = 0; index < count; index++)
+	{
+		appendPQExpBuffer(nodeIdsArray, "%s%" PRId64,
+						  index == 0 ? "" : ",",
+						  nodeIds[index]);
+	}
+
+	appendPQExpBufferStr(nodeIdsArray, "}");
+
+	if (PQExpBufferBroken(nodeIdsArray))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		destroyPQExpBuffer(nodeIdsArray);
+		return NULL;
+	}
+
+	return nodeIdsArray;
 }
 
 
 /*
- * monitor_perform_promotion calls the pgautofailover.perform_promotion
- * function on the monitor.
+ * parseRemovedNodeArray parses the result of pgautofailover.remove_nodes()
+ * into a RemovedNodeArray.
  */
-bool
+static void
+parseRemovedNodeArray(void *ctx, PGresult *result)
+{
+	RemovedNodeArrayParseContext *context = (RemovedNodeArrayParseContext *) ctx;
+	RemovedNodeArray *removedArray = context->removedArray;
+
+	int nTuples = PQntuples(result);
+	int errors = 0;
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (nTuples > removedArray->capacity)
+	{
+		RemovedNode *nodes =
+			(RemovedNode *) realloc(removedArray->nodes,
+									nTuples * sizeof(RemovedNode));
+
+		if (nodes == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOK = false;
+			return;
+		}
+
+		removedArray->nodes = nodes;
+		removedArray->capacity = nTuples;
+	}
+
+	removedArray->count = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		RemovedNode *node = &(removedArray->nodes[removedArray->count]);
+
+		memset(node, 0, sizeof(RemovedNode));
+
+		if (!stringToInt64(PQgetvalue(result, rowNumber, 0), &(node->nodeId)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 1), &(node->groupId)))
+		{
+			log_error("Invalid node id \"%s\" or group id \"%s\" returned "
+					  "by the monitor",
+					  PQgetvalue(result, rowNumber, 0),
+					  PQgetvalue(result, rowNumber, 1));
+			++errors;
+			continue;
+		}
+
+		node->removed = strcmp(PQgetvalue(result, rowNumber, 2), "t") == 0;
+
+		++removedArray->count;
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * parseRemovedNodeUpdates parses a node id and whether it's been removed from
+ * the monitor, and updates the matching entry of the RemovedNodeArray.
+ */
+static void
+parseRemovedNodeUpdates(void *ctx, PGresult *result)
+{
+	RemovedNodeArrayParseContext *context = (RemovedNodeArrayParseContext *) ctx;
+	RemovedNodeArray *removedArray = context->removedArray;
+
+	int errors = 0;
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		int64_t nodeId = 0;
+
+		if (!stringToInt64(PQgetvalue(result, rowNumber, 0), &nodeId))
+		{
+			log_error("Invalid node id \"%s\" returned by the monitor",
+					  PQgetvalue(result, rowNumber, 0));
+			++errors;
+			continue;
+		}
+
+		bool removed = strcmp(PQgetvalue(result, rowNumber, 1), "t") == 0;
+
+		for (int index = 0; index < removedArray->count; index++)
+		{
+			if (removedArray->nodes[index].nodeId == nodeId)
+			{
+				removedArray->nodes[index].removed = removed;
+			}
+		}
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * parseRemoveNodeContext parses a nodeid and groupid, and the result of the
+ * monitor's function call pgautofailover.remove_node which is a boolean.
+ */
+static void
+parseRemoveNodeContext(void *ctx, PGresult *result)
+{
+	int errors = 0;
+	RemoveNodeContext *context = (RemoveNodeContext *) ctx;
+
+	context->parsedOK = false;
+
+	if (PQntuples(result) == 0)
+	{
+		log_error("Failed to find the node to remove on the monitor");
+		context->parsedOK = false;
+		return;
+	}
+	else if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt64(value, &context->nodeId))
+	{
+		log_error("Invalid node ID \"%s\" returned by monitor", value);
+		++errors;
+	}
+
+	value = PQgetvalue(result, 0, 1);
+
+	if (!stringToInt(value, &context->groupId))
+	{
+		log_error("Invalid group ID \"%s\" returned by monitor", value);
+		++errors;
+	}
+
+	value = PQgetvalue(result, 0, 2);
+	if (value == NULL || ((*value != 't') && (*value != 'f')))
+	{
+		log_error("Invalid boolean value \"%s\" returned by monitor", value);
+		++errors;
+	}
+	else
+	{
+		context->removed = (*value) == 't';
+	}
+
+	if (errors > 0)
+	{
+		context->parsedOK = false;
+		return;
+	}
+
+	/* if we reach this line, then we're good. */
+	context->parsedOK = true;
+}
+
+
+/*
+ * monitor_count_groups counts how many groups we have in this formation, and
+ * sets the obtained value in the groupsCount parameter.
+ */
+bool
+monitor_count_groups(Monitor *monitor, char *formation, int *groupsCount)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT count(distinct(groupid)) "
+		"FROM pgautofailover.node "
+		"WHERE formationid = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { formation };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get how many groups are in formation %s",
+				  formation);
+		return false;
+	}
+
+	*groupsCount = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_get_groupId_from_name returns the groupId that belongs to a node
+ * identified by name.
+ */
+bool
+monitor_get_groupId_from_name(Monitor *monitor, char *formation, char *name,
+							  int *groupId)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT groupid FROM pgautofailover.node "
+		"WHERE formationid = $1 and nodename = $2";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { formation, name };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to retrieve groupId for node \"%s\" in formation \"%s\"",
+				  name, formation);
+		return false;
+	}
+
+	*groupId = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_perform_failover calls the pgautofailover.monitor_perform_failover
+ * function on the monitor.
+ */
+bool
+monitor_perform_failover(Monitor *monitor, char *formation, int group)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.perform_failover($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	paramValues[0] = formation;
+	paramValues[1] = intToString(group).strValue;
+
+	/*
+	 * pgautofailover.perform_failover() returns VOID.
+	 */
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to perform failover for formation %s and group %d",
+				  formation, group);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_perform_promotion calls the pgautofailover.perform_promotion
+ * function on the monitor.
+ */
+bool
 monitor_perform_promotion(Monitor *monitor, char *formation, char *name)
 {
 	PGSQL *pgsql = &monitor->pgsql;
@@ -1569,15 +2685,14 @@ parseNode(PGresult *result, int rowNumber, NodeAddress *node)
 		return false;
 	}
 
-	char *value = PQgetvalue(result, rowNumber, 0);
-	node->nodeId = strtol(value, NULL, 0);
-	if (node->nodeId == 0)
+	if (!pgresult_get_int64(result, rowNumber, 0, &(node->nodeId)) ||
+		node->nodeId == 0)
 	{
-		log_error("Invalid nodeId \"%s\" returned by monitor", value);
+		log_error("Invalid nodeId returned by monitor");
 		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 1);
+	char *value = PQgetvalue(result, rowNumber, 1);
 	int length = strlcpy(node->name, value, _POSIX_HOST_NAME_MAX);
 	if (length >= _POSIX_HOST_NAME_MAX)
 	{
@@ -1598,11 +2713,10 @@ parseNode(PGresult *result, int rowNumber, NodeAddress *node)
 		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 3);
-
-	if (!stringToInt(value, &node->port) || node->port == 0)
+	if (!pgresult_get_int(result, rowNumber, 3, &node->port) ||
+		node->port == 0)
 	{
-		log_error("Invalid port number \"%s\" returned by monitor", value);
+		log_error("Invalid port number returned by monitor");
 		return false;
 	}
 
@@ -1612,12 +2726,17 @@ parseNode(PGresult *result, int rowNumber, NodeAddress *node)
 	 */
 	if (PQnfields(result) == 6)
 	{
-		/* we trust Postgres pg_lsn data type to fit in our PG_LSN_MAXLENGTH */
-		value = PQgetvalue(result, rowNumber, 4);
-		strlcpy(node->lsn, value, PG_LSN_MAXLENGTH);
+		if (!pgresult_get_lsn(result, rowNumber, 4, &(node->lsn)))
+		{
+			log_error("Invalid LSN returned by monitor");
+			return false;
+		}
 
-		value = PQgetvalue(result, rowNumber, 5);
-		node->isPrimary = strcmp(value, "t") == 0;
+		if (!pgresult_get_bool(result, rowNumber, 5, &(node->isPrimary)))
+		{
+			log_error("Invalid is_primary returned by monitor");
+			return false;
+		}
 	}
 
 	return true;
@@ -1664,16 +2783,6 @@ parseNodeArray(void *ctx, PGresult *result)
 
 	log_debug("parseNodeArray: %d", PQntuples(result));
 
-	/* keep a NULL entry to mark the end of the array */
-	if (PQntuples(result) > NODE_ARRAY_MAX_COUNT)
-	{
-		log_error("Query returned %d rows, pg_auto_failover supports only up "
-				  "to %d standby nodes at the moment",
-				  PQntuples(result), NODE_ARRAY_MAX_COUNT);
-		context->parsedOK = false;
-		return;
-	}
-
 	/* pgautofailover.get_other_nodes returns 6 columns */
 	if (PQnfields(result) != 6)
 	{
@@ -1682,6 +2791,13 @@ parseNodeArray(void *ctx, PGresult *result)
 		return;
 	}
 
+	if (!nodeAddressArrayReserve(context->nodesArray, PQntuples(result)))
+	{
+		/* errors have already been logged */
+		context->parsedOK = false;
+		return;
+	}
+
 	context->nodesArray->count = PQntuples(result);
 
 	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
@@ -1704,7 +2820,6 @@ parseNodeState(void *ctx, PGresult *result)
 {
 	MonitorAssignedStateParseContext *context =
 		(MonitorAssignedStateParseContext *) ctx;
-	int errors = 0;
 
 	if (PQntuples(result) != 1)
 	{
@@ -1715,48 +2830,123 @@ parseNodeState(void *ctx, PGresult *result)
 
 	/*
 	 * We re-use the same data structure for register_node and node_active,
-	 * where the former adds the nodename to its result.
+	 * where the former adds the nodename to its result, and the latter adds
+	 * the group version, and then the trace id of the goal state.
 	 */
-	if (PQnfields(result) != 5 && PQnfields(result) != 6)
+	if (PQnfields(result) != 5 &&
+		PQnfields(result) != 6 &&
+		PQnfields(result) != 7 &&
+		PQnfields(result) != 8)
 	{
-		log_error("Query returned %d columns, expected 5 or 6", PQnfields(result));
+		log_error("Query returned %d columns, expected 5, 6, 7, or 8",
+				  PQnfields(result));
 		context->parsedOK = false;
 		return;
 	}
 
-	char *value = PQgetvalue(result, 0, 0);
+	int errors = parseAssignedStateFields(result, 0, context->assignedState);
+
+	if (errors > 0)
+	{
+		context->parsedOK = false;
+		return;
+	}
+
+	char *value = NULL;
+
+	if (PQnfields(result) == 6)
+	{
+		value = PQgetvalue(result, 0, 5);
+		strlcpy(context->assignedState->name,
+				value,
+				sizeof(context->assignedState->name));
+	}
+
+	/* without a group version, we have to assume other nodes changed */
+	context->assignedState->groupVersion = 0;
+	context->assignedState->otherNodesChanged = true;
+
+	if (PQnfields(result) >= 7)
+	{
+		value = PQgetvalue(result, 0, 5);
+		if (!stringToInt64(value, &context->assignedState->groupVersion))
+		{
+			log_error("Invalid group version \"%s\" returned by monitor", value);
+			context->parsedOK = false;
+			return;
+		}
+
+		value = PQgetvalue(result, 0, 6);
+		if (value == NULL || ((*value != 't') && (*value != 'f')))
+		{
+			log_error("Invalid group version changed \"%s\" "
+					  "returned by monitor", value);
+			context->parsedOK = false;
+			return;
+		}
+
+		context->assignedState->otherNodesChanged = (*value) == 't';
+	}
+
+	context->assignedState->traceId[0] = '\0';
+
+	if (PQnfields(result) == 8)
+	{
+		value = PQgetvalue(result, 0, 7);
+		strlcpy(context->assignedState->traceId,
+				value,
+				sizeof(context->assignedState->traceId));
+	}
+
+	/* if we reach this line, then we're good. */
+	context->parsedOK = true;
+}
+
 
-	if (!stringToInt64(value, &context->assignedState->nodeId))
+/*
+ * parseAssignedStateFields parses the first five columns of the given row of
+ * a register_node, register_nodes, or node_active result, and returns how
+ * many errors were found.
+ */
+static int
+parseAssignedStateFields(PGresult *result, int rowNumber,
+						 MonitorAssignedState *assignedState)
+{
+	int errors = 0;
+
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToInt64(value, &assignedState->nodeId))
 	{
 		log_error("Invalid node ID \"%s\" returned by monitor", value);
 		++errors;
 	}
 
-	value = PQgetvalue(result, 0, 1);
+	value = PQgetvalue(result, rowNumber, 1);
 
-	if (!stringToInt(value, &context->assignedState->groupId))
+	if (!stringToInt(value, &assignedState->groupId))
 	{
 		log_error("Invalid group ID \"%s\" returned by monitor", value);
 		++errors;
 	}
 
-	value = PQgetvalue(result, 0, 2);
-	context->assignedState->state = NodeStateFromString(value);
-	if (context->assignedState->state == NO_STATE)
+	value = PQgetvalue(result, rowNumber, 2);
+	assignedState->state = NodeStateFromString(value);
+	if (assignedState->state == NO_STATE)
 	{
 		log_error("Invalid node state \"%s\" returned by monitor", value);
 		++errors;
 	}
 
-	value = PQgetvalue(result, 0, 3);
-	if (!stringToInt(value, &context->assignedState->candidatePriority))
+	value = PQgetvalue(result, rowNumber, 3);
+	if (!stringToInt(value, &assignedState->candidatePriority))
 	{
 		log_error("Invalid failover candidate priority \"%s\" "
 				  "returned by monitor", value);
 		++errors;
 	}
 
-	value = PQgetvalue(result, 0, 4);
+	value = PQgetvalue(result, rowNumber, 4);
 	if (value == NULL || ((*value != 't') && (*value != 'f')))
 	{
 		log_error("Invalid replication quorum \"%s\" "
@@ -1765,25 +2955,54 @@ parseNodeState(void *ctx, PGresult *result)
 	}
 	else
 	{
-		context->assignedState->replicationQuorum = (*value) == 't';
+		assignedState->replicationQuorum = (*value) == 't';
 	}
 
-	if (errors > 0)
+	return errors;
+}
+
+
+/*
+ * parseNodeStateArray parses the result of register_nodes, one row per node.
+ */
+static void
+parseNodeStateArray(void *ctx, PGresult *result)
+{
+	MonitorAssignedStateArrayParseContext *context =
+		(MonitorAssignedStateArrayParseContext *) ctx;
+	int errors = 0;
+
+	if (PQntuples(result) != context->count)
 	{
+		log_error("Query returned %d rows, expected %d",
+				  PQntuples(result), context->count);
 		context->parsedOK = false;
 		return;
 	}
 
-	if (PQnfields(result) == 6)
+	if (PQnfields(result) != 6)
 	{
-		value = PQgetvalue(result, 0, 5);
-		strlcpy(context->assignedState->name,
-				value,
-				sizeof(context->assignedState->name));
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		context->parsedOK = false;
+		return;
 	}
 
-	/* if we reach this line, then we're good. */
-	context->parsedOK = true;
+	for (int rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		MonitorAssignedState *assignedState =
+			&(context->assignedStates[rowNumber]);
+
+		errors += parseAssignedStateFields(result, rowNumber, assignedState);
+
+		strlcpy(assignedState->name,
+				PQgetvalue(result, rowNumber, 5),
+				sizeof(assignedState->name));
+
+		assignedState->groupVersion = 0;
+		assignedState->otherNodesChanged = true;
+	}
+
+	context->parsedOK = errors == 0;
 }
 
 
@@ -1801,6 +3020,7 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 	if (!monitor_get_current_state(monitor, formation, group, &nodesArray))
 	{
 		/* errors have already been logged */
+		currentNodeStateArrayFree(&nodesArray);
 		return false;
 	}
 
@@ -1821,101 +3041,106 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 
 	fformat(stdout, "\n");
 
+	currentNodeStateArrayFree(&nodesArray);
+
 	return true;
 }
 
 
 /*
- * monitor_get_current_state gets the current state of a formation in the given
- * pre-allocated nodesArray. When group is -1, the state of all the nodes that
- * belong to the formation is retrieved. When group is 0 or more, the state for
- * only the nodes that belong to the given group in the given formation is
- * retrieved.
+ * monitor_resolve_formation_shard looks up the given formation in the
+ * pgautofailover.formation_shard directory of the (seed) monitor, and copies
+ * the connection string of the monitor shard that owns it in shardPguri. When
+ * the formation is not listed in the directory, then the seed monitor owns it
+ * and shardPguri is an empty string.
  */
 bool
-monitor_get_current_state(Monitor *monitor, char *formation, int group,
-						  CurrentNodeStateArray *nodesArray)
+monitor_resolve_formation_shard(Monitor *monitor, char *formation,
+								char *shardPguri, size_t size)
 {
-	CurrentNodeStateContext context = { { 0 }, nodesArray, false };
-	PGSQL *pgsql = &monitor->pgsql;
-	char *sql = NULL;
-	int paramCount = 0;
-	Oid paramTypes[2];
-	const char *paramValues[2];
-	IntString groupStr;
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql =
+		"SELECT monitor_uri FROM pgautofailover.formation_shard "
+		" WHERE formationid = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { formation };
 
-	log_trace("monitor_print_state(%s, %d)", formation, group);
+	shardPguri[0] = '\0';
 
-	switch (group)
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
-		case -1:
-		{
-			sql =
-				"  SELECT formation_kind, nodename, nodehost, nodeport, "
-				"         group_id, node_id, "
-				"         current_group_state, assigned_group_state, "
-				"         candidate_priority, replication_quorum, "
-				"         reported_tli, reported_lsn, health, nodecluster, "
-				"         healthlag, reportlag"
-				"    FROM pgautofailover.current_state($1) cs "
-				"    JOIN ("
-				"          select nodeid, "
-				"                 extract(epoch from now() - healthchecktime), "
-				"                 extract(epoch from now() - reporttime) "
-				"            from pgautofailover.node "
-				"         ) as n(nodeid, healthlag, reportlag)"
-				"         on n.nodeid = cs.node_id "
-				"ORDER BY group_id, node_id";
+		log_error("Failed to lookup formation \"%s\" in the monitor shards "
+				  "directory", formation);
+		return false;
+	}
 
-			paramCount = 1;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
+	if (context.ntuples == 0)
+	{
+		return true;
+	}
 
-			break;
-		}
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the monitor shard of formation \"%s\"",
+				  formation);
+		return false;
+	}
 
-		default:
-		{
-			sql =
-				"  SELECT formation_kind, nodename, nodehost, nodeport, "
-				"         group_id, node_id, "
-				"         current_group_state, assigned_group_state, "
-				"         candidate_priority, replication_quorum, "
-				"         reported_tli, reported_lsn, health, nodecluster, "
-				"         healthlag, reportlag"
-				"    FROM pgautofailover.current_state($1, $2) cs "
-				"    JOIN ("
-				"          select nodeid, "
-				"                 extract(epoch from now() - healthchecktime), "
-				"                 extract(epoch from now() - reporttime) "
-				"            from pgautofailover.node "
-				"         ) as n(nodeid, healthlag, reportlag)"
-				"         on n.nodeid = cs.node_id "
-				"ORDER BY group_id, node_id";
+	int length = strlcpy(shardPguri, context.strVal, size);
 
-			groupStr = intToString(group);
+	if (length >= size)
+	{
+		log_error("Monitor shard connection string for formation \"%s\" is "
+				  "%d characters, the maximum supported by pg_autoctl is %zu",
+				  formation, length, size - 1);
+		free(context.strVal);
+		return false;
+	}
 
-			paramCount = 2;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = groupStr.strValue;
+	free(context.strVal);
+
+	return true;
+}
 
-			break;
-		}
-	}
+
+/*
+ * monitor_get_formation_shards fetches the list of the monitor shards found
+ * in the directory of the (seed) monitor. The seed monitor itself is always
+ * the first entry of the list, as it owns the formations that are not listed
+ * in its directory.
+ */
+bool
+monitor_get_formation_shards(Monitor *monitor, MonitorShardArray *shards)
+{
+	FormationShardsParseContext context = { { 0 }, shards, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql =
+		"SELECT DISTINCT monitor_uri FROM pgautofailover.formation_shard "
+		"  WHERE monitor_uri <> $1 "
+		"ORDER BY monitor_uri";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { monitor->pgsql.connectionString };
+
+	shards->count = 1;
+	strlcpy(shards->pguri[0], monitor->pgsql.connectionString, MAXCONNINFO);
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
-								   &context, &getCurrentState))
+								   &context, &parseFormationShards))
 	{
-		log_error("Failed to retrieve current state from the monitor");
+		log_error("Failed to retrieve the monitor shards directory");
 		return false;
 	}
 
 	if (!context.parsedOK)
 	{
-		log_error("Failed to parse current state from the monitor");
+		log_error("Failed to parse the monitor shards directory, "
+				  "see above for details");
 		return false;
 	}
 
@@ -1924,553 +3149,2626 @@ monitor_get_current_state(Monitor *monitor, char *formation, int group,
 
 
 /*
- * parseCurrentNodeState parses the 11 columns returned by the API endpoint
- * pgautofailover.current_state.
+ * parseFormationShards parses the list of monitor shards connection strings
+ * into a MonitorShardArray, after the seed monitor entry.
  */
-static bool
-parseCurrentNodeState(PGresult *result, int rowNumber,
-					  CurrentNodeState *nodeState)
+static void
+parseFormationShards(void *ctx, PGresult *result)
 {
-	int colNumber = 0;
-	int errors = 0;
+	FormationShardsParseContext *context = (FormationShardsParseContext *) ctx;
+	MonitorShardArray *shards = context->shards;
+	int nTuples = PQntuples(result);
 
-	/* we don't expect any of the column to be NULL */
-	for (colNumber = 0; colNumber < 16; colNumber++)
+	if (PQnfields(result) != 1)
 	{
-		if (PQgetisnull(result, rowNumber, 0))
-		{
-			log_error("column %d in row %d returned by the monitor is NULL",
-					  colNumber, rowNumber);
-			return false;
-		}
+		log_error("Query returned %d columns, expected 1", PQnfields(result));
+		context->parsedOK = false;
+		return;
 	}
 
-	/*
-	 *  0 - OUT formation_kind       text,
-	 *  1 - OUT nodename             text,
-	 *  2 - OUT nodehost             text,
-	 *  3 - OUT nodeport             int,
-	 *  4 - OUT group_id             int,
-	 *  5 - OUT node_id              bigint,
-	 *  6 - OUT current_group_state  pgautofailover.replication_state,
-	 *  7 - OUT assigned_group_state pgautofailover.replication_state,
-	 *  8 - OUT candidate_priority	 int,
-	 *  9 - OUT replication_quorum	 bool,
-	 * 10 - OUT reported_tli         int,
-	 * 11 - OUT reported_lsn         pg_lsn,
-	 * 12 - OUT health               integer
-	 * 13 - OUT nodecluster          text
-	 * 14 -     healthlag            int (extract epoch from interval)
-	 * 15 -     reportlag            int (extract epoch from interval)
-	 *
-	 * We need the groupId to parse the formation kind into a nodeKind, so we
-	 * begin at column 1 and get back to column 0 later, after column 4.
-	 */
-	char *value = PQgetvalue(result, rowNumber, 1);
-	int length = strlcpy(nodeState->node.name, value, _POSIX_HOST_NAME_MAX);
-	if (length >= _POSIX_HOST_NAME_MAX)
+	if ((shards->count + nTuples) > MONITOR_SHARDS_MAX_COUNT)
 	{
-		log_error("Node name \"%s\" returned by monitor is %d characters, "
+		log_error("Query returned %d monitor shards, "
 				  "the maximum supported by pg_autoctl is %d",
-				  value, length, _POSIX_HOST_NAME_MAX - 1);
-		++errors;
+				  nTuples, MONITOR_SHARDS_MAX_COUNT - 1);
+		context->parsedOK = false;
+		return;
 	}
 
-	value = PQgetvalue(result, rowNumber, 2);
-
-	length = strlcpy(nodeState->node.host, value, _POSIX_HOST_NAME_MAX);
-	if (length >= _POSIX_HOST_NAME_MAX)
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		log_error("Hostname \"%s\" returned by monitor is %d characters, "
-				  "the maximum supported by pg_autoctl is %d",
-				  value, length, _POSIX_HOST_NAME_MAX - 1);
-		++errors;
+		char *value = PQgetvalue(result, rowNumber, 0);
+		int length =
+			strlcpy(shards->pguri[shards->count], value, MAXCONNINFO);
+
+		if (length >= MAXCONNINFO)
+		{
+			log_error("Monitor shard connection string \"%s\" is %d "
+					  "characters, the maximum supported by pg_autoctl is %d",
+					  value, length, MAXCONNINFO - 1);
+			context->parsedOK = false;
+			return;
+		}
+
+		++shards->count;
 	}
 
-	value = PQgetvalue(result, rowNumber, 3);
+	context->parsedOK = true;
+}
 
-	if (!stringToInt(value, &(nodeState->node.port)) ||
-		nodeState->node.port == 0)
-	{
-		log_error("Invalid port number \"%s\" returned by monitor", value);
-		++errors;
+
+/*
+ * monitor_print_state_all_shards prints the current state of all the
+ * formations of all the monitor shards listed in the directory of the given
+ * (seed) monitor. The shards are queried in parallel, and we print what we
+ * could fetch even when some of the shards are not available.
+ */
+bool
+monitor_print_state_all_shards(Monitor *monitor)
+{
+	MonitorShardArray *shards =
+		(MonitorShardArray *) calloc(1, sizeof(MonitorShardArray));
+	bool success = true;
+
+	const char *sql =
+		"  SELECT formation_kind, nodename, nodehost, nodeport, "
+		"         group_id, node_id, "
+		"         current_group_state, assigned_group_state, "
+		"         candidate_priority, replication_quorum, "
+		"         reported_tli, reported_lsn, health, nodecluster, "
+		"         health_lag, report_lag, f.formationid"
+		"    FROM pgautofailover.formation f "
+		"  CROSS JOIN LATERAL pgautofailover.current_state(f.formationid) cs "
+		"ORDER BY f.formationid, group_id, node_id";
+
+	if (shards == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 4);
-	if (!stringToInt(value, &(nodeState->groupId)))
+	if (!monitor_get_formation_shards(monitor, shards))
 	{
-		log_error("Invalid groupId \"%s\" returned by monitor", value);
-		++errors;
+		/* errors have already been logged */
+		free(shards);
+		return false;
 	}
 
-	/* we need the groupId to parse the formation kind into a nodeKind */
-	value = PQgetvalue(result, rowNumber, 0);
+	log_debug("Fetching the current state from %d monitor shard(s)",
+			  shards->count);
 
-	if (strcmp(value, "pgsql") == 0 && nodeState->groupId == 0)
+	for (int batch = 0; batch < shards->count;
+		 batch += PGSQL_PARALLEL_MAX_QUERIES)
 	{
-		nodeState->pgKind = NODE_KIND_STANDALONE;
+		PGSQL clients[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+		PGSQLQuery queries[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+		CurrentNodeStateArray nodesArrays[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+		CurrentNodeStateContext contexts[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+
+		int count = Min(PGSQL_PARALLEL_MAX_QUERIES, shards->count - batch);
+
+		for (int index = 0; index < count; index++)
+		{
+			char *pguri = shards->pguri[batch + index];
+
+			contexts[index].nodesArray = &(nodesArrays[index]);
+
+			queries[index].sql = sql;
+			queries[index].context = &(contexts[index]);
+			queries[index].parseFun = &getCurrentState;
+
+			if (!pgsql_init(&(clients[index]), pguri, PGSQL_CONN_MONITOR))
+			{
+				/* errors have already been logged */
+				free(shards);
+				return false;
+			}
+		}
+
+		/* failures are reported per shard below */
+		(void) pgsql_execute_parallel(clients, queries, count,
+									  MONITOR_SHARDS_QUERY_TIMEOUT);
+
+		for (int index = 0; index < count; index++)
+		{
+			char *pguri = shards->pguri[batch + index];
+
+			if (contexts[index].parsedOK)
+			{
+				(void) monitor_print_shard_state(pguri, &(nodesArrays[index]));
+			}
+			else
+			{
+				char scrubbedPguri[MAXCONNINFO] = { 0 };
+
+				(void) parse_and_scrub_connection_string(pguri, scrubbedPguri);
+
+				log_error("Failed to retrieve current state from monitor "
+						  "shard %s", scrubbedPguri);
+				success = false;
+			}
+
+			currentNodeStateArrayFree(&(nodesArrays[index]));
+		}
+	}
+
+	free(shards);
+
+	return success;
+}
+
+
+/*
+ * monitor_print_shard_state prints the current state of the formations found
+ * on a monitor shard, one table per formation. The nodes are sorted by
+ * formation already.
+ */
+static void
+monitor_print_shard_state(const char *pguri, CurrentNodeStateArray *nodesArray)
+{
+	char scrubbedPguri[MAXCONNINFO] = { 0 };
+
+	(void) parse_and_scrub_connection_string(pguri, scrubbedPguri);
+
+	int start = 0;
+
+	while (start < nodesArray->count)
+	{
+		char *formation = nodesArray->nodes[start].formation;
+		int end = start;
+
+		while (end < nodesArray->count &&
+			   strcmp(nodesArray->nodes[end].formation, formation) == 0)
+		{
+			++end;
+		}
+
+		CurrentNodeStateArray formationArray = {
+			.count = end - start,
+			.capacity = end - start,
+			.nodes = &(nodesArray->nodes[start])
+		};
+		NodeAddressHeaders *headers = &(formationArray.headers);
+
+		fformat(stdout, "Formation \"%s\" on monitor %s\n\n",
+				formation, scrubbedPguri);
+
+		(void) nodestatePrepareHeaders(&formationArray,
+									   formationArray.nodes[0].pgKind);
+		(void) nodestatePrintHeader(headers);
+
+		for (int position = 0; position < formationArray.count; position++)
+		{
+			(void) nodestatePrintNodeState(headers,
+										   &(formationArray.nodes[position]));
+		}
+
+		fformat(stdout, "\n");
+
+		start = end;
+	}
+}
+
+
+/*
+ * monitor_set_node_progress reports the progress of a pg_basebackup or
+ * pg_rewind operation running on the given node to the monitor.
+ */
+bool
+monitor_set_node_progress(Monitor *monitor, int64_t nodeId,
+						  const char *operation,
+						  int64_t doneBytes, int64_t totalBytes)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_progress($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { INT8OID, TEXTOID, INT8OID, INT8OID };
+	const char *paramValues[4];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString doneBytesString = intToString(doneBytes);
+	IntString totalBytesString = intToString(totalBytes);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = operation;
+	paramValues[2] = doneBytesString.strValue;
+	paramValues[3] = totalBytesString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to report %s progress of node %" PRId64
+				  " to the monitor",
+				  operation, nodeId);
+		return false;
+	}
+
+	return parseContext.parsedOk;
+}
+
+
+/*
+ * monitor_renew_primary_lease renews the lease of the given primary node on
+ * the monitor for leaseTimeoutMs milliseconds. The monitor refuses to renew
+ * the lease of a node that is not assigned a state in which it takes writes,
+ * and granted is then set to false.
+ */
+bool
+monitor_renew_primary_lease(Monitor *monitor, int64_t nodeId,
+							int leaseTimeoutMs, bool *granted)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.renew_primary_lease($1, $2) IS NOT NULL";
+	int paramCount = 2;
+	Oid paramTypes[2] = { INT8OID, INT4OID };
+	const char *paramValues[2];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString leaseTimeoutString = intToString(leaseTimeoutMs);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = leaseTimeoutString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to renew the primary lease of node %" PRId64
+				  " on the monitor",
+				  nodeId);
+		return false;
+	}
+
+	if (!parseContext.parsedOk)
+	{
+		log_error("Failed to parse the result of renew_primary_lease");
+		return false;
+	}
+
+	*granted = parseContext.boolVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_clear_node_progress removes the progress information of the given
+ * node on the monitor, once its operation is done.
+ */
+bool
+monitor_clear_node_progress(Monitor *monitor, int64_t nodeId)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.clear_node_progress($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to clear the progress of node %" PRId64
+				  " on the monitor",
+				  nodeId);
+		return false;
+	}
+
+	return parseContext.parsedOk;
+}
+
+
+/*
+ * monitor_set_replication_report reports the pg_stat_replication view of the
+ * given primary node to the monitor, for all its standby nodes at once.
+ */
+bool
+monitor_set_replication_report(Monitor *monitor, int64_t nodeId,
+							   StandbyReplicationArrays *report)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_replication_report($1, $2::bigint[], "
+		"$3::pg_lsn[], $4::pg_lsn[], $5::pg_lsn[], $6::pg_lsn[], "
+		"$7::bigint[], $8::bigint[], $9::bigint[])";
+	int paramCount = 9;
+	Oid paramTypes[9] = {
+		INT8OID, TEXTOID, TEXTOID, TEXTOID,
+		TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID
+	};
+	const char *paramValues[9];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = report->nodeIds;
+	paramValues[2] = report->sentLSNs;
+	paramValues[3] = report->writeLSNs;
+	paramValues[4] = report->flushLSNs;
+	paramValues[5] = report->replayLSNs;
+	paramValues[6] = report->writeLags;
+	paramValues[7] = report->flushLags;
+	paramValues[8] = report->retainedBytes;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to report the replication status of the standby "
+				  "nodes of node %" PRId64 " to the monitor",
+				  nodeId);
+		return false;
+	}
+
+	return parseContext.parsedOk;
+}
+
+
+/*
+ * monitor_set_node_resources reports the resources of the host of the given
+ * node to the monitor.
+ */
+bool
+monitor_set_node_resources(Monitor *monitor, int64_t nodeId,
+						   NodeResources *resources)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_resources($1, $2, $3, $4, "
+		"$5, $6, $7, $8, $9)";
+	int paramCount = 9;
+	Oid paramTypes[9] = {
+		INT8OID, INT4OID, INT8OID, INT8OID,
+		FLOAT8OID, FLOAT8OID, INT8OID, INT8OID, INT8OID
+	};
+	const char *paramValues[9];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	char loadAverage[BUFSIZE] = { 0 };
+	char cpuUsage[BUFSIZE] = { 0 };
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString ncpuString = intToString(resources->ncpu);
+	IntString totalRamString = intToString(resources->totalram);
+	IntString availableRamString = intToString(resources->availableram);
+	IntString diskReadRateString = intToString(resources->diskReadRate);
+	IntString diskWriteRateString = intToString(resources->diskWriteRate);
+	IntString walRateString = intToString(resources->walRate);
+
+	sformat(loadAverage, sizeof(loadAverage), "%.2f", resources->loadAverage);
+	sformat(cpuUsage, sizeof(cpuUsage), "%.2f", resources->cpuUsage);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = ncpuString.strValue;
+	paramValues[2] = totalRamString.strValue;
+	paramValues[3] = availableRamString.strValue;
+	paramValues[4] = loadAverage;
+	paramValues[5] = cpuUsage;
+	paramValues[6] = diskReadRateString.strValue;
+	paramValues[7] = diskWriteRateString.strValue;
+	paramValues[8] = walRateString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to report the resources of node %" PRId64
+				  " to the monitor",
+				  nodeId);
+		return false;
+	}
+
+	return parseContext.parsedOk;
+}
+
+
+/*
+ * monitor_set_sync_rep_waits reports to the monitor how many backends of the
+ * given primary node wait for synchronous replication, and for how long.
+ */
+bool
+monitor_set_sync_rep_waits(Monitor *monitor, int64_t nodeId,
+						   SyncRepStatus *status)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.set_sync_rep_waits($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { INT8OID, INT4OID, INT8OID };
+	const char *paramValues[3];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString waitingString = intToString(status->waiting);
+	IntString oldestWaitString = intToString(status->oldestWaitMs);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = waitingString.strValue;
+	paramValues[2] = oldestWaitString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to report the synchronous replication waits "
+				  "of node %" PRId64 " to the monitor",
+				  nodeId);
+		return false;
+	}
+
+	return parseContext.parsedOk;
+}
+
+
+/*
+ * monitor_get_node_progress gets the progress of the pg_basebackup and
+ * pg_rewind operations currently running in the given formation and group.
+ * When group is -1, all the groups of the formation are considered.
+ */
+bool
+monitor_get_node_progress(Monitor *monitor, char *formation, int group,
+						  NodeProgressArray *progressArray)
+{
+	NodeProgressArrayParseContext context = { { 0 }, progressArray, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT node_id, group_id, node_name, operation, "
+		"       done_bytes, total_bytes, coalesce(rate, 0), "
+		"       coalesce(extract(epoch from eta)::bigint, -1) "
+		"  FROM pgautofailover.current_progress($1) "
+		" WHERE $2 < 0 OR group_id = $2 "
+		" ORDER BY group_id, node_id";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	IntString groupString = intToString(group);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseNodeProgressArray))
+	{
+		log_error("Failed to retrieve the progress of node operations "
+				  "from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse the progress of node operations "
+				  "from the monitor, see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseNodeProgressArray parses the result of pgautofailover.current_progress
+ * into a NodeProgressArray.
+ */
+static void
+parseNodeProgressArray(void *ctx, PGresult *result)
+{
+	NodeProgressArrayParseContext *context =
+		(NodeProgressArrayParseContext *) ctx;
+	NodeProgressArray *progressArray = context->progressArray;
+
+	int nTuples = PQntuples(result);
+	int errors = 0;
+
+	if (PQnfields(result) != 8)
+	{
+		log_error("Query returned %d columns, expected 8", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	/* only a few nodes are ever rebuilding at the same time */
+	if (nTuples > NODE_PROGRESS_MAX_COUNT)
+	{
+		log_debug("Query returned %d rows, only showing the first %d",
+				  nTuples, NODE_PROGRESS_MAX_COUNT);
+		nTuples = NODE_PROGRESS_MAX_COUNT;
+	}
+
+	progressArray->count = nTuples;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		NodeProgress *progress = &(progressArray->nodes[rowNumber]);
+
+		if (!stringToInt64(PQgetvalue(result, rowNumber, 0),
+						   &(progress->nodeId)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 1),
+						 &(progress->groupId)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 4),
+						   &(progress->doneBytes)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 5),
+						   &(progress->totalBytes)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 6),
+						   &(progress->rate)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 7),
+						   &(progress->eta)))
+		{
+			log_error("Invalid progress values returned by the monitor "
+					  "for node \"%s\"",
+					  PQgetvalue(result, rowNumber, 2));
+			++errors;
+			continue;
+		}
+
+		strlcpy(progress->nodeName, PQgetvalue(result, rowNumber, 2),
+				sizeof(progress->nodeName));
+		strlcpy(progress->operation, PQgetvalue(result, rowNumber, 3),
+				sizeof(progress->operation));
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * nodeProgressToString prepares a human readable description of the given
+ * node progress, such as:
+ *
+ *   node 2 "node2": basebackup 1.2 GB / 4.0 GB (30%), 95.0 MB/s, ETA 31s
+ */
+void
+nodeProgressToString(NodeProgress *progress, char *buffer, size_t size)
+{
+	char done[BUFSIZE] = { 0 };
+	char total[BUFSIZE] = { 0 };
+	char rate[BUFSIZE] = { 0 };
+	char eta[BUFSIZE] = { 0 };
+
+	int percent = progress->totalBytes > 0
+				  ? (int) (100 * progress->doneBytes / progress->totalBytes)
+				  : 0;
+
+	(void) BytesToString(progress->doneBytes, done, sizeof(done));
+	(void) BytesToString(progress->totalBytes, total, sizeof(total));
+
+	if (progress->rate > 0)
+	{
+		(void) BytesToString(progress->rate, rate, sizeof(rate));
+	}
+	else
+	{
+		strlcpy(rate, "-", sizeof(rate));
+	}
+
+	if (progress->eta >= 0)
+	{
+		(void) IntervalToString((double) progress->eta, eta, sizeof(eta));
+	}
+	else
+	{
+		strlcpy(eta, "-", sizeof(eta));
+	}
+
+	sformat(buffer, size,
+			"node %" PRId64 " \"%s\": %s %s / %s (%d%%), %s/s, ETA %s",
+			progress->nodeId,
+			progress->nodeName,
+			progress->operation,
+			done, total, percent,
+			rate, eta);
+}
+
+
+/*
+ * monitor_print_node_progress prints the progress of the pg_basebackup and
+ * pg_rewind operations that are currently running, if any.
+ */
+bool
+monitor_print_node_progress(Monitor *monitor, char *formation, int group)
+{
+	NodeProgressArray progressArray = { 0 };
+
+	if (!monitor_get_node_progress(monitor, formation, group, &progressArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < progressArray.count; i++)
+	{
+		char line[BUFSIZE] = { 0 };
+
+		(void) nodeProgressToString(&(progressArray.nodes[i]),
+									line, sizeof(line));
+
+		fformat(stdout, "%s\n", line);
+	}
+
+	if (progressArray.count > 0)
+	{
+		fformat(stdout, "\n");
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_get_node_metrics fetches a snapshot of the pgautofailover.node
+ * table for the monitor metrics service. The lag of a node is computed
+ * against the most advanced LSN reported in its group, so that the primary
+ * always shows a zero lag.
+ */
+bool
+monitor_get_node_metrics(Monitor *monitor, MonitorNodeMetricsArray *nodesArray)
+{
+	MonitorNodeMetricsParseContext context = { { 0 }, nodesArray, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT formationid, groupid, nodeid, nodename, nodehost, nodeport, "
+		"       reportedstate, goalstate, health, "
+		"       coalesce(pg_wal_lsn_diff("
+		"                  max(reportedlsn) "
+		"                    over (partition by formationid, groupid), "
+		"                  reportedlsn), 0)::bigint, "
+		"       extract(epoch from "
+		"               pgautofailover.last_report_time(nodeid))::bigint, "
+		"       extract(epoch from healthchecktime)::bigint, "
+		"       resources.ncpu, resources.totalram, resources.availableram, "
+		"       resources.loadaverage, resources.cpuusage, "
+		"       resources.diskreadrate, resources.diskwriterate, "
+		"       resources.walrate, "
+		"       syncrep.waiting, syncrep.oldestwaitms, syncrep.stalls "
+		"  FROM pgautofailover.node "
+		"       LEFT JOIN pgautofailover.node_resources AS resources "
+		"              USING (nodeid) "
+		"       LEFT JOIN pgautofailover.node_sync_rep_waits AS syncrep "
+		"              USING (nodeid) "
+		" ORDER BY formationid, groupid, nodeid";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseNodeMetricsArray))
+	{
+		log_error("Failed to retrieve the nodes metrics from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse the nodes metrics from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_get_notification_queue_usage fetches the fraction of the Postgres
+ * notification queue of the monitor that is in use, between 0 and 1. A
+ * listener that doesn't read its notifications prevents the queue from being
+ * cleaned up, and the monitor can't assign new states once it is full.
+ */
+bool
+monitor_get_notification_queue_usage(Monitor *monitor, double *usage)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pg_notification_queue_usage()";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to retrieve the notification queue usage "
+				  "from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOk || !stringToDouble(context.strVal, usage))
+	{
+		log_error("Failed to parse the notification queue usage \"%s\" "
+				  "from the monitor",
+				  context.strVal == NULL ? "(null)" : context.strVal);
+		free(context.strVal);
+		return false;
+	}
+
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * parseNodeMetricsArray parses the result of the monitor_get_node_metrics
+ * query into a MonitorNodeMetricsArray, growing the array when needed.
+ */
+static void
+parseNodeMetricsArray(void *ctx, PGresult *result)
+{
+	MonitorNodeMetricsParseContext *context =
+		(MonitorNodeMetricsParseContext *) ctx;
+	MonitorNodeMetricsArray *nodesArray = context->nodesArray;
+
+	int nTuples = PQntuples(result);
+	int errors = 0;
+
+	if (PQnfields(result) != 23)
+	{
+		log_error("Query returned %d columns, expected 23", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (nTuples > nodesArray->capacity)
+	{
+		MonitorNodeMetrics *nodes =
+			(MonitorNodeMetrics *) realloc(nodesArray->nodes,
+										   nTuples * sizeof(MonitorNodeMetrics));
+
+		if (nodes == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOK = false;
+			return;
+		}
+
+		nodesArray->nodes = nodes;
+		nodesArray->capacity = nTuples;
+	}
+
+	nodesArray->count = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[nodesArray->count]);
+
+		memset(node, 0, sizeof(MonitorNodeMetrics));
+
+		if (!stringToInt(PQgetvalue(result, rowNumber, 1), &(node->groupId)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 2), &(node->nodeId)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 5), &(node->port)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 8), &(node->health)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 9),
+						   &(node->lagBytes)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 10),
+						   &(node->reportTime)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 11),
+						   &(node->healthCheckTime)))
+		{
+			log_error("Invalid metrics values returned by the monitor "
+					  "for node \"%s\"",
+					  PQgetvalue(result, rowNumber, 3));
+			++errors;
+			continue;
+		}
+
+		/* nodes that did not report their resources yet have NULLs here */
+		if (!PQgetisnull(result, rowNumber, 12))
+		{
+			NodeResources *resources = &(node->resources);
+
+			if (!stringToInt(PQgetvalue(result, rowNumber, 12),
+							 &(resources->ncpu)) ||
+				!stringToUInt64(PQgetvalue(result, rowNumber, 13),
+								&(resources->totalram)) ||
+				!stringToUInt64(PQgetvalue(result, rowNumber, 14),
+								&(resources->availableram)) ||
+				!stringToDouble(PQgetvalue(result, rowNumber, 15),
+								&(resources->loadAverage)) ||
+				!stringToDouble(PQgetvalue(result, rowNumber, 16),
+								&(resources->cpuUsage)) ||
+				!stringToInt64(PQgetvalue(result, rowNumber, 17),
+							   &(resources->diskReadRate)) ||
+				!stringToInt64(PQgetvalue(result, rowNumber, 18),
+							   &(resources->diskWriteRate)) ||
+				!stringToInt64(PQgetvalue(result, rowNumber, 19),
+							   &(resources->walRate)))
+			{
+				log_error("Invalid resources values returned by the monitor "
+						  "for node \"%s\"",
+						  PQgetvalue(result, rowNumber, 3));
+				++errors;
+				continue;
+			}
+
+			node->hasResources = true;
+		}
+
+		/* only primary nodes report their SyncRep waits */
+		if (!PQgetisnull(result, rowNumber, 20))
+		{
+			if (!stringToInt(PQgetvalue(result, rowNumber, 20),
+							 &(node->syncRepWaiting)) ||
+				!stringToInt64(PQgetvalue(result, rowNumber, 21),
+							   &(node->syncRepOldestWaitMs)) ||
+				!stringToInt64(PQgetvalue(result, rowNumber, 22),
+							   &(node->syncRepStalls)))
+			{
+				log_error("Invalid SyncRep waits values returned by the "
+						  "monitor for node \"%s\"",
+						  PQgetvalue(result, rowNumber, 3));
+				++errors;
+				continue;
+			}
+
+			node->hasSyncRepWaits = true;
+		}
+
+		strlcpy(node->formationId, PQgetvalue(result, rowNumber, 0),
+				sizeof(node->formationId));
+		strlcpy(node->name, PQgetvalue(result, rowNumber, 3),
+				sizeof(node->name));
+		strlcpy(node->host, PQgetvalue(result, rowNumber, 4),
+				sizeof(node->host));
+
+		node->reportedState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 6));
+		node->goalState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 7));
+
+		++nodesArray->count;
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * monitor_node_metrics_array_free releases the memory used by the given
+ * nodesArray, which is then a valid empty array again.
+ */
+void
+monitor_node_metrics_array_free(MonitorNodeMetricsArray *nodesArray)
+{
+	free(nodesArray->nodes);
+
+	nodesArray->nodes = NULL;
+	nodesArray->count = 0;
+	nodesArray->capacity = 0;
+}
+
+
+/*
+ * monitor_update_group_metrics accumulates the per-group counters from the
+ * events that have been added to pgautofailover.event since the last call,
+ * using groupsArray->lastEventId to only scan new events. A failover (or a
+ * switchover) is counted when a node is assigned the prepare_promotion state.
+ */
+bool
+monitor_update_group_metrics(Monitor *monitor,
+							 MonitorGroupMetricsArray *groupsArray)
+{
+	MonitorGroupMetricsParseContext context = { { 0 }, groupsArray, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT formationid, groupid, "
+		"       count(*) filter (where goalstate = 'prepare_promotion' "
+		"                          and reportedstate <> 'prepare_promotion'), "
+		"       count(*), max(eventid) "
+		"  FROM pgautofailover.event "
+		" WHERE eventid > $1 "
+		" GROUP BY formationid, groupid";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+
+	IntString lastEventIdString = intToString(groupsArray->lastEventId);
+
+	paramValues[0] = lastEventIdString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseGroupMetricsArray))
+	{
+		log_error("Failed to retrieve the events metrics from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse the events metrics from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseGroupMetricsArray adds the counters returned by the
+ * monitor_update_group_metrics query to the matching group entries, adding
+ * new entries for groups that we see for the first time.
+ */
+static void
+parseGroupMetricsArray(void *ctx, PGresult *result)
+{
+	MonitorGroupMetricsParseContext *context =
+		(MonitorGroupMetricsParseContext *) ctx;
+	MonitorGroupMetricsArray *groupsArray = context->groupsArray;
+
+	int nTuples = PQntuples(result);
+	int errors = 0;
+
+	if (PQnfields(result) != 5)
+	{
+		log_error("Query returned %d columns, expected 5", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		char *formationId = PQgetvalue(result, rowNumber, 0);
+		int groupId = 0;
+		int64_t failoverCount = 0;
+		int64_t eventCount = 0;
+		int64_t maxEventId = 0;
+
+		if (!stringToInt(PQgetvalue(result, rowNumber, 1), &groupId) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 2), &failoverCount) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 3), &eventCount) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 4), &maxEventId))
+		{
+			log_error("Invalid events metrics returned by the monitor "
+					  "for formation \"%s\" group %s",
+					  formationId,
+					  PQgetvalue(result, rowNumber, 1));
+			++errors;
+			continue;
+		}
+
+		MonitorGroupMetrics *group = NULL;
+
+		for (int i = 0; i < groupsArray->count; i++)
+		{
+			if (groupsArray->groups[i].groupId == groupId &&
+				strcmp(groupsArray->groups[i].formationId, formationId) == 0)
+			{
+				group = &(groupsArray->groups[i]);
+				break;
+			}
+		}
+
+		if (group == NULL)
+		{
+			if (groupsArray->count == groupsArray->capacity)
+			{
+				int capacity = 2 * groupsArray->capacity + 4;
+				MonitorGroupMetrics *groups =
+					(MonitorGroupMetrics *)
+					realloc(groupsArray->groups,
+							capacity * sizeof(MonitorGroupMetrics));
+
+				if (groups == NULL)
+				{
+					log_error(ALLOCATION_FAILED_ERROR);
+					context->parsedOK = false;
+					return;
+				}
+
+				groupsArray->groups = groups;
+				groupsArray->capacity = capacity;
+			}
+
+			group = &(groupsArray->groups[groupsArray->count++]);
+
+			memset(group, 0, sizeof(MonitorGroupMetrics));
+			strlcpy(group->formationId, formationId,
+					sizeof(group->formationId));
+			group->groupId = groupId;
+		}
+
+		group->failoverCount += failoverCount;
+		group->eventCount += eventCount;
+
+		if (maxEventId > groupsArray->lastEventId)
+		{
+			groupsArray->lastEventId = maxEventId;
+		}
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * monitor_group_metrics_array_free releases the memory used by the given
+ * groupsArray, which is then a valid empty array again.
+ */
+void
+monitor_group_metrics_array_free(MonitorGroupMetricsArray *groupsArray)
+{
+	free(groupsArray->groups);
+
+	groupsArray->groups = NULL;
+	groupsArray->count = 0;
+	groupsArray->capacity = 0;
+	groupsArray->lastEventId = 0;
+}
+
+
+/*
+ * monitor_get_current_state gets the current state of a formation in the given
+ * nodesArray, which storage grows as needed. When group is -1, the state of
+ * all the nodes that belong to the formation is retrieved. When group is 0 or
+ * more, the state for only the nodes that belong to the given group in the
+ * given formation is retrieved.
+ */
+bool
+monitor_get_current_state(Monitor *monitor, char *formation, int group,
+						  CurrentNodeStateArray *nodesArray)
+{
+	CurrentNodeStateContext context = { { 0 }, nodesArray, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	char *sql = NULL;
+	int paramCount = 0;
+	Oid paramTypes[2];
+	const char *paramValues[2];
+	IntString groupStr;
+
+	log_trace("monitor_print_state(%s, %d)", formation, group);
+
+	switch (group)
+	{
+		case -1:
+		{
+			sql =
+				"  SELECT formation_kind, nodename, nodehost, nodeport, "
+				"         group_id, node_id, "
+				"         current_group_state, assigned_group_state, "
+				"         candidate_priority, replication_quorum, "
+				"         reported_tli, reported_lsn, health, nodecluster, "
+				"         health_lag, report_lag"
+				"    FROM pgautofailover.current_state($1) cs "
+				"ORDER BY group_id, node_id";
+
+			paramCount = 1;
+			paramTypes[0] = TEXTOID;
+			paramValues[0] = formation;
+
+			break;
+		}
+
+		default:
+		{
+			sql =
+				"  SELECT formation_kind, nodename, nodehost, nodeport, "
+				"         group_id, node_id, "
+				"         current_group_state, assigned_group_state, "
+				"         candidate_priority, replication_quorum, "
+				"         reported_tli, reported_lsn, health, nodecluster, "
+				"         health_lag, report_lag"
+				"    FROM pgautofailover.current_state($1, $2) cs "
+				"ORDER BY group_id, node_id";
+
+			groupStr = intToString(group);
+
+			paramCount = 2;
+			paramTypes[0] = TEXTOID;
+			paramValues[0] = formation;
+			paramTypes[1] = INT4OID;
+			paramValues[1] = groupStr.strValue;
+
+			break;
+		}
+	}
+
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &context, &getCurrentState))
+	{
+		log_error("Failed to retrieve current state from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse current state from the monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseCurrentNodeState parses the 11 columns returned by the API endpoint
+ * pgautofailover.current_state.
+ */
+static bool
+parseCurrentNodeState(PGresult *result, int rowNumber,
+					  CurrentNodeState *nodeState)
+{
+	int colNumber = 0;
+	int errors = 0;
+
+	/* we don't expect any of the column to be NULL */
+	for (colNumber = 0; colNumber < 16; colNumber++)
+	{
+		if (PQgetisnull(result, rowNumber, 0))
+		{
+			log_error("column %d in row %d returned by the monitor is NULL",
+					  colNumber, rowNumber);
+			return false;
+		}
+	}
+
+	/*
+	 *  0 - OUT formation_kind       text,
+	 *  1 - OUT nodename             text,
+	 *  2 - OUT nodehost             text,
+	 *  3 - OUT nodeport             int,
+	 *  4 - OUT group_id             int,
+	 *  5 - OUT node_id              bigint,
+	 *  6 - OUT current_group_state  pgautofailover.replication_state,
+	 *  7 - OUT assigned_group_state pgautofailover.replication_state,
+	 *  8 - OUT candidate_priority	 int,
+	 *  9 - OUT replication_quorum	 bool,
+	 * 10 - OUT reported_tli         int,
+	 * 11 - OUT reported_lsn         pg_lsn,
+	 * 12 - OUT health               integer
+	 * 13 - OUT nodecluster          text
+	 * 14 -     health_lag           float8 (seconds)
+	 * 15 -     report_lag           float8 (seconds)
+	 *
+	 * We need the groupId to parse the formation kind into a nodeKind, so we
+	 * begin at column 1 and get back to column 0 later, after column 4.
+	 */
+	char *value = PQgetvalue(result, rowNumber, 1);
+	int length = strlcpy(nodeState->node.name, value, _POSIX_HOST_NAME_MAX);
+	if (length >= _POSIX_HOST_NAME_MAX)
+	{
+		log_error("Node name \"%s\" returned by monitor is %d characters, "
+				  "the maximum supported by pg_autoctl is %d",
+				  value, length, _POSIX_HOST_NAME_MAX - 1);
+		++errors;
+	}
+
+	value = PQgetvalue(result, rowNumber, 2);
+
+	length = strlcpy(nodeState->node.host, value, _POSIX_HOST_NAME_MAX);
+	if (length >= _POSIX_HOST_NAME_MAX)
+	{
+		log_error("Hostname \"%s\" returned by monitor is %d characters, "
+				  "the maximum supported by pg_autoctl is %d",
+				  value, length, _POSIX_HOST_NAME_MAX - 1);
+		++errors;
+	}
+
+	if (!pgresult_get_int(result, rowNumber, 3, &(nodeState->node.port)) ||
+		nodeState->node.port == 0)
+	{
+		log_error("Invalid port number returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_int(result, rowNumber, 4, &(nodeState->groupId)))
+	{
+		log_error("Invalid groupId returned by monitor");
+		++errors;
+	}
+
+	/* we need the groupId to parse the formation kind into a nodeKind */
+	value = PQgetvalue(result, rowNumber, 0);
+
+	if (strcmp(value, "pgsql") == 0 && nodeState->groupId == 0)
+	{
+		nodeState->pgKind = NODE_KIND_STANDALONE;
+	}
+	else if (strcmp(value, "citus") == 0 && nodeState->groupId == 0)
+	{
+		nodeState->pgKind = NODE_KIND_CITUS_COORDINATOR;
+	}
+	else if (strcmp(value, "citus") == 0 && nodeState->groupId > 0)
+	{
+		nodeState->pgKind = NODE_KIND_CITUS_WORKER;
+	}
+	else
+	{
+		log_error("Invalid groupId %d with formation kind \"%s\"",
+				  nodeState->groupId, value);
+		++errors;
+	}
+
+	if (!pgresult_get_int64(result, rowNumber, 5, &(nodeState->node.nodeId)))
+	{
+		log_error("Invalid nodeId returned by monitor");
+		++errors;
+	}
+
+	value = PQgetvalue(result, rowNumber, 6);
+	nodeState->reportedState = NodeStateFromString(value);
+	if (nodeState->reportedState == NO_STATE)
+	{
+		log_error("Invalid node state \"%s\" returned by monitor", value);
+		++errors;
+	}
+
+	value = PQgetvalue(result, rowNumber, 7);
+	nodeState->goalState = NodeStateFromString(value);
+	if (nodeState->goalState == NO_STATE)
+	{
+		log_error("Invalid node state \"%s\" returned by monitor", value);
+		++errors;
+	}
+
+	if (!pgresult_get_int(result, rowNumber, 8,
+						  &(nodeState->candidatePriority)))
+	{
+		log_error("Invalid failover candidate priority returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_bool(result, rowNumber, 9,
+						   &(nodeState->replicationQuorum)))
+	{
+		log_error("Invalid replication quorum returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_int(result, rowNumber, 10, &(nodeState->node.tli)))
+	{
+		log_error("Invalid timeline returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_lsn(result, rowNumber, 11, &(nodeState->node.lsn)))
+	{
+		log_error("Invalid LSN returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_int(result, rowNumber, 12, &(nodeState->health)))
+	{
+		log_error("Invalid node health returned by monitor");
+		++errors;
+	}
+
+	value = PQgetvalue(result, rowNumber, 13);
+	length = strlcpy(nodeState->citusClusterName, value, NAMEDATALEN);
+	if (length >= NAMEDATALEN)
+	{
+		log_error("Cluster name \"%s\" returned by monitor is %d characters, "
+				  "the maximum supported by pg_autoctl is %d",
+				  value, length, NAMEDATALEN - 1);
+		++errors;
+	}
+
+	if (!pgresult_get_double(result, rowNumber, 14, &(nodeState->healthLag)))
+	{
+		log_error("Invalid health lag returned by monitor");
+		++errors;
+	}
+
+	if (!pgresult_get_double(result, rowNumber, 15, &(nodeState->reportLag)))
+	{
+		log_error("Invalid report lag returned by monitor");
+		++errors;
+	}
+
+	/* 16 - formationid, only when querying all the formations */
+	if (PQnfields(result) > 16)
+	{
+		value = PQgetvalue(result, rowNumber, 16);
+		length = strlcpy(nodeState->formation, value, NAMEDATALEN);
+
+		if (length >= NAMEDATALEN)
+		{
+			log_error("Formation name \"%s\" returned by monitor is %d "
+					  "characters, the maximum supported by pg_autoctl is %d",
+					  value, length, NAMEDATALEN - 1);
+			++errors;
+		}
+	}
+
+	return errors == 0;
+}
+
+
+/*
+ * parseCurrentNodeStateArray parses an array of nodeStates, one entry per node
+ * in a given formation. It is also used by `pg_autoctl do bench parsers` on
+ * recorded result sets.
+ */
+bool
+parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray, PGresult *result)
+{
+	bool parsedOk = true;
+	int rowNumber = 0;
+
+	log_trace("parseCurrentNodeStateArray: %d", PQntuples(result));
+
+	/*
+	 * pgautofailover.current_state returns 14 columns, we add the health and
+	 * report lags, and the formation id when querying several formations.
+	 */
+	if (PQnfields(result) != 16 && PQnfields(result) != 17)
+	{
+		log_error("Query returned %d columns, expected 16 or 17",
+				  PQnfields(result));
+		return false;
+	}
+
+	if (!currentNodeStateArrayReserve(nodesArray, PQntuples(result)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	nodesArray->count = PQntuples(result);
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		CurrentNodeState *nodeState = &(nodesArray->nodes[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentNodeState(result, rowNumber, nodeState);
+	}
+
+	return parsedOk;
+}
+
+
+/*
+ * getCurrentState loops over pgautofailover.current_state() results and adds
+ * them to the context's nodes array.
+ */
+static void
+getCurrentState(void *ctx, PGresult *result)
+{
+	CurrentNodeStateContext *context = (CurrentNodeStateContext *) ctx;
+	CurrentNodeStateArray *nodesArray = context->nodesArray;
+
+	if (!parseCurrentNodeStateArray(nodesArray, result))
+	{
+		/* errors have already been logged */
+		context->parsedOK = false;
+		return;
+	}
+
+	context->parsedOK = true;
+}
+
+
+/*
+ * monitor_print_state_as_json prints to stdout the JSON representation of the
+ * current state on the monitor. The JSON objects are built on the monitor,
+ * one per node, and streamed to stdout as we receive them.
+ */
+bool
+monitor_print_state_as_json(Monitor *monitor, char *formation, int group)
+{
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql = "SELECT pgautofailover.current_state_json($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	log_trace("monitor_get_state_as_json(%s, %d)", formation, group);
+
+	IntString groupStr = intToString(group);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupStr.strValue;
+
+	if (!monitor_stream_json(pgsql, sql, paramCount, paramTypes, paramValues,
+							 true, stdout))
+	{
+		log_error("Failed to retrieve current state from the monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_get_fleet_state calls pgautofailover.fleet_state() on the monitor,
+ * which returns one row per group of all the formations, and fills-in the
+ * given fleetArray.
+ */
+bool
+monitor_get_fleet_state(Monitor *monitor, FleetGroupStateArray *fleetArray)
+{
+	FleetStateParseContext context = { { 0 }, fleetArray, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT formation_id, group_id, nodes, primary_name, primary_state, "
+		"       standbys, healthy_standbys, coalesce(max_lag_bytes, -1), "
+		"       in_flux "
+		"  FROM pgautofailover.fleet_state() "
+		" ORDER BY formation_id, group_id";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseFleetStateArray))
+	{
+		log_error("Failed to retrieve the fleet state from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse the fleet state from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseFleetStateArray parses the result of pgautofailover.fleet_state() into
+ * a FleetGroupStateArray.
+ */
+static void
+parseFleetStateArray(void *ctx, PGresult *result)
+{
+	FleetStateParseContext *context = (FleetStateParseContext *) ctx;
+	FleetGroupStateArray *fleetArray = context->fleetArray;
+
+	int nTuples = PQntuples(result);
+	int errors = 0;
+
+	if (PQnfields(result) != 9)
+	{
+		log_error("Query returned %d columns, expected 9", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (nTuples > fleetArray->capacity)
+	{
+		FleetGroupState *groups =
+			(FleetGroupState *) realloc(fleetArray->groups,
+										nTuples * sizeof(FleetGroupState));
+
+		if (groups == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOK = false;
+			return;
+		}
+
+		fleetArray->groups = groups;
+		fleetArray->capacity = nTuples;
+	}
+
+	fleetArray->count = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		FleetGroupState *group = &(fleetArray->groups[fleetArray->count]);
+
+		memset(group, 0, sizeof(FleetGroupState));
+
+		if (!stringToInt(PQgetvalue(result, rowNumber, 1), &(group->groupId)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 2), &(group->nodeCount)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 5),
+						 &(group->standbyCount)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 6),
+						 &(group->healthyStandbyCount)) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 7),
+						   &(group->maxLagBytes)))
+		{
+			log_error("Invalid fleet state values returned by the monitor "
+					  "for group %s of formation \"%s\"",
+					  PQgetvalue(result, rowNumber, 1),
+					  PQgetvalue(result, rowNumber, 0));
+			++errors;
+			continue;
+		}
+
+		strlcpy(group->formation, PQgetvalue(result, rowNumber, 0),
+				sizeof(group->formation));
+
+		/* a group without a primary has NULLs here */
+		if (!PQgetisnull(result, rowNumber, 3))
+		{
+			strlcpy(group->primaryName, PQgetvalue(result, rowNumber, 3),
+					sizeof(group->primaryName));
+
+			group->primaryState =
+				NodeStateFromString(PQgetvalue(result, rowNumber, 4));
+		}
+
+		group->inFlux = strcmp(PQgetvalue(result, rowNumber, 8), "t") == 0;
+
+		++fleetArray->count;
+	}
+
+	context->parsedOK = errors == 0;
+}
+
+
+/*
+ * monitor_fleet_state_array_free releases the memory used by the given
+ * fleetArray, which is then a valid empty array again.
+ */
+void
+monitor_fleet_state_array_free(FleetGroupStateArray *fleetArray)
+{
+	free(fleetArray->groups);
+
+	fleetArray->groups = NULL;
+	fleetArray->count = 0;
+	fleetArray->capacity = 0;
+}
+
+
+/*
+ * monitor_print_fleet_state prints one line per group of all the formations
+ * of the monitor, such as:
+ *
+ * Formation | Group | Primary | Primary State | Standbys |    Max Lag | In Flux
+ * ----------+-------+---------+---------------+----------+------------+--------
+ *   default |     0 |  node_1 |       primary |      2/2 |      32 kB |      no
+ *
+ * where the standbys column shows healthy secondary nodes over all the
+ * standby nodes of the group.
+ */
+bool
+monitor_print_fleet_state(Monitor *monitor)
+{
+	FleetGroupStateArray fleetArray = { 0 };
+
+	if (!monitor_get_fleet_state(monitor, &fleetArray))
+	{
+		/* errors have already been logged */
+		monitor_fleet_state_array_free(&fleetArray);
+		return false;
 	}
-	else if (strcmp(value, "citus") == 0 && nodeState->groupId == 0)
+
+	int formationSize = strlen("Formation");
+	int primarySize = strlen("Primary");
+	int stateSize = strlen("Primary State");
+
+	for (int index = 0; index < fleetArray.count; index++)
 	{
-		nodeState->pgKind = NODE_KIND_CITUS_COORDINATOR;
+		FleetGroupState *group = &(fleetArray.groups[index]);
+
+		formationSize = Max(formationSize, strlen(group->formation));
+		primarySize = Max(primarySize, strlen(group->primaryName));
+		stateSize =
+			Max(stateSize, strlen(NodeStateToString(group->primaryState)));
 	}
-	else if (strcmp(value, "citus") == 0 && nodeState->groupId > 0)
+
+	char dashes[BUFSIZE] = { 0 };
+
+	memset(dashes, '-', sizeof(dashes) - 1);
+
+	fformat(stdout, "%*s | %5s | %*s | %*s | %8s | %10s | %7s\n",
+			formationSize, "Formation",
+			"Group",
+			primarySize, "Primary",
+			stateSize, "Primary State",
+			"Standbys", "Max Lag", "In Flux");
+
+	fformat(stdout, "%.*s-+-%.5s-+-%.*s-+-%.*s-+-%.8s-+-%.10s-+-%.7s\n",
+			formationSize, dashes,
+			dashes,
+			primarySize, dashes,
+			stateSize, dashes,
+			dashes, dashes, dashes);
+
+	for (int index = 0; index < fleetArray.count; index++)
 	{
-		nodeState->pgKind = NODE_KIND_CITUS_WORKER;
+		FleetGroupState *group = &(fleetArray.groups[index]);
+		char standbys[BUFSIZE] = { 0 };
+		char lag[BUFSIZE] = { 0 };
+
+		sformat(standbys, sizeof(standbys), "%d/%d",
+				group->healthyStandbyCount, group->standbyCount);
+
+		if (group->maxLagBytes >= 0)
+		{
+			(void) pretty_print_bytes(lag, sizeof(lag), group->maxLagBytes);
+		}
+
+		fformat(stdout, "%*s | %5d | %*s | %*s | %8s | %10s | %7s\n",
+				formationSize, group->formation,
+				group->groupId,
+				primarySize, group->primaryName,
+				stateSize,
+				IS_EMPTY_STRING_BUFFER(group->primaryName)
+				? "none"
+				: NodeStateToString(group->primaryState),
+				standbys,
+				lag,
+				group->inFlux ? "yes" : "no");
 	}
-	else
+
+	fformat(stdout, "\n");
+
+	monitor_fleet_state_array_free(&fleetArray);
+
+	return true;
+}
+
+
+/*
+ * monitor_print_fleet_state_as_json prints the fleet state as a JSON array,
+ * with one object per group of all the formations of the monitor.
+ */
+bool
+monitor_print_fleet_state_as_json(Monitor *monitor)
+{
+	FleetGroupStateArray fleetArray = { 0 };
+
+	if (!monitor_get_fleet_state(monitor, &fleetArray))
 	{
-		log_error("Invalid groupId %d with formation kind \"%s\"",
-				  nodeState->groupId, value);
-		++errors;
+		/* errors have already been logged */
+		monitor_fleet_state_array_free(&fleetArray);
+		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 5);
-	if (!stringToInt64(value, &(nodeState->node.nodeId)))
+	JSON_Value *js = json_value_init_array();
+	JSON_Array *jsArray = json_value_get_array(js);
+
+	for (int index = 0; index < fleetArray.count; index++)
 	{
-		log_error("Invalid nodeId \"%s\" returned by monitor", value);
-		++errors;
+		FleetGroupState *group = &(fleetArray.groups[index]);
+
+		JSON_Value *jsGroup = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(jsGroup);
+
+		json_object_set_string(jsObj, "formation", group->formation);
+		json_object_set_number(jsObj, "group_id", (double) group->groupId);
+		json_object_set_number(jsObj, "nodes", (double) group->nodeCount);
+
+		if (IS_EMPTY_STRING_BUFFER(group->primaryName))
+		{
+			json_object_set_null(jsObj, "primary_name");
+			json_object_set_null(jsObj, "primary_state");
+		}
+		else
+		{
+			json_object_set_string(jsObj, "primary_name", group->primaryName);
+			json_object_set_string(jsObj, "primary_state",
+								   NodeStateToString(group->primaryState));
+		}
+
+		json_object_set_number(jsObj, "standbys",
+							   (double) group->standbyCount);
+		json_object_set_number(jsObj, "healthy_standbys",
+							   (double) group->healthyStandbyCount);
+
+		if (group->maxLagBytes >= 0)
+		{
+			json_object_set_number(jsObj, "max_lag_bytes",
+								   (double) group->maxLagBytes);
+		}
+		else
+		{
+			json_object_set_null(jsObj, "max_lag_bytes");
+		}
+
+		json_object_set_boolean(jsObj, "in_flux", group->inFlux);
+
+		json_array_append_value(jsArray, jsGroup);
 	}
 
-	value = PQgetvalue(result, rowNumber, 6);
-	nodeState->reportedState = NodeStateFromString(value);
-	if (nodeState->reportedState == NO_STATE)
+	char *serialized_string = json_serialize_to_string_pretty(js);
+
+	fformat(stdout, "%s\n", serialized_string);
+
+	json_free_serialized_string(serialized_string);
+	json_value_free(js);
+
+	monitor_fleet_state_array_free(&fleetArray);
+
+	return true;
+}
+
+
+/*
+ * monitor_print_last_events calls the function pgautofailover.last_events on
+ * the monitor, and prints a line of output per event obtained.
+ */
+bool
+monitor_print_last_events(Monitor *monitor, char *formation, int group, int count)
+{
+	LastEventsPrintContext context = { { 0 }, 0, true };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	char *sql = NULL;
+	int paramCount = 0;
+	Oid paramTypes[3];
+	const char *paramValues[3];
+	IntString countStr;
+	IntString groupStr;
+
+	log_trace("monitor_print_last_events(%s, %d, %d)", formation, group, count);
+
+	switch (group)
 	{
-		log_error("Invalid node state \"%s\" returned by monitor", value);
-		++errors;
+		case -1:
+		{
+			sql =
+				"SELECT eventTime, nodeid, groupid, "
+				"       reportedstate, goalState, description "
+				"  FROM pgautofailover.last_events($1, count => $2)";
+
+			countStr = intToString(count);
+
+			paramCount = 2;
+			paramTypes[0] = TEXTOID;
+			paramValues[0] = formation;
+			paramTypes[1] = INT4OID;
+			paramValues[1] = countStr.strValue;
+
+			break;
+		}
+
+		default:
+		{
+			sql =
+				"SELECT eventTime, nodeid, groupid, "
+				"       reportedstate, goalState, description "
+				"  FROM pgautofailover.last_events($1,$2,$3)";
+
+			countStr = intToString(count);
+			groupStr = intToString(group);
+
+			paramCount = 3;
+			paramTypes[0] = TEXTOID;
+			paramValues[0] = formation;
+			paramTypes[1] = INT4OID;
+			paramValues[1] = groupStr.strValue;
+			paramTypes[2] = INT4OID;
+			paramValues[2] = countStr.strValue;
+
+			break;
+		}
 	}
 
-	value = PQgetvalue(result, rowNumber, 7);
-	nodeState->goalState = NodeStateFromString(value);
-	if (nodeState->goalState == NO_STATE)
+	/* print the events as we receive them, see printLastEvents */
+	bool success = pgsql_execute_single_row(pgsql, sql,
+											paramCount, paramTypes, paramValues,
+											&context, &printLastEvents);
+
+	if (!success)
 	{
-		log_error("Invalid node state \"%s\" returned by monitor", value);
-		++errors;
+		fflush(stdout);
+		log_error("Failed to retrieve last events from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		return false;
+	}
+
+	if (context.rowCount == 0)
+	{
+		(void) printLastEventsHeader();
+	}
+
+	fformat(stdout, "\n");
+
+	return true;
+}
+
+
+/*
+ * monitor_print_last_events_as_json calls the function
+ * pgautofailover.last_events_json on the monitor, and streams the result as a
+ * JSON array to the given stream (stdout, typically).
+ */
+bool
+monitor_print_last_events_as_json(Monitor *monitor,
+								  char *formation, int group,
+								  int count,
+								  FILE *stream)
+{
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql = "SELECT pgautofailover.last_events_json($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, INT4OID, INT4OID };
+	const char *paramValues[3];
+
+	IntString groupStr = intToString(group);
+	IntString countStr = intToString(count);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupStr.strValue;
+	paramValues[2] = countStr.strValue;
+
+	if (!monitor_stream_json(pgsql, sql, paramCount, paramTypes, paramValues,
+							 true, stream))
+	{
+		log_error("Failed to retrieve the last %d events from the monitor",
+				  count);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * printLastEventsHeader prints the header of the output of
+ * monitor_print_last_events.
+ */
+static void
+printLastEventsHeader(void)
+{
+	fformat(stdout, "%30s | %6s | %19s | %19s | %s\n",
+			"Event Time", "Node",
+			"Current State", "Assigned State", "Comment");
+	fformat(stdout, "%30s-+-%6s-+-%19s-+-%19s-+-%10s\n",
+			"------------------------------",
+			"------", "-------------------",
+			"-------------------", "----------");
+}
+
+
+/*
+ * printLastEvents prints the pgautofailover.last_events() rows received in
+ * the single-row mode of the query in monitor_print_last_events, one per
+ * line. The columns have a fixed width, so that we don't need to see all the
+ * events before printing the first one.
+ */
+static void
+printLastEvents(void *ctx, PGresult *result)
+{
+	LastEventsPrintContext *context = (LastEventsPrintContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 6)
+	{
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		char *eventTime = PQgetvalue(result, rowNumber, 0);
+		char *nodeId = PQgetvalue(result, rowNumber, 1);
+		char *groupId = PQgetvalue(result, rowNumber, 2);
+		char *currentState = PQgetvalue(result, rowNumber, 3);
+		char *goalState = PQgetvalue(result, rowNumber, 4);
+		char *description = PQgetvalue(result, rowNumber, 5);
+		char node[BUFSIZE];
+
+		if (context->rowCount == 0)
+		{
+			(void) printLastEventsHeader();
+		}
+
+		/* for our grid alignment output it's best to have a single col here */
+		sformat(node, BUFSIZE, "%s/%s", groupId, nodeId);
+
+		fformat(stdout, "%30s | %6s | %19s | %19s | %s\n",
+				eventTime, node,
+				currentState, goalState, description);
+
+		++context->rowCount;
+	}
+}
+
+
+/*
+ * monitor_print_failover_timeline calls the function
+ * pgautofailover.failover_timeline on the monitor, and prints a line of
+ * output per event of the last failover of the given group.
+ */
+bool
+monitor_print_failover_timeline(Monitor *monitor, char *formation, int group)
+{
+	MonitorAssignedStateParseContext context = { 0 };
+	PGSQL *pgsql = &monitor->pgsql;
+	char *sql =
+		"SELECT eventtime, nodeid, phase, "
+		"       round(extract(epoch from elapsed) * 1000), "
+		"       round(extract(epoch from duration) * 1000), "
+		"       reportedstate, goalstate, description "
+		"  FROM pgautofailover.failover_timeline($1, $2)";
+
+	IntString groupStr = intToString(group);
+
+	const Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2] = { formation, groupStr.strValue };
+	int paramCount = 2;
+
+	log_trace("monitor_print_failover_timeline(%s, %d)", formation, group);
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &printFailoverTimeline))
+	{
+		log_error("Failed to retrieve the failover timeline from the monitor");
+		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 8);
-	if (!stringToInt(value, &(nodeState->candidatePriority)))
-	{
-		log_error("Invalid failover candidate priority \"%s\" "
-				  "returned by monitor", value);
-		++errors;
-	}
+	if (!context.parsedOK)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_print_failover_timeline_as_json calls the function
+ * pgautofailover.failover_timeline on the monitor, and prints the result as a
+ * JSON array to the given stream (stdout, typically).
+ */
+bool
+monitor_print_failover_timeline_as_json(Monitor *monitor,
+										char *formation, int group,
+										FILE *stream)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	char *sql =
+		"SELECT jsonb_pretty("
+		"coalesce(jsonb_agg(row_to_json(event) order by event.eventid), '[]'))"
+		" FROM pgautofailover.failover_timeline($1, $2) as event";
+
+	IntString groupStr = intToString(group);
 
-	value = PQgetvalue(result, rowNumber, 9);
-	if (value == NULL || ((*value != 't') && (*value != 'f')))
-	{
-		log_error("Invalid replication quorum \"%s\" "
-				  "returned by monitor", value);
-		++errors;
-	}
-	else
+	const Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2] = { formation, groupStr.strValue };
+	int paramCount = 2;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
-		nodeState->replicationQuorum = (*value) == 't';
+		log_error("Failed to retrieve the failover timeline from the monitor");
+		return false;
 	}
 
-	value = PQgetvalue(result, rowNumber, 10);
-	if (!stringToInt(value, &(nodeState->node.tli)))
+	if (!context.parsedOk)
 	{
-		log_error("Invalid timeline \"%s\" returned by monitor", value);
-		++errors;
+		log_error("Failed to parse the failover timeline from the monitor");
+		log_error("%s", context.strVal);
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
 	}
 
-	/* we trust Postgres pg_lsn data type to fit in our PG_LSN_MAXLENGTH */
-	value = PQgetvalue(result, rowNumber, 11);
-	strlcpy(nodeState->node.lsn, value, PG_LSN_MAXLENGTH);
+	fformat(stream, "%s\n", context.strVal);
+	free(context.strVal);
 
-	value = PQgetvalue(result, rowNumber, 12);
-	if (!stringToInt(value, &(nodeState->health)))
-	{
-		log_error("Invalid node health \"%s\" returned by monitor", value);
-		++errors;
-	}
+	return true;
+}
 
-	value = PQgetvalue(result, rowNumber, 13);
-	length = strlcpy(nodeState->citusClusterName, value, NAMEDATALEN);
-	if (length >= NAMEDATALEN)
+
+/*
+ * printFailoverTimeline loops over pgautofailover.failover_timeline() results
+ * and prints them, one per line.
+ */
+static void
+printFailoverTimeline(void *ctx, PGresult *result)
+{
+	MonitorAssignedStateParseContext *context =
+		(MonitorAssignedStateParseContext *) ctx;
+	int currentTupleIndex = 0;
+	int nTuples = PQntuples(result);
+
+	log_trace("printFailoverTimeline: %d tuples", nTuples);
+
+	if (PQnfields(result) != 8)
 	{
-		log_error("Cluster name \"%s\" returned by monitor is %d characters, "
-				  "the maximum supported by pg_autoctl is %d",
-				  value, length, NAMEDATALEN - 1);
-		++errors;
+		log_error("Query returned %d columns, expected 8", PQnfields(result));
+		context->parsedOK = false;
+		return;
 	}
 
-	value = PQgetvalue(result, rowNumber, 14);
-
-	if (!stringToDouble(value, &(nodeState->healthLag)))
+	if (nTuples == 0)
 	{
-		log_error("Invalid health lag \"%s\" returned by monitor", value);
-		++errors;
+		fformat(stdout, "No failover found for this group\n");
+		context->parsedOK = true;
+		return;
 	}
 
-	value = PQgetvalue(result, rowNumber, 15);
+	fformat(stdout, "%30s | %6s | %12s | %10s | %10s | %19s | %19s | %s\n",
+			"Event Time", "Node", "Phase", "Elapsed ms", "Duration",
+			"Current State", "Assigned State", "Comment");
+	fformat(stdout, "%30s-+-%6s-+-%12s-+-%10s-+-%10s-+-%19s-+-%19s-+-%10s\n",
+			"------------------------------",
+			"------", "------------", "----------", "----------",
+			"-------------------", "-------------------", "----------");
 
-	if (!stringToDouble(value, &(nodeState->reportLag)))
+	for (currentTupleIndex = 0; currentTupleIndex < nTuples; currentTupleIndex++)
 	{
-		log_error("Invalid report lag \"%s\" returned by monitor", value);
-		++errors;
+		char *eventTime = PQgetvalue(result, currentTupleIndex, 0);
+		char *nodeId = PQgetvalue(result, currentTupleIndex, 1);
+		char *phase = PQgetvalue(result, currentTupleIndex, 2);
+		char *elapsed = PQgetvalue(result, currentTupleIndex, 3);
+		char *duration = PQgetvalue(result, currentTupleIndex, 4);
+		char *currentState = PQgetvalue(result, currentTupleIndex, 5);
+		char *goalState = PQgetvalue(result, currentTupleIndex, 6);
+		char *description = PQgetvalue(result, currentTupleIndex, 7);
+
+		fformat(stdout, "%30s | %6s | %12s | %10s | %10s | %19s | %19s | %s\n",
+				eventTime, nodeId, phase, elapsed, duration,
+				currentState, goalState, description);
 	}
+	fformat(stdout, "\n");
 
-	return errors == 0;
+	context->parsedOK = true;
 }
 
 
 /*
- * parseCurrentNodeStateArray parses an array of up to NODE_ARRAY_MAX_COUNT
- * nodeStates, one entry per node in a given formation.
+ * monitor_get_current_state_of_nodes gets the current state of only the
+ * given nodes of a formation, in the same format as monitor_get_current_state.
  */
-static bool
-parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray, PGresult *result)
+bool
+monitor_get_current_state_of_nodes(Monitor *monitor, char *formation,
+								   MonitorChangedNodes *changes,
+								   CurrentNodeStateArray *nodesArray)
 {
-	bool parsedOk = true;
-	int rowNumber = 0;
+	CurrentNodeStateContext context = { { 0 }, nodesArray, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql =
+		"  SELECT formation_kind, nodename, nodehost, nodeport, "
+		"         group_id, node_id, "
+		"         current_group_state, assigned_group_state, "
+		"         candidate_priority, replication_quorum, "
+		"         reported_tli, reported_lsn, health, nodecluster, "
+		"         health_lag, report_lag"
+		"    FROM pgautofailover.current_state($1) cs "
+		"   WHERE node_id = any($2::bigint[]) "
+		"ORDER BY group_id, node_id";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2];
 
-	log_trace("parseCurrentNodeStateArray: %d", PQntuples(result));
+	/* build a Postgres array literal of the node ids */
+	PQExpBuffer nodeIds = createPQExpBuffer();
 
-	/* keep a NULL entry to mark the end of the array */
-	if (PQntuples(result) > NODE_ARRAY_MAX_COUNT)
+	if (nodeIds == NULL)
 	{
-		log_error("Query returned %d rows, pg_auto_failover supports only up "
-				  "to %d standby nodes at the moment",
-				  PQntuples(result), NODE_ARRAY_MAX_COUNT);
+		log_error(ALLOCATION_FAILED_ERROR);
 		return false;
 	}
 
-	/* pgautofailover.current_state returns 11 columns */
-	if (PQnfields(result) != 16)
+	appendPQExpBufferStr(nodeIds, "{");
+
+	for (int index = 0; index < changes->count; index++)
 	{
-		log_error("Query returned %d columns, expected 16", PQnfields(result));
+		appendPQExpBuffer(nodeIds, "%s%" PRId64,
+						  index == 0 ? "" : ",",
+						  changes->nodeIds[index]);
+	}
+
+	appendPQExpBufferStr(nodeIds, "}");
+
+	if (PQExpBufferBroken(nodeIds))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		destroyPQExpBuffer(nodeIds);
 		return false;
 	}
 
-	nodesArray->count = PQntuples(result);
+	paramValues[0] = formation;
+	paramValues[1] = nodeIds->data;
 
-	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	bool success =
+		pgsql_execute_with_params_binary(pgsql, sql,
+										 paramCount, paramTypes, paramValues,
+										 &context, &getCurrentState);
+
+	destroyPQExpBuffer(nodeIds);
+
+	if (!success)
 	{
-		CurrentNodeState *nodeState = &(nodesArray->nodes[rowNumber]);
+		log_error("Failed to retrieve current state from the monitor");
+		return false;
+	}
 
-		parsedOk = parsedOk &&
-				   parseCurrentNodeState(result, rowNumber, nodeState);
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse current state from the monitor");
+		return false;
 	}
 
-	return parsedOk;
+	return true;
 }
 
 
 /*
- * getCurrentState loops over pgautofailover.current_state() results and adds
- * them to the context's nodes array.
+ * monitor_get_events_since gets at most count events of the given formation
+ * and group that happened after the given eventId, in the given eventsArray.
  */
-static void
-getCurrentState(void *ctx, PGresult *result)
+bool
+monitor_get_events_since(Monitor *monitor, char *formation, int group,
+						 int64_t eventId, int count,
+						 MonitorEventsArray *eventsArray)
 {
-	CurrentNodeStateContext *context = (CurrentNodeStateContext *) ctx;
-	CurrentNodeStateArray *nodesArray = context->nodesArray;
+	MonitorEventsArrayParseContext context = { { 0 }, eventsArray, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql =
+		"SELECT eventId, to_char(eventTime, 'YYYY-MM-DD HH24:MI:SS'), "
+		"       formationId, nodeid, groupid, "
+		"       nodename, nodehost, nodeport, "
+		"       reportedstate, goalState, "
+		"       reportedrepstate, reportedtli, reportedlsn, "
+		"       candidatepriority, replicationquorum, "
+		"       description "
+		"  FROM pgautofailover.events_since($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { INT8OID, INT4OID, TEXTOID, INT4OID };
+	const char *paramValues[4];
 
-	if (!parseCurrentNodeStateArray(nodesArray, result))
+	IntString eventIdStr = intToString(eventId);
+	IntString countStr = intToString(count);
+	IntString groupStr = intToString(group);
+
+	paramValues[0] = eventIdStr.strValue;
+	paramValues[1] = countStr.strValue;
+	paramValues[2] = formation;
+	paramValues[3] = groupStr.strValue;
+
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &context, &getLastEvents))
 	{
-		/* errors have already been logged */
-		context->parsedOK = false;
-		return;
+		log_error("Failed to retrieve the events since event %" PRId64
+				  " from the monitor",
+				  eventId);
+		return false;
 	}
 
-	context->parsedOK = true;
+	if (!context.parsedOK)
+	{
+		log_error("Failed to parse the events since event %" PRId64
+				  " from the monitor, see above for details",
+				  eventId);
+		return false;
+	}
+
+	return true;
 }
 
 
 /*
- * monitor_print_state_as_json prints to given stream a single string that
- * contains the JSON representation of the current state on the monitor.
+ * monitor_listen_state_changes sends the LISTEN commands to receive the
+ * state notifications of the given formation, or of the given group when
+ * group is not -1, or of all the formations when formation is NULL, on the
+ * monitor notification connection. The notifications
+ * are then consumed with monitor_consume_state_changes() once the socket
+ * returned by monitor_notification_socket() is ready to be read.
  */
 bool
-monitor_print_state_as_json(Monitor *monitor, char *formation, int group)
+monitor_listen_state_changes(Monitor *monitor, char *formation, int group)
 {
-	SingleValueResultContext context = { 0 };
-	PGSQL *pgsql = &monitor->pgsql;
-	char *sql = NULL;
-	int paramCount = 0;
-	Oid paramTypes[2];
-	const char *paramValues[2];
-	IntString groupStr;
-
-	log_trace("monitor_get_state_as_json(%s, %d)", formation, group);
+	char channel[BUFSIZE] = { 0 };
+	char *channels[] = { channel, NULL };
 
-	context.resultType = PGSQL_RESULT_STRING;
-	context.parsedOk = false;
-
-	switch (group)
+	if (formation == NULL)
 	{
-		case -1:
-		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(state)), '[]'))"
-				  " FROM pgautofailover.current_state($1) as state";
+		strlcpy(channel, "state", sizeof(channel));
+	}
+	else if (group < 0)
+	{
+		(void) monitor_formation_state_channel(formation,
+											   channel, sizeof(channel));
+	}
+	else
+	{
+		(void) monitor_group_state_channel(formation, group,
+										   channel, sizeof(channel));
+	}
 
-			paramCount = 1;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
+	return pgsql_listen(&(monitor->notificationClient), channels);
+}
 
-			break;
-		}
 
-		default:
-		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(state)), '[]'))"
-				  "FROM pgautofailover.current_state($1,$2) as state";
+/*
+ * monitor_notification_socket returns the socket of the monitor notification
+ * connection, or -1 when the connection is not open.
+ */
+int
+monitor_notification_socket(Monitor *monitor)
+{
+	PGconn *connection = monitor->notificationClient.connection;
 
-			groupStr = intToString(group);
+	return connection == NULL ? -1 : PQsocket(connection);
+}
 
-			paramCount = 2;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = groupStr.strValue;
 
-			break;
-		}
+/*
+ * monitor_consume_state_changes reads the notifications received on the
+ * monitor notification connection without waiting, and adds the id of the
+ * nodes that changed state to the given changes. When the connection has
+ * been lost, it is closed and we return false.
+ */
+bool
+monitor_consume_state_changes(Monitor *monitor, MonitorChangedNodes *changes)
+{
+	PGSQL *pgsql = &(monitor->notificationClient);
+	PGnotify *notify;
+
+	if (pgsql->connection == NULL)
+	{
+		return false;
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (PQconsumeInput(pgsql->connection) == 0 ||
+		PQstatus(pgsql->connection) != CONNECTION_OK)
 	{
-		log_error("Failed to retrieve current state from the monitor");
+		log_warn("Lost connection to the monitor: %s",
+				 PQerrorMessage(pgsql->connection));
+		pgsql_finish(pgsql);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	while ((notify = PQnotifies(pgsql->connection)) != NULL)
 	{
-		log_error("Failed to parse current state from the monitor");
-		log_error("%s", context.strVal);
-		if (context.strVal)
+		CurrentNodeState nodeState = { 0 };
+
+		if (monitor_is_state_channel(notify->relname) &&
+			parse_state_notification_message(&nodeState, notify->extra))
 		{
-			free(context.strVal);
+			bool known = false;
+
+			for (int index = 0; index < changes->count; index++)
+			{
+				if (changes->nodeIds[index] == nodeState.node.nodeId)
+				{
+					known = true;
+					break;
+				}
+			}
+
+			if (!known && changes->count < MONITOR_CHANGED_NODES_MAX_COUNT)
+			{
+				changes->nodeIds[changes->count++] = nodeState.node.nodeId;
+			}
+			else if (!known)
+			{
+				changes->overflow = true;
+			}
 		}
-		return false;
-	}
 
-	fformat(stdout, "%s\n", context.strVal);
-	free(context.strVal);
+		PQfreemem(notify);
+		PQconsumeInput(pgsql->connection);
+	}
 
 	return true;
 }
 
 
 /*
- * monitor_print_last_events calls the function pgautofailover.last_events on
- * the monitor, and prints a line of output per event obtained.
+ * monitor_get_last_events_start sets eventId to the id of the event found
+ * just before the last count events of the given formation and group, so
+ * that events_since(eventId) returns those last count events first.
  */
 bool
-monitor_print_last_events(Monitor *monitor, char *formation, int group, int count)
+monitor_get_last_events_start(Monitor *monitor, char *formation, int group,
+							  int count, int64_t *eventId)
 {
-	MonitorAssignedStateParseContext context = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
 	PGSQL *pgsql = &monitor->pgsql;
-	char *sql = NULL;
-	int paramCount = 0;
-	Oid paramTypes[3];
+	const char *sql =
+		"SELECT coalesce(min(eventid) - 1, 0) "
+		"  FROM ( "
+		"         SELECT eventid "
+		"           FROM pgautofailover.event "
+		"          WHERE formationid = $1 "
+		"            AND ($2 < 0 OR groupid = $2) "
+		"       ORDER BY eventid DESC "
+		"          LIMIT $3 "
+		"       ) AS last_events";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, INT4OID, INT4OID };
 	const char *paramValues[3];
-	IntString countStr;
-	IntString groupStr;
-
-	log_trace("monitor_print_last_events(%s, %d, %d)", formation, group, count);
-
-	switch (group)
-	{
-		case -1:
-		{
-			sql =
-				"SELECT eventTime, nodeid, groupid, "
-				"       reportedstate, goalState, description "
-				"  FROM pgautofailover.last_events($1, count => $2)";
-
-			countStr = intToString(count);
-
-			paramCount = 2;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = countStr.strValue;
-
-			break;
-		}
-
-		default:
-		{
-			sql =
-				"SELECT eventTime, nodeid, groupid, "
-				"       reportedstate, goalState, description "
-				"  FROM pgautofailover.last_events($1,$2,$3)";
-
-			countStr = intToString(count);
-			groupStr = intToString(group);
 
-			paramCount = 3;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = groupStr.strValue;
-			paramTypes[2] = INT4OID;
-			paramValues[2] = countStr.strValue;
+	IntString groupStr = intToString(group);
+	IntString countStr = intToString(count);
 
-			break;
-		}
-	}
+	paramValues[0] = formation;
+	paramValues[1] = groupStr.strValue;
+	paramValues[2] = countStr.strValue;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
-								   &context, &printLastEvents))
+								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to retrieve last events from the monitor");
+		log_error("Failed to retrieve the last %d events from the monitor",
+				  count);
 		return false;
 	}
 
-	if (!context.parsedOK)
+	if (!context.parsedOk)
 	{
+		log_error("Failed to parse the last %d events from the monitor",
+				  count);
 		return false;
 	}
 
+	*eventId = (int64_t) context.bigint;
+
 	return true;
 }
 
 
 /*
- * monitor_print_last_events_as_json calls the function
- * pgautofailover.last_events on the monitor, and prints the result as a JSON
- * array to the given stream (stdout, typically).
+ * monitor_print_events_since_header prints the header of the output of
+ * monitor_print_events_since, which adds the event id to the columns printed
+ * by monitor_print_last_events so that the user can resume with --since.
+ */
+void
+monitor_print_events_since_header()
+{
+	fformat(stdout, "%8s | %30s | %6s | %19s | %19s | %s\n",
+			"Event", "Event Time", "Node",
+			"Current State", "Assigned State", "Comment");
+	fformat(stdout, "%8s-+-%30s-+-%6s-+-%19s-+-%19s-+-%10s\n",
+			"--------", "------------------------------",
+			"------", "-------------------",
+			"-------------------", "----------");
+}
+
+
+/*
+ * monitor_print_events_since prints all the events of the given formation
+ * and group that happened after lastEventId, which is updated to the id of
+ * the last event printed. The events are fetched in pages of
+ * MONITOR_EVENTS_PAGE_SIZE events using pgautofailover.events_since, and each
+ * page is streamed to stdout one row at a time, so that we never hold more
+ * than one event in memory.
+ *
+ * With json, each event is printed as a JSON object on its own line.
  */
 bool
-monitor_print_last_events_as_json(Monitor *monitor,
-								  char *formation, int group,
-								  int count,
-								  FILE *stream)
+monitor_print_events_since(Monitor *monitor, char *formation, int group,
+						   int64_t *lastEventId, bool json)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
 	PGSQL *pgsql = &monitor->pgsql;
-	char *sql = NULL;
-	int paramCount = 0;
-	Oid paramTypes[3];
-	const char *paramValues[3];
-	IntString countStr;
-	IntString groupStr;
+	const char *sql =
+		"SELECT eventid, eventtime, groupid, nodeid, "
+		"       reportedstate, goalstate, description, row_to_json(e) "
+		"  FROM pgautofailover.events_since($1, $2, $3, $4) AS e";
+	int paramCount = 4;
+	Oid paramTypes[4] = { INT8OID, INT4OID, TEXTOID, INT4OID };
+	const char *paramValues[4];
 
-	switch (group)
+	IntString countStr = intToString(MONITOR_EVENTS_PAGE_SIZE);
+	IntString groupStr = intToString(group);
+
+	paramValues[1] = countStr.strValue;
+	paramValues[2] = formation;
+	paramValues[3] = groupStr.strValue;
+
+	for (;;)
 	{
-		case -1:
-		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(event)), '[]'))"
-				  " FROM pgautofailover.last_events($1, count => $2) as event";
+		EventsSinceParseContext context = { { 0 }, json, *lastEventId, 0, true };
+		IntString eventIdStr = intToString(*lastEventId);
 
-			countStr = intToString(count);
+		paramValues[0] = eventIdStr.strValue;
 
-			paramCount = 2;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = countStr.strValue;
+		bool success =
+			pgsql_execute_single_row(pgsql, sql,
+									 paramCount, paramTypes, paramValues,
+									 &context, &printEventSince);
 
-			break;
+		fflush(stdout);
+
+		/* the events we printed before a failure are not printed again */
+		*lastEventId = context.lastEventId;
+
+		if (!success || !context.parsedOK)
+		{
+			log_error("Failed to retrieve the events since event %" PRId64
+					  " from the monitor",
+					  *lastEventId);
+			return false;
 		}
 
-		default:
+		if (context.rowCount < MONITOR_EVENTS_PAGE_SIZE)
 		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(event)), '[]'))"
-				  " FROM * FROM pgautofailover.last_events($1,$2,$3) as event";
+			break;
+		}
+	}
 
-			countStr = intToString(count);
-			groupStr = intToString(group);
+	return true;
+}
 
-			paramCount = 3;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = groupStr.strValue;
-			paramTypes[2] = INT4OID;
-			paramValues[2] = countStr.strValue;
 
-			break;
+/*
+ * printEventSince prints the events received in the single-row mode of the
+ * query in monitor_print_events_since.
+ */
+static void
+printEventSince(void *ctx, PGresult *result)
+{
+	EventsSinceParseContext *context = (EventsSinceParseContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 8)
+	{
+		log_error("Query returned %d columns, expected 8", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		char *eventId = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToInt64(eventId, &(context->lastEventId)))
+		{
+			log_error("Invalid event ID \"%s\" returned by monitor", eventId);
+			context->parsedOK = false;
+			return;
+		}
+
+		if (context->json)
+		{
+			fformat(stdout, "%s\n", PQgetvalue(result, rowNumber, 7));
+		}
+		else
+		{
+			char *eventTime = PQgetvalue(result, rowNumber, 1);
+			char *groupId = PQgetvalue(result, rowNumber, 2);
+			char *nodeId = PQgetvalue(result, rowNumber, 3);
+			char *currentState = PQgetvalue(result, rowNumber, 4);
+			char *goalState = PQgetvalue(result, rowNumber, 5);
+			char *description = PQgetvalue(result, rowNumber, 6);
+			char node[BUFSIZE];
+
+			/* for our grid alignment output it's best to have a single col */
+			sformat(node, BUFSIZE, "%s/%s", groupId, nodeId);
+
+			fformat(stdout, "%8s | %30s | %6s | %19s | %19s | %s\n",
+					eventId, eventTime, node,
+					currentState, goalState, description);
 		}
+
+		++context->rowCount;
 	}
+}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+
+/*
+ * monitor_follow_events prints the new events of the given formation and
+ * group as they happen, until we are asked to stop. We LISTEN to the state
+ * notifications of the formation or group and only fetch the new events when
+ * we receive one. Events that are not associated with a state notification
+ * are fetched at least every MONITOR_FOLLOW_EVENTS_POLL_INTERVAL seconds.
+ */
+bool
+monitor_follow_events(Monitor *monitor, char *formation, int group,
+					  int64_t lastEventId, bool json)
+{
+	char channel[BUFSIZE] = { 0 };
+	char *channels[] = { channel, NULL };
+
+	bool fetchEvents = false;
+	uint64_t lastFetchTime = time(NULL);
+
+	if (group < 0)
 	{
-		log_error("Failed to retrieve the last %d events from the monitor",
-				  count);
-		return false;
+		(void) monitor_formation_state_channel(formation,
+											   channel, sizeof(channel));
+	}
+	else
+	{
+		(void) monitor_group_state_channel(formation, group,
+										   channel, sizeof(channel));
 	}
 
-	if (!context.parsedOk)
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
 	{
-		log_error("Failed to parse %d last events from the monitor", count);
-		log_error("%s", context.strVal);
-		if (context.strVal)
+		uint64_t now = time(NULL);
+
+		if (fetchEvents ||
+			(now - lastFetchTime) >= MONITOR_FOLLOW_EVENTS_POLL_INTERVAL)
 		{
-			free(context.strVal);
+			if (!monitor_print_events_since(monitor, formation, group,
+											&lastEventId, json))
+			{
+				log_warn("Failed to fetch the new events, retrying");
+			}
+
+			lastFetchTime = now;
 		}
-		return false;
-	}
 
-	fformat(stream, "%s\n", context.strVal);
-	free(context.strVal);
+		FollowEventsNotificationContext context = { false };
+
+		if (!monitor_process_notifications(
+				monitor,
+				PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000,
+				channels,
+				(void *) &context,
+				&monitor_notification_process_follow_events))
+		{
+			/* we might have lost the connection, don't retry too fast */
+			pg_usleep(PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000 * 1000);
+		}
+
+		fetchEvents = context.received;
+	}
 
 	return true;
 }
 
 
 /*
- * printLastEcvents loops over pgautofailover.last_events() results and prints
- * them, one per line.
+ * monitor_notification_process_follow_events is a Notification Processing
+ * Function that registers that a state notification has been received, which
+ * means that new events are available.
  */
 static void
-printLastEvents(void *ctx, PGresult *result)
+monitor_notification_process_follow_events(void *context,
+										   CurrentNodeState *nodeState)
 {
-	MonitorAssignedStateParseContext *context =
-		(MonitorAssignedStateParseContext *) ctx;
-	int currentTupleIndex = 0;
-	int nTuples = PQntuples(result);
+	FollowEventsNotificationContext *ctx =
+		(FollowEventsNotificationContext *) context;
+
+	ctx->received = true;
+}
 
-	log_trace("printLastEvents: %d tuples", nTuples);
 
-	if (PQnfields(result) != 6)
+/*
+ * monitor_events_array_reserve ensures that the given eventsArray can hold at
+ * least capacity events.
+ */
+bool
+monitor_events_array_reserve(MonitorEventsArray *eventsArray, int capacity)
+{
+	if (capacity <= eventsArray->capacity)
 	{
-		log_error("Query returned %d columns, expected 6", PQnfields(result));
-		context->parsedOK = false;
-		return;
+		return true;
 	}
 
-	fformat(stdout, "%30s | %6s | %19s | %19s | %s\n",
-			"Event Time", "Node",
-			"Current State", "Assigned State", "Comment");
-	fformat(stdout, "%30s-+-%6s-+-%19s-+-%19s-+-%10s\n",
-			"------------------------------",
-			"------", "-------------------",
-			"-------------------", "----------");
+	MonitorEvent *events =
+		(MonitorEvent *) realloc(eventsArray->events,
+								 capacity * sizeof(MonitorEvent));
 
-	for (currentTupleIndex = 0; currentTupleIndex < nTuples; currentTupleIndex++)
+	if (events == NULL)
 	{
-		char *eventTime = PQgetvalue(result, currentTupleIndex, 0);
-		char *nodeId = PQgetvalue(result, currentTupleIndex, 1);
-		char *groupId = PQgetvalue(result, currentTupleIndex, 2);
-		char *currentState = PQgetvalue(result, currentTupleIndex, 3);
-		char *goalState = PQgetvalue(result, currentTupleIndex, 4);
-		char *description = PQgetvalue(result, currentTupleIndex, 5);
-		char node[BUFSIZE];
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
 
-		/* for our grid alignment output it's best to have a single col here */
-		sformat(node, BUFSIZE, "%s/%s", groupId, nodeId);
+	memset(events + eventsArray->capacity,
+		   0,
+		   (capacity - eventsArray->capacity) * sizeof(MonitorEvent));
 
-		fformat(stdout, "%30s | %6s | %19s | %19s | %s\n",
-				eventTime, node,
-				currentState, goalState, description);
-	}
-	fformat(stdout, "\n");
+	eventsArray->events = events;
+	eventsArray->capacity = capacity;
 
-	context->parsedOK = true;
+	return true;
+}
+
+
+/*
+ * monitor_events_array_free releases the memory used by the given
+ * eventsArray, which is then a valid empty array again.
+ */
+void
+monitor_events_array_free(MonitorEventsArray *eventsArray)
+{
+	free(eventsArray->events);
+
+	eventsArray->events = NULL;
+	eventsArray->count = 0;
+	eventsArray->capacity = 0;
 }
 
 
@@ -2485,7 +5783,7 @@ monitor_get_last_events(Monitor *monitor, char *formation, int group, int count,
 	MonitorEventsArrayParseContext context =
 	{ { 0 }, monitorEventsArray, false };
 
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	char *sql = NULL;
 	int paramCount = 0;
 	Oid paramTypes[3];
@@ -2525,6 +5823,7 @@ monitor_get_last_events(Monitor *monitor, char *formation, int group, int count,
 			sql =
 				"SELECT eventId, to_char(eventTime, 'YYYY-MM-DD HH24:MI:SS'), "
 				"       formationId, nodeid, groupid, "
+				"       nodename, nodehost, nodeport, "
 				"       reportedstate, goalState, "
 				"       reportedrepstate, reportedtli, reportedlsn, "
 				"       candidatepriority, replicationquorum, "
@@ -2546,9 +5845,9 @@ monitor_get_last_events(Monitor *monitor, char *formation, int group, int count,
 		}
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &getLastEvents))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &context, &getLastEvents))
 	{
 		log_error("Failed to retrieve last events from the monitor");
 		return false;
@@ -2584,18 +5883,16 @@ getLastEvents(void *ctx, PGresult *result)
 
 	log_trace("getLastEvents: %d tuples", nTuples);
 
-	if (nTuples > EVENTS_ARRAY_MAX_COUNT)
+	if (PQnfields(result) != 16)
 	{
-		log_error("Query returned %d rows, pg_auto_failover supports only up "
-				  "to %d events at the moment",
-				  PQntuples(result), EVENTS_ARRAY_MAX_COUNT);
+		log_error("Query returned %d columns, expected 16", PQnfields(result));
 		context->parsedOK = false;
 		return;
 	}
 
-	if (PQnfields(result) != 16)
+	if (!monitor_events_array_reserve(eventsArray, nTuples))
 	{
-		log_error("Query returned %d columns, expected 16", PQnfields(result));
+		/* errors have already been logged */
 		context->parsedOK = false;
 		return;
 	}
@@ -2606,17 +5903,17 @@ getLastEvents(void *ctx, PGresult *result)
 	{
 		MonitorEvent *event = &(eventsArray->events[currentTupleIndex]);
 
-		char *value = PQgetvalue(result, currentTupleIndex, 0);
+		uint64_t lsn = 0;
 
 		/* eventId */
-		if (!stringToInt64(value, &(event->eventId)))
+		if (!pgresult_get_int64(result, currentTupleIndex, 0, &(event->eventId)))
 		{
-			log_error("Invalid event ID \"%s\" returned by monitor", value);
+			log_error("Invalid event ID returned by monitor");
 			++errors;
 		}
 
 		/* eventTime */
-		value = PQgetvalue(result, currentTupleIndex, 1);
+		char *value = PQgetvalue(result, currentTupleIndex, 1);
 		strlcpy(event->eventTime, value, sizeof(event->eventTime));
 
 		/* formationId */
@@ -2624,20 +5921,16 @@ getLastEvents(void *ctx, PGresult *result)
 		strlcpy(event->formationId, value, sizeof(event->formationId));
 
 		/* nodeId */
-		value = PQgetvalue(result, currentTupleIndex, 3);
-
-		if (!stringToInt64(value, &(event->nodeId)))
+		if (!pgresult_get_int64(result, currentTupleIndex, 3, &(event->nodeId)))
 		{
-			log_error("Invalid node ID \"%s\" returned by monitor", value);
+			log_error("Invalid node ID returned by monitor");
 			++errors;
 		}
 
 		/* groupId */
-		value = PQgetvalue(result, currentTupleIndex, 4);
-
-		if (!stringToInt(value, &(event->groupId)))
+		if (!pgresult_get_int(result, currentTupleIndex, 4, &(event->groupId)))
 		{
-			log_error("Invalid group ID \"%s\" returned by monitor", value);
+			log_error("Invalid group ID returned by monitor");
 			++errors;
 		}
 
@@ -2650,11 +5943,9 @@ getLastEvents(void *ctx, PGresult *result)
 		strlcpy(event->nodeHost, value, sizeof(event->nodeHost));
 
 		/* nodePort */
-		value = PQgetvalue(result, currentTupleIndex, 7);
-
-		if (!stringToInt(value, &(event->nodePort)))
+		if (!pgresult_get_int(result, currentTupleIndex, 7, &(event->nodePort)))
 		{
-			log_error("Invalid group ID \"%s\" returned by monitor", value);
+			log_error("Invalid port number returned by monitor");
 			++errors;
 		}
 
@@ -2683,30 +5974,42 @@ getLastEvents(void *ctx, PGresult *result)
 		strlcpy(event->replicationState, value, sizeof(event->replicationState));
 
 		/* timeline */
-		value = PQgetvalue(result, currentTupleIndex, 11);
-
-		if (!stringToInt(value, &(event->timeline)))
+		if (!pgresult_get_int(result, currentTupleIndex, 11, &(event->timeline)))
 		{
-			log_error("Invalid timeline \"%s\" returned by monitor", value);
+			log_error("Invalid timeline returned by monitor");
 			++errors;
 		}
 
 		/* LSN */
-		value = PQgetvalue(result, currentTupleIndex, 12);
-		strlcpy(event->lsn, value, PG_LSN_MAXLENGTH);
+		if (pgresult_get_lsn(result, currentTupleIndex, 12, &lsn))
+		{
+			(void) formatLSN(lsn, event->lsn, PG_LSN_MAXLENGTH);
+		}
+		else
+		{
+			log_error("Invalid LSN returned by monitor");
+			++errors;
+		}
 
 		/* candidatePriority */
-		value = PQgetvalue(result, currentTupleIndex, 13);
-
-		if (!stringToInt(value, &(event->candidatePriority)))
+		if (!pgresult_get_int(result, currentTupleIndex, 13,
+							  &(event->candidatePriority)))
 		{
-			log_error("Invalid candidate priority \"%s\" returned by monitor", value);
+			log_error("Invalid candidate priority returned by monitor");
 			++errors;
 		}
 
-		/* replicationQuorum */
-		value = PQgetvalue(result, currentTupleIndex, 14);
-		event->replicationQuorum = strcmp(value, "t") == 0;
+		/* replicationQuorum, NULL in older events */
+		if (PQgetisnull(result, currentTupleIndex, 14))
+		{
+			event->replicationQuorum = false;
+		}
+		else if (!pgresult_get_bool(result, currentTupleIndex, 14,
+									&(event->replicationQuorum)))
+		{
+			log_error("Invalid replication quorum returned by monitor");
+			++errors;
+		}
 
 		/* description */
 		value = PQgetvalue(result, currentTupleIndex, 15);
@@ -2865,25 +6168,101 @@ monitor_formation_uri(Monitor *monitor,
 					  size_t size)
 {
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
+	const char *sql =
+		"SELECT formation_uri "
+		"FROM pgautofailover.formation_uri($1, $2, $3, $4, $5)";
+	int paramCount = 5;
+	Oid paramTypes[5] = { TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[5] = { 0 };
+
+	paramValues[0] = formation;
+	paramValues[1] = citusClusterName;
+	paramValues[2] = ssl->sslModeStr;
+	paramValues[3] = ssl->caFile;
+	paramValues[4] = ssl->crlFile;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to list the formation uri for \"%s\", "
+				  "see previous lines for details.",
+				  formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
+	}
+
+	if (context.strVal == NULL || strcmp(context.strVal, "") == 0)
+	{
+		log_error("Formation \"%s\" currently has no nodes in group 0",
+				  formation);
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
+	}
+
+	strlcpy(connectionString, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * monitor_formation_read_uri calls the SQL API on the monitor that returns a
+ * connection string that applications can use to spread their read-only
+ * queries on the standby nodes of a formation that are less than maxLagBytes
+ * behind, preferring the nodes in the given zone.
+ */
+bool
+monitor_formation_read_uri(Monitor *monitor,
+						   const char *formation,
+						   int64_t maxLagBytes,
+						   const char *zone,
+						   bool loadBalance,
+						   const SSLOptions *ssl,
+						   char *connectionString,
+						   size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	const char *sql =
-		"SELECT formation_uri "
-		"FROM pgautofailover.formation_uri($1, $2, $3, $4, $5)";
-	int paramCount = 5;
-	Oid paramTypes[5] = { TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID };
-	const char *paramValues[5] = { 0 };
+		"SELECT formation_read_uri "
+		"FROM pgautofailover.formation_read_uri($1, $2, $3, $4, $5, $6, $7)";
+	int paramCount = 7;
+	Oid paramTypes[7] = {
+		TEXTOID, INT8OID, TEXTOID, BOOLOID, TEXTOID, TEXTOID, TEXTOID
+	};
+	const char *paramValues[7] = { 0 };
+	char maxLagStr[BUFSIZE] = { 0 };
+
+	sformat(maxLagStr, sizeof(maxLagStr), "%" PRId64, maxLagBytes);
 
 	paramValues[0] = formation;
-	paramValues[1] = citusClusterName;
-	paramValues[2] = ssl->sslModeStr;
-	paramValues[3] = ssl->caFile;
-	paramValues[4] = ssl->crlFile;
+	paramValues[1] = maxLagStr;
+	paramValues[2] = zone;
+	paramValues[3] = loadBalance ? "true" : "false";
+	paramValues[4] = ssl->sslModeStr;
+	paramValues[5] = ssl->caFile;
+	paramValues[6] = ssl->crlFile;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
 								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to list the formation uri for \"%s\", "
+		log_error("Failed to get the read-only uri for formation \"%s\", "
 				  "see previous lines for details.",
 				  formation);
 		return false;
@@ -2901,7 +6280,8 @@ monitor_formation_uri(Monitor *monitor,
 
 	if (context.strVal == NULL || strcmp(context.strVal, "") == 0)
 	{
-		log_error("Formation \"%s\" currently has no nodes in group 0",
+		log_error("Formation \"%s\" currently has no node available "
+				  "for read-only queries in group 0",
 				  formation);
 		if (context.strVal)
 		{
@@ -2917,6 +6297,96 @@ monitor_formation_uri(Monitor *monitor,
 }
 
 
+/*
+ * monitor_follow_formation_read_uri prints the read-only connection string of
+ * the formation each time it changes, until we are asked to stop. The list
+ * of nodes changes with the state notifications of the formation, and their
+ * replication lag is checked at least every MONITOR_FOLLOW_EVENTS_POLL_INTERVAL
+ * seconds.
+ */
+bool
+monitor_follow_formation_read_uri(Monitor *monitor,
+								  const char *formation,
+								  int64_t maxLagBytes,
+								  const char *zone,
+								  bool loadBalance,
+								  const SSLOptions *ssl,
+								  bool json)
+{
+	char channel[BUFSIZE] = { 0 };
+	char *channels[] = { channel, NULL };
+
+	char previousUri[MAXCONNINFO] = { 0 };
+
+	bool fetchUri = true;
+	uint64_t lastFetchTime = 0;
+
+	(void) monitor_formation_state_channel(formation, channel, sizeof(channel));
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		uint64_t now = time(NULL);
+
+		if (fetchUri ||
+			(now - lastFetchTime) >= MONITOR_FOLLOW_EVENTS_POLL_INTERVAL)
+		{
+			char uri[MAXCONNINFO] = { 0 };
+
+			if (!monitor_formation_read_uri(monitor, formation,
+											maxLagBytes, zone, loadBalance,
+											ssl, uri, sizeof(uri)))
+			{
+				log_warn("Failed to fetch the read-only uri, retrying");
+			}
+			else if (strcmp(uri, previousUri) != 0)
+			{
+				if (json)
+				{
+					JSON_Value *js = json_value_init_object();
+					JSON_Object *jsObj = json_value_get_object(js);
+
+					json_object_set_string(jsObj, "formation", formation);
+					json_object_set_string(jsObj, "uri", uri);
+
+					char *serialized = json_serialize_to_string(js);
+
+					fformat(stdout, "%s\n", serialized);
+
+					json_free_serialized_string(serialized);
+					json_value_free(js);
+				}
+				else
+				{
+					fformat(stdout, "%s\n", uri);
+				}
+
+				fflush(stdout);
+				strlcpy(previousUri, uri, sizeof(previousUri));
+			}
+
+			lastFetchTime = now;
+		}
+
+		FollowEventsNotificationContext context = { false };
+
+		if (!monitor_process_notifications(
+				monitor,
+				PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000,
+				channels,
+				(void *) &context,
+				&monitor_notification_process_follow_events))
+		{
+			/* we might have lost the connection, don't retry too fast */
+			pg_usleep(PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000 * 1000);
+		}
+
+		fetchUri = context.received;
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_print_every_formation_uri prints a table of all our connection
  * strings: first the monitor URI itself, and then one line per formation.
@@ -2925,7 +6395,7 @@ bool
 monitor_print_every_formation_uri(Monitor *monitor, const SSLOptions *ssl)
 {
 	FormationURIParseContext context = { 0 };
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	const char *sql =
 		"SELECT 'monitor', 'monitor', $1 "
 		" UNION ALL "
@@ -2971,6 +6441,255 @@ monitor_print_every_formation_uri(Monitor *monitor, const SSLOptions *ssl)
 }
 
 
+/*
+ * monitor_print_uri_all_shards prints the connection strings of all the
+ * formations of all the monitor shards listed in the directory of the given
+ * (seed) monitor, as a single table or JSON array. The shards are queried in
+ * parallel, and we print what we could fetch even when some of the shards
+ * are not available.
+ */
+bool
+monitor_print_uri_all_shards(Monitor *monitor, const SSLOptions *ssl,
+							 bool json)
+{
+	MonitorShardArray *shards =
+		(MonitorShardArray *) calloc(1, sizeof(MonitorShardArray));
+	FormationURIArrayParseContext *contexts = NULL;
+	bool success = true;
+
+	const char *sql =
+		"SELECT 'monitor', 'monitor', $1 "
+		" UNION ALL "
+		"SELECT 'formation', formationid, formation_uri "
+		"  FROM pgautofailover.formation, "
+		"       pgautofailover.formation_uri"
+		"(formation.formationid, 'default', $2, $3, $4) "
+		" UNION ALL "
+		"SELECT 'read-replica', nodecluster, formation_uri "
+		"  FROM pgautofailover.formation "
+		"       JOIN pgautofailover.node using(formationid), "
+		"       pgautofailover.formation_uri"
+		"(formation.formationid, nodecluster, $2, $3, $4) "
+		" WHERE node.groupid = 0 and node.nodecluster <> 'default' ";
+
+	Oid paramTypes[4] = { TEXTOID, TEXTOID, TEXTOID, TEXTOID };
+
+	if (shards == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	if (!monitor_get_formation_shards(monitor, shards))
+	{
+		/* errors have already been logged */
+		free(shards);
+		return false;
+	}
+
+	contexts = (FormationURIArrayParseContext *)
+			   calloc(shards->count, sizeof(FormationURIArrayParseContext));
+
+	if (contexts == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(shards);
+		return false;
+	}
+
+	log_debug("Fetching the formation URIs from %d monitor shard(s)",
+			  shards->count);
+
+	for (int batch = 0; batch < shards->count;
+		 batch += PGSQL_PARALLEL_MAX_QUERIES)
+	{
+		PGSQL clients[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+		PGSQLQuery queries[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+		const char *paramValues[PGSQL_PARALLEL_MAX_QUERIES][4] = { 0 };
+
+		int count = Min(PGSQL_PARALLEL_MAX_QUERIES, shards->count - batch);
+
+		for (int index = 0; index < count; index++)
+		{
+			char *pguri = shards->pguri[batch + index];
+
+			paramValues[index][0] = pguri;
+			paramValues[index][1] = ssl->sslModeStr;
+			paramValues[index][2] = ssl->caFile;
+			paramValues[index][3] = ssl->crlFile;
+
+			queries[index].sql = sql;
+			queries[index].paramCount = 4;
+			queries[index].paramTypes = paramTypes;
+			queries[index].paramValues = paramValues[index];
+			queries[index].context = &(contexts[batch + index]);
+			queries[index].parseFun = &parseFormationURIArray;
+
+			if (!pgsql_init(&(clients[index]), pguri, PGSQL_CONN_MONITOR))
+			{
+				/* errors have already been logged */
+				success = false;
+				break;
+			}
+		}
+
+		if (!success)
+		{
+			break;
+		}
+
+		/* failures are reported per shard below */
+		(void) pgsql_execute_parallel(clients, queries, count,
+									  MONITOR_SHARDS_QUERY_TIMEOUT);
+	}
+
+	if (!success)
+	{
+		for (int index = 0; index < shards->count; index++)
+		{
+			free(contexts[index].uris);
+		}
+
+		free(contexts);
+		free(shards);
+		return false;
+	}
+
+	/* now merge the results, in the order of the shards directory */
+	int maxNameSize = 7;        /* "monitor" */
+
+	for (int index = 0; index < shards->count; index++)
+	{
+		FormationURIArrayParseContext *context = &(contexts[index]);
+
+		if (!context->parsedOK)
+		{
+			char scrubbedPguri[MAXCONNINFO] = { 0 };
+
+			(void) parse_and_scrub_connection_string(shards->pguri[index],
+													 scrubbedPguri);
+
+			log_error("Failed to retrieve the formation URIs from monitor "
+					  "shard %s", scrubbedPguri);
+			success = false;
+			continue;
+		}
+
+		for (int i = 0; i < context->count; i++)
+		{
+			maxNameSize = Max(maxNameSize, strlen(context->uris[i].name));
+		}
+	}
+
+	if (json)
+	{
+		JSON_Value *js = json_value_init_array();
+		JSON_Array *jsArray = json_value_get_array(js);
+
+		for (int index = 0; index < shards->count; index++)
+		{
+			FormationURIArrayParseContext *context = &(contexts[index]);
+
+			for (int i = 0; i < context->count; i++)
+			{
+				JSON_Value *jsURI = json_value_init_object();
+				JSON_Object *jsObj = json_value_get_object(jsURI);
+
+				json_object_set_string(jsObj, "type", context->uris[i].type);
+				json_object_set_string(jsObj, "name", context->uris[i].name);
+				json_object_set_string(jsObj, "uri", context->uris[i].uri);
+
+				json_array_append_value(jsArray, jsURI);
+			}
+		}
+
+		(void) json_serialize_to_file_stream_pretty(js, stdout);
+		fformat(stdout, "\n");
+
+		json_value_free(js);
+	}
+	else
+	{
+		char nameSeparator[BUFSIZE] = { 0 };
+
+		(void) prepareHostNameSeparator(nameSeparator, maxNameSize);
+
+		fformat(stdout, "%12s | %*s | %s\n",
+				"Type", maxNameSize, "Name", "Connection String");
+		fformat(stdout, "%12s-+-%*s-+-%s\n",
+				"------------", maxNameSize, nameSeparator,
+				"------------------------------");
+
+		for (int index = 0; index < shards->count; index++)
+		{
+			FormationURIArrayParseContext *context = &(contexts[index]);
+
+			for (int i = 0; i < context->count; i++)
+			{
+				fformat(stdout, "%12s | %*s | %s\n",
+						context->uris[i].type,
+						maxNameSize,
+						context->uris[i].name,
+						context->uris[i].uri);
+			}
+		}
+		fformat(stdout, "\n");
+	}
+
+	for (int index = 0; index < shards->count; index++)
+	{
+		free(contexts[index].uris);
+	}
+
+	free(contexts);
+	free(shards);
+
+	return success;
+}
+
+
+/*
+ * parseFormationURIArray parses the type, name, and connection string of the
+ * formations of a monitor shard.
+ */
+static void
+parseFormationURIArray(void *ctx, PGresult *result)
+{
+	FormationURIArrayParseContext *context =
+		(FormationURIArrayParseContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	context->uris = (FormationURI *) calloc(Max(nTuples, 1),
+											sizeof(FormationURI));
+
+	if (context->uris == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		FormationURI *uri = &(context->uris[rowNumber]);
+
+		strlcpy(uri->type, PQgetvalue(result, rowNumber, 0), sizeof(uri->type));
+		strlcpy(uri->name, PQgetvalue(result, rowNumber, 1), sizeof(uri->name));
+		strlcpy(uri->uri, PQgetvalue(result, rowNumber, 2), sizeof(uri->uri));
+	}
+
+	context->count = nTuples;
+	context->parsedOK = true;
+}
+
+
 /*
  * monitor_print_every_formation_uri_as_json prints all our connection strings
  * in the JSON format: first the monitor URI itself, and then one line per
@@ -2982,7 +6701,7 @@ monitor_print_every_formation_uri_as_json(Monitor *monitor,
 										  FILE *stream)
 {
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
-	PGSQL *pgsql = &monitor->pgsql;
+	PGSQL *pgsql = monitor_read_only_client(monitor);
 	const char *sql =
 		"WITH formation(type, name, uri) AS ( "
 		"SELECT 'monitor', 'monitor', $1 "
@@ -3284,69 +7003,123 @@ printFormationSettings(void *ctx, PGresult *result)
 
 
 /*
- * monitor_print_formation_settings calls the function
- * pgautofailover.formation_settings on the monitor, and prints a line of
- * output per state record obtained.
+ * monitor_print_formation_settings_as_json calls the function
+ * pgautofailover.formation_settings_json on the monitor, and prints the JSON
+ * document it returns.
  */
 bool
 monitor_print_formation_settings_as_json(Monitor *monitor, char *formation)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
 	PGSQL *pgsql = &monitor->pgsql;
-	char *sql =
-		"with settings as "
-		" ( "
-		"  select * "
-		"    from pgautofailover.formation_settings($1) "
-		" ), "
-		" f(json) as "
-		" ( "
-		"   select jsonb_agg(row_to_json(settings)) "
-		"     from settings "
-		"    where context = 'formation' "
-		" ), "
-		" p(json) as "
-		" ( "
-		"  select jsonb_agg(row_to_json(settings)) "
-		"    from settings "
-		"   where context = 'primary' "
-		" ), "
-		" n(json) as "
-		" ( "
-		"   select jsonb_agg(row_to_json(settings)) "
-		"     from settings "
-		"    where context = 'node' "
-		" ) "
-		"select jsonb_pretty(jsonb_build_object("
-		"'formation', f.json, 'primary', p.json, 'nodes', n.json)) "
-		"  from f, p, n";
+	const char *sql = "SELECT pgautofailover.formation_settings_json($1)";
 	int paramCount = 1;
 	Oid paramTypes[1] = { TEXTOID };
 	const char *paramValues[1] = { formation };
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_stream_json(pgsql, sql, paramCount, paramTypes, paramValues,
+							 false, stdout))
 	{
-		log_error("Failed to retrieve current state from the monitor");
+		log_error("Failed to retrieve formation settings from the monitor "
+				  "for formation \"%s\"", formation);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	return true;
+}
+
+
+/*
+ * monitor_stream_json runs a query that returns a JSON document per row, in
+ * the single-row mode, and writes each document to the given stream as soon
+ * as it has been received. When jsonArray is true the documents are written
+ * as the elements of a JSON array, formatted the same way as jsonb_pretty
+ * would, otherwise the query is expected to return a single document.
+ */
+static bool
+monitor_stream_json(PGSQL *pgsql, const char *sql,
+					int paramCount, const Oid *paramTypes,
+					const char **paramValues,
+					bool jsonArray, FILE *stream)
+{
+	JSONStreamContext context = { { 0 }, stream, jsonArray, 0, true };
+
+	if (!pgsql_execute_single_row(pgsql, sql,
+								  paramCount, paramTypes, paramValues,
+								  &context, &streamJSONRow))
 	{
-		log_error("Failed to parse formation settings from the monitor "
-				  "for formation \"%s\"", formation);
-		if (context.strVal)
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (jsonArray)
+	{
+		fformat(stream, context.rowCount == 0 ? "[\n]\n" : "\n]\n");
+	}
+
+	return true;
+}
+
+
+/*
+ * streamJSONRow writes the JSON documents found in the first column of the
+ * given partial result to the context's stream.
+ */
+static void
+streamJSONRow(void *ctx, PGresult *result)
+{
+	JSONStreamContext *context = (JSONStreamContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 1)
+	{
+		log_error("Query returned %d columns, expected a non-null JSON value",
+				  PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		if (PQgetisnull(result, rowNumber, 0))
+		{
+			log_error("Query returned a null JSON value");
+			context->parsedOK = false;
+			return;
+		}
+
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!context->jsonArray)
+		{
+			fformat(context->stream, "%s\n", value);
+			++context->rowCount;
+			continue;
+		}
+
+		fformat(context->stream, context->rowCount == 0 ? "[\n" : ",\n");
+
+		/* indent each line of the document as an element of the array */
+		char *line = value;
+
+		while (line != NULL && *line != '\0')
 		{
-			free(context.strVal);
-		}
-		return false;
-	}
+			char *newline = strchr(line, '\n');
+			int length = newline == NULL ? strlen(line) : newline - line;
 
-	fformat(stdout, "%s\n", context.strVal);
-	free(context.strVal);
+			fformat(context->stream, "%s    %.*s",
+					line == value ? "" : "\n", length, line);
 
-	return true;
+			line = newline == NULL ? NULL : newline + 1;
+		}
+
+		++context->rowCount;
+	}
 }
 
 
@@ -3481,9 +7254,9 @@ monitor_set_node_system_identifier(Monitor *monitor,
 	paramValues[0] = intToString(nodeId).strValue;
 	paramValues[1] = intToString(system_identifier).strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeResult))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeResult))
 	{
 		log_error("Failed to set_node_system_identifier of node %" PRId64
 				  " from the monitor", nodeId);
@@ -3726,11 +7499,6 @@ monitor_stop_maintenance(Monitor *monitor, int64_t nodeId, bool *mayRetry)
  * monitor_process_notifications listens to notifications from the monitor and
  * calls a specific processing function for each notification received.
  *
- * We use the pselect(2) facility to check if something is ready to be read on
- * the PQconn socket for us. When it's the case, return the next notification
- * message from the "state" channel. Other channel messages are sent to the log
- * directly.
- *
  * When the function returns true, it's safe for the caller to sleep, otherwise
  * it's expected that the caller keeps polling the results to drain the queue
  * of notifications received from the previous calls loop.
@@ -3741,20 +7509,85 @@ monitor_process_notifications(Monitor *monitor,
 							  char *channels[],
 							  void *notificationContext,
 							  NotificationProcessingFunction processor)
+{
+	return monitor_process_events(monitor,
+								  timeoutMs,
+								  channels,
+								  NULL,
+								  NULL,
+								  -1,
+								  NULL,
+								  notificationContext,
+								  processor);
+}
+
+
+/*
+ * monitor_process_events waits until either something is ready to be read on
+ * the monitor notification connection, or the given local Postgres connection
+ * has been closed by the server, or a signal is received, or timeoutMs
+ * milliseconds have passed, whichever comes first.
+ *
+ * We use the pselect(2) facility to check if something is ready to be read on
+ * the PQconn sockets for us. When it's the case for the monitor connection,
+ * process the notifications from the "state" channels, and send other channel
+ * messages to the log directly.
+ *
+ * An idle local Postgres connection only receives data when the server
+ * terminates it, or when a reported parameter changes. In the latter case we
+ * continue waiting, otherwise localClientLost is set to true, the connection
+ * is closed, and we return.
+ *
+ * When watchFd is not -1, we also return as soon as it's readable, and then
+ * set watchFdReady to true. The caller is responsible for reading from it.
+ *
+ * When the function returns true, it's safe for the caller to sleep, otherwise
+ * it's expected that the caller keeps polling the results to drain the queue
+ * of notifications received from the previous calls loop.
+ */
+static bool
+monitor_process_events(Monitor *monitor,
+					   int timeoutMs,
+					   char *channels[],
+					   PGSQL *localClient,
+					   bool *localClientLost,
+					   int watchFd,
+					   bool *watchFdReady,
+					   void *notificationContext,
+					   NotificationProcessingFunction processor)
 {
 	PGconn *connection = monitor->notificationClient.connection;
 	PGnotify *notify;
 
-
 	sigset_t sig_mask;
 	sigset_t sig_mask_orig;
 
-	/* we have milliseconds, we want seconds and nanoseconds separately */
-	int seconds = timeoutMs / 1000;
-	int nanosecs = 1000 * 1000 * (timeoutMs % 1000);
-	struct timespec timeout = { .tv_sec = seconds, .tv_nsec = nanosecs };
+	struct timespec deadline = { 0 };
 
-	fd_set input_mask;
+	if (localClientLost != NULL)
+	{
+		*localClientLost = false;
+	}
+
+	if (watchFdReady != NULL)
+	{
+		*watchFdReady = false;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &deadline) != 0)
+	{
+		log_warn("Failed to get the current time: clock_gettime(): %m");
+		return false;
+	}
+
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += 1000 * 1000 * (timeoutMs % 1000);
+
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000)
+	{
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000 * 1000 * 1000;
+	}
 
 	/* block signals now: process them as if received during the pselect call */
 	if (!block_signals(&sig_mask, &sig_mask_orig))
@@ -3791,13 +7624,15 @@ monitor_process_notifications(Monitor *monitor,
 		return false;
 	}
 
+	connection = monitor->notificationClient.connection;
+
 	/*
 	 * It looks like we are violating modularity of the code, when we are
 	 * following Postgres documentation and examples:
 	 *
 	 * https://www.postgresql.org/docs/current/libpq-example.html#LIBPQ-EXAMPLE-2
 	 */
-	int sock = PQsocket(monitor->notificationClient.connection);
+	int sock = PQsocket(connection);
 
 	if (sock < 0)
 	{
@@ -3807,43 +7642,132 @@ monitor_process_notifications(Monitor *monitor,
 		return false;   /* shouldn't happen */
 	}
 
-	FD_ZERO(&input_mask);
-	FD_SET(sock, &input_mask);
+	for (;;)
+	{
+		fd_set input_mask;
+		struct timespec now = { 0 };
+		struct timespec timeout = { 0 };
 
-	int ret = pselect(sock + 1, &input_mask, NULL, NULL, &timeout, &sig_mask_orig);
+		int localSock =
+			localClient != NULL && localClient->connection != NULL
+			? PQsocket(localClient->connection)
+			: -1;
 
-	/* restore signal masks (un block them) now that pselect() is done */
-	(void) unblock_signals(&sig_mask_orig);
+		(void) clock_gettime(CLOCK_MONOTONIC, &now);
 
-	if (ret < 0)
-	{
-		/* it might be interrupted by a signal we know how to handle */
-		if (errno == EINTR)
+		timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+		timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+
+		if (timeout.tv_nsec < 0)
+		{
+			timeout.tv_sec -= 1;
+			timeout.tv_nsec += 1000 * 1000 * 1000;
+		}
+
+		if (timeout.tv_sec < 0)
 		{
+			/* we reached the timeout */
+			(void) unblock_signals(&sig_mask_orig);
 			return true;
 		}
-		else
+
+		FD_ZERO(&input_mask);
+		FD_SET(sock, &input_mask);
+
+		if (localSock >= 0)
 		{
-			log_warn("Failed to get monitor notifications: select(): %m");
-			return false;
+			FD_SET(localSock, &input_mask);
 		}
-	}
 
-	if (ret == 0)
-	{
-		/* we reached the timeout */
-		return true;
+		if (watchFd >= 0)
+		{
+			FD_SET(watchFd, &input_mask);
+		}
+
+		int ret = pselect(Max(Max(sock, localSock), watchFd) + 1,
+						  &input_mask, NULL, NULL, &timeout, &sig_mask_orig);
+
+		if (ret < 0)
+		{
+			/* restore signal masks (un block them) now that pselect() is done */
+			(void) unblock_signals(&sig_mask_orig);
+
+			/* it might be interrupted by a signal we know how to handle */
+			if (errno == EINTR)
+			{
+				return true;
+			}
+			else
+			{
+				log_warn("Failed to get monitor notifications: select(): %m");
+				return false;
+			}
+		}
+
+		if (ret == 0)
+		{
+			/* we reached the timeout */
+			(void) unblock_signals(&sig_mask_orig);
+			return true;
+		}
+
+		if (localSock >= 0 && FD_ISSET(localSock, &input_mask))
+		{
+			if (PQconsumeInput(localClient->connection) == 0 ||
+				PQstatus(localClient->connection) != CONNECTION_OK)
+			{
+				pgsql_finish(localClient);
+
+				if (localClientLost != NULL)
+				{
+					*localClientLost = true;
+				}
+
+				(void) unblock_signals(&sig_mask_orig);
+				return true;
+			}
+		}
+
+		if (watchFd >= 0 && FD_ISSET(watchFd, &input_mask))
+		{
+			if (watchFdReady != NULL)
+			{
+				*watchFdReady = true;
+			}
+
+			/* process the notifications that arrived at the same time */
+			if (!FD_ISSET(sock, &input_mask))
+			{
+				(void) unblock_signals(&sig_mask_orig);
+				return true;
+			}
+		}
+
+		if (FD_ISSET(sock, &input_mask))
+		{
+			break;
+		}
 	}
 
+	/* restore signal masks (un block them) now that pselect() is done */
+	(void) unblock_signals(&sig_mask_orig);
+
 	/* Now check for input */
 	PQconsumeInput(connection);
 	while ((notify = PQnotifies(connection)) != NULL)
 	{
-		if (strcmp(notify->relname, "log") == 0)
+		if (monitor_is_log_channel(notify->relname))
 		{
-			log_info("%s", notify->extra);
+			if (strncmp(notify->relname, "log.warning", 11) == 0)
+			{
+				log_warn("%s", notify->extra);
+			}
+			else
+			{
+				log_info("%s", notify->extra);
+			}
 		}
-		else if (strcmp(notify->relname, "state") == 0)
+		else if (monitor_is_state_channel(notify->relname))
 		{
 			CurrentNodeState nodeState = { 0 };
 
@@ -3869,6 +7793,100 @@ monitor_process_notifications(Monitor *monitor,
 }
 
 
+/*
+ * monitor_is_state_channel returns true when the given channel is either the
+ * main "state" channel or one of the per-formation and per-group channels
+ * where the monitor sends the same notifications.
+ */
+static bool
+monitor_is_state_channel(const char *channel)
+{
+	return strcmp(channel, "state") == 0 || strncmp(channel, "state.", 6) == 0;
+}
+
+
+/*
+ * monitor_is_log_channel returns true when the given channel is one of the
+ * "log.<level>" or "log.<level>.<formation>" channels where the monitor
+ * sends its log messages to the clients that subscribed to them.
+ */
+static bool
+monitor_is_log_channel(const char *channel)
+{
+	return strncmp(channel, "log.", 4) == 0;
+}
+
+
+/*
+ * monitor_subscribe_log_notifications asks the monitor to send the log
+ * messages of the given level and above to our notification client, for the
+ * given formation only when it is not NULL. The monitor doesn't send its log
+ * messages to clients that did not subscribe.
+ */
+static bool
+monitor_subscribe_log_notifications(Monitor *monitor,
+									const char *level,
+									const char *formation)
+{
+	PGSQL *pgsql = &(monitor->notificationClient);
+	const char *sql =
+		"SELECT pgautofailover.subscribe_log_notifications($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { level, formation };
+
+	/* the subscription lasts as long as the connection */
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to subscribe to the monitor log notifications");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_formation_state_channel builds the name of the channel where the
+ * monitor sends the state notifications of the given formation only, falling
+ * back to the main "state" channel as monitor_group_state_channel does.
+ */
+static void
+monitor_formation_state_channel(const char *formation,
+								char *channel, size_t size)
+{
+	int n = sformat(channel, size, "state.%s", formation);
+
+	if (n < 0 || (size_t) n >= size || n >= NAMEDATALEN)
+	{
+		strlcpy(channel, "state", size);
+	}
+}
+
+
+/*
+ * monitor_group_state_channel builds the name of the channel where the
+ * monitor sends the state notifications of the given group only. When the
+ * channel name would be too long, the monitor only uses the main "state"
+ * channel, and so do we.
+ */
+static void
+monitor_group_state_channel(const char *formation, int groupId,
+							char *channel, size_t size)
+{
+	int n = sformat(channel, size, "state.%s.%d", formation, groupId);
+
+	if (n < 0 || (size_t) n >= size || n >= NAMEDATALEN)
+	{
+		strlcpy(channel, "state", size);
+	}
+}
+
+
 /*
  * monitor_log_notifications is a Notification Processing Function that gets
  * all the notifications from the monitor and append them to our logs.
@@ -3889,9 +7907,17 @@ monitor_log_notifications(void *context, CurrentNodeState *nodeState)
 bool
 monitor_get_notifications(Monitor *monitor, int timeoutMs)
 {
-	char *channels[] = { "state", "log", NULL };
+	char *channels[] = { "state", NULL };
 	LogNotificationContext context = { LOG_INFO };
 
+	/* subscribe again each time we open a new connection */
+	if (monitor->notificationClient.connection == NULL &&
+		!monitor_subscribe_log_notifications(monitor, "info", NULL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	return monitor_process_notifications(monitor,
 										 timeoutMs,
 										 channels,
@@ -4010,7 +8036,7 @@ monitor_wait_until_primary_applied_settings(Monitor *monitor,
 		false,
 		false
 	};
-	char *channels[] = { "state", "log", NULL };
+	char *channels[] = { "state", NULL };
 
 	uint64_t start = time(NULL);
 
@@ -4020,6 +8046,12 @@ monitor_wait_until_primary_applied_settings(Monitor *monitor,
 		return false;
 	}
 
+	if (!monitor_subscribe_log_notifications(monitor, "info", formation))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	log_info("Waiting for the settings to have been applied to "
 			 "the monitor and primary node");
 
@@ -4075,6 +8107,12 @@ monitor_notification_process_wait_for_state_change(void *context,
 	/* here, we received a state change that belongs to our formation/group */
 	ctx->stateHasChanged = true;
 	nodestate_log(nodeState, LOG_INFO, ctx->nodeId);
+
+	/* keep track of the states of the nodes in our group, when asked to */
+	if (ctx->groupStates != NULL)
+	{
+		(void) currentNodeStateArrayUpdate(ctx->groupStates, nodeState);
+	}
 }
 
 
@@ -4093,6 +8131,48 @@ monitor_wait_for_state_change(Monitor *monitor,
 							  int64_t nodeId,
 							  int timeoutMs,
 							  bool *stateHasChanged)
+{
+	return monitor_wait_for_events(monitor,
+								   formation,
+								   groupId,
+								   nodeId,
+								   NULL,
+								   NULL,
+								   timeoutMs,
+								   stateHasChanged,
+								   NULL,
+								   -1,
+								   NULL);
+}
+
+
+/*
+ * monitor_wait_for_events waits for timeout milliseconds, or until we receive
+ * a notification for a state change concerning the given groupId, or until
+ * the given local Postgres connection is closed by the server, or until a
+ * signal is received, whichever comes first.
+ *
+ * The localClient is expected to be an idle multi statement connection, or
+ * NULL. When the server closed it, localClientLost is set to true.
+ *
+ * When watchFd is not -1 and becomes readable, we return and watchFdReady is
+ * set to true.
+ *
+ * When groupStates is not NULL, the states of the nodes found in the
+ * notifications are updated in the array.
+ */
+bool
+monitor_wait_for_events(Monitor *monitor,
+						const char *formation,
+						int groupId,
+						int64_t nodeId,
+						PGSQL *localClient,
+						CurrentNodeStateArray *groupStates,
+						int timeoutMs,
+						bool *stateHasChanged,
+						bool *localClientLost,
+						int watchFd,
+						bool *watchFdReady)
 {
 	PGconn *connection = monitor->notificationClient.connection;
 
@@ -4100,10 +8180,16 @@ monitor_wait_for_state_change(Monitor *monitor,
 		(char *) formation,
 		groupId,
 		nodeId,
+		groupStates,
 		false                   /* stateHasChanged */
 	};
 
-	char *channels[] = { "state", NULL };
+	char groupChannel[BUFSIZE] = { 0 };
+	char *channels[] = { groupChannel, NULL };
+
+	/* only listen to the notifications about our own group */
+	(void) monitor_group_state_channel(formation, groupId,
+									   groupChannel, sizeof(groupChannel));
 
 	if (connection == NULL)
 	{
@@ -4111,10 +8197,14 @@ monitor_wait_for_state_change(Monitor *monitor,
 		return false;
 	}
 
-	if (!monitor_process_notifications(
+	if (!monitor_process_events(
 			monitor,
 			timeoutMs,
 			channels,
+			localClient,
+			localClientLost,
+			watchFd,
+			watchFdReady,
 			(void *) &context,
 			&monitor_notification_process_wait_for_state_change))
 	{
@@ -4127,6 +8217,68 @@ monitor_wait_for_state_change(Monitor *monitor,
 }
 
 
+/*
+ * monitor_poll_state_change waits for timeout milliseconds or until the
+ * version of the given group on the monitor differs from the given one,
+ * whichever comes first, using pgautofailover.wait_for_state_change().
+ *
+ * Unlike monitor_wait_for_events, this only uses short transactions on the
+ * main monitor connection, which works through a connection pooler in
+ * transaction pooling mode. The version is updated with the current version
+ * of the group on the monitor, and stateHasChanged is set to true when it
+ * differs from the given one.
+ */
+bool
+monitor_poll_state_change(Monitor *monitor,
+						  const char *formation,
+						  int groupId,
+						  int64_t *version,
+						  int timeoutMs,
+						  bool *stateHasChanged)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.wait_for_state_change($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, INT4OID, INT8OID, INT4OID };
+	const char *paramValues[4];
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	IntString groupIdString = intToString(groupId);
+	IntString versionString = intToString(*version);
+	IntString timeoutString = intToString(timeoutMs);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupIdString.strValue;
+	paramValues[2] = versionString.strValue;
+	paramValues[3] = timeoutString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to wait for a state change of group %d "
+				  "in formation \"%s\" on the monitor",
+				  groupId, formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the result of "
+				  "pgautofailover.wait_for_state_change()");
+		return false;
+	}
+
+	int64_t currentVersion = (int64_t) context.bigint;
+
+	*stateHasChanged = currentVersion != *version;
+	*version = currentVersion;
+
+	return true;
+}
+
+
 /*
  * monitor_report_state_print_headers fetches other nodes array on the monitor
  * and prints a table array on stdout to prepare for notifications output.
@@ -4186,7 +8338,8 @@ monitor_report_state_print_headers(Monitor *monitor,
  *
  * The function also maintains the context->failoverIsDone to signal to its
  * caller that the wait is over. We reach failoverIsDone when one of the nodes
- * in the context's group reaches the given targetState.
+ * in the context's group reaches the given targetState, or the node with the
+ * context's nodeName when it is set.
  */
 static void
 monitor_check_report_state(void *context, CurrentNodeState *nodeState)
@@ -4230,6 +8383,8 @@ monitor_check_report_state(void *context, CurrentNodeState *nodeState)
 
 	if (nodeState->goalState == ctx->targetState &&
 		nodeState->reportedState == ctx->targetState &&
+		(ctx->nodeName == NULL ||
+		 strcmp(nodeState->node.name, ctx->nodeName) == 0) &&
 		!ctx->firstLoop)
 	{
 		ctx->failoverIsDone = true;
@@ -4254,6 +8409,7 @@ bool
 monitor_wait_until_some_node_reported_state(Monitor *monitor,
 											const char *formation,
 											int groupId,
+											const char *nodeName,
 											PgInstanceKind nodeKind,
 											NodeState targetState,
 											int timeout)
@@ -4266,6 +8422,7 @@ monitor_wait_until_some_node_reported_state(Monitor *monitor,
 	WaitUntilStateNotificationContext context = {
 		(char *) formation,
 		groupId,
+		(char *) nodeName,
 		&headers,
 		targetState,
 		false,                  /* failoverIsDone */
@@ -4293,6 +8450,9 @@ monitor_wait_until_some_node_reported_state(Monitor *monitor,
 	(void) monitor_report_state_print_headers(monitor, formation, groupId,
 											  nodeKind, &nodesArray, &headers);
 
+	/* we only needed the nodes to compute the headers */
+	nodeAddressArrayFree(&nodesArray);
+
 	while (!context.failoverIsDone)
 	{
 		/* when timeout <= 0 we just never stop waiting */
@@ -4336,7 +8496,8 @@ monitor_wait_until_some_node_reported_state(Monitor *monitor,
  *
  * The function also maintains the context->failoverIsDone to signal to its
  * caller that the wait is over. We reach failoverIsDone when one of the nodes
- * in the context's group reaches the given targetState.
+ * in the context's group reaches the given targetState, or the node with the
+ * context's nodeName when it is set.
  */
 static void
 monitor_check_node_report_state(void *context, CurrentNodeState *nodeState)
@@ -4442,6 +8603,9 @@ monitor_wait_until_node_reported_state(Monitor *monitor,
 	(void) monitor_report_state_print_headers(monitor, formation, groupId,
 											  nodeKind, &nodesArray, &headers);
 
+	/* we only needed the nodes to compute the headers */
+	nodeAddressArrayFree(&nodesArray);
+
 	while (!context.done)
 	{
 		uint64_t now = time(NULL);
@@ -4480,15 +8644,29 @@ monitor_get_extension_version(Monitor *monitor, MonitorExtensionVersion *version
 {
 	MonitorExtensionVersionParseContext context = { { 0 }, version, false };
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql =
-		"SELECT default_version, installed_version"
-		"  FROM pg_available_extensions WHERE name = $1";
+	const char *sql = extensionVersionQuery;
 	int paramCount = 1;
 	Oid paramTypes[1] = { TEXTOID };
 	const char *paramValues[1];
 
 	paramValues[0] = PG_AUTOCTL_MONITOR_EXTENSION_NAME;
 
+	/* use the results of monitor_send_extension_version_query, if any */
+	if (pgsql->pendingQuery == sql)
+	{
+		if (pgsql_get_pending_results(pgsql, &context, &parseExtensionVersion) &&
+			context.parsedOK)
+		{
+			return true;
+		}
+
+		/* the connection might have been lost, query the monitor again */
+		log_debug("Failed to get the results of the extension version query "
+				  "sent earlier, querying the monitor again");
+
+		context.parsedOK = false;
+	}
+
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
 								   &context, &parseExtensionVersion))
@@ -4509,6 +8687,24 @@ monitor_get_extension_version(Monitor *monitor, MonitorExtensionVersion *version
 }
 
 
+/*
+ * monitor_send_extension_version_query sends the query that
+ * monitor_get_extension_version() runs, without waiting for its results, so
+ * that the monitor processes it while we do something else. The next call to
+ * monitor_get_extension_version() then reads the results.
+ */
+bool
+monitor_send_extension_version_query(Monitor *monitor)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { PG_AUTOCTL_MONITOR_EXTENSION_NAME };
+
+	return pgsql_send_with_params(pgsql, extensionVersionQuery,
+								  1, paramTypes, paramValues);
+}
+
+
 /*
  * parseExtensionVersion parses the resultset of a query on the Postgres
  * pg_available_extension_versions catalogs.
@@ -4619,9 +8815,47 @@ monitor_extension_update(Monitor *monitor, const char *targetVersion)
 		}
 	}
 
-	return pgsql_alter_extension_update_to(pgsql,
-										   PG_AUTOCTL_MONITOR_EXTENSION_NAME,
-										   targetVersion);
+	/*
+	 * The update scripts take locks on the pgautofailover tables, and while
+	 * the ALTER EXTENSION command waits for those locks, every node_active
+	 * call of the fleet queues behind it. Use a short lock timeout and retry,
+	 * so that a busy monitor keeps serving node_active between attempts, and
+	 * only wait for as long as needed when all the attempts failed.
+	 */
+	for (int attempt = 1; attempt <= MONITOR_EXTENSION_UPDATE_ATTEMPTS; attempt++)
+	{
+		bool lockNotAvailable = false;
+		int lockTimeoutMs =
+			attempt < MONITOR_EXTENSION_UPDATE_ATTEMPTS
+			? MONITOR_EXTENSION_UPDATE_LOCK_TIMEOUT
+			: 0;
+
+		if (pgsql_alter_extension_update_to(pgsql,
+											PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+											targetVersion,
+											lockTimeoutMs,
+											&lockNotAvailable))
+		{
+			return true;
+		}
+
+		if (!lockNotAvailable)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		log_info("Retrying to update extension \"%s\" in %dms "
+				 "(attempt %d of %d)",
+				 PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				 MONITOR_EXTENSION_UPDATE_RETRY_SLEEP,
+				 attempt + 1,
+				 MONITOR_EXTENSION_UPDATE_ATTEMPTS);
+
+		pg_usleep(MONITOR_EXTENSION_UPDATE_RETRY_SLEEP * 1000L);
+	}
+
+	return false;
 }
 
 
@@ -4859,9 +9093,9 @@ monitor_find_node_by_nodeid(Monitor *monitor,
 	paramValues[1] = intToString(groupId).strValue;
 	paramValues[2] = intToString(nodeId).strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeArray))
+	if (!pgsql_execute_with_params_binary(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  &parseContext, parseNodeArray))
 	{
 		log_error("Failed to get nodes for group %d in formation \"%s\" "
 				  "from the monitor", groupId, formation);
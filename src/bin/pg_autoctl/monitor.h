@@ -17,6 +17,7 @@
 #include "nodestate_utils.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "trace.h"
 
 /* the monitor manages a postgres server running the pgautofailover extension */
 typedef struct Monitor
@@ -24,6 +25,13 @@ typedef struct Monitor
 	PGSQL pgsql;
 	PGSQL notificationClient;
 	MonitorConfig config;
+
+	/* optional monitor standby nodes, used for read-only calls */
+	bool hasStandbys;
+	PGSQL standbyClient;
+	int standbyMaxLagMs;
+	bool standbyIsFresh;
+	uint64_t standbyCheckTime;
 } Monitor;
 
 typedef struct MonitorAssignedState
@@ -34,6 +42,13 @@ typedef struct MonitorAssignedState
 	NodeState state;
 	int candidatePriority;
 	bool replicationQuorum;
+
+	/* version of the group on the monitor, see node_active() */
+	int64_t groupVersion;
+	bool otherNodesChanged;
+
+	/* trace id of the decision that assigned the state, may be empty */
+	char traceId[TRACE_ID_HEX_LEN + 1];
 } MonitorAssignedState;
 
 typedef struct StateNotification
@@ -70,12 +85,12 @@ typedef struct MonitorEvent
 	char description[BUFSIZE];
 } MonitorEvent;
 
-#define EVENTS_ARRAY_MAX_COUNT 1024
-
+/* an array of MonitorEvent, allocated on the heap */
 typedef struct MonitorEventsArray
 {
 	int count;
-	MonitorEvent events[EVENTS_ARRAY_MAX_COUNT];
+	int capacity;
+	MonitorEvent *events;
 } MonitorEventsArray;
 
 typedef struct MonitorExtensionVersion
@@ -90,9 +105,174 @@ typedef struct CoordinatorNodeAddress
 	NodeAddress node;
 } CoordinatorNodeAddress;
 
+/*
+ * The progress of a pg_basebackup or pg_rewind operation on a node, as
+ * reported by pgautofailover.current_progress().
+ */
+typedef struct NodeProgress
+{
+	int64_t nodeId;
+	int groupId;
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	char operation[NAMEDATALEN];
+	int64_t doneBytes;
+	int64_t totalBytes;
+	int64_t rate;               /* bytes per second, 0 when unknown */
+	int64_t eta;                /* seconds, -1 when unknown */
+} NodeProgress;
+
+#define NODE_PROGRESS_MAX_COUNT 12
+
+typedef struct NodeProgressArray
+{
+	int count;
+	NodeProgress nodes[NODE_PROGRESS_MAX_COUNT];
+} NodeProgressArray;
+
+/*
+ * In federation mode, formations are assigned to monitor shards using the
+ * pgautofailover.formation_shard directory table on a seed monitor. The seed
+ * monitor itself owns the formations that are not listed there.
+ */
+#define MONITOR_SHARDS_MAX_COUNT 64
+
+typedef struct MonitorShardArray
+{
+	int count;
+	char pguri[MONITOR_SHARDS_MAX_COUNT][MAXCONNINFO];
+} MonitorShardArray;
+
+/*
+ * The resources of the host of a node, as reported by its keeper to the
+ * pgautofailover.node_resources table. Rates are averaged over the interval
+ * between two reports.
+ */
+typedef struct NodeResources
+{
+	int ncpu;
+	uint64_t totalram;          /* bytes */
+	uint64_t availableram;      /* bytes */
+	double loadAverage;         /* over the last minute */
+	double cpuUsage;            /* percentage of time all the CPUs are busy */
+	int64_t diskReadRate;       /* bytes per second */
+	int64_t diskWriteRate;      /* bytes per second */
+	int64_t walRate;            /* WAL bytes written or received per second */
+} NodeResources;
+
+/*
+ * The monitor metrics service keeps a snapshot of the pgautofailover.node
+ * table, and accumulates per-group counters from the pgautofailover.event
+ * table.
+ */
+typedef struct MonitorNodeMetrics
+{
+	char formationId[NAMEDATALEN];
+	int groupId;
+	int64_t nodeId;
+	char name[_POSIX_HOST_NAME_MAX];
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+	NodeState reportedState;
+	NodeState goalState;
+	int health;                 /* 1 good, 0 bad, -1 unknown */
+	int64_t lagBytes;           /* behind the most advanced node in its group */
+	int64_t reportTime;         /* epoch, seconds */
+	int64_t healthCheckTime;    /* epoch, seconds */
+	bool hasResources;          /* did the keeper report its resources? */
+	NodeResources resources;
+	bool hasSyncRepWaits;       /* did the keeper report SyncRep waits? */
+	int syncRepWaiting;         /* backends waiting for a sync standby */
+	int64_t syncRepOldestWaitMs;
+	int64_t syncRepStalls;      /* waits past sync_rep_stall_threshold */
+} MonitorNodeMetrics;
+
+/* an array of MonitorNodeMetrics, allocated on the heap */
+typedef struct MonitorNodeMetricsArray
+{
+	int count;
+	int capacity;
+	MonitorNodeMetrics *nodes;
+} MonitorNodeMetricsArray;
+
+typedef struct MonitorGroupMetrics
+{
+	char formationId[NAMEDATALEN];
+	int groupId;
+	int64_t failoverCount;
+	int64_t eventCount;
+} MonitorGroupMetrics;
+
+/* an array of MonitorGroupMetrics, allocated on the heap */
+typedef struct MonitorGroupMetricsArray
+{
+	int count;
+	int capacity;
+	int64_t lastEventId;
+	MonitorGroupMetrics *groups;
+} MonitorGroupMetricsArray;
+
+/*
+ * The summary of a group of nodes, as returned by pgautofailover.fleet_state()
+ * for all the groups of all the formations of a monitor.
+ */
+typedef struct FleetGroupState
+{
+	char formation[NAMEDATALEN];
+	int groupId;
+	int nodeCount;
+	char primaryName[_POSIX_HOST_NAME_MAX]; /* empty when there's no primary */
+	NodeState primaryState;
+	int standbyCount;
+	int healthyStandbyCount;
+	int64_t maxLagBytes;        /* -1 when unknown */
+	bool inFlux;                /* a node is not in its assigned state yet */
+} FleetGroupState;
+
+/* an array of FleetGroupState, allocated on the heap */
+typedef struct FleetGroupStateArray
+{
+	int count;
+	int capacity;
+	FleetGroupState *groups;
+} FleetGroupStateArray;
+
+/*
+ * A node given to pgautofailover.remove_nodes(): removed is true once the
+ * node is gone from the monitor, and false while it is being dropped.
+ */
+typedef struct RemovedNode
+{
+	int64_t nodeId;
+	int groupId;
+	bool removed;
+} RemovedNode;
+
+/* an array of RemovedNode, allocated on the heap */
+typedef struct RemovedNodeArray
+{
+	int count;
+	int capacity;
+	RemovedNode *nodes;
+} RemovedNodeArray;
+
+/*
+ * The nodes that changed state, as found in the notifications received from
+ * the monitor. When more nodes changed than we can track, overflow is set and
+ * the caller should fetch the state of all the nodes again.
+ */
+#define MONITOR_CHANGED_NODES_MAX_COUNT 64
+
+typedef struct MonitorChangedNodes
+{
+	int count;
+	bool overflow;
+	int64_t nodeIds[MONITOR_CHANGED_NODES_MAX_COUNT];
+} MonitorChangedNodes;
+
 #define NODE_FORMAT "%" PRId64 " \"%s\" (%s:%d)"
 
 bool monitor_init(Monitor *monitor, char *url);
+bool monitor_setup_standbys(Monitor *monitor, char *url, int maxLagMs);
 void monitor_setup_notifications(Monitor *monitor, int groupId, int64_t nodeId);
 bool monitor_has_received_notifications(Monitor *monitor);
 bool monitor_process_state_notification(int notificationGroupId,
@@ -112,6 +292,9 @@ bool monitor_get_other_nodes(Monitor *monitor,
 							 int64_t myNodeId,
 							 NodeState currentState,
 							 NodeAddressArray *nodeArray);
+bool monitor_get_cascaded_nodes(Monitor *monitor,
+								int64_t myNodeId,
+								NodeAddressArray *nodeArray);
 bool monitor_print_other_nodes(Monitor *monitor,
 							   int64_t myNodeId, NodeState currentState);
 bool monitor_print_other_nodes_as_json(Monitor *monitor,
@@ -120,11 +303,18 @@ bool monitor_print_other_nodes_as_json(Monitor *monitor,
 
 bool monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 						 NodeAddress *node);
+bool monitor_get_upstream(Monitor *monitor, int64_t nodeId,
+						  NodeAddress *node);
+bool monitor_get_node_timeline(Monitor *monitor, int64_t nodeId,
+							   uint64_t *sysIdentifier, uint32_t *timeline,
+							   bool *found);
 bool monitor_get_coordinator(Monitor *monitor, char *formation,
 							 CoordinatorNodeAddress *coordinatorNodeAddress);
 bool monitor_get_most_advanced_standby(Monitor *monitor,
 									   char *formation, int groupId,
 									   NodeAddress *node);
+bool monitor_get_clone_source(Monitor *monitor, char *formation, int groupId,
+							  NodeAddress *node, bool *found);
 bool monitor_register_node(Monitor *monitor,
 						   char *formation,
 						   char *name,
@@ -141,12 +331,28 @@ bool monitor_register_node(Monitor *monitor,
 						   char *citusClusterName,
 						   bool *mayRetry,
 						   MonitorAssignedState *assignedState);
+bool monitor_register_nodes(Monitor *monitor, const char *nodesJSON,
+							MonitorAssignedState *assignedStates, int count);
 bool monitor_node_active(Monitor *monitor,
 						 char *formation, int64_t nodeId,
 						 int groupId, NodeState currentState,
 						 bool pgIsRunning, int currentTLI,
 						 char *currentLSN, char *pgsrSyncState,
+						 int64_t knownGroupVersion,
+						 char *replayLSN, int64_t applyRate,
 						 MonitorAssignedState *assignedState);
+bool monitor_node_active_and_get_other_nodes(Monitor *monitor,
+											 char *formation, int64_t nodeId,
+											 int groupId, NodeState currentState,
+											 bool pgIsRunning, int currentTLI,
+											 char *currentLSN, char *pgsrSyncState,
+											 int64_t knownGroupVersion,
+											 char *replayLSN, int64_t applyRate,
+											 MonitorAssignedState *assignedState,
+											 NodeAddressArray *otherNodes,
+											 bool *otherNodesFetched);
+bool monitor_set_node_zone(Monitor *monitor,
+						   char *formation, char *name, char *zone);
 bool monitor_get_node_replication_settings(Monitor *monitor,
 										   NodeReplicationSettings *settings);
 bool monitor_set_node_candidate_priority(Monitor *monitor,
@@ -155,6 +361,9 @@ bool monitor_set_node_candidate_priority(Monitor *monitor,
 bool monitor_set_node_replication_quorum(Monitor *monitor,
 										 char *formation, char *name,
 										 bool replicationQuorum);
+bool monitor_set_node_upstream(Monitor *monitor,
+							   char *formation, char *name,
+							   char *upstreamName);
 bool monitor_get_formation_number_sync_standbys(Monitor *monitor, char *formation,
 												int *numberSyncStandbys);
 bool monitor_set_formation_number_sync_standbys(Monitor *monitor, char *formation,
@@ -166,6 +375,12 @@ bool monitor_remove_by_hostname(Monitor *monitor,
 bool monitor_remove_by_nodename(Monitor *monitor,
 								char *formation, char *name, bool force,
 								int64_t *nodeId, int *groupId);
+bool monitor_remove_nodes(Monitor *monitor,
+						  int64_t *nodeIds, int count, bool force,
+						  RemovedNodeArray *removedArray);
+bool monitor_update_removed_nodes(Monitor *monitor,
+								  RemovedNodeArray *removedArray);
+void monitor_removed_node_array_free(RemovedNodeArray *removedArray);
 
 bool monitor_count_groups(Monitor *monitor, char *formation, int *groupsCount);
 bool monitor_get_groupId_from_name(Monitor *monitor,
@@ -177,19 +392,80 @@ bool monitor_perform_promotion(Monitor *monitor, char *formation, char *name);
 
 bool monitor_get_current_state(Monitor *monitor, char *formation, int group,
 							   CurrentNodeStateArray *nodesArray);
+bool parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray,
+								PGresult *result);
+bool monitor_events_array_reserve(MonitorEventsArray *eventsArray, int capacity);
+void monitor_events_array_free(MonitorEventsArray *eventsArray);
 bool monitor_get_last_events(Monitor *monitor, char *formation, int group,
 							 int count,
 							 MonitorEventsArray *monitorEventsArray);
 bool monitor_print_state(Monitor *monitor, char *formation, int group);
+bool monitor_get_current_state_of_nodes(Monitor *monitor, char *formation,
+										MonitorChangedNodes *changes,
+										CurrentNodeStateArray *nodesArray);
+bool monitor_get_events_since(Monitor *monitor, char *formation, int group,
+							  int64_t eventId, int count,
+							  MonitorEventsArray *eventsArray);
+bool monitor_listen_state_changes(Monitor *monitor, char *formation, int group);
+int monitor_notification_socket(Monitor *monitor);
+bool monitor_consume_state_changes(Monitor *monitor,
+								   MonitorChangedNodes *changes);
+bool monitor_get_last_events_start(Monitor *monitor, char *formation,
+								   int group, int count, int64_t *eventId);
+void monitor_print_events_since_header(void);
+bool monitor_print_events_since(Monitor *monitor, char *formation, int group,
+								int64_t *lastEventId, bool json);
+bool monitor_follow_events(Monitor *monitor, char *formation, int group,
+						   int64_t lastEventId, bool json);
+bool monitor_resolve_formation_shard(Monitor *monitor, char *formation,
+									 char *shardPguri, size_t size);
+bool monitor_get_formation_shards(Monitor *monitor, MonitorShardArray *shards);
+bool monitor_print_state_all_shards(Monitor *monitor);
+bool monitor_set_node_progress(Monitor *monitor, int64_t nodeId,
+							   const char *operation,
+							   int64_t doneBytes, int64_t totalBytes);
+bool monitor_renew_primary_lease(Monitor *monitor, int64_t nodeId,
+								 int leaseTimeoutMs, bool *granted);
+bool monitor_clear_node_progress(Monitor *monitor, int64_t nodeId);
+bool monitor_set_replication_report(Monitor *monitor, int64_t nodeId,
+									StandbyReplicationArrays *report);
+bool monitor_set_node_resources(Monitor *monitor, int64_t nodeId,
+								NodeResources *resources);
+bool monitor_set_sync_rep_waits(Monitor *monitor, int64_t nodeId,
+								SyncRepStatus *status);
+bool monitor_get_node_progress(Monitor *monitor, char *formation, int group,
+							   NodeProgressArray *progressArray);
+bool monitor_print_node_progress(Monitor *monitor, char *formation, int group);
+void nodeProgressToString(NodeProgress *progress, char *buffer, size_t size);
+
+bool monitor_get_node_metrics(Monitor *monitor,
+							  MonitorNodeMetricsArray *nodesArray);
+void monitor_node_metrics_array_free(MonitorNodeMetricsArray *nodesArray);
+bool monitor_update_group_metrics(Monitor *monitor,
+								  MonitorGroupMetricsArray *groupsArray);
+void monitor_group_metrics_array_free(MonitorGroupMetricsArray *groupsArray);
+bool monitor_get_notification_queue_usage(Monitor *monitor, double *usage);
 bool monitor_print_last_events(Monitor *monitor,
 							   char *formation, int group, int count);
 bool monitor_print_state_as_json(Monitor *monitor, char *formation, int group);
+bool monitor_get_fleet_state(Monitor *monitor, FleetGroupStateArray *fleetArray);
+void monitor_fleet_state_array_free(FleetGroupStateArray *fleetArray);
+bool monitor_print_fleet_state(Monitor *monitor);
+bool monitor_print_fleet_state_as_json(Monitor *monitor);
 bool monitor_print_last_events_as_json(Monitor *monitor,
 									   char *formation, int group,
 									   int count,
 									   FILE *stream);
 
+bool monitor_print_failover_timeline(Monitor *monitor,
+									 char *formation, int group);
+bool monitor_print_failover_timeline_as_json(Monitor *monitor,
+											 char *formation, int group,
+											 FILE *stream);
+
 bool monitor_print_every_formation_uri(Monitor *monitor, const SSLOptions *ssl);
+bool monitor_print_uri_all_shards(Monitor *monitor, const SSLOptions *ssl,
+								  bool json);
 bool monitor_print_every_formation_uri_as_json(Monitor *monitor,
 											   const SSLOptions *ssl,
 											   FILE *stream);
@@ -216,6 +492,21 @@ bool monitor_formation_uri(Monitor *monitor,
 						   const SSLOptions *ssl,
 						   char *connectionString,
 						   size_t size);
+bool monitor_formation_read_uri(Monitor *monitor,
+								const char *formation,
+								int64_t maxLagBytes,
+								const char *zone,
+								bool loadBalance,
+								const SSLOptions *ssl,
+								char *connectionString,
+								size_t size);
+bool monitor_follow_formation_read_uri(Monitor *monitor,
+									   const char *formation,
+									   int64_t maxLagBytes,
+									   const char *zone,
+									   bool loadBalance,
+									   const SSLOptions *ssl,
+									   bool json);
 
 bool monitor_synchronous_standby_names(Monitor *monitor,
 									   char *formation, int groupId,
@@ -243,6 +534,7 @@ bool monitor_wait_until_primary_applied_settings(Monitor *monitor,
 bool monitor_wait_until_some_node_reported_state(Monitor *monitor,
 												 const char *formation,
 												 int groupId,
+												 const char *nodeName,
 												 PgInstanceKind nodeKind,
 												 NodeState targetState,
 												 int timeout);
@@ -259,8 +551,26 @@ bool monitor_wait_for_state_change(Monitor *monitor,
 								   int64_t nodeId,
 								   int timeoutMs,
 								   bool *stateHasChanged);
+bool monitor_wait_for_events(Monitor *monitor,
+							 const char *formation,
+							 int groupId,
+							 int64_t nodeId,
+							 PGSQL *localClient,
+							 CurrentNodeStateArray *groupStates,
+							 int timeoutMs,
+							 bool *stateHasChanged,
+							 bool *localClientLost,
+							 int watchFd,
+							 bool *watchFdReady);
+bool monitor_poll_state_change(Monitor *monitor,
+							   const char *formation,
+							   int groupId,
+							   int64_t *version,
+							   int timeoutMs,
+							   bool *stateHasChanged);
 bool monitor_get_extension_version(Monitor *monitor,
 								   MonitorExtensionVersion *version);
+bool monitor_send_extension_version_query(Monitor *monitor);
 bool monitor_extension_update(Monitor *monitor, const char *targetVersion);
 bool monitor_ensure_extension_version(Monitor *monitor,
 									  LocalPostgresServer *postgres,
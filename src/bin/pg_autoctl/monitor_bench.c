@@ -0,0 +1,940 @@
+/*
+ * src/bin/pg_autoctl/monitor_bench.c
+ *	 Benchmark the monitor decision engine with synthetic nodes.
+ *
+ * We register synthetic nodes on a scratch monitor, and then sub-processes
+ * drive concurrent node_active calls for those nodes, as if each of them had
+ * a keeper that reaches its goal state immediately. That exercises the
+ * monitor's node_active and ProceedGroupState code paths, and their locking,
+ * without having to run any Postgres instance.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "monitor.h"
+#include "monitor_bench.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+/* synthetic groups all share the same system identifier */
+#define MONITOR_BENCH_SYSTEM_IDENTIFIER 6000000000000000000ULL
+
+/* how often the monitor is sampled for lock waits, in milliseconds */
+#define MONITOR_BENCH_LOCK_SAMPLE_MS 100
+
+/* what a client sub-process sends to the parent process */
+typedef struct MonitorBenchClientResult
+{
+	int64_t calls;
+	int64_t errors;
+	int64_t transitions;
+	int64_t latencyCount;
+} MonitorBenchClientResult;
+
+typedef struct LockWaitersContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	int lockWaiters;
+	int lwlockWaiters;
+	bool parsedOk;
+} LockWaitersContext;
+
+static void monitor_bench_formation_name(MonitorBenchOptions *options,
+										 int groupIndex,
+										 char *formation, size_t size);
+
+static void monitor_bench_start_client(MonitorBenchOptions *options,
+									   MonitorBenchNode *nodes,
+									   int clientIndex,
+									   int writeFd);
+
+static bool monitor_bench_node_active(Monitor *monitor,
+									  MonitorBenchNode *node,
+									  bool *transition);
+
+static bool monitor_bench_read_client(int readFd,
+									  MonitorBenchClientResult *clientResult,
+									  double **latencies,
+									  int64_t *latencyCount,
+									  int64_t *latencyCapacity);
+
+static bool monitor_bench_sample_locks(Monitor *monitor,
+									   LockWaitersContext *context);
+static void parseLockWaiters(void *ctx, PGresult *result);
+
+static bool write_fully(int fd, const void *buffer, size_t size);
+static bool read_fully(int fd, void *buffer, size_t size);
+
+
+
+/*
+ * monitor_bench_formation_name computes the name of the formation used for a
+ * synthetic group. Formations of kind pgsql only have the group zero, so we
+ * create one formation per synthetic group when asked for more than one.
+ */
+static void
+monitor_bench_formation_name(MonitorBenchOptions *options, int groupIndex,
+							 char *formation, size_t size)
+{
+	if (options->groupsCount == 1)
+	{
+		strlcpy(formation, options->formation, size);
+	}
+	else
+	{
+		sformat(formation, size, "%s_%d", options->formation, groupIndex);
+	}
+}
+
+
+/*
+ * monitor_bench_register_nodes creates the synthetic formations and registers
+ * the synthetic nodes. The first node registered in each group becomes the
+ * primary, the other ones are standby nodes.
+ */
+bool
+monitor_bench_register_nodes(MonitorBenchOptions *options,
+							 MonitorBenchNode *nodes)
+{
+	Monitor monitor = { 0 };
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int groupIndex = 0; groupIndex < options->groupsCount; groupIndex++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		monitor_bench_formation_name(options, groupIndex,
+									 formation, sizeof(formation));
+
+		if (!monitor_create_formation(&monitor, formation,
+									  "pgsql", "postgres", true, 0))
+		{
+			log_error("Failed to create the synthetic formation \"%s\", "
+					  "the benchmark should run on a scratch monitor",
+					  formation);
+			pgsql_finish(&(monitor.pgsql));
+			return false;
+		}
+	}
+
+	/*
+	 * Register nodes round-robin so that each group gets its primary first,
+	 * all in a single call to register_nodes().
+	 */
+	JSON_Value *js = json_value_init_array();
+	JSON_Array *jsArray = json_value_get_array(js);
+
+	for (int index = 0; index < options->nodesCount; index++)
+	{
+		MonitorBenchNode *node = &(nodes[index]);
+		JSON_Value *jsNode = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(jsNode);
+
+		int groupIndex = index % options->groupsCount;
+		char sysIdentifier[BUFSIZE] = { 0 };
+
+		monitor_bench_formation_name(options, groupIndex,
+									 node->formation, sizeof(node->formation));
+
+		sformat(node->name, sizeof(node->name), "bench_%d", index + 1);
+		node->port = options->port + index;
+
+		/* a JSON number can't hold every 64 bits integer, use a string */
+		sformat(sysIdentifier, sizeof(sysIdentifier), "%" PRIu64,
+				(uint64_t) (MONITOR_BENCH_SYSTEM_IDENTIFIER + groupIndex));
+
+		json_object_set_string(jsObj, "formation_id", node->formation);
+		json_object_set_string(jsObj, "node_host", options->host);
+		json_object_set_number(jsObj, "node_port", (double) node->port);
+		json_object_set_string(jsObj, "dbname", "postgres");
+		json_object_set_string(jsObj, "node_name", node->name);
+		json_object_set_string(jsObj, "sysidentifier", sysIdentifier);
+		json_object_set_number(jsObj, "desired_group_id", 0);
+		json_object_set_number(jsObj, "candidate_priority",
+							   (double) FAILOVER_NODE_CANDIDATE_PRIORITY);
+
+		json_array_append_value(jsArray, jsNode);
+	}
+
+	char *nodesJSON = json_serialize_to_string(js);
+
+	MonitorAssignedState *assignedStates =
+		(MonitorAssignedState *) calloc(options->nodesCount,
+										sizeof(MonitorAssignedState));
+
+	if (nodesJSON == NULL || assignedStates == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		json_free_serialized_string(nodesJSON);
+		json_value_free(js);
+		free(assignedStates);
+		pgsql_finish(&(monitor.pgsql));
+		return false;
+	}
+
+	bool success = monitor_register_nodes(&monitor, nodesJSON,
+										  assignedStates, options->nodesCount);
+
+	json_free_serialized_string(nodesJSON);
+	json_value_free(js);
+
+	if (!success)
+	{
+		log_error("Failed to register the synthetic nodes");
+		free(assignedStates);
+		pgsql_finish(&(monitor.pgsql));
+		return false;
+	}
+
+	for (int index = 0; index < options->nodesCount; index++)
+	{
+		MonitorBenchNode *node = &(nodes[index]);
+
+		node->nodeId = assignedStates[index].nodeId;
+		node->groupId = assignedStates[index].groupId;
+		node->state = assignedStates[index].state;
+	}
+
+	free(assignedStates);
+
+	pgsql_finish(&(monitor.pgsql));
+
+	log_info("Registered %d synthetic nodes in %d group(s)",
+			 options->nodesCount, options->groupsCount);
+
+	return true;
+}
+
+
+/*
+ * monitor_bench_run starts the client sub-processes, samples the monitor for
+ * lock waits while they run, and then collects and aggregates their results.
+ */
+bool
+monitor_bench_run(MonitorBenchOptions *options,
+				  MonitorBenchNode *nodes,
+				  MonitorBenchResult *result)
+{
+	Monitor monitor = { 0 };
+
+	pid_t clientsPidArray[MONITOR_BENCH_MAX_CLIENTS] = { 0 };
+	int clientsFdArray[MONITOR_BENCH_MAX_CLIENTS] = { 0 };
+	int startedClientsCount = 0;
+
+	double *latencies = NULL;
+	int64_t latencyCount = 0;
+	int64_t latencyCapacity = 0;
+
+	int64_t lockWaitersSum = 0;
+	int64_t lwlockWaitersSum = 0;
+
+	bool success = true;
+
+	instr_time startTime;
+	instr_time duration;
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Starting %d concurrent clients for %ds, %s",
+			 options->clientsCount,
+			 options->duration,
+			 options->rate == 0
+			 ? "without rate limiting"
+			 : "with rate limiting");
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int index = 0; index < options->clientsCount; index++)
+	{
+		int pipeFd[2] = { 0 };
+
+		if (pipe(pipeFd) != 0)
+		{
+			log_error("Failed to create a pipe for client %d: %m", index);
+			success = false;
+			break;
+		}
+
+		pid_t fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork client %d: %m", index);
+				close(pipeFd[0]);
+				close(pipeFd[1]);
+				success = false;
+				break;
+			}
+
+			case 0:
+			{
+				/* the client only writes its results to the pipe */
+				close(pipeFd[0]);
+
+				(void) monitor_bench_start_client(options, nodes, index,
+												  pipeFd[1]);
+
+				/* never returns */
+				break;
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				close(pipeFd[1]);
+
+				clientsPidArray[index] = fpid;
+				clientsFdArray[index] = pipeFd[0];
+				++startedClientsCount;
+				break;
+			}
+		}
+
+		if (!success)
+		{
+			break;
+		}
+	}
+
+	/* sample lock waits on the monitor while the clients are running */
+	for (;;)
+	{
+		LockWaitersContext context = { { 0 }, 0, 0, false };
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		if (!success ||
+			INSTR_TIME_GET_MILLISEC(duration) >= options->duration * 1000.0)
+		{
+			break;
+		}
+
+		if (monitor_bench_sample_locks(&monitor, &context))
+		{
+			++result->lockSamples;
+
+			lockWaitersSum += context.lockWaiters;
+			lwlockWaitersSum += context.lwlockWaiters;
+
+			result->maxLockWaiters =
+				Max(result->maxLockWaiters, context.lockWaiters);
+			result->maxLWLockWaiters =
+				Max(result->maxLWLockWaiters, context.lwlockWaiters);
+		}
+
+		pg_usleep(MONITOR_BENCH_LOCK_SAMPLE_MS * 1000);
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	if (!success)
+	{
+		for (int index = 0; index < startedClientsCount; index++)
+		{
+			(void) kill(clientsPidArray[index], SIGTERM);
+		}
+	}
+
+	/* collect the clients results, reading each pipe until the end */
+	for (int index = 0; index < startedClientsCount; index++)
+	{
+		MonitorBenchClientResult clientResult = { 0 };
+		int status = 0;
+
+		if (monitor_bench_read_client(clientsFdArray[index],
+									  &clientResult,
+									  &latencies,
+									  &latencyCount,
+									  &latencyCapacity))
+		{
+			result->calls += clientResult.calls;
+			result->errors += clientResult.errors;
+			result->transitions += clientResult.transitions;
+		}
+		else
+		{
+			log_error("Failed to read the results of client %d", index);
+			success = false;
+		}
+
+		close(clientsFdArray[index]);
+
+		if (waitpid(clientsPidArray[index], &status, 0) == -1)
+		{
+			log_error("Failed to wait for client %d (pid %d): %m",
+					  index, clientsPidArray[index]);
+			success = false;
+		}
+		else if (WIFEXITED(status) && WEXITSTATUS(status) != EXIT_CODE_QUIT)
+		{
+			log_error("Client %d (pid %d) exited with code %d",
+					  index, clientsPidArray[index], WEXITSTATUS(status));
+			success = false;
+		}
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	result->durationMs = INSTR_TIME_GET_MILLISEC(duration);
+
+	if (result->lockSamples > 0)
+	{
+		result->avgLockWaiters =
+			(double) lockWaitersSum / (double) result->lockSamples;
+		result->avgLWLockWaiters =
+			(double) lwlockWaitersSum / (double) result->lockSamples;
+	}
+
+	if (latencyCount > 0)
+	{
+		qsort(latencies, latencyCount, sizeof(double),
+			  monitor_bench_compare_doubles);
+
+		result->minMs = latencies[0];
+		result->p50Ms =
+			monitor_bench_percentile(latencies, latencyCount, 0.50);
+		result->p90Ms =
+			monitor_bench_percentile(latencies, latencyCount, 0.90);
+		result->p99Ms =
+			monitor_bench_percentile(latencies, latencyCount, 0.99);
+		result->p999Ms =
+			monitor_bench_percentile(latencies, latencyCount, 0.999);
+		result->maxMs = latencies[latencyCount - 1];
+	}
+
+	free(latencies);
+
+	return success;
+}
+
+
+/*
+ * monitor_bench_start_client runs in a sub-process. The client takes care of
+ * the nodes whose index modulo the clients count is its own index, and calls
+ * node_active for each of them in turn until the duration has elapsed. The
+ * results are then written to the given file descriptor.
+ */
+static void
+monitor_bench_start_client(MonitorBenchOptions *options,
+						   MonitorBenchNode *nodes,
+						   int clientIndex,
+						   int writeFd)
+{
+	Monitor monitor = { 0 };
+	MonitorBenchClientResult clientResult = { 0 };
+
+	int64_t latencyCapacity = 1024;
+	double *latencies = (double *) calloc(latencyCapacity, sizeof(double));
+
+	/* each client gets a fair share of the target rate */
+	double intervalMs =
+		options->rate == 0
+		? 0.0
+		: 1000.0 * options->clientsCount / (double) options->rate;
+
+	instr_time startTime;
+
+	if (latencies == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* we want to measure the monitor, not our retry policy */
+	pgsql_set_main_loop_retry_policy(&(monitor.pgsql.retryPolicy));
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int64_t call = 0;; call++)
+	{
+		int nodeIndex =
+			clientIndex +
+			(int) (call % ((options->nodesCount - clientIndex - 1) /
+						   options->clientsCount + 1)) *
+			options->clientsCount;
+
+		MonitorBenchNode *node = &(nodes[nodeIndex]);
+		bool transition = false;
+
+		instr_time now;
+		instr_time latency;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, startTime);
+
+		double elapsedMs = INSTR_TIME_GET_MILLISEC(now);
+
+		if (elapsedMs >= options->duration * 1000.0)
+		{
+			break;
+		}
+
+		/* open-loop scheduling: wait until it's time for the next call */
+		if (intervalMs > 0.0 && elapsedMs < call * intervalMs)
+		{
+			pg_usleep((long) ((call * intervalMs - elapsedMs) * 1000.0));
+		}
+
+		INSTR_TIME_SET_CURRENT(latency);
+
+		if (!monitor_bench_node_active(&monitor, node, &transition))
+		{
+			++clientResult.errors;
+			continue;
+		}
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, latency);
+
+		++clientResult.calls;
+
+		if (transition)
+		{
+			++clientResult.transitions;
+		}
+
+		if (clientResult.latencyCount == latencyCapacity)
+		{
+			latencyCapacity *= 2;
+			latencies =
+				(double *) realloc(latencies, latencyCapacity * sizeof(double));
+
+			if (latencies == NULL)
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+		}
+
+		latencies[clientResult.latencyCount++] = INSTR_TIME_GET_MILLISEC(now);
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	if (!write_fully(writeFd, &clientResult, sizeof(clientResult)) ||
+		!write_fully(writeFd, latencies,
+					 clientResult.latencyCount * sizeof(double)))
+	{
+		log_error("Client %d failed to send its results: %m", clientIndex);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	close(writeFd);
+	free(latencies);
+
+	exit(EXIT_CODE_QUIT);
+}
+
+
+/*
+ * monitor_bench_node_active calls node_active for a synthetic node, reporting
+ * that the node has reached its previously assigned state.
+ */
+static bool
+monitor_bench_node_active(Monitor *monitor, MonitorBenchNode *node,
+						  bool *transition)
+{
+	MonitorAssignedState assignedState = { 0 };
+
+	if (!monitor_node_active(monitor,
+							 node->formation,
+							 node->nodeId,
+							 node->groupId,
+							 node->state,
+							 true,      /* pgIsRunning */
+							 1,         /* currentTLI */
+							 "0/0",     /* currentLSN */
+							 "",        /* pgsrSyncState */
+							 0,         /* knownGroupVersion */
+							 "0/0",     /* replayLSN */
+							 0,         /* applyRate */
+							 &assignedState))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*transition = assignedState.state != node->state;
+	node->state = assignedState.state;
+
+	return true;
+}
+
+
+/*
+ * monitor_bench_read_client reads a client result from the given pipe, and
+ * appends the client latencies to the given array.
+ */
+static bool
+monitor_bench_read_client(int readFd,
+						  MonitorBenchClientResult *clientResult,
+						  double **latencies,
+						  int64_t *latencyCount,
+						  int64_t *latencyCapacity)
+{
+	if (!read_fully(readFd, clientResult, sizeof(MonitorBenchClientResult)))
+	{
+		return false;
+	}
+
+	if (clientResult->latencyCount == 0)
+	{
+		return true;
+	}
+
+	int64_t count = *latencyCount + clientResult->latencyCount;
+
+	if (count > *latencyCapacity)
+	{
+		double *array = (double *) realloc(*latencies, count * sizeof(double));
+
+		if (array == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		*latencies = array;
+		*latencyCapacity = count;
+	}
+
+	if (!read_fully(readFd,
+					*latencies + *latencyCount,
+					clientResult->latencyCount * sizeof(double)))
+	{
+		return false;
+	}
+
+	*latencyCount = count;
+
+	return true;
+}
+
+
+/*
+ * monitor_bench_sample_locks counts the monitor sessions that are currently
+ * waiting on a heavyweight lock, and on a lightweight lock.
+ */
+static bool
+monitor_bench_sample_locks(Monitor *monitor, LockWaitersContext *context)
+{
+	const char *sql =
+		"SELECT count(*) FILTER (WHERE wait_event_type = 'Lock'), "
+		"       count(*) FILTER (WHERE wait_event_type = 'LWLock') "
+		"  FROM pg_stat_activity "
+		" WHERE datname = current_database() "
+		"   AND pid <> pg_backend_pid()";
+
+	if (!pgsql_execute_with_params(&(monitor->pgsql), sql, 0, NULL, NULL,
+								   context, &parseLockWaiters))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return context->parsedOk;
+}
+
+
+/*
+ * parseLockWaiters parses the result of the lock waiters sampling query.
+ */
+static void
+parseLockWaiters(void *ctx, PGresult *result)
+{
+	LockWaitersContext *context = (LockWaitersContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows with %d columns, expected 1 row "
+				  "with 2 columns",
+				  PQntuples(result), PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (!stringToInt(PQgetvalue(result, 0, 0), &(context->lockWaiters)) ||
+		!stringToInt(PQgetvalue(result, 0, 1), &(context->lwlockWaiters)))
+	{
+		log_error("Failed to parse the lock waiters counts");
+		context->parsedOk = false;
+		return;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * monitor_bench_cleanup removes the synthetic nodes and drops the synthetic
+ * formations from the monitor.
+ */
+bool
+monitor_bench_cleanup(MonitorBenchOptions *options, MonitorBenchNode *nodes)
+{
+	Monitor monitor = { 0 };
+	bool success = true;
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int index = 0; index < options->nodesCount; index++)
+	{
+		MonitorBenchNode *node = &(nodes[index]);
+		int64_t nodeId = -1;
+		int groupId = -1;
+
+		if (node->nodeId == 0)
+		{
+			/* that node has not been registered */
+			continue;
+		}
+
+		if (!monitor_remove_by_nodename(&monitor, node->formation, node->name,
+										true, &nodeId, &groupId))
+		{
+			log_warn("Failed to remove synthetic node %s", node->name);
+			success = false;
+		}
+	}
+
+	for (int groupIndex = 0; groupIndex < options->groupsCount; groupIndex++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		monitor_bench_formation_name(options, groupIndex,
+									 formation, sizeof(formation));
+
+		if (!monitor_drop_formation(&monitor, formation))
+		{
+			log_warn("Failed to drop synthetic formation \"%s\"", formation);
+			success = false;
+		}
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	return success;
+}
+
+
+/*
+ * monitor_bench_print_result prints the benchmark results.
+ */
+void
+monitor_bench_print_result(MonitorBenchOptions *options,
+						   MonitorBenchResult *result)
+{
+	double seconds = result->durationMs / 1000.0;
+
+	fformat(stdout, "%20s: %d in %d group(s)\n", "Nodes",
+			options->nodesCount, options->groupsCount);
+	fformat(stdout, "%20s: %d\n", "Clients", options->clientsCount);
+	fformat(stdout, "%20s: %.3fs\n", "Duration", seconds);
+	fformat(stdout, "%20s: %" PRId64 "\n", "Calls", result->calls);
+	fformat(stdout, "%20s: %" PRId64 "\n", "Errors", result->errors);
+	fformat(stdout, "%20s: %" PRId64 "\n", "State transitions",
+			result->transitions);
+	fformat(stdout, "%20s: %.1f calls/s\n", "Throughput",
+			seconds > 0 ? result->calls / seconds : 0.0);
+	fformat(stdout, "\n");
+	fformat(stdout, "%20s: %.3f ms\n", "Latency min", result->minMs);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p50", result->p50Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p90", result->p90Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p99", result->p99Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p99.9", result->p999Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency max", result->maxMs);
+	fformat(stdout, "\n");
+	fformat(stdout, "%20s: %" PRId64 "\n", "Lock samples",
+			result->lockSamples);
+	fformat(stdout, "%20s: %.2f avg, %d max\n", "Lock waiters",
+			result->avgLockWaiters, result->maxLockWaiters);
+	fformat(stdout, "%20s: %.2f avg, %d max\n", "LWLock waiters",
+			result->avgLWLockWaiters, result->maxLWLockWaiters);
+}
+
+
+/*
+ * monitor_bench_print_result_as_json prints the benchmark results in JSON.
+ */
+void
+monitor_bench_print_result_as_json(MonitorBenchOptions *options,
+								   MonitorBenchResult *result)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	double seconds = result->durationMs / 1000.0;
+
+	json_object_dotset_number(root, "options.nodes", options->nodesCount);
+	json_object_dotset_number(root, "options.groups", options->groupsCount);
+	json_object_dotset_number(root, "options.clients", options->clientsCount);
+	json_object_dotset_number(root, "options.duration", options->duration);
+	json_object_dotset_number(root, "options.rate", options->rate);
+
+	json_object_set_number(root, "duration_s", seconds);
+	json_object_set_number(root, "calls", (double) result->calls);
+	json_object_set_number(root, "errors", (double) result->errors);
+	json_object_set_number(root, "transitions", (double) result->transitions);
+	json_object_set_number(root, "throughput",
+						   seconds > 0 ? result->calls / seconds : 0.0);
+
+	json_object_dotset_number(root, "latency_ms.min", result->minMs);
+	json_object_dotset_number(root, "latency_ms.p50", result->p50Ms);
+	json_object_dotset_number(root, "latency_ms.p90", result->p90Ms);
+	json_object_dotset_number(root, "latency_ms.p99", result->p99Ms);
+	json_object_dotset_number(root, "latency_ms.p999", result->p999Ms);
+	json_object_dotset_number(root, "latency_ms.max", result->maxMs);
+
+	json_object_dotset_number(root, "lock_waits.samples",
+							  (double) result->lockSamples);
+	json_object_dotset_number(root, "lock_waits.lock_avg",
+							  result->avgLockWaiters);
+	json_object_dotset_number(root, "lock_waits.lock_max",
+							  result->maxLockWaiters);
+	json_object_dotset_number(root, "lock_waits.lwlock_avg",
+							  result->avgLWLockWaiters);
+	json_object_dotset_number(root, "lock_waits.lwlock_max",
+							  result->maxLWLockWaiters);
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * write_fully writes the whole buffer to the given file descriptor.
+ */
+static bool
+write_fully(int fd, const void *buffer, size_t size)
+{
+	const char *ptr = (const char *) buffer;
+
+	while (size > 0)
+	{
+		ssize_t bytes = write(fd, ptr, size);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		ptr += bytes;
+		size -= bytes;
+	}
+
+	return true;
+}
+
+
+/*
+ * read_fully reads exactly size bytes from the given file descriptor.
+ */
+static bool
+read_fully(int fd, void *buffer, size_t size)
+{
+	char *ptr = (char *) buffer;
+
+	while (size > 0)
+	{
+		ssize_t bytes = read(fd, ptr, size);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		ptr += bytes;
+		size -= bytes;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_bench_compare_doubles is a qsort comparison function for doubles.
+ */
+int
+monitor_bench_compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+
+	return (da > db) - (da < db);
+}
+
+
+/*
+ * monitor_bench_percentile returns the value at the given rank in a sorted
+ * array, using the nearest-rank method.
+ */
+double
+monitor_bench_percentile(double *sorted, int64_t count, double rank)
+{
+	int64_t index = (int64_t) (rank * count + 0.5);
+
+	if (index < 1)
+	{
+		index = 1;
+	}
+
+	if (index > count)
+	{
+		index = count;
+	}
+
+	return sorted[index - 1];
+}
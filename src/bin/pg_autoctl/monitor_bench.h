@@ -0,0 +1,92 @@
+/*
+ * src/bin/pg_autoctl/monitor_bench.h
+ *	 Benchmark the monitor decision engine with synthetic nodes.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef MONITOR_BENCH_H
+#define MONITOR_BENCH_H
+
+#include <stdbool.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "monitor.h"
+#include "state.h"
+
+#define MONITOR_BENCH_MAX_NODES 10000
+#define MONITOR_BENCH_MAX_CLIENTS 256
+
+typedef struct MonitorBenchOptions
+{
+	char monitor_pguri[MAXCONNINFO];
+	char formation[NAMEDATALEN];
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+
+	int nodesCount;
+	int groupsCount;
+	int clientsCount;
+	int duration;               /* seconds */
+	int rate;                   /* node_active calls per second, 0 is max */
+	bool keep;                  /* keep the synthetic formations at the end */
+} MonitorBenchOptions;
+
+/*
+ * A synthetic node behaves like a keeper that reaches its goal state
+ * immediately: it reports its assigned state back on the next call.
+ */
+typedef struct MonitorBenchNode
+{
+	char formation[NAMEDATALEN];
+	char name[_POSIX_HOST_NAME_MAX];
+	int port;
+	int64_t nodeId;
+	int groupId;
+	NodeState state;
+} MonitorBenchNode;
+
+typedef struct MonitorBenchResult
+{
+	double durationMs;
+	int64_t calls;
+	int64_t errors;
+	int64_t transitions;
+
+	/* latencies of the successful node_active calls, in milliseconds */
+	double minMs;
+	double p50Ms;
+	double p90Ms;
+	double p99Ms;
+	double p999Ms;
+	double maxMs;
+
+	/* sessions waiting on a lock, sampled on the monitor during the run */
+	int64_t lockSamples;
+	int maxLockWaiters;
+	double avgLockWaiters;
+	int maxLWLockWaiters;
+	double avgLWLockWaiters;
+} MonitorBenchResult;
+
+bool monitor_bench_register_nodes(MonitorBenchOptions *options,
+								  MonitorBenchNode *nodes);
+bool monitor_bench_run(MonitorBenchOptions *options,
+					   MonitorBenchNode *nodes,
+					   MonitorBenchResult *result);
+bool monitor_bench_cleanup(MonitorBenchOptions *options,
+						   MonitorBenchNode *nodes);
+
+void monitor_bench_print_result(MonitorBenchOptions *options,
+								MonitorBenchResult *result);
+void monitor_bench_print_result_as_json(MonitorBenchOptions *options,
+										MonitorBenchResult *result);
+
+int monitor_bench_compare_doubles(const void *a, const void *b);
+double monitor_bench_percentile(double *sorted, int64_t count, double rank);
+
+#endif /* MONITOR_BENCH_H */
@@ -19,7 +19,9 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "log.h"
+#include "parsing.h"
 #include "pgctl.h"
+#include "service_metrics.h"
 
 #define OPTION_AUTOCTL_ROLE(config) \
 	make_strbuf_option_default("pg_autoctl", "role", NULL, true, NAMEDATALEN, \
@@ -98,6 +100,27 @@
 	make_strbuf_option("ssl", "key_file", "server-key", \
 					   false, MAXPGPATH, config->pgSetup.ssl.serverKey)
 
+#define OPTION_METRICS_LISTEN(config) \
+	make_strbuf_option("metrics", "listen", NULL, \
+					   false, MAXPGPATH, config->metricsListen)
+
+#define OPTION_STANDBY_PRIMARY(config) \
+	make_strbuf_option("standby", "primary", "standby-of", \
+					   false, MAXCONNINFO, config->standbyOf)
+
+#define OPTION_STANDBY_TAKEOVER_TIMEOUT(config) \
+	make_int_option_default("standby", "takeover_timeout", NULL, \
+							false, &(config->takeoverTimeout), \
+							MONITOR_STANDBY_TAKEOVER_TIMEOUT)
+
+#define OPTION_CLUSTER_PEERS(config) \
+	make_strbuf_option("cluster", "peers", NULL, \
+					   false, MAXCONNINFO, config->clusterPeers)
+
+#define OPTION_CLUSTER_QUORUM(config) \
+	make_int_option_default("cluster", "quorum", NULL, \
+							false, &(config->clusterQuorum), 0)
+
 
 #define SET_INI_OPTIONS_ARRAY(config) \
 	{ \
@@ -118,6 +141,11 @@
 		OPTION_SSL_CRL_FILE(config), \
 		OPTION_SSL_SERVER_CERT(config), \
 		OPTION_SSL_SERVER_KEY(config), \
+		OPTION_METRICS_LISTEN(config), \
+		OPTION_STANDBY_PRIMARY(config), \
+		OPTION_STANDBY_TAKEOVER_TIMEOUT(config), \
+		OPTION_CLUSTER_PEERS(config), \
+		OPTION_CLUSTER_QUORUM(config), \
 		INI_OPTION_LAST \
 	}
 
@@ -281,6 +309,23 @@ monitor_config_read_file(MonitorConfig *config,
 		return false;
 	}
 
+	/*
+	 * Check metrics.listen now, so that a typo there fails pg_autoctl run
+	 * early rather than having the supervisor restart the metrics service
+	 * until it gives up.
+	 */
+	if (!IS_EMPTY_STRING_BUFFER(config->metricsListen))
+	{
+		MetricsListenAddress address = { 0 };
+
+		if (!service_metrics_parse_listen(config->metricsListen, &address))
+		{
+			log_error("Failed to parse metrics.listen from the \"%s\" "
+					  "configuration file", filename);
+			return false;
+		}
+	}
+
 	if (!pg_setup_init(&pgSetup,
 					   &config->pgSetup,
 					   missing_pgdata_is_ok,
@@ -395,6 +440,12 @@ monitor_config_log_settings(MonitorConfig config)
 	log_debug("ssl.crlFile: %s", config.pgSetup.ssl.crlFile);
 	log_debug("ssl.serverKey: %s", config.pgSetup.ssl.serverCert);
 	log_debug("ssl.serverCert: %s", config.pgSetup.ssl.serverKey);
+
+	log_debug("standby.primary: %s", config.standbyOf);
+	log_debug("standby.takeover_timeout: %d", config.takeoverTimeout);
+
+	log_debug("cluster.peers: %s", config.clusterPeers);
+	log_debug("cluster.quorum: %d", config.clusterQuorum);
 }
 
 
@@ -486,6 +537,34 @@ monitor_config_get_postgres_uri(MonitorConfig *config, char *connectionString,
 		strlcpy(host, config->pgSetup.listen_addresses, BUFSIZE);
 	}
 
+	/*
+	 * On a monitor standby, give a multi-host connection string that lists
+	 * the primary monitor first, so that the keepers follow the takeover.
+	 */
+	char hosts[BUFSIZE] = { 0 };
+	char separator = '?';
+
+	if (MONITOR_IS_STANDBY(config))
+	{
+		char primaryHost[_POSIX_HOST_NAME_MAX] = { 0 };
+		int primaryPort = 0;
+
+		if (!hostname_from_uri(config->standbyOf,
+							   primaryHost, sizeof(primaryHost),
+							   &primaryPort))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		sformat(hosts, sizeof(hosts), "%s:%d,%s:%d",
+				primaryHost, primaryPort, host, config->pgSetup.pgport);
+	}
+	else
+	{
+		sformat(hosts, sizeof(hosts), "%s:%d", host, config->pgSetup.pgport);
+	}
+
 	/*
 	 * Finalize the connection string, with some variants depending on the
 	 * usage of SSL certificates. The full variant is with sslrootcert and
@@ -494,19 +573,27 @@ monitor_config_get_postgres_uri(MonitorConfig *config, char *connectionString,
 	 */
 	connStringEnd += sformat(connStringEnd,
 							 size - (connStringEnd - connectionString),
-							 "postgres://%s@%s:%d/%s",
+							 "postgres://%s@%s/%s",
 							 config->pgSetup.username,
-							 host,
-							 config->pgSetup.pgport,
+							 hosts,
 							 config->pgSetup.dbname);
 
+	if (MONITOR_IS_STANDBY(config))
+	{
+		connStringEnd += sformat(connStringEnd,
+								 size - (connStringEnd - connectionString),
+								 "?target_session_attrs=read-write");
+		separator = '&';
+	}
+
 	if (config->pgSetup.ssl.sslMode >= SSL_MODE_PREFER)
 	{
 		char *sslmode = pgsetup_sslmode_to_string(config->pgSetup.ssl.sslMode);
 
 		connStringEnd += sformat(connStringEnd,
 								 size - (connStringEnd - connectionString),
-								 "?sslmode=%s",
+								 "%csslmode=%s",
+								 separator,
 								 sslmode);
 
 		if (config->pgSetup.ssl.sslMode >= SSL_MODE_VERIFY_CA)
@@ -633,6 +720,60 @@ monitor_config_accept_new(MonitorConfig *config, MonitorConfig *newConfig)
 		strlcpy(config->hostname, newConfig->hostname, _POSIX_HOST_NAME_MAX);
 	}
 
+	/*
+	 * The metrics service is only started by pg_autoctl run when
+	 * metrics.listen is set, so we keep using the value we started with.
+	 */
+	if (strneq(newConfig->metricsListen, config->metricsListen))
+	{
+		log_warn("pg_autoctl doesn't know how to change metrics.listen "
+				 "at run-time, continuing with \"%s\"; restart pg_autoctl "
+				 "to use \"%s\"",
+				 config->metricsListen,
+				 newConfig->metricsListen);
+	}
+
+	/* the takeover of a monitor standby can be tuned online */
+	if (newConfig->takeoverTimeout != config->takeoverTimeout)
+	{
+		log_info("Reloading configuration: standby.takeover_timeout is now %d; "
+				 "used to be %d",
+				 newConfig->takeoverTimeout, config->takeoverTimeout);
+		config->takeoverTimeout = newConfig->takeoverTimeout;
+	}
+
+	/* the monitor cluster setup can be changed online */
+	if (strneq(newConfig->clusterPeers, config->clusterPeers))
+	{
+		char scrubbedPeers[MAXCONNINFO] = { 0 };
+
+		(void) parse_and_scrub_connection_string(newConfig->clusterPeers,
+												 scrubbedPeers);
+
+		log_info("Reloading configuration: cluster.peers is now \"%s\"",
+				 scrubbedPeers);
+		strlcpy(config->clusterPeers, newConfig->clusterPeers, MAXCONNINFO);
+	}
+
+	if (newConfig->clusterQuorum != config->clusterQuorum)
+	{
+		log_info("Reloading configuration: cluster.quorum is now %d; "
+				 "used to be %d",
+				 newConfig->clusterQuorum, config->clusterQuorum);
+		config->clusterQuorum = newConfig->clusterQuorum;
+	}
+
+	/*
+	 * A standby monitor node is created with pg_basebackup, and only stops
+	 * being a standby when promoted, so we keep the value we started with.
+	 */
+	if (strneq(newConfig->standbyOf, config->standbyOf))
+	{
+		log_warn("pg_autoctl doesn't know how to change standby.primary "
+				 "at run-time, continuing with \"%s\"",
+				 config->standbyOf);
+	}
+
 	/* we can change any SSL related setup options at runtime */
 	return config_accept_new_ssloptions(&(config->pgSetup),
 										&(newConfig->pgSetup));
@@ -31,8 +31,22 @@ typedef struct MonitorConfig
 
 	/* PostgreSQL setup */
 	PostgresSetup pgSetup;
+
+	/* metrics service setup, empty when disabled */
+	char metricsListen[MAXPGPATH];
+
+	/* monitor standby setup, standbyOf is empty on a primary monitor */
+	char standbyOf[MAXCONNINFO];
+	int takeoverTimeout;        /* seconds */
+
+	/* the other monitors of a monitor cluster, and the commit quorum */
+	char clusterPeers[MAXCONNINFO];
+	int clusterQuorum;
 } MonitorConfig;
 
+#define MONITOR_IS_STANDBY(config) \
+	(!IS_EMPTY_STRING_BUFFER((config)->standbyOf))
+
 
 bool monitor_config_set_pathnames_from_pgdata(MonitorConfig *config);
 void monitor_config_init(MonitorConfig *config,
@@ -63,11 +63,13 @@ GUC monitor_default_settings[] = {
 
 
 static bool check_monitor_settings(PostgresSetup pgSetup);
+static bool monitor_pg_init_standby(Monitor *monitor);
 
 
 /*
  * monitor_pg_init initializes a pg_auto_failover monitor PostgreSQL cluster
- * from scratch using `pg_ctl initdb`.
+ * from scratch using `pg_ctl initdb`, or using pg_basebackup from the
+ * primary monitor when creating a monitor standby.
  */
 bool
 monitor_pg_init(Monitor *monitor)
@@ -108,6 +110,15 @@ monitor_pg_init(Monitor *monitor)
 			return false;
 		}
 	}
+	else if (MONITOR_IS_STANDBY(config))
+	{
+		if (!monitor_pg_init_standby(monitor))
+		{
+			log_fatal("Failed to initialize a monitor standby at \"%s\", "
+					  "see above for details", pgSetup->pgdata);
+			return false;
+		}
+	}
 	else
 	{
 		if (!pg_ctl_initdb(pgSetup->pg_ctl, pgSetup->pgdata))
@@ -129,6 +140,100 @@ monitor_pg_init(Monitor *monitor)
 }
 
 
+/*
+ * monitor_pg_init_standby copies the primary monitor database with
+ * pg_basebackup, and sets it up to stream from the primary monitor. We
+ * connect with the replication user that monitor_install() created, and
+ * don't use a replication slot: a lost monitor standby must not fill-up the
+ * disk of the primary monitor.
+ */
+static bool
+monitor_pg_init_standby(Monitor *monitor)
+{
+	MonitorConfig *config = &(monitor->config);
+	PostgresSetup *pgSetup = &(config->pgSetup);
+	ReplicationSource upstream = { 0 };
+
+	if (!monitor_standby_replication_source(config, &upstream))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Initialising the monitor as a hot standby of %s:%d",
+			 upstream.primaryNode.host, upstream.primaryNode.port);
+
+	/* first, make sure we can connect with "replication" */
+	if (!pgctl_identify_system(&upstream))
+	{
+		log_error("Failed to connect to the primary monitor with a "
+				  "replication connection string. See above for details");
+		return false;
+	}
+
+	if (!pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, &upstream))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* we need the pg_control_version of our new PGDATA */
+	if (!pg_controldata(pgSetup, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   &upstream))
+	{
+		log_error("Failed to setup the monitor as a standby "
+				  "after pg_basebackup");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_standby_replication_source prepares the replication source of a
+ * monitor standby from its standby.primary setting.
+ */
+bool
+monitor_standby_replication_source(MonitorConfig *config,
+								   ReplicationSource *upstream)
+{
+	PostgresSetup *pgSetup = &(config->pgSetup);
+	char backupDirectory[MAXPGPATH] = { 0 };
+
+	if (!hostname_from_uri(config->standbyOf,
+						   upstream->primaryNode.host,
+						   sizeof(upstream->primaryNode.host),
+						   &(upstream->primaryNode.port)))
+	{
+		log_error("Failed to parse the primary monitor URL \"%s\"",
+				  config->standbyOf);
+		return false;
+	}
+
+	path_in_same_directory(pgSetup->pgdata, "backup/monitor", backupDirectory);
+
+	strlcpy(upstream->primaryNode.name, "monitor", _POSIX_HOST_NAME_MAX);
+	strlcpy(upstream->userName, PG_AUTOCTL_REPLICA_USERNAME, NAMEDATALEN);
+	strlcpy(upstream->maximumBackupRate, MAXIMUM_BACKUP_RATE,
+			MAXIMUM_BACKUP_RATE_LEN);
+	strlcpy(upstream->backupDir, backupDirectory, MAXCONNINFO);
+	strlcpy(upstream->applicationName, MONITOR_STANDBY_APPLICATION_NAME,
+			sizeof(upstream->applicationName));
+	upstream->sslOptions = pgSetup->ssl;
+
+	return true;
+}
+
+
 /*
  * Install pg_auto_failover monitor in some existing PostgreSQL instance:
  *
@@ -181,6 +286,17 @@ monitor_install(const char *hostname,
 		return false;
 	}
 
+	/* monitor standby nodes stream from us with this user */
+	if (!pgsql_create_user(&postgres.sqlClient, PG_AUTOCTL_REPLICA_USERNAME,
+
+	                       /* password, login, superuser, replication, connlimit */
+						   NULL, true, false, true, -1))
+	{
+		log_error("Failed to create user \"%s\" on local postgres server",
+				  PG_AUTOCTL_REPLICA_USERNAME);
+		return false;
+	}
+
 	if (!pgsql_create_database(&postgres.sqlClient,
 							   PG_AUTOCTL_MONITOR_DBNAME,
 							   PG_AUTOCTL_MONITOR_DBOWNER))
@@ -249,6 +365,20 @@ monitor_install(const char *hostname,
 		return false;
 	}
 
+	if (!pghba_enable_lan_cidr(&postgres.sqlClient,
+							   pgSetup.ssl.active,
+							   HBA_DATABASE_REPLICATION,
+							   NULL,
+							   hostname,
+							   PG_AUTOCTL_REPLICA_USERNAME,
+							   pg_setup_get_auth_method(&pgSetup),
+							   pgSetup.hbaLevel,
+							   NULL))
+	{
+		log_warn("Failed to grant replication connections to local network.");
+		return false;
+	}
+
 	log_info("Your pg_auto_failover monitor instance is now ready on port %d.",
 			 pgSetup.pgport);
 
@@ -343,10 +473,19 @@ monitor_add_postgres_default_settings(Monitor *monitor)
 		}
 	}
 
+	/* the monitor has its own workload profile, see pgtuning.c */
+	if (IS_EMPTY_STRING_BUFFER(pgSetup->tuningProfile))
+	{
+		strlcpy(pgSetup->tuningProfile, MONITOR_TUNING_PROFILE,
+				sizeof(pgSetup->tuningProfile));
+	}
+
 	if (!pg_add_auto_failover_default_settings(pgSetup,
 											   config->hostname,
 											   configFilePath,
-											   monitor_default_settings))
+											   monitor_default_settings,
+											   NULL,
+											   0))
 	{
 		log_error("Failed to add default settings to \"%s\": couldn't "
 				  "write the new postgresql.conf, see above for details",
@@ -20,5 +20,7 @@ bool monitor_install(const char *hostname,
 					 PostgresSetup pgSetupOption,
 					 bool checkSettings);
 bool monitor_add_postgres_default_settings(Monitor *monitor);
+bool monitor_standby_replication_source(MonitorConfig *config,
+										ReplicationSource *upstream);
 
 #endif /* MONITOR_PG_INIT_H */
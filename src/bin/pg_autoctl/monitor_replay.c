@@ -0,0 +1,1664 @@
+/*
+ * src/bin/pg_autoctl/monitor_replay.c
+ *	 Replay a production events log against a scratch monitor.
+ *
+ * The events found in pgautofailover.event record what each node reported
+ * to the monitor, and which goal state the monitor assigned in return. We
+ * register a synthetic node on a scratch monitor for each node found in the
+ * events, and then replay the reported states, timelines and LSNs at the
+ * pace found in the events log, possibly accelerated. Health transitions
+ * found in the events are replayed too: a node marked unhealthy stops
+ * reporting until it's marked healthy again, as if its host was lost.
+ *
+ * Comparing the goal states assigned by the scratch monitor with the ones
+ * found in the events log then tells how a change in the monitor decisions,
+ * such as a new candidate selection policy or different timeouts, would have
+ * behaved during a real incident, and how it impacts failover times.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "monitor.h"
+#include "monitor_bench.h"
+#include "monitor_replay.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+/* synthetic groups all share the same system identifier */
+#define MONITOR_REPLAY_SYSTEM_IDENTIFIER 6100000000000000000ULL
+
+/* how many rounds we allow the synthetic groups to reach a stable state */
+#define MONITOR_REPLAY_WARMUP_ROUNDS 100
+
+/* node health values, see src/monitor/health_check.h */
+#define MONITOR_REPLAY_HEALTH_BAD 0
+#define MONITOR_REPLAY_HEALTH_GOOD 1
+
+/*
+ * The monitor timeouts are compared to the wall-clock time, so when the
+ * replay is accelerated we scale them down by the same factor.
+ */
+static const char *replayTimeoutNames[MONITOR_REPLAY_TIMEOUTS_COUNT] = {
+	"pgautofailover.node_considered_unhealthy_timeout",
+	"pgautofailover.node_unhealthy_timeout_min",
+	"pgautofailover.primary_demote_timeout",
+	"pgautofailover.startup_grace_period",
+	"pgautofailover.sync_standby_disconnect_timeout",
+	"pgautofailover.promotion_catchup_timeout",
+	"pgautofailover.node_report_persist_interval"
+};
+
+typedef struct ReplayEventsContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorReplay *replay;
+	bool parsedOk;
+} ReplayEventsContext;
+
+typedef struct ReplayTimeoutContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorReplayTimeout *timeout;
+	bool parsedOk;
+} ReplayTimeoutContext;
+
+static void parseReplayEvents(void *ctx, PGresult *result);
+static int monitor_replay_find_node(MonitorReplay *replay,
+									const char *formation,
+									int groupId,
+									int64_t nodeId);
+static int monitor_replay_find_group(MonitorReplay *replay,
+									 const char *formation,
+									 int groupId);
+static void monitor_replay_formation_name(MonitorReplayOptions *options,
+										  MonitorReplay *replay,
+										  int groupIndex,
+										  char *formation, size_t size);
+static bool monitor_replay_set_health(Monitor *monitor,
+									  MonitorReplayNode *node,
+									  int health);
+static bool monitor_replay_warmup(Monitor *monitor, MonitorReplay *replay);
+static bool monitor_replay_node_active(Monitor *monitor,
+									   MonitorReplay *replay,
+									   int nodeIndex,
+									   double time,
+									   MonitorReplayResult *result);
+static bool monitor_replay_apply_event(Monitor *monitor,
+									   MonitorReplay *replay,
+									   MonitorReplayEvent *event,
+									   int *openIncidents,
+									   MonitorReplayResult *result);
+static bool monitor_replay_add_decision(MonitorReplay *replay,
+										int nodeIndex,
+										double time,
+										NodeState previousGoalState,
+										NodeState goalState);
+static void monitor_replay_compute_result(MonitorReplay *replay,
+										  MonitorReplayResult *result);
+static void parseReplayTimeout(void *ctx, PGresult *result);
+static bool monitor_replay_reload(Monitor *monitor);
+static bool is_primary_role(NodeState state);
+static double replay_elapsed_seconds(instr_time startTime, double speed);
+
+
+/*
+ * monitor_replay_load_events reads the events log from the given file, in
+ * the JSON format of pg_autoctl show events --json, and loads the events and
+ * the nodes that they are about. We have the scratch monitor parse and sort
+ * the events for us, which also parses the timestamps and LSNs.
+ */
+bool
+monitor_replay_load_events(MonitorReplayOptions *options,
+						   MonitorReplay *replay)
+{
+	Monitor monitor = { 0 };
+	char *contents = NULL;
+	long size = 0L;
+
+	const char *sql =
+		"WITH events AS "
+		"( "
+		"  SELECT * "
+		"    FROM jsonb_to_recordset($1::jsonb) "
+		"      AS e(eventid bigint, eventtime timestamptz, "
+		"           formationid text, groupid int, nodeid bigint, "
+		"           nodename text, reportedstate text, goalstate text, "
+		"           reportedtli int, reportedlsn pg_lsn, "
+		"           candidatepriority int, replicationquorum bool, "
+		"           description text) "
+		") "
+		"SELECT eventid, "
+		"       extract(epoch from eventtime - min(eventtime) over ()), "
+		"       formationid, groupid, nodeid, nodename, "
+		"       reportedstate, goalstate, "
+		"       coalesce(reportedtli, 1), coalesce(reportedlsn, '0/0'), "
+		"       coalesce(candidatepriority, -1), "
+		"       coalesce(replicationquorum, true), "
+		"       coalesce(description, '') "
+		"  FROM events "
+		" ORDER BY eventtime, eventid";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1];
+
+	ReplayEventsContext context = { { 0 }, replay, false };
+
+	if (!read_file(options->filename, &contents, &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	paramValues[0] = contents;
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		free(contents);
+		return false;
+	}
+
+	bool success =
+		pgsql_execute_with_params(&(monitor.pgsql), sql,
+								  paramCount, paramTypes, paramValues,
+								  &context, &parseReplayEvents);
+
+	pgsql_finish(&(monitor.pgsql));
+	free(contents);
+
+	if (!success || !context.parsedOk)
+	{
+		log_error("Failed to parse the events found in \"%s\", "
+				  "see above for details",
+				  options->filename);
+		return false;
+	}
+
+	if (replay->eventsCount == 0)
+	{
+		log_error("Failed to find any event in \"%s\"", options->filename);
+		return false;
+	}
+
+	log_info("Loaded %d events about %d nodes in %d group(s), "
+			 "covering %.3fs",
+			 replay->eventsCount,
+			 replay->nodesCount,
+			 replay->groupsCount,
+			 replay->events[replay->eventsCount - 1].eventTime);
+
+	return true;
+}
+
+
+/*
+ * parseReplayEvents parses the events loaded by monitor_replay_load_events,
+ * and builds the list of nodes that they are about.
+ */
+static void
+parseReplayEvents(void *ctx, PGresult *result)
+{
+	ReplayEventsContext *context = (ReplayEventsContext *) ctx;
+	MonitorReplay *replay = context->replay;
+
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 13)
+	{
+		log_error("Query returned %d columns, expected 13", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	replay->events =
+		(MonitorReplayEvent *) calloc(Max(nTuples, 1),
+									  sizeof(MonitorReplayEvent));
+	replay->nodes =
+		(MonitorReplayNode *) calloc(MONITOR_REPLAY_MAX_NODES,
+									 sizeof(MonitorReplayNode));
+
+	if (replay->events == NULL || replay->nodes == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		context->parsedOk = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		MonitorReplayEvent *event = &(replay->events[rowNumber]);
+
+		const char *formation = PQgetvalue(result, rowNumber, 2);
+		const char *description = PQgetvalue(result, rowNumber, 12);
+
+		int groupId = 0;
+		int64_t nodeId = 0;
+		int candidatePriority = 0;
+
+		if (!stringToInt64(PQgetvalue(result, rowNumber, 0), &(event->eventId)) ||
+			!stringToDouble(PQgetvalue(result, rowNumber, 1),
+							&(event->eventTime)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 3), &groupId) ||
+			!stringToInt64(PQgetvalue(result, rowNumber, 4), &nodeId) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 8),
+						 &(event->reportedTLI)) ||
+			!stringToInt(PQgetvalue(result, rowNumber, 10),
+						 &candidatePriority))
+		{
+			log_error("Failed to parse event at row %d", rowNumber + 1);
+			context->parsedOk = false;
+			return;
+		}
+
+		event->reportedState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 6));
+		event->goalState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 7));
+
+		if (event->reportedState == NO_STATE || event->goalState == NO_STATE)
+		{
+			log_error("Failed to parse the states of event %" PRId64,
+					  event->eventId);
+			context->parsedOk = false;
+			return;
+		}
+
+		strlcpy(event->reportedLSN, PQgetvalue(result, rowNumber, 9),
+				sizeof(event->reportedLSN));
+
+		/* see SetNodeHealthStateList() in src/monitor */
+		if (strstr(description, " is marked as unhealthy by the monitor"))
+		{
+			event->type = REPLAY_EVENT_UNHEALTHY;
+		}
+		else if (strstr(description, " is marked as healthy by the monitor"))
+		{
+			event->type = REPLAY_EVENT_HEALTHY;
+		}
+		else
+		{
+			event->type = REPLAY_EVENT_REPORT;
+		}
+
+		int nodeIndex =
+			monitor_replay_find_node(replay, formation, groupId, nodeId);
+
+		if (nodeIndex == -1)
+		{
+			if (replay->nodesCount == MONITOR_REPLAY_MAX_NODES)
+			{
+				log_error("Failed to replay events about more than %d nodes",
+						  MONITOR_REPLAY_MAX_NODES);
+				context->parsedOk = false;
+				return;
+			}
+
+			int groupIndex =
+				monitor_replay_find_group(replay, formation, groupId);
+
+			nodeIndex = replay->nodesCount++;
+
+			MonitorReplayNode *node = &(replay->nodes[nodeIndex]);
+
+			strlcpy(node->sourceFormation, formation,
+					sizeof(node->sourceFormation));
+			strlcpy(node->sourceName, PQgetvalue(result, rowNumber, 5),
+					sizeof(node->sourceName));
+
+			node->sourceGroupId = groupId;
+			node->sourceNodeId = nodeId;
+			node->groupIndex =
+				groupIndex == -1 ? replay->groupsCount++ : groupIndex;
+
+			node->candidatePriority =
+				candidatePriority == -1
+				? FAILOVER_NODE_CANDIDATE_PRIORITY
+				: candidatePriority;
+			node->replicationQuorum =
+				strcmp(PQgetvalue(result, rowNumber, 11), "t") == 0;
+
+			/* the node was in its reported state before the first event */
+			node->reportedState = event->reportedState;
+			node->reportedTLI = event->reportedTLI;
+			node->sourceGoalState = event->reportedState;
+			strlcpy(node->reportedLSN, event->reportedLSN,
+					sizeof(node->reportedLSN));
+		}
+
+		event->nodeIndex = nodeIndex;
+	}
+
+	replay->eventsCount = nTuples;
+
+	/* at most one production decision per event */
+	replay->sourceDecisions =
+		(MonitorReplayDecision *) calloc(Max(nTuples, 1),
+										 sizeof(MonitorReplayDecision));
+
+	if (replay->sourceDecisions == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		context->parsedOk = false;
+		return;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * monitor_replay_find_node returns the index of the node with the given
+ * production identity, or -1 when it's not been seen yet.
+ */
+static int
+monitor_replay_find_node(MonitorReplay *replay,
+						 const char *formation, int groupId, int64_t nodeId)
+{
+	for (int index = 0; index < replay->nodesCount; index++)
+	{
+		MonitorReplayNode *node = &(replay->nodes[index]);
+
+		if (node->sourceNodeId == nodeId &&
+			node->sourceGroupId == groupId &&
+			strcmp(node->sourceFormation, formation) == 0)
+		{
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * monitor_replay_find_group returns the index of the given production group,
+ * or -1 when it's not been seen yet.
+ */
+static int
+monitor_replay_find_group(MonitorReplay *replay,
+						  const char *formation, int groupId)
+{
+	for (int index = 0; index < replay->nodesCount; index++)
+	{
+		MonitorReplayNode *node = &(replay->nodes[index]);
+
+		if (node->sourceGroupId == groupId &&
+			strcmp(node->sourceFormation, formation) == 0)
+		{
+			return node->groupIndex;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * monitor_replay_formation_name computes the name of the formation used for
+ * a replayed group. Formations of kind pgsql only have the group zero, so we
+ * create one formation per production group when there's more than one.
+ */
+static void
+monitor_replay_formation_name(MonitorReplayOptions *options,
+							  MonitorReplay *replay,
+							  int groupIndex,
+							  char *formation, size_t size)
+{
+	if (replay->groupsCount == 1)
+	{
+		strlcpy(formation, options->formation, size);
+	}
+	else
+	{
+		sformat(formation, size, "%s_%d", options->formation, groupIndex);
+	}
+}
+
+
+/*
+ * monitor_replay_register_nodes creates the synthetic formations, registers
+ * a synthetic node for each node found in the events log, and then has the
+ * synthetic groups reach a stable state before the replay starts.
+ *
+ * In each group, the node that first reported a primary role in the events
+ * log is registered first, so that it's also the primary node of the scratch
+ * monitor at the beginning of the replay.
+ */
+bool
+monitor_replay_register_nodes(MonitorReplayOptions *options,
+							  MonitorReplay *replay)
+{
+	Monitor monitor = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (pgsql_execute_with_params(&(monitor.pgsql),
+								  "SELECT current_setting("
+								  "'pgautofailover.enable_health_checks')::bool",
+								  0, NULL, NULL,
+								  &context, &parseSingleValueResult) &&
+		context.parsedOk &&
+		context.boolVal)
+	{
+		log_warn("The scratch monitor runs health checks, which are going "
+				 "to compete with the health transitions of the replay");
+		log_warn("Consider setting pgautofailover.enable_health_checks "
+				 "to off on the scratch monitor");
+	}
+
+	for (int groupIndex = 0; groupIndex < replay->groupsCount; groupIndex++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		monitor_replay_formation_name(options, replay, groupIndex,
+									  formation, sizeof(formation));
+
+		if (!monitor_create_formation(&monitor, formation,
+									  "pgsql", "postgres", true, 0))
+		{
+			log_error("Failed to create the synthetic formation \"%s\", "
+					  "the replay should run on a scratch monitor",
+					  formation);
+			pgsql_finish(&(monitor.pgsql));
+			return false;
+		}
+	}
+
+	int *order = (int *) calloc(replay->nodesCount, sizeof(int));
+	int orderCount = 0;
+
+	MonitorAssignedState *assignedStates =
+		(MonitorAssignedState *) calloc(replay->nodesCount,
+										sizeof(MonitorAssignedState));
+
+	if (order == NULL || assignedStates == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(order);
+		free(assignedStates);
+		pgsql_finish(&(monitor.pgsql));
+		return false;
+	}
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int index = 0; index < replay->nodesCount; index++)
+		{
+			bool primary = is_primary_role(replay->nodes[index].reportedState);
+
+			if ((pass == 0 && primary) || (pass == 1 && !primary))
+			{
+				order[orderCount++] = index;
+			}
+		}
+	}
+
+	JSON_Value *js = json_value_init_array();
+	JSON_Array *jsArray = json_value_get_array(js);
+
+	for (int orderIndex = 0; orderIndex < orderCount; orderIndex++)
+	{
+		int index = order[orderIndex];
+		MonitorReplayNode *node = &(replay->nodes[index]);
+
+		JSON_Value *jsNode = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(jsNode);
+
+		char sysIdentifier[BUFSIZE] = { 0 };
+
+		monitor_replay_formation_name(options, replay, node->groupIndex,
+									  node->formation, sizeof(node->formation));
+
+		strlcpy(node->name, node->sourceName, sizeof(node->name));
+		node->port = options->port + index;
+
+		/* a JSON number can't hold every 64 bits integer, use a string */
+		sformat(sysIdentifier, sizeof(sysIdentifier), "%" PRIu64,
+				(uint64_t) (MONITOR_REPLAY_SYSTEM_IDENTIFIER + node->groupIndex));
+
+		json_object_set_string(jsObj, "formation_id", node->formation);
+		json_object_set_string(jsObj, "node_host", options->host);
+		json_object_set_number(jsObj, "node_port", (double) node->port);
+		json_object_set_string(jsObj, "dbname", "postgres");
+		json_object_set_string(jsObj, "node_name", node->name);
+		json_object_set_string(jsObj, "sysidentifier", sysIdentifier);
+		json_object_set_number(jsObj, "desired_group_id", 0);
+		json_object_set_number(jsObj, "candidate_priority",
+							   (double) node->candidatePriority);
+		json_object_set_boolean(jsObj, "replication_quorum",
+								node->replicationQuorum);
+
+		json_array_append_value(jsArray, jsNode);
+	}
+
+	char *nodesJSON = json_serialize_to_string(js);
+
+	bool success =
+		nodesJSON != NULL &&
+		monitor_register_nodes(&monitor, nodesJSON,
+							   assignedStates, replay->nodesCount);
+
+	json_free_serialized_string(nodesJSON);
+	json_value_free(js);
+
+	if (!success)
+	{
+		log_error("Failed to register the synthetic nodes");
+		free(order);
+		free(assignedStates);
+		pgsql_finish(&(monitor.pgsql));
+		return false;
+	}
+
+	for (int orderIndex = 0; orderIndex < orderCount; orderIndex++)
+	{
+		MonitorReplayNode *node = &(replay->nodes[order[orderIndex]]);
+
+		node->nodeId = assignedStates[orderIndex].nodeId;
+		node->groupId = assignedStates[orderIndex].groupId;
+		node->goalState = assignedStates[orderIndex].state;
+		node->reporting = true;
+	}
+
+	free(order);
+	free(assignedStates);
+
+	/* the synthetic nodes are healthy until the events say otherwise */
+	for (int index = 0; index < replay->nodesCount; index++)
+	{
+		if (!monitor_replay_set_health(&monitor, &(replay->nodes[index]),
+									   MONITOR_REPLAY_HEALTH_GOOD))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&(monitor.pgsql));
+			return false;
+		}
+	}
+
+	success = monitor_replay_warmup(&monitor, replay);
+
+	pgsql_finish(&(monitor.pgsql));
+
+	if (success)
+	{
+		log_info("Registered %d synthetic nodes in %d group(s)",
+				 replay->nodesCount, replay->groupsCount);
+	}
+
+	return success;
+}
+
+
+/*
+ * monitor_replay_set_health sets the health of a synthetic node, as the
+ * monitor health checks would have done.
+ */
+static bool
+monitor_replay_set_health(Monitor *monitor, MonitorReplayNode *node,
+						  int health)
+{
+	const char *sql =
+		"UPDATE pgautofailover.node "
+		"   SET health = $2, healthchecktime = now() "
+		" WHERE nodeid = $1";
+
+	int paramCount = 2;
+	Oid paramTypes[2] = { INT8OID, INT4OID };
+	const char *paramValues[2];
+
+	IntString nodeIdStr = intToString(node->nodeId);
+	IntString healthStr = intToString(health);
+
+	paramValues[0] = nodeIdStr.strValue;
+	paramValues[1] = healthStr.strValue;
+
+	if (!pgsql_execute_with_params(&(monitor->pgsql), sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to set the health of synthetic node %s",
+				  node->name);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_warmup drives the synthetic nodes as keepers that reach
+ * their goal state immediately, until the groups are stable. That's the
+ * starting point of the replay.
+ */
+static bool
+monitor_replay_warmup(Monitor *monitor, MonitorReplay *replay)
+{
+	for (int round = 0; round < MONITOR_REPLAY_WARMUP_ROUNDS; round++)
+	{
+		bool transition = false;
+
+		for (int index = 0; index < replay->nodesCount; index++)
+		{
+			MonitorReplayNode *node = &(replay->nodes[index]);
+			MonitorAssignedState assignedState = { 0 };
+
+			if (!monitor_node_active(monitor,
+									 node->formation,
+									 node->nodeId,
+									 node->groupId,
+									 node->goalState,
+									 true,
+									 node->reportedTLI,
+									 node->reportedLSN,
+									 "",
+									 0,
+									 node->reportedLSN,
+									 0,
+									 &assignedState))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			if (assignedState.state != node->goalState)
+			{
+				transition = true;
+				node->goalState = assignedState.state;
+			}
+		}
+
+		if (!transition)
+		{
+			log_debug("Synthetic groups are stable after %d rounds",
+					  round + 1);
+			return true;
+		}
+	}
+
+	log_warn("Synthetic groups are still changing states after %d rounds, "
+			 "starting the replay anyway",
+			 MONITOR_REPLAY_WARMUP_ROUNDS);
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_scale_timeouts scales the monitor timeouts by the replay
+ * speed, so that the monitor decisions happen at the same production time
+ * as they would when replaying in real time. We use ALTER SYSTEM, which
+ * requires a superuser connection to the scratch monitor.
+ */
+bool
+monitor_replay_scale_timeouts(MonitorReplayOptions *options,
+							  MonitorReplay *replay)
+{
+	Monitor monitor = { 0 };
+
+	if (options->speed == 1.0)
+	{
+		return true;
+	}
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int index = 0; index < MONITOR_REPLAY_TIMEOUTS_COUNT; index++)
+	{
+		MonitorReplayTimeout *timeout = &(replay->timeouts[index]);
+		ReplayTimeoutContext context = { { 0 }, timeout, false };
+
+		const char *sql =
+			"SELECT setting::bigint, "
+			"       coalesce(sourcefile LIKE '%postgresql.auto.conf', false) "
+			"  FROM pg_settings "
+			" WHERE name = $1";
+
+		int paramCount = 1;
+		Oid paramTypes[1] = { TEXTOID };
+		const char *paramValues[1] = { replayTimeoutNames[index] };
+
+		timeout->name = replayTimeoutNames[index];
+
+		if (!pgsql_execute_with_params(&(monitor.pgsql), sql,
+									   paramCount, paramTypes, paramValues,
+									   &context, &parseReplayTimeout) ||
+			!context.parsedOk)
+		{
+			log_error("Failed to read the monitor setting \"%s\"",
+					  timeout->name);
+			pgsql_finish(&(monitor.pgsql));
+			return false;
+		}
+	}
+
+	for (int index = 0; index < MONITOR_REPLAY_TIMEOUTS_COUNT; index++)
+	{
+		MonitorReplayTimeout *timeout = &(replay->timeouts[index]);
+		char sql[BUFSIZE] = { 0 };
+
+		/* zero disables some of those features, keep it that way */
+		int64_t value =
+			timeout->value == 0
+			? 0
+			: Max(1, (int64_t) llround(timeout->value / options->speed));
+
+		sformat(sql, sizeof(sql), "ALTER SYSTEM SET %s TO %" PRId64,
+				timeout->name, Min(value, (int64_t) INT_MAX));
+
+		if (!pgsql_execute(&(monitor.pgsql), sql))
+		{
+			log_error("Failed to scale the monitor timeouts for --speed %g, "
+					  "the replay needs a superuser connection to the "
+					  "scratch monitor, or --speed 1",
+					  options->speed);
+			(void) monitor_replay_restore_timeouts(options, replay);
+			pgsql_finish(&(monitor.pgsql));
+			return false;
+		}
+
+		replay->timeoutsScaled = true;
+
+		log_debug("%s = %" PRId64 "ms", timeout->name, value);
+	}
+
+	bool success = monitor_replay_reload(&monitor);
+
+	pgsql_finish(&(monitor.pgsql));
+
+	log_info("Scaled the monitor timeouts down by a factor of %g",
+			 options->speed);
+
+	return success;
+}
+
+
+/*
+ * parseReplayTimeout parses a monitor timeout setting and whether it has
+ * already been set with ALTER SYSTEM.
+ */
+static void
+parseReplayTimeout(void *ctx, PGresult *result)
+{
+	ReplayTimeoutContext *context = (ReplayTimeoutContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows with %d columns, expected 1 row "
+				  "with 2 columns",
+				  PQntuples(result), PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (!stringToInt64(PQgetvalue(result, 0, 0), &(context->timeout->value)))
+	{
+		log_error("Failed to parse the value of \"%s\"",
+				  context->timeout->name);
+		context->parsedOk = false;
+		return;
+	}
+
+	context->timeout->fromAutoConf = strcmp(PQgetvalue(result, 0, 1), "t") == 0;
+	context->parsedOk = true;
+}
+
+
+/*
+ * monitor_replay_restore_timeouts restores the monitor timeouts that have
+ * been scaled by monitor_replay_scale_timeouts.
+ */
+bool
+monitor_replay_restore_timeouts(MonitorReplayOptions *options,
+								MonitorReplay *replay)
+{
+	Monitor monitor = { 0 };
+	bool success = true;
+
+	if (!replay->timeoutsScaled)
+	{
+		return true;
+	}
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int index = 0; index < MONITOR_REPLAY_TIMEOUTS_COUNT; index++)
+	{
+		MonitorReplayTimeout *timeout = &(replay->timeouts[index]);
+		char sql[BUFSIZE] = { 0 };
+
+		if (timeout->fromAutoConf)
+		{
+			sformat(sql, sizeof(sql), "ALTER SYSTEM SET %s TO %" PRId64,
+					timeout->name, timeout->value);
+		}
+		else
+		{
+			sformat(sql, sizeof(sql), "ALTER SYSTEM RESET %s", timeout->name);
+		}
+
+		if (!pgsql_execute(&(monitor.pgsql), sql))
+		{
+			log_warn("Failed to restore the monitor setting %s to %" PRId64,
+					 timeout->name, timeout->value);
+			success = false;
+		}
+	}
+
+	success = monitor_replay_reload(&monitor) && success;
+
+	pgsql_finish(&(monitor.pgsql));
+
+	if (success)
+	{
+		replay->timeoutsScaled = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * monitor_replay_reload has the monitor reload its configuration, and waits
+ * a little so that the background workers also get the new settings.
+ */
+static bool
+monitor_replay_reload(Monitor *monitor)
+{
+	if (!pgsql_execute(&(monitor->pgsql), "SELECT pg_reload_conf()"))
+	{
+		log_error("Failed to reload the monitor configuration");
+		return false;
+	}
+
+	pg_usleep(500 * 1000);
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_run replays the events log. Each synthetic node reports its
+ * current state every PG_AUTOCTL_KEEPER_SLEEP_TIME seconds of production
+ * time, and right away when it's found in an event. All the times that we
+ * record are in production time, counted in seconds since the first event.
+ */
+bool
+monitor_replay_run(MonitorReplayOptions *options,
+				   MonitorReplay *replay,
+				   MonitorReplayResult *result)
+{
+	Monitor monitor = { 0 };
+
+	double heartbeat = (double) PG_AUTOCTL_KEEPER_SLEEP_TIME;
+	double endTime =
+		replay->events[replay->eventsCount - 1].eventTime +
+		MONITOR_REPLAY_TAIL_TIME;
+
+	int nextEvent = 0;
+	bool success = true;
+
+	instr_time startTime;
+	instr_time duration;
+
+	/* per group, the promotion of the incident in progress, if any */
+	int *openIncidents = (int *) calloc(replay->groupsCount, sizeof(int));
+
+	replay->latencyCapacity = 1024;
+	replay->latencies =
+		(double *) calloc(replay->latencyCapacity, sizeof(double));
+
+	if (openIncidents == NULL || replay->latencies == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(openIncidents);
+		return false;
+	}
+
+	for (int groupIndex = 0; groupIndex < replay->groupsCount; groupIndex++)
+	{
+		openIncidents[groupIndex] = -1;
+	}
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		free(openIncidents);
+		return false;
+	}
+
+	/* we want to measure the monitor, not our retry policy */
+	pgsql_set_main_loop_retry_policy(&(monitor.pgsql.retryPolicy));
+
+	log_info("Replaying %d events at %gx speed, this takes about %.3fs",
+			 replay->eventsCount, options->speed, endTime / options->speed);
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (;;)
+	{
+		double now = replay_elapsed_seconds(startTime, options->speed);
+
+		if (now >= endTime)
+		{
+			break;
+		}
+
+		while (nextEvent < replay->eventsCount &&
+			   replay->events[nextEvent].eventTime <= now)
+		{
+			if (!monitor_replay_apply_event(&monitor, replay,
+											&(replay->events[nextEvent]),
+											openIncidents,
+											result))
+			{
+				success = false;
+				break;
+			}
+
+			++nextEvent;
+		}
+
+		if (!success)
+		{
+			break;
+		}
+
+		double nextTime = endTime;
+
+		if (nextEvent < replay->eventsCount)
+		{
+			nextTime = Min(nextTime, replay->events[nextEvent].eventTime);
+		}
+
+		for (int index = 0; index < replay->nodesCount; index++)
+		{
+			MonitorReplayNode *node = &(replay->nodes[index]);
+
+			if (!node->reporting)
+			{
+				continue;
+			}
+
+			if (now - node->lastReportTime >= heartbeat)
+			{
+				now = replay_elapsed_seconds(startTime, options->speed);
+
+				(void) monitor_replay_node_active(&monitor, replay, index,
+												  now, result);
+			}
+
+			nextTime = Min(nextTime, node->lastReportTime + heartbeat);
+		}
+
+		now = replay_elapsed_seconds(startTime, options->speed);
+
+		if (nextTime > now)
+		{
+			pg_usleep((long) ((nextTime - now) / options->speed * 1000000.0));
+		}
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+	free(openIncidents);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	result->durationMs = INSTR_TIME_GET_MILLISEC(duration);
+	result->replayedSeconds = result->durationMs / 1000.0 * options->speed;
+	result->events = nextEvent;
+
+	(void) monitor_replay_compute_result(replay, result);
+
+	return success;
+}
+
+
+/*
+ * monitor_replay_apply_event replays an event from the events log: the node
+ * now reports the state, timeline, and LSN found in the event, and the goal
+ * state found in the event is recorded as a production decision.
+ */
+static bool
+monitor_replay_apply_event(Monitor *monitor,
+						   MonitorReplay *replay,
+						   MonitorReplayEvent *event,
+						   int *openIncidents,
+						   MonitorReplayResult *result)
+{
+	MonitorReplayNode *node = &(replay->nodes[event->nodeIndex]);
+
+	node->reportedState = event->reportedState;
+	node->reportedTLI = event->reportedTLI;
+	strlcpy(node->reportedLSN, event->reportedLSN, sizeof(node->reportedLSN));
+
+	if (event->goalState != node->sourceGoalState)
+	{
+		MonitorReplayDecision *decision =
+			&(replay->sourceDecisions[replay->sourceDecisionsCount++]);
+
+		decision->time = event->eventTime;
+		decision->nodeIndex = event->nodeIndex;
+		decision->goalState = event->goalState;
+		decision->promotion =
+			is_primary_role(event->goalState) &&
+			!is_primary_role(node->sourceGoalState);
+
+		node->sourceGoalState = event->goalState;
+
+		/* close the incident in progress, if any, with this promotion */
+		int promotionIndex = openIncidents[node->groupIndex];
+
+		if (decision->promotion && promotionIndex >= 0)
+		{
+			MonitorReplayPromotion *promotion =
+				&(result->promotions[promotionIndex]);
+
+			promotion->sourceNodeIndex = event->nodeIndex;
+			promotion->sourceRTO = event->eventTime - promotion->incidentTime;
+
+			openIncidents[node->groupIndex] = -1;
+		}
+	}
+
+	switch (event->type)
+	{
+		case REPLAY_EVENT_UNHEALTHY:
+		{
+			log_debug("Replaying event %" PRId64 ": node %s is unhealthy",
+					  event->eventId, node->name);
+
+			node->reporting = false;
+
+			if (openIncidents[node->groupIndex] == -1 &&
+				result->promotionsCount < MONITOR_REPLAY_MAX_PROMOTIONS)
+			{
+				int promotionIndex = result->promotionsCount++;
+				MonitorReplayPromotion *promotion =
+					&(result->promotions[promotionIndex]);
+
+				promotion->groupIndex = node->groupIndex;
+				promotion->incidentTime = event->eventTime;
+				promotion->sourceNodeIndex = -1;
+				promotion->sourceRTO = -1.0;
+				promotion->replayNodeIndex = -1;
+				promotion->replayRTO = -1.0;
+
+				openIncidents[node->groupIndex] = promotionIndex;
+			}
+
+			return monitor_replay_set_health(monitor, node,
+											 MONITOR_REPLAY_HEALTH_BAD);
+		}
+
+		case REPLAY_EVENT_HEALTHY:
+		{
+			log_debug("Replaying event %" PRId64 ": node %s is healthy",
+					  event->eventId, node->name);
+
+			node->reporting = true;
+
+			if (!monitor_replay_set_health(monitor, node,
+										   MONITOR_REPLAY_HEALTH_GOOD))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			break;
+		}
+
+		case REPLAY_EVENT_REPORT:
+		{
+			log_debug("Replaying event %" PRId64 ": node %s reports %s",
+					  event->eventId, node->name,
+					  NodeStateToString(node->reportedState));
+			break;
+		}
+	}
+
+	/* an unhealthy node does not report, see above */
+	if (node->reporting)
+	{
+		(void) monitor_replay_node_active(monitor, replay, event->nodeIndex,
+										  event->eventTime, result);
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_node_active calls node_active for a synthetic node, and
+ * records the call latency and the scratch monitor decision, if any.
+ */
+static bool
+monitor_replay_node_active(Monitor *monitor,
+						   MonitorReplay *replay,
+						   int nodeIndex,
+						   double time,
+						   MonitorReplayResult *result)
+{
+	MonitorReplayNode *node = &(replay->nodes[nodeIndex]);
+	MonitorAssignedState assignedState = { 0 };
+
+	instr_time now;
+	instr_time latency;
+
+	INSTR_TIME_SET_CURRENT(latency);
+
+	node->lastReportTime = time;
+
+	if (!monitor_node_active(monitor,
+							 node->formation,
+							 node->nodeId,
+							 node->groupId,
+							 node->reportedState,
+							 true,      /* pgIsRunning */
+							 node->reportedTLI,
+							 node->reportedLSN,
+							 "",        /* pgsrSyncState */
+							 0,         /* knownGroupVersion */
+							 node->reportedLSN,
+							 0,         /* applyRate */
+							 &assignedState))
+	{
+		/* errors have already been logged */
+		++result->errors;
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, latency);
+
+	++result->calls;
+
+	if (replay->latencyCount == replay->latencyCapacity)
+	{
+		replay->latencyCapacity *= 2;
+		replay->latencies =
+			(double *) realloc(replay->latencies,
+							   replay->latencyCapacity * sizeof(double));
+
+		if (replay->latencies == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+	}
+
+	replay->latencies[replay->latencyCount++] =
+		INSTR_TIME_GET_MILLISEC(now);
+
+	if (assignedState.state != node->goalState)
+	{
+		log_debug("Replay assigns %s to node %s at %.3fs (was %s)",
+				  NodeStateToString(assignedState.state),
+				  node->name,
+				  time,
+				  NodeStateToString(node->goalState));
+
+		if (!monitor_replay_add_decision(replay, nodeIndex, time,
+										 node->goalState,
+										 assignedState.state))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		node->goalState = assignedState.state;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_add_decision appends a scratch monitor decision to our
+ * array of replay decisions.
+ */
+static bool
+monitor_replay_add_decision(MonitorReplay *replay,
+							int nodeIndex, double time,
+							NodeState previousGoalState,
+							NodeState goalState)
+{
+	if (replay->replayDecisionsCount == replay->replayDecisionsCapacity)
+	{
+		int capacity = Max(64, 2 * replay->replayDecisionsCapacity);
+
+		MonitorReplayDecision *decisions =
+			(MonitorReplayDecision *) realloc(replay->replayDecisions,
+											  capacity *
+											  sizeof(MonitorReplayDecision));
+
+		if (decisions == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		replay->replayDecisions = decisions;
+		replay->replayDecisionsCapacity = capacity;
+	}
+
+	MonitorReplayDecision *decision =
+		&(replay->replayDecisions[replay->replayDecisionsCount++]);
+
+	decision->time = time;
+	decision->nodeIndex = nodeIndex;
+	decision->goalState = goalState;
+	decision->promotion =
+		is_primary_role(goalState) && !is_primary_role(previousGoalState);
+	decision->matched = false;
+
+	return true;
+}
+
+
+/*
+ * monitor_replay_compute_result matches each production decision with the
+ * first replay decision that assigned the same goal state to the same node,
+ * and each incident with the first promotion in the same group in the
+ * replay. Then it computes the delays and latencies statistics.
+ */
+static void
+monitor_replay_compute_result(MonitorReplay *replay,
+							  MonitorReplayResult *result)
+{
+	double *delays =
+		(double *) calloc(Max(replay->sourceDecisionsCount, 1),
+						  sizeof(double));
+	int delaysCount = 0;
+	double delaysSum = 0.0;
+
+	result->sourceDecisions = replay->sourceDecisionsCount;
+	result->replayDecisions = replay->replayDecisionsCount;
+
+	for (int s = 0; s < replay->sourceDecisionsCount && delays != NULL; s++)
+	{
+		MonitorReplayDecision *source = &(replay->sourceDecisions[s]);
+
+		for (int r = 0; r < replay->replayDecisionsCount; r++)
+		{
+			MonitorReplayDecision *decision = &(replay->replayDecisions[r]);
+
+			if (!decision->matched &&
+				decision->nodeIndex == source->nodeIndex &&
+				decision->goalState == source->goalState)
+			{
+				decision->matched = true;
+				source->matched = true;
+
+				delays[delaysCount++] = decision->time - source->time;
+				delaysSum += decision->time - source->time;
+				break;
+			}
+		}
+	}
+
+	result->matchedDecisions = delaysCount;
+
+	if (delaysCount > 0)
+	{
+		qsort(delays, delaysCount, sizeof(double),
+			  monitor_bench_compare_doubles);
+
+		result->delayAvg = delaysSum / delaysCount;
+		result->delayP50 = monitor_bench_percentile(delays, delaysCount, 0.50);
+		result->delayP90 = monitor_bench_percentile(delays, delaysCount, 0.90);
+		result->delayMax = delays[delaysCount - 1];
+	}
+
+	free(delays);
+
+	/* an incident ends with the first promotion, or the next incident */
+	for (int p = 0; p < result->promotionsCount; p++)
+	{
+		MonitorReplayPromotion *promotion = &(result->promotions[p]);
+		double nextIncidentTime = -1.0;
+
+		for (int n = p + 1; n < result->promotionsCount; n++)
+		{
+			if (result->promotions[n].groupIndex == promotion->groupIndex)
+			{
+				nextIncidentTime = result->promotions[n].incidentTime;
+				break;
+			}
+		}
+
+		for (int r = 0; r < replay->replayDecisionsCount; r++)
+		{
+			MonitorReplayDecision *decision = &(replay->replayDecisions[r]);
+			MonitorReplayNode *node = &(replay->nodes[decision->nodeIndex]);
+
+			if (!decision->promotion ||
+				node->groupIndex != promotion->groupIndex ||
+				decision->time < promotion->incidentTime)
+			{
+				continue;
+			}
+
+			if (nextIncidentTime >= 0.0 && decision->time >= nextIncidentTime)
+			{
+				break;
+			}
+
+			promotion->replayNodeIndex = decision->nodeIndex;
+			promotion->replayRTO = decision->time - promotion->incidentTime;
+			break;
+		}
+	}
+
+	if (replay->latencyCount > 0)
+	{
+		double *latencies = replay->latencies;
+		int64_t count = replay->latencyCount;
+
+		qsort(latencies, count, sizeof(double), monitor_bench_compare_doubles);
+
+		result->minMs = latencies[0];
+		result->p50Ms = monitor_bench_percentile(latencies, count, 0.50);
+		result->p90Ms = monitor_bench_percentile(latencies, count, 0.90);
+		result->p99Ms = monitor_bench_percentile(latencies, count, 0.99);
+		result->maxMs = latencies[count - 1];
+	}
+}
+
+
+/*
+ * monitor_replay_cleanup removes the synthetic nodes and drops the synthetic
+ * formations from the monitor.
+ */
+bool
+monitor_replay_cleanup(MonitorReplayOptions *options, MonitorReplay *replay)
+{
+	Monitor monitor = { 0 };
+	bool success = true;
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int index = 0; index < replay->nodesCount; index++)
+	{
+		MonitorReplayNode *node = &(replay->nodes[index]);
+		int64_t nodeId = -1;
+		int groupId = -1;
+
+		if (node->nodeId == 0)
+		{
+			/* that node has not been registered */
+			continue;
+		}
+
+		if (!monitor_remove_by_nodename(&monitor, node->formation, node->name,
+										true, &nodeId, &groupId))
+		{
+			log_warn("Failed to remove synthetic node %s", node->name);
+			success = false;
+		}
+	}
+
+	for (int groupIndex = 0; groupIndex < replay->groupsCount; groupIndex++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		monitor_replay_formation_name(options, replay, groupIndex,
+									  formation, sizeof(formation));
+
+		if (!monitor_drop_formation(&monitor, formation))
+		{
+			log_warn("Failed to drop synthetic formation \"%s\"", formation);
+			success = false;
+		}
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	return success;
+}
+
+
+/*
+ * monitor_replay_free releases the memory used for the replay.
+ */
+void
+monitor_replay_free(MonitorReplay *replay)
+{
+	free(replay->nodes);
+	free(replay->events);
+	free(replay->sourceDecisions);
+	free(replay->replayDecisions);
+	free(replay->latencies);
+}
+
+
+/*
+ * monitor_replay_print_result prints the replay results.
+ */
+void
+monitor_replay_print_result(MonitorReplayOptions *options,
+							MonitorReplay *replay,
+							MonitorReplayResult *result)
+{
+	fformat(stdout, "%20s: %d in %d group(s)\n", "Nodes",
+			replay->nodesCount, replay->groupsCount);
+	fformat(stdout, "%20s: %d of %d\n", "Events",
+			result->events, replay->eventsCount);
+	fformat(stdout, "%20s: %gx\n", "Speed", options->speed);
+	fformat(stdout, "%20s: %.3fs (%.3fs replayed)\n", "Duration",
+			result->durationMs / 1000.0, result->replayedSeconds);
+	fformat(stdout, "%20s: %" PRId64 "\n", "Calls", result->calls);
+	fformat(stdout, "%20s: %" PRId64 "\n", "Errors", result->errors);
+	fformat(stdout, "\n");
+	fformat(stdout, "%20s: %d\n", "Source decisions", result->sourceDecisions);
+	fformat(stdout, "%20s: %d\n", "Replay decisions", result->replayDecisions);
+	fformat(stdout, "%20s: %d\n", "Matched decisions",
+			result->matchedDecisions);
+	fformat(stdout, "%20s: %.3fs avg, %.3fs p50, %.3fs p90, %.3fs max\n",
+			"Decision delay",
+			result->delayAvg, result->delayP50,
+			result->delayP90, result->delayMax);
+	fformat(stdout, "\n");
+	fformat(stdout, "%20s: %.3f ms\n", "Latency min", result->minMs);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p50", result->p50Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p90", result->p90Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency p99", result->p99Ms);
+	fformat(stdout, "%20s: %.3f ms\n", "Latency max", result->maxMs);
+
+	if (result->promotionsCount == 0)
+	{
+		return;
+	}
+
+	fformat(stdout, "\n%10s | %20s | %10s | %20s | %10s\n",
+			"Incident", "Source Promotion", "Source RTO",
+			"Replay Promotion", "Replay RTO");
+	fformat(stdout, "%10s-+-%20s-+-%10s-+-%20s-+-%10s\n",
+			"----------", "--------------------", "----------",
+			"--------------------", "----------");
+
+	for (int p = 0; p < result->promotionsCount; p++)
+	{
+		MonitorReplayPromotion *promotion = &(result->promotions[p]);
+
+		char incident[BUFSIZE] = { 0 };
+		char sourceRTO[BUFSIZE] = { 0 };
+		char replayRTO[BUFSIZE] = { 0 };
+
+		sformat(incident, sizeof(incident), "%.3fs", promotion->incidentTime);
+
+		if (promotion->sourceNodeIndex >= 0)
+		{
+			sformat(sourceRTO, sizeof(sourceRTO), "%.3fs",
+					promotion->sourceRTO);
+		}
+
+		if (promotion->replayNodeIndex >= 0)
+		{
+			sformat(replayRTO, sizeof(replayRTO), "%.3fs",
+					promotion->replayRTO);
+		}
+
+		fformat(stdout, "%10s | %20s | %10s | %20s | %10s\n",
+				incident,
+				promotion->sourceNodeIndex >= 0
+				? replay->nodes[promotion->sourceNodeIndex].name
+				: "-",
+				promotion->sourceNodeIndex >= 0 ? sourceRTO : "-",
+				promotion->replayNodeIndex >= 0
+				? replay->nodes[promotion->replayNodeIndex].name
+				: "-",
+				promotion->replayNodeIndex >= 0 ? replayRTO : "-");
+	}
+}
+
+
+/*
+ * monitor_replay_print_result_as_json prints the replay results in JSON.
+ */
+void
+monitor_replay_print_result_as_json(MonitorReplayOptions *options,
+									MonitorReplay *replay,
+									MonitorReplayResult *result)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	JSON_Value *jsPromotions = json_value_init_array();
+	JSON_Array *jsPromotionsArray = json_value_get_array(jsPromotions);
+
+	json_object_dotset_string(root, "options.file", options->filename);
+	json_object_dotset_number(root, "options.speed", options->speed);
+
+	json_object_set_number(root, "nodes", replay->nodesCount);
+	json_object_set_number(root, "groups", replay->groupsCount);
+	json_object_set_number(root, "events", result->events);
+	json_object_set_number(root, "duration_s", result->durationMs / 1000.0);
+	json_object_set_number(root, "replayed_s", result->replayedSeconds);
+	json_object_set_number(root, "calls", (double) result->calls);
+	json_object_set_number(root, "errors", (double) result->errors);
+
+	json_object_dotset_number(root, "decisions.source",
+							  result->sourceDecisions);
+	json_object_dotset_number(root, "decisions.replay",
+							  result->replayDecisions);
+	json_object_dotset_number(root, "decisions.matched",
+							  result->matchedDecisions);
+
+	json_object_dotset_number(root, "delay_s.avg", result->delayAvg);
+	json_object_dotset_number(root, "delay_s.p50", result->delayP50);
+	json_object_dotset_number(root, "delay_s.p90", result->delayP90);
+	json_object_dotset_number(root, "delay_s.max", result->delayMax);
+
+	json_object_dotset_number(root, "latency_ms.min", result->minMs);
+	json_object_dotset_number(root, "latency_ms.p50", result->p50Ms);
+	json_object_dotset_number(root, "latency_ms.p90", result->p90Ms);
+	json_object_dotset_number(root, "latency_ms.p99", result->p99Ms);
+	json_object_dotset_number(root, "latency_ms.max", result->maxMs);
+
+	for (int p = 0; p < result->promotionsCount; p++)
+	{
+		MonitorReplayPromotion *promotion = &(result->promotions[p]);
+
+		JSON_Value *jsPromotion = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(jsPromotion);
+
+		json_object_set_number(jsObj, "incident_s", promotion->incidentTime);
+
+		if (promotion->sourceNodeIndex >= 0)
+		{
+			json_object_dotset_string(
+				jsObj, "source.node",
+				replay->nodes[promotion->sourceNodeIndex].name);
+			json_object_dotset_number(jsObj, "source.rto_s",
+									  promotion->sourceRTO);
+		}
+		else
+		{
+			json_object_set_null(jsObj, "source");
+		}
+
+		if (promotion->replayNodeIndex >= 0)
+		{
+			json_object_dotset_string(
+				jsObj, "replay.node",
+				replay->nodes[promotion->replayNodeIndex].name);
+			json_object_dotset_number(jsObj, "replay.rto_s",
+									  promotion->replayRTO);
+		}
+		else
+		{
+			json_object_set_null(jsObj, "replay");
+		}
+
+		json_array_append_value(jsPromotionsArray, jsPromotion);
+	}
+
+	json_object_set_value(root, "promotions", jsPromotions);
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * is_primary_role returns true when the given state is one where the node
+ * accepts writes as the primary of its group.
+ */
+static bool
+is_primary_role(NodeState state)
+{
+	return state == SINGLE_STATE ||
+		   state == PRIMARY_STATE ||
+		   state == WAIT_PRIMARY_STATE ||
+		   state == JOIN_PRIMARY_STATE ||
+		   state == APPLY_SETTINGS_STATE;
+}
+
+
+/*
+ * replay_elapsed_seconds returns the production time that has been replayed
+ * since the given start time, in seconds.
+ */
+static double
+replay_elapsed_seconds(instr_time startTime, double speed)
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, startTime);
+
+	return INSTR_TIME_GET_DOUBLE(now) * speed;
+}
@@ -0,0 +1,201 @@
+/*
+ * src/bin/pg_autoctl/monitor_replay.h
+ *	 Replay a production events log against a scratch monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef MONITOR_REPLAY_H
+#define MONITOR_REPLAY_H
+
+#include <stdbool.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "monitor.h"
+#include "pgsql.h"
+#include "state.h"
+
+#define MONITOR_REPLAY_MAX_NODES 1024
+#define MONITOR_REPLAY_MAX_PROMOTIONS 64
+
+/* keep replaying node reports for that long after the last event */
+#define MONITOR_REPLAY_TAIL_TIME 30 /* seconds */
+
+/* the monitor timeouts that are scaled down by the replay --speed */
+#define MONITOR_REPLAY_TIMEOUTS_COUNT 7
+
+typedef struct MonitorReplayOptions
+{
+	char monitor_pguri[MAXCONNINFO];
+	char filename[MAXPGPATH];
+	char formation[NAMEDATALEN];
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+
+	double speed;               /* production seconds per replay second */
+	bool keep;                  /* keep the synthetic formations at the end */
+} MonitorReplayOptions;
+
+/*
+ * A replayed node maps a node found in the events log to a synthetic node
+ * registered on the scratch monitor. It reports the states, timeline and LSN
+ * found in its last replayed event, just like its keeper did in production.
+ */
+typedef struct MonitorReplayNode
+{
+	/* the production node, as found in the events log */
+	char sourceFormation[NAMEDATALEN];
+	int sourceGroupId;
+	int64_t sourceNodeId;
+	char sourceName[_POSIX_HOST_NAME_MAX];
+	int candidatePriority;
+	bool replicationQuorum;
+
+	/* the synthetic node registered on the scratch monitor */
+	char formation[NAMEDATALEN];
+	char name[_POSIX_HOST_NAME_MAX];
+	int port;
+	int64_t nodeId;
+	int groupId;
+	int groupIndex;
+
+	/* replay state */
+	bool reporting;             /* false while the node is marked unhealthy */
+	NodeState reportedState;
+	int reportedTLI;
+	char reportedLSN[PG_LSN_MAXLENGTH];
+
+	NodeState sourceGoalState;  /* last goal state found in the events log */
+	NodeState goalState;        /* last goal state assigned by the replay */
+	double lastReportTime;
+} MonitorReplayNode;
+
+typedef enum
+{
+	REPLAY_EVENT_REPORT = 0,
+	REPLAY_EVENT_UNHEALTHY,
+	REPLAY_EVENT_HEALTHY
+} MonitorReplayEventType;
+
+typedef struct MonitorReplayEvent
+{
+	int64_t eventId;
+	double eventTime;           /* seconds since the first event */
+	int nodeIndex;
+	MonitorReplayEventType type;
+	NodeState reportedState;
+	NodeState goalState;
+	int reportedTLI;
+	char reportedLSN[PG_LSN_MAXLENGTH];
+} MonitorReplayEvent;
+
+/* a goal state assigned to a node, either in production or in the replay */
+typedef struct MonitorReplayDecision
+{
+	double time;                /* seconds since the first event */
+	int nodeIndex;
+	NodeState goalState;
+	bool promotion;             /* the node is assigned a primary role */
+	bool matched;
+} MonitorReplayDecision;
+
+typedef struct MonitorReplayPromotion
+{
+	int groupIndex;
+	double incidentTime;        /* seconds since the first event */
+	int sourceNodeIndex;
+	double sourceRTO;           /* seconds, as recorded in production */
+	int replayNodeIndex;        /* -1 when the replay did not promote */
+	double replayRTO;           /* seconds, in production time */
+} MonitorReplayPromotion;
+
+typedef struct MonitorReplayTimeout
+{
+	const char *name;
+	int64_t value;              /* in milliseconds */
+	bool fromAutoConf;          /* was set with ALTER SYSTEM already */
+} MonitorReplayTimeout;
+
+typedef struct MonitorReplay
+{
+	MonitorReplayNode *nodes;
+	int nodesCount;
+	int groupsCount;
+
+	MonitorReplayEvent *events;
+	int eventsCount;
+
+	/* production decisions are found in the events log */
+	MonitorReplayDecision *sourceDecisions;
+	int sourceDecisionsCount;
+
+	/* replay decisions are the goal state changes from node_active */
+	MonitorReplayDecision *replayDecisions;
+	int replayDecisionsCount;
+	int replayDecisionsCapacity;
+
+	/* latencies of the successful node_active calls, in milliseconds */
+	double *latencies;
+	int64_t latencyCount;
+	int64_t latencyCapacity;
+
+	MonitorReplayTimeout timeouts[MONITOR_REPLAY_TIMEOUTS_COUNT];
+	bool timeoutsScaled;
+} MonitorReplay;
+
+typedef struct MonitorReplayResult
+{
+	double durationMs;
+	double replayedSeconds;     /* production time covered by the replay */
+	int events;
+	int64_t calls;
+	int64_t errors;
+
+	int sourceDecisions;
+	int replayDecisions;
+	int matchedDecisions;
+
+	/* delays of the matched decisions, replay minus production, in seconds */
+	double delayAvg;
+	double delayP50;
+	double delayP90;
+	double delayMax;
+
+	/* latencies of the successful node_active calls, in milliseconds */
+	double minMs;
+	double p50Ms;
+	double p90Ms;
+	double p99Ms;
+	double maxMs;
+
+	MonitorReplayPromotion promotions[MONITOR_REPLAY_MAX_PROMOTIONS];
+	int promotionsCount;
+} MonitorReplayResult;
+
+bool monitor_replay_load_events(MonitorReplayOptions *options,
+								MonitorReplay *replay);
+bool monitor_replay_register_nodes(MonitorReplayOptions *options,
+								   MonitorReplay *replay);
+bool monitor_replay_scale_timeouts(MonitorReplayOptions *options,
+								   MonitorReplay *replay);
+bool monitor_replay_run(MonitorReplayOptions *options,
+						MonitorReplay *replay,
+						MonitorReplayResult *result);
+bool monitor_replay_restore_timeouts(MonitorReplayOptions *options,
+									 MonitorReplay *replay);
+bool monitor_replay_cleanup(MonitorReplayOptions *options,
+							MonitorReplay *replay);
+void monitor_replay_free(MonitorReplay *replay);
+
+void monitor_replay_print_result(MonitorReplayOptions *options,
+								 MonitorReplay *replay,
+								 MonitorReplayResult *result);
+void monitor_replay_print_result_as_json(MonitorReplayOptions *options,
+										 MonitorReplay *replay,
+										 MonitorReplayResult *result);
+
+#endif /* MONITOR_REPLAY_H */
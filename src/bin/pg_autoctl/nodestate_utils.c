@@ -7,10 +7,13 @@
  *
  */
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "file_utils.h"
 #include "log.h"
 #include "nodestate_utils.h"
+#include "parsing.h"
 #include "string_utils.h"
 
 /*
@@ -276,7 +279,8 @@ nodestatePrepareNode(NodeAddressHeaders *headers, NodeAddress *node,
 					 char *composedId, char *tliLSN)
 {
 	sformat(hostport, BUFSIZE, "%s:%d", node->host, node->port);
-	sformat(tliLSN, BUFSIZE, "%3d: %s", node->tli, node->lsn);
+	sformat(tliLSN, BUFSIZE, "%3d: %X/%X",
+			node->tli, (uint32_t) (node->lsn >> 32), (uint32_t) node->lsn);
 
 	switch (headers->nodeKind)
 	{
@@ -342,8 +346,11 @@ nodestateAsJSON(CurrentNodeState *nodeState, JSON_Value *js)
 
 	json_object_set_number(jsobj, "timeline", (double) nodeState->node.tli);
 
-	json_object_set_string(jsobj, "Minimum Recovery Ending LSN",
-						   nodeState->node.lsn);
+	char lsn[PG_LSN_MAXLENGTH] = { 0 };
+
+	formatLSN(nodeState->node.lsn, lsn, sizeof(lsn));
+
+	json_object_set_string(jsobj, "Minimum Recovery Ending LSN", lsn);
 
 	json_object_set_string(jsobj, "reachable",
 						   nodestateHealthToString(nodeState->health));
@@ -355,6 +362,71 @@ nodestateAsJSON(CurrentNodeState *nodeState, JSON_Value *js)
 }
 
 
+/*
+ * nodestateFromJSON parses a JSON object as produced by nodestateAsJSON back
+ * into the given nodeState. Only the fields that nodestateAsJSON exports are
+ * set.
+ */
+bool
+nodestateFromJSON(JSON_Value *js, CurrentNodeState *nodeState)
+{
+	JSON_Object *jsobj = json_value_get_object(js);
+
+	if (jsobj == NULL)
+	{
+		log_error("Failed to parse node state: not a JSON object");
+		return false;
+	}
+
+	const char *name = json_object_get_string(jsobj, "nodename");
+	const char *host = json_object_get_string(jsobj, "nodehost");
+	const char *reportedState =
+		json_object_get_string(jsobj, "current_group_state");
+	const char *goalState = json_object_get_string(jsobj, "assigned_group_state");
+	const char *lsn = json_object_get_string(jsobj, "Minimum Recovery Ending LSN");
+	const char *health = json_object_get_string(jsobj, "reachable");
+
+	if (name == NULL || host == NULL || reportedState == NULL ||
+		goalState == NULL || lsn == NULL)
+	{
+		log_error("Failed to parse node state: missing fields");
+		return false;
+	}
+
+	nodeState->node.nodeId = (int64_t) json_object_get_number(jsobj, "node_id");
+	nodeState->groupId = (int) json_object_get_number(jsobj, "group_id");
+	strlcpy(nodeState->node.name, name, sizeof(nodeState->node.name));
+	strlcpy(nodeState->node.host, host, sizeof(nodeState->node.host));
+	nodeState->node.port = (int) json_object_get_number(jsobj, "nodeport");
+
+	nodeState->reportedState = NodeStateFromString(reportedState);
+	nodeState->goalState = NodeStateFromString(goalState);
+
+	nodeState->node.tli = (uint32_t) json_object_get_number(jsobj, "timeline");
+
+	if (!parseLSN(lsn, &(nodeState->node.lsn)))
+	{
+		log_error("Failed to parse node state LSN \"%s\"", lsn);
+		return false;
+	}
+
+	if (health != NULL && strcmp(health, "yes") == 0)
+	{
+		nodeState->health = 1;
+	}
+	else if (health != NULL && strcmp(health, "no") == 0)
+	{
+		nodeState->health = 0;
+	}
+	else
+	{
+		nodeState->health = -1;
+	}
+
+	return true;
+}
+
+
 /*
  * Transform the health column from a monitor into a string.
  */
@@ -585,7 +657,6 @@ bool
 nodestateFilterArrayGroup(CurrentNodeStateArray *nodesArray, const char *name)
 {
 	int groupId = -1;
-	CurrentNodeStateArray nodesInSameGroup = { 0 };
 
 	/* first, find the groupId of the target node name */
 	for (int index = 0; index < nodesArray->count; index++)
@@ -603,32 +674,212 @@ nodestateFilterArrayGroup(CurrentNodeStateArray *nodesArray, const char *name)
 	/* return false when the node name was not found */
 	if (groupId == -1)
 	{
-		/* turn the given nodesArray into a all-zero empty array */
-		memset(nodesArray, 0, sizeof(CurrentNodeStateArray));
+		/* turn the given nodesArray into an empty array */
+		nodesArray->count = 0;
 
 		return false;
 	}
 
-	/* now, build a new nodesArray with only the nodes in the same group */
+	/*
+	 * Now, only keep the nodes in the same group, moving them in place to the
+	 * front of the array. Note that we want to preserve the headers.
+	 */
+	int count = 0;
+
 	for (int index = 0; index < nodesArray->count; index++)
 	{
 		CurrentNodeState *nodeState = &(nodesArray->nodes[index]);
 
 		if (nodeState->groupId == groupId)
 		{
-			nodesInSameGroup.nodes[nodesInSameGroup.count] = *nodeState;
-			++nodesInSameGroup.count;
+			if (count != index)
+			{
+				nodesArray->nodes[count] = *nodeState;
+			}
+			++count;
 		}
 	}
 
-	/*
-	 * Finally, override the nodesArray parameter with the new contents. Note
-	 * that we want to preserve the headers.
-	 */
-	NodeAddressHeaders headers = nodesArray->headers;
+	nodesArray->count = count;
+
+	return true;
+}
+
+
+/*
+ * nodeArrayGrow grows the given heap allocated array so that it has room for
+ * at least the given capacity of elements of the given size. The new elements
+ * are zeroed out. The capacity is doubled each time we need to grow, so that
+ * appending one element at a time is still cheap.
+ */
+static bool
+nodeArrayGrow(void **elements, int *currentCapacity, int capacity, size_t size)
+{
+	if (capacity <= *currentCapacity)
+	{
+		return true;
+	}
+
+	int newCapacity =
+		*currentCapacity > 0 ? *currentCapacity : NODE_ARRAY_INITIAL_CAPACITY;
+
+	while (newCapacity < capacity)
+	{
+		newCapacity *= 2;
+	}
+
+	void *newElements = realloc(*elements, newCapacity * size);
+
+	if (newElements == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	memset((char *) newElements + (*currentCapacity * size),
+		   0,
+		   (newCapacity - *currentCapacity) * size);
+
+	*elements = newElements;
+	*currentCapacity = newCapacity;
+
+	return true;
+}
+
+
+/*
+ * nodeAddressArrayReserve ensures that the given nodesArray can hold at least
+ * capacity nodes.
+ */
+bool
+nodeAddressArrayReserve(NodeAddressArray *nodesArray, int capacity)
+{
+	return nodeArrayGrow((void **) &(nodesArray->nodes),
+						 &(nodesArray->capacity),
+						 capacity,
+						 sizeof(NodeAddress));
+}
+
+
+/*
+ * nodeAddressArrayAppend adds a new zeroed entry at the end of the given
+ * nodesArray and returns a pointer to it, or NULL when out of memory.
+ */
+NodeAddress *
+nodeAddressArrayAppend(NodeAddressArray *nodesArray)
+{
+	if (!nodeAddressArrayReserve(nodesArray, nodesArray->count + 1))
+	{
+		/* errors have already been logged */
+		return NULL;
+	}
+
+	NodeAddress *node = &(nodesArray->nodes[nodesArray->count++]);
+
+	memset(node, 0, sizeof(NodeAddress));
+
+	return node;
+}
+
+
+/*
+ * nodeAddressArrayCopy copies the nodes from src to dst, re-using the storage
+ * of dst when it is large enough.
+ */
+bool
+nodeAddressArrayCopy(NodeAddressArray *dst, NodeAddressArray *src)
+{
+	if (dst == src)
+	{
+		return true;
+	}
+
+	if (!nodeAddressArrayReserve(dst, src->count))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (src->count > 0)
+	{
+		memcpy(dst->nodes, src->nodes, src->count * sizeof(NodeAddress));
+	}
+
+	dst->count = src->count;
+
+	return true;
+}
+
+
+/*
+ * nodeAddressArrayFree releases the memory used by the given nodesArray, which
+ * is then a valid empty array again.
+ */
+void
+nodeAddressArrayFree(NodeAddressArray *nodesArray)
+{
+	free(nodesArray->nodes);
+
+	nodesArray->nodes = NULL;
+	nodesArray->count = 0;
+	nodesArray->capacity = 0;
+}
 
-	*nodesArray = nodesInSameGroup;
-	nodesArray->headers = headers;
+
+/*
+ * currentNodeStateArrayUpdate replaces the entry of the given nodesArray that
+ * has the same node id as the given nodeState, or appends the nodeState to
+ * the array when the node is not known yet.
+ */
+bool
+currentNodeStateArrayUpdate(CurrentNodeStateArray *nodesArray,
+							CurrentNodeState *nodeState)
+{
+	for (int index = 0; index < nodesArray->count; index++)
+	{
+		if (nodesArray->nodes[index].node.nodeId == nodeState->node.nodeId)
+		{
+			nodesArray->nodes[index] = *nodeState;
+			return true;
+		}
+	}
+
+	if (!currentNodeStateArrayReserve(nodesArray, nodesArray->count + 1))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	nodesArray->nodes[nodesArray->count++] = *nodeState;
 
 	return true;
 }
+
+
+/*
+ * currentNodeStateArrayReserve ensures that the given nodesArray can hold at
+ * least capacity nodes.
+ */
+bool
+currentNodeStateArrayReserve(CurrentNodeStateArray *nodesArray, int capacity)
+{
+	return nodeArrayGrow((void **) &(nodesArray->nodes),
+						 &(nodesArray->capacity),
+						 capacity,
+						 sizeof(CurrentNodeState));
+}
+
+
+/*
+ * currentNodeStateArrayFree releases the memory used by the given nodesArray,
+ * which is then a valid empty array again.
+ */
+void
+currentNodeStateArrayFree(CurrentNodeStateArray *nodesArray)
+{
+	free(nodesArray->nodes);
+
+	nodesArray->nodes = NULL;
+	nodesArray->count = 0;
+	nodesArray->capacity = 0;
+}
@@ -13,6 +13,7 @@
 #include <stdbool.h>
 
 #include "pgsql.h"
+#include "trace.h"
 
 /*
  * CurrentNodeState gathers information we retrieve through the monitor
@@ -36,6 +37,9 @@ typedef struct CurrentNodeState
 	int health;
 	double healthLag;
 	double reportLag;
+
+	/* trace id of the state change, only known from notifications */
+	char traceId[TRACE_ID_HEX_LEN + 1];
 } CurrentNodeState;
 
 
@@ -63,14 +67,31 @@ typedef struct NodeAddressHeaders
 } NodeAddressHeaders;
 
 
+/*
+ * An array of CurrentNodeState, allocated on the heap, see
+ * currentNodeStateArrayReserve() and currentNodeStateArrayFree().
+ */
 typedef struct CurrentNodeStateArray
 {
 	int count;
-	CurrentNodeState nodes[NODE_ARRAY_MAX_COUNT];
+	int capacity;
+	CurrentNodeState *nodes;
 	NodeAddressHeaders headers;
 } CurrentNodeStateArray;
 
 
+bool nodeAddressArrayReserve(NodeAddressArray *nodesArray, int capacity);
+NodeAddress * nodeAddressArrayAppend(NodeAddressArray *nodesArray);
+bool nodeAddressArrayCopy(NodeAddressArray *dst, NodeAddressArray *src);
+void nodeAddressArrayFree(NodeAddressArray *nodesArray);
+
+bool currentNodeStateArrayReserve(CurrentNodeStateArray *nodesArray,
+								  int capacity);
+void currentNodeStateArrayFree(CurrentNodeStateArray *nodesArray);
+bool currentNodeStateArrayUpdate(CurrentNodeStateArray *nodesArray,
+								 CurrentNodeState *nodeState);
+
+
 void nodestatePrepareHeaders(CurrentNodeStateArray *nodesArray,
 							 PgInstanceKind nodeKind);
 void nodeAddressArrayPrepareHeaders(NodeAddressHeaders *headers,
@@ -92,6 +113,7 @@ void nodestatePrepareNode(NodeAddressHeaders *headers, NodeAddress *node,
 void prepareHostNameSeparator(char nameSeparatorHeader[], int size);
 
 bool nodestateAsJSON(CurrentNodeState *nodeState, JSON_Value *js);
+bool nodestateFromJSON(JSON_Value *js, CurrentNodeState *nodeState);
 
 char * nodestateHealthToString(int health);
 char nodestateHealthToChar(int health);
@@ -0,0 +1,792 @@
+/*
+ * src/bin/pg_autoctl/parser_bench.c
+ *	 Microbenchmarks for the pg_autoctl parsing and formatting code.
+ *
+ * The keeper and the watch loops parse monitor result sets, pg_controldata
+ * output, timeline histories and configuration files, and format node states,
+ * all the time. Here we run those functions in a loop over recorded inputs,
+ * and report how long each call takes and how many allocations it makes.
+ *
+ * Each benchmark is run once before being measured, so that arrays that are
+ * re-used from a call to the next have already been grown, as in the keeper
+ * main loop.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "monitor.h"
+#include "nodestate_utils.h"
+#include "parser_bench.h"
+#include "parsing.h"
+#include "parson.h"
+#include "pgsetup.h"
+#include "pgsql.h"
+#include "state.h"
+#include "string_utils.h"
+
+/* the current_state result sets have 16 or 17 columns */
+#define PARSER_BENCH_MAX_COLUMNS 32
+
+/* maintained by bench/bench_alloc.c when linked in */
+BenchAllocStats benchAllocStats = { 0 };
+
+typedef bool (*ParserBenchFunction)(void *context);
+
+typedef struct CurrentStateContext
+{
+	PGresult *result;
+	CurrentNodeStateArray nodesArray;
+} CurrentStateContext;
+
+typedef struct ConfigContext
+{
+	const char *filename;
+	const char *contents;
+	size_t size;
+	KeeperConfig config;
+} ConfigContext;
+
+typedef struct ControlDataContext
+{
+	const char *contents;
+	PostgresControlData controlData;
+} ControlDataContext;
+
+typedef struct HistoryContext
+{
+	const char *filename;
+	const char *contents;
+	IdentifySystem system;
+} HistoryContext;
+
+static bool parser_bench_find_history_file(ParserBenchOptions *options,
+										   ParserBenchInputs *inputs);
+static PGresult * parser_bench_make_result(const char *filename,
+										   char *contents);
+static bool parser_bench_measure(ParserBenchOptions *options,
+								 ParserBenchResults *results,
+								 const char *name,
+								 const char *filename,
+								 int items,
+								 ParserBenchFunction function,
+								 void *context);
+
+static bool bench_parse_current_state(void *context);
+static bool bench_parse_config(void *context);
+static bool bench_parse_controldata(void *context);
+static bool bench_parse_timeline_history(void *context);
+static bool bench_keeper_state_as_json(void *context);
+static bool bench_print_node_states(void *context);
+
+static bool redirect_stdout_to_devnull(int *savedFd);
+static void restore_stdout(int savedFd);
+
+
+/*
+ * parser_bench_read_inputs reads the recorded inputs from the --inputs
+ * directory.
+ */
+bool
+parser_bench_read_inputs(ParserBenchOptions *options,
+						 ParserBenchInputs *inputs)
+{
+	long size = 0L;
+
+	join_path_components(inputs->currentStateFilename,
+						 options->inputs, PARSER_BENCH_CURRENT_STATE);
+
+	join_path_components(inputs->controlDataFilename,
+						 options->inputs, PARSER_BENCH_CONTROLDATA);
+
+	join_path_components(inputs->configFilename,
+						 options->inputs, PARSER_BENCH_CONFIG);
+
+	if (!parser_bench_find_history_file(options, inputs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!read_file(inputs->currentStateFilename,
+				   &(inputs->currentState), &size) ||
+		!read_file(inputs->controlDataFilename,
+				   &(inputs->controlData), &size) ||
+		!read_file(inputs->configFilename, &(inputs->config), &size) ||
+		!read_file(inputs->historyFilename, &(inputs->history), &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parser_bench_find_history_file finds a timeline history file in the
+ * --inputs directory, and parses its timeline from the file name, as
+ * Postgres names those files after the timeline they lead to.
+ */
+static bool
+parser_bench_find_history_file(ParserBenchOptions *options,
+							   ParserBenchInputs *inputs)
+{
+	DIR *dir = opendir(options->inputs);
+	struct dirent *entry = NULL;
+
+	if (dir == NULL)
+	{
+		log_error("Failed to open directory \"%s\": %m", options->inputs);
+		return false;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		unsigned int tli = 0;
+		char suffix[MAXPGPATH] = { 0 };
+
+		if (sscanf(entry->d_name, "%08X%s", &tli, suffix) == 2 &&
+			strcmp(suffix, PARSER_BENCH_HISTORY_SUFFIX) == 0)
+		{
+			join_path_components(inputs->historyFilename,
+								 options->inputs, entry->d_name);
+			inputs->historyTimeline = tli;
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	if (IS_EMPTY_STRING_BUFFER(inputs->historyFilename))
+	{
+		log_error("Failed to find a timeline history file in \"%s\"",
+				  options->inputs);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parser_bench_free_inputs releases the memory used by the recorded inputs.
+ */
+void
+parser_bench_free_inputs(ParserBenchInputs *inputs)
+{
+	free(inputs->currentState);
+	free(inputs->controlData);
+	free(inputs->config);
+	free(inputs->history);
+
+	inputs->currentState = NULL;
+	inputs->controlData = NULL;
+	inputs->config = NULL;
+	inputs->history = NULL;
+}
+
+
+/*
+ * parser_bench_make_result builds a PGresult from a recorded result set, in
+ * the format used by psql --no-align --field-separator with a tab: a first
+ * line of column names, then one line per row. The given contents are
+ * modified in place.
+ */
+static PGresult *
+parser_bench_make_result(const char *filename, char *contents)
+{
+	int linesCount = 1;
+
+	for (char *ptr = contents; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '\n')
+		{
+			++linesCount;
+		}
+	}
+
+	char **lines = (char **) calloc(linesCount, sizeof(char *));
+
+	if (lines == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return NULL;
+	}
+
+	linesCount = splitLines(contents, lines, linesCount);
+
+	if (linesCount < 2)
+	{
+		log_error("Failed to parse \"%s\": expected column names and rows",
+				  filename);
+		free(lines);
+		return NULL;
+	}
+
+	/* the first line is the list of column names */
+	PGresAttDesc attributes[PARSER_BENCH_MAX_COLUMNS] = { 0 };
+	int fieldsCount = 0;
+
+	for (char *name = lines[0];
+		 name != NULL && fieldsCount < PARSER_BENCH_MAX_COLUMNS;)
+	{
+		char *tab = strchr(name, '\t');
+
+		if (tab != NULL)
+		{
+			*tab = '\0';
+		}
+
+		/* the parsing functions only look at the text values */
+		attributes[fieldsCount].name = name;
+		attributes[fieldsCount].format = 0;
+		attributes[fieldsCount].typlen = -1;
+		attributes[fieldsCount].atttypmod = -1;
+		++fieldsCount;
+
+		name = tab == NULL ? NULL : tab + 1;
+	}
+
+	PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+
+	if (result == NULL ||
+		!PQsetResultAttrs(result, fieldsCount, attributes))
+	{
+		log_error("Failed to prepare a result set for \"%s\"", filename);
+		PQclear(result);
+		free(lines);
+		return NULL;
+	}
+
+	for (int lineNumber = 1; lineNumber < linesCount; lineNumber++)
+	{
+		int rowNumber = lineNumber - 1;
+		char *value = lines[lineNumber];
+
+		for (int field = 0; field < fieldsCount; field++)
+		{
+			char *tab = value == NULL ? NULL : strchr(value, '\t');
+
+			if (value == NULL)
+			{
+				log_error("Failed to parse \"%s\" line %d: "
+						  "expected %d columns, found %d",
+						  filename, lineNumber + 1, fieldsCount, field);
+				PQclear(result);
+				free(lines);
+				return NULL;
+			}
+
+			if (tab != NULL)
+			{
+				*tab = '\0';
+			}
+
+			if (!PQsetvalue(result, rowNumber, field, value, strlen(value)))
+			{
+				log_error("Failed to add row %d to the result set for \"%s\"",
+						  rowNumber, filename);
+				PQclear(result);
+				free(lines);
+				return NULL;
+			}
+
+			value = tab == NULL ? NULL : tab + 1;
+		}
+	}
+
+	free(lines);
+
+	return result;
+}
+
+
+/*
+ * parser_bench_run runs each of the benchmarks over the recorded inputs.
+ */
+bool
+parser_bench_run(ParserBenchOptions *options,
+				 ParserBenchInputs *inputs,
+				 ParserBenchResults *results)
+{
+	bool success = true;
+
+	results->countedAllocations = benchAllocStats.supported;
+
+	/* parseCurrentNodeStateArray, as in pg_autoctl show state and watch */
+	char *currentState = strdup(inputs->currentState);
+
+	if (currentState == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	CurrentStateContext currentStateContext = { 0 };
+
+	currentStateContext.result =
+		parser_bench_make_result(inputs->currentStateFilename, currentState);
+
+	free(currentState);
+
+	if (currentStateContext.result == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int rows = PQntuples(currentStateContext.result);
+
+	success = success &&
+			  parser_bench_measure(options, results,
+								   "parseCurrentNodeStateArray",
+								   inputs->currentStateFilename,
+								   rows,
+								   bench_parse_current_state,
+								   &currentStateContext);
+
+	/* nodestatePrintNodeState, for each node of the parsed result set */
+	int savedFd = -1;
+
+	if (success)
+	{
+		if (!redirect_stdout_to_devnull(&savedFd))
+		{
+			/* errors have already been logged */
+			success = false;
+		}
+		else
+		{
+			success = parser_bench_measure(options, results,
+										   "nodestatePrintNodeState",
+										   inputs->currentStateFilename,
+										   rows,
+										   bench_print_node_states,
+										   &(currentStateContext.nodesArray));
+
+			restore_stdout(savedFd);
+		}
+	}
+
+	/* keeperStateAsJSON, as in pg_autoctl show state --local --json */
+	KeeperStateData keeperState = { 0 };
+
+	if (success && currentStateContext.nodesArray.count > 0)
+	{
+		CurrentNodeState *nodeState =
+			&(currentStateContext.nodesArray.nodes[0]);
+
+		keeperState.pg_autoctl_state_version = PG_AUTOCTL_STATE_VERSION;
+		keeperState.current_node_id = (int) nodeState->node.nodeId;
+		keeperState.current_group = nodeState->groupId;
+		keeperState.current_role = nodeState->reportedState;
+		keeperState.assigned_role = nodeState->goalState;
+		keeperState.last_monitor_contact = 1791890091;
+		keeperState.last_secondary_contact = 1791890090;
+
+		success = parser_bench_measure(options, results,
+									   "keeperStateAsJSON",
+									   inputs->currentStateFilename,
+									   1,
+									   bench_keeper_state_as_json,
+									   &keeperState);
+	}
+
+	currentNodeStateArrayFree(&(currentStateContext.nodesArray));
+	PQclear(currentStateContext.result);
+
+	/* parse_ini_buffer, as in keeper_config_read_file */
+	ConfigContext configContext = {
+		.filename = inputs->configFilename,
+		.contents = inputs->config,
+		.size = strlen(inputs->config) + 1
+	};
+
+	success = success &&
+			  parser_bench_measure(options, results,
+								   "parse_ini_buffer",
+								   inputs->configFilename,
+								   1,
+								   bench_parse_config,
+								   &configContext);
+
+	/* parse_controldata, as in pg_controldata() */
+	ControlDataContext controlDataContext = {
+		.contents = inputs->controlData
+	};
+
+	success = success &&
+			  parser_bench_measure(options, results,
+								   "parse_controldata",
+								   inputs->controlDataFilename,
+								   1,
+								   bench_parse_controldata,
+								   &controlDataContext);
+
+	/* parseTimeLineHistory, as in pgsql_identify_system() */
+	HistoryContext historyContext = {
+		.filename = inputs->historyFilename,
+		.contents = inputs->history
+	};
+
+	historyContext.system.timeline = inputs->historyTimeline;
+
+	success = success &&
+			  parser_bench_measure(options, results,
+								   "parseTimeLineHistory",
+								   inputs->historyFilename,
+								   (int) inputs->historyTimeline,
+								   bench_parse_timeline_history,
+								   &historyContext);
+
+	timelineHistoryFree(&(historyContext.system.timelines));
+
+	return success;
+}
+
+
+/*
+ * parser_bench_measure calls the given function once to warm-up, and then
+ * --iterations times, and adds its result to the results array.
+ */
+static bool
+parser_bench_measure(ParserBenchOptions *options,
+					 ParserBenchResults *results,
+					 const char *name,
+					 const char *filename,
+					 int items,
+					 ParserBenchFunction function,
+					 void *context)
+{
+	instr_time startTime;
+	instr_time duration;
+
+	if (results->count >= PARSER_BENCH_MAX_RESULTS)
+	{
+		log_error("BUG: parser_bench_measure called with %d results",
+				  results->count);
+		return false;
+	}
+
+	log_debug("Running benchmark %s on \"%s\"", name, filename);
+
+	if (!(*function)(context))
+	{
+		log_error("Failed to run benchmark %s on \"%s\"", name, filename);
+		return false;
+	}
+
+	benchAllocStats.count = 0;
+	benchAllocStats.bytes = 0;
+	benchAllocStats.counting = true;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int i = 0; i < options->iterations; i++)
+	{
+		if (!(*function)(context))
+		{
+			benchAllocStats.counting = false;
+
+			log_error("Failed to run benchmark %s on \"%s\"", name, filename);
+			return false;
+		}
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	benchAllocStats.counting = false;
+
+	ParserBenchResult *result = &(results->results[results->count++]);
+	const char *basename = strrchr(filename, '/');
+
+	result->name = name;
+	result->input = basename == NULL ? filename : basename + 1;
+	result->items = items;
+	result->iterations = options->iterations;
+	result->nsPerOp =
+		INSTR_TIME_GET_DOUBLE(duration) * 1e9 / options->iterations;
+	result->allocsPerOp =
+		(double) benchAllocStats.count / options->iterations;
+	result->bytesPerOp =
+		(double) benchAllocStats.bytes / options->iterations;
+
+	return true;
+}
+
+
+/*
+ * bench_parse_current_state parses the whole recorded current_state result
+ * set, re-using the same nodes array from a call to the next.
+ */
+static bool
+bench_parse_current_state(void *context)
+{
+	CurrentStateContext *ctx = (CurrentStateContext *) context;
+
+	return parseCurrentNodeStateArray(&(ctx->nodesArray), ctx->result);
+}
+
+
+/*
+ * bench_print_node_states computes the column sizes and then prints each
+ * node, as pg_autoctl show state does.
+ */
+static bool
+bench_print_node_states(void *context)
+{
+	CurrentNodeStateArray *nodesArray = (CurrentNodeStateArray *) context;
+
+	nodestatePrepareHeaders(nodesArray, NODE_KIND_CITUS_COORDINATOR);
+
+	for (int index = 0; index < nodesArray->count; index++)
+	{
+		nodestatePrintNodeState(&(nodesArray->headers),
+								&(nodesArray->nodes[index]));
+	}
+
+	return true;
+}
+
+
+/*
+ * bench_keeper_state_as_json builds and serializes the JSON representation
+ * of a keeper state.
+ */
+static bool
+bench_keeper_state_as_json(void *context)
+{
+	KeeperStateData *keeperState = (KeeperStateData *) context;
+	JSON_Value *js = json_value_init_object();
+
+	if (!keeperStateAsJSON(keeperState, js))
+	{
+		json_value_free(js);
+		return false;
+	}
+
+	char *serialized = json_serialize_to_string_pretty(js);
+
+	json_free_serialized_string(serialized);
+	json_value_free(js);
+
+	return serialized != NULL;
+}
+
+
+/*
+ * bench_parse_config parses the recorded keeper configuration file. As
+ * parse_ini_buffer() takes ownership of the buffer, we copy the recorded
+ * contents first, as read_file() would have allocated them.
+ */
+static bool
+bench_parse_config(void *context)
+{
+	ConfigContext *ctx = (ConfigContext *) context;
+	char *contents = (char *) malloc(ctx->size);
+
+	if (contents == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	memcpy(contents, ctx->contents, ctx->size);
+
+	return keeper_config_parse_buffer(&(ctx->config), ctx->filename, contents);
+}
+
+
+/*
+ * bench_parse_controldata parses the recorded pg_controldata output.
+ */
+static bool
+bench_parse_controldata(void *context)
+{
+	ControlDataContext *ctx = (ControlDataContext *) context;
+
+	return parse_controldata(&(ctx->controlData), ctx->contents);
+}
+
+
+/*
+ * bench_parse_timeline_history parses the recorded timeline history file,
+ * re-using the same timelines array from a call to the next.
+ */
+static bool
+bench_parse_timeline_history(void *context)
+{
+	HistoryContext *ctx = (HistoryContext *) context;
+
+	return parseTimeLineHistory(ctx->filename, ctx->contents, &(ctx->system));
+}
+
+
+/*
+ * redirect_stdout_to_devnull sends our stdout to /dev/null, so that we can
+ * measure the formatting functions without a terminal in the way.
+ */
+static bool
+redirect_stdout_to_devnull(int *savedFd)
+{
+	fflush(stdout);
+
+	*savedFd = dup(fileno(stdout));
+
+	if (*savedFd < 0)
+	{
+		log_error("Failed to duplicate stdout: %m");
+		return false;
+	}
+
+	int devnull = open("/dev/null", O_WRONLY);
+
+	if (devnull < 0 || dup2(devnull, fileno(stdout)) < 0)
+	{
+		log_error("Failed to redirect stdout to /dev/null: %m");
+		close(*savedFd);
+		return false;
+	}
+
+	close(devnull);
+
+	return true;
+}
+
+
+/*
+ * restore_stdout restores our stdout from the given saved file descriptor.
+ */
+static void
+restore_stdout(int savedFd)
+{
+	fflush(stdout);
+
+	if (dup2(savedFd, fileno(stdout)) < 0)
+	{
+		log_error("Failed to restore stdout: %m");
+	}
+
+	close(savedFd);
+}
+
+
+/*
+ * parser_bench_print_results prints the benchmark results.
+ */
+void
+parser_bench_print_results(ParserBenchOptions *options,
+						   ParserBenchResults *results)
+{
+	fformat(stdout, "%28s | %18s | %5s | %12s | %10s | %10s\n",
+			"Benchmark", "Input", "Items", "ns/op", "allocs/op", "B/op");
+
+	fformat(stdout, "%28s-+-%18s-+-%5s-+-%12s-+-%10s-+-%10s\n",
+			"----------------------------",
+			"------------------",
+			"-----",
+			"------------",
+			"----------",
+			"----------");
+
+	for (int i = 0; i < results->count; i++)
+	{
+		ParserBenchResult *result = &(results->results[i]);
+
+		if (results->countedAllocations)
+		{
+			fformat(stdout, "%28s | %18s | %5d | %12.1f | %10.1f | %10.1f\n",
+					result->name,
+					result->input,
+					result->items,
+					result->nsPerOp,
+					result->allocsPerOp,
+					result->bytesPerOp);
+		}
+		else
+		{
+			fformat(stdout, "%28s | %18s | %5d | %12.1f | %10s | %10s\n",
+					result->name,
+					result->input,
+					result->items,
+					result->nsPerOp,
+					"-",
+					"-");
+		}
+	}
+
+	if (!results->countedAllocations)
+	{
+		fformat(stdout,
+				"\nAllocations are only counted by the pg_autoctl_bench "
+				"binary built with make bench.\n");
+	}
+}
+
+
+/*
+ * parser_bench_print_results_as_json prints the benchmark results in JSON.
+ */
+void
+parser_bench_print_results_as_json(ParserBenchOptions *options,
+								   ParserBenchResults *results)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	JSON_Value *jsResults = json_value_init_array();
+	JSON_Array *jsResultsArray = json_value_get_array(jsResults);
+
+	json_object_dotset_number(root, "options.iterations", options->iterations);
+	json_object_dotset_string(root, "options.inputs", options->inputs);
+
+	for (int i = 0; i < results->count; i++)
+	{
+		ParserBenchResult *result = &(results->results[i]);
+
+		JSON_Value *jsResult = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(jsResult);
+
+		json_object_set_string(jsObj, "name", result->name);
+		json_object_set_string(jsObj, "input", result->input);
+		json_object_set_number(jsObj, "items", result->items);
+		json_object_set_number(jsObj, "iterations",
+							   (double) result->iterations);
+		json_object_set_number(jsObj, "ns_per_op", result->nsPerOp);
+
+		if (results->countedAllocations)
+		{
+			json_object_set_number(jsObj, "allocs_per_op",
+								   result->allocsPerOp);
+			json_object_set_number(jsObj, "bytes_per_op", result->bytesPerOp);
+		}
+		else
+		{
+			json_object_set_null(jsObj, "allocs_per_op");
+			json_object_set_null(jsObj, "bytes_per_op");
+		}
+
+		json_array_append_value(jsResultsArray, jsResult);
+	}
+
+	json_object_set_value(root, "benchmarks", jsResults);
+
+	(void) cli_pprint_json(js);
+}
@@ -0,0 +1,96 @@
+/*
+ * src/bin/pg_autoctl/parser_bench.h
+ *	 Microbenchmarks for the pg_autoctl parsing and formatting code.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PARSER_BENCH_H
+#define PARSER_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+
+#define PARSER_BENCH_MAX_RESULTS 16
+
+/* the recorded inputs found in the --inputs directory */
+#define PARSER_BENCH_CURRENT_STATE "current_state.tsv"
+#define PARSER_BENCH_CONTROLDATA "pg_controldata.out"
+#define PARSER_BENCH_CONFIG "pg_autoctl.cfg"
+#define PARSER_BENCH_HISTORY_SUFFIX ".history"
+
+typedef struct ParserBenchOptions
+{
+	char inputs[MAXPGPATH];
+	int iterations;
+} ParserBenchOptions;
+
+typedef struct ParserBenchInputs
+{
+	char currentStateFilename[MAXPGPATH];
+	char *currentState;
+
+	char controlDataFilename[MAXPGPATH];
+	char *controlData;
+
+	char configFilename[MAXPGPATH];
+	char *config;
+
+	char historyFilename[MAXPGPATH];
+	char *history;
+	uint32_t historyTimeline;   /* parsed from the history file name */
+} ParserBenchInputs;
+
+typedef struct ParserBenchResult
+{
+	const char *name;
+	const char *input;
+	int items;                  /* rows, lines, or timelines per operation */
+	int64_t iterations;
+	double nsPerOp;
+	double allocsPerOp;
+	double bytesPerOp;
+} ParserBenchResult;
+
+typedef struct ParserBenchResults
+{
+	ParserBenchResult results[PARSER_BENCH_MAX_RESULTS];
+	int count;
+	bool countedAllocations;
+} ParserBenchResults;
+
+/*
+ * Allocations are counted by bench/bench_alloc.c, which replaces malloc() and
+ * friends in the pg_autoctl_bench binary that `make bench` builds. In the
+ * pg_autoctl binary allocations are not counted, and supported is false.
+ */
+typedef struct BenchAllocStats
+{
+	bool supported;
+	bool counting;
+	int64_t count;
+	int64_t bytes;
+} BenchAllocStats;
+
+extern BenchAllocStats benchAllocStats;
+
+bool parser_bench_read_inputs(ParserBenchOptions *options,
+							  ParserBenchInputs *inputs);
+void parser_bench_free_inputs(ParserBenchInputs *inputs);
+
+bool parser_bench_run(ParserBenchOptions *options,
+					  ParserBenchInputs *inputs,
+					  ParserBenchResults *results);
+
+void parser_bench_print_results(ParserBenchOptions *options,
+								ParserBenchResults *results);
+void parser_bench_print_results_as_json(ParserBenchOptions *options,
+										ParserBenchResults *results);
+
+#endif /* PARSER_BENCH_H */
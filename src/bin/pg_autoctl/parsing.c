@@ -16,6 +16,7 @@
 
 #include "parson.h"
 
+#include "defaults.h"
 #include "log.h"
 #include "nodestate_utils.h"
 #include "parsing.h"
@@ -37,8 +38,13 @@ static bool parse_controldata_field_lsn(const char *controlDataString,
 										char lsn[]);
 
 static bool parse_bool_with_len(const char *value, size_t len, bool *result);
+static bool parse_state_notification_compact(CurrentNodeState *nodeState,
+											 const char *message);
+static bool parse_state_notification_json(CurrentNodeState *nodeState,
+										  const char *message);
+static void unescape_compact_field(char *field);
+static bool parse_notification_health(const char *str, int *health);
 
-static int nodeAddressCmpByNodeId(const void *a, const void *b);
 
 #define RE_MATCH_COUNT 10
 
@@ -438,17 +444,226 @@ parse_controldata_field_lsn(const char *controlDataString,
 
 /*
  * parse_notification_message parses pgautofailover state change notifications,
- * which are sent in the JSON format.
+ * which are sent either in the compact format or in the JSON format.
  */
 bool
 parse_state_notification_message(CurrentNodeState *nodeState,
 								 const char *message)
+{
+	log_trace("parse_state_notification_message: %s", message);
+
+	if (strncmp(message,
+				STATE_NOTIFICATION_COMPACT_PREFIX,
+				strlen(STATE_NOTIFICATION_COMPACT_PREFIX)) == 0)
+	{
+		return parse_state_notification_compact(nodeState, message);
+	}
+
+	return parse_state_notification_json(nodeState, message);
+}
+
+
+/*
+ * parse_state_notification_group sets groupId from a compact state
+ * notification message, looking only at its prefix. It returns false when
+ * the message is not in the compact format, and then the caller has to parse
+ * the whole message to find out.
+ */
+bool
+parse_state_notification_group(const char *message, int *groupId)
+{
+	char group[BUFSIZE] = { 0 };
+
+	if (strncmp(message,
+				STATE_NOTIFICATION_COMPACT_PREFIX,
+				strlen(STATE_NOTIFICATION_COMPACT_PREFIX)) != 0)
+	{
+		return false;
+	}
+
+	/* skip the tag and the formation, which never contains the separator */
+	const char *formation = message + strlen(STATE_NOTIFICATION_COMPACT_PREFIX);
+	const char *start = strchr(formation, STATE_NOTIFICATION_SEPARATOR);
+
+	if (start == NULL)
+	{
+		return false;
+	}
+
+	const char *end = strchr(++start, STATE_NOTIFICATION_SEPARATOR);
+
+	if (end == NULL || (end - start) >= sizeof(group))
+	{
+		return false;
+	}
+
+	strlcpy(group, start, end - start + 1);
+
+	return stringToInt(group, groupId);
+}
+
+
+/*
+ * parse_state_notification_compact parses a state notification message in
+ * the compact format, where fields are separated with '|' and the '%' and '|'
+ * characters found in the values are escaped as %25 and %7C.
+ */
+static bool
+parse_state_notification_compact(CurrentNodeState *nodeState,
+								 const char *message)
+{
+	char *fields[STATE_NOTIFICATION_COMPACT_FIELDS] = { 0 };
+	int count = 0;
+
+	char *buffer = strdup(message);
+
+	if (buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	/* split the fields, newer monitors may add fields at the end */
+	for (char *ptr = buffer;
+		 ptr != NULL && count < STATE_NOTIFICATION_COMPACT_FIELDS;
+		 count++)
+	{
+		char *separator = strchr(ptr, STATE_NOTIFICATION_SEPARATOR);
+
+		fields[count] = ptr;
+
+		if (separator != NULL)
+		{
+			*separator = '\0';
+			ptr = separator + 1;
+		}
+		else
+		{
+			ptr = NULL;
+		}
+
+		(void) unescape_compact_field(fields[count]);
+	}
+
+	if (count < STATE_NOTIFICATION_COMPACT_FIELDS)
+	{
+		log_error("Failed to parse compact notification message "
+				  "\"%s\": expected %d fields, found %d",
+				  message, STATE_NOTIFICATION_COMPACT_FIELDS, count);
+		free(buffer);
+		return false;
+	}
+
+	int64_t nodeId = 0;
+
+	/* fields[0] is the tag, checked by our caller */
+	strlcpy(nodeState->formation, fields[1], sizeof(nodeState->formation));
+
+	if (!stringToInt(fields[2], &(nodeState->groupId)) ||
+		!stringToInt64(fields[3], &nodeId) ||
+		!stringToInt(fields[6], &(nodeState->node.port)))
+	{
+		log_error("Failed to parse compact notification message \"%s\"",
+				  message);
+		free(buffer);
+		return false;
+	}
+
+	nodeState->node.nodeId = nodeId;
+
+	strlcpy(nodeState->node.name, fields[4], sizeof(nodeState->node.name));
+	strlcpy(nodeState->node.host, fields[5], sizeof(nodeState->node.host));
+
+	nodeState->reportedState = NodeStateFromString(fields[7]);
+	nodeState->goalState = NodeStateFromString(fields[8]);
+
+	if (!parse_notification_health(fields[9], &(nodeState->health)))
+	{
+		log_error("Failed to parse health in compact "
+				  "notification message \"%s\"", message);
+		free(buffer);
+		return false;
+	}
+
+	strlcpy(nodeState->traceId, fields[10], sizeof(nodeState->traceId));
+
+	free(buffer);
+
+	return true;
+}
+
+
+/*
+ * unescape_compact_field decodes the %25 and %7C escapes of a compact
+ * notification field in place.
+ */
+static void
+unescape_compact_field(char *field)
+{
+	char *src = field;
+	char *dst = field;
+
+	while (*src != '\0')
+	{
+		if (strncmp(src, "%25", 3) == 0)
+		{
+			*dst++ = '%';
+			src += 3;
+		}
+		else if (strncmp(src, "%7C", 3) == 0)
+		{
+			*dst++ = STATE_NOTIFICATION_SEPARATOR;
+			src += 3;
+		}
+		else
+		{
+			*dst++ = *src++;
+		}
+	}
+
+	*dst = '\0';
+}
+
+
+/*
+ * parse_notification_health parses the node health found in state
+ * notifications.
+ */
+static bool
+parse_notification_health(const char *str, int *health)
+{
+	if (streq(str, "unknown"))
+	{
+		*health = -1;
+	}
+	else if (streq(str, "bad"))
+	{
+		*health = 0;
+	}
+	else if (streq(str, "good"))
+	{
+		*health = 1;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parse_state_notification_json parses a state notification message in the
+ * JSON format.
+ */
+static bool
+parse_state_notification_json(CurrentNodeState *nodeState,
+							  const char *message)
 {
 	JSON_Value *json = json_parse_string(message);
 	JSON_Object *jsobj = json_value_get_object(json);
 
-	log_trace("parse_state_notification_message: %s", message);
-
 	if (json_type(json) != JSONObject)
 	{
 		log_error("Failed to parse JSON notification message: \"%s\"", message);
@@ -532,19 +747,7 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 
 	str = (char *) json_object_get_string(jsobj, "health");
 
-	if (streq(str, "unknown"))
-	{
-		nodeState->health = -1;
-	}
-	else if (streq(str, "bad"))
-	{
-		nodeState->health = 0;
-	}
-	else if (streq(str, "good"))
-	{
-		nodeState->health = 1;
-	}
-	else
+	if (!parse_notification_health(str, &(nodeState->health)))
 	{
 		log_error("Failed to parse health in JSON "
 				  "notification message \"%s\"", message);
@@ -552,6 +755,14 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 		return false;
 	}
 
+	/* older monitors don't send a trace id */
+	str = (char *) json_object_get_string(jsobj, "traceId");
+
+	if (str != NULL)
+	{
+		strlcpy(nodeState->traceId, str, sizeof(nodeState->traceId));
+	}
+
 	json_value_free(json);
 	return true;
 }
@@ -703,6 +914,57 @@ parse_bool(const char *value, bool *result)
 }
 
 
+/*
+ * parse_backup_rate parses a transfer rate in the pg_basebackup --max-rate
+ * format, a number of kilobytes per second optionally followed by the unit k
+ * or M, such as "32k" or "100M", and sets kBps to the rate in kB/s.
+ */
+bool
+parse_backup_rate(const char *value, int64_t *kBps)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	double rate = strtod(value, &endptr);
+
+	if (errno != 0 || endptr == value || rate <= 0)
+	{
+		return false;
+	}
+
+	/* skip spaces between the number and the unit, as pg_basebackup does */
+	while (*endptr == ' ')
+	{
+		++endptr;
+	}
+
+	if (*endptr == 'M')
+	{
+		rate *= 1024;
+		++endptr;
+	}
+	else if (*endptr == 'k')
+	{
+		++endptr;
+	}
+
+	if (*endptr != '\0')
+	{
+		return false;
+	}
+
+	/* pg_basebackup accepts rates from 32 kB/s up to 1 GB/s */
+	if (rate < MAX_RATE_LOWER || rate > MAX_RATE_UPPER)
+	{
+		return false;
+	}
+
+	*kBps = (int64_t) rate;
+
+	return true;
+}
+
+
 /*
  * parse_pguri_info_key_vals decomposes elements of a Postgres connection
  * string (URI) into separate arrays of keywords and values as expected by
@@ -958,13 +1220,14 @@ parse_pguri_ssl_settings(const char *pguri, SSLOptions *ssl)
  * nodeId. We use this function to be able to pg_qsort() an array of nodes,
  * such as when parsing from a JSON file.
  */
-static int
+int
 nodeAddressCmpByNodeId(const void *a, const void *b)
 {
 	NodeAddress *nodeA = (NodeAddress *) a;
 	NodeAddress *nodeB = (NodeAddress *) b;
 
-	return nodeA->nodeId - nodeB->nodeId;
+	/* nodeId is an int64_t, don't overflow an int by subtracting them */
+	return (nodeA->nodeId > nodeB->nodeId) - (nodeA->nodeId < nodeB->nodeId);
 }
 
 
@@ -1006,6 +1269,17 @@ parseLSN(const char *str, uint64_t *lsn)
 }
 
 
+/*
+ * formatLSN formats the given LSN the way Postgres does, as in "0/3000148".
+ * The given buffer should be at least PG_LSN_MAXLENGTH bytes.
+ */
+void
+formatLSN(uint64_t lsn, char *str, int size)
+{
+	sformat(str, size, "%X/%X", (uint32_t) (lsn >> 32), (uint32_t) lsn);
+}
+
+
 /*
  * parseNodesArrayFromFile parses a Nodes Array from a JSON file, that contains
  * an array of JSON object with the following properties: node_id, node_lsn,
@@ -1046,12 +1320,9 @@ parseNodesArray(const char *nodesJSON,
 	JSON_Array *jsArray = json_value_get_array(json);
 	int len = json_array_get_count(jsArray);
 
-	if (NODE_ARRAY_MAX_COUNT < len)
+	if (!nodeAddressArrayReserve(nodesArray, len))
 	{
-		log_error("Failed to parse nodes array which contains "
-				  "%d nodes: pg_autoctl supports up to %d nodes",
-				  len,
-				  NODE_ARRAY_MAX_COUNT);
+		/* errors have already been logged */
 		json_value_free(template);
 		json_value_free(json);
 		return false;
@@ -1065,7 +1336,6 @@ parseNodesArray(const char *nodesJSON,
 		JSON_Object *jsObj = json_array_get_object(jsArray, i);
 
 		int jsNodeId = (int) json_object_get_number(jsObj, "node_id");
-		uint64_t lsn = 0;
 
 		/* we install the keeper.otherNodes array, so skip ourselves */
 		if (jsNodeId == nodeId)
@@ -1086,13 +1356,11 @@ parseNodesArray(const char *nodesJSON,
 
 		node->port = (int) json_object_get_number(jsObj, "node_port");
 
-		strlcpy(node->lsn,
-				json_object_get_string(jsObj, "node_lsn"),
-				sizeof(node->lsn));
+		const char *lsn = json_object_get_string(jsObj, "node_lsn");
 
-		if (!parseLSN(node->lsn, &lsn))
+		if (!parseLSN(lsn, &(node->lsn)))
 		{
-			log_error("Failed to parse nodes array LSN value \"%s\"", node->lsn);
+			log_error("Failed to parse nodes array LSN value \"%s\"", lsn);
 			json_value_free(template);
 			json_value_free(json);
 			return false;
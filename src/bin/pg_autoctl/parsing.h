@@ -33,10 +33,20 @@ bool parse_pgaf_extension_version_string(const char *version_string,
 bool parse_controldata(PostgresControlData *pgControlData,
 					   const char *control_data_string);
 
+/*
+ * The monitor sends state notifications either in JSON or in a compact format
+ * of fixed-order fields, see src/monitor/notifications.h.
+ */
+#define STATE_NOTIFICATION_COMPACT_PREFIX "S1|"
+#define STATE_NOTIFICATION_COMPACT_FIELDS 11
+#define STATE_NOTIFICATION_SEPARATOR '|'
+
 bool parse_state_notification_message(CurrentNodeState *nodeState,
 									  const char *message);
+bool parse_state_notification_group(const char *message, int *groupId);
 
 bool parse_bool(const char *value, bool *result);
+bool parse_backup_rate(const char *value, int64_t *kBps);
 
 #define boolToString(value) (value) ? "true" : "false"
 
@@ -93,6 +103,8 @@ bool parse_pguri_ssl_settings(const char *pguri, SSLOptions *ssl);
 bool parse_and_scrub_connection_string(const char *pguri, char *scrubbedPguri);
 
 bool parseLSN(const char *str, uint64_t *lsn);
+void formatLSN(uint64_t lsn, char *str, int size);
+int nodeAddressCmpByNodeId(const void *a, const void *b);
 bool parseNodesArray(const char *nodesJSON,
 					 NodeAddressArray *nodesArray,
 					 int64_t nodeId);
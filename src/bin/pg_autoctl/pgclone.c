@@ -0,0 +1,2371 @@
+/*
+ * src/bin/pg_autoctl/pgclone.c
+ *     Clone a standby node over several SQL connections, and resume the
+ *     clone when it has been interrupted.
+ *
+ * pg_basebackup can't resume its work: when it is interrupted by a network
+ * issue, a restart of the keeper, or the OOM killer, the next attempt wipes
+ * the backup directory and copies the whole data directory again. With very
+ * large databases that takes hours.
+ *
+ * Before running pg_basebackup, we write a clone state file next to the
+ * backup directory, with the system identifier of the upstream node and the
+ * time when the clone started, as seen by the upstream node. When that file
+ * is still there at the next attempt, the clone has been interrupted, and we
+ * resume it with a file-level delta sync over SQL, the same way pg_rewind
+ * does in its libpq mode:
+ *
+ *  1. start a non-exclusive backup on the upstream node,
+ *
+ *  2. list the upstream files and tablespaces, and remove the local files
+ *     that don't exist upstream anymore,
+ *
+ *  3. copy the files that changed, skipping the files that we already have
+ *     with the same size and that the upstream node did not modify since we
+ *     started copying them, then copy global/pg_control last,
+ *
+ *  4. stop the backup, fetch the WAL files written in the meantime, and
+ *     write the backup_label file.
+ *
+ * The checkpoint done when starting the backup flushes all the changes to
+ * disk on the upstream node, so a file that has not been modified since we
+ * copied it is the same as our copy. Other changes are replayed from the WAL
+ * at startup, as with any base backup.
+ *
+ * Each file copied during a resume is appended to the clone state file with
+ * the time when that copy started, so that a resume that is interrupted in
+ * turn does not lose its work either.
+ *
+ * The same engine also implements replication.clone_streams: pg_basebackup
+ * uses a single replication connection, which caps the clone throughput to a
+ * single TCP stream and walsender process. When more than one stream is
+ * configured, we start the clone with an empty backup directory and copy the
+ * files in chunks over that many connections at the same time, so that large
+ * relation segments and tablespaces are split across the streams too.
+ *
+ * A temporary physical replication slot keeps the WAL on the upstream node
+ * from the start of the backup until we have fetched it, and we then write a
+ * backup_manifest file and check the backup directory with pg_verifybackup
+ * before installing it. The manifest has no per-file checksums: computing
+ * them would mean reading the whole backup again.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "common/cryptohash.h"
+#include "common/sha2.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "pgclone.h"
+#include "pgctl.h"
+#include "pgresult.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+
+/*
+ * pg_rewind fetches files in chunks of 1MB, we use larger chunks to keep the
+ * clone streams busy with the data rather than the protocol round-trips.
+ */
+#define PGCLONE_CHUNK_SIZE (8 * 1024 * 1024)
+
+#define PGCLONE_BACKUP_LABEL "pg_autoctl clone"
+#define PGCLONE_SLOT_PREFIX "pgautofailover_clone_"
+
+
+/* an entry of the upstream data directory */
+typedef struct CloneFile
+{
+	char *path;                 /* relative to the data directory */
+	int64_t size;
+	int64_t mtime;              /* seconds since epoch, upstream clock */
+	bool isdir;
+	char *linkTarget;           /* tablespace location, or NULL */
+	bool inBackup;              /* found in the backup directory */
+	int64_t backupSize;         /* size in the backup directory */
+} CloneFile;
+
+
+typedef struct CloneFileArray
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOk;
+	int count;
+	int capacity;
+	CloneFile *array;
+} CloneFileArray;
+
+
+/* a file that a previous resume copied, see the clone state file */
+typedef struct CopiedFile
+{
+	char *path;
+	int64_t copiedAt;           /* seconds since epoch, upstream clock */
+} CopiedFile;
+
+
+typedef struct CloneState
+{
+	char filename[MAXPGPATH];
+	uint64_t systemIdentifier;
+	int64_t startedAt;          /* seconds since epoch, upstream clock */
+	int count;
+	int capacity;
+	CopiedFile *copied;
+	FILE *stream;               /* opened in append mode while resuming */
+} CloneState;
+
+
+typedef struct UpstreamInfo
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOk;
+	bool inRecovery;
+	int64_t now;
+	int version;
+	int walSegmentSize;
+} UpstreamInfo;
+
+
+typedef struct BackupStopContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOk;
+	char lsn[PG_LSN_MAXLENGTH];
+	char *labelfile;
+
+	/* parsed from the labelfile */
+	uint32_t timeline;
+	char startLSN[PG_LSN_MAXLENGTH];
+	char startWalFile[MAXPGPATH];
+} BackupStopContext;
+
+
+typedef struct FileChunkContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOk;
+	bool isNull;
+	int fd;
+	const char *filename;
+	int64_t length;
+} FileChunkContext;
+
+
+typedef struct CloneProgress
+{
+	uint64_t doneBytes;
+	uint64_t totalBytes;
+	int reusedFiles;
+	int copiedFiles;
+	uint64_t reusedBytes;
+	uint64_t copiedBytes;
+} CloneProgress;
+
+
+/* a file that the clone streams fetch, one chunk at a time */
+typedef struct CloneFetch
+{
+	CloneFile *file;
+	char localPath[MAXPGPATH];
+	int fd;
+	int64_t scheduledBytes;     /* offset of the next chunk to fetch */
+	int64_t fetchedBytes;
+	int64_t endOffset;          /* size of our copy */
+	int pendingChunks;
+	bool vanished;
+	bool done;
+} CloneFetch;
+
+
+struct CloneQueue;
+
+/* the chunk that a clone stream is fetching */
+typedef struct CloneChunk
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	struct CloneQueue *queue;
+	CloneFetch *fetch;
+	int64_t offset;
+	int64_t length;
+	char offsetStr[BUFSIZE];
+	char lengthStr[BUFSIZE];
+	const char *paramValues[3];
+} CloneChunk;
+
+
+/* the files to fetch with pgsql_execute_queue */
+typedef struct CloneQueue
+{
+	CloneFetch *fetches;
+	int count;
+	int next;                   /* first file with chunks left to fetch */
+	CloneChunk chunks[PGCLONE_STREAMS_MAX];
+	CloneState *state;          /* NULL when the files are not recorded */
+	int64_t copiedAt;
+	CloneProgress *progress;
+	bool failed;
+} CloneQueue;
+
+
+static void pgclone_state_filename(const char *backupDir, char *filename);
+static bool pgclone_read_state(const char *filename, CloneState *state);
+static void pgclone_free_state(CloneState *state);
+static bool pgclone_record_copied_file(CloneState *state, const char *path,
+									   int64_t copiedAt);
+static CopiedFile * pgclone_find_copied_file(CloneState *state,
+											 const char *path);
+
+static bool pgclone_get_upstream_info(PGSQL *pgsql, UpstreamInfo *info);
+static bool pgclone_copy_internal(ReplicationSource *upstream,
+								  PGSQL *pgsql,
+								  const char *pg_ctl,
+								  CloneState *state,
+								  CloneFileArray *files);
+static int pgclone_streams(ReplicationSource *upstream);
+static bool pgclone_create_slot(PGSQL *pgsql);
+static bool pgclone_start_backup(PGSQL *pgsql, UpstreamInfo *info);
+static bool pgclone_stop_backup(PGSQL *pgsql, UpstreamInfo *info,
+								BackupStopContext *context);
+static bool pgclone_list_files(PGSQL *pgsql, CloneFileArray *files);
+static void pgclone_free_files(CloneFileArray *files);
+static CloneFile * pgclone_find_file(CloneFileArray *files, const char *path);
+static bool pgclone_skip_path(const char *path);
+static bool pgclone_clean_directory(const char *backupDir, const char *relpath,
+									CloneFileArray *files);
+static bool pgclone_ensure_directory(const char *backupDir, CloneFile *file);
+static bool pgclone_file_is_current(CloneState *state, const char *localPath,
+									CloneFile *file);
+static bool pgclone_fetch_file(PGSQL *pgsql, const char *backupDir,
+							   const char *path, int64_t size,
+							   int64_t *fetchedBytes, bool *vanished);
+static bool pgclone_fetch_files(PGSQL *pgsql, int streams,
+								CloneQueue *queue);
+static bool pgclone_next_chunk(void *ctx, int clientIndex, PGSQLQuery *query);
+static bool pgclone_fetch_done(CloneQueue *queue, CloneFetch *fetch);
+static bool pgclone_parse_backup_label(BackupStopContext *stop);
+static bool pgclone_fetch_wal(PGSQL *pgsql, int streams, const char *backupDir,
+							  UpstreamInfo *info, BackupStopContext *stop);
+static bool pgclone_write_manifest(const char *backupDir,
+								   CloneFileArray *files,
+								   BackupStopContext *stop);
+static void pgclone_manifest_add_file(PQExpBuffer manifest, bool *first,
+									  const char *path, int64_t size,
+									  int64_t mtime);
+static bool pgclone_verify_backup(const char *backupDir, const char *pg_ctl,
+								  CloneFileArray *files);
+
+static void parseUpstreamInfo(void *ctx, PGresult *result);
+static void parseBackupStop(void *ctx, PGresult *result);
+static void parseCloneFiles(void *ctx, PGresult *result);
+static void parseFileChunk(void *ctx, PGresult *result);
+static void parseCloneChunk(void *ctx, PGresult *result);
+
+static int cloneFileCmp(const void *a, const void *b);
+static int copiedFileCmp(const void *a, const void *b);
+
+
+/*
+ * pgclone_exists returns true when a clone state file exists for the given
+ * backup directory, that is when a clone has been interrupted.
+ */
+bool
+pgclone_exists(const char *backupDir)
+{
+	char filename[MAXPGPATH] = { 0 };
+
+	(void) pgclone_state_filename(backupDir, filename);
+
+	return file_exists(filename);
+}
+
+
+/*
+ * pgclone_start writes the clone state file before the clone starts. Only
+ * the files copied after that time can be kept when resuming the clone.
+ *
+ * The canCopy parameter is set to true when the upstream node is a primary,
+ * which pgclone_copy needs.
+ */
+bool
+pgclone_start(ReplicationSource *upstream, PGSQL *pgsql, bool *canCopy)
+{
+	UpstreamInfo info = { 0 };
+	char filename[MAXPGPATH] = { 0 };
+	char contents[BUFSIZE] = { 0 };
+
+	(void) pgclone_state_filename(upstream->backupDir, filename);
+
+	if (!pgclone_get_upstream_info(pgsql, &info))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*canCopy = !info.inRecovery;
+
+	int len = sformat(contents, sizeof(contents),
+					  "system_identifier %" PRIu64 "\n"
+					  "started_at %" PRId64 "\n",
+					  upstream->system.identifier,
+					  info.now);
+
+	log_debug("Writing clone state file \"%s\"", filename);
+
+	return write_file(contents, len, filename);
+}
+
+
+/*
+ * pgclone_can_resume returns true when an interrupted clone of the same
+ * upstream system can be resumed from the backup directory.
+ */
+bool
+pgclone_can_resume(ReplicationSource *upstream, PGSQL *pgsql)
+{
+	CloneState state = { 0 };
+	UpstreamInfo info = { 0 };
+	char filename[MAXPGPATH] = { 0 };
+
+	(void) pgclone_state_filename(upstream->backupDir, filename);
+
+	if (!file_exists(filename) || !directory_exists(upstream->backupDir))
+	{
+		return false;
+	}
+
+	if (!pgclone_read_state(filename, &state))
+	{
+		log_warn("Failed to read clone state file \"%s\", "
+				 "starting a new base backup",
+				 filename);
+		return false;
+	}
+
+	uint64_t systemIdentifier = state.systemIdentifier;
+
+	(void) pgclone_free_state(&state);
+
+	if (systemIdentifier != upstream->system.identifier)
+	{
+		log_info("The interrupted clone in \"%s\" is from system "
+				 "identifier %" PRIu64 ", upstream node is %" PRIu64 ", "
+				 "starting a new base backup",
+				 upstream->backupDir,
+				 systemIdentifier,
+				 upstream->system.identifier);
+		return false;
+	}
+
+	if (!pgclone_get_upstream_info(pgsql, &info))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* we need pg_walfile_name() to fetch the WAL at the end of the backup */
+	if (info.inRecovery)
+	{
+		log_info("Upstream node " NODE_FORMAT " is a standby, the "
+				 "interrupted clone in \"%s\" can only be resumed "
+				 "from a primary node, starting a new base backup",
+				 upstream->primaryNode.nodeId,
+				 upstream->primaryNode.name,
+				 upstream->primaryNode.host,
+				 upstream->primaryNode.port,
+				 upstream->backupDir);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_copy clones the upstream node in the backup directory, or resumes
+ * an interrupted clone there, and then installs the backup directory as the
+ * new pgdata. The clone state file must have been written already, see
+ * pgclone_start.
+ */
+bool
+pgclone_copy(ReplicationSource *upstream, PGSQL *pgsql,
+			 const char *pgdata, const char *pg_ctl)
+{
+	CloneState state = { 0 };
+	CloneFileArray files = { 0 };
+
+	(void) pgclone_state_filename(upstream->backupDir, state.filename);
+
+	if (!pgclone_read_state(state.filename, &state))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Cloning node " NODE_FORMAT " in \"%s\" using %d stream(s)",
+			 upstream->primaryNode.nodeId,
+			 upstream->primaryNode.name,
+			 upstream->primaryNode.host,
+			 upstream->primaryNode.port,
+			 upstream->backupDir,
+			 pgclone_streams(upstream));
+
+	/* the backup ends when the session does, keep it open */
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	bool success =
+		pgclone_copy_internal(upstream, pgsql, pg_ctl, &state, &files);
+
+	(void) pg_call_progress_hook(NULL, 0, 0);
+	(void) pgsql_finish(pgsql);
+
+	(void) pgclone_free_files(&files);
+	(void) pgclone_free_state(&state);
+
+	if (!success)
+	{
+		log_error("Failed to clone in \"%s\", "
+				  "the clone will be resumed at the next attempt",
+				  upstream->backupDir);
+		return false;
+	}
+
+	if (!pg_basebackup_install(pgdata, upstream->backupDir))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return pgclone_done(upstream);
+}
+
+
+/*
+ * pgclone_done removes the clone state file, once the backup directory has
+ * been installed as pgdata.
+ */
+bool
+pgclone_done(ReplicationSource *upstream)
+{
+	char filename[MAXPGPATH] = { 0 };
+
+	(void) pgclone_state_filename(upstream->backupDir, filename);
+
+	if (!file_exists(filename))
+	{
+		return true;
+	}
+
+	log_debug("rm \"%s\"", filename);
+
+	return unlink_file(filename);
+}
+
+
+/*
+ * pgclone_copy_internal implements the clone of pgclone_copy.
+ */
+static bool
+pgclone_copy_internal(ReplicationSource *upstream, PGSQL *pgsql,
+					  const char *pg_ctl,
+					  CloneState *state, CloneFileArray *files)
+{
+	const char *backupDir = upstream->backupDir;
+	int streams = pgclone_streams(upstream);
+
+	UpstreamInfo info = { 0 };
+	BackupStopContext stop = { 0 };
+	CloneProgress progress = { 0 };
+	CloneQueue queue = { 0 };
+
+	CloneFile *pgControl = NULL;
+
+	/* files copied from now on are newer than the upstream changes so far */
+	if (!pgclone_get_upstream_info(pgsql, &info))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* keep the WAL from the start of the backup until we have fetched it */
+	if (!pgclone_create_slot(pgsql))
+	{
+		log_warn("Failed to create a temporary replication slot on the "
+				 "upstream node, the WAL files needed for the clone might "
+				 "be removed before we fetch them");
+	}
+
+	if (!pgclone_start_backup(pgsql, &info))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgclone_list_files(pgsql, files))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgclone_clean_directory(backupDir, "", files))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < files->count; i++)
+	{
+		if (!files->array[i].isdir)
+		{
+			progress.totalBytes += files->array[i].size;
+		}
+	}
+
+	state->stream =
+		fopen_with_umask(state->filename, "ab", FOPEN_FLAGS_A, 0644);
+
+	if (state->stream == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	queue.fetches = (CloneFetch *) calloc(files->count + 1, sizeof(CloneFetch));
+
+	if (queue.fetches == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	queue.state = state;
+	queue.copiedAt = info.now;
+	queue.progress = &progress;
+
+	for (int i = 0; i < files->count; i++)
+	{
+		CloneFile *file = &(files->array[i]);
+		char localPath[MAXPGPATH] = { 0 };
+
+		if (file->isdir)
+		{
+			if (!pgclone_ensure_directory(backupDir, file))
+			{
+				/* errors have already been logged */
+				free(queue.fetches);
+				return false;
+			}
+			continue;
+		}
+
+		/* pg_basebackup also copies pg_control last */
+		if (strcmp(file->path, "global/pg_control") == 0)
+		{
+			pgControl = file;
+			continue;
+		}
+
+		sformat(localPath, sizeof(localPath), "%s/%s", backupDir, file->path);
+
+		if (pgclone_file_is_current(state, localPath, file))
+		{
+			file->inBackup = true;
+			file->backupSize = file->size;
+
+			++progress.reusedFiles;
+			progress.reusedBytes += file->size;
+			progress.doneBytes += file->size;
+			continue;
+		}
+
+		CloneFetch *fetch = &(queue.fetches[queue.count++]);
+
+		fetch->file = file;
+		fetch->fd = -1;
+		strlcpy(fetch->localPath, localPath, sizeof(fetch->localPath));
+	}
+
+	(void) pg_call_progress_hook("basebackup",
+								 progress.doneBytes,
+								 progress.totalBytes);
+
+	bool success = pgclone_fetch_files(pgsql, streams, &queue);
+
+	free(queue.fetches);
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (pgControl == NULL)
+	{
+		log_error("Failed to find global/pg_control on the upstream node");
+		return false;
+	}
+	else
+	{
+		int64_t fetchedBytes = 0;
+		bool vanished = false;
+
+		if (!pgclone_fetch_file(pgsql, backupDir, pgControl->path,
+								pgControl->size, &fetchedBytes, &vanished) ||
+			vanished)
+		{
+			log_error("Failed to fetch global/pg_control from the upstream node");
+			return false;
+		}
+
+		pgControl->inBackup = true;
+		pgControl->backupSize = fetchedBytes;
+	}
+
+	if (!pgclone_stop_backup(pgsql, &info, &stop))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	success = pgclone_parse_backup_label(&stop) &&
+			  pgclone_fetch_wal(pgsql, streams, backupDir, &info, &stop);
+
+	if (success)
+	{
+		char backupLabel[MAXPGPATH] = { 0 };
+
+		sformat(backupLabel, sizeof(backupLabel), "%s/backup_label", backupDir);
+
+		success = write_file(stop.labelfile, strlen(stop.labelfile), backupLabel) &&
+				  pgclone_write_manifest(backupDir, files, &stop) &&
+				  pgclone_verify_backup(backupDir, pg_ctl, files);
+	}
+
+	free(stop.labelfile);
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Cloned node " NODE_FORMAT ": kept %d files (%" PRIu64 " MB), "
+			 "copied %d files (%" PRIu64 " MB), backup stopped at %s",
+			 upstream->primaryNode.nodeId,
+			 upstream->primaryNode.name,
+			 upstream->primaryNode.host,
+			 upstream->primaryNode.port,
+			 progress.reusedFiles,
+			 progress.reusedBytes / (1024 * 1024),
+			 progress.copiedFiles,
+			 progress.copiedBytes / (1024 * 1024),
+			 stop.lsn);
+
+	return true;
+}
+
+
+/*
+ * pgclone_streams returns how many connections we use to fetch the files.
+ */
+static int
+pgclone_streams(ReplicationSource *upstream)
+{
+	if (upstream->cloneStreams < 1)
+	{
+		return 1;
+	}
+
+	if (upstream->cloneStreams > PGCLONE_STREAMS_MAX)
+	{
+		return PGCLONE_STREAMS_MAX;
+	}
+
+	return upstream->cloneStreams;
+}
+
+
+/*
+ * pgclone_state_filename computes the clone state file name of the given
+ * backup directory. pg_basebackup wants an empty directory, so the file is
+ * kept next to it.
+ */
+static void
+pgclone_state_filename(const char *backupDir, char *filename)
+{
+	sformat(filename, MAXPGPATH, "%s%s", backupDir, KEEPER_CLONE_STATE_SUFFIX);
+}
+
+
+/*
+ * pgclone_read_state reads the clone state file. Files that have been copied
+ * several times are only kept once, with the time of the most recent copy.
+ */
+static bool
+pgclone_read_state(const char *filename, CloneState *state)
+{
+	char *contents = NULL;
+	long size = 0L;
+
+	if (!read_file(filename, &contents, &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	char *line = contents;
+	int lineNumber = 0;
+
+	while (line != NULL && *line != '\0')
+	{
+		char *eol = strchr(line, '\n');
+
+		if (eol != NULL)
+		{
+			*eol = '\0';
+		}
+
+		++lineNumber;
+
+		if (strncmp(line, "system_identifier ", 18) == 0)
+		{
+			if (!stringToUInt64(line + 18, &(state->systemIdentifier)))
+			{
+				log_error("Failed to parse system_identifier \"%s\" "
+						  "at line %d of \"%s\"",
+						  line + 18, lineNumber, filename);
+				free(contents);
+				return false;
+			}
+		}
+		else if (strncmp(line, "started_at ", 11) == 0)
+		{
+			if (!stringToInt64(line + 11, &(state->startedAt)))
+			{
+				log_error("Failed to parse started_at \"%s\" "
+						  "at line %d of \"%s\"",
+						  line + 11, lineNumber, filename);
+				free(contents);
+				return false;
+			}
+		}
+		else if (strncmp(line, "file ", 5) == 0)
+		{
+			/* file <copied at> <path>, the path might contain spaces */
+			char *copiedAt = line + 5;
+			char *path = strchr(copiedAt, ' ');
+			int64_t value = 0;
+
+			if (path == NULL)
+			{
+				log_error("Failed to parse line %d of \"%s\"",
+						  lineNumber, filename);
+				free(contents);
+				return false;
+			}
+
+			*path++ = '\0';
+
+			if (!stringToInt64(copiedAt, &value) ||
+				!pgclone_record_copied_file(state, path, value))
+			{
+				log_error("Failed to parse line %d of \"%s\"",
+						  lineNumber, filename);
+				free(contents);
+				return false;
+			}
+		}
+		else if (*line != '\0')
+		{
+			log_warn("Skipping unknown line %d of \"%s\": %s",
+					 lineNumber, filename, line);
+		}
+
+		line = eol == NULL ? NULL : eol + 1;
+	}
+
+	free(contents);
+
+	if (state->systemIdentifier == 0 || state->startedAt == 0)
+	{
+		log_error("Failed to parse clone state file \"%s\"", filename);
+		return false;
+	}
+
+	qsort(state->copied, state->count, sizeof(CopiedFile), copiedFileCmp);
+
+	/* keep only the most recent copy of each file */
+	int count = 0;
+
+	for (int i = 0; i < state->count; i++)
+	{
+		if (count > 0 &&
+			strcmp(state->copied[count - 1].path, state->copied[i].path) == 0)
+		{
+			if (state->copied[i].copiedAt > state->copied[count - 1].copiedAt)
+			{
+				state->copied[count - 1].copiedAt = state->copied[i].copiedAt;
+			}
+			free(state->copied[i].path);
+			continue;
+		}
+
+		state->copied[count++] = state->copied[i];
+	}
+
+	state->count = count;
+
+	return true;
+}
+
+
+/*
+ * pgclone_free_state frees the memory allocated in the given state.
+ */
+static void
+pgclone_free_state(CloneState *state)
+{
+	if (state->stream != NULL)
+	{
+		fclose(state->stream);
+		state->stream = NULL;
+	}
+
+	for (int i = 0; i < state->count; i++)
+	{
+		free(state->copied[i].path);
+	}
+
+	free(state->copied);
+
+	state->copied = NULL;
+	state->count = 0;
+	state->capacity = 0;
+}
+
+
+/*
+ * pgclone_record_copied_file adds a copied file to the state. When the clone
+ * state file is open, the file is also appended there.
+ *
+ * The copied file has been fsync'ed already, so that the clone state file
+ * never references a file that we might lose.
+ */
+static bool
+pgclone_record_copied_file(CloneState *state, const char *path,
+						   int64_t copiedAt)
+{
+	if (state->stream != NULL)
+	{
+		if (fformat(state->stream, "file %" PRId64 " %s\n", copiedAt, path) < 0 ||
+			fflush(state->stream) != 0)
+		{
+			log_error("Failed to write to clone state file \"%s\": %m",
+					  state->filename);
+			return false;
+		}
+
+		/* we don't need to search the state anymore */
+		return true;
+	}
+
+	if (state->count == state->capacity)
+	{
+		int capacity = state->capacity == 0 ? 1024 : 2 * state->capacity;
+		CopiedFile *copied =
+			(CopiedFile *) realloc(state->copied, capacity * sizeof(CopiedFile));
+
+		if (copied == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		state->copied = copied;
+		state->capacity = capacity;
+	}
+
+	char *copy = strdup(path);
+
+	if (copy == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	state->copied[state->count].path = copy;
+	state->copied[state->count].copiedAt = copiedAt;
+	++state->count;
+
+	return true;
+}
+
+
+/*
+ * pgclone_find_copied_file returns the entry of the given file in the clone
+ * state, or NULL when a previous resume did not copy the file.
+ */
+static CopiedFile *
+pgclone_find_copied_file(CloneState *state, const char *path)
+{
+	CopiedFile key = { .path = (char *) path };
+
+	if (state->count == 0)
+	{
+		return NULL;
+	}
+
+	return (CopiedFile *) bsearch(&key, state->copied, state->count,
+								  sizeof(CopiedFile), copiedFileCmp);
+}
+
+
+/*
+ * pgclone_get_upstream_info fetches the upstream clock, version, WAL segment
+ * size, and whether it's in recovery.
+ */
+static bool
+pgclone_get_upstream_info(PGSQL *pgsql, UpstreamInfo *info)
+{
+	const char *sql =
+		"SELECT pg_is_in_recovery(), "
+		"       floor(extract(epoch from now()))::bigint, "
+		"       current_setting('server_version_num')::int, "
+		"       (SELECT bytes_per_wal_segment FROM pg_control_init())";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   info, &parseUpstreamInfo))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!info->parsedOk)
+	{
+		log_error("Failed to get the current time of the upstream node");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_create_slot creates a temporary physical replication slot that
+ * reserves the WAL right away. The slot is dropped when our session ends,
+ * once we have fetched the WAL files of the backup.
+ */
+static bool
+pgclone_create_slot(PGSQL *pgsql)
+{
+	char slotName[NAMEDATALEN] = { 0 };
+
+	sformat(slotName, sizeof(slotName), "%s%d", PGCLONE_SLOT_PREFIX, getpid());
+
+	const char *sql =
+		"SELECT pg_create_physical_replication_slot($1, true, true)";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Created temporary replication slot \"%s\" on the upstream node",
+			 slotName);
+
+	return true;
+}
+
+
+/*
+ * pgclone_start_backup starts a non-exclusive backup on the upstream node.
+ * The backup is stopped when our session ends, if we did not stop it before.
+ */
+static bool
+pgclone_start_backup(PGSQL *pgsql, UpstreamInfo *info)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	const char *sql =
+		info->version >= 150000
+		? "SELECT pg_backup_start($1, true)"
+		: "SELECT pg_start_backup($1, true, false)";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { PGCLONE_BACKUP_LABEL };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to start a backup on the upstream node");
+		return false;
+	}
+
+	log_info("Started a backup on the upstream node at %s", context.strVal);
+
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * pgclone_stop_backup stops the backup on the upstream node, and fetches the
+ * contents of the backup_label file that we need to write.
+ */
+static bool
+pgclone_stop_backup(PGSQL *pgsql, UpstreamInfo *info,
+					BackupStopContext *context)
+{
+	const char *sql =
+		info->version >= 150000
+		? "SELECT lsn, labelfile FROM pg_backup_stop(false)"
+		: "SELECT lsn, labelfile FROM pg_stop_backup(false, false)";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   context, &parseBackupStop))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context->parsedOk)
+	{
+		log_error("Failed to stop the backup on the upstream node");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_list_files lists the files and directories of the upstream node,
+ * including the tablespaces, using the same query as pg_rewind.
+ */
+static bool
+pgclone_list_files(PGSQL *pgsql, CloneFileArray *files)
+{
+	const char *sql =
+		"WITH RECURSIVE files (path, filename, size, mtime, isdir) AS ( "
+		"  SELECT '' AS path, filename, size, modification, isdir "
+		"    FROM (SELECT pg_ls_dir('.', true, false) AS filename) AS fn, "
+		"         pg_stat_file(fn.filename, true) AS this "
+		"   UNION ALL "
+		"  SELECT parent.path || parent.filename || '/' AS path, "
+		"         fn, this.size, this.modification, this.isdir "
+		"    FROM files AS parent, "
+		"         pg_ls_dir(parent.path || parent.filename, true, false) AS fn, "
+		"         pg_stat_file(parent.path || parent.filename || '/' || fn, "
+		"                      true) AS this "
+		"   WHERE parent.isdir = 't' "
+		") "
+		"SELECT path || filename, size, "
+		"       floor(extract(epoch from mtime))::bigint, isdir, "
+		"       pg_tablespace_location(pg_tablespace.oid) "
+		"  FROM files "
+		"       LEFT OUTER JOIN pg_tablespace "
+		"                    ON files.path = 'pg_tblspc/' "
+		"                   AND pg_tablespace.oid::text = files.filename "
+		" WHERE isdir IS NOT NULL";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   files, &parseCloneFiles))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!files->parsedOk)
+	{
+		log_error("Failed to list the files of the upstream node");
+		return false;
+	}
+
+	/* parents sort before their contents */
+	qsort(files->array, files->count, sizeof(CloneFile), cloneFileCmp);
+
+	return true;
+}
+
+
+/*
+ * pgclone_free_files frees the memory allocated in the given array.
+ */
+static void
+pgclone_free_files(CloneFileArray *files)
+{
+	for (int i = 0; i < files->count; i++)
+	{
+		free(files->array[i].path);
+		free(files->array[i].linkTarget);
+	}
+
+	free(files->array);
+
+	files->array = NULL;
+	files->count = 0;
+	files->capacity = 0;
+}
+
+
+/*
+ * pgclone_find_file returns the upstream entry for the given path, or NULL.
+ */
+static CloneFile *
+pgclone_find_file(CloneFileArray *files, const char *path)
+{
+	CloneFile key = { .path = (char *) path };
+
+	if (files->count == 0)
+	{
+		return NULL;
+	}
+
+	return (CloneFile *) bsearch(&key, files->array, files->count,
+								 sizeof(CloneFile), cloneFileCmp);
+}
+
+
+/*
+ * pgclone_skip_path returns true for the paths that pg_basebackup does not
+ * copy either. The WAL files are fetched once the backup is stopped, only
+ * the timeline history files are copied along with the other files.
+ */
+static bool
+pgclone_skip_path(const char *path)
+{
+	const char *excludedDirContents[] = {
+		"pg_dynshmem/",
+		"pg_notify/",
+		"pg_replslot/",
+		"pg_serial/",
+		"pg_snapshots/",
+		"pg_stat_tmp/",
+		"pg_subtrans/",
+		NULL
+	};
+
+	const char *excludedFiles[] = {
+		"postmaster.pid",
+		"postmaster.opts",
+		"backup_label",
+		"tablespace_map",
+		"backup_manifest",
+		"postgresql.auto.conf.tmp",
+		"current_logfiles.tmp",
+		"pg_internal.init",
+		NULL
+	};
+
+	for (int i = 0; excludedDirContents[i] != NULL; i++)
+	{
+		if (strncmp(path,
+					excludedDirContents[i],
+					strlen(excludedDirContents[i])) == 0)
+		{
+			return true;
+		}
+	}
+
+	if (strncmp(path, "pg_wal/", 7) == 0)
+	{
+		const char *name = path + 7;
+		size_t len = strlen(name);
+
+		/* keep the 00000002.history files only */
+		return !(len == 16 &&
+				 strspn(name, "0123456789ABCDEF") == 8 &&
+				 strcmp(name + 8, ".history") == 0);
+	}
+
+	const char *basename = strrchr(path, '/');
+
+	basename = basename == NULL ? path : basename + 1;
+
+	for (int i = 0; excludedFiles[i] != NULL; i++)
+	{
+		if (strcmp(basename, excludedFiles[i]) == 0)
+		{
+			return true;
+		}
+	}
+
+	/* temporary files and directories, anywhere in the path */
+	return strncmp(path, "pgsql_tmp", 9) == 0 || strstr(path, "/pgsql_tmp") != NULL;
+}
+
+
+/*
+ * pgclone_clean_directory removes the local files and directories that are
+ * not found on the upstream node anymore, and the tablespace symbolic links
+ * that point to another location.
+ */
+static bool
+pgclone_clean_directory(const char *backupDir, const char *relpath,
+						CloneFileArray *files)
+{
+	char dirPath[MAXPGPATH] = { 0 };
+	struct dirent *dirEntry = NULL;
+
+	if (IS_EMPTY_STRING_BUFFER(relpath))
+	{
+		strlcpy(dirPath, backupDir, sizeof(dirPath));
+	}
+	else
+	{
+		sformat(dirPath, sizeof(dirPath), "%s/%s", backupDir, relpath);
+	}
+
+	DIR *dir = opendir(dirPath);
+
+	if (dir == NULL)
+	{
+		log_error("Failed to open directory \"%s\": %m", dirPath);
+		return false;
+	}
+
+	while ((dirEntry = readdir(dir)) != NULL)
+	{
+		char relname[MAXPGPATH] = { 0 };
+		char fullPath[MAXPGPATH] = { 0 };
+		struct stat st;
+
+		if (strcmp(dirEntry->d_name, ".") == 0 ||
+			strcmp(dirEntry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (IS_EMPTY_STRING_BUFFER(relpath))
+		{
+			strlcpy(relname, dirEntry->d_name, sizeof(relname));
+		}
+		else
+		{
+			sformat(relname, sizeof(relname), "%s/%s", relpath, dirEntry->d_name);
+		}
+
+		sformat(fullPath, sizeof(fullPath), "%s/%s", backupDir, relname);
+
+		if (lstat(fullPath, &st) != 0)
+		{
+			log_error("Failed to get file information for \"%s\": %m", fullPath);
+			closedir(dir);
+			return false;
+		}
+
+		CloneFile *file = pgclone_find_file(files, relname);
+
+		if (S_ISLNK(st.st_mode))
+		{
+			char target[MAXPGPATH] = { 0 };
+			ssize_t len = readlink(fullPath, target, sizeof(target) - 1);
+
+			if (file != NULL && file->isdir && file->linkTarget != NULL &&
+				len > 0 && strcmp(target, file->linkTarget) == 0)
+			{
+				if (!pgclone_clean_directory(backupDir, relname, files))
+				{
+					closedir(dir);
+					return false;
+				}
+				continue;
+			}
+
+			log_debug("rm \"%s\"", fullPath);
+
+			if (unlink(fullPath) != 0)
+			{
+				log_error("Failed to remove symbolic link \"%s\": %m", fullPath);
+				closedir(dir);
+				return false;
+			}
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			if (file != NULL && file->isdir && file->linkTarget == NULL)
+			{
+				if (!pgclone_clean_directory(backupDir, relname, files))
+				{
+					closedir(dir);
+					return false;
+				}
+				continue;
+			}
+
+			log_debug("rm -rf \"%s\"", fullPath);
+
+			if (!rmtree(fullPath, true))
+			{
+				log_error("Failed to remove directory \"%s\": %m", fullPath);
+				closedir(dir);
+				return false;
+			}
+		}
+		else if (file == NULL || file->isdir)
+		{
+			log_debug("rm \"%s\"", fullPath);
+
+			if (unlink(fullPath) != 0)
+			{
+				log_error("Failed to remove file \"%s\": %m", fullPath);
+				closedir(dir);
+				return false;
+			}
+		}
+	}
+
+	closedir(dir);
+
+	return true;
+}
+
+
+/*
+ * pgclone_ensure_directory creates the given directory in the backup
+ * directory, or the symbolic link to the tablespace location and that
+ * location, as pg_basebackup does in plain format.
+ */
+static bool
+pgclone_ensure_directory(const char *backupDir, CloneFile *file)
+{
+	char localPath[MAXPGPATH] = { 0 };
+	struct stat st;
+
+	sformat(localPath, sizeof(localPath), "%s/%s", backupDir, file->path);
+
+	if (lstat(localPath, &st) == 0)
+	{
+		/* pgclone_clean_directory removed what we can't keep */
+		return true;
+	}
+
+	if (file->linkTarget != NULL)
+	{
+		char target[MAXPGPATH] = { 0 };
+
+		strlcpy(target, file->linkTarget, sizeof(target));
+
+		if (pg_mkdir_p(target, 0700) == -1)
+		{
+			log_error("Failed to create tablespace directory \"%s\": %m",
+					  file->linkTarget);
+			return false;
+		}
+
+		log_debug("ln -s \"%s\" \"%s\"", file->linkTarget, localPath);
+
+		if (symlink(file->linkTarget, localPath) != 0)
+		{
+			log_error("Failed to create symbolic link \"%s\": %m", localPath);
+			return false;
+		}
+
+		return true;
+	}
+
+	if (pg_mkdir_p(localPath, 0700) == -1)
+	{
+		log_error("Failed to create directory \"%s\": %m", localPath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_file_is_current returns true when our local copy of the file is
+ * the same as the upstream one: it has the same size, and the upstream node
+ * has not modified the file since before we started copying it.
+ *
+ * The modification times are truncated to the second, so a file modified in
+ * the same second as the one we started copying at is copied again.
+ */
+static bool
+pgclone_file_is_current(CloneState *state, const char *localPath,
+						CloneFile *file)
+{
+	struct stat st;
+
+	if (lstat(localPath, &st) != 0 ||
+		!S_ISREG(st.st_mode) ||
+		st.st_size != file->size)
+	{
+		return false;
+	}
+
+	/* files without an entry are copied by pg_basebackup */
+	int64_t copiedAt = state->startedAt;
+	CopiedFile *copied = pgclone_find_copied_file(state, file->path);
+
+	if (copied != NULL && copied->copiedAt > copiedAt)
+	{
+		copiedAt = copied->copiedAt;
+	}
+
+	return file->mtime < copiedAt;
+}
+
+
+/*
+ * pgclone_fetch_file copies the given upstream file in the backup directory,
+ * one chunk at a time, and fsyncs it. When the file has been removed on the
+ * upstream node, vanished is set to true.
+ */
+static bool
+pgclone_fetch_file(PGSQL *pgsql, const char *backupDir,
+				   const char *path, int64_t size,
+				   int64_t *fetchedBytes, bool *vanished)
+{
+	char localPath[MAXPGPATH] = { 0 };
+
+	sformat(localPath, sizeof(localPath), "%s/%s", backupDir, path);
+
+	int fd = open(localPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (fd < 0)
+	{
+		log_error("Failed to open file \"%s\": %m", localPath);
+		return false;
+	}
+
+	const char *sql = "SELECT pg_read_binary_file($1, $2, $3, true)";
+	const Oid paramTypes[3] = { TEXTOID, INT8OID, INT8OID };
+
+	*fetchedBytes = 0;
+	*vanished = false;
+
+	while (*fetchedBytes < size)
+	{
+		FileChunkContext context = { { 0 }, false };
+		char offset[BUFSIZE] = { 0 };
+		char length[BUFSIZE] = { 0 };
+
+		int64_t chunkSize = size - *fetchedBytes;
+
+		if (chunkSize > PGCLONE_CHUNK_SIZE)
+		{
+			chunkSize = PGCLONE_CHUNK_SIZE;
+		}
+
+		sformat(offset, sizeof(offset), "%" PRId64, *fetchedBytes);
+		sformat(length, sizeof(length), "%" PRId64, chunkSize);
+
+		const char *paramValues[3] = { path, offset, length };
+
+		context.fd = fd;
+		context.filename = localPath;
+
+		if (!pgsql_execute_with_params_binary(pgsql, sql,
+											  3, paramTypes, paramValues,
+											  &context, &parseFileChunk) ||
+			!context.parsedOk)
+		{
+			log_error("Failed to fetch file \"%s\" from the upstream node",
+					  path);
+			close(fd);
+			return false;
+		}
+
+		if (context.isNull)
+		{
+			*vanished = true;
+			break;
+		}
+
+		*fetchedBytes += context.length;
+
+		/* the file has been truncated since we listed it */
+		if (context.length < chunkSize)
+		{
+			break;
+		}
+	}
+
+	if (fsync(fd) != 0)
+	{
+		log_error("Failed to fsync file \"%s\": %m", localPath);
+		close(fd);
+		return false;
+	}
+
+	if (close(fd) != 0)
+	{
+		log_error("Failed to close file \"%s\": %m", localPath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_fetch_files fetches the files of the queue from the upstream node,
+ * splitting them in chunks that we fetch using the given number of
+ * connections at the same time.
+ */
+static bool
+pgclone_fetch_files(PGSQL *pgsql, int streams, CloneQueue *queue)
+{
+	PGSQL clients[PGCLONE_STREAMS_MAX] = { 0 };
+
+	if (queue->count == 0)
+	{
+		return true;
+	}
+
+	for (int i = 0; i < streams; i++)
+	{
+		if (!pgsql_init(&(clients[i]),
+						pgsql->connectionString,
+						PGSQL_CONN_UPSTREAM))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	/* pg_read_binary_file returns bytea, use the binary format */
+	bool success =
+		pgsql_execute_queue(clients, streams, 1, &pgclone_next_chunk, queue);
+
+	/* on errors, some files might still be open */
+	for (int i = 0; i < queue->count; i++)
+	{
+		CloneFetch *fetch = &(queue->fetches[i]);
+
+		if (fetch->fd >= 0)
+		{
+			(void) close(fetch->fd);
+			fetch->fd = -1;
+		}
+
+		if (!fetch->done)
+		{
+			success = false;
+		}
+	}
+
+	if (!success || queue->failed)
+	{
+		log_error("Failed to fetch files from the upstream node");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_next_chunk is the pgsql_execute_queue callback that schedules the
+ * next chunk to fetch on the given connection. Each connection fetches the
+ * next chunk of the current file, so that a large file is split across all
+ * the connections.
+ */
+static bool
+pgclone_next_chunk(void *ctx, int clientIndex, PGSQLQuery *query)
+{
+	CloneQueue *queue = (CloneQueue *) ctx;
+
+	static const Oid paramTypes[3] = { TEXTOID, INT8OID, INT8OID };
+
+	while (!queue->failed && queue->next < queue->count)
+	{
+		CloneFetch *fetch = &(queue->fetches[queue->next]);
+		CloneFile *file = fetch->file;
+
+		if (fetch->fd < 0 && !fetch->done)
+		{
+			fetch->fd = open(fetch->localPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+			if (fetch->fd < 0)
+			{
+				log_error("Failed to open file \"%s\": %m", fetch->localPath);
+				queue->failed = true;
+				return false;
+			}
+		}
+
+		if (fetch->scheduledBytes >= file->size)
+		{
+			++queue->next;
+
+			/* empty files have no chunk to wait for */
+			if (fetch->pendingChunks == 0 && !fetch->done &&
+				!pgclone_fetch_done(queue, fetch))
+			{
+				queue->failed = true;
+				return false;
+			}
+			continue;
+		}
+
+		CloneChunk *chunk = &(queue->chunks[clientIndex]);
+
+		chunk->queue = queue;
+		chunk->fetch = fetch;
+		chunk->offset = fetch->scheduledBytes;
+		chunk->length = file->size - fetch->scheduledBytes;
+
+		if (chunk->length > PGCLONE_CHUNK_SIZE)
+		{
+			chunk->length = PGCLONE_CHUNK_SIZE;
+		}
+
+		sformat(chunk->offsetStr, sizeof(chunk->offsetStr),
+				"%" PRId64, chunk->offset);
+		sformat(chunk->lengthStr, sizeof(chunk->lengthStr),
+				"%" PRId64, chunk->length);
+
+		chunk->paramValues[0] = file->path;
+		chunk->paramValues[1] = chunk->offsetStr;
+		chunk->paramValues[2] = chunk->lengthStr;
+
+		fetch->scheduledBytes += chunk->length;
+		++fetch->pendingChunks;
+
+		if (fetch->scheduledBytes >= file->size)
+		{
+			++queue->next;
+		}
+
+		query->sql = "SELECT pg_read_binary_file($1, $2, $3, true)";
+		query->paramCount = 3;
+		query->paramTypes = paramTypes;
+		query->paramValues = chunk->paramValues;
+		query->context = chunk;
+		query->parseFun = &parseCloneChunk;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * pgclone_fetch_done is called when all the chunks of a file have been
+ * fetched: the file is fsync'ed and then recorded in the clone state file.
+ */
+static bool
+pgclone_fetch_done(CloneQueue *queue, CloneFetch *fetch)
+{
+	CloneFile *file = fetch->file;
+
+	fetch->done = true;
+
+	if (fsync(fetch->fd) != 0)
+	{
+		log_error("Failed to fsync file \"%s\": %m", fetch->localPath);
+		return false;
+	}
+
+	if (close(fetch->fd) != 0)
+	{
+		fetch->fd = -1;
+		log_error("Failed to close file \"%s\": %m", fetch->localPath);
+		return false;
+	}
+
+	fetch->fd = -1;
+
+	++queue->progress->copiedFiles;
+
+	/* a file removed upstream in the meantime, WAL replay handles it */
+	if (fetch->vanished)
+	{
+		log_debug("File \"%s\" has been removed on the upstream node",
+				  file->path);
+		(void) unlink(fetch->localPath);
+		return true;
+	}
+
+	file->inBackup = true;
+	file->backupSize = fetch->endOffset;
+
+	if (queue->state != NULL &&
+		!pgclone_record_copied_file(queue->state, file->path, queue->copiedAt))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgclone_parse_backup_label parses the backup start location, timeline, and
+ * WAL file from the backup label, which looks like the following:
+ *
+ *   START WAL LOCATION: 0/2000028 (file 000000010000000000000002)
+ */
+static bool
+pgclone_parse_backup_label(BackupStopContext *stop)
+{
+	uint32_t hi = 0, lo = 0;
+	uint32_t log = 0, seg = 0;
+
+	const char *start = strstr(stop->labelfile, "START WAL LOCATION: ");
+
+	if (start == NULL ||
+		sscanf(start, "START WAL LOCATION: %X/%X (file %24[0-9A-F])",
+			   &hi, &lo, stop->startWalFile) != 3 ||
+		sscanf(stop->startWalFile, "%08X%08X%08X",
+			   &(stop->timeline), &log, &seg) != 3)
+	{
+		log_error("Failed to parse the backup label: %s", stop->labelfile);
+		return false;
+	}
+
+	sformat(stop->startLSN, sizeof(stop->startLSN), "%X/%X", hi, lo);
+
+	return true;
+}
+
+
+/*
+ * pgclone_fetch_wal fetches the WAL files from the backup start location to
+ * the backup stop location, as pg_basebackup --wal-method=fetch does. Our
+ * temporary replication slot keeps those files on the upstream node.
+ */
+static bool
+pgclone_fetch_wal(PGSQL *pgsql, int streams, const char *backupDir,
+				  UpstreamInfo *info, BackupStopContext *stop)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char walDir[MAXPGPATH] = { 0 };
+	char stopWalFile[MAXPGPATH] = { 0 };
+
+	uint32_t startTLI = 0, startLog = 0, startSeg = 0;
+	uint32_t stopTLI = 0, stopLog = 0, stopSeg = 0;
+
+	if (sscanf(stop->startWalFile, "%08X%08X%08X",
+			   &startTLI, &startLog, &startSeg) != 3)
+	{
+		log_error("Failed to parse WAL file name \"%s\"", stop->startWalFile);
+		return false;
+	}
+
+	const char *sql = "SELECT pg_walfile_name($1::pg_lsn)";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { stop->lsn };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to get the WAL file name of the backup stop "
+				  "location %s", stop->lsn);
+		return false;
+	}
+
+	strlcpy(stopWalFile, context.strVal, sizeof(stopWalFile));
+	free(context.strVal);
+
+	if (sscanf(stopWalFile, "%08X%08X%08X", &stopTLI, &stopLog, &stopSeg) != 3)
+	{
+		log_error("Failed to parse WAL file name \"%s\"", stopWalFile);
+		return false;
+	}
+
+	if (startTLI != stopTLI)
+	{
+		log_error("The upstream node switched from timeline %u to %u "
+				  "during the backup", startTLI, stopTLI);
+		return false;
+	}
+
+	if (info->walSegmentSize <= 0)
+	{
+		log_error("Failed to get the WAL segment size of the upstream node");
+		return false;
+	}
+
+	uint64_t segmentsPerLog = UINT64_C(0x100000000) / info->walSegmentSize;
+	uint64_t startSegNo = (uint64_t) startLog * segmentsPerLog + startSeg;
+	uint64_t stopSegNo = (uint64_t) stopLog * segmentsPerLog + stopSeg;
+
+	if (stopSegNo < startSegNo)
+	{
+		log_error("Failed to fetch WAL files %s to %s",
+				  stop->startWalFile, stopWalFile);
+		return false;
+	}
+
+	sformat(walDir, sizeof(walDir), "%s/pg_wal/archive_status", backupDir);
+
+	if (pg_mkdir_p(walDir, 0700) == -1)
+	{
+		log_error("Failed to create directory \"%s\": %m", walDir);
+		return false;
+	}
+
+	log_info("Fetching WAL files %s to %s", stop->startWalFile, stopWalFile);
+
+	int count = (int) (stopSegNo - startSegNo + 1);
+
+	CloneFile *walFiles = (CloneFile *) calloc(count, sizeof(CloneFile));
+	CloneFetch *fetches = (CloneFetch *) calloc(count, sizeof(CloneFetch));
+	char (*walPaths)[MAXPGPATH] = calloc(count, MAXPGPATH);
+
+	if (walFiles == NULL || fetches == NULL || walPaths == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(walFiles);
+		free(fetches);
+		free(walPaths);
+		return false;
+	}
+
+	CloneProgress progress = { 0 };
+	CloneQueue queue = {
+		.fetches = fetches,
+		.count = count,
+		.progress = &progress
+	};
+
+	for (int i = 0; i < count; i++)
+	{
+		uint64_t segNo = startSegNo + i;
+
+		sformat(walPaths[i], MAXPGPATH, "pg_wal/%08X%08X%08X",
+				startTLI,
+				(uint32_t) (segNo / segmentsPerLog),
+				(uint32_t) (segNo % segmentsPerLog));
+
+		walFiles[i].path = walPaths[i];
+		walFiles[i].size = info->walSegmentSize;
+
+		fetches[i].file = &(walFiles[i]);
+		fetches[i].fd = -1;
+
+		sformat(fetches[i].localPath, MAXPGPATH, "%s/%s",
+				backupDir, walPaths[i]);
+	}
+
+	bool success = pgclone_fetch_files(pgsql, streams, &queue);
+
+	for (int i = 0; success && i < count; i++)
+	{
+		if (!walFiles[i].inBackup ||
+			walFiles[i].backupSize != info->walSegmentSize)
+		{
+			log_error("Failed to fetch WAL file \"%s\": it has been removed "
+					  "from the upstream node already", walFiles[i].path);
+			success = false;
+		}
+	}
+
+	free(walFiles);
+	free(fetches);
+	free(walPaths);
+
+	return success;
+}
+
+
+/*
+ * pgclone_write_manifest writes a backup_manifest file for the files that
+ * we have in the backup directory, in the format of pg_basebackup, so that
+ * pg_verifybackup can check the backup. We don't compute file checksums:
+ * that would mean reading all the files again.
+ *
+ * The WAL files are not listed in the manifest, pg_verifybackup checks them
+ * using the WAL-Ranges instead.
+ */
+static bool
+pgclone_write_manifest(const char *backupDir, CloneFileArray *files,
+					   BackupStopContext *stop)
+{
+	char filename[MAXPGPATH] = { 0 };
+	uint8_t checksum[PG_SHA256_DIGEST_LENGTH] = { 0 };
+	bool first = true;
+
+	sformat(filename, sizeof(filename), "%s/backup_manifest", backupDir);
+
+	PQExpBuffer manifest = createPQExpBuffer();
+
+	if (manifest == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	appendPQExpBufferStr(manifest,
+						 "{ \"PostgreSQL-Backup-Manifest-Version\": 1,\n"
+						 "\"Files\": [");
+
+	(void) pgclone_manifest_add_file(manifest, &first, "backup_label",
+									 strlen(stop->labelfile), time(NULL));
+
+	for (int i = 0; i < files->count; i++)
+	{
+		CloneFile *file = &(files->array[i]);
+
+		if (file->isdir || !file->inBackup ||
+			strncmp(file->path, "pg_wal/", 7) == 0)
+		{
+			continue;
+		}
+
+		(void) pgclone_manifest_add_file(manifest, &first,
+										 file->path,
+										 file->backupSize,
+										 file->mtime);
+	}
+
+	appendPQExpBuffer(manifest,
+					  "\n],\n"
+					  "\"WAL-Ranges\": [\n"
+					  "{ \"Timeline\": %u, \"Start-LSN\": \"%s\", "
+					  "\"End-LSN\": \"%s\" }\n"
+					  "],\n",
+					  stop->timeline,
+					  stop->startLSN,
+					  stop->lsn);
+
+	/* the checksum covers everything up to the Manifest-Checksum line */
+	pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+
+	if (ctx == NULL ||
+		pg_cryptohash_init(ctx) < 0 ||
+		pg_cryptohash_update(ctx,
+							 (uint8_t *) manifest->data,
+							 manifest->len) < 0 ||
+		pg_cryptohash_final(ctx, checksum, sizeof(checksum)) < 0)
+	{
+		log_error("Failed to compute the backup manifest checksum");
+		pg_cryptohash_free(ctx);
+		destroyPQExpBuffer(manifest);
+		return false;
+	}
+
+	pg_cryptohash_free(ctx);
+
+	appendPQExpBufferStr(manifest, "\"Manifest-Checksum\": \"");
+
+	for (int i = 0; i < PG_SHA256_DIGEST_LENGTH; i++)
+	{
+		appendPQExpBuffer(manifest, "%02x", checksum[i]);
+	}
+
+	appendPQExpBufferStr(manifest, "\"}\n");
+
+	if (PQExpBufferBroken(manifest))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		destroyPQExpBuffer(manifest);
+		return false;
+	}
+
+	bool success = write_file(manifest->data, manifest->len, filename);
+
+	destroyPQExpBuffer(manifest);
+
+	return success;
+}
+
+
+/*
+ * pgclone_manifest_add_file adds a file entry to the backup manifest. Paths
+ * are escaped as JSON strings.
+ */
+static void
+pgclone_manifest_add_file(PQExpBuffer manifest, bool *first,
+						  const char *path, int64_t size, int64_t mtime)
+{
+	char lastModified[BUFSIZE] = { 0 };
+	time_t modified = (time_t) mtime;
+	struct tm tm = { 0 };
+
+	(void) gmtime_r(&modified, &tm);
+	(void) strftime(lastModified, sizeof(lastModified),
+					"%Y-%m-%d %H:%M:%S GMT", &tm);
+
+	appendPQExpBuffer(manifest, "%s{ \"Path\": \"", *first ? "\n" : ",\n");
+
+	for (const char *c = path; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			appendPQExpBuffer(manifest, "\\%c", *c);
+		}
+		else if ((unsigned char) *c < 0x20)
+		{
+			appendPQExpBuffer(manifest, "\\u%04x", (unsigned char) *c);
+		}
+		else
+		{
+			appendPQExpBufferChar(manifest, *c);
+		}
+	}
+
+	appendPQExpBuffer(manifest,
+					  "\", \"Size\": %" PRId64 ", \"Last-Modified\": \"%s\" }",
+					  size,
+					  lastModified);
+
+	*first = false;
+}
+
+
+/*
+ * pgclone_verify_backup checks that the files in the backup directory have
+ * the size we expect, and then runs pg_verifybackup, which also checks that
+ * the WAL needed to restore the backup has been fetched.
+ */
+static bool
+pgclone_verify_backup(const char *backupDir, const char *pg_ctl,
+					  CloneFileArray *files)
+{
+	for (int i = 0; i < files->count; i++)
+	{
+		CloneFile *file = &(files->array[i]);
+		char localPath[MAXPGPATH] = { 0 };
+		struct stat st;
+
+		if (file->isdir || !file->inBackup)
+		{
+			continue;
+		}
+
+		sformat(localPath, sizeof(localPath), "%s/%s", backupDir, file->path);
+
+		if (stat(localPath, &st) != 0)
+		{
+			log_error("Failed to get file information for \"%s\": %m",
+					  localPath);
+			return false;
+		}
+
+		if (st.st_size != file->backupSize)
+		{
+			log_error("File \"%s\" has size %lld, expected %" PRId64,
+					  localPath, (long long) st.st_size, file->backupSize);
+			return false;
+		}
+	}
+
+	return pg_verifybackup(pg_ctl, backupDir);
+}
+
+
+/*
+ * parseUpstreamInfo parses the result of pgclone_get_upstream_info.
+ */
+static void
+parseUpstreamInfo(void *ctx, PGresult *result)
+{
+	UpstreamInfo *info = (UpstreamInfo *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 4)
+	{
+		log_error("Query returned %d rows of %d columns, expected 1 row "
+				  "of 4 columns", PQntuples(result), PQnfields(result));
+		info->parsedOk = false;
+		return;
+	}
+
+	info->parsedOk =
+		pgresult_get_bool(result, 0, 0, &(info->inRecovery)) &&
+		pgresult_get_int64(result, 0, 1, &(info->now)) &&
+		pgresult_get_int(result, 0, 2, &(info->version)) &&
+		pgresult_get_int(result, 0, 3, &(info->walSegmentSize));
+}
+
+
+/*
+ * parseBackupStop parses the result of pg_backup_stop().
+ */
+static void
+parseBackupStop(void *ctx, PGresult *result)
+{
+	BackupStopContext *context = (BackupStopContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2 ||
+		PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	{
+		log_error("Query returned an unexpected result for pg_backup_stop()");
+		context->parsedOk = false;
+		return;
+	}
+
+	strlcpy(context->lsn, PQgetvalue(result, 0, 0), sizeof(context->lsn));
+
+	context->labelfile = strdup(PQgetvalue(result, 0, 1));
+
+	if (context->labelfile == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		context->parsedOk = false;
+		return;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * parseCloneFiles parses the list of files of the upstream node, and skips
+ * the files that we don't copy.
+ */
+static void
+parseCloneFiles(void *ctx, PGresult *result)
+{
+	CloneFileArray *files = (CloneFileArray *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 5)
+	{
+		log_error("Query returned %d columns, expected 5", PQnfields(result));
+		files->parsedOk = false;
+		return;
+	}
+
+	files->array = (CloneFile *) calloc(nTuples + 1, sizeof(CloneFile));
+
+	if (files->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		files->parsedOk = false;
+		return;
+	}
+
+	files->capacity = nTuples + 1;
+
+	for (int row = 0; row < nTuples; row++)
+	{
+		CloneFile *file = &(files->array[files->count]);
+		char *path = PQgetvalue(result, row, 0);
+
+		if (pgclone_skip_path(path))
+		{
+			continue;
+		}
+
+		if (!pgresult_get_int64(result, row, 1, &(file->size)) ||
+			!pgresult_get_int64(result, row, 2, &(file->mtime)) ||
+			!pgresult_get_bool(result, row, 3, &(file->isdir)))
+		{
+			log_error("Failed to parse the file information for \"%s\"", path);
+			files->parsedOk = false;
+			return;
+		}
+
+		file->path = strdup(path);
+
+		if (file->path == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			files->parsedOk = false;
+			return;
+		}
+
+		/* in-place tablespaces (allow_in_place_tablespaces) are directories */
+		if (!PQgetisnull(result, row, 4) &&
+			PQgetvalue(result, row, 4)[0] == '/')
+		{
+			file->linkTarget = strdup(PQgetvalue(result, row, 4));
+
+			if (file->linkTarget == NULL)
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				files->parsedOk = false;
+				return;
+			}
+		}
+
+		++files->count;
+	}
+
+	files->parsedOk = true;
+}
+
+
+/*
+ * parseFileChunk writes a chunk of the file fetched with pg_read_binary_file
+ * to the local file.
+ */
+static void
+parseFileChunk(void *ctx, PGresult *result)
+{
+	FileChunkContext *context = (FileChunkContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 1)
+	{
+		log_error("Query returned %d rows of %d columns, expected 1 row "
+				  "of 1 column", PQntuples(result), PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0))
+	{
+		context->isNull = true;
+		context->parsedOk = true;
+		return;
+	}
+
+	const char *data = PQgetvalue(result, 0, 0);
+	int length = PQgetlength(result, 0, 0);
+	int written = 0;
+
+	while (written < length)
+	{
+		ssize_t bytes = write(context->fd, data + written, length - written);
+
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to write file \"%s\": %m", context->filename);
+			context->parsedOk = false;
+			return;
+		}
+
+		written += bytes;
+	}
+
+	context->length = length;
+	context->parsedOk = true;
+}
+
+
+/*
+ * parseCloneChunk writes a chunk fetched by one of the clone streams at its
+ * offset in the local file, and completes the file once all of its chunks
+ * have been fetched.
+ */
+static void
+parseCloneChunk(void *ctx, PGresult *result)
+{
+	CloneChunk *chunk = (CloneChunk *) ctx;
+	CloneFetch *fetch = chunk->fetch;
+	CloneQueue *queue = chunk->queue;
+	CloneProgress *progress = queue->progress;
+
+	--fetch->pendingChunks;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 1)
+	{
+		log_error("Query returned %d rows of %d columns, expected 1 row "
+				  "of 1 column", PQntuples(result), PQnfields(result));
+		queue->failed = true;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0))
+	{
+		fetch->vanished = true;
+	}
+	else
+	{
+		const char *data = PQgetvalue(result, 0, 0);
+		int length = PQgetlength(result, 0, 0);
+		int written = 0;
+
+		while (written < length)
+		{
+			ssize_t bytes = pwrite(fetch->fd,
+								   data + written,
+								   length - written,
+								   chunk->offset + written);
+
+			if (bytes < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				log_error("Failed to write file \"%s\": %m", fetch->localPath);
+				queue->failed = true;
+				return;
+			}
+
+			written += bytes;
+		}
+
+		fetch->fetchedBytes += length;
+		progress->copiedBytes += length;
+
+		/* the file might have been truncated since we listed it */
+		if (length > 0 && chunk->offset + length > fetch->endOffset)
+		{
+			fetch->endOffset = chunk->offset + length;
+		}
+	}
+
+	progress->doneBytes += chunk->length;
+
+	/* the WAL files are not part of the progress report */
+	if (progress->totalBytes > 0)
+	{
+		(void) pg_call_progress_hook("basebackup",
+									 progress->doneBytes,
+									 progress->totalBytes);
+	}
+
+	if (fetch->pendingChunks == 0 &&
+		fetch->scheduledBytes >= fetch->file->size &&
+		!pgclone_fetch_done(queue, fetch))
+	{
+		queue->failed = true;
+	}
+}
+
+
+/*
+ * cloneFileCmp sorts the upstream files by path, in the C collation.
+ */
+static int
+cloneFileCmp(const void *a, const void *b)
+{
+	return strcmp(((CloneFile *) a)->path, ((CloneFile *) b)->path);
+}
+
+
+/*
+ * copiedFileCmp sorts the copied files by path, in the C collation.
+ */
+static int
+copiedFileCmp(const void *a, const void *b)
+{
+	return strcmp(((CopiedFile *) a)->path, ((CopiedFile *) b)->path);
+}
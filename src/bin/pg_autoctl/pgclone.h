@@ -0,0 +1,28 @@
+/*
+ * src/bin/pg_autoctl/pgclone.h
+ *     Clone a standby node over several SQL connections, and resume the
+ *     clone when it has been interrupted.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PGCLONE_H
+#define PGCLONE_H
+
+#include <stdbool.h>
+
+#include "pgsql.h"
+
+/* maximum number of connections that replication.clone_streams can use */
+#define PGCLONE_STREAMS_MAX PGSQL_PARALLEL_MAX_QUERIES
+
+bool pgclone_exists(const char *backupDir);
+bool pgclone_start(ReplicationSource *upstream, PGSQL *pgsql, bool *canCopy);
+bool pgclone_can_resume(ReplicationSource *upstream, PGSQL *pgsql);
+bool pgclone_copy(ReplicationSource *upstream, PGSQL *pgsql,
+				  const char *pgdata, const char *pg_ctl);
+bool pgclone_done(ReplicationSource *upstream);
+
+#endif /* PGCLONE_H */
@@ -0,0 +1,289 @@
+/*
+ * src/bin/pg_autoctl/pgcontrol.c
+ *     Read the Postgres control file directly, without running
+ *     pg_controldata.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "file_utils.h"
+#include "log.h"
+#include "pgcontrol.h"
+#include "pgsetup.h"
+#include "string_utils.h"
+
+/*
+ * The ControlFileData struct from postgres:src/include/catalog/pg_control.h
+ * starts with the same fields in all the supported Postgres versions:
+ *
+ *   uint64     system_identifier;      offset 0
+ *   uint32     pg_control_version;     offset 8
+ *   uint32     catalog_version_no;     offset 12
+ *   DBState    state;                  offset 16
+ *   pg_time_t  time;                   offset 24
+ *   XLogRecPtr checkPoint;             offset 32
+ *
+ * Postgres 10 then has an XLogRecPtr prevCheckPoint field, that has been
+ * removed in Postgres 11, before the CheckPoint checkPointCopy field, which
+ * itself starts with XLogRecPtr redo and TimeLineID ThisTimeLineID.
+ */
+#define PG_CONTROL_OFFSET_SYSTEM_IDENTIFIER 0
+#define PG_CONTROL_OFFSET_CONTROL_VERSION 8
+#define PG_CONTROL_OFFSET_CATALOG_VERSION 12
+#define PG_CONTROL_OFFSET_STATE 16
+#define PG_CONTROL_OFFSET_CHECKPOINT 32
+#define PG_CONTROL_OFFSET_TIMELINE_PG10 56
+#define PG_CONTROL_OFFSET_TIMELINE 48
+
+/* PG_CONTROL_VERSION of Postgres 10, 11, 12 and 13 to 15 */
+#define PG_CONTROL_VERSION_10 1002
+#define PG_CONTROL_VERSION_11 1100
+#define PG_CONTROL_VERSION_12 1201
+#define PG_CONTROL_VERSION_13 1300
+
+/*
+ * The whole ControlFileData struct is smaller than that in all the supported
+ * versions, the rest of the file being zero padding.
+ */
+#define PG_CONTROL_MAX_DATA_SIZE 512
+
+static bool pg_control_read_buffer(const char *path, char *buffer, int size);
+static bool pg_control_check_crc(const char *buffer, int size);
+static uint32_t pg_crc32c(const char *data, size_t len);
+
+
+/*
+ * pg_control_read_file reads the $PGDATA/global/pg_control file and fills in
+ * the given PostgresControlData structure, as pg_controldata would.
+ *
+ * Postgres writes its control file in place, so we might read it while it is
+ * being written to. In that case the CRC check fails, and we read the file
+ * again once.
+ *
+ * The function returns false when the file can't be read or when its contents
+ * can't be trusted, including when the pg_control_version is not one that we
+ * know about: the caller then runs pg_controldata instead.
+ */
+bool
+pg_control_read_file(const char *pgdata, PostgresControlData *control)
+{
+	char path[MAXPGPATH] = { 0 };
+	char buffer[PG_CONTROL_FILE_SIZE] = { 0 };
+
+	join_path_components(path, pgdata, "global/pg_control");
+
+	bool crcIsValid = false;
+
+	for (int attempt = 0; attempt < 2 && !crcIsValid; attempt++)
+	{
+		if (!pg_control_read_buffer(path, buffer, sizeof(buffer)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		crcIsValid = pg_control_check_crc(buffer, sizeof(buffer));
+	}
+
+	if (!crcIsValid)
+	{
+		log_debug("Failed to validate the CRC of \"%s\"", path);
+		return false;
+	}
+
+	uint32_t pg_control_version = 0;
+
+	memcpy(&pg_control_version,
+		   buffer + PG_CONTROL_OFFSET_CONTROL_VERSION,
+		   sizeof(uint32_t));
+
+	int timelineOffset = 0;
+
+	switch (pg_control_version)
+	{
+		case PG_CONTROL_VERSION_10:
+		{
+			timelineOffset = PG_CONTROL_OFFSET_TIMELINE_PG10;
+			break;
+		}
+
+		case PG_CONTROL_VERSION_11:
+		case PG_CONTROL_VERSION_12:
+		case PG_CONTROL_VERSION_13:
+		{
+			timelineOffset = PG_CONTROL_OFFSET_TIMELINE;
+			break;
+		}
+
+		default:
+		{
+			log_debug("Unknown pg_control version %u in \"%s\"",
+					  pg_control_version, path);
+			return false;
+		}
+	}
+
+	int32_t state = 0;
+	uint64_t checkPoint = 0;
+
+	memcpy(&(control->system_identifier),
+		   buffer + PG_CONTROL_OFFSET_SYSTEM_IDENTIFIER,
+		   sizeof(uint64_t));
+
+	memcpy(&(control->catalog_version_no),
+		   buffer + PG_CONTROL_OFFSET_CATALOG_VERSION,
+		   sizeof(uint32_t));
+
+	memcpy(&state, buffer + PG_CONTROL_OFFSET_STATE, sizeof(int32_t));
+	memcpy(&checkPoint, buffer + PG_CONTROL_OFFSET_CHECKPOINT, sizeof(uint64_t));
+
+	memcpy(&(control->timeline_id), buffer + timelineOffset, sizeof(uint32_t));
+
+	if (state < DB_STARTUP || state > DB_IN_PRODUCTION)
+	{
+		log_debug("Unknown database cluster state %d in \"%s\"", state, path);
+		return false;
+	}
+
+	control->pg_control_version = pg_control_version;
+	control->state = (DBState) state;
+
+	/* pg_controldata uses upper case hexadecimal digits for LSNs */
+	sformat(control->latestCheckpointLSN, PG_LSN_MAXLENGTH, "%X/%X",
+			(uint32_t) (checkPoint >> 32), (uint32_t) checkPoint);
+
+	return true;
+}
+
+
+/*
+ * pg_control_read_buffer reads the control file at the given path in the
+ * given buffer.
+ */
+static bool
+pg_control_read_buffer(const char *path, char *buffer, int size)
+{
+	int fd = open(path, O_RDONLY, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to open file \"%s\": %m", path);
+		return false;
+	}
+
+	int bytes = 0;
+
+	while (bytes < size)
+	{
+		ssize_t r = read(fd, buffer + bytes, size - bytes);
+
+		if (r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (r <= 0)
+		{
+			break;
+		}
+
+		bytes += r;
+	}
+
+	close(fd);
+
+	if (bytes != size)
+	{
+		log_debug("Failed to read %d bytes from file \"%s\": %m", size, path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_control_check_crc returns true when the CRC of the control data matches
+ * the contents of the buffer.
+ *
+ * The crc field is the last one of the ControlFileData struct, and its offset
+ * changes with the Postgres major version. The struct is followed by zero
+ * bytes up to the end of the file, so the CRC is found in the last 4-bytes
+ * aligned word that is not zero. A CRC of zero, or a struct that is misplaced
+ * in the buffer, fails the check and the caller falls back to pg_controldata.
+ */
+static bool
+pg_control_check_crc(const char *buffer, int size)
+{
+	int last = size - 1;
+
+	while (last >= 0 && buffer[last] == 0)
+	{
+		--last;
+	}
+
+	int crcOffset = last - (last % sizeof(uint32_t));
+
+	if (crcOffset < PG_CONTROL_OFFSET_TIMELINE ||
+		crcOffset + sizeof(uint32_t) > PG_CONTROL_MAX_DATA_SIZE)
+	{
+		return false;
+	}
+
+	uint32_t crc = 0;
+
+	memcpy(&crc, buffer + crcOffset, sizeof(uint32_t));
+
+	return pg_crc32c(buffer, crcOffset) == crc;
+}
+
+
+/*
+ * pg_crc32c computes a CRC-32C (Castagnoli) checksum, just like the
+ * INIT_CRC32C, COMP_CRC32C and FIN_CRC32C macros do in Postgres. We only
+ * compute a few hundred bytes at a time, so a simple table-driven
+ * implementation is good enough.
+ */
+static uint32_t
+pg_crc32c(const char *data, size_t len)
+{
+	static uint32_t table[256] = { 0 };
+	static bool tableIsReady = false;
+
+	if (!tableIsReady)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t crc = i;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+			}
+
+			table[i] = crc;
+		}
+
+		tableIsReady = true;
+	}
+
+	uint32_t crc = 0xFFFFFFFF;
+	const unsigned char *p = (const unsigned char *) data;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc ^ 0xFFFFFFFF;
+}
@@ -0,0 +1,23 @@
+/*
+ * src/bin/pg_autoctl/pgcontrol.h
+ *     Read the Postgres control file directly, without running
+ *     pg_controldata.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PGCONTROL_H
+#define PGCONTROL_H
+
+#include <stdbool.h>
+
+#include "pgsetup.h"
+
+/* From postgres:src/include/catalog/pg_control.h */
+#define PG_CONTROL_FILE_SIZE 8192
+
+bool pg_control_read_file(const char *pgdata, PostgresControlData *control);
+
+#endif /* PGCONTROL_H */
@@ -10,6 +10,7 @@
 
 #include <dirent.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -24,12 +25,17 @@
 #include "file_utils.h"
 #include "log.h"
 #include "parsing.h"
+#include "pgcontrol.h"
 #include "pgctl.h"
 #include "pgsql.h"
 #include "pgsetup.h"
+#include "pgtoolchain.h"
 #include "pgtuning.h"
 #include "signals.h"
+#include "ssl_utils.h"
 #include "string_utils.h"
+#include "trace.h"
+#include "walprefetch.h"
 
 #define RUN_PROGRAM_IMPLEMENTATION
 #include "runprogram.h"
@@ -39,6 +45,10 @@
 
 #define AUTOCTL_CONF_INCLUDE_LINE "include '" AUTOCTL_DEFAULTS_CONF_FILENAME "'"
 #define AUTOCTL_SB_CONF_INCLUDE_LINE "include '" AUTOCTL_STANDBY_CONF_FILENAME "'"
+#define AUTOCTL_ROLE_CONF_INCLUDE_LINE "include '" AUTOCTL_ROLE_CONF_FILENAME "'"
+
+/* we display only the last lines of Postgres logs, the most recent ones */
+#define PG_LOG_STARTUP_MAX_LINES BUFSIZE
 
 static bool pg_include_config(const char *configFilePath,
 							  const char *configIncludeLine,
@@ -47,7 +57,13 @@ static bool ensure_default_settings_file_exists(const char *configFilePath,
 												GUC *settings,
 												PostgresSetup *pgSetup,
 												const char *hostname,
-												bool includeTuning);
+												bool includeTuning,
+												char *changedSettings,
+												size_t size);
+static void pg_conf_changed_settings(const char *currentContents,
+									 const char *newContents,
+									 char *changedSettings, size_t size);
+static bool pg_conf_setting_name(const char *line, char *name, size_t size);
 static bool prepare_guc_settings_from_pgsetup(const char *configFilePath,
 											  PQExpBuffer config,
 											  GUC *settings,
@@ -55,12 +71,15 @@ static bool prepare_guc_settings_from_pgsetup(const char *configFilePath,
 											  const char *hostname,
 											  bool includeTuning);
 static void log_program_output(Program prog, int outLogLevel, int errorLogLevel);
+static void processProgressCallback(const char *buffer, bool error);
+static int pg_ctl_status_from_pidfile(const char *pgdata, pid_t *pid);
 
 
 static bool prepare_recovery_settings(const char *pgdata,
 									  ReplicationSource *replicationSource,
 									  char *primaryConnInfo,
 									  char *primarySlotName,
+									  char *restoreCommand,
 									  char *targetLSN,
 									  char *targetAction,
 									  char *targetTimeline);
@@ -83,18 +102,41 @@ static bool pg_write_recovery_conf(const char *pgdata,
 								   ReplicationSource *replicationSource);
 static bool pg_write_standby_signal(const char *pgdata,
 									ReplicationSource *replicationSource);
-static bool ensure_empty_tablespace_dirs(const char *pgdata);
+static bool pg_config_get_dir(const char *pg_config, const char *option,
+							  char *dir, size_t size);
+
+/*
+ * The progress hook is installed by the keeper around the pg_basebackup and
+ * pg_rewind operations, and parses their --progress output.
+ */
+static PgProgressHook progressHook = NULL;
+static void *progressHookContext = NULL;
+static const char *progressOperation = NULL;
+
 
 /*
  * Get pg_ctl --version output in pgSetup->pg_version.
+ *
+ * The version string is cached in our toolchain cache file, so that we only
+ * run pg_ctl --version again when the pg_ctl binary has changed.
  */
 bool
 pg_ctl_version(PostgresSetup *pgSetup)
 {
-	Program prog = run_program(pgSetup->pg_ctl, "--version", NULL);
 	char pg_version_string[PG_VERSION_STRING_MAX] = { 0 };
 	int pg_version = 0;
 
+	if (pg_toolchain_cache_lookup(pgSetup->pg_ctl, "--version",
+								  pg_version_string,
+								  sizeof(pg_version_string)))
+	{
+		strlcpy(pgSetup->pg_version, pg_version_string, PG_VERSION_STRING_MAX);
+
+		return true;
+	}
+
+	Program prog = run_program(pgSetup->pg_ctl, "--version", NULL);
+
 	if (prog.returnCode != 0)
 	{
 		errno = prog.error;
@@ -117,54 +159,87 @@ pg_ctl_version(PostgresSetup *pgSetup)
 
 	strlcpy(pgSetup->pg_version, pg_version_string, PG_VERSION_STRING_MAX);
 
+	pg_toolchain_cache_store(pgSetup->pg_ctl, "--version", pg_version_string);
+
 	return true;
 }
 
 
 /*
- * set_pg_ctl_from_PG_CONFIG sets given pgSetup->pg_ctl to the pg_ctl binary
- * installed in the bindir of the target Postgres installation:
- *
- *  $(${PG_CONFIG} --bindir)/pg_ctl
+ * pg_config_get_dir runs pg_config with the given option, such as --bindir or
+ * --sharedir, and copies the directory it outputs to the given buffer. The
+ * result is cached in our toolchain cache file, so that we only run this
+ * pg_config command again when the pg_config binary has changed.
  */
-bool
-set_pg_ctl_from_config_bindir(PostgresSetup *pgSetup, const char *pg_config)
+static bool
+pg_config_get_dir(const char *pg_config, const char *option,
+				  char *dir, size_t size)
 {
-	char pg_ctl[MAXPGPATH] = { 0 };
-
-	if (!file_exists(pg_config))
+	if (pg_toolchain_cache_lookup(pg_config, option, dir, size))
 	{
-		log_debug("set_pg_ctl_from_config_bindir: file not found: \"%s\"",
-				  pg_config);
-		return false;
+		return true;
 	}
 
-	Program prog = run_program(pg_config, "--bindir", NULL);
+	Program prog = run_program(pg_config, option, NULL);
 
 	char *lines[1];
 
 	if (prog.returnCode != 0)
 	{
 		errno = prog.error;
-		log_error("Failed to run \"pg_config --bindir\" using program \"%s\": %m",
+		(void) log_program_output(prog, LOG_INFO, LOG_ERROR);
+		log_error("Failed to run \"pg_config %s\" using program \"%s\": %m",
+				  option,
 				  pg_config);
 		free_program(&prog);
 		return false;
 	}
 
-	if (splitLines(prog.stdOut, lines, 1) != 1)
+	if (prog.stdOut == NULL || splitLines(prog.stdOut, lines, 1) != 1)
 	{
-		log_error("Unable to parse output from pg_config --bindir");
+		log_error("Unable to parse output from pg_config %s", option);
 		free_program(&prog);
 		return false;
 	}
 
-	char *bindir = lines[0];
-	join_path_components(pg_ctl, bindir, "pg_ctl");
+	strlcpy(dir, lines[0], size);
 
 	/* we're now done with the Program and its output */
 	free_program(&prog);
 
+	pg_toolchain_cache_store(pg_config, option, dir);
+
+	return true;
+}
+
+
+/*
+ * set_pg_ctl_from_PG_CONFIG sets given pgSetup->pg_ctl to the pg_ctl binary
+ * installed in the bindir of the target Postgres installation:
+ *
+ *  $(${PG_CONFIG} --bindir)/pg_ctl
+ */
+bool
+set_pg_ctl_from_config_bindir(PostgresSetup *pgSetup, const char *pg_config)
+{
+	char pg_ctl[MAXPGPATH] = { 0 };
+	char bindir[MAXPGPATH] = { 0 };
+
+	if (!file_exists(pg_config))
+	{
+		log_debug("set_pg_ctl_from_config_bindir: file not found: \"%s\"",
+				  pg_config);
+		return false;
+	}
+
+	if (!pg_config_get_dir(pg_config, "--bindir", bindir, sizeof(bindir)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	join_path_components(pg_ctl, bindir, "pg_ctl");
+
 	if (!file_exists(pg_ctl))
 	{
 		log_error("Failed to find pg_ctl at \"%s\" from PG_CONFIG at \"%s\"",
@@ -180,7 +255,9 @@ set_pg_ctl_from_config_bindir(PostgresSetup *pgSetup, const char *pg_config)
 
 
 /*
- * Read some of the information from pg_controldata output.
+ * Read some of the information from the Postgres control file. We read the
+ * file directly when we know its format, and otherwise parse the output of
+ * the pg_controldata program.
  */
 bool
 pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
@@ -207,6 +284,11 @@ pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
 		return false;
 	}
 
+	if (pg_control_read_file(pgSetup->pgdata, &(pgSetup->control)))
+	{
+		return true;
+	}
+
 	/* now find the pg_controldata binary */
 	path_in_same_directory(pgSetup->pg_ctl, "pg_controldata", pg_controldata_path);
 	log_debug("%s %s", pg_controldata_path, pgSetup->pgdata);
@@ -672,9 +754,8 @@ find_extension_control_file(const char *pg_ctl, const char *extName)
 {
 	char pg_config_path[MAXPGPATH] = { 0 };
 	char extension_path[MAXPGPATH] = { 0 };
-	char *share_dir;
+	char share_dir[MAXPGPATH] = { 0 };
 	char extension_control_file_name[MAXPGPATH] = { 0 };
-	char *lines[1];
 
 	log_debug("Checking if the %s extension is installed", extName);
 
@@ -684,44 +765,24 @@ find_extension_control_file(const char *pg_ctl, const char *extName)
 		return false;
 	}
 
-	Program prog = run_program(pg_config_path, "--sharedir", NULL);
-
-	if (prog.returnCode == 0)
+	if (!pg_config_get_dir(pg_config_path, "--sharedir",
+						   share_dir, sizeof(share_dir)))
 	{
-		if (!prog.stdOut)
-		{
-			log_error("Got empty output from pg_config --sharedir");
-			free_program(&prog);
-			return false;
-		}
-		if (splitLines(prog.stdOut, lines, 1) != 1)
-		{
-			log_error("Unable to parse output from pg_config --sharedir");
-			free_program(&prog);
-			return false;
-		}
-		share_dir = lines[0];
-
-		join_path_components(extension_path, share_dir, "extension");
-		sformat(extension_control_file_name, MAXPGPATH, "%s.control", extName);
-		join_path_components(extension_path, extension_path, extension_control_file_name);
-		if (!file_exists(extension_path))
-		{
-			log_error("Failed to find extension control file \"%s\"",
-					  extension_path);
-			free_program(&prog);
-			return false;
-		}
+		/* errors have already been logged */
+		return false;
 	}
-	else
+
+	join_path_components(extension_path, share_dir, "extension");
+	sformat(extension_control_file_name, MAXPGPATH, "%s.control", extName);
+	join_path_components(extension_path, extension_path, extension_control_file_name);
+
+	if (!file_exists(extension_path))
 	{
-		(void) log_program_output(prog, LOG_INFO, LOG_ERROR);
-		log_error("Failed to run \"%s\", see above for details",
-				  pg_config_path);
-		free_program(&prog);
+		log_error("Failed to find extension control file \"%s\"",
+				  extension_path);
 		return false;
 	}
-	free_program(&prog);
+
 	return true;
 }
 
@@ -730,12 +791,18 @@ find_extension_control_file(const char *pg_ctl, const char *extName)
  * pg_add_auto_failover_default_settings ensures the pg_auto_failover default
  * settings are included in postgresql.conf. For simplicity, this function
  * reads the whole contents of postgresql.conf into memory.
+ *
+ * When changedSettings is not NULL, the names of the settings that we have
+ * changed are copied there, separated by commas, or an empty string when
+ * the file was up to date already.
  */
 bool
 pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 									  const char *hostname,
 									  const char *configFilePath,
-									  GUC *settings)
+									  GUC *settings,
+									  char *changedSettings,
+									  size_t size)
 {
 	bool includeTuning = true;
 	char pgAutoFailoverDefaultsConfigPath[MAXPGPATH];
@@ -754,7 +821,9 @@ pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 											 settings,
 											 pgSetup,
 											 hostname,
-											 includeTuning))
+											 includeTuning,
+											 changedSettings,
+											 size))
 	{
 		return false;
 	}
@@ -765,6 +834,47 @@ pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 }
 
 
+/*
+ * pg_add_auto_failover_role_settings writes the settings that depend on the
+ * role of the node, primary or standby, to postgresql-auto-failover-role.conf
+ * and ensures that file is included in postgresql.conf. The file is written
+ * again at each role change, so that the settings of the previous role are
+ * removed.
+ *
+ * When changedSettings is not NULL, the names of the settings that we have
+ * changed are copied there, see ensure_default_settings_file_exists.
+ */
+bool
+pg_add_auto_failover_role_settings(const char *pgdata,
+								   GUC *settings,
+								   char *changedSettings,
+								   size_t size)
+{
+	bool includeTuning = false;
+	char configFilePath[MAXPGPATH] = { 0 };
+	char roleConfigFilePath[MAXPGPATH] = { 0 };
+
+	join_path_components(configFilePath, pgdata, "postgresql.conf");
+	join_path_components(roleConfigFilePath, pgdata, AUTOCTL_ROLE_CONF_FILENAME);
+
+	/* we pass NULL as pgSetup because we know it won't be used... */
+	if (!ensure_default_settings_file_exists(roleConfigFilePath,
+											 settings,
+											 NULL,
+											 NULL,
+											 includeTuning,
+											 changedSettings,
+											 size))
+	{
+		return false;
+	}
+
+	return pg_include_config(configFilePath,
+							 AUTOCTL_ROLE_CONF_INCLUDE_LINE,
+							 AUTOCTL_CONF_INCLUDE_COMMENT);
+}
+
+
 /*
  * pg_auto_failover_default_settings_file_exists returns true when our expected
  * postgresql-auto-failover.conf file exists in PGDATA.
@@ -796,6 +906,47 @@ pg_auto_failover_default_settings_file_exists(PostgresSetup *pgSetup)
 }
 
 
+/*
+ * pg_auto_conf_has_primary_conninfo returns true when the postgresql.auto.conf
+ * file of the given pgdata sets primary_conninfo or primary_slot_name, which
+ * pg_basebackup --write-recovery-conf did before pg_auto_failover 1.3.
+ */
+bool
+pg_auto_conf_has_primary_conninfo(const char *pgdata)
+{
+	char autoConfPath[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long size = 0L;
+	char *lines[BUFSIZE] = { 0 };
+	bool found = false;
+
+	join_path_components(autoConfPath, pgdata, "postgresql.auto.conf");
+
+	if (!file_exists(autoConfPath) ||
+		!read_file(autoConfPath, &contents, &size))
+	{
+		return false;
+	}
+
+	int lineCount = splitLines(contents, lines, BUFSIZE);
+
+	for (int i = 0; !found && i < lineCount; i++)
+	{
+		char name[NAMEDATALEN] = { 0 };
+
+		if (pg_conf_setting_name(lines[i], name, sizeof(name)))
+		{
+			found = strcmp(name, "primary_conninfo") == 0 ||
+					strcmp(name, "primary_slot_name") == 0;
+		}
+	}
+
+	free(contents);
+
+	return found;
+}
+
+
 /*
  * pg_include_config adds an include line to postgresql.conf to include the
  * given configuration file, with a comment refering pg_auto_failover.
@@ -868,14 +1019,18 @@ pg_include_config(const char *configFilePath,
 
 /*
  * ensure_default_settings_file_exists writes the postgresql-auto-failover.conf
- * file to the database directory.
+ * file to the database directory. The file is only written when its contents
+ * change, and then the names of the changed settings are copied to the
+ * changedSettings buffer, when it's not NULL.
  */
 static bool
 ensure_default_settings_file_exists(const char *configFilePath,
 									GUC *settings,
 									PostgresSetup *pgSetup,
 									const char *hostname,
-									bool includeTuning)
+									bool includeTuning,
+									char *changedSettings,
+									size_t size)
 {
 	PQExpBuffer defaultConfContents = createPQExpBuffer();
 
@@ -885,6 +1040,11 @@ ensure_default_settings_file_exists(const char *configFilePath,
 		return false;
 	}
 
+	if (changedSettings != NULL)
+	{
+		changedSettings[0] = '\0';
+	}
+
 	if (!prepare_guc_settings_from_pgsetup(configFilePath,
 										   defaultConfContents,
 										   settings,
@@ -920,13 +1080,36 @@ ensure_default_settings_file_exists(const char *configFilePath,
 			return true;
 		}
 
-		log_info("Contents of \"%s\" have changed, overwriting", configFilePath);
+		char changed[BUFSIZE] = { 0 };
+
+		(void) pg_conf_changed_settings(currentDefaultConfContents,
+										defaultConfContents->data,
+										changed,
+										sizeof(changed));
+
+		log_info("Contents of \"%s\" have changed, overwriting "
+				 "(settings: %s)",
+				 configFilePath, changed);
+
+		if (changedSettings != NULL)
+		{
+			strlcpy(changedSettings, changed, size);
+		}
+
 		free(currentDefaultConfContents);
 	}
 	else
 	{
 		log_debug("Configuration file \"%s\" doesn't exists yet, creating",
 				  configFilePath);
+
+		if (changedSettings != NULL)
+		{
+			(void) pg_conf_changed_settings("",
+											defaultConfContents->data,
+											changedSettings,
+											size);
+		}
 	}
 
 	if (!write_file(defaultConfContents->data,
@@ -1150,6 +1333,8 @@ prepare_guc_settings_from_pgsetup(const char *configFilePath,
 	if (includeTuning)
 	{
 		if (!pgtuning_prepare_guc_settings(postgres_tuning,
+										   pgSetup->pgdata,
+										   pgSetup->tuningProfile,
 										   tuning,
 										   sizeof(tuning)))
 		{
@@ -1172,6 +1357,11 @@ prepare_guc_settings_from_pgsetup(const char *configFilePath,
 }
 
 
+/*
+ * ensure_empty_tablespace_dirs removes the contents of the tablespace
+ * directories of the given pgdata, before we clone the upstream node
+ * tablespaces to the same locations.
+ */
 bool
 ensure_empty_tablespace_dirs(const char *pgdata)
 {
@@ -1264,9 +1454,13 @@ pg_basebackup(const char *pgdata,
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 
-	char *args[16];
+	char *args[20];
 	int argsIndex = 0;
 
+	char walMethod[BUFSIZE] = { 0 };
+	char compress[BUFSIZE] = { 0 };
+	char manifestChecksums[BUFSIZE] = { 0 };
+
 	char command[BUFSIZE];
 	char pgpassword[BUFSIZE] = { 0 };
 
@@ -1329,10 +1523,38 @@ pg_basebackup(const char *pgdata,
 	args[argsIndex++] = "--progress";
 	args[argsIndex++] = "--max-rate";
 	args[argsIndex++] = replicationSource->maximumBackupRate;
-	args[argsIndex++] = "--wal-method=stream";
+	/* default to streaming the WAL, which allows using our slot */
+	bool streamWal =
+		IS_EMPTY_STRING_BUFFER(replicationSource->backupWalMethod) ||
+		strcmp(replicationSource->backupWalMethod, "stream") == 0;
 
-	/* we don't use a replication slot e.g. when upstream is a standby */
-	if (!IS_EMPTY_STRING_BUFFER(replicationSource->slotName))
+	sformat(walMethod, sizeof(walMethod), "--wal-method=%s",
+			streamWal ? "stream" : replicationSource->backupWalMethod);
+	args[argsIndex++] = walMethod;
+
+	/* server-side compression is typically used over slow networks */
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->backupCompress))
+	{
+		sformat(compress, sizeof(compress), "--compress=%s",
+				replicationSource->backupCompress);
+		args[argsIndex++] = compress;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->backupManifestChecksums))
+	{
+		sformat(manifestChecksums, sizeof(manifestChecksums),
+				"--manifest-checksums=%s",
+				replicationSource->backupManifestChecksums);
+		args[argsIndex++] = manifestChecksums;
+	}
+
+	/*
+	 * We don't use a replication slot e.g. when upstream is a standby.
+	 * pg_basebackup only uses a replication slot to stream the WAL, with
+	 * --wal-method=fetch our slot on the upstream node still retains the WAL
+	 * files that we need.
+	 */
+	if (streamWal && !IS_EMPTY_STRING_BUFFER(replicationSource->slotName))
 	{
 		args[argsIndex++] = "--slot";
 		args[argsIndex++] = replicationSource->slotName;
@@ -1348,7 +1570,8 @@ pg_basebackup(const char *pgdata,
 	Program program = { 0 };
 
 	(void) initialize_program(&program, args, false);
-	program.processBuffer = &processBufferCallback;
+	program.processBuffer = &processProgressCallback;
+	progressOperation = "basebackup";
 
 	/* log the exact command line we're using */
 	int commandSize = snprintf_program_command_line(&program, command, BUFSIZE);
@@ -1363,7 +1586,17 @@ pg_basebackup(const char *pgdata,
 		log_info("%s", command);
 	}
 
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "pg_basebackup", NULL);
+	trace_span_set_attribute(&span, "process.command_line", "%s", command);
+
 	(void) execute_subprogram(&program);
+	(void) pg_call_progress_hook(NULL, 0, 0);
+
+	trace_span_set_attribute(&span, "process.exit_code", "%d",
+							 program.returnCode);
+	trace_span_end(&span, program.returnCode == 0);
 
 	/* clean-up the environment again */
 	if (!IS_EMPTY_STRING_BUFFER(replicationSource->password))
@@ -1387,7 +1620,16 @@ pg_basebackup(const char *pgdata,
 		return false;
 	}
 
-	/* replace $pgdata with the backup directory */
+	return pg_basebackup_install(pgdata, replicationSource->backupDir);
+}
+
+
+/*
+ * pg_basebackup_install replaces pgdata with the given backup directory.
+ */
+bool
+pg_basebackup_install(const char *pgdata, const char *backupDir)
+{
 	if (directory_exists(pgdata))
 	{
 		if (!rmtree(pgdata, true))
@@ -1397,16 +1639,103 @@ pg_basebackup(const char *pgdata,
 		}
 	}
 
-	log_debug("mv \"%s\" \"%s\"", replicationSource->backupDir, pgdata);
+	log_debug("mv \"%s\" \"%s\"", backupDir, pgdata);
 
-	if (rename(replicationSource->backupDir, pgdata) != 0)
+	if (rename(backupDir, pgdata) != 0)
 	{
 		log_error(
 			"Failed to install pg_basebackup dir " " \"%s\" in \"%s\": %m",
-			replicationSource->backupDir, pgdata);
+			backupDir, pgdata);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_verifybackup runs pg_verifybackup on the given backup directory, which
+ * checks the files against the backup_manifest and parses the WAL needed to
+ * restore the backup. The program ships with Postgres 13 and later, when it
+ * is not installed next to pg_ctl we skip the verification.
+ */
+bool
+pg_verifybackup(const char *pg_ctl, const char *backupDir)
+{
+	char pg_verifybackup[MAXPGPATH] = { 0 };
+
+	path_in_same_directory(pg_ctl, "pg_verifybackup", pg_verifybackup);
+
+	if (!file_exists(pg_verifybackup))
+	{
+		log_warn("Skipping the verification of \"%s\": "
+				 "program \"%s\" not found",
+				 backupDir, pg_verifybackup);
+		return true;
+	}
+
+	log_info("%s --quiet \"%s\"", pg_verifybackup, backupDir);
+
+	Program prog = run_program(pg_verifybackup, "--quiet", backupDir, NULL);
+
+	if (prog.returnCode != 0)
+	{
+		errno = prog.error;
+		(void) log_program_output(prog, LOG_INFO, LOG_ERROR);
+		log_error("Failed to verify backup \"%s\" "
+				  "using program \"%s\": %m",
+				  backupDir,
+				  pg_verifybackup);
+		free_program(&prog);
 		return false;
 	}
 
+	free_program(&prog);
+
+	return true;
+}
+
+
+/*
+ * pg_get_restore_command runs "postgres -C restore_command" on the given
+ * stopped database directory, and copies the value to the given buffer. The
+ * value is an empty string when the setting is not set.
+ */
+bool
+pg_get_restore_command(const char *pg_ctl, const char *pgdata,
+					   char *restoreCommand, size_t size)
+{
+	char postgres[MAXPGPATH] = { 0 };
+	char *lines[1];
+
+	path_in_same_directory(pg_ctl, "postgres", postgres);
+
+	Program prog = run_program(postgres,
+							   "-D", pgdata, "-C", "restore_command",
+							   NULL);
+
+	if (prog.returnCode != 0)
+	{
+		errno = prog.error;
+		(void) log_program_output(prog, LOG_INFO, LOG_ERROR);
+		log_error("Failed to run \"postgres -C restore_command\" "
+				  "using program \"%s\": %m",
+				  postgres);
+		free_program(&prog);
+		return false;
+	}
+
+	if (prog.stdOut != NULL && splitLines(prog.stdOut, lines, 1) == 1)
+	{
+		strlcpy(restoreCommand, lines[0], size);
+	}
+	else
+	{
+		restoreCommand[0] = '\0';
+	}
+
+	free_program(&prog);
+
 	return true;
 }
 
@@ -1415,11 +1744,16 @@ pg_basebackup(const char *pgdata,
  * pg_rewind runs the pg_rewind program to rewind the given database directory
  * to a state where it can follow the given primary. We need the ability to
  * connect to the node.
+ *
+ * When restoreTargetWal is true, pg_rewind uses the restore_command of the
+ * target to fetch the WAL files it needs and that have been removed from the
+ * target pg_wal directory already (Postgres 13 and later).
  */
 bool
 pg_rewind(const char *pgdata,
 		  const char *pg_ctl,
-		  ReplicationSource *replicationSource)
+		  ReplicationSource *replicationSource,
+		  bool restoreTargetWal)
 {
 	int returnCode;
 	char pg_rewind[MAXPGPATH] = { 0 };
@@ -1427,7 +1761,7 @@ pg_rewind(const char *pgdata,
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 
-	char *args[7];
+	char *args[8];
 	int argsIndex = 0;
 
 	char command[BUFSIZE];
@@ -1472,6 +1806,12 @@ pg_rewind(const char *pgdata,
 	args[argsIndex++] = "--source-server";
 	args[argsIndex++] = primaryConnInfo;
 	args[argsIndex++] = "--progress";
+
+	if (restoreTargetWal)
+	{
+		args[argsIndex++] = "--restore-target-wal";
+	}
+
 	args[argsIndex] = NULL;
 
 	/*
@@ -1482,7 +1822,8 @@ pg_rewind(const char *pgdata,
 	Program program = { 0 };
 
 	(void) initialize_program(&program, args, false);
-	program.processBuffer = &processBufferCallback;
+	program.processBuffer = &processProgressCallback;
+	progressOperation = "rewind";
 
 	/* log the exact command line we're using */
 	int commandSize = snprintf_program_command_line(&program, command, BUFSIZE);
@@ -1497,7 +1838,17 @@ pg_rewind(const char *pgdata,
 		log_info("%s", command);
 	}
 
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "pg_rewind", NULL);
+	trace_span_set_attribute(&span, "process.command_line", "%s", command);
+
 	(void) execute_subprogram(&program);
+	(void) pg_call_progress_hook(NULL, 0, 0);
+
+	trace_span_set_attribute(&span, "process.exit_code", "%d",
+							 program.returnCode);
+	trace_span_end(&span, program.returnCode == 0);
 
 	/* clean-up the environment again */
 	if (!IS_EMPTY_STRING_BUFFER(replicationSource->password))
@@ -1569,6 +1920,10 @@ pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
 	log_info("Initialising a PostgreSQL cluster at \"%s\"", pgdata);
 	log_info("%s initdb -s -D %s --option '--auth=trust'", pg_ctl, pgdata);
 
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "pg_ctl initdb", NULL);
+
 	Program program = run_program(pg_ctl, "initdb",
 								  "--silent",
 								  "--pgdata", pgdata,
@@ -1579,6 +1934,8 @@ pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
 
 	bool success = program.returnCode == 0;
 
+	trace_span_end(&span, success);
+
 	if (program.returnCode != 0)
 	{
 		(void) log_program_output(program, LOG_INFO, LOG_ERROR);
@@ -1730,10 +2087,13 @@ pg_log_startup(const char *pgdata, int logLevel)
 	/* prepare startup.log file in PGDATA */
 	join_path_components(pgStartupPath, pgdata, "startup.log");
 
-	if (read_file(pgStartupPath, &fileContents, &fileSize) && fileSize > 0)
+	if (read_file_tail(pgStartupPath, PG_LOG_STARTUP_MAX_LINES,
+					   &fileContents, &fileSize) &&
+		fileSize > 0)
 	{
-		char *lines[BUFSIZE];
-		int lineCount = splitLines(fileContents, lines, BUFSIZE);
+		char *lines[PG_LOG_STARTUP_MAX_LINES];
+		int lineCount =
+			splitLines(fileContents, lines, PG_LOG_STARTUP_MAX_LINES);
 		int lineNumber = 0;
 
 		log_level(pathLogLevel, "Postgres logs from \"%s\":", pgStartupPath);
@@ -1753,8 +2113,8 @@ pg_log_startup(const char *pgdata, int logLevel)
 	 *
 	 * Given that we setup Postgres to use the logging_collector, we expect
 	 * there to be a single Postgres log file in the "log" directory that was
-	 * created later than the "startup.log" file, and we expect the file to be
-	 * rather short.
+	 * created later than the "startup.log" file. The file might be long when
+	 * Postgres is verbose, so we only read its last lines.
 	 *
 	 * Also we setup log_directory to be "log" so that's where we are looking
 	 * into.
@@ -1843,11 +2203,13 @@ pg_log_startup(const char *pgdata, int logLevel)
 			log_level(pathLogLevel,
 					  "Postgres logs from \"%s\":", pgLogFilePath);
 
-			if (read_file(pgLogFilePath, &fileContents, &fileSize) &&
+			if (read_file_tail(pgLogFilePath, PG_LOG_STARTUP_MAX_LINES,
+							   &fileContents, &fileSize) &&
 				fileSize > 0)
 			{
-				char *lines[BUFSIZE];
-				int lineCount = splitLines(fileContents, lines, BUFSIZE);
+				char *lines[PG_LOG_STARTUP_MAX_LINES];
+				int lineCount =
+					splitLines(fileContents, lines, PG_LOG_STARTUP_MAX_LINES);
 				int lineNumber = 0;
 
 				for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
@@ -2005,13 +2367,32 @@ pg_ctl_stop(const char *pg_ctl, const char *pgdata)
 
 
 /*
- * pg_ctl_status gets the status of the PostgreSQL server by running
- * "pg_ctl status". Output of this command is logged if log_output is true.
- * Return code of this command is returned.
+ * pg_ctl_status gets the status of the PostgreSQL server, with the same
+ * result as running "pg_ctl status". Return code of this command is returned.
+ *
+ * We implement the same checks as pg_ctl does from the postmaster.pid file,
+ * and only run "pg_ctl status" when the file exists and can't be parsed, such
+ * as when reading it while Postgres writes it. Output of this command is
+ * logged if log_output is true.
  */
 int
 pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 {
+	pid_t pid = 0;
+	int pidfileStatus = pg_ctl_status_from_pidfile(pgdata, &pid);
+
+	if (pidfileStatus != -1)
+	{
+		log_level(log_output ? LOG_INFO : LOG_DEBUG,
+				  "Postgres at \"%s\" is %s (pid %d) [%d]",
+				  pgdata,
+				  pidfileStatus == 0 ? "running" : "not running",
+				  pid,
+				  pidfileStatus);
+
+		return pidfileStatus;
+	}
+
 	Program program = run_program(pg_ctl, "status", "-D", pgdata, NULL);
 	int returnCode = program.returnCode;
 
@@ -2028,16 +2409,89 @@ pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 }
 
 
+/*
+ * pg_ctl_status_from_pidfile implements the checks that "pg_ctl status" does
+ * using the postmaster.pid file in PGDATA, and returns the same return code:
+ * 0 when Postgres is running, and PG_CTL_STATUS_NOT_RUNNING otherwise.
+ *
+ * When the pid file can't be trusted, we return -1 so that the caller may run
+ * "pg_ctl status" instead.
+ */
+static int
+pg_ctl_status_from_pidfile(const char *pgdata, pid_t *pid)
+{
+	char versionFilePath[MAXPGPATH] = { 0 };
+	char pidfile[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long fileSize = 0;
+	char *lines[1];
+	int filePid = 0;
+
+	/* pg_ctl returns 4 when PGDATA is not a data directory */
+	join_path_components(versionFilePath, pgdata, "PG_VERSION");
+
+	if (!file_exists(versionFilePath))
+	{
+		return -1;
+	}
+
+	join_path_components(pidfile, pgdata, "postmaster.pid");
+
+	if (!file_exists(pidfile))
+	{
+		return PG_CTL_STATUS_NOT_RUNNING;
+	}
+
+	if (!read_file_if_exists(pidfile, &contents, &fileSize))
+	{
+		return -1;
+	}
+
+	if (fileSize == 0 ||
+		splitLines(contents, lines, 1) != 1 ||
+		!stringToInt(lines[0], &filePid) ||
+		filePid == 0)
+	{
+		free(contents);
+		return -1;
+	}
+
+	free(contents);
+
+	/* a standalone backend pid is negative, we signal the actual pid */
+	*pid = abs(filePid);
+
+	/*
+	 * Just like pg_ctl does, consider that a pid file that contains our own
+	 * pid or the pid of our parent process is stale: that happens when the
+	 * pids are recycled after a container restart.
+	 */
+	if (*pid == getpid() || *pid == getppid())
+	{
+		return PG_CTL_STATUS_NOT_RUNNING;
+	}
+
+	return kill(*pid, 0) == 0 ? 0 : PG_CTL_STATUS_NOT_RUNNING;
+}
+
+
 /*
  * pg_ctl_promote promotes a standby by running "pg_ctl promote"
  */
 bool
 pg_ctl_promote(const char *pg_ctl, const char *pgdata)
 {
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "pg_ctl promote", NULL);
+
 	Program program =
 		run_program(pg_ctl, "promote", "-D", pgdata, "--no-wait", NULL);
 	int returnCode = program.returnCode;
 
+	trace_span_set_attribute(&span, "process.exit_code", "%d", returnCode);
+	trace_span_end(&span, returnCode == 0);
+
 	log_debug("%s promote -D %s --no-wait", pg_ctl, pgdata);
 
 	if (program.stdErr != NULL)
@@ -2123,6 +2577,7 @@ pg_write_recovery_conf(const char *pgdata, ReplicationSource *replicationSource)
 	/* prepare storage areas for parameters */
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 	char primarySlotName[MAXCONNINFO] = { 0 };
+	char restoreCommand[RESTORE_COMMAND_MAXLENGTH] = { 0 };
 	char targetLSN[PG_LSN_MAXLENGTH] = { 0 };
 	char targetAction[NAMEDATALEN] = { 0 };
 	char targetTimeline[NAMEDATALEN] = { 0 };
@@ -2131,6 +2586,7 @@ pg_write_recovery_conf(const char *pgdata, ReplicationSource *replicationSource)
 		{ "standby_mode", "'on'" },
 		{ "primary_conninfo", (char *) primaryConnInfo },
 		{ "primary_slot_name", (char *) primarySlotName },
+		{ "restore_command", (char *) restoreCommand },
 		{ "recovery_target_timeline", (char *) targetTimeline },
 		{ NULL, NULL }
 	};
@@ -2139,6 +2595,7 @@ pg_write_recovery_conf(const char *pgdata, ReplicationSource *replicationSource)
 		{ "standby_mode", "'on'" },
 		{ "primary_conninfo", (char *) primaryConnInfo },
 		{ "primary_slot_name", (char *) primarySlotName },
+		{ "restore_command", (char *) restoreCommand },
 		{ "recovery_target_timeline", (char *) targetTimeline },
 		{ "recovery_target_lsn", (char *) targetLSN },
 		{ "recovery_target_inclusive", "'true'" },
@@ -2161,6 +2618,7 @@ pg_write_recovery_conf(const char *pgdata, ReplicationSource *replicationSource)
 								   replicationSource,
 								   primaryConnInfo,
 								   primarySlotName,
+								   restoreCommand,
 								   targetLSN,
 								   targetAction,
 								   targetTimeline))
@@ -2173,7 +2631,9 @@ pg_write_recovery_conf(const char *pgdata, ReplicationSource *replicationSource)
 											   recoverySettings,
 											   NULL,
 											   NULL,
-											   includeTuning);
+											   includeTuning,
+											   NULL,
+											   0);
 }
 
 
@@ -2194,6 +2654,7 @@ pg_write_standby_signal(const char *pgdata,
 	/* prepare storage areas for parameters */
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 	char primarySlotName[MAXCONNINFO] = { 0 };
+	char restoreCommand[RESTORE_COMMAND_MAXLENGTH] = { 0 };
 	char targetLSN[PG_LSN_MAXLENGTH] = { 0 };
 	char targetAction[NAMEDATALEN] = { 0 };
 	char targetTimeline[NAMEDATALEN] = { 0 };
@@ -2201,6 +2662,7 @@ pg_write_standby_signal(const char *pgdata,
 	GUC recoverySettingsStandby[] = {
 		{ "primary_conninfo", (char *) primaryConnInfo },
 		{ "primary_slot_name", (char *) primarySlotName },
+		{ "restore_command", (char *) restoreCommand },
 		{ "recovery_target_timeline", (char *) targetTimeline },
 		{ NULL, NULL }
 	};
@@ -2208,6 +2670,7 @@ pg_write_standby_signal(const char *pgdata,
 	GUC recoverySettingsTargetLSN[] = {
 		{ "primary_conninfo", (char *) primaryConnInfo },
 		{ "primary_slot_name", (char *) primarySlotName },
+		{ "restore_command", (char *) restoreCommand },
 		{ "recovery_target_timeline", (char *) targetTimeline },
 		{ "recovery_target_lsn", (char *) targetLSN },
 		{ "recovery_target_inclusive", "'true'" },
@@ -2228,6 +2691,7 @@ pg_write_standby_signal(const char *pgdata,
 								   replicationSource,
 								   primaryConnInfo,
 								   primarySlotName,
+								   restoreCommand,
 								   targetLSN,
 								   targetAction,
 								   targetTimeline))
@@ -2249,18 +2713,18 @@ pg_write_standby_signal(const char *pgdata,
 	 * configuration.
 	 */
 
-	/* only logs about this the first time */
+	/* the file only needs to exist, don't write it again */
 	if (!file_exists(signalFilePath))
 	{
 		log_info("Creating the standby signal file at \"%s\", "
 				 "and replication setup at \"%s\"",
 				 signalFilePath, standbyConfigFilePath);
-	}
 
-	if (!write_file("", 0, signalFilePath))
-	{
-		/* write_file logs I/O error */
-		return false;
+		if (!write_file("", 0, signalFilePath))
+		{
+			/* write_file logs I/O error */
+			return false;
+		}
 	}
 
 	/*
@@ -2273,7 +2737,9 @@ pg_write_standby_signal(const char *pgdata,
 											 recoverySettings,
 											 NULL,
 											 NULL,
-											 includeTuning))
+											 includeTuning,
+											 NULL,
+											 0))
 	{
 		return false;
 	}
@@ -2307,6 +2773,7 @@ prepare_recovery_settings(const char *pgdata,
 						  ReplicationSource *replicationSource,
 						  char *primaryConnInfo,
 						  char *primarySlotName,
+						  char *restoreCommand,
 						  char *targetLSN,
 						  char *targetAction,
 						  char *targetTimeline)
@@ -2324,12 +2791,18 @@ prepare_recovery_settings(const char *pgdata,
 				  primaryNode->host,
 				  primaryNode->port);
 
+		/* the Postgres 17 slot synchronization worker needs a dbname */
+		const char *dbname =
+			IS_EMPTY_STRING_BUFFER(replicationSource->slotSyncDbname)
+			? NULL
+			: replicationSource->slotSyncDbname;
+
 		if (!prepare_primary_conninfo(primaryConnInfo,
 									  MAXCONNINFO,
 									  primaryNode->host,
 									  primaryNode->port,
 									  replicationSource->userName,
-									  NULL, /* no database */
+									  dbname,
 									  replicationSource->password,
 									  replicationSource->applicationName,
 									  replicationSource->sslOptions,
@@ -2354,6 +2827,21 @@ prepare_recovery_settings(const char *pgdata,
 				replicationSource->slotName);
 	}
 
+	/*
+	 * When a restore_command is given, Postgres fetches WAL from the archive
+	 * too, which helps a standby that has fallen behind to catch up.
+	 */
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->restoreCommand))
+	{
+		if (!escape_recovery_conf_string(restoreCommand,
+										 RESTORE_COMMAND_MAXLENGTH,
+										 replicationSource->restoreCommand))
+		{
+			/* errors have already been logged. */
+			return false;
+		}
+	}
+
 	/* The default target timeline is 'latest' */
 	if (IS_EMPTY_STRING_BUFFER(replicationSource->targetTimeline))
 	{
@@ -2444,6 +2932,181 @@ pg_cleanup_standby_mode(uint32_t pg_control_version,
 		}
 	}
 
+	/* the prefetched WAL segments are not going to be used anymore */
+	if (!wal_prefetch_cleanup(pgdata))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_standby_settings_are_reloadable returns true when the standby settings
+ * file with the given new contents can be applied to a running standby with
+ * a reload of the configuration rather than a restart of Postgres. That's
+ * the case when none of the changed settings has the "postmaster" context in
+ * the running Postgres, such as primary_conninfo and primary_slot_name with
+ * Postgres 13 and later, which then restarts the WAL receiver when needed,
+ * or restore_command with Postgres 14 and later.
+ */
+bool
+pg_standby_settings_are_reloadable(PGSQL *pgsql,
+								   uint32_t pg_control_version,
+								   const char *currentContents,
+								   const char *newContents)
+{
+	char changedSettings[BUFSIZE] = { 0 };
+	char restartSettings[BUFSIZE] = { 0 };
+	bool needRestart = true;
+
+	/* recovery.conf is only read at start-up */
+	if (pg_control_version < 1200 ||
+		currentContents == NULL ||
+		newContents == NULL)
+	{
+		return false;
+	}
+
+	(void) pg_conf_changed_settings(currentContents,
+									newContents,
+									changedSettings,
+									sizeof(changedSettings));
+
+	if (IS_EMPTY_STRING_BUFFER(changedSettings))
+	{
+		return true;
+	}
+
+	if (!pgsql_settings_need_restart(pgsql,
+									 changedSettings,
+									 &needRestart,
+									 restartSettings,
+									 sizeof(restartSettings)))
+	{
+		/* errors have already been logged, restart to be safe */
+		return false;
+	}
+
+	if (needRestart)
+	{
+		log_info("Changed replication settings need a restart of Postgres: %s",
+				 restartSettings);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_conf_changed_settings compares two Postgres configuration files
+ * contents, and copies the names of the settings that have been added,
+ * removed, or changed to the changedSettings buffer, separated by commas.
+ */
+static void
+pg_conf_changed_settings(const char *currentContents,
+						 const char *newContents,
+						 char *changedSettings, size_t size)
+{
+	char *currentLines[BUFSIZE] = { 0 };
+	char *newLines[BUFSIZE] = { 0 };
+
+	changedSettings[0] = '\0';
+
+	char *currentCopy = strdup(currentContents);
+	char *newCopy = strdup(newContents);
+
+	if (currentCopy == NULL || newCopy == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(currentCopy);
+		free(newCopy);
+		return;
+	}
+
+	int currentCount = splitLines(currentCopy, currentLines, BUFSIZE);
+	int newCount = splitLines(newCopy, newLines, BUFSIZE);
+
+	/* a line found only on one side is a changed setting */
+	for (int side = 0; side < 2; side++)
+	{
+		char **lines = side == 0 ? newLines : currentLines;
+		int count = side == 0 ? newCount : currentCount;
+		char **otherLines = side == 0 ? currentLines : newLines;
+		int otherCount = side == 0 ? currentCount : newCount;
+
+		for (int i = 0; i < count; i++)
+		{
+			char name[NAMEDATALEN] = { 0 };
+			char pattern[NAMEDATALEN + 2] = { 0 };
+			bool found = false;
+
+			if (!pg_conf_setting_name(lines[i], name, sizeof(name)))
+			{
+				continue;
+			}
+
+			for (int j = 0; !found && j < otherCount; j++)
+			{
+				found = strcmp(lines[i], otherLines[j]) == 0;
+			}
+
+			if (found)
+			{
+				continue;
+			}
+
+			/* only list each setting once */
+			sformat(pattern, sizeof(pattern), ",%s,", name);
+
+			char listed[BUFSIZE] = { 0 };
+
+			sformat(listed, sizeof(listed), ",%s,", changedSettings);
+
+			if (strstr(listed, pattern) != NULL)
+			{
+				continue;
+			}
+
+			size_t len = strlen(changedSettings);
+
+			sformat(changedSettings + len, size - len, "%s%s",
+					len == 0 ? "" : ",",
+					name);
+		}
+	}
+
+	free(currentCopy);
+	free(newCopy);
+}
+
+
+/*
+ * pg_conf_setting_name copies the name of the setting found on the given
+ * configuration file line, and returns false for comments and empty lines.
+ */
+static bool
+pg_conf_setting_name(const char *line, char *name, size_t size)
+{
+	const char *ptr = line;
+
+	while (*ptr == ' ' || *ptr == '\t')
+	{
+		++ptr;
+	}
+
+	size_t len = strcspn(ptr, " \t=");
+
+	if (len == 0 || *ptr == '#' || len >= size)
+	{
+		return false;
+	}
+
+	strlcpy(name, ptr, len + 1);
+
 	return true;
 }
 
@@ -2731,26 +3394,20 @@ pg_is_running(const char *pg_ctl, const char *pgdata)
 /*
  * pg_create_self_signed_cert creates self-signed certificates for the local
  * Postgres server and places the private key in $PGDATA/server.key and the
- * public certificate in $PGDATA/server.cert
+ * public certificate in $PGDATA/server.crt
  *
- * We simply follow Postgres documentation at:
+ * We used to follow Postgres documentation at:
  * https://www.postgresql.org/docs/current/ssl-tcp.html#SSL-CERTIFICATE-CREATION
  *
  * openssl req -new -x509 -days 365 -nodes -text -out server.crt \
  *             -keyout server.key -subj "/CN=dbhost.yourdomain.com"
+ *
+ * We now create the same files in process with the OpenSSL library, see
+ * ssl_utils.c, so that we don't depend on the openssl command line tool.
  */
 bool
 pg_create_self_signed_cert(PostgresSetup *pgSetup, const char *hostname)
 {
-	char subject[BUFSIZE] = { 0 };
-	char openssl[MAXPGPATH] = { 0 };
-
-	if (!search_path_first("openssl", openssl, LOG_ERROR))
-	{
-		/* errors have already been logged */
-		return false;
-	}
-
 	/* ensure PGDATA has been normalized */
 	if (!normalize_filename(pgSetup->pgdata, pgSetup->pgdata, MAXPGPATH))
 	{
@@ -2779,50 +3436,82 @@ pg_create_self_signed_cert(PostgresSetup *pgSetup, const char *hostname)
 		return false;
 	}
 
-	size = sformat(subject, BUFSIZE, "/CN=%s", hostname);
+	log_info("Creating a self-signed certificate for \"/CN=%s\" "
+			 "in \"%s\" with its private key in \"%s\"",
+			 hostname,
+			 pgSetup->ssl.serverCert,
+			 pgSetup->ssl.serverKey);
 
-	if (size == -1 || size > BUFSIZE)
+	if (!ssl_create_self_signed_cert(pgSetup->ssl.serverKey,
+									 pgSetup->ssl.serverCert,
+									 hostname))
 	{
-		log_error("BUG: the ssl subject \"/CN=%s\" requires %d bytes and"
-				  "pg_auto_failover only support up to %d bytes",
-				  hostname, size, BUFSIZE);
+		/* errors have already been logged */
 		return false;
 	}
 
-	log_info(" %s req -new -x509 -days 365 -nodes -text "
-			 "-out %s -keyout %s -subj \"%s\"",
-			 openssl,
-			 pgSetup->ssl.serverCert,
-			 pgSetup->ssl.serverKey,
-			 subject);
-
-	Program program = run_program(openssl,
-								  "req", "-new", "-x509", "-days", "365",
-								  "-nodes", "-text",
-								  "-out", pgSetup->ssl.serverCert,
-								  "-keyout", pgSetup->ssl.serverKey,
-								  "-subj", subject,
-								  NULL);
+	return true;
+}
 
-	if (program.returnCode != 0)
+
+/*
+ * pg_set_progress_hook installs a function that is called with the progress
+ * of the next pg_basebackup and pg_rewind operations. Use a NULL hook to
+ * remove it.
+ */
+void
+pg_set_progress_hook(PgProgressHook hook, void *context)
+{
+	progressHook = hook;
+	progressHookContext = context;
+}
+
+
+/*
+ * pg_call_progress_hook calls the progress hook, when one is installed.
+ */
+void
+pg_call_progress_hook(const char *operation,
+					  uint64_t doneBytes, uint64_t totalBytes)
+{
+	if (progressHook != NULL)
 	{
-		(void) log_program_output(program, LOG_INFO, LOG_ERROR);
-		log_error("openssl failed with return code: %d", program.returnCode);
-		free_program(&program);
-		return false;
+		(*progressHook)(progressHookContext, operation, doneBytes, totalBytes);
 	}
+}
 
-	(void) log_program_output(program, LOG_DEBUG, LOG_DEBUG);
-	free_program(&program);
 
-	/*
-	 * Then do: chmod og-rwx server.key
-	 */
-	if (chmod(pgSetup->ssl.serverKey, S_IRUSR | S_IWUSR) != 0)
+/*
+ * processProgressCallback logs the output of pg_basebackup and pg_rewind just
+ * like processBufferCallback does, and also parses their --progress lines to
+ * call the progress hook. Those lines start with the number of kilobytes done
+ * and the total number of kilobytes, as in:
+ *
+ *   pg_basebackup:  25834/139739 kB (18%), 0/1 tablespace
+ *   pg_rewind:      25834/139739 kB (18%) copied
+ */
+static void
+processProgressCallback(const char *buffer, bool error)
+{
+	(void) processBufferCallback(buffer, error);
+
+	if (progressHook == NULL || progressOperation == NULL)
 	{
-		log_error("Failed to chmod og-rwx \"%s\": %m", pgSetup->ssl.serverKey);
-		return false;
+		return;
 	}
 
-	return true;
+	/* when stderr is a terminal, progress lines are separated with \r */
+	const char *line = strrchr(buffer, '\r');
+
+	line = line == NULL ? buffer : line + 1;
+
+	unsigned long long doneKB = 0;
+	unsigned long long totalKB = 0;
+
+	if (sscanf(line, " %llu/%llu kB", &doneKB, &totalKB) == 2)
+	{
+		(void) pg_call_progress_hook(progressOperation,
+									 (uint64_t) doneKB * 1024,
+									 (uint64_t) totalKB * 1024);
+	}
 }
@@ -25,9 +25,26 @@
 
 #define AUTOCTL_DEFAULTS_CONF_FILENAME "postgresql-auto-failover.conf"
 #define AUTOCTL_STANDBY_CONF_FILENAME "postgresql-auto-failover-standby.conf"
+#define AUTOCTL_ROLE_CONF_FILENAME "postgresql-auto-failover-role.conf"
 
 #define PG_CTL_STATUS_NOT_RUNNING 3
 
+/* restore_command is escaped, single quotes are doubled */
+#define RESTORE_COMMAND_MAXLENGTH (2 * MAXCONNINFO + 3)
+
+/*
+ * A progress hook is called with the number of bytes done and the total
+ * number of bytes of a running pg_basebackup ("basebackup") or pg_rewind
+ * ("rewind") operation, as parsed from their --progress output. Once the
+ * program is done, the hook is called again with a NULL operation.
+ */
+typedef void (*PgProgressHook)(void *context, const char *operation,
+							   uint64_t doneBytes, uint64_t totalBytes);
+
+void pg_set_progress_hook(PgProgressHook hook, void *context);
+void pg_call_progress_hook(const char *operation,
+						   uint64_t doneBytes, uint64_t totalBytes);
+
 bool pg_controldata(PostgresSetup *pgSetup, bool missing_ok);
 bool set_pg_ctl_from_PG_CONFIG(PostgresSetup *pgSetup);
 bool set_pg_ctl_from_pg_config(PostgresSetup *pgSetup);
@@ -40,16 +57,29 @@ bool find_pg_config_from_pg_ctl(const char *pg_ctl, char *pg_config, size_t size
 bool pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 										   const char *hostname,
 										   const char *configFilePath,
-										   GUC *settings);
+										   GUC *settings,
+										   char *changedSettings,
+										   size_t size);
+bool pg_add_auto_failover_role_settings(const char *pgdata,
+										GUC *settings,
+										char *changedSettings,
+										size_t size);
 
 bool pg_auto_failover_default_settings_file_exists(PostgresSetup *pgSetup);
+bool pg_auto_conf_has_primary_conninfo(const char *pgdata);
 
 bool pg_basebackup(const char *pgdata,
 				   const char *pg_ctl,
 				   ReplicationSource *replicationSource);
+bool pg_basebackup_install(const char *pgdata, const char *backupDir);
+bool ensure_empty_tablespace_dirs(const char *pgdata);
+bool pg_verifybackup(const char *pg_ctl, const char *backupDir);
+bool pg_get_restore_command(const char *pg_ctl, const char *pgdata,
+							char *restoreCommand, size_t size);
 bool pg_rewind(const char *pgdata,
 			   const char *pg_ctl,
-			   ReplicationSource *replicationSource);
+			   ReplicationSource *replicationSource,
+			   bool restoreTargetWal);
 
 bool pg_ctl_initdb(const char *pg_ctl, const char *pgdata);
 bool pg_ctl_postgres(const char *pg_ctl, const char *pgdata, int pgport,
@@ -70,6 +100,11 @@ bool pg_cleanup_standby_mode(uint32_t pg_control_version,
 							 const char *pgdata,
 							 PGSQL *pgsql);
 
+bool pg_standby_settings_are_reloadable(PGSQL *pgsql,
+										uint32_t pg_control_version,
+										const char *currentContents,
+										const char *newContents);
+
 bool pgctl_identify_system(ReplicationSource *replicationSource);
 
 bool pg_is_running(const char *pg_ctl, const char *pgdata);
@@ -11,11 +11,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
 
 #include "defaults.h"
+#include "dnscache.h"
 #include "file_utils.h"
 #include "ipaddr.h"
 #include "parsing.h"
@@ -27,6 +29,31 @@
 
 #define HBA_LINE_COMMENT " # Auto-generated by pg_auto_failover"
 
+/*
+ * An HBARuleIndex is a hash set of the rules of a pg_hba.conf file, where a
+ * rule is the contents of a line without its comment and trailing spaces, so
+ * that checking for each rule we need doesn't scan the whole file again.
+ */
+#define HBA_RULE_INDEX_INITIAL_CAPACITY 64
+
+typedef struct HBARuleIndex
+{
+	int capacity;               /* always a power of 2 */
+	int count;
+	uint32_t *hashes;
+	int *offsets;               /* offset in keys, -1 for an empty slot */
+	PQExpBuffer keys;           /* NUL separated rules */
+} HBARuleIndex;
+
+static bool hba_rule_index_init(HBARuleIndex *index, const char *contents);
+static bool hba_rule_index_contains(HBARuleIndex *index, const char *rule);
+static bool hba_rule_index_add(HBARuleIndex *index,
+							   const char *rule, int len);
+static void hba_rule_index_free(HBARuleIndex *index);
+static uint32_t hba_rule_hash(const char *rule, int len);
+static bool pghba_write_file_atomically(const char *hbaFilePath,
+										PQExpBuffer contents);
+
 static bool pghba_append_rule_to_buffer(PQExpBuffer buffer,
 										bool ssl,
 										HBADatabaseType databaseType,
@@ -269,7 +296,7 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 	PQExpBuffer newHbaContents = createPQExpBuffer();
 	char *currentHbaContents = NULL;
 	long currentHbaSize = 0L;
-	char *includeLine = NULL;
+	HBARuleIndex rulesIndex = { 0 };
 
 	int nodeIndex = 0;
 	int hbaLinesAdded = 0;
@@ -293,6 +320,19 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 	/* always begin with the existing HBA file */
 	appendPQExpBufferStr(newHbaContents, currentHbaContents);
 
+	/* index the existing rules, and then we're done with the old contents */
+	bool indexed = hba_rule_index_init(&rulesIndex, currentHbaContents);
+
+	free(currentHbaContents);
+
+	if (!indexed)
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(newHbaContents);
+		hba_rule_index_free(&rulesIndex);
+		return false;
+	}
+
 	for (nodeIndex = 0; nodeIndex < nodesArray->count; nodeIndex++)
 	{
 		NodeAddress *node = &(nodesArray->nodes[nodeIndex]);
@@ -316,9 +356,9 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 		{
 			log_error("Failed to allocate memory");
 
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
+			/* done with the new pg_hba.conf contents and rules index */
 			destroyPQExpBuffer(newHbaContents);
+			hba_rule_index_free(&rulesIndex);
 
 			/* done with the new HBA line buffers */
 			destroyPQExpBuffer(hbaLineReplicationBuffer);
@@ -367,9 +407,9 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 		{
 			/* errors have already been logged */
 
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
+			/* done with the new pg_hba.conf contents and rules index */
 			destroyPQExpBuffer(newHbaContents);
+			hba_rule_index_free(&rulesIndex);
 
 			/* done with the new HBA line buffers (and safe to call on NULL) */
 			destroyPQExpBuffer(hbaLineReplicationBuffer);
@@ -388,9 +428,9 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 		{
 			/* errors have already been logged */
 
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
+			/* done with the new pg_hba.conf contents and rules index */
 			destroyPQExpBuffer(newHbaContents);
+			hba_rule_index_free(&rulesIndex);
 
 			/* done with the new HBA line buffers (and safe to call on NULL) */
 			destroyPQExpBuffer(hbaLineReplicationBuffer);
@@ -416,14 +456,11 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 			log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
 					  hbaFilePath, hbaLineBuffer->data);
 
-			includeLine = strstr(currentHbaContents, hbaLineBuffer->data);
-
 			/*
-			 * If the rule was found and it starts on a new line. We can
-			 * skip adding it.
+			 * If the rule was found, either in the existing file or because
+			 * we just added it for another node, we can skip adding it.
 			 */
-			if (includeLine != NULL && (includeLine == currentHbaContents ||
-										includeLine[-1] == '\n'))
+			if (hba_rule_index_contains(&rulesIndex, hbaLineBuffer->data))
 			{
 				log_debug("Line already exists in %s, skipping %s",
 						  hbaFilePath, hbaLineBuffer->data);
@@ -449,6 +486,20 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 				appendPQExpBufferStr(newHbaContents, hbaLineBuffer->data);
 				appendPQExpBufferStr(newHbaContents, HBA_LINE_COMMENT "\n");
 
+				if (!hba_rule_index_add(&rulesIndex,
+										hbaLineBuffer->data,
+										hbaLineBuffer->len))
+				{
+					/* errors have already been logged */
+					destroyPQExpBuffer(newHbaContents);
+					hba_rule_index_free(&rulesIndex);
+
+					destroyPQExpBuffer(hbaLineReplicationBuffer);
+					destroyPQExpBuffer(hbaLineDatabaseBuffer);
+
+					return false;
+				}
+
 				++hbaLinesAdded;
 			}
 		}
@@ -458,8 +509,8 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 	destroyPQExpBuffer(hbaLineReplicationBuffer);
 	destroyPQExpBuffer(hbaLineDatabaseBuffer);
 
-	/* done with the old pg_hba.conf contents */
-	free(currentHbaContents);
+	/* done with the rules index */
+	hba_rule_index_free(&rulesIndex);
 
 	/* memory allocation could have failed while building string */
 	if (PQExpBufferBroken(newHbaContents))
@@ -472,11 +523,12 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 	/* write the new pg_hba.conf, unless --skip-pg-hba has been used */
 	if (hbaLevel >= HBA_EDIT_MINIMAL && hbaLinesAdded > 0)
 	{
-		log_info("Writing new HBA rules in \"%s\"", hbaFilePath);
+		log_info("Writing %d new HBA rules in \"%s\"",
+				 hbaLinesAdded, hbaFilePath);
 
-		if (!write_file(newHbaContents->data, newHbaContents->len, hbaFilePath))
+		if (!pghba_write_file_atomically(hbaFilePath, newHbaContents))
 		{
-			/* write_file logs an error */
+			/* errors have already been logged */
 			destroyPQExpBuffer(newHbaContents);
 			return false;
 		}
@@ -490,6 +542,260 @@ pghba_ensure_host_rules_exist(const char *hbaFilePath,
 }
 
 
+/*
+ * pghba_write_file_atomically writes the given contents to a temporary file
+ * next to the HBA file, with the same permissions, and then renames it over
+ * the HBA file, so that Postgres never reads a partially written file.
+ */
+static bool
+pghba_write_file_atomically(const char *hbaFilePath, PQExpBuffer contents)
+{
+	char tempFilePath[MAXPGPATH] = { 0 };
+	struct stat st;
+
+	sformat(tempFilePath, sizeof(tempFilePath), "%s.tmp", hbaFilePath);
+
+	if (!write_file(contents->data, contents->len, tempFilePath))
+	{
+		/* write_file logs an error */
+		return false;
+	}
+
+	if (stat(hbaFilePath, &st) == 0 && chmod(tempFilePath, st.st_mode) != 0)
+	{
+		log_error("Failed to set permissions of file \"%s\": %m",
+				  tempFilePath);
+		(void) unlink(tempFilePath);
+		return false;
+	}
+
+	if (rename(tempFilePath, hbaFilePath) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tempFilePath, hbaFilePath);
+		(void) unlink(tempFilePath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * hba_rule_index_init indexes the rules found in the given HBA file contents.
+ * Only the lines that are rules are indexed: a rule is the line contents
+ * before the first comment outside of a quoted string, without the trailing
+ * spaces.
+ */
+static bool
+hba_rule_index_init(HBARuleIndex *index, const char *contents)
+{
+	index->capacity = HBA_RULE_INDEX_INITIAL_CAPACITY;
+	index->count = 0;
+	index->hashes = (uint32_t *) calloc(index->capacity, sizeof(uint32_t));
+	index->offsets = (int *) malloc(index->capacity * sizeof(int));
+	index->keys = createPQExpBuffer();
+
+	if (index->hashes == NULL || index->offsets == NULL || index->keys == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	memset(index->offsets, -1, index->capacity * sizeof(int));
+
+	for (const char *line = contents; *line != '\0';)
+	{
+		const char *end = line;
+		bool inQuotes = false;
+		int len = 0;
+
+		/* find the end of the rule, and then the end of the line */
+		for (; *end != '\0' && *end != '\n'; end++)
+		{
+			if (*end == '"')
+			{
+				inQuotes = !inQuotes;
+			}
+			else if (*end == '#' && !inQuotes)
+			{
+				break;
+			}
+
+			if (!isspace((unsigned char) *end))
+			{
+				len = end - line + 1;
+			}
+		}
+
+		if (len > 0 && !hba_rule_index_add(index, line, len))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		line = strchr(end, '\n');
+
+		if (line == NULL)
+		{
+			break;
+		}
+
+		++line;
+	}
+
+	return true;
+}
+
+
+/*
+ * hba_rule_index_contains returns true when the given rule has been indexed.
+ */
+static bool
+hba_rule_index_contains(HBARuleIndex *index, const char *rule)
+{
+	int len = strlen(rule);
+	uint32_t hash = hba_rule_hash(rule, len);
+	uint32_t mask = index->capacity - 1;
+
+	for (uint32_t slot = hash & mask; index->offsets[slot] != -1;
+		 slot = (slot + 1) & mask)
+	{
+		const char *key = index->keys->data + index->offsets[slot];
+
+		if (index->hashes[slot] == hash && strcmp(key, rule) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * hba_rule_index_add adds the first len bytes of the given rule to the index,
+ * growing the index when it's half full.
+ */
+static bool
+hba_rule_index_add(HBARuleIndex *index, const char *rule, int len)
+{
+	if ((index->count + 1) * 2 > index->capacity)
+	{
+		HBARuleIndex newIndex = { 0 };
+
+		newIndex.capacity = index->capacity * 2;
+		newIndex.hashes = (uint32_t *) calloc(newIndex.capacity,
+											  sizeof(uint32_t));
+		newIndex.offsets = (int *) malloc(newIndex.capacity * sizeof(int));
+
+		if (newIndex.hashes == NULL || newIndex.offsets == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			free(newIndex.hashes);
+			free(newIndex.offsets);
+			return false;
+		}
+
+		memset(newIndex.offsets, -1, newIndex.capacity * sizeof(int));
+
+		uint32_t mask = newIndex.capacity - 1;
+
+		for (int i = 0; i < index->capacity; i++)
+		{
+			if (index->offsets[i] == -1)
+			{
+				continue;
+			}
+
+			uint32_t slot = index->hashes[i] & mask;
+
+			while (newIndex.offsets[slot] != -1)
+			{
+				slot = (slot + 1) & mask;
+			}
+
+			newIndex.hashes[slot] = index->hashes[i];
+			newIndex.offsets[slot] = index->offsets[i];
+		}
+
+		free(index->hashes);
+		free(index->offsets);
+
+		index->capacity = newIndex.capacity;
+		index->hashes = newIndex.hashes;
+		index->offsets = newIndex.offsets;
+	}
+
+	uint32_t hash = hba_rule_hash(rule, len);
+	uint32_t mask = index->capacity - 1;
+	uint32_t slot = hash & mask;
+
+	while (index->offsets[slot] != -1)
+	{
+		const char *key = index->keys->data + index->offsets[slot];
+
+		/* the same rule might be found several times in the HBA file */
+		if (index->hashes[slot] == hash &&
+			strncmp(key, rule, len) == 0 && key[len] == '\0')
+		{
+			return true;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	index->hashes[slot] = hash;
+	index->offsets[slot] = index->keys->len;
+	++index->count;
+
+	appendBinaryPQExpBuffer(index->keys, rule, len);
+	appendPQExpBufferChar(index->keys, '\0');
+
+	if (PQExpBufferBroken(index->keys))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * hba_rule_index_free releases the memory used by the index.
+ */
+static void
+hba_rule_index_free(HBARuleIndex *index)
+{
+	free(index->hashes);
+	free(index->offsets);
+	destroyPQExpBuffer(index->keys);
+
+	index->hashes = NULL;
+	index->offsets = NULL;
+	index->keys = NULL;
+}
+
+
+/*
+ * hba_rule_hash computes the FNV-1a hash of the first len bytes of a rule.
+ */
+static uint32_t
+hba_rule_hash(const char *rule, int len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) rule[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
 /*
  * append_database_field writes the database field to destination according to
  * the databaseType. If the type is HBA_DATABASE_DBNAME then the databaseName
@@ -739,8 +1045,8 @@ pghba_check_hostname(const char *hostname,
 
 	bool foundHostnameFromAddress = false;
 
-	if (!resolveHostnameForwardAndReverse(hostname, ipaddr, size,
-										  &foundHostnameFromAddress))
+	if (!dns_cache_resolve_forward_and_reverse(hostname, ipaddr, size,
+											 &foundHostnameFromAddress))
 	{
 		/* errors have already been logged (DNS failure) */
 		*useHostname = true;
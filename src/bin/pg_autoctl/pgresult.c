@@ -0,0 +1,273 @@
+/*
+ * src/bin/pg_autoctl/pgresult.c
+ *   Read the integer, boolean, LSN and floating point columns of a libpq
+ *   result, in either the text or the binary result format.
+ *
+ * In the binary format Postgres sends integers in network byte order, an
+ * LSN as an unsigned 64-bit integer, a boolean as a single byte and the
+ * floating point numbers as their IEEE 754 representation, also in network
+ * byte order. The text, varchar, name and enum columns are sent the same in
+ * both formats, PQgetvalue is good for them.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+
+#include "log.h"
+#include "parsing.h"
+#include "pgresult.h"
+#include "string_utils.h"
+
+static bool pgresult_is_binary(PGresult *result, int col);
+static uint64_t pgresult_read_uint64(const unsigned char *bytes, int length);
+static void pgresult_log_invalid(PGresult *result, int row, int col,
+								 const char *typname);
+
+
+/*
+ * pgresult_get_int64 reads a smallint, integer or bigint column.
+ */
+bool
+pgresult_get_int64(PGresult *result, int row, int col, int64_t *value)
+{
+	if (!pgresult_is_binary(result, col))
+	{
+		if (!stringToInt64(PQgetvalue(result, row, col), value))
+		{
+			(void) pgresult_log_invalid(result, row, col, "bigint");
+			return false;
+		}
+
+		return true;
+	}
+
+	const unsigned char *bytes =
+		(const unsigned char *) PQgetvalue(result, row, col);
+	int length = PQgetlength(result, row, col);
+
+	switch (length)
+	{
+		case 2:
+		{
+			*value = (int16_t) pgresult_read_uint64(bytes, length);
+			return true;
+		}
+
+		case 4:
+		{
+			*value = (int32_t) pgresult_read_uint64(bytes, length);
+			return true;
+		}
+
+		case 8:
+		{
+			*value = (int64_t) pgresult_read_uint64(bytes, length);
+			return true;
+		}
+
+		default:
+		{
+			(void) pgresult_log_invalid(result, row, col, "bigint");
+			return false;
+		}
+	}
+}
+
+
+/*
+ * pgresult_get_int reads a smallint or integer column, or a bigint column
+ * that holds a value in the int range.
+ */
+bool
+pgresult_get_int(PGresult *result, int row, int col, int *value)
+{
+	int64_t bigint = 0;
+
+	if (!pgresult_get_int64(result, row, col, &bigint))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (bigint < INT_MIN || bigint > INT_MAX)
+	{
+		(void) pgresult_log_invalid(result, row, col, "integer");
+		return false;
+	}
+
+	*value = (int) bigint;
+
+	return true;
+}
+
+
+/*
+ * pgresult_get_bool reads a boolean column.
+ */
+bool
+pgresult_get_bool(PGresult *result, int row, int col, bool *value)
+{
+	char *str = PQgetvalue(result, row, col);
+
+	if (pgresult_is_binary(result, col))
+	{
+		if (PQgetlength(result, row, col) != 1)
+		{
+			(void) pgresult_log_invalid(result, row, col, "boolean");
+			return false;
+		}
+
+		*value = *str != 0;
+
+		return true;
+	}
+
+	if (strcmp(str, "t") != 0 && strcmp(str, "f") != 0)
+	{
+		(void) pgresult_log_invalid(result, row, col, "boolean");
+		return false;
+	}
+
+	*value = *str == 't';
+
+	return true;
+}
+
+
+/*
+ * pgresult_get_lsn reads a pg_lsn column.
+ */
+bool
+pgresult_get_lsn(PGresult *result, int row, int col, uint64_t *value)
+{
+	if (!pgresult_is_binary(result, col))
+	{
+		if (!parseLSN(PQgetvalue(result, row, col), value))
+		{
+			(void) pgresult_log_invalid(result, row, col, "pg_lsn");
+			return false;
+		}
+
+		return true;
+	}
+
+	if (PQgetlength(result, row, col) != 8)
+	{
+		(void) pgresult_log_invalid(result, row, col, "pg_lsn");
+		return false;
+	}
+
+	*value = pgresult_read_uint64(
+		(const unsigned char *) PQgetvalue(result, row, col), 8);
+
+	return true;
+}
+
+
+/*
+ * pgresult_get_double reads a double precision or real column, and in the
+ * text format also a numeric column. Postgres has no simple binary format
+ * for numeric, cast those to float8 in the query.
+ */
+bool
+pgresult_get_double(PGresult *result, int row, int col, double *value)
+{
+	if (!pgresult_is_binary(result, col))
+	{
+		if (!stringToDouble(PQgetvalue(result, row, col), value))
+		{
+			(void) pgresult_log_invalid(result, row, col, "double precision");
+			return false;
+		}
+
+		return true;
+	}
+
+	const unsigned char *bytes =
+		(const unsigned char *) PQgetvalue(result, row, col);
+	int length = PQgetlength(result, row, col);
+
+	if (length == 8)
+	{
+		uint64_t bits = pgresult_read_uint64(bytes, length);
+
+		memcpy(value, &bits, sizeof(double));
+
+		return true;
+	}
+	else if (length == 4)
+	{
+		uint32_t bits = (uint32_t) pgresult_read_uint64(bytes, length);
+		float real = 0;
+
+		memcpy(&real, &bits, sizeof(float));
+		*value = real;
+
+		return true;
+	}
+
+	(void) pgresult_log_invalid(result, row, col, "double precision");
+
+	return false;
+}
+
+
+/*
+ * pgresult_is_binary returns true when the given column has been sent in the
+ * binary format.
+ */
+static bool
+pgresult_is_binary(PGresult *result, int col)
+{
+	return PQfformat(result, col) == 1;
+}
+
+
+/*
+ * pgresult_read_uint64 reads an unsigned integer of the given length in
+ * bytes, in network byte order.
+ */
+static uint64_t
+pgresult_read_uint64(const unsigned char *bytes, int length)
+{
+	uint64_t value = 0;
+
+	for (int i = 0; i < length; i++)
+	{
+		value = (value << 8) | bytes[i];
+	}
+
+	return value;
+}
+
+
+/*
+ * pgresult_log_invalid logs an error about a value we failed to read.
+ */
+static void
+pgresult_log_invalid(PGresult *result, int row, int col, const char *typname)
+{
+	if (pgresult_is_binary(result, col))
+	{
+		log_error("Invalid %s value of %d bytes in column \"%s\" of row %d "
+				  "returned by the server",
+				  typname, PQgetlength(result, row, col),
+				  PQfname(result, col), row);
+	}
+	else
+	{
+		log_error("Invalid %s value \"%s\" in column \"%s\" of row %d "
+				  "returned by the server",
+				  typname, PQgetvalue(result, row, col),
+				  PQfname(result, col), row);
+	}
+}
@@ -0,0 +1,24 @@
+/*
+ * src/bin/pg_autoctl/pgresult.h
+ *   Read the integer, boolean, LSN and floating point columns of a libpq
+ *   result, in either the text or the binary result format.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef PGRESULT_H
+#define PGRESULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libpq-fe.h"
+
+bool pgresult_get_int64(PGresult *result, int row, int col, int64_t *value);
+bool pgresult_get_int(PGresult *result, int row, int col, int *value);
+bool pgresult_get_bool(PGresult *result, int row, int col, bool *value);
+bool pgresult_get_lsn(PGresult *result, int row, int col, uint64_t *value);
+bool pgresult_get_double(PGresult *result, int row, int col, double *value);
+
+#endif /* PGRESULT_H */
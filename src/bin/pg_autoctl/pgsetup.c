@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,6 +35,7 @@
 
 static bool get_pgpid(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk);
 static PostmasterStatus pmStatusFromString(const char *postmasterStatus);
+static bool pg_setup_child_has_exited(pid_t childPid);
 
 
 /*
@@ -1017,6 +1019,61 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 }
 
 
+/*
+ * pg_setup_is_starting returns true when the postmaster.pid file has a
+ * "starting" status in it, as when Postgres replays WAL in crash recovery.
+ * Unlike pg_setup_is_ready, it doesn't wait for Postgres to be ready.
+ */
+bool
+pg_setup_is_starting(PostgresSetup *pgSetup)
+{
+	bool pgIsNotRunningIsOk = true;
+	int maxRetries = 0;
+
+	if (!get_pgpid(pgSetup, pgIsNotRunningIsOk) || pgSetup->pidFile.pid <= 0)
+	{
+		return false;
+	}
+
+	/* the status line might not have been written yet */
+	pgSetup->pm_status = POSTMASTER_STATUS_UNKNOWN;
+
+	if (!read_pg_pidfile(pgSetup, pgIsNotRunningIsOk, maxRetries))
+	{
+		return false;
+	}
+
+	return pgSetup->pm_status == POSTMASTER_STATUS_STARTING;
+}
+
+
+/*
+ * pg_setup_is_ready_now returns true when the postmaster.pid file has a
+ * "ready" status in it. Unlike pg_setup_is_ready, it doesn't wait, so that
+ * it can be used from a loop that has other things to do.
+ */
+bool
+pg_setup_is_ready_now(PostgresSetup *pgSetup)
+{
+	bool pgIsNotRunningIsOk = true;
+	int maxRetries = 0;
+
+	if (!get_pgpid(pgSetup, pgIsNotRunningIsOk) || pgSetup->pidFile.pid <= 0)
+	{
+		return false;
+	}
+
+	pgSetup->pm_status = POSTMASTER_STATUS_UNKNOWN;
+
+	if (!read_pg_pidfile(pgSetup, pgIsNotRunningIsOk, maxRetries))
+	{
+		return false;
+	}
+
+	return pgSetup->pm_status == POSTMASTER_STATUS_READY;
+}
+
+
 /*
  * pg_setup_wait_until_is_ready loops over pg_setup_is_running() and returns
  * when Postgres is ready. The loop tries every 100ms up to the given timeout,
@@ -1024,6 +1081,21 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
  */
 bool
 pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
+{
+	return pg_setup_wait_until_child_is_ready(pgSetup, 0, timeout, logLevel);
+}
+
+
+/*
+ * pg_setup_wait_until_child_is_ready is pg_setup_wait_until_is_ready for a
+ * Postgres that runs as our child process with the given pid: when the child
+ * exits before being ready, for instance because the shared memory of a
+ * crashed postmaster is still in use, we return false right away rather than
+ * waiting until the timeout. The child process is reaped here in that case.
+ */
+bool
+pg_setup_wait_until_child_is_ready(PostgresSetup *pgSetup, pid_t childPid,
+								   int timeout, int logLevel)
 {
 	uint64_t startTime = time(NULL);
 	int attempts = 0;
@@ -1044,6 +1116,11 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 		/* sleep 100 ms in between postmaster.pid probes */
 		pg_usleep(100 * 1000);
 
+		if (pg_setup_child_has_exited(childPid))
+		{
+			return false;
+		}
+
 		pgIsRunning = get_pgpid(pgSetup, postgresNotRunningIsOk) &&
 					  pgSetup->pidFile.pid > 0;
 
@@ -1104,6 +1181,11 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 	{
 		uint64_t now = time(NULL);
 
+		if (pg_setup_child_has_exited(childPid))
+		{
+			return false;
+		}
+
 		pgIsReady = pg_setup_is_ready(pgSetup, postgresNotRunningIsOk);
 
 		/* let's not be THAT verbose about it */
@@ -1149,6 +1231,36 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 }
 
 
+/*
+ * pg_setup_child_has_exited returns true when the given child process has
+ * exited, and logs how it did. A zero childPid is never considered exited.
+ */
+static bool
+pg_setup_child_has_exited(pid_t childPid)
+{
+	int status = 0;
+
+	if (childPid <= 0 || waitpid(childPid, &status, WNOHANG) != childPid)
+	{
+		return false;
+	}
+
+	if (WIFSIGNALED(status))
+	{
+		log_warn("Postgres pid %d was terminated by signal %s "
+				 "before being ready",
+				 childPid, signal_to_string(WTERMSIG(status)));
+	}
+	else
+	{
+		log_warn("Postgres pid %d exited with code %d before being ready",
+				 childPid, WEXITSTATUS(status));
+	}
+
+	return true;
+}
+
+
 /*
  * pg_setup_wait_until_is_stopped loops over pg_ctl_status() and returns when
  * Postgres is stopped. The loop tries every 100ms up to the given timeout,
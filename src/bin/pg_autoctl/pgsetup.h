@@ -217,6 +217,7 @@ typedef struct pg_setup
 	NodeReplicationSettings settings;       /* node replication settings */
 	SSLOptions ssl;                         /* ssl options */
 	char citusClusterName[NAMEDATALEN];     /* citus.cluster_name */
+	char tuningProfile[NAMEDATALEN];        /* oltp, mixed, analytics... */
 } PostgresSetup;
 
 #define IS_EMPTY_STRING_BUFFER(strbuf) (strbuf[0] == '\0')
@@ -239,8 +240,12 @@ bool pg_setup_pgdata_exists(PostgresSetup *pgSetup);
 bool pg_setup_is_running(PostgresSetup *pgSetup);
 PostgresRole pg_setup_role(PostgresSetup *pgSetup);
 bool pg_setup_is_ready(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok);
+bool pg_setup_is_starting(PostgresSetup *pgSetup);
+bool pg_setup_is_ready_now(PostgresSetup *pgSetup);
 bool pg_setup_wait_until_is_ready(PostgresSetup *pgSetup,
 								  int timeout, int logLevel);
+bool pg_setup_wait_until_child_is_ready(PostgresSetup *pgSetup, pid_t childPid,
+										int timeout, int logLevel);
 bool pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup,
 									int timeout, int logLevel);
 char * pmStatusToString(PostmasterStatus pm_status);
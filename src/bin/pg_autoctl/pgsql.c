@@ -7,6 +7,7 @@
  *
  */
 #include <stdlib.h>
+#include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -36,15 +37,82 @@
 #define STR_ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE "55000"
 #define STR_ERRCODE_OBJECT_IN_USE "55006"
 #define STR_ERRCODE_UNDEFINED_OBJECT "42704"
+#define STR_ERRCODE_FEATURE_NOT_SUPPORTED "0A000"
+#define STR_ERRCODE_QUERY_CANCELED "57014"
+#define STR_ERRCODE_LOCK_NOT_AVAILABLE "55P03"
+#define STR_ERRCODE_CONFIGURATION_LIMIT_EXCEEDED "53400"
+
+/*
+ * The connections to the monitor of a process share a circuit breaker per
+ * monitor connection string. After MONITOR_CIRCUIT_BREAKER_FAILURES failed
+ * connections in a row the circuit is open, and we don't try to connect
+ * anymore until the open time has passed. The next connection attempt is
+ * then a probe (half-open): when it succeeds the circuit is closed again,
+ * otherwise it opens again for a longer time.
+ *
+ * The open time uses decorrelated jitter, so that when the monitor comes
+ * back the nodes of the fleet reconnect at different times instead of all
+ * at once.
+ */
+typedef enum
+{
+	CIRCUIT_CLOSED = 0,
+	CIRCUIT_OPEN,
+	CIRCUIT_HALF_OPEN
+} CircuitState;
+
+typedef struct CircuitBreaker
+{
+	char connectionString[MAXCONNINFO];
+	CircuitState state;
+	int failures;               /* failed connections in a row */
+	int openTime;               /* in milliseconds, last open time */
+	double openUntil;           /* in milliseconds, see INSTR_TIME_GET_MILLISEC */
+} CircuitBreaker;
+
+#define CIRCUIT_BREAKER_MAX_COUNT 8
+
+static CircuitBreaker circuitBreakers[CIRCUIT_BREAKER_MAX_COUNT] = { 0 };
+static int circuitBreakersCount = 0;
+
+#if PG_MAJORVERSION_NUM >= 15
+static pg_prng_state circuitBreakerPrngState;
+#endif
 
 static char * ConnectionTypeToString(ConnectionType connectionType);
 static void log_connection_error(PGconn *connection, int logLevel);
 static void pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message);
 static void pgAutoCtlDebugNoticeProcessor(void *arg, const char *message);
 static PGconn * pgsql_open_connection(PGSQL *pgsql);
+static PGconn * pgsql_connectdb(PGSQL *pgsql);
 static bool pgsql_retry_open_connection(PGSQL *pgsql);
+static CircuitBreaker * pgsql_circuit_breaker(PGSQL *pgsql);
+static int pgsql_circuit_breaker_wait_time(CircuitBreaker *breaker);
+static void pgsql_circuit_breaker_report(CircuitBreaker *breaker, bool success);
 static bool is_response_ok(PGresult *result);
+static bool is_partial_result(PGresult *result);
+static void pgsql_format_params(int paramCount, const char **paramValues,
+								char *buffer, int size);
+static void pgsql_log_result_error(PGSQL *pgsql, PGresult *result,
+								   const char *sql,
+								   const char *debugParameters,
+								   void *context);
+static PreparedStatement * pgsql_lookup_prepared_statement(PGSQL *pgsql,
+														   const char *sql,
+														   int paramCount,
+														   const Oid *paramTypes,
+														   bool prepareNow);
+static bool pgsql_statement_is_cacheable(const char *sql);
+static void pgsql_forget_prepared_statement(PreparedStatement *statement);
+static void pgsql_clear_prepared_statements(PGSQL *pgsql);
 static bool clear_results(PGSQL *pgsql);
+static bool pgsql_execute_with_result_format(PGSQL *pgsql, const char *sql,
+											 int paramCount,
+											 const Oid *paramTypes,
+											 const char **paramValues,
+											 int resultFormat,
+											 void *context,
+											 ParsePostgresResultCB *parseFun);
 static void pgsql_handle_notifications(PGSQL *pgsql);
 static bool pgsql_alter_system_set(PGSQL *pgsql, GUC setting);
 static bool pgsql_get_current_setting(PGSQL *pgsql, char *settingName,
@@ -55,6 +123,16 @@ static void parseReplicationSlotMaintain(void *ctx, PGresult *result);
 static void parsePgReachedTargetLSN(void *ctx, PGresult *result);
 static void parseIdentifySystemResult(void *ctx, PGresult *result);
 static void parseTimelineHistoryResult(void *ctx, PGresult *result);
+static bool scanTimeLineHistoryEntry(const char *ptr, const char *lineEnd,
+									 TimeLineHistoryEntry *entry);
+static bool scanUnsignedNumber(const char **ptr, const char *end, int base,
+							   uint64_t *number);
+static TimeLineHistoryEntry * timelineHistoryAppend(TimeLineHistory *timelines);
+static void parseStandbyReplicationArrays(void *ctx, PGresult *result);
+static void parseSyncRepStatus(void *ctx, PGresult *result);
+static void parseWalReceiverStatus(void *ctx, PGresult *result);
+static void parseLogicalSlotArray(void *ctx, PGresult *result);
+static bool pgsql_is_simple_name(const char *name);
 
 
 /*
@@ -151,6 +229,8 @@ pgsql_init(PGSQL *pgsql, char *url, ConnectionType connectionType)
 {
 	pgsql->connectionType = connectionType;
 	pgsql->connection = NULL;
+	pgsql->pendingQuery = NULL;
+	memset(&(pgsql->preparedStatements), 0, sizeof(PreparedStatementCache));
 
 	/* set our default retry policy for interactive commands */
 	(void) pgsql_set_interactive_retry_policy(&(pgsql->retryPolicy));
@@ -461,6 +541,9 @@ pgsql_finish(PGSQL *pgsql)
 				  scrubbedConnectionString);
 		PQfinish(pgsql->connection);
 		pgsql->connection = NULL;
+		pgsql->pendingQuery = NULL;
+
+		(void) pgsql_clear_prepared_statements(pgsql);
 
 		/*
 		 * When we fail to connect, on the way out we call pgsql_finish to
@@ -507,6 +590,60 @@ log_connection_error(PGconn *connection, int logLevel)
 }
 
 
+/*
+ * pgsql_connectdb connects to the given connection string. Connections to the
+ * monitor and to the other nodes of the group use TCP keepalives and a TCP
+ * user timeout, so that a network partition breaks them in a bounded time
+ * instead of having the keeper wait on a dead connection. The connection
+ * string is processed last, so that it can still override those settings.
+ */
+static PGconn *
+pgsql_connectdb(PGSQL *pgsql)
+{
+	switch (pgsql->connectionType)
+	{
+		case PGSQL_CONN_MONITOR:
+		case PGSQL_CONN_COORDINATOR:
+		case PGSQL_CONN_UPSTREAM:
+		{
+			const char *keywords[] = {
+				"keepalives",
+				"keepalives_idle",
+				"keepalives_interval",
+				"keepalives_count",
+#if PG_MAJORVERSION_NUM >= 12
+				"tcp_user_timeout",
+#endif
+				"dbname",
+				NULL
+			};
+
+			const char *values[] = {
+				"1",
+				POSTGRES_KEEPALIVES_IDLE,
+				POSTGRES_KEEPALIVES_INTERVAL,
+				POSTGRES_KEEPALIVES_COUNT,
+#if PG_MAJORVERSION_NUM >= 12
+				POSTGRES_TCP_USER_TIMEOUT,
+#endif
+				pgsql->connectionString,
+				NULL
+			};
+
+			return PQconnectdbParams(keywords, values, 1);
+		}
+
+		/* local connections use a Unix socket, apps have their own settings */
+		case PGSQL_CONN_LOCAL:
+		case PGSQL_CONN_APP:
+		default:
+		{
+			return PQconnectdb(pgsql->connectionString);
+		}
+	}
+}
+
+
 /*
  * pgsql_open_connection opens a PostgreSQL connection, given a PGSQL client
  * instance. If a connection is already open in the client (it's not NULL),
@@ -515,6 +652,24 @@ log_connection_error(PGconn *connection, int logLevel)
 static PGconn *
 pgsql_open_connection(PGSQL *pgsql)
 {
+	/*
+	 * Nobody is going to read the results of the query we sent with
+	 * pgsql_send_with_params() anymore, as we are about to run another query
+	 * on this connection: skip them.
+	 */
+	if (pgsql->connection != NULL && pgsql->pendingQuery != NULL)
+	{
+		log_debug("Skipping the results of a query sent to [%s]: %s",
+				  ConnectionTypeToString(pgsql->connectionType),
+				  pgsql->pendingQuery);
+
+		pgsql->pendingQuery = NULL;
+		(void) clear_results(pgsql);
+	}
+
+	/* only the error of the query we are about to run may ask us to wait */
+	pgsql->retryAfterMs = 0;
+
 	/* we might be connected already */
 	if (pgsql->connection != NULL)
 	{
@@ -525,7 +680,30 @@ pgsql_open_connection(PGSQL *pgsql)
 			pgsql_finish(pgsql);
 			return NULL;
 		}
-		return pgsql->connection;
+
+		/*
+		 * An idle connection kept open between queries might have been
+		 * closed by the server in the meantime, for instance when Postgres
+		 * has been restarted. Reading from the socket without blocking is
+		 * enough to notice, and then we connect again.
+		 */
+		if (PQtransactionStatus(pgsql->connection) == PQTRANS_IDLE &&
+			(PQconsumeInput(pgsql->connection) == 0 ||
+			 PQstatus(pgsql->connection) != CONNECTION_OK))
+		{
+			log_debug("Connection to [%s] was closed by the server, "
+					  "connecting again",
+					  ConnectionTypeToString(pgsql->connectionType));
+
+			PQfinish(pgsql->connection);
+			pgsql->connection = NULL;
+
+			(void) pgsql_clear_prepared_statements(pgsql);
+		}
+		else
+		{
+			return pgsql->connection;
+		}
 	}
 
 	char scrubbedConnectionString[MAXCONNINFO] = { 0 };
@@ -533,6 +711,45 @@ pgsql_open_connection(PGSQL *pgsql)
 	(void) parse_and_scrub_connection_string(pgsql->connectionString,
 											 scrubbedConnectionString);
 
+	/*
+	 * When the circuit breaker for this monitor is open, we fail right away
+	 * when we are not meant to retry, such as in the keeper main loop. When
+	 * we are meant to retry, we wait until the circuit breaker lets us probe
+	 * the monitor again, as the other connections of this process do.
+	 */
+	CircuitBreaker *breaker = pgsql_circuit_breaker(pgsql);
+	int waitTime = pgsql_circuit_breaker_wait_time(breaker);
+
+	if (waitTime > 0)
+	{
+		if (pgsql->retryPolicy.maxR == 0)
+		{
+			log_debug("Skipping connection to [%s] \"%s\": the monitor "
+					  "failed %d times in a row, next attempt in %d ms",
+					  ConnectionTypeToString(pgsql->connectionType),
+					  scrubbedConnectionString,
+					  breaker->failures,
+					  waitTime);
+
+			pgsql->status = PG_CONNECTION_BAD;
+			return NULL;
+		}
+
+		log_debug("Waiting %d ms before connecting to [%s] \"%s\"",
+				  waitTime,
+				  ConnectionTypeToString(pgsql->connectionType),
+				  scrubbedConnectionString);
+
+		/* we have milliseconds, pg_usleep() wants microseconds */
+		(void) pg_usleep(waitTime * 1000);
+	}
+
+	/* this connection attempt is a probe when the circuit breaker is open */
+	if (breaker != NULL && breaker->state == CIRCUIT_OPEN)
+	{
+		breaker->state = CIRCUIT_HALF_OPEN;
+	}
+
 	log_debug("Connecting to [%s] \"%s\"",
 			  ConnectionTypeToString(pgsql->connectionType),
 			  scrubbedConnectionString);
@@ -545,7 +762,7 @@ pgsql_open_connection(PGSQL *pgsql)
 	INSTR_TIME_SET_ZERO(pgsql->retryPolicy.connectTime);
 
 	/* Make a connection to the database */
-	pgsql->connection = PQconnectdb(pgsql->connectionString);
+	pgsql->connection = pgsql_connectdb(pgsql);
 
 	/* Check to see that the backend connection was successfully made */
 	if (PQstatus(pgsql->connection) != CONNECTION_OK)
@@ -570,6 +787,8 @@ pgsql_open_connection(PGSQL *pgsql)
 			pgsql->status = PG_CONNECTION_BAD;
 
 			pgsql_finish(pgsql);
+			(void) pgsql_circuit_breaker_report(breaker, false);
+
 			return NULL;
 		}
 
@@ -580,6 +799,8 @@ pgsql_open_connection(PGSQL *pgsql)
 		if (!pgsql_retry_open_connection(pgsql))
 		{
 			/* errors have already been logged */
+			(void) pgsql_circuit_breaker_report(breaker, false);
+
 			return NULL;
 		}
 	}
@@ -587,6 +808,8 @@ pgsql_open_connection(PGSQL *pgsql)
 	INSTR_TIME_SET_CURRENT(pgsql->retryPolicy.connectTime);
 	pgsql->status = PG_CONNECTION_OK;
 
+	(void) pgsql_circuit_breaker_report(breaker, true);
+
 	/* set the libpq notice receiver to integrate notifications as warnings. */
 	PQsetNoticeProcessor(pgsql->connection,
 						 &pgAutoCtlDefaultNoticeProcessor,
@@ -596,6 +819,152 @@ pgsql_open_connection(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_circuit_breaker returns the circuit breaker to use for the given
+ * connection: only the connections to a monitor use one, shared by all the
+ * connections of this process to the same monitor connection string.
+ */
+static CircuitBreaker *
+pgsql_circuit_breaker(PGSQL *pgsql)
+{
+	if (pgsql->connectionType != PGSQL_CONN_MONITOR)
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < circuitBreakersCount; i++)
+	{
+		if (strcmp(circuitBreakers[i].connectionString,
+				   pgsql->connectionString) == 0)
+		{
+			return &(circuitBreakers[i]);
+		}
+	}
+
+	if (circuitBreakersCount == CIRCUIT_BREAKER_MAX_COUNT)
+	{
+		/* that's a lot of monitors, just don't use a circuit breaker then */
+		return NULL;
+	}
+
+	if (circuitBreakersCount == 0)
+	{
+#if PG_MAJORVERSION_NUM < 15
+		pg_srand48(getpid() ^ time(NULL));
+#else
+		pg_prng_seed(&circuitBreakerPrngState,
+					 (uint64) (getpid() ^ time(NULL)));
+#endif
+	}
+
+	CircuitBreaker *breaker = &(circuitBreakers[circuitBreakersCount++]);
+
+	strlcpy(breaker->connectionString, pgsql->connectionString, MAXCONNINFO);
+
+	return breaker;
+}
+
+
+/*
+ * pgsql_circuit_breaker_wait_time returns how many milliseconds to wait until
+ * the given circuit breaker lets us connect again, and zero when we may
+ * connect now. When the open time has passed, the next connection attempt
+ * is a probe, and its outcome is reported with pgsql_circuit_breaker_report.
+ */
+static int
+pgsql_circuit_breaker_wait_time(CircuitBreaker *breaker)
+{
+	if (breaker == NULL || breaker->state != CIRCUIT_OPEN)
+	{
+		return 0;
+	}
+
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	int waitTime = (int) (breaker->openUntil - INSTR_TIME_GET_MILLISEC(now));
+
+	return waitTime > 0 ? waitTime : 0;
+}
+
+
+/*
+ * pgsql_circuit_breaker_report registers the outcome of a connection attempt
+ * to a monitor, and opens or closes the circuit breaker.
+ */
+static void
+pgsql_circuit_breaker_report(CircuitBreaker *breaker, bool success)
+{
+	if (breaker == NULL)
+	{
+		return;
+	}
+
+	if (success)
+	{
+		if (breaker->state != CIRCUIT_CLOSED)
+		{
+			log_info("Connected to the monitor again after %d failed "
+					 "attempts",
+					 breaker->failures);
+		}
+
+		breaker->state = CIRCUIT_CLOSED;
+		breaker->failures = 0;
+		breaker->openTime = 0;
+
+		return;
+	}
+
+	++breaker->failures;
+
+	/* a failed probe opens the circuit again, as do too many failures */
+	if (breaker->state != CIRCUIT_HALF_OPEN &&
+		breaker->failures < MONITOR_CIRCUIT_BREAKER_FAILURES)
+	{
+		return;
+	}
+
+#if PG_MAJORVERSION_NUM < 15
+	long random = pg_lrand48();
+#else
+	uint32_t random = pg_prng_uint32(&circuitBreakerPrngState);
+#endif
+
+	/* decorrelated jitter, see pgsql_compute_connection_retry_sleep_time */
+	int previous = Max(breaker->openTime, MONITOR_CIRCUIT_BREAKER_BASE_TIME);
+	int openTime = random_between(random,
+								  MONITOR_CIRCUIT_BREAKER_BASE_TIME,
+								  previous * 3);
+
+	breaker->openTime = min(MONITOR_CIRCUIT_BREAKER_CAP_TIME, openTime);
+
+	if (breaker->state == CIRCUIT_CLOSED)
+	{
+		log_warn("Failed to connect to the monitor %d times in a row, "
+				 "next attempt in %d ms",
+				 breaker->failures,
+				 breaker->openTime);
+	}
+	else
+	{
+		log_debug("Failed to connect to the monitor %d times in a row, "
+				  "next attempt in %d ms",
+				  breaker->failures,
+				  breaker->openTime);
+	}
+
+	breaker->state = CIRCUIT_OPEN;
+
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	breaker->openUntil = INSTR_TIME_GET_MILLISEC(now) + breaker->openTime;
+}
+
+
 /*
  * Refrain from warning too often. The user certainly wants to know that we are
  * still trying to connect, though warning several times a second is not going
@@ -694,7 +1063,7 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 				 * PQping does not check authentication, so we might still fail
 				 * to connect to the server.
 				 */
-				pgsql->connection = PQconnectdb(pgsql->connectionString);
+				pgsql->connection = pgsql_connectdb(pgsql);
 
 				if (PQstatus(pgsql->connection) == CONNECTION_OK)
 				{
@@ -1018,6 +1387,41 @@ bool
 pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 						  const Oid *paramTypes, const char **paramValues,
 						  void *context, ParsePostgresResultCB *parseFun)
+{
+	return pgsql_execute_with_result_format(pgsql, sql,
+											paramCount, paramTypes, paramValues,
+											PGSQL_RESULT_FORMAT_TEXT,
+											context, parseFun);
+}
+
+
+/*
+ * pgsql_execute_with_params_binary is pgsql_execute_with_params with the
+ * results sent in the binary format, which saves the server from printing
+ * the integers and LSNs and us from parsing them again. The parseFun must
+ * then use the pgresult.h helpers to read the non-text columns.
+ */
+bool
+pgsql_execute_with_params_binary(PGSQL *pgsql, const char *sql, int paramCount,
+								 const Oid *paramTypes, const char **paramValues,
+								 void *context, ParsePostgresResultCB *parseFun)
+{
+	return pgsql_execute_with_result_format(pgsql, sql,
+											paramCount, paramTypes, paramValues,
+											PGSQL_RESULT_FORMAT_BINARY,
+											context, parseFun);
+}
+
+
+/*
+ * pgsql_execute_with_result_format implements pgsql_execute_with_params with
+ * the given libpq resultFormat, 0 for text and 1 for binary.
+ */
+static bool
+pgsql_execute_with_result_format(PGSQL *pgsql, const char *sql, int paramCount,
+								 const Oid *paramTypes, const char **paramValues,
+								 int resultFormat,
+								 void *context, ParsePostgresResultCB *parseFun)
 {
 	char debugParameters[BUFSIZE] = { 0 };
 	PGresult *result = NULL;
@@ -1033,103 +1437,64 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 	if (paramCount > 0)
 	{
-		int paramIndex = 0;
-		int remainingBytes = BUFSIZE;
-		char *writePointer = (char *) debugParameters;
+		(void) pgsql_format_params(paramCount, paramValues,
+								   debugParameters, sizeof(debugParameters));
+		log_debug("%s", debugParameters);
+	}
+
+	PreparedStatement *statement =
+		pgsql_lookup_prepared_statement(pgsql, sql, paramCount, paramTypes,
+										false);
+
+	if (statement != NULL)
+	{
+		result = PQexecPrepared(connection, statement->name,
+								paramCount, paramValues, NULL, NULL,
+								resultFormat);
 
-		for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+		/*
+		 * A prepared statement can't be used anymore when the result type of
+		 * its query changed, for instance after an extension update on the
+		 * monitor. Forget about it and run the query as usual.
+		 */
+		if (PQresultStatus(result) == PGRES_FATAL_ERROR &&
+			PQtransactionStatus(connection) == PQTRANS_IDLE)
 		{
-			int bytesWritten = 0;
-			const char *value = paramValues[paramIndex];
+			char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
 
-			if (paramIndex > 0)
+			if (sqlstate != NULL &&
+				strcmp(sqlstate, STR_ERRCODE_FEATURE_NOT_SUPPORTED) == 0)
 			{
-				bytesWritten = sformat(writePointer, remainingBytes, ", ");
-				remainingBytes -= bytesWritten;
-				writePointer += bytesWritten;
-			}
+				log_debug("Forgetting prepared statement \"%s\": %s",
+						  statement->name, PQerrorMessage(connection));
 
-			if (value == NULL)
-			{
-				bytesWritten = sformat(writePointer, remainingBytes, "NULL");
-			}
-			else
-			{
-				bytesWritten =
-					sformat(writePointer, remainingBytes, "'%s'", value);
+				(void) pgsql_forget_prepared_statement(statement);
+
+				PQclear(result);
+				clear_results(pgsql);
+
+				result = PQexecParams(connection, sql,
+									  paramCount, paramTypes, paramValues,
+									  NULL, NULL, resultFormat);
 			}
-			remainingBytes -= bytesWritten;
-			writePointer += bytesWritten;
 		}
-		log_debug("%s", debugParameters);
 	}
-
-	if (paramCount == 0)
+	else if (paramCount == 0 && resultFormat == PGSQL_RESULT_FORMAT_TEXT)
 	{
+		/* PQexec allows several statements, PQexecParams does not */
 		result = PQexec(connection, sql);
 	}
 	else
 	{
 		result = PQexecParams(connection, sql,
 							  paramCount, paramTypes, paramValues,
-							  NULL, NULL, 0);
+							  NULL, NULL, resultFormat);
 	}
 
 	if (!is_response_ok(result))
 	{
-		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
-		char *message = PQerrorMessage(connection);
-		char *errorLines[BUFSIZE];
-		int lineCount = splitLines(message, errorLines, BUFSIZE);
-		int lineNumber = 0;
-
-		char *prefix =
-			pgsql->connectionType == PGSQL_CONN_MONITOR ? "Monitor" : "Postgres";
-
-		/*
-		 * PostgreSQL Error message might contain several lines. Log each of
-		 * them as a separate ERROR line here.
-		 */
-		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
-		{
-			log_error("%s %s", prefix, errorLines[lineNumber]);
-		}
-
-		/*
-		 * The monitor uses those error codes in situations we know how to
-		 * handle, so if we have one of those, it's not a client-side error
-		 * with a badly formed SQL query etc.
-		 */
-		if (pgsql->connectionType == PGSQL_CONN_MONITOR &&
-			sqlstate != NULL &&
-			!(strcmp(sqlstate, STR_ERRCODE_INVALID_OBJECT_DEFINITION) == 0 ||
-			  strcmp(sqlstate, STR_ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE) == 0 ||
-			  strcmp(sqlstate, STR_ERRCODE_OBJECT_IN_USE) == 0 ||
-			  strcmp(sqlstate, STR_ERRCODE_UNDEFINED_OBJECT) == 0))
-		{
-			log_error("SQL query: %s", sql);
-			log_error("SQL params: %s", debugParameters);
-		}
-		else
-		{
-			log_debug("SQL query: %s", sql);
-			log_debug("SQL params: %s", debugParameters);
-		}
-
-		/* now stash away the SQL STATE if any */
-		if (context && sqlstate)
-		{
-			AbstractResultContext *ctx = (AbstractResultContext *) context;
-
-			strlcpy(ctx->sqlstate, sqlstate, SQLSTATE_LENGTH);
-		}
-
-		/* if we get a connection exception, track that */
-		if (sqlstate &&
-			strncmp(sqlstate, STR_ERRCODE_CLASS_CONNECTION_EXCEPTION, 2) == 0)
-		{
-			pgsql->status = PG_CONNECTION_BAD;
-		}
+		(void) pgsql_log_result_error(pgsql, result, sql, debugParameters,
+									  context);
 
 		PQclear(result);
 		clear_results(pgsql);
@@ -1165,65 +1530,1891 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 
 /*
- * is_response_ok returns whether the query result is a correct response
- * (not an error or failure).
+ * pgsql_execute_single_row runs the given SQL query in the libpq single-row
+ * mode, and calls rowFun with the rows of the result set as soon as they have
+ * been received. This allows processing a large result set without ever
+ * having it all in memory at once.
+ *
+ * With libpq 17 and later, we use the chunked mode instead, so that rowFun is
+ * called with up to PGSQL_RESULT_CHUNK_SIZE rows at a time, which costs less
+ * than a PGresult per row. The rowFun callbacks must then loop over all the
+ * rows of the result they are given.
+ *
+ * When the query fails after some rows have been sent, rowFun has already
+ * been called for those rows.
  */
-static bool
-is_response_ok(PGresult *result)
+bool
+pgsql_execute_single_row(PGSQL *pgsql, const char *sql, int paramCount,
+						 const Oid *paramTypes, const char **paramValues,
+						 void *context, ParsePostgresResultCB *rowFun)
 {
-	ExecStatusType resultStatus = PQresultStatus(result);
+	char debugParameters[BUFSIZE] = { 0 };
+	bool success = true;
 
-	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
-		   resultStatus == PGRES_COMMAND_OK;
-}
+	PGconn *connection = pgsql_open_connection(pgsql);
 
+	if (connection == NULL)
+	{
+		return false;
+	}
 
-/*
- * clear_results consumes results on a connection until NULL is returned.
- * If an error is returned it returns false.
- */
-static bool
-clear_results(PGSQL *pgsql)
-{
-	PGconn *connection = pgsql->connection;
+	log_debug("%s;", sql);
 
-	/*
-	 * Per Postgres documentation: You should, however, remember to check
-	 * PQnotifies after each PQgetResult or PQexec, to see if any
-	 * notifications came in during the processing of the command.
-	 *
-	 * Before calling clear_results(), we called PQexecParams().
-	 */
-	(void) pgsql_handle_notifications(pgsql);
+	if (paramCount > 0)
+	{
+		(void) pgsql_format_params(paramCount, paramValues,
+								   debugParameters, sizeof(debugParameters));
+		log_debug("%s", debugParameters);
+	}
 
-	while (true)
+	if (PQsendQueryParams(connection, sql,
+						  paramCount, paramTypes, paramValues,
+						  NULL, NULL, 0) != 1)
 	{
-		PGresult *result = PQgetResult(connection);
+		log_error("Failed to send query to [%s]: %s",
+				  ConnectionTypeToString(pgsql->connectionType),
+				  PQerrorMessage(connection));
+		success = false;
+	}
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	else if (PQsetChunkedRowsMode(connection, PGSQL_RESULT_CHUNK_SIZE) != 1)
+	{
+		log_error("Failed to use the chunked rows mode on [%s]",
+				  ConnectionTypeToString(pgsql->connectionType));
+		success = false;
+	}
+#else
+	else if (PQsetSingleRowMode(connection) != 1)
+	{
+		log_error("Failed to use the single-row mode on [%s]",
+				  ConnectionTypeToString(pgsql->connectionType));
+		success = false;
+	}
+#endif
+
+	for (PGresult *result = success ? PQgetResult(connection) : NULL;
+		 result != NULL;
+		 result = PQgetResult(connection))
+	{
+		if (!is_response_ok(result))
+		{
+			(void) pgsql_log_result_error(pgsql, result, sql, debugParameters,
+										  context);
+			success = false;
+		}
+		else if (is_partial_result(result) && rowFun != NULL)
+		{
+			(*rowFun)(context, result);
+		}
+
+		PQclear(result);
+	}
+
+	clear_results(pgsql);
+
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		PQfinish(pgsql->connection);
+		pgsql->connection = NULL;
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_execute_pipeline runs the given queries one after the other on the
+ * same connection. When libpq supports the pipeline mode (Postgres 14 and
+ * later), all the queries are sent before reading the first result, so that
+ * it only takes one network round trip.
+ *
+ * Each query result is parsed with its own parsing function and context, and
+ * we return false when any of the queries failed. The other queries are still
+ * executed, as they would be when calling pgsql_execute_with_params() in a
+ * loop.
+ *
+ * Queries with the prepare flag set are prepared on the connection before
+ * being sent, and are then sent with PQsendQueryPrepared().
+ */
+bool
+pgsql_execute_pipeline(PGSQL *pgsql, PGSQLQuery *queries, int queryCount)
+{
+	bool success = true;
+
+	if (queryCount < 1)
+	{
+		return true;
+	}
+
+	/* the same connection is used for all the queries in the pipeline */
+	ConnectionStatementType statementType = pgsql->connectionStatementType;
+
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		pgsql->connectionStatementType = statementType;
+		return false;
+	}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	PreparedStatement *statements[PGSQL_PIPELINE_MAX_QUERIES] = { 0 };
+	bool prepare = false;
+
+	/*
+	 * Queries that are flagged to be prepared are prepared now, before
+	 * entering pipeline mode, where we would have to wait for the result of
+	 * PQprepare() anyway.
+	 */
+	for (int index = 0; index < queryCount; index++)
+	{
+		if (queries[index].prepare && index < PGSQL_PIPELINE_MAX_QUERIES)
+		{
+			statements[index] =
+				pgsql_lookup_prepared_statement(pgsql,
+												queries[index].sql,
+												queries[index].paramCount,
+												queries[index].paramTypes,
+												true);
+			prepare = prepare || statements[index] != NULL;
+		}
+	}
+
+	if ((queryCount > 1 || prepare) &&
+		PQtransactionStatus(connection) == PQTRANS_IDLE &&
+		PQenterPipelineMode(connection) == 1)
+	{
+		int sent = 0;
 
 		/*
-		 * Per Postgres documentation: You should, however, remember to check
-		 * PQnotifies after each PQgetResult or PQexec, to see if any
-		 * notifications came in during the processing of the command.
-		 *
-		 * Here, we just called PQgetResult().
+		 * Each query is followed by a synchronisation point, so that each
+		 * query runs in its own implicit transaction, as it would outside of
+		 * a pipeline: an error only aborts its own query.
 		 */
+		for (; sent < queryCount; sent++)
+		{
+			PGSQLQuery *query = &(queries[sent]);
+
+			PreparedStatement *statement =
+				sent < PGSQL_PIPELINE_MAX_QUERIES ? statements[sent] : NULL;
+
+			log_debug("%s;", query->sql);
+
+			int sendStatus =
+				statement != NULL
+				? PQsendQueryPrepared(connection, statement->name,
+									  query->paramCount,
+									  query->paramValues,
+									  NULL, NULL, 0)
+				: PQsendQueryParams(connection, query->sql,
+									query->paramCount,
+									query->paramTypes,
+									query->paramValues,
+									NULL, NULL, 0);
+
+			if (sendStatus != 1 || PQpipelineSync(connection) != 1)
+			{
+				log_error("Failed to send query to [%s]: %s",
+						  ConnectionTypeToString(pgsql->connectionType),
+						  PQerrorMessage(connection));
+				success = false;
+				break;
+			}
+		}
+
+		/* now read all the results, one query at a time */
+		for (int index = 0; index < sent; index++)
+		{
+			PGSQLQuery *query = &(queries[index]);
+			PGresult *result = NULL;
+
+			while ((result = PQgetResult(connection)) != NULL)
+			{
+				if (!is_response_ok(result))
+				{
+					char debugParameters[BUFSIZE] = { 0 };
+
+					(void) pgsql_format_params(query->paramCount,
+											   query->paramValues,
+											   debugParameters,
+											   sizeof(debugParameters));
+
+					(void) pgsql_log_result_error(pgsql, result, query->sql,
+												  debugParameters,
+												  query->context);
+					success = false;
+				}
+				else if (query->parseFun != NULL)
+				{
+					(*query->parseFun)(query->context, result);
+				}
+
+				PQclear(result);
+			}
+
+			/* consume the result of the PQpipelineSync() for that query */
+			result = PQgetResult(connection);
+
+			if (PQresultStatus(result) != PGRES_PIPELINE_SYNC)
+			{
+				log_error("Failed to read query results from [%s]: %s",
+						  ConnectionTypeToString(pgsql->connectionType),
+						  PQerrorMessage(connection));
+				success = false;
+			}
+
+			PQclear(result);
+		}
+
 		(void) pgsql_handle_notifications(pgsql);
 
-		if (result == NULL)
+		if (PQexitPipelineMode(connection) != 1)
+		{
+			log_error("Failed to exit pipeline mode: %s",
+					  PQerrorMessage(connection));
+			success = false;
+
+			/* we can't use that connection anymore */
+			pgsql_finish(pgsql);
+		}
+	}
+	else
+#endif
+	{
+		for (int index = 0; index < queryCount; index++)
+		{
+			PGSQLQuery *query = &(queries[index]);
+
+			if (!pgsql_execute_with_params(pgsql,
+										   query->sql,
+										   query->paramCount,
+										   query->paramTypes,
+										   query->paramValues,
+										   query->context,
+										   query->parseFun))
+			{
+				success = false;
+			}
+		}
+	}
+
+	if (statementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		pgsql_finish(pgsql);
+	}
+	else
+	{
+		pgsql->connectionStatementType = statementType;
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_send_with_params sends the given SQL query without waiting for its
+ * results, which are to be read later with pgsql_get_pending_results(). In
+ * the meantime the server runs the query, and we can do something else, such
+ * as running a query on another connection.
+ *
+ * The connection must be a PGSQL_CONNECTION_MULTI_STATEMENT one, and the sql
+ * string must outlive the call to pgsql_get_pending_results(). When any other
+ * query is run on the same connection first, the results are skipped.
+ */
+bool
+pgsql_send_with_params(PGSQL *pgsql, const char *sql, int paramCount,
+					   const Oid *paramTypes, const char **paramValues)
+{
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT)
+	{
+		log_error("BUG: pgsql_send_with_params called on a connection "
+				  "that is not in PGSQL_CONNECTION_MULTI_STATEMENT mode");
+		return false;
+	}
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_debug("%s;", sql);
+
+	if (paramCount > 0)
+	{
+		char debugParameters[BUFSIZE] = { 0 };
+
+		(void) pgsql_format_params(paramCount, paramValues,
+								   debugParameters, sizeof(debugParameters));
+		log_debug("%s", debugParameters);
+	}
+
+	if (PQsendQueryParams(connection, sql,
+						  paramCount, paramTypes, paramValues,
+						  NULL, NULL, 0) != 1)
+	{
+		log_debug("Failed to send query to [%s]: %s",
+				  ConnectionTypeToString(pgsql->connectionType),
+				  PQerrorMessage(connection));
+
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	pgsql->pendingQuery = sql;
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_pending_results waits for the results of the query sent with
+ * pgsql_send_with_params(), and calls parseFun with them. When the
+ * connection has been lost in the meantime, we close it and return false,
+ * and the caller may run its query again the usual way.
+ */
+bool
+pgsql_get_pending_results(PGSQL *pgsql, void *context,
+						  ParsePostgresResultCB *parseFun)
+{
+	bool success = true;
+	const char *sql = pgsql->pendingQuery;
+
+	if (pgsql->connection == NULL || sql == NULL)
+	{
+		log_error("BUG: pgsql_get_pending_results called without "
+				  "a pending query");
+		return false;
+	}
+
+	pgsql->pendingQuery = NULL;
+
+	for (PGresult *result = PQgetResult(pgsql->connection);
+		 result != NULL;
+		 result = PQgetResult(pgsql->connection))
+	{
+		(void) pgsql_handle_notifications(pgsql);
+
+		if (!is_response_ok(result))
+		{
+			(void) pgsql_log_result_error(pgsql, result, sql, "", context);
+			success = false;
+		}
+		else if (parseFun != NULL)
+		{
+			(*parseFun)(context, result);
+		}
+
+		PQclear(result);
+	}
+
+	if (PQstatus(pgsql->connection) != CONNECTION_OK)
+	{
+		pgsql->status = PG_CONNECTION_BAD;
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_execute_parallel runs each of the given queries on its own
+ * connection, all at the same time, and waits until they are all done or the
+ * given timeout (in seconds) is reached. Queries that are still running at the
+ * timeout are cancelled.
+ *
+ * The clients array must have queryCount entries already initialized with
+ * pgsql_init(), and the connections are closed when we return. We return false
+ * when any of the queries failed or has been cancelled, after all of them have
+ * been given a chance to complete.
+ */
+bool
+pgsql_execute_parallel(PGSQL *clients, PGSQLQuery *queries, int queryCount,
+					   int timeout)
+{
+	bool success = true;
+	bool pending[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+	int pendingCount = 0;
+
+	if (queryCount > PGSQL_PARALLEL_MAX_QUERIES)
+	{
+		log_error("BUG: pgsql_execute_parallel called with %d queries, "
+				  "the maximum is %d",
+				  queryCount, PGSQL_PARALLEL_MAX_QUERIES);
+		return false;
+	}
+
+	for (int index = 0; index < queryCount; index++)
+	{
+		PGSQL *pgsql = &(clients[index]);
+		PGSQLQuery *query = &(queries[index]);
+
+		/* keep the connection open until we have fetched the results */
+		pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+		PGconn *connection = pgsql_open_connection(pgsql);
+
+		if (connection == NULL)
+		{
+			/* error message was logged in pgsql_open_connection */
+			success = false;
+			continue;
+		}
+
+		log_debug("%s;", query->sql);
+
+		if (PQsendQueryParams(connection, query->sql,
+							  query->paramCount,
+							  query->paramTypes,
+							  query->paramValues,
+							  NULL, NULL, 0) != 1)
+		{
+			log_error("Failed to send query to [%s]: %s",
+					  ConnectionTypeToString(pgsql->connectionType),
+					  PQerrorMessage(connection));
+			success = false;
+			continue;
+		}
+
+		pending[index] = true;
+		++pendingCount;
+	}
+
+	uint64_t deadline = time(NULL) + timeout;
+
+	while (pendingCount > 0 && !(asked_to_stop_fast || asked_to_quit))
+	{
+		uint64_t now = time(NULL);
+		fd_set readFds;
+		int maxFd = -1;
+
+		if (now >= deadline)
+		{
+			break;
+		}
+
+		FD_ZERO(&readFds);
+
+		for (int index = 0; index < queryCount; index++)
+		{
+			if (pending[index])
+			{
+				int sock = PQsocket(clients[index].connection);
+
+				FD_SET(sock, &readFds);
+				maxFd = Max(maxFd, sock);
+			}
+		}
+
+		/* wake up at least once per second to check for signals */
+		struct timeval timeval = { .tv_sec = 1, .tv_usec = 0 };
+
+		int ret = select(maxFd + 1, &readFds, NULL, NULL, &timeval);
+
+		if (ret < 0)
 		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for query results: %m");
+			success = false;
 			break;
 		}
 
-		if (!is_response_ok(result))
-		{
-			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
+		for (int index = 0; index < queryCount; index++)
+		{
+			PGSQL *pgsql = &(clients[index]);
+			PGSQLQuery *query = &(queries[index]);
+
+			if (!pending[index] || !FD_ISSET(PQsocket(pgsql->connection),
+											 &readFds))
+			{
+				continue;
+			}
+
+			if (PQconsumeInput(pgsql->connection) == 0)
+			{
+				log_error("Failed to read query results from [%s]: %s",
+						  ConnectionTypeToString(pgsql->connectionType),
+						  PQerrorMessage(pgsql->connection));
+
+				pending[index] = false;
+				--pendingCount;
+				success = false;
+				continue;
+			}
+
+			while (pending[index] && PQisBusy(pgsql->connection) == 0)
+			{
+				PGresult *result = PQgetResult(pgsql->connection);
+
+				if (result == NULL)
+				{
+					pending[index] = false;
+					--pendingCount;
+					break;
+				}
+
+				if (!is_response_ok(result))
+				{
+					char debugParameters[BUFSIZE] = { 0 };
+
+					(void) pgsql_format_params(query->paramCount,
+											   query->paramValues,
+											   debugParameters,
+											   sizeof(debugParameters));
+
+					(void) pgsql_log_result_error(pgsql, result, query->sql,
+												  debugParameters,
+												  query->context);
+					success = false;
+				}
+				else if (query->parseFun != NULL)
+				{
+					(*query->parseFun)(query->context, result);
+				}
+
+				PQclear(result);
+			}
+		}
+	}
+
+	/* cancel the queries that are still running, and close all connections */
+	for (int index = 0; index < queryCount; index++)
+	{
+		PGSQL *pgsql = &(clients[index]);
+
+		if (pending[index])
+		{
+			char errbuf[BUFSIZE] = { 0 };
+			PGcancel *cancel = PQgetCancel(pgsql->connection);
+
+			log_debug("Cancelling query on [%s] after %ds",
+					  ConnectionTypeToString(pgsql->connectionType),
+					  timeout);
+
+			if (cancel == NULL || PQcancel(cancel, errbuf, sizeof(errbuf)) != 1)
+			{
+				log_warn("Failed to cancel query on [%s]: %s",
+						 ConnectionTypeToString(pgsql->connectionType),
+						 errbuf);
+			}
+
+			if (cancel != NULL)
+			{
+				PQfreeCancel(cancel);
+			}
+
+			success = false;
+		}
+
+		pgsql->connectionStatementType = PGSQL_CONNECTION_SINGLE_STATEMENT;
+		pgsql_finish(pgsql);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_execute_queue runs a queue of queries on the given connections, all
+ * at the same time: each time a connection is done with a query, the
+ * nextQuery callback gives us the next query to run on that connection. We
+ * return once the queue is empty and all the queries are done.
+ *
+ * The clients array must have clientCount entries already initialized with
+ * pgsql_init(), and the connections are closed when we return. When a query
+ * fails we stop sending new queries, and we return false once the queries
+ * that are still running are done.
+ */
+bool
+pgsql_execute_queue(PGSQL *clients, int clientCount, int resultFormat,
+					PGSQLNextQueryCB *nextQuery, void *context)
+{
+	bool success = true;
+	bool queueIsEmpty = false;
+	PGSQLQuery queries[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+	bool pending[PGSQL_PARALLEL_MAX_QUERIES] = { 0 };
+	int pendingCount = 0;
+
+	if (clientCount > PGSQL_PARALLEL_MAX_QUERIES)
+	{
+		log_error("BUG: pgsql_execute_queue called with %d clients, "
+				  "the maximum is %d",
+				  clientCount, PGSQL_PARALLEL_MAX_QUERIES);
+		return false;
+	}
+
+	for (int index = 0; index < clientCount; index++)
+	{
+		PGSQL *pgsql = &(clients[index]);
+
+		/* keep the connection open from a query to the next */
+		pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+		if (pgsql_open_connection(pgsql) == NULL)
+		{
+			/* error message was logged in pgsql_open_connection */
+			success = false;
+			break;
+		}
+	}
+
+	while (success || pendingCount > 0)
+	{
+		/* send the next query on each idle connection */
+		for (int index = 0;
+			 success && !queueIsEmpty && index < clientCount;
+			 index++)
+		{
+			PGSQL *pgsql = &(clients[index]);
+			PGSQLQuery *query = &(queries[index]);
+
+			if (pending[index])
+			{
+				continue;
+			}
+
+			if (!(*nextQuery)(context, index, query))
+			{
+				queueIsEmpty = true;
+				break;
+			}
+
+			log_trace("%s;", query->sql);
+
+			if (PQsendQueryParams(pgsql->connection, query->sql,
+								  query->paramCount,
+								  query->paramTypes,
+								  query->paramValues,
+								  NULL, NULL, resultFormat) != 1)
+			{
+				log_error("Failed to send query to [%s]: %s",
+						  ConnectionTypeToString(pgsql->connectionType),
+						  PQerrorMessage(pgsql->connection));
+				success = false;
+				break;
+			}
+
+			pending[index] = true;
+			++pendingCount;
+		}
+
+		if (pendingCount == 0)
+		{
+			break;
+		}
+
+		if (asked_to_stop_fast || asked_to_quit)
+		{
+			success = false;
+			break;
+		}
+
+		fd_set readFds;
+		int maxFd = -1;
+
+		FD_ZERO(&readFds);
+
+		for (int index = 0; index < clientCount; index++)
+		{
+			if (pending[index])
+			{
+				int sock = PQsocket(clients[index].connection);
+
+				FD_SET(sock, &readFds);
+				maxFd = Max(maxFd, sock);
+			}
+		}
+
+		/* wake up at least once per second to check for signals */
+		struct timeval timeval = { .tv_sec = 1, .tv_usec = 0 };
+
+		int ret = select(maxFd + 1, &readFds, NULL, NULL, &timeval);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for query results: %m");
+			success = false;
+			break;
+		}
+
+		for (int index = 0; index < clientCount; index++)
+		{
+			PGSQL *pgsql = &(clients[index]);
+			PGSQLQuery *query = &(queries[index]);
+
+			if (!pending[index] || !FD_ISSET(PQsocket(pgsql->connection),
+											 &readFds))
+			{
+				continue;
+			}
+
+			if (PQconsumeInput(pgsql->connection) == 0)
+			{
+				log_error("Failed to read query results from [%s]: %s",
+						  ConnectionTypeToString(pgsql->connectionType),
+						  PQerrorMessage(pgsql->connection));
+
+				pending[index] = false;
+				--pendingCount;
+				success = false;
+				continue;
+			}
+
+			while (pending[index] && PQisBusy(pgsql->connection) == 0)
+			{
+				PGresult *result = PQgetResult(pgsql->connection);
+
+				if (result == NULL)
+				{
+					pending[index] = false;
+					--pendingCount;
+					break;
+				}
+
+				if (!is_response_ok(result))
+				{
+					char debugParameters[BUFSIZE] = { 0 };
+
+					(void) pgsql_format_params(query->paramCount,
+											   query->paramValues,
+											   debugParameters,
+											   sizeof(debugParameters));
+
+					(void) pgsql_log_result_error(pgsql, result, query->sql,
+												  debugParameters,
+												  query->context);
+					success = false;
+				}
+				else if (query->parseFun != NULL)
+				{
+					(*query->parseFun)(query->context, result);
+				}
+
+				PQclear(result);
+			}
+		}
+	}
+
+	/* closing the connections cancels the queries that are still running */
+	for (int index = 0; index < clientCount; index++)
+	{
+		PGSQL *pgsql = &(clients[index]);
+
+		pgsql->connectionStatementType = PGSQL_CONNECTION_SINGLE_STATEMENT;
+		pgsql_finish(pgsql);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_format_params formats the given query parameters in a buffer, for
+ * logging purposes.
+ */
+static void
+pgsql_format_params(int paramCount, const char **paramValues,
+					char *buffer, int size)
+{
+	int remainingBytes = size;
+	char *writePointer = buffer;
+
+	for (int paramIndex = 0; paramIndex < paramCount; paramIndex++)
+	{
+		int bytesWritten = 0;
+		const char *value = paramValues[paramIndex];
+
+		if (paramIndex > 0)
+		{
+			bytesWritten = sformat(writePointer, remainingBytes, ", ");
+			remainingBytes -= bytesWritten;
+			writePointer += bytesWritten;
+		}
+
+		if (value == NULL)
+		{
+			bytesWritten = sformat(writePointer, remainingBytes, "NULL");
+		}
+		else
+		{
+			bytesWritten =
+				sformat(writePointer, remainingBytes, "'%s'", value);
+		}
+		remainingBytes -= bytesWritten;
+		writePointer += bytesWritten;
+	}
+}
+
+
+/*
+ * pgsql_log_result_error logs the error message of a failed query, and
+ * stashes away its SQL STATE in the given context, if any.
+ */
+static void
+pgsql_log_result_error(PGSQL *pgsql, PGresult *result, const char *sql,
+					   const char *debugParameters, void *context)
+{
+	PGconn *connection = pgsql->connection;
+	char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+	char *message = PQresultErrorMessage(result);
+	char *errorLines[BUFSIZE];
+
+	if (message == NULL || message[0] == '\0')
+	{
+		message = PQerrorMessage(connection);
+	}
+
+	/* splitLines modifies its input */
+	char *messageCopy = strdup(message);
+	int lineCount = messageCopy == NULL ? 0
+					: splitLines(messageCopy, errorLines, BUFSIZE);
+
+	char *prefix =
+		pgsql->connectionType == PGSQL_CONN_MONITOR ? "Monitor" : "Postgres";
+
+	/*
+	 * A busy monitor tells us when to try again, in the error detail. That's
+	 * expected after a monitor restart, and not worth an error message.
+	 */
+	pgsql->retryAfterMs = 0;
+
+	if (pgsql->connectionType == PGSQL_CONN_MONITOR &&
+		sqlstate != NULL &&
+		strcmp(sqlstate, STR_ERRCODE_CONFIGURATION_LIMIT_EXCEEDED) == 0)
+	{
+		char *detail = PQresultErrorField(result, PG_DIAG_MESSAGE_DETAIL);
+		int retryAfterMs = 0;
+
+		if (detail != NULL &&
+			sscanf(detail, "Retry after %d ms", &retryAfterMs) == 1 &&
+			retryAfterMs > 0)
+		{
+			pgsql->retryAfterMs = retryAfterMs;
+		}
+	}
+
+	/*
+	 * PostgreSQL Error message might contain several lines. Log each of
+	 * them as a separate ERROR line here.
+	 */
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		if (pgsql->retryAfterMs > 0)
+		{
+			log_warn("%s %s", prefix, errorLines[lineNumber]);
+		}
+		else
+		{
+			log_error("%s %s", prefix, errorLines[lineNumber]);
+		}
+	}
+
+	free(messageCopy);
+
+	/*
+	 * The monitor uses those error codes in situations we know how to
+	 * handle, so if we have one of those, it's not a client-side error
+	 * with a badly formed SQL query etc.
+	 */
+	if (pgsql->connectionType == PGSQL_CONN_MONITOR &&
+		sqlstate != NULL &&
+		pgsql->retryAfterMs == 0 &&
+		!(strcmp(sqlstate, STR_ERRCODE_INVALID_OBJECT_DEFINITION) == 0 ||
+		  strcmp(sqlstate, STR_ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE) == 0 ||
+		  strcmp(sqlstate, STR_ERRCODE_OBJECT_IN_USE) == 0 ||
+		  strcmp(sqlstate, STR_ERRCODE_UNDEFINED_OBJECT) == 0))
+	{
+		log_error("SQL query: %s", sql);
+		log_error("SQL params: %s", debugParameters);
+	}
+	else
+	{
+		log_debug("SQL query: %s", sql);
+		log_debug("SQL params: %s", debugParameters);
+	}
+
+	/* now stash away the SQL STATE if any */
+	if (context && sqlstate)
+	{
+		AbstractResultContext *ctx = (AbstractResultContext *) context;
+
+		strlcpy(ctx->sqlstate, sqlstate, SQLSTATE_LENGTH);
+	}
+
+	/* if we get a connection exception, track that */
+	if (sqlstate &&
+		strncmp(sqlstate, STR_ERRCODE_CLASS_CONNECTION_EXCEPTION, 2) == 0)
+	{
+		pgsql->status = PG_CONNECTION_BAD;
+	}
+}
+
+
+/*
+ * pgsql_lookup_prepared_statement returns the statement prepared for the
+ * given SQL text on the current connection, if any.
+ *
+ * Only connections that are kept open for several queries use prepared
+ * statements, and only for the queries that they run more than once: the
+ * first time a query is seen we only remember its text, and we prepare it the
+ * second time. When the cache is full, queries run unprepared.
+ *
+ * When prepareNow is true the caller knows the query is going to be run many
+ * times: any statement is then prepared the first time it is seen.
+ */
+static PreparedStatement *
+pgsql_lookup_prepared_statement(PGSQL *pgsql, const char *sql,
+								int paramCount, const Oid *paramTypes,
+								bool prepareNow)
+{
+	PreparedStatementCache *cache = &(pgsql->preparedStatements);
+	PreparedStatement *unused = NULL;
+
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT ||
+		pgsql->connection == NULL ||
+		(!prepareNow && !pgsql_statement_is_cacheable(sql)))
+	{
+		return NULL;
+	}
+
+	/* statements only exist on the connection they were prepared with */
+	if (cache->connection != pgsql->connection)
+	{
+		(void) pgsql_clear_prepared_statements(pgsql);
+		cache->connection = pgsql->connection;
+	}
+
+	for (int index = 0; index < PGSQL_PREPARED_STATEMENT_CACHE_SIZE; index++)
+	{
+		PreparedStatement *statement = &(cache->statements[index]);
+
+		if (statement->sql == NULL)
+		{
+			if (unused == NULL)
+			{
+				unused = statement;
+			}
+			continue;
+		}
+
+		if (strcmp(statement->sql, sql) != 0)
+		{
+			continue;
+		}
+
+		if (statement->prepared)
+		{
+			return statement;
+		}
+
+		/* a failure to prepare would abort the current transaction */
+		if (PQtransactionStatus(pgsql->connection) != PQTRANS_IDLE)
+		{
+			return NULL;
+		}
+
+		/* second time we see this query: prepare it */
+		sformat(statement->name, sizeof(statement->name),
+				"pgautofailover_%d", ++(cache->serial));
+
+		PGresult *result = PQprepare(pgsql->connection, statement->name,
+									 sql, paramCount, paramTypes);
+
+		bool prepared = is_response_ok(result);
+
+		if (!prepared)
+		{
+			log_debug("Failed to prepare statement \"%s\": %s",
+					  statement->name, PQerrorMessage(pgsql->connection));
+		}
+
+		PQclear(result);
+		clear_results(pgsql);
+
+		if (!prepared)
+		{
+			(void) pgsql_forget_prepared_statement(statement);
+			return NULL;
+		}
+
+		statement->prepared = true;
+
+		return statement;
+	}
+
+	/* first time we see this query: remember it for next time */
+	if (unused != NULL)
+	{
+		unused->sql = strdup(sql);
+		unused->prepared = false;
+
+		if (prepareNow)
+		{
+			return pgsql_lookup_prepared_statement(pgsql, sql,
+												   paramCount, paramTypes,
+												   prepareNow);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * pgsql_statement_is_cacheable returns true when the given SQL text is a
+ * single SELECT or WITH query, which we know we can prepare.
+ */
+static bool
+pgsql_statement_is_cacheable(const char *sql)
+{
+	const char *ptr = sql;
+
+	while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')
+	{
+		++ptr;
+	}
+
+	return (strncasecmp(ptr, "select", 6) == 0 ||
+			strncasecmp(ptr, "with", 4) == 0) &&
+		   strchr(ptr, ';') == NULL;
+}
+
+
+/*
+ * pgsql_forget_prepared_statement removes the given statement from the cache.
+ * The statement is not deallocated on the server, where it disappears with
+ * the session.
+ */
+static void
+pgsql_forget_prepared_statement(PreparedStatement *statement)
+{
+	free(statement->sql);
+
+	statement->sql = NULL;
+	statement->prepared = false;
+	statement->name[0] = '\0';
+}
+
+
+/*
+ * pgsql_clear_prepared_statements empties the prepared statement cache of the
+ * given connection.
+ */
+static void
+pgsql_clear_prepared_statements(PGSQL *pgsql)
+{
+	PreparedStatementCache *cache = &(pgsql->preparedStatements);
+
+	for (int index = 0; index < PGSQL_PREPARED_STATEMENT_CACHE_SIZE; index++)
+	{
+		if (cache->statements[index].sql != NULL)
+		{
+			(void) pgsql_forget_prepared_statement(&(cache->statements[index]));
+		}
+	}
+
+	cache->connection = NULL;
+}
+
+
+/*
+ * is_response_ok returns whether the query result is a correct response
+ * (not an error or failure).
+ */
+static bool
+is_response_ok(PGresult *result)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+
+	return is_partial_result(result) || resultStatus == PGRES_TUPLES_OK ||
+		   resultStatus == PGRES_COMMAND_OK;
+}
+
+
+/*
+ * is_partial_result returns true when the given result has some of the rows
+ * of a query run with pgsql_execute_single_row, rather than the final result
+ * of the query.
+ */
+static bool
+is_partial_result(PGresult *result)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (resultStatus == PGRES_TUPLES_CHUNK)
+	{
+		return true;
+	}
+#endif
+
+	return resultStatus == PGRES_SINGLE_TUPLE;
+}
+
+
+/*
+ * clear_results consumes results on a connection until NULL is returned.
+ * If an error is returned it returns false.
+ */
+static bool
+clear_results(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
+
+	/*
+	 * Per Postgres documentation: You should, however, remember to check
+	 * PQnotifies after each PQgetResult or PQexec, to see if any
+	 * notifications came in during the processing of the command.
+	 *
+	 * Before calling clear_results(), we called PQexecParams().
+	 */
+	(void) pgsql_handle_notifications(pgsql);
+
+	while (true)
+	{
+		PGresult *result = PQgetResult(connection);
+
+		/*
+		 * Per Postgres documentation: You should, however, remember to check
+		 * PQnotifies after each PQgetResult or PQexec, to see if any
+		 * notifications came in during the processing of the command.
+		 *
+		 * Here, we just called PQgetResult().
+		 */
+		(void) pgsql_handle_notifications(pgsql);
+
+		if (result == NULL)
+		{
+			break;
+		}
+
+		if (!is_response_ok(result))
+		{
+			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
+
+			PQclear(result);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		PQclear(result);
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_handle_notifications check PQnotifies when a PGSQL notificationChannel
+ * has been set. Then if the parsed notification is from the
+ * notificationGroupId we set notificationReceived and also log the
+ * notification.
+ *
+ * This allow another part of the code to later know that some notifications
+ * have been received.
+ */
+static void
+pgsql_handle_notifications(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
+	PGnotify *notify;
+
+	if (pgsql->notificationProcessFunction == NULL)
+	{
+		return;
+	}
+
+	PQconsumeInput(connection);
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		log_trace("pgsql_handle_notifications: \"%s\"", notify->extra);
+
+		if ((*pgsql->notificationProcessFunction)(pgsql->notificationGroupId,
+												  pgsql->notificationNodeId,
+												  notify->relname,
+												  notify->extra))
+		{
+			/* mark that we received some notifications */
+			pgsql->notificationReceived = true;
+		}
+
+		PQfreemem(notify);
+		PQconsumeInput(connection);
+	}
+}
+
+
+/*
+ * pgsql_is_in_recovery connects to PostgreSQL and sets the is_in_recovery
+ * boolean to the result of the SELECT pg_is_in_recovery() query. It returns
+ * false when something went wrong doing that.
+ */
+bool
+pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT pg_is_in_recovery()";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_is_in_recovery()");
+		return false;
+	}
+
+	*is_in_recovery = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * check_postgresql_settings connects to our local PostgreSQL instance and
+ * verifies that our minimal viable configuration is in place by running a SQL
+ * query that looks at the current settings.
+ */
+bool
+pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
+								bool *settings_are_ok)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	const char *sql =
+		isCitusInstanceKind ?
+		CHECK_CITUS_NODE_SETTINGS_SQL : CHECK_POSTGRESQL_NODE_SETTINGS_SQL;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*settings_are_ok = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_check_monitor_settings connects to the given pgsql instance to check
+ * that pgautofailover is part of shared_preload_libraries.
+ */
+bool
+pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	const char *sql =
+		"select exists(select 1 from "
+		"unnest("
+		"string_to_array(current_setting('shared_preload_libraries'), ','))"
+		" as t(name) "
+		"where trim(name) = 'pgautofailover');";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*settings_are_ok = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * postgres_sprintf_replicationSlotName prints the replication Slot Name to use
+ * for given nodeId in the given slotName buffer of given size.
+ */
+bool
+postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int size)
+{
+	int bytesWritten =
+		sformat(slotName, size, "%s_%" PRId64,
+				REPLICATION_SLOT_NAME_DEFAULT,
+				nodeId);
+
+	return bytesWritten <= size;
+}
+
+
+/*
+ * pgsql_set_synchronous_standby_names set synchronous_standby_names on the
+ * local Postgres to the value computed on the pg_auto_failover monitor.
+ *
+ * A reload makes every backend read the configuration files again, so we
+ * skip the ALTER SYSTEM and the reload when Postgres already uses the value.
+ */
+bool
+pgsql_set_synchronous_standby_names(PGSQL *pgsql,
+									char *synchronous_standby_names)
+{
+	char quoted[BUFSIZE] = { 0 };
+	GUC setting = { "synchronous_standby_names", quoted };
+	char *currentValue = NULL;
+
+	if (pgsql_get_current_setting(pgsql,
+								  "synchronous_standby_names",
+								  &currentValue))
+	{
+		bool unchanged = streq(currentValue, synchronous_standby_names);
+
+		free(currentValue);
+
+		if (unchanged)
+		{
+			log_info("synchronous_standby_names is already set to '%s'",
+					 synchronous_standby_names);
+			return true;
+		}
+	}
+	else
+	{
+		log_warn("Failed to get the current synchronous_standby_names value, "
+				 "setting it anyway");
+	}
+
+	log_info("Setting synchronous_standby_names to '%s'",
+			 synchronous_standby_names);
+
+	if (sformat(quoted, BUFSIZE, "'%s'", synchronous_standby_names) >= BUFSIZE)
+	{
+		log_error("Failed to apply the synchronous_standby_names value \"%s\": "
+				  "pg_autoctl supports values up to %d bytes and this one "
+				  "requires %lu bytes",
+				  synchronous_standby_names,
+				  BUFSIZE,
+				  (unsigned long) strlen(synchronous_standby_names));
+		return false;
+	}
+
+	return pgsql_alter_system_set(pgsql, setting);
+}
+
+
+/*
+ * pgsql_set_max_slot_wal_keep_size sets max_slot_wal_keep_size on the local
+ * Postgres, which then invalidates the replication slots that retain more WAL
+ * than that. The setting is available in Postgres 13 and later.
+ */
+bool
+pgsql_set_max_slot_wal_keep_size(PGSQL *pgsql, const char *size)
+{
+	char quoted[NAMEDATALEN + 2] = { 0 };
+	GUC setting = { "max_slot_wal_keep_size", quoted };
+
+	sformat(quoted, sizeof(quoted), "'%s'", size);
+
+	log_info("Setting max_slot_wal_keep_size to %s", quoted);
+
+	return pgsql_alter_system_set(pgsql, setting);
+}
+
+
+/*
+ * pgsql_replication_slot_maintain advances the current confirmed position of
+ * the given replication slot up to the given LSN position, create the
+ * replication slot if it does not exist yet, and remove the slots that exist
+ * in Postgres but are ommited in the given array of slots.
+ */
+typedef struct ReplicationSlotMaintainContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	char operation[NAMEDATALEN];
+	char slotName[BUFSIZE];
+	char lsn[PG_LSN_MAXLENGTH];
+	bool parsedOK;
+} ReplicationSlotMaintainContext;
+
+
+/*
+ * pgsql_replication_slot_exists checks that a replication slot with the given
+ * slotName exists on the Postgres server.
+ */
+bool
+pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
+							  bool *slotExists)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT 1 FROM pg_replication_slots WHERE slot_name = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { NAMEOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &fetchedRows))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to check if the replication slot \"%s\" exists",
+				  slotName);
+		return false;
+	}
+
+	/* we receive 0 rows in the result when the slot does not exist yet */
+	*slotExists = context.intVal == 1;
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_sync_standby_lag_bytes gets how many bytes of WAL the synchronous
+ * standby nodes have yet to flush, as the highest lag of them. When there is
+ * no synchronous standby node, the lag is zero.
+ */
+bool
+pgsql_get_sync_standby_lag_bytes(PGSQL *pgsql, int64_t *lagBytes)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+	char *sql =
+		"SELECT greatest(coalesce(max(pg_wal_lsn_diff(pg_current_wal_lsn(), "
+		"                                             flush_lsn)), 0), "
+		"                0)::bigint "
+		"  FROM pg_stat_replication "
+		" WHERE application_name ~ '^pgautofailover_standby_[0-9]+$' "
+		"   AND sync_state IN ('sync', 'quorum')";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the replication lag of the synchronous "
+				  "standby nodes");
+		return false;
+	}
+
+	*lagBytes = (int64_t) context.bigint;
+
+	return true;
+}
+
+
+/*
+ * pgsql_count_sessions_in_transaction counts the client sessions, other than
+ * our own, that are in a transaction, either running a query or idle in
+ * transaction.
+ */
+bool
+pgsql_count_sessions_in_transaction(PGSQL *pgsql, int *count)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	char *sql =
+		"SELECT count(*) "
+		"  FROM pg_stat_activity "
+		" WHERE backend_type = 'client backend' "
+		"   AND pid <> pg_backend_pid() "
+		"   AND xact_start IS NOT NULL";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to count the sessions in a transaction");
+		return false;
+	}
+
+	*count = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_signal_sessions_in_transaction cancels the queries of the client
+ * sessions, other than our own, that are in a transaction, or terminates
+ * those sessions when terminate is true. The count is set to how many
+ * sessions have been signaled.
+ */
+bool
+pgsql_signal_sessions_in_transaction(PGSQL *pgsql, bool terminate, int *count)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	char *cancelSQL =
+		"SELECT count(*) FILTER (WHERE pg_cancel_backend(pid)) "
+		"  FROM pg_stat_activity "
+		" WHERE backend_type = 'client backend' "
+		"   AND pid <> pg_backend_pid() "
+		"   AND xact_start IS NOT NULL";
+	char *terminateSQL =
+		"SELECT count(*) FILTER (WHERE pg_terminate_backend(pid)) "
+		"  FROM pg_stat_activity "
+		" WHERE backend_type = 'client backend' "
+		"   AND pid <> pg_backend_pid() "
+		"   AND xact_start IS NOT NULL";
+
+	if (!pgsql_execute_with_params(pgsql,
+								   terminate ? terminateSQL : cancelSQL,
+								   0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to %s the sessions in a transaction",
+				  terminate ? "terminate" : "cancel");
+		return false;
+	}
+
+	*count = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_replication_lag gets the highest replication lag, in milliseconds,
+ * of the standby nodes connected to the Postgres server, skipping the given
+ * application name, which is our own.
+ */
+bool
+pgsql_get_replication_lag(PGSQL *pgsql, const char *applicationName,
+						  int *lagMs)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	char *sql =
+		"SELECT coalesce(max(extract(epoch from "
+		"         greatest(write_lag, flush_lag, replay_lag)) * 1000), 0)::int "
+		"  FROM pg_stat_replication "
+		" WHERE application_name <> $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { applicationName };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the replication lag of the standby nodes");
+		return false;
+	}
+
+	*lagMs = context.intVal;
+
+	return true;
+}
+
+
+typedef struct StandbyReplicationArraysContext
+{
+	char sqlstate[6];
+	StandbyReplicationArrays *report;
+	bool parsedOk;
+} StandbyReplicationArraysContext;
+
+
+/*
+ * pgsql_get_standby_replication gets a snapshot of pg_stat_replication for
+ * the pg_auto_failover standby nodes connected to the Postgres server: the
+ * sent, write, flush and replay LSN of each node, and its write and flush
+ * lag in milliseconds. The lags are NULL when the standby has caught up and
+ * there is no recent WAL activity.
+ */
+bool
+pgsql_get_standby_replication(PGSQL *pgsql, StandbyReplicationArrays *report)
+{
+	StandbyReplicationArraysContext context = { { 0 }, report, false };
+	char *sql =
+		"SELECT coalesce(array_agg(nodeid ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(sent_lsn ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(write_lsn ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(flush_lsn ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(replay_lsn ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(writelag ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(flushlag ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(retained ORDER BY nodeid), '{}')::text, "
+		"       coalesce(array_agg(restart_lsn ORDER BY nodeid), '{}')::text "
+		"  FROM ("
+		"    SELECT substring(application_name "
+		"                     from '^pgautofailover_standby_([0-9]+)$')::bigint "
+		"             as nodeid, "
+		"           sent_lsn, write_lsn, flush_lsn, replay_lsn, "
+		"           (extract(epoch from write_lag) * 1000)::bigint as writelag, "
+		"           (extract(epoch from flush_lag) * 1000)::bigint as flushlag "
+		"      FROM pg_stat_replication "
+		"     WHERE application_name ~ '^pgautofailover_standby_[0-9]+$'"
+		"  ) as rep "
+		"  FULL JOIN ("
+		"    SELECT substring(slot_name "
+		"                     from '^pgautofailover_standby_([0-9]+)$')::bigint "
+		"             as nodeid, "
+		"           pg_wal_lsn_diff(pg_current_wal_lsn(), restart_lsn)::bigint "
+		"             as retained, "
+		"           restart_lsn "
+		"      FROM pg_replication_slots "
+		"     WHERE slot_name ~ '^pgautofailover_standby_[0-9]+$' "
+		"       AND slot_type = 'physical'"
+		"  ) as slot USING (nodeid)";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseStandbyReplicationArrays))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the replication status of the standby nodes");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseStandbyReplicationArrays parses the array literals returned by the
+ * pgsql_get_standby_replication query.
+ */
+static void
+parseStandbyReplicationArrays(void *ctx, PGresult *result)
+{
+	StandbyReplicationArraysContext *context =
+		(StandbyReplicationArraysContext *) ctx;
+	char *buffers[STANDBY_REPLICATION_ARRAYS_COUNT] = {
+		context->report->nodeIds,
+		context->report->sentLSNs,
+		context->report->writeLSNs,
+		context->report->flushLSNs,
+		context->report->replayLSNs,
+		context->report->writeLags,
+		context->report->flushLags,
+		context->report->retainedBytes,
+		context->report->restartLSNs
+	};
+
+	if (PQnfields(result) != STANDBY_REPLICATION_ARRAYS_COUNT)
+	{
+		log_error("Query returned %d columns, expected %d",
+				  PQnfields(result), STANDBY_REPLICATION_ARRAYS_COUNT);
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	for (int col = 0; col < STANDBY_REPLICATION_ARRAYS_COUNT; col++)
+	{
+		char *value = PQgetvalue(result, 0, col);
+
+		if (strlen(value) >= BUFSIZE)
+		{
+			log_error("Failed to parse the replication status of the standby "
+					  "nodes: value is %zu bytes long, the maximum is %d",
+					  strlen(value), BUFSIZE - 1);
+			context->parsedOk = false;
+			return;
+		}
+
+		strlcpy(buffers[col], value, BUFSIZE);
+	}
+
+	context->parsedOk = true;
+}
+
+
+typedef struct SyncRepStatusContext
+{
+	char sqlstate[6];
+	SyncRepStatus *status;
+	bool parsedOk;
+} SyncRepStatusContext;
+
+
+/*
+ * pgsql_get_sync_rep_status counts how many pg_auto_failover standby nodes
+ * have a walsender process connected to the Postgres server, how many
+ * backends are currently waiting for a synchronous standby to acknowledge
+ * their commit, and for how long the oldest of them has been waiting. The
+ * wait is measured from the start of the waiting statement. The query is
+ * cheap enough to run at each keeper loop.
+ */
+bool
+pgsql_get_sync_rep_status(PGSQL *pgsql, SyncRepStatus *status)
+{
+	SyncRepStatusContext context = { { 0 }, status, false };
+	char *sql =
+		"SELECT (SELECT count(*) FROM pg_stat_replication "
+		"         WHERE application_name "
+		"               ~ '^pgautofailover_standby_[0-9]+$'), "
+		"       count(*), "
+		"       coalesce(max(extract(epoch from now() - query_start)), 0)"
+		"         * 1000 "
+		"  FROM pg_stat_activity "
+		" WHERE wait_event = 'SyncRep'";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSyncRepStatus))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the synchronous replication status");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseSyncRepStatus parses the result of the pgsql_get_sync_rep_status
+ * query.
+ */
+static void
+parseSyncRepStatus(void *ctx, PGresult *result)
+{
+	SyncRepStatusContext *context = (SyncRepStatusContext *) ctx;
+	SyncRepStatus *status = context->status;
+	double oldestWaitMs = 0;
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (!stringToInt(PQgetvalue(result, 0, 0), &(status->walSenders)) ||
+		!stringToInt(PQgetvalue(result, 0, 1), &(status->waiting)) ||
+		!stringToDouble(PQgetvalue(result, 0, 2), &oldestWaitMs))
+	{
+		log_error("Failed to parse the synchronous replication status "
+				  "\"%s\", \"%s\", \"%s\"",
+				  PQgetvalue(result, 0, 0),
+				  PQgetvalue(result, 0, 1),
+				  PQgetvalue(result, 0, 2));
+		context->parsedOk = false;
+		return;
+	}
+
+	status->oldestWaitMs = (int64_t) oldestWaitMs;
+
+	context->parsedOk = true;
+}
+
+
+typedef struct WalReceiverStatusContext
+{
+	char sqlstate[6];
+	WalReceiverStatus *status;
+	bool parsedOk;
+} WalReceiverStatusContext;
+
 
-			PQclear(result);
-			pgsql_finish(pgsql);
-			return false;
-		}
+/*
+ * pgsql_get_wal_receiver_status tells if a Postgres server is in recovery
+ * and, when it is, how long ago it heard from its upstream server and the
+ * last LSN it received. On a primary server, the receivedLSN is the current
+ * flush LSN.
+ *
+ * The pg_stat_wal_receiver columns are only visible to privileged users, so
+ * we also look at the last replayed transaction timestamp, which anyone can
+ * read. The standby heard from its upstream at the most recent of both.
+ */
+bool
+pgsql_get_wal_receiver_status(PGSQL *pgsql, WalReceiverStatus *status)
+{
+	WalReceiverStatusContext context = { { 0 }, status, false };
+	char *sql =
+		"SELECT pg_is_in_recovery(), "
+		"       coalesce(least("
+		"         extract(epoch from now() - r.last_msg_receipt_time), "
+		"         extract(epoch from now() - pg_last_xact_replay_timestamp()))"
+		"         * 1000, -1)::bigint, "
+		"       CASE WHEN pg_is_in_recovery() "
+		"            THEN coalesce(pg_last_wal_receive_lsn(), "
+		"                          pg_last_wal_replay_lsn()) "
+		"            ELSE pg_current_wal_flush_lsn() "
+		"        END "
+		"  FROM (values(1)) AS dummy "
+		"       LEFT JOIN pg_stat_wal_receiver r ON true";
 
-		PQclear(result);
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseWalReceiverStatus))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the wal receiver status");
+		return false;
 	}
 
 	return true;
@@ -1231,282 +3422,312 @@ clear_results(PGSQL *pgsql)
 
 
 /*
- * pgsql_handle_notifications check PQnotifies when a PGSQL notificationChannel
- * has been set. Then if the parsed notification is from the
- * notificationGroupId we set notificationReceived and also log the
- * notification.
- *
- * This allow another part of the code to later know that some notifications
- * have been received.
+ * parseWalReceiverStatus parses the result of the
+ * pgsql_get_wal_receiver_status query.
  */
 static void
-pgsql_handle_notifications(PGSQL *pgsql)
+parseWalReceiverStatus(void *ctx, PGresult *result)
 {
-	PGconn *connection = pgsql->connection;
-	PGnotify *notify;
+	WalReceiverStatusContext *context = (WalReceiverStatusContext *) ctx;
+	WalReceiverStatus *status = context->status;
 
-	if (pgsql->notificationProcessFunction == NULL)
+	if (PQnfields(result) != 3)
 	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
 		return;
 	}
 
-	PQconsumeInput(connection);
-	while ((notify = PQnotifies(connection)) != NULL)
+	if (PQntuples(result) != 1)
 	{
-		log_trace("pgsql_handle_notifications: \"%s\"", notify->extra);
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
 
-		if ((*pgsql->notificationProcessFunction)(pgsql->notificationGroupId,
-												  pgsql->notificationNodeId,
-												  notify->relname,
-												  notify->extra))
-		{
-			/* mark that we received some notifications */
-			pgsql->notificationReceived = true;
-		}
+	status->isInRecovery = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
 
-		PQfreemem(notify);
-		PQconsumeInput(connection);
+	if (!stringToInt64(PQgetvalue(result, 0, 1), &(status->upstreamAgeMs)))
+	{
+		log_error("Failed to parse the wal receiver upstream age \"%s\"",
+				  PQgetvalue(result, 0, 1));
+		context->parsedOk = false;
+		return;
 	}
+
+	strlcpy(status->receivedLSN, PQgetvalue(result, 0, 2),
+			sizeof(status->receivedLSN));
+
+	context->parsedOk = true;
 }
 
 
 /*
- * pgsql_is_in_recovery connects to PostgreSQL and sets the is_in_recovery
- * boolean to the result of the SELECT pg_is_in_recovery() query. It returns
- * false when something went wrong doing that.
+ * pgsql_create_replication_slot tries to create a replication slot on the
+ * database identified by a connection string. It's implemented as CREATE IF
+ * NOT EXISTS so that it's idempotent and can be retried easily.
  */
 bool
-pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery)
+pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	char *sql = "SELECT pg_is_in_recovery()";
+	ReplicationSlotMaintainContext context = { 0 };
+	char *sql =
+		"SELECT 'create', slot_name, lsn "
+		"  FROM pg_create_physical_replication_slot($1) "
+		" WHERE NOT EXISTS "
+		" (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1)";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
-	{
-		/* errors have been logged already */
-		return false;
-	}
+	log_trace("pgsql_create_replication_slot");
 
-	if (!context.parsedOk)
-	{
-		log_error("Failed to get result from pg_is_in_recovery()");
-		return false;
-	}
+	/*
+	 * parseReplicationSlotMaintain will log_info() the replication slot
+	 * creation if it happens. When the slot already exists we return 0 row and
+	 * remain silent about it.
+	 */
+	return pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+									 &context, parseReplicationSlotMaintain);
+}
 
-	*is_in_recovery = context.boolVal;
 
-	return true;
+/*
+ * pgsql_drop_replication_slot drops a given replication slot.
+ */
+bool
+pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	char *sql =
+		"SELECT pg_drop_replication_slot(slot_name) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1";
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	log_info("Drop replication slot \"%s\"", slotName);
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 1, paramTypes, paramValues, NULL, NULL);
 }
 
 
+typedef struct LogicalSlotArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	LogicalSlotArray *slotsArray;
+	bool parsedOk;
+} LogicalSlotArrayContext;
+
+
 /*
- * check_postgresql_settings connects to our local PostgreSQL instance and
- * verifies that our minimal viable configuration is in place by running a SQL
- * query that looks at the current settings.
+ * pgsql_get_logical_slots gets the list of the logical replication slots of
+ * the Postgres server, in all the databases. Temporary slots are skipped.
  */
 bool
-pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
-								bool *settings_are_ok)
+pgsql_get_logical_slots(PGSQL *pgsql, LogicalSlotArray *slotsArray)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	const char *sql =
-		isCitusInstanceKind ?
-		CHECK_CITUS_NODE_SETTINGS_SQL : CHECK_POSTGRESQL_NODE_SETTINGS_SQL;
+	LogicalSlotArrayContext context = { { 0 }, slotsArray, false };
+	char *sql =
+		"SELECT slot_name, plugin, database, confirmed_flush_lsn, "
+		"       two_phase, coalesce(conflicting, false) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_type = 'logical' AND NOT temporary "
+		" ORDER BY slot_name";
 
 	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
+								   &context, &parseLogicalSlotArray))
 	{
-		/* errors have been logged already */
+		/* errors have already been logged */
 		return false;
 	}
 
 	if (!context.parsedOk)
 	{
-		/* errors have already been logged */
+		log_error("Failed to get the list of logical replication slots");
 		return false;
 	}
 
-	*settings_are_ok = context.boolVal;
-
 	return true;
 }
 
 
 /*
- * pgsql_check_monitor_settings connects to the given pgsql instance to check
- * that pgautofailover is part of shared_preload_libraries.
+ * parseLogicalSlotArray parses the result of the pgsql_get_logical_slots
+ * query.
  */
-bool
-pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok)
+static void
+parseLogicalSlotArray(void *ctx, PGresult *result)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	const char *sql =
-		"select exists(select 1 from "
-		"unnest("
-		"string_to_array(current_setting('shared_preload_libraries'), ','))"
-		" as t(name) "
-		"where trim(name) = 'pgautofailover');";
+	LogicalSlotArrayContext *context = (LogicalSlotArrayContext *) ctx;
+	LogicalSlotArray *slotsArray = context->slotsArray;
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
+	if (PQnfields(result) != 6)
 	{
-		/* errors have been logged already */
-		return false;
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	if (!context.parsedOk)
+	if (PQntuples(result) > LOGICAL_SLOTS_MAX_COUNT)
 	{
-		/* errors have already been logged */
-		return false;
+		log_warn("Found %d logical replication slots, only the first %d "
+				 "are considered",
+				 PQntuples(result), LOGICAL_SLOTS_MAX_COUNT);
 	}
 
-	*settings_are_ok = context.boolVal;
+	slotsArray->count = 0;
 
-	return true;
-}
+	for (int row = 0;
+		 row < PQntuples(result) && row < LOGICAL_SLOTS_MAX_COUNT;
+		 row++)
+	{
+		LogicalSlot *slot = &(slotsArray->slots[slotsArray->count++]);
 
+		strlcpy(slot->slotName, PQgetvalue(result, row, 0), NAMEDATALEN);
+		strlcpy(slot->plugin, PQgetvalue(result, row, 1), NAMEDATALEN);
+		strlcpy(slot->database, PQgetvalue(result, row, 2), NAMEDATALEN);
 
-/*
- * postgres_sprintf_replicationSlotName prints the replication Slot Name to use
- * for given nodeId in the given slotName buffer of given size.
- */
-bool
-postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int size)
-{
-	int bytesWritten =
-		sformat(slotName, size, "%s_%" PRId64,
-				REPLICATION_SLOT_NAME_DEFAULT,
-				nodeId);
+		/* confirmed_flush_lsn is NULL until the slot is consistent */
+		strlcpy(slot->confirmedFlushLSN,
+				PQgetisnull(result, row, 3) ? "" : PQgetvalue(result, row, 3),
+				PG_LSN_MAXLENGTH);
 
-	return bytesWritten <= size;
+		slot->twoPhase = strcmp(PQgetvalue(result, row, 4), "t") == 0;
+		slot->conflicting = strcmp(PQgetvalue(result, row, 5), "t") == 0;
+	}
+
+	context->parsedOk = true;
 }
 
 
 /*
- * pgsql_set_synchronous_standby_names set synchronous_standby_names on the
- * local Postgres to the value computed on the pg_auto_failover monitor.
+ * pgsql_create_logical_slot creates a logical replication slot with the same
+ * name, plugin and options as the given one, in the database we're connected
+ * to. On a standby node, Postgres waits until the primary logs a snapshot of
+ * its running transactions, so we only wait for up to timeoutMs, and the
+ * caller tries again later.
  */
 bool
-pgsql_set_synchronous_standby_names(PGSQL *pgsql,
-									char *synchronous_standby_names)
+pgsql_create_logical_slot(PGSQL *pgsql, LogicalSlot *slot, int timeoutMs)
 {
-	char quoted[BUFSIZE] = { 0 };
-	GUC setting = { "synchronous_standby_names", quoted };
+	char command[BUFSIZE] = { 0 };
 
-	if (sformat(quoted, BUFSIZE, "'%s'", synchronous_standby_names) >= BUFSIZE)
+	/* the names are used as literals in a multi-statement query */
+	if (!pgsql_is_simple_name(slot->slotName) ||
+		!pgsql_is_simple_name(slot->plugin))
 	{
-		log_error("Failed to apply the synchronous_standby_names value \"%s\": "
-				  "pg_autoctl supports values up to %d bytes and this one "
-				  "requires %lu bytes",
-				  synchronous_standby_names,
-				  BUFSIZE,
-				  (unsigned long) strlen(synchronous_standby_names));
+		log_warn("Skipping logical replication slot \"%s\" with plugin \"%s\": "
+				 "pg_autoctl only supports names made of letters, digits, "
+				 "underscores and dashes",
+				 slot->slotName, slot->plugin);
 		return false;
 	}
 
-	return pgsql_alter_system_set(pgsql, setting);
+	sformat(command, sizeof(command),
+			"SET statement_timeout TO %d; "
+			"SELECT pg_create_logical_replication_slot('%s', '%s', false, %s); "
+			"RESET statement_timeout",
+			timeoutMs,
+			slot->slotName,
+			slot->plugin,
+			slot->twoPhase ? "true" : "false");
+
+	log_info("Creating logical replication slot \"%s\" in database \"%s\"",
+			 slot->slotName, slot->database);
+
+	return pgsql_execute(pgsql, command);
 }
 
 
 /*
- * pgsql_replication_slot_maintain advances the current confirmed position of
- * the given replication slot up to the given LSN position, create the
- * replication slot if it does not exist yet, and remove the slots that exist
- * in Postgres but are ommited in the given array of slots.
+ * pgsql_advance_logical_slot advances the logical replication slot with the
+ * same name as the given one, in the database we're connected to, up to its
+ * confirmed_flush_lsn, or up to the WAL we have replayed when we're behind.
  */
-typedef struct ReplicationSlotMaintainContext
+bool
+pgsql_advance_logical_slot(PGSQL *pgsql, LogicalSlot *slot)
 {
-	char sqlstate[SQLSTATE_LENGTH];
-	char operation[NAMEDATALEN];
-	char slotName[BUFSIZE];
-	char lsn[PG_LSN_MAXLENGTH];
-	bool parsedOK;
-} ReplicationSlotMaintainContext;
+	char *sql =
+		"SELECT pg_replication_slot_advance(slot_name, "
+		"         least($2::pg_lsn, pg_last_wal_replay_lsn())) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1 "
+		"   AND slot_type = 'logical' "
+		"   AND database = current_database() "
+		"   AND confirmed_flush_lsn < least($2::pg_lsn, pg_last_wal_replay_lsn())";
+	Oid paramTypes[2] = { TEXTOID, LSNOID };
+	const char *paramValues[2] = { slot->slotName, slot->confirmedFlushLSN };
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 2, paramTypes, paramValues, NULL, NULL);
+}
 
 
 /*
- * pgsql_replication_slot_exists checks that a replication slot with the given
- * slotName exists on the Postgres server.
+ * pgsql_enable_logical_slots_sync sets hot_standby_feedback, which logical
+ * replication slots on a standby node need so that the primary keeps the
+ * catalog rows they use, and when syncWorker is true sync_replication_slots,
+ * which starts the Postgres 17 slot synchronization worker. We only ALTER
+ * SYSTEM when the settings are not already on.
  */
 bool
-pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
-							  bool *slotExists)
+pgsql_enable_logical_slots_sync(PGSQL *pgsql, bool syncWorker)
 {
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	char *sql = "SELECT 1 FROM pg_replication_slots WHERE slot_name = $1";
-	int paramCount = 1;
-	Oid paramTypes[1] = { NAMEOID };
-	const char *paramValues[1] = { slotName };
+	char *sql =
+		syncWorker
+		? "SELECT bool_and(setting = 'on') FROM pg_settings "
+		  " WHERE name IN ('hot_standby_feedback', 'sync_replication_slots')"
+		: "SELECT bool_and(setting = 'on') FROM pg_settings "
+		  " WHERE name = 'hot_standby_feedback'";
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &fetchedRows))
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
 	if (!context.parsedOk)
-	{
-		log_error("Failed to check if the replication slot \"%s\" exists",
-				  slotName);
-		return false;
-	}
-
-	/* we receive 0 rows in the result when the slot does not exist yet */
-	*slotExists = context.intVal == 1;
-
-	return true;
-}
-
-
-/*
- * pgsql_create_replication_slot tries to create a replication slot on the
- * database identified by a connection string. It's implemented as CREATE IF
- * NOT EXISTS so that it's idempotent and can be retried easily.
- */
-bool
-pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName)
-{
-	ReplicationSlotMaintainContext context = { 0 };
-	char *sql =
-		"SELECT 'create', slot_name, lsn "
-		"  FROM pg_create_physical_replication_slot($1) "
-		" WHERE NOT EXISTS "
-		" (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1)";
-	const Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { slotName };
+	{
+		log_error("Failed to check the logical replication slots settings");
+		return false;
+	}
 
-	log_trace("pgsql_create_replication_slot");
+	if (context.boolVal)
+	{
+		return true;
+	}
 
-	/*
-	 * parseReplicationSlotMaintain will log_info() the replication slot
-	 * creation if it happens. When the slot already exists we return 0 row and
-	 * remain silent about it.
-	 */
-	return pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
-									 &context, parseReplicationSlotMaintain);
+	GUC hotStandbyFeedback = { "hot_standby_feedback", "'on'" };
+	GUC syncReplicationSlots = { "sync_replication_slots", "'on'" };
+
+	log_info("Setting hot_standby_feedback%s to on for the logical "
+			 "replication slots failover",
+			 syncWorker ? " and sync_replication_slots" : "");
+
+	if (!pgsql_alter_system_set(pgsql, hotStandbyFeedback))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return !syncWorker || pgsql_alter_system_set(pgsql, syncReplicationSlots);
 }
 
 
 /*
- * pgsql_drop_replication_slot drops a given replication slot.
+ * pgsql_is_simple_name returns true when the given name only contains
+ * letters, digits, underscores and dashes.
  */
-bool
-pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
+static bool
+pgsql_is_simple_name(const char *name)
 {
-	char *sql =
-		"SELECT pg_drop_replication_slot(slot_name) "
-		"  FROM pg_replication_slots "
-		" WHERE slot_name = $1";
-	Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { slotName };
-
-	log_info("Drop replication slot \"%s\"", slotName);
-
-	return pgsql_execute_with_params(pgsql, sql,
-									 1, paramTypes, paramValues, NULL, NULL);
+	return name[0] != '\0' &&
+		   strspn(name,
+				  "abcdefghijklmnopqrstuvwxyz"
+				  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				  "0123456789_-") == strlen(name);
 }
 
 
@@ -1536,19 +3757,22 @@ pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
 typedef struct nodesArraysValuesParams
 {
 	int count;
-	Oid types[NODE_ARRAY_MAX_COUNT * 2];
-	char *values[NODE_ARRAY_MAX_COUNT * 2];
+	Oid *types;
+	char **values;
 
 	/*
-	 * Pre-allocate arrays for the data separately from the values array, which
+	 * Allocate arrays for the data separately from the values array, which
 	 * needs to be a (const char **) thing rather than a (char [][]) thing,
 	 * because of the pgsql_execute_with_params and libpq APIs.
 	 */
-	char nodeIds[NODE_ARRAY_MAX_COUNT][NODEID_MAX_LENGTH];
-	char lsns[NODE_ARRAY_MAX_COUNT][PG_LSN_MAXLENGTH];
+	char (*nodeIds)[NODEID_MAX_LENGTH];
+	char (*lsns)[PG_LSN_MAXLENGTH];
 } nodesArraysValuesParams;
 
 
+static void FreeNodesArrayValues(nodesArraysValuesParams *sqlParams);
+
+
 static bool
 BuildNodesArrayValues(NodeAddressArray *nodeArray,
 					  nodesArraysValuesParams *sqlParams,
@@ -1569,6 +3793,19 @@ BuildNodesArrayValues(NodeAddressArray *nodeArray,
 		return true;
 	}
 
+	sqlParams->types = (Oid *) calloc(nodeArray->count * 2, sizeof(Oid));
+	sqlParams->values = (char **) calloc(nodeArray->count * 2, sizeof(char *));
+	sqlParams->nodeIds = calloc(nodeArray->count, NODEID_MAX_LENGTH);
+	sqlParams->lsns = calloc(nodeArray->count, PG_LSN_MAXLENGTH);
+
+	if (sqlParams->types == NULL || sqlParams->values == NULL ||
+		sqlParams->nodeIds == NULL || sqlParams->lsns == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		FreeNodesArrayValues(sqlParams);
+		return false;
+	}
+
 	/* we start the VALUES subquery with the values SQL keyword */
 	appendPQExpBufferStr(values, "values ");
 
@@ -1592,7 +3829,7 @@ BuildNodesArrayValues(NodeAddressArray *nodeArray,
 		sqlParams->values[idParamIndex] = sqlParams->nodeIds[nodeIndex];
 
 		sqlParams->types[lsnParamIndex] = LSNOID;
-		strlcpy(sqlParams->lsns[nodeIndex], node->lsn, PG_LSN_MAXLENGTH);
+		formatLSN(node->lsn, sqlParams->lsns[nodeIndex], PG_LSN_MAXLENGTH);
 
 		/* store the (char *) pointer to the data in values */
 		sqlParams->values[lsnParamIndex] = sqlParams->lsns[nodeIndex];
@@ -1618,6 +3855,25 @@ BuildNodesArrayValues(NodeAddressArray *nodeArray,
 }
 
 
+/*
+ * FreeNodesArrayValues releases the memory allocated by BuildNodesArrayValues.
+ */
+static void
+FreeNodesArrayValues(nodesArraysValuesParams *sqlParams)
+{
+	free(sqlParams->types);
+	free(sqlParams->values);
+	free(sqlParams->nodeIds);
+	free(sqlParams->lsns);
+
+	sqlParams->types = NULL;
+	sqlParams->values = NULL;
+	sqlParams->nodeIds = NULL;
+	sqlParams->lsns = NULL;
+	sqlParams->count = 0;
+}
+
+
 /*
  * pgsql_replication_slot_create_and_drop drops replication slots that belong
  * to nodes that have been removed, and creates replication slots for nodes
@@ -1692,6 +3948,7 @@ pgsql_replication_slot_create_and_drop(PGSQL *pgsql, NodeAddressArray *nodeArray
 
 	destroyPQExpBuffer(query);
 	destroyPQExpBuffer(values);
+	FreeNodesArrayValues(&sqlParams);
 
 	return success;
 }
@@ -1769,6 +4026,67 @@ pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray)
 
 	destroyPQExpBuffer(query);
 	destroyPQExpBuffer(values);
+	FreeNodesArrayValues(&sqlParams);
+
+	return success;
+}
+
+
+/*
+ * pgsql_replication_slot_advance advances the given nodes replication slots
+ * to the LSN found in the nodeArray. We call that function on the primary for
+ * the cascaded standby nodes, which stream from another standby node and
+ * never use their replication slot on the primary.
+ */
+bool
+pgsql_replication_slot_advance(PGSQL *pgsql, NodeAddressArray *nodeArray)
+{
+	PQExpBuffer query = createPQExpBuffer();
+	PQExpBuffer values = createPQExpBuffer();
+
+	/* *INDENT-OFF* */
+	char *sqlTemplate =
+		"WITH nodes(slot_name, lsn) as ("
+		" SELECT '" REPLICATION_SLOT_NAME_DEFAULT "_' || id, lsn"
+		"   FROM (%s) as sb(id, lsn) "
+		"), \n"
+		"advanced as ("
+		"SELECT a.slot_name, a.end_lsn"
+		"  FROM pg_replication_slots s JOIN nodes USING(slot_name), "
+		"       LATERAL pg_replication_slot_advance(slot_name, lsn) a"
+		" WHERE nodes.lsn <> '0/0' and nodes.lsn >= s.restart_lsn "
+		"   and not s.active "
+		") \n"
+		"SELECT 'advance', slot_name, end_lsn FROM advanced ";
+	/* *INDENT-ON* */
+
+	nodesArraysValuesParams sqlParams = { 0 };
+	ReplicationSlotMaintainContext context = { 0 };
+
+	if (!BuildNodesArrayValues(nodeArray, &sqlParams, values))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(query);
+		destroyPQExpBuffer(values);
+
+		return false;
+	}
+
+	/* add the computed ($1,$2), ... string to the query "template" */
+	appendPQExpBuffer(query, sqlTemplate, values->data);
+
+	bool success =
+		pgsql_execute_with_params(pgsql,
+								  query->data,
+								  sqlParams.count,
+								  sqlParams.types,
+								  (const char **) sqlParams.values,
+								  &context,
+								  parseReplicationSlotMaintain);
+
+	destroyPQExpBuffer(query);
+	destroyPQExpBuffer(values);
+	FreeNodesArrayValues(&sqlParams);
 
 	return success;
 }
@@ -1885,6 +4203,65 @@ pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_get_default_transaction_read_only sets readOnly to the current value
+ * of default_transaction_read_only on the server.
+ */
+bool
+pgsql_get_default_transaction_read_only(PGSQL *pgsql, bool *readOnly)
+{
+	char *currentValue = NULL;
+
+	if (!pgsql_get_current_setting(pgsql,
+								   "default_transaction_read_only",
+								   &currentValue))
+	{
+		/* pgsql_get_current_setting logs a relevant error */
+		return false;
+	}
+
+	*readOnly = streq(currentValue, "on");
+
+	free(currentValue);
+
+	return true;
+}
+
+
+/*
+ * pgsql_promote calls pg_promote() on a standby server, which waits for up to
+ * waitSeconds for the promotion to be done. The promoted boolean is set to
+ * false when the promotion is still in progress after that time.
+ */
+bool
+pgsql_promote(PGSQL *pgsql, int waitSeconds, bool *promoted)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT pg_promote(wait => true, wait_seconds => $1)";
+
+	IntString waitSecondsStr = intToString(waitSeconds);
+	const Oid paramTypes[1] = { INT4OID };
+	const char *paramValues[1] = { waitSecondsStr.strValue };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_promote()");
+		return false;
+	}
+
+	*promoted = context.boolVal;
+
+	return true;
+}
+
+
 /*
  * pgsql_checkpoint runs a CHECKPOINT command on postgres to trigger a checkpoint.
  */
@@ -1895,6 +4272,25 @@ pgsql_checkpoint(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_checkpoint_with_timeout runs a CHECKPOINT command with a
+ * statement_timeout, so that a slow checkpoint is canceled rather than
+ * blocking the caller. When the CHECKPOINT is canceled, the implicit
+ * transaction is rolled back and the SET command with it.
+ */
+bool
+pgsql_checkpoint_with_timeout(PGSQL *pgsql, int timeoutMs)
+{
+	char command[BUFSIZE] = { 0 };
+
+	sformat(command, sizeof(command),
+			"SET statement_timeout TO %d; CHECKPOINT; RESET statement_timeout",
+			timeoutMs);
+
+	return pgsql_execute(pgsql, command);
+}
+
+
 /*
  * pgsql_alter_system_set runs an ALTER SYSTEM SET ... command on Postgres
  * to globally set a GUC and then runs pg_reload_conf() to make existing
@@ -1975,6 +4371,53 @@ pgsql_reload_conf(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_settings_need_restart checks if any of the given comma separated
+ * setting names is only applied when Postgres restarts, and copies those
+ * names to restartSettings. Names that are not known to Postgres, such as
+ * the recovery.conf settings before Postgres 12, also need a restart.
+ *
+ * We look at pg_settings.context rather than pending_restart so that the
+ * answer does not depend on when the backends process a reload.
+ */
+bool
+pgsql_settings_need_restart(PGSQL *pgsql, const char *settings,
+							bool *needRestart,
+							char *restartSettings, size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	const char *sql =
+		"SELECT coalesce(string_agg(n.name, ', ' ORDER BY n.name), '') "
+		"  FROM unnest(string_to_array($1, ',')) AS n(name) "
+		"       LEFT JOIN pg_settings s ON s.name = n.name "
+		" WHERE s.context IS NULL OR s.context = 'postmaster'";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { settings };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the context of settings \"%s\"", settings);
+		return false;
+	}
+
+	*needRestart = !IS_EMPTY_STRING_BUFFER(context.strVal);
+	strlcpy(restartSettings, context.strVal, size);
+
+	free(context.strVal);
+
+	return true;
+}
+
+
 /*
  * pgsql_get_hba_file_path gets the value of the hba_file setting in
  * Postgres or returns false if a failure occurred. The value is copied to
@@ -2375,75 +4818,194 @@ pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
 }
 
 
+/*
+ * pgsql_get_replica_reply_time sets replyTime to the most recent reply_time
+ * of the replicas connected with the given username, in microseconds since
+ * the epoch, 0 when the replicas didn't reply yet, or -1 when there is no
+ * replica at all. The reply_time column is only available in Postgres 12.
+ */
+bool
+pgsql_get_replica_reply_time(PGSQL *pgsql, char *userName, int64_t *replyTime)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	char *sql =
+		"SELECT CASE WHEN count(*) = 0 THEN -1 "
+		"            ELSE coalesce((extract(epoch FROM max(reply_time)) "
+		"                          * 1000000)::bigint, 0) "
+		"        END "
+		"  FROM pg_stat_replication WHERE usename = $1";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { userName };
+	int paramCount = 1;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the reply_time from pg_stat_replication");
+		return false;
+	}
+
+	*replyTime = (int64_t) context.bigint;
+
+	return true;
+}
+
+
 /*
  * hostname_from_uri parses a PostgreSQL connection string URI and returns
- * whether the URL was successfully parsed.
+ * whether the URL was successfully parsed. With a multi-host connection
+ * string, the first host and its port are used.
  */
 bool
 hostname_from_uri(const char *pguri,
 				  char *hostname, int maxHostLength, int *port)
 {
-	int found = 0;
+	bool found = false;
+
+	return hostname_from_uri_at(pguri, 0, hostname, maxHostLength, port, &found);
+}
+
+
+/*
+ * hostname_from_uri_at parses a PostgreSQL connection string URI, which may
+ * be a multi-host connection string, and sets hostname and port to the
+ * host at the given index in the list of hosts. The found boolean is set to
+ * false when the connection string has fewer hosts than that.
+ */
+bool
+hostname_from_uri_at(const char *pguri, int index,
+					 char *hostname, int maxHostLength, int *port,
+					 bool *found)
+{
 	char *errmsg;
 	PQconninfoOption *conninfo, *option;
 
-	conninfo = PQconninfoParse(pguri, &errmsg);
-	if (conninfo == NULL)
+	char hosts[MAXCONNINFO] = { 0 };
+	char ports[MAXCONNINFO] = { 0 };
+
+	*found = false;
+
+	conninfo = PQconninfoParse(pguri, &errmsg);
+	if (conninfo == NULL)
+	{
+		log_error("Failed to parse pguri \"%s\": %s", pguri, errmsg);
+		PQfreemem(errmsg);
+		return false;
+	}
+
+	for (option = conninfo; option->keyword != NULL; option++)
+	{
+		if ((strcmp(option->keyword, "host") == 0 ||
+			 strcmp(option->keyword, "hostaddr") == 0) &&
+			option->val != NULL)
+		{
+			strlcpy(hosts, option->val, sizeof(hosts));
+		}
+		else if (strcmp(option->keyword, "port") == 0 && option->val != NULL)
+		{
+			strlcpy(ports, option->val, sizeof(ports));
+		}
+	}
+	PQconninfoFree(conninfo);
+
+	/* without any host, keep the caller's default */
+	if (IS_EMPTY_STRING_BUFFER(hosts))
+	{
+		*port = POSTGRES_PORT;
+		return true;
+	}
+
+	/* find the host at the given index in the comma separated list */
+	char *host = hosts;
+
+	for (int i = 0; i < index && host != NULL; i++)
+	{
+		host = strchr(host, ',');
+
+		if (host != NULL)
+		{
+			++host;
+		}
+	}
+
+	if (host == NULL)
+	{
+		return true;
+	}
+
+	char *hostEnd = strchr(host, ',');
+
+	if (hostEnd != NULL)
+	{
+		*hostEnd = '\0';
+	}
+
+	int hostNameLength = strlcpy(hostname, host, maxHostLength);
+
+	if (hostNameLength >= maxHostLength)
 	{
-		log_error("Failed to parse pguri \"%s\": %s", pguri, errmsg);
-		PQfreemem(errmsg);
+		log_error("The URL \"%s\" contains a hostname of %d characters, "
+				  "the maximum supported by pg_autoctl is %d characters",
+				  pguri, hostNameLength, maxHostLength);
 		return false;
 	}
 
-	for (option = conninfo; option->keyword != NULL; option++)
+	/* a single port applies to all the hosts, otherwise use the index */
+	if (IS_EMPTY_STRING_BUFFER(ports))
+	{
+		*port = POSTGRES_PORT;
+	}
+	else
 	{
-		if (strcmp(option->keyword, "host") == 0 ||
-			strcmp(option->keyword, "hostaddr") == 0)
+		char *portString = ports;
+
+		if (strchr(ports, ',') != NULL)
 		{
-			if (option->val)
+			for (int i = 0; i < index && portString != NULL; i++)
 			{
-				int hostNameLength = strlcpy(hostname, option->val, maxHostLength);
+				portString = strchr(portString, ',');
 
-				if (hostNameLength >= maxHostLength)
+				if (portString != NULL)
 				{
-					log_error(
-						"The URL \"%s\" contains a hostname of %d characters, "
-						"the maximum supported by pg_autoctl is %d characters",
-						option->val, hostNameLength, maxHostLength);
-					PQconninfoFree(conninfo);
-					return false;
+					++portString;
 				}
-
-				++found;
 			}
-		}
 
-		if (strcmp(option->keyword, "port") == 0)
-		{
-			if (option->val)
+			if (portString == NULL)
 			{
-				/* we expect a single port number in a monitor's URI */
-				if (!stringToInt(option->val, port))
-				{
-					log_error("Failed to parse port number : %s", option->val);
-
-					PQconninfoFree(conninfo);
-					return false;
-				}
-				++found;
+				log_error("Failed to parse the URL \"%s\": "
+						  "it has more hosts than ports", pguri);
+				return false;
 			}
-			else
+
+			char *portEnd = strchr(portString, ',');
+
+			if (portEnd != NULL)
 			{
-				*port = POSTGRES_PORT;
+				*portEnd = '\0';
 			}
 		}
 
-		if (found == 2)
+		if (portString[0] == '\0')
 		{
-			break;
+			*port = POSTGRES_PORT;
+		}
+		else if (!stringToInt(portString, port))
+		{
+			log_error("Failed to parse port number : %s", portString);
+			return false;
 		}
 	}
-	PQconninfoFree(conninfo);
+
+	*found = true;
 
 	return true;
 }
@@ -2489,6 +5051,7 @@ validate_connection_string(const char *connectionString)
  *  - pg_is_in_recovery (primary or standby, as expected?)
  *  - sync_state from pg_stat_replication when a primary
  *  - current_lsn from the server
+ *  - replay_lsn from the server, the same as current_lsn on a primary
  *  - pg_control_version
  *  - catalog_version_no
  *  - system_identifier
@@ -2504,6 +5067,7 @@ typedef struct PgMetadata
 	bool pg_is_in_recovery;
 	char syncState[PGSR_SYNC_STATE_MAXLENGTH];
 	char currentLSN[PG_LSN_MAXLENGTH];
+	char replayLSN[PG_LSN_MAXLENGTH];
 	PostgresControlData control;
 } PgMetadata;
 
@@ -2513,6 +5077,7 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 							bool *pg_is_in_recovery,
 							char *pgsrSyncState,
 							char *currentLSN,
+							char *replayLSN,
 							PostgresControlData *control)
 {
 	PgMetadata context = { 0 };
@@ -2537,8 +5102,19 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 		" pg_control_version, catalog_version_no, system_identifier,"
 		" case when pg_is_in_recovery()"
 		" then (select received_tli from pg_stat_wal_receiver)"
-		" else (select timeline_id from pg_control_checkpoint()) "
-		" end as timeline_id "
+		/*
+		 * On a primary, the timeline of the last checkpoint lags behind
+		 * after a promotion, until the end-of-recovery checkpoint is done.
+		 * The WAL file name of the current LSN starts with the timeline
+		 * that is being written to, that we report to the monitor.
+		 */
+		" else ('x' || substr(pg_walfile_name(pg_current_wal_flush_lsn()),"
+		"                     1, 8))::bit(32)::int"
+		" end as timeline_id, "
+		" case when pg_is_in_recovery()"
+		" then pg_last_wal_replay_lsn()"
+		" else pg_current_wal_flush_lsn()"
+		" end as replay_lsn"
 		" from (values(1)) as dummy"
 		" full outer join"
 		" (select pg_control_version, catalog_version_no, system_identifier "
@@ -2579,7 +5155,7 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 
 	*pg_is_in_recovery = context.pg_is_in_recovery;
 
-	/* the last two metadata items are opt-in */
+	/* the last LSN and sync state metadata items are opt-in */
 	if (pgsrSyncState != NULL)
 	{
 		strlcpy(pgsrSyncState, context.syncState, PGSR_SYNC_STATE_MAXLENGTH);
@@ -2590,11 +5166,14 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 		strlcpy(currentLSN, context.currentLSN, PG_LSN_MAXLENGTH);
 	}
 
+	if (replayLSN != NULL)
+	{
+		strlcpy(replayLSN, context.replayLSN, PG_LSN_MAXLENGTH);
+	}
+
 	/* overwrite the Control Data fetched from the query */
 	*control = context.control;
 
-	pgsql_finish(pgsql);
-
 	return true;
 }
 
@@ -2609,9 +5188,9 @@ parsePgMetadata(void *ctx, PGresult *result)
 	PgMetadata *context = (PgMetadata *) ctx;
 	char *value;
 
-	if (PQnfields(result) != 7)
+	if (PQnfields(result) != 8)
 	{
-		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		log_error("Query returned %d columns, expected 8", PQnfields(result));
 		context->parsedOk = false;
 		return;
 	}
@@ -2691,6 +5270,17 @@ parsePgMetadata(void *ctx, PGresult *result)
 		}
 	}
 
+	if (!PQgetisnull(result, 0, 7))
+	{
+		value = PQgetvalue(result, 0, 7);
+
+		strlcpy(context->replayLSN, value, PG_LSN_MAXLENGTH);
+	}
+	else
+	{
+		context->replayLSN[0] = '\0';
+	}
+
 	context->parsedOk = true;
 }
 
@@ -2804,6 +5394,108 @@ pgsql_has_reached_target_lsn(PGSQL *pgsql, char *targetLSN,
 }
 
 
+/*
+ * pgsql_has_wal_replay_wait sets available to true when the Postgres server
+ * implements the pg_wal_replay_wait() procedure, which waits until the
+ * recovery has replayed the given LSN.
+ */
+bool
+pgsql_has_wal_replay_wait(PGSQL *pgsql, bool *available)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql =
+		"SELECT to_regprocedure("
+		"'pg_catalog.pg_wal_replay_wait(pg_lsn,bigint)') IS NOT NULL";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to check if pg_wal_replay_wait() is available");
+		return false;
+	}
+
+	*available = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_wal_replay_wait calls pg_wal_replay_wait() to wait for up to
+ * timeoutMs until Postgres has replayed the targetLSN. Postgres reports a
+ * timeout as an error, and so it does when recovery has ended already, which
+ * we expect here: we then set hasReachedLSN to false and return true without
+ * logging the error, the caller checks pg_last_wal_replay_lsn() anyway.
+ */
+bool
+pgsql_wal_replay_wait(PGSQL *pgsql, char *targetLSN, int timeoutMs,
+					  bool *hasReachedLSN)
+{
+	char *sql = "CALL pg_catalog.pg_wal_replay_wait($1::pg_lsn, $2::bigint)";
+	char debugParameters[BUFSIZE] = { 0 };
+
+	IntString timeoutStr = intToString(timeoutMs);
+	const Oid paramTypes[2] = { LSNOID, INT8OID };
+	const char *paramValues[2] = { targetLSN, timeoutStr.strValue };
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	(void) pgsql_format_params(2, paramValues,
+							   debugParameters, sizeof(debugParameters));
+
+	log_debug("%s;", sql);
+	log_debug("%s", debugParameters);
+
+	PGresult *result = PQexecParams(connection, sql,
+									2, paramTypes, paramValues,
+									NULL, NULL, 0);
+
+	bool success = true;
+	char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+
+	if (is_response_ok(result))
+	{
+		*hasReachedLSN = true;
+	}
+	else if (sqlstate != NULL &&
+			 (strcmp(sqlstate, STR_ERRCODE_QUERY_CANCELED) == 0 ||
+			  strcmp(sqlstate, STR_ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE) == 0))
+	{
+		/* timeout, or the recovery is over already */
+		log_debug("pg_wal_replay_wait: %s", PQresultErrorMessage(result));
+		*hasReachedLSN = false;
+	}
+	else
+	{
+		(void) pgsql_log_result_error(pgsql, result, sql, debugParameters,
+									  NULL);
+		success = false;
+	}
+
+	PQclear(result);
+	clear_results(pgsql);
+
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		PQfinish(pgsql->connection);
+		pgsql->connection = NULL;
+	}
+
+	return success;
+}
+
+
 /*
  * parsePgMetadata parses the result from a PostgreSQL query fetching
  * two columns from pg_stat_replication: sync_state and currentLSN.
@@ -2864,7 +5556,7 @@ typedef struct TimelineHistoryResult
 	char sqlstate[6];
 	bool parsedOk;
 	char filename[MAXPGPATH];
-	char content[BUFSIZE * BUFSIZE]; /* 1MB should get us quite very far */
+	const char *content;        /* points into the PGresult */
 } TimelineHistoryResult;
 
 
@@ -2940,17 +5632,23 @@ pgsql_identify_system(PGSQL *pgsql, IdentifySystem *system)
 
 		(void) parseTimelineHistoryResult((void *) &hContext, result);
 
-		PQclear(result);
-		clear_results(pgsql);
-
 		if (!hContext.parsedOk)
 		{
 			log_error("Failed to get result from TIMELINE_HISTORY");
+			PQclear(result);
+			clear_results(pgsql);
 			PQfinish(connection);
 			return false;
 		}
 
-		if (!parseTimeLineHistory(hContext.filename, hContext.content, system))
+		/* the history content is parsed in place, before PQclear() */
+		bool parsedHistory =
+			parseTimeLineHistory(hContext.filename, hContext.content, system);
+
+		PQclear(result);
+		clear_results(pgsql);
+
+		if (!parsedHistory)
 		{
 			/* errors have already been logged */
 			PQfinish(connection);
@@ -3070,18 +5768,8 @@ parseTimelineHistoryResult(void *ctx, PGresult *result)
 	char *value = PQgetvalue(result, 0, 0);
 	strlcpy(context->filename, value, sizeof(context->filename));
 
-	/* content (bytea) */
-	value = PQgetvalue(result, 0, 1);
-
-	if (strlen(value) >= sizeof(context->content))
-	{
-		log_error("Received a timeline history file of %lu bytes, "
-				  "pg_autoctl is limited to files of up to %lu bytes.",
-				  (unsigned long) strlen(value),
-				  (unsigned long) sizeof(context->content));
-		context->parsedOk = false;
-	}
-	strlcpy(context->content, value, sizeof(context->content));
+	/* content (bytea), valid until the result is cleared */
+	context->content = PQgetvalue(result, 0, 1);
 
 	context->parsedOk = true;
 }
@@ -3089,84 +5777,56 @@ parseTimelineHistoryResult(void *ctx, PGresult *result)
 
 /*
  * parseTimeLineHistory parses the content of a timeline history file.
+ *
+ * The content is scanned in place, one line at a time, without copying it:
+ * after many failovers the history file can be long, and we parse it each
+ * time we check the timeline of an upstream node. The entries are appended
+ * to the system->timelines array, which grows as needed.
  */
 bool
 parseTimeLineHistory(const char *filename, const char *content,
 					 IdentifySystem *system)
 {
-	char *historyLines[BUFSIZE] = { 0 };
-	int lineCount = splitLines((char *) content, historyLines, BUFSIZE);
-	int lineNumber = 0;
-
-	if (lineCount >= PG_AUTOCTL_MAX_TIMELINES)
-	{
-		log_error("history file \"%s\" contains %d lines, "
-				  "pg_autoctl only supports up to %d lines",
-				  filename, lineCount, PG_AUTOCTL_MAX_TIMELINES - 1);
-		return false;
-	}
-
+	TimeLineHistory *timelines = &(system->timelines);
 	uint64_t prevend = InvalidXLogRecPtr;
+	int lineNumber = 0;
 
-	system->timelines.count = 0;
-
-	TimeLineHistoryEntry *entry =
-		&(system->timelines.history[system->timelines.count]);
+	timelines->count = 0;
 
-	for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	for (const char *line = content; *line != '\0'; lineNumber++)
 	{
-		char *ptr = historyLines[lineNumber];
+		const char *eol = strchr(line, '\n');
+		const char *next = eol == NULL ? line + strlen(line) : eol + 1;
+		const char *lineEnd = eol == NULL ? next : eol;
+		const char *ptr = line;
 
 		/* skip leading whitespace and check for # comment */
-		for (; *ptr; ptr++)
+		while (ptr < lineEnd && isspace((unsigned char) *ptr))
 		{
-			if (!isspace((unsigned char) *ptr))
-			{
-				break;
-			}
+			ptr++;
 		}
 
-		if (*ptr == '\0' || *ptr == '#')
+		if (ptr == lineEnd || *ptr == '#')
 		{
+			line = next;
 			continue;
 		}
 
-		log_trace("parseTimeLineHistory line %d is \"%s\"",
-				  lineNumber,
-				  historyLines[lineNumber]);
-
-		char *tabptr = strchr(historyLines[lineNumber], '\t');
-
-		if (tabptr == NULL)
-		{
-			log_error("Failed to parse history file line %d: \"%s\"",
-					  lineNumber, ptr);
-			return false;
-		}
+		log_trace("parseTimeLineHistory line %d is \"%.*s\"",
+				  lineNumber, (int) (lineEnd - line), line);
 
-		*tabptr = '\0';
+		TimeLineHistoryEntry *entry = timelineHistoryAppend(timelines);
 
-		if (!stringToUInt(historyLines[lineNumber], &(entry->tli)))
+		if (entry == NULL)
 		{
-			log_error("Failed to parse history timeline \"%s\"", tabptr);
+			/* errors have already been logged */
 			return false;
 		}
 
-		char *lsn = tabptr + 1;
-
-		for (char *lsnend = lsn; *lsnend; lsnend++)
-		{
-			if (!(isxdigit((unsigned char) *lsnend) || *lsnend == '/'))
-			{
-				*lsnend = '\0';
-				break;
-			}
-		}
-
-		if (!parseLSN(lsn, &(entry->end)))
+		if (!scanTimeLineHistoryEntry(ptr, lineEnd, entry))
 		{
-			log_error("Failed to parse history timeline %d LSN \"%s\"",
-					  entry->tli, lsn);
+			log_error("Failed to parse history file \"%s\" line %d: \"%.*s\"",
+					  filename, lineNumber, (int) (lineEnd - line), line);
 			return false;
 		}
 
@@ -3174,39 +5834,224 @@ parseTimeLineHistory(const char *filename, const char *content,
 		prevend = entry->end;
 
 		log_trace("parseTimeLineHistory[%d]: tli %d [%X/%X %X/%X]",
-				  system->timelines.count,
+				  timelines->count - 1,
 				  entry->tli,
 				  (uint32) (entry->begin >> 32),
 				  (uint32) entry->begin,
 				  (uint32) (entry->end >> 32),
 				  (uint32) entry->end);
 
-		entry = &(system->timelines.history[++system->timelines.count]);
+		line = next;
 	}
 
 	/*
 	 * Create one more entry for the "tip" of the timeline, which has no entry
 	 * in the history file.
 	 */
+	TimeLineHistoryEntry *entry = timelineHistoryAppend(timelines);
+
+	if (entry == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	entry->tli = system->timeline;
 	entry->begin = prevend;
 	entry->end = InvalidXLogRecPtr;
 
 	log_trace("parseTimeLineHistory[%d]: tli %d [%X/%X %X/%X]",
-			  system->timelines.count,
+			  timelines->count - 1,
 			  entry->tli,
 			  (uint32) (entry->begin >> 32),
 			  (uint32) entry->begin,
 			  (uint32) (entry->end >> 32),
 			  (uint32) entry->end);
 
-	/* fix the off-by-one so that the count is a count, not an index */
-	++system->timelines.count;
+	return true;
+}
+
+
+/*
+ * scanTimeLineHistoryEntry parses a "tli<tab>X/X<tab>reason" line of a
+ * history file, between ptr and lineEnd, into the tli and end LSN of the
+ * given entry. We don't use sscanf() here because it calls strlen() on its
+ * input, which is the whole remaining file content.
+ */
+static bool
+scanTimeLineHistoryEntry(const char *ptr, const char *lineEnd,
+						 TimeLineHistoryEntry *entry)
+{
+	uint64_t tli = 0;
+	uint64_t xlogid = 0;
+	uint64_t xrecoff = 0;
+
+	if (!scanUnsignedNumber(&ptr, lineEnd, 10, &tli) ||
+		tli == 0 || tli > UINT32_MAX)
+	{
+		return false;
+	}
+
+	/* Postgres separates the fields with a tab, and accepts any spaces */
+	while (ptr < lineEnd && isspace((unsigned char) *ptr))
+	{
+		ptr++;
+	}
+
+	if (!scanUnsignedNumber(&ptr, lineEnd, 16, &xlogid) ||
+		xlogid > UINT32_MAX ||
+		ptr == lineEnd || *ptr++ != '/' ||
+		!scanUnsignedNumber(&ptr, lineEnd, 16, &xrecoff) ||
+		xrecoff > UINT32_MAX)
+	{
+		return false;
+	}
+
+	entry->tli = (uint32_t) tli;
+	entry->end = (xlogid << 32) | xrecoff;
+
+	return true;
+}
+
+
+/*
+ * scanUnsignedNumber parses the digits found at *ptr, up to end, in the given
+ * base, and advances *ptr past them. Returns false when there is no digit at
+ * *ptr, or when the number does not fit in 64 bits.
+ */
+static bool
+scanUnsignedNumber(const char **ptr, const char *end, int base,
+				   uint64_t *number)
+{
+	const char *p = *ptr;
+	uint64_t value = 0;
+
+	for (; p < end; p++)
+	{
+		int digit;
+
+		if (*p >= '0' && *p <= '9')
+		{
+			digit = *p - '0';
+		}
+		else if (base == 16 && *p >= 'a' && *p <= 'f')
+		{
+			digit = *p - 'a' + 10;
+		}
+		else if (base == 16 && *p >= 'A' && *p <= 'F')
+		{
+			digit = *p - 'A' + 10;
+		}
+		else
+		{
+			break;
+		}
+
+		if (value > (UINT64_MAX - digit) / base)
+		{
+			return false;
+		}
+
+		value = value * base + digit;
+	}
+
+	if (p == *ptr)
+	{
+		return false;
+	}
+
+	*ptr = p;
+	*number = value;
 
 	return true;
 }
 
 
+/*
+ * timelineHistoryAppend adds a new zeroed entry at the end of the given
+ * timeline history, growing the array when needed, and returns a pointer to
+ * it, or NULL when out of memory.
+ */
+static TimeLineHistoryEntry *
+timelineHistoryAppend(TimeLineHistory *timelines)
+{
+	if (timelines->count >= timelines->capacity)
+	{
+		int newCapacity =
+			timelines->capacity > 0 ? 2 * timelines->capacity : 16;
+
+		TimeLineHistoryEntry *history =
+			(TimeLineHistoryEntry *) realloc(timelines->history,
+											 newCapacity *
+											 sizeof(TimeLineHistoryEntry));
+
+		if (history == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return NULL;
+		}
+
+		timelines->history = history;
+		timelines->capacity = newCapacity;
+	}
+
+	TimeLineHistoryEntry *entry = &(timelines->history[timelines->count++]);
+
+	memset(entry, 0, sizeof(TimeLineHistoryEntry));
+
+	return entry;
+}
+
+
+/*
+ * timelineHistoryFindLSN returns the entry of the given timeline history that
+ * contains the given LSN, or NULL when the LSN is not part of the history.
+ * The entries are sorted and contiguous, so we use a binary search.
+ */
+TimeLineHistoryEntry *
+timelineHistoryFindLSN(TimeLineHistory *timelines, uint64_t lsn)
+{
+	int low = 0;
+	int high = timelines->count - 1;
+
+	while (low <= high)
+	{
+		int middle = low + (high - low) / 2;
+		TimeLineHistoryEntry *entry = &(timelines->history[middle]);
+
+		if (lsn < entry->begin)
+		{
+			high = middle - 1;
+		}
+		else if (!XLogRecPtrIsInvalid(entry->end) && lsn >= entry->end)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * timelineHistoryFree releases the memory used by the given timeline history,
+ * which is then a valid empty history again.
+ */
+void
+timelineHistoryFree(TimeLineHistory *timelines)
+{
+	free(timelines->history);
+
+	timelines->history = NULL;
+	timelines->count = 0;
+	timelines->capacity = 0;
+}
+
+
 /*
  * LISTEN/NOTIFY support.
  *
@@ -3299,10 +6144,14 @@ pgsql_prepare_to_wait(PGSQL *pgsql)
 
 /*
  * pgsql_alter_extension_update_to executes ALTER EXTENSION ... UPDATE TO ...
+ *
+ * When lockTimeoutMs is positive, the command gives up when it could not get
+ * its locks within that delay, and then lockNotAvailable is set to true.
  */
 bool
 pgsql_alter_extension_update_to(PGSQL *pgsql,
-								const char *extname, const char *version)
+								const char *extname, const char *version,
+								int lockTimeoutMs, bool *lockNotAvailable)
 {
 	char command[BUFSIZE];
 	char *escapedIdentifier, *escapedVersion;
@@ -3337,7 +6186,9 @@ pgsql_alter_extension_update_to(PGSQL *pgsql,
 	}
 
 	/* now build the SQL command */
-	int n = sformat(command, BUFSIZE, "ALTER EXTENSION %s UPDATE TO %s",
+	int n = sformat(command, BUFSIZE,
+					"SET lock_timeout TO %d; ALTER EXTENSION %s UPDATE TO %s",
+					lockTimeoutMs > 0 ? lockTimeoutMs : 0,
 					escapedIdentifier, escapedVersion);
 
 	if (n >= BUFSIZE)
@@ -3353,12 +6204,28 @@ pgsql_alter_extension_update_to(PGSQL *pgsql,
 
 	log_debug("Running command on Postgres: %s;", command);
 
+	*lockNotAvailable = false;
+
 	PGresult *result = PQexec(connection, command);
 
 	if (!is_response_ok(result))
 	{
 		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
 
+		if (sqlstate != NULL &&
+			strcmp(sqlstate, STR_ERRCODE_LOCK_NOT_AVAILABLE) == 0)
+		{
+			log_warn("Failed to update extension \"%s\" to version \"%s\" "
+					 "within %dms, its locks are not available",
+					 extname, version, lockTimeoutMs);
+
+			*lockNotAvailable = true;
+
+			PQclear(result);
+			clear_results(pgsql);
+			return false;
+		}
+
 		log_error("Error %s while running Postgres query: %s:",
 				  sqlstate, command);
 
@@ -32,9 +32,13 @@
  */
 #define BOOLOID 16
 #define NAMEOID 19
+#define INT2OID 21
 #define INT4OID 23
 #define INT8OID 20
 #define TEXTOID 25
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define NUMERICOID 1700
 #define LSNOID 3220
 
 /*
@@ -51,10 +55,10 @@
 
 /*
  * We receive a list of "other nodes" from the monitor, and we store that list
- * in local memory. We pre-allocate the memory storage, and limit how many node
- * addresses we can handle because of the pre-allocation strategy.
+ * in local memory. The storage is allocated on the heap and grows as needed,
+ * with NODE_ARRAY_INITIAL_CAPACITY entries at first.
  */
-#define NODE_ARRAY_MAX_COUNT 12
+#define NODE_ARRAY_INITIAL_CAPACITY 8
 
 
 /* abstract representation of a Postgres server that we can connect to */
@@ -138,6 +142,28 @@ typedef bool (*ProcessNotificationFunction)(int notificationGroupId,
 											int64_t notificationNodeId,
 											char *channel, char *payload);
 
+/*
+ * Connections that are kept open for several queries cache prepared
+ * statements, keyed by their SQL text. The statements are only valid on the
+ * connection they have been prepared on, so we keep track of it.
+ */
+#define PGSQL_PREPARED_STATEMENT_CACHE_SIZE 16
+#define PGSQL_PREPARED_STATEMENT_NAMELEN 32
+
+typedef struct PreparedStatement
+{
+	char *sql;
+	char name[PGSQL_PREPARED_STATEMENT_NAMELEN];
+	bool prepared;
+} PreparedStatement;
+
+typedef struct PreparedStatementCache
+{
+	PGconn *connection;
+	int serial;
+	PreparedStatement statements[PGSQL_PREPARED_STATEMENT_CACHE_SIZE];
+} PreparedStatementCache;
+
 typedef struct PGSQL
 {
 	ConnectionType connectionType;
@@ -151,6 +177,14 @@ typedef struct PGSQL
 	int notificationGroupId;
 	int64_t notificationNodeId;
 	bool notificationReceived;
+
+	PreparedStatementCache preparedStatements;
+
+	/* query sent with pgsql_send_with_params, which results we didn't read */
+	const char *pendingQuery;
+
+	/* set when a busy monitor rejected the last query, see admission control */
+	int retryAfterMs;
 } PGSQL;
 
 
@@ -169,14 +203,92 @@ typedef struct NodeAddress
 	char host[_POSIX_HOST_NAME_MAX];
 	int port;
 	int tli;
-	char lsn[PG_LSN_MAXLENGTH];
+	uint64_t lsn;
 	bool isPrimary;
 } NodeAddress;
 
+/*
+ * The pg_stat_replication view of the standby nodes connected to a primary,
+ * as Postgres array literals indexed the same way as the node ids, ready to
+ * be sent to the monitor. Lags are in milliseconds. The standby nodes that
+ * have a replication slot and are not connected have NULL LSNs and lags, and
+ * retainedBytes is how much WAL the replication slot of each node retains.
+ * The restartLSNs of the slots are only used locally, see
+ * keeper_check_replication_slots.
+ */
+#define STANDBY_REPLICATION_ARRAYS_COUNT 9
+
+typedef struct StandbyReplicationArrays
+{
+	char nodeIds[BUFSIZE];
+	char sentLSNs[BUFSIZE];
+	char writeLSNs[BUFSIZE];
+	char flushLSNs[BUFSIZE];
+	char replayLSNs[BUFSIZE];
+	char writeLags[BUFSIZE];
+	char flushLags[BUFSIZE];
+	char retainedBytes[BUFSIZE];
+	char restartLSNs[BUFSIZE];
+} StandbyReplicationArrays;
+
+/*
+ * The walsenders connected to a primary node, and the backends that wait for
+ * a synchronous standby to acknowledge their commit.
+ */
+typedef struct SyncRepStatus
+{
+	int walSenders;
+	int waiting;
+	int64_t oldestWaitMs;
+} SyncRepStatus;
+
+/*
+ * The replication status of a standby node, as seen from the standby. The
+ * upstream age is how long ago the standby last heard from its upstream node,
+ * either thanks to its wal receiver or to a replayed transaction.
+ */
+typedef struct WalReceiverStatus
+{
+	bool isInRecovery;
+	int64_t upstreamAgeMs;      /* -1 when unknown */
+	char receivedLSN[PG_LSN_MAXLENGTH];
+} WalReceiverStatus;
+
+
+/*
+ * The logical replication slots of a Postgres instance, as found in the
+ * pg_replication_slots view. Conflicting slots have been invalidated on a
+ * standby node and can't be used anymore.
+ */
+#define LOGICAL_SLOTS_MAX_COUNT 32
+
+typedef struct LogicalSlot
+{
+	char slotName[NAMEDATALEN];
+	char plugin[NAMEDATALEN];
+	char database[NAMEDATALEN];
+	char confirmedFlushLSN[PG_LSN_MAXLENGTH];
+	bool twoPhase;
+	bool conflicting;
+} LogicalSlot;
+
+typedef struct LogicalSlotArray
+{
+	int count;
+	LogicalSlot slots[LOGICAL_SLOTS_MAX_COUNT];
+} LogicalSlotArray;
+
+
+/*
+ * An array of NodeAddress, see nodeAddressArrayReserve() and friends. The
+ * nodes are allocated on the heap and the array must be released with
+ * nodeAddressArrayFree().
+ */
 typedef struct NodeAddressArray
 {
 	int count;
-	NodeAddress nodes[NODE_ARRAY_MAX_COUNT];
+	int capacity;
+	NodeAddress *nodes;
 } NodeAddressArray;
 
 
@@ -193,8 +305,6 @@ typedef struct NodeAddressArray
 #define InvalidXLogRecPtr 0
 #define XLogRecPtrIsInvalid(r) ((r) == InvalidXLogRecPtr)
 
-#define PG_AUTOCTL_MAX_TIMELINES 1024
-
 typedef struct TimeLineHistoryEntry
 {
 	uint32_t tli;
@@ -203,10 +313,17 @@ typedef struct TimeLineHistoryEntry
 } TimeLineHistoryEntry;
 
 
+/*
+ * The timeline history is a heap allocated array that grows as needed and is
+ * re-used from a call to pgsql_identify_system() to the next, see
+ * timelineHistoryFree(). Entries are sorted by LSN, the last one being the
+ * current timeline of the node.
+ */
 typedef struct TimeLineHistory
 {
 	int count;
-	TimeLineHistoryEntry history[PG_AUTOCTL_MAX_TIMELINES];
+	int capacity;
+	TimeLineHistoryEntry *history;
 } TimeLineHistory;
 
 
@@ -234,11 +351,18 @@ typedef struct ReplicationSource
 {
 	NodeAddress primaryNode;
 	char userName[NAMEDATALEN];
-	char slotName[MAXCONNINFO];
+	char slotName[NAMEDATALEN];
 	char password[MAXCONNINFO];
 	char maximumBackupRate[MAXIMUM_BACKUP_RATE_LEN];
+	char minimumBackupRate[MAXIMUM_BACKUP_RATE_LEN];
 	char backupDir[MAXCONNINFO];
-	char applicationName[MAXCONNINFO];
+	char backupCompress[NAMEDATALEN];
+	char backupWalMethod[NAMEDATALEN];
+	char backupManifestChecksums[NAMEDATALEN];
+	int cloneStreams;
+	char restoreCommand[MAXCONNINFO];
+	char applicationName[NAMEDATALEN];
+	char slotSyncDbname[NAMEDATALEN]; /* primary_conninfo dbname, or empty */
 	char targetLSN[PG_LSN_MAXLENGTH];
 	char targetAction[NAMEDATALEN];
 	char targetTimeline[NAMEDATALEN];
@@ -256,6 +380,38 @@ typedef struct ReplicationSource
 /* callback for parsing query results */
 typedef void (ParsePostgresResultCB)(void *context, PGresult *result);
 
+/* libpq resultFormat values */
+#define PGSQL_RESULT_FORMAT_TEXT 0
+#define PGSQL_RESULT_FORMAT_BINARY 1
+
+/* rows per result with libpq 17 chunked mode, see pgsql_execute_single_row */
+#define PGSQL_RESULT_CHUNK_SIZE 128
+
+/* maximum number of queries that pgsql_execute_parallel() can run */
+#define PGSQL_PARALLEL_MAX_QUERIES 16
+
+/* maximum number of prepared queries in a pgsql_execute_pipeline() call */
+#define PGSQL_PIPELINE_MAX_QUERIES 1024
+
+/* a query to run in a pipeline, see pgsql_execute_pipeline() */
+typedef struct PGSQLQuery
+{
+	const char *sql;
+	int paramCount;
+	const Oid *paramTypes;
+	const char **paramValues;
+	void *context;
+	ParsePostgresResultCB *parseFun;
+	bool prepare;               /* use a prepared statement from the start */
+} PGSQLQuery;
+
+/*
+ * callback for pgsql_execute_queue, which fills-in the next query to run on
+ * the given client, and returns false when the queue is empty
+ */
+typedef bool (PGSQLNextQueryCB)(void *context, int clientIndex,
+								PGSQLQuery *query);
+
 typedef enum
 {
 	PGSQL_RESULT_BOOL = 1,
@@ -341,25 +497,65 @@ bool pgsql_execute(PGSQL *pgsql, const char *sql);
 bool pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 							   const Oid *paramTypes, const char **paramValues,
 							   void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_with_params_binary(PGSQL *pgsql, const char *sql,
+									  int paramCount, const Oid *paramTypes,
+									  const char **paramValues,
+									  void *parseContext,
+									  ParsePostgresResultCB *parseFun);
+bool pgsql_execute_single_row(PGSQL *pgsql, const char *sql, int paramCount,
+							  const Oid *paramTypes, const char **paramValues,
+							  void *parseContext, ParsePostgresResultCB *rowFun);
+bool pgsql_execute_pipeline(PGSQL *pgsql, PGSQLQuery *queries, int queryCount);
+bool pgsql_send_with_params(PGSQL *pgsql, const char *sql, int paramCount,
+							const Oid *paramTypes, const char **paramValues);
+bool pgsql_get_pending_results(PGSQL *pgsql,
+							   void *parseContext,
+							   ParsePostgresResultCB *parseFun);
+bool pgsql_execute_parallel(PGSQL *clients, PGSQLQuery *queries, int queryCount,
+							int timeout);
+bool pgsql_execute_queue(PGSQL *clients, int clientCount, int resultFormat,
+						 PGSQLNextQueryCB *nextQuery, void *context);
 bool pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
 									 bool *settings_are_ok);
 bool pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok);
 bool pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery);
 bool pgsql_reload_conf(PGSQL *pgsql);
+bool pgsql_settings_need_restart(PGSQL *pgsql, const char *settings,
+								 bool *needRestart,
+								 char *restartSettings, size_t size);
+bool pgsql_get_sync_standby_lag_bytes(PGSQL *pgsql, int64_t *lagBytes);
+bool pgsql_count_sessions_in_transaction(PGSQL *pgsql, int *count);
+bool pgsql_signal_sessions_in_transaction(PGSQL *pgsql, bool terminate,
+										  int *count);
+bool pgsql_get_replication_lag(PGSQL *pgsql, const char *applicationName,
+							   int *lagMs);
+bool pgsql_get_standby_replication(PGSQL *pgsql,
+								   StandbyReplicationArrays *report);
+bool pgsql_get_sync_rep_status(PGSQL *pgsql, SyncRepStatus *status);
+bool pgsql_get_wal_receiver_status(PGSQL *pgsql, WalReceiverStatus *status);
 bool pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
 								   bool *slotExists);
 bool pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName);
 bool pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName);
 bool postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int size);
+bool pgsql_set_max_slot_wal_keep_size(PGSQL *pgsql, const char *size);
+bool pgsql_get_logical_slots(PGSQL *pgsql, LogicalSlotArray *slotsArray);
+bool pgsql_create_logical_slot(PGSQL *pgsql, LogicalSlot *slot, int timeoutMs);
+bool pgsql_advance_logical_slot(PGSQL *pgsql, LogicalSlot *slot);
+bool pgsql_enable_logical_slots_sync(PGSQL *pgsql, bool syncWorker);
 bool pgsql_set_synchronous_standby_names(PGSQL *pgsql,
 										 char *synchronous_standby_names);
 bool pgsql_replication_slot_create_and_drop(PGSQL *pgsql,
 											NodeAddressArray *nodeArray);
 bool pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray);
+bool pgsql_replication_slot_advance(PGSQL *pgsql, NodeAddressArray *nodeArray);
 bool pgsql_disable_synchronous_replication(PGSQL *pgsql);
 bool pgsql_set_default_transaction_mode_read_only(PGSQL *pgsql);
+bool pgsql_get_default_transaction_read_only(PGSQL *pgsql, bool *readOnly);
 bool pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql);
+bool pgsql_promote(PGSQL *pgsql, int waitSeconds, bool *promoted);
 bool pgsql_checkpoint(PGSQL *pgsql);
+bool pgsql_checkpoint_with_timeout(PGSQL *pgsql, int timeoutMs);
 bool pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength);
 bool pgsql_create_database(PGSQL *pgsql, const char *dbname, const char *owner);
 bool pgsql_create_extension(PGSQL *pgsql, const char *name);
@@ -367,14 +563,20 @@ bool pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
 					   bool login, bool superuser, bool replication,
 					   int connlimit);
 bool pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica);
+bool pgsql_get_replica_reply_time(PGSQL *pgsql, char *userName,
+								  int64_t *replyTime);
 bool hostname_from_uri(const char *pguri,
 					   char *hostname, int maxHostLength, int *port);
+bool hostname_from_uri_at(const char *pguri, int index,
+						  char *hostname, int maxHostLength, int *port,
+						  bool *found);
 bool validate_connection_string(const char *connectionString);
 bool pgsql_reset_primary_conninfo(PGSQL *pgsql);
 
 bool pgsql_get_postgres_metadata(PGSQL *pgsql,
 								 bool *pg_is_in_recovery,
 								 char *pgsrSyncState, char *currentLSN,
+								 char *replayLSN,
 								 PostgresControlData *control);
 
 bool pgsql_one_slot_has_reached_target_lsn(PGSQL *pgsql,
@@ -383,15 +585,22 @@ bool pgsql_one_slot_has_reached_target_lsn(PGSQL *pgsql,
 										   bool *hasReachedLSN);
 bool pgsql_has_reached_target_lsn(PGSQL *pgsql, char *targetLSN,
 								  char *currentLSN, bool *hasReachedLSN);
+bool pgsql_has_wal_replay_wait(PGSQL *pgsql, bool *available);
+bool pgsql_wal_replay_wait(PGSQL *pgsql, char *targetLSN, int timeoutMs,
+						   bool *hasReachedLSN);
 bool pgsql_identify_system(PGSQL *pgsql, IdentifySystem *system);
 bool pgsql_listen(PGSQL *pgsql, char *channels[]);
 bool pgsql_prepare_to_wait(PGSQL *pgsql);
 
 bool pgsql_alter_extension_update_to(PGSQL *pgsql,
-									 const char *extname, const char *version);
+									 const char *extname, const char *version,
+									 int lockTimeoutMs, bool *lockNotAvailable);
 
 bool parseTimeLineHistory(const char *filename, const char *content,
 						  IdentifySystem *system);
+TimeLineHistoryEntry * timelineHistoryFindLSN(TimeLineHistory *timelines,
+											 uint64_t lsn);
+void timelineHistoryFree(TimeLineHistory *timelines);
 
 
 #endif /* PGSQL_H */
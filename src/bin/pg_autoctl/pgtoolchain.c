@@ -0,0 +1,395 @@
+/*
+ * src/bin/pg_autoctl/pgtoolchain.c
+ *     Cache the output of the Postgres programs that pg_autoctl runs to
+ *     discover the Postgres installation, such as pg_ctl --version.
+ *
+ * Each pg_autoctl command, including short-lived ones such as pg_autoctl show
+ * state, runs pg_ctl --version, and sometimes pg_config --bindir or pg_config
+ * --sharedir. Those outputs only change when the program itself changes, so
+ * we keep them in a cache file in the pg_autoctl state directory, where each
+ * entry is keyed on the program path and the device, inode, size, mtime and
+ * ctime of the program file. Installing another version of Postgres over the
+ * same path changes at least one of those, and the cached entry is then
+ * ignored and replaced.
+ *
+ * The cache is only a shortcut: failure to read or write it is never an
+ * error, we then run the programs as usual.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgtoolchain.h"
+#include "string_utils.h"
+
+/*
+ * A cache entry is a line of tab separated fields:
+ *
+ *   program option dev ino size mtime ctime value
+ */
+#define PG_TOOLCHAIN_CACHE_FIELDS 8
+
+typedef struct ToolchainCacheKey
+{
+	unsigned long long dev;
+	unsigned long long ino;
+	long long size;
+	long long mtime;
+	long long ctime;
+} ToolchainCacheKey;
+
+static bool pg_toolchain_cache_path(char *filename);
+static bool pg_toolchain_cache_key(const char *program, ToolchainCacheKey *key);
+static bool pg_toolchain_cache_valid_string(const char *str);
+static int pg_toolchain_cache_split(char *line,
+									char **fields, int count);
+static bool pg_toolchain_cache_entry_matches(char **fields,
+											 const char *program,
+											 const char *option,
+											 ToolchainCacheKey *key);
+
+
+/*
+ * pg_toolchain_cache_lookup copies the cached output of running "program
+ * option" to the given value buffer, and returns true when the cache has an
+ * entry for it that matches the current program file.
+ */
+bool
+pg_toolchain_cache_lookup(const char *program, const char *option,
+						  char *value, size_t size)
+{
+	char filename[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long fileSize = 0L;
+	ToolchainCacheKey key = { 0 };
+
+	if (!pg_toolchain_cache_path(filename) ||
+		!pg_toolchain_cache_key(program, &key))
+	{
+		return false;
+	}
+
+	if (!file_exists(filename) ||
+		!read_file_if_exists(filename, &contents, &fileSize))
+	{
+		return false;
+	}
+
+	char *lines[PG_TOOLCHAIN_CACHE_MAX_ENTRIES];
+	int lineCount = splitLines(contents, lines, PG_TOOLCHAIN_CACHE_MAX_ENTRIES);
+	bool found = false;
+
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		char *fields[PG_TOOLCHAIN_CACHE_FIELDS] = { 0 };
+
+		if (pg_toolchain_cache_split(lines[lineNumber],
+									 fields,
+									 PG_TOOLCHAIN_CACHE_FIELDS) !=
+			PG_TOOLCHAIN_CACHE_FIELDS)
+		{
+			continue;
+		}
+
+		if (pg_toolchain_cache_entry_matches(fields, program, option, &key) &&
+			fields[7][0] != '\0' &&
+			strlen(fields[7]) < size)
+		{
+			strlcpy(value, fields[7], size);
+			found = true;
+			break;
+		}
+	}
+
+	free(contents);
+
+	if (found)
+	{
+		log_trace("pg_toolchain_cache_lookup: \"%s %s\" is \"%s\"",
+				  program, option, value);
+	}
+
+	return found;
+}
+
+
+/*
+ * pg_toolchain_cache_store adds or replaces the cache entry for running
+ * "program option", keeping the other entries found in the cache file.
+ *
+ * The cache file is written to a temporary file first, and then renamed, so
+ * that concurrent pg_autoctl processes only ever read a complete file. When
+ * two processes store an entry at the same time, one of the entries is lost,
+ * and is going to be computed and stored again later.
+ */
+void
+pg_toolchain_cache_store(const char *program, const char *option,
+						 const char *value)
+{
+	char filename[MAXPGPATH] = { 0 };
+	char tempFilename[MAXPGPATH] = { 0 };
+	char directory[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long fileSize = 0L;
+	ToolchainCacheKey key = { 0 };
+
+	if (!pg_toolchain_cache_valid_string(program) ||
+		!pg_toolchain_cache_valid_string(option) ||
+		!pg_toolchain_cache_valid_string(value))
+	{
+		return;
+	}
+
+	if (!pg_toolchain_cache_path(filename) ||
+		!pg_toolchain_cache_key(program, &key))
+	{
+		return;
+	}
+
+	strlcpy(directory, filename, sizeof(directory));
+	get_parent_directory(directory);
+
+	if (pg_mkdir_p(directory, 0700) == -1)
+	{
+		log_debug("Failed to create directory \"%s\": %m", directory);
+		return;
+	}
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	appendPQExpBuffer(buffer, "%s\t%s\t%llu\t%llu\t%lld\t%lld\t%lld\t%s\n",
+					  program, option,
+					  key.dev, key.ino, key.size, key.mtime, key.ctime,
+					  value);
+
+	/* now keep the other entries, up to our maximum number of entries */
+	if (file_exists(filename) &&
+		read_file_if_exists(filename, &contents, &fileSize))
+	{
+		char *lines[PG_TOOLCHAIN_CACHE_MAX_ENTRIES];
+		int lineCount =
+			splitLines(contents, lines, PG_TOOLCHAIN_CACHE_MAX_ENTRIES);
+
+		for (int lineNumber = 0;
+			 lineNumber < lineCount &&
+			 lineNumber < PG_TOOLCHAIN_CACHE_MAX_ENTRIES - 1;
+			 lineNumber++)
+		{
+			char line[BUFSIZE] = { 0 };
+			char *fields[PG_TOOLCHAIN_CACHE_FIELDS] = { 0 };
+
+			strlcpy(line, lines[lineNumber], sizeof(line));
+
+			if (pg_toolchain_cache_split(line,
+										 fields,
+										 PG_TOOLCHAIN_CACHE_FIELDS) !=
+				PG_TOOLCHAIN_CACHE_FIELDS)
+			{
+				continue;
+			}
+
+			/* skip the entry we are replacing */
+			if (strcmp(fields[0], program) == 0 &&
+				strcmp(fields[1], option) == 0)
+			{
+				continue;
+			}
+
+			appendPQExpBuffer(buffer, "%s\n", lines[lineNumber]);
+		}
+
+		free(contents);
+	}
+
+	if (PQExpBufferBroken(buffer))
+	{
+		destroyPQExpBuffer(buffer);
+		return;
+	}
+
+	sformat(tempFilename, sizeof(tempFilename), "%s.%d", filename, getpid());
+
+	FILE *stream = fopen(tempFilename, "w");
+
+	if (stream == NULL)
+	{
+		log_debug("Failed to open file \"%s\": %m", tempFilename);
+		destroyPQExpBuffer(buffer);
+		return;
+	}
+
+	bool success =
+		fwrite(buffer->data, sizeof(char), buffer->len, stream) == buffer->len;
+
+	if (fclose(stream) == EOF)
+	{
+		success = false;
+	}
+
+	destroyPQExpBuffer(buffer);
+
+	if (!success || rename(tempFilename, filename) != 0)
+	{
+		log_debug("Failed to write file \"%s\": %m", filename);
+		(void) unlink(tempFilename);
+		return;
+	}
+
+	log_trace("pg_toolchain_cache_store: \"%s %s\" is \"%s\"",
+			  program, option, value);
+}
+
+
+/*
+ * pg_toolchain_cache_path sets filename to the path of the cache file, in the
+ * same top-level XDG_DATA_HOME directory as our state files. The cache is not
+ * specific to a PGDATA, which allows running several nodes with the same
+ * Postgres installation to share it.
+ */
+static bool
+pg_toolchain_cache_path(char *filename)
+{
+	char home[MAXPGPATH] = { 0 };
+	char fallback[MAXPGPATH] = { 0 };
+	char xdg_topdir[MAXPGPATH] = { 0 };
+
+	if (env_exists("HOME") && get_env_copy("HOME", home, MAXPGPATH))
+	{
+		join_path_components(fallback, home, ".local/share");
+	}
+
+	if (env_exists("XDG_DATA_HOME"))
+	{
+		if (!get_env_copy("XDG_DATA_HOME", xdg_topdir, MAXPGPATH))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		strlcpy(xdg_topdir, fallback, MAXPGPATH);
+	}
+
+	if (xdg_topdir[0] == '\0')
+	{
+		return false;
+	}
+
+	join_path_components(filename, xdg_topdir, "pg_autoctl");
+	join_path_components(filename, filename, PG_TOOLCHAIN_CACHE_FILENAME);
+
+	return true;
+}
+
+
+/*
+ * pg_toolchain_cache_key fills in the cache key of the given program file.
+ */
+static bool
+pg_toolchain_cache_key(const char *program, ToolchainCacheKey *key)
+{
+	struct stat st;
+
+	if (stat(program, &st) != 0)
+	{
+		return false;
+	}
+
+	key->dev = (unsigned long long) st.st_dev;
+	key->ino = (unsigned long long) st.st_ino;
+	key->size = (long long) st.st_size;
+	key->mtime = (long long) st.st_mtime;
+	key->ctime = (long long) st.st_ctime;
+
+	return true;
+}
+
+
+/*
+ * pg_toolchain_cache_valid_string returns true when the given string can be
+ * stored as a field of the cache file.
+ */
+static bool
+pg_toolchain_cache_valid_string(const char *str)
+{
+	return str != NULL &&
+		   str[0] != '\0' &&
+		   strlen(str) < MAXPGPATH &&
+		   strpbrk(str, "\t\r\n") == NULL;
+}
+
+
+/*
+ * pg_toolchain_cache_split splits the given line in place at tab characters,
+ * and returns how many fields have been found.
+ */
+static int
+pg_toolchain_cache_split(char *line, char **fields, int count)
+{
+	int fieldCount = 0;
+	char *ptr = line;
+
+	while (ptr != NULL && fieldCount < count)
+	{
+		fields[fieldCount++] = ptr;
+
+		ptr = strchr(ptr, '\t');
+
+		if (ptr != NULL)
+		{
+			*ptr++ = '\0';
+		}
+	}
+
+	/* more fields than expected is an error too */
+	return ptr == NULL ? fieldCount : -1;
+}
+
+
+/*
+ * pg_toolchain_cache_entry_matches returns true when the given cache entry
+ * fields are about the given program and option, and the program file has not
+ * changed since the entry was written.
+ */
+static bool
+pg_toolchain_cache_entry_matches(char **fields,
+								 const char *program,
+								 const char *option,
+								 ToolchainCacheKey *key)
+{
+	char keyString[BUFSIZE] = { 0 };
+	char entryString[BUFSIZE] = { 0 };
+
+	if (strcmp(fields[0], program) != 0 || strcmp(fields[1], option) != 0)
+	{
+		return false;
+	}
+
+	sformat(keyString, sizeof(keyString), "%llu\t%llu\t%lld\t%lld\t%lld",
+			key->dev, key->ino, key->size, key->mtime, key->ctime);
+
+	sformat(entryString, sizeof(entryString), "%s\t%s\t%s\t%s\t%s",
+			fields[2], fields[3], fields[4], fields[5], fields[6]);
+
+	return strcmp(keyString, entryString) == 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * src/bin/pg_autoctl/pgtoolchain.h
+ *     Cache the output of the Postgres programs that pg_autoctl runs to
+ *     discover the Postgres installation, such as pg_ctl --version.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PGTOOLCHAIN_H
+#define PGTOOLCHAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PG_TOOLCHAIN_CACHE_FILENAME "toolchain.cache"
+#define PG_TOOLCHAIN_CACHE_MAX_ENTRIES 32
+
+bool pg_toolchain_cache_lookup(const char *program, const char *option,
+							   char *value, size_t size);
+void pg_toolchain_cache_store(const char *program, const char *option,
+							  const char *value);
+
+#endif /* PGTOOLCHAIN_H */
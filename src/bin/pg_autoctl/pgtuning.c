@@ -7,6 +7,8 @@
  *
  */
 
+#include <inttypes.h>
+
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
 
@@ -40,49 +42,136 @@ GUC postgres_tuning[] = {
 };
 
 
+/*
+ * Apart from the settings in the static array, the profile settings are only
+ * added when we compute them: they are not part of the unit test suite
+ * default setup.
+ */
+/* shared memory that is not shared_buffers nor wal_buffers, approximately */
+#define PG_TUNING_SHMEM_OVERHEAD (((uint64_t) 64) << 20) /* 64 MB */
+
 typedef struct DynamicTuning
 {
+	PgTuningProfile profile;
+	StorageType storageType;
+
 	int autovacuum_max_workers;
 	uint64_t shared_buffers;
 	uint64_t work_mem;
 	uint64_t maintenance_work_mem;
 	uint64_t effective_cache_size;
+
+	/* profile settings */
+	uint64_t wal_buffers;
+	uint64_t min_wal_size;
+	uint64_t max_wal_size;
+	double checkpoint_completion_target;
+	int effective_io_concurrency;
+	double random_page_cost;
+	int max_parallel_workers;
+	int max_parallel_workers_per_gather;
+	char *huge_pages;
+
+	/* monitor profile settings */
+	int max_connections;
+	int checkpoint_timeout;     /* seconds */
+	int autovacuum_naptime;     /* seconds */
 } DynamicTuning;
 
 
 static bool pgtuning_compute_mem_settings(SystemInfo *sysInfo,
 										  DynamicTuning *tuning);
 
+static void pgtuning_compute_profile_settings(SystemInfo *sysInfo,
+											  DynamicTuning *tuning);
+
+static void pgtuning_compute_huge_pages(SystemInfo *sysInfo,
+										DynamicTuning *tuning);
+
 void pgtuning_log_settings(DynamicTuning *tuning, int logLevel);
 
 static int pgtuning_compute_max_workers(SystemInfo *sysInfo);
 
+static void pgtuning_append_bytes(PQExpBuffer contents,
+								  const char *name, uint64_t bytes);
+
 static bool pgtuning_edit_guc_settings(GUC *settings, DynamicTuning *tuning,
 									   char *config, size_t size);
 
 
 /*
- * pgtuning_prepare_guc_settings probes the system information (nCPU and total
- * RAM) and computes some better defaults for Postgres.
+ * pgtuning_prepare_guc_settings probes the system information (nCPU, total
+ * RAM, and storage type of PGDATA) and computes some better defaults for
+ * Postgres, adjusted to the given workload profile.
  */
 bool
-pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
+pgtuning_prepare_guc_settings(GUC *settings,
+							  const char *pgdata,
+							  const char *profile,
+							  char *config, size_t size)
 {
 	SystemInfo sysInfo = { 0 };
 	DynamicTuning tuning = { 0 };
 	char totalram[BUFSIZE] = { 0 };
 
+	if (profile == NULL || IS_EMPTY_STRING_BUFFER(profile))
+	{
+		profile = DEFAULT_TUNING_PROFILE;
+	}
+
+	tuning.profile = pgtuning_parse_profile(profile);
+
+	if (tuning.profile == PG_TUNING_PROFILE_UNKNOWN)
+	{
+		log_error("Unknown tuning profile \"%s\", "
+				  "expected one of oltp, mixed, analytics, write-heavy, "
+				  "monitor",
+				  profile);
+		return false;
+	}
+
 	if (!get_system_info(&sysInfo))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
+	if (!get_storage_type(pgdata, &sysInfo))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	tuning.storageType = sysInfo.storageType;
+
 	(void) pretty_print_bytes(totalram, sizeof(totalram), sysInfo.totalram);
 
-	log_debug("Detected %d CPUs and %s total RAM on this server",
+	log_debug("Detected %d CPUs, %s total RAM, and %s storage on this server",
 			  sysInfo.ncpu,
-			  totalram);
+			  totalram,
+			  storage_type_to_string(sysInfo.storageType));
+
+	if (sysInfo.totalram < sysInfo.physicalram)
+	{
+		char physicalram[BUFSIZE] = { 0 };
+
+		(void) pretty_print_bytes(physicalram, sizeof(physicalram),
+								  sysInfo.physicalram);
+
+		log_debug("Using the cgroup memory limit of %s rather than "
+				  "the %s of physical RAM",
+				  totalram,
+				  physicalram);
+	}
+
+	if (sysInfo.hugePagesTotal > 0)
+	{
+		log_debug("Detected %" PRIu64 " huge pages of %" PRIu64 " kB, "
+				  "%" PRIu64 " of them free",
+				  sysInfo.hugePagesTotal,
+				  sysInfo.hugePageSize / 1024,
+				  sysInfo.hugePagesFree);
+	}
 
 	/*
 	 * Disable Postgres tuning when running the unit test suite: we install our
@@ -99,6 +188,8 @@ pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
 			return false;
 		}
 
+		(void) pgtuning_compute_profile_settings(&sysInfo, &tuning);
+		(void) pgtuning_compute_huge_pages(&sysInfo, &tuning);
 		(void) pgtuning_log_settings(&tuning, LOG_DEBUG);
 	}
 
@@ -106,6 +197,80 @@ pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
 }
 
 
+/*
+ * pgtuning_parse_profile parses a string that represents a PgTuningProfile
+ * value.
+ */
+PgTuningProfile
+pgtuning_parse_profile(const char *profile)
+{
+	PgTuningProfile enumArray[] = {
+		PG_TUNING_PROFILE_OLTP,
+		PG_TUNING_PROFILE_MIXED,
+		PG_TUNING_PROFILE_ANALYTICS,
+		PG_TUNING_PROFILE_WRITE_HEAVY,
+		PG_TUNING_PROFILE_MONITOR
+	};
+
+	char *profileArray[] = {
+		"oltp", "mixed", "analytics", "write-heavy", "monitor", NULL
+	};
+
+	for (int i = 0; profileArray[i] != NULL; i++)
+	{
+		if (strcmp(profile, profileArray[i]) == 0)
+		{
+			return enumArray[i];
+		}
+	}
+
+	return PG_TUNING_PROFILE_UNKNOWN;
+}
+
+
+/*
+ * pgtuning_profile_to_string returns the string representation of a
+ * PgTuningProfile enum value.
+ */
+char *
+pgtuning_profile_to_string(PgTuningProfile profile)
+{
+	switch (profile)
+	{
+		case PG_TUNING_PROFILE_OLTP:
+		{
+			return "oltp";
+		}
+
+		case PG_TUNING_PROFILE_MIXED:
+		{
+			return "mixed";
+		}
+
+		case PG_TUNING_PROFILE_ANALYTICS:
+		{
+			return "analytics";
+		}
+
+		case PG_TUNING_PROFILE_WRITE_HEAVY:
+		{
+			return "write-heavy";
+		}
+
+		case PG_TUNING_PROFILE_MONITOR:
+		{
+			return "monitor";
+		}
+
+		case PG_TUNING_PROFILE_UNKNOWN:
+			return "unknown";
+	}
+
+	log_error("BUG: tuning profile %d is unknown", profile);
+	return "unknown";
+}
+
+
 /*
  * pgtuning_compute_max_workers returns how many autovacuum max workers we can
  * setup on the local system, depending on its number of CPUs.
@@ -201,6 +366,19 @@ pgtuning_compute_mem_settings(SystemInfo *sysInfo, DynamicTuning *tuning)
 		tuning->maintenance_work_mem = 2 * oneGB;   /*  2 GB */
 	}
 
+	/*
+	 * The monitor data set is a handful of rows in the node table and an
+	 * append-only event table: it fits in a small cache. Most of the monitor
+	 * connections are keepers that call node_active() or sit idle waiting
+	 * for a notification, so we keep the per-connection memory small.
+	 */
+	if (tuning->profile == PG_TUNING_PROFILE_MONITOR)
+	{
+		tuning->shared_buffers = Min(tuning->shared_buffers, oneGB);
+		tuning->work_mem = 4 * 1 << 20;               /*   4 MB */
+		tuning->maintenance_work_mem = 64 * 1 << 20;  /*  64 MB */
+	}
+
 	/*
 	 * What's not in shared buffers is expected to be mostly file system cache,
 	 * and then again effective_cache_size is a hint and does not need to be
@@ -208,10 +386,249 @@ pgtuning_compute_mem_settings(SystemInfo *sysInfo, DynamicTuning *tuning)
 	 */
 	tuning->effective_cache_size = sysInfo->totalram - tuning->shared_buffers;
 
+	/*
+	 * Analytics queries sort and hash much more data than short transactions
+	 * do, and bulk loading data benefits from bigger index builds.
+	 */
+	if (tuning->profile == PG_TUNING_PROFILE_ANALYTICS)
+	{
+		tuning->work_mem *= 4;
+		tuning->maintenance_work_mem *= 2;
+	}
+	else if (tuning->profile == PG_TUNING_PROFILE_WRITE_HEAVY)
+	{
+		tuning->maintenance_work_mem *= 2;
+	}
+
 	return true;
 }
 
 
+/*
+ * pgtuning_compute_profile_settings computes the WAL, checkpoint, I/O and
+ * parallelism settings from the workload profile, the system properties, and
+ * the memory settings that have already been computed.
+ */
+static void
+pgtuning_compute_profile_settings(SystemInfo *sysInfo, DynamicTuning *tuning)
+{
+	uint64_t oneMB = ((uint64_t) 1) << 20;
+	uint64_t oneGB = ((uint64_t) 1) << 30;
+
+	/*
+	 * The default wal_buffers is 1/32 of shared_buffers up to 16 MB, which
+	 * is too small for sustained write activity on big servers.
+	 */
+	tuning->wal_buffers = 16 * oneMB;
+
+	if (tuning->profile == PG_TUNING_PROFILE_WRITE_HEAVY &&
+		tuning->shared_buffers >= (4 * oneGB))
+	{
+		tuning->wal_buffers = 64 * oneMB;
+	}
+
+	/*
+	 * Size max_wal_size so that checkpoints are triggered by the timeout
+	 * rather than by the amount of WAL, in proportion with the server size.
+	 */
+	if (sysInfo->totalram <= (8 * oneGB))
+	{
+		tuning->max_wal_size = 2 * oneGB;
+	}
+	else if (sysInfo->totalram <= (64 * oneGB))
+	{
+		tuning->max_wal_size = 4 * oneGB;
+	}
+	else if (sysInfo->totalram <= (256 * oneGB))
+	{
+		tuning->max_wal_size = 8 * oneGB;
+	}
+	else
+	{
+		tuning->max_wal_size = 16 * oneGB;
+	}
+
+	if (tuning->profile == PG_TUNING_PROFILE_ANALYTICS)
+	{
+		tuning->max_wal_size *= 2;
+	}
+	else if (tuning->profile == PG_TUNING_PROFILE_WRITE_HEAVY)
+	{
+		tuning->max_wal_size *= 4;
+	}
+
+	tuning->min_wal_size = tuning->max_wal_size / 4;
+	tuning->checkpoint_completion_target = 0.9;
+
+	/*
+	 * The monitor commits a tiny transaction for each node_active() call,
+	 * updating the same few pages of the node table over and over again. The
+	 * WAL volume is then mostly the full page images written at the first
+	 * change of those pages after each checkpoint: spacing checkpoints cuts
+	 * most of it, and keeping recycled segments around avoids creating new
+	 * WAL files in the commit path. We keep synchronous_commit on: the
+	 * monitor must not forget a state it has assigned to a node.
+	 *
+	 * Each keeper holds a connection to the monitor, and some commands add a
+	 * LISTEN connection, so we allow more than the default 100 connections.
+	 * Finally a shorter autovacuum naptime lets the per-table autovacuum
+	 * settings of the node table kick in before it bloats.
+	 */
+	if (tuning->profile == PG_TUNING_PROFILE_MONITOR)
+	{
+		tuning->max_wal_size = oneGB;
+		tuning->min_wal_size = 256 * oneMB;
+		tuning->checkpoint_timeout = 15 * 60;
+		tuning->max_connections = 300;
+		tuning->autovacuum_naptime = 10;
+	}
+
+	/*
+	 * On SSD storage random reads cost about the same as sequential reads,
+	 * and the device is happy to serve many requests concurrently. Postgres
+	 * only supports effective_io_concurrency where posix_fadvise() exists.
+	 */
+	switch (tuning->storageType)
+	{
+		case STORAGE_TYPE_SSD:
+		{
+			tuning->random_page_cost = 1.1;
+#if !defined(__APPLE__)
+			tuning->effective_io_concurrency = 200;
+#endif
+			break;
+		}
+
+		case STORAGE_TYPE_HDD:
+		{
+#if !defined(__APPLE__)
+			tuning->effective_io_concurrency = 2;
+#endif
+			break;
+		}
+
+		case STORAGE_TYPE_UNKNOWN:
+		{
+			/* keep the Postgres defaults */
+			break;
+		}
+	}
+
+	/*
+	 * We don't change max_worker_processes: a standby requires a value at
+	 * least as large as its primary's, and our nodes might have different
+	 * numbers of CPUs. The parallel workers are taken from the default pool
+	 * of 8 worker processes.
+	 */
+	int maxParallelWorkers = Min(sysInfo->ncpu, 8);
+	int perGather = 0;
+
+	switch (tuning->profile)
+	{
+		case PG_TUNING_PROFILE_ANALYTICS:
+		{
+			perGather = sysInfo->ncpu / 2;
+			break;
+		}
+
+		case PG_TUNING_PROFILE_MIXED:
+		{
+			perGather = Min(sysInfo->ncpu / 4, 4);
+			break;
+		}
+
+		case PG_TUNING_PROFILE_MONITOR:
+		{
+			/* node_active() and friends only do index lookups */
+			perGather = 0;
+			break;
+		}
+
+		default:
+		{
+			/* short transactions don't benefit from parallel query */
+			perGather = Min(sysInfo->ncpu / 8, 2);
+			break;
+		}
+	}
+
+	tuning->max_parallel_workers = maxParallelWorkers;
+	tuning->max_parallel_workers_per_gather = Min(perGather, maxParallelWorkers);
+}
+
+
+/*
+ * pgtuning_compute_huge_pages decides whether to use huge pages, depending on
+ * the huge pages that are reserved on the system.
+ *
+ * Postgres refuses to start with huge_pages = on when it can't allocate its
+ * shared memory segment in huge pages, so we only use "on" when the huge
+ * pages that are currently free can hold the segment. When Postgres is
+ * already running, it uses some of the reserved pages itself: then we keep
+ * "try", which still uses huge pages when possible.
+ */
+static void
+pgtuning_compute_huge_pages(SystemInfo *sysInfo, DynamicTuning *tuning)
+{
+	tuning->huge_pages = "try";
+
+	if (sysInfo->hugePagesTotal == 0 || sysInfo->hugePageSize == 0)
+	{
+		return;
+	}
+
+	/*
+	 * The shared memory segment is mostly shared_buffers and wal_buffers,
+	 * the rest depends on max_connections and other settings that we don't
+	 * tune here. Add some headroom for those.
+	 */
+	uint64_t segmentSize =
+		tuning->shared_buffers
+		+ tuning->wal_buffers
+		+ PG_TUNING_SHMEM_OVERHEAD;
+
+	uint64_t pagesNeeded =
+		(segmentSize + sysInfo->hugePageSize - 1) / sysInfo->hugePageSize;
+
+	char segment[BUFSIZE] = { 0 };
+	char reserved[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(segment, sizeof(segment), segmentSize);
+	(void) pretty_print_bytes(reserved, sizeof(reserved),
+							  sysInfo->hugePagesTotal * sysInfo->hugePageSize);
+
+	if (pagesNeeded <= sysInfo->hugePagesFree)
+	{
+		log_debug("Using huge_pages = on: the %s shared memory segment "
+				  "fits in %" PRIu64 " of the %" PRIu64 " free huge pages",
+				  segment,
+				  pagesNeeded,
+				  sysInfo->hugePagesFree);
+
+		tuning->huge_pages = "on";
+	}
+	else if (pagesNeeded <= sysInfo->hugePagesTotal)
+	{
+		log_debug("Using huge_pages = try: the %s shared memory segment needs "
+				  "%" PRIu64 " huge pages, only %" PRIu64 " are free now",
+				  segment,
+				  pagesNeeded,
+				  sysInfo->hugePagesFree);
+	}
+	else
+	{
+		log_warn("The %s of reserved huge pages can't fit the %s shared "
+				 "memory segment for shared_buffers, "
+				 "Postgres is going to use regular pages",
+				 reserved,
+				 segment);
+		log_warn("HINT: set vm.nr_hugepages to at least %" PRIu64
+				 " to use huge pages",
+				 pagesNeeded);
+	}
+}
+
+
 /*
  * pgtuning_log_mem_settings logs the memory settings we computed.
  */
@@ -237,6 +654,33 @@ pgtuning_log_settings(DynamicTuning *tuning, int logLevel)
 	(void) pretty_print_bytes(buf, sizeof(buf),
 							  tuning->effective_cache_size);
 	log_level(logLevel, "Setting effective_cache_size to %s", buf);
+
+	log_level(logLevel, "Using tuning profile \"%s\"",
+			  pgtuning_profile_to_string(tuning->profile));
+
+	(void) pretty_print_bytes(buf, sizeof(buf), tuning->wal_buffers);
+	log_level(logLevel, "Setting wal_buffers to %s", buf);
+
+	(void) pretty_print_bytes(buf, sizeof(buf), tuning->max_wal_size);
+	log_level(logLevel, "Setting max_wal_size to %s", buf);
+
+	log_level(logLevel,
+			  "Setting max_parallel_workers_per_gather to %d",
+			  tuning->max_parallel_workers_per_gather);
+
+	if (tuning->effective_io_concurrency > 0)
+	{
+		log_level(logLevel,
+				  "Setting effective_io_concurrency to %d",
+				  tuning->effective_io_concurrency);
+	}
+
+	if (tuning->max_connections > 0)
+	{
+		log_level(logLevel,
+				  "Setting max_connections to %d",
+				  tuning->max_connections);
+	}
 }
 
 
@@ -363,6 +807,60 @@ pgtuning_edit_guc_settings(GUC *settings, DynamicTuning *tuning,
 		}
 	}
 
+	/* the profile settings are not part of the static array */
+	if (tuning->max_wal_size > 0)
+	{
+		appendPQExpBuffer(contents,
+						  "\n# tuning profile \"%s\" for %s storage\n",
+						  pgtuning_profile_to_string(tuning->profile),
+						  storage_type_to_string(tuning->storageType));
+
+		pgtuning_append_bytes(contents, "wal_buffers", tuning->wal_buffers);
+		pgtuning_append_bytes(contents, "min_wal_size", tuning->min_wal_size);
+		pgtuning_append_bytes(contents, "max_wal_size", tuning->max_wal_size);
+
+		appendPQExpBuffer(contents, "checkpoint_completion_target = %g\n",
+						  tuning->checkpoint_completion_target);
+
+		if (tuning->checkpoint_timeout > 0)
+		{
+			appendPQExpBuffer(contents, "checkpoint_timeout = '%ds'\n",
+							  tuning->checkpoint_timeout);
+		}
+
+		if (tuning->max_connections > 0)
+		{
+			appendPQExpBuffer(contents, "max_connections = %d\n",
+							  tuning->max_connections);
+		}
+
+		if (tuning->autovacuum_naptime > 0)
+		{
+			appendPQExpBuffer(contents, "autovacuum_naptime = '%ds'\n",
+							  tuning->autovacuum_naptime);
+		}
+
+		if (tuning->effective_io_concurrency > 0)
+		{
+			appendPQExpBuffer(contents, "effective_io_concurrency = %d\n",
+							  tuning->effective_io_concurrency);
+		}
+
+		if (tuning->random_page_cost > 0)
+		{
+			appendPQExpBuffer(contents, "random_page_cost = %g\n",
+							  tuning->random_page_cost);
+		}
+
+		appendPQExpBuffer(contents, "max_parallel_workers = %d\n",
+						  tuning->max_parallel_workers);
+
+		appendPQExpBuffer(contents, "max_parallel_workers_per_gather = %d\n",
+						  tuning->max_parallel_workers_per_gather);
+
+		appendPQExpBuffer(contents, "huge_pages = %s\n", tuning->huge_pages);
+	}
+
 	/* memory allocation could have failed while building string */
 	if (PQExpBufferBroken(contents))
 	{
@@ -388,3 +886,18 @@ pgtuning_edit_guc_settings(GUC *settings, DynamicTuning *tuning,
 
 	return true;
 }
+
+
+/*
+ * pgtuning_append_bytes appends a memory setting to the given buffer, using
+ * the pretty printed form of the given amount of bytes.
+ */
+static void
+pgtuning_append_bytes(PQExpBuffer contents, const char *name, uint64_t bytes)
+{
+	char pretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(pretty, sizeof(pretty), bytes);
+
+	appendPQExpBuffer(contents, "%s = '%s'\n", name, pretty);
+}
@@ -14,6 +14,27 @@
 
 extern GUC postgres_tuning[];
 
-bool pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size);
+/*
+ * Tuning profiles describe the workload that a node is expected to serve,
+ * the default being a mix of short transactions and reporting queries. The
+ * monitor profile is only used by the monitor's own Postgres instance.
+ */
+typedef enum
+{
+	PG_TUNING_PROFILE_UNKNOWN = 0,
+	PG_TUNING_PROFILE_OLTP,
+	PG_TUNING_PROFILE_MIXED,
+	PG_TUNING_PROFILE_ANALYTICS,
+	PG_TUNING_PROFILE_WRITE_HEAVY,
+	PG_TUNING_PROFILE_MONITOR
+} PgTuningProfile;
+
+PgTuningProfile pgtuning_parse_profile(const char *profile);
+char * pgtuning_profile_to_string(PgTuningProfile profile);
+
+bool pgtuning_prepare_guc_settings(GUC *settings,
+								   const char *pgdata,
+								   const char *profile,
+								   char *config, size_t size);
 
 #endif /* PGTUNING_H */
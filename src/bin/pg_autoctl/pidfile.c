@@ -14,6 +14,18 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/syscall.h>
+#if defined(SYS_pidfd_open)
+#define HAVE_PIDFD_OPEN 1
+#endif
+#elif defined(__APPLE__) || defined(__FreeBSD__) || \
+	defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#define HAVE_KQUEUE_EVFILT_PROC 1
+#endif
+
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
 
@@ -33,11 +45,14 @@
 #include "state.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "system_utils.h"
 
 /* pidfile for this process */
 char service_pidfile[MAXPGPATH] = { 0 };
 
 static void remove_service_pidfile_atexit(void);
+static bool wait_for_pid_to_exit(pid_t pid, int timeout, bool *exited);
+static void process_memory_as_json(JSON_Object *jsobj, pid_t pid);
 
 /*
  * create_pidfile writes our pid in a file.
@@ -381,6 +396,7 @@ pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
 				if (kill(pidnum, 0) == 0)
 				{
 					json_object_set_string(jsobj, "status", "running");
+					(void) process_memory_as_json(jsobj, pidnum);
 				}
 				else
 				{
@@ -458,6 +474,7 @@ pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
 					if (kill(pidnum, 0) == 0)
 					{
 						json_object_set_string(jsServiceObj, "status", "running");
+						(void) process_memory_as_json(jsServiceObj, pidnum);
 					}
 					else
 					{
@@ -499,6 +516,36 @@ pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
 }
 
 
+/*
+ * process_memory_as_json adds a "memory" entry to the given JSON object with
+ * the resident, proportional, and private memory used by the given process,
+ * in bytes. When the memory usage isn't available, nothing is added.
+ */
+static void
+process_memory_as_json(JSON_Object *jsobj, pid_t pid)
+{
+	ProcessMemory memory = { 0 };
+
+	if (!get_process_memory(pid, &memory))
+	{
+		return;
+	}
+
+	JSON_Value *jsMemory = json_value_init_object();
+	JSON_Object *jsMemoryObj = json_value_get_object(jsMemory);
+
+	json_object_set_number(jsMemoryObj, "rss", (double) memory.rss);
+
+	if (memory.pss > 0)
+	{
+		json_object_set_number(jsMemoryObj, "pss", (double) memory.pss);
+		json_object_set_number(jsMemoryObj, "private", (double) memory.private);
+	}
+
+	json_object_set_value(jsobj, "memory", jsMemory);
+}
+
+
 /*
  * is_process_stopped reads given pidfile and checks if the included PID
  * belongs to a process that's still running, and if not, sets the *stopped
@@ -546,6 +593,18 @@ wait_for_process_to_stop(const char *pidfile, int timeout, bool *stopped, pid_t
 	log_info("An instance of pg_autoctl is running with PID %d, "
 			 "waiting for it to stop.", *pid);
 
+	/* when the system can notify us of the process exit, use that */
+	if (wait_for_pid_to_exit(*pid, timeout, stopped))
+	{
+		if (*stopped)
+		{
+			log_info("The pg_autoctl instance with pid %d "
+					 "has now terminated.",
+					 *pid);
+		}
+		return true;
+	}
+
 	int timeout_counter = timeout;
 
 	while (timeout_counter > 0)
@@ -566,3 +625,146 @@ wait_for_process_to_stop(const char *pidfile, int timeout, bool *stopped, pid_t
 	*stopped = false;
 	return true;
 }
+
+
+#if defined(HAVE_PIDFD_OPEN) || defined(HAVE_KQUEUE_EVFILT_PROC)
+
+/*
+ * remaining_timeout_ms returns how many milliseconds are left until the given
+ * deadline, on the monotonic clock.
+ */
+static int
+remaining_timeout_ms(struct timespec *deadline)
+{
+	struct timespec now;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t remaining =
+		(int64_t) (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return remaining > 0 ? (int) remaining : 0;
+}
+
+
+#endif
+
+
+/*
+ * wait_for_pid_to_exit waits for up to timeout seconds for the given process
+ * to exit, using pidfd_open(2) and poll(2) on Linux, or EVFILT_PROC with
+ * kqueue(2) on BSD systems and macOS, so that we return as soon as the
+ * process is gone rather than at the next tick of a polling loop.
+ *
+ * Returns false when the system does not support waiting that way, and then
+ * the caller falls back to polling. Otherwise *exited is set to whether the
+ * process exited before the timeout.
+ */
+static bool
+wait_for_pid_to_exit(pid_t pid, int timeout, bool *exited)
+{
+#if defined(HAVE_PIDFD_OPEN) || defined(HAVE_KQUEUE_EVFILT_PROC)
+	struct timespec deadline;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout;
+#endif
+
+#if defined(HAVE_PIDFD_OPEN)
+	int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+	if (pidfd < 0)
+	{
+		if (errno == ESRCH)
+		{
+			*exited = true;
+			return true;
+		}
+
+		/* ENOSYS on kernels before 5.3, or seccomp filters */
+		log_debug("Failed to open a pidfd for process %d: %m", pid);
+		return false;
+	}
+
+	struct pollfd pfd = { .fd = pidfd, .events = POLLIN, .revents = 0 };
+
+	for (;;)
+	{
+		int ret = poll(&pfd, 1, remaining_timeout_ms(&deadline));
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret < 0)
+		{
+			log_debug("Failed to poll pidfd for process %d: %m", pid);
+			close(pidfd);
+			return false;
+		}
+
+		/* the pidfd is readable once the process has exited */
+		*exited = ret > 0;
+		close(pidfd);
+		return true;
+	}
+#elif defined(HAVE_KQUEUE_EVFILT_PROC)
+	struct kevent change;
+	struct kevent event;
+
+	int kq = kqueue();
+
+	if (kq < 0)
+	{
+		log_debug("Failed to create a kqueue: %m");
+		return false;
+	}
+
+	EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+
+	if (kevent(kq, &change, 1, NULL, 0, NULL) < 0)
+	{
+		bool gone = errno == ESRCH;
+
+		if (!gone)
+		{
+			log_debug("Failed to watch process %d with kqueue: %m", pid);
+		}
+
+		close(kq);
+		*exited = gone;
+		return gone;
+	}
+
+	for (;;)
+	{
+		int timeoutMs = remaining_timeout_ms(&deadline);
+		struct timespec ts = {
+			.tv_sec = timeoutMs / 1000,
+			.tv_nsec = (timeoutMs % 1000) * 1000000L
+		};
+
+		int ret = kevent(kq, NULL, 0, &event, 1, &ts);
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret < 0)
+		{
+			log_debug("Failed to wait for process %d with kqueue: %m", pid);
+			close(kq);
+			return false;
+		}
+
+		*exited = ret > 0;
+		close(kq);
+		return true;
+	}
+#else
+	return false;
+#endif
+}
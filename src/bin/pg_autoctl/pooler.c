@@ -0,0 +1,318 @@
+/*
+ * src/bin/pg_autoctl/pooler.c
+ *     Pause and resume the connection poolers in front of a group, using
+ *     their admin console, so that a switchover doesn't get to the
+ *     applications as connection errors.
+ *
+ * The PgBouncer admin console implements the PAUSE, RESUME and RECONNECT
+ * commands. When a primary is being demoted it PAUSEs the poolers: the
+ * pooler waits for the current transactions to be done and then holds the
+ * new ones in its queue. When the new primary has been promoted it sends
+ * RECONNECT so that the pooler opens new server connections, to the new
+ * primary, and then RESUMEs the traffic. The applications see a latency
+ * blip, and the new primary gets the pooler connections rather than all the
+ * application connections at once.
+ *
+ * The pooler finds the new primary by itself: its database entry should use
+ * a host name or address that follows the primary, the admin console has no
+ * command to edit the database entries.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+
+#include "defaults.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "parsing.h"
+#include "pooler.h"
+#include "signals.h"
+#include "string_utils.h"
+
+static int pooler_parse_endpoints(char *endpoints, char **endpointsArray);
+static bool pooler_send_command(KeeperConfig *config, const char *command,
+								const char *ignoredError);
+static bool pooler_admin_command(const char *endpoint, const char *command,
+								 int timeout, const char *ignoredError);
+
+
+/*
+ * pooler_enabled returns true when pooler.admin_endpoints is set.
+ */
+bool
+pooler_enabled(KeeperConfig *config)
+{
+	return !IS_EMPTY_STRING_BUFFER(config->poolerAdminEndpoints);
+}
+
+
+/*
+ * pooler_pause sends PAUSE to all the poolers, which then stop sending new
+ * transactions to the current primary. Each pooler is given up to
+ * POOLER_COMMAND_TIMEOUT seconds to complete the current transactions; a
+ * pooler that doesn't make it is still paused, it just keeps waiting.
+ */
+bool
+pooler_pause(KeeperConfig *config)
+{
+	if (!pooler_enabled(config))
+	{
+		return true;
+	}
+
+	log_info("Pausing the connection poolers");
+
+	return pooler_send_command(config, "PAUSE", NULL);
+}
+
+
+/*
+ * pooler_resume sends RECONNECT and then RESUME to all the poolers, so that
+ * they open new connections to the new primary and send it the transactions
+ * they held since pooler_pause.
+ *
+ * RESUME fails when the pooler is not paused, which is expected when the
+ * pause happened on another pooler, or not at all, as when pg_autoctl
+ * restarts on a primary node.
+ */
+bool
+pooler_resume(KeeperConfig *config)
+{
+	if (!pooler_enabled(config))
+	{
+		return true;
+	}
+
+	log_info("Resuming the connection poolers");
+
+	bool reconnected = pooler_send_command(config, "RECONNECT", NULL);
+	bool resumed = pooler_send_command(config, "RESUME", "not paused");
+
+	return reconnected && resumed;
+}
+
+
+/*
+ * pooler_send_command sends the given admin command to all the poolers,
+ * adding the pooler.database name when it's set. It returns true when all
+ * the poolers have accepted the command.
+ */
+static bool
+pooler_send_command(KeeperConfig *config, const char *command,
+					const char *ignoredError)
+{
+	char endpoints[MAXCONNINFO] = { 0 };
+	char *endpointsArray[POOLER_MAX_ENDPOINTS] = { 0 };
+	char sql[BUFSIZE] = { 0 };
+
+	bool success = true;
+
+	if (IS_EMPTY_STRING_BUFFER(config->poolerDatabase))
+	{
+		sformat(sql, sizeof(sql), "%s", command);
+	}
+	else
+	{
+		sformat(sql, sizeof(sql), "%s %s", command, config->poolerDatabase);
+	}
+
+	/* pooler_parse_endpoints edits the string in place */
+	strlcpy(endpoints, config->poolerAdminEndpoints, sizeof(endpoints));
+
+	int count = pooler_parse_endpoints(endpoints, endpointsArray);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!pooler_admin_command(endpointsArray[i], sql,
+								  POOLER_COMMAND_TIMEOUT,
+								  ignoredError))
+		{
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+
+/*
+ * pooler_parse_endpoints splits the comma separated list of admin console
+ * connection strings in place, and returns how many we found.
+ */
+static int
+pooler_parse_endpoints(char *endpoints, char **endpointsArray)
+{
+	int count = 0;
+	char *ptr = endpoints;
+
+	while (ptr != NULL && *ptr != '\0' && count < POOLER_MAX_ENDPOINTS)
+	{
+		char *next = strchr(ptr, ',');
+
+		if (next != NULL)
+		{
+			*next++ = '\0';
+		}
+
+		/* skip the spaces around the connection strings */
+		while (*ptr == ' ')
+		{
+			++ptr;
+		}
+
+		for (char *end = ptr + strlen(ptr) - 1; end >= ptr && *end == ' '; end--)
+		{
+			*end = '\0';
+		}
+
+		if (*ptr != '\0')
+		{
+			endpointsArray[count++] = ptr;
+		}
+
+		ptr = next;
+	}
+
+	if (ptr != NULL && *ptr != '\0')
+	{
+		log_warn("Ignoring pooler admin endpoints after the first %d",
+				 POOLER_MAX_ENDPOINTS);
+	}
+
+	return count;
+}
+
+
+/*
+ * pooler_admin_command connects to the given pooler admin console, sends the
+ * given command and waits for up to timeout seconds for it to complete.
+ *
+ * The admin consoles only implement the simple query protocol, so we can't
+ * use the pgsql.c facilities here, which also would not give up on a PAUSE
+ * command that takes too long to complete.
+ */
+static bool
+pooler_admin_command(const char *endpoint, const char *command,
+					 int timeout, const char *ignoredError)
+{
+	char connectTimeout[BUFSIZE] = { 0 };
+	char scrubbedEndpoint[MAXCONNINFO] = { 0 };
+	bool success = true;
+
+	/* don't log the passwords found in the endpoints */
+	(void) parse_and_scrub_connection_string(endpoint, scrubbedEndpoint);
+
+	sformat(connectTimeout, sizeof(connectTimeout), "%d", timeout);
+
+	const char *keywords[] = { "dbname", "connect_timeout", NULL };
+	const char *values[] = { endpoint, connectTimeout, NULL };
+
+	PGconn *connection = PQconnectdbParams(keywords, values, 1);
+
+	if (PQstatus(connection) != CONNECTION_OK)
+	{
+		log_warn("Failed to connect to pooler admin console \"%s\": %s",
+				 scrubbedEndpoint, PQerrorMessage(connection));
+		PQfinish(connection);
+		return false;
+	}
+
+	log_debug("%s; -- on pooler \"%s\"", command, scrubbedEndpoint);
+
+	if (PQsendQuery(connection, command) != 1)
+	{
+		log_warn("Failed to send \"%s\" to pooler \"%s\": %s",
+				 command, scrubbedEndpoint, PQerrorMessage(connection));
+		PQfinish(connection);
+		return false;
+	}
+
+	uint64_t deadline = time(NULL) + timeout;
+	bool done = false;
+
+	while (!done && !(asked_to_stop_fast || asked_to_quit))
+	{
+		if (time(NULL) >= deadline)
+		{
+			log_warn("Pooler \"%s\" didn't complete \"%s\" in %ds",
+					 scrubbedEndpoint, command, timeout);
+			success = false;
+			break;
+		}
+
+		while (PQisBusy(connection) == 0)
+		{
+			PGresult *result = PQgetResult(connection);
+
+			if (result == NULL)
+			{
+				done = true;
+				break;
+			}
+
+			if (PQresultStatus(result) != PGRES_COMMAND_OK &&
+				PQresultStatus(result) != PGRES_TUPLES_OK)
+			{
+				char *message = PQresultErrorMessage(result);
+
+				if (ignoredError != NULL && strstr(message, ignoredError) != NULL)
+				{
+					log_debug("Pooler \"%s\": %s", scrubbedEndpoint, message);
+				}
+				else
+				{
+					log_warn("Pooler \"%s\" failed to \"%s\": %s",
+							 scrubbedEndpoint, command, message);
+					success = false;
+				}
+			}
+
+			PQclear(result);
+		}
+
+		if (done)
+		{
+			break;
+		}
+
+		int sock = PQsocket(connection);
+		fd_set readFds;
+
+		FD_ZERO(&readFds);
+		FD_SET(sock, &readFds);
+
+		/* wake up at least once per second to check for signals */
+		struct timeval timeval = { .tv_sec = 1, .tv_usec = 0 };
+
+		int ret = select(sock + 1, &readFds, NULL, NULL, &timeval);
+
+		if (ret < 0 && errno != EINTR)
+		{
+			log_warn("Failed to wait for pooler \"%s\": %m", scrubbedEndpoint);
+			success = false;
+			break;
+		}
+
+		if (ret > 0 && PQconsumeInput(connection) == 0)
+		{
+			log_warn("Failed to read from pooler \"%s\": %s",
+					 scrubbedEndpoint, PQerrorMessage(connection));
+			success = false;
+			break;
+		}
+	}
+
+	PQfinish(connection);
+
+	return success && done;
+}
@@ -0,0 +1,25 @@
+/*
+ * src/bin/pg_autoctl/pooler.h
+ *     Pause and resume the connection poolers in front of a group, using
+ *     their admin console, so that a switchover doesn't get to the
+ *     applications as connection errors.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef POOLER_H
+#define POOLER_H
+
+#include <stdbool.h>
+
+#include "keeper_config.h"
+
+#define POOLER_MAX_ENDPOINTS 16
+
+bool pooler_enabled(KeeperConfig *config);
+bool pooler_pause(KeeperConfig *config);
+bool pooler_resume(KeeperConfig *config);
+
+#endif /* POOLER_H */
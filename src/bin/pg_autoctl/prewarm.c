@@ -0,0 +1,434 @@
+/*
+ * src/bin/pg_autoctl/prewarm.c
+ *     Keep a list of the blocks found in the primary's buffer cache, and load
+ *     it on a standby when it is being promoted.
+ *
+ * A standby replays the writes of the primary, but its buffer cache only
+ * contains what recovery and the read-only queries have been using. Right
+ * after a failover, the new primary then has to read most of the workload's
+ * data set from disk again, and latency is much higher for a while.
+ *
+ * When replication.prewarm_workers is set, the keeper of a standby node
+ * regularly fetches from its upstream node the list of the blocks currently
+ * found in its shared buffers, using the pg_buffercache extension, and keeps
+ * that list in a file in its state directory. Consecutive blocks are merged
+ * into ranges, so that the list is small.
+ *
+ * When the standby is asked to prepare its promotion, the list is split in as
+ * many parts as replication.prewarm_workers, and each part is loaded with the
+ * pg_prewarm extension on its own connection to the local standby, all in
+ * parallel, and for up to timeout.prepare_promotion_prewarm seconds.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "prewarm.h"
+
+/* a range of consecutive blocks of a relation fork, as found in the list */
+typedef struct PrewarmRange
+{
+	unsigned int relid;
+	char fork[5];
+	long long first;
+	long long last;
+} PrewarmRange;
+
+static bool prewarm_parse_block_list(char *contents,
+									 PrewarmRange **ranges,
+									 int *rangeCount,
+									 long long *blockCount);
+
+
+/*
+ * prewarm_create_extensions creates the extensions that we need on the
+ * primary node. The extensions are then replicated to the standby nodes.
+ */
+bool
+prewarm_create_extensions(PGSQL *pgsql)
+{
+	return pgsql_create_extension(pgsql, "pg_buffercache") &&
+		   pgsql_create_extension(pgsql, "pg_prewarm");
+}
+
+
+/*
+ * prewarm_save_block_list fetches the list of the blocks found in the buffer
+ * cache of the target Postgres instance for the current database, including
+ * the shared catalogs, and writes it to the given file.
+ *
+ * Each line of the file is a tab separated range of blocks:
+ *
+ *   relation oid, fork name, first block, last block
+ *
+ * The file is written to a temporary file first, and then renamed, so that a
+ * promotion happening at the same time only ever reads a complete file.
+ */
+bool
+prewarm_save_block_list(PGSQL *pgsql, const char *filename)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	char tempFilename[MAXPGPATH] = { 0 };
+
+	/*
+	 * Consecutive blocks in the buffer cache are grouped into ranges with the
+	 * classic gaps-and-islands technique: within a relation fork, the block
+	 * number minus the row number is the same for all the blocks of a range.
+	 */
+	char *sql =
+		"WITH db AS "
+		"  (SELECT oid, dattablespace "
+		"     FROM pg_database WHERE datname = current_database()), "
+		"blocks AS "
+		"  (SELECT c.oid AS relid, b.relforknumber AS fork, "
+		"          b.relblocknumber AS block "
+		"     FROM pg_buffercache b "
+		"          JOIN db ON b.reldatabase IN (0, db.oid) "
+		"          JOIN pg_class c "
+		"            ON pg_relation_filenode(c.oid) = b.relfilenode "
+		"           AND b.reltablespace = "
+		"               CASE c.reltablespace WHEN 0 THEN db.dattablespace "
+		"                    ELSE c.reltablespace END "
+		"    WHERE b.relforknumber BETWEEN 0 AND 3), "
+		"islands AS "
+		"  (SELECT relid, fork, block, "
+		"          block - row_number() "
+		"                  OVER (PARTITION BY relid, fork ORDER BY block) "
+		"          AS island "
+		"     FROM blocks), "
+		"ranges AS "
+		"  (SELECT relid, fork, min(block) AS first, max(block) AS last "
+		"     FROM islands "
+		" GROUP BY relid, fork, island) "
+		"SELECT coalesce(string_agg("
+		"         format(E'%s\\t%s\\t%s\\t%s', relid, "
+		"                (ARRAY['main', 'fsm', 'vm', 'init'])[fork + 1], "
+		"                first, last), "
+		"         E'\\n' ORDER BY relid, fork, first), '') "
+		"  FROM ranges";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the list of blocks in the buffer cache");
+		return false;
+	}
+
+	sformat(tempFilename, sizeof(tempFilename), "%s.%d", filename, getpid());
+
+	PQExpBuffer contents = createPQExpBuffer();
+
+	if (contents == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(context.strVal);
+		return false;
+	}
+
+	appendPQExpBuffer(contents, "%s\n", context.strVal);
+	free(context.strVal);
+
+	if (PQExpBufferBroken(contents))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		destroyPQExpBuffer(contents);
+		return false;
+	}
+
+	bool success = write_file(contents->data, contents->len, tempFilename);
+
+	destroyPQExpBuffer(contents);
+
+	if (!success || rename(tempFilename, filename) != 0)
+	{
+		log_error("Failed to write file \"%s\": %m", filename);
+		(void) unlink(tempFilename);
+		return false;
+	}
+
+	log_debug("Saved the buffer cache block list to \"%s\"", filename);
+
+	return true;
+}
+
+
+/*
+ * prewarm_load_block_list loads the blocks listed in the given file into the
+ * buffer cache of the Postgres instance at pguri, splitting the work among
+ * the given number of connections, for up to timeout seconds.
+ *
+ * The relations might have changed since the list was saved: the blocks of
+ * relations that do not exist anymore, or that are past the end of a
+ * relation, are skipped.
+ */
+bool
+prewarm_load_block_list(const char *pguri, const char *filename,
+						int workers, int timeout)
+{
+	char *fileContents = NULL;
+	long fileSize = 0L;
+	PrewarmRange *ranges = NULL;
+	int rangeCount = 0;
+	long long blockCount = 0;
+
+	PGSQL clients[PREWARM_WORKERS_MAX] = { 0 };
+	PGSQLQuery queries[PREWARM_WORKERS_MAX] = { 0 };
+	SingleValueResultContext contexts[PREWARM_WORKERS_MAX] = { 0 };
+	PQExpBuffer arrays[PREWARM_WORKERS_MAX][4] = { 0 };
+	const char *paramValues[PREWARM_WORKERS_MAX][4] = { 0 };
+
+	char *sql =
+		"SELECT coalesce(sum(pg_prewarm(c.oid::regclass, 'buffer', r.fork, "
+		"                               r.first, "
+		"                               least(r.last, s.blocks - 1))), 0)::bigint "
+		"  FROM unnest($1::oid[], $2::text[], $3::bigint[], $4::bigint[]) "
+		"       AS r(relid, fork, first, last) "
+		"       JOIN pg_class c ON c.oid = r.relid "
+		"       CROSS JOIN LATERAL "
+		"       (SELECT pg_relation_size(c.oid, r.fork) "
+		"               / current_setting('block_size')::bigint AS blocks) s "
+		" WHERE r.first < s.blocks";
+
+	if (workers < 1)
+	{
+		return true;
+	}
+
+	if (!file_exists(filename))
+	{
+		log_info("Skipping buffer cache pre-warm: "
+				 "the block list \"%s\" does not exist", filename);
+		return true;
+	}
+
+	if (!read_file_if_exists(filename, &fileContents, &fileSize))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!prewarm_parse_block_list(fileContents,
+								  &ranges, &rangeCount, &blockCount))
+	{
+		free(fileContents);
+		return false;
+	}
+
+	free(fileContents);
+
+	if (rangeCount == 0)
+	{
+		log_info("Skipping buffer cache pre-warm: the block list is empty");
+		free(ranges);
+		return true;
+	}
+
+	if (workers > PREWARM_WORKERS_MAX)
+	{
+		workers = PREWARM_WORKERS_MAX;
+	}
+
+	if (workers > rangeCount)
+	{
+		workers = rangeCount;
+	}
+
+	/*
+	 * Split the list in parts of about the same number of blocks, keeping the
+	 * ranges of a part in the list order, so that each connection reads the
+	 * relations mostly sequentially.
+	 */
+	long long blocksPerWorker = (blockCount + workers - 1) / workers;
+	long long assignedBlocks = 0;
+	int worker = 0;
+
+	for (int w = 0; w < workers; w++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			arrays[w][i] = createPQExpBuffer();
+
+			/* a NULL buffer is reported as broken later */
+			appendPQExpBufferChar(arrays[w][i], '{');
+		}
+	}
+
+	for (int r = 0; r < rangeCount; r++)
+	{
+		PrewarmRange *range = &(ranges[r]);
+		const char *sep = arrays[worker][0]->len > 1 ? "," : "";
+
+		appendPQExpBuffer(arrays[worker][0], "%s%u", sep, range->relid);
+		appendPQExpBuffer(arrays[worker][1], "%s%s", sep, range->fork);
+		appendPQExpBuffer(arrays[worker][2], "%s%lld", sep, range->first);
+		appendPQExpBuffer(arrays[worker][3], "%s%lld", sep, range->last);
+
+		assignedBlocks += range->last - range->first + 1;
+
+		if (assignedBlocks >= blocksPerWorker * (worker + 1) &&
+			worker < workers - 1)
+		{
+			++worker;
+		}
+	}
+
+	free(ranges);
+
+	/* some parts might be empty when a few ranges hold most of the blocks */
+	workers = worker + 1;
+
+	bool success = true;
+
+	for (int w = 0; w < workers; w++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			appendPQExpBufferChar(arrays[w][i], '}');
+
+			if (PQExpBufferBroken(arrays[w][i]))
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				success = false;
+			}
+
+			paramValues[w][i] = arrays[w][i]->data;
+		}
+
+		contexts[w].resultType = PGSQL_RESULT_BIGINT;
+
+		queries[w].sql = sql;
+		queries[w].paramCount = 4;
+		queries[w].paramTypes = NULL;
+		queries[w].paramValues = paramValues[w];
+		queries[w].context = &(contexts[w]);
+		queries[w].parseFun = &parseSingleValueResult;
+
+		if (!pgsql_init(&(clients[w]), (char *) pguri, PGSQL_CONN_LOCAL))
+		{
+			success = false;
+		}
+	}
+
+	if (success)
+	{
+		log_info("Pre-warming the buffer cache with %lld blocks "
+				 "in %d ranges, using %d connections for up to %ds",
+				 blockCount, rangeCount, workers, timeout);
+
+		success = pgsql_execute_parallel(clients, queries, workers, timeout);
+
+		long long loadedBlocks = 0;
+
+		for (int w = 0; w < workers; w++)
+		{
+			if (contexts[w].parsedOk)
+			{
+				loadedBlocks += contexts[w].bigint;
+			}
+		}
+
+		if (success)
+		{
+			log_info("Pre-warmed the buffer cache with %lld blocks",
+					 loadedBlocks);
+		}
+		else
+		{
+			log_warn("Failed to pre-warm the buffer cache completely "
+					 "within timeout.prepare_promotion_prewarm (%ds), "
+					 "see above for details",
+					 timeout);
+		}
+	}
+
+	for (int w = 0; w < workers; w++)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			destroyPQExpBuffer(arrays[w][i]);
+		}
+	}
+
+	return success;
+}
+
+
+/*
+ * prewarm_parse_block_list parses the contents of a block list file into an
+ * array of ranges, that the caller must free. Lines that can not be parsed
+ * are skipped, the list is only a hint of what to load in the buffer cache.
+ */
+static bool
+prewarm_parse_block_list(char *contents,
+						 PrewarmRange **ranges,
+						 int *rangeCount,
+						 long long *blockCount)
+{
+	int lineCount = 1;
+
+	for (char *ptr = contents; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '\n')
+		{
+			++lineCount;
+		}
+	}
+
+	*ranges = (PrewarmRange *) calloc(lineCount, sizeof(PrewarmRange));
+	*rangeCount = 0;
+	*blockCount = 0;
+
+	if (*ranges == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	char *line = contents;
+
+	while (line != NULL && *line != '\0')
+	{
+		PrewarmRange *range = &((*ranges)[*rangeCount]);
+		char *next = strchr(line, '\n');
+
+		if (next != NULL)
+		{
+			*next++ = '\0';
+		}
+
+		if (sscanf(line, "%u %4s %lld %lld",
+				   &(range->relid),
+				   range->fork,
+				   &(range->first),
+				   &(range->last)) == 4 &&
+			range->first >= 0 &&
+			range->first <= range->last)
+		{
+			*blockCount += range->last - range->first + 1;
+			++(*rangeCount);
+		}
+
+		line = next;
+	}
+
+	return true;
+}
@@ -0,0 +1,25 @@
+/*
+ * src/bin/pg_autoctl/prewarm.h
+ *     Keep a list of the blocks found in the primary's buffer cache, and load
+ *     it on a standby when it is being promoted.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <stdbool.h>
+
+#include "pgsql.h"
+
+#define PREWARM_WORKERS_MAX PGSQL_PARALLEL_MAX_QUERIES
+
+bool prewarm_create_extensions(PGSQL *pgsql);
+bool prewarm_save_block_list(PGSQL *pgsql, const char *filename);
+bool prewarm_load_block_list(const char *pguri, const char *filename,
+							 int workers, int timeout);
+
+#endif /* PREWARM_H */
@@ -17,12 +17,16 @@
 #include "keeper.h"
 #include "log.h"
 #include "parsing.h"
+#include "pgclone.h"
 #include "pgctl.h"
 #include "pghba.h"
 #include "pgsql.h"
+#include "prewarm.h"
 #include "primary_standby.h"
 #include "signals.h"
 #include "state.h"
+#include "trace.h"
+#include "walprefetch.h"
 
 
 static bool local_postgres_wait_until_ready(LocalPostgresServer *postgres);
@@ -30,6 +34,27 @@ static bool local_postgres_wait_until_ready(LocalPostgresServer *postgres);
 static void local_postgres_update_pg_failures_tracking(LocalPostgresServer *postgres,
 													   bool pgIsRunning);
 
+static bool upstream_init_client(ReplicationSource *upstream,
+								 PostgresSetup *pgSetup,
+								 PGSQL *upstreamClient);
+static void upstream_set_adaptive_backup_rate(ReplicationSource *upstream,
+											  PostgresSetup *pgSetup);
+static bool upstream_wait_for_replication_slot(ReplicationSource *upstream,
+											   PostgresSetup *pgSetup);
+static bool standby_wait_for_replay_lsn(PGSQL *pgsql, char *targetLSN,
+										char *currentLSN, bool *hasReachedLSN);
+static int await_next_sleep_time(int sleepTimeMs);
+static bool primary_is_behind_fork_point(LocalPostgresServer *postgres);
+static bool standby_resume_clone(LocalPostgresServer *postgres, bool *resumed);
+static bool standby_run_basebackup(LocalPostgresServer *postgres,
+								   bool useTemporarySlot);
+static bool standby_clone_database(LocalPostgresServer *postgres,
+								   bool useTemporarySlot);
+static bool standby_setup_cloned_database(LocalPostgresServer *postgres,
+										  const char *hostname);
+static bool standby_reload_replication_source(LocalPostgresServer *postgres,
+											  bool *reloaded);
+
 /*
  * Default settings for postgres databases managed by pg_auto_failover.
  * These settings primarily ensure that streaming replication is
@@ -104,6 +129,48 @@ GUC citus_default_settings_13[] = {
 };
 
 
+/*
+ * Settings that depend on the role of the node, see
+ * postgres_add_role_settings. All of them can be changed with a reload of
+ * the Postgres configuration, so that a role change never needs a restart.
+ *
+ * A primary flushes WAL more often, and groups concurrent commits when at
+ * least commit_siblings other transactions are active.
+ *
+ * A standby gives more time to its queries before canceling them, and
+ * prefetches the blocks referenced in the WAL to speed up replay.
+ */
+GUC postgres_primary_role_settings[] = {
+	{ "wal_writer_delay", "'10ms'" },
+	{ "commit_delay", "10" },
+	{ "commit_siblings", "5" },
+	{ NULL, NULL }
+};
+
+#define STANDBY_ROLE_GUC_SETTINGS \
+	{ "max_standby_streaming_delay", "'2min'" }
+
+#define STANDBY_ROLE_GUC_SETTINGS_13 \
+	STANDBY_ROLE_GUC_SETTINGS, \
+	{ "maintenance_io_concurrency", "32" }
+
+GUC postgres_standby_role_settings_pre_13[] = {
+	STANDBY_ROLE_GUC_SETTINGS,
+	{ NULL, NULL }
+};
+
+GUC postgres_standby_role_settings_13[] = {
+	STANDBY_ROLE_GUC_SETTINGS_13,
+	{ NULL, NULL }
+};
+
+GUC postgres_standby_role_settings_15[] = {
+	STANDBY_ROLE_GUC_SETTINGS_13,
+	{ "recovery_prefetch", "'try'" },
+	{ NULL, NULL }
+};
+
+
 /*
  * local_postgres_init initializes an interface for managing a local
  * postgres server with the given setup.
@@ -273,6 +340,11 @@ local_postgres_update(LocalPostgresServer *postgres, bool postgresNotRunningIsOk
 /*
  * local_postgres_wait_until_ready waits until Postgres is running and updates
  * our failure tracking counters for the Postgres service accordingly.
+ *
+ * The Postgres controller restarts a crashed Postgres as soon as the
+ * postmaster exits, so by the time we get here Postgres may already be
+ * running again with a new pid. We read the postmaster.pid file rather than
+ * forking pg_ctl status, which also gives us the pid to notice that case.
  */
 static bool
 local_postgres_wait_until_ready(LocalPostgresServer *postgres)
@@ -280,22 +352,40 @@ local_postgres_wait_until_ready(LocalPostgresServer *postgres)
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 
 	int timeout = 10;       /* wait for Postgres for 10s */
-	bool pgIsRunning = pg_is_running(pgSetup->pg_ctl, pgSetup->pgdata);
+	pid_t previousPid = pgSetup->pidFile.pid;
+	bool pgIsNotRunningIsOk = true;
+	bool pgIsRunning = pg_setup_is_ready(pgSetup, pgIsNotRunningIsOk);
+
+	bool pgHasRestarted =
+		pgIsRunning && previousPid > 0 && previousPid != pgSetup->pidFile.pid;
 
 	log_trace("local_postgres_wait_until_ready: Postgres %s in \"%s\"",
 			  pgIsRunning ? "is running" : "is not running", pgSetup->pgdata);
 
+	if (pgHasRestarted)
+	{
+		log_warn("Postgres has been restarted with pid %d (was %d)",
+				 pgSetup->pidFile.pid, previousPid);
+	}
+
 	if (!pgIsRunning)
 	{
 		/* main logging is done in the Postgres controller sub-process */
 		pgIsRunning = pg_setup_wait_until_is_ready(pgSetup, timeout, LOG_DEBUG);
+	}
 
+	if (!pgIsRunning || pgHasRestarted ||
+		postgres->pgFirstStartFailureTs > 0)
+	{
 		/* update connection string for connection to postgres */
 		(void)
 		local_postgres_update_pg_failures_tracking(postgres, pgIsRunning);
 
 		if (pgIsRunning)
 		{
+			/* a connection we kept open belongs to the previous Postgres */
+			local_postgres_finish(postgres);
+
 			/* update pgSetup cache with new Postgres pid and all */
 			local_postgres_init(postgres, pgSetup);
 
@@ -332,7 +422,15 @@ ensure_postgres_service_is_running(LocalPostgresServer *postgres)
 		return false;
 	}
 
-	return local_postgres_wait_until_ready(postgres);
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "wait until postgres is running", NULL);
+
+	bool ready = local_postgres_wait_until_ready(postgres);
+
+	trace_span_end(&span, ready);
+
+	return ready;
 }
 
 
@@ -402,7 +500,15 @@ ensure_postgres_service_is_stopped(LocalPostgresServer *postgres)
 		return false;
 	}
 
-	return pg_setup_wait_until_is_stopped(pgSetup, timeout, LOG_DEBUG);
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "wait until postgres is stopped", NULL);
+
+	bool stopped = pg_setup_wait_until_is_stopped(pgSetup, timeout, LOG_DEBUG);
+
+	trace_span_end(&span, stopped);
+
+	return stopped;
 }
 
 
@@ -424,6 +530,39 @@ primary_has_replica(LocalPostgresServer *postgres, char *userName, bool *hasStan
 }
 
 
+/*
+ * primary_get_replica_reply_time gets the last time our replicas sent us a
+ * reply message, see pgsql_get_replica_reply_time. Before Postgres 12 we
+ * only know whether we have a replica, and set replyTime to 0 when we do.
+ */
+bool
+primary_get_replica_reply_time(LocalPostgresServer *postgres, char *userName,
+							   int64_t *replyTime)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	log_trace("primary_get_replica_reply_time");
+
+	bool result = false;
+
+	if (pgSetup->control.pg_control_version >= 1200)
+	{
+		result = pgsql_get_replica_reply_time(pgsql, userName, replyTime);
+	}
+	else
+	{
+		bool hasReplica = false;
+
+		result = pgsql_has_replica(pgsql, userName, &hasReplica);
+		*replyTime = hasReplica ? 0 : -1;
+	}
+
+	pgsql_finish(pgsql);
+	return result;
+}
+
+
 /*
  * upstream_has_replication_slot checks whether the upstream server already has
  * created our replication slot.
@@ -432,11 +571,196 @@ bool
 upstream_has_replication_slot(ReplicationSource *upstream,
 							  PostgresSetup *pgSetup,
 							  bool *hasReplicationSlot)
+{
+	PGSQL upstreamClient = { 0 };
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_replication_slot_exists(&upstreamClient,
+									   upstream->slotName,
+									   hasReplicationSlot))
+	{
+		/* errors have already been logged */
+		PQfinish(upstreamClient.connection);
+		return false;
+	}
+
+	PQfinish(upstreamClient.connection);
+	return true;
+}
+
+
+/*
+ * upstream_wait_for_replication_slot waits until the upstream node has created
+ * our replication slot.
+ *
+ * After a base backup that used a temporary slot, we wait before starting
+ * Postgres. The primary creates our slot in the transition that lets us join
+ * the group, so this wait is typically a single keeper loop, overlapping with
+ * the time it took to copy the data.
+ */
+static bool
+upstream_wait_for_replication_slot(ReplicationSource *upstream,
+								   PostgresSetup *pgSetup)
+{
+	int errors = 0, tries = 0;
+	bool hasReplicationSlot = false;
+
+	for (;;)
+	{
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit)
+		{
+			return false;
+		}
+
+		if (!upstream_has_replication_slot(upstream,
+										   pgSetup,
+										   &hasReplicationSlot))
+		{
+			++errors;
+
+			log_warn("Failed to contact the primary node " NODE_FORMAT,
+					 upstream->primaryNode.nodeId,
+					 upstream->primaryNode.name,
+					 upstream->primaryNode.host,
+					 upstream->primaryNode.port);
+
+			if (errors > 5)
+			{
+				log_error("Failed to contact the primary 5 times in a row now, "
+						  "so we stop trying. You can do `pg_autoctl create` "
+						  "to retry and finish the local setup");
+				return false;
+			}
+		}
+
+		if (hasReplicationSlot)
+		{
+			return true;
+		}
+
+		if (++tries == 3)
+		{
+			log_info("Still waiting for the primary to create our "
+					 "replication slot \"%s\"",
+					 upstream->slotName);
+			log_warn("Please make sure that the primary node is currently "
+					 "running `pg_autoctl run` and contacting the monitor.");
+		}
+
+		sleep(PG_AUTOCTL_KEEPER_SLEEP_TIME);
+	}
+}
+
+
+/*
+ * upstream_save_prewarm_block_list saves the list of the blocks found in the
+ * buffer cache of the upstream node to the given file. When createExtensions
+ * is true, we first make sure the extensions that we need are installed.
+ */
+bool
+upstream_save_prewarm_block_list(ReplicationSource *upstream,
+								 PostgresSetup *pgSetup,
+								 bool createExtensions,
+								 const char *filename)
+{
+	PGSQL upstreamClient = { 0 };
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (createExtensions && !prewarm_create_extensions(&upstreamClient))
+	{
+		/* errors have already been logged */
+		PQfinish(upstreamClient.connection);
+		return false;
+	}
+
+	if (!prewarm_save_block_list(&upstreamClient, filename))
+	{
+		/* errors have already been logged */
+		PQfinish(upstreamClient.connection);
+		return false;
+	}
+
+	PQfinish(upstreamClient.connection);
+	return true;
+}
+
+
+/*
+ * upstream_get_logical_slots gets the list of the logical replication slots
+ * of the upstream node.
+ */
+bool
+upstream_get_logical_slots(ReplicationSource *upstream,
+						   PostgresSetup *pgSetup,
+						   LogicalSlotArray *slotsArray)
+{
+	PGSQL upstreamClient = { 0 };
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	bool success = pgsql_get_logical_slots(&upstreamClient, slotsArray);
+
+	PQfinish(upstreamClient.connection);
+
+	return success;
+}
+
+
+/*
+ * local_postgres_init_database_client initializes a SQL connection to the
+ * given database of the local Postgres instance, which the caller must close
+ * with pgsql_finish. Logical replication slots can only be created, advanced
+ * or dropped from a connection to their own database.
+ */
+bool
+local_postgres_init_database_client(LocalPostgresServer *postgres,
+									const char *dbname,
+									PGSQL *client)
+{
+	PostgresSetup pgSetup = postgres->postgresSetup;
+	char connInfo[MAXCONNINFO] = { 0 };
+
+	strlcpy(pgSetup.dbname, dbname, NAMEDATALEN);
+	pg_setup_get_local_connection_string(&pgSetup, connInfo);
+
+	if (!pgsql_init(client, connInfo, PGSQL_CONN_LOCAL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	client->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	return true;
+}
+
+
+/*
+ * upstream_init_client initializes a SQL connection to the upstream node,
+ * using the replication user.
+ */
+static bool
+upstream_init_client(ReplicationSource *upstream,
+					 PostgresSetup *pgSetup,
+					 PGSQL *upstreamClient)
 {
 	NodeAddress *primaryNode = &(upstream->primaryNode);
 
 	PostgresSetup upstreamSetup = { 0 };
-	PGSQL upstreamClient = { 0 };
 	char connectionString[MAXCONNINFO] = { 0 };
 
 	/* prepare a PostgresSetup that allows preparing a connection string */
@@ -452,23 +776,87 @@ upstream_has_replication_slot(ReplicationSource *upstream,
 	 */
 	pg_setup_get_local_connection_string(&upstreamSetup, connectionString);
 
-	if (!pgsql_init(&upstreamClient, connectionString, PGSQL_CONN_UPSTREAM))
+	return pgsql_init(upstreamClient, connectionString, PGSQL_CONN_UPSTREAM);
+}
+
+
+/*
+ * upstream_set_adaptive_backup_rate sets the rate used by pg_basebackup
+ * depending on how busy the upstream node is, when the
+ * replication.minimum_backup_rate setting is used.
+ *
+ * We use the replication lag of the other standby nodes of the upstream node
+ * as a measure of its load: when they keep up, we use the maximum backup rate,
+ * and as their lag grows to ADAPTIVE_BACKUP_RATE_LAG_THRESHOLD, we go down to
+ * the minimum backup rate.
+ *
+ * The pg_basebackup --max-rate option can not be changed once the base backup
+ * has started, so the load is sampled each time we start a base backup.
+ * When the load can not be sampled, we use the maximum backup rate.
+ */
+static void
+upstream_set_adaptive_backup_rate(ReplicationSource *upstream,
+								  PostgresSetup *pgSetup)
+{
+	PGSQL upstreamClient = { 0 };
+	int64_t minimumRate = 0;
+	int64_t maximumRate = 0;
+	int lagMs = 0;
+
+	if (IS_EMPTY_STRING_BUFFER(upstream->minimumBackupRate))
 	{
-		/* errors have already been logged */
-		return false;
+		return;
 	}
 
-	if (!pgsql_replication_slot_exists(&upstreamClient,
-									   upstream->slotName,
-									   hasReplicationSlot))
+	if (!parse_backup_rate(upstream->minimumBackupRate, &minimumRate) ||
+		!parse_backup_rate(upstream->maximumBackupRate, &maximumRate) ||
+		minimumRate >= maximumRate)
+	{
+		log_warn("Failed to use an adaptive backup rate between \"%s\" "
+				 "and \"%s\", using \"%s\"",
+				 upstream->minimumBackupRate,
+				 upstream->maximumBackupRate,
+				 upstream->maximumBackupRate);
+		return;
+	}
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient))
 	{
 		/* errors have already been logged */
-		PQfinish(upstreamClient.connection);
-		return false;
+		return;
 	}
 
+	bool success = pgsql_get_replication_lag(&upstreamClient,
+											 upstream->applicationName,
+											 &lagMs);
+
 	PQfinish(upstreamClient.connection);
-	return true;
+
+	if (!success)
+	{
+		log_warn("Failed to sample the load of the upstream node, "
+				 "using the maximum backup rate \"%s\"",
+				 upstream->maximumBackupRate);
+		return;
+	}
+
+	int lag = lagMs < ADAPTIVE_BACKUP_RATE_LAG_THRESHOLD
+			  ? lagMs
+			  : ADAPTIVE_BACKUP_RATE_LAG_THRESHOLD;
+
+	int64_t rate =
+		maximumRate -
+		(maximumRate - minimumRate) * lag / ADAPTIVE_BACKUP_RATE_LAG_THRESHOLD;
+
+	log_info("Standby nodes of the upstream node replicate with a lag of "
+			 "%d ms, using a backup rate of %lldk between \"%s\" and \"%s\"",
+			 lagMs,
+			 (long long) rate,
+			 upstream->minimumBackupRate,
+			 upstream->maximumBackupRate);
+
+	sformat(upstream->maximumBackupRate, MAXIMUM_BACKUP_RATE_LEN,
+			"%lldk", (long long) rate);
 }
 
 
@@ -556,10 +944,7 @@ postgres_replication_slot_create_and_drop(LocalPostgresServer *postgres,
 
 	log_trace("postgres_replication_slot_drop_removed");
 
-	bool result = pgsql_replication_slot_create_and_drop(pgsql, nodeArray);
-
-	pgsql_finish(pgsql);
-	return result;
+	return pgsql_replication_slot_create_and_drop(pgsql, nodeArray);
 }
 
 
@@ -575,10 +960,23 @@ postgres_replication_slot_maintain(LocalPostgresServer *postgres,
 
 	log_trace("postgres_replication_slot_maintain");
 
-	bool result = pgsql_replication_slot_maintain(pgsql, nodeArray);
+	return pgsql_replication_slot_maintain(pgsql, nodeArray);
+}
 
-	pgsql_finish(pgsql);
-	return result;
+
+/*
+ * postgres_replication_slot_advance advances the replication slots of the
+ * given nodes, without creating or dropping any replication slot.
+ */
+bool
+postgres_replication_slot_advance(LocalPostgresServer *postgres,
+								  NodeAddressArray *nodeArray)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+
+	log_trace("postgres_replication_slot_advance");
+
+	return pgsql_replication_slot_advance(pgsql, nodeArray);
 }
 
 
@@ -591,9 +989,6 @@ primary_set_synchronous_standby_names(LocalPostgresServer *postgres)
 {
 	PGSQL *pgsql = &(postgres->sqlClient);
 
-	log_info("Setting synchronous_standby_names to '%s'",
-			 postgres->synchronousStandbyNames);
-
 	bool result =
 		pgsql_set_synchronous_standby_names(pgsql,
 											postgres->synchronousStandbyNames);
@@ -625,6 +1020,8 @@ primary_disable_synchronous_replication(LocalPostgresServer *postgres)
  * postgres_add_default_settings ensures that postgresql.conf includes a
  * postgresql-auto-failover.conf file that sets a number of good defaults for
  * settings related to streaming replication and running pg_auto_failover.
+ * The names of the settings that changed are kept in
+ * postgres->changedSettings, so that callers only reload when needed.
  */
 bool
 postgres_add_default_settings(LocalPostgresServer *postgres,
@@ -691,7 +1088,9 @@ postgres_add_default_settings(LocalPostgresServer *postgres,
 	if (!pg_add_auto_failover_default_settings(pgSetup,
 											   hostname,
 											   configFilePath,
-											   default_settings))
+											   default_settings,
+											   postgres->changedSettings,
+											   sizeof(postgres->changedSettings)))
 	{
 		log_error("Failed to add default settings to postgresql.conf: couldn't "
 				  "write the new postgresql.conf, see above for details");
@@ -702,6 +1101,74 @@ postgres_add_default_settings(LocalPostgresServer *postgres,
 }
 
 
+/*
+ * postgres_add_role_settings writes the settings for the given role of the
+ * node, primary or standby, and reloads the Postgres configuration when the
+ * settings have changed and Postgres is running. Otherwise Postgres uses the
+ * new settings when it starts.
+ */
+bool
+postgres_add_role_settings(LocalPostgresServer *postgres, bool standby)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	char changedSettings[BUFSIZE] = { 0 };
+	GUC *role_settings = postgres_primary_role_settings;
+	int pgVersion = 0;
+
+	log_trace("postgres_add_role_settings (%s)",
+			  standby ? "standby" : "primary");
+
+	/* recovery_prefetch is only available on Postgres 15 and later */
+	if (!parse_pg_version_string(pgSetup->pg_version, &pgVersion))
+	{
+		pgVersion = pgSetup->control.pg_control_version;
+	}
+
+	if (standby)
+	{
+		if (pgVersion >= 1500)
+		{
+			role_settings = postgres_standby_role_settings_15;
+		}
+		else if (pgVersion >= 1300)
+		{
+			role_settings = postgres_standby_role_settings_13;
+		}
+		else
+		{
+			role_settings = postgres_standby_role_settings_pre_13;
+		}
+	}
+
+	if (!pg_add_auto_failover_role_settings(pgSetup->pgdata,
+											role_settings,
+											changedSettings,
+											sizeof(changedSettings)))
+	{
+		log_error("Failed to add %s settings to postgresql.conf, "
+				  "see above for details",
+				  standby ? "standby" : "primary");
+		return false;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(changedSettings))
+	{
+		return true;
+	}
+
+	log_info("Applying %s settings: %s",
+			 standby ? "standby" : "primary", changedSettings);
+
+	if (!pg_setup_is_running(pgSetup))
+	{
+		return true;
+	}
+
+	return pgsql_reload_conf(pgsql);
+}
+
+
 /*
  * primary_create_user_with_hba creates a user and updates pg_hba.conf
  * to allow the user to connect from the given hostname.
@@ -828,7 +1295,7 @@ standby_init_replication_source(LocalPostgresServer *postgres,
 		strlcpy(upstream->password, password, MAXCONNINFO);
 	}
 
-	strlcpy(upstream->slotName, slotName, MAXCONNINFO);
+	strlcpy(upstream->slotName, slotName, sizeof(upstream->slotName));
 	strlcpy(upstream->maximumBackupRate,
 			maximumBackupRate,
 			MAXIMUM_BACKUP_RATE_LEN);
@@ -842,7 +1309,7 @@ standby_init_replication_source(LocalPostgresServer *postgres,
 	upstream->sslOptions = sslOptions;
 
 	/* prepare our application_name */
-	sformat(upstream->applicationName, MAXCONNINFO,
+	sformat(upstream->applicationName, sizeof(upstream->applicationName),
 			"%s%d",
 			REPLICATION_APPLICATION_NAME_PREFIX,
 			currentNodeId);
@@ -851,6 +1318,34 @@ standby_init_replication_source(LocalPostgresServer *postgres,
 }
 
 
+/*
+ * standby_init_basebackup_options sets the options that we use when running
+ * pg_basebackup from the upstream node: compression, WAL method, backup
+ * manifest checksums, and the minimum backup rate that enables the adaptive
+ * backup rate. Empty strings use the pg_basebackup defaults. More than one
+ * clone stream uses our own parallel clone engine instead of pg_basebackup.
+ */
+void
+standby_init_basebackup_options(LocalPostgresServer *postgres,
+								const char *compress,
+								const char *walMethod,
+								const char *manifestChecksums,
+								const char *minimumBackupRate,
+								int cloneStreams)
+{
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	strlcpy(upstream->backupCompress, compress, NAMEDATALEN);
+	strlcpy(upstream->backupWalMethod, walMethod, NAMEDATALEN);
+	strlcpy(upstream->backupManifestChecksums, manifestChecksums, NAMEDATALEN);
+	strlcpy(upstream->minimumBackupRate,
+			minimumBackupRate,
+			MAXIMUM_BACKUP_RATE_LEN);
+
+	upstream->cloneStreams = cloneStreams;
+}
+
+
 /*
  * standby_init_database tries to initialize PostgreSQL as a hot standby. It uses
  * pg_basebackup to do so. Returns false on failure.
@@ -923,7 +1418,19 @@ standby_init_database(LocalPostgresServer *postgres,
 			return false;
 		}
 
-		if (!needsReplicationSlot || hasReplicationSlot)
+		/*
+		 * When streaming the WAL, pg_basebackup can use a temporary slot
+		 * while the primary creates our permanent slot, so that the copy of
+		 * the data does not have to wait for a full primary keeper loop.
+		 */
+		bool streamWal =
+			IS_EMPTY_STRING_BUFFER(upstream->backupWalMethod) ||
+			strcmp(upstream->backupWalMethod, "stream") == 0;
+
+		bool useTemporarySlot =
+			needsReplicationSlot && !hasReplicationSlot && streamWal;
+
+		if (!needsReplicationSlot || hasReplicationSlot || useTemporarySlot)
 		{
 			/* first, make sure we can connect with "replication" */
 			if (!pgctl_identify_system(upstream))
@@ -933,9 +1440,27 @@ standby_init_database(LocalPostgresServer *postgres,
 				return false;
 			}
 
-			/* now pg_basebackup from our upstream node */
-			if (!pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, upstream))
+			/* an interrupted clone is resumed rather than started over */
+			bool resumed = false;
+
+			if (!standby_resume_clone(postgres, &resumed))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			if (resumed)
+			{
+				if (useTemporarySlot &&
+					!upstream_wait_for_replication_slot(upstream, pgSetup))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+			}
+			else if (!standby_clone_database(postgres, useTemporarySlot))
 			{
+				/* errors have already been logged */
 				return false;
 			}
 		}
@@ -952,6 +1477,199 @@ standby_init_database(LocalPostgresServer *postgres,
 		}
 	}
 
+	return standby_setup_cloned_database(postgres, hostname);
+}
+
+
+/*
+ * standby_resume_clone resumes the clone that pg_basebackup did not finish
+ * in the backup directory, when there is one that we can resume. The
+ * resumed parameter is set to false when we need to run pg_basebackup.
+ */
+static bool
+standby_resume_clone(LocalPostgresServer *postgres, bool *resumed)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+	PGSQL upstreamClient = { 0 };
+
+	*resumed = false;
+
+	if (!pgclone_exists(upstream->backupDir))
+	{
+		return true;
+	}
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgclone_can_resume(upstream, &upstreamClient))
+	{
+		pgsql_finish(&upstreamClient);
+		return true;
+	}
+
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "resume clone", NULL);
+	bool copied = pgclone_copy(upstream, &upstreamClient,
+							   pgSetup->pgdata, pgSetup->pg_ctl);
+	trace_span_end(&span, copied);
+
+	if (!copied)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*resumed = true;
+
+	return true;
+}
+
+
+/*
+ * standby_clone_database runs pg_basebackup from the upstream node, after
+ * having written the clone state file that allows resuming the clone when
+ * pg_basebackup is interrupted.
+ *
+ * When replication.clone_streams is more than one, we use our own parallel
+ * clone engine instead, which needs the upstream node to be a primary.
+ */
+static bool
+standby_clone_database(LocalPostgresServer *postgres, bool useTemporarySlot)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	PGSQL upstreamClient = { 0 };
+	bool canCopy = false;
+	bool success = false;
+
+	if (!upstream_init_client(upstream, pgSetup, &upstreamClient) ||
+		!pgclone_start(upstream, &upstreamClient, &canCopy))
+	{
+		log_warn("Failed to prepare for resuming pg_basebackup, "
+				 "an interrupted clone would start over");
+	}
+
+	if (upstream->cloneStreams > 1 && canCopy)
+	{
+		TraceSpan span = { 0 };
+
+		trace_span_start(&span, "parallel clone", NULL);
+		success =
+			ensure_empty_dir(upstream->backupDir, 0700) &&
+			ensure_empty_tablespace_dirs(pgSetup->pgdata) &&
+			pgclone_copy(upstream, &upstreamClient,
+						 pgSetup->pgdata, pgSetup->pg_ctl);
+		trace_span_end(&span, success);
+	}
+	else
+	{
+		pgsql_finish(&upstreamClient);
+
+		if (upstream->cloneStreams > 1)
+		{
+			log_info("The parallel clone needs a primary upstream node, "
+					 "using pg_basebackup");
+		}
+
+		success = standby_run_basebackup(postgres, useTemporarySlot);
+	}
+
+	if (!success)
+	{
+		return false;
+	}
+
+	if (!pgclone_done(upstream))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * The temporary slot is gone with the clone, and we need our permanent
+	 * slot to stream from the primary.
+	 */
+	if (useTemporarySlot &&
+		!upstream_wait_for_replication_slot(upstream, pgSetup))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * standby_run_basebackup runs pg_basebackup from the upstream node, with the
+ * adaptive backup rate, and with a temporary slot when our permanent slot
+ * does not exist yet.
+ */
+static bool
+standby_run_basebackup(LocalPostgresServer *postgres, bool useTemporarySlot)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	/* back-off when the upstream node is busy */
+	char maximumBackupRate[MAXIMUM_BACKUP_RATE_LEN] = { 0 };
+
+	strlcpy(maximumBackupRate,
+			upstream->maximumBackupRate,
+			MAXIMUM_BACKUP_RATE_LEN);
+
+	(void) upstream_set_adaptive_backup_rate(upstream, pgSetup);
+
+	/* without --slot, pg_basebackup uses a temporary slot */
+	char slotName[NAMEDATALEN] = { 0 };
+
+	strlcpy(slotName, upstream->slotName, sizeof(slotName));
+
+	if (useTemporarySlot)
+	{
+		log_info("The replication slot \"%s\" has not been created "
+				 "yet on the primary node " NODE_FORMAT
+				 ", using a temporary slot for pg_basebackup",
+				 upstream->slotName,
+				 upstream->primaryNode.nodeId,
+				 upstream->primaryNode.name,
+				 upstream->primaryNode.host,
+				 upstream->primaryNode.port);
+
+		upstream->slotName[0] = '\0';
+	}
+
+	/* now pg_basebackup from our upstream node */
+	bool success = pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, upstream);
+
+	strlcpy(upstream->maximumBackupRate,
+			maximumBackupRate,
+			MAXIMUM_BACKUP_RATE_LEN);
+
+	strlcpy(upstream->slotName, slotName, sizeof(upstream->slotName));
+
+	return success;
+}
+
+
+/*
+ * standby_setup_cloned_database sets up the new PGDATA as a standby, and
+ * starts Postgres.
+ */
+static bool
+standby_setup_cloned_database(LocalPostgresServer *postgres,
+							  const char *hostname)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
 	/* we have a new PGDATA, update our pgSetup information */
 	if (!local_postgres_update(postgres, true))
 	{
@@ -997,87 +1715,213 @@ standby_init_database(LocalPostgresServer *postgres,
 	 */
 	if (!postgres_add_default_settings(postgres, hostname))
 	{
-		log_error("Failed to add default settings to the secondary, "
-				  "see above for details.");
+		log_error("Failed to add default settings to the secondary, "
+				  "see above for details.");
+		return false;
+	}
+
+	if (!ensure_postgres_service_is_running(postgres))
+	{
+		return false;
+	}
+
+	log_info("PostgreSQL started on port %d", pgSetup->pgport);
+
+	return true;
+}
+
+
+/*
+ * primary_rewind_to_standby brings a database directory of a failed primary back
+ * into a state where it can become the standby of the new primary.
+ */
+bool
+primary_rewind_to_standby(LocalPostgresServer *postgres)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+
+	log_trace("primary_rewind_to_standby");
+	log_info("Rewinding PostgreSQL to follow new primary node " NODE_FORMAT,
+			 primaryNode->nodeId,
+			 primaryNode->name,
+			 primaryNode->host,
+			 primaryNode->port);
+
+	if (!ensure_postgres_service_is_stopped(postgres))
+	{
+		log_error("Failed to stop postgres to do rewind");
+		return false;
+	}
+
+	if (!postgres_maybe_do_crash_recovery(postgres))
+	{
+		log_error("Failed to implement Postgres crash recovery "
+				  "before calling pg_rewind");
+		return false;
+	}
+
+	/* before pg_rewind, make sure we can connect with "replication" */
+	bool identified = pgctl_identify_system(replicationSource);
+
+	if (!identified)
+	{
+		log_error("Failed to connect to the primary node " NODE_FORMAT
+				  "with a replication connection string. "
+				  "See above for details",
+				  primaryNode->nodeId,
+				  primaryNode->name,
+				  primaryNode->host,
+				  primaryNode->port);
+	}
+
+	/*
+	 * After a clean switchover, the old primary WAL ends with its shutdown
+	 * checkpoint, which the new primary has replayed before switching to its
+	 * new timeline. There is nothing to rewind then, and we can follow the
+	 * new primary right away.
+	 */
+	if (identified && primary_is_behind_fork_point(postgres))
+	{
+		if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+								   pgSetup->pgdata,
+								   pgSetup->pg_ctl,
+								   replicationSource))
+		{
+			log_error("Failed to setup Postgres as a standby");
+			return false;
+		}
+
+		if (!ensure_postgres_service_is_running(postgres))
+		{
+			log_error("Failed to start postgres as a standby");
+			return false;
+		}
+
+		return true;
+	}
+
+	/*
+	 * pg_rewind needs the WAL of the target from the last common checkpoint,
+	 * which might have been recycled already. When that happens we have to
+	 * copy the whole data directory with pg_basebackup instead, which takes a
+	 * very long time with large databases. Since Postgres 13, pg_rewind can
+	 * fetch the missing WAL files using restore_command, when it is set.
+	 */
+	bool restoreTargetWal = false;
+
+	if (pgSetup->control.pg_control_version >= 1300)
+	{
+		char restoreCommand[MAXCONNINFO] = { 0 };
+
+		if (pg_get_restore_command(pgSetup->pg_ctl, pgSetup->pgdata,
+								   restoreCommand, sizeof(restoreCommand)) &&
+			!IS_EMPTY_STRING_BUFFER(restoreCommand))
+		{
+			log_info("Using restore_command \"%s\" to fetch missing WAL "
+					 "files during pg_rewind", restoreCommand);
+			restoreTargetWal = true;
+		}
+	}
+
+	if (!pg_rewind(pgSetup->pgdata, pgSetup->pg_ctl,
+				   replicationSource, restoreTargetWal))
+	{
+		log_error("Failed to rewind old data directory");
+		return false;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres as a standby, after rewind");
 		return false;
 	}
 
 	if (!ensure_postgres_service_is_running(postgres))
 	{
+		log_error("Failed to start postgres after rewind");
 		return false;
 	}
 
-	log_info("PostgreSQL started on port %d", pgSetup->pgport);
-
 	return true;
 }
 
 
 /*
- * primary_rewind_to_standby brings a database directory of a failed primary back
- * into a state where it can become the standby of the new primary.
+ * primary_is_behind_fork_point returns true when the local Postgres instance
+ * has been shut down cleanly as a primary, on a timeline that the upstream
+ * node forked from after the local shutdown checkpoint.
+ *
+ * A clean shutdown checkpoint is the last WAL record of the instance, and the
+ * upstream node switched to its new timeline at the end of a record it got
+ * from us: when the checkpoint begins before the fork point, the upstream
+ * node has replayed all our WAL, and we didn't write anything it doesn't
+ * have.
  */
-bool
-primary_rewind_to_standby(LocalPostgresServer *postgres)
+static bool
+primary_is_behind_fork_point(LocalPostgresServer *postgres)
 {
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
-	ReplicationSource *replicationSource = &(postgres->replicationSource);
-	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	IdentifySystem *system = &(postgres->replicationSource.system);
+	TimeLineHistory *timelines = &(system->timelines);
 
-	log_trace("primary_rewind_to_standby");
-	log_info("Rewinding PostgreSQL to follow new primary node " NODE_FORMAT,
-			 primaryNode->nodeId,
-			 primaryNode->name,
-			 primaryNode->host,
-			 primaryNode->port);
+	uint64_t checkpointLSN = InvalidXLogRecPtr;
 
-	if (!ensure_postgres_service_is_stopped(postgres))
+	/* crash recovery might have run, and changed the control file */
+	if (!pg_controldata(pgSetup, false))
 	{
-		log_error("Failed to stop postgres to do rewind");
+		/* errors have already been logged */
 		return false;
 	}
 
-	if (!postgres_maybe_do_crash_recovery(postgres))
+	if (pgSetup->control.state != DB_SHUTDOWNED)
 	{
-		log_error("Failed to implement Postgres crash recovery "
-				  "before calling pg_rewind");
+		log_debug("primary_is_behind_fork_point: Postgres was not shut down "
+				  "cleanly as a primary");
 		return false;
 	}
 
-	/* before pg_rewind, make sure we can connect with "replication" */
-	if (!pgctl_identify_system(replicationSource))
-	{
-		log_error("Failed to connect to the primary node " NODE_FORMAT
-				  "with a replication connection string. "
-				  "See above for details",
-				  primaryNode->nodeId,
-				  primaryNode->name,
-				  primaryNode->host,
-				  primaryNode->port);
-	}
-
-	if (!pg_rewind(pgSetup->pgdata, pgSetup->pg_ctl, replicationSource))
+	if (!parseLSN(pgSetup->control.latestCheckpointLSN, &checkpointLSN))
 	{
-		log_error("Failed to rewind old data directory");
+		log_debug("primary_is_behind_fork_point: failed to parse LSN \"%s\"",
+				  pgSetup->control.latestCheckpointLSN);
 		return false;
 	}
 
-	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
-							   pgSetup->pgdata,
-							   pgSetup->pg_ctl,
-							   replicationSource))
+	for (int i = 0; i < timelines->count; i++)
 	{
-		log_error("Failed to setup Postgres as a standby, after rewind");
-		return false;
-	}
+		TimeLineHistoryEntry *entry = &(timelines->history[i]);
 
-	if (!ensure_postgres_service_is_running(postgres))
-	{
-		log_error("Failed to start postgres after rewind");
-		return false;
+		if (entry->tli != pgSetup->control.timeline_id)
+		{
+			continue;
+		}
+
+		/* the upstream node is still on our timeline, or forked before us */
+		if (entry->end == InvalidXLogRecPtr ||
+			checkpointLSN < entry->begin ||
+			checkpointLSN >= entry->end)
+		{
+			return false;
+		}
+
+		log_info("Local shutdown checkpoint %s on timeline %u is before "
+				 "the fork point %X/%X of the new primary timeline %u, "
+				 "skipping pg_rewind",
+				 pgSetup->control.latestCheckpointLSN,
+				 entry->tli,
+				 (uint32) (entry->end >> 32),
+				 (uint32) entry->end,
+				 system->timeline);
+
+		return true;
 	}
 
-	return true;
+	return false;
 }
 
 
@@ -1222,6 +2066,7 @@ postgres_maybe_do_crash_recovery(LocalPostgresServer *postgres)
 												&pgSetup->is_in_recovery,
 												postgres->pgsrSyncState,
 												postgres->currentLSN,
+												postgres->replayLSN,
 												&(pgSetup->control)))
 				{
 					log_info("Postgres has finished crash recovery at LSN %s",
@@ -1320,26 +2165,65 @@ standby_promote(LocalPostgresServer *postgres)
 		return true;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(pgsql);
-
 	log_info("Promoting postgres");
 
-	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	TraceSpan span = { 0 };
+
+	trace_span_start(&span, "wait until postgres is promoted", NULL);
+
+	/*
+	 * Since Postgres 12 we can promote with pg_promote() over our existing
+	 * connection, which returns as soon as the promotion is done. When that
+	 * fails, or on older versions, fork pg_ctl promote and poll.
+	 */
+	bool promoted = false;
+
+	if (pgSetup->control.pg_control_version >= 1200 &&
+		pgsql_promote(pgsql, AWAIT_PROMOTION_TIMEOUT_SECONDS, &promoted))
 	{
-		log_error("Failed to promote standby: see pg_ctl promote errors above");
-		return false;
+		if (!promoted)
+		{
+			log_warn("Postgres is still being promoted after %ds",
+					 AWAIT_PROMOTION_TIMEOUT_SECONDS);
+		}
+	}
+	else
+	{
+		/* disconnect from PostgreSQL now */
+		pgsql_finish(pgsql);
+
+		if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+		{
+			log_error("Failed to promote standby: "
+					  "see pg_ctl promote errors above");
+			trace_span_end(&span, false);
+			return false;
+		}
 	}
 
-	do {
-		log_info("Waiting for postgres to promote");
-		pg_usleep(AWAIT_PROMOTION_SLEEP_TIME_MS * 1000);
+	/* a promotion usually takes a few milliseconds, begin with short sleeps */
+	int sleepTimeMs = AWAIT_LSN_MIN_SLEEP_TIME_MS;
+	uint64_t lastLogTime = 0;
+
+	inRecovery = !promoted;
+
+	while (inRecovery)
+	{
+		if (time(NULL) > lastLogTime)
+		{
+			log_info("Waiting for postgres to promote");
+			lastLogTime = time(NULL);
+		}
+
+		pg_usleep(sleepTimeMs * 1000);
+		sleepTimeMs = await_next_sleep_time(sleepTimeMs);
 
 		if (asked_to_stop || asked_to_stop_fast)
 		{
 			log_trace("standby_promote: signaled");
 			pgsql_finish(pgsql);
 
+			trace_span_end(&span, false);
 			return false;
 		}
 
@@ -1347,9 +2231,12 @@ standby_promote(LocalPostgresServer *postgres)
 		{
 			log_error("Failed to determine whether postgres is in "
 					  "recovery mode after promotion");
+			trace_span_end(&span, false);
 			return false;
 		}
-	} while (inRecovery);
+	}
+
+	trace_span_end(&span, true);
 
 	/*
 	 * It's necessary to do a checkpoint before allowing the old primary to
@@ -1422,13 +2309,35 @@ primary_standby_has_caught_up(LocalPostgresServer *postgres)
 		return false;
 	}
 
-	if (!pgsql_one_slot_has_reached_target_lsn(pgsql,
-											   postgres->standbyTargetLSN,
-											   standbyCurrentLSN,
-											   &hasReachedLSN))
+	/*
+	 * The standby is usually only a few milliseconds behind, poll with short
+	 * sleeps for up to AWAIT_PROMOTION_SLEEP_TIME_MS before we get back to
+	 * the main loop.
+	 */
+	int sleepTimeMs = AWAIT_LSN_MIN_SLEEP_TIME_MS;
+	int waitedMs = 0;
+
+	for (;;)
 	{
-		/* errors have already been logged */
-		return false;
+		if (!pgsql_one_slot_has_reached_target_lsn(pgsql,
+												   postgres->standbyTargetLSN,
+												   standbyCurrentLSN,
+												   &hasReachedLSN))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (hasReachedLSN ||
+			waitedMs >= AWAIT_PROMOTION_SLEEP_TIME_MS ||
+			asked_to_stop || asked_to_stop_fast)
+		{
+			break;
+		}
+
+		pg_usleep(sleepTimeMs * 1000);
+		waitedMs += sleepTimeMs;
+		sleepTimeMs = await_next_sleep_time(sleepTimeMs);
 	}
 
 	if (hasReachedLSN)
@@ -1480,6 +2389,20 @@ standby_follow_new_primary(LocalPostgresServer *postgres)
 		}
 	}
 
+	/* keep the read-only sessions of a running standby when we can */
+	bool reloaded = false;
+
+	if (!standby_reload_replication_source(postgres, &reloaded))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (reloaded)
+	{
+		return true;
+	}
+
 	/* cleanup our existing standby setup, including postgresql.auto.conf */
 	if (!pg_cleanup_standby_mode(pgSetup->control.pg_control_version,
 								 pgSetup->pg_ctl,
@@ -1525,6 +2448,115 @@ standby_follow_new_primary(LocalPostgresServer *postgres)
 }
 
 
+/*
+ * standby_reload_replication_source applies the current replication source
+ * to a running standby with a reload of the Postgres configuration, when
+ * only primary_conninfo and primary_slot_name change. Postgres 13 and later
+ * then restart the WAL receiver, and the read-only sessions on the standby
+ * are not disconnected.
+ *
+ * The reloaded parameter is set to false when a restart is needed, either
+ * because of the Postgres version, because Postgres is not running as a
+ * standby, because we have no primary to follow, or because other settings
+ * have changed.
+ */
+static bool
+standby_reload_replication_source(LocalPostgresServer *postgres, bool *reloaded)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+
+	char standbyConfigFilePath[MAXPGPATH] = { 0 };
+	char *currentContents = NULL;
+	long currentSize = 0L;
+	char *newContents = NULL;
+	long newSize = 0L;
+	bool isInRecovery = false;
+
+	*reloaded = false;
+
+	/*
+	 * Without a primary, we want streaming replication to be stopped by the
+	 * time we return, so that the LSN we report next is our final one.
+	 */
+	if (pgSetup->control.pg_control_version < 1300 ||
+		IS_EMPTY_STRING_BUFFER(replicationSource->primaryNode.host) ||
+		!IS_EMPTY_STRING_BUFFER(replicationSource->targetLSN) ||
+		!pg_is_running(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		return true;
+	}
+
+	if (!pgsql_is_in_recovery(pgsql, &isInRecovery) || !isInRecovery)
+	{
+		/* we restart Postgres as a standby then */
+		return true;
+	}
+
+	join_path_components(standbyConfigFilePath,
+						 pgSetup->pgdata,
+						 AUTOCTL_STANDBY_CONF_FILENAME);
+
+	if (!file_exists(standbyConfigFilePath) ||
+		!read_file(standbyConfigFilePath, &currentContents, &currentSize))
+	{
+		return true;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres as a standby");
+		free(currentContents);
+		return false;
+	}
+
+	if (!read_file(standbyConfigFilePath, &newContents, &newSize))
+	{
+		/* errors have already been logged */
+		free(currentContents);
+		return false;
+	}
+
+	bool reloadable =
+		pg_standby_settings_are_reloadable(pgsql,
+										   pgSetup->control.pg_control_version,
+										   currentContents,
+										   newContents);
+
+	free(currentContents);
+	free(newContents);
+
+	if (!reloadable)
+	{
+		return true;
+	}
+
+	/* the prefetched WAL segments are not going to be used anymore */
+	if (!wal_prefetch_cleanup(pgSetup->pgdata))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Reloading Postgres at \"%s\" to apply the new "
+			 "replication settings", pgSetup->pgdata);
+
+	if (!pgsql_reload_conf(pgsql))
+	{
+		log_warn("Failed to reload Postgres, restarting it instead");
+		return true;
+	}
+
+	*reloaded = true;
+
+	return true;
+}
+
+
 /*
  * standby_fetch_missing_wal sets up replication to fetch up to given
  * recovery_target_lsn (inclusive) with a recovery_target_action set to
@@ -1562,31 +2594,15 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 	}
 
 	/*
-	 * Now loop until replay has reached our targetLSN.
+	 * Now wait until replay has reached our targetLSN.
 	 */
-	while (!hasReachedLSN)
+	if (!standby_wait_for_replay_lsn(pgsql,
+									 replicationSource->targetLSN,
+									 currentLSN,
+									 &hasReachedLSN))
 	{
-		if (asked_to_stop || asked_to_stop_fast)
-		{
-			log_trace("standby_fetch_missing_wal_and_promote: signaled");
-			break;
-		}
-
-		if (!pgsql_has_reached_target_lsn(pgsql,
-										  replicationSource->targetLSN,
-										  currentLSN,
-										  &hasReachedLSN))
-		{
-			/* errors have already been logged */
-			return false;
-		}
-
-		if (!hasReachedLSN)
-		{
-			log_info("Postgres recovery is at LSN %s, waiting for LSN %s",
-					 currentLSN, replicationSource->targetLSN);
-			pg_usleep(AWAIT_PROMOTION_SLEEP_TIME_MS * 1000);
-		}
+		/* errors have already been logged */
+		return false;
 	}
 
 	/* done with fast-forwarding, keep the value for node_active() call */
@@ -1625,6 +2641,96 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 }
 
 
+/*
+ * standby_wait_for_replay_lsn waits until Postgres recovery has replayed the
+ * given targetLSN, or until we are asked to stop. When Postgres implements
+ * pg_wal_replay_wait() we use it so that we're woken up as soon as the LSN
+ * has been replayed. Otherwise we poll pg_last_wal_replay_lsn(), sleeping
+ * AWAIT_LSN_MIN_SLEEP_TIME_MS first and then twice as long each time, up to
+ * AWAIT_PROMOTION_SLEEP_TIME_MS.
+ */
+static bool
+standby_wait_for_replay_lsn(PGSQL *pgsql, char *targetLSN,
+							char *currentLSN, bool *hasReachedLSN)
+{
+	bool useReplayWait = false;
+	int sleepTimeMs = AWAIT_LSN_MIN_SLEEP_TIME_MS;
+	uint64_t lastLogTime = 0;
+
+	if (!pgsql_has_wal_replay_wait(pgsql, &useReplayWait))
+	{
+		/* errors have already been logged, just poll then */
+		useReplayWait = false;
+	}
+
+	*hasReachedLSN = false;
+
+	while (!*hasReachedLSN)
+	{
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			log_trace("standby_wait_for_replay_lsn: signaled");
+			break;
+		}
+
+		if (!pgsql_has_reached_target_lsn(pgsql, targetLSN, currentLSN,
+										  hasReachedLSN))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (*hasReachedLSN)
+		{
+			break;
+		}
+
+		if (time(NULL) > lastLogTime)
+		{
+			log_info("Postgres recovery is at LSN %s, waiting for LSN %s",
+					 currentLSN, targetLSN);
+			lastLogTime = time(NULL);
+		}
+
+		if (useReplayWait)
+		{
+			bool replayed = false;
+
+			/* we check pg_last_wal_replay_lsn() again in the next loop */
+			if (!pgsql_wal_replay_wait(pgsql, targetLSN,
+									   AWAIT_PROMOTION_SLEEP_TIME_MS,
+									   &replayed))
+			{
+				log_warn("Failed to wait with pg_wal_replay_wait(), "
+						 "polling pg_last_wal_replay_lsn() instead");
+				useReplayWait = false;
+			}
+		}
+		else
+		{
+			pg_usleep(sleepTimeMs * 1000);
+			sleepTimeMs = await_next_sleep_time(sleepTimeMs);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * await_next_sleep_time returns how long to sleep next time when waiting for
+ * Postgres to reach a LSN or to be promoted: twice the previous sleep time,
+ * up to AWAIT_PROMOTION_SLEEP_TIME_MS.
+ */
+static int
+await_next_sleep_time(int sleepTimeMs)
+{
+	return sleepTimeMs * 2 > AWAIT_PROMOTION_SLEEP_TIME_MS
+		   ? AWAIT_PROMOTION_SLEEP_TIME_MS
+		   : sleepTimeMs * 2;
+}
+
+
 /*
  * standby_restart_with_no_primary sets up recovery parameters without a
  * primary_conninfo, so as to force disconnect from the primary and still
@@ -1648,6 +2754,20 @@ standby_restart_with_current_replication_source(LocalPostgresServer *postgres)
 		}
 	}
 
+	/* a recovery target needs a restart, other changes might not */
+	bool reloaded = false;
+
+	if (!standby_reload_replication_source(postgres, &reloaded))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (reloaded)
+	{
+		return true;
+	}
+
 	/* cleanup our existing standby setup, including postgresql.auto.conf */
 	if (!pg_cleanup_standby_mode(pgSetup->control.pg_control_version,
 								 pgSetup->pg_ctl,
@@ -1740,6 +2860,7 @@ standby_check_timeline_with_upstream(LocalPostgresServer *postgres)
 									 &(postgres->postgresSetup.is_in_recovery),
 									 postgres->pgsrSyncState,
 									 postgres->currentLSN,
+									 postgres->replayLSN,
 									 &(postgres->postgresSetup.control)))
 	{
 		log_error("Failed to update the local Postgres metadata");
@@ -1788,6 +2909,34 @@ standby_check_timeline_with_upstream(LocalPostgresServer *postgres)
 				 upstreamTimeline,
 				 localTimeline);
 
+		/*
+		 * The standby can only catch-up with the upstream timeline when its
+		 * current LSN belongs to its own timeline in the upstream history,
+		 * otherwise the upstream node switched timeline before that LSN.
+		 */
+		uint64_t currentLSN = InvalidXLogRecPtr;
+
+		if (parseLSN(postgres->currentLSN, &currentLSN))
+		{
+			TimeLineHistoryEntry *entry =
+				timelineHistoryFindLSN(&(replicationSource->system.timelines),
+									   currentLSN);
+
+			if (entry != NULL && entry->tli != localTimeline)
+			{
+				log_warn("Current LSN %s on this standby node is part of "
+						 "timeline %d on upstream node " NODE_FORMAT
+						 ", not timeline %d",
+						 postgres->currentLSN,
+						 entry->tli,
+						 primaryNode->nodeId,
+						 primaryNode->name,
+						 primaryNode->host,
+						 primaryNode->port,
+						 localTimeline);
+			}
+		}
+
 		return false;
 	}
 	else if (upstreamTimeline == localTimeline)
@@ -41,12 +41,21 @@ typedef struct LocalPostgresServer
 	bool pgIsRunning;
 	char pgsrSyncState[PGSR_SYNC_STATE_MAXLENGTH];
 	char currentLSN[PG_LSN_MAXLENGTH];
+	char replayLSN[PG_LSN_MAXLENGTH];
+	int64_t applyRate;          /* bytes per second, zero when unknown */
+	uint64_t applyRateSampleLSN;
+	uint64_t applyRateSampleTime;
+	bool applyRateSampleBacklog;
 	uint64_t pgFirstStartFailureTs;
 	int pgStartRetries;
+	uint64_t pgCrashRecoveryStartTs;    /* zero unless Postgres is starting */
 	PgInstanceKind pgKind;
 	LocalExpectedPostgresStatus expectedPgStatus;
 	char standbyTargetLSN[PG_LSN_MAXLENGTH];
 	char synchronousStandbyNames[BUFSIZE];
+
+	/* settings changed by the last postgres_add_default_settings() call */
+	char changedSettings[BUFSIZE];
 } LocalPostgresServer;
 
 
@@ -63,9 +72,21 @@ bool ensure_postgres_service_is_stopped(LocalPostgresServer *postgres);
 
 bool primary_has_replica(LocalPostgresServer *postgres, char *userName,
 						 bool *hasStandby);
+bool primary_get_replica_reply_time(LocalPostgresServer *postgres, char *userName,
+								   int64_t *replyTime);
 bool upstream_has_replication_slot(ReplicationSource *upstream,
 								   PostgresSetup *pgSetup,
 								   bool *hasReplicationSlot);
+bool upstream_save_prewarm_block_list(ReplicationSource *upstream,
+									  PostgresSetup *pgSetup,
+									  bool createExtensions,
+									  const char *filename);
+bool upstream_get_logical_slots(ReplicationSource *upstream,
+								PostgresSetup *pgSetup,
+								LogicalSlotArray *slotsArray);
+bool local_postgres_init_database_client(LocalPostgresServer *postgres,
+										 const char *dbname,
+										 PGSQL *client);
 bool primary_create_replication_slot(LocalPostgresServer *postgres,
 									 char *replicationSlotName);
 bool primary_drop_replication_slot(LocalPostgresServer *postgres,
@@ -77,9 +98,12 @@ bool postgres_replication_slot_create_and_drop(LocalPostgresServer *postgres,
 											   NodeAddressArray *nodeArray);
 bool postgres_replication_slot_maintain(LocalPostgresServer *postgres,
 										NodeAddressArray *nodeArray);
+bool postgres_replication_slot_advance(LocalPostgresServer *postgres,
+									   NodeAddressArray *nodeArray);
 bool primary_disable_synchronous_replication(LocalPostgresServer *postgres);
 bool postgres_add_default_settings(LocalPostgresServer *postgres,
 								   const char *hostname);
+bool postgres_add_role_settings(LocalPostgresServer *postgres, bool standby);
 bool primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 								  char *password, char *hostname,
 								  char *authMethod, HBAEditLevel hbaLevel,
@@ -97,6 +121,12 @@ bool standby_init_replication_source(LocalPostgresServer *postgres,
 									 const char *targetLSN,
 									 SSLOptions sslOptions,
 									 int currentNodeId);
+void standby_init_basebackup_options(LocalPostgresServer *postgres,
+									 const char *compress,
+									 const char *walMethod,
+									 const char *manifestChecksums,
+									 const char *minimumBackupRate,
+									 int cloneStreams);
 bool standby_init_database(LocalPostgresServer *postgres,
 						   const char *hostname,
 						   bool skipBaseBackup);
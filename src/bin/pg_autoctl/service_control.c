@@ -0,0 +1,755 @@
+/*
+ * src/bin/pg_autoctl/service_control.c
+ *   Serve the local node state over a Unix socket, so that CLI commands such
+ *   as pg_autoctl status don't need to connect to Postgres or the monitor.
+ *
+ * The node-active process writes a JSON snapshot of the local node state to a
+ * file next to its state file at the end of each iteration of its main loop,
+ * and this service answers the requests it receives on the control socket
+ * from that snapshot. As with the metrics service, a CLI command never waits
+ * for the keeper main loop, which might be busy with a transition.
+ *
+ * The protocol is a single request line, such as "state" or "status", and
+ * the answer is a JSON object, after which the service closes the
+ * connection. Errors are sent as {"error": "..."}, and the CLI commands then
+ * fall back to doing the work themselves.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "nodestate_utils.h"
+#include "parsing.h"
+#include "pidfile.h"
+#include "service_control.h"
+#include "signals.h"
+#include "state.h"
+#include "string_utils.h"
+
+#include "runprogram.h"
+
+#define CONTROL_REQUEST_MAXLENGTH 1024
+#define CONTROL_LISTEN_BACKLOG 16
+#define CONTROL_POLL_TIMEOUT_MS 1000
+#define CONTROL_CLIENT_TIMEOUT_MS 1000
+
+static int control_listen(const char *socketPath);
+static bool control_read_request(int clientFd, char *request, int size);
+static void control_send_answer(int clientFd, const char *answer, long size);
+static void control_send_error(int clientFd, const char *message);
+static void control_answer_status(int clientFd, KeeperConfig *config,
+								  const char *controlFile);
+static int control_poll_elapsed(int fd, short events, instr_time startTime);
+
+
+/*
+ * keeper_control_socket_path computes the control socket pathname, next to
+ * our pidfile in the XDG runtime directory. It returns false when the
+ * pathname doesn't fit in a Unix socket address.
+ */
+bool
+keeper_control_socket_path(ConfigFilePaths *pathnames, char *socketPath)
+{
+	path_in_same_directory(pathnames->pid,
+						   KEEPER_CONTROL_SOCKET_FILENAME,
+						   socketPath);
+
+	if (strlen(socketPath) >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+	{
+		log_debug("Control socket pathname \"%s\" is too long", socketPath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * service_control_start starts a subprocess that serves the control socket.
+ */
+bool
+service_control_start(void *context, pid_t *pid)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the control process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_control_runprogram();
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_control_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			log_debug("pg_autoctl control process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_control_runprogram runs the control service:
+ *
+ *   $ pg_autoctl do service control --pgdata ...
+ */
+void
+service_control_runprogram(void)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* see service_keeper_runprogram() about using --pgdata here */
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "control";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = keeperOptions.pgSetup.pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_control_loop listens on the control socket and answers the
+ * requests from the keeper snapshot file, one client at a time.
+ */
+bool
+service_control_loop(KeeperConfig *config)
+{
+	char socketPath[MAXPGPATH] = { 0 };
+	char controlFile[MAXPGPATH] = { 0 };
+
+	if (!keeper_control_socket_path(&(config->pathnames), socketPath))
+	{
+		log_error("Failed to serve the control socket: pathname \"%s\" "
+				  "is too long for a Unix socket",
+				  socketPath);
+		return false;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_CONTROL_FILENAME,
+						   controlFile);
+
+	int listenFd = control_listen(socketPath);
+
+	if (listenFd < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Serving the pg_autoctl control socket on \"%s\"", socketPath);
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		struct pollfd pfd = { .fd = listenFd, .events = POLLIN };
+
+		int ready = poll(&pfd, 1, CONTROL_POLL_TIMEOUT_MS);
+
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to poll the control socket: %m");
+			break;
+		}
+
+		if (ready == 0 || !(pfd.revents & POLLIN))
+		{
+			continue;
+		}
+
+		int clientFd = accept(listenFd, NULL, NULL);
+
+		if (clientFd < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+			{
+				log_warn("Failed to accept a control client connection: %m");
+			}
+			continue;
+		}
+
+		char request[CONTROL_REQUEST_MAXLENGTH] = { 0 };
+
+		if (!control_read_request(clientFd, request, sizeof(request)))
+		{
+			close(clientFd);
+			continue;
+		}
+
+		log_trace("Control request: \"%s\"", request);
+
+		if (strcmp(request, CONTROL_REQUEST_STATE) == 0)
+		{
+			char *contents = NULL;
+			long size = 0;
+
+			if (read_file_if_exists(controlFile, &contents, &size))
+			{
+				(void) control_send_answer(clientFd, contents, size);
+				free(contents);
+			}
+			else
+			{
+				(void) control_send_error(clientFd,
+										  "the keeper has not written "
+										  "its state yet");
+			}
+		}
+		else if (strcmp(request, CONTROL_REQUEST_STATUS) == 0)
+		{
+			(void) control_answer_status(clientFd, config, controlFile);
+		}
+		else
+		{
+			(void) control_send_error(clientFd, "unknown request");
+		}
+
+		close(clientFd);
+	}
+
+	close(listenFd);
+	(void) unlink_file(socketPath);
+
+	return true;
+}
+
+
+/*
+ * control_listen opens the control socket, only accessible to our user, and
+ * returns its file descriptor, or -1 on error.
+ */
+static int
+control_listen(const char *socketPath)
+{
+	struct sockaddr_un addr = { 0 };
+
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+
+	/* remove a socket left behind by a previous run */
+	if (file_exists(socketPath) && !unlink_file(socketPath))
+	{
+		/* errors have already been logged */
+		return -1;
+	}
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listenFd < 0)
+	{
+		log_error("Failed to create a Unix socket: %m");
+		return -1;
+	}
+
+	if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+	{
+		log_error("Failed to bind Unix socket \"%s\": %m", socketPath);
+		close(listenFd);
+		return -1;
+	}
+
+	if (chmod(socketPath, S_IRUSR | S_IWUSR) != 0)
+	{
+		log_error("Failed to set permissions on \"%s\": %m", socketPath);
+		close(listenFd);
+		return -1;
+	}
+
+	if (listen(listenFd, CONTROL_LISTEN_BACKLOG) != 0)
+	{
+		log_error("Failed to listen on the control socket: %m");
+		close(listenFd);
+		return -1;
+	}
+
+	return listenFd;
+}
+
+
+/*
+ * control_poll_elapsed waits for the given events on fd, for what remains of
+ * CONTROL_CLIENT_TIMEOUT_MS since startTime. It returns the poll() result,
+ * and 0 when the time is up.
+ */
+static int
+control_poll_elapsed(int fd, short events, instr_time startTime)
+{
+	for (;;)
+	{
+		instr_time duration;
+		struct pollfd pfd = { .fd = fd, .events = events };
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		int elapsedMs = (int) INSTR_TIME_GET_MILLISEC(duration);
+
+		if (elapsedMs >= CONTROL_CLIENT_TIMEOUT_MS)
+		{
+			return 0;
+		}
+
+		int ready = poll(&pfd, 1, CONTROL_CLIENT_TIMEOUT_MS - elapsedMs);
+
+		if (ready < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		return ready;
+	}
+}
+
+
+/*
+ * control_read_request reads the client request line, waiting at most
+ * CONTROL_CLIENT_TIMEOUT_MS in total, and removes its ending newline.
+ */
+static bool
+control_read_request(int clientFd, char *request, int size)
+{
+	int length = 0;
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	while (length < size - 1 && strchr(request, '\n') == NULL)
+	{
+		if (control_poll_elapsed(clientFd, POLLIN, startTime) <= 0)
+		{
+			log_debug("Control client took too long to send its request");
+			return false;
+		}
+
+		ssize_t bytes = recv(clientFd, request + length, size - 1 - length, 0);
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		length += bytes;
+		request[length] = '\0';
+	}
+
+	char *newline = strchr(request, '\n');
+
+	if (newline == NULL)
+	{
+		log_debug("Control client request is too long");
+		return false;
+	}
+
+	*newline = '\0';
+
+	return true;
+}
+
+
+/*
+ * control_send_answer writes the given answer to the client.
+ */
+static void
+control_send_answer(int clientFd, const char *answer, long size)
+{
+	long written = 0;
+
+	while (written < size)
+	{
+		ssize_t bytes = send(clientFd, answer + written, size - written,
+							 MSG_NOSIGNAL);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			log_debug("Failed to send the control answer to client: %m");
+			return;
+		}
+
+		written += bytes;
+	}
+}
+
+
+/*
+ * control_send_error sends an {"error": message} answer to the client.
+ */
+static void
+control_send_error(int clientFd, const char *message)
+{
+	json_arena_begin();
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsobj = json_value_get_object(js);
+
+	json_object_set_string(jsobj, "error", message);
+
+	char *serialized = json_serialize_to_string(js);
+
+	if (serialized != NULL)
+	{
+		(void) control_send_answer(clientFd, serialized, strlen(serialized));
+	}
+
+	json_arena_end();
+}
+
+
+/*
+ * control_answer_status answers the "status" request, in the same format as
+ * pg_autoctl status --json. The Postgres pid and status are read again from
+ * the postmaster.pid file, the rest comes from the keeper snapshot.
+ */
+static void
+control_answer_status(int clientFd, KeeperConfig *config,
+					  const char *controlFile)
+{
+	PostgresSetup *pgSetup = &(config->pgSetup);
+	bool pgIsNotRunningIsOk = true;
+	int maxRetries = 0;
+
+	if (!file_exists(config->pathnames.pid))
+	{
+		(void) control_send_error(clientFd, "pg_autoctl pidfile not found");
+		return;
+	}
+
+	json_arena_begin();
+
+	JSON_Value *snapshot = json_parse_file(controlFile);
+	JSON_Object *jsSnapshot = json_value_get_object(snapshot);
+	JSON_Value *jsPostgres = json_object_get_value(jsSnapshot, "postgres");
+
+	if (jsPostgres == NULL || json_type(jsPostgres) != JSONObject)
+	{
+		json_arena_end();
+
+		(void) control_send_error(clientFd,
+								  "the keeper has not written its state yet");
+		return;
+	}
+
+	pgSetup->pidFile.pid = 0;
+	pgSetup->pm_status = POSTMASTER_STATUS_UNKNOWN;
+
+	if (pg_setup_is_running(pgSetup))
+	{
+		(void) read_pg_pidfile(pgSetup, pgIsNotRunningIsOk, maxRetries);
+	}
+
+	JSON_Object *jsPostgresObj = json_value_get_object(jsPostgres);
+
+	json_object_set_number(jsPostgresObj, "pid",
+						   (double) pgSetup->pidFile.pid);
+	json_object_dotset_string(jsPostgresObj, "postmaster.status",
+							  pmStatusToString(pgSetup->pm_status));
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Value *jsPGAutoCtl = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	bool includeStatus = true;
+
+	pidfile_as_json(jsPGAutoCtl, config->pathnames.pid, includeStatus);
+
+	json_object_set_value(root, "postgres", json_value_deep_copy(jsPostgres));
+	json_object_set_value(root, "pg_autoctl", jsPGAutoCtl);
+
+	char *serialized = json_serialize_to_string(js);
+
+	if (serialized != NULL)
+	{
+		(void) control_send_answer(clientFd, serialized, strlen(serialized));
+	}
+
+	json_arena_end();
+}
+
+
+/*
+ * keeper_control_write_file writes a JSON snapshot of the local node state to
+ * a file next to the keeper state file, for the control service to serve.
+ * The file is replaced atomically.
+ */
+bool
+keeper_control_write_file(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	CurrentNodeState nodeState = { 0 };
+
+	char controlFile[MAXPGPATH] = { 0 };
+	char tempFile[MAXPGPATH] = { 0 };
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_CONTROL_FILENAME,
+						   controlFile);
+	sformat(tempFile, sizeof(tempFile), "%s.new", controlFile);
+
+	/* same as pg_autoctl show state --local */
+	nodeState.node.nodeId = keeperState->current_node_id;
+	strlcpy(nodeState.node.name, config->name, _POSIX_HOST_NAME_MAX);
+	strlcpy(nodeState.node.host, config->hostname, _POSIX_HOST_NAME_MAX);
+	nodeState.node.port = config->pgSetup.pgport;
+
+	strlcpy(nodeState.formation, config->formation, NAMEDATALEN);
+	nodeState.groupId = config->groupId;
+
+	nodeState.reportedState = keeperState->current_role;
+	nodeState.goalState = keeperState->assigned_role;
+
+	nodeState.node.tli = pgSetup->control.timeline_id;
+
+	if (postgres->pgIsRunning && !IS_EMPTY_STRING_BUFFER(postgres->currentLSN))
+	{
+		(void) parseLSN(postgres->currentLSN, &(nodeState.node.lsn));
+	}
+	else
+	{
+		(void) parseLSN(pgSetup->control.latestCheckpointLSN,
+						&(nodeState.node.lsn));
+	}
+
+	/* only the monitor knows */
+	nodeState.health = -1;
+
+	json_arena_begin();
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Value *jsState = json_value_init_object();
+	JSON_Value *jsPostgres = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	(void) nodestateAsJSON(&nodeState, jsState);
+	(void) pg_setup_as_json(pgSetup, jsPostgres);
+
+	json_object_set_number(root, "updated", (double) time(NULL));
+	json_object_set_string(root, "nodekind",
+						   nodeKindToString(config->pgSetup.pgKind));
+	json_object_set_value(root, "state", jsState);
+	json_object_set_value(root, "postgres", jsPostgres);
+
+	char *serialized = json_serialize_to_string(js);
+
+	bool success =
+		serialized != NULL &&
+		write_file(serialized, strlen(serialized), tempFile);
+
+	json_arena_end();
+
+	if (!success)
+	{
+		log_error("Failed to write the control file \"%s\"", tempFile);
+		return false;
+	}
+
+	if (rename(tempFile, controlFile) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tempFile, controlFile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_control_request sends the given request to the control service of
+ * the pg_autoctl node at pathnames, and parses its JSON answer. It returns
+ * false when the control service is not running or can't answer, in which
+ * case the caller is expected to do the work itself, so we only log at the
+ * DEBUG level here.
+ */
+bool
+keeper_control_request(ConfigFilePaths *pathnames,
+					   const char *request,
+					   JSON_Value **answer)
+{
+	char socketPath[MAXPGPATH] = { 0 };
+	char requestLine[CONTROL_REQUEST_MAXLENGTH] = { 0 };
+	struct sockaddr_un addr = { 0 };
+
+	if (!keeper_control_socket_path(pathnames, socketPath) ||
+		!file_exists(socketPath))
+	{
+		return false;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to create a Unix socket: %m");
+		return false;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+	{
+		log_debug("Failed to connect to the control socket \"%s\": %m",
+				  socketPath);
+		close(fd);
+		return false;
+	}
+
+	int length = sformat(requestLine, sizeof(requestLine), "%s\n", request);
+
+	if (send(fd, requestLine, length, MSG_NOSIGNAL) != length)
+	{
+		log_debug("Failed to send control request \"%s\": %m", request);
+		close(fd);
+		return false;
+	}
+
+	PQExpBuffer buffer = createPQExpBuffer();
+	instr_time startTime;
+	bool done = false;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	while (!done)
+	{
+		char chunk[BUFSIZE];
+
+		if (control_poll_elapsed(fd, POLLIN, startTime) <= 0)
+		{
+			log_debug("Control service took too long to answer \"%s\"",
+					  request);
+			break;
+		}
+
+		ssize_t bytes = recv(fd, chunk, sizeof(chunk), 0);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes < 0)
+		{
+			log_debug("Failed to read the control answer: %m");
+			break;
+		}
+
+		if (bytes == 0)
+		{
+			done = true;
+			break;
+		}
+
+		appendBinaryPQExpBuffer(buffer, chunk, bytes);
+	}
+
+	close(fd);
+
+	if (!done || PQExpBufferBroken(buffer))
+	{
+		destroyPQExpBuffer(buffer);
+		return false;
+	}
+
+	JSON_Value *js = json_parse_string(buffer->data);
+
+	destroyPQExpBuffer(buffer);
+
+	if (js == NULL || json_type(js) != JSONObject)
+	{
+		log_debug("Failed to parse the control answer to \"%s\"", request);
+		json_value_free(js);
+		return false;
+	}
+
+	const char *error = json_object_get_string(json_value_get_object(js),
+											   "error");
+
+	if (error != NULL)
+	{
+		log_debug("Control service failed to answer \"%s\": %s",
+				  request, error);
+		json_value_free(js);
+		return false;
+	}
+
+	*answer = js;
+
+	return true;
+}
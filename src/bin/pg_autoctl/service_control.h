@@ -0,0 +1,37 @@
+/*
+ * src/bin/pg_autoctl/service_control.h
+ *   Serve the local node state over a Unix socket, so that CLI commands such
+ *   as pg_autoctl status don't need to connect to Postgres or the monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef SERVICE_CONTROL_H
+#define SERVICE_CONTROL_H
+
+#include <stdbool.h>
+
+#include "parson.h"
+
+#include "config.h"
+#include "keeper.h"
+#include "keeper_config.h"
+
+/* the requests that the control service answers */
+#define CONTROL_REQUEST_STATE "state"
+#define CONTROL_REQUEST_STATUS "status"
+
+bool keeper_control_socket_path(ConfigFilePaths *pathnames, char *socketPath);
+
+bool service_control_start(void *context, pid_t *pid);
+void service_control_runprogram(void);
+bool service_control_loop(KeeperConfig *config);
+
+bool keeper_control_write_file(Keeper *keeper);
+
+bool keeper_control_request(ConfigFilePaths *pathnames,
+							const char *request,
+							JSON_Value **answer);
+
+#endif /* SERVICE_CONTROL_H */
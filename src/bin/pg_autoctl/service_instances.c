@@ -0,0 +1,196 @@
+/*
+ * src/bin/pg_autoctl/service_instances.c
+ *   Supervise several local pg_autoctl nodes from a single pg_autoctl run.
+ *
+ * When pg_autoctl run is given more than one --pgdata option, it runs one
+ * supervisor with a service per data directory, and each service is the
+ * usual pg_autoctl run for that data directory. A single command or systemd
+ * unit then manages all the Postgres nodes of a host.
+ *
+ * Each node keeps its own process tree: the FSM transitions of a node may
+ * run pg_basebackup or pg_rewind for a long time, and should never delay a
+ * failover of another node on the same host.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "config.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "service_instances.h"
+#include "service_keeper.h"
+#include "string_utils.h"
+#include "supervisor.h"
+
+#include "runprogram.h"
+
+
+/*
+ * start_instances starts a supervisor with one pg_autoctl run service per
+ * given PGDATA. The supervisor pidfile is found next to the pidfile of the
+ * first node.
+ */
+bool
+start_instances(char **pgdataArray, int count)
+{
+	Service services[PG_AUTOCTL_MAX_INSTANCES] = { 0 };
+	char pidfile[MAXPGPATH] = { 0 };
+
+	if (!build_xdg_path(pidfile,
+						XDG_RUNTIME,
+						pgdataArray[0],
+						KEEPER_INSTANCES_PID_FILENAME))
+	{
+		log_error("Failed to build pg_autoctl pid file pathname, see above.");
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		Service *service = &(services[i]);
+
+		sformat(service->name, sizeof(service->name), "instance-%d", i + 1);
+		service->policy = RP_INDEPENDENT;
+		service->pid = -1;
+		service->startFunction = &service_instance_start;
+		service->context = (void *) pgdataArray[i];
+		service->readyFunction = &service_instance_is_ready;
+
+		log_info("pg_autoctl service %s runs the node at \"%s\"",
+				 service->name, pgdataArray[i]);
+	}
+
+	return supervisor_start(services, count, pidfile);
+}
+
+
+/*
+ * service_instance_start starts a sub-process that runs pg_autoctl run for
+ * the PGDATA given as the context.
+ */
+bool
+service_instance_start(void *context, pid_t *pid)
+{
+	const char *pgdata = (const char *) context;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the pg_autoctl process for \"%s\"",
+					  pgdata);
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_instance_runprogram(pgdata);
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_instance_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			log_debug("pg_autoctl process for \"%s\" started in subprocess %d",
+					  pgdata, fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_instance_is_ready is the readyFunction of an instance service. As
+ * the nested pg_autoctl run doesn't notify systemd itself, we check the node
+ * readiness here, the same way its own supervisor would.
+ */
+bool
+service_instance_is_ready(void *context)
+{
+	const char *pgdata = (const char *) context;
+	KeeperConfig config = { 0 };
+
+	strlcpy(config.pgSetup.pgdata, pgdata, sizeof(config.pgSetup.pgdata));
+
+	if (!keeper_config_set_pathnames_from_pgdata(&(config.pathnames), pgdata))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	switch (ProbeConfigurationFileRole(config.pathnames.config))
+	{
+		case PG_AUTOCTL_ROLE_MONITOR:
+		{
+			return pg_setup_is_ready_now(&(config.pgSetup));
+		}
+
+		case PG_AUTOCTL_ROLE_KEEPER:
+		{
+			return service_keeper_node_is_ready(&config);
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
+
+
+/*
+ * service_instance_runprogram runs the pg_autoctl service of a single node:
+ *
+ *   $ pg_autoctl run --pgdata ...
+ */
+void
+service_instance_runprogram(const char *pgdata)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "run";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = (char *) pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
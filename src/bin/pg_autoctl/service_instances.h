@@ -0,0 +1,20 @@
+/*
+ * src/bin/pg_autoctl/service_instances.h
+ *   Supervise several local pg_autoctl nodes from a single pg_autoctl run.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef SERVICE_INSTANCES_H
+#define SERVICE_INSTANCES_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool start_instances(char **pgdataArray, int count);
+bool service_instance_start(void *context, pid_t *pid);
+bool service_instance_is_ready(void *context);
+void service_instance_runprogram(const char *pgdata);
+
+#endif /* SERVICE_INSTANCES_H */
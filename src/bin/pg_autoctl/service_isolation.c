@@ -0,0 +1,300 @@
+/*
+ * src/bin/pg_autoctl/service_isolation.c
+ *     Protect a pg_autoctl service from the load of its host: scheduling
+ *     priority, CPU affinity, memory locking, and cgroup placement.
+ *
+ * When the host is saturated, by a runaway query or a vacuum storm, the
+ * node-active process competes with Postgres for CPU and memory, and may
+ * then miss its node_active calls to the monitor, which could start a
+ * failover that only makes things worse. The functions here are used to
+ * give the node-active process an edge. Failures are logged as warnings and
+ * never prevent pg_autoctl from running: most of them need privileges that
+ * pg_autoctl might not have.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsetup.h"
+#include "service_isolation.h"
+#include "string_utils.h"
+
+
+#if defined(__linux__)
+static bool parse_cpu_list(const char *cpus, cpu_set_t *cpuSet);
+#endif
+
+
+/*
+ * service_set_nice sets the nice value of the current process. Negative
+ * values need the CAP_SYS_NICE capability, or a RLIMIT_NICE resource limit,
+ * which systemd sets with LimitNICE=.
+ */
+bool
+service_set_nice(int nice)
+{
+	if (nice < SERVICE_NICE_MIN || nice > SERVICE_NICE_MAX)
+	{
+		log_warn("Failed to set nice value %d: value must be between %d and %d",
+				 nice, SERVICE_NICE_MIN, SERVICE_NICE_MAX);
+		return false;
+	}
+
+	if (setpriority(PRIO_PROCESS, 0, nice) != 0)
+	{
+		log_warn("Failed to set nice value %d: %m", nice);
+
+		if (errno == EACCES || errno == EPERM)
+		{
+			log_warn("HINT: a negative nice value needs CAP_SYS_NICE, "
+					 "or LimitNICE= in the systemd unit");
+		}
+		return false;
+	}
+
+	log_info("Running with nice value %d", nice);
+
+	return true;
+}
+
+
+/*
+ * service_set_cpu_affinity pins the current process to the given list of
+ * CPUs, such as "3" or "0-1,6", or allows it to run on any CPU again when
+ * the list is empty. This is only supported on Linux.
+ */
+bool
+service_set_cpu_affinity(const char *cpus)
+{
+#if defined(__linux__)
+	cpu_set_t cpuSet;
+
+	if (IS_EMPTY_STRING_BUFFER(cpus))
+	{
+		/* the kernel ignores the CPUs that we are not allowed to use */
+		CPU_ZERO(&cpuSet);
+
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			CPU_SET(cpu, &cpuSet);
+		}
+
+		if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0)
+		{
+			log_warn("Failed to reset CPU affinity: %m");
+			return false;
+		}
+
+		return true;
+	}
+
+	if (!parse_cpu_list(cpus, &cpuSet))
+	{
+		log_warn("Failed to parse CPU list \"%s\", expected a list of CPU "
+				 "numbers or ranges such as \"0-1,6\"",
+				 cpus);
+		return false;
+	}
+
+	if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0)
+	{
+		log_warn("Failed to set CPU affinity to \"%s\": %m", cpus);
+		return false;
+	}
+
+	log_info("Running on CPUs %s", cpus);
+
+	return true;
+#else
+	log_warn("Failed to set CPU affinity to \"%s\": "
+			 "Operating System not supported",
+			 cpus);
+	return false;
+#endif
+}
+
+
+/*
+ * service_lock_memory locks the pages of the current process in memory, so
+ * that they can't be swapped out, or unlocks them. We lock pages as they are
+ * faulted in when the system allows it, so that the reserved but unused
+ * parts of the address space, such as thread stacks, are not locked.
+ *
+ * The locked memory is limited by RLIMIT_MEMLOCK, which systemd sets with
+ * LimitMEMLOCK=.
+ */
+bool
+service_lock_memory(bool lock)
+{
+	if (!lock)
+	{
+		if (munlockall() != 0)
+		{
+			log_warn("Failed to unlock memory: %m");
+			return false;
+		}
+
+		return true;
+	}
+
+	int flags = MCL_CURRENT | MCL_FUTURE;
+
+#if defined(MCL_ONFAULT)
+	flags |= MCL_ONFAULT;
+#endif
+
+	if (mlockall(flags) != 0)
+	{
+		log_warn("Failed to lock memory: %m");
+
+		if (errno == ENOMEM || errno == EPERM)
+		{
+			log_warn("HINT: locking memory needs CAP_IPC_LOCK, or a large "
+					 "enough LimitMEMLOCK= in the systemd unit");
+		}
+		return false;
+	}
+
+	log_info("Locked the memory of the process");
+
+	return true;
+}
+
+
+/*
+ * service_join_cgroup moves the current process to the given cgroup, given
+ * as the absolute pathname of its directory, such as
+ * "/sys/fs/cgroup/pg_autoctl". The cgroup must already exist and be writable
+ * by our user.
+ */
+bool
+service_join_cgroup(const char *cgroup)
+{
+	char procsFile[MAXPGPATH] = { 0 };
+	char pid[BUFSIZE] = { 0 };
+
+	if (cgroup[0] != '/')
+	{
+		log_warn("Failed to join cgroup \"%s\": pathname must be absolute",
+				 cgroup);
+		return false;
+	}
+
+	if (!directory_exists(cgroup))
+	{
+		log_warn("Failed to join cgroup \"%s\": directory does not exist",
+				 cgroup);
+		return false;
+	}
+
+	join_path_components(procsFile, cgroup, "cgroup.procs");
+
+	int fd = open(procsFile, O_WRONLY);
+
+	if (fd < 0)
+	{
+		log_warn("Failed to open \"%s\": %m", procsFile);
+		return false;
+	}
+
+	int len = sformat(pid, sizeof(pid), "%d\n", getpid());
+
+	if (write(fd, pid, len) != len)
+	{
+		log_warn("Failed to join cgroup \"%s\": %m", cgroup);
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	log_info("Running in cgroup \"%s\"", cgroup);
+
+	return true;
+}
+
+
+#if defined(__linux__)
+
+/*
+ * parse_cpu_list parses a list of CPU numbers and ranges such as "0-1,6" in
+ * the given CPU set, the same syntax as taskset --cpu-list and systemd's
+ * CPUAffinity=.
+ */
+static bool
+parse_cpu_list(const char *cpus, cpu_set_t *cpuSet)
+{
+	const char *ptr = cpus;
+
+	CPU_ZERO(cpuSet);
+
+	while (*ptr != '\0')
+	{
+		char *end = NULL;
+
+		errno = 0;
+		long first = strtol(ptr, &end, 10);
+
+		if (errno != 0 || end == ptr || first < 0 || first >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		long last = first;
+
+		ptr = end;
+
+		if (*ptr == '-')
+		{
+			const char *start = ++ptr;
+
+			errno = 0;
+			last = strtol(start, &end, 10);
+
+			if (errno != 0 || end == start || last < first || last >= CPU_SETSIZE)
+			{
+				return false;
+			}
+
+			ptr = end;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			CPU_SET(cpu, cpuSet);
+		}
+
+		if (*ptr == ',')
+		{
+			++ptr;
+		}
+		else if (*ptr != '\0')
+		{
+			return false;
+		}
+	}
+
+	return CPU_COUNT(cpuSet) > 0;
+}
+
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * src/bin/pg_autoctl/service_isolation.h
+ *     Protect a pg_autoctl service from the load of its host: scheduling
+ *     priority, CPU affinity, memory locking, and cgroup placement.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SERVICE_ISOLATION_H
+#define SERVICE_ISOLATION_H
+
+#include <stdbool.h>
+
+/* the range of nice(2) values */
+#define SERVICE_NICE_MIN (-20)
+#define SERVICE_NICE_MAX 19
+
+bool service_set_nice(int nice);
+bool service_set_cpu_affinity(const char *cpus);
+bool service_lock_memory(bool lock);
+bool service_join_cgroup(const char *cgroup);
+
+#endif /* SERVICE_ISOLATION_H */
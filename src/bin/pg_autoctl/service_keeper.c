@@ -7,16 +7,26 @@
  *
  */
 
+#include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "postgres_fe.h"
+
+#if PG_MAJORVERSION_NUM >= 15
+#include "common/pg_prng.h"
+#endif
+
 #include "cli_common.h"
 #include "cli_root.h"
 #include "defaults.h"
+#include "env_utils.h"
+#include "file_utils.h"
 #include "fsm.h"
 #include "keeper.h"
 #include "keeper_config.h"
@@ -26,12 +36,18 @@
 #include "pgctl.h"
 #include "pidfile.h"
 #include "service_keeper.h"
+#include "service_control.h"
+#include "service_isolation.h"
+#include "service_metrics.h"
 #include "service_postgres_ctl.h"
 #include "signals.h"
 #include "state.h"
 #include "string_utils.h"
 #include "supervisor.h"
+#include "systemd_notify.h"
+#include "trace.h"
 
+#include "portability/instr_time.h"
 #include "runprogram.h"
 
 static bool keepRunning = true;
@@ -47,30 +63,48 @@ KeeperReloadFunction *KeeperReloadHooks = KeeperReloadHooksArray;
 /* list of hooks to run to update a list of nodes, at node active time */
 KeeperNodesArrayRefreshFunction KeeperNodesArrayRefreshArray[] = {
 	&keeper_refresh_hba,
+	&keeper_refresh_pooler,
 	NULL
 };
 
 KeeperNodesArrayRefreshFunction *KeeperRefreshHooks =
 	KeeperNodesArrayRefreshArray;
 
+static void keeper_process_file_watch(Keeper *keeper, FileWatch *fileWatch,
+									  int configWatchIndex, int nodesWatchIndex);
+
 
 static bool service_keeper_node_active(Keeper *keeper, bool doInit);
+static int keeper_debug_sleep_time(void);
+static int keeper_random_time(int maxMs);
+static int keeper_node_active_sleep_time(Keeper *keeper,
+										 bool couldContactMonitor);
 static void check_for_network_partitions(Keeper *keeper);
+static void update_secondary_contact(Keeper *keeper);
 static bool is_network_healthy(Keeper *keeper);
 static bool in_network_partition(KeeperStateData *keeperState, uint64_t now,
 								 int networkPartitionTimeout);
+static bool role_holds_primary_lease(NodeState role);
+static void renew_primary_lease(Keeper *keeper);
+static void check_primary_lease(Keeper *keeper);
+static double elapsed_ms(instr_time startTime);
+static void keeper_loop_phase_done(Keeper *keeper, KeeperLoopPhase phase,
+								   instr_time startTime);
+static void keeper_loop_done(Keeper *keeper, instr_time loopStartTime);
 
 
 /*
  * keeper_service_start starts the keeper processes: the node_active main loop
- * and depending on the current state the Postgres instance.
+ * and depending on the current state the Postgres instance, and the control
+ * service. When metrics.listen is set, the metrics service is started too.
  */
 bool
 start_keeper(Keeper *keeper)
 {
 	const char *pidfile = keeper->config.pathnames.pid;
+	char socketPath[MAXPGPATH] = { 0 };
 
-	Service subprocesses[] = {
+	Service subprocesses[4] = {
 		{
 			SERVICE_NAME_POSTGRES,
 			RP_PERMANENT,
@@ -82,16 +116,131 @@ start_keeper(Keeper *keeper)
 			RP_PERMANENT,
 			-1,
 			&service_keeper_start,
-			(void *) keeper
+			(void *) keeper,
+			&service_keeper_is_ready
 		}
 	};
 
-	int subprocessesCount = sizeof(subprocesses) / sizeof(subprocesses[0]);
+	int subprocessesCount = 2;
+
+	/* the control socket pathname must fit in a Unix socket address */
+	if (keeper_control_socket_path(&(keeper->config.pathnames), socketPath))
+	{
+		Service control = {
+			SERVICE_NAME_CONTROL,
+			RP_PERMANENT,
+			-1,
+			&service_control_start
+		};
+
+		subprocesses[subprocessesCount++] = control;
+	}
+	else
+	{
+		log_warn("Skipping the control service: pathname \"%s\" is too "
+				 "long for a Unix socket",
+				 socketPath);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(keeper->config.metricsListen))
+	{
+		Service metrics = {
+			SERVICE_NAME_METRICS,
+			RP_PERMANENT,
+			-1,
+			&service_metrics_start
+		};
+
+		subprocesses[subprocessesCount++] = metrics;
+	}
 
 	return supervisor_start(subprocesses, subprocessesCount, pidfile);
 }
 
 
+/*
+ * service_keeper_is_ready is the readyFunction of the node-active service. It
+ * is called from the supervisor process, see service_keeper_node_is_ready.
+ */
+bool
+service_keeper_is_ready(void *context)
+{
+	Keeper *keeper = (Keeper *) context;
+
+	return service_keeper_node_is_ready(&(keeper->config));
+}
+
+
+/*
+ * service_keeper_node_is_ready returns true when the node has reached the
+ * state assigned by the monitor, and when Postgres accepts connections if it
+ * is expected to be running in that state. We only read the files that the
+ * node-active process maintains, so this never blocks.
+ */
+bool
+service_keeper_node_is_ready(KeeperConfig *config)
+{
+	KeeperStateData keeperState = { 0 };
+	LocalPostgresServer postgres = { 0 };
+	KeeperStatePostgres *pgStatus = &(postgres.expectedPgStatus.state);
+
+	if (!file_exists(config->pathnames.state) ||
+		!keeper_state_read(&keeperState, config->pathnames.state))
+	{
+		return false;
+	}
+
+	if (keeperState.current_role != keeperState.assigned_role)
+	{
+		return false;
+	}
+
+	switch (keeperState.current_role)
+	{
+		case NO_STATE:
+		case INIT_STATE:
+		case DROPPED_STATE:
+		{
+			return false;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+
+	postgres.postgresSetup = config->pgSetup;
+
+	if (!local_postgres_set_status_path(&postgres, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (file_exists(postgres.expectedPgStatus.pgStatusPath) &&
+		keeper_postgres_state_read(pgStatus,
+								   postgres.expectedPgStatus.pgStatusPath))
+	{
+		switch (pgStatus->pgExpectedStatus)
+		{
+			case PG_EXPECTED_STATUS_RUNNING:
+			case PG_EXPECTED_STATUS_RUNNING_AS_SUBPROCESS:
+			{
+				return pg_setup_is_ready_now(&(postgres.postgresSetup));
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * keeper_start_node_active_process starts a sub-process that communicates with
  * the monitor to implement the node_active protocol.
@@ -193,6 +342,38 @@ service_keeper_runprogram(Keeper *keeper)
 }
 
 
+/*
+ * service_keeper_reexec replaces the running node-active process with the
+ * pg_autoctl binary found on-disk, after an upgrade. The process keeps its
+ * PID and its parent, so the supervisor does not restart anything and the
+ * PID file stays valid. The keeper state is kept on-disk and read again by
+ * the new binary at its first loop.
+ *
+ * Connections to the monitor and to Postgres can't be handed over to a new
+ * program, so we close them cleanly before. This function only returns when
+ * execv() failed, then the caller exits and the supervisor restarts us.
+ */
+void
+service_keeper_reexec(Keeper *keeper)
+{
+	log_info("Re-executing the node-active process with \"%s\"",
+			 pg_autoctl_program);
+
+	(void) pgsql_finish(&(keeper->monitor.pgsql));
+	(void) pgsql_finish(&(keeper->monitor.notificationClient));
+	(void) pgsql_finish(&(keeper->monitor.standbyClient));
+	(void) pgsql_finish(&(keeper->postgres.sqlClient));
+
+	/* don't lose log lines from our buffer */
+	(void) log_flush();
+
+	(void) service_keeper_runprogram(keeper);
+
+	log_error("Failed to re-execute the node-active process with \"%s\": %m",
+			  pg_autoctl_program);
+}
+
+
 /*
  * service_keeper_node_active_init initializes the pg_autoctl service for the
  * node_active protocol.
@@ -238,10 +419,52 @@ service_keeper_node_active_init(Keeper *keeper)
 		exit(EXIT_CODE_PGCTL);
 	}
 
+	(void) trace_setup(config->tracingOtlpFile,
+					   config->formation,
+					   config->name,
+					   config->hostname);
+
+	(void) service_keeper_isolate(config);
+
 	return true;
 }
 
 
+/*
+ * service_keeper_isolate applies the service settings of the configuration to
+ * the node-active process, so that it keeps calling node_active on time when
+ * the host is overloaded. We join the cgroup first, as its cpuset limits the
+ * CPU affinity that we can then set.
+ *
+ * Only the node-active process is isolated that way, not Postgres. The
+ * commands that the node-active process runs, such as pg_basebackup or
+ * pg_rewind, inherit its nice value, CPU affinity and cgroup though.
+ */
+void
+service_keeper_isolate(KeeperConfig *config)
+{
+	if (!IS_EMPTY_STRING_BUFFER(config->serviceCgroup))
+	{
+		(void) service_join_cgroup(config->serviceCgroup);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(config->serviceCpus))
+	{
+		(void) service_set_cpu_affinity(config->serviceCpus);
+	}
+
+	if (config->serviceNice != 0)
+	{
+		(void) service_set_nice(config->serviceNice);
+	}
+
+	if (config->serviceLockMemory)
+	{
+		(void) service_lock_memory(true);
+	}
+}
+
+
 /*
  * keeper_node_active_loop implements the main loop of the keeper, which
  * periodically gets the goal state from the monitor and makes the state
@@ -264,8 +487,30 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 
 	bool nodeHasBeenDroppedFromTheMonitor = false;
 
+	/*
+	 * Watch the configuration file, and the nodes file used when the monitor
+	 * is disabled, so that changes are applied without waiting for a SIGHUP
+	 * or the end of our sleep time.
+	 */
+	FileWatch fileWatch = { 0 };
+
+	(void) file_watch_init(&fileWatch);
+
+	int configWatchIndex = file_watch_add(&fileWatch, config->pathnames.config);
+	int nodesWatchIndex = file_watch_add(&fileWatch, config->pathnames.nodes);
+
 	log_debug("pg_autoctl service is starting");
 
+	/* on upgrades, execv() the new binary rather than exit for a restart */
+	keeper->reexecOnUpgrade = true;
+
+	/*
+	 * The node-active process logs a lot at debug level, and it shares its
+	 * stderr with the other pg_autoctl processes. Buffer our log lines and
+	 * write them in batches, errors are still written right away.
+	 */
+	(void) log_set_buffered(true);
+
 	/* setup our monitor client connection with our notification handler */
 	(void) monitor_setup_notifications(monitor,
 									   keeperState->current_group,
@@ -311,44 +556,163 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		bool needStateChange = false;
 		bool transitionFailed = false;
 
+		instr_time loopStartTime;
+		instr_time phaseStartTime;
+
+		/* when running as a systemd service, we're still alive */
+		(void) systemd_watchdog_ping();
+
 		/*
 		 * If we're in a stable state (current state and goal state are the
 		 * same, and this didn't change in the previous loop), then we can
 		 * sleep for a while. As the monitor notifies every state change, we
 		 * can also interrupt our sleep as soon as we get the hint.
 		 */
+		/* don't keep log lines in our buffer while we sleep */
+		if (doSleep)
+		{
+			(void) log_flush();
+		}
+
 		if (doSleep && !config->monitorDisabled)
 		{
-			int timeoutMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+			int timeoutMs =
+				keeper_node_active_sleep_time(keeper, couldContactMonitor);
 
 			bool groupStateHasChanged = false;
+			bool localPostgresLost = false;
+			bool filesHaveChanged = false;
+
+			/*
+			 * Also watch the idle connection to the local Postgres server
+			 * that we kept from the previous iteration, so that we wake-up as
+			 * soon as Postgres stops, rather than at the end of our sleep
+			 * time.
+			 */
+			PGSQL *watchClient =
+				postgres->sqlClient.connection != NULL
+				? &(postgres->sqlClient)
+				: NULL;
+
+			if (PG_AUTOCTL_MONITOR_LONG_POLL(config))
+			{
+				/* we might have switched from LISTEN with a reload */
+				if (monitor->notificationClient.connection != NULL)
+				{
+					pgsql_finish(&(monitor->notificationClient));
+				}
+
+				/*
+				 * Long-polling only tells us that the states of our group
+				 * have changed, fetch them again before we use them. When
+				 * the monitor can't be reached, sleep as if we had waited.
+				 */
+				if (!monitor_poll_state_change(monitor,
+											   config->formation,
+											   keeperState->current_group,
+											   &(keeper->groupStateVersion),
+											   timeoutMs,
+											   &groupStateHasChanged))
+				{
+					pg_usleep(timeoutMs * 1000L);
+				}
+				else if (groupStateHasChanged)
+				{
+					keeper->groupStatesKnown = false;
+				}
+			}
+			else
+			{
+				/* establish a connection for notifications if none present */
+				(void) pgsql_prepare_to_wait(&(monitor->notificationClient));
+				(void) monitor_wait_for_events(monitor,
+											   config->formation,
+											   keeperState->current_group,
+											   keeperState->current_node_id,
+											   watchClient,
+											   &(keeper->groupStates),
+											   timeoutMs,
+											   &groupStateHasChanged,
+											   &localPostgresLost,
+											   fileWatch.fd,
+											   &filesHaveChanged);
+			}
+
+			if (filesHaveChanged)
+			{
+				(void) keeper_process_file_watch(keeper, &fileWatch,
+												 configWatchIndex,
+												 nodesWatchIndex);
+			}
+
+			if (groupStateHasChanged)
+			{
+				keeper->groupStatesChangeTime = time(NULL);
+			}
+
+			if (localPostgresLost)
+			{
+				log_info("Connection to the local Postgres server was closed, "
+						 "checking Postgres status now");
+			}
 
-			/* establish a connection for notifications if none present */
-			(void) pgsql_prepare_to_wait(&(monitor->notificationClient));
-			(void) monitor_wait_for_state_change(monitor,
-												 config->formation,
-												 keeperState->current_group,
-												 keeperState->current_node_id,
-												 timeoutMs,
-												 &groupStateHasChanged);
-
-			/* when no state change has been notified, close the connection */
-			if (!groupStateHasChanged &&
-				monitor->notificationClient.connectionStatementType ==
-				PGSQL_CONNECTION_MULTI_STATEMENT)
+			/*
+			 * We keep the notification connection open for the next loop:
+			 * the notifications sent while we are busy elsewhere are then
+			 * queued for us rather than lost, and we don't pay for a new
+			 * connection at each loop. When the wait failed, connect again,
+			 * and fetch the states of our group nodes again, as we might
+			 * have missed some notifications.
+			 */
+			if (!PG_AUTOCTL_MONITOR_LONG_POLL(config) &&
+				(monitor->notificationClient.connection == NULL ||
+				 PQstatus(monitor->notificationClient.connection) !=
+				 CONNECTION_OK))
 			{
 				pgsql_finish(&(monitor->notificationClient));
+				keeper->groupStatesKnown = false;
 			}
 		}
 		else if (doSleep && config->monitorDisabled)
 		{
-			int timeoutUs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000 * 1000;
+			int timeoutMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+
+			/*
+			 * An external process edits our state and nodes files when the
+			 * monitor is disabled, wake-up as soon as it's done.
+			 */
+			if (fileWatch.fd >= 0)
+			{
+				struct pollfd pfd = { .fd = fileWatch.fd, .events = POLLIN };
+
+				int ready = poll(&pfd, 1, timeoutMs);
 
-			pg_usleep(timeoutUs);
+				if (ready > 0)
+				{
+					(void) keeper_process_file_watch(keeper, &fileWatch,
+													 configWatchIndex,
+													 nodesWatchIndex);
+				}
+				else if (ready < 0 && errno != EINTR)
+				{
+					log_debug("Failed to poll for file changes: %m");
+				}
+			}
+			else
+			{
+				pg_usleep(timeoutMs * 1000L);
+			}
 		}
 
 		doSleep = true;
 
+		/* the loop duration metric does not count our sleep time */
+		INSTR_TIME_SET_CURRENT(loopStartTime);
+
+		memset(keeper->metrics.phaseDone, 0, sizeof(keeper->metrics.phaseDone));
+		memset(keeper->metrics.phaseDurationMs, 0,
+			   sizeof(keeper->metrics.phaseDurationMs));
+
 		/*
 		 * Handle signals.
 		 *
@@ -362,6 +726,9 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 */
 		if (asked_to_reload || firstLoop)
 		{
+			/* the connection string might change */
+			pgsql_finish(&(postgres->sqlClient));
+
 			(void) keeper_call_reload_hooks(keeper, firstLoop, doInit);
 		}
 
@@ -387,7 +754,14 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 * Also, when --disable-monitor is used, then we get our assigned state
 		 * by reading the state file, which is edited by an external process.
 		 */
-		if (!keeper_load_state(keeper))
+		INSTR_TIME_SET_CURRENT(phaseStartTime);
+
+		bool stateLoaded = keeper_load_state(keeper);
+
+		keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_LOAD_STATE,
+							   phaseStartTime);
+
+		if (!stateLoaded)
 		{
 			log_error("Failed to read keeper state file, retrying...");
 			CHECK_FOR_FAST_SHUTDOWN;
@@ -401,11 +775,35 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 					 NodeStateToString(keeperState->current_role));
 		}
 
+		/*
+		 * Our round with the monitor starts with checking the version of its
+		 * extension, which doesn't depend on the local Postgres state that
+		 * we report next. Send that query now and read its results in
+		 * keeper_node_active(), so that the monitor round trip happens while
+		 * we check the local Postgres instance.
+		 */
+		if (!config->monitorDisabled)
+		{
+			monitor->pgsql.connectionStatementType =
+				PGSQL_CONNECTION_MULTI_STATEMENT;
+
+			(void) pgsql_set_main_loop_retry_policy(
+				&(monitor->pgsql.retryPolicy));
+			(void) monitor_send_extension_version_query(monitor);
+		}
+
 		/*
 		 * Check for any changes in the local PostgreSQL instance, and update
 		 * our in-memory values for the replication WAL lag and sync_state.
 		 */
-		if (!keeper_update_pg_state(keeper, LOG_WARN))
+		INSTR_TIME_SET_CURRENT(phaseStartTime);
+
+		bool pgStateUpdated = keeper_update_pg_state(keeper, LOG_WARN);
+
+		keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_UPDATE_PG_STATE,
+							   phaseStartTime);
+
+		if (!pgStateUpdated)
 		{
 			warnedOnCurrentIteration = true;
 			log_warn("Failed to update the keeper's state from the local "
@@ -433,8 +831,17 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			bool forceCacheInvalidation =
 				keeperState->current_role == WAIT_STANDBY_STATE;
 
+			INSTR_TIME_SET_CURRENT(phaseStartTime);
+
 			/* maybe update our cached list of other nodes */
-			if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
+			bool refreshed =
+				keeper_refresh_other_nodes(keeper, forceCacheInvalidation);
+
+			keeper_loop_phase_done(keeper,
+								   KEEPER_LOOP_PHASE_REFRESH_OTHER_NODES,
+								   phaseStartTime);
+
+			if (!refreshed)
 			{
 				/* we will try again... */
 				log_warn("Failed to update our list of other nodes");
@@ -504,6 +911,9 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 */
 		if (needStateChange)
 		{
+			/* transitions may stop or rewind Postgres, don't hold on to it */
+			pgsql_finish(&(postgres->sqlClient));
+
 			/*
 			 * First, ensure the current state (make sure Postgres is running
 			 * if it should, or Postgres is stopped if it should not run).
@@ -513,7 +923,17 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			 */
 			if (keeper_should_ensure_current_state_before_transition(keeper))
 			{
-				if (!keeper_ensure_current_state(keeper))
+				INSTR_TIME_SET_CURRENT(phaseStartTime);
+
+				(void) systemd_watchdog_extend();
+				bool ensured = keeper_ensure_current_state(keeper);
+				(void) systemd_watchdog_reset();
+
+				keeper_loop_phase_done(keeper,
+									   KEEPER_LOOP_PHASE_ENSURE_CURRENT_STATE,
+									   phaseStartTime);
+
+				if (!ensured)
 				{
 					/*
 					 * We don't take care of the warnedOnCurrentIteration here
@@ -529,17 +949,51 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 				}
 			}
 
-			if (!keeper_fsm_reach_assigned_state(keeper))
+			instr_time transitionTime;
+			NodeState fromState = keeperState->current_role;
+			NodeState toState = keeperState->assigned_role;
+
+			INSTR_TIME_SET_CURRENT(transitionTime);
+
+			/*
+			 * A transition may run pg_basebackup or pg_rewind, and we can't
+			 * ping the systemd watchdog meanwhile.
+			 */
+			(void) systemd_watchdog_extend();
+			bool reached = keeper_fsm_reach_assigned_state(keeper);
+			(void) systemd_watchdog_reset();
+
+			if (!reached)
 			{
 				log_error("Failed to transition to state \"%s\", retrying... ",
 						  NodeStateToString(keeperState->assigned_role));
 
 				transitionFailed = true;
+				++keeper->metrics.transitionFailures;
 			}
+
+			++keeper->metrics.transitionCount;
+			keeper->metrics.transitionDurationMs = elapsed_ms(transitionTime);
+
+			keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_FSM_TRANSITION,
+								   transitionTime);
+			keeper->metrics.transitionFromState = fromState;
+			keeper->metrics.transitionToState = toState;
 		}
 		else if (couldContactMonitor || config->monitorDisabled)
 		{
-			if (!keeper_ensure_current_state(keeper))
+			INSTR_TIME_SET_CURRENT(phaseStartTime);
+
+			/* restarting Postgres may wait for crash recovery */
+			(void) systemd_watchdog_extend();
+			bool ensured = keeper_ensure_current_state(keeper);
+			(void) systemd_watchdog_reset();
+
+			keeper_loop_phase_done(keeper,
+								   KEEPER_LOOP_PHASE_ENSURE_CURRENT_STATE,
+								   phaseStartTime);
+
+			if (!ensured)
 			{
 				warnedOnCurrentIteration = true;
 				log_warn("pg_autoctl failed to ensure current state \"%s\": "
@@ -556,8 +1010,15 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			}
 		}
 
-		/* now is a good time to make sure we're closing our connections */
-		pgsql_finish(&(postgres->sqlClient));
+		/*
+		 * Now is a good time to make sure we're closing our connections. In a
+		 * stable state we keep the local one for the next iteration instead,
+		 * which saves connecting to Postgres again each time.
+		 */
+		if (needStateChange || !postgres->pgIsRunning)
+		{
+			pgsql_finish(&(postgres->sqlClient));
+		}
 
 		CHECK_FOR_FAST_SHUTDOWN;
 
@@ -573,10 +1034,15 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 */
 		if (!config->monitorDisabled || (needStateChange && !transitionFailed))
 		{
+			INSTR_TIME_SET_CURRENT(phaseStartTime);
+
 			if (!keeper_store_state(keeper))
 			{
 				transitionFailed = true;
 			}
+
+			keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_STORE_STATE,
+								   phaseStartTime);
 		}
 
 		/*
@@ -598,6 +1064,12 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			}
 		}
 
+		/* edit the HBA rules we deferred, once per debounce window */
+		if (!keeper_flush_hba_changes(keeper, false))
+		{
+			log_warn("Failed to update HBA rules, we will try again");
+		}
+
 		if ((needStateChange ||
 			 (!config->monitorDisabled &&
 			  monitor_has_received_notifications(monitor))) &&
@@ -655,12 +1127,22 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			warnedOnPreviousIteration = true;
 			warnedOnCurrentIteration = false;
 		}
+
+		/* now update our metrics for this iteration */
+		(void) keeper_loop_done(keeper, loopStartTime);
+
+		(void) keeper_metrics_write_file(keeper);
+		(void) keeper_control_write_file(keeper);
 	}
 
 	/* One last check that we do not have any connections open */
 	pgsql_finish(&(keeper->monitor.pgsql));
 	pgsql_finish(&(monitor->notificationClient));
 
+	(void) file_watch_close(&fileWatch);
+
+	currentNodeStateArrayFree(&(keeper->groupStates));
+
 	if (nodeHasBeenDroppedFromTheMonitor)
 	{
 		/* signal that it's time to shutdown everything */
@@ -672,72 +1154,436 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 
 
 /*
- * keeper_node_active calls the node_active function on the monitor, and when
- * it could contact the monitor it also updates our copy of the list of other
- * nodes currenty in the group (keeper->otherNodes).
+ * keeper_process_file_watch reads the changes reported by our file watch.
+ * When the configuration file changed, we reload it the same way as when we
+ * receive SIGHUP, unless it's one of our own writes: the reload path only
+ * applies what differs from the current configuration anyway. The nodes file
+ * is read at each loop when the monitor is disabled, and we only had to wake
+ * up for that.
+ */
+static void
+keeper_process_file_watch(Keeper *keeper, FileWatch *fileWatch,
+						  int configWatchIndex, int nodesWatchIndex)
+{
+	KeeperConfig *config = &(keeper->config);
+	int changes = file_watch_read_changes(fileWatch);
+
+	if (configWatchIndex >= 0 && (changes & (1 << configWatchIndex)))
+	{
+		ConfigFileStamp stamp = { 0 };
+
+		if (!config_file_stamp(config->pathnames.config, &stamp) ||
+			!config_file_stamp_equals(&stamp, &(keeper->configStamp)))
+		{
+			log_info("Configuration file \"%s\" has changed, reloading",
+					 config->pathnames.config);
+			asked_to_reload = 1;
+		}
+	}
+
+	if (nodesWatchIndex >= 0 && (changes & (1 << nodesWatchIndex)))
+	{
+		log_debug("Nodes file \"%s\" has changed", config->pathnames.nodes);
+	}
+}
+
+
+/*
+ * keeper_node_active_sleep_time returns how long the node-active loop waits
+ * for notifications before its next call to node_active, in milliseconds.
  *
- * keeper_node_active returns true if it could successfully connect to the
- * monitor, and false otherwise. When it returns false, it also checks for
- * network partitions and set the goal state to DEMOTE_TIMEOUT_STATE when
- * needed.
+ * When the current state of every node in our group is its goal state,
+ * nothing happens until a node fails or a user asks for a change, and the
+ * monitor notifies us about those: we call node_active less often, which
+ * reduces the load on the monitor. While a node is transitioning, the
+ * monitor makes progress in the group state machine at each node_active
+ * call, so we call node_active more often, unless the transition has been
+ * stuck for a while, for instance because the transitioning node is down.
+ *
+ * The states of the nodes of our group come from the monitor notifications,
+ * and we fetch them again when we might have missed some notifications.
  */
-static bool
-service_keeper_node_active(Keeper *keeper, bool doInit)
+static int
+keeper_node_active_sleep_time(Keeper *keeper, bool couldContactMonitor)
 {
 	KeeperConfig *config = &(keeper->config);
 	KeeperStateData *keeperState = &(keeper->state);
 
-	MonitorAssignedState assignedState = { 0 };
+	int sleepTimeMs = PG_AUTOCTL_KEEPER_STABLE_SLEEP_TIME_MS;
+	int debugSleepTimeMs = keeper_debug_sleep_time();
 
-	uint64_t now = time(NULL);
+	/* in test environments, soak tests compress days of heartbeats */
+	if (debugSleepTimeMs > 0)
+	{
+		return debugSleepTimeMs;
+	}
 
 	/*
-	 * Report the current state to the monitor and get the assigned state.
+	 * A busy monitor told us when to call again. Add some jitter, so that the
+	 * keepers that got the same answer don't all come back at once.
 	 */
-	if (!keeper_node_active(keeper, doInit, &assignedState))
+	if (keeper->nodeActiveRetryAfterMs > 0)
 	{
-		log_error("Failed to get the goal state from the monitor");
+		int retryAfterMs = keeper->nodeActiveRetryAfterMs;
 
-		/*
-		 * Check whether we're likely to be in a network partition.
-		 * That will cause the assigned_role to become demoted.
-		 */
-		(void) check_for_network_partitions(keeper);
+		keeper->nodeActiveRetryAfterMs = 0;
 
-		return false;
+		return retryAfterMs + keeper_random_time(retryAfterMs / 10);
 	}
 
-	/*
-	 * We could contact the monitor, update our internal state.
-	 */
-	keeperState->last_monitor_contact = now;
-	keeperState->assigned_role = assignedState.state;
-
-	if (keeperState->assigned_role != keeperState->current_role)
+	/* when we fail to contact the monitor, keep checking every second */
+	if (!couldContactMonitor)
 	{
-		log_debug("keeper_node_active: %s ➜ %s",
-				  NodeStateToString(keeperState->current_role),
-				  NodeStateToString(keeperState->assigned_role));
+		return PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
 	}
 
-	/* maybe update our cached list of other nodes */
-	if (keeperState->current_role == DROPPED_STATE &&
+	if (!keeper->groupStatesKnown)
+	{
+		if (!monitor_get_current_state(&(keeper->monitor),
+									   config->formation,
+									   keeperState->current_group,
+									   &(keeper->groupStates)))
+		{
+			/* errors have already been logged */
+			return PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+		}
+
+		keeper->groupStatesKnown = true;
+		keeper->groupStatesChangeTime = time(NULL);
+	}
+
+	bool groupIsStable =
+		keeperState->current_role == keeperState->assigned_role;
+
+	for (int index = 0; groupIsStable && index < keeper->groupStates.count;
+		 index++)
+	{
+		CurrentNodeState *nodeState = &(keeper->groupStates.nodes[index]);
+
+		/* we know better about our own state */
+		if (nodeState->node.nodeId == keeperState->current_node_id)
+		{
+			continue;
+		}
+
+		if (nodeState->reportedState != nodeState->goalState)
+		{
+			groupIsStable = false;
+		}
+	}
+
+	if (!groupIsStable)
+	{
+		uint64_t now = time(NULL);
+
+		if ((now - keeper->groupStatesChangeTime) <
+			PG_AUTOCTL_KEEPER_TRANSITION_PACING_TIMEOUT)
+		{
+			return PG_AUTOCTL_KEEPER_TRANSITION_SLEEP_TIME_MS;
+		}
+
+		return PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+	}
+
+	/* renew our primary lease well before half of it has passed */
+	if (keeper->primaryLeaseHeld &&
+		keeper->primaryLeaseTimeoutMs / 4 < sleepTimeMs)
+	{
+		sleepTimeMs = keeper->primaryLeaseTimeoutMs / 4;
+	}
+
+	/*
+	 * Keepers that started, or reconnected, at the same time would otherwise
+	 * keep calling the monitor at the same time: shorten our sleep by a
+	 * random amount so that our heartbeats drift apart.
+	 */
+	return sleepTimeMs - keeper_random_time(sleepTimeMs / 10);
+}
+
+
+/*
+ * keeper_random_time returns a random number of milliseconds between zero and
+ * the given maximum.
+ */
+static int
+keeper_random_time(int maxMs)
+{
+	static bool seeded = false;
+
+#if PG_MAJORVERSION_NUM >= 15
+	static pg_prng_state prngState;
+#endif
+
+	if (maxMs <= 0)
+	{
+		return 0;
+	}
+
+	if (!seeded)
+	{
+#if PG_MAJORVERSION_NUM < 15
+		pg_srand48(getpid() ^ time(NULL));
+#else
+		pg_prng_seed(&prngState, (uint64) (getpid() ^ time(NULL)));
+#endif
+		seeded = true;
+	}
+
+#if PG_MAJORVERSION_NUM < 15
+	long random = pg_lrand48();
+#else
+	uint32_t random = pg_prng_uint32(&prngState);
+#endif
+
+	return (int) (random % ((uint32_t) maxMs + 1));
+}
+
+
+/*
+ * keeper_debug_sleep_time returns the node-active loop sleep time found in
+ * the environment, in milliseconds, or zero. It's only used when the DEBUG
+ * facilities are available, and the environment is only read once.
+ */
+static int
+keeper_debug_sleep_time(void)
+{
+	static int debugSleepTimeMs = -1;
+
+	if (debugSleepTimeMs >= 0)
+	{
+		return debugSleepTimeMs;
+	}
+
+	debugSleepTimeMs = 0;
+
+	if (env_exists(PG_AUTOCTL_DEBUG) &&
+		env_exists(PG_AUTOCTL_KEEPER_SLEEP_TIME_VAR))
+	{
+		char value[BUFSIZE] = { 0 };
+		int sleepTimeMs = 0;
+
+		if (get_env_copy(PG_AUTOCTL_KEEPER_SLEEP_TIME_VAR,
+						 value, sizeof(value)) &&
+			stringToInt(value, &sleepTimeMs) &&
+			sleepTimeMs > 0)
+		{
+			log_debug("Using environment %s=%d",
+					  PG_AUTOCTL_KEEPER_SLEEP_TIME_VAR, sleepTimeMs);
+			debugSleepTimeMs = sleepTimeMs;
+		}
+	}
+
+	return debugSleepTimeMs;
+}
+
+
+/*
+ * keeper_node_active calls the node_active function on the monitor, and when
+ * it could contact the monitor it also updates our copy of the list of other
+ * nodes currenty in the group (keeper->otherNodes).
+ *
+ * keeper_node_active returns true if it could successfully connect to the
+ * monitor, and false otherwise. When it returns false, it also checks for
+ * network partitions and set the goal state to DEMOTE_TIMEOUT_STATE when
+ * needed.
+ */
+static bool
+service_keeper_node_active(Keeper *keeper, bool doInit)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+
+	MonitorAssignedState assignedState = { 0 };
+
+	NodeAddressArray otherNodes = { 0 };
+	bool otherNodesFetched = false;
+
+	/*
+	 * When we don't have a list of other nodes yet, we know that the monitor
+	 * is going to tell us to fetch it, so ask for it in the same round trip.
+	 * A secondary maintains the replication slots of the other nodes at each
+	 * loop, and needs their current LSN: that's one round trip less too.
+	 */
+	bool prefetchOtherNodes =
+		!config->monitorDisabled &&
+		(keeper->otherNodesGroupVersion == 0 ||
+		 (keeperState->current_role == SECONDARY_STATE &&
+		  keeperState->assigned_role == SECONDARY_STATE));
+
+	uint64_t now = time(NULL);
+
+	instr_time callTime;
+
+	INSTR_TIME_SET_CURRENT(callTime);
+
+	/*
+	 * Keep track of our standby nodes replies at each round, so that we know
+	 * how long ago we last heard from them if we lose the monitor.
+	 */
+	(void) update_secondary_contact(keeper);
+
+	/*
+	 * Keep the monitor connection open from one loop to the next, rather
+	 * than paying for a new connection, and its TLS handshake, every few
+	 * seconds. An idle connection that the monitor closed in the meantime is
+	 * detected when we use it again, see pgsql_open_connection().
+	 */
+	keeper->monitor.pgsql.connectionStatementType =
+		PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	/*
+	 * Report the current state to the monitor and get the assigned state.
+	 */
+	bool couldContactMonitor =
+		keeper_node_active(keeper, doInit, &assignedState,
+						   prefetchOtherNodes ? &otherNodes : NULL,
+						   &otherNodesFetched);
+
+	++keeper->metrics.monitorCallCount;
+	keeper->metrics.monitorRoundTripMs = elapsed_ms(callTime);
+
+	keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_NODE_ACTIVE, callTime);
+
+	/*
+	 * A busy monitor is up and running: keep our connection, and our primary
+	 * lease, and call again when it told us to.
+	 */
+	if (!couldContactMonitor && keeper->monitor.pgsql.retryAfterMs > 0)
+	{
+		++keeper->metrics.monitorCallFailures;
+
+		keeper->nodeActiveRetryAfterMs = keeper->monitor.pgsql.retryAfterMs;
+		keeperState->last_monitor_contact = now;
+
+		log_warn("Monitor is busy, calling node_active again in %d ms",
+				 keeper->nodeActiveRetryAfterMs);
+
+		(void) renew_primary_lease(keeper);
+
+		nodeAddressArrayFree(&otherNodes);
+
+		return false;
+	}
+
+	if (!couldContactMonitor)
+	{
+		++keeper->metrics.monitorCallFailures;
+
+		log_error("Failed to get the goal state from the monitor");
+
+		/* connect again next time, maybe to another monitor node */
+		pgsql_finish(&(keeper->monitor.pgsql));
+
+		/*
+		 * Check whether we're likely to be in a network partition.
+		 * That will cause the assigned_role to become demoted.
+		 */
+		(void) check_for_network_partitions(keeper);
+
+		/* fence ourselves when we can't renew our primary lease anymore */
+		(void) check_primary_lease(keeper);
+
+		nodeAddressArrayFree(&otherNodes);
+
+		return false;
+	}
+
+	/*
+	 * We could contact the monitor, update our internal state.
+	 */
+	keeperState->last_monitor_contact = now;
+	keeperState->assigned_role = assignedState.state;
+
+	strlcpy(keeper->goalTraceId,
+			assignedState.traceId,
+			sizeof(keeper->goalTraceId));
+
+	(void) renew_primary_lease(keeper);
+
+	/* the resources report is only a hint, ignore errors here */
+	(void) keeper_report_resources(keeper);
+
+	if (keeperState->assigned_role != keeperState->current_role)
+	{
+		log_debug("keeper_node_active: %s ➜ %s",
+				  NodeStateToString(keeperState->current_role),
+				  NodeStateToString(keeperState->assigned_role));
+	}
+
+	/* maybe update our cached list of other nodes */
+	if (keeperState->current_role == DROPPED_STATE &&
 		keeperState->current_role == keeperState->assigned_role)
 	{
+		nodeAddressArrayFree(&otherNodes);
 		return true;
 	}
 
 	bool forceCacheInvalidation = false;
 
-	if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
+	/*
+	 * The monitor tells us when the group changed since the version of the
+	 * list of other nodes that we have, skip fetching the list otherwise.
+	 */
+	if (assignedState.otherNodesChanged)
 	{
+		instr_time refreshTime;
+
+		INSTR_TIME_SET_CURRENT(refreshTime);
+
+		/* our list is stale now, don't use it in place of the monitor's */
+		keeper->otherNodesGroupVersion = 0;
+		keeper->otherNodesRefreshTime = 0;
+
+		bool success =
+			otherNodesFetched
+			? keeper_set_other_nodes(keeper, &otherNodes, forceCacheInvalidation)
+			: keeper_refresh_other_nodes(keeper, forceCacheInvalidation);
+
+		keeper_loop_phase_done(keeper, KEEPER_LOOP_PHASE_REFRESH_OTHER_NODES,
+							   refreshTime);
+
+		nodeAddressArrayFree(&otherNodes);
+
+		if (!success)
+		{
+			/*
+			 * We have a new MD5 but failed to update our list, try again next
+			 * round, the monitor might be restarting or something.
+			 */
+			log_error("Failed to update our list of other nodes");
+			keeper->otherNodesGroupVersion = 0;
+			keeper->otherNodesRefreshTime = 0;
+			return false;
+		}
+
+		keeper->otherNodesGroupVersion = assignedState.groupVersion;
+		keeper->otherNodesRefreshTime = now;
+
 		/*
-		 * We have a new MD5 but failed to update our list, try again next
-		 * round, the monitor might be restarting or something.
+		 * A change in the group might mean a change of our upstream node,
+		 * when using cascading replication: re-parent when needed.
 		 */
-		log_error("Failed to update our list of other nodes");
-		return false;
+		if (keeper->state.current_role == SECONDARY_STATE &&
+			keeper->state.assigned_role == SECONDARY_STATE)
+		{
+			if (!keeper_ensure_upstream(keeper))
+			{
+				log_warn("Failed to update our upstream node, "
+						 "see above for details");
+			}
+		}
 	}
+	else if (otherNodesFetched)
+	{
+		/* same group version, refresh the LSN of the other nodes */
+		if (keeper_set_other_nodes(keeper, &otherNodes, forceCacheInvalidation))
+		{
+			keeper->otherNodesRefreshTime = now;
+		}
+	}
+
+	/* we might have fetched the list of other nodes and not needed it */
+	nodeAddressArrayFree(&otherNodes);
 
 	/*
 	 * Also update the groupId and replication slot name in the
@@ -820,10 +1666,8 @@ is_network_healthy(Keeper *keeper)
 {
 	KeeperConfig *config = &(keeper->config);
 	KeeperStateData *keeperState = &(keeper->state);
-	LocalPostgresServer *postgres = &(keeper->postgres);
 	int networkPartitionTimeout = config->network_partition_timeout;
 	uint64_t now = time(NULL);
-	bool hasReplica = false;
 
 	if (keeperState->current_role != PRIMARY_STATE)
 	{
@@ -834,18 +1678,20 @@ is_network_healthy(Keeper *keeper)
 		return true;
 	}
 
-	if (primary_has_replica(postgres, PG_AUTOCTL_REPLICA_USERNAME, &hasReplica) &&
-		hasReplica)
-	{
-		keeperState->last_secondary_contact = now;
-		log_warn("We lost the monitor, but still have a standby: "
-				 "we're not in a network partition, continuing.");
-		return true;
-	}
+	(void) update_secondary_contact(keeper);
 
 	if (!in_network_partition(keeperState, now, networkPartitionTimeout))
 	{
 		/* still had recent contact with monitor and/or secondary */
+		if (keeperState->last_secondary_contact > 0 &&
+			(now - keeperState->last_secondary_contact) <=
+			networkPartitionTimeout)
+		{
+			log_warn("We lost the monitor, but our standby replied %d "
+					 "seconds ago: we're not in a network partition, "
+					 "continuing.",
+					 (int) (now - keeperState->last_secondary_contact));
+		}
 		return true;
 	}
 
@@ -858,6 +1704,48 @@ is_network_healthy(Keeper *keeper)
 }
 
 
+/*
+ * update_secondary_contact sets last_secondary_contact to now when one of our
+ * standby nodes sent us a reply message since the previous call.
+ *
+ * A standby replies at least every wal_receiver_status_interval, and the
+ * reply_time column of pg_stat_replication changes each time. We only
+ * compare the values that we get from Postgres, so we don't depend on the
+ * standby's clock. Before Postgres 12, or when a replica didn't send any
+ * reply yet, we count having a connected replica as a contact, as its
+ * walsender is terminated after wal_sender_timeout without a reply.
+ */
+static void
+update_secondary_contact(Keeper *keeper)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	int64_t replyTime = -1;
+
+	if (keeperState->current_role != PRIMARY_STATE)
+	{
+		keeper->lastReplicaReplyTime = -1;
+		return;
+	}
+
+	if (!primary_get_replica_reply_time(postgres,
+										PG_AUTOCTL_REPLICA_USERNAME,
+										&replyTime))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (replyTime == 0 ||
+		(replyTime > 0 && replyTime != keeper->lastReplicaReplyTime))
+	{
+		keeperState->last_secondary_contact = time(NULL);
+	}
+
+	keeper->lastReplicaReplyTime = replyTime;
+}
+
+
 /*
  * in_network_partition determines if we're in a network partition by applying
  * the configured network_partition_timeout to current known values. Updating
@@ -875,3 +1763,279 @@ in_network_partition(KeeperStateData *keeperState, uint64_t now,
 		   networkPartitionTimeout < monitor_contact_lag &&
 		   networkPartitionTimeout < secondary_contact_lag;
 }
+
+
+/*
+ * role_holds_primary_lease returns true when a node in the given role takes
+ * writes while the monitor could fail over to one of its standby nodes.
+ */
+static bool
+role_holds_primary_lease(NodeState role)
+{
+	return role == PRIMARY_STATE ||
+		   role == WAIT_PRIMARY_STATE ||
+		   role == JOIN_PRIMARY_STATE ||
+		   role == APPLY_SETTINGS_STATE;
+}
+
+
+/*
+ * renew_primary_lease is called after each successful node_active call. When
+ * timeout.primary_lease_timeout is set and we are a primary node, we renew
+ * our lease on the monitor, and we promise to stop taking writes once half
+ * of the lease has passed without another renewal, see check_primary_lease.
+ *
+ * The monitor only trusts a lease that was renewed after the last report of
+ * the node, so when we don't renew our lease after a node_active call, or
+ * when the monitor refuses to renew it, we are released from our promise.
+ * When the renewal fails we can't know whether the monitor registered it,
+ * and we keep our promise.
+ */
+static void
+renew_primary_lease(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	int leaseTimeoutMs = config->primary_lease_timeout * 1000;
+	bool granted = false;
+
+	instr_time renewTime;
+
+	if (config->monitorDisabled ||
+		leaseTimeoutMs <= 0 ||
+		!role_holds_primary_lease(keeperState->current_role))
+	{
+		keeper->primaryLeaseHeld = false;
+
+		if (!role_holds_primary_lease(keeperState->current_role))
+		{
+			keeper->primaryLeaseFenced = false;
+		}
+		else if (keeper->primaryLeaseFenced)
+		{
+			log_info("The primary lease is now disabled, resuming writes");
+
+			if (pgsql_set_default_transaction_mode_read_write(
+					&(postgres->sqlClient)))
+			{
+				keeper->primaryLeaseFenced = false;
+			}
+		}
+
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(renewTime);
+
+	if (!monitor_renew_primary_lease(&(keeper->monitor),
+									 keeperState->current_node_id,
+									 leaseTimeoutMs,
+									 &granted))
+	{
+		log_warn("Failed to renew our primary lease on the monitor");
+
+		if (!keeper->primaryLeaseHeld)
+		{
+			keeper->primaryLeaseHeld = true;
+			keeper->primaryLeaseTimeoutMs = leaseTimeoutMs;
+			keeper->primaryLeaseRenewTime = renewTime;
+		}
+
+		return;
+	}
+
+	if (!granted)
+	{
+		log_info("The monitor did not renew our primary lease, "
+				 "current goal state is %s",
+				 NodeStateToString(keeperState->assigned_role));
+
+		keeper->primaryLeaseHeld = false;
+		return;
+	}
+
+	keeper->primaryLeaseHeld = true;
+	keeper->primaryLeaseTimeoutMs = leaseTimeoutMs;
+	keeper->primaryLeaseRenewTime = renewTime;
+
+	/*
+	 * The read-only setting survives restarts of pg_autoctl and Postgres, so
+	 * at our first renewal we check whether a previous pg_autoctl run fenced
+	 * this primary node.
+	 */
+	if (!keeper->primaryLeaseChecked)
+	{
+		bool readOnly = false;
+
+		if (pgsql_get_default_transaction_read_only(&(postgres->sqlClient),
+													&readOnly))
+		{
+			keeper->primaryLeaseChecked = true;
+			keeper->primaryLeaseFenced = readOnly;
+		}
+	}
+
+	if (keeper->primaryLeaseFenced)
+	{
+		log_info("Renewed our primary lease on the monitor, resuming writes");
+
+		if (pgsql_set_default_transaction_mode_read_write(&(postgres->sqlClient)))
+		{
+			keeper->primaryLeaseFenced = false;
+		}
+	}
+}
+
+
+/*
+ * check_primary_lease is called when we failed to contact the monitor. When
+ * half of our primary lease has passed since we last renewed it, we make the
+ * local Postgres instance read-only, leaving the other half of the lease for
+ * the keeper main loop to get here, and terminate the client sessions that
+ * are in a transaction, which would otherwise keep writing.
+ *
+ * This only limits the writes that a partitioned primary accepts: the monitor
+ * still waits for the whole of pgautofailover.primary_demote_timeout before
+ * promoting a standby node.
+ */
+static void
+check_primary_lease(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (!keeper->primaryLeaseHeld || keeper->primaryLeaseFenced)
+	{
+		return;
+	}
+
+	double leaseAgeMs = elapsed_ms(keeper->primaryLeaseRenewTime);
+
+	if (leaseAgeMs < keeper->primaryLeaseTimeoutMs / 2)
+	{
+		return;
+	}
+
+	log_warn("Failed to renew our primary lease on the monitor "
+			 "in the last %ds, making Postgres read-only",
+			 (int) (leaseAgeMs / 1000));
+
+	if (!pgsql_set_default_transaction_mode_read_only(&(postgres->sqlClient)))
+	{
+		log_error("Failed to fence this primary node, "
+				  "see above for details");
+		return;
+	}
+
+	keeper->primaryLeaseFenced = true;
+	keeper->primaryLeaseChecked = true;
+
+	int count = 0;
+
+	if (pgsql_signal_sessions_in_transaction(&(postgres->sqlClient),
+											 true, &count) &&
+		count > 0)
+	{
+		log_warn("Terminated %d sessions still in a transaction", count);
+	}
+}
+
+
+/*
+ * elapsed_ms returns how many milliseconds have passed since startTime.
+ */
+static double
+elapsed_ms(instr_time startTime)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	return INSTR_TIME_GET_MILLISEC(duration);
+}
+
+
+/*
+ * keeper_loop_phase_done adds the time spent since startTime to the given
+ * phase of the current keeper main loop iteration.
+ */
+static void
+keeper_loop_phase_done(Keeper *keeper, KeeperLoopPhase phase,
+					   instr_time startTime)
+{
+	keeper->metrics.phaseDone[phase] = true;
+	keeper->metrics.phaseDurationMs[phase] += elapsed_ms(startTime);
+}
+
+
+/*
+ * keeper_loop_done updates the keeper metrics at the end of a main loop
+ * iteration. When the iteration took longer than timeout.slow_loop_threshold
+ * we log where its time went, with one key=value pair per phase, and with
+ * "other" being the time spent outside of the timed phases.
+ */
+static void
+keeper_loop_done(Keeper *keeper, instr_time loopStartTime)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperMetrics *metrics = &(keeper->metrics);
+
+	double loopDurationMs = elapsed_ms(loopStartTime);
+	double phasesDurationMs = 0;
+
+	++metrics->loopCount;
+	metrics->loopDurationMs = loopDurationMs;
+	metrics->loopDurationSumMs += loopDurationMs;
+
+	(void) keeper_histogram_record(&(metrics->loopHistogram), loopDurationMs);
+
+	for (int phase = 0; phase < KEEPER_LOOP_PHASE_COUNT; phase++)
+	{
+		if (metrics->phaseDone[phase])
+		{
+			(void) keeper_histogram_record(&(metrics->phaseHistograms[phase]),
+										   metrics->phaseDurationMs[phase]);
+
+			phasesDurationMs += metrics->phaseDurationMs[phase];
+		}
+	}
+
+	if (config->slow_loop_threshold <= 0 ||
+		loopDurationMs < config->slow_loop_threshold)
+	{
+		return;
+	}
+
+	++metrics->slowLoopCount;
+
+	PQExpBuffer phases = createPQExpBuffer();
+
+	if (phases == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return;
+	}
+
+	for (int phase = 0; phase < KEEPER_LOOP_PHASE_COUNT; phase++)
+	{
+		if (metrics->phaseDone[phase])
+		{
+			appendPQExpBuffer(phases, " %s=%.1fms",
+							  KeeperLoopPhaseToString(phase),
+							  metrics->phaseDurationMs[phase]);
+		}
+	}
+
+	log_warn("Slow keeper main loop iteration: duration=%.1fms "
+			 "threshold=%dms state=%s goal=%s%s other=%.1fms",
+			 loopDurationMs,
+			 config->slow_loop_threshold,
+			 NodeStateToString(keeper->state.current_role),
+			 NodeStateToString(keeper->state.assigned_role),
+			 PQExpBufferBroken(phases) ? "" : phases->data,
+			 loopDurationMs - phasesDurationMs);
+
+	destroyPQExpBuffer(phases);
+}
@@ -18,8 +18,12 @@
 
 bool start_keeper(Keeper *keeper);
 bool service_keeper_start(void *context, pid_t *pid);
+bool service_keeper_is_ready(void *context);
+bool service_keeper_node_is_ready(KeeperConfig *config);
 void service_keeper_runprogram(Keeper *keeper);
+void service_keeper_reexec(Keeper *keeper);
 bool service_keeper_node_active_init(Keeper *keeper);
+void service_keeper_isolate(KeeperConfig *config);
 bool keeper_node_active_loop(Keeper *keeper, pid_t start_pid);
 
 
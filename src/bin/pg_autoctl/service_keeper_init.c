@@ -31,6 +31,7 @@
 #include "signals.h"
 #include "string_utils.h"
 #include "supervisor.h"
+#include "trace.h"
 
 
 /*
@@ -108,17 +109,24 @@ service_keeper_init_start(void *context, pid_t *pid)
 			 * then quit, avoiding to call the atexit() semaphore clean-up
 			 * function.
 			 */
-			IntString semIdString = intToString(log_semaphore.semId);
-
 			const char *serviceName = createAndRun ?
 									  "pg_autoctl: node active" :
 									  "pg_autoctl: node installer";
 
 			(void) set_ps_title(serviceName);
 
-			setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+			(void) semaphore_setenv(&log_semaphore);
+
+			TraceSpan span = { 0 };
+
+			trace_span_start(&span, "pg_autoctl create", NULL);
+			bool initialized = keeper_pg_init_and_register(keeper);
+			trace_span_end(&span, initialized);
+
+			/* pg_autoctl create --timing */
+			(void) trace_timing_report();
 
-			if (!keeper_pg_init_and_register(keeper))
+			if (!initialized)
 			{
 				/* errors have already been logged */
 				exit(EXIT_CODE_INTERNAL_ERROR);
@@ -0,0 +1,1188 @@
+/*
+ * src/bin/pg_autoctl/service_metrics.c
+ *   Serve the keeper metrics over HTTP, in the Prometheus text format.
+ *
+ * The node-active process writes its metrics to a file next to its state file
+ * at the end of each iteration of its main loop, and this service answers
+ * HTTP GET /metrics requests with the contents of that file. That way a
+ * scraper never waits for the keeper main loop, and never forks a pg_autoctl
+ * command, connects to the monitor, or connects to Postgres.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "nodestate_utils.h"
+#include "parsing.h"
+#include "service_metrics.h"
+#include "signals.h"
+#include "state.h"
+#include "string_utils.h"
+
+#include "runprogram.h"
+
+#define METRICS_REQUEST_MAXLENGTH 4096
+#define METRICS_LISTEN_BACKLOG 16
+#define METRICS_POLL_TIMEOUT_MS 1000
+#define METRICS_CLIENT_TIMEOUT_MS 1000
+
+static bool metrics_read_request(int clientFd, char *request, int size);
+static void appendStandbyMetrics(PQExpBuffer buffer,
+								 StandbyReplicationArrays *report);
+static void appendHistogramMetrics(PQExpBuffer buffer,
+								   const char *name,
+								   const char *labels,
+								   KeeperDurationHistogram *histogram);
+
+/* upper bounds of the histogram buckets, see KeeperDurationHistogram */
+const double KeeperHistogramBucketsMs[KEEPER_HISTOGRAM_BUCKETS] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000
+};
+
+
+/*
+ * service_metrics_parse_listen parses the metrics.listen setting.
+ */
+bool
+service_metrics_parse_listen(const char *listen, MetricsListenAddress *address)
+{
+	const char *portStr = NULL;
+	int hostLength = 0;
+
+	if (listen == NULL || IS_EMPTY_STRING_BUFFER(listen))
+	{
+		log_error("Failed to parse metrics.listen: value is empty");
+		return false;
+	}
+
+	if (listen[0] == '/')
+	{
+		address->isUnixSocket = true;
+
+		if (strlen(listen) >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+		{
+			log_error("Failed to parse metrics.listen \"%s\": Unix socket "
+					  "pathname is longer than %zu bytes",
+					  listen,
+					  sizeof(((struct sockaddr_un *) 0)->sun_path) - 1);
+			return false;
+		}
+
+		strlcpy(address->socketPath, listen, MAXPGPATH);
+
+		return true;
+	}
+
+	if (listen[0] == '[')
+	{
+		const char *closingBracket = strchr(listen, ']');
+
+		if (closingBracket == NULL || closingBracket[1] != ':')
+		{
+			log_error("Failed to parse metrics.listen \"%s\": expected "
+					  "[address]:port", listen);
+			return false;
+		}
+
+		hostLength = closingBracket - listen - 1;
+		portStr = closingBracket + 2;
+
+		/* skip the opening bracket */
+		++listen;
+	}
+	else
+	{
+		const char *colon = strrchr(listen, ':');
+
+		if (colon == NULL)
+		{
+			log_error("Failed to parse metrics.listen \"%s\": expected "
+					  "host:port or an absolute Unix socket pathname",
+					  listen);
+			return false;
+		}
+
+		hostLength = colon - listen;
+		portStr = colon + 1;
+	}
+
+	if (hostLength >= _POSIX_HOST_NAME_MAX)
+	{
+		log_error("Failed to parse metrics.listen \"%s\": host name is "
+				  "longer than %d bytes",
+				  listen, _POSIX_HOST_NAME_MAX - 1);
+		return false;
+	}
+
+	address->isUnixSocket = false;
+	strlcpy(address->host, listen, hostLength + 1);
+
+	if (!stringToInt(portStr, &(address->port)) ||
+		address->port <= 0 || address->port > 65535)
+	{
+		log_error("Failed to parse metrics.listen \"%s\": "
+				  "invalid port number \"%s\"",
+				  listen, portStr);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * service_metrics_start starts a subprocess that serves the keeper metrics, or
+ * the monitor metrics when running on a monitor node.
+ */
+bool
+service_metrics_start(void *context, pid_t *pid)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the metrics process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_metrics_runprogram();
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_metrics_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			log_debug("pg_autoctl metrics process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_metrics_runprogram runs the metrics service:
+ *
+ *   $ pg_autoctl do service metrics --pgdata ...
+ */
+void
+service_metrics_runprogram(void)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/*
+	 * See service_keeper_runprogram() about using --pgdata here. On a monitor
+	 * node the metrics service is started from either pg_autoctl create
+	 * monitor --run, which sets monitorOptions, or from pg_autoctl run, which
+	 * sets keeperOptions.
+	 */
+	char *pgdata =
+		IS_EMPTY_STRING_BUFFER(monitorOptions.pgSetup.pgdata)
+		? keeperOptions.pgSetup.pgdata
+		: monitorOptions.pgSetup.pgdata;
+
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "metrics";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_metrics_loop listens on metrics.listen and serves the contents of
+ * the keeper metrics file to each client, one client at a time. A scrape only
+ * costs reading a small file, and clients that are too slow to send their
+ * request are disconnected after METRICS_CLIENT_TIMEOUT_MS.
+ *
+ * Changes to metrics.listen are taken into account at the next restart of the
+ * service.
+ */
+bool
+service_metrics_loop(KeeperConfig *config)
+{
+	MetricsListenAddress address = { 0 };
+	char metricsFile[MAXPGPATH] = { 0 };
+
+	if (!service_metrics_parse_listen(config->metricsListen, &address))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_METRICS_FILENAME,
+						   metricsFile);
+
+	int listenFd = metrics_http_listen(&address);
+
+	if (listenFd < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Serving the pg_autoctl keeper metrics on \"%s\"",
+			 config->metricsListen);
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		struct pollfd pfd = { .fd = listenFd, .events = POLLIN };
+
+		int ready = poll(&pfd, 1, METRICS_POLL_TIMEOUT_MS);
+
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to poll the metrics socket: %m");
+			break;
+		}
+
+		int clientFd = -1;
+		char *contents = NULL;
+		long size = 0;
+
+		if (ready == 0 ||
+			!(pfd.revents & POLLIN) ||
+			!metrics_http_accept(listenFd, &clientFd))
+		{
+			continue;
+		}
+
+		if (read_file_if_exists(metricsFile, &contents, &size))
+		{
+			(void) metrics_http_send_response(clientFd, "200 OK",
+											  contents, size);
+			free(contents);
+		}
+		else
+		{
+			char *body = "The pg_autoctl keeper has not written metrics yet\n";
+
+			(void) metrics_http_send_response(clientFd,
+											  "503 Service Unavailable",
+											  body, strlen(body));
+		}
+
+		close(clientFd);
+	}
+
+	(void) metrics_http_close(listenFd, &address);
+
+	return true;
+}
+
+
+/*
+ * metrics_http_listen opens the metrics listening socket, and returns its file
+ * descriptor, or -1 on error.
+ */
+int
+metrics_http_listen(MetricsListenAddress *address)
+{
+	int listenFd = -1;
+
+	if (address->isUnixSocket)
+	{
+		struct sockaddr_un addr = { 0 };
+
+		addr.sun_family = AF_UNIX;
+		strlcpy(addr.sun_path, address->socketPath, sizeof(addr.sun_path));
+
+		/* remove a socket left behind by a previous run */
+		if (file_exists(address->socketPath) &&
+			!unlink_file(address->socketPath))
+		{
+			/* errors have already been logged */
+			return -1;
+		}
+
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (listenFd < 0)
+		{
+			log_error("Failed to create a Unix socket: %m");
+			return -1;
+		}
+
+		if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		{
+			log_error("Failed to bind Unix socket \"%s\": %m",
+					  address->socketPath);
+			close(listenFd);
+			return -1;
+		}
+	}
+	else
+	{
+		struct addrinfo hints = { 0 };
+		struct addrinfo *addresses = NULL;
+		char service[NAMEDATALEN] = { 0 };
+
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		sformat(service, sizeof(service), "%d", address->port);
+
+		int error = getaddrinfo(IS_EMPTY_STRING_BUFFER(address->host)
+								? NULL : address->host,
+								service, &hints, &addresses);
+
+		if (error != 0)
+		{
+			log_error("Failed to resolve metrics listen address \"%s\": %s",
+					  address->host, gai_strerror(error));
+			return -1;
+		}
+
+		for (struct addrinfo *ai = addresses; ai != NULL; ai = ai->ai_next)
+		{
+			int on = 1;
+
+			listenFd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+			if (listenFd < 0)
+			{
+				continue;
+			}
+
+			(void) setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR,
+							  &on, sizeof(on));
+
+			if (bind(listenFd, ai->ai_addr, ai->ai_addrlen) == 0)
+			{
+				break;
+			}
+
+			log_debug("Failed to bind metrics socket: %m");
+			close(listenFd);
+			listenFd = -1;
+		}
+
+		freeaddrinfo(addresses);
+
+		if (listenFd < 0)
+		{
+			log_error("Failed to bind the metrics socket to \"%s\" port %d",
+					  address->host, address->port);
+			return -1;
+		}
+	}
+
+	if (listen(listenFd, METRICS_LISTEN_BACKLOG) != 0)
+	{
+		log_error("Failed to listen on the metrics socket: %m");
+		close(listenFd);
+		return -1;
+	}
+
+	return listenFd;
+}
+
+
+/*
+ * metrics_http_close closes the metrics listening socket, and removes the Unix
+ * socket file when we created one.
+ */
+void
+metrics_http_close(int listenFd, MetricsListenAddress *address)
+{
+	close(listenFd);
+
+	if (address->isUnixSocket)
+	{
+		(void) unlink_file(address->socketPath);
+	}
+}
+
+
+/*
+ * metrics_http_accept accepts a client connection and reads its HTTP request.
+ * Only GET /metrics is supported: other requests get a 404 answer. When the
+ * function returns true, the caller sends the metrics to clientFd with
+ * metrics_http_send_response() and then closes it.
+ */
+bool
+metrics_http_accept(int listenFd, int *clientFd)
+{
+	char request[METRICS_REQUEST_MAXLENGTH] = { 0 };
+
+	int fd = accept(listenFd, NULL, NULL);
+
+	if (fd < 0)
+	{
+		if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+		{
+			log_warn("Failed to accept a metrics client connection: %m");
+		}
+		return false;
+	}
+
+	if (!metrics_read_request(fd, request, sizeof(request)))
+	{
+		close(fd);
+		return false;
+	}
+
+	if (strncmp(request, "GET ", 4) != 0 ||
+		(strncmp(request + 4, "/metrics ", 9) != 0 &&
+		 strncmp(request + 4, "/metrics?", 9) != 0))
+	{
+		char *body = "Not Found\n";
+
+		(void) metrics_http_send_response(fd, "404 Not Found",
+										  body, strlen(body));
+		close(fd);
+		return false;
+	}
+
+	*clientFd = fd;
+
+	return true;
+}
+
+
+/*
+ * metrics_read_request reads the client request headers, waiting at most
+ * METRICS_CLIENT_TIMEOUT_MS in total. We only need the request line.
+ */
+static bool
+metrics_read_request(int clientFd, char *request, int size)
+{
+	int length = 0;
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	while (length < size - 1 && strstr(request, "\r\n") == NULL)
+	{
+		instr_time duration;
+		struct pollfd pfd = { .fd = clientFd, .events = POLLIN };
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		int elapsedMs = (int) INSTR_TIME_GET_MILLISEC(duration);
+
+		if (elapsedMs >= METRICS_CLIENT_TIMEOUT_MS)
+		{
+			log_debug("Metrics client took too long to send its request");
+			return false;
+		}
+
+		int ready = poll(&pfd, 1, METRICS_CLIENT_TIMEOUT_MS - elapsedMs);
+
+		if (ready < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ready <= 0)
+		{
+			log_debug("Metrics client took too long to send its request");
+			return false;
+		}
+
+		ssize_t bytes = recv(clientFd, request + length, size - 1 - length, 0);
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		length += bytes;
+		request[length] = '\0';
+	}
+
+	return true;
+}
+
+
+/*
+ * metrics_http_send_response writes an HTTP/1.0 response to the client.
+ */
+void
+metrics_http_send_response(int clientFd, const char *status,
+					  const char *body, long bodySize)
+{
+	char header[BUFSIZE] = { 0 };
+
+	int headerSize =
+		sformat(header, sizeof(header),
+				"HTTP/1.0 %s\r\n"
+				"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+				"Content-Length: %ld\r\n"
+				"Connection: close\r\n"
+				"\r\n",
+				status, bodySize);
+
+	const char *buffers[2] = { header, body };
+	long sizes[2] = { headerSize, bodySize };
+
+	for (int i = 0; i < 2; i++)
+	{
+		long written = 0;
+
+		while (written < sizes[i])
+		{
+			ssize_t bytes = send(clientFd, buffers[i] + written,
+								 sizes[i] - written, MSG_NOSIGNAL);
+
+			if (bytes < 0 && errno == EINTR)
+			{
+				continue;
+			}
+
+			if (bytes <= 0)
+			{
+				log_debug("Failed to send metrics to client: %m");
+				return;
+			}
+
+			written += bytes;
+		}
+	}
+}
+
+
+/*
+ * keeper_metrics_write_file writes the keeper metrics in the Prometheus text
+ * exposition format to a file next to the keeper state file, for the metrics
+ * service to serve. The file is replaced atomically.
+ */
+bool
+keeper_metrics_write_file(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	KeeperMetrics *metrics = &(keeper->metrics);
+
+	char metricsFile[MAXPGPATH] = { 0 };
+	char tempFile[MAXPGPATH] = { 0 };
+
+	if (IS_EMPTY_STRING_BUFFER(config->metricsListen))
+	{
+		return true;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_METRICS_FILENAME,
+						   metricsFile);
+	sformat(tempFile, sizeof(tempFile), "%s.new", metricsFile);
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_node_info pg_autoctl node "
+						 "identification and FSM states.\n"
+						 "# TYPE pg_autoctl_node_info gauge\n"
+						 "pg_autoctl_node_info{formation=\"");
+	appendPrometheusLabelValue(buffer, config->formation);
+	appendPQExpBuffer(buffer,
+					  "\",group=\"%d\",node_id=\"%d\",name=\"",
+					  keeperState->current_group,
+					  keeperState->current_node_id);
+	appendPrometheusLabelValue(buffer, config->name);
+	appendPQExpBuffer(buffer,
+					  "\",current_state=\"%s\",assigned_state=\"%s\"} 1\n",
+					  NodeStateToString(keeperState->current_role),
+					  NodeStateToString(keeperState->assigned_role));
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_keeper_last_update_timestamp_seconds "
+					  "When the keeper last updated these metrics.\n"
+					  "# TYPE pg_autoctl_keeper_last_update_timestamp_seconds "
+					  "gauge\n"
+					  "pg_autoctl_keeper_last_update_timestamp_seconds "
+					  "%" PRIu64 "\n",
+					  (uint64_t) time(NULL));
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_keeper_loops_total "
+					  "Iterations of the keeper main loop.\n"
+					  "# TYPE pg_autoctl_keeper_loops_total counter\n"
+					  "pg_autoctl_keeper_loops_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_keeper_loop_duration_seconds "
+					  "Duration of the last keeper main loop iteration, "
+					  "not counting its sleep time.\n"
+					  "# TYPE pg_autoctl_keeper_loop_duration_seconds gauge\n"
+					  "pg_autoctl_keeper_loop_duration_seconds %.6f\n"
+					  "# HELP pg_autoctl_keeper_loop_duration_seconds_total "
+					  "Time spent in keeper main loop iterations.\n"
+					  "# TYPE pg_autoctl_keeper_loop_duration_seconds_total "
+					  "counter\n"
+					  "pg_autoctl_keeper_loop_duration_seconds_total %.6f\n",
+					  metrics->loopCount,
+					  metrics->loopDurationMs / 1000.0,
+					  metrics->loopDurationSumMs / 1000.0);
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_keeper_loop_seconds "
+						 "Duration of the keeper main loop iterations, "
+						 "not counting their sleep time.\n"
+						 "# TYPE pg_autoctl_keeper_loop_seconds histogram\n");
+	appendHistogramMetrics(buffer,
+						   "pg_autoctl_keeper_loop_seconds", "",
+						   &(metrics->loopHistogram));
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_keeper_phase_seconds "
+						 "Duration of each phase of the keeper main loop "
+						 "iterations.\n"
+						 "# TYPE pg_autoctl_keeper_phase_seconds histogram\n");
+
+	for (int phase = 0; phase < KEEPER_LOOP_PHASE_COUNT; phase++)
+	{
+		char labels[BUFSIZE] = { 0 };
+
+		sformat(labels, sizeof(labels), "phase=\"%s\",",
+				KeeperLoopPhaseToString(phase));
+
+		appendHistogramMetrics(buffer,
+							   "pg_autoctl_keeper_phase_seconds", labels,
+							   &(metrics->phaseHistograms[phase]));
+	}
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_keeper_slow_loops_total "
+					  "Keeper main loop iterations slower than "
+					  "timeout.slow_loop_threshold.\n"
+					  "# TYPE pg_autoctl_keeper_slow_loops_total counter\n"
+					  "pg_autoctl_keeper_slow_loops_total %" PRIu64 "\n",
+					  metrics->slowLoopCount);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_calls_total "
+					  "Calls to node_active on the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_calls_total counter\n"
+					  "pg_autoctl_monitor_calls_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_monitor_call_failures_total "
+					  "Failed calls to node_active on the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_call_failures_total counter\n"
+					  "pg_autoctl_monitor_call_failures_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_monitor_round_trip_seconds "
+					  "Duration of the last call to node_active.\n"
+					  "# TYPE pg_autoctl_monitor_round_trip_seconds gauge\n"
+					  "pg_autoctl_monitor_round_trip_seconds %.6f\n",
+					  metrics->monitorCallCount,
+					  metrics->monitorCallFailures,
+					  metrics->monitorRoundTripMs / 1000.0);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_fsm_transitions_total "
+					  "FSM transitions attempted by the keeper.\n"
+					  "# TYPE pg_autoctl_fsm_transitions_total counter\n"
+					  "pg_autoctl_fsm_transitions_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_fsm_transition_failures_total "
+					  "FSM transitions that failed and are retried.\n"
+					  "# TYPE pg_autoctl_fsm_transition_failures_total counter\n"
+					  "pg_autoctl_fsm_transition_failures_total %" PRIu64 "\n",
+					  metrics->transitionCount,
+					  metrics->transitionFailures);
+
+	if (metrics->transitionCount > 0)
+	{
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_fsm_transition_duration_seconds "
+						  "Duration of the last FSM transition.\n"
+						  "# TYPE pg_autoctl_fsm_transition_duration_seconds "
+						  "gauge\n"
+						  "pg_autoctl_fsm_transition_duration_seconds"
+						  "{from=\"%s\",to=\"%s\"} %.6f\n",
+						  NodeStateToString(metrics->transitionFromState),
+						  NodeStateToString(metrics->transitionToState),
+						  metrics->transitionDurationMs / 1000.0);
+	}
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_postgres_running "
+					  "Whether the local Postgres server is running.\n"
+					  "# TYPE pg_autoctl_postgres_running gauge\n"
+					  "pg_autoctl_postgres_running %d\n"
+					  "# HELP pg_autoctl_postgres_start_retries "
+					  "Current number of attempts at starting Postgres.\n"
+					  "# TYPE pg_autoctl_postgres_start_retries gauge\n"
+					  "pg_autoctl_postgres_start_retries %d\n",
+					  postgres->pgIsRunning ? 1 : 0,
+					  postgres->pgStartRetries);
+
+	if (keeper->resourcesReportTime > 0)
+	{
+		NodeResources *resources = &(keeper->resources);
+
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_host_cpu_count "
+						  "Number of CPUs of the host.\n"
+						  "# TYPE pg_autoctl_host_cpu_count gauge\n"
+						  "pg_autoctl_host_cpu_count %d\n"
+						  "# HELP pg_autoctl_host_cpu_usage_percent "
+						  "Percentage of time the CPUs of the host are busy.\n"
+						  "# TYPE pg_autoctl_host_cpu_usage_percent gauge\n"
+						  "pg_autoctl_host_cpu_usage_percent %.2f\n"
+						  "# HELP pg_autoctl_host_load_average "
+						  "Load average of the host over the last minute.\n"
+						  "# TYPE pg_autoctl_host_load_average gauge\n"
+						  "pg_autoctl_host_load_average %.2f\n",
+						  resources->ncpu,
+						  resources->cpuUsage,
+						  resources->loadAverage);
+
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_host_memory_total_bytes "
+						  "Memory of the host, or of its cgroup.\n"
+						  "# TYPE pg_autoctl_host_memory_total_bytes gauge\n"
+						  "pg_autoctl_host_memory_total_bytes %" PRIu64 "\n"
+						  "# HELP pg_autoctl_host_memory_available_bytes "
+						  "Memory available on the host.\n"
+						  "# TYPE pg_autoctl_host_memory_available_bytes "
+						  "gauge\n"
+						  "pg_autoctl_host_memory_available_bytes %" PRIu64 "\n",
+						  resources->totalram,
+						  resources->availableram);
+
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_host_disk_read_rate_bytes "
+						  "Bytes read from disk per second on the host.\n"
+						  "# TYPE pg_autoctl_host_disk_read_rate_bytes gauge\n"
+						  "pg_autoctl_host_disk_read_rate_bytes %" PRId64 "\n"
+						  "# HELP pg_autoctl_host_disk_write_rate_bytes "
+						  "Bytes written to disk per second on the host.\n"
+						  "# TYPE pg_autoctl_host_disk_write_rate_bytes gauge\n"
+						  "pg_autoctl_host_disk_write_rate_bytes %" PRId64 "\n"
+						  "# HELP pg_autoctl_postgres_wal_rate_bytes "
+						  "WAL bytes written or received per second.\n"
+						  "# TYPE pg_autoctl_postgres_wal_rate_bytes gauge\n"
+						  "pg_autoctl_postgres_wal_rate_bytes %" PRId64 "\n",
+						  resources->diskReadRate,
+						  resources->diskWriteRate,
+						  resources->walRate);
+	}
+
+	/* on a standby, currentLSN is the receive LSN */
+	if (keeperState->current_role != PRIMARY_STATE &&
+		!IS_EMPTY_STRING_BUFFER(postgres->replayLSN))
+	{
+		uint64_t receiveLSN = 0;
+		uint64_t replayLSN = 0;
+
+		if (parseLSN(postgres->currentLSN, &receiveLSN) &&
+			parseLSN(postgres->replayLSN, &replayLSN))
+		{
+			appendPQExpBuffer(buffer,
+							  "# HELP pg_autoctl_replication_replay_lag_bytes "
+							  "WAL received but not replayed yet.\n"
+							  "# TYPE pg_autoctl_replication_replay_lag_bytes "
+							  "gauge\n"
+							  "pg_autoctl_replication_replay_lag_bytes "
+							  "%" PRIu64 "\n",
+							  receiveLSN > replayLSN
+							  ? receiveLSN - replayLSN
+							  : 0);
+		}
+
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_replication_apply_rate_bytes "
+						  "WAL replay rate in bytes per second.\n"
+						  "# TYPE pg_autoctl_replication_apply_rate_bytes "
+						  "gauge\n"
+						  "pg_autoctl_replication_apply_rate_bytes "
+						  "%" PRId64 "\n",
+						  postgres->applyRate);
+	}
+
+	if (keeperState->current_role == PRIMARY_STATE)
+	{
+		(void) appendStandbyMetrics(buffer, &(keeper->replicationReport));
+	}
+
+	if (keeperState->current_role == PRIMARY_STATE ||
+		keeperState->current_role == WAIT_PRIMARY_STATE)
+	{
+		SyncRepStatus *syncRep = &(keeper->syncRepStatus);
+
+		appendPQExpBuffer(buffer,
+						  "# HELP pg_autoctl_sync_rep_waiting_backends "
+						  "Backends waiting for a synchronous standby.\n"
+						  "# TYPE pg_autoctl_sync_rep_waiting_backends "
+						  "gauge\n"
+						  "pg_autoctl_sync_rep_waiting_backends %d\n"
+						  "# HELP pg_autoctl_sync_rep_oldest_wait_seconds "
+						  "How long the oldest SyncRep waiter has waited.\n"
+						  "# TYPE pg_autoctl_sync_rep_oldest_wait_seconds "
+						  "gauge\n"
+						  "pg_autoctl_sync_rep_oldest_wait_seconds %.3f\n",
+						  syncRep->waiting,
+						  (double) syncRep->oldestWaitMs / 1000.0);
+	}
+
+	if (PQExpBufferBroken(buffer))
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(buffer);
+		return false;
+	}
+
+	if (!write_file(buffer->data, buffer->len, tempFile))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(buffer);
+		return false;
+	}
+
+	destroyPQExpBuffer(buffer);
+
+	if (rename(tempFile, metricsFile) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tempFile, metricsFile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * appendStandbyMetrics appends the write and flush lag of each standby node
+ * from the last pg_stat_replication report sent to the monitor, and the WAL
+ * retained by their replication slot. The samples of a metric must all be
+ * grouped together, so we walk the arrays once per metric.
+ */
+static void
+appendStandbyMetrics(PQExpBuffer buffer, StandbyReplicationArrays *report)
+{
+	struct
+	{
+		const char *name;
+		const char *help;
+		const char *lags;
+	} lagMetrics[] = {
+		{
+			"pg_autoctl_standby_write_lag_seconds",
+			"Write lag of each standby node, as reported by "
+			"pg_stat_replication.",
+			report->writeLags
+		},
+		{
+			"pg_autoctl_standby_flush_lag_seconds",
+			"Flush lag of each standby node, as reported by "
+			"pg_stat_replication.",
+			report->flushLags
+		}
+	};
+
+	int metricsCount = sizeof(lagMetrics) / sizeof(lagMetrics[0]);
+
+	for (int i = 0; i < metricsCount; i++)
+	{
+		const char *nodeIds = report->nodeIds;
+		const char *sentLSNs = report->sentLSNs;
+		const char *lags = lagMetrics[i].lags;
+
+		char nodeId[NAMEDATALEN] = { 0 };
+		char sentLSN[NAMEDATALEN] = { 0 };
+		char lag[NAMEDATALEN] = { 0 };
+
+		bool first = true;
+
+		while (nextArrayElement(&nodeIds, nodeId, sizeof(nodeId)) &&
+			   nextArrayElement(&sentLSNs, sentLSN, sizeof(sentLSN)) &&
+			   nextArrayElement(&lags, lag, sizeof(lag)))
+		{
+			int64_t lagMs = 0;
+
+			/* standby nodes that are not connected have no lag */
+			if (strcmp(sentLSN, "NULL") == 0)
+			{
+				continue;
+			}
+
+			if (first)
+			{
+				appendPQExpBuffer(buffer,
+								  "# HELP %s %s\n"
+								  "# TYPE %s gauge\n",
+								  lagMetrics[i].name, lagMetrics[i].help,
+								  lagMetrics[i].name);
+				first = false;
+			}
+
+			/* a NULL lag means the standby has caught up */
+			(void) stringToInt64(lag, &lagMs);
+
+			appendPQExpBuffer(buffer, "%s{node_id=\"%s\"} %.3f\n",
+							  lagMetrics[i].name, nodeId, lagMs / 1000.0);
+		}
+	}
+
+	const char *nodeIds = report->nodeIds;
+	const char *retainedBytes = report->retainedBytes;
+
+	char nodeId[NAMEDATALEN] = { 0 };
+	char retained[NAMEDATALEN] = { 0 };
+
+	bool first = true;
+
+	while (nextArrayElement(&nodeIds, nodeId, sizeof(nodeId)) &&
+		   nextArrayElement(&retainedBytes, retained, sizeof(retained)))
+	{
+		int64_t bytes = 0;
+
+		/* standby nodes without a replication slot retain nothing */
+		if (!stringToInt64(retained, &bytes))
+		{
+			continue;
+		}
+
+		if (first)
+		{
+			appendPQExpBufferStr(buffer,
+								 "# HELP pg_autoctl_standby_slot_retained_bytes "
+								 "WAL retained by the replication slot of each "
+								 "standby node.\n"
+								 "# TYPE pg_autoctl_standby_slot_retained_bytes "
+								 "gauge\n");
+			first = false;
+		}
+
+		appendPQExpBuffer(buffer,
+						  "pg_autoctl_standby_slot_retained_bytes"
+						  "{node_id=\"%s\"} %" PRId64 "\n",
+						  nodeId, bytes);
+	}
+}
+
+
+/*
+ * appendHistogramMetrics appends the samples of the given histogram, with
+ * the given labels, which are either empty or end with a comma.
+ */
+static void
+appendHistogramMetrics(PQExpBuffer buffer,
+					   const char *name,
+					   const char *labels,
+					   KeeperDurationHistogram *histogram)
+{
+	uint64_t cumulativeCount = 0;
+
+	for (int i = 0; i < KEEPER_HISTOGRAM_BUCKETS; i++)
+	{
+		cumulativeCount += histogram->buckets[i];
+
+		appendPQExpBuffer(buffer,
+						  "%s_bucket{%sle=\"%g\"} %" PRIu64 "\n",
+						  name, labels,
+						  KeeperHistogramBucketsMs[i] / 1000.0,
+						  cumulativeCount);
+	}
+
+	appendPQExpBuffer(buffer,
+					  "%s_bucket{%sle=\"+Inf\"} %" PRIu64 "\n",
+					  name, labels, histogram->count);
+
+	/* remove the trailing comma of the labels for the _sum and _count */
+	int labelsLength = strlen(labels);
+
+	if (labelsLength > 0)
+	{
+		appendPQExpBuffer(buffer,
+						  "%s_sum{%.*s} %.6f\n"
+						  "%s_count{%.*s} %" PRIu64 "\n",
+						  name, labelsLength - 1, labels,
+						  histogram->sumMs / 1000.0,
+						  name, labelsLength - 1, labels,
+						  histogram->count);
+	}
+	else
+	{
+		appendPQExpBuffer(buffer,
+						  "%s_sum %.6f\n"
+						  "%s_count %" PRIu64 "\n",
+						  name, histogram->sumMs / 1000.0,
+						  name, histogram->count);
+	}
+}
+
+
+/*
+ * keeper_histogram_record counts the given duration in its histogram bucket.
+ */
+void
+keeper_histogram_record(KeeperDurationHistogram *histogram, double durationMs)
+{
+	int bucket = 0;
+
+	while (bucket < KEEPER_HISTOGRAM_BUCKETS &&
+		   durationMs > KeeperHistogramBucketsMs[bucket])
+	{
+		++bucket;
+	}
+
+	++histogram->buckets[bucket];
+	++histogram->count;
+	histogram->sumMs += durationMs;
+}
+
+
+/*
+ * KeeperLoopPhaseToString returns the name of a keeper main loop phase, as
+ * used in the logs and the metrics.
+ */
+const char *
+KeeperLoopPhaseToString(KeeperLoopPhase phase)
+{
+	switch (phase)
+	{
+		case KEEPER_LOOP_PHASE_LOAD_STATE:
+		{
+			return "load_state";
+		}
+
+		case KEEPER_LOOP_PHASE_UPDATE_PG_STATE:
+		{
+			return "update_pg_state";
+		}
+
+		case KEEPER_LOOP_PHASE_NODE_ACTIVE:
+		{
+			return "node_active";
+		}
+
+		case KEEPER_LOOP_PHASE_REFRESH_OTHER_NODES:
+		{
+			return "refresh_other_nodes";
+		}
+
+		case KEEPER_LOOP_PHASE_ENSURE_CURRENT_STATE:
+		{
+			return "ensure_current_state";
+		}
+
+		case KEEPER_LOOP_PHASE_FSM_TRANSITION:
+		{
+			return "fsm_transition";
+		}
+
+		case KEEPER_LOOP_PHASE_STORE_STATE:
+		{
+			return "store_state";
+		}
+
+		default:
+		{
+			return "unknown";
+		}
+	}
+}
+
+
+/*
+ * appendPrometheusLabelValue appends a Prometheus label value, escaping
+ * backslashes, double quotes and newlines.
+ */
+void
+appendPrometheusLabelValue(PQExpBuffer buffer, const char *value)
+{
+	for (const char *ptr = value; *ptr != '\0'; ptr++)
+	{
+		switch (*ptr)
+		{
+			case '\\':
+			{
+				appendPQExpBufferStr(buffer, "\\\\");
+				break;
+			}
+
+			case '"':
+			{
+				appendPQExpBufferStr(buffer, "\\\"");
+				break;
+			}
+
+			case '\n':
+			{
+				appendPQExpBufferStr(buffer, "\\n");
+				break;
+			}
+
+			default:
+			{
+				appendPQExpBufferChar(buffer, *ptr);
+				break;
+			}
+		}
+	}
+}
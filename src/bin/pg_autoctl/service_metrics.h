@@ -0,0 +1,55 @@
+/*
+ * src/bin/pg_autoctl/service_metrics.h
+ *   Serve the keeper metrics over HTTP, in the Prometheus text format.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef SERVICE_METRICS_H
+#define SERVICE_METRICS_H
+
+#include <stdbool.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "keeper.h"
+#include "keeper_config.h"
+
+/*
+ * The metrics.listen setting is either an absolute Unix socket pathname, or a
+ * host:port pair where the host part may be empty, meaning all the addresses,
+ * or an IPv6 address in square brackets.
+ */
+typedef struct MetricsListenAddress
+{
+	bool isUnixSocket;
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+	char socketPath[MAXPGPATH];
+} MetricsListenAddress;
+
+bool service_metrics_parse_listen(const char *listen,
+								  MetricsListenAddress *address);
+
+int metrics_http_listen(MetricsListenAddress *address);
+bool metrics_http_accept(int listenFd, int *clientFd);
+void metrics_http_send_response(int clientFd, const char *status,
+								const char *body, long bodySize);
+void metrics_http_close(int listenFd, MetricsListenAddress *address);
+void appendPrometheusLabelValue(PQExpBuffer buffer, const char *value);
+
+bool service_metrics_start(void *context, pid_t *pid);
+void service_metrics_runprogram(void);
+bool service_metrics_loop(KeeperConfig *config);
+
+bool keeper_metrics_write_file(Keeper *keeper);
+
+extern const double KeeperHistogramBucketsMs[KEEPER_HISTOGRAM_BUCKETS];
+
+const char * KeeperLoopPhaseToString(KeeperLoopPhase phase);
+void keeper_histogram_record(KeeperDurationHistogram *histogram,
+							 double durationMs);
+
+#endif /* SERVICE_METRICS_H */
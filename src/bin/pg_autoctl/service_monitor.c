@@ -20,23 +20,54 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "monitor_pg_init.h"
+#include "parsing.h"
 #include "pidfile.h"
+#include "primary_standby.h"
+#include "service_metrics.h"
 #include "service_monitor.h"
 #include "service_postgres_ctl.h"
 #include "signals.h"
 #include "string_utils.h"
 #include "supervisor.h"
+#include "systemd_notify.h"
 
 #include "runprogram.h"
 
 
 static void reload_configuration(Monitor *monitor);
 static bool monitor_ensure_configuration(Monitor *monitor);
+static bool monitor_standby_watch(Monitor *monitor,
+								  LocalPostgresServer *postgres,
+								  uint64_t *lastContactTime);
+static bool monitor_standby_primary_is_reachable(Monitor *monitor);
+
+/* a monitor of the cluster, as seen from a monitor standby */
+typedef struct MonitorPeer
+{
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+	char pguri[MAXCONNINFO];
+	bool reachable;
+	WalReceiverStatus status;
+} MonitorPeer;
+
+static int monitor_cluster_get_peers(MonitorConfig *config,
+									 MonitorPeer *peers, int size);
+static bool monitor_peer_get_status(MonitorPeer *peer);
+static bool monitor_cluster_follow_promoted_peer(Monitor *monitor,
+												 LocalPostgresServer *postgres);
+static bool monitor_cluster_allows_takeover(Monitor *monitor,
+											LocalPostgresServer *postgres);
+static bool monitor_standby_follow(Monitor *monitor,
+								   LocalPostgresServer *postgres,
+								   MonitorPeer *peer);
+static bool monitor_ensure_commit_quorum(MonitorConfig *config, PGSQL *pgsql);
 
 
 /*
- * monitor_service_start starts the monitor processes: the Postgres instance
- * and the user-facing LISTEN client that displays notifications.
+ * monitor_service_start starts the monitor processes: the Postgres instance,
+ * the user-facing LISTEN client that displays notifications, and the metrics
+ * service when metrics.listen is set.
  */
 bool
 start_monitor(Monitor *monitor)
@@ -57,12 +88,25 @@ start_monitor(Monitor *monitor)
 			RP_PERMANENT,
 			-1,
 			&service_monitor_start,
-			(void *) monitor
+			(void *) monitor,
+			&service_monitor_is_ready
+		},
+		{
+			SERVICE_NAME_METRICS,
+			RP_PERMANENT,
+			-1,
+			&service_metrics_start
 		}
 	};
 
 	int subprocessesCount = sizeof(subprocesses) / sizeof(subprocesses[0]);
 
+	/* the metrics service comes last, skip it when it's disabled */
+	if (IS_EMPTY_STRING_BUFFER(config->metricsListen))
+	{
+		--subprocessesCount;
+	}
+
 	/* initialize our local Postgres instance representation */
 	(void) local_postgres_init(&postgres, pgSetup);
 
@@ -185,6 +229,20 @@ service_monitor_runprogram(Monitor *monitor)
 }
 
 
+/*
+ * service_monitor_is_ready is the readyFunction of the listener service: the
+ * monitor is ready when its Postgres instance accepts connections.
+ */
+bool
+service_monitor_is_ready(void *context)
+{
+	Monitor *monitor = (Monitor *) context;
+	PostgresSetup pgSetup = monitor->config.pgSetup;
+
+	return pg_setup_is_ready_now(&pgSetup);
+}
+
+
 /*
  * monitor_service_run watches over monitor process, restarts if it is
  * necessary, also loops over a LISTEN command that is notified at every change
@@ -200,6 +258,9 @@ monitor_service_run(Monitor *monitor)
 	bool firstLoop = true;
 	LocalPostgresServer postgres = { 0 };
 
+	/* a monitor standby watches over the primary monitor */
+	uint64_t lastContactTime = time(NULL);
+
 	/* Initialize our local connection to the monitor */
 	if (!monitor_local_init(monitor))
 	{
@@ -223,6 +284,9 @@ monitor_service_run(Monitor *monitor)
 		bool pgIsNotRunningIsOk = true;
 		PostgresSetup *pgSetup = &(postgres.postgresSetup);
 
+		/* when running as a systemd service, we're still alive */
+		(void) systemd_watchdog_ping();
+
 		if (asked_to_reload || firstLoop)
 		{
 			(void) reload_configuration(monitor);
@@ -245,11 +309,42 @@ monitor_service_run(Monitor *monitor)
 		 * the version in the shared object library and maybe upgrade the
 		 * extension SQL definitions to match.
 		 */
+		if (MONITOR_IS_STANDBY(mconfig))
+		{
+			if (!ensure_postgres_service_is_running_as_subprocess(&postgres))
+			{
+				log_error("Failed to ensure Postgres is running "
+						  "as a pg_autoctl subprocess, "
+						  "see above for details.");
+				return false;
+			}
+
+			/*
+			 * A hot standby can't run our extension upgrade scripts, and
+			 * doesn't send notifications. When the standby has been promoted,
+			 * continue as the primary monitor from the next loop.
+			 */
+			if (monitor_standby_watch(monitor, &postgres, &lastContactTime))
+			{
+				firstLoop = true;
+				continue;
+			}
+
+			sleep(PG_AUTOCTL_MONITOR_RETRY_TIME);
+			continue;
+		}
+
 		if (firstLoop || !pg_setup_is_ready(pgSetup, pgIsNotRunningIsOk))
 		{
 			MonitorExtensionVersion version = { 0 };
 
-			if (!ensure_postgres_service_is_running_as_subprocess(&postgres))
+			/* starting Postgres may wait for crash recovery */
+			(void) systemd_watchdog_extend();
+			bool pgIsRunning =
+				ensure_postgres_service_is_running_as_subprocess(&postgres);
+			(void) systemd_watchdog_reset();
+
+			if (!pgIsRunning)
 			{
 				log_error("Failed to ensure Postgres is running "
 						  "as a pg_autoctl subprocess, "
@@ -299,6 +394,518 @@ monitor_service_run(Monitor *monitor)
 }
 
 
+/*
+ * monitor_standby_watch checks the primary monitor from a monitor standby,
+ * and promotes the local standby when the primary monitor could not be
+ * reached for takeover_timeout seconds. In a monitor cluster, the other
+ * monitors must also agree, see monitor_cluster_allows_takeover.
+ *
+ * It returns true when the local Postgres instance is not in recovery
+ * anymore, after having updated our configuration file: from then on, we are
+ * the primary monitor.
+ */
+static bool
+monitor_standby_watch(Monitor *monitor,
+					  LocalPostgresServer *postgres,
+					  uint64_t *lastContactTime)
+{
+	MonitorConfig *config = &(monitor->config);
+	PostgresSetup *pgSetup = &(config->pgSetup);
+	bool isInRecovery = true;
+
+	if (!pgsql_is_in_recovery(&(monitor->pgsql), &isInRecovery))
+	{
+		/* errors have already been logged, Postgres might be starting */
+		return false;
+	}
+
+	if (!isInRecovery)
+	{
+		log_info("This monitor is not a standby anymore, "
+				 "continuing as the primary monitor");
+
+		strlcpy(config->standbyOf, "", MAXCONNINFO);
+
+		if (!monitor_config_write_file(config))
+		{
+			log_warn("Failed to remove standby.primary from \"%s\", "
+					 "please update the configuration file",
+					 config->pathnames.config);
+		}
+
+		return true;
+	}
+
+	uint64_t now = time(NULL);
+
+	if (monitor_standby_primary_is_reachable(monitor))
+	{
+		*lastContactTime = now;
+		return false;
+	}
+
+	uint64_t lostTime = now - *lastContactTime;
+
+	if (config->takeoverTimeout <= 0 ||
+		lostTime < (uint64_t) config->takeoverTimeout)
+	{
+		log_warn("Failed to contact the primary monitor for %" PRIu64 "s",
+				 lostTime);
+
+		/* another monitor of the cluster might have been promoted already */
+		if (!IS_EMPTY_STRING_BUFFER(config->clusterPeers))
+		{
+			(void) monitor_cluster_follow_promoted_peer(monitor, postgres);
+		}
+
+		return false;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(config->clusterPeers) &&
+		!monitor_cluster_allows_takeover(monitor, postgres))
+	{
+		/* the reason has already been logged */
+		return false;
+	}
+
+	log_warn("Primary monitor has been unreachable for %" PRIu64 "s, "
+			 "promoting this monitor standby (takeover_timeout is %ds)",
+			 lostTime, config->takeoverTimeout);
+
+	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		log_error("Failed to promote the monitor standby, "
+				  "see above for details");
+		return false;
+	}
+
+	/* the next call notices that we are not in recovery anymore */
+	return false;
+}
+
+
+/*
+ * monitor_standby_primary_is_reachable returns true when we could run a
+ * query on the primary monitor. We don't retry: the caller loops already.
+ */
+static bool
+monitor_standby_primary_is_reachable(Monitor *monitor)
+{
+	MonitorConfig *config = &(monitor->config);
+	PGSQL pgsql = { 0 };
+	bool isInRecovery = false;
+
+	if (!pgsql_init(&pgsql, config->standbyOf, PGSQL_CONN_MONITOR))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) pgsql_set_retry_policy(&(pgsql.retryPolicy), 0, 0, 0, 0);
+
+	bool success = pgsql_is_in_recovery(&pgsql, &isInRecovery);
+
+	pgsql_finish(&pgsql);
+
+	return success && !isInRecovery;
+}
+
+
+/*
+ * monitor_cluster_get_peers fills-in the given array with the monitors listed
+ * in the cluster.peers multi-host connection string, and returns how many
+ * were found. Each peer gets its own connection string, without the
+ * target_session_attrs parameter, so that we can connect to standby nodes.
+ */
+static int
+monitor_cluster_get_peers(MonitorConfig *config, MonitorPeer *peers, int size)
+{
+	URIParams params = { 0 };
+	KeyVal overrides = { 0 };
+	bool checkForCompleteURI = false;
+	int count = 0;
+
+	if (!parse_pguri_info_key_vals(config->clusterPeers,
+								   &overrides,
+								   &params,
+								   checkForCompleteURI))
+	{
+		log_error("Failed to parse cluster.peers \"%s\"",
+				  config->clusterPeers);
+		return 0;
+	}
+
+	/* remove target_session_attrs, keeping the other parameters in order */
+	KeyVal *parameters = &(params.parameters);
+	int kept = 0;
+
+	for (int i = 0; i < parameters->count; i++)
+	{
+		if (strcmp(parameters->keywords[i], "target_session_attrs") == 0)
+		{
+			continue;
+		}
+
+		if (kept != i)
+		{
+			strlcpy(parameters->keywords[kept], parameters->keywords[i],
+					MAXCONNINFO);
+			strlcpy(parameters->values[kept], parameters->values[i],
+					MAXCONNINFO);
+		}
+		++kept;
+	}
+	parameters->count = kept;
+
+	for (int index = 0; index < size; index++)
+	{
+		MonitorPeer *peer = &(peers[count]);
+		bool found = false;
+
+		if (!hostname_from_uri_at(config->clusterPeers, index,
+								  peer->host, sizeof(peer->host),
+								  &(peer->port), &found))
+		{
+			/* errors have already been logged */
+			return 0;
+		}
+
+		if (!found)
+		{
+			break;
+		}
+
+		strlcpy(params.hostname, peer->host, sizeof(params.hostname));
+		sformat(params.port, sizeof(params.port), "%d", peer->port);
+
+		if (!buildPostgresURIfromPieces(&params, peer->pguri))
+		{
+			log_error("Failed to build the connection string of the "
+					  "monitor peer %s:%d", peer->host, peer->port);
+			return 0;
+		}
+
+		++count;
+	}
+
+	return count;
+}
+
+
+/*
+ * monitor_peer_get_status connects to the given monitor peer and fetches its
+ * replication status. We don't retry: the caller loops already.
+ */
+static bool
+monitor_peer_get_status(MonitorPeer *peer)
+{
+	PGSQL pgsql = { 0 };
+
+	if (!pgsql_init(&pgsql, peer->pguri, PGSQL_CONN_MONITOR))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) pgsql_set_retry_policy(&(pgsql.retryPolicy), 0, 0, 0, 0);
+
+	peer->reachable = pgsql_get_wal_receiver_status(&pgsql, &(peer->status));
+
+	pgsql_finish(&pgsql);
+
+	return peer->reachable;
+}
+
+
+/*
+ * monitor_cluster_follow_promoted_peer looks for a monitor of the cluster,
+ * other than our primary monitor, that is not in recovery anymore. When one
+ * is found, our monitor standby follows it, so that the new primary monitor
+ * gets its commit quorum back without waiting for our takeover_timeout.
+ */
+static bool
+monitor_cluster_follow_promoted_peer(Monitor *monitor,
+									 LocalPostgresServer *postgres)
+{
+	MonitorConfig *config = &(monitor->config);
+	MonitorPeer peers[MONITOR_CLUSTER_MAX_PEERS] = { 0 };
+
+	char primaryHost[_POSIX_HOST_NAME_MAX] = { 0 };
+	int primaryPort = 0;
+
+	int peersCount =
+		monitor_cluster_get_peers(config, peers, MONITOR_CLUSTER_MAX_PEERS);
+
+	if (!hostname_from_uri(config->standbyOf,
+						   primaryHost, sizeof(primaryHost), &primaryPort))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < peersCount; i++)
+	{
+		MonitorPeer *peer = &(peers[i]);
+
+		if (streq(peer->host, primaryHost) && peer->port == primaryPort)
+		{
+			continue;
+		}
+
+		if (monitor_peer_get_status(peer) && !peer->status.isInRecovery)
+		{
+			log_warn("Monitor %s:%d has been promoted, following it",
+					 peer->host, peer->port);
+
+			return monitor_standby_follow(monitor, postgres, peer);
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * monitor_cluster_allows_takeover asks the other monitors of the cluster
+ * whether this monitor standby should be promoted, now that it has lost
+ * contact with the primary monitor for takeover_timeout seconds:
+ *
+ * - when another monitor has been promoted already, we follow it instead,
+ *
+ * - when a monitor standby still hears from the primary monitor, we are
+ *   the one that's partitioned away and we stay a standby,
+ *
+ * - a monitor standby that has received more WAL than we did is a better
+ *   candidate, and wins a tie when its host:port sorts first,
+ *
+ * - we need a majority of the monitors, including ourselves, to agree that
+ *   the primary monitor is lost.
+ *
+ * With cluster.quorum set on the primary monitor, the standby that has
+ * received the most WAL has every committed decision of the primary monitor,
+ * so the takeover doesn't lose any FSM decision that a keeper acted upon.
+ */
+static bool
+monitor_cluster_allows_takeover(Monitor *monitor, LocalPostgresServer *postgres)
+{
+	MonitorConfig *config = &(monitor->config);
+	MonitorPeer peers[MONITOR_CLUSTER_MAX_PEERS] = { 0 };
+	WalReceiverStatus localStatus = { 0 };
+	uint64_t localLSN = 0;
+
+	char primaryHost[_POSIX_HOST_NAME_MAX] = { 0 };
+	int primaryPort = 0;
+	char localAddress[BUFSIZE] = { 0 };
+
+	int peersCount =
+		monitor_cluster_get_peers(config, peers, MONITOR_CLUSTER_MAX_PEERS);
+
+	if (peersCount == 0)
+	{
+		log_warn("Failed to find any monitor in cluster.peers, "
+				 "not promoting this monitor standby");
+		return false;
+	}
+
+	if (!hostname_from_uri(config->standbyOf,
+						   primaryHost, sizeof(primaryHost), &primaryPort))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_get_wal_receiver_status(&(monitor->pgsql), &localStatus) ||
+		!parseLSN(localStatus.receivedLSN, &localLSN))
+	{
+		log_warn("Failed to get the received LSN of this monitor standby");
+		return false;
+	}
+
+	sformat(localAddress, sizeof(localAddress), "%s:%d",
+			config->hostname, config->pgSetup.pgport);
+
+	int votes = 1;              /* our own vote */
+	int monitorsCount = peersCount + 1;
+	int64_t timeoutMs = (int64_t) config->takeoverTimeout * 1000;
+
+	for (int i = 0; i < peersCount; i++)
+	{
+		MonitorPeer *peer = &(peers[i]);
+		uint64_t peerLSN = 0;
+
+		char peerAddress[BUFSIZE] = { 0 };
+
+		bool isPrimary =
+			streq(peer->host, primaryHost) && peer->port == primaryPort;
+
+		sformat(peerAddress, sizeof(peerAddress), "%s:%d",
+				peer->host, peer->port);
+
+		/* the same configuration may be used on every monitor */
+		if (streq(peerAddress, localAddress))
+		{
+			--monitorsCount;
+			continue;
+		}
+
+		if (!monitor_peer_get_status(peer))
+		{
+			log_info("Monitor %s:%d is unreachable", peer->host, peer->port);
+			continue;
+		}
+
+		if (!peer->status.isInRecovery)
+		{
+			if (isPrimary)
+			{
+				log_info("Primary monitor %s:%d is reachable again",
+						 peer->host, peer->port);
+				return false;
+			}
+
+			log_warn("Monitor %s:%d has been promoted already, following it",
+					 peer->host, peer->port);
+
+			(void) monitor_standby_follow(monitor, postgres, peer);
+
+			return false;
+		}
+
+		if (peer->status.upstreamAgeMs >= 0 &&
+			peer->status.upstreamAgeMs < timeoutMs)
+		{
+			log_warn("Monitor standby %s:%d heard from its primary %" PRId64
+					 "ms ago, not promoting this monitor standby",
+					 peer->host, peer->port, peer->status.upstreamAgeMs);
+			return false;
+		}
+
+		if (!parseLSN(peer->status.receivedLSN, &peerLSN))
+		{
+			log_warn("Failed to parse LSN \"%s\" of monitor standby %s:%d",
+					 peer->status.receivedLSN, peer->host, peer->port);
+			return false;
+		}
+
+		if (peerLSN > localLSN)
+		{
+			log_info("Monitor standby %s:%d has received WAL up to %s, "
+					 "ahead of this monitor standby at %s, "
+					 "leaving the takeover to it",
+					 peer->host, peer->port,
+					 peer->status.receivedLSN, localStatus.receivedLSN);
+			return false;
+		}
+
+		if (peerLSN == localLSN)
+		{
+			if (strcmp(peerAddress, localAddress) < 0)
+			{
+				log_info("Monitor standby %s has also received WAL up to %s, "
+						 "leaving the takeover to it",
+						 peerAddress, localStatus.receivedLSN);
+				return false;
+			}
+		}
+
+		++votes;
+	}
+
+	if (votes <= monitorsCount / 2)
+	{
+		log_warn("Only %d of %d monitors agree that the primary monitor "
+				 "is lost, not promoting this monitor standby",
+				 votes, monitorsCount);
+		return false;
+	}
+
+	log_info("%d of %d monitors agree that the primary monitor is lost",
+			 votes, monitorsCount);
+
+	return true;
+}
+
+
+/*
+ * monitor_standby_follow makes our monitor standby follow another monitor of
+ * the cluster that has been promoted. Postgres 13 and later only need a
+ * reload, older versions are restarted.
+ */
+static bool
+monitor_standby_follow(Monitor *monitor,
+					   LocalPostgresServer *postgres,
+					   MonitorPeer *peer)
+{
+	MonitorConfig *config = &(monitor->config);
+	PostgresSetup *pgSetup = &(config->pgSetup);
+	ReplicationSource upstream = { 0 };
+
+	strlcpy(config->standbyOf, peer->pguri, MAXCONNINFO);
+
+	if (!monitor_config_write_file(config))
+	{
+		log_warn("Failed to update standby.primary in \"%s\", "
+				 "please update the configuration file",
+				 config->pathnames.config);
+	}
+
+	if (!monitor_standby_replication_source(config, &upstream) ||
+		!pgctl_identify_system(&upstream))
+	{
+		log_error("Failed to connect to the new primary monitor %s:%d "
+				  "with a replication connection string, "
+				  "see above for details",
+				  peer->host, peer->port);
+		return false;
+	}
+
+	if (!pg_controldata(pgSetup, false) ||
+		!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   &upstream))
+	{
+		log_error("Failed to setup this monitor as a standby of %s:%d",
+				  peer->host, peer->port);
+		return false;
+	}
+
+	if (pgSetup->control.pg_control_version >= 1300)
+	{
+		return monitor_ensure_configuration(monitor);
+	}
+
+	log_info("Restarting Postgres at \"%s\" to follow the new primary monitor",
+			 pgSetup->pgdata);
+
+	return ensure_postgres_service_is_stopped(postgres) &&
+		   ensure_postgres_service_is_running_as_subprocess(postgres);
+}
+
+
+/*
+ * monitor_ensure_commit_quorum sets synchronous_standby_names on the primary
+ * monitor so that each commit waits for cluster.quorum monitor standbys. The
+ * FSM decisions are then committed on a quorum of the monitors before the
+ * keepers see them.
+ */
+static bool
+monitor_ensure_commit_quorum(MonitorConfig *config, PGSQL *pgsql)
+{
+	char synchronousStandbyNames[BUFSIZE] = { 0 };
+
+	if (config->clusterQuorum > 0)
+	{
+		sformat(synchronousStandbyNames, sizeof(synchronousStandbyNames),
+				"ANY %d (%s)",
+				config->clusterQuorum,
+				MONITOR_STANDBY_APPLICATION_NAME);
+	}
+
+	return pgsql_set_synchronous_standby_names(pgsql, synchronousStandbyNames);
+}
+
+
 /*
  * reload_configuration reads the supposedly new configuration file and
  * integrates accepted new values into the current setup.
@@ -398,6 +1005,17 @@ monitor_ensure_configuration(Monitor *monitor)
 
 	if (pg_setup_is_ready(&(postgres.postgresSetup), pgIsNotRunningIsOk))
 	{
+		/* the primary monitor waits for cluster.quorum standbys to commit */
+		if (!MONITOR_IS_STANDBY(config) &&
+			(config->clusterQuorum > 0 ||
+			 !IS_EMPTY_STRING_BUFFER(config->clusterPeers)) &&
+			!monitor_ensure_commit_quorum(config, &(postgres.sqlClient)))
+		{
+			log_warn("Failed to apply cluster.quorum %d, "
+					 "see above for details",
+					 config->clusterQuorum);
+		}
+
 		if (!pgsql_reload_conf(&(postgres.sqlClient)))
 		{
 			log_warn("Failed to reload Postgres configuration after "
@@ -133,14 +133,24 @@ service_monitor_init_start(void *context, pid_t *pid)
 
 			(void) set_ps_title(serviceName);
 
-			/* finish the install if necessary */
-			if (!monitor_install(config->hostname, *pgSetup, false))
+			/*
+			 * Finish the install if necessary. A monitor standby is a copy of
+			 * the primary monitor and can't be written to.
+			 */
+			if (MONITOR_IS_STANDBY(config))
 			{
-				/* errors have already been logged */
-				exit(EXIT_CODE_INTERNAL_ERROR);
+				log_info("Monitor standby has been successfully initialized.");
 			}
+			else
+			{
+				if (!monitor_install(config->hostname, *pgSetup, false))
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
 
-			log_info("Monitor has been successfully initialized.");
+				log_info("Monitor has been successfully initialized.");
+			}
 
 			if (createAndRun)
 			{
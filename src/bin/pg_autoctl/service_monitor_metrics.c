@@ -0,0 +1,751 @@
+/*
+ * src/bin/pg_autoctl/service_monitor_metrics.c
+ *   Serve the monitor's view of the formations over HTTP, in the Prometheus
+ *   text format.
+ *
+ * The metrics service keeps a snapshot of the pgautofailover.node table and
+ * of the per-group event counters in memory, and answers HTTP GET /metrics
+ * requests from that snapshot. The snapshot is refreshed when the monitor
+ * sends a notification on the "state" channel, at most once per
+ * MONITOR_METRICS_MIN_REFRESH_MS, and every MONITOR_METRICS_MAX_REFRESH_MS
+ * otherwise, because nodes report their LSN without a state change. That
+ * way, scrapes never cost a query on the monitor, however often they happen
+ * and however many scrapers there are.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+#include "portability/instr_time.h"
+
+#include "defaults.h"
+#include "log.h"
+#include "monitor.h"
+#include "monitor_config.h"
+#include "pgsql.h"
+#include "service_metrics.h"
+#include "service_monitor_metrics.h"
+#include "signals.h"
+#include "state.h"
+#include "string_utils.h"
+
+#define MONITOR_METRICS_POLL_TIMEOUT_MS 1000
+#define MONITOR_METRICS_MIN_REFRESH_MS 1000
+#define MONITOR_METRICS_MAX_REFRESH_MS 5000
+
+typedef struct MonitorMetricsSnapshot
+{
+	MonitorNodeMetricsArray nodesArray;
+	MonitorGroupMetricsArray groupsArray;
+
+	bool connected;
+	bool ready;                 /* have we refreshed the snapshot once yet? */
+	bool refreshNeeded;         /* have we received notifications since? */
+
+	instr_time refreshTime;
+	time_t refreshTimestamp;
+	double refreshDurationMs;
+	double notificationQueueUsage;
+
+	uint64_t refreshCount;
+	uint64_t refreshFailures;
+	uint64_t notificationCount;
+} MonitorMetricsSnapshot;
+
+static bool monitor_metrics_connect(Monitor *monitor,
+									MonitorMetricsSnapshot *snapshot);
+static void monitor_metrics_disconnect(Monitor *monitor,
+									   MonitorMetricsSnapshot *snapshot);
+static bool monitor_metrics_consume_notifications(Monitor *monitor,
+												  MonitorMetricsSnapshot *snapshot);
+static bool monitor_metrics_refresh(Monitor *monitor,
+									MonitorMetricsSnapshot *snapshot);
+static void monitor_metrics_serve_client(int clientFd,
+										 MonitorMetricsSnapshot *snapshot);
+static void appendNodeResourcesMetrics(PQExpBuffer buffer,
+									   MonitorNodeMetricsArray *nodesArray);
+static void appendNodeSyncRepMetrics(PQExpBuffer buffer,
+									 MonitorNodeMetricsArray *nodesArray);
+static void appendNodeMetricsLabels(PQExpBuffer buffer,
+									MonitorNodeMetrics *node);
+static double elapsed_ms(instr_time startTime);
+
+
+/*
+ * service_monitor_metrics_loop listens on metrics.listen and serves the
+ * monitor metrics snapshot to each client, one client at a time, while
+ * maintaining the snapshot from the monitor notifications.
+ *
+ * Changes to metrics.listen are taken into account at the next restart of the
+ * service.
+ */
+bool
+service_monitor_metrics_loop(Monitor *monitor)
+{
+	MonitorConfig *config = &(monitor->config);
+	MetricsListenAddress address = { 0 };
+	MonitorMetricsSnapshot snapshot = { 0 };
+
+	if (!service_metrics_parse_listen(config->metricsListen, &address))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!monitor_local_init(monitor))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* we retry connecting in our own loop, don't block the HTTP clients */
+	(void) pgsql_set_main_loop_retry_policy(&(monitor->pgsql.retryPolicy));
+
+	int listenFd = metrics_http_listen(&address);
+
+	if (listenFd < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Serving the pg_autoctl monitor metrics on \"%s\"",
+			 config->metricsListen);
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		struct pollfd pfds[2] = { 0 };
+		int nfds = 1;
+
+		/* connect (again) to the monitor, and LISTEN to state changes */
+		if (!snapshot.connected &&
+			(INSTR_TIME_IS_ZERO(snapshot.refreshTime) ||
+			 elapsed_ms(snapshot.refreshTime) >= MONITOR_METRICS_MAX_REFRESH_MS))
+		{
+			if (!monitor_metrics_connect(monitor, &snapshot))
+			{
+				/* try again later, meanwhile serve the previous snapshot */
+				INSTR_TIME_SET_CURRENT(snapshot.refreshTime);
+			}
+		}
+
+		if (snapshot.connected)
+		{
+			double sinceRefreshMs =
+				INSTR_TIME_IS_ZERO(snapshot.refreshTime)
+				? MONITOR_METRICS_MAX_REFRESH_MS
+				: elapsed_ms(snapshot.refreshTime);
+
+			if ((snapshot.refreshNeeded &&
+				 sinceRefreshMs >= MONITOR_METRICS_MIN_REFRESH_MS) ||
+				sinceRefreshMs >= MONITOR_METRICS_MAX_REFRESH_MS)
+			{
+				if (!monitor_metrics_refresh(monitor, &snapshot))
+				{
+					log_warn("Failed to refresh the monitor metrics, "
+							 "reconnecting to the monitor");
+					(void) monitor_metrics_disconnect(monitor, &snapshot);
+				}
+			}
+		}
+
+		/* a failed query might have closed the connection already */
+		if (snapshot.connected && monitor->pgsql.connection == NULL)
+		{
+			(void) monitor_metrics_disconnect(monitor, &snapshot);
+		}
+
+		pfds[0].fd = listenFd;
+		pfds[0].events = POLLIN;
+
+		if (snapshot.connected)
+		{
+			pfds[1].fd = PQsocket(monitor->pgsql.connection);
+			pfds[1].events = POLLIN;
+			++nfds;
+		}
+
+		int ready = poll(pfds, nfds, MONITOR_METRICS_POLL_TIMEOUT_MS);
+
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to poll the metrics socket: %m");
+			break;
+		}
+
+		if (ready == 0)
+		{
+			continue;
+		}
+
+		if (nfds > 1 && (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			if (!monitor_metrics_consume_notifications(monitor, &snapshot))
+			{
+				log_warn("Lost the connection to the monitor, "
+						 "reconnecting");
+				(void) monitor_metrics_disconnect(monitor, &snapshot);
+			}
+		}
+
+		int clientFd = -1;
+
+		if ((pfds[0].revents & POLLIN) &&
+			metrics_http_accept(listenFd, &clientFd))
+		{
+			(void) monitor_metrics_serve_client(clientFd, &snapshot);
+			close(clientFd);
+		}
+	}
+
+	(void) metrics_http_close(listenFd, &address);
+	(void) monitor_metrics_disconnect(monitor, &snapshot);
+
+	monitor_node_metrics_array_free(&(snapshot.nodesArray));
+	monitor_group_metrics_array_free(&(snapshot.groupsArray));
+
+	return true;
+}
+
+
+/*
+ * monitor_metrics_connect opens the monitor connection that we use both to
+ * LISTEN to the "state" channel and to refresh the snapshot.
+ */
+static bool
+monitor_metrics_connect(Monitor *monitor, MonitorMetricsSnapshot *snapshot)
+{
+	char *channels[] = { "state", NULL };
+
+	if (!pgsql_listen(&(monitor->pgsql), channels))
+	{
+		log_warn("Failed to LISTEN to the monitor notifications, "
+				 "trying again in %ds",
+				 MONITOR_METRICS_MAX_REFRESH_MS / 1000);
+		return false;
+	}
+
+	snapshot->connected = true;
+
+	/* we might have missed notifications while disconnected */
+	snapshot->refreshNeeded = true;
+	INSTR_TIME_SET_ZERO(snapshot->refreshTime);
+
+	return true;
+}
+
+
+/*
+ * monitor_metrics_disconnect closes the monitor connection.
+ */
+static void
+monitor_metrics_disconnect(Monitor *monitor, MonitorMetricsSnapshot *snapshot)
+{
+	pgsql_finish(&(monitor->pgsql));
+
+	snapshot->connected = false;
+	INSTR_TIME_SET_CURRENT(snapshot->refreshTime);
+}
+
+
+/*
+ * monitor_metrics_consume_notifications reads the notifications that the
+ * monitor sent us. We don't need their payload, only to know that the
+ * snapshot is now outdated. Returns false when the connection is lost.
+ */
+static bool
+monitor_metrics_consume_notifications(Monitor *monitor,
+									  MonitorMetricsSnapshot *snapshot)
+{
+	PGconn *connection = monitor->pgsql.connection;
+	PGnotify *notify = NULL;
+
+	if (PQconsumeInput(connection) == 0 ||
+		PQstatus(connection) != CONNECTION_OK)
+	{
+		log_debug("Failed to read from the monitor connection: %s",
+				  PQerrorMessage(connection));
+		return false;
+	}
+
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		++snapshot->notificationCount;
+		snapshot->refreshNeeded = true;
+
+		PQfreemem(notify);
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_metrics_refresh fetches the pgautofailover.node table and the new
+ * pgautofailover.event rows from the monitor. The event counters are only
+ * ever accumulated from the events that we didn't see yet.
+ */
+static bool
+monitor_metrics_refresh(Monitor *monitor, MonitorMetricsSnapshot *snapshot)
+{
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	/* notifications that arrive during the refresh call for another one */
+	snapshot->refreshNeeded = false;
+	snapshot->refreshTime = startTime;
+
+	if (!monitor_get_node_metrics(monitor, &(snapshot->nodesArray)) ||
+		!monitor_update_group_metrics(monitor, &(snapshot->groupsArray)) ||
+		!monitor_get_notification_queue_usage(monitor,
+											  &(snapshot->notificationQueueUsage)))
+	{
+		++snapshot->refreshFailures;
+		return false;
+	}
+
+	snapshot->ready = true;
+	snapshot->refreshTimestamp = time(NULL);
+	snapshot->refreshDurationMs = elapsed_ms(startTime);
+	++snapshot->refreshCount;
+
+	log_trace("Refreshed the monitor metrics for %d nodes in %.3f ms",
+			  snapshot->nodesArray.count,
+			  snapshot->refreshDurationMs);
+
+	return true;
+}
+
+
+/*
+ * monitor_metrics_serve_client renders the current snapshot in the
+ * Prometheus text exposition format and sends it to the client. Ages are
+ * computed now, so that they keep growing between two refreshes.
+ */
+static void
+monitor_metrics_serve_client(int clientFd, MonitorMetricsSnapshot *snapshot)
+{
+	MonitorNodeMetricsArray *nodesArray = &(snapshot->nodesArray);
+	MonitorGroupMetricsArray *groupsArray = &(snapshot->groupsArray);
+
+	time_t now = time(NULL);
+
+	if (!snapshot->ready)
+	{
+		char *body = "The pg_autoctl monitor metrics are not available yet\n";
+
+		(void) metrics_http_send_response(clientFd,
+										  "503 Service Unavailable",
+										  body, strlen(body));
+		return;
+	}
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return;
+	}
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_up "
+					  "Whether the metrics service is connected "
+					  "to the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_up gauge\n"
+					  "pg_autoctl_monitor_up %d\n",
+					  snapshot->connected ? 1 : 0);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_snapshot_timestamp_seconds "
+					  "When the metrics were last fetched from the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_snapshot_timestamp_seconds "
+					  "gauge\n"
+					  "pg_autoctl_monitor_snapshot_timestamp_seconds %lld\n",
+					  (long long) snapshot->refreshTimestamp);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_snapshot_duration_seconds "
+					  "Duration of the last metrics refresh.\n"
+					  "# TYPE pg_autoctl_monitor_snapshot_duration_seconds "
+					  "gauge\n"
+					  "pg_autoctl_monitor_snapshot_duration_seconds %.6f\n",
+					  snapshot->refreshDurationMs / 1000.0);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_snapshot_refreshes_total "
+					  "Metrics refreshes from the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_snapshot_refreshes_total "
+					  "counter\n"
+					  "pg_autoctl_monitor_snapshot_refreshes_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_monitor_snapshot_failures_total "
+					  "Failed metrics refreshes from the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_snapshot_failures_total "
+					  "counter\n"
+					  "pg_autoctl_monitor_snapshot_failures_total %" PRIu64 "\n",
+					  snapshot->refreshCount,
+					  snapshot->refreshFailures);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_notifications_total "
+					  "State change notifications received from the monitor.\n"
+					  "# TYPE pg_autoctl_monitor_notifications_total counter\n"
+					  "pg_autoctl_monitor_notifications_total %" PRIu64 "\n",
+					  snapshot->notificationCount);
+
+	appendPQExpBuffer(buffer,
+					  "# HELP pg_autoctl_monitor_notification_queue_usage "
+					  "Fraction of the monitor notification queue in use.\n"
+					  "# TYPE pg_autoctl_monitor_notification_queue_usage "
+					  "gauge\n"
+					  "pg_autoctl_monitor_notification_queue_usage %.6f\n",
+					  snapshot->notificationQueueUsage);
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_info "
+						 "Node identification and FSM states.\n"
+						 "# TYPE pg_autoctl_monitor_node_info gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		appendPQExpBufferStr(buffer, "pg_autoctl_monitor_node_info{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBufferStr(buffer, ",host=\"");
+		appendPrometheusLabelValue(buffer, node->host);
+		appendPQExpBuffer(buffer,
+						  "\",port=\"%d\","
+						  "reported_state=\"%s\",goal_state=\"%s\"} 1\n",
+						  node->port,
+						  NodeStateToString(node->reportedState),
+						  NodeStateToString(node->goalState));
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_health "
+						 "Node health as seen by the monitor: "
+						 "1 good, 0 bad, -1 unknown.\n"
+						 "# TYPE pg_autoctl_monitor_node_health gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		appendPQExpBufferStr(buffer, "pg_autoctl_monitor_node_health{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %d\n", node->health);
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_lag_bytes "
+						 "WAL bytes behind the most advanced node "
+						 "of the group.\n"
+						 "# TYPE pg_autoctl_monitor_node_lag_bytes gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		appendPQExpBufferStr(buffer, "pg_autoctl_monitor_node_lag_bytes{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %" PRId64 "\n", node->lagBytes);
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_report_age_seconds "
+						 "Time since the node last reported to the monitor.\n"
+						 "# TYPE pg_autoctl_monitor_node_report_age_seconds "
+						 "gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_node_report_age_seconds{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %lld\n",
+						  (long long) (now - node->reportTime));
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_health_check_age_seconds "
+						 "Time since the monitor last health checked the node.\n"
+						 "# TYPE pg_autoctl_monitor_node_health_check_age_seconds "
+						 "gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_node_health_check_age_seconds{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %lld\n",
+						  (long long) (now - node->healthCheckTime));
+	}
+
+	(void) appendNodeResourcesMetrics(buffer, nodesArray);
+	(void) appendNodeSyncRepMetrics(buffer, nodesArray);
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_group_failovers_total "
+						 "Promotions (failovers and switchovers) "
+						 "in the group.\n"
+						 "# TYPE pg_autoctl_monitor_group_failovers_total "
+						 "counter\n");
+
+	for (int i = 0; i < groupsArray->count; i++)
+	{
+		MonitorGroupMetrics *group = &(groupsArray->groups[i]);
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_group_failovers_total"
+							 "{formation=\"");
+		appendPrometheusLabelValue(buffer, group->formationId);
+		appendPQExpBuffer(buffer, "\",group=\"%d\"} %" PRId64 "\n",
+						  group->groupId,
+						  group->failoverCount);
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_group_events_total "
+						 "Events recorded by the monitor for the group.\n"
+						 "# TYPE pg_autoctl_monitor_group_events_total "
+						 "counter\n");
+
+	for (int i = 0; i < groupsArray->count; i++)
+	{
+		MonitorGroupMetrics *group = &(groupsArray->groups[i]);
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_group_events_total"
+							 "{formation=\"");
+		appendPrometheusLabelValue(buffer, group->formationId);
+		appendPQExpBuffer(buffer, "\",group=\"%d\"} %" PRId64 "\n",
+						  group->groupId,
+						  group->eventCount);
+	}
+
+	if (PQExpBufferBroken(buffer))
+	{
+		char *body = "Failed to allocate memory\n";
+
+		log_error("Failed to allocate memory for the monitor metrics");
+
+		(void) metrics_http_send_response(clientFd,
+										  "500 Internal Server Error",
+										  body, strlen(body));
+	}
+	else
+	{
+		(void) metrics_http_send_response(clientFd, "200 OK",
+										  buffer->data, buffer->len);
+	}
+
+	destroyPQExpBuffer(buffer);
+}
+
+
+/*
+ * appendNodeResourcesMetrics appends the resources that the keepers reported
+ * for their host, so that an undersized standby node can be spotted before a
+ * failover promotes it. Nodes that did not report yet are skipped.
+ */
+static void
+appendNodeResourcesMetrics(PQExpBuffer buffer,
+						   MonitorNodeMetricsArray *nodesArray)
+{
+	struct
+	{
+		const char *name;
+		const char *help;
+		int precision;
+	} resourceMetrics[] = {
+		{
+			"pg_autoctl_monitor_node_cpu_count",
+			"Number of CPUs of the host of the node.", 0
+		},
+		{
+			"pg_autoctl_monitor_node_cpu_usage_percent",
+			"Percentage of time the CPUs of the host of the node are busy.", 2
+		},
+		{
+			"pg_autoctl_monitor_node_memory_total_bytes",
+			"Memory of the host of the node.", 0
+		},
+		{
+			"pg_autoctl_monitor_node_memory_available_bytes",
+			"Memory available on the host of the node.", 0
+		},
+		{
+			"pg_autoctl_monitor_node_disk_write_rate_bytes",
+			"Bytes written to disk per second on the host of the node.", 0
+		},
+		{
+			"pg_autoctl_monitor_node_wal_rate_bytes",
+			"WAL bytes written or received per second by the node.", 0
+		}
+	};
+
+	int metricsCount = sizeof(resourceMetrics) / sizeof(resourceMetrics[0]);
+
+	for (int m = 0; m < metricsCount; m++)
+	{
+		appendPQExpBuffer(buffer,
+						  "# HELP %s %s\n"
+						  "# TYPE %s gauge\n",
+						  resourceMetrics[m].name, resourceMetrics[m].help,
+						  resourceMetrics[m].name);
+
+		for (int i = 0; i < nodesArray->count; i++)
+		{
+			MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+			NodeResources *resources = &(node->resources);
+
+			/* same order as the resourceMetrics array */
+			double values[] = {
+				resources->ncpu,
+				resources->cpuUsage,
+				resources->totalram,
+				resources->availableram,
+				resources->diskWriteRate,
+				resources->walRate
+			};
+
+			if (!node->hasResources)
+			{
+				continue;
+			}
+
+			appendPQExpBuffer(buffer, "%s{", resourceMetrics[m].name);
+			appendNodeMetricsLabels(buffer, node);
+			appendPQExpBuffer(buffer, "} %.*f\n",
+							  resourceMetrics[m].precision, values[m]);
+		}
+	}
+}
+
+
+/*
+ * appendNodeSyncRepMetrics appends how many commits wait for synchronous
+ * replication on the primary nodes, for how long, and how many times they
+ * stalled past pgautofailover.sync_rep_stall_threshold.
+ */
+static void
+appendNodeSyncRepMetrics(PQExpBuffer buffer,
+						 MonitorNodeMetricsArray *nodesArray)
+{
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_sync_rep_waiting "
+						 "Backends waiting for a synchronous standby.\n"
+						 "# TYPE pg_autoctl_monitor_node_sync_rep_waiting "
+						 "gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		if (!node->hasSyncRepWaits)
+		{
+			continue;
+		}
+
+		appendPQExpBufferStr(buffer, "pg_autoctl_monitor_node_sync_rep_waiting{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %d\n", node->syncRepWaiting);
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_sync_rep_oldest_wait_seconds "
+						 "How long the oldest SyncRep waiter has waited.\n"
+						 "# TYPE pg_autoctl_monitor_node_sync_rep_oldest_wait_seconds "
+						 "gauge\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		if (!node->hasSyncRepWaits)
+		{
+			continue;
+		}
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_node_sync_rep_oldest_wait_seconds{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %.3f\n",
+						  (double) node->syncRepOldestWaitMs / 1000.0);
+	}
+
+	appendPQExpBufferStr(buffer,
+						 "# HELP pg_autoctl_monitor_node_sync_rep_stalls_total "
+						 "Commit waits longer than the stall threshold.\n"
+						 "# TYPE pg_autoctl_monitor_node_sync_rep_stalls_total "
+						 "counter\n");
+
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		MonitorNodeMetrics *node = &(nodesArray->nodes[i]);
+
+		if (!node->hasSyncRepWaits)
+		{
+			continue;
+		}
+
+		appendPQExpBufferStr(buffer,
+							 "pg_autoctl_monitor_node_sync_rep_stalls_total{");
+		appendNodeMetricsLabels(buffer, node);
+		appendPQExpBuffer(buffer, "} %" PRId64 "\n", node->syncRepStalls);
+	}
+}
+
+
+/*
+ * appendNodeMetricsLabels appends the labels that identify a node.
+ */
+static void
+appendNodeMetricsLabels(PQExpBuffer buffer, MonitorNodeMetrics *node)
+{
+	appendPQExpBufferStr(buffer, "formation=\"");
+	appendPrometheusLabelValue(buffer, node->formationId);
+	appendPQExpBuffer(buffer, "\",group=\"%d\",node_id=\"%" PRId64 "\",name=\"",
+					  node->groupId,
+					  node->nodeId);
+	appendPrometheusLabelValue(buffer, node->name);
+	appendPQExpBufferStr(buffer, "\"");
+}
+
+
+/*
+ * elapsed_ms returns how many milliseconds have passed since startTime.
+ */
+static double
+elapsed_ms(instr_time startTime)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	return INSTR_TIME_GET_MILLISEC(duration);
+}
@@ -0,0 +1,19 @@
+/*
+ * src/bin/pg_autoctl/service_monitor_metrics.h
+ *   Serve the monitor's view of the formations over HTTP, in the Prometheus
+ *   text format.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef SERVICE_MONITOR_METRICS_H
+#define SERVICE_MONITOR_METRICS_H
+
+#include <stdbool.h>
+
+#include "monitor.h"
+
+bool service_monitor_metrics_loop(Monitor *monitor);
+
+#endif /* SERVICE_MONITOR_METRICS_H */
@@ -88,8 +88,14 @@ service_postgres_start(void *context, pid_t *pid)
 			/* we're starting postgres, reset the cached value for the pid */
 			pgSetup->pidFile.pid = 0;
 
+			/*
+			 * When postgres exits before being ready, return early: the
+			 * Postgres controller then tries again on its next round rather
+			 * than after the whole timeout.
+			 */
 			bool pgIsReady =
-				pg_setup_wait_until_is_ready(pgSetup, timeout, logLevel);
+				pg_setup_wait_until_child_is_ready(pgSetup, fpid,
+												   timeout, logLevel);
 
 			/*
 			 * If Postgres failed to start the least we can do is log the
@@ -7,12 +7,18 @@
  *
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #include "cli_common.h"
 #include "cli_root.h"
 #include "defaults.h"
@@ -33,6 +39,30 @@
 
 static bool shutdownSequenceInProgress = false;
 
+/*
+ * On Linux we hold a pidfd for the postmaster, so that we wake up as soon as
+ * it exits rather than at the next 100ms tick.
+ */
+typedef struct PostmasterWatch
+{
+	pid_t pid;
+	int pidfd;
+} PostmasterWatch;
+
+static PostmasterWatch postmasterWatch = { 0, -1 };
+
+/*
+ * The keeper writes to a named pipe each time it updates the Postgres
+ * expected status file, so that we act on its orders right away. When the
+ * status is ensured and we watch the postmaster with a pidfd, nothing else
+ * needs our attention and we only wake-up once in a while.
+ */
+#define POSTGRES_CTL_IDLE_TIMEOUT_MS 1000
+
+static int postgresStateFifo = -1;
+
+static void service_postgres_ctl_wait(pid_t pid, int timeoutMs, bool idle);
+
 static bool ensure_postgres_status(LocalPostgresServer *postgres,
 								   Service *service);
 
@@ -256,6 +286,28 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 					char *verb = WIFEXITED(status) ? "exited" : "failed";
 					log_debug("waitpid(): process %d has %s", pid, verb);
 				}
+				else if (pgStatus->pgExpectedStatus == PG_EXPECTED_STATUS_RUNNING ||
+						 pgStatus->pgExpectedStatus ==
+						 PG_EXPECTED_STATUS_RUNNING_AS_SUBPROCESS)
+				{
+					/*
+					 * We have been woken up by the postmaster exit, and the
+					 * rest of this loop restarts Postgres right away, without
+					 * waiting for the keeper to notice.
+					 */
+					if (WIFSIGNALED(status))
+					{
+						log_error("Postgres pid %d was terminated by signal %s, "
+								  "restarting now",
+								  pid, signal_to_string(WTERMSIG(status)));
+					}
+					else
+					{
+						log_error("Postgres pid %d exited with code %d, "
+								  "restarting now",
+								  pid, WEXITSTATUS(status));
+					}
+				}
 
 				/*
 				 * Postgres is not running anymore, the rest of the code will
@@ -291,6 +343,12 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 
 				log_trace("Reading current postgres expected status from \"%s\"",
 						  localStatus->pgStatusPath);
+
+				if (postgresStateFifo < 0)
+				{
+					postgresStateFifo =
+						keeper_postgres_state_open_fifo(localStatus->pgStatusPath);
+				}
 			}
 		}
 		else if (!pgStatusPathIsReady)
@@ -338,10 +396,18 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 		 * Adding to that, during the `pg_autoctl create postgres` phase we
 		 * also need to start Postgres and sometimes even restart it.
 		 */
+		bool idle = false;
+
 		if (pgStatusPathIsReady && file_exists(localStatus->pgStatusPath))
 		{
 			const char *filename = localStatus->pgStatusPath;
 
+			/* we're about to read the file, forget about past updates */
+			if (postgresStateFifo >= 0)
+			{
+				(void) keeper_postgres_state_drain_fifo(postgresStateFifo);
+			}
+
 			if (!keeper_postgres_state_read(pgStatus, filename))
 			{
 				/* errors have already been logged, will try again */
@@ -353,13 +419,91 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 					  ExpectedPostgresStatusToString(pgStatus->pgExpectedStatus),
 					  filename);
 
-			if (!ensure_postgres_status(postgres, &postgresService))
+			if (ensure_postgres_status(postgres, &postgresService))
+			{
+				idle = true;
+			}
+			else
 			{
 				pgStatusPathIsReady = false;
 			}
 		}
 
-		pg_usleep(100 * 1000);  /* 100ms */
+		pid_t postmasterPid =
+			pgSetup->pidFile.pid > 0 ? pgSetup->pidFile.pid : postgresService.pid;
+
+		(void) service_postgres_ctl_wait(postmasterPid, 100, idle);
+	}
+}
+
+
+/*
+ * service_postgres_ctl_wait waits for timeoutMs milliseconds, or until the
+ * given postmaster pid exits, or until the keeper updates the Postgres
+ * expected status file, whichever comes first. When idle is true and both
+ * the postmaster and the keeper can wake us up, we wait for up to
+ * POSTGRES_CTL_IDLE_TIMEOUT_MS instead.
+ *
+ * We open a pidfd for the postmaster the first time we wait for it, and keep
+ * it around until the pid changes. Once the postmaster has exited, the pidfd
+ * stays readable, so we close it then and only sleep until the pid changes.
+ * When pidfd_open() is not available, we only watch the keeper.
+ */
+static void
+service_postgres_ctl_wait(pid_t pid, int timeoutMs, bool idle)
+{
+	if (pid != postmasterWatch.pid)
+	{
+		if (postmasterWatch.pidfd >= 0)
+		{
+			close(postmasterWatch.pidfd);
+		}
+
+		postmasterWatch.pid = pid;
+		postmasterWatch.pidfd = -1;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+		if (pid > 0)
+		{
+			postmasterWatch.pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+			if (postmasterWatch.pidfd < 0 && errno != ENOSYS)
+			{
+				log_debug("Failed to open a pidfd for Postgres pid %d: %m", pid);
+			}
+		}
+#endif
+	}
+
+	struct pollfd pfds[2] = {
+		{ .fd = postgresStateFifo, .events = POLLIN },
+		{ .fd = postmasterWatch.pidfd, .events = POLLIN }
+	};
+
+	if (idle && postgresStateFifo >= 0 && postmasterWatch.pidfd >= 0)
+	{
+		timeoutMs = POSTGRES_CTL_IDLE_TIMEOUT_MS;
+	}
+
+	if (postgresStateFifo < 0 && postmasterWatch.pidfd < 0)
+	{
+		pg_usleep(timeoutMs * 1000);
+		return;
+	}
+
+	/* poll(2) ignores the entries with a negative file descriptor */
+	int ready = poll(pfds, 2, timeoutMs);
+
+	if (ready > 0 && (pfds[1].revents & POLLIN))
+	{
+		log_debug("Postgres pid %d has exited", pid);
+
+		close(postmasterWatch.pidfd);
+		postmasterWatch.pidfd = -1;
+	}
+	else if (ready < 0 && errno != EINTR)
+	{
+		log_debug("Failed to poll for the Postgres controller events: %m");
 	}
 }
 
@@ -0,0 +1,375 @@
+/*
+ * src/bin/pg_autoctl/ssl_utils.c
+ *   Utility functions for creating SSL keys and certificates in process.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "log.h"
+#include "ssl_utils.h"
+
+#ifdef USE_OPENSSL
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+static EVP_PKEY * ssl_generate_key(void);
+static X509 * ssl_build_self_signed_cert(EVP_PKEY *pkey, const char *commonName);
+static bool ssl_add_extension(X509 *cert, int nid, const char *value);
+static bool ssl_write_key(const char *keyFile, EVP_PKEY *pkey);
+static bool ssl_write_cert(const char *certFile, X509 *cert);
+static void ssl_log_error(const char *message);
+
+
+/*
+ * ssl_create_self_signed_cert creates a private key and a self-signed
+ * certificate for the given common name, and writes them in PEM format in
+ * keyFile and certFile. The private key file is only readable by its owner,
+ * as Postgres requires.
+ *
+ * This uses the OpenSSL library that libpq is linked with, rather than the
+ * openssl command line tool, which is not always installed. The key is an
+ * ECDSA key on the P-256 curve: it is much faster to generate than an RSA
+ * key of the same strength, and all the TLS versions that Postgres supports
+ * can use it. As with openssl req -x509, the certificate is also a CA
+ * certificate, so that clients may use it as their root certificate.
+ */
+bool
+ssl_create_self_signed_cert(const char *keyFile,
+							const char *certFile,
+							const char *commonName)
+{
+	EVP_PKEY *pkey = ssl_generate_key();
+
+	if (pkey == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	X509 *cert = ssl_build_self_signed_cert(pkey, commonName);
+
+	if (cert == NULL)
+	{
+		/* errors have already been logged */
+		EVP_PKEY_free(pkey);
+		return false;
+	}
+
+	bool success =
+		ssl_write_key(keyFile, pkey) &&
+		ssl_write_cert(certFile, cert);
+
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+
+	return success;
+}
+
+
+/*
+ * ssl_generate_key generates a new ECDSA private key on the P-256 curve.
+ */
+static EVP_PKEY *
+ssl_generate_key(void)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+
+	if (ctx == NULL)
+	{
+		ssl_log_error("Failed to allocate an EC key generation context");
+		return NULL;
+	}
+
+	if (EVP_PKEY_keygen_init(ctx) <= 0 ||
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0 ||
+		EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) <= 0 ||
+		EVP_PKEY_keygen(ctx, &pkey) <= 0)
+	{
+		ssl_log_error("Failed to generate an ECDSA private key");
+		EVP_PKEY_CTX_free(ctx);
+		return NULL;
+	}
+
+	EVP_PKEY_CTX_free(ctx);
+
+	return pkey;
+}
+
+
+/*
+ * ssl_build_self_signed_cert builds an X509 v3 certificate for the given
+ * common name, valid for SSL_SELF_SIGNED_CERT_DAYS days from now, with a
+ * random serial number, and signs it with the given key.
+ */
+static X509 *
+ssl_build_self_signed_cert(EVP_PKEY *pkey, const char *commonName)
+{
+	X509 *cert = X509_new();
+
+	if (cert == NULL)
+	{
+		ssl_log_error("Failed to allocate a certificate");
+		return NULL;
+	}
+
+	/* version 3 certificates are numbered 2 */
+	if (X509_set_version(cert, 2) != 1)
+	{
+		ssl_log_error("Failed to set the certificate version");
+		X509_free(cert);
+		return NULL;
+	}
+
+	/* use a random positive 127 bits serial number, as openssl req does */
+	unsigned char serialBytes[16] = { 0 };
+
+	if (RAND_bytes(serialBytes, sizeof(serialBytes)) != 1)
+	{
+		ssl_log_error("Failed to generate a certificate serial number");
+		X509_free(cert);
+		return NULL;
+	}
+
+	serialBytes[0] &= 0x7f;
+
+	BIGNUM *serial = BN_bin2bn(serialBytes, sizeof(serialBytes), NULL);
+
+	if (serial == NULL ||
+		BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(cert)) == NULL)
+	{
+		ssl_log_error("Failed to set the certificate serial number");
+		BN_free(serial);
+		X509_free(cert);
+		return NULL;
+	}
+
+	BN_free(serial);
+
+	long validity = (long) SSL_SELF_SIGNED_CERT_DAYS * 24 * 60 * 60;
+
+	if (X509_gmtime_adj(X509_getm_notBefore(cert), 0) == NULL ||
+		X509_gmtime_adj(X509_getm_notAfter(cert), validity) == NULL)
+	{
+		ssl_log_error("Failed to set the certificate validity period");
+		X509_free(cert);
+		return NULL;
+	}
+
+	/* a self-signed certificate is its own issuer */
+	X509_NAME *name = X509_get_subject_name(cert);
+
+	if (X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8,
+								   (const unsigned char *) commonName,
+								   -1, -1, 0) != 1 ||
+		X509_set_issuer_name(cert, name) != 1)
+	{
+		ssl_log_error("Failed to set the certificate subject");
+		X509_free(cert);
+		return NULL;
+	}
+
+	if (X509_set_pubkey(cert, pkey) != 1)
+	{
+		ssl_log_error("Failed to set the certificate public key");
+		X509_free(cert);
+		return NULL;
+	}
+
+	/* the extensions that openssl req -x509 adds by default (v3_ca) */
+	if (!ssl_add_extension(cert, NID_subject_key_identifier, "hash") ||
+		!ssl_add_extension(cert, NID_authority_key_identifier,
+						   "keyid:always") ||
+		!ssl_add_extension(cert, NID_basic_constraints, "critical,CA:TRUE"))
+	{
+		/* errors have already been logged */
+		X509_free(cert);
+		return NULL;
+	}
+
+	if (X509_sign(cert, pkey, EVP_sha256()) == 0)
+	{
+		ssl_log_error("Failed to sign the certificate");
+		X509_free(cert);
+		return NULL;
+	}
+
+	return cert;
+}
+
+
+/*
+ * ssl_add_extension adds an X509 v3 extension given in the openssl
+ * configuration file syntax to a self-signed certificate.
+ */
+static bool
+ssl_add_extension(X509 *cert, int nid, const char *value)
+{
+	X509V3_CTX ctx;
+
+	X509V3_set_ctx_nodb(&ctx);
+	X509V3_set_ctx(&ctx, cert, cert, NULL, NULL, 0);
+
+	X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &ctx, nid, (char *) value);
+
+	if (ext == NULL)
+	{
+		ssl_log_error("Failed to prepare a certificate extension");
+		return false;
+	}
+
+	int ret = X509_add_ext(cert, ext, -1);
+
+	X509_EXTENSION_free(ext);
+
+	if (ret != 1)
+	{
+		ssl_log_error("Failed to add a certificate extension");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * ssl_write_key writes the private key in PEM format to keyFile. The file is
+ * created with 0600 permissions so that the key is never readable by other
+ * users, not even for a short while.
+ */
+static bool
+ssl_write_key(const char *keyFile, EVP_PKEY *pkey)
+{
+	int fd = open(keyFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+	if (fd < 0)
+	{
+		log_error("Failed to create file \"%s\": %m", keyFile);
+		return false;
+	}
+
+	/* the file might have existed before with other permissions */
+	if (fchmod(fd, S_IRUSR | S_IWUSR) != 0)
+	{
+		log_error("Failed to chmod og-rwx \"%s\": %m", keyFile);
+		close(fd);
+		return false;
+	}
+
+	FILE *file = fdopen(fd, "w");
+
+	if (file == NULL)
+	{
+		log_error("Failed to open file \"%s\": %m", keyFile);
+		close(fd);
+		return false;
+	}
+
+	if (PEM_write_PrivateKey(file, pkey, NULL, NULL, 0, NULL, NULL) != 1)
+	{
+		ssl_log_error("Failed to write the private key");
+		fclose(file);
+		return false;
+	}
+
+	if (fclose(file) != 0)
+	{
+		log_error("Failed to write file \"%s\": %m", keyFile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * ssl_write_cert writes the certificate in PEM format to certFile.
+ */
+static bool
+ssl_write_cert(const char *certFile, X509 *cert)
+{
+	FILE *file = fopen(certFile, "w");
+
+	if (file == NULL)
+	{
+		log_error("Failed to open file \"%s\": %m", certFile);
+		return false;
+	}
+
+	if (PEM_write_X509(file, cert) != 1)
+	{
+		ssl_log_error("Failed to write the certificate");
+		fclose(file);
+		return false;
+	}
+
+	if (fclose(file) != 0)
+	{
+		log_error("Failed to write file \"%s\": %m", certFile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * ssl_log_error logs the given message along with the errors that the
+ * OpenSSL library queued, and clears its error queue.
+ */
+static void
+ssl_log_error(const char *message)
+{
+	unsigned long code = ERR_get_error();
+
+	if (code == 0)
+	{
+		log_error("%s", message);
+		return;
+	}
+
+	for (; code != 0; code = ERR_get_error())
+	{
+		char buf[256] = { 0 };
+
+		ERR_error_string_n(code, buf, sizeof(buf));
+		log_error("%s: %s", message, buf);
+	}
+}
+
+
+#else /* !USE_OPENSSL */
+
+
+/*
+ * Without OpenSSL support in Postgres we can't use SSL anyway.
+ */
+bool
+ssl_create_self_signed_cert(const char *keyFile,
+							const char *certFile,
+							const char *commonName)
+{
+	log_error("Failed to create a self-signed certificate: "
+			  "Postgres has been built without OpenSSL support");
+	return false;
+}
+
+
+#endif /* USE_OPENSSL */
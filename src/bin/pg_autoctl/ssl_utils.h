@@ -0,0 +1,22 @@
+/*
+ * src/bin/pg_autoctl/ssl_utils.h
+ *   Utility functions for creating SSL keys and certificates in process.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SSL_UTILS_H
+#define SSL_UTILS_H
+
+#include "postgres_fe.h"
+
+/* validity of the self-signed certificates we create, as openssl req does */
+#define SSL_SELF_SIGNED_CERT_DAYS 365
+
+bool ssl_create_self_signed_cert(const char *keyFile,
+								 const char *certFile,
+								 const char *commonName);
+
+#endif /* SSL_UTILS_H */
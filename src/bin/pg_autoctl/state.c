@@ -7,6 +7,7 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -29,12 +30,37 @@
 #include "pgsetup.h"
 #include "pgsql.h"
 #include "state.h"
+#include "string_utils.h"
 
 static bool keeper_state_is_readable(int pg_autoctl_state_version);
+static bool keeper_state_needs_write(KeeperStateData *keeperState,
+									 const char *filename);
+static bool keeper_state_equals_ignoring_volatile(KeeperStateData *a,
+												  KeeperStateData *b);
+static void fsync_parent_directory(const char *filename);
+
+/*
+ * We keep a copy of the last state that we wrote, with the identity of the
+ * file we wrote it to, to avoid writing the same contents again.
+ */
+typedef struct KeeperStateLastWrite
+{
+	bool valid;
+	char filename[MAXPGPATH];
+	KeeperStateData state;
+	uint64_t writeTime;
+	dev_t st_dev;
+	ino_t st_ino;
+} KeeperStateLastWrite;
+
+static KeeperStateLastWrite keeperStateLastWrite = { 0 };
 static bool keeper_init_state_write(KeeperStateInit *initState,
 									const char *filename);
 static bool keeper_postgres_state_write(KeeperStatePostgres *pgStatus,
 										const char *filename);
+static void keeper_postgres_state_fifo_path(const char *filename,
+											char *fifoPath);
+static void keeper_postgres_state_notify(const char *filename);
 
 
 /*
@@ -91,6 +117,8 @@ keeper_state_is_readable(int pg_autoctl_state_version)
  * The KeeperState data structure contains only direct values (int, long), not
  * a single pointer, so writing to disk is a single fwrite() instruction.
  *
+ * We skip writing the file when its contents would not change, see
+ * keeper_state_needs_write().
  */
 bool
 keeper_state_write(KeeperStateData *keeperState, const char *filename)
@@ -98,6 +126,15 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 	char buffer[PG_AUTOCTL_KEEPER_STATE_FILE_SIZE];
 	char tempFileName[MAXPGPATH];
 
+	if (!keeper_state_needs_write(keeperState, filename))
+	{
+		log_trace("Skipping write of unchanged state to \"%s\"", filename);
+		return true;
+	}
+
+	/* in case of errors, we want to write the file again next time */
+	keeperStateLastWrite.valid = false;
+
 	/* we're going to write our contents to keeper.state.new first */
 	sformat(tempFileName, MAXPGPATH, "%s.new", filename);
 
@@ -181,10 +218,124 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 		return false;
 	}
 
+	/* make the rename itself durable */
+	(void) fsync_parent_directory(filename);
+
+	struct stat st;
+
+	if (stat(filename, &st) == 0)
+	{
+		keeperStateLastWrite.valid = true;
+		keeperStateLastWrite.state = *keeperState;
+		keeperStateLastWrite.writeTime = time(NULL);
+		keeperStateLastWrite.st_dev = st.st_dev;
+		keeperStateLastWrite.st_ino = st.st_ino;
+		strlcpy(keeperStateLastWrite.filename, filename, MAXPGPATH);
+	}
+
 	return true;
 }
 
 
+/*
+ * keeper_state_needs_write returns false when the given state is the same as
+ * the one we wrote last to the same file, that is still in place.
+ *
+ * The contact timestamps and the xlog lag are updated at every keeper loop.
+ * They are only used for network partition detection, where the in-memory
+ * values are authoritative, and for display. When only those fields changed,
+ * we write the file at most every
+ * PG_AUTOCTL_KEEPER_STATE_VOLATILE_WRITE_INTERVAL seconds.
+ */
+static bool
+keeper_state_needs_write(KeeperStateData *keeperState, const char *filename)
+{
+	KeeperStateLastWrite *last = &keeperStateLastWrite;
+
+	if (!last->valid || strcmp(last->filename, filename) != 0)
+	{
+		return true;
+	}
+
+	/* another process might have written the file since our last write */
+	struct stat st;
+
+	if (stat(filename, &st) != 0 ||
+		st.st_dev != last->st_dev ||
+		st.st_ino != last->st_ino)
+	{
+		return true;
+	}
+
+	if (memcmp(keeperState, &(last->state), sizeof(KeeperStateData)) == 0)
+	{
+		return false;
+	}
+
+	if (keeper_state_equals_ignoring_volatile(keeperState, &(last->state)))
+	{
+		uint64_t now = time(NULL);
+
+		return (now - last->writeTime) >=
+			   PG_AUTOCTL_KEEPER_STATE_VOLATILE_WRITE_INTERVAL;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_state_equals_ignoring_volatile compares two keeper states, except
+ * for the fields that change at every keeper loop.
+ */
+static bool
+keeper_state_equals_ignoring_volatile(KeeperStateData *a, KeeperStateData *b)
+{
+	KeeperStateData left = *a;
+	KeeperStateData right = *b;
+
+	left.last_monitor_contact = right.last_monitor_contact = 0;
+	left.last_secondary_contact = right.last_secondary_contact = 0;
+	left.xlog_lag = right.xlog_lag = 0;
+
+	return memcmp(&left, &right, sizeof(KeeperStateData)) == 0;
+}
+
+
+/*
+ * fsync_parent_directory fsyncs the directory that contains the given file,
+ * so that a rename() to that file survives a crash.
+ */
+static void
+fsync_parent_directory(const char *filename)
+{
+	char dirname[MAXPGPATH] = { 0 };
+
+	strlcpy(dirname, filename, MAXPGPATH);
+	get_parent_directory(dirname);
+
+	if (dirname[0] == '\0')
+	{
+		strlcpy(dirname, ".", MAXPGPATH);
+	}
+
+	int fd = open(dirname, O_RDONLY, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to open directory \"%s\": %m", dirname);
+		return;
+	}
+
+	if (fsync(fd) != 0)
+	{
+		log_debug("Failed to fsync directory \"%s\": %m", dirname);
+	}
+
+	close(fd);
+}
+
+
 /*
  * keeper_state_init initializes a new state structure with default values.
  */
@@ -493,6 +644,67 @@ NodeStateToString(NodeState s)
 }
 
 
+/*
+ * NodeStateFromString uses a perfect hash of the state names: the seeded
+ * FNV-1a hash below sends each of them to its own slot of a 64 entries
+ * table, so that we need a single strcmp() to parse a state name. When
+ * adding a state, pick a NODE_STATE_HASH_SEED that still has no collisions.
+ */
+#define NODE_STATE_HASH_SEED 5
+#define NODE_STATE_HASH_BITS 6
+
+typedef struct NodeStateName
+{
+	const char *name;
+	NodeState state;
+} NodeStateName;
+
+/* *INDENT-OFF* */
+static const NodeStateName NodeStateHashTable[1 << NODE_STATE_HASH_BITS] = {
+	[3] = { "prepare_promotion", PREP_PROMOTION_STATE },
+	[4] = { "wait_maintenance", WAIT_MAINTENANCE_STATE },
+	[7] = { "draining", DRAINING_STATE },
+	[9] = { "primary", PRIMARY_STATE },
+	[10] = { "apply_settings", APPLY_SETTINGS_STATE },
+	[12] = { "catchingup", CATCHINGUP_STATE },
+	[14] = { "wait_primary", WAIT_PRIMARY_STATE },
+	[23] = { "demote_timeout", DEMOTE_TIMEOUT_STATE },
+	[25] = { "init", INIT_STATE },
+	[28] = { "fast_forward", FAST_FORWARD_STATE },
+	[29] = { "dropped", DROPPED_STATE },
+	[31] = { "demoted", DEMOTED_STATE },
+	[35] = { "maintenance", MAINTENANCE_STATE },
+	[40] = { "unknown", NO_STATE },
+	[43] = { "join_primary", JOIN_PRIMARY_STATE },
+	[51] = { "single", SINGLE_STATE },
+	[55] = { "join_secondary", JOIN_SECONDARY_STATE },
+	[56] = { "stop_replication", STOP_REPLICATION_STATE },
+	[59] = { "prepare_maintenance", PREPARE_MAINTENANCE_STATE },
+	[60] = { "wait_standby", WAIT_STANDBY_STATE },
+	[61] = { "report_lsn", REPORT_LSN_STATE },
+	[62] = { "secondary", SECONDARY_STATE },
+};
+/* *INDENT-ON* */
+
+
+/*
+ * node_state_hash returns the NodeStateHashTable slot of the given name.
+ */
+static uint32_t
+node_state_hash(const char *str)
+{
+	uint32_t hash = NODE_STATE_HASH_SEED;
+
+	for (const unsigned char *ptr = (const unsigned char *) str; *ptr; ptr++)
+	{
+		hash ^= *ptr;
+		hash *= 16777619;
+	}
+
+	return hash >> (32 - NODE_STATE_HASH_BITS);
+}
+
+
 /*
  * NodeStateFromString converts a string representation of a node state into
  * the corresponding internal ENUM value.
@@ -500,99 +712,14 @@ NodeStateToString(NodeState s)
 NodeState
 NodeStateFromString(const char *str)
 {
-	if (strcmp(str, "unknown") == 0)
-	{
-		return NO_STATE;
-	}
-	else if (strcmp(str, "init") == 0)
-	{
-		return INIT_STATE;
-	}
-	else if (strcmp(str, "single") == 0)
-	{
-		return SINGLE_STATE;
-	}
-	else if (strcmp(str, "primary") == 0)
-	{
-		return PRIMARY_STATE;
-	}
-	else if (strcmp(str, "wait_primary") == 0)
-	{
-		return WAIT_PRIMARY_STATE;
-	}
-	else if (strcmp(str, "wait_standby") == 0)
-	{
-		return WAIT_STANDBY_STATE;
-	}
-	else if (strcmp(str, "demoted") == 0)
-	{
-		return DEMOTED_STATE;
-	}
-	else if (strcmp(str, "demote_timeout") == 0)
-	{
-		return DEMOTE_TIMEOUT_STATE;
-	}
-	else if (strcmp(str, "draining") == 0)
-	{
-		return DRAINING_STATE;
-	}
-	else if (strcmp(str, "secondary") == 0)
-	{
-		return SECONDARY_STATE;
-	}
-	else if (strcmp(str, "catchingup") == 0)
-	{
-		return CATCHINGUP_STATE;
-	}
-	else if (strcmp(str, "prepare_promotion") == 0)
-	{
-		return PREP_PROMOTION_STATE;
-	}
-	else if (strcmp(str, "stop_replication") == 0)
-	{
-		return STOP_REPLICATION_STATE;
-	}
-	else if (strcmp(str, "maintenance") == 0)
-	{
-		return MAINTENANCE_STATE;
-	}
-	else if (strcmp(str, "join_primary") == 0)
-	{
-		return JOIN_PRIMARY_STATE;
-	}
-	else if (strcmp(str, "apply_settings") == 0)
-	{
-		return APPLY_SETTINGS_STATE;
-	}
-	else if (strcmp(str, "prepare_maintenance") == 0)
-	{
-		return PREPARE_MAINTENANCE_STATE;
-	}
-	else if (strcmp(str, "wait_maintenance") == 0)
-	{
-		return WAIT_MAINTENANCE_STATE;
-	}
-	else if (strcmp(str, "report_lsn") == 0)
-	{
-		return REPORT_LSN_STATE;
-	}
-	else if (strcmp(str, "fast_forward") == 0)
-	{
-		return FAST_FORWARD_STATE;
-	}
-	else if (strcmp(str, "join_secondary") == 0)
-	{
-		return JOIN_SECONDARY_STATE;
-	}
-	else if (strcmp(str, "dropped") == 0)
-	{
-		return DROPPED_STATE;
-	}
-	else
+	const NodeStateName *entry = &(NodeStateHashTable[node_state_hash(str)]);
+
+	if (entry->name != NULL && strcmp(entry->name, str) == 0)
 	{
-		log_fatal("Failed to parse state string \"%s\"", str);
-		return NO_STATE;
+		return entry->state;
 	}
+
+	log_fatal("Failed to parse state string \"%s\"", str);
 	return NO_STATE;
 }
 
@@ -1006,10 +1133,108 @@ keeper_postgres_state_write(KeeperStatePostgres *pgStatus,
 
 	close(fd);
 
+	/* now that the file is safe on-disk, wake-up the Postgres controller */
+	(void) keeper_postgres_state_notify(filename);
+
 	return true;
 }
 
 
+/*
+ * keeper_postgres_state_fifo_path computes the path of the named pipe that
+ * goes with the given Postgres expected status file.
+ */
+static void
+keeper_postgres_state_fifo_path(const char *filename, char *fifoPath)
+{
+	sformat(fifoPath, MAXPGPATH, "%s%s",
+			filename, KEEPER_POSTGRES_STATE_FIFO_SUFFIX);
+}
+
+
+/*
+ * keeper_postgres_state_notify writes a single byte to the named pipe that
+ * the Postgres controller listens to, so that it reads the Postgres expected
+ * status file again right away.
+ *
+ * The expected status file remains the source of truth: when the controller
+ * is not running, or the pipe is full already, there is nothing to do. The
+ * controller reads the file when it starts, and from time to time anyway.
+ */
+static void
+keeper_postgres_state_notify(const char *filename)
+{
+	char fifoPath[MAXPGPATH] = { 0 };
+
+	(void) keeper_postgres_state_fifo_path(filename, fifoPath);
+
+	/* ENOENT and ENXIO mean that the controller is not listening */
+	int fd = open(fifoPath, O_WRONLY | O_NONBLOCK);
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	if (write(fd, "!", 1) != 1 && errno != EAGAIN)
+	{
+		log_debug("Failed to notify the Postgres controller at \"%s\": %m",
+				  fifoPath);
+	}
+
+	close(fd);
+}
+
+
+/*
+ * keeper_postgres_state_open_fifo creates if needed and opens the named pipe
+ * that goes with the given Postgres expected status file, and returns the
+ * file descriptor, or -1 when the pipe can't be used.
+ *
+ * We open the pipe for reading and writing, so that it always has a writer
+ * and poll() doesn't report an end-of-file each time the keeper closes it.
+ */
+int
+keeper_postgres_state_open_fifo(const char *filename)
+{
+	char fifoPath[MAXPGPATH] = { 0 };
+
+	(void) keeper_postgres_state_fifo_path(filename, fifoPath);
+
+	if (mkfifo(fifoPath, S_IRUSR | S_IWUSR) != 0 && errno != EEXIST)
+	{
+		log_debug("Failed to create fifo \"%s\": %m", fifoPath);
+		return -1;
+	}
+
+	int fd = open(fifoPath, O_RDWR | O_NONBLOCK);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to open fifo \"%s\": %m", fifoPath);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/*
+ * keeper_postgres_state_drain_fifo reads all the pending notifications from
+ * the given named pipe file descriptor.
+ */
+void
+keeper_postgres_state_drain_fifo(int fd)
+{
+	char buffer[BUFSIZE];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0)
+	{
+		/* the notifications carry no data */
+	}
+}
+
+
 /*
  * keeper_postgres_state_read reads the information kept in the keeper postgres
  * file.
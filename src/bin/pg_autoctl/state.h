@@ -24,6 +24,13 @@
  */
 #define PG_AUTOCTL_KEEPER_STATE_FILE_SIZE 1024
 
+/*
+ * The keeper state is written at every keeper loop, and most of the time only
+ * the contact timestamps and the lag have changed. Such changes are written
+ * at most this often, in seconds.
+ */
+#define PG_AUTOCTL_KEEPER_STATE_VOLATILE_WRITE_INTERVAL 5
+
 
 /*
  * The keeper State Machine handle the following possible states:
@@ -57,6 +64,9 @@ typedef enum
 	ANY_STATE = 128
 } NodeState;
 
+/* the number of NodeState values, not counting ANY_STATE */
+#define NODE_STATE_COUNT (DROPPED_STATE + 1)
+
 #define MAX_NODE_STATE_LEN 19   /* "prepare_maintenance" */
 
 /*
@@ -238,6 +248,8 @@ bool keeper_postgres_state_update(KeeperStatePostgres *pgStatus,
 								  const char *filename);
 bool keeper_postgres_state_read(KeeperStatePostgres *pgStatus,
 								const char *filename);
+int keeper_postgres_state_open_fifo(const char *filename);
+void keeper_postgres_state_drain_fifo(int fd);
 
 
 #endif /* STATE_H */
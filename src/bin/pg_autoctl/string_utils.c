@@ -495,6 +495,71 @@ IntervalToString(double seconds, char *buffer, size_t size)
 }
 
 
+/*
+ * BytesToString prepares a string buffer to represent a given amount of bytes
+ * in a human readable way, using the same units as Postgres pg_size_pretty.
+ */
+bool
+BytesToString(uint64_t bytes, char *buffer, size_t size)
+{
+	const char *units[] = { "bytes", "kB", "MB", "GB", "TB", "PB" };
+	int unitCount = sizeof(units) / sizeof(units[0]);
+
+	double value = (double) bytes;
+	int unit = 0;
+
+	while (value >= 1024.0 && unit < (unitCount - 1))
+	{
+		value /= 1024.0;
+		++unit;
+	}
+
+	if (unit == 0)
+	{
+		sformat(buffer, size, "%llu %s", (unsigned long long) bytes, units[0]);
+	}
+	else
+	{
+		sformat(buffer, size, "%.1f %s", value, units[unit]);
+	}
+
+	return true;
+}
+
+
+/*
+ * nextArrayElement copies the next element of a one-dimension Postgres array
+ * literal of numbers or LSNs, such as "{1,NULL,3}", and advances the cursor.
+ */
+bool
+nextArrayElement(const char **cursor, char *value, int size)
+{
+	const char *ptr = *cursor;
+
+	if (*ptr == '{' || *ptr == ',')
+	{
+		++ptr;
+	}
+
+	if (*ptr == '}' || *ptr == '\0')
+	{
+		return false;
+	}
+
+	int length = strcspn(ptr, ",}");
+
+	if (length >= size)
+	{
+		return false;
+	}
+
+	strlcpy(value, ptr, length + 1);
+	*cursor = ptr + length;
+
+	return true;
+}
+
+
 /*
  * splitLines prepares a multi-line error message in a way that calling code
  * can loop around one line at a time and call log_error() or log_warn() on
@@ -36,6 +36,8 @@ bool stringToUInt32(const char *str, uint32_t *number);
 
 bool stringToDouble(const char *str, double *number);
 bool IntervalToString(double seconds, char *buffer, size_t size);
+bool BytesToString(uint64_t bytes, char *buffer, size_t size);
+bool nextArrayElement(const char **cursor, char *value, int size);
 
 int splitLines(char *errorMessage, char **linesArray, int size);
 void processBufferCallback(const char *buffer, bool error);
@@ -7,10 +7,12 @@
  *
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/select.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -33,6 +35,7 @@
 #include "supervisor.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "systemd_notify.h"
 
 static bool supervisor_init(Supervisor *supervisor);
 static SupervisorExitMode supervisor_loop(Supervisor *supervisor);
@@ -58,6 +61,22 @@ static bool supervisor_restart_service(Supervisor *supervisor,
 
 static bool supervisor_may_restart(Service *service);
 
+static void supervisor_catch_child(int sig);
+static void supervisor_wait_for_events(Supervisor *supervisor);
+
+static void supervisor_notify_ready(Supervisor *supervisor);
+
+/*
+ * The supervisor sleeps until a signal is received. SIGCHLD is ignored by
+ * default, we install a handler for it in the supervisor so that a child
+ * process termination interrupts our sleep.
+ */
+static volatile sig_atomic_t supervisor_child_exited = 0;
+
+/* how long to sleep when idle, and when waiting for services to terminate */
+#define SUPERVISOR_IDLE_TIMEOUT_MS 1000
+#define SUPERVISOR_SHUTDOWN_TIMEOUT_MS 100
+
 static bool supervisor_update_pidfile(Supervisor *supervisor);
 
 
@@ -86,6 +105,12 @@ supervisor_start(Service services[], int serviceCount, const char *pidfile)
 		return false;
 	}
 
+	/*
+	 * When started as a systemd notify service, hide the notification socket
+	 * from Postgres before starting any sub-process.
+	 */
+	supervisor.notifyReady = systemd_notify_init();
+
 	/*
 	 * Start all the given services, in order.
 	 *
@@ -194,6 +219,10 @@ supervisor_loop(Supervisor *supervisor)
 	int subprocessCount = supervisor->serviceCount;
 	bool firstLoop = true;
 
+	/* a child process might have exited before we installed our handler */
+	supervisor_child_exited = 1;
+	pqsignal(SIGCHLD, supervisor_catch_child);
+
 	/* wait until all subprocesses are done */
 	while (subprocessCount > 0)
 	{
@@ -211,17 +240,26 @@ supervisor_loop(Supervisor *supervisor)
 			(void) supervisor_reload_services(supervisor);
 		}
 
+		/* tell systemd when all our services are ready */
+		if (supervisor->notifyReady &&
+			!supervisor->ready &&
+			!supervisor->shutdownSequenceInProgress)
+		{
+			(void) supervisor_notify_ready(supervisor);
+		}
+
 		if (firstLoop)
 		{
 			firstLoop = false;
 		}
 		else
 		{
-			/* avoid busy looping on waitpid(WNOHANG) */
-			pg_usleep(100 * 1000); /* 100 ms */
+			/* sleep until a signal is received, or a child process exits */
+			(void) supervisor_wait_for_events(supervisor);
 		}
 
 		/* ignore errors */
+		supervisor_child_exited = 0;
 		pid = waitpid(-1, &status, WNOHANG);
 
 		switch (pid)
@@ -284,6 +322,9 @@ supervisor_loop(Supervisor *supervisor)
 				/* one child process is no more */
 				--subprocessCount;
 
+				/* other child processes might have exited too */
+				supervisor_child_exited = 1;
+
 				/* apply the service restart policy */
 				if (supervisor_restart_service(supervisor, dead, status))
 				{
@@ -300,6 +341,106 @@ supervisor_loop(Supervisor *supervisor)
 }
 
 
+/*
+ * supervisor_notify_ready sends READY=1 to systemd when the readyFunction of
+ * every service returns true. Services without a readyFunction are ready as
+ * soon as they are started.
+ */
+static void
+supervisor_notify_ready(Supervisor *supervisor)
+{
+	for (int serviceIndex = 0; serviceIndex < supervisor->serviceCount; serviceIndex++)
+	{
+		Service *service = &(supervisor->services[serviceIndex]);
+
+		if (service->readyFunction != NULL &&
+			!(*service->readyFunction)(service->context))
+		{
+			log_trace("supervisor_notify_ready: %s is not ready yet",
+					  service->name);
+			return;
+		}
+	}
+
+	if (systemd_notify("READY=1\nSTATUS=pg_autoctl services are running"))
+	{
+		log_info("Notified systemd that pg_autoctl services are ready");
+	}
+
+	/* never try again, even when we failed to notify systemd */
+	supervisor->ready = true;
+}
+
+
+/*
+ * supervisor_catch_child receives the SIGCHLD signal.
+ */
+static void
+supervisor_catch_child(int sig)
+{
+	supervisor_child_exited = 1;
+}
+
+
+/*
+ * supervisor_wait_for_events sleeps until either a signal is received or a
+ * child process exits. We block signals while checking our flags, and
+ * pselect() atomically unblocks them, so that we never miss a signal that
+ * would be received just before going to sleep.
+ *
+ * We still wake-up from time to time, to check that we own our pidfile, and
+ * more often when in the shutdown sequence, which counts the loops.
+ */
+static void
+supervisor_wait_for_events(Supervisor *supervisor)
+{
+	sigset_t mask;
+	sigset_t origMask;
+
+	int timeoutMs =
+		supervisor->shutdownSequenceInProgress
+		? SUPERVISOR_SHUTDOWN_TIMEOUT_MS
+		: SUPERVISOR_IDLE_TIMEOUT_MS;
+
+	struct timespec timeout = {
+		.tv_sec = timeoutMs / 1000,
+		.tv_nsec = (timeoutMs % 1000) * 1000 * 1000
+	};
+
+	if (!block_signals(&mask, &origMask))
+	{
+		/* errors have already been logged */
+		pg_usleep(SUPERVISOR_SHUTDOWN_TIMEOUT_MS * 1000);
+		return;
+	}
+
+	sigset_t childMask;
+
+	sigemptyset(&childMask);
+	sigaddset(&childMask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &childMask, NULL);
+
+	/* the shutdown sequence resets the signal flags once processed */
+	bool pendingEvents =
+		supervisor_child_exited ||
+		asked_to_reload ||
+		asked_to_stop ||
+		asked_to_stop_fast ||
+		asked_to_quit;
+
+	if (!pendingEvents)
+	{
+		if (pselect(0, NULL, NULL, NULL, &timeout, &origMask) == -1 &&
+			errno != EINTR)
+		{
+			log_debug("Failed to wait for events: pselect: %m");
+		}
+	}
+
+	(void) unblock_signals(&origMask);
+}
+
+
 /*
  * supervisor_find_service loops over the SubProcess array to find given pid and
  * return its entry in the array.
@@ -584,6 +725,11 @@ supervisor_handle_signals(Supervisor *supervisor)
 static void
 supervisor_shutdown_sequence(Supervisor *supervisor)
 {
+	if (supervisor->stoppingLoopCounter == 0 && supervisor->notifyReady)
+	{
+		(void) systemd_notify("STOPPING=1");
+	}
+
 	if (supervisor->stoppingLoopCounter == 1)
 	{
 		log_info("Waiting for subprocesses to terminate.");
@@ -664,6 +810,31 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 		logLevel = LOG_WARN;
 	}
 
+	/*
+	 * An independent service that is done, or that can't run, quits on its
+	 * own: the other services keep running.
+	 */
+	if (service->policy == RP_INDEPENDENT && WIFEXITED(status))
+	{
+		int returnCode = WEXITSTATUS(status);
+
+		if (returnCode == EXIT_CODE_QUIT ||
+			returnCode == EXIT_CODE_DROPPED ||
+			returnCode == EXIT_CODE_FATAL)
+		{
+			log_level(returnCode == EXIT_CODE_FATAL ? LOG_ERROR : LOG_INFO,
+					  "pg_autoctl service %s exited with exit status %d",
+					  service->name, returnCode);
+
+			if (returnCode != EXIT_CODE_FATAL)
+			{
+				supervisor->exitMode = SUPERVISOR_EXIT_CLEAN;
+			}
+
+			return false;
+		}
+	}
+
 	if (WIFEXITED(status))
 	{
 		int returnCode = WEXITSTATUS(status);
@@ -731,6 +902,12 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 		counters->position = position;
 		counters->startTime[counters->position] = now;
 	}
+	else if (service->policy == RP_INDEPENDENT)
+	{
+		log_error("pg_autoctl service %s has been restarted too often, "
+				  "giving up on it", service->name);
+		return false;
+	}
 	else
 	{
 		/* exit with a non-zero exit code, and process with shutdown sequence */
@@ -775,8 +952,16 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 	 * too.
 	 */
 	log_info("Restarting service %s", service->name);
+
+	/* our services expect the default SIGCHLD disposition */
+	pqsignal(SIGCHLD, SIG_DFL);
+
 	bool restarted = (*service->startFunction)(service->context, &(service->pid));
 
+	/* we might have missed a child process exit in the meantime */
+	pqsignal(SIGCHLD, supervisor_catch_child);
+	supervisor_child_exited = 1;
+
 	if (!restarted)
 	{
 		log_fatal("Failed to restart service %s", service->name);
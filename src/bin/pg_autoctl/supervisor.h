@@ -23,6 +23,8 @@
 #define SERVICE_NAME_POSTGRES "postgres"
 #define SERVICE_NAME_KEEPER "node-active"
 #define SERVICE_NAME_MONITOR "listener"
+#define SERVICE_NAME_METRICS "metrics"
+#define SERVICE_NAME_CONTROL "control"
 
 /*
  * At pg_autoctl create time we use a transient service to initialize our local
@@ -42,12 +44,17 @@
  *
  * - A transient child process is restarted only if it terminates abnormally,
  *   that is, with an exit code other EXIT_CODE_QUIT (zero).
+ *
+ * - An independent child process is restarted like a transient one, and its
+ *   exit never stops the other child processes. That's how a pg_autoctl run
+ *   with several --pgdata options supervises each of its nodes.
  */
 typedef enum
 {
 	RP_PERMANENT = 0,
 	RP_TEMPORARY,
-	RP_TRANSIENT
+	RP_TRANSIENT,
+	RP_INDEPENDENT
 } RestartPolicy;
 
 
@@ -93,6 +100,9 @@ typedef struct RestartCounters
  * seen by the supervisor.
  *
  * In particular, services may be started more than once when they fail.
+ *
+ * When running as a systemd notify service, the supervisor sends READY=1 once
+ * the readyFunction of every service returns true.
  */
 typedef struct Service
 {
@@ -101,6 +111,7 @@ typedef struct Service
 	pid_t pid;                          /* Service PID */
 	bool (*startFunction)(void *context, pid_t *pid);
 	void *context;             /* Service Context (Monitor or Keeper struct) */
+	bool (*readyFunction)(void *context);   /* NULL when always ready */
 	RestartCounters restartCounters;
 } Service;
 
@@ -122,6 +133,8 @@ typedef struct Supervisor
 	bool shutdownSequenceInProgress;
 	int shutdownSignal;
 	int stoppingLoopCounter;
+	bool notifyReady;           /* are we the systemd notify service? */
+	bool ready;                 /* have we sent READY=1 already? */
 } Supervisor;
 
 
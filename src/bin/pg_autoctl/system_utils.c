@@ -16,13 +16,24 @@
 #endif
 
 #include <math.h>
+#include <sys/stat.h>
 
+#include "postgres_fe.h"
+
+#include "defaults.h"
 #include "log.h"
 #include "file_utils.h"
+#include "string_utils.h"
 #include "system_utils.h"
 
 #if defined(__linux__)
+#include <sys/sysmacros.h>
+
 static bool get_system_info_linux(SystemInfo *sysInfo);
+static uint64_t get_cgroup_memory_limit(void);
+static void get_huge_pages_info(SystemInfo *sysInfo);
+static bool read_uint64_from_file(const char *filename, uint64_t *value);
+static bool get_system_usage_linux(SystemUsage *usage);
 #endif
 
 #if defined(__APPLE__) || defined(BSD)
@@ -48,6 +59,126 @@ get_system_info(SystemInfo *sysInfo)
 }
 
 
+/*
+ * get_system_usage samples the host-level CPU, memory, and disk I/O usage
+ * counters, and the load average.
+ */
+bool
+get_system_usage(SystemUsage *usage)
+{
+#if defined(__linux__)
+	return get_system_usage_linux(usage);
+#elif defined(__APPLE__) || defined(BSD)
+
+	/* only the load average is easily available here */
+	double loadAverage[1] = { 0 };
+
+	if (getloadavg(loadAverage, 1) != 1)
+	{
+		log_debug("Failed to get the load average: %m");
+		return false;
+	}
+
+	usage->loadAverage = loadAverage[0];
+
+	return true;
+#else
+	log_debug("Failed to get system usage: "
+			  "Operating System not supported");
+	return false;
+#endif
+}
+
+
+/*
+ * get_process_memory samples the memory used by the given process. On Linux
+ * we read /proc/<pid>/smaps_rollup, and fall back to the VmRSS line of
+ * /proc/<pid>/status on older kernels, where only the resident set size is
+ * then known.
+ */
+bool
+get_process_memory(pid_t pid, ProcessMemory *memory)
+{
+#if defined(__linux__)
+	char filename[MAXPGPATH] = { 0 };
+	char line[BUFSIZE] = { 0 };
+	bool found = false;
+
+	sformat(filename, sizeof(filename), "/proc/%d/smaps_rollup", pid);
+
+	FILE *stream = fopen(filename, "r");
+
+	if (stream != NULL)
+	{
+		uint64_t privateClean = 0;
+		uint64_t privateDirty = 0;
+
+		while (fgets(line, sizeof(line), stream) != NULL)
+		{
+			unsigned long long value = 0;
+
+			if (sscanf(line, "Rss: %llu kB", &value) == 1)
+			{
+				memory->rss = value * 1024;
+				found = true;
+			}
+			else if (sscanf(line, "Pss: %llu kB", &value) == 1)
+			{
+				memory->pss = value * 1024;
+			}
+			else if (sscanf(line, "Private_Clean: %llu kB", &value) == 1)
+			{
+				privateClean = value * 1024;
+			}
+			else if (sscanf(line, "Private_Dirty: %llu kB", &value) == 1)
+			{
+				privateDirty = value * 1024;
+			}
+		}
+
+		fclose(stream);
+
+		memory->private = privateClean + privateDirty;
+
+		if (found)
+		{
+			return true;
+		}
+	}
+
+	sformat(filename, sizeof(filename), "/proc/%d/status", pid);
+
+	stream = fopen(filename, "r");
+
+	if (stream == NULL)
+	{
+		log_debug("Failed to open \"%s\": %m", filename);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), stream) != NULL)
+	{
+		unsigned long long value = 0;
+
+		if (sscanf(line, "VmRSS: %llu kB", &value) == 1)
+		{
+			memory->rss = value * 1024;
+			found = true;
+			break;
+		}
+	}
+
+	fclose(stream);
+
+	return found;
+#else
+	log_debug("Failed to get process memory usage: "
+			  "Operating System not supported");
+	return false;
+#endif
+}
+
+
 /*
  * On Linux, use sysinfo(2) and getnprocs(3)
  */
@@ -64,12 +195,235 @@ get_system_info_linux(SystemInfo *sysInfo)
 	}
 
 	sysInfo->ncpu = get_nprocs();
-	sysInfo->totalram = linuxSysInfo.totalram;
+	sysInfo->physicalram =
+		(uint64_t) linuxSysInfo.totalram * linuxSysInfo.mem_unit;
+	sysInfo->totalram = sysInfo->physicalram;
+
+	/*
+	 * When running in a container, the memory we can use is limited by the
+	 * cgroup rather than by the physical RAM of the host.
+	 */
+	sysInfo->cgroupMemoryLimit = get_cgroup_memory_limit();
+
+	if (sysInfo->cgroupMemoryLimit > 0 &&
+		sysInfo->cgroupMemoryLimit < sysInfo->totalram)
+	{
+		sysInfo->totalram = sysInfo->cgroupMemoryLimit;
+	}
+
+	(void) get_huge_pages_info(sysInfo);
 
 	return true;
 }
 
 
+/*
+ * get_huge_pages_info reads the huge pages counters from /proc/meminfo. When
+ * the file can't be read we leave the counters to zero, as if no huge pages
+ * were reserved on the system.
+ */
+static void
+get_huge_pages_info(SystemInfo *sysInfo)
+{
+	char line[BUFSIZE] = { 0 };
+	uint64_t reserved = 0;
+
+	FILE *stream = fopen("/proc/meminfo", "r");
+
+	if (stream == NULL)
+	{
+		log_debug("Failed to open \"/proc/meminfo\": %m");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), stream) != NULL)
+	{
+		unsigned long long value = 0;
+
+		if (sscanf(line, "HugePages_Total: %llu", &value) == 1)
+		{
+			sysInfo->hugePagesTotal = value;
+		}
+		else if (sscanf(line, "HugePages_Free: %llu", &value) == 1)
+		{
+			sysInfo->hugePagesFree = value;
+		}
+		else if (sscanf(line, "HugePages_Rsvd: %llu", &value) == 1)
+		{
+			reserved = value;
+		}
+		else if (sscanf(line, "Hugepagesize: %llu kB", &value) == 1)
+		{
+			sysInfo->hugePageSize = value * 1024;
+		}
+	}
+
+	fclose(stream);
+
+	/* pages that are reserved by a running process have not been used yet */
+	sysInfo->hugePagesFree =
+		sysInfo->hugePagesFree > reserved
+		? sysInfo->hugePagesFree - reserved
+		: 0;
+}
+
+
+/*
+ * get_cgroup_memory_limit returns the memory limit of our cgroup, checking
+ * for cgroup v2 first and then cgroup v1. We return zero when there is no
+ * limit, or when we could not find out.
+ */
+static uint64_t
+get_cgroup_memory_limit()
+{
+	uint64_t limit = 0;
+
+	/* cgroup v2 uses the string "max" when there is no limit */
+	if (read_uint64_from_file("/sys/fs/cgroup/memory.max", &limit))
+	{
+		return limit;
+	}
+
+	/* cgroup v1 uses a very large number when there is no limit */
+	if (read_uint64_from_file("/sys/fs/cgroup/memory/memory.limit_in_bytes",
+							  &limit))
+	{
+		return limit;
+	}
+
+	return 0;
+}
+
+
+/*
+ * read_uint64_from_file reads a single number from a file, such as the ones
+ * found in /sys, and returns false when the file does not exist or does not
+ * contain a number. Files in /sys report a size that does not match their
+ * contents, so we don't use read_file() here.
+ */
+static bool
+read_uint64_from_file(const char *filename, uint64_t *value)
+{
+	char line[BUFSIZE] = { 0 };
+
+	FILE *stream = fopen(filename, "r");
+
+	if (stream == NULL)
+	{
+		return false;
+	}
+
+	if (fgets(line, sizeof(line), stream) == NULL)
+	{
+		fclose(stream);
+		return false;
+	}
+
+	fclose(stream);
+
+	/* remove the final newline */
+	char *newline = strchr(line, '\n');
+
+	if (newline != NULL)
+	{
+		*newline = '\0';
+	}
+
+	return stringToUInt64(line, value);
+}
+
+
+/*
+ * get_system_usage_linux reads the CPU ticks from /proc/stat, the memory
+ * available from /proc/meminfo, the pages in and out from /proc/vmstat, and
+ * the load average from /proc/loadavg.
+ */
+static bool
+get_system_usage_linux(SystemUsage *usage)
+{
+	char line[BUFSIZE] = { 0 };
+	unsigned long long user = 0, nice = 0, system = 0, idle = 0;
+	unsigned long long iowait = 0, irq = 0, softirq = 0, steal = 0;
+
+	FILE *stream = fopen("/proc/stat", "r");
+
+	if (stream == NULL)
+	{
+		log_debug("Failed to open \"/proc/stat\": %m");
+		return false;
+	}
+
+	/* the first line sums up the ticks of all the CPUs */
+	if (fgets(line, sizeof(line), stream) == NULL ||
+		sscanf(line, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &user, &nice, &system, &idle,
+			   &iowait, &irq, &softirq, &steal) < 4)
+	{
+		log_debug("Failed to parse \"/proc/stat\"");
+		fclose(stream);
+		return false;
+	}
+
+	fclose(stream);
+
+	usage->cpuBusyTicks = user + nice + system + irq + softirq + steal;
+	usage->cpuTotalTicks = usage->cpuBusyTicks + idle + iowait;
+
+	stream = fopen("/proc/meminfo", "r");
+
+	if (stream != NULL)
+	{
+		while (fgets(line, sizeof(line), stream) != NULL)
+		{
+			unsigned long long value = 0;
+
+			if (sscanf(line, "MemAvailable: %llu kB", &value) == 1)
+			{
+				usage->availableram = value * 1024;
+				break;
+			}
+		}
+
+		fclose(stream);
+	}
+
+	stream = fopen("/proc/vmstat", "r");
+
+	if (stream != NULL)
+	{
+		while (fgets(line, sizeof(line), stream) != NULL)
+		{
+			unsigned long long value = 0;
+
+			/* pgpgin and pgpgout are counted in kB */
+			if (sscanf(line, "pgpgin %llu", &value) == 1)
+			{
+				usage->diskReadBytes = value * 1024;
+			}
+			else if (sscanf(line, "pgpgout %llu", &value) == 1)
+			{
+				usage->diskWriteBytes = value * 1024;
+			}
+		}
+
+		fclose(stream);
+	}
+
+	stream = fopen("/proc/loadavg", "r");
+
+	if (stream != NULL)
+	{
+		if (fscanf(stream, "%lf", &(usage->loadAverage)) != 1)
+		{
+			usage->loadAverage = 0;
+		}
+
+		fclose(stream);
+	}
+
+	return true;
+}
+
 #endif
 
 
@@ -107,6 +461,8 @@ get_system_info_bsd(SystemInfo *sysInfo)
 		return false;
 	}
 
+	sysInfo->physicalram = sysInfo->totalram;
+
 	return true;
 }
 
@@ -114,6 +470,97 @@ get_system_info_bsd(SystemInfo *sysInfo)
 #endif
 
 
+/*
+ * get_storage_type probes the kind of storage found at the given path. On
+ * Linux the block device of the file system is found in /sys, where the
+ * kernel tells us if the device is rotational. On other systems, and when
+ * the path is on a virtual file system (tmpfs, overlayfs, etc), we don't
+ * know.
+ */
+bool
+get_storage_type(const char *pgdata, SystemInfo *sysInfo)
+{
+	sysInfo->storageType = STORAGE_TYPE_UNKNOWN;
+
+#if defined(__linux__)
+	struct stat st = { 0 };
+	char path[MAXPGPATH] = { 0 };
+	uint64_t rotational = 0;
+
+	if (pgdata == NULL || pgdata[0] == '\0')
+	{
+		return true;
+	}
+
+	/* PGDATA might not exist yet, then look at its parent directory */
+	char dirname[MAXPGPATH] = { 0 };
+
+	strlcpy(dirname, pgdata, sizeof(dirname));
+
+	while (stat(dirname, &st) != 0)
+	{
+		char *slash = strrchr(dirname, '/');
+
+		if (slash == NULL || slash == dirname)
+		{
+			return true;
+		}
+
+		*slash = '\0';
+	}
+
+	unsigned int major = major(st.st_dev);
+	unsigned int minor = minor(st.st_dev);
+
+	/* partitions don't have a queue, their parent device does */
+	sformat(path, sizeof(path),
+			"/sys/dev/block/%u:%u/queue/rotational", major, minor);
+
+	if (!read_uint64_from_file(path, &rotational))
+	{
+		sformat(path, sizeof(path),
+				"/sys/dev/block/%u:%u/../queue/rotational", major, minor);
+
+		if (!read_uint64_from_file(path, &rotational))
+		{
+			return true;
+		}
+	}
+
+	sysInfo->storageType = rotational == 0 ? STORAGE_TYPE_SSD : STORAGE_TYPE_HDD;
+#endif
+
+	return true;
+}
+
+
+/*
+ * storage_type_to_string returns a string representation of a StorageType.
+ */
+char *
+storage_type_to_string(StorageType storageType)
+{
+	switch (storageType)
+	{
+		case STORAGE_TYPE_SSD:
+		{
+			return "SSD";
+		}
+
+		case STORAGE_TYPE_HDD:
+		{
+			return "HDD";
+		}
+
+		case STORAGE_TYPE_UNKNOWN:
+		default:
+		{
+			return "unknown";
+		}
+	}
+}
+
+
 /*
  * pretty_print_bytes pretty prints bytes in a human readable form. Given
  * 17179869184 it places the string "16 GB" in the given buffer.
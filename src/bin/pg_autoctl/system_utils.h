@@ -11,16 +11,68 @@
 #define SYSTEM_UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 
+/*
+ * Storage type of the device where PGDATA is found, used to tune the planner
+ * costs and the I/O concurrency.
+ */
+typedef enum
+{
+	STORAGE_TYPE_UNKNOWN = 0,
+	STORAGE_TYPE_SSD,
+	STORAGE_TYPE_HDD
+} StorageType;
+
 /* taken from sysinfo(2) on Linux */
 typedef struct SystemInfo
 {
 	uint64_t totalram;          /* Total usable main memory size */
+	uint64_t physicalram;       /* Physical RAM, before cgroup limits */
+	uint64_t cgroupMemoryLimit; /* cgroup memory limit, 0 when unlimited */
 	unsigned short ncpu;        /* Number of current processes */
+	StorageType storageType;    /* SSD or HDD, when we could find out */
+
+	/* huge pages reserved on the system, from /proc/meminfo on Linux */
+	uint64_t hugePageSize;      /* bytes */
+	uint64_t hugePagesTotal;    /* pages reserved with vm.nr_hugepages */
+	uint64_t hugePagesFree;     /* pages neither in use nor reserved */
 } SystemInfo;
 
+/*
+ * Host-level usage counters, from /proc on Linux. The counters only ever
+ * grow, rates are computed by comparing two samples.
+ */
+typedef struct SystemUsage
+{
+	uint64_t cpuBusyTicks;      /* user, nice, system, irq, softirq, steal */
+	uint64_t cpuTotalTicks;     /* the same, plus idle and iowait */
+	uint64_t diskReadBytes;     /* paged in from block devices */
+	uint64_t diskWriteBytes;    /* paged out to block devices */
+	uint64_t availableram;      /* estimate of the memory available */
+	double loadAverage;         /* over the last minute */
+} SystemUsage;
+
+/*
+ * Memory used by a single process, from /proc/<pid>/smaps_rollup on Linux.
+ * The resident set size counts the shared libraries pages in every process
+ * that maps them, the proportional set size divides them among those
+ * processes, and the private memory is what the process alone uses.
+ */
+typedef struct ProcessMemory
+{
+	uint64_t rss;               /* bytes */
+	uint64_t pss;               /* bytes, 0 when not available */
+	uint64_t private;           /* bytes, 0 when not available */
+} ProcessMemory;
+
 bool get_system_info(SystemInfo *sysInfo);
+bool get_system_usage(SystemUsage *usage);
+bool get_process_memory(pid_t pid, ProcessMemory *memory);
+bool get_storage_type(const char *pgdata, SystemInfo *sysInfo);
+char * storage_type_to_string(StorageType storageType);
 void pretty_print_bytes(char *buffer, size_t size, uint64_t bytes);
 
 
@@ -42,6 +42,15 @@
 	make_strbuf_option_default("Service", "User", NULL, true, BUFSIZE, \
 							   config->User, "postgres")
 
+#define OPTION_SYSTEMD_TYPE(config) \
+	make_strbuf_option_default("Service", "Type", NULL, true, NAMEDATALEN, \
+							   config->Type, "notify")
+
+#define OPTION_SYSTEMD_NOTIFYACCESS(config) \
+	make_strbuf_option_default("Service", "NotifyAccess", \
+							   NULL, true, NAMEDATALEN, \
+							   config->NotifyAccess, "all")
+
 #define OPTION_SYSTEMD_EXECSTART(config) \
 	make_strbuf_option_default("Service", "ExecStart", NULL, true, BUFSIZE, \
 							   config->ExecStart, "/usr/bin/pg_autoctl run")
@@ -54,6 +63,15 @@
 	make_int_option_default("Service", "StartLimitBurst", NULL, true, \
 							&(config->StartLimitBurst), 20)
 
+#define OPTION_SYSTEMD_TIMEOUTSTARTSEC(config) \
+	make_strbuf_option_default("Service", "TimeoutStartSec", \
+							   NULL, true, NAMEDATALEN, \
+							   config->TimeoutStartSec, "infinity")
+
+#define OPTION_SYSTEMD_WATCHDOGSEC(config) \
+	make_int_option_default("Service", "WatchdogSec", NULL, true, \
+							&(config->WatchdogSec), 60)
+
 #define OPTION_SYSTEMD_EXECRELOAD(config) \
 	make_strbuf_option_default("Service", "ExecReload", NULL, true, BUFSIZE, \
 							   config->ExecReload, "/usr/bin/pg_autoctl reload")
@@ -68,9 +86,13 @@
 		OPTION_SYSTEMD_WORKING_DIRECTORY(config), \
 		OPTION_SYSTEMD_ENVIRONMENT_PGDATA(config), \
 		OPTION_SYSTEMD_USER(config), \
+		OPTION_SYSTEMD_TYPE(config), \
+		OPTION_SYSTEMD_NOTIFYACCESS(config), \
 		OPTION_SYSTEMD_EXECSTART(config), \
 		OPTION_SYSTEMD_RESTART(config), \
 		OPTION_SYSTEMD_STARTLIMITBURST(config), \
+		OPTION_SYSTEMD_TIMEOUTSTARTSEC(config), \
+		OPTION_SYSTEMD_WATCHDOGSEC(config), \
 		OPTION_SYSTEMD_EXECRELOAD(config), \
 		OPTION_SYSTEMD_WANTEDBY(config), \
 		INI_OPTION_LAST \
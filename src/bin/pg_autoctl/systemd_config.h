@@ -26,9 +26,13 @@ typedef struct SystemdServiceConfig
 	char WorkingDirectory[MAXPGPATH];
 	char EnvironmentPGDATA[BUFSIZE];
 	char User[NAMEDATALEN];
+	char Type[NAMEDATALEN];
+	char NotifyAccess[NAMEDATALEN];
 	char ExecStart[BUFSIZE];
 	char Restart[BUFSIZE];
 	int StartLimitBurst;
+	char TimeoutStartSec[NAMEDATALEN];
+	int WatchdogSec;
 	char ExecReload[BUFSIZE];
 
 	/* Install */
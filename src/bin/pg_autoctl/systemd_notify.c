@@ -0,0 +1,209 @@
+/*
+ * src/bin/pg_autoctl/systemd_notify.c
+ *     Implementation of the systemd service notification protocol, see
+ *     sd_notify(3).
+ *
+ * We don't link with libsystemd: the protocol is a datagram sent to the Unix
+ * socket found in the NOTIFY_SOCKET environment variable, and when pg_autoctl
+ * doesn't run as a systemd service all the functions here do nothing.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "log.h"
+#include "pgsetup.h"
+#include "string_utils.h"
+#include "systemd_notify.h"
+
+
+/*
+ * systemd_notify_init is called by the supervisor before starting any
+ * service. When we run as a systemd notify service, it moves the socket
+ * pathname to the PG_AUTOCTL_NOTIFY_SOCKET environment variable, and returns
+ * true.
+ */
+bool
+systemd_notify_init(void)
+{
+	char socketPath[MAXPGPATH] = { 0 };
+
+	if (!env_exists(SYSTEMD_NOTIFY_SOCKET) ||
+		!get_env_copy(SYSTEMD_NOTIFY_SOCKET, socketPath, sizeof(socketPath)) ||
+		IS_EMPTY_STRING_BUFFER(socketPath))
+	{
+		return false;
+	}
+
+	if (setenv(PG_AUTOCTL_NOTIFY_SOCKET, socketPath, 1) != 0 ||
+		unsetenv(SYSTEMD_NOTIFY_SOCKET) != 0)
+	{
+		log_error("Failed to set environment variable %s: %m",
+				  PG_AUTOCTL_NOTIFY_SOCKET);
+		return false;
+	}
+
+	log_debug("systemd notification socket is \"%s\"", socketPath);
+
+	return true;
+}
+
+
+/*
+ * systemd_notify sends the given state to systemd, such as "READY=1" or
+ * "WATCHDOG=1". Several assignments may be sent at once, separated with a
+ * newline. Failures are only logged at debug level: systemd integration must
+ * never prevent pg_autoctl from running.
+ */
+bool
+systemd_notify(const char *fmt, ...)
+{
+	char socketPath[MAXPGPATH] = { 0 };
+	char state[BUFSIZE] = { 0 };
+	struct sockaddr_un addr = { 0 };
+	va_list args;
+
+	const char *envName =
+		env_exists(PG_AUTOCTL_NOTIFY_SOCKET)
+		? PG_AUTOCTL_NOTIFY_SOCKET
+		: SYSTEMD_NOTIFY_SOCKET;
+
+	if (!env_exists(envName) ||
+		!get_env_copy(envName, socketPath, sizeof(socketPath)) ||
+		IS_EMPTY_STRING_BUFFER(socketPath))
+	{
+		/* not running as a systemd notify service */
+		return false;
+	}
+
+	/* abstract namespace sockets start with @ */
+	if ((socketPath[0] != '/' && socketPath[0] != '@') ||
+		strlen(socketPath) >= sizeof(addr.sun_path))
+	{
+		log_debug("Failed to use systemd notification socket \"%s\"",
+				  socketPath);
+		return false;
+	}
+
+	va_start(args, fmt);
+	pg_vsnprintf(state, sizeof(state), fmt, args);
+	va_end(args);
+
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+
+	if (addr.sun_path[0] == '@')
+	{
+		addr.sun_path[0] = '\0';
+	}
+
+	socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(socketPath);
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to create systemd notification socket: %m");
+		return false;
+	}
+
+	ssize_t sent = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+						  (struct sockaddr *) &addr, addrlen);
+
+	if (sent < 0)
+	{
+		log_debug("Failed to notify systemd \"%s\": %m", state);
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	log_trace("systemd_notify: %s", state);
+
+	return true;
+}
+
+
+/*
+ * systemd_watchdog_enabled returns true when systemd expects us to send
+ * keep-alive pings, and sets usec to the watchdog timeout.
+ */
+bool
+systemd_watchdog_enabled(uint64_t *usec)
+{
+	char value[BUFSIZE] = { 0 };
+
+	if (!env_exists(SYSTEMD_WATCHDOG_USEC) ||
+		!get_env_copy(SYSTEMD_WATCHDOG_USEC, value, sizeof(value)))
+	{
+		return false;
+	}
+
+	return stringToUInt64(value, usec) && *usec > 0;
+}
+
+
+/*
+ * systemd_watchdog_ping tells systemd that we are still alive.
+ */
+void
+systemd_watchdog_ping(void)
+{
+	uint64_t usec = 0;
+
+	if (systemd_watchdog_enabled(&usec))
+	{
+		(void) systemd_notify("WATCHDOG=1");
+	}
+}
+
+
+/*
+ * systemd_watchdog_extend extends the watchdog timeout before an operation
+ * that may take a long time, and that doesn't give us a chance to send
+ * keep-alive pings in the meantime.
+ */
+void
+systemd_watchdog_extend(void)
+{
+	uint64_t usec = 0;
+
+	if (systemd_watchdog_enabled(&usec))
+	{
+		(void) systemd_notify("WATCHDOG=1\nWATCHDOG_USEC=%llu",
+							  (unsigned long long) SYSTEMD_WATCHDOG_LONG_OPERATION_USEC);
+	}
+}
+
+
+/*
+ * systemd_watchdog_reset restores the watchdog timeout of the service after
+ * a call to systemd_watchdog_extend.
+ */
+void
+systemd_watchdog_reset(void)
+{
+	uint64_t usec = 0;
+
+	if (systemd_watchdog_enabled(&usec))
+	{
+		(void) systemd_notify("WATCHDOG_USEC=%llu\nWATCHDOG=1",
+							  (unsigned long long) usec);
+	}
+}
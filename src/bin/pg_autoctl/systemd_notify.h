@@ -0,0 +1,45 @@
+/*
+ * src/bin/pg_autoctl/systemd_notify.h
+ *     Implementation of the systemd service notification protocol, see
+ *     sd_notify(3).
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SYSTEMD_NOTIFY_H
+#define SYSTEMD_NOTIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* environment variables set by systemd for Type=notify services */
+#define SYSTEMD_NOTIFY_SOCKET "NOTIFY_SOCKET"
+#define SYSTEMD_WATCHDOG_USEC "WATCHDOG_USEC"
+
+/*
+ * Postgres knows how to talk to systemd too, and would send READY=1 itself
+ * when it finds NOTIFY_SOCKET in its environment. The supervisor moves the
+ * socket to our own environment variable before starting any service, so
+ * that only pg_autoctl processes notify systemd.
+ */
+#define PG_AUTOCTL_NOTIFY_SOCKET "PG_AUTOCTL_NOTIFY_SOCKET"
+
+/*
+ * FSM transitions may take a long time, as when running pg_basebackup or
+ * waiting for Postgres crash recovery. In that case the watchdog timeout is
+ * extended to this value for the duration of the operation.
+ */
+#define SYSTEMD_WATCHDOG_LONG_OPERATION_USEC (24 * 3600 * 1000000ULL)
+
+bool systemd_notify_init(void);
+bool systemd_notify(const char *fmt, ...)
+__attribute__((format(printf, 1, 2)));
+
+bool systemd_watchdog_enabled(uint64_t *usec);
+void systemd_watchdog_ping(void);
+void systemd_watchdog_extend(void);
+void systemd_watchdog_reset(void);
+
+#endif /* SYSTEMD_NOTIFY_H */
@@ -0,0 +1,563 @@
+/*
+ * src/bin/pg_autoctl/trace.c
+ *   Trace spans of the keeper FSM transitions, in the OpenTelemetry format,
+ *   and time the phases of the pg_autoctl commands.
+ *
+ * The monitor assigns a trace id to each reconfiguration of a group, and
+ * returns it along with the goal state in node_active. The keeper then traces
+ * the FSM transition that reaches the goal state, and the steps and the
+ * sub-processes of that transition, as spans of the same trace.
+ *
+ * Spans are exported in the OTLP/JSON format, one export request per line,
+ * appended to the tracing.otlp_file file. That's the format read by the
+ * OpenTelemetry Collector "otlpjsonfile" receiver, which then forwards the
+ * spans to any OTLP endpoint.
+ *
+ * Spans are also used to time the phases of pg_autoctl create and perform
+ * commands, whether tracing is enabled or not: each span logs its duration at
+ * the DEBUG level when it ends, and the --timing option prints a table of the
+ * phase durations when the command is done.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "parson.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsetup.h"
+#include "string_utils.h"
+#include "trace.h"
+
+
+/* OTLP enum values, see opentelemetry/proto/trace/v1/trace.proto */
+#define OTLP_SPAN_KIND_INTERNAL 1
+#define OTLP_STATUS_CODE_OK 1
+#define OTLP_STATUS_CODE_ERROR 2
+
+typedef struct TraceTiming
+{
+	char name[NAMEDATALEN];
+	int depth;
+	bool done;
+	bool success;
+	uint64_t startTimeNs;
+	uint64_t durationNs;
+} TraceTiming;
+
+typedef struct TraceExporter
+{
+	char otlpFile[MAXPGPATH];
+	char formation[NAMEDATALEN];
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	char hostname[_POSIX_HOST_NAME_MAX];
+
+	/* we warn once when we fail to export, and then when it works again */
+	bool exportFailed;
+
+	int depth;
+	TraceSpan *stack[TRACE_MAX_DEPTH];
+
+	/* phases timed for the --timing report, in the order they started */
+	bool timing;
+	int timingCount;
+	TraceTiming timings[TRACE_MAX_TIMINGS];
+} TraceExporter;
+
+static TraceExporter exporter = { 0 };
+
+
+static void trace_random_hex_id(char *buffer, int hexLength);
+static uint64_t trace_now_ns(void);
+static void trace_export_span(TraceSpan *span, uint64_t endTimeNs, bool success);
+static void json_array_append_attribute(JSON_Array *array,
+										const char *key,
+										const char *value);
+static void trace_format_duration(uint64_t durationNs,
+								  char *buffer, size_t size);
+
+
+/*
+ * trace_setup enables tracing when otlpFile is not empty, and registers the
+ * OpenTelemetry resource attributes of this pg_autoctl node. It may be called
+ * again when the configuration is reloaded.
+ */
+void
+trace_setup(const char *otlpFile,
+			const char *formation,
+			const char *nodeName,
+			const char *hostname)
+{
+	strlcpy(exporter.otlpFile, otlpFile, sizeof(exporter.otlpFile));
+	strlcpy(exporter.formation, formation, sizeof(exporter.formation));
+	strlcpy(exporter.nodeName, nodeName, sizeof(exporter.nodeName));
+	strlcpy(exporter.hostname, hostname, sizeof(exporter.hostname));
+
+	exporter.exportFailed = false;
+}
+
+
+/*
+ * trace_enabled returns true when spans are exported.
+ */
+bool
+trace_enabled(void)
+{
+	return !IS_EMPTY_STRING_BUFFER(exporter.otlpFile);
+}
+
+
+/*
+ * trace_span_start starts a new span, child of the innermost span that is
+ * still open. The root span of a trace uses the given traceId, or a new
+ * random one when traceId is NULL or empty. When tracing is disabled the span
+ * is only timed, and not exported.
+ */
+void
+trace_span_start(TraceSpan *span, const char *name, const char *traceId)
+{
+	TraceSpan *parent =
+		exporter.depth > 0 ? exporter.stack[exporter.depth - 1] : NULL;
+
+	span->started = false;
+	span->exported = false;
+	span->timingIndex = -1;
+
+	if (exporter.depth >= TRACE_MAX_DEPTH)
+	{
+		return;
+	}
+
+	span->started = true;
+	span->attributeCount = 0;
+	span->startTimeNs = trace_now_ns();
+
+	strlcpy(span->name, name, sizeof(span->name));
+
+	if (exporter.timingCount < TRACE_MAX_TIMINGS)
+	{
+		TraceTiming *timing = &(exporter.timings[exporter.timingCount]);
+
+		strlcpy(timing->name, name, sizeof(timing->name));
+		timing->depth = exporter.depth;
+		timing->done = false;
+		timing->startTimeNs = span->startTimeNs;
+
+		span->timingIndex = exporter.timingCount++;
+	}
+
+	if (trace_enabled())
+	{
+		span->exported = true;
+
+		if (parent != NULL && parent->exported)
+		{
+			strlcpy(span->traceId, parent->traceId, sizeof(span->traceId));
+			strlcpy(span->parentSpanId, parent->spanId,
+					sizeof(span->parentSpanId));
+		}
+		else
+		{
+			if (traceId != NULL && strlen(traceId) == TRACE_ID_HEX_LEN)
+			{
+				strlcpy(span->traceId, traceId, sizeof(span->traceId));
+			}
+			else
+			{
+				trace_random_hex_id(span->traceId, TRACE_ID_HEX_LEN);
+			}
+
+			span->parentSpanId[0] = '\0';
+		}
+
+		trace_random_hex_id(span->spanId, SPAN_ID_HEX_LEN);
+	}
+
+	exporter.stack[exporter.depth++] = span;
+}
+
+
+/*
+ * trace_span_set_attribute adds a string attribute to the given span. Extra
+ * attributes are silently ignored.
+ */
+void
+trace_span_set_attribute(TraceSpan *span, const char *key, const char *fmt, ...)
+{
+	va_list args;
+
+	if (!span->exported || span->attributeCount >= TRACE_MAX_ATTRIBUTES)
+	{
+		return;
+	}
+
+	TraceAttribute *attribute = &(span->attributes[span->attributeCount++]);
+
+	strlcpy(attribute->key, key, sizeof(attribute->key));
+
+	va_start(args, fmt);
+	pg_vsnprintf(attribute->value, sizeof(attribute->value), fmt, args);
+	va_end(args);
+}
+
+
+/*
+ * trace_span_end ends the given span, logs its duration, and exports it when
+ * tracing is enabled. Spans that were started after this one and not ended
+ * are discarded.
+ */
+void
+trace_span_end(TraceSpan *span, bool success)
+{
+	if (!span->started)
+	{
+		return;
+	}
+
+	uint64_t endTimeNs = trace_now_ns();
+	uint64_t durationNs =
+		endTimeNs > span->startTimeNs ? endTimeNs - span->startTimeNs : 0;
+
+	while (exporter.depth > 0)
+	{
+		TraceSpan *top = exporter.stack[--exporter.depth];
+
+		if (top == span)
+		{
+			break;
+		}
+	}
+
+	span->started = false;
+
+	char duration[BUFSIZE] = { 0 };
+
+	(void) trace_format_duration(durationNs, duration, sizeof(duration));
+
+	log_debug("%s %s in %s",
+			  span->name, success ? "done" : "failed", duration);
+
+	if (span->timingIndex >= 0)
+	{
+		TraceTiming *timing = &(exporter.timings[span->timingIndex]);
+
+		timing->done = true;
+		timing->success = success;
+		timing->durationNs = durationNs;
+	}
+
+	if (span->exported)
+	{
+		(void) trace_export_span(span, endTimeNs, success);
+	}
+}
+
+
+/*
+ * trace_timing_enable registers that the phase durations are to be reported
+ * at the end of the current command, as per the --timing option.
+ */
+void
+trace_timing_enable(void)
+{
+	exporter.timing = true;
+}
+
+
+/*
+ * trace_timing_enabled returns true when the --timing option has been used.
+ */
+bool
+trace_timing_enabled(void)
+{
+	return exporter.timing;
+}
+
+
+/*
+ * trace_timing_report logs a table of the phases timed so far, in the order
+ * they started, indented by their nesting level. Phases that are still in
+ * progress are reported with their duration so far.
+ */
+void
+trace_timing_report(void)
+{
+	if (!exporter.timing || exporter.timingCount == 0)
+	{
+		return;
+	}
+
+	uint64_t nowNs = trace_now_ns();
+
+	log_info("%10s  %-7s  %s", "Duration", "Status", "Phase");
+	log_info("%10s  %-7s  %s", "----------", "-------", "-----");
+
+	for (int i = 0; i < exporter.timingCount; i++)
+	{
+		TraceTiming *timing = &(exporter.timings[i]);
+		char duration[BUFSIZE] = { 0 };
+
+		uint64_t durationNs =
+			timing->done
+			? timing->durationNs
+			: (nowNs > timing->startTimeNs ? nowNs - timing->startTimeNs : 0);
+
+		(void) trace_format_duration(durationNs, duration, sizeof(duration));
+
+		log_info("%10s  %-7s  %*s%s",
+				 duration,
+				 timing->done ? (timing->success ? "ok" : "failed") : "running",
+				 2 * timing->depth, "",
+				 timing->name);
+	}
+
+	if (exporter.timingCount == TRACE_MAX_TIMINGS)
+	{
+		log_info("Only the first %d phases have been timed",
+				 TRACE_MAX_TIMINGS);
+	}
+}
+
+
+/*
+ * trace_format_duration writes a human readable duration to the given
+ * buffer, with millisecond precision for short phases.
+ */
+static void
+trace_format_duration(uint64_t durationNs, char *buffer, size_t size)
+{
+	uint64_t durationMs = durationNs / 1000000;
+
+	if (durationMs < 1000)
+	{
+		sformat(buffer, size, "%" PRIu64 "ms", durationMs);
+	}
+	else if (durationMs < 60 * 1000)
+	{
+		sformat(buffer, size, "%.3fs", (double) durationMs / 1000.0);
+	}
+	else
+	{
+		(void) IntervalToString((double) durationMs / 1000.0, buffer, size);
+	}
+}
+
+
+/*
+ * trace_export_span appends the given span to the OTLP/JSON file, as a
+ * complete ExportTraceServiceRequest on a single line.
+ */
+static void
+trace_export_span(TraceSpan *span, uint64_t endTimeNs, bool success)
+{
+	char startTime[BUFSIZE] = { 0 };
+	char endTime[BUFSIZE] = { 0 };
+
+	/* the JSON document is only needed until it's copied to the line */
+	json_arena_begin();
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	/* resourceSpans[0].resource.attributes */
+	JSON_Value *resourceSpansValue = json_value_init_array();
+	JSON_Value *resourceSpanValue = json_value_init_object();
+	JSON_Object *resourceSpan = json_value_get_object(resourceSpanValue);
+
+	JSON_Value *resourceAttributes = json_value_init_array();
+	JSON_Array *resourceAttrs = json_value_get_array(resourceAttributes);
+
+	json_array_append_attribute(resourceAttrs, "service.name", "pg_autoctl");
+	json_array_append_attribute(resourceAttrs,
+								"service.version", PG_AUTOCTL_VERSION);
+	json_array_append_attribute(resourceAttrs,
+								"service.instance.id", exporter.nodeName);
+	json_array_append_attribute(resourceAttrs,
+								"host.name", exporter.hostname);
+	json_array_append_attribute(resourceAttrs,
+								"pg_auto_failover.formation",
+								exporter.formation);
+
+	json_object_dotset_value(resourceSpan,
+							 "resource.attributes", resourceAttributes);
+
+	/* resourceSpans[0].scopeSpans[0].scope */
+	JSON_Value *scopeSpansValue = json_value_init_array();
+	JSON_Value *scopeSpanValue = json_value_init_object();
+	JSON_Object *scopeSpan = json_value_get_object(scopeSpanValue);
+
+	json_object_dotset_string(scopeSpan, "scope.name", "pg_autoctl");
+	json_object_dotset_string(scopeSpan, "scope.version", PG_AUTOCTL_VERSION);
+
+	/* resourceSpans[0].scopeSpans[0].spans[0] */
+	JSON_Value *spansValue = json_value_init_array();
+	JSON_Value *spanValue = json_value_init_object();
+	JSON_Object *spanObj = json_value_get_object(spanValue);
+
+	sformat(startTime, sizeof(startTime), "%" PRIu64, span->startTimeNs);
+	sformat(endTime, sizeof(endTime), "%" PRIu64, endTimeNs);
+
+	json_object_set_string(spanObj, "traceId", span->traceId);
+	json_object_set_string(spanObj, "spanId", span->spanId);
+
+	if (!IS_EMPTY_STRING_BUFFER(span->parentSpanId))
+	{
+		json_object_set_string(spanObj, "parentSpanId", span->parentSpanId);
+	}
+
+	json_object_set_string(spanObj, "name", span->name);
+	json_object_set_number(spanObj, "kind", OTLP_SPAN_KIND_INTERNAL);
+
+	/* 64-bit integers are encoded as decimal strings in OTLP/JSON */
+	json_object_set_string(spanObj, "startTimeUnixNano", startTime);
+	json_object_set_string(spanObj, "endTimeUnixNano", endTime);
+
+	JSON_Value *spanAttributes = json_value_init_array();
+	JSON_Array *spanAttrs = json_value_get_array(spanAttributes);
+
+	for (int i = 0; i < span->attributeCount; i++)
+	{
+		json_array_append_attribute(spanAttrs,
+									span->attributes[i].key,
+									span->attributes[i].value);
+	}
+
+	json_object_set_value(spanObj, "attributes", spanAttributes);
+
+	json_object_dotset_number(spanObj, "status.code",
+							  success
+							  ? OTLP_STATUS_CODE_OK
+							  : OTLP_STATUS_CODE_ERROR);
+
+	json_array_append_value(json_value_get_array(spansValue), spanValue);
+	json_object_set_value(scopeSpan, "spans", spansValue);
+
+	json_array_append_value(json_value_get_array(scopeSpansValue),
+							scopeSpanValue);
+	json_object_set_value(resourceSpan, "scopeSpans", scopeSpansValue);
+
+	json_array_append_value(json_value_get_array(resourceSpansValue),
+							resourceSpanValue);
+	json_object_set_value(root, "resourceSpans", resourceSpansValue);
+
+	char *serialized = json_serialize_to_string(js);
+	PQExpBuffer line = createPQExpBuffer();
+
+	appendPQExpBuffer(line, "%s\n", serialized);
+
+	json_arena_end();
+
+	if (PQExpBufferBroken(line))
+	{
+		log_error("Failed to export trace span \"%s\": out of memory",
+				  span->name);
+		destroyPQExpBuffer(line);
+		return;
+	}
+
+	if (append_to_file(line->data, line->len, exporter.otlpFile))
+	{
+		if (exporter.exportFailed)
+		{
+			log_info("Exporting trace spans to \"%s\" again",
+					 exporter.otlpFile);
+			exporter.exportFailed = false;
+		}
+	}
+	else if (!exporter.exportFailed)
+	{
+		log_warn("Failed to export trace spans to \"%s\", "
+				 "see above for details",
+				 exporter.otlpFile);
+		exporter.exportFailed = true;
+	}
+
+	destroyPQExpBuffer(line);
+}
+
+
+/*
+ * json_array_append_attribute appends an OTLP KeyValue object with a string
+ * value to the given array.
+ */
+static void
+json_array_append_attribute(JSON_Array *array, const char *key, const char *value)
+{
+	JSON_Value *attributeValue = json_value_init_object();
+	JSON_Object *attribute = json_value_get_object(attributeValue);
+
+	json_object_set_string(attribute, "key", key);
+	json_object_dotset_string(attribute, "value.stringValue", value);
+
+	json_array_append_value(array, attributeValue);
+}
+
+
+/*
+ * trace_random_hex_id writes a random id of hexLength hexadecimal digits to
+ * the given buffer, that must be at least hexLength + 1 bytes long.
+ */
+static void
+trace_random_hex_id(char *buffer, int hexLength)
+{
+	const char *hexDigits = "0123456789abcdef";
+	unsigned char randomBytes[TRACE_ID_HEX_LEN / 2] = { 0 };
+	int byteCount = hexLength / 2;
+	bool haveRandomBytes = false;
+
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if (fd >= 0)
+	{
+		haveRandomBytes = read(fd, randomBytes, byteCount) == byteCount;
+		close(fd);
+	}
+
+	/* an all-zero id is invalid, and ids need not be cryptographically strong */
+	if (!haveRandomBytes)
+	{
+		for (int i = 0; i < byteCount; i++)
+		{
+			randomBytes[i] = (unsigned char) (random() & 0xff);
+		}
+	}
+
+	for (int i = 0; i < byteCount; i++)
+	{
+		buffer[2 * i] = hexDigits[randomBytes[i] >> 4];
+		buffer[2 * i + 1] = hexDigits[randomBytes[i] & 0x0f];
+	}
+
+	buffer[hexLength] = '\0';
+}
+
+
+/*
+ * trace_now_ns returns the current wall clock time in nanoseconds since the
+ * Unix epoch, as expected in OTLP spans.
+ */
+static uint64_t
+trace_now_ns(void)
+{
+	struct timespec now = { 0 };
+
+	(void) clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
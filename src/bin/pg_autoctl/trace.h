@@ -0,0 +1,73 @@
+/*
+ * src/bin/pg_autoctl/trace.h
+ *   Trace spans of the keeper FSM transitions, in the OpenTelemetry format,
+ *   and time the phases of the pg_autoctl commands.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+
+/* W3C Trace Context ids, as used by OpenTelemetry, in hexadecimal */
+#define TRACE_ID_HEX_LEN 32
+#define SPAN_ID_HEX_LEN 16
+
+#define TRACE_MAX_ATTRIBUTES 8
+#define TRACE_MAX_DEPTH 16
+
+/* phases kept for the --timing report, later spans are only logged */
+#define TRACE_MAX_TIMINGS 64
+
+typedef struct TraceAttribute
+{
+	char key[NAMEDATALEN];
+	char value[BUFSIZE];
+} TraceAttribute;
+
+/*
+ * A TraceSpan is allocated by the caller, usually on the stack, and must be
+ * ended in the same function that started it: spans are nested following the
+ * C call stack. Spans are always timed, and only exported when tracing is
+ * enabled.
+ */
+typedef struct TraceSpan
+{
+	bool started;
+	bool exported;
+	int timingIndex;
+	char name[NAMEDATALEN];
+	char traceId[TRACE_ID_HEX_LEN + 1];
+	char spanId[SPAN_ID_HEX_LEN + 1];
+	char parentSpanId[SPAN_ID_HEX_LEN + 1];
+	uint64_t startTimeNs;
+
+	int attributeCount;
+	TraceAttribute attributes[TRACE_MAX_ATTRIBUTES];
+} TraceSpan;
+
+void trace_setup(const char *otlpFile,
+				 const char *formation,
+				 const char *nodeName,
+				 const char *hostname);
+bool trace_enabled(void);
+
+void trace_span_start(TraceSpan *span, const char *name, const char *traceId);
+void trace_span_set_attribute(TraceSpan *span, const char *key,
+							  const char *fmt, ...)
+__attribute__((format(printf, 3, 4)));
+void trace_span_end(TraceSpan *span, bool success);
+
+void trace_timing_enable(void);
+bool trace_timing_enabled(void);
+void trace_timing_report(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,508 @@
+/*
+ * src/bin/pg_autoctl/walprefetch.c
+ *     Implement a restore_command that fetches WAL segments from the archive
+ *     in parallel, ahead of the Postgres recovery process.
+ *
+ * Postgres calls restore_command for one WAL file at a time, and waits until
+ * the command is done before calling it again for the next WAL file. When the
+ * archive is a remote object storage, each call spends most of its time
+ * waiting on the network, and a standby that has fallen far behind catches up
+ * slowly: replay waits for one WAL segment at a time.
+ *
+ * When replication.wal_prefetch is set, pg_autoctl installs its own command
+ * as the Postgres restore_command:
+ *
+ *   pg_autoctl do standby restore-wal --pgdata ... %f %p %r
+ *
+ * The command first looks for the requested WAL segment in a spool directory
+ * that we maintain in pg_wal/pg_autoctl_prefetch. When the segment is not
+ * found there, it runs the replication.restore_command given by the user.
+ * Then when the spool directory runs low, it fetches the next WAL segments by
+ * running several restore commands in parallel.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "walprefetch.h"
+
+/* a WAL segment file name is 24 hexadecimal digits: TLI, log, seg */
+#define WAL_FILE_NAME_LEN 24
+
+static void wal_prefetch_spool_path(const char *pgdata, char *spoolDir);
+static bool wal_prefetch_file_is_segment(const char *walFileName);
+static bool wal_prefetch_next_segment(const char *walFileName,
+									  uint64_t segmentSize,
+									  char *nextFileName);
+static bool wal_prefetch_prepare_command(const char *restoreCommand,
+										 const char *walFileName,
+										 const char *walFilePath,
+										 const char *restartPoint,
+										 PQExpBuffer command);
+static void wal_prefetch_remove_old_segments(const char *spoolDir,
+											 const char *walFileName);
+static void wal_prefetch_segments(const char *spoolDir,
+								  const char *restoreCommand,
+								  int prefetch,
+								  const char *walFileName,
+								  const char *restartPoint,
+								  uint64_t segmentSize);
+
+
+/*
+ * wal_prefetch_restore implements our restore_command: it copies the WAL file
+ * walFileName to walFilePath, either from our spool directory or by running
+ * the user given restoreCommand, and then prefetches the next WAL segments.
+ *
+ * The function returns false when the requested WAL file could not be
+ * restored, which Postgres expects when reaching the end of the archive.
+ */
+bool
+wal_prefetch_restore(const char *pgdata,
+					 const char *restoreCommand,
+					 int prefetch,
+					 const char *walFileName,
+					 const char *walFilePath,
+					 const char *restartPoint)
+{
+	char spoolDir[MAXPGPATH] = { 0 };
+	char spoolFilePath[MAXPGPATH] = { 0 };
+
+	wal_prefetch_spool_path(pgdata, spoolDir);
+	join_path_components(spoolFilePath, spoolDir, walFileName);
+
+	bool restored = false;
+
+	if (file_exists(spoolFilePath))
+	{
+		if (rename(spoolFilePath, walFilePath) == 0)
+		{
+			log_debug("Restored WAL file \"%s\" from \"%s\"",
+					  walFileName, spoolDir);
+			restored = true;
+		}
+		else
+		{
+			log_warn("Failed to move \"%s\" to \"%s\": %m",
+					 spoolFilePath, walFilePath);
+		}
+	}
+
+	if (!restored)
+	{
+		PQExpBuffer command = createPQExpBuffer();
+
+		if (!wal_prefetch_prepare_command(restoreCommand,
+										  walFileName,
+										  walFilePath,
+										  restartPoint,
+										  command))
+		{
+			/* errors have already been logged */
+			destroyPQExpBuffer(command);
+			return false;
+		}
+
+		log_debug("%s", command->data);
+
+		int returnCode = system(command->data);
+
+		destroyPQExpBuffer(command);
+
+		if (returnCode != 0)
+		{
+			/* the end of the archive, or a history file that does not exist */
+			return false;
+		}
+	}
+
+	/* only WAL segments are prefetched, not history or backup files */
+	if (prefetch <= 0 || !wal_prefetch_file_is_segment(walFileName))
+	{
+		return true;
+	}
+
+	/* the segment we just restored tells us the WAL segment size */
+	struct stat st;
+
+	if (stat(walFilePath, &st) != 0)
+	{
+		log_warn("Failed to stat \"%s\": %m", walFilePath);
+		return true;
+	}
+
+	uint64_t segmentSize = (uint64_t) st.st_size;
+
+	/* wal_segment_size is a power of 2 between 1MB and 1GB */
+	if (segmentSize < (1024 * 1024) ||
+		segmentSize > (1024 * 1024 * 1024) ||
+		(segmentSize & (segmentSize - 1)) != 0)
+	{
+		log_debug("Skipping WAL prefetch: WAL file \"%s\" has size %" PRIu64,
+				  walFilePath, segmentSize);
+		return true;
+	}
+
+	if (pg_mkdir_p(spoolDir, 0700) == -1)
+	{
+		log_warn("Failed to create directory \"%s\": %m", spoolDir);
+		return true;
+	}
+
+	(void) wal_prefetch_remove_old_segments(spoolDir, walFileName);
+
+	(void) wal_prefetch_segments(spoolDir, restoreCommand, prefetch,
+								 walFileName, restartPoint, segmentSize);
+
+	return true;
+}
+
+
+/*
+ * wal_prefetch_cleanup removes the spool directory and the WAL segments that
+ * have been prefetched, when Postgres is not a standby anymore.
+ */
+bool
+wal_prefetch_cleanup(const char *pgdata)
+{
+	char spoolDir[MAXPGPATH] = { 0 };
+
+	wal_prefetch_spool_path(pgdata, spoolDir);
+
+	if (!directory_exists(spoolDir))
+	{
+		return true;
+	}
+
+	log_debug("rm -rf \"%s\"", spoolDir);
+
+	if (!rmtree(spoolDir, true))
+	{
+		log_error("Failed to remove directory \"%s\": %m", spoolDir);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * wal_prefetch_spool_path sets spoolDir to the directory where we prefetch
+ * WAL segments. The directory is in pg_wal, where pg_basebackup does not copy
+ * files from, and on the same file system as the WAL files that Postgres
+ * restores, so that spooled files are moved there with a rename.
+ */
+static void
+wal_prefetch_spool_path(const char *pgdata, char *spoolDir)
+{
+	join_path_components(spoolDir, pgdata, "pg_wal");
+	join_path_components(spoolDir, spoolDir, WAL_PREFETCH_SPOOL_DIRNAME);
+}
+
+
+/*
+ * wal_prefetch_file_is_segment returns true when the given WAL file name is
+ * the name of a WAL segment, rather than a history, backup, or partial file.
+ */
+static bool
+wal_prefetch_file_is_segment(const char *walFileName)
+{
+	return strlen(walFileName) == WAL_FILE_NAME_LEN &&
+		   strspn(walFileName, "0123456789ABCDEF") == WAL_FILE_NAME_LEN;
+}
+
+
+/*
+ * wal_prefetch_next_segment computes the file name of the WAL segment that
+ * follows the given one, as the XLogFileName() macro of Postgres would.
+ */
+static bool
+wal_prefetch_next_segment(const char *walFileName,
+						  uint64_t segmentSize,
+						  char *nextFileName)
+{
+	unsigned int tli = 0;
+	unsigned int log = 0;
+	unsigned int seg = 0;
+
+	if (sscanf(walFileName, "%08X%08X%08X", &tli, &log, &seg) != 3)
+	{
+		return false;
+	}
+
+	uint64_t segmentsPerLog = UINT64_C(0x100000000) / segmentSize;
+	uint64_t segno = (uint64_t) log * segmentsPerLog + seg + 1;
+
+	sformat(nextFileName, MAXPGPATH, "%08X%08X%08X",
+			tli,
+			(uint32_t) (segno / segmentsPerLog),
+			(uint32_t) (segno % segmentsPerLog));
+
+	return true;
+}
+
+
+/*
+ * wal_prefetch_prepare_command replaces the %f, %p, %r and %% placeholders of
+ * the restore command template, as Postgres does for restore_command.
+ */
+static bool
+wal_prefetch_prepare_command(const char *restoreCommand,
+							 const char *walFileName,
+							 const char *walFilePath,
+							 const char *restartPoint,
+							 PQExpBuffer command)
+{
+	for (const char *ptr = restoreCommand; *ptr != '\0'; ptr++)
+	{
+		if (ptr[0] == '%' && ptr[1] != '\0')
+		{
+			switch (*++ptr)
+			{
+				case 'f':
+				{
+					appendPQExpBufferStr(command, walFileName);
+					break;
+				}
+
+				case 'p':
+				{
+					appendPQExpBufferStr(command, walFilePath);
+					break;
+				}
+
+				case 'r':
+				{
+					appendPQExpBufferStr(command, restartPoint);
+					break;
+				}
+
+				case '%':
+				{
+					appendPQExpBufferChar(command, '%');
+					break;
+				}
+
+				default:
+				{
+					/* unknown placeholders are kept as-is, as Postgres does */
+					appendPQExpBufferChar(command, '%');
+					appendPQExpBufferChar(command, *ptr);
+					break;
+				}
+			}
+		}
+		else
+		{
+			appendPQExpBufferChar(command, *ptr);
+		}
+	}
+
+	if (PQExpBufferBroken(command))
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * wal_prefetch_remove_old_segments removes the WAL segments in the spool
+ * directory that Postgres is not going to ask for anymore: the ones on the
+ * same timeline that come before walFileName.
+ */
+static void
+wal_prefetch_remove_old_segments(const char *spoolDir, const char *walFileName)
+{
+	DIR *dir = opendir(spoolDir);
+
+	if (dir == NULL)
+	{
+		log_debug("Failed to open directory \"%s\": %m", spoolDir);
+		return;
+	}
+
+	struct dirent *entry = NULL;
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char *name = entry->d_name;
+
+		if (!wal_prefetch_file_is_segment(name) ||
+			strncmp(name, walFileName, 8) != 0 ||
+			strcmp(name, walFileName) >= 0)
+		{
+			continue;
+		}
+
+		char filePath[MAXPGPATH] = { 0 };
+
+		join_path_components(filePath, spoolDir, name);
+
+		log_debug("rm \"%s\"", filePath);
+		(void) unlink(filePath);
+	}
+
+	closedir(dir);
+}
+
+
+/*
+ * wal_prefetch_segments fetches the WAL segments that follow walFileName
+ * into the spool directory, running up to prefetch restore commands in
+ * parallel, and waits until they are all done.
+ *
+ * To keep most of the calls to our restore_command fast, we only fetch WAL
+ * segments when less than half of the next prefetch segments are found in the
+ * spool directory already. Failing to fetch a segment is expected at the end
+ * of the archive, and is not an error.
+ */
+static void
+wal_prefetch_segments(const char *spoolDir,
+					  const char *restoreCommand,
+					  int prefetch,
+					  const char *walFileName,
+					  const char *restartPoint,
+					  uint64_t segmentSize)
+{
+	char segments[WAL_PREFETCH_MAX][MAXPGPATH] = { 0 };
+	pid_t pids[WAL_PREFETCH_MAX] = { 0 };
+	int segmentCount = 0;
+	int spooledCount = 0;
+
+	char currentFileName[MAXPGPATH] = { 0 };
+
+	strlcpy(currentFileName, walFileName, sizeof(currentFileName));
+
+	if (prefetch > WAL_PREFETCH_MAX)
+	{
+		prefetch = WAL_PREFETCH_MAX;
+	}
+
+	for (int i = 0; i < prefetch; i++)
+	{
+		char nextFileName[MAXPGPATH] = { 0 };
+		char spoolFilePath[MAXPGPATH] = { 0 };
+
+		if (!wal_prefetch_next_segment(currentFileName,
+									   segmentSize,
+									   nextFileName))
+		{
+			break;
+		}
+
+		strlcpy(currentFileName, nextFileName, sizeof(currentFileName));
+		join_path_components(spoolFilePath, spoolDir, nextFileName);
+
+		if (file_exists(spoolFilePath))
+		{
+			++spooledCount;
+		}
+		else
+		{
+			strlcpy(segments[segmentCount++], nextFileName, MAXPGPATH);
+		}
+	}
+
+	if (segmentCount == 0 || spooledCount >= (prefetch + 1) / 2)
+	{
+		return;
+	}
+
+	log_debug("Prefetching %d WAL segments from \"%s\" to \"%s\"",
+			  segmentCount, segments[0], segments[segmentCount - 1]);
+
+	/* flush stdio before forking, so that buffers don't get written twice */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < segmentCount; i++)
+	{
+		char tempFilePath[MAXPGPATH] = { 0 };
+		char spoolFilePath[MAXPGPATH] = { 0 };
+
+		join_path_components(spoolFilePath, spoolDir, segments[i]);
+		sformat(tempFilePath, sizeof(tempFilePath), "%s.tmp", spoolFilePath);
+
+		PQExpBuffer command = createPQExpBuffer();
+
+		if (!wal_prefetch_prepare_command(restoreCommand,
+										  segments[i],
+										  tempFilePath,
+										  restartPoint,
+										  command))
+		{
+			destroyPQExpBuffer(command);
+			break;
+		}
+
+		pid_t pid = fork();
+
+		switch (pid)
+		{
+			case -1:
+			{
+				log_warn("Failed to fork a WAL prefetch process: %m");
+				destroyPQExpBuffer(command);
+				break;
+			}
+
+			case 0:
+			{
+				/* child process: fetch the segment, then publish it */
+				int returnCode = system(command->data);
+
+				if (returnCode == 0 && rename(tempFilePath, spoolFilePath) == 0)
+				{
+					exit(EXIT_CODE_QUIT);
+				}
+
+				(void) unlink(tempFilePath);
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			default:
+			{
+				pids[i] = pid;
+				destroyPQExpBuffer(command);
+				break;
+			}
+		}
+
+		if (pid == -1)
+		{
+			break;
+		}
+	}
+
+	for (int i = 0; i < segmentCount; i++)
+	{
+		int status = 0;
+
+		if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] &&
+			WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CODE_QUIT)
+		{
+			log_debug("Prefetched WAL segment \"%s\"", segments[i]);
+		}
+	}
+}
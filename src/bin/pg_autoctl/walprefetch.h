@@ -0,0 +1,27 @@
+/*
+ * src/bin/pg_autoctl/walprefetch.h
+ *     Implement a restore_command that fetches WAL segments from the archive
+ *     in parallel, ahead of the Postgres recovery process.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef WALPREFETCH_H
+#define WALPREFETCH_H
+
+#include <stdbool.h>
+
+#define WAL_PREFETCH_SPOOL_DIRNAME "pg_autoctl_prefetch"
+#define WAL_PREFETCH_MAX 32
+
+bool wal_prefetch_restore(const char *pgdata,
+						  const char *restoreCommand,
+						  int prefetch,
+						  const char *walFileName,
+						  const char *walFilePath,
+						  const char *restartPoint);
+bool wal_prefetch_cleanup(const char *pgdata);
+
+#endif /* WALPREFETCH_H */
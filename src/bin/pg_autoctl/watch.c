@@ -10,6 +10,8 @@
 #include <inttypes.h>
 #include <getopt.h>
 #include <math.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <curses.h>
@@ -40,18 +42,38 @@
 #include "pidfile.h"
 #include "state.h"
 #include "string_utils.h"
+#include "system_utils.h"
 #include "watch.h"
 #include "watch_colspecs.h"
 
 volatile sig_atomic_t window_size_changed = 0;      /* SIGWINCH */
 
 static bool cli_watch_update_from_monitor(WatchContext *context);
+static bool cli_watch_update_changed_nodes(WatchContext *context,
+										   MonitorChangedNodes *changes);
+static bool cli_watch_refresh_from_monitor(WatchContext *context);
+static bool cli_watch_append_new_events(WatchContext *context);
+static void cli_watch_update_fleet(WatchContext *context, uint64_t now);
+static bool cli_watch_render_fleet(WatchContext *context);
+static void print_fleet_header(WatchContext *context, int r);
+static void format_fleet_group(FleetGroupState *group,
+							   int formationSize, int primarySize,
+							   char *line, size_t size);
+static uint32_t watch_hash_fleet_group(uint32_t hash, bool selected,
+									   FleetGroupState *group);
+static void cli_watch_wait(WatchContext *context);
 static bool cli_watch_process_keys(WatchContext *context);
 
-static int print_watch_header(WatchContext *context, int r);
+static void cli_watch_next_group_filter(WatchContext *context);
+static bool cli_watch_filter_nodes(WatchContext *context);
+static int cli_watch_count_filtered_events(WatchContext *context);
+
+static int print_watch_header(WatchContext *context, int r, int nodeRows);
+static void print_node_progress(WatchContext *context, int r);
 static int print_watch_footer(WatchContext *context);
-static int print_nodes_array(WatchContext *context, int r, int c);
-static int print_events_array(WatchContext *context, int r, int c);
+static bool print_nodes_array(WatchContext *context, int r, int count);
+static bool print_events_array(WatchContext *context, int r, int count);
+static void print_window_too_small(WatchContext *context);
 
 static void print_current_time(WatchContext *context, int r);
 
@@ -92,6 +114,21 @@ static void watch_set_state_attributes(NodeState state, bool toggle);
 
 static void clear_line_at(int row);
 
+static void watch_reset_frame(WatchContext *context);
+static bool watch_row_changed(WatchContext *context, int row, uint32_t hash);
+static uint32_t watch_hash_bytes(uint32_t hash, const void *data, size_t size);
+static uint32_t watch_hash_int(uint32_t hash, int64_t value);
+static uint32_t watch_hash_string(uint32_t hash, const char *str);
+static uint32_t watch_hash_column_policy(WatchContext *context,
+										 ColPolicy *policy);
+static uint32_t watch_hash_node_state(uint32_t hash, bool selected,
+									  CurrentNodeState *nodeState);
+static uint32_t watch_hash_event_column_policy(WatchContext *context,
+											   EventColPolicy *policy);
+
+/* FNV-1a 32 bits offset basis, used as the initial value of our hashes */
+#define WATCH_HASH_INIT 2166136261u
+
 
 /*
  * catch_sigwinch is registered as the SIGWINCH signal handler.
@@ -106,33 +143,25 @@ catch_sigwinch(int sig)
 
 /*
  * watch_main_loop takes over the terminal window and displays the state and
- * events in there, refreshing the output often, as when using the watch(1)
- * command, or similar to what top(1) would be doing.
+ * events in there, as when using the watch(1) command, or similar to what
+ * top(1) would be doing. Rather than polling the monitor, we block until
+ * either a key is pressed or the monitor notifies a state change.
  */
 void
 cli_watch_main_loop(WatchContext *context)
 {
-	WatchContext previous = { 0 };
-
-	int step = -1;
+	/* start with displaying all the groups */
+	context->groupFilter = -1;
+	context->filteredGroup = -1;
 
 	/* the main loop */
 	for (;;)
 	{
-		instr_time start;
-		instr_time duration;
-
-		INSTR_TIME_SET_CURRENT(start);
-
 		/*
 		 * First, update the data that we want to display, and process key
-		 * strokes. We are going to update our data set twice per second, and
-		 * we want to react to key strokes and other events much faster than
-		 * this, every 50ms.
+		 * strokes.
 		 */
-		step = (step + 1) % 10;
-
-		(void) cli_watch_update(context, step);
+		(void) cli_watch_update(context);
 
 		if (context->shouldExit)
 		{
@@ -142,7 +171,7 @@ cli_watch_main_loop(WatchContext *context)
 		/* now display the context we have */
 		if (context->couldContactMonitor)
 		{
-			(void) cli_watch_render(context, &previous);
+			(void) cli_watch_render(context);
 		}
 		else if (!context->cookedMode)
 		{
@@ -152,22 +181,59 @@ cli_watch_main_loop(WatchContext *context)
 			endwin();
 		}
 
-		/* and then sleep for the rest of the 50 ms */
-		INSTR_TIME_SET_CURRENT(duration);
-		INSTR_TIME_SUBTRACT(duration, start);
+		/* and then wait until something happens */
+		(void) cli_watch_wait(context);
+	}
 
-		int sleepMs = 50 - INSTR_TIME_GET_MILLISEC(duration);
+	(void) cli_watch_end_window(context);
+
+	currentNodeStateArrayFree(&(context->nodesArray));
+	monitor_events_array_free(&(context->eventsArray));
+	monitor_fleet_state_array_free(&(context->fleetArray));
+
+	free(context->filteredNodes);
+	context->filteredNodes = NULL;
+}
 
-		if (sleepMs > 0)
-		{
-			pg_usleep(sleepMs * 1000);
-		}
 
-		/* update the previous context */
-		previous = *context;
+/*
+ * cli_watch_wait blocks until a key is pressed, the monitor sends a
+ * notification, a signal is received, or PG_AUTOCTL_WATCH_POLL_TIMEOUT has
+ * passed, so that we still update the current time displayed.
+ */
+static void
+cli_watch_wait(WatchContext *context)
+{
+	struct pollfd fds[2] = { 0 };
+	int count = 0;
+
+	fds[count].fd = STDIN_FILENO;
+	fds[count].events = POLLIN;
+	++count;
+
+	int monitorSock = context->listening
+					  ? monitor_notification_socket(&(context->monitor))
+					  : -1;
+
+	if (monitorSock >= 0)
+	{
+		fds[count].fd = monitorSock;
+		fds[count].events = POLLIN;
+		++count;
 	}
 
-	(void) cli_watch_end_window(context);
+	int ready = poll(fds, count, PG_AUTOCTL_WATCH_POLL_TIMEOUT);
+
+	/* EINTR is expected when receiving SIGWINCH */
+	if (ready < 0 && errno != EINTR)
+	{
+		log_warn("Failed to wait for input: %m");
+		pg_usleep(PG_AUTOCTL_WATCH_POLL_TIMEOUT * 1000);
+		return;
+	}
+
+	context->notified =
+		ready > 0 && monitorSock >= 0 && (fds[1].revents & POLLIN) != 0;
 }
 
 
@@ -220,12 +286,58 @@ cli_watch_end_window(WatchContext *context)
  * watch_update updates the context to be displayed on the terminal window.
  */
 bool
-cli_watch_update(WatchContext *context, int step)
+cli_watch_update(WatchContext *context)
 {
-	/* only update data from the monitor at step 0 */
-	if (step == 0)
+	uint64_t now = time(NULL);
+
+	if (context->fleet)
+	{
+		(void) cli_watch_update_fleet(context, now);
+	}
+	else if (!context->listening)
 	{
+		/* (re)connect: fetch everything and then LISTEN for changes */
 		context->couldContactMonitor = cli_watch_update_from_monitor(context);
+		++context->dataVersion;
+
+		context->listening =
+			context->couldContactMonitor &&
+			monitor_listen_state_changes(&(context->monitor),
+										 context->formation,
+										 context->groupId);
+
+		context->lastRefreshTime = now;
+	}
+	else if (context->notified)
+	{
+		MonitorChangedNodes changes = { 0 };
+
+		context->notified = false;
+
+		if (!monitor_consume_state_changes(&(context->monitor), &changes))
+		{
+			/* we lost the connection, reconnect at the next update */
+			context->listening = false;
+		}
+		else if (changes.overflow)
+		{
+			context->couldContactMonitor =
+				cli_watch_update_from_monitor(context);
+			++context->dataVersion;
+		}
+		else if (changes.count > 0)
+		{
+			context->couldContactMonitor =
+				cli_watch_update_changed_nodes(context, &changes);
+			++context->dataVersion;
+		}
+	}
+	else if ((now - context->lastRefreshTime) >=
+			 PG_AUTOCTL_WATCH_REFRESH_INTERVAL)
+	{
+		context->couldContactMonitor = cli_watch_refresh_from_monitor(context);
+		context->lastRefreshTime = now;
+		++context->dataVersion;
 	}
 
 	/* now process any key pressed by the user */
@@ -285,13 +397,252 @@ cli_watch_update_from_monitor(WatchContext *context)
 		return false;
 	}
 
+	if (!monitor_get_node_progress(monitor,
+								   context->formation,
+								   context->groupId,
+								   &(context->progressArray)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	/* time to finish our connection */
 	pgsql_finish(pgsql);
 
+	context->lastEventId =
+		eventsArray->count > 0
+		? eventsArray->events[eventsArray->count - 1].eventId
+		: 0;
+
 	return true;
 }
 
 
+/*
+ * cli_watch_update_changed_nodes fetches the current state of only the nodes
+ * that changed, as notified by the monitor, and the events that happened
+ * since the last one we display. When a notified node is not part of our
+ * nodes array, it has just been added or removed, and we fetch everything
+ * again.
+ */
+static bool
+cli_watch_update_changed_nodes(WatchContext *context,
+							   MonitorChangedNodes *changes)
+{
+	Monitor *monitor = &(context->monitor);
+	CurrentNodeStateArray *nodesArray = &(context->nodesArray);
+	CurrentNodeStateArray changedArray = { 0 };
+	bool fetchEverything = false;
+
+	PGSQL *pgsql = &(monitor->pgsql);
+
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	if (!monitor_get_current_state_of_nodes(monitor,
+											context->formation,
+											changes,
+											&changedArray))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		currentNodeStateArrayFree(&changedArray);
+		return false;
+	}
+
+	/* a node that has been dropped is not returned anymore */
+	fetchEverything = changedArray.count != changes->count;
+
+	for (int c = 0; c < changedArray.count && !fetchEverything; c++)
+	{
+		CurrentNodeState *changed = &(changedArray.nodes[c]);
+		bool found = false;
+
+		for (int n = 0; n < nodesArray->count; n++)
+		{
+			if (nodesArray->nodes[n].node.nodeId == changed->node.nodeId)
+			{
+				nodesArray->nodes[n] = *changed;
+				found = true;
+				break;
+			}
+		}
+
+		fetchEverything = !found;
+	}
+
+	currentNodeStateArrayFree(&changedArray);
+
+	if (fetchEverything)
+	{
+		pgsql_finish(pgsql);
+
+		return cli_watch_update_from_monitor(context);
+	}
+
+	if (!monitor_get_formation_number_sync_standbys(
+			monitor,
+			context->formation,
+			&(context->number_sync_standbys)))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	bool success = cli_watch_append_new_events(context);
+
+	pgsql_finish(pgsql);
+
+	return success;
+}
+
+
+/*
+ * cli_watch_append_new_events fetches the events that happened since the
+ * last one we display, and appends them to our events array, where we keep
+ * only the last EVENTS_BUFFER_COUNT events.
+ */
+static bool
+cli_watch_append_new_events(WatchContext *context)
+{
+	MonitorEventsArray *eventsArray = &(context->eventsArray);
+	MonitorEventsArray newEvents = { 0 };
+
+	if (!monitor_get_events_since(&(context->monitor),
+								  context->formation,
+								  context->groupId,
+								  context->lastEventId,
+								  EVENTS_BUFFER_COUNT,
+								  &newEvents))
+	{
+		/* errors have already been logged */
+		monitor_events_array_free(&newEvents);
+		return false;
+	}
+
+	if (newEvents.count == 0)
+	{
+		monitor_events_array_free(&newEvents);
+		return true;
+	}
+
+	/* make room for the new events, dropping the oldest ones */
+	int keep = Min(eventsArray->count, EVENTS_BUFFER_COUNT - newEvents.count);
+	int drop = eventsArray->count - keep;
+
+	if (!monitor_events_array_reserve(eventsArray, keep + newEvents.count))
+	{
+		/* errors have already been logged */
+		monitor_events_array_free(&newEvents);
+		return false;
+	}
+
+	memmove(eventsArray->events,
+			eventsArray->events + drop,
+			keep * sizeof(MonitorEvent));
+
+	memcpy(eventsArray->events + keep,
+		   newEvents.events,
+		   newEvents.count * sizeof(MonitorEvent));
+
+	eventsArray->count = keep + newEvents.count;
+
+	context->lastEventId = eventsArray->events[eventsArray->count - 1].eventId;
+
+	monitor_events_array_free(&newEvents);
+
+	return true;
+}
+
+
+/*
+ * cli_watch_refresh_from_monitor fetches the current state of the nodes
+ * again, to refresh the health check and report lags that change without
+ * notifications, and the progress of the pg_basebackup and pg_rewind
+ * operations.
+ */
+static bool
+cli_watch_refresh_from_monitor(WatchContext *context)
+{
+	Monitor *monitor = &(context->monitor);
+	PGSQL *pgsql = &(monitor->pgsql);
+
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	bool success =
+		monitor_get_current_state(monitor,
+								  context->formation,
+								  context->groupId,
+								  &(context->nodesArray)) &&
+		monitor_get_node_progress(monitor,
+								  context->formation,
+								  context->groupId,
+								  &(context->progressArray));
+
+	pgsql_finish(pgsql);
+
+	return success;
+}
+
+
+/*
+ * cli_watch_update_fleet updates the summary of all the groups of all the
+ * formations. That's a single query on the monitor, which we run again when
+ * any node of any formation changed state, and every
+ * PG_AUTOCTL_WATCH_REFRESH_INTERVAL to refresh the lags.
+ */
+static void
+cli_watch_update_fleet(WatchContext *context, uint64_t now)
+{
+	Monitor *monitor = &(context->monitor);
+	bool fetch = false;
+
+	if (!context->listening)
+	{
+		fetch = true;
+	}
+	else if (context->notified)
+	{
+		MonitorChangedNodes changes = { 0 };
+
+		context->notified = false;
+
+		if (!monitor_consume_state_changes(monitor, &changes))
+		{
+			/* we lost the connection, reconnect at the next update */
+			context->listening = false;
+		}
+		else
+		{
+			fetch = changes.overflow || changes.count > 0;
+		}
+	}
+	else if ((now - context->lastRefreshTime) >=
+			 PG_AUTOCTL_WATCH_REFRESH_INTERVAL)
+	{
+		fetch = true;
+	}
+
+	if (!fetch)
+	{
+		return;
+	}
+
+	context->couldContactMonitor =
+		monitor_get_fleet_state(monitor, &(context->fleetArray));
+	context->lastRefreshTime = now;
+	++context->dataVersion;
+
+	if (!context->listening)
+	{
+		/* a NULL formation is for the notifications of all the formations */
+		context->listening =
+			context->couldContactMonitor &&
+			monitor_listen_state_changes(monitor, NULL, -1);
+	}
+}
+
+
 /* Capture CTRL + a key */
 #define ctrl(x) ((x) & 0x1f)
 
@@ -401,14 +752,13 @@ cli_watch_process_keys(WatchContext *context)
 				--context->selectedRow;
 			}
 		}
-		/* page up, which is also C-u in the terminal with less/more etc */
+		/*
+		 * Page up, which is also C-u in the terminal with less/more etc. When
+		 * moving past the visible rows, cli_watch_render scrolls the area.
+		 */
 		else if (ch == KEY_PPAGE || ch == ctrl('u'))
 		{
-			if (context->selectedRow > 0 && context->selectedRow <= 6)
-			{
-				context->selectedRow = 1;
-			}
-			else if (context->selectedRow > 6)
+			if (context->selectedRow > 0)
 			{
 				context->selectedRow -= 5;
 			}
@@ -426,15 +776,12 @@ cli_watch_process_keys(WatchContext *context)
 		/* page down, which is also C-d in the terminal with less/more etc */
 		else if (ch == KEY_NPAGE || ch == ctrl('d'))
 		{
-			if (context->selectedRow < context->rows &&
-				context->selectedRow >= (context->rows - 6))
-			{
-				context->selectedRow = context->rows - 1;
-			}
-			else if (context->selectedRow < (context->rows - 6))
-			{
-				context->selectedRow += 5;
-			}
+			context->selectedRow += 5;
+		}
+		/* only display the nodes and events of the next group */
+		else if (ch == 'g')
+		{
+			(void) cli_watch_next_group_filter(context);
 		}
 		/* cancel current selected row */
 		else if (ch == KEY_DL || ch == KEY_DC)
@@ -442,158 +789,579 @@ cli_watch_process_keys(WatchContext *context)
 			context->selectedRow = 0;
 			context->selectedArea = 0;
 		}
-	} while (ch != ERR);
+	} while (ch != ERR);
+
+	return true;
+}
+
+
+/*
+ * watch_render displays the context on the terminal window.
+ *
+ * Only the visible window of the nodes and events arrays is considered, and
+ * only the rows where the data to display is different from what we drew at
+ * the previous render are drawn again, see WatchFrame.
+ */
+bool
+cli_watch_render(WatchContext *context)
+{
+	WatchFrame *frame = &(context->frame);
+
+	/* on the first call to render, initialize the ncurses terminal control */
+	if (!context->initialized)
+	{
+		(void) cli_watch_init_window(context);
+		context->initialized = true;
+	}
+
+	/*
+	 * When we fail to contact the monitor, we switch the terminal back to
+	 * cookedMode so that the usual stderr logs are visible. In that case the
+	 * render function is not called. When cli_watch_render() is called again,
+	 * it means we could contact the monitor and get an update, and we need to
+	 * take control of the terminal again.
+	 */
+	if (context->cookedMode)
+	{
+		reset_prog_mode();
+		refresh();
+
+		context->cookedMode = false;
+		(void) watch_reset_frame(context);
+	}
+
+	/* when the window size changed, we need to draw everything again */
+	if (frame->rows != context->rows || frame->cols != context->cols)
+	{
+		clear();
+		(void) watch_reset_frame(context);
+	}
+
+	if (context->fleet)
+	{
+		return cli_watch_render_fleet(context);
+	}
+
+	/* column sizes depend on all the nodes and events, not just visible ones */
+	if (context->sizedVersion != context->dataVersion)
+	{
+		(void) compute_column_spec_lens(context);
+		(void) compute_event_column_spec_lens(context);
+
+		context->sizedVersion = context->dataVersion;
+	}
+
+	if (!cli_watch_filter_nodes(context))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int eventsCount = cli_watch_count_filtered_events(context);
+
+	/*
+	 * Compute the layout of the screen: the nodes area is given as many rows
+	 * as possible while keeping at least half of the remaining rows for the
+	 * events, after the blank line and the events headers.
+	 */
+	int nodeHeaderRow = 2;
+	int firstNodeRow = nodeHeaderRow + 1;
+	int availableRows = Max(0, context->rows - firstNodeRow - 2);
+
+	int nodeRows =
+		Min(context->filteredCount,
+			availableRows - Min(eventsCount, availableRows / 2));
+
+	int maxNodeOffset = Max(0, context->filteredCount - nodeRows);
+	int lastNodeRow = firstNodeRow + nodeRows - 1;
+
+	int eventHeaderRow = lastNodeRow + 2; /* blank line, events headers */
+	int firstEventRow = eventHeaderRow + 1;
+	int eventRows = Max(0, Min(eventsCount, context->rows - firstEventRow));
+
+	int maxEventOffset = Max(0, eventsCount - eventRows);
+	int lastEventRow = firstEventRow + eventRows - 1;
+
+	/* the data might have changed since we scrolled */
+	context->nodeOffset = Min(context->nodeOffset, maxNodeOffset);
+	context->eventOffset = Min(context->eventOffset, maxEventOffset);
+
+	/* first usage of the arrow keys select an area */
+	if (context->selectedArea == 0 && context->selectedRow > 0)
+	{
+		context->selectedArea = 1;
+	}
+
+	/*
+	 * Adjust the selectedRow position to make sure we always select a row
+	 * that's part of the data: avoid empty separation lines, avoid header
+	 * lines.
+	 *
+	 * We conceptually divide the screen in two areas: first, the nodes array
+	 * area, and then the events area. When moving the selection out of the
+	 * visible rows of an area we first scroll that area, and when we reach
+	 * the end of the data we may jump to the other area directly.
+	 */
+	if (context->selectedArea == 1)
+	{
+		if (context->selectedRow < firstNodeRow)
+		{
+			int delta = firstNodeRow - context->selectedRow;
+
+			context->nodeOffset = Max(0, context->nodeOffset - delta);
+			context->selectedRow = firstNodeRow;
+		}
+		else if (context->selectedRow > lastNodeRow)
+		{
+			int delta = context->selectedRow - lastNodeRow;
+
+			if (context->nodeOffset < maxNodeOffset)
+			{
+				context->nodeOffset =
+					Min(maxNodeOffset, context->nodeOffset + delta);
+				context->selectedRow = lastNodeRow;
+			}
+			else
+			{
+				context->selectedArea = 2;
+				context->selectedRow = firstEventRow;
+			}
+		}
+	}
+	else if (context->selectedArea == 2)
+	{
+		if (context->selectedRow < firstEventRow)
+		{
+			int delta = firstEventRow - context->selectedRow;
+
+			if (context->eventOffset > 0)
+			{
+				context->eventOffset = Max(0, context->eventOffset - delta);
+				context->selectedRow = firstEventRow;
+			}
+			else
+			{
+				context->selectedArea = 1;
+				context->selectedRow = lastNodeRow;
+			}
+		}
+		else if (context->selectedRow > lastEventRow)
+		{
+			int delta = context->selectedRow - lastEventRow;
+
+			context->eventOffset =
+				Min(maxEventOffset, context->eventOffset + delta);
+			context->selectedRow = lastEventRow;
+		}
+	}
+
+	/*
+	 * Print the main header, which changes every second anyway, and then the
+	 * nodes array.
+	 */
+	(void) print_watch_header(context, 0, nodeRows);
+
+	/* the line after the header shows running base backups and rewinds */
+	(void) clear_line_at(1);
+	(void) print_node_progress(context, 1);
+
+	if (!print_nodes_array(context, nodeHeaderRow, nodeRows))
+	{
+		return true;
+	}
+
+	/* blank line between the nodes and the events */
+	if (watch_row_changed(context, lastNodeRow + 1, WATCH_HASH_INIT))
+	{
+		(void) clear_line_at(lastNodeRow + 1);
+	}
+
+	if (!print_events_array(context, eventHeaderRow, eventRows))
+	{
+		return true;
+	}
+
+	/* clean the remaining rows that we didn't use for displaying events */
+	for (int r = lastEventRow + 1; r < context->rows; r++)
+	{
+		if (watch_row_changed(context, r, WATCH_HASH_INIT))
+		{
+			(void) clear_line_at(r);
+		}
+	}
+
+	/* now display the footer */
+	(void) print_watch_footer(context);
+
+	refresh();
+
+	return true;
+}
+
+
+/*
+ * cli_watch_render_fleet displays one row per group of all the formations,
+ * scrolling when they don't fit on the screen. Groups that have no primary
+ * or some standby node that is not a healthy secondary are shown in bold.
+ */
+static bool
+cli_watch_render_fleet(WatchContext *context)
+{
+	FleetGroupStateArray *fleetArray = &(context->fleetArray);
+
+	int headerRow = 2;
+	int firstRow = headerRow + 1;
+	int visibleRows = Max(0, Min(fleetArray->count, context->rows - firstRow - 1));
+	int lastRow = firstRow + visibleRows - 1;
+	int maxOffset = Max(0, fleetArray->count - visibleRows);
+
+	/* the data might have changed since we scrolled */
+	context->nodeOffset = Min(context->nodeOffset, maxOffset);
+
+	/* the selection scrolls the groups when moving past the visible rows */
+	if (context->selectedRow > 0 && context->selectedRow < firstRow)
+	{
+		int delta = firstRow - context->selectedRow;
+
+		context->nodeOffset = Max(0, context->nodeOffset - delta);
+		context->selectedRow = firstRow;
+	}
+	else if (context->selectedRow > lastRow && visibleRows > 0)
+	{
+		int delta = context->selectedRow - lastRow;
+
+		context->nodeOffset = Min(maxOffset, context->nodeOffset + delta);
+		context->selectedRow = lastRow;
+	}
+
+	int formationSize = strlen("Formation");
+	int primarySize = strlen("Primary");
+
+	for (int index = 0; index < fleetArray->count; index++)
+	{
+		FleetGroupState *group = &(fleetArray->groups[index]);
+
+		formationSize = Max(formationSize, strlen(group->formation));
+		primarySize = Max(primarySize, strlen(group->primaryName));
+	}
+
+	(void) print_fleet_header(context, 0);
+
+	if (watch_row_changed(context, 1, WATCH_HASH_INIT))
+	{
+		(void) clear_line_at(1);
+	}
+
+	uint32_t layoutHash = watch_hash_int(WATCH_HASH_INIT, context->cols);
+
+	layoutHash = watch_hash_int(layoutHash, formationSize);
+	layoutHash = watch_hash_int(layoutHash, primarySize);
+
+	if (watch_row_changed(context, headerRow, layoutHash))
+	{
+		char header[BUFSIZE] = { 0 };
+
+		sformat(header, sizeof(header),
+				"%*s  %5s  %*s  %18s  %8s  %10s  %7s",
+				formationSize, "Formation",
+				"Group",
+				primarySize, "Primary",
+				"Primary State",
+				"Standbys", "Max Lag", "In Flux");
+
+		/* fill the whole line with the standout attribute */
+		attron(A_STANDOUT);
+		mvprintw(headerRow, 0, "%-*.*s", context->cols, context->cols, header);
+		attroff(A_STANDOUT);
+	}
+
+	for (int i = 0; i < visibleRows; i++)
+	{
+		int currentRow = firstRow + i;
+		FleetGroupState *group = &(fleetArray->groups[context->nodeOffset + i]);
+		bool selected = currentRow == context->selectedRow;
+		bool attention =
+			IS_EMPTY_STRING_BUFFER(group->primaryName) ||
+			group->healthyStandbyCount < group->standbyCount;
+
+		uint32_t hash = watch_hash_fleet_group(layoutHash, selected, group);
+
+		if (!watch_row_changed(context, currentRow, hash))
+		{
+			continue;
+		}
+
+		char line[BUFSIZE] = { 0 };
+
+		(void) format_fleet_group(group, formationSize, primarySize,
+								  line, sizeof(line));
+
+		clear_line_at(currentRow);
+
+		if (selected)
+		{
+			attron(A_REVERSE);
+		}
+
+		if (attention)
+		{
+			attron(A_BOLD);
+		}
+
+		mvprintw(currentRow, 0, "%.*s", context->cols, line);
+
+		if (attention)
+		{
+			attroff(A_BOLD);
+		}
+
+		if (selected)
+		{
+			attroff(A_REVERSE);
+		}
+	}
+
+	/* clean the remaining rows */
+	for (int r = lastRow + 1; r < context->rows; r++)
+	{
+		if (watch_row_changed(context, r, WATCH_HASH_INIT))
+		{
+			(void) clear_line_at(r);
+		}
+	}
+
+	(void) print_watch_footer(context);
+
+	refresh();
+
+	return true;
+}
+
+
+/*
+ * print_fleet_header prints the first line of the screen in fleet mode, with
+ * how many groups need attention, and the current time.
+ */
+static void
+print_fleet_header(WatchContext *context, int r)
+{
+	FleetGroupStateArray *fleetArray = &(context->fleetArray);
+	int formations = 0;
+	int noPrimary = 0;
+	int degraded = 0;
+	int inFlux = 0;
+
+	for (int index = 0; index < fleetArray->count; index++)
+	{
+		FleetGroupState *group = &(fleetArray->groups[index]);
+
+		if (index == 0 ||
+			strcmp(group->formation, fleetArray->groups[index - 1].formation) != 0)
+		{
+			++formations;
+		}
+
+		if (IS_EMPTY_STRING_BUFFER(group->primaryName))
+		{
+			++noPrimary;
+		}
+		else if (group->healthyStandbyCount < group->standbyCount)
+		{
+			++degraded;
+		}
+
+		if (group->inFlux)
+		{
+			++inFlux;
+		}
+	}
+
+	(void) print_current_time(context, r);
+
+	char header[BUFSIZE] = { 0 };
+
+	sformat(header, sizeof(header),
+			"Fleet: %d groups in %d formations - "
+			"No primary: %d - Degraded: %d - In flux: %d",
+			fleetArray->count, formations, noPrimary, degraded, inFlux);
+
+	/* keep 9 cols for the date at the end of the line */
+	mvprintw(r, 0, "%.*s", Max(0, context->cols - 9), header);
+}
+
+
+/*
+ * format_fleet_group prepares the line to display for the given group in
+ * fleet mode, using the same columns as pg_autoctl show state --fleet.
+ */
+static void
+format_fleet_group(FleetGroupState *group,
+				   int formationSize, int primarySize,
+				   char *line, size_t size)
+{
+	char standbys[BUFSIZE] = { 0 };
+	char lag[BUFSIZE] = { 0 };
+
+	sformat(standbys, sizeof(standbys), "%d/%d",
+			group->healthyStandbyCount, group->standbyCount);
+
+	if (group->maxLagBytes >= 0)
+	{
+		(void) pretty_print_bytes(lag, sizeof(lag), group->maxLagBytes);
+	}
+
+	sformat(line, size, "%*s  %5d  %*s  %18s  %8s  %10s  %7s",
+			formationSize, group->formation,
+			group->groupId,
+			primarySize, group->primaryName,
+			IS_EMPTY_STRING_BUFFER(group->primaryName)
+			? "none"
+			: NodeStateToString(group->primaryState),
+			standbys,
+			lag,
+			group->inFlux ? "yes" : "no");
+}
+
+
+/*
+ * cli_watch_next_group_filter cycles through displaying all the groups and
+ * then only the nodes and events of each group, in groupId order.
+ */
+static void
+cli_watch_next_group_filter(WatchContext *context)
+{
+	CurrentNodeStateArray *nodesArray = &(context->nodesArray);
+	int nextGroupId = -1;
+
+	for (int index = 0; index < nodesArray->count; index++)
+	{
+		int groupId = nodesArray->nodes[index].groupId;
+
+		if (groupId > context->groupFilter &&
+			(nextGroupId == -1 || groupId < nextGroupId))
+		{
+			nextGroupId = groupId;
+		}
+	}
 
-	return true;
+	context->groupFilter = nextGroupId;
+	context->nodeOffset = 0;
+	context->eventOffset = 0;
 }
 
 
 /*
- * watch_render displays the context on the terminal window.
+ * cli_watch_filter_nodes computes the list of the nodes to display given the
+ * current group filter, only when the data or the filter changed.
  */
-bool
-cli_watch_render(WatchContext *context, WatchContext *previous)
+static bool
+cli_watch_filter_nodes(WatchContext *context)
 {
-	int printedRows = 0;
+	CurrentNodeStateArray *nodesArray = &(context->nodesArray);
 
-	/* on the first call to render, initialize the ncurses terminal control */
-	if (!context->initialized)
+	if (context->filteredVersion == context->dataVersion &&
+		context->filteredGroup == context->groupFilter)
 	{
-		(void) cli_watch_init_window(context);
-		context->initialized = true;
+		return true;
 	}
 
-	/*
-	 * When we fail to contact the monitor, we switch the terminal back to
-	 * cookedMode so that the usual stderr logs are visible. In that case the
-	 * render function is not called. When cli_watch_render() is called again,
-	 * it means we could contact the monitor and get an update, and we need to
-	 * take control of the terminal again.
-	 */
-	if (context->cookedMode)
+	if (context->filteredCapacity < nodesArray->count)
 	{
-		reset_prog_mode();
-		refresh();
-
-		context->cookedMode = false;
-	}
+		int *filteredNodes =
+			realloc(context->filteredNodes, nodesArray->count * sizeof(int));
 
-	/* adjust selected row to fit the selected area */
-	int nodeHeaderRow = 2;
-	int firstNodeRow = nodeHeaderRow + 1;
-	int lastNodeRow = firstNodeRow + context->nodesArray.count - 1;
-
-	int eventHeaderRow = lastNodeRow + 2; /* blank line, evenzt headers */
-	int firstEventRow = eventHeaderRow + 1;
-	int lastEventRow = firstEventRow + context->eventsArray.count - 1;
+		if (filteredNodes == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
 
-	if (lastEventRow > context->rows)
-	{
-		lastEventRow = context->rows;
+		context->filteredNodes = filteredNodes;
+		context->filteredCapacity = nodesArray->count;
 	}
 
-	/* first usage of the arrow keys select an area */
-	if (context->selectedArea == 0 && context->selectedRow > 0)
-	{
-		context->selectedArea = 1;
-	}
+	context->filteredCount = 0;
 
-	/*
-	 * Adjust the selectedRow position to make sure we always select a row
-	 * that's part of the data: avoid empty separation lines, avoid header
-	 * lines.
-	 *
-	 * We conceptually divide the screen in two areas: first, the nodes array
-	 * area, and then the events area. When scrolling away from an area we may
-	 * jump to the other area directly.
-	 */
-	if (context->selectedArea == 1)
-	{
-		if (context->selectedRow < firstNodeRow)
-		{
-			context->selectedRow = firstNodeRow;
-		}
-		else if (context->selectedRow > lastNodeRow)
-		{
-			context->selectedArea = 2;
-			context->selectedRow = firstEventRow;
-		}
-	}
-	else if (context->selectedArea == 2)
+	for (int index = 0; index < nodesArray->count; index++)
 	{
-		if (context->selectedRow < firstEventRow)
-		{
-			context->selectedArea = 1;
-			context->selectedRow = lastNodeRow;
-		}
-		else if (context->selectedRow > lastEventRow)
+		if (context->groupFilter == -1 ||
+			nodesArray->nodes[index].groupId == context->groupFilter)
 		{
-			context->selectedRow = lastEventRow;
+			context->filteredNodes[context->filteredCount++] = index;
 		}
 	}
 
-	/*
-	 * Print the main header and then the nodes array.
-	 */
-	printedRows += print_watch_header(context, 0);
-
-	/* skip empty lines and headers */
-	(void) clear_line_at(1);
-	++printedRows;
+	context->filteredVersion = context->dataVersion;
+	context->filteredGroup = context->groupFilter;
 
-	int nodeRows = print_nodes_array(context, nodeHeaderRow, 0);
-	printedRows += nodeRows;
+	return true;
+}
 
-	(void) clear_line_at(printedRows);
 
-	/*
-	 * Now print the events array. Because that operation is more expensive,
-	 * and because most of the times there is no event happening, we compare
-	 * the current context with the previous one and avoid this part of the
-	 * code entirely when we figure out that we would only redisplay what's
-	 * already visible on the terminal.
-	 */
+/*
+ * cli_watch_count_filtered_events returns how many events we have to display
+ * given the current group filter.
+ */
+static int
+cli_watch_count_filtered_events(WatchContext *context)
+{
+	MonitorEventsArray *eventsArray = &(context->eventsArray);
 
-	if (context->rows != previous->rows ||
-		context->cols != previous->cols ||
-		context->selectedRow != previous->selectedRow ||
-		context->selectedArea != previous->selectedArea ||
-		context->startCol != previous->startCol ||
-		context->cookedMode != previous->cookedMode ||
-		context->eventsArray.count != previous->eventsArray.count ||
-		(context->eventsArray.events[0].eventId !=
-		 previous->eventsArray.events[0].eventId))
+	if (context->groupFilter == -1)
 	{
-		(void) clear_line_at(++printedRows);
+		return eventsArray->count;
+	}
 
-		printedRows += print_events_array(context, eventHeaderRow, 0);
+	int count = 0;
 
-		/* clean the remaining rows that we didn't use for displaying events */
-		if (printedRows < context->rows)
+	for (int index = 0; index < eventsArray->count; index++)
+	{
+		if (eventsArray->events[index].groupId == context->groupFilter)
 		{
-			for (int r = printedRows; r < context->rows; r++)
-			{
-				(void) clear_line_at(r);
-			}
+			++count;
 		}
 	}
 
-	/* now display the footer */
-	(void) print_watch_footer(context);
+	return count;
+}
 
-	refresh();
 
-	return true;
+/*
+ * print_node_progress prints the progress of the first pg_basebackup or
+ * pg_rewind operation currently running, if any, at the given row.
+ */
+static void
+print_node_progress(WatchContext *context, int r)
+{
+	NodeProgressArray *progressArray = &(context->progressArray);
+	char line[BUFSIZE] = { 0 };
+
+	if (progressArray->count == 0)
+	{
+		return;
+	}
+
+	(void) nodeProgressToString(&(progressArray->nodes[0]), line, sizeof(line));
+
+	if (progressArray->count > 1)
+	{
+		mvprintw(r, 0, "%.*s (and %d more)",
+				 context->cols - 16, line, progressArray->count - 1);
+	}
+	else
+	{
+		mvprintw(r, 0, "%.*s", context->cols, line);
+	}
 }
 
 
 /*
  * print_watch_header prints the first line of the screen, with the current
- * formation that's being displayed, the number_sync_standbys, and the current
- * time.
+ * formation that's being displayed, the number_sync_standbys, the group
+ * filter and the visible nodes when they don't all fit, and the current time.
  */
 static int
-print_watch_header(WatchContext *context, int r)
+print_watch_header(WatchContext *context, int r, int nodeRows)
 {
 	int c = 0;
 
@@ -625,10 +1393,40 @@ print_watch_header(WatchContext *context, int r)
 		c += 8;
 	}
 
+	char nss[BUFSIZE] = { 0 };
+
+	sformat(nss, sizeof(nss), "%d", context->number_sync_standbys);
+
 	attron(A_BOLD);
-	mvprintw(r, c, "%d", context->number_sync_standbys);
+	mvprintw(r, c, "%s", nss);
 	attroff(A_BOLD);
 
+	c += strlen(nss);
+
+	char details[BUFSIZE] = { 0 };
+	int len = 0;
+
+	if (context->groupFilter != -1)
+	{
+		len += sformat(details + len, sizeof(details) - len,
+					   " - Group: %d", context->groupFilter);
+	}
+
+	if (nodeRows > 0 && nodeRows < context->filteredCount)
+	{
+		len += sformat(details + len, sizeof(details) - len,
+					   " - Nodes: %d-%d/%d",
+					   context->nodeOffset + 1,
+					   context->nodeOffset + nodeRows,
+					   context->filteredCount);
+	}
+
+	/* keep 9 cols for the date at the end of the line */
+	if (len > 0 && context->cols > (c + 9 + len))
+	{
+		mvprintw(r, c, "%s", details);
+	}
+
 	/* we only use one row */
 	return 1;
 }
@@ -680,41 +1478,46 @@ print_watch_footer(WatchContext *context)
 
 
 /*
- * print_nodes_array prints a nodes array at the given position (r, c) in a
- * window of size (context->rows, context->cols).
+ * print_nodes_array prints count nodes of the filtered nodes array, starting
+ * at context->nodeOffset, at the given row r, below the column headers.
  */
-static int
-print_nodes_array(WatchContext *context, int r, int c)
+static bool
+print_nodes_array(WatchContext *context, int r, int count)
 {
 	CurrentNodeStateArray *nodesArray = &(context->nodesArray);
 
-	int lines = 0;
-	int currentRow = r;
-
-	(void) compute_column_spec_lens(context);
-
 	ColPolicy *columnPolicy = pick_column_policy(context);
 
 	if (columnPolicy == NULL)
 	{
-		clear();
-		mvprintw(0, 0, "Window too small: %dx%d", context->rows, context->cols);
-		refresh();
-
+		(void) print_window_too_small(context);
 		return false;
 	}
 
-	/* display the headers */
-	clear_line_at(currentRow);
-	(void) print_column_headers(context, columnPolicy, currentRow++, c);
+	uint32_t layoutHash = watch_hash_column_policy(context, columnPolicy);
 
-	++lines;
+	/* display the headers */
+	if (watch_row_changed(context, r, layoutHash))
+	{
+		(void) print_column_headers(context, columnPolicy, r, 0);
+	}
 
 	/* display the data */
-	for (int index = 0; index < nodesArray->count; index++)
+	for (int i = 0; i < count; i++)
 	{
+		int currentRow = r + 1 + i;
+		int index = context->filteredNodes[context->nodeOffset + i];
 		bool selected = currentRow == context->selectedRow;
 
+		uint32_t hash =
+			watch_hash_node_state(layoutHash, selected,
+								  &(nodesArray->nodes[index]));
+
+		if (!watch_row_changed(context, currentRow, hash))
+		{
+			continue;
+		}
+
 		clear_line_at(currentRow);
 
 		if (selected)
@@ -722,22 +1525,30 @@ print_nodes_array(WatchContext *context, int r, int c)
 			attron(A_REVERSE);
 		}
 
-		(void) print_node_state(context, columnPolicy, index, currentRow++, c);
+		(void) print_node_state(context, columnPolicy, index, currentRow, 0);
 
 		if (selected)
 		{
 			attroff(A_REVERSE);
 		}
+	}
 
-		++lines;
+	return true;
+}
 
-		if (context->rows <= currentRow)
-		{
-			break;
-		}
-	}
 
-	return lines;
+/*
+ * print_window_too_small replaces the whole display with a message, and
+ * forgets about what was drawn before.
+ */
+static void
+print_window_too_small(WatchContext *context)
+{
+	clear();
+	mvprintw(0, 0, "Window too small: %dx%d", context->rows, context->cols);
+	refresh();
+
+	(void) watch_reset_frame(context);
 }
 
 
@@ -1154,6 +1965,192 @@ clear_line_at(int row)
 }
 
 
+/*
+ * watch_reset_frame forgets about what's been drawn on the screen, so that
+ * the next render draws every row.
+ */
+static void
+watch_reset_frame(WatchContext *context)
+{
+	WatchFrame *frame = &(context->frame);
+
+	frame->rows = context->rows;
+	frame->cols = context->cols;
+
+	memset(frame->rowHash, 0, sizeof(frame->rowHash));
+}
+
+
+/*
+ * watch_row_changed returns true when the given row must be drawn, because
+ * the hash of what we want to display there is not the same as the hash of
+ * what we displayed at the previous render, and registers the new hash.
+ */
+static bool
+watch_row_changed(WatchContext *context, int row, uint32_t hash)
+{
+	WatchFrame *frame = &(context->frame);
+
+	if (row < 0 || row >= WATCH_FRAME_MAX_ROWS)
+	{
+		return true;
+	}
+
+	/* zero is reserved for rows that we need to draw */
+	if (hash == 0)
+	{
+		hash = 1;
+	}
+
+	if (frame->rowHash[row] == hash)
+	{
+		return false;
+	}
+
+	frame->rowHash[row] = hash;
+
+	return true;
+}
+
+
+/*
+ * watch_hash_bytes implements the FNV-1a hash function, which is good enough
+ * to compare what we display on a row of the screen from a render to the
+ * next.
+ */
+static uint32_t
+watch_hash_bytes(uint32_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+/*
+ * watch_hash_int adds an integer value to the given hash.
+ */
+static uint32_t
+watch_hash_int(uint32_t hash, int64_t value)
+{
+	return watch_hash_bytes(hash, &value, sizeof(value));
+}
+
+
+/*
+ * watch_hash_string adds a string to the given hash, ignoring the contents of
+ * the buffer after the terminating NUL byte.
+ */
+static uint32_t
+watch_hash_string(uint32_t hash, const char *str)
+{
+	return watch_hash_bytes(hash, str, strlen(str) + 1);
+}
+
+
+/*
+ * watch_hash_fleet_group adds the data displayed for a group in fleet mode to
+ * the given hash.
+ */
+static uint32_t
+watch_hash_fleet_group(uint32_t hash, bool selected, FleetGroupState *group)
+{
+	hash = watch_hash_int(hash, selected);
+	hash = watch_hash_string(hash, group->formation);
+	hash = watch_hash_int(hash, group->groupId);
+	hash = watch_hash_string(hash, group->primaryName);
+	hash = watch_hash_int(hash, group->primaryState);
+	hash = watch_hash_int(hash, group->standbyCount);
+	hash = watch_hash_int(hash, group->healthyStandbyCount);
+	hash = watch_hash_int(hash, group->maxLagBytes);
+	hash = watch_hash_int(hash, group->inFlux);
+
+	return hash;
+}
+
+
+/*
+ * watch_hash_column_policy computes a hash of the layout of the nodes array:
+ * when the column policy or the sizes of the columns change, all the rows
+ * must be drawn again.
+ */
+static uint32_t
+watch_hash_column_policy(WatchContext *context, ColPolicy *policy)
+{
+	uint32_t hash = watch_hash_int(WATCH_HASH_INIT, context->cols);
+
+	hash = watch_hash_int(hash, policy - ColumnPolicies);
+	hash = watch_hash_int(hash, context->nodesArray.headers.nodeKind);
+
+	for (int col = 0; policy->specs[col].type != COLUMN_TYPE_LAST; col++)
+	{
+		hash = watch_hash_int(hash, policy->specs[col].len);
+	}
+
+	return hash;
+}
+
+
+/*
+ * watch_hash_node_state adds the data we display for a node to the given
+ * layout hash.
+ */
+static uint32_t
+watch_hash_node_state(uint32_t hash, bool selected, CurrentNodeState *nodeState)
+{
+	NodeAddress *node = &(nodeState->node);
+
+	hash = watch_hash_int(hash, selected);
+	hash = watch_hash_int(hash, node->nodeId);
+	hash = watch_hash_string(hash, node->name);
+	hash = watch_hash_string(hash, node->host);
+	hash = watch_hash_int(hash, node->port);
+	hash = watch_hash_int(hash, node->tli);
+	hash = watch_hash_int(hash, (int64_t) node->lsn);
+	hash = watch_hash_int(hash, node->isPrimary);
+
+	hash = watch_hash_int(hash, nodeState->groupId);
+	hash = watch_hash_int(hash, nodeState->pgKind);
+	hash = watch_hash_int(hash, nodeState->reportedState);
+	hash = watch_hash_int(hash, nodeState->goalState);
+	hash = watch_hash_int(hash, nodeState->candidatePriority);
+	hash = watch_hash_int(hash, nodeState->replicationQuorum);
+	hash = watch_hash_int(hash, nodeState->health);
+	hash = watch_hash_bytes(hash, &(nodeState->healthLag), sizeof(double));
+	hash = watch_hash_bytes(hash, &(nodeState->reportLag), sizeof(double));
+
+	return hash;
+}
+
+
+/*
+ * watch_hash_event_column_policy computes a hash of the layout of the events
+ * array, including the horizontal scrolling of the events descriptions.
+ */
+static uint32_t
+watch_hash_event_column_policy(WatchContext *context, EventColPolicy *policy)
+{
+	uint32_t hash = watch_hash_int(WATCH_HASH_INIT, context->cols);
+
+	hash = watch_hash_int(hash, policy - EventColumnPolicies);
+	hash = watch_hash_int(hash, context->startCol);
+	hash = watch_hash_int(hash, context->move == WATCH_MOVE_FOCUS_END);
+
+	for (int col = 0; policy->specs[col].type != EVENT_COLUMN_TYPE_LAST; col++)
+	{
+		hash = watch_hash_int(hash, policy->specs[col].len);
+	}
+
+	return hash;
+}
+
+
 /*
  * pick_event_column_policy chooses which column spec should be used depending
  * on the current size (rows, cols) of the display, and given update column
@@ -1311,47 +2308,69 @@ compute_event_column_size(EventColumnType type, MonitorEventsHeaders *headers)
 
 
 /*
- * print_events_array prints an events array at the given position (r, c) in a
- * window of size (context-rows, context->cols).
+ * print_events_array prints count events at the given row r, below the events
+ * column headers, the most recent first, skipping context->eventOffset events
+ * and the events that are not part of the current group filter.
  */
-static int
-print_events_array(WatchContext *context, int r, int c)
+static bool
+print_events_array(WatchContext *context, int r, int count)
 {
 	MonitorEventsArray *eventsArray = &(context->eventsArray);
 
-	int lines = 0;
-	int currentRow = r;
+	int currentRow = r + 1;
+	int skipped = 0;
 	int maxStartCol = 0;
-
-	/* compute column sizes */
-	(void) compute_event_column_spec_lens(context);
+	bool printedAll = true;
 
 	/* pick a display policy for the events table */
 	EventColPolicy *eventColumnPolicy = pick_event_column_policy(context);
 
 	if (eventColumnPolicy == NULL)
 	{
-		clear();
-		mvprintw(0, 0, "Window too small: %dx%d", context->rows, context->cols);
-		refresh();
-
+		(void) print_window_too_small(context);
 		return false;
 	}
 
-	/* display the events headers */
-	(void) print_events_headers(context, eventColumnPolicy, currentRow++, c);
-	++lines;
-
-	int capacity = context->rows - currentRow;
+	uint32_t layoutHash =
+		watch_hash_event_column_policy(context, eventColumnPolicy);
 
-	int start =
-		eventsArray->count <= capacity ? 0 : eventsArray->count - capacity;
+	/* display the events headers */
+	if (watch_row_changed(context, r, layoutHash))
+	{
+		(void) print_events_headers(context, eventColumnPolicy, r, 0);
+	}
 
 	/* display most recent events first */
-	for (int index = eventsArray->count - 1; index >= start; index--)
+	for (int index = eventsArray->count - 1;
+		 index >= 0 && currentRow < (r + 1 + count);
+		 index--)
 	{
+		MonitorEvent *event = &(eventsArray->events[index]);
+
+		if (context->groupFilter != -1 && event->groupId != context->groupFilter)
+		{
+			continue;
+		}
+
+		if (skipped < context->eventOffset)
+		{
+			++skipped;
+			continue;
+		}
+
 		bool selected = currentRow == context->selectedRow;
 
+		/* events are never updated, the eventId is all we need to hash */
+		uint32_t hash = watch_hash_int(layoutHash, selected);
+		hash = watch_hash_int(hash, event->eventId);
+
+		if (!watch_row_changed(context, currentRow, hash))
+		{
+			printedAll = false;
+			++currentRow;
+			continue;
+		}
+
 		clear_line_at(currentRow);
 
 		if (selected)
@@ -1359,7 +2378,7 @@ print_events_array(WatchContext *context, int r, int c)
 			attron(A_REVERSE);
 		}
 
-		int sc = print_event(context, eventColumnPolicy, index, currentRow, c);
+		int sc = print_event(context, eventColumnPolicy, index, currentRow, 0);
 
 		if (sc > maxStartCol)
 		{
@@ -1371,22 +2390,19 @@ print_events_array(WatchContext *context, int r, int c)
 			attroff(A_REVERSE);
 		}
 
-		if (context->rows < currentRow)
-		{
-			break;
-		}
-
 		++currentRow;
-		++lines;
 	}
 
-	/* reset context->startCol to something sensible when it needs to be */
-	if (maxStartCol > 0 && maxStartCol < context->startCol)
+	/*
+	 * Reset context->startCol to something sensible when it needs to be, which
+	 * we know only when we printed all the visible events.
+	 */
+	if (printedAll && maxStartCol > 0 && maxStartCol < context->startCol)
 	{
 		context->startCol = maxStartCol;
 	}
 
-	return lines;
+	return true;
 }
 
 
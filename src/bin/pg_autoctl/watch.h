@@ -43,6 +43,21 @@ typedef struct MonitorEventsHeaders
 
 #define EVENTS_BUFFER_COUNT 80
 
+/* we keep track of what's been drawn on that many rows of the screen */
+#define WATCH_FRAME_MAX_ROWS 512
+
+/*
+ * WatchFrame keeps a hash of what's been drawn on each row of the screen at
+ * the previous render, so that we only redraw rows when their data changed.
+ * A zero hash means that the row needs to be drawn.
+ */
+typedef struct WatchFrame
+{
+	int rows;
+	int cols;
+	uint32_t rowHash[WATCH_FRAME_MAX_ROWS];
+} WatchFrame;
+
 /* share a context between the update and render functions */
 typedef struct WatchContext
 {
@@ -54,29 +69,66 @@ typedef struct WatchContext
 	int startCol;
 	WatchMoveFocus move;
 
+	/* only a window of the nodes and events is visible, see nodeOffset */
+	int groupFilter;            /* -1 to display all the groups */
+	int nodeOffset;             /* first visible node, in filtered nodes */
+	int eventOffset;            /* count of more recent events scrolled past */
+	WatchFrame frame;
+
 	/* internal state */
 	bool initialized;
 	bool cookedMode;
 	bool shouldExit;            /* true when q or F1 have been pressed */
 	bool couldContactMonitor;
 
+	/*
+	 * We LISTEN to the monitor state notifications, and fetch the data of
+	 * the nodes that changed when notified. The lags and progress of the
+	 * nodes are refreshed every PG_AUTOCTL_WATCH_REFRESH_INTERVAL, and we
+	 * fetch everything again only when connecting to the monitor.
+	 */
+	bool listening;
+	bool notified;
+	uint64_t lastRefreshTime;
+	int64_t lastEventId;
+
 	/* parameters used to fetch the data we display */
+	bool fleet;                 /* one row per group of all the formations */
 	Monitor monitor;
 	char formation[NAMEDATALEN];
 	int groupId;
 	int number_sync_standbys;
 
-	/* data to display */
+	/* data to display, the arrays are allocated on the heap */
 	CurrentNodeStateArray nodesArray;
 	MonitorEventsArray eventsArray;
 	MonitorEventsHeaders eventsHeaders;
+
+	/* progress of the running pg_basebackup and pg_rewind operations */
+	NodeProgressArray progressArray;
+
+	/* in fleet mode, we only display the summary of each group */
+	FleetGroupStateArray fleetArray;
+
+	/*
+	 * dataVersion is incremented each time we fetch data from the monitor,
+	 * the columns sizes and the filtered nodes are computed again only when
+	 * the data or the group filter changed.
+	 */
+	uint64_t dataVersion;
+	uint64_t sizedVersion;
+	uint64_t filteredVersion;
+	int filteredGroup;
+	int filteredCount;
+	int filteredCapacity;
+	int *filteredNodes;         /* index in nodesArray of the nodes to show */
 } WatchContext;
 
 void cli_watch_main_loop(WatchContext *context);
 void cli_watch_init_window(WatchContext *context);
 void cli_watch_end_window(WatchContext *context);
 
-bool cli_watch_update(WatchContext *context, int step);
-bool cli_watch_render(WatchContext *context, WatchContext *previous);
+bool cli_watch_update(WatchContext *context);
+bool cli_watch_render(WatchContext *context);
 
 #endif  /* WATCH_H */
@@ -0,0 +1,204 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/admission_control.c
+ *
+ * Implementation of the admission control of the node_active and
+ * register_node protocol calls.
+ *
+ * After a monitor restart, or when the network comes back, all the keepers
+ * call the monitor at once. When there are thousands of them, the monitor is
+ * saturated, calls time out, and the keepers retry and keep it saturated.
+ *
+ * When pgautofailover.node_active_rate_limit is set, the calls are admitted
+ * by a token bucket shared by all the backends: the bucket holds up to
+ * pgautofailover.node_active_burst tokens, and is refilled with rate limit
+ * tokens per second. A call that finds the bucket empty fails right away,
+ * before taking any lock, with an error that tells the keeper when to try
+ * again. The retry times are spread over the time it takes to refill the
+ * bucket, so that rejected keepers don't come back all at once.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "miscadmin.h"
+
+#include "admission_control.h"
+
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+
+/* GUC variables, zero disables admission control */
+int NodeActiveRateLimit = 0;
+int NodeActiveBurst = 100;
+
+
+typedef struct AdmissionControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* tokens available at lastRefillTime */
+	double tokens;
+	TimestampTz lastRefillTime;
+
+	/* used to spread the retry times of the rejected calls */
+	uint64 rejectedCount;
+} AdmissionControlData;
+
+
+static AdmissionControlData *AdmissionControl = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void AdmissionControlShmemInit(void);
+
+
+/*
+ * InitializeAdmissionControl, called at server start, requests the shared
+ * memory used for the token bucket.
+ */
+void
+InitializeAdmissionControl(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(AdmissionControlShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = AdmissionControlShmemInit;
+}
+
+
+/*
+ * AdmissionControlShmemSize computes how much shared memory is required.
+ */
+size_t
+AdmissionControlShmemSize(void)
+{
+	return MAXALIGN(sizeof(AdmissionControlData));
+}
+
+
+/*
+ * AdmissionControlShmemInit initializes the requested shared memory.
+ */
+static void
+AdmissionControlShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	AdmissionControl =
+		(AdmissionControlData *)
+		ShmemInitStruct("pg_auto_failover Admission Control",
+						AdmissionControlShmemSize(),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		AdmissionControl->trancheId = LWLockNewTrancheId();
+		AdmissionControl->lockTrancheName =
+			"pg_auto_failover Admission Control";
+		LWLockRegisterTranche(AdmissionControl->trancheId,
+							  AdmissionControl->lockTrancheName);
+
+		LWLockInitialize(&AdmissionControl->lock,
+						 AdmissionControl->trancheId);
+
+		/* the bucket starts full, it's refilled at the first call */
+		AdmissionControl->tokens = -1;
+		AdmissionControl->lastRefillTime = 0;
+		AdmissionControl->rejectedCount = 0;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * AdmitProtocolCall takes a token from the bucket for the current call to the
+ * given protocol function, or fails with an error that tells the caller how
+ * many milliseconds to wait before trying again. It does nothing when
+ * admission control is disabled.
+ */
+void
+AdmitProtocolCall(const char *functionName)
+{
+	if (NodeActiveRateLimit <= 0 || AdmissionControl == NULL)
+	{
+		return;
+	}
+
+	double rate = (double) NodeActiveRateLimit;
+	double burst = (double) Max(NodeActiveBurst, 1);
+	TimestampTz now = GetCurrentTimestamp();
+	int retryAfterMs = 0;
+
+	LWLockAcquire(&AdmissionControl->lock, LW_EXCLUSIVE);
+
+	if (AdmissionControl->tokens < 0)
+	{
+		AdmissionControl->tokens = burst;
+	}
+	else if (now > AdmissionControl->lastRefillTime)
+	{
+		double elapsedSecs =
+			(double) (now - AdmissionControl->lastRefillTime) / USECS_PER_SEC;
+
+		AdmissionControl->tokens =
+			Min(burst, AdmissionControl->tokens + elapsedSecs * rate);
+	}
+
+	AdmissionControl->lastRefillTime = now;
+
+	if (AdmissionControl->tokens >= 1.0)
+	{
+		AdmissionControl->tokens -= 1.0;
+	}
+	else
+	{
+		/*
+		 * Wait at least until the next token is there, and then spread the
+		 * rejected callers over the time it takes to refill the bucket.
+		 */
+		double nextTokenMs = (1.0 - AdmissionControl->tokens) * 1000.0 / rate;
+		uint64 refillMs = (uint64) Max(1.0, burst * 1000.0 / rate);
+		uint64 spreadMs =
+			(AdmissionControl->rejectedCount++ * 1000 / NodeActiveRateLimit)
+			% refillMs;
+
+		retryAfterMs = (int) Min(nextTokenMs + spreadMs, (double) INT_MAX);
+	}
+
+	LWLockRelease(&AdmissionControl->lock);
+
+	if (retryAfterMs > 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("pg_auto_failover monitor is too busy to run %s",
+						functionName),
+				 errdetail("Retry after %d ms.", retryAfterMs),
+				 errhint("See pgautofailover.node_active_rate_limit.")));
+	}
+}
@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/admission_control.h
+ *
+ * Declarations for the admission control of the node_active and
+ * register_node protocol calls.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* GUCs */
+extern int NodeActiveRateLimit;
+extern int NodeActiveBurst;
+
+
+/* public function declarations */
+extern void InitializeAdmissionControl(void);
+extern size_t AdmissionControlShmemSize(void);
+extern void AdmitProtocolCall(const char *functionName);
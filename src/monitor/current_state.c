@@ -0,0 +1,470 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/current_state.c
+ *
+ * Implementation of the pgautofailover.current_state() functions, and of
+ * pgautofailover.fleet_state(), which summarizes the groups of all the
+ * formations in one row per group.
+ *
+ * Every pg_autoctl show state and pg_autoctl watch refresh calls
+ * current_state(), so we build its result from the node lists of
+ * node_metadata.c, which come from the shared node cache when possible,
+ * rather than joining the node and formation tables. We also compute there
+ * the values that clients would otherwise get from another join on the node
+ * table: the reachability of the node as a string, its lag behind the
+ * primary in bytes, and the age of its last health check and last report.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+/* list_qsort is only in Postgres 11 and 12 */
+#include "version_compat.h"
+
+#include "formation_metadata.h"
+#include "health_check.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+#define CURRENT_STATE_COLS 18
+#define FLEET_STATE_COLS 9
+
+
+static List * SortNodesByGroupAndId(List *nodeList);
+static char * NodeReachableToString(NodeHealthState health);
+static double SecondsSince(TimestampTz now, TimestampTz time);
+static void PutFleetGroupState(Tuplestorestate *tupleStore,
+							   TupleDesc tupleDescriptor,
+							   char *formationId,
+							   List *groupNodeList);
+
+
+PG_FUNCTION_INFO_V1(current_state);
+PG_FUNCTION_INFO_V1(fleet_state);
+
+
+/*
+ * current_state returns the current state of the nodes of a formation, or of
+ * a group of a formation when the group_id argument is given, ordered by
+ * group and node id.
+ */
+Datum
+current_state(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	ListCell *nodeCell = NULL;
+
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	AutoFailoverFormation *formation = GetFormation(formationId);
+
+	if (formation == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	List *nodeList = NIL;
+
+	if (PG_NARGS() == 2)
+	{
+		int32 groupId = PG_GETARG_INT32(1);
+
+		nodeList = AutoFailoverAllNodesInGroup(formationId, groupId);
+	}
+	else
+	{
+		nodeList = AllAutoFailoverNodes(formationId);
+	}
+
+	nodeList = SortNodesByGroupAndId(nodeList);
+
+	Datum formationKind =
+		CStringGetTextDatum(FormationKindToString(formation->kind));
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+
+	/* the nodes are sorted by group, so we look for each primary once */
+	int primaryGroupId = -1;
+	AutoFailoverNode *primaryNode = NULL;
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		Datum values[CURRENT_STATE_COLS];
+		bool isNulls[CURRENT_STATE_COLS];
+
+		if (node->groupId != primaryGroupId)
+		{
+			ListCell *groupCell = NULL;
+
+			primaryGroupId = node->groupId;
+			primaryNode = NULL;
+
+			foreach(groupCell, nodeList)
+			{
+				AutoFailoverNode *groupNode =
+					(AutoFailoverNode *) lfirst(groupCell);
+
+				if (groupNode->groupId == primaryGroupId &&
+					IsInPrimaryState(groupNode))
+				{
+					primaryNode = groupNode;
+					break;
+				}
+			}
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = formationKind;
+		values[1] = CStringGetTextDatum(node->nodeName);
+		values[2] = CStringGetTextDatum(node->nodeHost);
+		values[3] = Int32GetDatum(node->nodePort);
+		values[4] = Int32GetDatum(node->groupId);
+		values[5] = Int64GetDatum(node->nodeId);
+		values[6] = ObjectIdGetDatum(ReplicationStateGetEnum(node->reportedState));
+		values[7] = ObjectIdGetDatum(ReplicationStateGetEnum(node->goalState));
+		values[8] = Int32GetDatum(node->candidatePriority);
+		values[9] = BoolGetDatum(node->replicationQuorum);
+		values[10] = Int32GetDatum(node->reportedTLI);
+		values[11] = LSNGetDatum(node->reportedLSN);
+		values[12] = Int32GetDatum(node->health);
+		values[13] = CStringGetTextDatum(node->nodeCluster);
+		values[14] = CStringGetTextDatum(NodeReachableToString(node->health));
+
+		/* the lag in bytes is unknown when the group has no primary */
+		if (primaryNode == NULL)
+		{
+			isNulls[15] = true;
+		}
+		else if (primaryNode->reportedLSN > node->reportedLSN)
+		{
+			values[15] =
+				Int64GetDatum(primaryNode->reportedLSN - node->reportedLSN);
+		}
+		else
+		{
+			values[15] = Int64GetDatum(0);
+		}
+
+		values[16] = Float8GetDatum(SecondsSince(now, node->healthCheckTime));
+		values[17] = Float8GetDatum(SecondsSince(now, node->reportTime));
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * fleet_state returns one row per group of all the formations, with the
+ * primary node of the group, how many of its standby nodes are healthy
+ * secondary nodes, the lag of the most lagging one, and whether a node is
+ * still on its way to its assigned state. That's what a fleet dashboard
+ * needs, without fetching the state of every node of every formation.
+ */
+Datum
+fleet_state(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	ListCell *formationCell = NULL;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	List *formationIdList = AllFormationIds();
+
+	foreach(formationCell, formationIdList)
+	{
+		char *formationId = (char *) lfirst(formationCell);
+		List *nodeList = SortNodesByGroupAndId(AllAutoFailoverNodes(formationId));
+		List *groupNodeList = NIL;
+		ListCell *nodeCell = NULL;
+
+		/* the nodes are sorted by group, split the list at each new group */
+		foreach(nodeCell, nodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (groupNodeList != NIL &&
+				((AutoFailoverNode *) linitial(groupNodeList))->groupId !=
+				node->groupId)
+			{
+				PutFleetGroupState(tupleStore, tupleDescriptor,
+								   formationId, groupNodeList);
+
+				list_free(groupNodeList);
+				groupNodeList = NIL;
+			}
+
+			groupNodeList = lappend(groupNodeList, node);
+		}
+
+		if (groupNodeList != NIL)
+		{
+			PutFleetGroupState(tupleStore, tupleDescriptor,
+							   formationId, groupNodeList);
+
+			list_free(groupNodeList);
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * PutFleetGroupState adds the summary row of the given group of nodes to the
+ * fleet_state() result.
+ */
+static void
+PutFleetGroupState(Tuplestorestate *tupleStore, TupleDesc tupleDescriptor,
+				   char *formationId, List *groupNodeList)
+{
+	Datum values[FLEET_STATE_COLS];
+	bool isNulls[FLEET_STATE_COLS];
+	ListCell *nodeCell = NULL;
+
+	AutoFailoverNode *primaryNode = NULL;
+	int standbyCount = 0;
+	int healthyStandbyCount = 0;
+	int64 maxLagBytes = 0;
+	bool inFlux = false;
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (primaryNode == NULL && IsInPrimaryState(node))
+		{
+			primaryNode = node;
+		}
+
+		if (node->reportedState != node->goalState)
+		{
+			inFlux = true;
+		}
+	}
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node == primaryNode)
+		{
+			continue;
+		}
+
+		++standbyCount;
+
+		if (node->reportedState == REPLICATION_STATE_SECONDARY &&
+			node->goalState == REPLICATION_STATE_SECONDARY &&
+			IsHealthy(node))
+		{
+			++healthyStandbyCount;
+		}
+
+		if (primaryNode != NULL &&
+			primaryNode->reportedLSN > node->reportedLSN)
+		{
+			maxLagBytes = Max(maxLagBytes,
+							  (int64) (primaryNode->reportedLSN -
+									   node->reportedLSN));
+		}
+	}
+
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[0] = CStringGetTextDatum(formationId);
+	values[1] = Int32GetDatum(
+		((AutoFailoverNode *) linitial(groupNodeList))->groupId);
+	values[2] = Int32GetDatum(list_length(groupNodeList));
+
+	if (primaryNode == NULL)
+	{
+		isNulls[3] = true;
+		isNulls[4] = true;
+	}
+	else
+	{
+		values[3] = CStringGetTextDatum(primaryNode->nodeName);
+		values[4] =
+			ObjectIdGetDatum(ReplicationStateGetEnum(primaryNode->reportedState));
+	}
+
+	values[5] = Int32GetDatum(standbyCount);
+	values[6] = Int32GetDatum(healthyStandbyCount);
+
+	/* the lag in bytes is unknown when the group has no primary */
+	if (primaryNode == NULL || standbyCount == 0)
+	{
+		isNulls[7] = true;
+	}
+	else
+	{
+		values[7] = Int64GetDatum(maxLagBytes);
+	}
+
+	values[8] = BoolGetDatum(inFlux);
+
+	tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+}
+
+
+/*
+ * pgautofailover_node_group_id_compare
+ *	  qsort comparator for sorting node lists by group id and then node id
+ */
+#if (PG_VERSION_NUM >= 130000)
+static int
+pgautofailover_node_group_id_compare(const union ListCell *a,
+									 const union ListCell *b)
+{
+	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(a);
+	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(b);
+#else
+static int
+pgautofailover_node_group_id_compare(const void *a, const void *b)
+{
+	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(*(ListCell **) a);
+	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(*(ListCell **) b);
+#endif
+
+	if (node1->groupId != node2->groupId)
+	{
+		return node1->groupId < node2->groupId ? -1 : 1;
+	}
+
+	if (node1->nodeId != node2->nodeId)
+	{
+		return node1->nodeId < node2->nodeId ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * SortNodesByGroupAndId returns the given list of nodes sorted by group id
+ * and then node id.
+ */
+static List *
+SortNodesByGroupAndId(List *nodeList)
+{
+	List *sortedNodeList = list_copy(nodeList);
+
+	#if (PG_VERSION_NUM >= 130000)
+	list_sort(sortedNodeList, pgautofailover_node_group_id_compare);
+	#else
+	sortedNodeList =
+		list_qsort(sortedNodeList, pgautofailover_node_group_id_compare);
+	#endif
+
+	return sortedNodeList;
+}
+
+
+/*
+ * NodeReachableToString returns the same strings as pg_autoctl show state
+ * uses in its reachable column.
+ */
+static char *
+NodeReachableToString(NodeHealthState health)
+{
+	switch (health)
+	{
+		case NODE_HEALTH_GOOD:
+		{
+			return "yes";
+		}
+
+		case NODE_HEALTH_BAD:
+		{
+			return "no";
+		}
+
+		default:
+		{
+			return "unknown";
+		}
+	}
+}
+
+
+/*
+ * SecondsSince returns how many seconds, with a fractional part, passed
+ * between the given time and now.
+ */
+static double
+SecondsSince(TimestampTz now, TimestampTz time)
+{
+	return (double) (now - time) / USECS_PER_SEC;
+}
@@ -22,22 +22,62 @@
 #include "notifications.h"
 
 #include "access/htup_details.h"
+#include "access/xact.h"
 #include "access/xlogdefs.h"
 #include "catalog/pg_type.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
 #include "storage/lockdefs.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
 #include "utils/syscache.h"
 
 
+/*
+ * FormationCacheEntry is a formation found in the formation table, kept in
+ * the backend-local formation cache. Formations almost never change, and
+ * node_active reads the formation of the node at each call.
+ *
+ * A trigger on the formation table invalidates the relcache entry of the
+ * table on any change, and our relcache callback then empties the cache:
+ * other backends accept the invalidation at their next transaction start,
+ * and the current transaction at its next command.
+ */
+typedef struct FormationCacheEntry
+{
+	/* hash key: the formation id, zero-padded */
+	char formationId[NAMEDATALEN];
+	AutoFailoverFormation formation;
+} FormationCacheEntry;
+
+
+static HTAB *FormationCache = NULL;
+static Oid FormationCacheRelationId = InvalidOid;
+static bool FormationCacheCallbackRegistered = false;
+
+/* counts the invalidations, so that we don't cache rows read before one */
+static uint64 FormationCacheInvalidations = 0;
+
+
+static AutoFailoverFormation * LookupFormationCache(const char *formationId);
+static void StoreFormationCache(AutoFailoverFormation *formation,
+								uint64 invalidations);
+static AutoFailoverFormation * CopyFormation(AutoFailoverFormation *formation);
+static void FormationCacheRelcacheCallback(Datum argument, Oid relationId);
+
+
 PG_FUNCTION_INFO_V1(create_formation);
 PG_FUNCTION_INFO_V1(drop_formation);
 PG_FUNCTION_INFO_V1(enable_secondary);
 PG_FUNCTION_INFO_V1(disable_secondary);
 PG_FUNCTION_INFO_V1(set_formation_number_sync_standbys);
+PG_FUNCTION_INFO_V1(invalidate_formation_cache);
 
 Datum AutoFailoverFormationGetDatum(FunctionCallInfo fcinfo,
 									AutoFailoverFormation *formation);
@@ -45,13 +85,19 @@ Datum AutoFailoverFormationGetDatum(FunctionCallInfo fcinfo,
 /*
  * GetFormation returns an AutoFailoverFormation structure with the formationId
  * and its kind, when the formation has already been created, or NULL
- * otherwise.
+ * otherwise. The caller gets its own copy, which it may modify.
  */
 AutoFailoverFormation *
 GetFormation(const char *formationId)
 {
-	AutoFailoverFormation *formation = NULL;
+	AutoFailoverFormation *formation = LookupFormationCache(formationId);
 	MemoryContext callerContext = CurrentMemoryContext;
+	uint64 invalidations = FormationCacheInvalidations;
+
+	if (formation != NULL)
+	{
+		return formation;
+	}
 
 	Oid argTypes[] = {
 		TEXTOID /* formationid */
@@ -115,10 +161,220 @@ GetFormation(const char *formationId)
 
 	SPI_finish();
 
+	if (formation != NULL)
+	{
+		StoreFormationCache(formation, invalidations);
+	}
+
 	return formation;
 }
 
 
+/*
+ * AllFormationIds returns the list of the ids of all the formations that the
+ * monitor manages, sorted by formation id, as palloc'ed C strings.
+ */
+List *
+AllFormationIds(void)
+{
+	List *formationIdList = NIL;
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	const char *selectQuery =
+		"SELECT formationid FROM " AUTO_FAILOVER_FORMATION_TABLE
+		" ORDER BY formationid";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute(selectQuery, true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_FORMATION_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		bool isNull = false;
+
+		Datum formationId =
+			heap_getattr(heapTuple, 1, SPI_tuptable->tupdesc, &isNull);
+
+		formationIdList = lappend(formationIdList,
+								  TextDatumGetCString(formationId));
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	return formationIdList;
+}
+
+
+/*
+ * LookupFormationCache returns a copy of the given formation when it is in
+ * the formation cache, and NULL otherwise.
+ */
+static AutoFailoverFormation *
+LookupFormationCache(const char *formationId)
+{
+	char key[NAMEDATALEN] = { 0 };
+	bool found = false;
+
+	if (FormationCache == NULL || strlen(formationId) >= NAMEDATALEN)
+	{
+		return NULL;
+	}
+
+	strlcpy(key, formationId, NAMEDATALEN);
+
+	FormationCacheEntry *entry = (FormationCacheEntry *)
+								 hash_search(FormationCache, key,
+											 HASH_FIND, &found);
+
+	return found ? CopyFormation(&(entry->formation)) : NULL;
+}
+
+
+/*
+ * StoreFormationCache adds the given formation to the formation cache,
+ * creating the cache and registering its relcache callback when needed.
+ *
+ * The formation must have been read when the cache had seen the given count
+ * of invalidations: a row read before an invalidation might be stale. Rows
+ * read with a transaction snapshot might be stale too, even though their
+ * invalidation was processed before we read them.
+ */
+static void
+StoreFormationCache(AutoFailoverFormation *formation, uint64 invalidations)
+{
+	char key[NAMEDATALEN] = { 0 };
+	bool found = false;
+
+	if (strlen(formation->formationId) >= NAMEDATALEN ||
+		IsolationUsesXactSnapshot())
+	{
+		return;
+	}
+
+	if (!FormationCacheCallbackRegistered)
+	{
+		CacheRegisterRelcacheCallback(FormationCacheRelcacheCallback,
+									  (Datum) 0);
+		FormationCacheCallbackRegistered = true;
+	}
+
+	/* looking up the relation may process invalidations */
+	Oid relationId = FormationCacheRelationId;
+
+	if (FormationCache == NULL)
+	{
+		relationId = pgAutoFailoverRelationId(AUTO_FAILOVER_FORMATION_TABLE_NAME);
+	}
+
+	if (invalidations != FormationCacheInvalidations)
+	{
+		return;
+	}
+
+	if (FormationCache == NULL)
+	{
+		HASHCTL hashInfo;
+
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = NAMEDATALEN;
+		hashInfo.entrysize = sizeof(FormationCacheEntry);
+		hashInfo.hcxt = CacheMemoryContext;
+
+		FormationCache = hash_create("pg_auto_failover formation cache",
+									 8, &hashInfo,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		/* the callback only needs to empty the cache for this relation */
+		FormationCacheRelationId = relationId;
+	}
+
+	strlcpy(key, formation->formationId, NAMEDATALEN);
+
+	FormationCacheEntry *entry = (FormationCacheEntry *)
+								 hash_search(FormationCache, key,
+											 HASH_ENTER, &found);
+
+	entry->formation = *formation;
+	entry->formation.formationId = entry->formationId;
+}
+
+
+/*
+ * CopyFormation returns a copy of the given formation, allocated in the
+ * current memory context.
+ */
+static AutoFailoverFormation *
+CopyFormation(AutoFailoverFormation *formation)
+{
+	AutoFailoverFormation *copy =
+		(AutoFailoverFormation *) palloc0(sizeof(AutoFailoverFormation));
+
+	*copy = *formation;
+	copy->formationId = pstrdup(formation->formationId);
+
+	return copy;
+}
+
+
+/*
+ * FormationCacheRelcacheCallback empties the formation cache when the
+ * relcache entry of the formation table, or all of them, are invalidated.
+ */
+static void
+FormationCacheRelcacheCallback(Datum argument, Oid relationId)
+{
+	/* until the cache exists, we don't know the relation to look for */
+	if (relationId != InvalidOid &&
+		FormationCacheRelationId != InvalidOid &&
+		relationId != FormationCacheRelationId)
+	{
+		return;
+	}
+
+	FormationCacheInvalidations++;
+
+	if (FormationCache != NULL)
+	{
+		hash_destroy(FormationCache);
+
+		FormationCache = NULL;
+		FormationCacheRelationId = InvalidOid;
+	}
+}
+
+
+/*
+ * invalidate_formation_cache is a trigger function on the
+ * pgautofailover.formation table that invalidates the formation caches of
+ * every backend when the table changes.
+ */
+Datum
+invalidate_formation_cache(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("invalidate_formation_cache: must be called as trigger")));
+	}
+
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+
+	CacheInvalidateRelcache(triggerData->tg_relation);
+
+	PG_RETURN_POINTER(NULL);
+}
+
+
 /*
  * create_formation inserts a new tuple in pgautofailover.formation table, of
  * the given formation kind. We know only two formation kind at the moment,
@@ -625,7 +881,8 @@ set_formation_number_sync_standbys(PG_FUNCTION_ARGS)
 	bool success = SetFormationNumberSyncStandbys(formationId, number_sync_standbys);
 
 	/* and now ask the primary to change its settings */
-	LogAndNotifyMessage(
+	LogAndNotifyFormationMessage(
+		LOG_NOTIFY_INFO, primaryNode->formationId,
 		message, BUFSIZE,
 		"Setting goal state of " NODE_FORMAT
 		" to apply_settings "
@@ -46,6 +46,7 @@ typedef struct AutoFailoverFormation
 
 /* public function declarations */
 extern AutoFailoverFormation * GetFormation(const char *formationId);
+extern List * AllFormationIds(void);
 extern void AddFormation(const char *formationId, FormationKind kind, Name dbname,
 						 bool optionSecondary, int numberSyncStandbys);
 extern void RemoveFormation(const char *formationId);
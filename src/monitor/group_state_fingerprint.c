@@ -0,0 +1,249 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/group_state_fingerprint.c
+ *
+ * Implementation of the shared memory tracking of the group state machine
+ * inputs seen by each node.
+ *
+ * Each keeper calls node_active() every second or so, and each call runs the
+ * group state machine for the node's group. In a stable group, the state
+ * machine is given the same inputs at each call and reaches the same
+ * conclusion: nothing to do. We keep a fingerprint of the inputs of the last
+ * evaluation that made no changes, per node, so that node_active() can skip
+ * the state machine entirely until something changes in the group.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "miscadmin.h"
+
+#include "group_state_fingerprint.h"
+
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+
+/* nodes past that limit always run the group state machine */
+#define GROUP_STATE_FINGERPRINT_MAX_NODES 4096
+
+
+typedef struct GroupStateFingerprintKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} GroupStateFingerprintKey;
+
+
+typedef struct GroupStateFingerprintEntry
+{
+	GroupStateFingerprintKey key;
+	uint64 fingerprint;
+} GroupStateFingerprintEntry;
+
+
+typedef struct GroupStateFingerprintControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} GroupStateFingerprintControlData;
+
+
+/* GUC variable */
+bool SkipUnchangedGroupState = true;
+
+static GroupStateFingerprintControlData *GroupStateFingerprintControl = NULL;
+static HTAB *GroupStateFingerprintHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void GroupStateFingerprintShmemInit(void);
+static void BuildGroupStateFingerprintKey(GroupStateFingerprintKey *key,
+										  int64 nodeId);
+
+
+/*
+ * InitializeGroupStateFingerprints, called at server start, requests the
+ * shared memory used to track the group state machine inputs.
+ */
+void
+InitializeGroupStateFingerprints(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(GroupStateFingerprintShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = GroupStateFingerprintShmemInit;
+}
+
+
+/*
+ * GroupStateFingerprintShmemSize computes how much shared memory is required.
+ */
+size_t
+GroupStateFingerprintShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(GroupStateFingerprintControlData)));
+	size = add_size(size,
+					hash_estimate_size(GROUP_STATE_FINGERPRINT_MAX_NODES,
+									   sizeof(GroupStateFingerprintEntry)));
+
+	return size;
+}
+
+
+/*
+ * GroupStateFingerprintShmemInit initializes the requested shared memory.
+ */
+static void
+GroupStateFingerprintShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	GroupStateFingerprintControl =
+		(GroupStateFingerprintControlData *)
+		ShmemInitStruct("pg_auto_failover Group State Fingerprints",
+						MAXALIGN(sizeof(GroupStateFingerprintControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		GroupStateFingerprintControl->trancheId = LWLockNewTrancheId();
+		GroupStateFingerprintControl->lockTrancheName =
+			"pg_auto_failover Group State Fingerprints";
+		LWLockRegisterTranche(GroupStateFingerprintControl->trancheId,
+							  GroupStateFingerprintControl->lockTrancheName);
+
+		LWLockInitialize(&GroupStateFingerprintControl->lock,
+						 GroupStateFingerprintControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(GroupStateFingerprintKey);
+	hashInfo.entrysize = sizeof(GroupStateFingerprintEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	GroupStateFingerprintHash =
+		ShmemInitHash("pg_auto_failover Group State Fingerprints Hash",
+					  GROUP_STATE_FINGERPRINT_MAX_NODES,
+					  GROUP_STATE_FINGERPRINT_MAX_NODES,
+					  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * GroupStateFingerprintMatches returns true when the given fingerprint is the
+ * one registered for the given node by its last evaluation of the group state
+ * machine that made no changes.
+ */
+bool
+GroupStateFingerprintMatches(int64 nodeId, uint64 fingerprint)
+{
+	GroupStateFingerprintKey key;
+	bool found = false;
+	bool matches = false;
+
+	if (!SkipUnchangedGroupState || GroupStateFingerprintHash == NULL)
+	{
+		return false;
+	}
+
+	BuildGroupStateFingerprintKey(&key, nodeId);
+
+	LWLockAcquire(&GroupStateFingerprintControl->lock, LW_SHARED);
+
+	GroupStateFingerprintEntry *entry =
+		(GroupStateFingerprintEntry *) hash_search(GroupStateFingerprintHash,
+												   &key, HASH_FIND, &found);
+
+	if (found && entry->fingerprint == fingerprint)
+	{
+		matches = true;
+	}
+
+	LWLockRelease(&GroupStateFingerprintControl->lock);
+
+	return matches;
+}
+
+
+/*
+ * GroupStateFingerprintStore registers the given fingerprint for the given
+ * node. The caller is responsible for checking that the evaluation of the
+ * group state machine with those inputs made no changes. A zero fingerprint
+ * forgets about the node.
+ */
+void
+GroupStateFingerprintStore(int64 nodeId, uint64 fingerprint)
+{
+	GroupStateFingerprintKey key;
+	bool found = false;
+
+	if (GroupStateFingerprintHash == NULL)
+	{
+		return;
+	}
+
+	BuildGroupStateFingerprintKey(&key, nodeId);
+
+	LWLockAcquire(&GroupStateFingerprintControl->lock, LW_EXCLUSIVE);
+
+	if (fingerprint == 0)
+	{
+		(void) hash_search(GroupStateFingerprintHash, &key, HASH_REMOVE, &found);
+	}
+	else
+	{
+		GroupStateFingerprintEntry *entry =
+			(GroupStateFingerprintEntry *) hash_search(GroupStateFingerprintHash,
+													   &key, HASH_ENTER_NULL,
+													   &found);
+
+		/* when the hash table is full, we keep running the state machine */
+		if (entry != NULL)
+		{
+			entry->fingerprint = fingerprint;
+		}
+	}
+
+	LWLockRelease(&GroupStateFingerprintControl->lock);
+}
+
+
+/*
+ * BuildGroupStateFingerprintKey fills-in the given key.
+ */
+static void
+BuildGroupStateFingerprintKey(GroupStateFingerprintKey *key, int64 nodeId)
+{
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(GroupStateFingerprintKey));
+
+	key->databaseId = MyDatabaseId;
+	key->nodeId = nodeId;
+}
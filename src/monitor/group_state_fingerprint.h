@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/group_state_fingerprint.h
+ *
+ * Declarations for the shared memory tracking of the group state machine
+ * inputs seen by each node.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* GUC variable */
+extern bool SkipUnchangedGroupState;
+
+
+/* public function declarations */
+extern void InitializeGroupStateFingerprints(void);
+extern size_t GroupStateFingerprintShmemSize(void);
+extern bool GroupStateFingerprintMatches(int64 nodeId, uint64 fingerprint);
+extern void GroupStateFingerprintStore(int64 nodeId, uint64 fingerprint);
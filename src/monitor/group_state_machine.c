@@ -17,14 +17,19 @@
 #include "miscadmin.h"
 
 #include "formation_metadata.h"
+#include "group_state_fingerprint.h"
 #include "group_state_machine.h"
+#include "metadata.h"
 #include "node_metadata.h"
+#include "node_probe.h"
 #include "notifications.h"
 #include "replication_state.h"
 #include "version_compat.h"
 
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "catalog/pg_enum.h"
+#include "lib/stringinfo.h"
 #include "commands/trigger.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
@@ -35,6 +40,14 @@
 #include "utils/timestamp.h"
 
 
+/*
+ * The target of perform_promotion has caught up with the primary when their
+ * reported LSNs are that close: commits wait for the target then, and the
+ * difference is only due to the delay between the reports of both nodes.
+ */
+#define PROMOTION_CATCHUP_LAG (1024 * 1024)
+
+
 /*
  * To communicate with the BuildCandidateList function, it's easier to handle a
  * structure with those bits of information to share:
@@ -51,6 +64,50 @@ typedef struct CandidateList
 } CandidateList;
 
 
+/*
+ * GroupStateInput is the part of a node that the group state machine looks
+ * at, including the outcome of the time based checks, and is used to compute
+ * a fingerprint of the inputs of the state machine.
+ */
+typedef struct GroupStateInput
+{
+	int64 nodeId;
+	int32 goalState;
+	int32 reportedState;
+	int32 reportedTLI;
+	int32 candidatePriority;
+	XLogRecPtr reportedLSN;
+	XLogRecPtr reportedReplayLSN;
+	int64 reportedApplyRate;
+	int32 health;
+	int32 pgsrSyncState;
+	bool pgIsRunning;
+	bool replicationQuorum;
+	bool isHealthy;
+	bool isUnhealthy;
+	bool isReporting;
+	bool isDrainTimeExpired;
+	bool isInApplicationZone;
+	bool isSyncStandbyDisconnected;
+	bool isPromotionCatchupExpired;
+	bool isCaughtUp;
+	bool isWarmingUp;
+} GroupStateInput;
+
+
+/*
+ * GroupStateContext holds what GroupStateFingerprint queries once for the
+ * whole group, rather than once per node, before hashing the node inputs.
+ */
+typedef struct GroupStateContext
+{
+	AutoFailoverNode *primaryNode;
+	int64 primaryWalRate;
+	List *disconnectedNodesList;
+	List *warmingUpNodesList;
+} GroupStateContext;
+
+
 /* private function forward declarations */
 static bool ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode);
 static bool ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
@@ -73,10 +130,412 @@ static void AssignGoalState(AutoFailoverNode *pgAutoFailoverNode,
 static bool WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 								AutoFailoverNode *primaryNode,
 								int64 delta);
+static bool IsCaughtUp(AutoFailoverNode *secondaryNode,
+					   AutoFailoverNode *primaryNode,
+					   int64 primaryWalRate,
+					   int64 *catchupTimeMs);
+static int64 EstimatedTimeToCatchup(AutoFailoverNode *secondaryNode,
+									AutoFailoverNode *primaryNode,
+									int64 primaryWalRate);
+static int64 PrimaryWalRate(AutoFailoverNode *primaryNode);
+static int64 EstimatedTimeToWritable(AutoFailoverNode *node,
+									 XLogRecPtr targetLSN);
+static bool IsFasterToWritable(AutoFailoverNode *node,
+							   AutoFailoverNode *selectedNode,
+							   XLogRecPtr targetLSN);
+static bool IsInApplicationZone(AutoFailoverNode *node);
+static bool IsLargerHost(AutoFailoverNode *node, AutoFailoverNode *otherNode);
+static bool IsGroupFailingOver(char *formationId, int groupId);
+static int ProceedOtherGroupState(char *formationId, int groupId);
+static uint64 GroupStateFingerprint(AutoFailoverNode *activeNode);
+static void AppendGroupStateInput(StringInfo buffer, AutoFailoverNode *node,
+								  GroupStateContext *context);
+static bool IsSyncStandbyDisconnected(AutoFailoverNode *node);
+static bool IsPromotionCatchupExpired(AutoFailoverNode *primaryNode);
+static bool ProceedPromotionCatchup(AutoFailoverNode *primaryNode,
+									List *otherNodesGroupList);
 
 /* GUC variables */
 int EnableSyncXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
+int EnableSyncCatchupTimeMs = 1000;
 int PromoteXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
+int PromoteReplayMarginMs = 5 * 1000;
+int CandidateCapacityMargin = 0;
+int SyncStandbyDisconnectTimeoutMs = 0;
+int PromotionCatchupTimeoutMs = 30 * 1000;
+char *ApplicationZone = NULL;
+bool ParallelGroupFailover = true;
+
+
+/*
+ * ProceedGroupStateIfChanged proceeds the state machines of the group of
+ * which the given node is part, unless the previous evaluation for this node
+ * was done with the same inputs and made no changes.
+ */
+bool
+ProceedGroupStateIfChanged(AutoFailoverNode *activeNode)
+{
+	if (!SkipUnchangedGroupState)
+	{
+		return ProceedGroupState(activeNode);
+	}
+
+	uint64 fingerprint = GroupStateFingerprint(activeNode);
+
+	if (GroupStateFingerprintMatches(activeNode->nodeId, fingerprint))
+	{
+		return true;
+	}
+
+	bool result = ProceedGroupState(activeNode);
+
+	/*
+	 * When the state machine made changes, the inputs are different now, and
+	 * the next call has to run the state machine again. Otherwise, the same
+	 * inputs are known to lead to no changes.
+	 */
+	if (GroupStateFingerprint(activeNode) == fingerprint)
+	{
+		GroupStateFingerprintStore(activeNode->nodeId, fingerprint);
+	}
+	else
+	{
+		GroupStateFingerprintStore(activeNode->nodeId, 0);
+	}
+
+	return result;
+}
+
+
+/*
+ * ProceedCorrelatedGroupStates proceeds the state machines of the other
+ * groups of a Citus formation when the group of the given node is failing
+ * over, and other groups of the formation are failing over too, as happens
+ * when a whole zone is lost.
+ *
+ * Each group otherwise waits for one of its own keepers to call node_active
+ * before its failover makes progress, and every step costs each group a
+ * round trip of its own. Here the first keeper to report in a failing group
+ * drives the other failing groups through the same step, and because
+ * notifications are only sent at commit time, the keepers of all the groups
+ * learn about their new goal states at once.
+ *
+ * Groups that are locked by a concurrent call are skipped: that call is
+ * proceeding them already.
+ */
+void
+ProceedCorrelatedGroupStates(AutoFailoverNode *activeNode)
+{
+	char *formationId = activeNode->formationId;
+	List *checkedGroupIds = list_make1_int(activeNode->groupId);
+	List *failingGroupIds = NIL;
+	ListCell *nodeCell = NULL;
+	ListCell *groupCell = NULL;
+	int proceededCount = 0;
+
+	if (!ParallelGroupFailover)
+	{
+		return;
+	}
+
+	AutoFailoverFormation *formation = GetFormation(formationId);
+
+	if (formation == NULL || !IsCitusFormation(formation))
+	{
+		return;
+	}
+
+	if (!IsGroupFailingOver(formationId, activeNode->groupId))
+	{
+		return;
+	}
+
+	List *formationNodesList = AllAutoFailoverNodes(formationId);
+
+	foreach(nodeCell, formationNodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (list_member_int(checkedGroupIds, node->groupId))
+		{
+			continue;
+		}
+
+		checkedGroupIds = lappend_int(checkedGroupIds, node->groupId);
+
+		if (IsGroupFailingOver(formationId, node->groupId))
+		{
+			failingGroupIds = lappend_int(failingGroupIds, node->groupId);
+		}
+	}
+
+	foreach(groupCell, failingGroupIds)
+	{
+		int groupId = lfirst_int(groupCell);
+
+		if (!TryLockNodeGroup(formationId, groupId, ExclusiveLock))
+		{
+			continue;
+		}
+
+		proceededCount += ProceedOtherGroupState(formationId, groupId);
+	}
+
+	if (proceededCount > 0)
+	{
+		ereport(LOG,
+				(errmsg("proceeded %d nodes of %d other failing groups of "
+						"formation \"%s\" along with group %d",
+						proceededCount, list_length(failingGroupIds),
+						formationId, activeNode->groupId)));
+	}
+}
+
+
+/*
+ * IsGroupFailingOver returns true when the given group has standby nodes and
+ * its primary node is unhealthy or missing, or a failover is in progress.
+ */
+static bool
+IsGroupFailingOver(char *formationId, int groupId)
+{
+	List *groupNodesList = AutoFailoverNodeGroup(formationId, groupId);
+
+	if (list_length(groupNodesList) < 2)
+	{
+		return false;
+	}
+
+	AutoFailoverNode *primaryNode =
+		GetPrimaryOrDemotedNodeInGroup(formationId, groupId);
+
+	return primaryNode == NULL ||
+		   IsUnhealthy(primaryNode) ||
+		   IsFailoverInProgress(groupNodesList);
+}
+
+
+/*
+ * ProceedOtherGroupState proceeds the state machine of the given group as if
+ * each of its healthy standby nodes had called node_active, and returns how
+ * many nodes have been proceeded. The primary node is not proceeded: its own
+ * keeper reports when it's still around.
+ */
+static int
+ProceedOtherGroupState(char *formationId, int groupId)
+{
+	List *groupNodesList = AutoFailoverNodeGroup(formationId, groupId);
+	ListCell *nodeCell = NULL;
+	int proceededCount = 0;
+
+	foreach(nodeCell, groupNodesList)
+	{
+		AutoFailoverNode *groupNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		/* the previous node might have changed this one, fetch it again */
+		AutoFailoverNode *node = GetAutoFailoverNodeById(groupNode->nodeId);
+
+		if (node == NULL || IsInPrimaryState(node) || IsUnhealthy(node))
+		{
+			continue;
+		}
+
+		(void) ProceedGroupState(node);
+
+		++proceededCount;
+	}
+
+	return proceededCount;
+}
+
+
+/*
+ * GroupStateFingerprint computes a fingerprint of everything that the group
+ * state machine looks at when the given node is the active node: the
+ * formation settings, the GUCs, and the nodes of the group.
+ */
+static uint64
+GroupStateFingerprint(AutoFailoverNode *activeNode)
+{
+	StringInfo buffer = makeStringInfo();
+	ListCell *nodeCell = NULL;
+
+	AutoFailoverFormation *formation = GetFormation(activeNode->formationId);
+	List *nodesGroupList =
+		AutoFailoverAllNodesInGroup(activeNode->formationId,
+									activeNode->groupId);
+
+	/* leave room for the salt of the second half of the fingerprint */
+	uint32 salt = 0x9e3779b9;
+	appendBinaryStringInfo(buffer, (char *) &salt, sizeof(salt));
+
+	if (formation != NULL)
+	{
+		int32 kind = (int32) formation->kind;
+		int32 numberSyncStandbys = formation->number_sync_standbys;
+		bool optSecondary = formation->opt_secondary;
+
+		appendBinaryStringInfo(buffer, (char *) &kind, sizeof(kind));
+		appendBinaryStringInfo(buffer, (char *) &numberSyncStandbys,
+							   sizeof(numberSyncStandbys));
+		appendBinaryStringInfo(buffer, (char *) &optSecondary,
+							   sizeof(optSecondary));
+	}
+
+	appendBinaryStringInfo(buffer, (char *) &EnableSyncXlogThreshold,
+						   sizeof(EnableSyncXlogThreshold));
+	appendBinaryStringInfo(buffer, (char *) &EnableSyncCatchupTimeMs,
+						   sizeof(EnableSyncCatchupTimeMs));
+	appendBinaryStringInfo(buffer, (char *) &PromoteXlogThreshold,
+						   sizeof(PromoteXlogThreshold));
+	appendBinaryStringInfo(buffer, (char *) &PromoteReplayMarginMs,
+						   sizeof(PromoteReplayMarginMs));
+
+	/*
+	 * Look for disconnected and warming up nodes once for the whole group
+	 * rather than once per node, see IsSyncStandbyDisconnected and
+	 * IsWarmingUp, and fetch the WAL rate of the primary that IsCaughtUp
+	 * uses.
+	 */
+	GroupStateContext context = { 0 };
+
+	context.disconnectedNodesList =
+		GroupStreamingLostNodes(activeNode->formationId,
+								activeNode->groupId,
+								nodesGroupList,
+								SyncStandbyDisconnectTimeoutMs);
+
+	context.warmingUpNodesList =
+		GroupWarmingUpNodes(activeNode->formationId,
+							activeNode->groupId,
+							nodesGroupList);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (IsCurrentState(node, REPLICATION_STATE_WAIT_PRIMARY) ||
+			IsCurrentState(node, REPLICATION_STATE_JOIN_PRIMARY) ||
+			IsCurrentState(node, REPLICATION_STATE_PRIMARY))
+		{
+			context.primaryNode = node;
+			context.primaryWalRate = PrimaryWalRate(node);
+			break;
+		}
+	}
+
+	/* the active node might have been edited in memory by the caller */
+	AppendGroupStateInput(buffer, activeNode, &context);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		AppendGroupStateInput(buffer, node, &context);
+	}
+
+	uint32 high =
+		DatumGetUInt32(hash_any((unsigned char *) buffer->data + sizeof(salt),
+								buffer->len - sizeof(salt)));
+	uint32 low =
+		DatumGetUInt32(hash_any((unsigned char *) buffer->data, buffer->len));
+
+	pfree(buffer->data);
+	pfree(buffer);
+
+	/* zero is reserved for "no fingerprint" */
+	return (((uint64) high) << 32 | low) | 1;
+}
+
+
+/*
+ * AppendGroupStateInput appends the parts of the given node that the group
+ * state machine looks at to the given buffer, using the group context that
+ * GroupStateFingerprint prepared.
+ */
+static void
+AppendGroupStateInput(StringInfo buffer, AutoFailoverNode *node,
+					  GroupStateContext *context)
+{
+	GroupStateInput input;
+
+	/* the input is hashed as a blob, including padding bytes */
+	memset(&input, 0, sizeof(GroupStateInput));
+
+	input.nodeId = node->nodeId;
+	input.goalState = (int32) node->goalState;
+	input.reportedState = (int32) node->reportedState;
+	input.reportedTLI = node->reportedTLI;
+	input.candidatePriority = node->candidatePriority;
+	input.reportedLSN = NodeLatestLSN(node);
+	input.reportedReplayLSN = node->reportedReplayLSN;
+	input.reportedApplyRate = node->reportedApplyRate;
+	input.health = (int32) node->health;
+	input.pgsrSyncState = (int32) node->pgsrSyncState;
+	input.pgIsRunning = node->pgIsRunning;
+	input.replicationQuorum = node->replicationQuorum;
+	input.isHealthy = IsHealthy(node);
+	input.isUnhealthy = IsUnhealthy(node);
+	input.isReporting = IsReporting(node);
+	input.isDrainTimeExpired = IsDrainTimeExpired(node);
+	input.isInApplicationZone = IsInApplicationZone(node);
+	input.isSyncStandbyDisconnected =
+		node->replicationQuorum &&
+		FindNodeInListById(context->disconnectedNodesList,
+						   node->nodeId) != NULL;
+	input.isPromotionCatchupExpired = IsPromotionCatchupExpired(node);
+	input.isWarmingUp =
+		FindNodeInListById(context->warmingUpNodesList, node->nodeId) != NULL;
+
+	/* the WAL rate of the primary changes often, hash the outcome only */
+	if (context->primaryNode != NULL &&
+		context->primaryNode->nodeId != node->nodeId &&
+		IsCurrentState(node, REPLICATION_STATE_CATCHINGUP))
+	{
+		int64 catchupTimeMs = -1;
+
+		input.isCaughtUp = IsCaughtUp(node, context->primaryNode,
+									  context->primaryWalRate,
+									  &catchupTimeMs);
+	}
+
+	appendBinaryStringInfo(buffer, (char *) &input, sizeof(GroupStateInput));
+}
+
+
+/*
+ * IsSyncStandbyDisconnected returns true when the given node is part of the
+ * replication quorum, and the primary has reported for more than
+ * pgautofailover.sync_standby_disconnect_timeout that the node is not
+ * streaming from it. Commits on the primary might be waiting for the node
+ * then, and we don't wait for the node to be unhealthy to degrade.
+ */
+static bool
+IsSyncStandbyDisconnected(AutoFailoverNode *node)
+{
+	return node->replicationQuorum &&
+		   IsStreamingLost(node, SyncStandbyDisconnectTimeoutMs);
+}
+
+
+/*
+ * IsPromotionCatchupExpired returns true when the given primary node has been
+ * in the primary state for more than pgautofailover.promotion_catchup_timeout:
+ * a target of perform_promotion that hasn't caught up by then is promoted
+ * anyway, fetching the WAL it misses from the other nodes.
+ */
+static bool
+IsPromotionCatchupExpired(AutoFailoverNode *primaryNode)
+{
+	if (primaryNode->goalState != REPLICATION_STATE_PRIMARY)
+	{
+		return false;
+	}
+
+	return TimestampDifferenceExceeds(primaryNode->stateChangeTime,
+									  GetCurrentTimestamp(),
+									  PromotionCatchupTimeoutMs);
+}
 
 
 /*
@@ -112,7 +571,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		/* time to actually remove the current node */
 		RemoveAutoFailoverNode(activeNode);
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Removing " NODE_FORMAT " from formation \"%s\" and group %d",
 			NODE_FORMAT_ARGS(activeNode),
@@ -153,7 +613,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to single as there is no other node.",
@@ -170,7 +631,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to report_lsn as there is no other node"
@@ -253,7 +715,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		{
 			char message[BUFSIZE] = { 0 };
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_WARNING, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to draining after it became unhealthy.",
@@ -272,7 +735,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		{
 			char message[BUFSIZE] = { 0 };
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to maintenance after it converged to prepare_maintenance.",
@@ -314,7 +778,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to secondary after " NODE_FORMAT
@@ -339,7 +804,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to secondary after " NODE_FORMAT
@@ -360,7 +826,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to prepare_promotion",
@@ -391,7 +858,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup after " NODE_FORMAT
@@ -417,7 +885,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup and " NODE_FORMAT
@@ -445,7 +914,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup.",
@@ -468,22 +938,46 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	 * state to PRIMARY includes that edit. If the primary already is in the
 	 * primary state, we assign APPLY_SETTINGS to it to make sure its
 	 * repication settings are updated now.
+	 *
+	 * The standby has caught up when it is within EnableSyncXlogThreshold
+	 * bytes of the primary, or when it is expected to replay the remaining
+	 * WAL within EnableSyncCatchupTimeMs given its apply rate and the WAL
+	 * rate of the primary: the same byte count is a very different wait for
+	 * the commits on a busy primary and on a quiet one.
 	 */
+	int64 catchupTimeMs = -1;
+
 	if (IsCurrentState(activeNode, REPLICATION_STATE_CATCHINGUP) &&
 		(IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) ||
 		 IsCurrentState(primaryNode, REPLICATION_STATE_JOIN_PRIMARY) ||
 		 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY)) &&
 		IsHealthy(activeNode) &&
+		!IsSyncStandbyDisconnected(activeNode) &&
 		activeNode->reportedTLI == primaryNode->reportedTLI &&
-		WalDifferenceWithin(activeNode, primaryNode, EnableSyncXlogThreshold))
+		IsCaughtUp(activeNode, primaryNode, PrimaryWalRate(primaryNode),
+				   &catchupTimeMs))
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting goal state of " NODE_FORMAT
-			" to secondary after it caught up.",
-			NODE_FORMAT_ARGS(activeNode));
+		if (catchupTimeMs < 0)
+		{
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, activeNode->formationId,
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to secondary after it caught up.",
+				NODE_FORMAT_ARGS(activeNode));
+		}
+		else
+		{
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, activeNode->formationId,
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to secondary, it is expected to catch up in %lld ms.",
+				NODE_FORMAT_ARGS(activeNode),
+				(long long) catchupTimeMs);
+		}
 
 		/* node is ready for promotion */
 		AssignGoalState(activeNode, REPLICATION_STATE_SECONDARY, message);
@@ -504,7 +998,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to draining and " NODE_FORMAT
@@ -534,7 +1029,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to maintenance after " NODE_FORMAT
@@ -559,7 +1055,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to maintenance after " NODE_FORMAT
@@ -583,7 +1080,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to stop_replication after " NODE_FORMAT
@@ -607,7 +1105,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
@@ -634,7 +1133,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary after the coordinator metadata was updated.",
@@ -660,7 +1160,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to demote_timeout and " NODE_FORMAT
@@ -688,7 +1189,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary after " NODE_FORMAT
@@ -712,7 +1214,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
@@ -739,7 +1242,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_WARNING, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
@@ -766,7 +1270,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
@@ -793,7 +1298,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary after the coordinator metadata was updated.",
@@ -822,7 +1328,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup after it converged to demotion and " NODE_FORMAT
@@ -848,7 +1355,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup after it converged to demotion and " NODE_FORMAT
@@ -886,7 +1394,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to secondary after " NODE_FORMAT
@@ -913,7 +1422,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to secondary after " NODE_FORMAT
@@ -956,7 +1466,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 			{
 				char message[BUFSIZE];
 
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, primaryNode->formationId,
 					message, BUFSIZE,
 					"Setting goal state of " NODE_FORMAT
 					" to wait_primary after " NODE_FORMAT
@@ -974,6 +1485,16 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 		}
 	}
 
+	/*
+	 * when the target of perform_promotion has caught up with the primary:
+	 *   primary ➜ draining
+	 */
+	if (IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+		ProceedPromotionCatchup(primaryNode, otherNodesGroupList))
+	{
+		return true;
+	}
+
 	/*
 	 * when secondary unhealthy:
 	 *   secondary ➜ catchingup
@@ -1029,18 +1550,22 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 			if (otherNode->goalState == REPLICATION_STATE_SECONDARY &&
 				otherNode->reportedState != REPLICATION_STATE_REPORT_LSN &&
 				otherNode->reportedState != REPLICATION_STATE_JOIN_SECONDARY &&
-				IsUnhealthy(otherNode))
+				(IsUnhealthy(otherNode) || IsSyncStandbyDisconnected(otherNode)))
 			{
 				char message[BUFSIZE];
 
 				--secondaryNodesCount;
 				--secondaryQuorumNodesCount;
 
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, otherNode->formationId,
 					message, BUFSIZE,
 					"Setting goal state of " NODE_FORMAT
-					" to catchingup after it became unhealthy.",
-					NODE_FORMAT_ARGS(otherNode));
+					" to catchingup after it %s.",
+					NODE_FORMAT_ARGS(otherNode),
+					IsUnhealthy(otherNode)
+					? "became unhealthy"
+					: "disconnected from the primary");
 
 				/* other node is behind, no longer eligible for promotion */
 				AssignGoalState(otherNode,
@@ -1089,7 +1614,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 			{
 				char message[BUFSIZE] = { 0 };
 
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, primaryNode->formationId,
 					message, BUFSIZE,
 					"Setting goal state of " NODE_FORMAT
 					" to %s because none of the secondary nodes"
@@ -1141,7 +1667,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 			{
 				char message[BUFSIZE] = { 0 };
 
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, primaryNode->formationId,
 					message, BUFSIZE,
 					"Setting goal state of " NODE_FORMAT
 					" to %s because none of the standby nodes in the quorum"
@@ -1165,7 +1692,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 		{
 			char message[BUFSIZE] = { 0 };
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to primary now that we have %d healthy "
@@ -1204,7 +1732,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 				? REPLICATION_STATE_WAIT_PRIMARY
 				: REPLICATION_STATE_PRIMARY;
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to %s after it applied replication properties change.",
@@ -1230,7 +1759,8 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT " to primary",
 			NODE_FORMAT_ARGS(primaryNode));
@@ -1244,6 +1774,114 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 }
 
 
+/*
+ * ProceedPromotionCatchup proceeds with the target of perform_promotion. Its
+ * candidate priority has been incremented past the user defined range, and
+ * the primary keeps taking writes with the target listed first in the
+ * synchronous_standby_names setting, so that the target catches up before
+ * we stop writes. Once the target has caught up, or when the catch-up
+ * timeout has expired, we start the failover the same way perform_failover
+ * does. When the target is not a secondary anymore, we cancel its promotion.
+ */
+static bool
+ProceedPromotionCatchup(AutoFailoverNode *primaryNode, List *otherNodesGroupList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesGroupList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+		char message[BUFSIZE] = { 0 };
+
+		if (otherNode->candidatePriority <= MAX_USER_DEFINED_CANDIDATE_PRIORITY)
+		{
+			continue;
+		}
+
+		if (!otherNode->replicationQuorum ||
+			!IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY))
+		{
+			otherNode->candidatePriority -= CANDIDATE_PRIORITY_INCREMENT;
+
+			ReportAutoFailoverNodeReplicationSetting(
+				otherNode->nodeId,
+				otherNode->nodeHost,
+				otherNode->nodePort,
+				otherNode->candidatePriority,
+				otherNode->replicationQuorum);
+
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, otherNode->formationId,
+				message, BUFSIZE,
+				"Cancelling the promotion of " NODE_FORMAT
+				", which is not a secondary anymore, and setting goal state of "
+				NODE_FORMAT " to apply_settings.",
+				NODE_FORMAT_ARGS(otherNode),
+				NODE_FORMAT_ARGS(primaryNode));
+
+			NotifyStateChange(otherNode, message);
+
+			/* list the standby nodes in the usual way again */
+			AssignGoalState(primaryNode,
+							REPLICATION_STATE_APPLY_SETTINGS, message);
+
+			return true;
+		}
+
+		bool caughtUp =
+			WalDifferenceWithin(otherNode, primaryNode, PROMOTION_CATCHUP_LAG);
+
+		if (!caughtUp && !IsPromotionCatchupExpired(primaryNode))
+		{
+			return false;
+		}
+
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
+			message, BUFSIZE,
+			"Setting goal state of " NODE_FORMAT
+			" at LSN %X/%X to draining after " NODE_FORMAT
+			" %s at LSN %X/%X.",
+			NODE_FORMAT_ARGS(primaryNode),
+			(uint32) (primaryNode->reportedLSN >> 32),
+			(uint32) primaryNode->reportedLSN,
+			NODE_FORMAT_ARGS(otherNode),
+			caughtUp
+			? "caught up for its promotion"
+			: "did not catch up within the promotion catch-up timeout",
+			(uint32) (otherNode->reportedLSN >> 32),
+			(uint32) otherNode->reportedLSN);
+
+		AssignGoalState(primaryNode, REPLICATION_STATE_DRAINING, message);
+
+		/* the old primary must lose the election, see perform_failover */
+		memset(message, 0, BUFSIZE);
+
+		primaryNode->candidatePriority -= CANDIDATE_PRIORITY_INCREMENT;
+
+		ReportAutoFailoverNodeReplicationSetting(
+			primaryNode->nodeId,
+			primaryNode->nodeHost,
+			primaryNode->nodePort,
+			primaryNode->candidatePriority,
+			primaryNode->replicationQuorum);
+
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
+			message, BUFSIZE,
+			"Updating candidate priority to %d for " NODE_FORMAT,
+			primaryNode->candidatePriority,
+			NODE_FORMAT_ARGS(primaryNode));
+
+		NotifyStateChange(primaryNode, message);
+
+		return true;
+	}
+
+	return false;
+}
+
+
 /*
  * ProceedGroupStateForMSFailover implements Group State Machine transition to
  * orchestrate a failover when we have more than one standby.
@@ -1290,7 +1928,8 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 			return ProceedWithMSFailover(activeNode, nodeBeingPromoted);
 		}
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Active " NODE_FORMAT
 			" found failover candidate " NODE_FORMAT
@@ -1360,7 +1999,8 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Failover still in progress after %d nodes reported their LSN "
 			"and we are waiting for %d nodes to report, "
@@ -1398,7 +2038,8 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Failover still in progress with %d candidates that participate "
 			"in the quorum having reported their LSN: %d nodes are required "
@@ -1441,7 +2082,8 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 			candidateList.mostAdvancedNodesGroupList = mostAdvancedNodeList;
 			candidateList.mostAdvancedReportedLSN = mostAdvancedNode->reportedLSN;
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, mostAdvancedNode->formationId,
 				message, BUFSIZE,
 				"The current most advanced reported LSN is %X/%X, "
 				"as reported by " NODE_FORMAT
@@ -1469,7 +2111,8 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 			 */
 			char message[BUFSIZE] = { 0 };
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_WARNING, activeNode->formationId,
 				message, BUFSIZE,
 				"Failover still in progress after all %d candidate nodes "
 				"reported their LSN and we failed to select one of them; "
@@ -1634,7 +2277,8 @@ BuildCandidateList(List *nodesGroupList, CandidateList *candidateList)
 
 			++(candidateList->missingNodesCount);
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, node->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to report_lsn to find the failover candidate",
@@ -1680,7 +2324,8 @@ ProceedWithMSFailover(AutoFailoverNode *activeNode,
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, activeNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to join_secondary after " NODE_FORMAT
@@ -1733,6 +2378,7 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 
 	/* the goal in this function is to find this one */
 	AutoFailoverNode *selectedNode = NULL;
+	bool selectedWarmingUp = false;
 
 	ListCell *nodeCell = NULL;
 
@@ -1760,7 +2406,8 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, mostAdvancedNode->formationId,
 			message, BUFSIZE,
 			"One of the most advanced standby nodes in the group "
 			"is " NODE_FORMAT
@@ -1781,8 +2428,18 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 
 	/*
 	 * Select the node to be promoted: we can pick any candidate with the
-	 * max priority, so we pick the one with the most advanced LSN among
-	 * those having max(candidate priority).
+	 * max priority, so we pick the one that is expected to be writable first
+	 * among those having max(candidate priority). That's the one with the
+	 * most advanced LSN unless the replay lag and apply rate reported by the
+	 * nodes tell otherwise, see IsFasterToWritable.
+	 *
+	 * Candidates that are still warming up after maintenance are only
+	 * selected when no other candidate with the same priority is ready.
+	 *
+	 * When pgautofailover.application_zone is set, candidates in that zone
+	 * are preferred over the others with the same priority. Then when
+	 * pgautofailover.candidate_capacity_margin is set, candidates on a
+	 * larger host are preferred, see IsLargerHost.
 	 */
 	foreach(nodeCell, sortedCandidateNodesGroupList)
 	{
@@ -1793,7 +2450,8 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 		{
 			char message[BUFSIZE];
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, node->formationId,
 				message, BUFSIZE,
 				"Not selecting failover candidate " NODE_FORMAT
 				"because it is unhealthy",
@@ -1806,13 +2464,97 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 			int cPriority = node->candidatePriority;
 			XLogRecPtr cLSN = node->reportedLSN;
 
+			bool warmingUp = IsWarmingUp(node);
+
 			if (selectedNode == NULL)
 			{
 				selectedNode = node;
+				selectedWarmingUp = warmingUp;
 			}
 			else if (cPriority == selectedNode->candidatePriority &&
-					 cLSN > selectedNode->reportedLSN)
+					 warmingUp != selectedWarmingUp)
 			{
+				if (selectedWarmingUp)
+				{
+					char message[BUFSIZE] = { 0 };
+
+					LogAndNotifyFormationMessage(
+						LOG_NOTIFY_INFO, node->formationId,
+						message, BUFSIZE,
+						"Selecting failover candidate " NODE_FORMAT
+						" over " NODE_FORMAT
+						" as the latter is still warming up after maintenance",
+						NODE_FORMAT_ARGS(node),
+						NODE_FORMAT_ARGS(selectedNode));
+
+					selectedNode = node;
+					selectedWarmingUp = warmingUp;
+				}
+			}
+			else if (cPriority == selectedNode->candidatePriority &&
+					 IsInApplicationZone(node) &&
+					 !IsInApplicationZone(selectedNode))
+			{
+				char message[BUFSIZE] = { 0 };
+
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, node->formationId,
+					message, BUFSIZE,
+					"Selecting failover candidate " NODE_FORMAT
+					" over " NODE_FORMAT
+					" as it is in the application zone \"%s\"",
+					NODE_FORMAT_ARGS(node),
+					NODE_FORMAT_ARGS(selectedNode),
+					ApplicationZone);
+
+				selectedNode = node;
+			}
+			else if (cPriority == selectedNode->candidatePriority &&
+					 IsInApplicationZone(node) ==
+					 IsInApplicationZone(selectedNode) &&
+					 IsLargerHost(node, selectedNode))
+			{
+				char message[BUFSIZE] = { 0 };
+
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, node->formationId,
+					message, BUFSIZE,
+					"Selecting failover candidate " NODE_FORMAT
+					" over " NODE_FORMAT
+					" as its host has more CPU or memory capacity",
+					NODE_FORMAT_ARGS(node),
+					NODE_FORMAT_ARGS(selectedNode));
+
+				selectedNode = node;
+			}
+			else if (cPriority == selectedNode->candidatePriority &&
+					 IsInApplicationZone(node) ==
+					 IsInApplicationZone(selectedNode) &&
+					 !IsLargerHost(selectedNode, node) &&
+					 IsFasterToWritable(node, selectedNode,
+										candidateList->mostAdvancedReportedLSN))
+			{
+				if (cLSN < selectedNode->reportedLSN)
+				{
+					char message[BUFSIZE] = { 0 };
+
+					LogAndNotifyFormationMessage(
+						LOG_NOTIFY_INFO, node->formationId,
+						message, BUFSIZE,
+						"Selecting failover candidate " NODE_FORMAT
+						" over " NODE_FORMAT
+						" as it is estimated to replay its WAL %lld ms "
+						"faster, even though it has received less WAL",
+						NODE_FORMAT_ARGS(node),
+						NODE_FORMAT_ARGS(selectedNode),
+						(long long) (EstimatedTimeToWritable(
+										 selectedNode,
+										 candidateList->mostAdvancedReportedLSN)
+									 - EstimatedTimeToWritable(
+										 node,
+										 candidateList->mostAdvancedReportedLSN)));
+				}
+
 				selectedNode = node;
 			}
 			else if (cPriority < selectedNode->candidatePriority)
@@ -1851,7 +2593,8 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 		{
 			char message[BUFSIZE] = { 0 };
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, selectedNode->formationId,
 				message, BUFSIZE,
 				"The selected candidate " NODE_FORMAT
 				" needs to fetch missing "
@@ -1872,6 +2615,221 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 }
 
 
+/*
+ * IsCaughtUp returns true when the given standby node is within
+ * EnableSyncXlogThreshold bytes of the primary node, or when it is expected
+ * to catch up within EnableSyncCatchupTimeMs given the primaryWalRate, -1
+ * when unknown, see PrimaryWalRate. In the latter case only, catchupTimeMs is
+ * set to the estimate.
+ */
+static bool
+IsCaughtUp(AutoFailoverNode *secondaryNode, AutoFailoverNode *primaryNode,
+		   int64 primaryWalRate, int64 *catchupTimeMs)
+{
+	*catchupTimeMs = -1;
+
+	if (WalDifferenceWithin(secondaryNode, primaryNode, EnableSyncXlogThreshold))
+	{
+		return true;
+	}
+
+	if (EnableSyncCatchupTimeMs <= 0)
+	{
+		return false;
+	}
+
+	int64 estimateMs =
+		EstimatedTimeToCatchup(secondaryNode, primaryNode, primaryWalRate);
+
+	if (estimateMs < 0 || estimateMs > EnableSyncCatchupTimeMs)
+	{
+		return false;
+	}
+
+	*catchupTimeMs = estimateMs;
+
+	return true;
+}
+
+
+/*
+ * EstimatedTimeToCatchup returns how long, in milliseconds, the given standby
+ * node is expected to need before it has replayed all the WAL that the
+ * primary node has written, given the apply rate that the standby reports
+ * and the WAL rate that the primary reports with its host resources. It
+ * returns -1 when we don't know the rates, or when the standby does not
+ * replay WAL faster than the primary writes it.
+ */
+static int64
+EstimatedTimeToCatchup(AutoFailoverNode *secondaryNode,
+					   AutoFailoverNode *primaryNode,
+					   int64 primaryWalRate)
+{
+	XLogRecPtr secondaryLsn = NodeLatestLSN(secondaryNode);
+	XLogRecPtr primaryLsn = NodeLatestLSN(primaryNode);
+
+	if (secondaryLsn == InvalidXLogRecPtr || primaryLsn == InvalidXLogRecPtr)
+	{
+		return -1;
+	}
+
+	if (secondaryLsn >= primaryLsn)
+	{
+		return 0;
+	}
+
+	if (secondaryNode->reportedApplyRate <= 0 ||
+		primaryWalRate < 0 ||
+		secondaryNode->reportedApplyRate <= primaryWalRate)
+	{
+		return -1;
+	}
+
+	uint64 backlog = primaryLsn - secondaryLsn;
+	uint64 catchupRate = secondaryNode->reportedApplyRate - primaryWalRate;
+
+	return (int64) (backlog * 1000 / catchupRate);
+}
+
+
+/*
+ * PrimaryWalRate returns how many bytes of WAL per second the given primary
+ * node writes, as reported with its host resources, or -1 when unknown.
+ */
+static int64
+PrimaryWalRate(AutoFailoverNode *primaryNode)
+{
+	int64 walRate = 0;
+
+	if (!GetReportedWalRate(primaryNode->nodeId, &walRate))
+	{
+		return -1;
+	}
+
+	return walRate;
+}
+
+
+/*
+ * EstimatedTimeToWritable returns how long, in milliseconds, the given node
+ * is expected to need before it has replayed all the WAL up to the target
+ * LSN, given its reported replay LSN and recent apply rate. It returns -1 when
+ * the node did not report enough information for an estimate.
+ */
+static int64
+EstimatedTimeToWritable(AutoFailoverNode *node, XLogRecPtr targetLSN)
+{
+	if (node->reportedReplayLSN == InvalidXLogRecPtr)
+	{
+		return -1;
+	}
+
+	if (node->reportedReplayLSN >= targetLSN)
+	{
+		return 0;
+	}
+
+	if (node->reportedApplyRate <= 0)
+	{
+		return -1;
+	}
+
+	uint64 backlog = targetLSN - node->reportedReplayLSN;
+
+	return (int64) (backlog * 1000 / (uint64) node->reportedApplyRate);
+}
+
+
+/*
+ * IsFasterToWritable returns true when the given node should be preferred
+ * over the currently selected node, both having the same candidate priority.
+ *
+ * By default we prefer the node that received the most WAL. When both nodes
+ * reported their replay LSN and apply rate though, a node that is estimated
+ * to finish replaying the WAL more than pgautofailover.promote_replay_margin
+ * before the other one wins, even if it still has to fetch some WAL from one
+ * of the most advanced nodes.
+ */
+static bool
+IsFasterToWritable(AutoFailoverNode *node,
+				   AutoFailoverNode *selectedNode,
+				   XLogRecPtr targetLSN)
+{
+	if (PromoteReplayMarginMs > 0)
+	{
+		int64 nodeTime = EstimatedTimeToWritable(node, targetLSN);
+		int64 selectedTime = EstimatedTimeToWritable(selectedNode, targetLSN);
+
+		if (nodeTime >= 0 && selectedTime >= 0)
+		{
+			if (nodeTime + PromoteReplayMarginMs < selectedTime)
+			{
+				return true;
+			}
+			else if (selectedTime + PromoteReplayMarginMs < nodeTime)
+			{
+				return false;
+			}
+		}
+	}
+
+	return node->reportedLSN > selectedNode->reportedLSN;
+}
+
+
+/*
+ * IsLargerHost returns true when pgautofailover.candidate_capacity_margin is
+ * set and the host of the given node has at least as many CPUs and as much
+ * memory as the host of the other node, and more than the margin of one of
+ * them, as last reported by their keepers. Hosts that did not report their
+ * resources recently are not compared.
+ */
+static bool
+IsLargerHost(AutoFailoverNode *node, AutoFailoverNode *otherNode)
+{
+	int ncpu = 0;
+	int64 totalram = 0;
+	int otherNcpu = 0;
+	int64 otherTotalram = 0;
+
+	if (CandidateCapacityMargin <= 0)
+	{
+		return false;
+	}
+
+	if (!GetReportedHostCapacity(node->nodeId, &ncpu, &totalram) ||
+		!GetReportedHostCapacity(otherNode->nodeId, &otherNcpu, &otherTotalram))
+	{
+		return false;
+	}
+
+	if (ncpu < otherNcpu || totalram < otherTotalram)
+	{
+		return false;
+	}
+
+	/* the reported values are known to be greater than zero */
+	double margin = 1.0 + CandidateCapacityMargin / 100.0;
+
+	return (double) ncpu / otherNcpu > margin ||
+		   (double) totalram / otherTotalram > margin;
+}
+
+
+/*
+ * IsInApplicationZone returns true when pgautofailover.application_zone is
+ * set and the given node has been placed in that zone.
+ */
+static bool
+IsInApplicationZone(AutoFailoverNode *node)
+{
+	return ApplicationZone != NULL &&
+		   ApplicationZone[0] != '\0' &&
+		   node->nodeZone != NULL &&
+		   strcmp(node->nodeZone, ApplicationZone) == 0;
+}
+
+
 /*
  * PromoteSelectedNode assigns goal state to the selected node to failover to.
  */
@@ -1916,7 +2874,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 			selectedNode->candidatePriority,
 			selectedNode->replicationQuorum);
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, selectedNode->formationId,
 			message, BUFSIZE,
 			"Updating candidate priority back to %d for " NODE_FORMAT,
 			selectedNode->candidatePriority,
@@ -1962,7 +2921,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 					node->candidatePriority,
 					node->replicationQuorum);
 
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, node->formationId,
 					message, BUFSIZE,
 					"Updating candidate priority back to %d for " NODE_FORMAT,
 					node->candidatePriority,
@@ -1979,7 +2939,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 
 		if (primaryNode)
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, selectedNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to prepare_promotion after " NODE_FORMAT
@@ -1990,7 +2951,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 		}
 		else
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, selectedNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to prepare_promotion and %d nodes reported their LSN position.",
@@ -2011,7 +2973,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 
 		if (primaryNode)
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, selectedNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to fast_forward after " NODE_FORMAT
@@ -2022,7 +2985,8 @@ PromoteSelectedNode(AutoFailoverNode *selectedNode,
 		}
 		else
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, selectedNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to fast_forward after %d nodes reported their LSN position.",
@@ -2053,9 +3017,9 @@ AssignGoalState(AutoFailoverNode *pgAutoFailoverNode,
 
 
 /*
- * WalDifferenceWithin returns whether the most recently reported relative log
- * position of the given nodes is within the specified bound. Returns false if
- * neither node has reported a relative xlog position.
+ * WalDifferenceWithin returns whether the most recent relative log position of
+ * the given nodes, as reported or probed, is within the specified bound.
+ * Returns false if neither node has reported a relative xlog position.
  *
  * Returns false when the nodes are not on the same reported timeline.
  */
@@ -2068,8 +3032,8 @@ WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 		return true;
 	}
 
-	XLogRecPtr secondaryLsn = secondaryNode->reportedLSN;
-	XLogRecPtr otherNodeLsn = otherNode->reportedLSN;
+	XLogRecPtr secondaryLsn = NodeLatestLSN(secondaryNode);
+	XLogRecPtr otherNodeLsn = NodeLatestLSN(otherNode);
 
 	if (secondaryLsn == 0 || otherNodeLsn == 0)
 	{
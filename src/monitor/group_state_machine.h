@@ -27,6 +27,8 @@ typedef struct AutoFailoverNodeState
 	ReplicationState replicationState;
 	int32 reportedTLI;
 	XLogRecPtr reportedLSN;
+	XLogRecPtr reportedReplayLSN;
+	int64 reportedApplyRate;
 	SyncState pgsrSyncState;
 	bool pgIsRunning;
 	int candidatePriority;
@@ -36,10 +38,21 @@ typedef struct AutoFailoverNodeState
 
 /* public function declarations */
 extern bool ProceedGroupState(AutoFailoverNode *activeNode);
+extern bool ProceedGroupStateIfChanged(AutoFailoverNode *activeNode);
+extern void ProceedCorrelatedGroupStates(AutoFailoverNode *activeNode);
 
 /* GUCs */
 extern int EnableSyncXlogThreshold;
+extern int EnableSyncCatchupTimeMs;
 extern int PromoteXlogThreshold;
 extern int DrainTimeoutMs;
 extern int UnhealthyTimeoutMs;
 extern int StartupGracePeriodMs;
+extern int PromoteReplayMarginMs;
+extern int CandidateCapacityMargin;
+extern int SyncStandbyLatencyMarginMs;
+extern int SyncStandbyDisconnectTimeoutMs;
+extern int SyncRepStallThresholdMs;
+extern int PromotionCatchupTimeoutMs;
+extern char *ApplicationZone;
+extern bool ParallelGroupFailover;
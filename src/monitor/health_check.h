@@ -17,6 +17,7 @@
 
 #include "access/htup.h"
 #include "access/tupdesc.h"
+#include "datatype/timestamp.h"
 #include "nodes/pg_list.h"
 
 
@@ -42,15 +43,41 @@ typedef struct NodeHealth
 	char *nodeHost;
 	int nodePort;
 	NodeHealthState healthState;
+	TimestampTz reportTime;
 } NodeHealth;
 
 
+/*
+ * NodeHealthChange is the outcome of a health check, which is written to the
+ * metadata together with the other outcomes found at the same time.
+ */
+typedef struct NodeHealthChange
+{
+	NodeHealth *node;
+	NodeHealthState previousHealthState;
+	NodeHealthState healthState;
+} NodeHealthChange;
+
+
+/*
+ * The nodes of a monitor database can be split across several health check
+ * workers, see pgautofailover.health_check_workers.
+ */
+#define HEALTH_CHECK_MAX_WORKERS 32
+
 /* GUCs to configure health checks */
 extern bool HealthChecksEnabled;
 extern int HealthCheckPeriod;
 extern int HealthCheckTimeout;
 extern int HealthCheckMaxRetries;
 extern int HealthCheckRetryDelay;
+extern int HealthCheckWorkers;
+extern bool HealthCheckKeepalive;
+extern bool HealthCheckProbeLSN;
+extern int HealthCheckMaxPeriod;
+extern int EventRetention;
+extern int NotifyQueueWarningThreshold;
+extern int NotifyQueueTerminateThreshold;
 
 extern size_t HealthCheckWorkerShmemSize(void);
 
@@ -60,11 +87,13 @@ extern void HealthCheckWorkerLauncherMain(Datum arg);
 extern List * LoadNodeHealthList(void);
 extern NodeHealth * TupleToNodeHealth(HeapTuple heapTuple,
 									  TupleDesc tupleDescriptor);
-extern void SetNodeHealthState(int64 nodeId,
-							   char *nodeName,
-							   char *nodeHost,
-							   uint16 nodePort,
-							   int previousHealthState,
-							   int healthState);
+extern void SetNodeHealthStateList(List *nodeHealthChangeList);
+extern int DeleteExpiredEvents(int maxEvents);
+extern double NotificationQueueUsage(void);
+extern int TerminateLaggingListener(void);
 extern void StopHealthCheckWorker(Oid databaseId);
+extern void HealthCheckWorkersWakeUp(Oid databaseId);
+extern void HealthCheckNodeListChanged(Oid databaseId);
+extern void HealthCheckLauncherWakeUpAtCommit(void);
+extern void HealthCheckWorkersWakeUpAtCommit(void);
 extern char * NodeHealthToString(NodeHealthState health);
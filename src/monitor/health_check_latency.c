@@ -0,0 +1,355 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/health_check_latency.c
+ *
+ * Implementation of the shared memory histograms of health check latencies.
+ *
+ * A health check only decides whether a node is healthy or not, and a node
+ * that is getting slower to answer goes unnoticed until its health checks
+ * time out. The health check workers measure the time from the start of each
+ * successful probe to the answer of the node, and keep a histogram of those
+ * latencies per node in shared memory, so that slow nodes can be spotted and
+ * pgautofailover.health_check_timeout be tuned from real data.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "health_check_latency.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "utils/float.h"
+#endif
+
+
+/* nodes past that limit have no latency histogram */
+#define HEALTH_CHECK_LATENCY_MAX_NODES 4096
+
+#define HEALTH_CHECK_LATENCY_BUCKETS 13
+
+#define HEALTH_CHECK_LATENCY_COLS 7
+
+
+/*
+ * Upper bounds of the histogram buckets, in milliseconds. The last bucket
+ * counts the probes that took longer than the previous bounds.
+ */
+static const double LatencyBucketBounds[HEALTH_CHECK_LATENCY_BUCKETS - 1] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+
+typedef struct HealthCheckLatencyKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} HealthCheckLatencyKey;
+
+
+typedef struct HealthCheckLatencyEntry
+{
+	HealthCheckLatencyKey key;
+
+	int64 probes;
+	int64 totalLatencyUs;
+	int64 maxLatencyUs;
+	int64 lastLatencyUs;
+	int64 counts[HEALTH_CHECK_LATENCY_BUCKETS];
+} HealthCheckLatencyEntry;
+
+
+typedef struct HealthCheckLatencyControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} HealthCheckLatencyControlData;
+
+
+static HealthCheckLatencyControlData *HealthCheckLatencyControl = NULL;
+static HTAB *HealthCheckLatencyHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void HealthCheckLatencyShmemInit(void);
+static int LatencyBucket(int64 latencyUs);
+
+
+PG_FUNCTION_INFO_V1(health_check_latency);
+
+
+/*
+ * InitializeHealthCheckLatency, called at server start, requests the shared
+ * memory used to keep the health check latency histograms.
+ */
+void
+InitializeHealthCheckLatency(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(HealthCheckLatencyShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = HealthCheckLatencyShmemInit;
+}
+
+
+/*
+ * HealthCheckLatencyShmemSize computes how much shared memory is required.
+ */
+size_t
+HealthCheckLatencyShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(HealthCheckLatencyControlData)));
+	size = add_size(size, hash_estimate_size(HEALTH_CHECK_LATENCY_MAX_NODES,
+											 sizeof(HealthCheckLatencyEntry)));
+
+	return size;
+}
+
+
+/*
+ * HealthCheckLatencyShmemInit initializes the requested shared memory.
+ */
+static void
+HealthCheckLatencyShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	HealthCheckLatencyControl =
+		(HealthCheckLatencyControlData *)
+		ShmemInitStruct("pg_auto_failover Health Check Latency",
+						MAXALIGN(sizeof(HealthCheckLatencyControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		HealthCheckLatencyControl->trancheId = LWLockNewTrancheId();
+		HealthCheckLatencyControl->lockTrancheName =
+			"pg_auto_failover Health Check Latency";
+		LWLockRegisterTranche(HealthCheckLatencyControl->trancheId,
+							  HealthCheckLatencyControl->lockTrancheName);
+
+		LWLockInitialize(&HealthCheckLatencyControl->lock,
+						 HealthCheckLatencyControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(HealthCheckLatencyKey);
+	hashInfo.entrysize = sizeof(HealthCheckLatencyEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	HealthCheckLatencyHash =
+		ShmemInitHash("pg_auto_failover Health Check Latency Hash",
+					  HEALTH_CHECK_LATENCY_MAX_NODES,
+					  HEALTH_CHECK_LATENCY_MAX_NODES,
+					  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * HealthCheckLatencyRecord adds the latency of a successful health check of
+ * the given node, in microseconds, to the node's histogram.
+ */
+void
+HealthCheckLatencyRecord(int64 nodeId, int64 latencyUs)
+{
+	HealthCheckLatencyKey key;
+	bool found = false;
+
+	if (HealthCheckLatencyHash == NULL)
+	{
+		return;
+	}
+
+	/* the key is hashed and compared as a blob */
+	memset(&key, 0, sizeof(HealthCheckLatencyKey));
+
+	key.databaseId = MyDatabaseId;
+	key.nodeId = nodeId;
+
+	latencyUs = Max(latencyUs, 0);
+
+	LWLockAcquire(&HealthCheckLatencyControl->lock, LW_EXCLUSIVE);
+
+	HealthCheckLatencyEntry *entry =
+		(HealthCheckLatencyEntry *) hash_search(HealthCheckLatencyHash, &key,
+												HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->probes = 0;
+			entry->totalLatencyUs = 0;
+			entry->maxLatencyUs = 0;
+			memset(entry->counts, 0, sizeof(entry->counts));
+		}
+
+		entry->probes++;
+		entry->totalLatencyUs += latencyUs;
+		entry->maxLatencyUs = Max(entry->maxLatencyUs, latencyUs);
+		entry->lastLatencyUs = latencyUs;
+		entry->counts[LatencyBucket(latencyUs)]++;
+	}
+
+	LWLockRelease(&HealthCheckLatencyControl->lock);
+}
+
+
+/*
+ * LatencyBucket returns the index of the histogram bucket of the given
+ * latency.
+ */
+static int
+LatencyBucket(int64 latencyUs)
+{
+	int bucket = 0;
+
+	for (bucket = 0; bucket < HEALTH_CHECK_LATENCY_BUCKETS - 1; bucket++)
+	{
+		if (latencyUs <= LatencyBucketBounds[bucket] * 1000)
+		{
+			break;
+		}
+	}
+
+	return bucket;
+}
+
+
+/*
+ * health_check_latency returns the health check latency histogram of each
+ * node of the current database, with the latencies in milliseconds. The
+ * bucket_bounds array contains the upper bound of each of the counts, the
+ * last one being infinite.
+ */
+Datum
+health_check_latency(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+	Datum boundDatums[HEALTH_CHECK_LATENCY_BUCKETS];
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (HealthCheckLatencyHash == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	for (int bucket = 0; bucket < HEALTH_CHECK_LATENCY_BUCKETS - 1; bucket++)
+	{
+		boundDatums[bucket] = Float8GetDatum(LatencyBucketBounds[bucket]);
+	}
+	boundDatums[HEALTH_CHECK_LATENCY_BUCKETS - 1] =
+		Float8GetDatum(get_float8_infinity());
+
+	LWLockAcquire(&HealthCheckLatencyControl->lock, LW_SHARED);
+
+	hash_seq_init(&status, HealthCheckLatencyHash);
+
+	HealthCheckLatencyEntry *entry = NULL;
+
+	while ((entry = (HealthCheckLatencyEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[HEALTH_CHECK_LATENCY_COLS];
+		bool isNulls[HEALTH_CHECK_LATENCY_COLS];
+		Datum countDatums[HEALTH_CHECK_LATENCY_BUCKETS];
+
+		if (entry->key.databaseId != MyDatabaseId)
+		{
+			continue;
+		}
+
+		for (int bucket = 0; bucket < HEALTH_CHECK_LATENCY_BUCKETS; bucket++)
+		{
+			countDatums[bucket] = Int64GetDatum(entry->counts[bucket]);
+		}
+
+		ArrayType *boundsArray =
+			construct_array(boundDatums, HEALTH_CHECK_LATENCY_BUCKETS,
+							FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd');
+
+		ArrayType *countsArray =
+			construct_array(countDatums, HEALTH_CHECK_LATENCY_BUCKETS,
+							INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd');
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+		values[1] = Int64GetDatum(entry->probes);
+		values[2] = Float8GetDatum((double) entry->totalLatencyUs /
+								   Max(entry->probes, 1) / 1000.0);
+		values[3] = Float8GetDatum((double) entry->maxLatencyUs / 1000.0);
+		values[4] = Float8GetDatum((double) entry->lastLatencyUs / 1000.0);
+		values[5] = PointerGetDatum(boundsArray);
+		values[6] = PointerGetDatum(countsArray);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(&HealthCheckLatencyControl->lock);
+
+	PG_RETURN_VOID();
+}
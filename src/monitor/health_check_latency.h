@@ -0,0 +1,21 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/health_check_latency.h
+ *
+ * Declarations for the shared memory histograms of health check latencies.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* public function declarations */
+extern void InitializeHealthCheckLatency(void);
+extern size_t HealthCheckLatencyShmemSize(void);
+extern void HealthCheckLatencyRecord(int64 nodeId, int64 latencyUs);
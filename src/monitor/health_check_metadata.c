@@ -15,6 +15,7 @@
 
 #include "health_check.h"
 #include "metadata.h"
+#include "node_liveness.h"
 #include "notifications.h"
 
 #include "access/htup.h"
@@ -36,10 +37,14 @@
 #define TLIST_NUM_NODE_HOST 3
 #define TLIST_NUM_NODE_PORT 4
 #define TLIST_NUM_HEALTH_STATUS 5
+#define TLIST_NUM_REPORT_TIME 6
 
 
 /* GUCs */
 bool HealthChecksEnabled = true;
+int EventRetention = 0;
+int NotifyQueueWarningThreshold = 10;
+int NotifyQueueTerminateThreshold = 0;
 
 
 static bool HaMonitorHasBeenLoaded(void);
@@ -70,7 +75,8 @@ LoadNodeHealthList(void)
 	{
 		initStringInfo(&query);
 		appendStringInfo(&query,
-						 "SELECT nodeid, nodename, nodehost, nodeport, health "
+						 "SELECT nodeid, nodename, nodehost, nodeport, health, "
+						 "       reporttime "
 						 "FROM " AUTO_FAILOVER_NODE_TABLE);
 
 		pgstat_report_activity(STATE_RUNNING, query.data);
@@ -164,6 +170,8 @@ TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 										TLIST_NUM_NODE_PORT, &isNull);
 	Datum healthStateDatum = SPI_getbinval(heapTuple, tupleDescriptor,
 										   TLIST_NUM_HEALTH_STATUS, &isNull);
+	Datum reportTimeDatum = SPI_getbinval(heapTuple, tupleDescriptor,
+										  TLIST_NUM_REPORT_TIME, &isNull);
 
 	NodeHealth *nodeHealth = palloc0(sizeof(NodeHealth));
 	nodeHealth->nodeId = DatumGetInt64(nodeIdDatum);
@@ -171,41 +179,65 @@ TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 	nodeHealth->nodeHost = TextDatumGetCString(nodeHostDatum);
 	nodeHealth->nodePort = DatumGetInt32(nodePortDatum);
 	nodeHealth->healthState = DatumGetInt32(healthStateDatum);
+	nodeHealth->reportTime = DatumGetTimestampTz(reportTimeDatum);
+
+	NodeLivenessApply(nodeHealth->nodeId, &(nodeHealth->reportTime), NULL);
 
 	return nodeHealth;
 }
 
 
 /*
- * SetNodeHealthState updates the health state of a node in the metadata.
+ * SetNodeHealthStateList updates the health state of a list of nodes in the
+ * metadata, using a single UPDATE statement in a single transaction, and
+ * notifies about the nodes which health state changed.
  */
 void
-SetNodeHealthState(int64 nodeId,
-				   char *nodeName,
-				   char *nodeHost,
-				   uint16 nodePort,
-				   int previousHealthState,
-				   int healthState)
+SetNodeHealthStateList(List *nodeHealthChangeList)
 {
 	StringInfoData query;
 	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
 	MemoryContext upperContext = CurrentMemoryContext;
 
+	if (nodeHealthChangeList == NIL)
+	{
+		return;
+	}
+
 	StartSPITransaction();
 
 	if (HaMonitorHasBeenLoaded())
 	{
+		ListCell *changeCell = NULL;
+		bool firstValue = true;
+
 		initStringInfo(&query);
-		appendStringInfo(&query,
-						 "UPDATE " AUTO_FAILOVER_NODE_TABLE
-						 "   SET health = %d, healthchecktime = now() "
-						 " WHERE nodeid = %lld "
-						 "   AND nodehost = %s AND nodeport = %d "
-						 " RETURNING node.*",
-						 healthState,
-						 (long long) nodeId,
-						 quote_literal_cstr(nodeHost),
-						 nodePort);
+		appendStringInfoString(&query,
+							   "UPDATE " AUTO_FAILOVER_NODE_TABLE
+							   "   SET health = change.health, "
+							   "       healthchecktime = now() "
+							   "  FROM (VALUES ");
+
+		foreach(changeCell, nodeHealthChangeList)
+		{
+			NodeHealthChange *change = (NodeHealthChange *) lfirst(changeCell);
+
+			appendStringInfo(&query, "%s(%lld, %s, %d, %d)",
+							 firstValue ? "" : ", ",
+							 (long long) change->node->nodeId,
+							 quote_literal_cstr(change->node->nodeHost),
+							 change->node->nodePort,
+							 change->healthState);
+
+			firstValue = false;
+		}
+
+		appendStringInfoString(&query,
+							   ") AS change(nodeid, nodehost, nodeport, health) "
+							   " WHERE node.nodeid = change.nodeid "
+							   "   AND node.nodehost = change.nodehost "
+							   "   AND node.nodeport = change.nodeport "
+							   " RETURNING node.*");
 
 		pgstat_report_activity(STATE_RUNNING, query.data);
 
@@ -213,27 +245,47 @@ SetNodeHealthState(int64 nodeId,
 		Assert(spiStatus == SPI_OK_UPDATE_RETURNING);
 
 		/*
-		 * We should have 0 or 1 row impacted, because of pkey on nodeid. We
-		 * might have updated zero rows when a node is concurrently being
-		 * DELETEd, because of the default REPETEABLE READ isolation level.
+		 * We might have updated fewer rows than we have changes when a node
+		 * is concurrently being DELETEd, because of the default REPETEABLE
+		 * READ isolation level.
 		 */
-		if (SPI_processed == 1)
+		for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
 		{
-			if (healthState != previousHealthState)
-			{
-				HeapTuple heapTuple = SPI_tuptable->vals[0];
-				AutoFailoverNode *pgAutoFailoverNode =
-					TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
-
-				char message[BUFSIZE] = { 0 };
-
-				LogAndNotifyMessage(message, sizeof(message),
-									"Node " NODE_FORMAT
-									" is marked as %s by the monitor",
-									NODE_FORMAT_ARGS(pgAutoFailoverNode),
-									healthState == 0 ? "unhealthy" : "healthy");
+			HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+			AutoFailoverNode *pgAutoFailoverNode =
+				TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
 
-				NotifyStateChange(pgAutoFailoverNode, message);
+			foreach(changeCell, nodeHealthChangeList)
+			{
+				NodeHealthChange *change = (NodeHealthChange *) lfirst(changeCell);
+
+				if (change->node->nodeId != pgAutoFailoverNode->nodeId)
+				{
+					continue;
+				}
+
+				if (change->healthState != change->previousHealthState)
+				{
+					char message[BUFSIZE] = { 0 };
+
+					LogNotificationLevel level =
+						change->healthState == NODE_HEALTH_BAD
+						? LOG_NOTIFY_WARNING
+						: LOG_NOTIFY_INFO;
+
+					LogAndNotifyFormationMessage(level,
+												 pgAutoFailoverNode->formationId,
+												 message, sizeof(message),
+												 "Node " NODE_FORMAT
+												 " is marked as %s by the monitor",
+												 NODE_FORMAT_ARGS(pgAutoFailoverNode),
+												 change->healthState == NODE_HEALTH_BAD ?
+												 "unhealthy" : "healthy");
+
+					NotifyStateChange(pgAutoFailoverNode, message);
+				}
+
+				break;
 			}
 		}
 	}
@@ -248,6 +300,167 @@ SetNodeHealthState(int64 nodeId,
 }
 
 
+/*
+ * DeleteExpiredEvents deletes up to maxEvents of the oldest events that are
+ * older than the pgautofailover.event_retention setting, and returns how many
+ * events have been deleted.
+ *
+ * We walk the event table in eventid order, which is also the eventtime
+ * order, so that each call only reads a batch of rows through the primary
+ * key index, however large the table is.
+ */
+int
+DeleteExpiredEvents(int maxEvents)
+{
+	StringInfoData query;
+	int deletedCount = 0;
+	MemoryContext upperContext = CurrentMemoryContext;
+
+	if (EventRetention <= 0)
+	{
+		return 0;
+	}
+
+	StartSPITransaction();
+
+	if (HaMonitorHasBeenLoaded())
+	{
+		initStringInfo(&query);
+		appendStringInfo(&query,
+						 "DELETE FROM " AUTO_FAILOVER_EVENT_TABLE
+						 " WHERE eventid IN "
+						 "       (SELECT eventid "
+						 "          FROM " AUTO_FAILOVER_EVENT_TABLE
+						 "      ORDER BY eventid "
+						 "         LIMIT %d) "
+						 "   AND eventtime < now() - interval '%d min'",
+						 maxEvents, EventRetention);
+
+		pgstat_report_activity(STATE_RUNNING, query.data);
+
+		int spiStatus = SPI_execute(query.data, false, 0);
+
+		if (spiStatus == SPI_OK_DELETE)
+		{
+			deletedCount = (int) SPI_processed;
+		}
+	}
+
+	EndSPITransaction();
+
+	MemoryContextSwitchTo(upperContext);
+
+	return deletedCount;
+}
+
+
+/*
+ * NotificationQueueUsage returns the fraction of the Postgres notification
+ * queue that is currently used, between 0 and 1.
+ */
+double
+NotificationQueueUsage(void)
+{
+	double usage = 0;
+	MemoryContext upperContext = CurrentMemoryContext;
+
+	StartSPITransaction();
+
+	const char *query = "SELECT pg_notification_queue_usage()";
+
+	pgstat_report_activity(STATE_RUNNING, query);
+
+	int spiStatus = SPI_execute(query, true, 1);
+
+	if (spiStatus == SPI_OK_SELECT && SPI_processed == 1)
+	{
+		bool isNull = false;
+		Datum usageDatum = SPI_getbinval(SPI_tuptable->vals[0],
+										 SPI_tuptable->tupdesc,
+										 1, &isNull);
+
+		if (!isNull)
+		{
+			usage = DatumGetFloat8(usageDatum);
+		}
+	}
+
+	EndSPITransaction();
+
+	MemoryContextSwitchTo(upperContext);
+
+	return usage;
+}
+
+
+/*
+ * TerminateLaggingListener terminates the session of this database that
+ * prevents the notification queue from being cleaned up for the longest
+ * time, and returns its pid, or zero when there is none.
+ *
+ * A listener only reads its notifications when it is idle, so the queue
+ * can't be cleaned up past the position of a listener that is in a long
+ * transaction, or of a listener which client doesn't read its socket
+ * anymore, such as a suspended process. Postgres doesn't tell which
+ * sessions are listening, so we pick among all the sessions in one of those
+ * situations.
+ */
+int
+TerminateLaggingListener(void)
+{
+	int pid = 0;
+	MemoryContext upperContext = CurrentMemoryContext;
+	StringInfoData query;
+
+	StartSPITransaction();
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+					 "SELECT pid, application_name, state, "
+					 "       pg_terminate_backend(pid) "
+					 "  FROM (SELECT pid, application_name, state "
+					 "          FROM pg_stat_activity "
+					 "         WHERE datid = %u "
+					 "           AND pid <> pg_backend_pid() "
+					 "           AND backend_type = 'client backend' "
+					 "           AND (state LIKE 'idle in transaction%%' "
+					 "                OR wait_event = 'ClientWrite') "
+					 "      ORDER BY coalesce(xact_start, state_change) "
+					 "         LIMIT 1) AS lagging",
+					 MyDatabaseId);
+
+	pgstat_report_activity(STATE_RUNNING, query.data);
+
+	int spiStatus = SPI_execute(query.data, false, 1);
+
+	if (spiStatus == SPI_OK_SELECT && SPI_processed == 1)
+	{
+		HeapTuple tuple = SPI_tuptable->vals[0];
+		TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+		bool isNull = false;
+
+		pid = DatumGetInt32(SPI_getbinval(tuple, tupleDesc, 1, &isNull));
+
+		char *applicationName = SPI_getvalue(tuple, tupleDesc, 2);
+		char *state = SPI_getvalue(tuple, tupleDesc, 3);
+
+		ereport(LOG,
+				(errmsg("terminated session %d of application "%s" in "
+						"state "%s" to let the notification queue be "
+						"cleaned up",
+						pid,
+						applicationName == NULL ? "" : applicationName,
+						state == NULL ? "" : state)));
+	}
+
+	EndSPITransaction();
+
+	MemoryContextSwitchTo(upperContext);
+
+	return pid;
+}
+
+
 /*
  * StartSPITransaction starts a transaction using SPI.
  */
@@ -13,11 +13,16 @@
 #include "postgres.h"
 
 /* these are internal headers */
+#include "group_state_machine.h"
 #include "health_check.h"
+#include "health_check_latency.h"
 #include "metadata.h"
+#include "node_heartbeat.h"
+#include "node_probe.h"
 #include "version_compat.h"
 
 /* these are always necessary for a bgworker */
+#include "access/hash.h"
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/xact.h"
@@ -31,35 +36,95 @@
 #include "storage/lmgr.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
 #include "fmgr.h"
+#include "lib/ilist.h"
 #include "lib/stringinfo.h"
 #include "libpq-fe.h"
 #include "libpq-int.h"
 #include "libpq/pqsignal.h"
-#include "poll.h"
 #include "sys/time.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "tcop/utility.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include "poll.h"
+#endif
+
 /*
  * The healthcheck only checks if it gets a response back from postgres. So
  * both user and password are actually useless, because we do not need to
  * authenticate. They are provided though to override any settings set through
  * PGPASSWORD environment variable or .pgpass file. This way it does not matter
  * that TLS is not necessarily used, because no secret information is sent.
+ *
+ * We don't use libpq connect_timeout, which is in whole seconds and only
+ * enforced by the blocking connection functions anyway. Each connection
+ * attempt has a deadline of pgautofailover.health_check_timeout kept in our
+ * timer wheel instead, so that sub-second timeouts work as expected.
  */
 #define CONN_INFO_TEMPLATE \
 	"host=%s port=%u user=pgautofailover_monitor " \
-	"password=pgautofailover_monitor dbname=postgres " \
-	"connect_timeout=%u"
+	"password=pgautofailover_monitor dbname=postgres"
 #define MAX_CONN_INFO_SIZE 1024
 
 #define CANNOT_CONNECT_NOW "57P03"
 
+/*
+ * When pgautofailover.health_check_probe_lsn is on, the keepalive probe gets
+ * the role of the node and its WAL positions, computed the same way as the
+ * keeper does for its node_active reports.
+ */
+#define LSN_PROBE_QUERY \
+	"SELECT pg_is_in_recovery(), " \
+	"CASE WHEN pg_is_in_recovery() " \
+	"THEN coalesce(pg_last_wal_receive_lsn(), pg_last_wal_replay_lsn()) " \
+	"ELSE pg_current_wal_flush_lsn() END, " \
+	"pg_last_wal_replay_lsn()"
+
+/*
+ * The health check worker multiplexes all the node connections in a single
+ * event loop. Sockets are watched using epoll(7) when available, and the
+ * deadlines (connect timeouts and retry delays) are kept in a hierarchical
+ * timer wheel, so that each wake-up costs O(ready events) rather than
+ * O(nodes).
+ *
+ * The wheel has two levels: the first level has one slot per tick, and the
+ * second level has one slot per full turn of the first level. Timers that
+ * expire further away than what the second level can represent are parked
+ * in its farthest slot and re-inserted when that slot is cascaded.
+ */
+#define HEALTH_CHECK_TIMER_TICK_MS 10
+
+#define TIMER_WHEEL_L0_BITS 8
+#define TIMER_WHEEL_L1_BITS 6
+#define TIMER_WHEEL_L0_SLOTS (1 << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_L1_SLOTS (1 << TIMER_WHEEL_L1_BITS)
+#define TIMER_WHEEL_L0_MASK (TIMER_WHEEL_L0_SLOTS - 1)
+#define TIMER_WHEEL_L1_MASK (TIMER_WHEEL_L1_SLOTS - 1)
+#define TIMER_WHEEL_SPAN (TIMER_WHEEL_L0_SLOTS * TIMER_WHEEL_L1_SLOTS)
+
+#define HEALTH_CHECK_MAX_EVENTS 64
+
+/*
+ * The first health check worker of a database also deletes the events older
+ * than pgautofailover.event_retention, by batches, once in a while.
+ */
+#define EVENT_RETENTION_BATCH_SIZE 1000
+#define EVENT_RETENTION_INTERVAL_MS (60 * 1000)
+
+/* socket events a health check is waiting for */
+#define HEALTH_CHECK_WATCH_NONE 0
+#define HEALTH_CHECK_WATCH_READ (1 << 0)
+#define HEALTH_CHECK_WATCH_WRITE (1 << 1)
+
 
 typedef enum
 {
@@ -67,7 +132,8 @@ typedef enum
 	HEALTH_CHECK_CONNECTING = 1,
 	HEALTH_CHECK_OK = 2,
 	HEALTH_CHECK_RETRY = 3,
-	HEALTH_CHECK_DEAD = 4
+	HEALTH_CHECK_DEAD = 4,
+	HEALTH_CHECK_PROBING = 5
 } HealthCheckState;
 
 typedef struct HealthCheck
@@ -79,9 +145,46 @@ typedef struct HealthCheck
 	PostgresPollingStatusType pollingStatus;
 	int numTries;
 	struct timeval nextEventTime;
+	struct timeval probeStartTime;
+	bool probeAnswered;
+
+	/* event loop bookkeeping, see HealthCheckReactor */
+	pgsocket watchedSocket;
+	int watchedEvents;
+	bool isReady;
+	dlist_node readyNode;
+	bool timerArmed;
+	uint64 timerExpiry;
+	dlist_node timerNode;
+#ifndef HAVE_SYS_EPOLL_H
+	int pollIndex;
+#endif
 } HealthCheck;
 
 
+/*
+ * HealthCheckReactor is the event loop of the health check worker: it knows
+ * which sockets to watch, which timers are armed, and which health checks are
+ * ready to make progress.
+ */
+typedef struct HealthCheckReactor
+{
+#ifdef HAVE_SYS_EPOLL_H
+	int epollFd;
+#else
+	int pollCount;
+	int pollSize;
+	struct pollfd *pollFDs;
+	HealthCheck **pollChecks;
+#endif
+	uint64 currentTick;
+	int timerCount;
+	dlist_head readyList;
+	dlist_head wheel0[TIMER_WHEEL_L0_SLOTS];
+	dlist_head wheel1[TIMER_WHEEL_L1_SLOTS];
+} HealthCheckReactor;
+
+
 /*
  * Shared memory data for all maintenance workers.
  */
@@ -95,6 +198,9 @@ typedef struct HealthCheckHelperControlData
 	int trancheId;
 	char *lockTrancheName;
 	LWLock lock;
+
+	/* the launcher, woken up when databases are created */
+	pid_t launcherPid;
 } HealthCheckHelperControlData;
 
 /*
@@ -104,10 +210,57 @@ typedef struct HealthCheckHelperDatabase
 {
 	/* hash key: database to run on */
 	Oid dboid;
-	pid_t workerPid;
-	BackgroundWorkerHandle *handle;
+	int workerCount;
+
+	/* bumped when a transaction that changed the nodes to check commits */
+	uint64 nodeListGeneration;
+	pid_t workerPids[HEALTH_CHECK_MAX_WORKERS];
+	BackgroundWorkerHandle *handles[HEALTH_CHECK_MAX_WORKERS];
 } HealthCheckHelperDatabase;
 
+/*
+ * Arguments given to each health check worker in its bgw_extra area: each
+ * worker only checks the nodes which nodeid hashes to its own workerIndex.
+ */
+typedef struct HealthCheckWorkerArgs
+{
+	int workerIndex;
+	int workerCount;
+} HealthCheckWorkerArgs;
+
+/*
+ * When pgautofailover.health_check_keepalive is on, the health check worker
+ * keeps an authenticated connection open to each node in between rounds of
+ * health checks, and probes it with an empty query rather than connecting
+ * again each time.
+ */
+typedef struct KeepaliveConnection
+{
+	/* hash key: the node id */
+	int64 nodeId;
+	char *nodeHost;
+	int nodePort;
+	PGconn *connection;
+	bool seen;
+} KeepaliveConnection;
+
+/*
+ * When pgautofailover.health_check_max_period is greater than
+ * pgautofailover.health_check_period, each node is checked on its own
+ * schedule: the checking period of a stable node backs off up to the maximum
+ * period, and a suspect node is checked again at the fast rate of
+ * pgautofailover.health_check_retry_delay.
+ */
+typedef struct NodeCheckSchedule
+{
+	/* hash key: the node id */
+	int64 nodeId;
+	int periodMs;
+	struct timeval lastCheckTime;
+	struct timeval nextCheckTime;
+	bool seen;
+} NodeCheckSchedule;
+
 typedef struct DatabaseListEntry
 {
 	Oid dboid;
@@ -123,22 +276,97 @@ static HTAB *HealthCheckWorkerDBHash;
 static HealthCheckHelperControlData *HealthCheckHelperControl = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
+/* event loop of the per-database health check worker */
+static HealthCheckReactor *Reactor = NULL;
+
+/* connections kept open to the nodes, see KeepaliveConnection */
+static HTAB *KeepaliveConnections = NULL;
+
+/* health check outcomes not yet written to the metadata */
+static List *PendingHealthChanges = NIL;
+
+/*
+ * The nodes to check, kept from one round to the next, and the generation of
+ * the node list they were loaded at. See GetNodeHealthList.
+ */
+static MemoryContext NodeHealthListContext = NULL;
+static List *NodeHealthList = NIL;
+static uint64 NodeHealthListGeneration = 0;
+static bool NodeHealthListValid = false;
+
+/* per-node adaptive schedules, see NodeCheckSchedule */
+static HTAB *NodeCheckSchedules = NULL;
+
+/* wake-ups to send once the current transaction commits */
+static bool PendingLauncherWakeUp = false;
+static bool PendingWorkersWakeUp = false;
+
+/* when to delete expired events next */
+static struct timeval NextEventRetentionTime = { 0, 0 };
+
+/* the notification queue usage we last warned about, in percent */
+static int NotifyQueueWarnedPercent = 0;
+
 
 /* private function declarations */
 static void pg_auto_failover_monitor_sigterm(SIGNAL_ARGS);
 static void pg_auto_failover_monitor_sighup(SIGNAL_ARGS);
-static BackgroundWorkerHandle * RegisterHealthCheckWorker(DatabaseListEntry *db);
+static BackgroundWorkerHandle * RegisterHealthCheckWorker(DatabaseListEntry *db,
+															int workerIndex,
+															int workerCount);
+static bool NodeIsCheckedByThisWorker(NodeHealth *nodeHealth);
 static List * BuildDatabaseList(void);
 static bool pgAutoFailoverExtensionExists(void);
-static List * CreateHealthChecks(List *nodeHealthList);
+static List * GetNodeHealthList(void);
+static uint64 NodeListGeneration(void);
+static List * CreateHealthChecks(List *nodeHealthList, struct timeval currentTime);
+static bool AdaptiveHealthChecksEnabled(void);
+static bool NodeIsSuspect(NodeHealth *nodeHealth);
+static NodeCheckSchedule * GetNodeCheckSchedule(NodeHealth *nodeHealth);
+static bool NodeIsDueForHealthCheck(NodeHealth *nodeHealth,
+									struct timeval currentTime);
+static void UpdateNodeCheckSchedules(List *healthCheckList,
+									 struct timeval roundStartTime);
+static struct timeval NextScheduledCheckTime(struct timeval roundEndTime);
+static void PruneNodeCheckSchedules(void);
+static void ReplanNodeCheckSchedules(void);
+static void EnforceEventRetention(struct timeval currentTime);
+static void CheckNotificationQueue(void);
 static HealthCheck * CreateHealthCheck(NodeHealth *nodeHealth);
 static void DoHealthChecks(List *healthCheckList);
 static void ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime);
-static int WaitForEvent(List *healthCheckList);
+static bool ScheduleHealthCheck(HealthCheck *healthCheck);
+static void FinishHealthCheckConnection(HealthCheck *healthCheck);
+static void RecordNodeHealthState(HealthCheck *healthCheck,
+								  NodeHealthState healthState);
+static void FlushNodeHealthStates(void);
+static void RecordHealthCheckLatency(HealthCheck *healthCheck,
+									 struct timeval currentTime);
+static void StartKeepaliveProbe(HealthCheck *healthCheck, struct timeval currentTime);
+static void RecordNodeProbe(HealthCheck *healthCheck, PGresult *result);
+static bool ParseProbedLSN(PGresult *result, int column, XLogRecPtr *lsn);
+static void KeepHealthCheckConnection(HealthCheck *healthCheck);
+static void DropHealthCheckConnection(HealthCheck *healthCheck);
+static PGconn * LookupKeepaliveConnection(NodeHealth *nodeHealth);
+static void PruneKeepaliveConnections(bool closeAll);
+static int WaitForEvent(void);
+static void CreateHealthCheckReactor(void);
+static void ResetHealthCheckReactor(List *healthCheckList);
+static void WatchHealthCheckSocket(HealthCheck *healthCheck,
+								   pgsocket socket, int events);
+static void MarkHealthCheckReady(HealthCheck *healthCheck);
+static void ArmHealthCheckTimer(HealthCheck *healthCheck, struct timeval expiryTime);
+static void DisarmHealthCheckTimer(HealthCheck *healthCheck);
+static void TimerWheelInsert(HealthCheck *healthCheck);
+static void AdvanceTimerWheel(uint64 nowTick);
+static int NextTimerTimeout(struct timeval currentTime, int maxTimeoutMs);
+static uint64 TimeToTick(struct timeval time);
 static int CompareTimes(struct timeval *leftTime, struct timeval *rightTime);
 static int SubtractTimes(struct timeval base, struct timeval subtract);
 static struct timeval AddTimeMillis(struct timeval base, uint32 additionalMs);
 static void LatchWait(long timeoutMs);
+static void HealthCheckXactCallback(XactEvent event, void *arg);
+static void WakeUpProcess(pid_t pid);
 static void HealthCheckWorkerShmemInit(void);
 
 
@@ -151,6 +379,13 @@ int HealthCheckPeriod = 5 * 1000;
 int HealthCheckTimeout = 5 * 1000;
 int HealthCheckMaxRetries = 2;
 int HealthCheckRetryDelay = 2 * 1000;
+int HealthCheckWorkers = 1;
+bool HealthCheckKeepalive = false;
+bool HealthCheckProbeLSN = false;
+int HealthCheckMaxPeriod = 0;
+
+/* which part of the nodes this health check worker is responsible for */
+static HealthCheckWorkerArgs MyWorkerArgs = { 0, 1 };
 
 
 /*
@@ -205,6 +440,8 @@ InitializeHealthCheckWorker(void)
 
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = HealthCheckWorkerShmemInit;
+
+	RegisterXactCallback(HealthCheckXactCallback, NULL);
 }
 
 
@@ -216,6 +453,11 @@ InitializeHealthCheckWorker(void)
  * worker may only connect to a single database for its whole lifetime. Each
  * worker checks if the "pgautofailover" extension is installed locally, and
  * then does the health checks.
+ *
+ * The launcher scans pg_database when it starts, when a transaction that
+ * created a database commits, and when one of its workers stops, since the
+ * postmaster then notifies it. In between, it sleeps without a timeout,
+ * unless the previous scan failed to start some workers.
  */
 void
 HealthCheckWorkerLauncherMain(Datum arg)
@@ -238,6 +480,11 @@ HealthCheckWorkerLauncherMain(Datum arg)
 	/* Make background worker recognisable in pg_stat_activity */
 	pgstat_report_appname("pg_auto_failover monitor launcher");
 
+	/* from this point, CREATE DATABASE wakes us up */
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+	HealthCheckHelperControl->launcherPid = MyProcPid;
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
 	MemoryContext launcherContext = AllocSetContextCreate(CurrentMemoryContext,
 														  "Health Check Launcher Context",
 														  ALLOCSET_DEFAULT_MINSIZE,
@@ -249,6 +496,7 @@ HealthCheckWorkerLauncherMain(Datum arg)
 	{
 		List *databaseList;
 		ListCell *databaseListCell;
+		bool retryScan = false;
 
 		originalContext = MemoryContextSwitchTo(launcherContext);
 
@@ -259,10 +507,11 @@ HealthCheckWorkerLauncherMain(Datum arg)
 		foreach(databaseListCell, databaseList)
 		{
 			int pid;
-			BackgroundWorkerHandle *handle = NULL;
 			DatabaseListEntry *entry =
 				(DatabaseListEntry *) lfirst(databaseListCell);
 			bool isFound = false;
+			int workerCount = 0;
+			BackgroundWorkerHandle *handles[HEALTH_CHECK_MAX_WORKERS] = { 0 };
 
 			LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
@@ -272,22 +521,35 @@ HealthCheckWorkerLauncherMain(Datum arg)
 															HASH_ENTER, &isFound);
 			if (isFound)
 			{
-				handle = dbData->handle;
+				bool allStarted = true;
+
+				workerCount = dbData->workerCount;
+				memcpy(handles, dbData->handles, sizeof(handles));
 
 				LWLockRelease(&HealthCheckHelperControl->lock);
 
 				/*
 				 * This database has already been processed.
 				 *
-				 * Perform a quick and inexpensive check to verify that it is
-				 * actually running. Note that it is not possible to get
-				 * BGWH_NOT_YET_STARTED at this point, because this is not first
-				 * time we try to register the worker due to the isFound value
-				 * above. The HealthCheckWorkerDBHash only maintains verified
-				 * started entries. Thus we can only get BGWH_STARTED or
-				 * BGWH_STOPPED.
+				 * Perform a quick and inexpensive check to verify that its
+				 * workers are actually running. Note that it is not possible
+				 * to get BGWH_NOT_YET_STARTED at this point, because this is
+				 * not first time we try to register the workers due to the
+				 * isFound value above. The HealthCheckWorkerDBHash only
+				 * maintains verified started entries. Thus we can only get
+				 * BGWH_STARTED or BGWH_STOPPED.
 				 */
-				if (GetBackgroundWorkerPid(handle, &pid) != BGWH_STARTED)
+				for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+				{
+					if (GetBackgroundWorkerPid(handles[workerIndex], &pid) !=
+						BGWH_STARTED)
+					{
+						allStarted = false;
+						break;
+					}
+				}
+
+				if (!allStarted)
 				{
 					ereport(WARNING,
 							(errmsg(
@@ -296,85 +558,113 @@ HealthCheckWorkerLauncherMain(Datum arg)
 								 entry->dbname)));
 
 					/*
-					 * Now we know that the worker has stopped. We use
+					 * Now we know that a worker has stopped. We use
 					 * StopHealthCheckWorker to remove the entry from the
 					 * HealthCheckWorkerDBHash. That will force a retry in the
 					 * next scan of the databaselist.
 					 *
-					 * Furthermore, if the status from GetBackgroundWorkerPid
-					 * was not the correct one, then StopHealthCheckWorker will
-					 * also make certain that the rogue worker will be stopped.
+					 * Furthermore, StopHealthCheckWorker also makes certain
+					 * that the other workers of the database are stopped, so
+					 * that the retry starts a complete new set of workers.
 					 * That will leave HealthCheckWorkerDBHash in a consistent
 					 * state.
 					 */
 					StopHealthCheckWorker(entry->dboid);
+					retryScan = true;
 				}
 
 				continue;
 			}
 
-			/* register a worker for the entry database, in the background */
-			handle = RegisterHealthCheckWorker(entry);
-			if (handle)
-			{
-				/*
-				 * Once started, the Health Check process will update its
-				 * pid.
-				 */
-				dbData->workerPid = 0;
+			/*
+			 * Once started, each Health Check process will update its pid.
+			 */
+			dbData->workerCount = 0;
+			dbData->nodeListGeneration = 0;
+			memset(dbData->workerPids, 0, sizeof(dbData->workerPids));
+			memset(dbData->handles, 0, sizeof(dbData->handles));
 
-				/*
-				 * We need to release the lock for the worker to be able to
-				 * complete its startup procedure: the per-database worker
-				 * takes the control lock in SHARED mode to edit its own PID in
-				 * its own entry in HealthCheckWorkerDBHash.
-				 */
-				LWLockRelease(&HealthCheckHelperControl->lock);
+			/* register the workers for the entry database, in the background */
+			for (int workerIndex = 0; workerIndex < HealthCheckWorkers; workerIndex++)
+			{
+				BackgroundWorkerHandle *handle =
+					RegisterHealthCheckWorker(entry, workerIndex, HealthCheckWorkers);
 
-				/*
-				 * WaitForBackgroundWorkerStartup will wait for worker to start;
-				 * thus, BGWH_NOT_YET_STARTED is never returned. However, if the
-				 * postmaster has died, it will give up and return
-				 * BGWH_POSTMASTER_DIED. In such a case the process will get
-				 * signaled to stop and we will exit further down. For good
-				 * measure though, do verify the process did actually start
-				 * before marking it as Active.
-				 */
-				if (WaitForBackgroundWorkerStartup(handle, &pid) == BGWH_STARTED)
+				if (handle == NULL)
 				{
-					dbData->handle = handle;
-					ereport(LOG,
-							(errmsg(
-								 "started worker for pg_auto_failover "
-								 "health checks in \"%s\"",
-								 entry->dbname)));
-					continue;
+					break;
 				}
+
+				dbData->handles[workerIndex] = handle;
+				dbData->workerCount++;
 			}
 
+			workerCount = dbData->workerCount;
+			memcpy(handles, dbData->handles, sizeof(handles));
+
+			/*
+			 * We need to release the lock for the workers to be able to
+			 * complete their startup procedure: the per-database workers
+			 * take the control lock in SHARED mode to edit their own PID in
+			 * their own entry in HealthCheckWorkerDBHash.
+			 */
 			LWLockRelease(&HealthCheckHelperControl->lock);
 
+			/*
+			 * WaitForBackgroundWorkerStartup will wait for worker to start;
+			 * thus, BGWH_NOT_YET_STARTED is never returned. However, if the
+			 * postmaster has died, it will give up and return
+			 * BGWH_POSTMASTER_DIED. In such a case the process will get
+			 * signaled to stop and we will exit further down. For good
+			 * measure though, do verify the processes did actually start
+			 * before marking them as Active.
+			 */
+			int startedCount = 0;
+
+			for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+			{
+				if (WaitForBackgroundWorkerStartup(handles[workerIndex], &pid) !=
+					BGWH_STARTED)
+				{
+					break;
+				}
+
+				startedCount++;
+			}
+
+			if (workerCount == HealthCheckWorkers && startedCount == workerCount)
+			{
+				ereport(LOG,
+						(errmsg(
+							 "started %d worker(s) for pg_auto_failover "
+							 "health checks in \"%s\"",
+							 workerCount,
+							 entry->dbname)));
+				continue;
+			}
+
 			/*
 			 * Similarly to the comment above, we either failed to start
-			 * the worker, or we failed to register it.
+			 * the workers, or we failed to register them.
 			 *
 			 * NOTE. We use StopHealthCheckWorker to remove the entry
 			 * from the HealthCheckWorkerDBHash so that it will be
 			 * retried in the next databaselist scan. The call to kill()
-			 * the failed worker in StopHealthCheckWorker() will take
-			 * place only if a handle was registered.
+			 * the failed workers in StopHealthCheckWorker() will take
+			 * place only for the workers that did register their pid.
 			 */
 			ereport(WARNING,
 					(errmsg("failed to %s worker for pg_auto_failover "
 							"health checks in \"%s\"",
-							handle ? "start" : "register",
+							workerCount == HealthCheckWorkers ? "start" : "register",
 							entry->dbname)));
 			StopHealthCheckWorker(entry->dboid);
+			retryScan = true;
 		}
 
 		MemoryContextReset(launcherContext);
 
-		LatchWait(HealthCheckTimeout);
+		LatchWait(retryScan ? HealthCheckTimeout : -1);
 
 		if (got_sighup)
 		{
@@ -397,11 +687,12 @@ HealthCheckWorkerLauncherMain(Datum arg)
  * lock from the caller before waiting for the worker's start.
  */
 static BackgroundWorkerHandle *
-RegisterHealthCheckWorker(DatabaseListEntry *db)
+RegisterHealthCheckWorker(DatabaseListEntry *db, int workerIndex, int workerCount)
 {
 	BackgroundWorker worker;
 	BackgroundWorkerHandle *handle;
 	StringInfoData buf;
+	HealthCheckWorkerArgs workerArgs = { 0 };
 
 	initStringInfo(&buf);
 
@@ -419,9 +710,22 @@ RegisterHealthCheckWorker(DatabaseListEntry *db)
 			sizeof(worker.bgw_function_name));
 	appendStringInfo(&buf, "pg_auto_failover monitor healthcheck worker %s",
 					 db->dbname);
+
+	if (workerCount > 1)
+	{
+		appendStringInfo(&buf, " %d/%d", workerIndex + 1, workerCount);
+	}
+
 	strlcpy(worker.bgw_name, buf.data,
 			sizeof(worker.bgw_name));
 
+	StaticAssertStmt(sizeof(HealthCheckWorkerArgs) <= BGW_EXTRALEN,
+					 "HealthCheckWorkerArgs does not fit in bgw_extra");
+
+	workerArgs.workerIndex = workerIndex;
+	workerArgs.workerCount = workerCount;
+	memcpy(worker.bgw_extra, &workerArgs, sizeof(HealthCheckWorkerArgs));
+
 	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
 	{
 		ereport(WARNING,
@@ -514,8 +818,18 @@ HealthCheckWorkerMain(Datum arg)
 		proc_exit(0);
 	}
 
+	memcpy(&MyWorkerArgs, MyBgworkerEntry->bgw_extra, sizeof(HealthCheckWorkerArgs));
+
+	if (MyWorkerArgs.workerIndex < 0 ||
+		MyWorkerArgs.workerIndex >= myDbData->workerCount)
+	{
+		/* the launcher failed to register a complete set of workers */
+		LWLockRelease(&HealthCheckHelperControl->lock);
+		proc_exit(0);
+	}
+
 	/* from this point, DROP DATABASE will attempt to kill the worker */
-	myDbData->workerPid = MyProcPid;
+	myDbData->workerPids[MyWorkerArgs.workerIndex] = MyProcPid;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pg_auto_failover_monitor_sighup);
@@ -544,6 +858,8 @@ HealthCheckWorkerMain(Datum arg)
 															 ALLOCSET_DEFAULT_INITSIZE,
 															 ALLOCSET_DEFAULT_MAXSIZE);
 
+	CreateHealthCheckReactor();
+
 	MemoryContextSwitchTo(healthCheckContext);
 
 	/*
@@ -570,22 +886,36 @@ HealthCheckWorkerMain(Datum arg)
 
 		if (foundPgAutoFailoverExtension)
 		{
-			List *nodeHealthList = LoadNodeHealthList();
+			List *nodeHealthList = GetNodeHealthList();
 
 			if (nodeHealthList != NIL)
 			{
-				List *healthCheckList = CreateHealthChecks(nodeHealthList);
+				List *healthCheckList =
+					CreateHealthChecks(nodeHealthList, currentTime);
 
 				DoHealthChecks(healthCheckList);
+				UpdateNodeCheckSchedules(healthCheckList, currentTime);
 			}
 
+			PruneKeepaliveConnections(false);
+			PruneNodeCheckSchedules();
+			EnforceEventRetention(currentTime);
+			CheckNotificationQueue();
+
+			roundEndTime = NextScheduledCheckTime(roundEndTime);
+
 			MemoryContextReset(healthCheckContext);
 		}
 
 		gettimeofday(&currentTime, NULL);
 		int timeout = SubtractTimes(roundEndTime, currentTime);
 
-		if (timeout >= 0)
+		if (!foundPgAutoFailoverExtension)
+		{
+			/* CREATE EXTENSION pgautofailover wakes us up */
+			LatchWait(-1);
+		}
+		else if (timeout >= 0)
 		{
 			LatchWait(timeout);
 		}
@@ -594,9 +924,22 @@ HealthCheckWorkerMain(Datum arg)
 		{
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
+
+			/* health checks might have been disabled or enabled */
+			NodeHealthListValid = false;
+
+			if (!HealthCheckKeepalive)
+			{
+				PruneKeepaliveConnections(true);
+			}
+
+			/* the next round starts now, with schedules fit for the new GUCs */
+			ReplanNodeCheckSchedules();
 		}
 	}
 
+	PruneKeepaliveConnections(true);
+
 	elog(LOG,
 		 "pg_auto_failover monitor exiting for database %d", dboid);
 
@@ -604,6 +947,94 @@ HealthCheckWorkerMain(Datum arg)
 }
 
 
+/*
+ * EnforceEventRetention deletes a batch of expired events when it's time to.
+ * Only the first worker of a database does that. When a full batch has been
+ * deleted, more events are probably expired, and we continue at the next
+ * round of health checks rather than waiting for the next interval.
+ */
+static void
+EnforceEventRetention(struct timeval currentTime)
+{
+	if (EventRetention <= 0 || MyWorkerArgs.workerIndex != 0)
+	{
+		return;
+	}
+
+	if (CompareTimes(&currentTime, &NextEventRetentionTime) < 0)
+	{
+		return;
+	}
+
+	int deletedCount = DeleteExpiredEvents(EVENT_RETENTION_BATCH_SIZE);
+
+	if (deletedCount < EVENT_RETENTION_BATCH_SIZE)
+	{
+		NextEventRetentionTime =
+			AddTimeMillis(currentTime, EVENT_RETENTION_INTERVAL_MS);
+	}
+}
+
+
+/*
+ * CheckNotificationQueue warns when the Postgres notification queue fills up,
+ * and terminates a lagging session when it's above the termination
+ * threshold. Only the first worker of a database does that.
+ *
+ * The queue is shared by all the databases and can only be cleaned up to
+ * the position of the listener that lags the most behind, for instance a
+ * frozen pg_autoctl watch. When the queue is full, every transaction that
+ * sends a notification fails, and then the monitor can't change the state
+ * of any node anymore.
+ */
+static void
+CheckNotificationQueue(void)
+{
+	if (MyWorkerArgs.workerIndex != 0 ||
+		(NotifyQueueWarningThreshold <= 0 && NotifyQueueTerminateThreshold <= 0))
+	{
+		return;
+	}
+
+	int usedPercent = (int) (NotificationQueueUsage() * 100);
+
+	if (NotifyQueueWarningThreshold > 0 &&
+		usedPercent >= NotifyQueueWarningThreshold)
+	{
+		/* warn again each time the usage rises by another 5% */
+		if (NotifyQueueWarnedPercent == 0 ||
+			usedPercent >= NotifyQueueWarnedPercent + 5)
+		{
+			ereport(WARNING,
+					(errmsg("the notification queue is %d%% full",
+							usedPercent),
+					 errdetail("A session that listens to notifications and "
+							   "does not read them prevents the queue from "
+							   "being cleaned up. When the queue is full, "
+							   "the monitor can't assign new states."),
+					 errhint("See pgautofailover.notify_queue_terminate_threshold.")));
+
+			NotifyQueueWarnedPercent = usedPercent;
+		}
+	}
+	else if (NotifyQueueWarnedPercent > 0)
+	{
+		ereport(LOG,
+				(errmsg("the notification queue is back to %d%% full",
+						usedPercent)));
+
+		NotifyQueueWarnedPercent = 0;
+	}
+
+	if (NotifyQueueTerminateThreshold > 0 &&
+		usedPercent >= NotifyQueueTerminateThreshold)
+	{
+		/* one session per round, the queue is cleaned up in the meantime */
+		(void) TerminateLaggingListener();
+	}
+}
+
+
 /*
  * pgAutoFailoverExtensionExists returns true when we can find the
  * "pgautofailover" extension in the pg_extension catalogs. Caller must have
@@ -632,7 +1063,7 @@ pgAutoFailoverExtensionExists(void)
  * descriptions.
  */
 static List *
-CreateHealthChecks(List *nodeHealthList)
+CreateHealthChecks(List *nodeHealthList, struct timeval currentTime)
 {
 	List *healthCheckList = NIL;
 	ListCell *nodeHealthCell = NULL;
@@ -640,6 +1071,13 @@ CreateHealthChecks(List *nodeHealthList)
 	foreach(nodeHealthCell, nodeHealthList)
 	{
 		NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
+
+		if (!NodeIsCheckedByThisWorker(nodeHealth) ||
+			!NodeIsDueForHealthCheck(nodeHealth, currentTime))
+		{
+			continue;
+		}
+
 		HealthCheck *healthCheck = CreateHealthCheck(nodeHealth);
 		healthCheckList = lappend(healthCheckList, healthCheck);
 	}
@@ -649,161 +1087,1039 @@ CreateHealthChecks(List *nodeHealthList)
 
 
 /*
- * CreateHealthCheck creates a health check from a health check description.
+ * NodeIsCheckedByThisWorker returns true when the given node is assigned to
+ * the current health check worker, using a hash of its nodeid. With a single
+ * worker per database, that's all the nodes.
  */
-static HealthCheck *
-CreateHealthCheck(NodeHealth *nodeHealth)
+static bool
+NodeIsCheckedByThisWorker(NodeHealth *nodeHealth)
 {
-	struct timeval invalidTime = { 0, 0 };
+	if (MyWorkerArgs.workerCount <= 1)
+	{
+		return true;
+	}
 
-	HealthCheck *healthCheck = palloc0(sizeof(HealthCheck));
-	healthCheck->node = nodeHealth;
-	healthCheck->state = HEALTH_CHECK_INITIAL;
-	healthCheck->connection = NULL;
-	healthCheck->numTries = 0;
-	healthCheck->nextEventTime = invalidTime;
+	uint32 hash = DatumGetUInt32(hash_any((unsigned char *) &(nodeHealth->nodeId),
+										  sizeof(int64)));
 
-	return healthCheck;
+	return (int) (hash % MyWorkerArgs.workerCount) == MyWorkerArgs.workerIndex;
 }
 
 
 /*
- * DoHealthChecks performs the given health checks.
+ * GetNodeHealthList returns the list of the nodes to check. The list is only
+ * loaded from the node table again when a transaction that added or removed
+ * nodes, or changed the address or the health of a node, committed since the
+ * last load. In between, we only refresh the report times of the nodes from
+ * the heartbeats that the monitor keeps in shared memory.
  */
-static void
-DoHealthChecks(List *healthCheckList)
+static List *
+GetNodeHealthList(void)
 {
-	while (!got_sigterm)
+	ListCell *nodeHealthCell = NULL;
+
+	/* read the generation first, so that a concurrent change is seen later */
+	uint64 generation = NodeListGeneration();
+
+	if (NodeHealthListContext == NULL)
 	{
-		int pendingCheckCount = 0;
-		struct timeval currentTime = { 0, 0 };
-		ListCell *healthCheckCell = NULL;
+		NodeHealthListContext =
+			AllocSetContextCreate(TopMemoryContext,
+								  "Health check node list",
+								  ALLOCSET_DEFAULT_MINSIZE,
+								  ALLOCSET_DEFAULT_INITSIZE,
+								  ALLOCSET_DEFAULT_MAXSIZE);
+	}
 
-		gettimeofday(&currentTime, NULL);
+	if (!NodeHealthListValid || generation != NodeHealthListGeneration)
+	{
+		MemoryContextReset(NodeHealthListContext);
 
-		foreach(healthCheckCell, healthCheckList)
-		{
-			HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+		MemoryContext oldContext = MemoryContextSwitchTo(NodeHealthListContext);
 
-			ManageHealthCheck(healthCheck, currentTime);
+		NodeHealthList = LoadNodeHealthList();
 
-			if (healthCheck->state != HEALTH_CHECK_OK &&
-				healthCheck->state != HEALTH_CHECK_DEAD)
-			{
-				pendingCheckCount++;
-			}
-		}
-		if (pendingCheckCount == 0)
-		{
-			break;
-		}
+		MemoryContextSwitchTo(oldContext);
+
+		/* an empty list is cheap to load again, and may be a failed load */
+		NodeHealthListGeneration = generation;
+		NodeHealthListValid = NodeHealthList != NIL;
+
+		return NodeHealthList;
+	}
+
+	foreach(nodeHealthCell, NodeHealthList)
+	{
+		NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
+		TimestampTz lastHeartbeatTime = NodeLastHeartbeatTime(nodeHealth->nodeId);
 
-		WaitForEvent(healthCheckList);
+		nodeHealth->reportTime = Max(nodeHealth->reportTime, lastHeartbeatTime);
 	}
+
+	return NodeHealthList;
 }
 
 
 /*
- * WaitForEvent sleeps until a time-based or I/O event occurs in any of the health
- * checks.
+ * NodeListGeneration returns the current generation of the node list of the
+ * database of this worker.
  */
-static int
-WaitForEvent(List *healthCheckList)
+static uint64
+NodeListGeneration(void)
 {
-	ListCell *healthCheckCell = NULL;
-	int healthCheckCount = list_length(healthCheckList);
-	struct timeval currentTime = { 0, 0 };
-	struct timeval nextEventTime = { 0, 0 };
-	int healthCheckIndex = 0;
+	bool found = false;
+	uint64 generation = 0;
 
-	struct pollfd *pollFDs = (struct pollfd *) palloc0(healthCheckCount * sizeof(struct
-																				 pollfd));
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
 
-	gettimeofday(&currentTime, NULL);
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&MyDatabaseId, HASH_FIND, &found);
 
-	foreach(healthCheckCell, healthCheckList)
+	if (found)
 	{
-		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
-
-		pollFileDescriptor->fd = -1;
-		pollFileDescriptor->events = 0;
-		pollFileDescriptor->revents = 0;
-
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
-			healthCheck->state == HEALTH_CHECK_RETRY)
-		{
-			bool hasTimeout = healthCheck->nextEventTime.tv_sec != 0;
+		generation = dbData->nodeListGeneration;
+	}
 
-			if (hasTimeout &&
-				(nextEventTime.tv_sec == 0 ||
-				 CompareTimes(&healthCheck->nextEventTime, &nextEventTime) < 0))
-			{
-				nextEventTime = healthCheck->nextEventTime;
-			}
-		}
+	LWLockRelease(&HealthCheckHelperControl->lock);
 
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING)
-		{
-			PGconn *connection = healthCheck->connection;
-			int pollEventMask = 0;
+	return generation;
+}
 
-			if (healthCheck->pollingStatus == PGRES_POLLING_READING)
-			{
-				pollEventMask = POLLIN;
-			}
-			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
-			{
-				pollEventMask = POLLOUT;
-			}
 
-			pollFileDescriptor->fd = PQsocket(connection);
-			pollFileDescriptor->events = pollEventMask;
-		}
+/*
+ * AdaptiveHealthChecksEnabled returns true when nodes are checked on their
+ * own adaptive schedule.
+ */
+static bool
+AdaptiveHealthChecksEnabled(void)
+{
+	return HealthCheckMaxPeriod > HealthCheckPeriod;
+}
 
-		healthCheckIndex++;
-	}
 
-	int pollTimeout = SubtractTimes(nextEventTime, currentTime);
-	if (pollTimeout < 0)
-	{
-		pollTimeout = 0;
-	}
-	else if (pollTimeout > HealthCheckRetryDelay)
+/*
+ * NodeIsSuspect returns true when the node has not been found healthy by the
+ * last health check, or when its keeper stopped reporting to the monitor.
+ */
+static bool
+NodeIsSuspect(NodeHealth *nodeHealth)
+{
+	if (nodeHealth->healthState != NODE_HEALTH_GOOD)
 	{
-		pollTimeout = HealthCheckRetryDelay;
+		return true;
 	}
 
-	int pollResult = poll(pollFDs, healthCheckCount, pollTimeout);
+	return TimestampDifferenceExceeds(nodeHealth->reportTime,
+									  GetCurrentTimestamp(),
+									  UnhealthyTimeoutMs);
+}
 
-	if (pollResult < 0)
-	{
-		return STATUS_ERROR;
-	}
 
-	healthCheckIndex = 0;
+/*
+ * GetNodeCheckSchedule returns the adaptive schedule of the given node,
+ * creating it when needed.
+ */
+static NodeCheckSchedule *
+GetNodeCheckSchedule(NodeHealth *nodeHealth)
+{
+	bool found = false;
 
-	foreach(healthCheckCell, healthCheckList)
+	if (NodeCheckSchedules == NULL)
 	{
-		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
+		HASHCTL hashInfo;
 
-		healthCheck->readyToPoll = pollFileDescriptor->revents != 0;
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = sizeof(int64);
+		hashInfo.entrysize = sizeof(NodeCheckSchedule);
+		hashInfo.hcxt = TopMemoryContext;
 
-		healthCheckIndex++;
+		NodeCheckSchedules = hash_create("pg_auto_failover node check schedules",
+										 32, &hashInfo,
+										 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 	}
 
-	return 0;
-}
+	NodeCheckSchedule *schedule = (NodeCheckSchedule *)
+								  hash_search(NodeCheckSchedules,
+											  &(nodeHealth->nodeId),
+											  HASH_ENTER, &found);
+
+	if (!found)
+	{
+		struct timeval invalidTime = { 0, 0 };
+
+		schedule->periodMs = HealthCheckPeriod;
+		schedule->lastCheckTime = invalidTime;
+		schedule->nextCheckTime = invalidTime;
+	}
+
+	schedule->seen = true;
+
+	return schedule;
+}
+
+
+/*
+ * NodeIsDueForHealthCheck returns true when the node should be checked in
+ * the current round. Suspect nodes are always checked right away.
+ */
+static bool
+NodeIsDueForHealthCheck(NodeHealth *nodeHealth, struct timeval currentTime)
+{
+	if (!AdaptiveHealthChecksEnabled())
+	{
+		return true;
+	}
+
+	NodeCheckSchedule *schedule = GetNodeCheckSchedule(nodeHealth);
+
+	return NodeIsSuspect(nodeHealth) ||
+		   CompareTimes(&(schedule->nextCheckTime), &currentTime) <= 0;
+}
+
+
+/*
+ * UpdateNodeCheckSchedules computes when to check again each node of the
+ * round that just finished. The period of a node found healthy that was not
+ * suspect doubles, up to pgautofailover.health_check_max_period, and the
+ * period of any other node is reset to the fast retry rate.
+ */
+static void
+UpdateNodeCheckSchedules(List *healthCheckList, struct timeval roundStartTime)
+{
+	ListCell *healthCheckCell = NULL;
+
+	if (!AdaptiveHealthChecksEnabled())
+	{
+		return;
+	}
+
+	foreach(healthCheckCell, healthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+		NodeCheckSchedule *schedule = GetNodeCheckSchedule(healthCheck->node);
+
+		if (healthCheck->state == HEALTH_CHECK_OK &&
+			!NodeIsSuspect(healthCheck->node))
+		{
+			int64 periodMs = Max((int64) schedule->periodMs, HealthCheckPeriod) * 2;
+
+			schedule->periodMs = (int) Min(periodMs, (int64) HealthCheckMaxPeriod);
+		}
+		else
+		{
+			schedule->periodMs = Min(HealthCheckRetryDelay, HealthCheckPeriod);
+		}
+
+		schedule->lastCheckTime = roundStartTime;
+		schedule->nextCheckTime =
+			AddTimeMillis(roundStartTime, schedule->periodMs);
+	}
+}
+
+
+/*
+ * NextScheduledCheckTime returns when the next round of health checks should
+ * start: at the earliest scheduled check time, and no later than the given
+ * round end time.
+ */
+static struct timeval
+NextScheduledCheckTime(struct timeval roundEndTime)
+{
+	HASH_SEQ_STATUS status;
+	NodeCheckSchedule *schedule = NULL;
+	struct timeval nextCheckTime = roundEndTime;
+
+	if (!AdaptiveHealthChecksEnabled() || NodeCheckSchedules == NULL)
+	{
+		return roundEndTime;
+	}
+
+	hash_seq_init(&status, NodeCheckSchedules);
+
+	while ((schedule = (NodeCheckSchedule *) hash_seq_search(&status)) != NULL)
+	{
+		if (schedule->nextCheckTime.tv_sec != 0 &&
+			CompareTimes(&(schedule->nextCheckTime), &nextCheckTime) < 0)
+		{
+			nextCheckTime = schedule->nextCheckTime;
+		}
+	}
+
+	return nextCheckTime;
+}
+
+
+/*
+ * PruneNodeCheckSchedules removes the schedules of the nodes that were not
+ * part of the last round, because they have been removed or are now checked
+ * by another worker.
+ */
+static void
+PruneNodeCheckSchedules(void)
+{
+	HASH_SEQ_STATUS status;
+	NodeCheckSchedule *schedule = NULL;
+
+	if (NodeCheckSchedules == NULL)
+	{
+		return;
+	}
+
+	hash_seq_init(&status, NodeCheckSchedules);
+
+	while ((schedule = (NodeCheckSchedule *) hash_seq_search(&status)) != NULL)
+	{
+		if (!schedule->seen || !AdaptiveHealthChecksEnabled())
+		{
+			hash_search(NodeCheckSchedules, &(schedule->nodeId), HASH_REMOVE, NULL);
+		}
+		else
+		{
+			schedule->seen = false;
+		}
+	}
+}
+
+
+/*
+ * ReplanNodeCheckSchedules computes the schedules again after a reload of
+ * the configuration: the period of each node is brought within the new
+ * bounds, and its next check is planned from its last check, so that a
+ * shorter health_check_max_period applies at once instead of after the
+ * current period of the node.
+ */
+static void
+ReplanNodeCheckSchedules(void)
+{
+	HASH_SEQ_STATUS status;
+	NodeCheckSchedule *schedule = NULL;
+
+	if (NodeCheckSchedules == NULL)
+	{
+		return;
+	}
+
+	/* PruneNodeCheckSchedules drops them all when adaptive checks are off */
+	if (!AdaptiveHealthChecksEnabled())
+	{
+		return;
+	}
+
+	int minPeriodMs = Min(HealthCheckRetryDelay, HealthCheckPeriod);
+
+	hash_seq_init(&status, NodeCheckSchedules);
+
+	while ((schedule = (NodeCheckSchedule *) hash_seq_search(&status)) != NULL)
+	{
+		schedule->periodMs = Max(schedule->periodMs, minPeriodMs);
+		schedule->periodMs = Min(schedule->periodMs, HealthCheckMaxPeriod);
+
+		if (schedule->lastCheckTime.tv_sec != 0)
+		{
+			schedule->nextCheckTime =
+				AddTimeMillis(schedule->lastCheckTime, schedule->periodMs);
+		}
+	}
+}
+
+
+/*
+ * CreateHealthCheck creates a health check from a health check description.
+ */
+static HealthCheck *
+CreateHealthCheck(NodeHealth *nodeHealth)
+{
+	struct timeval invalidTime = { 0, 0 };
+
+	HealthCheck *healthCheck = palloc0(sizeof(HealthCheck));
+	healthCheck->node = nodeHealth;
+	healthCheck->state = HEALTH_CHECK_INITIAL;
+	healthCheck->connection = NULL;
+	healthCheck->numTries = 0;
+	healthCheck->nextEventTime = invalidTime;
+	healthCheck->watchedSocket = PGINVALID_SOCKET;
+	healthCheck->watchedEvents = HEALTH_CHECK_WATCH_NONE;
+	healthCheck->isReady = false;
+	healthCheck->timerArmed = false;
+	healthCheck->probeAnswered = false;
+
+	/* re-use the connection kept open from the previous round, if any */
+	if (HealthCheckKeepalive)
+	{
+		healthCheck->connection = LookupKeepaliveConnection(nodeHealth);
+	}
+
+	return healthCheck;
+}
+
+
+/*
+ * DoHealthChecks performs the given health checks.
+ *
+ * All the health checks are first marked ready, then only the health checks
+ * that have a socket event or an expired timer are processed again, until
+ * every one of them is either OK or DEAD.
+ */
+static void
+DoHealthChecks(List *healthCheckList)
+{
+	int pendingCheckCount = 0;
+	ListCell *healthCheckCell = NULL;
+
+	foreach(healthCheckCell, healthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+
+		MarkHealthCheckReady(healthCheck);
+		pendingCheckCount++;
+	}
+
+	while (!got_sigterm && pendingCheckCount > 0)
+	{
+		struct timeval currentTime = { 0, 0 };
+
+		gettimeofday(&currentTime, NULL);
+
+		while (!dlist_is_empty(&Reactor->readyList))
+		{
+			dlist_node *node = dlist_pop_head_node(&Reactor->readyList);
+			HealthCheck *healthCheck = dlist_container(HealthCheck, readyNode, node);
+
+			healthCheck->isReady = false;
+
+			ManageHealthCheck(healthCheck, currentTime);
+			healthCheck->readyToPoll = false;
+
+			if (ScheduleHealthCheck(healthCheck))
+			{
+				pendingCheckCount--;
+			}
+		}
+
+		/* write all the outcomes found in this iteration at once */
+		FlushNodeHealthStates();
+
+		if (pendingCheckCount == 0)
+		{
+			break;
+		}
+
+		if (WaitForEvent() == STATUS_ERROR)
+		{
+			ereport(WARNING,
+					(errmsg("pg_auto_failover health check worker failed "
+							"to wait for events: %m")));
+			LatchWait(HealthCheckRetryDelay);
+		}
+	}
+
+	FlushNodeHealthStates();
+	ResetHealthCheckReactor(healthCheckList);
+}
+
+
+/*
+ * RecordNodeHealthState registers the outcome of a health check, to be
+ * written to the metadata by FlushNodeHealthStates.
+ */
+static void
+RecordNodeHealthState(HealthCheck *healthCheck, NodeHealthState healthState)
+{
+	NodeHealthChange *change = palloc0(sizeof(NodeHealthChange));
+
+	change->node = healthCheck->node;
+	change->previousHealthState = healthCheck->node->healthState;
+	change->healthState = healthState;
+
+	PendingHealthChanges = lappend(PendingHealthChanges, change);
+}
+
+
+/*
+ * FlushNodeHealthStates writes the recorded health check outcomes to the
+ * metadata, in a single transaction. When a rack goes down, the health
+ * checks of all its nodes time out together, and they are all marked
+ * unhealthy with a single UPDATE statement.
+ */
+static void
+FlushNodeHealthStates(void)
+{
+	if (PendingHealthChanges == NIL)
+	{
+		return;
+	}
+
+	SetNodeHealthStateList(PendingHealthChanges);
+
+	list_free_deep(PendingHealthChanges);
+	PendingHealthChanges = NIL;
+}
+
+
+/*
+ * RecordHealthCheckLatency registers the time it took for the node to answer
+ * the successful health check, see health_check_latency.c.
+ */
+static void
+RecordHealthCheckLatency(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	struct timeval startTime = healthCheck->probeStartTime;
+
+	int64 latencyUs =
+		(int64) (currentTime.tv_sec - startTime.tv_sec) * 1000000L +
+		(currentTime.tv_usec - startTime.tv_usec);
+
+	HealthCheckLatencyRecord(healthCheck->node->nodeId, latencyUs);
+}
+
+
+/*
+ * ScheduleHealthCheck registers the socket events and the timer that the
+ * health check is now waiting for, given its current state. It returns true
+ * when the health check is done.
+ */
+static bool
+ScheduleHealthCheck(HealthCheck *healthCheck)
+{
+	switch (healthCheck->state)
+	{
+		case HEALTH_CHECK_INITIAL:
+		{
+			MarkHealthCheckReady(healthCheck);
+			return false;
+		}
+
+		case HEALTH_CHECK_CONNECTING:
+		case HEALTH_CHECK_PROBING:
+		{
+			int events = HEALTH_CHECK_WATCH_NONE;
+
+			if (healthCheck->pollingStatus == PGRES_POLLING_READING)
+			{
+				events = HEALTH_CHECK_WATCH_READ;
+			}
+			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				events = HEALTH_CHECK_WATCH_WRITE;
+			}
+
+			WatchHealthCheckSocket(healthCheck,
+								   PQsocket(healthCheck->connection),
+								   events);
+			ArmHealthCheckTimer(healthCheck, healthCheck->nextEventTime);
+
+			return false;
+		}
+
+		case HEALTH_CHECK_RETRY:
+		{
+			WatchHealthCheckSocket(healthCheck, PGINVALID_SOCKET,
+								   HEALTH_CHECK_WATCH_NONE);
+
+			/* when out of retries, mark the node as dead right away */
+			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
+			{
+				DisarmHealthCheckTimer(healthCheck);
+				MarkHealthCheckReady(healthCheck);
+			}
+			else
+			{
+				ArmHealthCheckTimer(healthCheck, healthCheck->nextEventTime);
+			}
+
+			return false;
+		}
+
+		case HEALTH_CHECK_OK:
+		case HEALTH_CHECK_DEAD:
+		default:
+		{
+			WatchHealthCheckSocket(healthCheck, PGINVALID_SOCKET,
+								   HEALTH_CHECK_WATCH_NONE);
+			DisarmHealthCheckTimer(healthCheck);
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * WaitForEvent sleeps until a time-based or I/O event occurs in any of the
+ * health checks, and adds the health checks concerned to the ready list.
+ */
+static int
+WaitForEvent(void)
+{
+	struct timeval currentTime = { 0, 0 };
+
+	gettimeofday(&currentTime, NULL);
+	AdvanceTimerWheel(TimeToTick(currentTime));
+
+	/* expired timers are processed before sleeping again */
+	if (!dlist_is_empty(&Reactor->readyList))
+	{
+		return 0;
+	}
+
+	int timeout = NextTimerTimeout(currentTime, HealthCheckRetryDelay);
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[HEALTH_CHECK_MAX_EVENTS];
+
+	int eventCount = epoll_wait(Reactor->epollFd, events,
+								HEALTH_CHECK_MAX_EVENTS, timeout);
+
+	if (eventCount < 0)
+	{
+		return errno == EINTR ? 0 : STATUS_ERROR;
+	}
+
+	for (int eventIndex = 0; eventIndex < eventCount; eventIndex++)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) events[eventIndex].data.ptr;
+
+		healthCheck->readyToPoll = true;
+		MarkHealthCheckReady(healthCheck);
+	}
+#else
+	int pollResult = poll(Reactor->pollFDs, Reactor->pollCount, timeout);
+
+	if (pollResult < 0)
+	{
+		return errno == EINTR ? 0 : STATUS_ERROR;
+	}
+
+	for (int pollIndex = 0;
+		 pollResult > 0 && pollIndex < Reactor->pollCount;
+		 pollIndex++)
+	{
+		if (Reactor->pollFDs[pollIndex].revents != 0)
+		{
+			HealthCheck *healthCheck = Reactor->pollChecks[pollIndex];
+
+			healthCheck->readyToPoll = true;
+			MarkHealthCheckReady(healthCheck);
+			pollResult--;
+		}
+	}
+#endif
+
+	gettimeofday(&currentTime, NULL);
+	AdvanceTimerWheel(TimeToTick(currentTime));
+
+	return 0;
+}
+
+
+/*
+ * CreateHealthCheckReactor allocates the event loop of the health check
+ * worker, for the whole lifetime of the process.
+ */
+static void
+CreateHealthCheckReactor(void)
+{
+	struct timeval currentTime = { 0, 0 };
+
+	Reactor = (HealthCheckReactor *)
+			  MemoryContextAllocZero(TopMemoryContext, sizeof(HealthCheckReactor));
+
+#ifdef HAVE_SYS_EPOLL_H
+	Reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (Reactor->epollFd < 0)
+	{
+		ereport(ERROR,
+				(errcode_for_socket_access(),
+				 errmsg("failed to create epoll file descriptor: %m")));
+	}
+#else
+	Reactor->pollCount = 0;
+	Reactor->pollSize = 64;
+	Reactor->pollFDs = (struct pollfd *)
+					   MemoryContextAllocZero(TopMemoryContext,
+											  Reactor->pollSize *
+											  sizeof(struct pollfd));
+	Reactor->pollChecks = (HealthCheck **)
+						  MemoryContextAllocZero(TopMemoryContext,
+												 Reactor->pollSize *
+												 sizeof(HealthCheck *));
+#endif
+
+	dlist_init(&Reactor->readyList);
+
+	for (int slot = 0; slot < TIMER_WHEEL_L0_SLOTS; slot++)
+	{
+		dlist_init(&Reactor->wheel0[slot]);
+	}
+
+	for (int slot = 0; slot < TIMER_WHEEL_L1_SLOTS; slot++)
+	{
+		dlist_init(&Reactor->wheel1[slot]);
+	}
+
+	gettimeofday(&currentTime, NULL);
+	Reactor->currentTick = TimeToTick(currentTime);
+	Reactor->timerCount = 0;
+}
+
+
+/*
+ * ResetHealthCheckReactor makes sure that none of the given health checks is
+ * still known to the event loop, so that their memory can be released. This
+ * is only useful when the health checks round has been interrupted.
+ */
+static void
+ResetHealthCheckReactor(List *healthCheckList)
+{
+	ListCell *healthCheckCell = NULL;
+
+	foreach(healthCheckCell, healthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+
+		if (healthCheck->connection != NULL)
+		{
+			DropHealthCheckConnection(healthCheck);
+		}
+
+		DisarmHealthCheckTimer(healthCheck);
+
+		if (healthCheck->isReady)
+		{
+			dlist_delete(&healthCheck->readyNode);
+			healthCheck->isReady = false;
+		}
+	}
+}
+
+
+/*
+ * FinishHealthCheckConnection stops watching the health check socket and
+ * then closes its connection. A socket must be removed from the event loop
+ * before it's closed, because its file descriptor number may be reused right
+ * away by another health check.
+ */
+static void
+FinishHealthCheckConnection(HealthCheck *healthCheck)
+{
+	WatchHealthCheckSocket(healthCheck, PGINVALID_SOCKET, HEALTH_CHECK_WATCH_NONE);
+
+	PQfinish(healthCheck->connection);
+	healthCheck->connection = NULL;
+}
+
+
+/*
+ * WatchHealthCheckSocket registers the given socket and events for the health
+ * check, replacing any previous registration. Using PGINVALID_SOCKET stops
+ * watching the health check socket.
+ *
+ * libpq may replace the connection socket while in PQconnectPoll, when trying
+ * the next address of a host, and the new socket is then likely to get the
+ * same file descriptor number as the old one. That's why we always refresh
+ * the registration of a socket that we keep watching.
+ */
+static void
+WatchHealthCheckSocket(HealthCheck *healthCheck, pgsocket socket, int events)
+{
+	pgsocket watchedSocket = healthCheck->watchedSocket;
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event event = { 0 };
+
+	event.events =
+		((events & HEALTH_CHECK_WATCH_READ) ? EPOLLIN : 0) |
+		((events & HEALTH_CHECK_WATCH_WRITE) ? EPOLLOUT : 0);
+	event.data.ptr = healthCheck;
+
+	if (watchedSocket != PGINVALID_SOCKET && watchedSocket != socket)
+	{
+		/* the socket might have been closed already, ignore errors */
+		(void) epoll_ctl(Reactor->epollFd, EPOLL_CTL_DEL, watchedSocket, NULL);
+		watchedSocket = PGINVALID_SOCKET;
+	}
+
+	if (socket != PGINVALID_SOCKET)
+	{
+		int operation =
+			watchedSocket == PGINVALID_SOCKET ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		int result = epoll_ctl(Reactor->epollFd, operation, socket, &event);
+
+		if (result < 0 && operation == EPOLL_CTL_MOD && errno == ENOENT)
+		{
+			result = epoll_ctl(Reactor->epollFd, EPOLL_CTL_ADD, socket, &event);
+		}
+
+		if (result < 0)
+		{
+			ereport(WARNING,
+					(errmsg("failed to watch health check socket for node "
+							"%lld \"%s\" (%s:%d): %m",
+							(long long) healthCheck->node->nodeId,
+							healthCheck->node->nodeName,
+							healthCheck->node->nodeHost,
+							healthCheck->node->nodePort)));
+
+			/* the connect timeout is going to take care of this check */
+			socket = PGINVALID_SOCKET;
+			events = HEALTH_CHECK_WATCH_NONE;
+		}
+	}
+#else
+	short pollEvents =
+		((events & HEALTH_CHECK_WATCH_READ) ? POLLIN : 0) |
+		((events & HEALTH_CHECK_WATCH_WRITE) ? POLLOUT : 0);
+
+	if (watchedSocket != PGINVALID_SOCKET && socket == PGINVALID_SOCKET)
+	{
+		/* swap the last registered socket in the free spot */
+		int lastIndex = --Reactor->pollCount;
+
+		Reactor->pollFDs[healthCheck->pollIndex] = Reactor->pollFDs[lastIndex];
+		Reactor->pollChecks[healthCheck->pollIndex] = Reactor->pollChecks[lastIndex];
+		Reactor->pollChecks[healthCheck->pollIndex]->pollIndex =
+			healthCheck->pollIndex;
+	}
+	else if (socket != PGINVALID_SOCKET)
+	{
+		if (watchedSocket == PGINVALID_SOCKET)
+		{
+			if (Reactor->pollCount == Reactor->pollSize)
+			{
+				Reactor->pollSize *= 2;
+				Reactor->pollFDs = (struct pollfd *)
+								   repalloc(Reactor->pollFDs,
+											Reactor->pollSize *
+											sizeof(struct pollfd));
+				Reactor->pollChecks = (HealthCheck **)
+									  repalloc(Reactor->pollChecks,
+											   Reactor->pollSize *
+											   sizeof(HealthCheck *));
+			}
+
+			healthCheck->pollIndex = Reactor->pollCount++;
+			Reactor->pollChecks[healthCheck->pollIndex] = healthCheck;
+		}
+
+		Reactor->pollFDs[healthCheck->pollIndex].fd = socket;
+		Reactor->pollFDs[healthCheck->pollIndex].events = pollEvents;
+		Reactor->pollFDs[healthCheck->pollIndex].revents = 0;
+	}
+#endif
+
+	healthCheck->watchedSocket = socket;
+	healthCheck->watchedEvents = events;
+}
+
+
+/*
+ * MarkHealthCheckReady adds the health check to the list of health checks to
+ * process in the next iteration of the event loop, unless it's there already.
+ */
+static void
+MarkHealthCheckReady(HealthCheck *healthCheck)
+{
+	if (!healthCheck->isReady)
+	{
+		dlist_push_tail(&Reactor->readyList, &healthCheck->readyNode);
+		healthCheck->isReady = true;
+	}
+}
+
+
+/*
+ * ArmHealthCheckTimer makes sure the health check is processed again once
+ * the given time has passed. The timer expires on the first tick strictly
+ * after expiryTime, so that the health check finds its deadline passed.
+ */
+static void
+ArmHealthCheckTimer(HealthCheck *healthCheck, struct timeval expiryTime)
+{
+	uint64 expiry = TimeToTick(expiryTime) + 1;
+
+	if (healthCheck->timerArmed && healthCheck->timerExpiry == expiry)
+	{
+		return;
+	}
+
+	DisarmHealthCheckTimer(healthCheck);
+
+	healthCheck->timerExpiry = expiry;
+	TimerWheelInsert(healthCheck);
+}
+
+
+/*
+ * DisarmHealthCheckTimer removes the health check timer from the wheel.
+ */
+static void
+DisarmHealthCheckTimer(HealthCheck *healthCheck)
+{
+	if (healthCheck->timerArmed)
+	{
+		dlist_delete(&healthCheck->timerNode);
+		healthCheck->timerArmed = false;
+		Reactor->timerCount--;
+	}
+}
+
+
+/*
+ * TimerWheelInsert adds the health check timer to the wheel slot that matches
+ * its expiry tick, or marks the health check ready when its timer has expired
+ * already.
+ */
+static void
+TimerWheelInsert(HealthCheck *healthCheck)
+{
+	uint64 currentTick = Reactor->currentTick;
+	uint64 expiry = healthCheck->timerExpiry;
+	dlist_head *slot = NULL;
+
+	if (expiry <= currentTick)
+	{
+		MarkHealthCheckReady(healthCheck);
+		return;
+	}
+
+	if (expiry - currentTick < TIMER_WHEEL_L0_SLOTS)
+	{
+		slot = &Reactor->wheel0[expiry & TIMER_WHEEL_L0_MASK];
+	}
+	else
+	{
+		/* park far away timers, they are re-inserted when cascaded */
+		if (expiry - currentTick >= TIMER_WHEEL_SPAN)
+		{
+			expiry = currentTick + TIMER_WHEEL_SPAN - 1;
+		}
+
+		slot = &Reactor->wheel1[(expiry >> TIMER_WHEEL_L0_BITS) &
+								TIMER_WHEEL_L1_MASK];
+	}
+
+	dlist_push_tail(slot, &healthCheck->timerNode);
+	healthCheck->timerArmed = true;
+	Reactor->timerCount++;
+}
+
+
+/*
+ * AdvanceTimerWheel moves the wheel forward to the given tick, cascading the
+ * second level timers into the first level when it completes a turn, and
+ * marking ready the health checks which timer has expired.
+ */
+static void
+AdvanceTimerWheel(uint64 nowTick)
+{
+	while (Reactor->currentTick < nowTick)
+	{
+		dlist_mutable_iter iter;
+
+		/* no need to walk empty slots one tick at a time */
+		if (Reactor->timerCount == 0)
+		{
+			Reactor->currentTick = nowTick;
+			break;
+		}
+
+		uint64 tick = ++Reactor->currentTick;
+
+		if ((tick & TIMER_WHEEL_L0_MASK) == 0)
+		{
+			dlist_head *slot =
+				&Reactor->wheel1[(tick >> TIMER_WHEEL_L0_BITS) &
+								 TIMER_WHEEL_L1_MASK];
+
+			dlist_foreach_modify(iter, slot)
+			{
+				HealthCheck *healthCheck =
+					dlist_container(HealthCheck, timerNode, iter.cur);
+
+				DisarmHealthCheckTimer(healthCheck);
+				TimerWheelInsert(healthCheck);
+			}
+		}
+
+		dlist_foreach_modify(iter, &Reactor->wheel0[tick & TIMER_WHEEL_L0_MASK])
+		{
+			HealthCheck *healthCheck =
+				dlist_container(HealthCheck, timerNode, iter.cur);
+
+			DisarmHealthCheckTimer(healthCheck);
+			MarkHealthCheckReady(healthCheck);
+		}
+	}
+}
+
+
+/*
+ * NextTimerTimeout returns how many milliseconds we can sleep before the next
+ * timer expires, or before the next cascade of the wheel, capped to the given
+ * maximum timeout.
+ */
+static int
+NextTimerTimeout(struct timeval currentTime, int maxTimeoutMs)
+{
+	uint64 currentTick = Reactor->currentTick;
+	uint64 nextTick = currentTick + TIMER_WHEEL_L0_SLOTS;
+
+	if (Reactor->timerCount == 0)
+	{
+		return maxTimeoutMs;
+	}
+
+	for (uint64 tick = currentTick + 1; tick < nextTick; tick++)
+	{
+		if ((tick & TIMER_WHEEL_L0_MASK) == 0 ||
+			!dlist_is_empty(&Reactor->wheel0[tick & TIMER_WHEEL_L0_MASK]))
+		{
+			nextTick = tick;
+			break;
+		}
+	}
+
+	int64 currentMs =
+		(int64) currentTime.tv_sec * 1000 + currentTime.tv_usec / 1000;
+	int64 timeoutMs = (int64) nextTick * HEALTH_CHECK_TIMER_TICK_MS - currentMs;
+
+	if (timeoutMs < 0)
+	{
+		return 0;
+	}
+
+	return timeoutMs > maxTimeoutMs ? maxTimeoutMs : (int) timeoutMs;
+}
+
+
+/*
+ * TimeToTick converts a timeval to a timer wheel tick.
+ */
+static uint64
+TimeToTick(struct timeval time)
+{
+	uint64 timeMs = (uint64) time.tv_sec * 1000 + time.tv_usec / 1000;
+
+	return timeMs / HEALTH_CHECK_TIMER_TICK_MS;
+}
 
 
 /*
- * LatchWait sleeps on the process latch until a timeout occurs.
+ * LatchWait sleeps on the process latch until a timeout occurs. A negative
+ * timeout sleeps until the latch is set.
  */
 static void
 LatchWait(long timeoutMs)
 {
 	int waitResult = 0;
+	int wakeEvents = WL_LATCH_SET | WL_POSTMASTER_DEATH;
+
+	if (timeoutMs >= 0)
+	{
+		wakeEvents |= WL_TIMEOUT;
+	}
 
 	/*
 	 * Background workers mustn't call usleep() or any direct equivalent:
@@ -812,13 +2128,9 @@ LatchWait(long timeoutMs)
 	 * background process goes away immediately in an emergency.
 	 */
 #if (PG_VERSION_NUM >= 100000)
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs, WAIT_EVENT_CLIENT_READ);
+	waitResult = WaitLatch(MyLatch, wakeEvents, timeoutMs, WAIT_EVENT_CLIENT_READ);
 #else
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs);
+	waitResult = WaitLatch(MyLatch, wakeEvents, timeoutMs);
 #endif
 
 	ResetLatch(MyLatch);
@@ -834,166 +2146,505 @@ LatchWait(long timeoutMs)
 
 
 /*
- * ManageHealthCheck proceeds the health check state machine.
+ * ManageHealthCheck proceeds the health check state machine.
+ */
+static void
+ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	HealthCheckState checkState = healthCheck->state;
+	NodeHealth *nodeHealth = healthCheck->node;
+
+	switch (checkState)
+	{
+		case HEALTH_CHECK_RETRY:
+		{
+			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
+			{
+				RecordNodeHealthState(healthCheck, NODE_HEALTH_BAD);
+
+				healthCheck->state = HEALTH_CHECK_DEAD;
+				break;
+			}
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
+			{
+				/* Retry time lies in the future */
+				break;
+			}
+
+			/* Fall through to re-connect */
+		}
+
+		/* fallthrough */
+		case HEALTH_CHECK_INITIAL:
+		{
+			if (healthCheck->connection != NULL)
+			{
+				StartKeepaliveProbe(healthCheck, currentTime);
+				break;
+			}
+
+			StringInfo connInfoString = makeStringInfo();
+
+			appendStringInfo(connInfoString, CONN_INFO_TEMPLATE,
+							 nodeHealth->nodeHost, nodeHealth->nodePort);
+
+			PGconn *connection = PQconnectStart(connInfoString->data);
+			PQsetnonblocking(connection, true);
+
+			ConnStatusType connStatus = PQstatus(connection);
+			if (connStatus == CONNECTION_BAD)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+			}
+			else
+			{
+				struct timeval timeoutTime = { 0, 0 };
+
+				timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+
+				healthCheck->nextEventTime = timeoutTime;
+				healthCheck->probeStartTime = currentTime;
+				healthCheck->connection = connection;
+				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+				healthCheck->state = HEALTH_CHECK_CONNECTING;
+			}
+
+			healthCheck->numTries++;
+
+			pfree(connInfoString->data);
+			pfree(connInfoString);
+
+			break;
+		}
+
+		case HEALTH_CHECK_CONNECTING:
+		{
+			PGconn *connection = healthCheck->connection;
+			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				FinishHealthCheckConnection(healthCheck);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->pollingStatus = pollingStatus;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				break;
+			}
+
+			if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+
+			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
+			pollingStatus = PQconnectPoll(connection);
+			char *sqlstate = connection->last_sqlstate;
+			bool receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
+			bool cannotConnectNowSqlstate = (receivedSqlstate &&
+											 strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+
+			if (pollingStatus == PGRES_POLLING_OK ||
+
+			    /* an auth request means pg is running */
+				connection->auth_req_received ||
+
+			    /* any error but CANNOT_CONNECT means the db is accepting connections */
+				(receivedSqlstate && !cannotConnectNowSqlstate))
+			{
+				if (pollingStatus == PGRES_POLLING_OK && HealthCheckKeepalive)
+				{
+					KeepHealthCheckConnection(healthCheck);
+				}
+				else
+				{
+					FinishHealthCheckConnection(healthCheck);
+				}
+
+				RecordNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+				RecordHealthCheckLatency(healthCheck, currentTime);
+
+				healthCheck->numTries = 0;
+				healthCheck->state = HEALTH_CHECK_OK;
+			}
+			else if (pollingStatus == PGRES_POLLING_FAILED)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				FinishHealthCheckConnection(healthCheck);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+			}
+			else
+			{
+				/* Health check is still connecting */
+			}
+
+			healthCheck->pollingStatus = pollingStatus;
+
+			break;
+		}
+
+		case HEALTH_CHECK_PROBING:
+		{
+			PGconn *connection = healthCheck->connection;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				/* the node failed to answer in time, count that as a try */
+				DropHealthCheckConnection(healthCheck);
+
+				healthCheck->numTries++;
+				healthCheck->nextEventTime =
+					AddTimeMillis(currentTime, HealthCheckRetryDelay);
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				break;
+			}
+
+			if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+
+			if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				int flushResult = PQflush(connection);
+
+				if (flushResult == 0)
+				{
+					healthCheck->pollingStatus = PGRES_POLLING_READING;
+					break;
+				}
+				else if (flushResult == 1)
+				{
+					/* still some data to send */
+					break;
+				}
+			}
+			else if (PQconsumeInput(connection) == 1)
+			{
+				bool probeDone = false;
+
+				/* consume results without blocking, until ReadyForQuery */
+				while (!PQisBusy(connection))
+				{
+					PGresult *result = PQgetResult(connection);
+
+					if (result == NULL)
+					{
+						probeDone = true;
+						break;
+					}
+
+					healthCheck->probeAnswered = true;
+
+					if (PQresultStatus(result) == PGRES_TUPLES_OK)
+					{
+						RecordNodeProbe(healthCheck, result);
+					}
+
+					PQclear(result);
+				}
+
+				if (!probeDone)
+				{
+					break;
+				}
+
+				if (healthCheck->probeAnswered &&
+					PQstatus(connection) == CONNECTION_OK)
+				{
+					KeepHealthCheckConnection(healthCheck);
+
+					RecordNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+					RecordHealthCheckLatency(healthCheck, currentTime);
+
+					healthCheck->numTries = 0;
+					healthCheck->state = HEALTH_CHECK_OK;
+					break;
+				}
+			}
+
+			/*
+			 * The kept connection is broken: fall back to connecting again,
+			 * right away.
+			 */
+			DropHealthCheckConnection(healthCheck);
+
+			healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+			healthCheck->state = HEALTH_CHECK_INITIAL;
+
+			break;
+		}
+
+		case HEALTH_CHECK_DEAD:
+		case HEALTH_CHECK_OK:
+		default:
+		{
+			/* Health check is done */
+		}
+	}
+}
+
+
+/*
+ * StartKeepaliveProbe sends an empty query on the connection that has been
+ * kept open to the node since the previous round of health checks. Any
+ * answer from the server means the node is healthy.
+ */
+static void
+StartKeepaliveProbe(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	PGconn *connection = healthCheck->connection;
+
+	const char *query = HealthCheckProbeLSN ? LSN_PROBE_QUERY : "";
+
+	if (PQstatus(connection) != CONNECTION_OK ||
+		PQsendQuery(connection, query) == 0)
+	{
+		/* fall back to connecting again, right away */
+		DropHealthCheckConnection(healthCheck);
+
+		healthCheck->state = HEALTH_CHECK_INITIAL;
+		return;
+	}
+
+	int flushResult = PQflush(connection);
+
+	if (flushResult < 0)
+	{
+		DropHealthCheckConnection(healthCheck);
+
+		healthCheck->state = HEALTH_CHECK_INITIAL;
+		return;
+	}
+
+	healthCheck->nextEventTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+	healthCheck->probeStartTime = currentTime;
+	healthCheck->probeAnswered = false;
+	healthCheck->pollingStatus =
+		flushResult == 1 ? PGRES_POLLING_WRITING : PGRES_POLLING_READING;
+	healthCheck->state = HEALTH_CHECK_PROBING;
+}
+
+
+/*
+ * RecordNodeProbe registers the role and WAL positions of the node found in
+ * the result of the LSN probe query.
+ */
+static void
+RecordNodeProbe(HealthCheck *healthCheck, PGresult *result)
+{
+	XLogRecPtr lsn = InvalidXLogRecPtr;
+	XLogRecPtr replayLSN = InvalidXLogRecPtr;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 3 ||
+		PQgetisnull(result, 0, 0))
+	{
+		return;
+	}
+
+	bool inRecovery = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
+
+	if (!ParseProbedLSN(result, 1, &lsn) ||
+		!ParseProbedLSN(result, 2, &replayLSN))
+	{
+		return;
+	}
+
+	NodeProbeRecord(healthCheck->node->nodeId, inRecovery, lsn, replayLSN);
+}
+
+
+/*
+ * ParseProbedLSN parses the pg_lsn value of the given column of the probe
+ * result. A NULL value is parsed as InvalidXLogRecPtr.
+ */
+static bool
+ParseProbedLSN(PGresult *result, int column, XLogRecPtr *lsn)
+{
+	uint32 hi = 0;
+	uint32 lo = 0;
+
+	if (PQgetisnull(result, 0, column))
+	{
+		*lsn = InvalidXLogRecPtr;
+		return true;
+	}
+
+	if (sscanf(PQgetvalue(result, 0, column), "%X/%X", &hi, &lo) != 2)
+	{
+		return false;
+	}
+
+	*lsn = ((uint64) hi) << 32 | lo;
+
+	return true;
+}
+
+
+/*
+ * KeepHealthCheckConnection stops watching the health check socket and keeps
+ * its connection open for the next round of health checks.
  */
 static void
-ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+KeepHealthCheckConnection(HealthCheck *healthCheck)
 {
-	HealthCheckState checkState = healthCheck->state;
 	NodeHealth *nodeHealth = healthCheck->node;
+	bool found = false;
 
-	switch (checkState)
-	{
-		case HEALTH_CHECK_RETRY:
-		{
-			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
-			{
-				SetNodeHealthState(healthCheck->node->nodeId,
-								   healthCheck->node->nodeName,
-								   healthCheck->node->nodeHost,
-								   healthCheck->node->nodePort,
-								   nodeHealth->healthState,
-								   NODE_HEALTH_BAD);
-
-				healthCheck->state = HEALTH_CHECK_DEAD;
-				break;
-			}
-
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
-			{
-				/* Retry time lies in the future */
-				break;
-			}
-
-			/* Fall through to re-connect */
-		}
-
-		/* fallthrough */
-		case HEALTH_CHECK_INITIAL:
-		{
-			StringInfo connInfoString = makeStringInfo();
-
-			appendStringInfo(connInfoString, CONN_INFO_TEMPLATE,
-							 nodeHealth->nodeHost, nodeHealth->nodePort,
-							 HealthCheckTimeout);
-
-			PGconn *connection = PQconnectStart(connInfoString->data);
-			PQsetnonblocking(connection, true);
+	WatchHealthCheckSocket(healthCheck, PGINVALID_SOCKET, HEALTH_CHECK_WATCH_NONE);
 
-			ConnStatusType connStatus = PQstatus(connection);
-			if (connStatus == CONNECTION_BAD)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+	if (KeepaliveConnections == NULL)
+	{
+		HASHCTL hashInfo;
 
-				PQfinish(connection);
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = sizeof(int64);
+		hashInfo.entrysize = sizeof(KeepaliveConnection);
+		hashInfo.hcxt = TopMemoryContext;
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+		KeepaliveConnections = hash_create("pg_auto_failover keepalive connections",
+										   32, &hashInfo,
+										   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
-			{
-				struct timeval timeoutTime = { 0, 0 };
+	KeepaliveConnection *entry = (KeepaliveConnection *)
+								 hash_search(KeepaliveConnections,
+											 &(nodeHealth->nodeId),
+											 HASH_ENTER, &found);
 
-				timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+	if (!found)
+	{
+		entry->nodeHost = MemoryContextStrdup(TopMemoryContext,
+											  nodeHealth->nodeHost);
+		entry->nodePort = nodeHealth->nodePort;
+	}
 
-				healthCheck->nextEventTime = timeoutTime;
-				healthCheck->connection = connection;
-				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
-				healthCheck->state = HEALTH_CHECK_CONNECTING;
-			}
+	entry->connection = healthCheck->connection;
+	entry->seen = true;
 
-			healthCheck->numTries++;
+	healthCheck->connection = NULL;
+}
 
-			pfree(connInfoString->data);
-			pfree(connInfoString);
 
-			break;
-		}
+/*
+ * DropHealthCheckConnection closes the health check connection, and makes
+ * sure it's not kept open for the next round of health checks.
+ */
+static void
+DropHealthCheckConnection(HealthCheck *healthCheck)
+{
+	if (KeepaliveConnections != NULL)
+	{
+		bool found = false;
+		KeepaliveConnection *entry = (KeepaliveConnection *)
+									 hash_search(KeepaliveConnections,
+												 &(healthCheck->node->nodeId),
+												 HASH_FIND, &found);
 
-		case HEALTH_CHECK_CONNECTING:
+		if (found && entry->connection == healthCheck->connection)
 		{
-			PGconn *connection = healthCheck->connection;
-			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
-
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+			pfree(entry->nodeHost);
+			hash_search(KeepaliveConnections,
+						&(healthCheck->node->nodeId),
+						HASH_REMOVE, NULL);
+		}
+	}
 
-				PQfinish(connection);
+	FinishHealthCheckConnection(healthCheck);
+}
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = pollingStatus;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-				break;
-			}
+/*
+ * LookupKeepaliveConnection returns the connection kept open to the given
+ * node, if any. When the node host or port changed, the old connection is
+ * closed.
+ */
+static PGconn *
+LookupKeepaliveConnection(NodeHealth *nodeHealth)
+{
+	bool found = false;
 
-			if (!healthCheck->readyToPoll)
-			{
-				break;
-			}
+	if (KeepaliveConnections == NULL)
+	{
+		return NULL;
+	}
 
-			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
-			pollingStatus = PQconnectPoll(connection);
-			char *sqlstate = connection->last_sqlstate;
-			bool receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
-			bool cannotConnectNowSqlstate = (receivedSqlstate &&
-											 strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+	KeepaliveConnection *entry = (KeepaliveConnection *)
+								 hash_search(KeepaliveConnections,
+											 &(nodeHealth->nodeId),
+											 HASH_FIND, &found);
 
-			if (pollingStatus == PGRES_POLLING_OK ||
+	if (!found)
+	{
+		return NULL;
+	}
 
-			    /* an auth request means pg is running */
-				connection->auth_req_received ||
+	if (strcmp(entry->nodeHost, nodeHealth->nodeHost) != 0 ||
+		entry->nodePort != nodeHealth->nodePort)
+	{
+		PQfinish(entry->connection);
+		pfree(entry->nodeHost);
+		hash_search(KeepaliveConnections, &(nodeHealth->nodeId), HASH_REMOVE, NULL);
 
-			    /* any error but CANNOT_CONNECT means the db is accepting connections */
-				(receivedSqlstate && !cannotConnectNowSqlstate))
-			{
-				PQfinish(connection);
+		return NULL;
+	}
 
-				SetNodeHealthState(healthCheck->node->nodeId,
-								   healthCheck->node->nodeName,
-								   healthCheck->node->nodeHost,
-								   healthCheck->node->nodePort,
-								   nodeHealth->healthState,
-								   NODE_HEALTH_GOOD);
+	entry->seen = true;
 
-				healthCheck->connection = NULL;
-				healthCheck->numTries = 0;
-				healthCheck->state = HEALTH_CHECK_OK;
-			}
-			else if (pollingStatus == PGRES_POLLING_FAILED)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+	return entry->connection;
+}
 
-				PQfinish(connection);
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+/*
+ * PruneKeepaliveConnections closes the connections kept open to nodes that
+ * have not been checked in the last round, because they have been removed or
+ * are now checked by another worker. When closeAll is true, every connection
+ * is closed.
+ */
+static void
+PruneKeepaliveConnections(bool closeAll)
+{
+	HASH_SEQ_STATUS status;
+	KeepaliveConnection *entry = NULL;
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
-			{
-				/* Health check is still connecting */
-			}
+	if (KeepaliveConnections == NULL)
+	{
+		return;
+	}
 
-			healthCheck->pollingStatus = pollingStatus;
+	hash_seq_init(&status, KeepaliveConnections);
 
-			break;
+	while ((entry = (KeepaliveConnection *) hash_seq_search(&status)) != NULL)
+	{
+		if (closeAll || !entry->seen)
+		{
+			PQfinish(entry->connection);
+			pfree(entry->nodeHost);
+			hash_search(KeepaliveConnections, &(entry->nodeId), HASH_REMOVE, NULL);
 		}
-
-		case HEALTH_CHECK_DEAD:
-		case HEALTH_CHECK_OK:
-		default:
+		else
 		{
-			/* Health check is done */
+			entry->seen = false;
 		}
 	}
 }
@@ -1140,6 +2791,8 @@ HealthCheckWorkerShmemInit(void)
 
 		LWLockInitialize(&HealthCheckHelperControl->lock,
 						 HealthCheckHelperControl->trancheId);
+
+		HealthCheckHelperControl->launcherPid = 0;
 	}
 
 	memset(&hashInfo, 0, sizeof(hashInfo));
@@ -1163,14 +2816,15 @@ HealthCheckWorkerShmemInit(void)
 
 
 /*
- * StopHealthCheckWorker stops the maintenance daemon for the given database
- * and removes it from the Health Check Launcher control hash.
+ * StopHealthCheckWorker stops the health check workers for the given database
+ * and removes them from the Health Check Launcher control hash.
  */
 void
 StopHealthCheckWorker(Oid databaseId)
 {
 	bool found = false;
-	pid_t workerPid = 0;
+	int workerCount = 0;
+	pid_t workerPids[HEALTH_CHECK_MAX_WORKERS] = { 0 };
 
 	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
@@ -1180,13 +2834,182 @@ StopHealthCheckWorker(Oid databaseId)
 
 	if (found)
 	{
-		workerPid = dbData->workerPid;
+		workerCount = dbData->workerCount;
+		memcpy(workerPids, dbData->workerPids, sizeof(workerPids));
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		if (workerPids[workerIndex] > 0)
+		{
+			kill(workerPids[workerIndex], SIGTERM);
+		}
+	}
+}
+
+
+/*
+ * HealthCheckWorkersWakeUp sets the latch of the health check workers of the
+ * given database, so that they start a new round of health checks right
+ * away. The node table trigger calls it when a transaction that registered
+ * new nodes commits, and each worker then loads the new nodes and checks
+ * them without waiting for the end of the current period.
+ */
+void
+HealthCheckWorkersWakeUp(Oid databaseId)
+{
+	bool found = false;
+	int workerCount = 0;
+	pid_t workerPids[HEALTH_CHECK_MAX_WORKERS] = { 0 };
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, &found);
+
+	if (found)
+	{
+		workerCount = dbData->workerCount;
+		memcpy(workerPids, dbData->workerPids, sizeof(workerPids));
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		WakeUpProcess(workerPids[workerIndex]);
+	}
+}
+
+
+/*
+ * HealthCheckNodeListChanged bumps the generation of the node list of the
+ * given database, so that its health check workers load the nodes again
+ * before their next round. The node table trigger calls it when a
+ * transaction that changed the nodes to check commits.
+ */
+void
+HealthCheckNodeListChanged(Oid databaseId)
+{
+	bool found = false;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, &found);
+
+	if (found)
+	{
+		dbData->nodeListGeneration++;
 	}
 
 	LWLockRelease(&HealthCheckHelperControl->lock);
+}
+
+
+/*
+ * HealthCheckLauncherWakeUpAtCommit makes the launcher scan pg_database
+ * again once the current transaction commits, so that a new database gets
+ * its health check workers right away.
+ */
+void
+HealthCheckLauncherWakeUpAtCommit(void)
+{
+	PendingLauncherWakeUp = true;
+}
+
+
+/*
+ * HealthCheckWorkersWakeUpAtCommit wakes up the health check workers of the
+ * current database once the current transaction commits, so that they find
+ * the pgautofailover extension that it created.
+ */
+void
+HealthCheckWorkersWakeUpAtCommit(void)
+{
+	PendingWorkersWakeUp = true;
+}
+
+
+/*
+ * HealthCheckXactCallback sends the wake-ups registered by the current
+ * transaction when it commits. Before that, the launcher and the workers
+ * would not see the new database or extension.
+ */
+static void
+HealthCheckXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		{
+			if (PendingLauncherWakeUp && HealthCheckHelperControl != NULL)
+			{
+				LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+				pid_t launcherPid = HealthCheckHelperControl->launcherPid;
+				LWLockRelease(&HealthCheckHelperControl->lock);
+
+				WakeUpProcess(launcherPid);
+			}
+
+			if (PendingWorkersWakeUp)
+			{
+				HealthCheckWorkersWakeUp(MyDatabaseId);
+			}
+
+			PendingLauncherWakeUp = false;
+			PendingWorkersWakeUp = false;
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+		{
+			PendingLauncherWakeUp = false;
+			PendingWorkersWakeUp = false;
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * WakeUpProcess sets the latch of the backend or background worker with the
+ * given pid, when it is still running.
+ */
+static void
+WakeUpProcess(pid_t pid)
+{
+	if (pid <= 0)
+	{
+		return;
+	}
+
+	PGPROC *proc = BackendPidGetProc(pid);
 
-	if (workerPid > 0)
+	if (proc != NULL)
 	{
-		kill(workerPid, SIGTERM);
+		SetLatch(&proc->procLatch);
 	}
 }
@@ -0,0 +1,465 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/log_subscription.c
+ *
+ * Implementation of the opt-in subscriptions to the monitor log
+ * notifications.
+ *
+ * The monitor duplicates the messages about its decisions that it sends to
+ * the Postgres logs as notifications, so that a client can follow them
+ * without the privileges to tail the server logs. Postgres writes every
+ * notification to its shared queue though, and only filters them by channel
+ * when delivering them to the listeners. Busy monitors would then fill the
+ * queue with messages that most clients read and discard.
+ *
+ * Instead, a client calls pgautofailover.subscribe_log_notifications() with
+ * the minimum level of the messages it wants, and optionally a formation.
+ * The backend is registered in shared memory and LISTENs to the matching
+ * channels:
+ *
+ *   log.<level>              messages of that level, for any formation
+ *   log.<level>.<formation>  messages of that level about the formation
+ *
+ * The monitor only sends a message on a channel that has subscribers, and
+ * doesn't send anything when no client subscribed at all. The subscription
+ * ends when the backend exits, or with unsubscribe_log_notifications().
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "log_subscription.h"
+#include "metadata.h"
+#include "notifications.h"
+
+#include "commands/async.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+
+
+/* subscribe_log_notifications() fails when all the slots are used */
+#define LOG_SUBSCRIPTION_MAX_SUBSCRIBERS 128
+
+
+typedef struct LogSubscriber
+{
+	/* zero when the slot is free */
+	int pid;
+	Oid databaseId;
+	LogNotificationLevel minLevel;
+
+	/* empty when subscribed to all the formations */
+	char formationId[NAMEDATALEN];
+} LogSubscriber;
+
+
+typedef struct LogSubscriptionControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	LogSubscriber subscribers[LOG_SUBSCRIPTION_MAX_SUBSCRIBERS];
+} LogSubscriptionControlData;
+
+
+static const char *LogNotificationLevelNames[LOG_NOTIFY_LEVEL_COUNT] = {
+	"info",
+	"warning"
+};
+
+
+static LogSubscriptionControlData *LogSubscriptionControl = NULL;
+static bool LogSubscriptionExitCallbackRegistered = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void LogSubscriptionShmemInit(void);
+static void LogSubscriptionShmemExit(int code, Datum arg);
+static bool LogSubscriptionRemove(LogSubscriber *previous);
+static LogNotificationLevel ParseLogNotificationLevel(const char *levelName);
+static void LogSubscriptionListen(LogSubscriber *subscriber, bool listen);
+
+
+PG_FUNCTION_INFO_V1(subscribe_log_notifications);
+PG_FUNCTION_INFO_V1(unsubscribe_log_notifications);
+
+
+/*
+ * InitializeLogSubscription, called at server start, requests the shared
+ * memory used to keep the subscribers.
+ */
+void
+InitializeLogSubscription(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(LogSubscriptionShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = LogSubscriptionShmemInit;
+}
+
+
+/*
+ * LogSubscriptionShmemSize computes how much shared memory is required.
+ */
+size_t
+LogSubscriptionShmemSize(void)
+{
+	return MAXALIGN(sizeof(LogSubscriptionControlData));
+}
+
+
+/*
+ * LogSubscriptionShmemInit initializes the requested shared memory.
+ */
+static void
+LogSubscriptionShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	LogSubscriptionControl =
+		(LogSubscriptionControlData *)
+		ShmemInitStruct("pg_auto_failover Log Subscriptions",
+						LogSubscriptionShmemSize(),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(LogSubscriptionControl->subscribers, 0,
+			   sizeof(LogSubscriptionControl->subscribers));
+
+		LogSubscriptionControl->trancheId = LWLockNewTrancheId();
+		LogSubscriptionControl->lockTrancheName =
+			"pg_auto_failover Log Subscriptions";
+		LWLockRegisterTranche(LogSubscriptionControl->trancheId,
+							  LogSubscriptionControl->lockTrancheName);
+
+		LWLockInitialize(&LogSubscriptionControl->lock,
+						 LogSubscriptionControl->trancheId);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * LogSubscriptionLookup tells whether a message of the given level should be
+ * sent on the channel of its level, because a client subscribed to all the
+ * formations, and on the channel of its formation, because a client
+ * subscribed to that formation only. The formationId may be NULL for
+ * messages that are not about a single formation.
+ */
+void
+LogSubscriptionLookup(LogNotificationLevel level, const char *formationId,
+					  bool *allFormations, bool *thisFormation)
+{
+	*allFormations = false;
+	*thisFormation = false;
+
+	if (LogSubscriptionControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&LogSubscriptionControl->lock, LW_SHARED);
+
+	for (int i = 0; i < LOG_SUBSCRIPTION_MAX_SUBSCRIBERS; i++)
+	{
+		LogSubscriber *subscriber = &(LogSubscriptionControl->subscribers[i]);
+
+		if (subscriber->pid == 0 ||
+			subscriber->databaseId != MyDatabaseId ||
+			subscriber->minLevel > level)
+		{
+			continue;
+		}
+
+		if (subscriber->formationId[0] == '\0')
+		{
+			*allFormations = true;
+		}
+		else if (formationId != NULL &&
+				 strcmp(subscriber->formationId, formationId) == 0)
+		{
+			*thisFormation = true;
+		}
+
+		if (*allFormations && (*thisFormation || formationId == NULL))
+		{
+			break;
+		}
+	}
+
+	LWLockRelease(&LogSubscriptionControl->lock);
+}
+
+
+/*
+ * LogSubscriptionChannel builds the name of the channel of the given level,
+ * and formation when formationId is not NULL. It returns false when the name
+ * does not fit in NAMEDATALEN.
+ */
+bool
+LogSubscriptionChannel(char *channel, size_t size,
+					   LogNotificationLevel level, const char *formationId)
+{
+	int n = 0;
+
+	/*
+	 * Explanation of IGNORE-BANNED
+	 * Arguments are always non-null and we
+	 * do not write before the allocated buffer.
+	 *
+	 */
+	if (formationId == NULL || formationId[0] == '\0')
+	{
+		n = snprintf(channel, size, CHANNEL_LOG_LEVEL, /* IGNORE-BANNED */
+					 LogNotificationLevelNames[level]);
+	}
+	else
+	{
+		n = snprintf(channel, size, CHANNEL_LOG_FORMATION, /* IGNORE-BANNED */
+					 LogNotificationLevelNames[level], formationId);
+	}
+
+	return n >= 0 && (size_t) n < size && n < NAMEDATALEN;
+}
+
+
+/*
+ * subscribe_log_notifications registers the current backend as a subscriber
+ * to the log notifications of the given level and above, for the given
+ * formation or all of them when formation_id is NULL, and LISTENs to the
+ * matching channels. Calling it again replaces the previous subscription.
+ */
+Datum
+subscribe_log_notifications(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	LogSubscriber subscriber = { 0 };
+	LogSubscriber previous = { 0 };
+
+	const char *levelName =
+		PG_ARGISNULL(0) ? "info" : text_to_cstring(PG_GETARG_TEXT_P(0));
+
+	subscriber.pid = MyProcPid;
+	subscriber.databaseId = MyDatabaseId;
+	subscriber.minLevel = ParseLogNotificationLevel(levelName);
+
+	if (!PG_ARGISNULL(1))
+	{
+		char *formationId = text_to_cstring(PG_GETARG_TEXT_P(1));
+		char channel[NAMEDATALEN] = { 0 };
+
+		/* "warning" is the longest level name */
+		if (!LogSubscriptionChannel(channel, sizeof(channel),
+									LOG_NOTIFY_WARNING, formationId))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NAME_TOO_LONG),
+					 errmsg("formation name \"%s\" is too long to subscribe "
+							"to its log notifications", formationId)));
+		}
+
+		strlcpy(subscriber.formationId, formationId, NAMEDATALEN);
+	}
+
+	if (LogSubscriptionControl == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover.subscribe_log_notifications() requires "
+						"pgautofailover to be in shared_preload_libraries")));
+	}
+
+	if (!LogSubscriptionExitCallbackRegistered)
+	{
+		before_shmem_exit(LogSubscriptionShmemExit, (Datum) 0);
+		LogSubscriptionExitCallbackRegistered = true;
+	}
+
+	bool hadSubscription = LogSubscriptionRemove(&previous);
+	bool registered = false;
+
+	LWLockAcquire(&LogSubscriptionControl->lock, LW_EXCLUSIVE);
+
+	for (int i = 0; i < LOG_SUBSCRIPTION_MAX_SUBSCRIBERS; i++)
+	{
+		if (LogSubscriptionControl->subscribers[i].pid == 0)
+		{
+			LogSubscriptionControl->subscribers[i] = subscriber;
+			registered = true;
+			break;
+		}
+	}
+
+	LWLockRelease(&LogSubscriptionControl->lock);
+
+	if (!registered)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("too many subscribers to the log notifications"),
+				 errdetail("The monitor accepts at most %d subscribers.",
+						   LOG_SUBSCRIPTION_MAX_SUBSCRIBERS)));
+	}
+
+	/* both take effect at commit, in that order */
+	if (hadSubscription)
+	{
+		LogSubscriptionListen(&previous, false);
+	}
+
+	LogSubscriptionListen(&subscriber, true);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * unsubscribe_log_notifications ends the subscription of the current backend
+ * to the log notifications, and returns false when there was none.
+ */
+Datum
+unsubscribe_log_notifications(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	LogSubscriber previous = { 0 };
+
+	if (!LogSubscriptionRemove(&previous))
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	LogSubscriptionListen(&previous, false);
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * LogSubscriptionShmemExit releases the slot of the current backend when it
+ * exits.
+ */
+static void
+LogSubscriptionShmemExit(int code, Datum arg)
+{
+	LogSubscriber previous = { 0 };
+
+	(void) LogSubscriptionRemove(&previous);
+}
+
+
+/*
+ * LogSubscriptionRemove releases the slot of the current backend, copies it
+ * to previous, and returns false when the backend had no subscription.
+ */
+static bool
+LogSubscriptionRemove(LogSubscriber *previous)
+{
+	bool found = false;
+
+	if (LogSubscriptionControl == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(&LogSubscriptionControl->lock, LW_EXCLUSIVE);
+
+	for (int i = 0; i < LOG_SUBSCRIPTION_MAX_SUBSCRIBERS; i++)
+	{
+		LogSubscriber *subscriber = &(LogSubscriptionControl->subscribers[i]);
+
+		if (subscriber->pid == MyProcPid)
+		{
+			*previous = *subscriber;
+			memset(subscriber, 0, sizeof(LogSubscriber));
+			found = true;
+			break;
+		}
+	}
+
+	LWLockRelease(&LogSubscriptionControl->lock);
+
+	return found;
+}
+
+
+/*
+ * ParseLogNotificationLevel returns the level of the given name.
+ */
+static LogNotificationLevel
+ParseLogNotificationLevel(const char *levelName)
+{
+	for (int level = 0; level < LOG_NOTIFY_LEVEL_COUNT; level++)
+	{
+		if (pg_strcasecmp(levelName, LogNotificationLevelNames[level]) == 0)
+		{
+			return (LogNotificationLevel) level;
+		}
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown log notification level \"%s\"", levelName),
+			 errhint("Use one of \"info\" or \"warning\".")));
+
+	/* keep compiler quiet */
+	return LOG_NOTIFY_INFO;
+}
+
+
+/*
+ * LogSubscriptionListen LISTENs, or UNLISTENs, to the channels that match
+ * the given subscription.
+ */
+static void
+LogSubscriptionListen(LogSubscriber *subscriber, bool listen)
+{
+	for (int level = subscriber->minLevel; level < LOG_NOTIFY_LEVEL_COUNT; level++)
+	{
+		char channel[NAMEDATALEN] = { 0 };
+
+		/* formation names have been checked when subscribing */
+		if (!LogSubscriptionChannel(channel, sizeof(channel),
+									(LogNotificationLevel) level,
+									subscriber->formationId))
+		{
+			continue;
+		}
+
+		if (listen)
+		{
+			Async_Listen(channel);
+		}
+		else
+		{
+			Async_Unlisten(channel);
+		}
+	}
+}
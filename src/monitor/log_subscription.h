@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/log_subscription.h
+ *
+ * Declarations for the opt-in subscriptions to the monitor log
+ * notifications.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/*
+ * Levels of the log notifications, in increasing order of severity. A
+ * subscriber receives the messages of its level and above.
+ */
+typedef enum LogNotificationLevel
+{
+	LOG_NOTIFY_INFO = 0,
+	LOG_NOTIFY_WARNING
+} LogNotificationLevel;
+
+#define LOG_NOTIFY_LEVEL_COUNT (LOG_NOTIFY_WARNING + 1)
+
+
+/* public function declarations */
+extern void InitializeLogSubscription(void);
+extern size_t LogSubscriptionShmemSize(void);
+extern void LogSubscriptionLookup(LogNotificationLevel level,
+								  const char *formationId,
+								  bool *allFormations,
+								  bool *thisFormation);
+extern bool LogSubscriptionChannel(char *channel, size_t size,
+								   LogNotificationLevel level,
+								   const char *formationId);
@@ -15,6 +15,7 @@
 #include "fmgr.h"
 
 #include "metadata.h"
+#include "protocol_stats.h"
 #include "version_compat.h"
 
 #include "access/genam.h"
@@ -140,13 +141,18 @@ LockFormation(char *formationId, LOCKMODE lockMode)
 	LOCKTAG tag;
 	const bool sessionLock = false;
 	const bool dontWait = false;
+	instr_time lockStart;
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, formationIdHash,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION);
 
+	ProtocolStatsSetGroup(formationId, -1);
+
+	INSTR_TIME_SET_CURRENT(lockStart);
 	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	ProtocolStatsLockWait(lockStart);
 }
 
 
@@ -160,13 +166,70 @@ LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
 	LOCKTAG tag;
 	const bool sessionLock = false;
 	const bool dontWait = false;
+	instr_time lockStart;
+
+	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, formationIdHash, (uint32) groupId,
+						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP);
+
+	ProtocolStatsSetGroup(formationId, groupId);
+
+	INSTR_TIME_SET_CURRENT(lockStart);
+	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	ProtocolStatsLockWait(lockStart);
+}
+
+
+/*
+ * TryLockNodeGroup takes a lock on a particular group in a formation when
+ * it's available right away, and returns whether the lock was acquired. It is
+ * used when we already hold the lock of another group, so that two backends
+ * proceeding groups in a different order skip each other's groups rather
+ * than deadlock.
+ */
+bool
+TryLockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
+{
+	LOCKTAG tag;
+	const bool sessionLock = false;
+	const bool dontWait = true;
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, formationIdHash, (uint32) groupId,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP);
 
+	return LockAcquire(&tag, lockMode, sessionLock, dontWait) !=
+		   LOCKACQUIRE_NOT_AVAIL;
+}
+
+
+/*
+ * LockFormationGroupAllocation takes a lock on the allocation of groups in a
+ * formation, to prevent concurrent registrations from picking the same group
+ * or changing the formation kind and dbname at the same time. This lock does
+ * not conflict with the formation lock, so that the nodes of the other groups
+ * can keep reporting to the monitor meanwhile.
+ */
+void
+LockFormationGroupAllocation(char *formationId, LOCKMODE lockMode)
+{
+	LOCKTAG tag;
+	const bool sessionLock = false;
+	const bool dontWait = false;
+	instr_time lockStart;
+
+	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, formationIdHash,
+						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_GROUP_ALLOCATION);
+
+	ProtocolStatsSetGroup(formationId, -1);
+
+	INSTR_TIME_SET_CURRENT(lockStart);
 	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	ProtocolStatsLockWait(lockStart);
 }
 
 
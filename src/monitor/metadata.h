@@ -15,12 +15,16 @@
 
 #include "storage/lockdefs.h"
 
-#define AUTO_FAILOVER_EXTENSION_VERSION "1.6"
+#define AUTO_FAILOVER_EXTENSION_VERSION "1.7"
 #define AUTO_FAILOVER_EXTENSION_NAME "pgautofailover"
 #define AUTO_FAILOVER_SCHEMA_NAME "pgautofailover"
 #define AUTO_FAILOVER_FORMATION_TABLE "pgautofailover.formation"
 #define AUTO_FAILOVER_NODE_TABLE "pgautofailover.node"
 #define AUTO_FAILOVER_EVENT_TABLE "pgautofailover.event"
+#define AUTO_FAILOVER_REPLICATION_REPORT_TABLE "pgautofailover.replication_report"
+#define AUTO_FAILOVER_NODE_RESOURCES_TABLE "pgautofailover.node_resources"
+#define AUTO_FAILOVER_NODE_SYNC_REP_WAITS_TABLE "pgautofailover.node_sync_rep_waits"
+#define AUTO_FAILOVER_NODE_PROGRESS_TABLE "pgautofailover.node_progress"
 #define REPLICATION_STATE_TYPE_NAME "replication_state"
 
 
@@ -32,7 +36,8 @@
 typedef enum AutoFailoverHALocktagClass
 {
 	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION = 10,
-	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP = 11
+	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP = 11,
+	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_GROUP_ALLOCATION = 12
 } AutoFailoverHALocktagClass;
 
 /* GUC variable for version checks, true by default */
@@ -44,4 +49,6 @@ extern Oid pgAutoFailoverSchemaId(void);
 extern Oid pgAutoFailoverExtensionOwner(void);
 extern void LockFormation(char *formationId, LOCKMODE lockMode);
 extern void LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode);
+extern bool TryLockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode);
+extern void LockFormationGroupAllocation(char *formationId, LOCKMODE lockMode);
 extern bool checkPgAutoFailoverVersion(void);
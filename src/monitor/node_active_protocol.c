@@ -17,26 +17,64 @@
 #include "miscadmin.h"
 #include "access/xact.h"
 
+/* list_qsort is only in Postgres 11 and 12 */
+#include "version_compat.h"
+
+#include "admission_control.h"
 #include "formation_metadata.h"
 #include "group_state_machine.h"
 #include "metadata.h"
+#include "node_cache.h"
+#include "node_heartbeat.h"
+#include "node_liveness.h"
 #include "node_metadata.h"
 #include "notifications.h"
+#include "primary_lease.h"
+#include "protocol_stats.h"
 #include "replication_state.h"
 
 #include "access/htup_details.h"
 #include "access/xlogdefs.h"
 #include "catalog/pg_enum.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
 #include "storage/lockdefs.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/pg_lsn.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+/*
+ * RegisterNodeRequest contains the arguments of a node registration, as given
+ * to register_node() or in an entry of the register_nodes() array.
+ */
+typedef struct RegisterNodeRequest
+{
+	char *formationId;
+	char *nodeHost;
+	int nodePort;
+	const char *expectedDBName;
+	char *nodeName;
+	uint64 sysIdentifier;
+	int64 nodeId;
+	int groupId;
+	ReplicationState initialState;
+	char *nodeKind;
+	int candidatePriority;
+	bool replicationQuorum;
+	char *nodeCluster;
+} RegisterNodeRequest;
 
 
 /* private function forward declarations */
+static AutoFailoverNode * RegisterNode(RegisterNodeRequest *request);
+static List * ParseRegisterNodesRequests(Datum nodesDatum);
 static AutoFailoverNodeState * NodeActive(char *formationId,
 										  AutoFailoverNodeState *currentNodeState);
 static void JoinAutoFailoverFormation(AutoFailoverFormation *formation,
@@ -48,9 +86,25 @@ static int AssignGroupId(AutoFailoverFormation *formation,
 						 ReplicationState *initialState);
 
 static bool RemoveNode(AutoFailoverNode *currentNode, bool force);
+static bool StartNodeRemoval(AutoFailoverNode *currentNode, bool force,
+							 bool *currentNodeIsPrimary);
+static void ProceedGroupAfterRemoval(char *formationId, int groupId,
+									 bool primaryRemoved,
+									 AutoFailoverNode *removedStandbyNode,
+									 int removedCount);
+#if (PG_VERSION_NUM >= 130000)
+static int pgautofailover_node_removal_compare(const union ListCell *a,
+											   const union ListCell *b);
+#else
+static int pgautofailover_node_removal_compare(const void *a, const void *b);
+#endif
+static List * SortSyncStandbysByLatency(List *syncStandbyNodesGroupList);
+static List * SortSyncStandbysByZone(List *syncStandbyNodesGroupList,
+									 AutoFailoverNode *primaryNode);
 
 /* SQL-callable function declarations */
 PG_FUNCTION_INFO_V1(register_node);
+PG_FUNCTION_INFO_V1(register_nodes);
 PG_FUNCTION_INFO_V1(node_active);
 PG_FUNCTION_INFO_V1(update_node_metadata);
 PG_FUNCTION_INFO_V1(get_nodes);
@@ -60,12 +114,19 @@ PG_FUNCTION_INFO_V1(get_other_nodes);
 PG_FUNCTION_INFO_V1(remove_node);
 PG_FUNCTION_INFO_V1(remove_node_by_nodeid);
 PG_FUNCTION_INFO_V1(remove_node_by_host);
+PG_FUNCTION_INFO_V1(remove_nodes);
 PG_FUNCTION_INFO_V1(perform_failover);
 PG_FUNCTION_INFO_V1(perform_promotion);
 PG_FUNCTION_INFO_V1(start_maintenance);
 PG_FUNCTION_INFO_V1(stop_maintenance);
 PG_FUNCTION_INFO_V1(set_node_candidate_priority);
 PG_FUNCTION_INFO_V1(set_node_replication_quorum);
+PG_FUNCTION_INFO_V1(set_node_upstream);
+PG_FUNCTION_INFO_V1(get_upstream);
+PG_FUNCTION_INFO_V1(get_cascaded_nodes);
+PG_FUNCTION_INFO_V1(get_most_advanced_standby);
+PG_FUNCTION_INFO_V1(renew_primary_lease);
+PG_FUNCTION_INFO_V1(set_sync_rep_waits);
 PG_FUNCTION_INFO_V1(synchronous_standby_names);
 
 
@@ -81,49 +142,125 @@ register_node(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
+	RegisterNodeRequest request = { 0 };
+
 	text *formationIdText = PG_GETARG_TEXT_P(0);
-	char *formationId = text_to_cstring(formationIdText);
+	request.formationId = text_to_cstring(formationIdText);
+
+	ProtocolStatsBegin(PROTOCOL_REGISTER_NODE, request.formationId, -1);
+	AdmitProtocolCall("register_node");
 
 	text *nodeHostText = PG_GETARG_TEXT_P(1);
-	char *nodeHost = text_to_cstring(nodeHostText);
-	int32 nodePort = PG_GETARG_INT32(2);
+	request.nodeHost = text_to_cstring(nodeHostText);
+	request.nodePort = PG_GETARG_INT32(2);
 
 	Name dbnameName = PG_GETARG_NAME(3);
-	const char *expectedDBName = NameStr(*dbnameName);
+	request.expectedDBName = NameStr(*dbnameName);
 
 	text *nodeNameText = PG_GETARG_TEXT_P(4);
-	char *nodeName = text_to_cstring(nodeNameText);
+	request.nodeName = text_to_cstring(nodeNameText);
 
-	uint64 sysIdentifier = PG_GETARG_INT64(5);
+	request.sysIdentifier = PG_GETARG_INT64(5);
 
-	int64 currentNodeId = PG_GETARG_INT64(6);
-	int32 currentGroupId = PG_GETARG_INT32(7);
-	Oid currentReplicationStateOid = PG_GETARG_OID(8);
+	request.nodeId = PG_GETARG_INT64(6);
+	request.groupId = PG_GETARG_INT32(7);
+	request.initialState = EnumGetReplicationState(PG_GETARG_OID(8));
 
 	text *nodeKindText = PG_GETARG_TEXT_P(9);
-	char *nodeKind = text_to_cstring(nodeKindText);
-	FormationKind expectedFormationKind =
-		FormationKindFromNodeKindString(nodeKind);
-	int candidatePriority = PG_GETARG_INT32(10);
-	bool replicationQuorum = PG_GETARG_BOOL(11);
+	request.nodeKind = text_to_cstring(nodeKindText);
+	request.candidatePriority = PG_GETARG_INT32(10);
+	request.replicationQuorum = PG_GETARG_BOOL(11);
 
 	text *nodeClusterText = PG_GETARG_TEXT_P(12);
-	char *nodeCluster = text_to_cstring(nodeClusterText);
+	request.nodeCluster = text_to_cstring(nodeClusterText);
+
+	AutoFailoverNode *pgAutoFailoverNode = RegisterNode(&request);
+
+	ProceedGroupState(pgAutoFailoverNode);
+
+	TupleDesc resultDescriptor = NULL;
+	Datum values[6];
+	bool isNulls[6];
+
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[0] = Int64GetDatum(pgAutoFailoverNode->nodeId);
+	values[1] = Int32GetDatum(pgAutoFailoverNode->groupId);
+	values[2] = ObjectIdGetDatum(
+		ReplicationStateGetEnum(pgAutoFailoverNode->goalState));
+	values[3] = Int32GetDatum(pgAutoFailoverNode->candidatePriority);
+	values[4] = BoolGetDatum(pgAutoFailoverNode->replicationQuorum);
+	values[5] = CStringGetTextDatum(pgAutoFailoverNode->nodeName);
+
+	TypeFuncClass resultTypeClass =
+		get_call_result_type(fcinfo, NULL, &resultDescriptor);
+
+	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+	Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+	PG_RETURN_DATUM(resultDatum);
+}
+
+
+/*
+ * RegisterNode adds a node to a given formation, as asked by the given
+ * request, and returns the registered node. The caller is responsible for
+ * proceeding the state machine of the node's group afterwards.
+ */
+static AutoFailoverNode *
+RegisterNode(RegisterNodeRequest *request)
+{
+	char *formationId = request->formationId;
+	char *nodeHost = request->nodeHost;
+	int nodePort = request->nodePort;
+	const char *expectedDBName = request->expectedDBName;
+	char *nodeName = request->nodeName;
+	uint64 sysIdentifier = request->sysIdentifier;
+	char *nodeKind = request->nodeKind;
+	FormationKind expectedFormationKind =
+		FormationKindFromNodeKindString(nodeKind);
+	char *nodeCluster = request->nodeCluster;
 
 	AutoFailoverNodeState currentNodeState = { 0 };
 
-	currentNodeState.nodeId = currentNodeId;
-	currentNodeState.groupId = currentGroupId;
-	currentNodeState.replicationState =
-		EnumGetReplicationState(currentReplicationStateOid);
+	currentNodeState.nodeId = request->nodeId;
+	currentNodeState.groupId = request->groupId;
+	currentNodeState.replicationState = request->initialState;
 	currentNodeState.reportedLSN = 0;
-	currentNodeState.candidatePriority = candidatePriority;
-	currentNodeState.replicationQuorum = replicationQuorum;
+	currentNodeState.candidatePriority = request->candidatePriority;
+	currentNodeState.replicationQuorum = request->replicationQuorum;
 
-	LockFormation(formationId, ExclusiveLock);
+	/*
+	 * Registering a node only changes its own group, which is locked in
+	 * JoinAutoFailoverFormation, so the other groups of the formation can keep
+	 * calling node_active() meanwhile.
+	 */
+	LockFormation(formationId, ShareLock);
 
 	AutoFailoverFormation *formation = GetFormation(formationId);
 
+	/*
+	 * Picking a group for the new node, or changing the formation kind or
+	 * dbname when registering its first node, depends on the whole formation
+	 * though. Concurrent registrations that need to do that are serialized,
+	 * and we read the formation again once we hold the lock.
+	 */
+	if (formation != NULL &&
+		(currentNodeState.groupId < 0 ||
+		 formation->kind != expectedFormationKind ||
+		 strncmp(formation->dbname, expectedDBName, NAMEDATALEN) != 0))
+	{
+		LockFormationGroupAllocation(formationId, ExclusiveLock);
+
+		formation = GetFormation(formationId);
+	}
+
 	/*
 	 * The default formationId is "default" and of kind FORMATION_KIND_PGSQL.
 	 * It might get used to manage a formation though. Check about that here,
@@ -209,7 +346,8 @@ register_node(PG_FUNCTION_ARGS)
 	{
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, pgAutoFailoverNode->formationId,
 			message, BUFSIZE,
 			"Registering " NODE_FORMAT
 			" to formation \"%s\" "
@@ -265,7 +403,8 @@ register_node(PG_FUNCTION_ARGS)
 								formationId)));
 			}
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, formation->formationId,
 				message, BUFSIZE,
 				"Setting number_sync_standbys to %d for formation %s "
 				"now that we have %d/%d standby nodes set with replication-quorum.",
@@ -275,14 +414,6 @@ register_node(PG_FUNCTION_ARGS)
 		}
 	}
 
-	AutoFailoverNodeState *assignedNodeState =
-		(AutoFailoverNodeState *) palloc0(sizeof(AutoFailoverNodeState));
-	assignedNodeState->nodeId = pgAutoFailoverNode->nodeId;
-	assignedNodeState->groupId = pgAutoFailoverNode->groupId;
-	assignedNodeState->replicationState = pgAutoFailoverNode->goalState;
-	assignedNodeState->candidatePriority = pgAutoFailoverNode->candidatePriority;
-	assignedNodeState->replicationQuorum = pgAutoFailoverNode->replicationQuorum;
-
 	/*
 	 * Check that the state selected by the monitor matches the state required
 	 * by the keeper, if any. REPLICATION_STATE_INITIAL means the monitor can
@@ -309,35 +440,241 @@ register_node(PG_FUNCTION_ARGS)
 		}
 	}
 
-	ProceedGroupState(pgAutoFailoverNode);
+	return pgAutoFailoverNode;
+}
 
-	TupleDesc resultDescriptor = NULL;
-	Datum values[6];
-	bool isNulls[6];
 
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
+/*
+ * register_nodes registers many nodes at once, in a single transaction. The
+ * nodes are given as a JSON array of objects, which keys are the names of the
+ * arguments of register_node(), with the same default values.
+ *
+ * The nodes are registered in the order of the array, and then we proceed
+ * the state machine of each group they joined only once, rather than once per
+ * node. The result has a row per node, in the same order as the array.
+ */
+Datum
+register_nodes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	ListCell *requestCell = NULL;
+	ListCell *nodeCell = NULL;
+	List *registeredNodeList = NIL;
+	List *groupNodeList = NIL;
 
-	values[0] = Int64GetDatum(assignedNodeState->nodeId);
-	values[1] = Int32GetDatum(assignedNodeState->groupId);
-	values[2] = ObjectIdGetDatum(
-		ReplicationStateGetEnum(pgAutoFailoverNode->goalState));
-	values[3] = Int32GetDatum(assignedNodeState->candidatePriority);
-	values[4] = BoolGetDatum(assignedNodeState->replicationQuorum);
-	values[5] = CStringGetTextDatum(pgAutoFailoverNode->nodeName);
+	checkPgAutoFailoverVersion();
 
-	TypeFuncClass resultTypeClass =
-		get_call_result_type(fcinfo, NULL, &resultDescriptor);
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
 
-	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
 	{
 		ereport(ERROR, (errmsg("return type must be a row type")));
 	}
 
-	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
-	Datum resultDatum = HeapTupleGetDatum(resultTuple);
+	List *requestList = ParseRegisterNodesRequests(PG_GETARG_DATUM(0));
 
-	PG_RETURN_DATUM(resultDatum);
+	if (list_length(requestList) > 0)
+	{
+		RegisterNodeRequest *firstRequest =
+			(RegisterNodeRequest *) linitial(requestList);
+
+		ProtocolStatsBegin(PROTOCOL_REGISTER_NODES,
+						   firstRequest->formationId, -1);
+	}
+
+	foreach(requestCell, requestList)
+	{
+		RegisterNodeRequest *request =
+			(RegisterNodeRequest *) lfirst(requestCell);
+
+		AutoFailoverNode *node = RegisterNode(request);
+
+		registeredNodeList = lappend(registeredNodeList, node);
+	}
+
+	/* keep the last registered node of each group */
+	foreach(nodeCell, registeredNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		ListCell *groupCell = NULL;
+		bool found = false;
+
+		foreach(groupCell, groupNodeList)
+		{
+			AutoFailoverNode *groupNode = (AutoFailoverNode *) lfirst(groupCell);
+
+			if (groupNode->groupId == node->groupId &&
+				strcmp(groupNode->formationId, node->formationId) == 0)
+			{
+				lfirst(groupCell) = node;
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			groupNodeList = lappend(groupNodeList, node);
+		}
+	}
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		ProceedGroupState(node);
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	foreach(nodeCell, registeredNodeList)
+	{
+		AutoFailoverNode *registeredNode = (AutoFailoverNode *) lfirst(nodeCell);
+		Datum values[6];
+		bool isNulls[6];
+
+		/* the group state machine might have assigned another goal state */
+		AutoFailoverNode *node = GetAutoFailoverNodeById(registeredNode->nodeId);
+
+		if (node == NULL)
+		{
+			node = registeredNode;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(node->nodeId);
+		values[1] = Int32GetDatum(node->groupId);
+		values[2] = ObjectIdGetDatum(ReplicationStateGetEnum(node->goalState));
+		values[3] = Int32GetDatum(node->candidatePriority);
+		values[4] = BoolGetDatum(node->replicationQuorum);
+		values[5] = CStringGetTextDatum(node->nodeName);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * ParseRegisterNodesRequests returns a list of RegisterNodeRequest from the
+ * given JSON array of nodes, using the default values of register_node() for
+ * the keys that are not given.
+ */
+static List *
+ParseRegisterNodesRequests(Datum nodesDatum)
+{
+	List *requestList = NIL;
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	Oid argTypes[] = {
+		JSONBOID /* nodes */
+	};
+
+	Datum argValues[] = {
+		nodesDatum /* nodes */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT formation_id, node_host, node_port, dbname, "
+		"       coalesce(node_name, ''), "
+		"       coalesce(sysidentifier, 0), "
+		"       coalesce(desired_node_id, -1), "
+		"       coalesce(desired_group_id, -1), "
+		"       coalesce(initial_group_role, 'init'), "
+		"       coalesce(node_kind, 'standalone'), "
+		"       coalesce(candidate_priority, 100), "
+		"       coalesce(replication_quorum, true), "
+		"       coalesce(node_cluster, 'default') "
+		"  FROM jsonb_to_recordset($1) "
+		"    AS nodes(formation_id text, node_host text, node_port int, "
+		"             dbname name, node_name text, sysidentifier bigint, "
+		"             desired_node_id bigint, desired_group_id int, "
+		"             initial_group_role pgautofailover.replication_state, "
+		"             node_kind text, candidate_priority int, "
+		"             replication_quorum bool, node_cluster text)";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes,
+										  argValues, NULL, false, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not parse the nodes to register");
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		TupleDesc tupleDescriptor = SPI_tuptable->tupdesc;
+		Datum values[13];
+		bool isNulls[13];
+
+		heap_deform_tuple(heapTuple, tupleDescriptor, values, isNulls);
+
+		/* the arguments of register_node() without a default value */
+		for (int column = 0; column < 4; column++)
+		{
+			if (isNulls[column])
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("node %lld to register has no \"%s\"",
+								(long long) rowNumber + 1,
+								NameStr(TupleDescAttr(tupleDescriptor,
+													  column)->attname))));
+			}
+		}
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		RegisterNodeRequest *request =
+			(RegisterNodeRequest *) palloc0(sizeof(RegisterNodeRequest));
+
+		request->formationId = TextDatumGetCString(values[0]);
+		request->nodeHost = TextDatumGetCString(values[1]);
+		request->nodePort = DatumGetInt32(values[2]);
+		request->expectedDBName = pstrdup(NameStr(*DatumGetName(values[3])));
+		request->nodeName = TextDatumGetCString(values[4]);
+		request->sysIdentifier = DatumGetInt64(values[5]);
+		request->nodeId = DatumGetInt64(values[6]);
+		request->groupId = DatumGetInt32(values[7]);
+		request->initialState =
+			EnumGetReplicationState(DatumGetObjectId(values[8]));
+		request->nodeKind = TextDatumGetCString(values[9]);
+		request->candidatePriority = DatumGetInt32(values[10]);
+		request->replicationQuorum = DatumGetBool(values[11]);
+		request->nodeCluster = TextDatumGetCString(values[12]);
+
+		requestList = lappend(requestList, request);
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	return requestList;
 }
 
 
@@ -365,6 +702,9 @@ node_active(PG_FUNCTION_ARGS)
 	text *currentPgsrSyncStateText = PG_GETARG_TEXT_P(7);
 	char *currentPgsrSyncState = text_to_cstring(currentPgsrSyncStateText);
 
+	ProtocolStatsBegin(PROTOCOL_NODE_ACTIVE, formationId, currentGroupId);
+	AdmitProtocolCall("node_active");
+
 	AutoFailoverNodeState currentNodeState = { 0 };
 
 	currentNodeState.nodeId = currentNodeId;
@@ -376,6 +716,17 @@ node_active(PG_FUNCTION_ARGS)
 	currentNodeState.pgsrSyncState = SyncStateFromString(currentPgsrSyncState);
 	currentNodeState.pgIsRunning = currentPgIsRunning;
 
+	/*
+	 * Keepers that know about the group version also report their replay LSN
+	 * and their recent WAL apply rate, used when selecting a failover
+	 * candidate.
+	 */
+	if (PG_NARGS() > 9)
+	{
+		currentNodeState.reportedReplayLSN = PG_GETARG_LSN(9);
+		currentNodeState.reportedApplyRate = PG_GETARG_INT64(10);
+	}
+
 	AutoFailoverNodeState *assignedNodeState =
 		NodeActive(formationId, &currentNodeState);
 
@@ -383,8 +734,8 @@ node_active(PG_FUNCTION_ARGS)
 		ReplicationStateGetEnum(assignedNodeState->replicationState);
 
 	TupleDesc resultDescriptor = NULL;
-	Datum values[5];
-	bool isNulls[5];
+	Datum values[8];
+	bool isNulls[8];
 
 	memset(values, 0, sizeof(values));
 	memset(isNulls, false, sizeof(isNulls));
@@ -395,6 +746,23 @@ node_active(PG_FUNCTION_ARGS)
 	values[3] = Int32GetDatum(assignedNodeState->candidatePriority);
 	values[4] = BoolGetDatum(assignedNodeState->replicationQuorum);
 
+	/*
+	 * The node_active variant that takes the keeper's last known group version
+	 * also returns the current group version, and whether the list of other
+	 * nodes might have changed since the keeper's version. A zero version
+	 * means that we can't tell.
+	 */
+	if (PG_NARGS() > 8)
+	{
+		int64 knownGroupVersion = PG_GETARG_INT64(8);
+		uint64 groupVersion =
+			NodeGroupVersion(formationId, assignedNodeState->groupId);
+
+		values[5] = Int64GetDatum((int64) groupVersion);
+		values[6] = BoolGetDatum(groupVersion == 0 ||
+								 (int64) groupVersion != knownGroupVersion);
+	}
+
 	TypeFuncClass resultTypeClass =
 		get_call_result_type(fcinfo, NULL, &resultDescriptor);
 
@@ -403,6 +771,31 @@ node_active(PG_FUNCTION_ARGS)
 		ereport(ERROR, (errmsg("return type must be a row type")));
 	}
 
+	/*
+	 * The latest node_active variant also returns the trace id of the decision
+	 * that assigned the goal state, so that the keeper's transition spans join
+	 * the monitor's trace. There is nothing to trace when the node already
+	 * reached its goal state.
+	 */
+	if (resultDescriptor->natts > 7)
+	{
+		char *traceId = "";
+
+		if (assignedNodeState->replicationState !=
+			currentNodeState.replicationState)
+		{
+			AutoFailoverNode *assignedNode =
+				GetAutoFailoverNodeById(assignedNodeState->nodeId);
+
+			if (assignedNode != NULL)
+			{
+				traceId = GoalStateTraceId(assignedNode);
+			}
+		}
+
+		values[7] = CStringGetTextDatum(traceId);
+	}
+
 	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
 	Datum resultDatum = HeapTupleGetDatum(resultTuple);
 
@@ -436,6 +829,15 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 	{
 		LockFormation(formationId, ShareLock);
 
+		NodeHeartbeatRecord(pgAutoFailoverNode->nodeId, GetCurrentTimestamp());
+
+		bool reportChanged =
+			pgAutoFailoverNode->reportedState != currentNodeState->replicationState ||
+			pgAutoFailoverNode->pgIsRunning != currentNodeState->pgIsRunning ||
+			pgAutoFailoverNode->pgsrSyncState != currentNodeState->pgsrSyncState ||
+			(currentNodeState->reportedTLI != 0 &&
+			 pgAutoFailoverNode->reportedTLI != currentNodeState->reportedTLI);
+
 		if (pgAutoFailoverNode->reportedState != currentNodeState->replicationState)
 		{
 			/*
@@ -447,7 +849,8 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 
 			if (pgAutoFailoverNode->goalState == REPLICATION_STATE_REPORT_LSN)
 			{
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, pgAutoFailoverNode->formationId,
 					message, BUFSIZE,
 					"New state is reported by " NODE_FORMAT
 					" with LSN %X/%X: %s",
@@ -458,7 +861,8 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 			}
 			else
 			{
-				LogAndNotifyMessage(
+				LogAndNotifyFormationMessage(
+					LOG_NOTIFY_INFO, pgAutoFailoverNode->formationId,
 					message, BUFSIZE,
 					"New state is reported by " NODE_FORMAT
 					": \"%s\"",
@@ -475,20 +879,32 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 
 		/*
 		 * Report the current state. The state might not have changed, but in
-		 * that case we still update the last report time.
+		 * that case we still update the last report time and LSN, possibly
+		 * only in shared memory.
 		 */
-		ReportAutoFailoverNodeState(pgAutoFailoverNode->nodeHost,
-									pgAutoFailoverNode->nodePort,
-									currentNodeState->replicationState,
-									currentNodeState->pgIsRunning,
-									currentNodeState->pgsrSyncState,
-									currentNodeState->reportedTLI,
-									currentNodeState->reportedLSN);
+		if (reportChanged ||
+			!NodeLivenessSkipReport(pgAutoFailoverNode, currentNodeState))
+		{
+			ReportAutoFailoverNodeState(pgAutoFailoverNode->nodeHost,
+										pgAutoFailoverNode->nodePort,
+										currentNodeState->replicationState,
+										currentNodeState->pgIsRunning,
+										currentNodeState->pgsrSyncState,
+										currentNodeState->reportedTLI,
+										currentNodeState->reportedLSN,
+										currentNodeState->reportedReplayLSN,
+										currentNodeState->reportedApplyRate);
+
+			NodeLivenessReportPersisted(pgAutoFailoverNode, currentNodeState);
+		}
 	}
 
 	LockNodeGroup(formationId, currentNodeState->groupId, ExclusiveLock);
 
-	ProceedGroupState(pgAutoFailoverNode);
+	ProceedGroupStateIfChanged(pgAutoFailoverNode);
+
+	/* in a Citus formation, other groups might be failing over too */
+	ProceedCorrelatedGroupStates(pgAutoFailoverNode);
 
 	AutoFailoverNodeState *assignedNodeState =
 		(AutoFailoverNodeState *) palloc0(sizeof(AutoFailoverNodeState));
@@ -702,6 +1118,20 @@ AssignGroupId(AutoFailoverFormation *formation, char *nodeHost, int nodePort,
 		List *groupNodeList =
 			AutoFailoverNodeGroup(formation->formationId, candidateGroupId);
 
+		/*
+		 * We hold the group allocation lock, but a node might still be
+		 * registering in this group explicitly: lock the candidate group and
+		 * have another look at its nodes.
+		 */
+		if (list_length(groupNodeList) == 0 ||
+			(formation->opt_secondary && list_length(groupNodeList) == 1))
+		{
+			LockNodeGroup(formation->formationId, candidateGroupId, ExclusiveLock);
+
+			groupNodeList =
+				AutoFailoverNodeGroup(formation->formationId, candidateGroupId);
+		}
+
 		if (list_length(groupNodeList) == 0)
 		{
 			groupId = candidateGroupId;
@@ -734,6 +1164,7 @@ get_primary(PG_FUNCTION_ARGS)
 	char *formationId = text_to_cstring(formationIdText);
 	int32 groupId = PG_GETARG_INT32(1);
 
+	ProtocolStatsBegin(PROTOCOL_GET_PRIMARY, formationId, groupId);
 
 	TupleDesc resultDescriptor = NULL;
 	Datum values[4];
@@ -798,6 +1229,9 @@ get_nodes(PG_FUNCTION_ARGS)
 
 		checkPgAutoFailoverVersion();
 
+		ProtocolStatsBegin(PROTOCOL_GET_NODES, formationId,
+						   PG_ARGISNULL(1) ? -1 : PG_GETARG_INT32(1));
+
 		/* create a function context for cross-call persistence */
 		funcctx = SRF_FIRSTCALL_INIT();
 
@@ -907,6 +1341,7 @@ get_other_nodes(PG_FUNCTION_ARGS)
 
 
 		checkPgAutoFailoverVersion();
+		ProtocolStatsBegin(PROTOCOL_GET_OTHER_NODES, NULL, -1);
 
 		/* create a function context for cross-call persistence */
 		funcctx = SRF_FIRSTCALL_INIT();
@@ -931,6 +1366,8 @@ get_other_nodes(PG_FUNCTION_ARGS)
 								   (long long) nodeId)));
 		}
 
+		ProtocolStatsSetGroup(activeNode->formationId, activeNode->groupId);
+
 		if (PG_NARGS() == 1)
 		{
 			fctx->nodesList = AutoFailoverOtherNodesList(activeNode);
@@ -1023,6 +1460,7 @@ Datum
 remove_node_by_nodeid(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
+	ProtocolStatsBegin(PROTOCOL_REMOVE_NODE, NULL, -1);
 
 	int64 nodeId = PG_GETARG_INT64(0);
 	bool force = PG_GETARG_BOOL(1);
@@ -1047,6 +1485,7 @@ Datum
 remove_node_by_host(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
+	ProtocolStatsBegin(PROTOCOL_REMOVE_NODE, NULL, -1);
 
 	text *nodeHostText = PG_GETARG_TEXT_P(0);
 	char *nodeHost = text_to_cstring(nodeHostText);
@@ -1067,68 +1506,326 @@ remove_node_by_host(PG_FUNCTION_ARGS)
 }
 
 
-/* RemoveNode removes the given node from the monitor. */
-static bool
-RemoveNode(AutoFailoverNode *currentNode, bool force)
+/*
+ * remove_nodes removes many nodes at once, in a single transaction. The nodes
+ * are given as an array of node ids. We first set the goal state of all the
+ * nodes to dropped, and then proceed the state machine of each group they
+ * belong to only once, rather than once per node. The result has a row per
+ * node, in the same order as the array, where removed is true when the node
+ * is already gone from the monitor, and false when its removal is in progress.
+ */
+Datum
+remove_nodes(PG_FUNCTION_ARGS)
 {
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	ArrayType *nodeIdsArray = PG_GETARG_ARRAYTYPE_P(0);
+	bool force = PG_GETARG_BOOL(1);
+	Datum *nodeIdDatums = NULL;
+	bool *nodeIdNulls = NULL;
+	int nodeIdCount = 0;
+	List *nodeList = NIL;
 	ListCell *nodeCell = NULL;
-	char message[BUFSIZE] = { 0 };
+	AutoFailoverNode *previousNode = NULL;
 
-	if (currentNode == NULL)
+	/* the groups that need a state evaluation */
+	List *groupNodeList = NIL;
+	List *groupPrimaryRemovedList = NIL;
+	List *groupRemovedCountList = NIL;
+
+	checkPgAutoFailoverVersion();
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
 	{
-		return false;
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
 	}
 
-	LockFormation(currentNode->formationId, ExclusiveLock);
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
 
-	AutoFailoverFormation *formation = GetFormation(currentNode->formationId);
+	deconstruct_array(nodeIdsArray, INT8OID, sizeof(int64), FLOAT8PASSBYVAL,
+					  'd', &nodeIdDatums, &nodeIdNulls, &nodeIdCount);
 
-	/* when removing the primary, initiate a failover */
-	bool currentNodeIsPrimary = CanTakeWritesInState(currentNode->goalState);
+	for (int index = 0; index < nodeIdCount; index++)
+	{
+		if (nodeIdNulls[index])
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("node ids to remove must not be NULL")));
+		}
 
-	/* get the list of the other nodes */
-	List *otherNodesGroupList = AutoFailoverOtherNodesList(currentNode);
+		int64 nodeId = DatumGetInt64(nodeIdDatums[index]);
+		AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
 
-	/* and the first other node to trigger our first FSM transition */
-	AutoFailoverNode *firstStandbyNode =
-		otherNodesGroupList == NIL ? NULL : linitial(otherNodesGroupList);
+		if (node == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+							errmsg("couldn't find node with nodeid %lld",
+								   (long long) nodeId)));
+		}
 
-	/*
-	 * To remove a node is a 2-step process.
-	 *
-	 *  1. pgautofailover.remove_node() sets the goal state to DROPPED
-	 *  2. pgautofailover.node_active() reports that the goal state is reached
-	 *
-	 * From the client side though, if a crash happens after having called the
-	 * node_active() function but before having stored the state, it might be
-	 * useful to call pgautofailover.remove_node() again.
-	 *
-	 * When pgautofailover.remove_node() is called on a node that has already
-	 * reached the DROPPED state, we proceed to remove it.
-	 */
-	if (IsCurrentState(currentNode, REPLICATION_STATE_DROPPED) || force)
-	{
-		/* time to actually remove the current node */
-		RemoveAutoFailoverNode(currentNode);
+		nodeList = lappend(nodeList, node);
+	}
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Removing " NODE_FORMAT " from formation \"%s\" and group %d",
-			NODE_FORMAT_ARGS(currentNode),
-			currentNode->formationId,
-			currentNode->groupId);
+	if (nodeList != NIL)
+	{
+		AutoFailoverNode *firstNode = (AutoFailoverNode *) linitial(nodeList);
 
-		return true;
+		ProtocolStatsBegin(PROTOCOL_REMOVE_NODES, firstNode->formationId, -1);
+	}
+
+	/*
+	 * Lock the groups in a consistent order so that concurrent calls can't
+	 * deadlock, and mark the standby nodes of a group before its primary, so
+	 * that we don't assign report_lsn to standby nodes that are being removed.
+	 */
+	List *sortedNodeList = list_copy(nodeList);
+
+	#if (PG_VERSION_NUM >= 130000)
+	list_sort(sortedNodeList, pgautofailover_node_removal_compare);
+	#else
+	sortedNodeList =
+		list_qsort(sortedNodeList, pgautofailover_node_removal_compare);
+	#endif
+
+	foreach(nodeCell, sortedNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		bool primaryRemoved = false;
+
+		/* the same node id might have been given more than once */
+		if (previousNode != NULL && previousNode->nodeId == node->nodeId)
+		{
+			continue;
+		}
+
+		if (previousNode == NULL ||
+			previousNode->groupId != node->groupId ||
+			strcmp(previousNode->formationId, node->formationId) != 0)
+		{
+			LockFormation(node->formationId, ShareLock);
+			LockNodeGroup(node->formationId, node->groupId, ExclusiveLock);
+		}
+
+		previousNode = node;
+
+		if (!StartNodeRemoval(node, force, &primaryRemoved))
+		{
+			continue;
+		}
+
+		/* nodes of the same group are next to each other in the sorted list */
+		AutoFailoverNode *groupNode =
+			groupNodeList == NIL ? NULL : (AutoFailoverNode *) llast(groupNodeList);
+
+		if (groupNode != NULL &&
+			groupNode->groupId == node->groupId &&
+			strcmp(groupNode->formationId, node->formationId) == 0)
+		{
+			llast_int(groupRemovedCountList) += 1;
+			llast_int(groupPrimaryRemovedList) |= primaryRemoved;
+		}
+		else
+		{
+			groupNodeList = lappend(groupNodeList, node);
+			groupPrimaryRemovedList =
+				lappend_int(groupPrimaryRemovedList, primaryRemoved);
+			groupRemovedCountList = lappend_int(groupRemovedCountList, 1);
+		}
+	}
+
+	/* now one state evaluation per group */
+	ListCell *primaryRemovedCell = NULL;
+	ListCell *removedCountCell = NULL;
+
+	forthree(nodeCell, groupNodeList,
+			 primaryRemovedCell, groupPrimaryRemovedList,
+			 removedCountCell, groupRemovedCountList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		int removedCount = lfirst_int(removedCountCell);
+
+		ProceedGroupAfterRemoval(node->formationId,
+								 node->groupId,
+								 lfirst_int(primaryRemovedCell),
+								 removedCount == 1 ? node : NULL,
+								 removedCount);
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		Datum values[3];
+		bool isNulls[3];
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(node->nodeId);
+		values[1] = Int32GetDatum(node->groupId);
+		values[2] = BoolGetDatum(GetAutoFailoverNodeById(node->nodeId) == NULL);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * pgautofailover_node_removal_compare
+ *	  qsort comparator for sorting node lists by formation, group, then
+ *	  standby nodes before the primary, and then node id.
+ */
+#if (PG_VERSION_NUM >= 130000)
+static int
+pgautofailover_node_removal_compare(const union ListCell *a,
+									const union ListCell *b)
+{
+	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(a);
+	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(b);
+#else
+static int
+pgautofailover_node_removal_compare(const void *a, const void *b)
+{
+	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(*(ListCell **) a);
+	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(*(ListCell **) b);
+#endif
+
+	int formationCompare = strcmp(node1->formationId, node2->formationId);
+
+	if (formationCompare != 0)
+	{
+		return formationCompare;
+	}
+
+	if (node1->groupId != node2->groupId)
+	{
+		return node1->groupId < node2->groupId ? -1 : 1;
+	}
+
+	bool node1IsPrimary = CanTakeWritesInState(node1->goalState);
+	bool node2IsPrimary = CanTakeWritesInState(node2->goalState);
+
+	if (node1IsPrimary != node2IsPrimary)
+	{
+		return node1IsPrimary ? 1 : -1;
+	}
+
+	if (node1->nodeId != node2->nodeId)
+	{
+		return node1->nodeId < node2->nodeId ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/* RemoveNode removes the given node from the monitor. */
+static bool
+RemoveNode(AutoFailoverNode *currentNode, bool force)
+{
+	bool currentNodeIsPrimary = false;
+
+	if (currentNode == NULL)
+	{
+		return false;
+	}
+
+	/* removing a node only changes its own group */
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	if (StartNodeRemoval(currentNode, force, &currentNodeIsPrimary))
+	{
+		ProceedGroupAfterRemoval(currentNode->formationId,
+								 currentNode->groupId,
+								 currentNodeIsPrimary,
+								 currentNode,
+								 1);
+	}
+
+	return true;
+}
+
+
+/*
+ * StartNodeRemoval removes the given node from the monitor when it has
+ * already reached the dropped state, or when force is true, and otherwise
+ * sets its goal state to dropped. It returns true when the state of the group
+ * of the node must then be evaluated, see ProceedGroupAfterRemoval, and sets
+ * currentNodeIsPrimary to whether we are removing the primary node.
+ *
+ * The caller must hold the lock of the group of the node.
+ */
+static bool
+StartNodeRemoval(AutoFailoverNode *currentNode, bool force,
+				 bool *currentNodeIsPrimary)
+{
+	ListCell *nodeCell = NULL;
+	char message[BUFSIZE] = { 0 };
+
+	/* when removing the primary, initiate a failover */
+	*currentNodeIsPrimary = CanTakeWritesInState(currentNode->goalState);
+
+	/* get the list of the other nodes */
+	List *otherNodesGroupList = AutoFailoverOtherNodesList(currentNode);
+
+	/*
+	 * To remove a node is a 2-step process.
+	 *
+	 *  1. pgautofailover.remove_node() sets the goal state to DROPPED
+	 *  2. pgautofailover.node_active() reports that the goal state is reached
+	 *
+	 * From the client side though, if a crash happens after having called the
+	 * node_active() function but before having stored the state, it might be
+	 * useful to call pgautofailover.remove_node() again.
+	 *
+	 * When pgautofailover.remove_node() is called on a node that has already
+	 * reached the DROPPED state, we proceed to remove it.
+	 */
+	if (IsCurrentState(currentNode, REPLICATION_STATE_DROPPED) || force)
+	{
+		/* time to actually remove the current node */
+		RemoveAutoFailoverNode(currentNode);
+
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
+			message, BUFSIZE,
+			"Removing " NODE_FORMAT " from formation \"%s\" and group %d",
+			NODE_FORMAT_ARGS(currentNode),
+			currentNode->formationId,
+			currentNode->groupId);
+
+		return false;
 	}
 
 	/* if the removal is already in progress, politely ignore the request */
 	if (currentNode->goalState == REPLICATION_STATE_DROPPED)
 	{
-		return true;
+		return false;
 	}
 
 	/* review the FSM for every other node, when removing the primary */
-	if (currentNodeIsPrimary)
+	if (*currentNodeIsPrimary)
 	{
 		foreach(nodeCell, otherNodesGroupList)
 		{
@@ -1148,7 +1845,8 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 				continue;
 			}
 
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, node->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to report_lsn after primary node removal.",
@@ -1162,7 +1860,8 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 	 * Mark the node as being dropped, so that the pg_autoctl node-active
 	 * process can implement further actions at drop time.
 	 */
-	LogAndNotifyMessage(
+	LogAndNotifyFormationMessage(
+		LOG_NOTIFY_INFO, currentNode->formationId,
 		message, BUFSIZE,
 		"Setting goal state of " NODE_FORMAT
 		" from formation \"%s\" and group %d to \"dropped\""
@@ -1173,14 +1872,41 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 
 	SetNodeGoalState(currentNode, REPLICATION_STATE_DROPPED, message);
 
+	return true;
+}
+
+
+/*
+ * ProceedGroupAfterRemoval adjusts number_sync_standbys and proceeds with the
+ * state machine of the given group once some of its nodes have been assigned
+ * the dropped goal state. When a single standby node has been removed, it is
+ * given as removedStandbyNode, to be mentioned in the events.
+ */
+static void
+ProceedGroupAfterRemoval(char *formationId, int groupId,
+						 bool primaryRemoved,
+						 AutoFailoverNode *removedStandbyNode,
+						 int removedCount)
+{
+	char message[BUFSIZE] = { 0 };
+
+	AutoFailoverFormation *formation = GetFormation(formationId);
+
+	/* the nodes that are being dropped are not part of the group anymore */
+	List *groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
+
+	/* and the first other node to trigger our first FSM transition */
+	AutoFailoverNode *firstStandbyNode =
+		groupNodeList == NIL ? NULL : linitial(groupNodeList);
+
 	/*
 	 * Adjust number-sync-standbys if necessary.
 	 *
-	 * otherNodesGroupList is the list of all the remaining nodes, and that
+	 * groupNodeList is the list of all the remaining nodes, and that
 	 * includes the current primary, which might be setup with replication
 	 * quorum set to true (and probably is).
 	 */
-	int countSyncStandbys = CountSyncStandbys(otherNodesGroupList) - 1;
+	int countSyncStandbys = CountSyncStandbys(groupNodeList) - 1;
 
 	if (countSyncStandbys < (formation->number_sync_standbys + 1))
 	{
@@ -1198,11 +1924,12 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 					(errmsg("couldn't set the formation \"%s\" "
 							"number_sync_standbys to %d now that a "
 							"standby node has been removed",
-							currentNode->formationId,
+							formationId,
 							formation->number_sync_standbys)));
 		}
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, formation->formationId,
 			message, BUFSIZE,
 			"Setting number_sync_standbys to %d for formation \"%s\" "
 			"now that we have %d standby nodes set with replication-quorum.",
@@ -1212,7 +1939,7 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 	}
 
 	/* now proceed with the failover, starting with the first standby */
-	if (currentNodeIsPrimary)
+	if (primaryRemoved)
 	{
 		/* if we have at least one other node in the group, proceed */
 		if (firstStandbyNode)
@@ -1224,8 +1951,7 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 	{
 		/* find the primary, if any, and have it realize a node has left */
 		AutoFailoverNode *primaryNode =
-			GetPrimaryNodeInGroup(currentNode->formationId,
-								  currentNode->groupId);
+			GetPrimaryNodeInGroup(formationId, groupId);
 
 		if (primaryNode)
 		{
@@ -1243,22 +1969,36 @@ RemoveNode(AutoFailoverNode *currentNode, bool force)
 			if (primaryNode->goalState == goalState &&
 				goalState != REPLICATION_STATE_APPLY_SETTINGS)
 			{
-				LogAndNotifyMessage(
-					message, BUFSIZE,
-					"Setting goal state of " NODE_FORMAT
-					" to apply_settings after removing standby " NODE_FORMAT
-					" from formation %s.",
-					NODE_FORMAT_ARGS(primaryNode),
-					NODE_FORMAT_ARGS(currentNode),
-					formation->formationId);
+				if (removedStandbyNode != NULL)
+				{
+					LogAndNotifyFormationMessage(
+						LOG_NOTIFY_INFO, primaryNode->formationId,
+						message, BUFSIZE,
+						"Setting goal state of " NODE_FORMAT
+						" to apply_settings after removing standby " NODE_FORMAT
+						" from formation %s.",
+						NODE_FORMAT_ARGS(primaryNode),
+						NODE_FORMAT_ARGS(removedStandbyNode),
+						formation->formationId);
+				}
+				else
+				{
+					LogAndNotifyFormationMessage(
+						LOG_NOTIFY_INFO, primaryNode->formationId,
+						message, BUFSIZE,
+						"Setting goal state of " NODE_FORMAT
+						" to apply_settings after removing %d standby nodes"
+						" from formation %s.",
+						NODE_FORMAT_ARGS(primaryNode),
+						removedCount,
+						formation->formationId);
+				}
 
 				SetNodeGoalState(primaryNode,
 								 REPLICATION_STATE_APPLY_SETTINGS, message);
 			}
 		}
 	}
-
-	return true;
 }
 
 
@@ -1274,6 +2014,8 @@ perform_failover(PG_FUNCTION_ARGS)
 	char *formationId = text_to_cstring(formationIdText);
 	int32 groupId = PG_GETARG_INT32(1);
 
+	ProtocolStatsBegin(PROTOCOL_PERFORM_FAILOVER, formationId, groupId);
+
 	LockFormation(formationId, ShareLock);
 	LockNodeGroup(formationId, groupId, ExclusiveLock);
 
@@ -1368,7 +2110,8 @@ perform_failover(PG_FUNCTION_ARGS)
 
 		char message[BUFSIZE] = { 0 };
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to draining and " NODE_FORMAT
@@ -1389,7 +2132,8 @@ perform_failover(PG_FUNCTION_ARGS)
 		char message[BUFSIZE] = { 0 };
 
 		/* so we have at least one candidate, let's get started */
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			"at LSN %X/%X to draining after a user-initiated failover.",
@@ -1418,7 +2162,8 @@ perform_failover(PG_FUNCTION_ARGS)
 			primaryNode->candidatePriority,
 			primaryNode->replicationQuorum);
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, primaryNode->formationId,
 			message, BUFSIZE,
 			"Updating candidate priority to %d for " NODE_FORMAT,
 			primaryNode->candidatePriority,
@@ -1445,6 +2190,8 @@ perform_promotion(PG_FUNCTION_ARGS)
 	text *formationIdText = PG_GETARG_TEXT_P(0);
 	char *formationId = text_to_cstring(formationIdText);
 
+	ProtocolStatsBegin(PROTOCOL_PERFORM_PROMOTION, formationId, -1);
+
 	text *nodeNameText = PG_GETARG_TEXT_P(1);
 	char *nodeName = text_to_cstring(nodeNameText);
 
@@ -1549,7 +2296,8 @@ perform_promotion(PG_FUNCTION_ARGS)
 			currentNode->candidatePriority,
 			currentNode->replicationQuorum);
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Updating candidate priority to %d for " NODE_FORMAT,
 			currentNode->candidatePriority,
@@ -1557,6 +2305,39 @@ perform_promotion(PG_FUNCTION_ARGS)
 
 		NotifyStateChange(currentNode, message);
 
+		/*
+		 * When the target is a secondary node in the replication quorum and
+		 * the primary is stable, the primary first lists the target as a
+		 * synchronous standby that acknowledges every commit, and keeps
+		 * taking writes until the target has caught up. The failover then
+		 * starts from the group state machine, see ProceedPromotionCatchup.
+		 */
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(formationId, currentNode->groupId);
+
+		if (PromotionCatchupTimeoutMs > 0 &&
+			primaryNode != NULL &&
+			currentNode->replicationQuorum &&
+			IsCurrentState(currentNode, REPLICATION_STATE_SECONDARY) &&
+			IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
+		{
+			memset(message, 0, BUFSIZE);
+
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to apply_settings so that " NODE_FORMAT
+				" catches up before its promotion.",
+				NODE_FORMAT_ARGS(primaryNode),
+				NODE_FORMAT_ARGS(currentNode));
+
+			SetNodeGoalState(primaryNode,
+							 REPLICATION_STATE_APPLY_SETTINGS, message);
+
+			PG_RETURN_BOOL(true);
+		}
+
 		/*
 		 * In case of errors in the perform_failover function, we ereport an
 		 * ERROR and that causes the transaction to fail (ROLLBACK). In that
@@ -1587,6 +2368,7 @@ Datum
 start_maintenance(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
+	ProtocolStatsBegin(PROTOCOL_START_MAINTENANCE, NULL, -1);
 
 	int64 nodeId = PG_GETARG_INT64(0);
 
@@ -1737,7 +2519,8 @@ start_maintenance(PG_FUNCTION_ARGS)
 			 * single secondary we assign it prepare_promotion, otherwise we
 			 * need to elect a secondary, same as in perform_failover.
 			 */
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to prepare_maintenance "
@@ -1752,7 +2535,8 @@ start_maintenance(PG_FUNCTION_ARGS)
 			/*
 			 * We put the only secondary node straight to prepare_replication.
 			 */
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to prepare_maintenance and " NODE_FORMAT
@@ -1767,7 +2551,8 @@ start_maintenance(PG_FUNCTION_ARGS)
 		else
 		{
 			/* put the primary directly to maintenance */
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to maintenance "
@@ -1805,7 +2590,8 @@ start_maintenance(PG_FUNCTION_ARGS)
 		if (formation->number_sync_standbys == 0 && secondaryNodesCount == 1 &&
 			IsHealthySyncStandby(currentNode))
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to wait_primary and " NODE_FORMAT
@@ -1818,7 +2604,8 @@ start_maintenance(PG_FUNCTION_ARGS)
 		}
 		else
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to maintenance "
@@ -1858,6 +2645,7 @@ Datum
 stop_maintenance(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
+	ProtocolStatsBegin(PROTOCOL_STOP_MAINTENANCE, NULL, -1);
 
 	int64 nodeId = PG_GETARG_INT64(0);
 
@@ -1921,7 +2709,8 @@ stop_maintenance(PG_FUNCTION_ARGS)
 	}
 	else if (primaryNode == NULL && totalNodesCount > 2)
 	{
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to report_lsn  after a user-initiated stop_maintenance call.",
@@ -1940,7 +2729,8 @@ stop_maintenance(PG_FUNCTION_ARGS)
 	 */
 	if (IsFailoverInProgress(groupNodesList))
 	{
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup  after a user-initiated stop_maintenance call.",
@@ -1950,7 +2740,8 @@ stop_maintenance(PG_FUNCTION_ARGS)
 	}
 	else
 	{
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to catchingup  after a user-initiated stop_maintenance call.",
@@ -1974,6 +2765,8 @@ set_node_candidate_priority(PG_FUNCTION_ARGS)
 	text *formationIdText = PG_GETARG_TEXT_P(0);
 	char *formationId = text_to_cstring(formationIdText);
 
+	ProtocolStatsBegin(PROTOCOL_SET_NODE_CANDIDATE_PRIORITY, formationId, -1);
+
 	text *nodeNameText = PG_GETARG_TEXT_P(1);
 	char *nodeName = text_to_cstring(nodeNameText);
 
@@ -2066,7 +2859,8 @@ set_node_candidate_priority(PG_FUNCTION_ARGS)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Updating candidate priority to %d for " NODE_FORMAT,
 			currentNode->candidatePriority,
@@ -2093,7 +2887,8 @@ set_node_candidate_priority(PG_FUNCTION_ARGS)
 		if (primaryNode &&
 			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to apply_settings after updating " NODE_FORMAT
@@ -2136,6 +2931,8 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 	text *formationIdText = PG_GETARG_TEXT_P(0);
 	char *formationId = text_to_cstring(formationIdText);
 
+	ProtocolStatsBegin(PROTOCOL_SET_NODE_REPLICATION_QUORUM, formationId, -1);
+
 	text *nodeNameText = PG_GETARG_TEXT_P(1);
 	char *nodeName = text_to_cstring(nodeNameText);
 
@@ -2156,6 +2953,19 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 	LockFormation(currentNode->formationId, ShareLock);
 	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
 
+	/* a cascading standby is not connected to the primary */
+	if (replicationQuorum && currentNode->upstreamNodeId != 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("can't set replication quorum to true for "
+						NODE_FORMAT,
+						NODE_FORMAT_ARGS(currentNode)),
+				 errdetail("This node streams from upstream node %lld.",
+						   (long long) currentNode->upstreamNodeId),
+				 errhint("Reset the upstream node of this node first.")));
+	}
+
 	List *nodesGroupList =
 		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
 	int nodesCount = list_length(nodesGroupList);
@@ -2214,7 +3024,8 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
 			message, BUFSIZE,
 			"Updating replicationQuorum to %s for " NODE_FORMAT,
 			currentNode->replicationQuorum ? "true" : "false",
@@ -2241,7 +3052,8 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 		if (primaryNode &&
 			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
 		{
-			LogAndNotifyMessage(
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, primaryNode->formationId,
 				message, BUFSIZE,
 				"Setting goal state of " NODE_FORMAT
 				" to apply_settings after updating " NODE_FORMAT
@@ -2274,82 +3086,604 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 
 
 /*
- * update_node_metadata allows to update a node's nodename, hostname, and port.
+ * set_node_upstream sets the upstream node of a standby node, that is the
+ * other standby node of the same group it streams from instead of streaming
+ * from the primary. When upstream_name is NULL, the node streams from the
+ * primary again.
  *
- * The pg_autoctl client fetches the list of "other" nodes on each iteration
- * and will take it from there that they need to update their HBA rules when
- * the hostname has changed.
+ * The upstream setting is only used while both nodes are secondary nodes,
+ * see FindCascadingUpstreamNode(). A cascading standby is not connected to
+ * the primary and can't participate in the replication quorum.
  */
 Datum
-update_node_metadata(PG_FUNCTION_ARGS)
+set_node_upstream(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	int64 nodeid = 0;
-	char *nodeName = NULL;
-	char *nodeHost = NULL;
-	int32 nodePort = 0;
-
-
-	if (PG_ARGISNULL(0))
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
 	{
 		ereport(ERROR,
-				(errmsg("udpate_node_metadata requires a non-null nodeid")));
-	}
-	else
-	{
-		nodeid = PG_GETARG_INT64(0);
+				(errmsg("formation_id and node_name must not be null")));
 	}
 
-	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeid);
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+
+	ProtocolStatsBegin(PROTOCOL_SET_NODE_UPSTREAM, formationId, -1);
+
+	text *nodeNameText = PG_GETARG_TEXT_P(1);
+	char *nodeName = text_to_cstring(nodeNameText);
+
+	AutoFailoverNode *currentNode =
+		GetAutoFailoverNodeByName(formationId, nodeName);
 
 	if (currentNode == NULL)
 	{
-		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
-						errmsg("node %lld is not registered",
-							   (long long) nodeid)));
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node \"%s\" is not registered in formation \"%s\"",
+						nodeName, formationId)));
 	}
 
+	ProtocolStatsSetGroup(currentNode->formationId, currentNode->groupId);
+
 	LockFormation(currentNode->formationId, ShareLock);
 	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
 
-	/*
-	 * When arguments are NULL, replace them with the current value of the node
-	 * metadata, so that the UPDATE statement then is a noop on that field.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		nodeName = currentNode->nodeName;
-	}
-	else
-	{
-		text *nodeNameText = PG_GETARG_TEXT_P(1);
-
-		nodeName = text_to_cstring(nodeNameText);
-	}
+	AutoFailoverNode *upstreamNode = NULL;
 
-	if (PG_ARGISNULL(2))
-	{
-		nodeHost = currentNode->nodeHost;
-	}
-	else
+	if (!PG_ARGISNULL(2))
 	{
-		text *nodeHostText = PG_GETARG_TEXT_P(2);
+		text *upstreamNameText = PG_GETARG_TEXT_P(2);
+		char *upstreamName = text_to_cstring(upstreamNameText);
 
-		nodeHost = text_to_cstring(nodeHostText);
-	}
+		upstreamNode = GetAutoFailoverNodeByName(formationId, upstreamName);
 
-	if (PG_ARGISNULL(3))
-	{
-		nodePort = currentNode->nodePort;
-	}
-	else
-	{
-		nodePort = PG_GETARG_INT32(3);
-	}
+		if (upstreamNode == NULL)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("node \"%s\" is not registered in formation \"%s\"",
+							upstreamName, formationId)));
+		}
 
-	UpdateAutoFailoverNodeMetadata(currentNode->nodeId,
-								   nodeName, nodeHost, nodePort);
+		if (upstreamNode->nodeId == currentNode->nodeId)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg(NODE_FORMAT " can't be its own upstream node",
+							NODE_FORMAT_ARGS(currentNode))));
+		}
+
+		if (upstreamNode->groupId != currentNode->groupId)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("upstream " NODE_FORMAT " is in group %d, "
+							"and " NODE_FORMAT " is in group %d",
+							NODE_FORMAT_ARGS(upstreamNode),
+							upstreamNode->groupId,
+							NODE_FORMAT_ARGS(currentNode),
+							currentNode->groupId)));
+		}
+
+		if (currentNode->replicationQuorum)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("can't set the upstream node of " NODE_FORMAT,
+							NODE_FORMAT_ARGS(currentNode)),
+					 errdetail("A cascading standby node is not connected to "
+							   "the primary and can't participate in the "
+							   "replication quorum."),
+					 errhint("Set replication quorum to false first.")));
+		}
+
+		/* refuse to create a loop of upstream nodes */
+		List *groupNodeList =
+			AutoFailoverNodeGroup(currentNode->formationId,
+								  currentNode->groupId);
+		AutoFailoverNode *node = upstreamNode;
+		int depth = 0;
+
+		while (node != NULL && node->upstreamNodeId != 0)
+		{
+			if (node->upstreamNodeId == currentNode->nodeId ||
+				++depth > list_length(groupNodeList))
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("can't set the upstream node of " NODE_FORMAT
+								" to " NODE_FORMAT,
+								NODE_FORMAT_ARGS(currentNode),
+								NODE_FORMAT_ARGS(upstreamNode)),
+						 errdetail("That would create a loop of upstream "
+								   "nodes.")));
+			}
+
+			node = FindNodeInListById(groupNodeList, node->upstreamNodeId);
+		}
+	}
+
+	int64 upstreamNodeId = upstreamNode == NULL ? 0 : upstreamNode->nodeId;
+
+	if (upstreamNodeId != currentNode->upstreamNodeId)
+	{
+		char message[BUFSIZE];
+
+		currentNode->upstreamNodeId = upstreamNodeId;
+
+		SetAutoFailoverNodeUpstream(currentNode->nodeId, upstreamNodeId);
+
+		if (upstreamNode == NULL)
+		{
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
+				message, BUFSIZE,
+				"Resetting upstream node of " NODE_FORMAT
+				", now streaming from the primary",
+				NODE_FORMAT_ARGS(currentNode));
+		}
+		else
+		{
+			LogAndNotifyFormationMessage(
+				LOG_NOTIFY_INFO, currentNode->formationId,
+				message, BUFSIZE,
+				"Setting upstream node of " NODE_FORMAT " to " NODE_FORMAT,
+				NODE_FORMAT_ARGS(currentNode),
+				NODE_FORMAT_ARGS(upstreamNode));
+		}
+
+		NotifyStateChange(currentNode, message);
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * get_upstream returns the node that the given standby node should stream
+ * from right now: either its upstream node, or the primary node of its group.
+ */
+Datum
+get_upstream(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+
+	ProtocolStatsBegin(PROTOCOL_GET_UPSTREAM, NULL, -1);
+
+	TupleDesc resultDescriptor = NULL;
+	Datum values[4];
+	bool isNulls[4];
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("node %lld is not registered",
+							   (long long) nodeId)));
+	}
+
+	ProtocolStatsSetGroup(currentNode->formationId, currentNode->groupId);
+
+	List *groupNodeList =
+		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
+
+	AutoFailoverNode *upstreamNode =
+		FindCascadingUpstreamNode(groupNodeList, currentNode);
+
+	if (upstreamNode == NULL)
+	{
+		upstreamNode =
+			GetPrimaryOrDemotedNodeInGroup(currentNode->formationId,
+										   currentNode->groupId);
+	}
+
+	if (upstreamNode == NULL)
+	{
+		ereport(ERROR, (errmsg("group has no writable node right now")));
+	}
+
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[0] = Int64GetDatum(upstreamNode->nodeId);
+	values[1] = CStringGetTextDatum(upstreamNode->nodeName);
+	values[2] = CStringGetTextDatum(upstreamNode->nodeHost);
+	values[3] = Int32GetDatum(upstreamNode->nodePort);
+
+	TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL, &resultDescriptor);
+	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+	Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+	PG_RETURN_DATUM(resultDatum);
+}
+
+
+/*
+ * get_most_advanced_standby returns the node of the given group that reported
+ * the most advanced LSN while in the report_lsn state, preferring healthy
+ * nodes when several nodes reported the same LSN. Keepers call it repeatedly
+ * during a failover, so we find the node in a single pass over the group
+ * nodes from the node cache, rather than with a sorted scan of the node
+ * table.
+ */
+Datum
+get_most_advanced_standby(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	ListCell *nodeCell = NULL;
+
+	checkPgAutoFailoverVersion();
+
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+	int32 groupId = PG_GETARG_INT32(1);
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	ProtocolStatsBegin(PROTOCOL_GET_MOST_ADVANCED_STANDBY, formationId, groupId);
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	List *groupNodeList = AutoFailoverAllNodesInGroup(formationId, groupId);
+	AutoFailoverNode *mostAdvancedNode = NULL;
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->reportedState != REPLICATION_STATE_REPORT_LSN)
+		{
+			continue;
+		}
+
+		if (mostAdvancedNode == NULL ||
+			node->reportedLSN > mostAdvancedNode->reportedLSN ||
+			(node->reportedLSN == mostAdvancedNode->reportedLSN &&
+			 node->health > mostAdvancedNode->health))
+		{
+			mostAdvancedNode = node;
+		}
+	}
+
+	if (mostAdvancedNode != NULL)
+	{
+		Datum values[6];
+		bool isNulls[6];
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(mostAdvancedNode->nodeId);
+		values[1] = CStringGetTextDatum(mostAdvancedNode->nodeName);
+		values[2] = CStringGetTextDatum(mostAdvancedNode->nodeHost);
+		values[3] = Int32GetDatum(mostAdvancedNode->nodePort);
+		values[4] = LSNGetDatum(mostAdvancedNode->reportedLSN);
+		values[5] = BoolGetDatum(false);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * get_cascaded_nodes returns the other nodes in the group of the given node
+ * that currently stream from another standby node rather than from the
+ * primary. The primary uses that list to maintain the replication slots of
+ * those nodes, which are not in use on the primary.
+ */
+Datum
+get_cascaded_nodes(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	FuncCallContext *funcctx;
+	get_nodes_fctx *fctx;
+	MemoryContext oldcontext;
+
+	/* stuff done only on the first call of the function */
+	if (SRF_IS_FIRSTCALL())
+	{
+		int64 nodeId = PG_GETARG_INT64(0);
+		ListCell *nodeCell = NULL;
+
+		ProtocolStatsBegin(PROTOCOL_GET_CASCADED_NODES, NULL, -1);
+
+		/* create a function context for cross-call persistence */
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		/*
+		 * switch to memory context appropriate for multiple function calls
+		 */
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* allocate memory for user context */
+		fctx = (get_nodes_fctx *) palloc(sizeof(get_nodes_fctx));
+		fctx->nodesList = NIL;
+
+		AutoFailoverNode *activeNode = GetAutoFailoverNodeById(nodeId);
+		if (activeNode == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+							errmsg("node %lld is not registered",
+								   (long long) nodeId)));
+		}
+
+		ProtocolStatsSetGroup(activeNode->formationId, activeNode->groupId);
+
+		List *groupNodeList =
+			AutoFailoverNodeGroup(activeNode->formationId,
+								  activeNode->groupId);
+
+		foreach(nodeCell, groupNodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (node->nodeId != activeNode->nodeId &&
+				FindCascadingUpstreamNode(groupNodeList, node) != NULL)
+			{
+				fctx->nodesList = lappend(fctx->nodesList, node);
+			}
+		}
+
+		funcctx->user_fctx = fctx;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* stuff done on every call of the function */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/*
+	 * get the saved state and use current as the result for this iteration
+	 */
+	fctx = funcctx->user_fctx;
+
+	if (fctx->nodesList != NIL)
+	{
+		TupleDesc resultDescriptor = NULL;
+		Datum values[6];
+		bool isNulls[6];
+
+		AutoFailoverNode *node = (AutoFailoverNode *) linitial(fctx->nodesList);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(node->nodeId);
+		values[1] = CStringGetTextDatum(node->nodeName);
+		values[2] = CStringGetTextDatum(node->nodeHost);
+		values[3] = Int32GetDatum(node->nodePort);
+		values[4] = LSNGetDatum(node->reportedLSN);
+		values[5] = BoolGetDatum(CanTakeWritesInState(node->reportedState));
+
+		TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL,
+															 &resultDescriptor);
+		if (resultTypeClass != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errmsg("return type must be a row type")));
+		}
+
+		HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+		Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+		/* prepare next SRF call */
+		fctx->nodesList = list_delete_first(fctx->nodesList);
+
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(resultDatum));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * renew_primary_lease renews the lease of a primary node, see primary_lease.c,
+ * and returns when the lease expires on the monitor's clock. We refuse to
+ * renew the lease of a node which is not assigned a state where it takes
+ * writes anymore, and return NULL then: the keeper of that node should be
+ * demoting it already.
+ */
+Datum
+renew_primary_lease(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	int32 leaseTimeoutMs = PG_GETARG_INT32(1);
+
+	ProtocolStatsBegin(PROTOCOL_RENEW_PRIMARY_LEASE, NULL, -1);
+
+	if (leaseTimeoutMs <= 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid lease timeout %d", leaseTimeoutMs),
+				 errhint("The lease timeout is a number of milliseconds "
+						 "greater than zero.")));
+	}
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("node %lld is not registered",
+							   (long long) nodeId)));
+	}
+
+	ProtocolStatsSetGroup(currentNode->formationId, currentNode->groupId);
+
+	if (!CanTakeWritesInState(currentNode->goalState))
+	{
+		PG_RETURN_NULL();
+	}
+
+	TimestampTz expireTime = PrimaryLeaseRenew(nodeId, leaseTimeoutMs);
+
+	if (expireTime == 0)
+	{
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_TIMESTAMPTZ(expireTime);
+}
+
+
+/*
+ * set_sync_rep_waits saves how many backends of a primary node wait for
+ * synchronous replication to acknowledge their commit, and records an event
+ * when the oldest of them has been waiting for more than
+ * pgautofailover.sync_rep_stall_threshold.
+ */
+Datum
+set_sync_rep_waits(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	int32 waiting = PG_GETARG_INT32(1);
+	int64 oldestWaitMs = PG_GETARG_INT64(2);
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	if (ReportSyncRepWaits(nodeId, waiting, oldestWaitMs,
+						   SyncRepStallThresholdMs))
+	{
+		char message[BUFSIZE] = { 0 };
+
+		LogAndNotifyFormationMessage(
+			LOG_NOTIFY_INFO, currentNode->formationId,
+			message, BUFSIZE,
+			"Commits on " NODE_FORMAT " have been waiting for "
+			"synchronous replication for %lld ms, "
+			"%d backends are waiting.",
+			NODE_FORMAT_ARGS(currentNode),
+			(long long) oldestWaitMs,
+			waiting);
+
+		NotifyStateChange(currentNode, message);
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * update_node_metadata allows to update a node's nodename, hostname, and port.
+ *
+ * The pg_autoctl client fetches the list of "other" nodes on each iteration
+ * and will take it from there that they need to update their HBA rules when
+ * the hostname has changed.
+ */
+Datum
+update_node_metadata(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+	ProtocolStatsBegin(PROTOCOL_UPDATE_NODE_METADATA, NULL, -1);
+
+	int64 nodeid = 0;
+	char *nodeName = NULL;
+	char *nodeHost = NULL;
+	int32 nodePort = 0;
+
+
+	if (PG_ARGISNULL(0))
+	{
+		ereport(ERROR,
+				(errmsg("udpate_node_metadata requires a non-null nodeid")));
+	}
+	else
+	{
+		nodeid = PG_GETARG_INT64(0);
+	}
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeid);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("node %lld is not registered",
+							   (long long) nodeid)));
+	}
+
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	/*
+	 * When arguments are NULL, replace them with the current value of the node
+	 * metadata, so that the UPDATE statement then is a noop on that field.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		nodeName = currentNode->nodeName;
+	}
+	else
+	{
+		text *nodeNameText = PG_GETARG_TEXT_P(1);
+
+		nodeName = text_to_cstring(nodeNameText);
+	}
+
+	if (PG_ARGISNULL(2))
+	{
+		nodeHost = currentNode->nodeHost;
+	}
+	else
+	{
+		text *nodeHostText = PG_GETARG_TEXT_P(2);
+
+		nodeHost = text_to_cstring(nodeHostText);
+	}
+
+	if (PG_ARGISNULL(3))
+	{
+		nodePort = currentNode->nodePort;
+	}
+	else
+	{
+		nodePort = PG_GETARG_INT32(3);
+	}
+
+	UpdateAutoFailoverNodeMetadata(currentNode->nodeId,
+								   nodeName, nodeHost, nodePort);
 
 	PG_RETURN_BOOL(true);
 }
@@ -2369,6 +3703,8 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 
 	int32 groupId = PG_GETARG_INT32(1);
 
+	ProtocolStatsBegin(PROTOCOL_SYNCHRONOUS_STANDBY_NAMES, formationId, groupId);
+
 	AutoFailoverFormation *formation = GetFormation(formationId);
 
 	List *nodesGroupList = AutoFailoverNodeGroup(formationId, groupId);
@@ -2436,11 +3772,44 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 	 *       ANY 1 (pgautofailover_standby_2, pgautofailover_standby_3)
 	 *
 	 *     The num_sync number is the formation number_sync_standbys property.
+	 *
+	 *   - when pgautofailover.sync_standby_latency_margin is set, the nodes
+	 *     are listed by their flush lag as reported by the primary.
+	 *
+	 *   - when the primary has a zone, the nodes in the same zone are listed
+	 *     first.
+	 *
+	 *   - when perform_promotion waits for its target node to catch up, the
+	 *     target is listed first with the FIRST method, so that it is one of
+	 *     the standby nodes that acknowledge every commit.
 	 */
 	{
 		List *syncStandbyNodesGroupList =
 			GroupListSyncStandbys(standbyNodesGroupList);
 
+		if (SyncStandbyLatencyMarginMs > 0)
+		{
+			syncStandbyNodesGroupList =
+				SortSyncStandbysByLatency(syncStandbyNodesGroupList);
+		}
+
+		if (primaryNode != NULL && primaryNode->nodeZone[0] != '\0')
+		{
+			syncStandbyNodesGroupList =
+				SortSyncStandbysByZone(syncStandbyNodesGroupList, primaryNode);
+		}
+
+		AutoFailoverNode *promotionTarget =
+			GetPromotionTarget(syncStandbyNodesGroupList);
+
+		if (promotionTarget != NULL)
+		{
+			syncStandbyNodesGroupList =
+				list_delete_ptr(syncStandbyNodesGroupList, promotionTarget);
+			syncStandbyNodesGroupList =
+				lcons(promotionTarget, syncStandbyNodesGroupList);
+		}
+
 		int count = list_length(syncStandbyNodesGroupList);
 
 		if (count == 0 ||
@@ -2468,7 +3837,9 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 			ListCell *nodeCell = NULL;
 			bool firstNode = true;
 
-			appendStringInfo(sbnames, "ANY %d (", number_sync_standbys);
+			appendStringInfo(sbnames, "%s %d (",
+							 promotionTarget != NULL ? "FIRST" : "ANY",
+							 number_sync_standbys);
 
 			foreach(nodeCell, syncStandbyNodesGroupList)
 			{
@@ -2490,3 +3861,95 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 		}
 	}
 }
+
+
+/*
+ * SortSyncStandbysByLatency returns the given list of sync standby nodes
+ * ordered by their flush lag, as reported by the primary node.
+ *
+ * A node is only moved ahead of another one when its flush lag is smaller by
+ * more than pgautofailover.sync_standby_latency_margin, otherwise the
+ * candidate priority order is kept. This avoids changing the setting back and
+ * forth when the standby nodes have about the same latency. Nodes for which
+ * we don't know the lag keep their place relative to the others.
+ */
+static List *
+SortSyncStandbysByLatency(List *syncStandbyNodesGroupList)
+{
+	int nodeCount = list_length(syncStandbyNodesGroupList);
+	AutoFailoverNode **nodes =
+		(AutoFailoverNode **) palloc0(nodeCount * sizeof(AutoFailoverNode *));
+	int64 *flushLags = (int64 *) palloc0(nodeCount * sizeof(int64));
+	List *sortedNodesGroupList = NIL;
+	ListCell *nodeCell = NULL;
+	int sortedCount = 0;
+
+	foreach(nodeCell, syncStandbyNodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		int64 flushLag = GetReportedFlushLag(node->nodeId);
+		int position = sortedCount;
+
+		/* insertion sort, stable for lags within the margin */
+		for (int index = 0; index < sortedCount; index++)
+		{
+			if (flushLag >= 0 && flushLags[index] >= 0 &&
+				flushLag + SyncStandbyLatencyMarginMs < flushLags[index])
+			{
+				position = index;
+				break;
+			}
+		}
+
+		for (int index = sortedCount; index > position; index--)
+		{
+			nodes[index] = nodes[index - 1];
+			flushLags[index] = flushLags[index - 1];
+		}
+
+		nodes[position] = node;
+		flushLags[position] = flushLag;
+		++sortedCount;
+	}
+
+	for (int index = 0; index < sortedCount; index++)
+	{
+		sortedNodesGroupList = lappend(sortedNodesGroupList, nodes[index]);
+	}
+
+	pfree(nodes);
+	pfree(flushLags);
+
+	return sortedNodesGroupList;
+}
+
+
+/*
+ * SortSyncStandbysByZone returns the given list of sync standby nodes with
+ * the nodes placed in the same zone as the primary first, keeping the order
+ * of the list otherwise.
+ */
+static List *
+SortSyncStandbysByZone(List *syncStandbyNodesGroupList,
+					   AutoFailoverNode *primaryNode)
+{
+	List *sameZoneNodesList = NIL;
+	List *otherZonesNodesList = NIL;
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, syncStandbyNodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (strcmp(node->nodeZone, primaryNode->nodeZone) == 0)
+		{
+			sameZoneNodesList = lappend(sameZoneNodesList, node);
+		}
+		else
+		{
+			otherZonesNodesList = lappend(otherZonesNodesList, node);
+		}
+	}
+
+	return list_concat(sameZoneNodesList, otherZonesNodesList);
+}
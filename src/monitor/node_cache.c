@@ -0,0 +1,1117 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_cache.c
+ *
+ * Implementation of a shared memory cache of the pgautofailover.node rows,
+ * organized by formation and group.
+ *
+ * Keepers and the pg_autoctl commands read the nodes of their formation and
+ * group very often, while the node table only changes when a node reports a
+ * new state or when the monitor assigns a new goal state. We keep a copy of
+ * the rows in shared memory so that most of the reads do not have to scan
+ * the node table and build an AutoFailoverNode from each tuple.
+ *
+ * A trigger on pgautofailover.node registers which formation and group has
+ * been modified by the current transaction, and we invalidate the matching
+ * cache entries when the transaction commits. Each cache entry carries a
+ * stamp that changes at each invalidation: the result of a table scan done
+ * after a cache miss is only stored when the stamp did not change in the
+ * meantime, so that we never cache rows older than the last commit.
+ *
+ * The same trigger also maintains a version number per group, which only
+ * changes when a node is added to or removed from the group, or when a node
+ * changes its name, address, states or replication settings. Keepers send
+ * their last known group version to node_active() and skip fetching the
+ * list of other nodes when it did not change. Versions are not persisted,
+ * so we start counting from the current timestamp (in microseconds) at
+ * server start, which keeps versions increasing across restarts.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "health_check.h"
+#include "node_cache.h"
+#include "node_metadata.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "commands/trigger.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+
+/* hostnames are at most 255 characters long */
+#define NODE_CACHE_MAX_HOST_LEN 256
+
+/* we do not track versions for more groups than that */
+#define NODE_GROUP_VERSION_MAX_GROUPS 1024
+
+
+/*
+ * NodeCacheKey identifies a cache entry: either a group of nodes, or all the
+ * nodes of a formation when groupId is NODE_CACHE_ALL_GROUPS.
+ */
+typedef struct NodeCacheKey
+{
+	Oid databaseId;
+	int32 groupId;
+	char formationId[NAMEDATALEN];
+} NodeCacheKey;
+
+
+/*
+ * NodeCacheRecord is a copy of an AutoFailoverNode that fits in shared
+ * memory. The formationId is found in the entry's key.
+ */
+typedef struct NodeCacheRecord
+{
+	int64 nodeId;
+	int groupId;
+	char nodeName[NAMEDATALEN];
+	char nodeHost[NODE_CACHE_MAX_HOST_LEN];
+	int nodePort;
+	uint64 sysIdentifier;
+	ReplicationState goalState;
+	ReplicationState reportedState;
+	TimestampTz reportTime;
+	bool pgIsRunning;
+	SyncState pgsrSyncState;
+	TimestampTz walReportTime;
+	NodeHealthState health;
+	TimestampTz healthCheckTime;
+	TimestampTz stateChangeTime;
+	int reportedTLI;
+	XLogRecPtr reportedLSN;
+	int candidatePriority;
+	bool replicationQuorum;
+	char nodeCluster[NAMEDATALEN];
+	int64 upstreamNodeId;
+	XLogRecPtr reportedReplayLSN;
+	int64 reportedApplyRate;
+	char nodeZone[NAMEDATALEN];
+} NodeCacheRecord;
+
+
+typedef struct NodeCacheEntry
+{
+	NodeCacheKey key;
+
+	/* changes each time the entry is invalidated */
+	uint64 stamp;
+	bool valid;
+
+	/* used to evict the least recently used entry when the cache is full */
+	pg_atomic_uint64 lastUsed;
+
+	int nodeCount;
+	NodeCacheRecord nodes[NODE_CACHE_MAX_NODES];
+} NodeCacheEntry;
+
+
+typedef struct NodeGroupVersionEntry
+{
+	NodeCacheKey key;
+	uint64 version;
+} NodeGroupVersionEntry;
+
+
+/*
+ * PendingInvalidation is a group that the current transaction modified, and
+ * bumpVersion is true when the change is visible in the list of other nodes
+ * that keepers use.
+ */
+typedef struct PendingInvalidation
+{
+	NodeCacheKey key;
+	bool bumpVersion;
+} PendingInvalidation;
+
+
+typedef struct NodeCacheControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* protected by the lock */
+	uint64 nextStamp;
+	uint64 nextVersion;
+
+	pg_atomic_uint64 clock;
+} NodeCacheControlData;
+
+
+/* GUC variable: how many entries we keep in the cache, 0 disables it */
+int NodeCacheSize = 64;
+
+static NodeCacheControlData *NodeCacheControl = NULL;
+static HTAB *NodeCacheHash = NULL;
+static HTAB *NodeGroupVersionHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * Groups that the current transaction modified, allocated in the
+ * TopTransactionContext. We invalidate them at commit time, and until then
+ * we bypass the cache for them so that the transaction sees its own changes.
+ */
+static List *PendingInvalidations = NIL;
+static bool PendingInvalidateAll = false;
+
+/*
+ * Whether the current transaction registered new nodes, and whether it
+ * changed the list of nodes that the health check workers check.
+ */
+static bool PendingNodeInsert = false;
+static bool PendingNodeListChange = false;
+
+
+static void NodeCacheShmemInit(void);
+static void NodeCacheXactCallback(XactEvent event, void *arg);
+static void ApplyPendingInvalidations(void);
+static void InvalidateEntry(NodeCacheKey *key);
+static void BumpGroupVersion(NodeCacheKey *key);
+static void NodeCacheInvalidateTuple(TupleDesc tupleDesc, HeapTuple heapTuple,
+									 bool bumpVersion);
+static bool NodeTupleChangesHealthCheck(TupleDesc tupleDesc,
+										HeapTuple oldTuple,
+										HeapTuple newTuple);
+static bool TupleAttributesDiffer(TupleDesc tupleDesc,
+								  HeapTuple oldTuple, HeapTuple newTuple,
+								  const int *attributes, int attributeCount);
+static bool NodeTupleChangesGroup(TupleDesc tupleDesc,
+								  HeapTuple oldTuple, HeapTuple newTuple);
+static bool NodeCacheUsable(char *formationId, int groupId);
+static bool BuildNodeCacheKey(NodeCacheKey *key, char *formationId, int groupId);
+static NodeCacheEntry * EnterNodeCacheEntry(NodeCacheKey *key);
+static List * NodeCacheEntryToList(NodeCacheEntry *entry);
+static bool FillNodeCacheEntry(NodeCacheEntry *entry, List *nodeList);
+static void TouchNodeCacheEntry(NodeCacheEntry *entry);
+
+
+PG_FUNCTION_INFO_V1(invalidate_node_cache);
+
+
+/*
+ * InitializeNodeCache, called at server start, requests the shared memory
+ * used by the node cache and the group versions, and registers the
+ * transaction callback that applies invalidations at commit time.
+ */
+void
+InitializeNodeCache(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeCacheShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = NodeCacheShmemInit;
+
+	RegisterXactCallback(NodeCacheXactCallback, NULL);
+}
+
+
+/*
+ * NodeCacheShmemSize computes how much shared memory is required.
+ */
+size_t
+NodeCacheShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(NodeCacheControlData)));
+	size = add_size(size, hash_estimate_size(NODE_GROUP_VERSION_MAX_GROUPS,
+											 sizeof(NodeGroupVersionEntry)));
+
+	if (NodeCacheSize > 0)
+	{
+		size = add_size(size, hash_estimate_size(NodeCacheSize,
+												 sizeof(NodeCacheEntry)));
+	}
+
+	return size;
+}
+
+
+/*
+ * NodeCacheShmemInit initializes the requested shared memory for the node
+ * cache.
+ */
+static void
+NodeCacheShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeCacheControl =
+		(NodeCacheControlData *)
+		ShmemInitStruct("pg_auto_failover Node Cache",
+						MAXALIGN(sizeof(NodeCacheControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		NodeCacheControl->trancheId = LWLockNewTrancheId();
+		NodeCacheControl->lockTrancheName = "pg_auto_failover Node Cache";
+		LWLockRegisterTranche(NodeCacheControl->trancheId,
+							  NodeCacheControl->lockTrancheName);
+
+		LWLockInitialize(&NodeCacheControl->lock, NodeCacheControl->trancheId);
+
+		NodeCacheControl->nextStamp = 1;
+		NodeCacheControl->nextVersion = (uint64) GetCurrentTimestamp();
+		pg_atomic_init_u64(&NodeCacheControl->clock, 0);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(NodeCacheKey);
+	hashInfo.entrysize = sizeof(NodeGroupVersionEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	NodeGroupVersionHash =
+		ShmemInitHash("pg_auto_failover Node Group Version Hash",
+					  NODE_GROUP_VERSION_MAX_GROUPS,
+					  NODE_GROUP_VERSION_MAX_GROUPS,
+					  &hashInfo, hashFlags);
+
+	if (NodeCacheSize > 0)
+	{
+		hashInfo.entrysize = sizeof(NodeCacheEntry);
+
+		NodeCacheHash = ShmemInitHash("pg_auto_failover Node Cache Hash",
+									  NodeCacheSize, NodeCacheSize,
+									  &hashInfo, hashFlags);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * NodeCacheLookup returns true and sets nodeList to a copy of the cached
+ * nodes of the given formation and group when they are available. Otherwise
+ * it returns false and fills-in the ticket that NodeCacheStore needs to
+ * cache the nodes that the caller reads from the table.
+ *
+ * The entry is created before the caller scans the node table, so that any
+ * commit that happens after the scan started is seen as an invalidation.
+ */
+bool
+NodeCacheLookup(char *formationId, int groupId,
+				List **nodeList, NodeCacheTicket *ticket)
+{
+	NodeCacheKey key;
+	bool found = false;
+
+	ticket->cacheable = false;
+	ticket->stamp = 0;
+
+	if (!NodeCacheUsable(formationId, groupId) ||
+		!BuildNodeCacheKey(&key, formationId, groupId))
+	{
+		return false;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_FIND, &found);
+
+	if (found && entry->valid)
+	{
+		*nodeList = NodeCacheEntryToList(entry);
+		TouchNodeCacheEntry(entry);
+
+		LWLockRelease(&NodeCacheControl->lock);
+
+		return true;
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	entry = EnterNodeCacheEntry(&key);
+
+	if (entry->valid)
+	{
+		/* another backend filled the entry in the meantime */
+		*nodeList = NodeCacheEntryToList(entry);
+		TouchNodeCacheEntry(entry);
+
+		LWLockRelease(&NodeCacheControl->lock);
+
+		return true;
+	}
+
+	ticket->cacheable = true;
+	ticket->stamp = entry->stamp;
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	return false;
+}
+
+
+/*
+ * NodeCacheStore caches the given list of nodes for the given formation and
+ * group, unless the entry has been invalidated (or evicted) since the
+ * NodeCacheLookup call that filled the ticket.
+ */
+void
+NodeCacheStore(char *formationId, int groupId,
+			   List *nodeList, NodeCacheTicket *ticket)
+{
+	NodeCacheKey key;
+	bool found = false;
+
+	if (!ticket->cacheable ||
+		!NodeCacheUsable(formationId, groupId) ||
+		!BuildNodeCacheKey(&key, formationId, groupId))
+	{
+		return;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_FIND, &found);
+
+	if (found && !entry->valid && entry->stamp == ticket->stamp)
+	{
+		entry->valid = FillNodeCacheEntry(entry, nodeList);
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+}
+
+
+/*
+ * NodeCacheInvalidateAll registers that the whole cache must be invalidated
+ * when the current transaction commits. We use that for TRUNCATE and for DDL
+ * commands that might drop or re-create the node table.
+ */
+void
+NodeCacheInvalidateAll(void)
+{
+	PendingInvalidateAll = true;
+}
+
+
+/*
+ * invalidate_node_cache is a trigger function on the pgautofailover.node
+ * table that registers the groups modified by the current transaction.
+ */
+Datum
+invalidate_node_cache(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("invalidate_node_cache: must be called as trigger")));
+	}
+
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+
+	if (!TRIGGER_FIRED_FOR_ROW(triggerData->tg_event))
+	{
+		NodeCacheInvalidateAll();
+	}
+	else
+	{
+		TupleDesc tupleDesc = RelationGetDescr(triggerData->tg_relation);
+
+		if (TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event))
+		{
+			HeapTuple oldTuple = triggerData->tg_trigtuple;
+			HeapTuple newTuple = triggerData->tg_newtuple;
+			bool bumpVersion =
+				NodeTupleChangesGroup(tupleDesc, oldTuple, newTuple);
+
+			NodeCacheInvalidateTuple(tupleDesc, oldTuple, bumpVersion);
+			NodeCacheInvalidateTuple(tupleDesc, newTuple, bumpVersion);
+
+			if (NodeTupleChangesHealthCheck(tupleDesc, oldTuple, newTuple))
+			{
+				PendingNodeListChange = true;
+			}
+		}
+		else
+		{
+			NodeCacheInvalidateTuple(tupleDesc, triggerData->tg_trigtuple, true);
+
+			PendingNodeListChange = true;
+
+			if (TRIGGER_FIRED_BY_INSERT(triggerData->tg_event))
+			{
+				PendingNodeInsert = true;
+			}
+		}
+	}
+
+	PG_RETURN_POINTER(NULL);
+}
+
+
+/*
+ * NodeCacheInvalidateTuple registers the group of the given node tuple to be
+ * invalidated at commit time.
+ */
+static void
+NodeCacheInvalidateTuple(TupleDesc tupleDesc, HeapTuple heapTuple,
+						 bool bumpVersion)
+{
+	bool isNull = false;
+	NodeCacheKey key;
+	ListCell *pendingCell = NULL;
+
+	if (PendingInvalidateAll)
+	{
+		return;
+	}
+
+	Datum formationId = heap_getattr(heapTuple,
+									 Anum_pgautofailover_node_formationid,
+									 tupleDesc, &isNull);
+	Datum groupId = heap_getattr(heapTuple,
+								 Anum_pgautofailover_node_groupid,
+								 tupleDesc, &isNull);
+
+	/* we never cache formations with a name that does not fit in the key */
+	if (!BuildNodeCacheKey(&key,
+						   TextDatumGetCString(formationId),
+						   DatumGetInt32(groupId)))
+	{
+		return;
+	}
+
+	foreach(pendingCell, PendingInvalidations)
+	{
+		PendingInvalidation *pending = (PendingInvalidation *) lfirst(pendingCell);
+
+		if (memcmp(&(pending->key), &key, sizeof(NodeCacheKey)) == 0)
+		{
+			pending->bumpVersion = pending->bumpVersion || bumpVersion;
+			return;
+		}
+	}
+
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+	PendingInvalidation *pending =
+		(PendingInvalidation *) palloc(sizeof(PendingInvalidation));
+
+	pending->key = key;
+	pending->bumpVersion = bumpVersion;
+
+	PendingInvalidations = lappend(PendingInvalidations, pending);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * NodeTupleChangesGroup returns true when the given UPDATE of a node row
+ * changes anything that keepers see in their list of other nodes, or that
+ * drives their state. We skip the report times, health check results and
+ * LSN positions, which change all the time.
+ */
+static bool
+NodeTupleChangesGroup(TupleDesc tupleDesc, HeapTuple oldTuple, HeapTuple newTuple)
+{
+	const int attributes[] = {
+		Anum_pgautofailover_node_formationid,
+		Anum_pgautofailover_node_groupid,
+		Anum_pgautofailover_node_nodename,
+		Anum_pgautofailover_node_nodehost,
+		Anum_pgautofailover_node_nodeport,
+		Anum_pgautofailover_node_goalstate,
+		Anum_pgautofailover_node_reportedstate,
+		Anum_pgautofailover_node_candidate_priority,
+		Anum_pgautofailover_node_replication_quorum,
+		Anum_pgautofailover_node_nodecluster,
+		Anum_pgautofailover_node_upstreamnodeid
+	};
+	const int attributeCount = sizeof(attributes) / sizeof(attributes[0]);
+
+	return TupleAttributesDiffer(tupleDesc, oldTuple, newTuple,
+								 attributes, attributeCount);
+}
+
+
+/*
+ * NodeTupleChangesHealthCheck returns true when the given UPDATE of a node
+ * row changes what the health check workers keep in their list of nodes to
+ * check, except for the report time, which they follow in shared memory.
+ */
+static bool
+NodeTupleChangesHealthCheck(TupleDesc tupleDesc,
+							HeapTuple oldTuple, HeapTuple newTuple)
+{
+	const int attributes[] = {
+		Anum_pgautofailover_node_nodeid,
+		Anum_pgautofailover_node_nodename,
+		Anum_pgautofailover_node_nodehost,
+		Anum_pgautofailover_node_nodeport,
+		Anum_pgautofailover_node_health
+	};
+	const int attributeCount = sizeof(attributes) / sizeof(attributes[0]);
+
+	return TupleAttributesDiffer(tupleDesc, oldTuple, newTuple,
+								 attributes, attributeCount);
+}
+
+
+/*
+ * TupleAttributesDiffer returns true when any of the given attributes has a
+ * different value in the given tuples.
+ */
+static bool
+TupleAttributesDiffer(TupleDesc tupleDesc, HeapTuple oldTuple, HeapTuple newTuple,
+					  const int *attributes, int attributeCount)
+{
+	for (int index = 0; index < attributeCount; index++)
+	{
+		int attributeNumber = attributes[index];
+		Form_pg_attribute attribute = TupleDescAttr(tupleDesc, attributeNumber - 1);
+		bool oldIsNull = false;
+		bool newIsNull = false;
+
+		Datum oldValue = heap_getattr(oldTuple, attributeNumber,
+									  tupleDesc, &oldIsNull);
+		Datum newValue = heap_getattr(newTuple, attributeNumber,
+									  tupleDesc, &newIsNull);
+
+		if (oldIsNull != newIsNull)
+		{
+			return true;
+		}
+
+		if (!oldIsNull &&
+			!datumIsEqual(oldValue, newValue,
+						  attribute->attbyval, attribute->attlen))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * NodeCacheXactCallback applies the pending invalidations once the
+ * transaction that modified the node table has committed, so that any scan
+ * that starts after the invalidation sees the new rows.
+ */
+static void
+NodeCacheXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			/* we would not know when to invalidate the cache */
+			if (PendingInvalidations != NIL || PendingInvalidateAll)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has "
+								"modified the pg_auto_failover node table")));
+			}
+			break;
+		}
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		{
+			ApplyPendingInvalidations();
+
+			/* have the health check workers load the nodes again */
+			if (PendingNodeListChange || PendingInvalidateAll)
+			{
+				HealthCheckNodeListChanged(MyDatabaseId);
+			}
+
+			/* have new nodes probed now rather than at the next round */
+			if (PendingNodeInsert)
+			{
+				HealthCheckWorkersWakeUp(MyDatabaseId);
+			}
+
+			PendingInvalidations = NIL;
+			PendingInvalidateAll = false;
+			PendingNodeInsert = false;
+			PendingNodeListChange = false;
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+		{
+			PendingInvalidations = NIL;
+			PendingInvalidateAll = false;
+			PendingNodeInsert = false;
+			PendingNodeListChange = false;
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * ApplyPendingInvalidations invalidates the cache entries of the groups that
+ * the current transaction modified, and the entries of their formations.
+ */
+static void
+ApplyPendingInvalidations(void)
+{
+	ListCell *pendingCell = NULL;
+
+	if (NodeCacheControl == NULL ||
+		(PendingInvalidations == NIL && !PendingInvalidateAll))
+	{
+		return;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	if (PendingInvalidateAll)
+	{
+		HASH_SEQ_STATUS status;
+
+		if (NodeCacheHash != NULL)
+		{
+			NodeCacheEntry *entry = NULL;
+
+			hash_seq_init(&status, NodeCacheHash);
+
+			while ((entry = (NodeCacheEntry *) hash_seq_search(&status)) != NULL)
+			{
+				entry->valid = false;
+				entry->stamp = NodeCacheControl->nextStamp++;
+			}
+		}
+
+		NodeGroupVersionEntry *versionEntry = NULL;
+
+		hash_seq_init(&status, NodeGroupVersionHash);
+
+		while ((versionEntry =
+					(NodeGroupVersionEntry *) hash_seq_search(&status)) != NULL)
+		{
+			versionEntry->version = NodeCacheControl->nextVersion++;
+		}
+	}
+	else
+	{
+		foreach(pendingCell, PendingInvalidations)
+		{
+			PendingInvalidation *pending =
+				(PendingInvalidation *) lfirst(pendingCell);
+			NodeCacheKey formationKey = pending->key;
+
+			formationKey.groupId = NODE_CACHE_ALL_GROUPS;
+
+			if (NodeCacheHash != NULL)
+			{
+				InvalidateEntry(&(pending->key));
+				InvalidateEntry(&formationKey);
+			}
+
+			if (pending->bumpVersion)
+			{
+				BumpGroupVersion(&(pending->key));
+			}
+		}
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+}
+
+
+/*
+ * InvalidateEntry invalidates the cache entry with the given key, if any.
+ * The caller must hold the lock in exclusive mode.
+ */
+static void
+InvalidateEntry(NodeCacheKey *key)
+{
+	bool found = false;
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, key, HASH_FIND, &found);
+
+	if (found)
+	{
+		entry->valid = false;
+		entry->stamp = NodeCacheControl->nextStamp++;
+	}
+}
+
+
+/*
+ * BumpGroupVersion assigns a new version to the given group, if we track it.
+ * The caller must hold the lock in exclusive mode.
+ */
+static void
+BumpGroupVersion(NodeCacheKey *key)
+{
+	bool found = false;
+
+	NodeGroupVersionEntry *entry =
+		(NodeGroupVersionEntry *) hash_search(NodeGroupVersionHash, key,
+											  HASH_FIND, &found);
+
+	if (found)
+	{
+		entry->version = NodeCacheControl->nextVersion++;
+	}
+}
+
+
+/*
+ * NodeGroupVersion returns the current version of the given group, or zero
+ * when we can't tell: the current transaction modified the group, or there
+ * is no room left to track the group's version.
+ *
+ * The version is bumped after the commit of a change is visible, so a list
+ * of nodes fetched after reading a version is at least as recent as this
+ * version.
+ */
+uint64
+NodeGroupVersion(char *formationId, int groupId)
+{
+	NodeCacheKey key;
+	bool found = false;
+	ListCell *pendingCell = NULL;
+	uint64 version = 0;
+
+	if (NodeCacheControl == NULL ||
+		PendingInvalidateAll ||
+		!BuildNodeCacheKey(&key, formationId, groupId))
+	{
+		return 0;
+	}
+
+	foreach(pendingCell, PendingInvalidations)
+	{
+		PendingInvalidation *pending = (PendingInvalidation *) lfirst(pendingCell);
+
+		if (pending->bumpVersion &&
+			memcmp(&(pending->key), &key, sizeof(NodeCacheKey)) == 0)
+		{
+			return 0;
+		}
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+
+	NodeGroupVersionEntry *entry =
+		(NodeGroupVersionEntry *) hash_search(NodeGroupVersionHash, &key,
+											  HASH_FIND, &found);
+
+	if (found)
+	{
+		version = entry->version;
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	if (found)
+	{
+		return version;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	entry = (NodeGroupVersionEntry *) hash_search(NodeGroupVersionHash, &key,
+												  HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->version = NodeCacheControl->nextVersion++;
+		}
+
+		version = entry->version;
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	return version;
+}
+
+
+/*
+ * NodeCacheUsable returns true when the cache can be used to read the nodes
+ * of the given formation and group in the current transaction.
+ */
+static bool
+NodeCacheUsable(char *formationId, int groupId)
+{
+	ListCell *pendingCell = NULL;
+
+	if (NodeCacheHash == NULL || PendingInvalidateAll)
+	{
+		return false;
+	}
+
+	/*
+	 * The cache contains the last committed version of the rows, which is
+	 * what a new snapshot would see anyway in READ COMMITTED, but not what
+	 * older snapshots would see.
+	 */
+	if (IsolationUsesXactSnapshot() || RecoveryInProgress())
+	{
+		return false;
+	}
+
+	/* make sure the current transaction sees its own changes */
+	foreach(pendingCell, PendingInvalidations)
+	{
+		PendingInvalidation *pending = (PendingInvalidation *) lfirst(pendingCell);
+
+		if (strcmp(pending->key.formationId, formationId) == 0 &&
+			(groupId == NODE_CACHE_ALL_GROUPS || pending->key.groupId == groupId))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * BuildNodeCacheKey fills-in the given key, and returns false when the
+ * formation name is too long to be used in a key.
+ */
+static bool
+BuildNodeCacheKey(NodeCacheKey *key, char *formationId, int groupId)
+{
+	if (strlen(formationId) >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(NodeCacheKey));
+
+	key->databaseId = MyDatabaseId;
+	key->groupId = groupId;
+	strlcpy(key->formationId, formationId, NAMEDATALEN);
+
+	return true;
+}
+
+
+/*
+ * EnterNodeCacheEntry finds or creates the entry for the given key, evicting
+ * the least recently used entry when the cache is full. The caller must hold
+ * the lock in exclusive mode.
+ */
+static NodeCacheEntry *
+EnterNodeCacheEntry(NodeCacheKey *key)
+{
+	bool found = false;
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, key, HASH_FIND, &found);
+
+	if (found)
+	{
+		return entry;
+	}
+
+	if (hash_get_num_entries(NodeCacheHash) >= NodeCacheSize)
+	{
+		HASH_SEQ_STATUS status;
+		NodeCacheEntry *victim = NULL;
+		uint64 victimLastUsed = PG_UINT64_MAX;
+
+		hash_seq_init(&status, NodeCacheHash);
+
+		while ((entry = (NodeCacheEntry *) hash_seq_search(&status)) != NULL)
+		{
+			uint64 lastUsed = pg_atomic_read_u64(&entry->lastUsed);
+
+			if (lastUsed < victimLastUsed)
+			{
+				victim = entry;
+				victimLastUsed = lastUsed;
+			}
+		}
+
+		if (victim != NULL)
+		{
+			hash_search(NodeCacheHash, &(victim->key), HASH_REMOVE, NULL);
+		}
+	}
+
+	entry = (NodeCacheEntry *) hash_search(NodeCacheHash, key, HASH_ENTER, &found);
+
+	/* stamps are never re-used, even when an entry is evicted */
+	entry->stamp = NodeCacheControl->nextStamp++;
+	entry->valid = false;
+	entry->nodeCount = 0;
+	pg_atomic_init_u64(&entry->lastUsed,
+					   pg_atomic_fetch_add_u64(&NodeCacheControl->clock, 1));
+
+	return entry;
+}
+
+
+/*
+ * TouchNodeCacheEntry marks the entry as recently used.
+ */
+static void
+TouchNodeCacheEntry(NodeCacheEntry *entry)
+{
+	pg_atomic_write_u64(&entry->lastUsed,
+						pg_atomic_fetch_add_u64(&NodeCacheControl->clock, 1));
+}
+
+
+/*
+ * FillNodeCacheEntry copies the given list of nodes into the cache entry, and
+ * returns false when the nodes do not fit in the entry.
+ */
+static bool
+FillNodeCacheEntry(NodeCacheEntry *entry, List *nodeList)
+{
+	ListCell *nodeCell = NULL;
+	int nodeIndex = 0;
+
+	if (list_length(nodeList) > NODE_CACHE_MAX_NODES)
+	{
+		return false;
+	}
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		NodeCacheRecord *record = &(entry->nodes[nodeIndex++]);
+
+		if (strlen(node->nodeName) >= NAMEDATALEN ||
+			strlen(node->nodeHost) >= NODE_CACHE_MAX_HOST_LEN ||
+			strlen(node->nodeCluster) >= NAMEDATALEN ||
+			strlen(node->nodeZone) >= NAMEDATALEN)
+		{
+			return false;
+		}
+
+		record->nodeId = node->nodeId;
+		record->groupId = node->groupId;
+		strlcpy(record->nodeName, node->nodeName, NAMEDATALEN);
+		strlcpy(record->nodeHost, node->nodeHost, NODE_CACHE_MAX_HOST_LEN);
+		record->nodePort = node->nodePort;
+		record->sysIdentifier = node->sysIdentifier;
+		record->goalState = node->goalState;
+		record->reportedState = node->reportedState;
+		record->reportTime = node->reportTime;
+		record->pgIsRunning = node->pgIsRunning;
+		record->pgsrSyncState = node->pgsrSyncState;
+		record->walReportTime = node->walReportTime;
+		record->health = node->health;
+		record->healthCheckTime = node->healthCheckTime;
+		record->stateChangeTime = node->stateChangeTime;
+		record->reportedTLI = node->reportedTLI;
+		record->reportedLSN = node->reportedLSN;
+		record->candidatePriority = node->candidatePriority;
+		record->replicationQuorum = node->replicationQuorum;
+		strlcpy(record->nodeCluster, node->nodeCluster, NAMEDATALEN);
+		record->upstreamNodeId = node->upstreamNodeId;
+		record->reportedReplayLSN = node->reportedReplayLSN;
+		record->reportedApplyRate = node->reportedApplyRate;
+		strlcpy(record->nodeZone, node->nodeZone, NAMEDATALEN);
+	}
+
+	entry->nodeCount = nodeIndex;
+
+	return true;
+}
+
+
+/*
+ * NodeCacheEntryToList builds a list of AutoFailoverNode from the cache entry,
+ * in the current memory context.
+ */
+static List *
+NodeCacheEntryToList(NodeCacheEntry *entry)
+{
+	List *nodeList = NIL;
+
+	for (int nodeIndex = 0; nodeIndex < entry->nodeCount; nodeIndex++)
+	{
+		NodeCacheRecord *record = &(entry->nodes[nodeIndex]);
+		AutoFailoverNode *node =
+			(AutoFailoverNode *) palloc0(sizeof(AutoFailoverNode));
+
+		node->formationId = pstrdup(entry->key.formationId);
+		node->nodeId = record->nodeId;
+		node->groupId = record->groupId;
+		node->nodeName = pstrdup(record->nodeName);
+		node->nodeHost = pstrdup(record->nodeHost);
+		node->nodePort = record->nodePort;
+		node->sysIdentifier = record->sysIdentifier;
+		node->goalState = record->goalState;
+		node->reportedState = record->reportedState;
+		node->reportTime = record->reportTime;
+		node->pgIsRunning = record->pgIsRunning;
+		node->pgsrSyncState = record->pgsrSyncState;
+		node->walReportTime = record->walReportTime;
+		node->health = record->health;
+		node->healthCheckTime = record->healthCheckTime;
+		node->stateChangeTime = record->stateChangeTime;
+		node->reportedTLI = record->reportedTLI;
+		node->reportedLSN = record->reportedLSN;
+		node->candidatePriority = record->candidatePriority;
+		node->replicationQuorum = record->replicationQuorum;
+		node->nodeCluster = pstrdup(record->nodeCluster);
+		node->upstreamNodeId = record->upstreamNodeId;
+		node->reportedReplayLSN = record->reportedReplayLSN;
+		node->reportedApplyRate = record->reportedApplyRate;
+		node->nodeZone = pstrdup(record->nodeZone);
+
+		nodeList = lappend(nodeList, node);
+	}
+
+	return nodeList;
+}
@@ -0,0 +1,53 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_cache.h
+ *
+ * Declarations for the shared memory cache of pgautofailover.node rows.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+
+
+/*
+ * We cache the nodes of a whole formation using this special group id, and
+ * the nodes of a single group using the actual group id.
+ */
+#define NODE_CACHE_ALL_GROUPS -1
+
+/* groups with more nodes than that are always read from the node table */
+#define NODE_CACHE_MAX_NODES 32
+
+/*
+ * NodeCacheTicket is filled when a lookup misses, and allows storing the
+ * result of the table scan in the cache afterwards, unless the group has been
+ * invalidated in the meantime.
+ */
+typedef struct NodeCacheTicket
+{
+	bool cacheable;
+	uint64 stamp;
+} NodeCacheTicket;
+
+
+/* GUC variable */
+extern int NodeCacheSize;
+
+
+/* public function declarations */
+extern void InitializeNodeCache(void);
+extern size_t NodeCacheShmemSize(void);
+extern bool NodeCacheLookup(char *formationId, int groupId,
+							List **nodeList, NodeCacheTicket *ticket);
+extern void NodeCacheStore(char *formationId, int groupId,
+						   List *nodeList, NodeCacheTicket *ticket);
+extern void NodeCacheInvalidateAll(void);
+extern uint64 NodeGroupVersion(char *formationId, int groupId);
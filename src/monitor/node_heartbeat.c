@@ -0,0 +1,508 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_heartbeat.c
+ *
+ * Implementation of the shared memory tracking of node heartbeat intervals.
+ *
+ * The monitor considers that a keeper stopped reporting when it did not call
+ * node_active for pgautofailover.node_considered_unhealthy_timeout. That
+ * timeout has to be long enough for the nodes with the slowest and least
+ * regular network, and all the other nodes then wait as long before being
+ * failed over.
+ *
+ * We keep a histogram of the intervals between the node_active calls of each
+ * node in shared memory. When pgautofailover.node_unhealthy_timeout_factor
+ * is set, the timeout of a node that has enough heartbeats in its histogram
+ * is the 99.9th percentile of its intervals times that factor, bounded by
+ * pgautofailover.node_unhealthy_timeout_min and by the global timeout. Older
+ * heartbeats are progressively forgotten, so that the timeout follows changes
+ * of the network of a node.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "group_state_machine.h"
+#include "node_heartbeat.h"
+
+#include "access/htup_details.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+/* nodes past that limit use the global timeout */
+#define NODE_HEARTBEAT_MAX_NODES 4096
+
+#define NODE_HEARTBEAT_BUCKETS 26
+
+/* we need that many heartbeats before using an adaptive timeout */
+#define NODE_HEARTBEAT_MIN_SAMPLES 1000
+
+/* the counts are halved when the histogram reaches that many heartbeats */
+#define NODE_HEARTBEAT_DECAY_SAMPLES 10000
+
+#define NODE_HEARTBEAT_PERCENTILE 0.999
+
+#define NODE_HEARTBEAT_COLS 4
+
+
+/*
+ * Upper bounds of the histogram buckets, in milliseconds. The last bucket
+ * counts the intervals that were longer than the previous bounds.
+ */
+static const int HeartbeatBucketBounds[NODE_HEARTBEAT_BUCKETS - 1] = {
+	100, 150, 200, 250, 300, 400, 500, 600, 750,
+	1000, 1250, 1500, 2000, 2500, 3000, 4000, 5000, 6000, 7500,
+	10000, 12500, 15000, 20000, 30000, 60000
+};
+
+
+typedef struct NodeHeartbeatKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} NodeHeartbeatKey;
+
+
+typedef struct NodeHeartbeatEntry
+{
+	NodeHeartbeatKey key;
+
+	TimestampTz lastHeartbeatTime;
+
+	int64 samples;
+	int64 counts[NODE_HEARTBEAT_BUCKETS];
+
+	/* percentile of the intervals, in milliseconds, -1 when unknown */
+	int percentileMs;
+} NodeHeartbeatEntry;
+
+
+typedef struct NodeHeartbeatControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} NodeHeartbeatControlData;
+
+
+/* GUC variables: a factor of 0 disables the adaptive timeouts */
+double NodeUnhealthyTimeoutFactor = 0;
+int NodeUnhealthyTimeoutMinMs = 5 * 1000;
+
+static NodeHeartbeatControlData *NodeHeartbeatControl = NULL;
+static HTAB *NodeHeartbeatHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void NodeHeartbeatShmemInit(void);
+static void BuildNodeHeartbeatKey(NodeHeartbeatKey *key, int64 nodeId);
+static int HeartbeatBucket(int64 intervalMs);
+static int HeartbeatPercentile(NodeHeartbeatEntry *entry);
+static int AdaptiveUnhealthyTimeoutMs(int percentileMs);
+
+
+PG_FUNCTION_INFO_V1(node_heartbeat_intervals);
+
+
+/*
+ * InitializeNodeHeartbeats, called at server start, requests the shared
+ * memory used to keep the heartbeat histograms.
+ */
+void
+InitializeNodeHeartbeats(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeHeartbeatShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = NodeHeartbeatShmemInit;
+}
+
+
+/*
+ * NodeHeartbeatShmemSize computes how much shared memory is required.
+ */
+size_t
+NodeHeartbeatShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(NodeHeartbeatControlData)));
+	size = add_size(size, hash_estimate_size(NODE_HEARTBEAT_MAX_NODES,
+											 sizeof(NodeHeartbeatEntry)));
+
+	return size;
+}
+
+
+/*
+ * NodeHeartbeatShmemInit initializes the requested shared memory.
+ */
+static void
+NodeHeartbeatShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeHeartbeatControl =
+		(NodeHeartbeatControlData *)
+		ShmemInitStruct("pg_auto_failover Node Heartbeats",
+						MAXALIGN(sizeof(NodeHeartbeatControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		NodeHeartbeatControl->trancheId = LWLockNewTrancheId();
+		NodeHeartbeatControl->lockTrancheName = "pg_auto_failover Node Heartbeats";
+		LWLockRegisterTranche(NodeHeartbeatControl->trancheId,
+							  NodeHeartbeatControl->lockTrancheName);
+
+		LWLockInitialize(&NodeHeartbeatControl->lock,
+						 NodeHeartbeatControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(NodeHeartbeatKey);
+	hashInfo.entrysize = sizeof(NodeHeartbeatEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	NodeHeartbeatHash = ShmemInitHash("pg_auto_failover Node Heartbeats Hash",
+									  NODE_HEARTBEAT_MAX_NODES,
+									  NODE_HEARTBEAT_MAX_NODES,
+									  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * NodeHeartbeatRecord registers a node_active call of the given node, and
+ * adds the interval since its previous call to the node's histogram. Longer
+ * intervals than node_considered_unhealthy_timeout are outages rather than
+ * jitter, and are not counted.
+ */
+void
+NodeHeartbeatRecord(int64 nodeId, TimestampTz now)
+{
+	NodeHeartbeatKey key;
+	bool found = false;
+
+	if (NodeHeartbeatHash == NULL)
+	{
+		return;
+	}
+
+	BuildNodeHeartbeatKey(&key, nodeId);
+
+	LWLockAcquire(&NodeHeartbeatControl->lock, LW_EXCLUSIVE);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) hash_search(NodeHeartbeatHash, &key,
+										   HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->samples = 0;
+			entry->percentileMs = -1;
+			memset(entry->counts, 0, sizeof(entry->counts));
+		}
+		else if (now > entry->lastHeartbeatTime)
+		{
+			int64 intervalMs = (now - entry->lastHeartbeatTime) / 1000;
+
+			if (intervalMs <= UnhealthyTimeoutMs)
+			{
+				entry->counts[HeartbeatBucket(intervalMs)]++;
+				entry->samples++;
+
+				if (entry->samples >= NODE_HEARTBEAT_DECAY_SAMPLES)
+				{
+					entry->samples = 0;
+
+					for (int bucket = 0; bucket < NODE_HEARTBEAT_BUCKETS; bucket++)
+					{
+						entry->counts[bucket] /= 2;
+						entry->samples += entry->counts[bucket];
+					}
+				}
+
+				entry->percentileMs = HeartbeatPercentile(entry);
+			}
+		}
+
+		entry->lastHeartbeatTime = now;
+	}
+
+	LWLockRelease(&NodeHeartbeatControl->lock);
+}
+
+
+/*
+ * NodeLastHeartbeatTime returns when the given node last called node_active,
+ * or 0 when we don't know.
+ */
+TimestampTz
+NodeLastHeartbeatTime(int64 nodeId)
+{
+	NodeHeartbeatKey key;
+	bool found = false;
+	TimestampTz lastHeartbeatTime = 0;
+
+	if (NodeHeartbeatHash == NULL)
+	{
+		return 0;
+	}
+
+	BuildNodeHeartbeatKey(&key, nodeId);
+
+	LWLockAcquire(&NodeHeartbeatControl->lock, LW_SHARED);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) hash_search(NodeHeartbeatHash, &key,
+										   HASH_FIND, &found);
+
+	if (found)
+	{
+		lastHeartbeatTime = entry->lastHeartbeatTime;
+	}
+
+	LWLockRelease(&NodeHeartbeatControl->lock);
+
+	return lastHeartbeatTime;
+}
+
+
+/*
+ * NodeUnhealthyTimeoutMs returns the time without a report after which we
+ * consider that the keeper of the given node stopped reporting.
+ */
+int
+NodeUnhealthyTimeoutMs(int64 nodeId)
+{
+	NodeHeartbeatKey key;
+	bool found = false;
+	int percentileMs = -1;
+
+	if (NodeUnhealthyTimeoutFactor <= 0 || NodeHeartbeatHash == NULL)
+	{
+		return UnhealthyTimeoutMs;
+	}
+
+	BuildNodeHeartbeatKey(&key, nodeId);
+
+	LWLockAcquire(&NodeHeartbeatControl->lock, LW_SHARED);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) hash_search(NodeHeartbeatHash, &key,
+										   HASH_FIND, &found);
+
+	if (found)
+	{
+		percentileMs = entry->percentileMs;
+	}
+
+	LWLockRelease(&NodeHeartbeatControl->lock);
+
+	return AdaptiveUnhealthyTimeoutMs(percentileMs);
+}
+
+
+/*
+ * AdaptiveUnhealthyTimeoutMs applies the unhealthy timeout factor and bounds
+ * to the given percentile of the heartbeat intervals of a node.
+ */
+static int
+AdaptiveUnhealthyTimeoutMs(int percentileMs)
+{
+	if (NodeUnhealthyTimeoutFactor <= 0 || percentileMs < 0)
+	{
+		return UnhealthyTimeoutMs;
+	}
+
+	double timeoutMs = percentileMs * NodeUnhealthyTimeoutFactor;
+
+	timeoutMs = Max(timeoutMs, (double) NodeUnhealthyTimeoutMinMs);
+
+	return (int) Min(timeoutMs, (double) UnhealthyTimeoutMs);
+}
+
+
+/*
+ * HeartbeatBucket returns the index of the histogram bucket of the given
+ * interval.
+ */
+static int
+HeartbeatBucket(int64 intervalMs)
+{
+	int bucket = 0;
+
+	for (bucket = 0; bucket < NODE_HEARTBEAT_BUCKETS - 1; bucket++)
+	{
+		if (intervalMs <= HeartbeatBucketBounds[bucket])
+		{
+			break;
+		}
+	}
+
+	return bucket;
+}
+
+
+/*
+ * HeartbeatPercentile returns the upper bound of the bucket that contains the
+ * NODE_HEARTBEAT_PERCENTILE of the intervals of the given entry, or -1 when
+ * the entry does not have enough heartbeats yet or when the percentile falls
+ * in the last bucket, which has no upper bound.
+ */
+static int
+HeartbeatPercentile(NodeHeartbeatEntry *entry)
+{
+	int64 cumulated = 0;
+
+	if (entry->samples < NODE_HEARTBEAT_MIN_SAMPLES)
+	{
+		return -1;
+	}
+
+	double target = entry->samples * NODE_HEARTBEAT_PERCENTILE;
+
+	for (int bucket = 0; bucket < NODE_HEARTBEAT_BUCKETS - 1; bucket++)
+	{
+		cumulated += entry->counts[bucket];
+
+		if (cumulated >= target)
+		{
+			return HeartbeatBucketBounds[bucket];
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * BuildNodeHeartbeatKey fills-in the given key.
+ */
+static void
+BuildNodeHeartbeatKey(NodeHeartbeatKey *key, int64 nodeId)
+{
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(NodeHeartbeatKey));
+
+	key->databaseId = MyDatabaseId;
+	key->nodeId = nodeId;
+}
+
+
+/*
+ * node_heartbeat_intervals returns, for each node of the current database,
+ * how many heartbeats its histogram holds, the 99.9th percentile of the
+ * intervals between its heartbeats, and the unhealthy timeout that the
+ * monitor currently uses for the node, in milliseconds. The percentile is
+ * NULL until a node has enough heartbeats.
+ */
+Datum
+node_heartbeat_intervals(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (NodeHeartbeatHash == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	LWLockAcquire(&NodeHeartbeatControl->lock, LW_SHARED);
+
+	hash_seq_init(&status, NodeHeartbeatHash);
+
+	NodeHeartbeatEntry *entry = NULL;
+
+	while ((entry = (NodeHeartbeatEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[NODE_HEARTBEAT_COLS];
+		bool isNulls[NODE_HEARTBEAT_COLS];
+
+		if (entry->key.databaseId != MyDatabaseId)
+		{
+			continue;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+		values[1] = Int64GetDatum(entry->samples);
+
+		if (entry->percentileMs < 0)
+		{
+			isNulls[2] = true;
+		}
+		else
+		{
+			values[2] = Int32GetDatum(entry->percentileMs);
+		}
+
+		values[3] = Int32GetDatum(AdaptiveUnhealthyTimeoutMs(entry->percentileMs));
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(&NodeHeartbeatControl->lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_heartbeat.h
+ *
+ * Declarations for the shared memory tracking of node heartbeat intervals.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+
+/* GUC variables */
+extern double NodeUnhealthyTimeoutFactor;
+extern int NodeUnhealthyTimeoutMinMs;
+
+
+/* public function declarations */
+extern void InitializeNodeHeartbeats(void);
+extern size_t NodeHeartbeatShmemSize(void);
+extern void NodeHeartbeatRecord(int64 nodeId, TimestampTz now);
+extern TimestampTz NodeLastHeartbeatTime(int64 nodeId);
+extern int NodeUnhealthyTimeoutMs(int64 nodeId);
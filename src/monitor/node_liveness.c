@@ -0,0 +1,415 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_liveness.c
+ *
+ * Implementation of the shared memory tracking of node report times.
+ *
+ * Each keeper calls node_active() every second or so, and most of those
+ * calls report the same state, timeline and LSN as the previous call. Only
+ * the reporttime and walreporttime columns would change then, and updating
+ * the pgautofailover.node row each time is most of the WAL volume and
+ * vacuum work of a monitor.
+ *
+ * When pgautofailover.node_report_persist_interval is set, we keep such
+ * report times in shared memory, and only update the node row when the
+ * reported state changes or when the persisted report time is older than
+ * the interval. Every AutoFailoverNode read from the table then gets its
+ * report times from shared memory, as long as the row still has the report
+ * time that we persisted last: any other change to the row, including the
+ * node table being dropped and re-created by DDL, makes us ignore the
+ * shared memory entry.
+ *
+ * On a node that takes writes, or replays them, the reported LSN moves at
+ * each call too. While a node is in a stable state, that is when its goal
+ * state is the same as its reported state, the reported LSN, replay LSN and
+ * apply rate are kept in shared memory the same way, and the node row is
+ * only updated once per interval. Changes of state, timeline, or a reported
+ * LSN that goes backwards are always written to the node row.
+ *
+ * Shared memory is lost when the monitor restarts, and the node rows then
+ * have values that are up to one interval old. The first report of each
+ * node updates its row again, and pgautofailover.startup_grace_period
+ * prevents decisions based on the older report times meanwhile.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "node_liveness.h"
+
+#include "access/xact.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+
+/* we fall back to updating the node table for nodes past that limit */
+#define NODE_LIVENESS_MAX_NODES 4096
+
+
+typedef struct NodeLivenessKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} NodeLivenessKey;
+
+
+typedef struct NodeLivenessEntry
+{
+	NodeLivenessKey key;
+
+	/* reporttime value of the node row when we last updated it */
+	TimestampTz persistedReportTime;
+
+	/* last report times, possibly more recent than the node row */
+	TimestampTz reportTime;
+	TimestampTz walReportTime;
+
+	/* last reported LSNs, possibly more recent than the node row */
+	XLogRecPtr reportedLSN;
+	XLogRecPtr reportedReplayLSN;
+	int64 reportedApplyRate;
+} NodeLivenessEntry;
+
+
+typedef struct NodeLivenessControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} NodeLivenessControlData;
+
+
+/* GUC variable: 0 means that we update the node row at each report */
+int NodeReportPersistInterval = 0;
+
+static NodeLivenessControlData *NodeLivenessControl = NULL;
+static HTAB *NodeLivenessHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void NodeLivenessShmemInit(void);
+static void BuildNodeLivenessKey(NodeLivenessKey *key, int64 nodeId);
+
+
+PG_FUNCTION_INFO_V1(last_report_time);
+
+
+/*
+ * InitializeNodeLiveness, called at server start, requests the shared memory
+ * used to track node report times.
+ */
+void
+InitializeNodeLiveness(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeLivenessShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = NodeLivenessShmemInit;
+}
+
+
+/*
+ * NodeLivenessShmemSize computes how much shared memory is required.
+ */
+size_t
+NodeLivenessShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(NodeLivenessControlData)));
+	size = add_size(size, hash_estimate_size(NODE_LIVENESS_MAX_NODES,
+											 sizeof(NodeLivenessEntry)));
+
+	return size;
+}
+
+
+/*
+ * NodeLivenessShmemInit initializes the requested shared memory.
+ */
+static void
+NodeLivenessShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeLivenessControl =
+		(NodeLivenessControlData *)
+		ShmemInitStruct("pg_auto_failover Node Liveness",
+						MAXALIGN(sizeof(NodeLivenessControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		NodeLivenessControl->trancheId = LWLockNewTrancheId();
+		NodeLivenessControl->lockTrancheName = "pg_auto_failover Node Liveness";
+		LWLockRegisterTranche(NodeLivenessControl->trancheId,
+							  NodeLivenessControl->lockTrancheName);
+
+		LWLockInitialize(&NodeLivenessControl->lock,
+						 NodeLivenessControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(NodeLivenessKey);
+	hashInfo.entrysize = sizeof(NodeLivenessEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	NodeLivenessHash = ShmemInitHash("pg_auto_failover Node Liveness Hash",
+									 NODE_LIVENESS_MAX_NODES,
+									 NODE_LIVENESS_MAX_NODES,
+									 &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * NodeLivenessSkipReport returns true when the given report of the node only
+ * changes its report times and LSNs, and the node row has been updated
+ * recently enough that we can keep the new values in shared memory only. The
+ * given node must have been read from the node table in the current
+ * transaction, and the caller is responsible for checking that the reported
+ * state and timeline are the same as in the node row.
+ */
+bool
+NodeLivenessSkipReport(AutoFailoverNode *node, AutoFailoverNodeState *report)
+{
+	NodeLivenessKey key;
+	bool found = false;
+	bool skipped = false;
+
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+	bool walReported = report->reportedLSN != InvalidXLogRecPtr;
+
+	if (NodeReportPersistInterval == 0 || NodeLivenessHash == NULL)
+	{
+		return false;
+	}
+
+	/* only keep a moving LSN in shared memory while the node is stable */
+	if (walReported &&
+		report->reportedLSN != node->reportedLSN &&
+		(node->goalState != node->reportedState ||
+		 report->reportedLSN < node->reportedLSN))
+	{
+		return false;
+	}
+
+	BuildNodeLivenessKey(&key, node->nodeId);
+
+	LWLockAcquire(&NodeLivenessControl->lock, LW_EXCLUSIVE);
+
+	NodeLivenessEntry *entry =
+		(NodeLivenessEntry *) hash_search(NodeLivenessHash, &key,
+										  HASH_FIND, &found);
+
+	/*
+	 * The node's reportTime has already been replaced by the entry's one,
+	 * see NodeLivenessApply, so the entry is only valid when it is still in
+	 * charge of it.
+	 */
+	if (found &&
+		entry->reportTime == node->reportTime &&
+		!TimestampDifferenceExceeds(entry->persistedReportTime, now,
+									NodeReportPersistInterval))
+	{
+		entry->reportTime = Max(entry->reportTime, now);
+
+		if (walReported)
+		{
+			entry->walReportTime = Max(entry->walReportTime, now);
+			entry->reportedLSN = Max(entry->reportedLSN, report->reportedLSN);
+		}
+
+		entry->reportedReplayLSN = report->reportedReplayLSN;
+		entry->reportedApplyRate = report->reportedApplyRate;
+
+		skipped = true;
+	}
+
+	LWLockRelease(&NodeLivenessControl->lock);
+
+	return skipped;
+}
+
+
+/*
+ * NodeLivenessReportPersisted registers that the current transaction updated
+ * the node row with a reporttime of now() and the values of the given
+ * report. Should the transaction abort, the node row would keep its
+ * previous reporttime and the entry would then be ignored.
+ */
+void
+NodeLivenessReportPersisted(AutoFailoverNode *node, AutoFailoverNodeState *report)
+{
+	NodeLivenessKey key;
+	bool found = false;
+
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+	bool walReported = report->reportedLSN != InvalidXLogRecPtr;
+
+	if (NodeReportPersistInterval == 0 || NodeLivenessHash == NULL)
+	{
+		return;
+	}
+
+	BuildNodeLivenessKey(&key, node->nodeId);
+
+	LWLockAcquire(&NodeLivenessControl->lock, LW_EXCLUSIVE);
+
+	NodeLivenessEntry *entry =
+		(NodeLivenessEntry *) hash_search(NodeLivenessHash, &key,
+										  HASH_ENTER_NULL, &found);
+
+	/* when the hash table is full, we keep updating the node row */
+	if (entry != NULL)
+	{
+		entry->persistedReportTime = now;
+		entry->reportTime = now;
+		entry->walReportTime = walReported ? now : node->walReportTime;
+
+		entry->reportedLSN =
+			walReported ? report->reportedLSN : node->reportedLSN;
+		entry->reportedReplayLSN = report->reportedReplayLSN;
+		entry->reportedApplyRate = report->reportedApplyRate;
+	}
+
+	LWLockRelease(&NodeLivenessControl->lock);
+}
+
+
+/*
+ * NodeLivenessApply replaces the given report times, as read from the node
+ * table, with the more recent ones kept in shared memory, if any.
+ */
+void
+NodeLivenessApply(int64 nodeId,
+				  TimestampTz *reportTime,
+				  TimestampTz *walReportTime)
+{
+	NodeLivenessKey key;
+	bool found = false;
+
+	if (NodeLivenessHash == NULL)
+	{
+		return;
+	}
+
+	BuildNodeLivenessKey(&key, nodeId);
+
+	LWLockAcquire(&NodeLivenessControl->lock, LW_SHARED);
+
+	NodeLivenessEntry *entry =
+		(NodeLivenessEntry *) hash_search(NodeLivenessHash, &key,
+										  HASH_FIND, &found);
+
+	if (found && entry->persistedReportTime == *reportTime)
+	{
+		*reportTime = Max(*reportTime, entry->reportTime);
+
+		if (walReportTime != NULL)
+		{
+			*walReportTime = Max(*walReportTime, entry->walReportTime);
+		}
+	}
+
+	LWLockRelease(&NodeLivenessControl->lock);
+}
+
+
+/*
+ * NodeLivenessApplyNode replaces the report times and the reported LSNs of
+ * the given node, as read from the node table, with the more recent ones
+ * kept in shared memory, if any.
+ */
+void
+NodeLivenessApplyNode(AutoFailoverNode *node)
+{
+	NodeLivenessKey key;
+	bool found = false;
+
+	if (NodeLivenessHash == NULL)
+	{
+		return;
+	}
+
+	BuildNodeLivenessKey(&key, node->nodeId);
+
+	LWLockAcquire(&NodeLivenessControl->lock, LW_SHARED);
+
+	NodeLivenessEntry *entry =
+		(NodeLivenessEntry *) hash_search(NodeLivenessHash, &key,
+										  HASH_FIND, &found);
+
+	if (found && entry->persistedReportTime == node->reportTime)
+	{
+		node->reportTime = Max(node->reportTime, entry->reportTime);
+		node->walReportTime = Max(node->walReportTime, entry->walReportTime);
+
+		/* the replication report might have advanced the row's LSN */
+		node->reportedLSN = Max(node->reportedLSN, entry->reportedLSN);
+		node->reportedReplayLSN = entry->reportedReplayLSN;
+		node->reportedApplyRate = entry->reportedApplyRate;
+	}
+
+	LWLockRelease(&NodeLivenessControl->lock);
+}
+
+
+/*
+ * BuildNodeLivenessKey fills-in the given key.
+ */
+static void
+BuildNodeLivenessKey(NodeLivenessKey *key, int64 nodeId)
+{
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(NodeLivenessKey));
+
+	key->databaseId = MyDatabaseId;
+	key->nodeId = nodeId;
+}
+
+
+/*
+ * last_report_time returns the last time the given node reported to the
+ * monitor, which might be more recent than the node's reporttime column.
+ */
+Datum
+last_report_time(PG_FUNCTION_ARGS)
+{
+	int64 nodeId = PG_GETARG_INT64(0);
+
+	AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+	if (node == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_TIMESTAMPTZ(node->reportTime);
+}
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_liveness.h
+ *
+ * Declarations for the shared memory tracking of node report times.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+#include "group_state_machine.h"
+#include "node_metadata.h"
+
+
+/* GUC variable */
+extern int NodeReportPersistInterval;
+
+
+/* public function declarations */
+extern void InitializeNodeLiveness(void);
+extern size_t NodeLivenessShmemSize(void);
+extern bool NodeLivenessSkipReport(AutoFailoverNode *node,
+								   AutoFailoverNodeState *report);
+extern void NodeLivenessReportPersisted(AutoFailoverNode *node,
+										AutoFailoverNodeState *report);
+extern void NodeLivenessApply(int64 nodeId,
+							  TimestampTz *reportTime,
+							  TimestampTz *walReportTime);
+extern void NodeLivenessApplyNode(AutoFailoverNode *node);
@@ -21,6 +21,9 @@
 
 #include "health_check.h"
 #include "metadata.h"
+#include "node_cache.h"
+#include "node_heartbeat.h"
+#include "node_liveness.h"
 #include "node_metadata.h"
 #include "notifications.h"
 
@@ -28,12 +31,17 @@
 #include "access/heapam.h"
 #include "access/htup.h"
 #include "access/htup_details.h"
+#include "access/skey.h"
 #include "access/tupdesc.h"
 #include "access/xact.h"
 #include "access/xlogdefs.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_extension.h"
+#include "catalog/pg_index.h"
 #include "catalog/pg_type.h"
 #include "commands/sequence.h"
 #include "executor/spi.h"
@@ -45,6 +53,7 @@
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/snapmgr.h"
 #include "utils/syscache.h"
 
 
@@ -52,6 +61,38 @@
 int DrainTimeoutMs = 30 * 1000;
 int UnhealthyTimeoutMs = 20 * 1000;
 int StartupGracePeriodMs = 10 * 1000;
+int SyncStandbyLatencyMarginMs = 0;
+int SyncRepStallThresholdMs = 10 * 1000;
+
+
+static List * LoadAutoFailoverNodes(char *formationId, int groupId);
+static void ApplyNodeLivenessList(List *nodeList);
+static bool ScanAutoFailoverNodes(const AttrNumber *indexColumns,
+								  int indexColumnCount,
+								  ScanKeyData *scanKeys, int scanKeyCount,
+								  List **nodeList);
+static Oid NodeTableIndexId(Relation nodeRelation,
+							const AttrNumber *indexColumns,
+							int indexColumnCount);
+
+
+/*
+ * The btree indexes of the node table that we scan directly, by column.
+ */
+static const AttrNumber NodeIdIndexColumns[] = {
+	Anum_pgautofailover_node_nodeid
+};
+
+static const AttrNumber NodeHostPortIndexColumns[] = {
+	Anum_pgautofailover_node_nodehost,
+	Anum_pgautofailover_node_nodeport
+};
+
+static const AttrNumber NodeGroupIndexColumns[] = {
+	Anum_pgautofailover_node_formationid,
+	Anum_pgautofailover_node_groupid,
+	Anum_pgautofailover_node_nodeid
+};
 
 
 /*
@@ -60,23 +101,82 @@ int StartupGracePeriodMs = 10 * 1000;
  */
 List *
 AllAutoFailoverNodes(char *formationId)
+{
+	return LoadAutoFailoverNodes(formationId, NODE_CACHE_ALL_GROUPS);
+}
+
+
+/*
+ * LoadAutoFailoverNodes returns all the nodes in the given formation and
+ * group, including nodes that are currently being dropped, or all the nodes
+ * in the formation when groupId is NODE_CACHE_ALL_GROUPS. The nodes are read
+ * from the shared node cache when possible, and from the node table
+ * otherwise.
+ */
+static List *
+LoadAutoFailoverNodes(char *formationId, int groupId)
 {
 	List *nodeList = NIL;
+	NodeCacheTicket ticket = { 0 };
 	MemoryContext callerContext = CurrentMemoryContext;
 
+	if (NodeCacheLookup(formationId, groupId, &nodeList, &ticket))
+	{
+		ApplyNodeLivenessList(nodeList);
+		return nodeList;
+	}
+
+	ScanKeyData scanKeys[2];
+
+	/* text comparisons need a collation, the one of the node table columns */
+	ScanKeyEntryInitialize(&scanKeys[0], 0, Anum_pgautofailover_node_formationid,
+						   BTEqualStrategyNumber, InvalidOid,
+						   DEFAULT_COLLATION_OID, F_TEXTEQ,
+						   CStringGetTextDatum(formationId));
+
+	ScanKeyInit(&scanKeys[1], Anum_pgautofailover_node_groupid,
+				BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(groupId));
+
+	if (ScanAutoFailoverNodes(NodeGroupIndexColumns,
+							  lengthof(NodeGroupIndexColumns),
+							  scanKeys,
+							  groupId == NODE_CACHE_ALL_GROUPS ? 1 : 2,
+							  &nodeList))
+	{
+		/* the cache keeps the report times as found in the node table */
+		NodeCacheStore(formationId, groupId, nodeList, &ticket);
+
+		ApplyNodeLivenessList(nodeList);
+
+		return nodeList;
+	}
+
 	Oid argTypes[] = {
-		TEXTOID /* formationid */
+		TEXTOID, /* formationid */
+		INT4OID  /* groupid */
 	};
 
 	Datum argValues[] = {
-		CStringGetTextDatum(formationId)  /* formationid */
+		CStringGetTextDatum(formationId), /* formationid */
+		Int32GetDatum(groupId)            /* groupid */
 	};
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+	int argCount = sizeof(argValues) / sizeof(argValues[0]);
 	uint64 rowNumber = 0;
 
 	const char *selectQuery =
 		SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE
-		" WHERE formationid = $1 ";
+		"    WHERE formationid = $1 AND groupid = $2"
+		" ORDER BY nodeid";
+
+	if (groupId == NODE_CACHE_ALL_GROUPS)
+	{
+		selectQuery =
+			SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE
+			" WHERE formationid = $1 ";
+
+		argCount = 1;
+	}
 
 	SPI_connect();
 
@@ -102,10 +202,162 @@ AllAutoFailoverNodes(char *formationId)
 
 	SPI_finish();
 
+	/* the cache keeps the report times as found in the node table */
+	NodeCacheStore(formationId, groupId, nodeList, &ticket);
+
+	ApplyNodeLivenessList(nodeList);
+
 	return nodeList;
 }
 
 
+/*
+ * ApplyNodeLivenessList replaces the report times and LSNs of the given nodes
+ * with the ones kept in shared memory, see node_liveness.c.
+ */
+static void
+ApplyNodeLivenessList(List *nodeList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		NodeLivenessApplyNode(node);
+	}
+}
+
+
+/*
+ * ScanAutoFailoverNodes appends to nodeList the nodes found with an index
+ * scan of the node table, using the btree index that has exactly the given
+ * columns and the given scan keys, which use the node table attribute
+ * numbers. The nodes come in the index order.
+ *
+ * We return false when the node table has no such index, or when its columns
+ * are not the ones we expect (say a column was added and then dropped by an
+ * extension upgrade), and then the caller uses an SPI query instead.
+ */
+static bool
+ScanAutoFailoverNodes(const AttrNumber *indexColumns, int indexColumnCount,
+					  ScanKeyData *scanKeys, int scanKeyCount,
+					  List **nodeList)
+{
+	Oid nodeRelationId = pgAutoFailoverRelationId("node");
+	Relation nodeRelation = heap_open(nodeRelationId, AccessShareLock);
+	TupleDesc tupleDescriptor = RelationGetDescr(nodeRelation);
+
+	Oid indexId = InvalidOid;
+
+	if (tupleDescriptor->natts == Natts_pgautofailover_node)
+	{
+		indexId = NodeTableIndexId(nodeRelation, indexColumns, indexColumnCount);
+	}
+
+	if (!OidIsValid(indexId))
+	{
+		heap_close(nodeRelation, AccessShareLock);
+		return false;
+	}
+
+	/* see the changes made so far, as SPI_execute() would */
+	CommandCounterIncrement();
+
+	Snapshot snapshot = RegisterSnapshot(GetTransactionSnapshot());
+
+	SysScanDesc scanDescriptor =
+		systable_beginscan(nodeRelation, indexId, true,
+						   snapshot, scanKeyCount, scanKeys);
+
+	HeapTuple heapTuple = NULL;
+
+	while (HeapTupleIsValid(heapTuple = systable_getnext(scanDescriptor)))
+	{
+		AutoFailoverNode *node =
+			TupleToAutoFailoverNode(tupleDescriptor, heapTuple);
+
+		*nodeList = lappend(*nodeList, node);
+	}
+
+	systable_endscan(scanDescriptor);
+	UnregisterSnapshot(snapshot);
+
+	heap_close(nodeRelation, AccessShareLock);
+
+	return true;
+}
+
+
+/*
+ * NodeTableIndexId returns the OID of the btree index of the node table that
+ * has exactly the given columns, or InvalidOid. We don't look indexes up by
+ * name, because the names of the constraint indexes depend on the upgrade
+ * path of the extension.
+ */
+static Oid
+NodeTableIndexId(Relation nodeRelation,
+				 const AttrNumber *indexColumns, int indexColumnCount)
+{
+	ListCell *indexCell = NULL;
+	Oid foundIndexId = InvalidOid;
+	List *indexList = RelationGetIndexList(nodeRelation);
+
+	foreach(indexCell, indexList)
+	{
+		Oid indexId = lfirst_oid(indexCell);
+
+		HeapTuple indexTuple = SearchSysCache1(INDEXRELID,
+											   ObjectIdGetDatum(indexId));
+
+		if (!HeapTupleIsValid(indexTuple))
+		{
+			continue;
+		}
+
+		Form_pg_index indexForm = (Form_pg_index) GETSTRUCT(indexTuple);
+		bool matches = indexForm->indnatts == indexColumnCount &&
+					   indexForm->indisvalid &&
+					   heap_attisnull(indexTuple, Anum_pg_index_indpred, NULL);
+
+		for (int column = 0; matches && column < indexColumnCount; column++)
+		{
+			matches = indexForm->indkey.values[column] == indexColumns[column];
+		}
+
+		ReleaseSysCache(indexTuple);
+
+		if (!matches)
+		{
+			continue;
+		}
+
+		HeapTuple classTuple = SearchSysCache1(RELOID, ObjectIdGetDatum(indexId));
+
+		if (HeapTupleIsValid(classTuple))
+		{
+			Form_pg_class classForm = (Form_pg_class) GETSTRUCT(classTuple);
+
+			if (classForm->relam == BTREE_AM_OID)
+			{
+				foundIndexId = indexId;
+			}
+
+			ReleaseSysCache(classTuple);
+		}
+
+		if (OidIsValid(foundIndexId))
+		{
+			break;
+		}
+	}
+
+	list_free(indexList);
+
+	return foundIndexId;
+}
+
+
 /*
  * TupleToAutoFailoverNode constructs a AutoFailoverNode from a heap tuple.
  */
@@ -168,6 +420,18 @@ TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 	Datum nodeCluster = heap_getattr(heapTuple,
 									 Anum_pgautofailover_node_nodecluster,
 									 tupleDescriptor, &isNull);
+	bool upstreamNodeIdIsNull = false;
+	Datum upstreamNodeId = heap_getattr(heapTuple,
+										Anum_pgautofailover_node_upstreamnodeid,
+										tupleDescriptor, &upstreamNodeIdIsNull);
+	Datum reportedReplayLSN =
+		heap_getattr(heapTuple, Anum_pgautofailover_node_reportedreplaylsn,
+					 tupleDescriptor, &isNull);
+	Datum reportedApplyRate =
+		heap_getattr(heapTuple, Anum_pgautofailover_node_reportedapplyrate,
+					 tupleDescriptor, &isNull);
+	Datum nodeZone = heap_getattr(heapTuple, Anum_pgautofailover_node_nodezone,
+								  tupleDescriptor, &isNull);
 
 	Oid goalStateOid = DatumGetObjectId(goalState);
 	Oid reportedStateOid = DatumGetObjectId(reportedState);
@@ -200,6 +464,13 @@ TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 	pgAutoFailoverNode->replicationQuorum = DatumGetBool(replicationQuorum);
 	pgAutoFailoverNode->nodeCluster = TextDatumGetCString(nodeCluster);
 
+	pgAutoFailoverNode->upstreamNodeId =
+		upstreamNodeIdIsNull ? 0 : DatumGetInt64(upstreamNodeId);
+
+	pgAutoFailoverNode->reportedReplayLSN = DatumGetLSN(reportedReplayLSN);
+	pgAutoFailoverNode->reportedApplyRate = DatumGetInt64(reportedApplyRate);
+	pgAutoFailoverNode->nodeZone = TextDatumGetCString(nodeZone);
+
 	return pgAutoFailoverNode;
 }
 
@@ -211,51 +482,20 @@ TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 List *
 AutoFailoverNodeGroup(char *formationId, int groupId)
 {
+	ListCell *nodeCell = NULL;
 	List *nodeList = NIL;
-	MemoryContext callerContext = CurrentMemoryContext;
-
-	Oid argTypes[] = {
-		TEXTOID, /* formationid */
-		INT4OID  /* groupid */
-	};
-
-	Datum argValues[] = {
-		CStringGetTextDatum(formationId), /* formationid */
-		Int32GetDatum(groupId)            /* groupid */
-	};
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	uint64 rowNumber = 0;
-
-	const char *selectQuery =
-		SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE
-		"    WHERE formationid = $1 AND groupid = $2"
-		"      AND goalstate <> 'dropped'"
-		" ORDER BY nodeid";
-
-	SPI_connect();
-
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 0);
-	if (spiStatus != SPI_OK_SELECT)
-	{
-		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
-	}
-
-	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+	List *allNodesList = LoadAutoFailoverNodes(formationId, groupId);
 
-	for (rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	foreach(nodeCell, allNodesList)
 	{
-		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
-		AutoFailoverNode *pgAutoFailoverNode =
-			TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
 
-		nodeList = lappend(nodeList, pgAutoFailoverNode);
+		if (node->goalState != REPLICATION_STATE_DROPPED)
+		{
+			nodeList = lappend(nodeList, node);
+		}
 	}
 
-	MemoryContextSwitchTo(spiContext);
-
-	SPI_finish();
-
 	return nodeList;
 }
 
@@ -267,51 +507,7 @@ AutoFailoverNodeGroup(char *formationId, int groupId)
 List *
 AutoFailoverAllNodesInGroup(char *formationId, int groupId)
 {
-	List *nodeList = NIL;
-	MemoryContext callerContext = CurrentMemoryContext;
-
-	Oid argTypes[] = {
-		TEXTOID, /* formationid */
-		INT4OID  /* groupid */
-	};
-
-	Datum argValues[] = {
-		CStringGetTextDatum(formationId), /* formationid */
-		Int32GetDatum(groupId)            /* groupid */
-	};
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	uint64 rowNumber = 0;
-
-	const char *selectQuery =
-		SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE
-		"    WHERE formationid = $1 AND groupid = $2"
-		" ORDER BY nodeid";
-
-	SPI_connect();
-
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 0);
-	if (spiStatus != SPI_OK_SELECT)
-	{
-		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
-	}
-
-	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
-
-	for (rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
-	{
-		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
-		AutoFailoverNode *pgAutoFailoverNode =
-			TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
-
-		nodeList = lappend(nodeList, pgAutoFailoverNode);
-	}
-
-	MemoryContextSwitchTo(spiContext);
-
-	SPI_finish();
-
-	return nodeList;
+	return LoadAutoFailoverNodes(formationId, groupId);
 }
 
 
@@ -654,6 +850,84 @@ FindCandidateNodeBeingPromoted(List *groupNodeList)
 }
 
 
+/*
+ * FindCascadingUpstreamNode returns the standby node that the given node
+ * streams from, or NULL when the node streams from the primary.
+ *
+ * A node that has an upstream node set only streams from it when both nodes
+ * are currently secondary nodes. In all the other cases, including failover
+ * and when the upstream node has been assigned catchingup after failing its
+ * health checks, the node follows the primary node again.
+ *
+ * We only look at the goal and reported states here, because changes of
+ * those bump the group version, which is how keepers learn that they might
+ * have to re-parent.
+ */
+AutoFailoverNode *
+FindCascadingUpstreamNode(List *groupNodeList, AutoFailoverNode *node)
+{
+	if (node->upstreamNodeId == 0 ||
+		!IsCurrentState(node, REPLICATION_STATE_SECONDARY))
+	{
+		return NULL;
+	}
+
+	AutoFailoverNode *upstreamNode =
+		FindNodeInListById(groupNodeList, node->upstreamNodeId);
+
+	if (upstreamNode == NULL ||
+		!IsCurrentState(upstreamNode, REPLICATION_STATE_SECONDARY))
+	{
+		return NULL;
+	}
+
+	/*
+	 * set_node_upstream() refuses to create loops, still we never want to
+	 * have a set of standby nodes that only stream from each other.
+	 */
+	AutoFailoverNode *current = upstreamNode;
+
+	for (int depth = 0;
+		 current != NULL && depth < list_length(groupNodeList);
+		 depth++)
+	{
+		if (current->upstreamNodeId == node->nodeId)
+		{
+			return NULL;
+		}
+
+		current = current->upstreamNodeId == 0
+				  ? NULL
+				  : FindNodeInListById(groupNodeList, current->upstreamNodeId);
+	}
+
+	return upstreamNode;
+}
+
+
+/*
+ * FindNodeInListById returns the node with the given nodeId in the given
+ * groupNodeList, or NULL.
+ */
+AutoFailoverNode *
+FindNodeInListById(List *groupNodeList, int64 nodeId)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->nodeId == nodeId)
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+
 /*
  * pgautofailover_node_candidate_priority_compare
  *	  qsort comparator for sorting node lists by candidate priority
@@ -724,63 +998,18 @@ GroupListCandidates(List *groupNodeList)
 
 
 /*
- * pgautofailover_node_reportedlsn_compare
- *	  qsort comparator for sorting node lists by reported lsn, descending
+ * ListMostAdvancedStandbyNodes returns the nodes in groupNodeList that have
+ * the most advanced LSN, on the most recent timeline, skipping the old
+ * primary. We find them in a single pass over the group, without sorting it.
  */
-#if (PG_VERSION_NUM >= 130000)
-static int
-pgautofailover_node_reportedlsn_compare(const union ListCell *a,
-										const union ListCell *b)
-{
-	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(a);
-	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(b);
-#else
-static int
-pgautofailover_node_reportedlsn_compare(const void *a, const void *b)
-{
-	AutoFailoverNode *node1 = (AutoFailoverNode *) lfirst(*(ListCell **) a);
-	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(*(ListCell **) b);
-#endif
-
-	if (node1->reportedTLI > node2->reportedTLI ||
-		(node1->reportedTLI == node2->reportedTLI &&
-		 node1->reportedLSN > node2->reportedLSN))
-	{
-		return -1;
-	}
-
-	if (node1->reportedTLI < node2->reportedTLI ||
-		(node1->reportedTLI == node2->reportedTLI &&
-		 node1->reportedLSN < node2->reportedLSN))
-	{
-		return 1;
-	}
-
-	return 0;
-}
-
-
-/*
- * ListMostAdvancedStandbyNodes returns the nodes in groupNodeList that have
- * the most advanced LSN.
- */
-List *
-ListMostAdvancedStandbyNodes(List *groupNodeList)
+List *
+ListMostAdvancedStandbyNodes(List *groupNodeList)
 {
 	ListCell *nodeCell = NULL;
 	List *mostAdvancedNodeList = NIL;
-	XLogRecPtr mostAdvancedLSN = 0;
-
-	#if (PG_VERSION_NUM >= 130000)
-	List *sortedNodeList = list_copy(groupNodeList);
-	list_sort(sortedNodeList, pgautofailover_node_reportedlsn_compare);
-	#else
-	List *sortedNodeList =
-		list_qsort(groupNodeList,
-				   pgautofailover_node_reportedlsn_compare);
-	#endif
+	AutoFailoverNode *mostAdvancedNode = NULL;
 
-	foreach(nodeCell, sortedNodeList)
+	foreach(nodeCell, groupNodeList)
 	{
 		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
 
@@ -790,12 +1019,17 @@ ListMostAdvancedStandbyNodes(List *groupNodeList)
 			continue;
 		}
 
-		if (mostAdvancedLSN == 0)
+		if (mostAdvancedNode == NULL ||
+			node->reportedTLI > mostAdvancedNode->reportedTLI ||
+			(node->reportedTLI == mostAdvancedNode->reportedTLI &&
+			 node->reportedLSN > mostAdvancedNode->reportedLSN))
 		{
-			mostAdvancedLSN = node->reportedLSN;
+			/* a new most advanced node, forget about the previous ones */
+			mostAdvancedNode = node;
+			mostAdvancedNodeList = list_make1(node);
 		}
-
-		if (node->reportedLSN == mostAdvancedLSN)
+		else if (node->reportedTLI == mostAdvancedNode->reportedTLI &&
+				 node->reportedLSN == mostAdvancedNode->reportedLSN)
 		{
 			mostAdvancedNodeList = lappend(mostAdvancedNodeList, node);
 		}
@@ -845,6 +1079,33 @@ GroupListSyncStandbys(List *groupNodeList)
 }
 
 
+/*
+ * GetPromotionTarget returns the node of groupNodeList that perform_promotion
+ * is waiting for before it starts the failover, or NULL. That's a secondary
+ * node in the replication quorum which candidate priority has been
+ * incremented past MAX_USER_DEFINED_CANDIDATE_PRIORITY.
+ */
+AutoFailoverNode *
+GetPromotionTarget(List *groupNodeList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->candidatePriority > MAX_USER_DEFINED_CANDIDATE_PRIORITY &&
+			node->replicationQuorum &&
+			IsCurrentState(node, REPLICATION_STATE_SECONDARY))
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+
 /*
  * CountSyncStandbys returns how many standby nodes have their
  * replicationQuorum property set to true in the given groupNodeList.
@@ -944,6 +1205,28 @@ GetAutoFailoverNode(char *nodeHost, int nodePort)
 {
 	AutoFailoverNode *pgAutoFailoverNode = NULL;
 	MemoryContext callerContext = CurrentMemoryContext;
+	List *nodeList = NIL;
+	ScanKeyData scanKeys[2];
+
+	/* text comparisons need a collation, the one of the node table columns */
+	ScanKeyEntryInitialize(&scanKeys[0], 0, Anum_pgautofailover_node_nodehost,
+						   BTEqualStrategyNumber, InvalidOid,
+						   DEFAULT_COLLATION_OID, F_TEXTEQ,
+						   CStringGetTextDatum(nodeHost));
+
+	ScanKeyInit(&scanKeys[1], Anum_pgautofailover_node_nodeport,
+				BTEqualStrategyNumber, F_INT4EQ,
+				Int32GetDatum(nodePort));
+
+	if (ScanAutoFailoverNodes(NodeHostPortIndexColumns,
+							  lengthof(NodeHostPortIndexColumns),
+							  scanKeys, lengthof(scanKeys),
+							  &nodeList))
+	{
+		ApplyNodeLivenessList(nodeList);
+
+		return list_length(nodeList) > 0 ? linitial(nodeList) : NULL;
+	}
 
 	Oid argTypes[] = {
 		TEXTOID, /* nodehost */
@@ -975,6 +1258,8 @@ GetAutoFailoverNode(char *nodeHost, int nodePort)
 		pgAutoFailoverNode = TupleToAutoFailoverNode(SPI_tuptable->tupdesc,
 													 SPI_tuptable->vals[0]);
 		MemoryContextSwitchTo(spiContext);
+
+		NodeLivenessApplyNode(pgAutoFailoverNode);
 	}
 	else
 	{
@@ -998,6 +1283,22 @@ GetAutoFailoverNodeById(int64 nodeId)
 {
 	AutoFailoverNode *pgAutoFailoverNode = NULL;
 	MemoryContext callerContext = CurrentMemoryContext;
+	List *nodeList = NIL;
+	ScanKeyData scanKeys[1];
+
+	ScanKeyInit(&scanKeys[0], Anum_pgautofailover_node_nodeid,
+				BTEqualStrategyNumber, F_INT8EQ,
+				Int64GetDatum(nodeId));
+
+	if (ScanAutoFailoverNodes(NodeIdIndexColumns,
+							  lengthof(NodeIdIndexColumns),
+							  scanKeys, lengthof(scanKeys),
+							  &nodeList))
+	{
+		ApplyNodeLivenessList(nodeList);
+
+		return list_length(nodeList) > 0 ? linitial(nodeList) : NULL;
+	}
 
 	Oid argTypes[] = {
 		INT8OID  /* nodeId */
@@ -1028,6 +1329,8 @@ GetAutoFailoverNodeById(int64 nodeId)
 		pgAutoFailoverNode = TupleToAutoFailoverNode(SPI_tuptable->tupdesc,
 													 SPI_tuptable->vals[0]);
 		MemoryContextSwitchTo(spiContext);
+
+		NodeLivenessApplyNode(pgAutoFailoverNode);
 	}
 	else
 	{
@@ -1080,6 +1383,8 @@ GetAutoFailoverNodeByName(char *formationId, char *nodeName)
 		pgAutoFailoverNode = TupleToAutoFailoverNode(SPI_tuptable->tupdesc,
 													 SPI_tuptable->vals[0]);
 		MemoryContextSwitchTo(spiContext);
+
+		NodeLivenessApplyNode(pgAutoFailoverNode);
 	}
 	else
 	{
@@ -1323,7 +1628,9 @@ ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 							ReplicationState reportedState,
 							bool pgIsRunning, SyncState pgSyncState,
 							int reportedTLI,
-							XLogRecPtr reportedLSN)
+							XLogRecPtr reportedLSN,
+							XLogRecPtr reportedReplayLSN,
+							int64 reportedApplyRate)
 {
 	Oid reportedStateOid = ReplicationStateGetEnum(reportedState);
 	Oid replicationStateTypeOid = ReplicationStateTypeOid();
@@ -1335,7 +1642,9 @@ ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 		INT4OID,                 /* reportedtli */
 		LSNOID,                  /* reportedlsn */
 		TEXTOID,                 /* nodehost */
-		INT4OID                  /* nodeport */
+		INT4OID,                 /* nodeport */
+		LSNOID,                  /* reportedreplaylsn */
+		INT8OID                  /* reportedapplyrate */
 	};
 
 	Datum argValues[] = {
@@ -1345,7 +1654,9 @@ ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 		Int32GetDatum(reportedTLI),                          /* reportedtli */
 		LSNGetDatum(reportedLSN),             /* reportedlsn */
 		CStringGetTextDatum(nodeHost),        /* nodehost */
-		Int32GetDatum(nodePort)               /* nodeport */
+		Int32GetDatum(nodePort),              /* nodeport */
+		LSNGetDatum(reportedReplayLSN),       /* reportedreplaylsn */
+		Int64GetDatum(reportedApplyRate)      /* reportedapplyrate */
 	};
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
@@ -1356,6 +1667,7 @@ ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 		"reportedtli = CASE $4 WHEN 0 THEN reportedtli ELSE $4 END, "
 		"reportedlsn = CASE $5 WHEN '0/0'::pg_lsn THEN reportedlsn ELSE $5 END, "
 		"walreporttime = CASE $5 WHEN '0/0'::pg_lsn THEN walreporttime ELSE now() END, "
+		"reportedreplaylsn = $8, reportedapplyrate = $9, "
 		"statechangetime = CASE WHEN reportedstate <> $1 THEN now() ELSE statechangetime END "
 		"WHERE nodehost = $6 AND nodeport = $7";
 
@@ -1472,6 +1784,529 @@ ReportAutoFailoverNodeReplicationSetting(int64 nodeid,
 }
 
 
+/*
+ * GetReportedFlushLag returns the flush lag of the given standby node, in
+ * milliseconds, as last reported by the primary of its group. It returns -1
+ * when the lag is unknown, or when it has not been reported in the last
+ * minute.
+ */
+int64
+GetReportedFlushLag(int64 nodeId)
+{
+	int64 flushLag = -1;
+
+	Oid argTypes[] = {
+		INT8OID                  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)    /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT flushlag FROM " AUTO_FAILOVER_REPLICATION_REPORT_TABLE
+		" WHERE nodeid = $1 AND flushlag IS NOT NULL"
+		"   AND reportedat > now() - interval '1 min'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_REPLICATION_REPORT_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum flushLagDatum = SPI_getbinval(SPI_tuptable->vals[0],
+											SPI_tuptable->tupdesc,
+											1, &isNull);
+
+		if (!isNull)
+		{
+			flushLag = DatumGetInt64(flushLagDatum);
+		}
+	}
+
+	SPI_finish();
+
+	return flushLag;
+}
+
+
+/*
+ * GetReportedHostCapacity sets the number of CPUs and the memory of the host
+ * of the given node, as last reported by its keeper, and returns true. It
+ * returns false when the node has not reported its resources in the last 5
+ * minutes, keepers report them every 30 seconds.
+ */
+bool
+GetReportedHostCapacity(int64 nodeId, int *ncpu, int64 *totalram)
+{
+	bool found = false;
+
+	Oid argTypes[] = {
+		INT8OID                  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)    /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT ncpu, totalram FROM " AUTO_FAILOVER_NODE_RESOURCES_TABLE
+		" WHERE nodeid = $1 AND ncpu > 0 AND totalram > 0"
+		"   AND reportedat > now() - interval '5 min'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_NODE_RESOURCES_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool ncpuIsNull = false;
+		bool totalramIsNull = false;
+
+		Datum ncpuDatum = SPI_getbinval(SPI_tuptable->vals[0],
+										SPI_tuptable->tupdesc,
+										1, &ncpuIsNull);
+		Datum totalramDatum = SPI_getbinval(SPI_tuptable->vals[0],
+											SPI_tuptable->tupdesc,
+											2, &totalramIsNull);
+
+		if (!ncpuIsNull && !totalramIsNull)
+		{
+			*ncpu = DatumGetInt32(ncpuDatum);
+			*totalram = DatumGetInt64(totalramDatum);
+			found = true;
+		}
+	}
+
+	SPI_finish();
+
+	return found;
+}
+
+
+/*
+ * GetReportedWalRate sets how many bytes of WAL per second the given node
+ * writes, or receives when it's a standby, as last reported by its keeper
+ * along with its host resources, and returns true. It returns false when the
+ * node has not reported its resources in the last 5 minutes.
+ */
+bool
+GetReportedWalRate(int64 nodeId, int64 *walRate)
+{
+	bool found = false;
+
+	Oid argTypes[] = {
+		INT8OID                  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)    /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT walrate FROM " AUTO_FAILOVER_NODE_RESOURCES_TABLE
+		" WHERE nodeid = $1"
+		"   AND reportedat > now() - interval '5 min'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_NODE_RESOURCES_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool walRateIsNull = false;
+
+		Datum walRateDatum = SPI_getbinval(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc,
+										   1, &walRateIsNull);
+
+		if (!walRateIsNull)
+		{
+			*walRate = DatumGetInt64(walRateDatum);
+			found = true;
+		}
+	}
+
+	SPI_finish();
+
+	return found;
+}
+
+
+/*
+ * IsStreamingLost returns true when the primary of the group of the given
+ * standby node has been reporting for more than timeoutMs milliseconds that
+ * the node has a replication slot but no walsender, see
+ * set_replication_report. It always returns false when timeoutMs is zero.
+ */
+bool
+IsStreamingLost(AutoFailoverNode *node, int timeoutMs)
+{
+	if (node == NULL || timeoutMs <= 0)
+	{
+		return false;
+	}
+
+	Oid argTypes[] = {
+		INT8OID,                 /* nodeid */
+		INT4OID                  /* timeout in milliseconds */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(node->nodeId),  /* nodeid */
+		Int32GetDatum(timeoutMs)      /* timeout in milliseconds */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT 1 FROM " AUTO_FAILOVER_REPLICATION_REPORT_TABLE " AS report"
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " AS standby"
+		"    ON standby.nodeid = report.nodeid"
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " AS reporter"
+		"    ON reporter.nodeid = report.reportedby"
+		"   AND reporter.formationid = standby.formationid"
+		"   AND reporter.groupid = standby.groupid"
+		" WHERE report.nodeid = $1"
+		"   AND reporter.goalstate IN ('primary', 'wait_primary')"
+		"   AND report.reportedat > now() - interval '1 min'"
+		"   AND report.disconnectedat <= now() - $2 * interval '1 ms'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_REPLICATION_REPORT_TABLE);
+	}
+
+	bool streamingLost = SPI_processed > 0;
+
+	SPI_finish();
+
+	return streamingLost;
+}
+
+
+/*
+ * GroupStreamingLostNodes returns the nodes of the given group node list for
+ * which IsStreamingLost would return true with the same timeoutMs, using a
+ * single query for the whole group rather than one query per node.
+ */
+List *
+GroupStreamingLostNodes(char *formationId, int groupId,
+						List *groupNodeList, int timeoutMs)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	List *lostNodesList = NIL;
+
+	if (timeoutMs <= 0 || groupNodeList == NIL)
+	{
+		return NIL;
+	}
+
+	Oid argTypes[] = {
+		TEXTOID,                 /* formationid */
+		INT4OID,                 /* groupid */
+		INT4OID                  /* timeout in milliseconds */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(formationId), /* formationid */
+		Int32GetDatum(groupId),           /* groupid */
+		Int32GetDatum(timeoutMs)          /* timeout in milliseconds */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT report.nodeid"
+		"  FROM " AUTO_FAILOVER_REPLICATION_REPORT_TABLE " AS report"
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " AS standby"
+		"    ON standby.nodeid = report.nodeid"
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " AS reporter"
+		"    ON reporter.nodeid = report.reportedby"
+		"   AND reporter.formationid = standby.formationid"
+		"   AND reporter.groupid = standby.groupid"
+		" WHERE standby.formationid = $1"
+		"   AND standby.groupid = $2"
+		"   AND reporter.goalstate IN ('primary', 'wait_primary')"
+		"   AND report.reportedat > now() - interval '1 min'"
+		"   AND report.disconnectedat <= now() - $3 * interval '1 ms'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_REPLICATION_REPORT_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		bool isNull = false;
+
+		Datum nodeIdDatum = SPI_getbinval(SPI_tuptable->vals[rowNumber],
+										  SPI_tuptable->tupdesc,
+										  1, &isNull);
+
+		AutoFailoverNode *node =
+			FindNodeInListById(groupNodeList, DatumGetInt64(nodeIdDatum));
+
+		if (node != NULL && !list_member_ptr(lostNodesList, node))
+		{
+			MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+			lostNodesList = lappend(lostNodesList, node);
+			MemoryContextSwitchTo(spiContext);
+		}
+	}
+
+	SPI_finish();
+
+	return lostNodesList;
+}
+
+
+/*
+ * ReportSyncRepWaits saves how many backends of the given primary node are
+ * waiting for synchronous replication, and for how long the oldest of them
+ * has been waiting. A wait longer than stallThresholdMs is a stall: we count
+ * stalls and return true when this report starts a new one. We also keep the
+ * longest wait ever reported, so that tuning number_sync_standbys can be
+ * based on actual data.
+ */
+bool
+ReportSyncRepWaits(int64 nodeId, int waiting, int64 oldestWaitMs,
+				   int stallThresholdMs)
+{
+	bool newStall = false;
+
+	Oid argTypes[] = {
+		INT8OID,                 /* nodeid */
+		INT4OID,                 /* waiting */
+		INT8OID,                 /* oldestwaitms */
+		INT4OID                  /* stall threshold in milliseconds */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId),         /* nodeid */
+		Int32GetDatum(waiting),        /* waiting */
+		Int64GetDatum(oldestWaitMs),   /* oldestwaitms */
+		Int32GetDatum(stallThresholdMs) /* stall threshold in milliseconds */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *upsertQuery =
+		"WITH previous AS ("
+		"  SELECT stalledsince FROM " AUTO_FAILOVER_NODE_SYNC_REP_WAITS_TABLE
+		"   WHERE nodeid = $1"
+		"), saved AS ("
+		"  INSERT INTO " AUTO_FAILOVER_NODE_SYNC_REP_WAITS_TABLE " AS current"
+		"         (nodeid, waiting, oldestwaitms, maxwaitms, stalls, stalledsince)"
+		"  VALUES ($1, $2, $3, $3,"
+		"          CASE WHEN $4 > 0 AND $3 >= $4 THEN 1 ELSE 0 END,"
+		"          CASE WHEN $4 > 0 AND $3 >= $4 THEN now() END)"
+		"  ON CONFLICT (nodeid) DO UPDATE"
+		"     SET waiting = excluded.waiting,"
+		"         oldestwaitms = excluded.oldestwaitms,"
+		"         maxwaitms = greatest(current.maxwaitms, excluded.maxwaitms),"
+		"         stalls = current.stalls"
+		"                + CASE WHEN current.stalledsince IS NULL"
+		"                       THEN excluded.stalls ELSE 0 END,"
+		"         stalledsince = CASE WHEN excluded.stalledsince IS NOT NULL"
+		"                             THEN coalesce(current.stalledsince,"
+		"                                           excluded.stalledsince)"
+		"                         END,"
+		"         reportedat = now()"
+		"  RETURNING stalledsince"
+		")"
+		"SELECT (SELECT stalledsince FROM saved) IS NOT NULL"
+		"   AND (SELECT stalledsince FROM previous) IS NULL";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not update " AUTO_FAILOVER_NODE_SYNC_REP_WAITS_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum newStallDatum = SPI_getbinval(SPI_tuptable->vals[0],
+											SPI_tuptable->tupdesc,
+											1, &isNull);
+
+		newStall = !isNull && DatumGetBool(newStallDatum);
+	}
+
+	SPI_finish();
+
+	return newStall;
+}
+
+
+/*
+ * IsWarmingUp returns true when the keeper of the given node reported in the
+ * last 2 minutes that it's warming up after maintenance: it's still
+ * replaying the WAL it missed, or pre-warming its buffer cache. The keeper
+ * reports its warmup progress every few seconds, and clears it when done.
+ */
+bool
+IsWarmingUp(AutoFailoverNode *node)
+{
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	Oid argTypes[] = {
+		INT8OID                  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(node->nodeId)    /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT 1 FROM " AUTO_FAILOVER_NODE_PROGRESS_TABLE
+		" WHERE nodeid = $1 AND operation = 'warmup'"
+		"   AND reportedat > now() - interval '2 min'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_NODE_PROGRESS_TABLE);
+	}
+
+	bool warmingUp = SPI_processed > 0;
+
+	SPI_finish();
+
+	return warmingUp;
+}
+
+
+/*
+ * GroupWarmingUpNodes returns the nodes of the given group node list for
+ * which IsWarmingUp would return true, using a single query for the whole
+ * group rather than one query per node.
+ */
+List *
+GroupWarmingUpNodes(char *formationId, int groupId, List *groupNodeList)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	List *warmingUpNodesList = NIL;
+
+	if (groupNodeList == NIL)
+	{
+		return NIL;
+	}
+
+	Oid argTypes[] = {
+		TEXTOID,                 /* formationid */
+		INT4OID                  /* groupid */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(formationId), /* formationid */
+		Int32GetDatum(groupId)            /* groupid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT progress.nodeid"
+		"  FROM " AUTO_FAILOVER_NODE_PROGRESS_TABLE " AS progress"
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " AS node"
+		"    ON node.nodeid = progress.nodeid"
+		" WHERE node.formationid = $1"
+		"   AND node.groupid = $2"
+		"   AND progress.operation = 'warmup'"
+		"   AND progress.reportedat > now() - interval '2 min'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR,
+			 "could not select from " AUTO_FAILOVER_NODE_PROGRESS_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		bool isNull = false;
+
+		Datum nodeIdDatum = SPI_getbinval(SPI_tuptable->vals[rowNumber],
+										  SPI_tuptable->tupdesc,
+										  1, &isNull);
+
+		AutoFailoverNode *node =
+			FindNodeInListById(groupNodeList, DatumGetInt64(nodeIdDatum));
+
+		if (node != NULL)
+		{
+			MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+			warmingUpNodesList = lappend(warmingUpNodesList, node);
+			MemoryContextSwitchTo(spiContext);
+		}
+	}
+
+	SPI_finish();
+
+	return warmingUpNodesList;
+}
+
+
 /*
  * UpdateAutoFailoverNodeMetadata updates a node registration to a possibly new
  * nodeName, nodeHost, and nodePort. Those are NULL (or zero) when not changed.
@@ -1519,6 +2354,51 @@ UpdateAutoFailoverNodeMetadata(int64 nodeid,
 }
 
 
+/*
+ * SetAutoFailoverNodeUpstream sets the upstream node of the given node, or
+ * resets it when upstreamNodeId is zero.
+ *
+ * We use SPI to automatically handle triggers, function calls, etc.
+ */
+void
+SetAutoFailoverNodeUpstream(int64 nodeid, int64 upstreamNodeId)
+{
+	Oid argTypes[] = {
+		INT8OID,                 /* nodeid */
+		INT8OID                  /* upstreamnodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeid),                /* nodeid */
+		Int64GetDatum(upstreamNodeId)         /* upstreamnodeid */
+	};
+
+	char argNulls[] = {
+		' ',                                  /* nodeid */
+		upstreamNodeId == 0 ? 'n' : ' '       /* upstreamnodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *updateQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		" SET upstreamnodeid = $2 "
+		"WHERE nodeid = $1";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(updateQuery,
+										  argCount, argTypes, argValues,
+										  argNulls, false, 0);
+
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+	}
+
+	SPI_finish();
+}
+
+
 /*
  * RemoveAutoFailoverNode removes a node from a AutoFailover formation.
  *
@@ -1540,6 +2420,12 @@ RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode)
 		"DELETE FROM " AUTO_FAILOVER_NODE_TABLE
 		" WHERE nodeid = $1";
 
+	/* the nodes that used to stream from this one now use the primary */
+	const char *resetUpstreamQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		" SET upstreamnodeid = NULL "
+		"WHERE upstreamnodeid = $1";
+
 	SPI_connect();
 
 	int spiStatus = SPI_execute_with_args(deleteQuery,
@@ -1551,6 +2437,15 @@ RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode)
 		elog(ERROR, "could not delete from " AUTO_FAILOVER_NODE_TABLE);
 	}
 
+	spiStatus = SPI_execute_with_args(resetUpstreamQuery,
+									  argCount, argTypes, argValues,
+									  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+	}
+
 	SPI_finish();
 }
 
@@ -1924,8 +2819,9 @@ IsHealthy(AutoFailoverNode *pgAutoFailoverNode)
 
 /*
  * IsUnhealthy returns whether the given node is unhealthy, meaning it failed
- * its last health check and has not reported for more than UnhealthyTimeoutMs,
- * and it's PostgreSQL instance has been reporting as running by the keeper.
+ * its last health check and has not reported for more than its unhealthy
+ * timeout, see NodeUnhealthyTimeoutMs, and it's PostgreSQL instance has been
+ * reporting as running by the keeper.
  */
 bool
 IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
@@ -1940,7 +2836,7 @@ IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
 	/* if the keeper isn't reporting, trust our Health Checks */
 	if (TimestampDifferenceExceeds(pgAutoFailoverNode->reportTime,
 								   now,
-								   UnhealthyTimeoutMs))
+								   NodeUnhealthyTimeoutMs(pgAutoFailoverNode->nodeId)))
 	{
 		if (pgAutoFailoverNode->health == NODE_HEALTH_BAD &&
 			TimestampDifferenceExceeds(PgStartTime,
@@ -1971,8 +2867,8 @@ IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
 
 
 /*
- * IsReporting returns whether the given node has reported recently, within the
- * UnhealthyTimeoutMs interval.
+ * IsReporting returns whether the given node has reported recently, within its
+ * unhealthy timeout.
  */
 bool
 IsReporting(AutoFailoverNode *pgAutoFailoverNode)
@@ -1986,7 +2882,7 @@ IsReporting(AutoFailoverNode *pgAutoFailoverNode)
 
 	if (TimestampDifferenceExceeds(pgAutoFailoverNode->reportTime,
 								   now,
-								   UnhealthyTimeoutMs))
+								   NodeUnhealthyTimeoutMs(pgAutoFailoverNode->nodeId)))
 	{
 		return false;
 	}
@@ -1997,7 +2893,8 @@ IsReporting(AutoFailoverNode *pgAutoFailoverNode)
 
 /*
  * IsDrainTimeExpired returns whether the node should be done according
- * to the drain time-outs.
+ * to the drain time-outs. The expiry of a primary lease does not end the
+ * drain early, see primary_lease.c.
  */
 bool
 IsDrainTimeExpired(AutoFailoverNode *pgAutoFailoverNode)
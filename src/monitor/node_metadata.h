@@ -26,7 +26,7 @@
  * indices must match with the columns given
  * in the following definition.
  */
-#define Natts_pgautofailover_node 19
+#define Natts_pgautofailover_node 25
 #define Anum_pgautofailover_node_formationid 1
 #define Anum_pgautofailover_node_nodeid 2
 #define Anum_pgautofailover_node_groupid 3
@@ -48,6 +48,10 @@
 #define Anum_pgautofailover_node_candidate_priority 19
 #define Anum_pgautofailover_node_replication_quorum 20
 #define Anum_pgautofailover_node_nodecluster 21
+#define Anum_pgautofailover_node_upstreamnodeid 22
+#define Anum_pgautofailover_node_reportedreplaylsn 23
+#define Anum_pgautofailover_node_reportedapplyrate 24
+#define Anum_pgautofailover_node_nodezone 25
 
 #define AUTO_FAILOVER_NODE_TABLE_ALL_COLUMNS \
 	"formationid, " \
@@ -70,7 +74,11 @@
 	"statechangetime, " \
 	"candidatepriority, " \
 	"replicationquorum, " \
-	"nodecluster"
+	"nodecluster, " \
+	"upstreamnodeid, " \
+	"reportedreplaylsn, " \
+	"reportedapplyrate, " \
+	"nodezone"
 
 
 #define SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE \
@@ -133,6 +141,10 @@ typedef struct AutoFailoverNode
 	int candidatePriority;
 	bool replicationQuorum;
 	char *nodeCluster;
+	int64 upstreamNodeId;
+	XLogRecPtr reportedReplayLSN;
+	int64 reportedApplyRate;    /* bytes per second, zero when unknown */
+	char *nodeZone;             /* empty string when not set */
 } AutoFailoverNode;
 
 
@@ -167,6 +179,7 @@ extern AutoFailoverNode * FindFailoverNewStandbyNode(List *groupNodeList);
 extern List * GroupListCandidates(List *groupNodeList);
 extern List * ListMostAdvancedStandbyNodes(List *groupNodeList);
 extern List * GroupListSyncStandbys(List *groupNodeList);
+extern AutoFailoverNode * GetPromotionTarget(List *groupNodeList);
 extern bool AllNodesHaveSameCandidatePriority(List *groupNodeList);
 extern int CountSyncStandbys(List *groupNodeList);
 extern bool IsHealthySyncStandby(AutoFailoverNode *node);
@@ -175,6 +188,9 @@ extern int CountHealthyCandidates(List *groupNodeList);
 extern bool IsFailoverInProgress(List *groupNodeList);
 extern AutoFailoverNode * FindMostAdvancedStandby(List *groupNodeList);
 extern AutoFailoverNode * FindCandidateNodeBeingPromoted(List *groupNodeList);
+extern AutoFailoverNode * FindNodeInListById(List *groupNodeList, int64 nodeId);
+extern AutoFailoverNode * FindCascadingUpstreamNode(List *groupNodeList,
+													AutoFailoverNode *node);
 
 extern AutoFailoverNode * GetAutoFailoverNode(char *nodeHost, int nodePort);
 extern AutoFailoverNode * GetAutoFailoverNodeById(int64 nodeId);
@@ -205,7 +221,9 @@ extern void ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 										bool pgIsRunning,
 										SyncState pgSyncState,
 										int reportedTLI,
-										XLogRecPtr reportedLSN);
+										XLogRecPtr reportedLSN,
+										XLogRecPtr reportedReplayLSN,
+										int64 reportedApplyRate);
 extern void ReportAutoFailoverNodeHealth(char *nodeHost, int nodePort,
 										 ReplicationState goalState,
 										 NodeHealthState health);
@@ -214,10 +232,22 @@ extern void ReportAutoFailoverNodeReplicationSetting(int64 nodeid,
 													 int nodePort,
 													 int candidatePriority,
 													 bool replicationQuorum);
+extern int64 GetReportedFlushLag(int64 nodeId);
+extern bool GetReportedHostCapacity(int64 nodeId, int *ncpu, int64 *totalram);
+extern bool GetReportedWalRate(int64 nodeId, int64 *walRate);
+extern bool IsWarmingUp(AutoFailoverNode *node);
+extern List * GroupWarmingUpNodes(char *formationId, int groupId,
+								  List *groupNodeList);
+extern bool IsStreamingLost(AutoFailoverNode *node, int timeoutMs);
+extern List * GroupStreamingLostNodes(char *formationId, int groupId,
+									  List *groupNodeList, int timeoutMs);
+extern bool ReportSyncRepWaits(int64 nodeId, int waiting, int64 oldestWaitMs,
+							   int stallThresholdMs);
 extern void UpdateAutoFailoverNodeMetadata(int64 nodeid,
 										   char *nodeName,
 										   char *nodeHost,
 										   int nodePort);
+extern void SetAutoFailoverNodeUpstream(int64 nodeid, int64 upstreamNodeId);
 extern void RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode);
 
 
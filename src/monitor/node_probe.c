@@ -0,0 +1,352 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_probe.c
+ *
+ * Implementation of the shared memory tracking of the WAL positions that the
+ * health check workers probe on the nodes.
+ *
+ * The monitor learns the WAL position of a node from the node_active calls
+ * of its keeper only, so when a keeper stalls the monitor keeps deciding on
+ * the last LSN it reported. When pgautofailover.health_check_probe_lsn is
+ * on, the health check workers probe the nodes with a query on the
+ * connections kept open by pgautofailover.health_check_keepalive, getting
+ * whether the node is in recovery, its current WAL position (the received
+ * position on a standby and the flushed position on a primary, as the
+ * keeper reports it), and its replayed position.
+ *
+ * The latest probe of each node is kept in shared memory. NodeLatestLSN
+ * returns the probed position when it is more recent and more advanced than
+ * the reported one, and when the probe agrees with the role of the node:
+ * the group state machine then compares the WAL positions of the nodes on
+ * data as fresh as the health checks.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "node_probe.h"
+
+#include "access/htup_details.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+/* nodes past that limit are not probed */
+#define NODE_PROBE_MAX_NODES 4096
+
+#define NODE_PROBES_COLS 5
+
+
+typedef struct NodeProbeKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} NodeProbeKey;
+
+
+typedef struct NodeProbeEntry
+{
+	NodeProbeKey key;
+
+	TimestampTz probeTime;
+	bool inRecovery;
+	XLogRecPtr lsn;
+	XLogRecPtr replayLSN;
+} NodeProbeEntry;
+
+
+typedef struct NodeProbeControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} NodeProbeControlData;
+
+
+static NodeProbeControlData *NodeProbeControl = NULL;
+static HTAB *NodeProbeHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void NodeProbeShmemInit(void);
+static void BuildNodeProbeKey(NodeProbeKey *key, int64 nodeId);
+
+
+PG_FUNCTION_INFO_V1(node_probes);
+
+
+/*
+ * InitializeNodeProbes, called at server start, requests the shared memory
+ * used to track node probes.
+ */
+void
+InitializeNodeProbes(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeProbeShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = NodeProbeShmemInit;
+}
+
+
+/*
+ * NodeProbeShmemSize computes how much shared memory is required.
+ */
+size_t
+NodeProbeShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(NodeProbeControlData)));
+	size = add_size(size, hash_estimate_size(NODE_PROBE_MAX_NODES,
+											 sizeof(NodeProbeEntry)));
+
+	return size;
+}
+
+
+/*
+ * NodeProbeShmemInit initializes the requested shared memory.
+ */
+static void
+NodeProbeShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeProbeControl =
+		(NodeProbeControlData *)
+		ShmemInitStruct("pg_auto_failover Node Probes",
+						MAXALIGN(sizeof(NodeProbeControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		NodeProbeControl->trancheId = LWLockNewTrancheId();
+		NodeProbeControl->lockTrancheName = "pg_auto_failover Node Probes";
+		LWLockRegisterTranche(NodeProbeControl->trancheId,
+							  NodeProbeControl->lockTrancheName);
+
+		LWLockInitialize(&NodeProbeControl->lock,
+						 NodeProbeControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(NodeProbeKey);
+	hashInfo.entrysize = sizeof(NodeProbeEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	NodeProbeHash = ShmemInitHash("pg_auto_failover Node Probes Hash",
+								  NODE_PROBE_MAX_NODES,
+								  NODE_PROBE_MAX_NODES,
+								  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * NodeProbeRecord registers the outcome of a probe of the given node, done
+ * now by a health check worker.
+ */
+void
+NodeProbeRecord(int64 nodeId, bool inRecovery,
+				XLogRecPtr lsn, XLogRecPtr replayLSN)
+{
+	NodeProbeKey key;
+	bool found = false;
+
+	if (NodeProbeHash == NULL)
+	{
+		return;
+	}
+
+	BuildNodeProbeKey(&key, nodeId);
+
+	LWLockAcquire(&NodeProbeControl->lock, LW_EXCLUSIVE);
+
+	NodeProbeEntry *entry =
+		(NodeProbeEntry *) hash_search(NodeProbeHash, &key,
+									   HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		entry->probeTime = GetCurrentTimestamp();
+		entry->inRecovery = inRecovery;
+		entry->lsn = lsn;
+		entry->replayLSN = replayLSN;
+	}
+
+	LWLockRelease(&NodeProbeControl->lock);
+}
+
+
+/*
+ * NodeLatestLSN returns the most recent known WAL position of the given
+ * node: the position probed by the health check worker when the probe
+ * happened after the last report of the node, found the node in the role
+ * that it reported, and found it ahead of the reported position. Otherwise
+ * we return the reported position.
+ */
+XLogRecPtr
+NodeLatestLSN(AutoFailoverNode *node)
+{
+	NodeProbeKey key;
+	bool found = false;
+
+	if (node == NULL)
+	{
+		return InvalidXLogRecPtr;
+	}
+
+	XLogRecPtr latestLSN = node->reportedLSN;
+
+	if (NodeProbeHash == NULL || latestLSN == InvalidXLogRecPtr)
+	{
+		return latestLSN;
+	}
+
+	BuildNodeProbeKey(&key, node->nodeId);
+
+	LWLockAcquire(&NodeProbeControl->lock, LW_SHARED);
+
+	NodeProbeEntry *entry =
+		(NodeProbeEntry *) hash_search(NodeProbeHash, &key, HASH_FIND, &found);
+
+	if (found &&
+		entry->probeTime > node->reportTime &&
+		entry->inRecovery != IsInPrimaryState(node) &&
+		entry->lsn > latestLSN)
+	{
+		latestLSN = entry->lsn;
+	}
+
+	LWLockRelease(&NodeProbeControl->lock);
+
+	return latestLSN;
+}
+
+
+/*
+ * BuildNodeProbeKey fills-in the given key.
+ */
+static void
+BuildNodeProbeKey(NodeProbeKey *key, int64 nodeId)
+{
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(NodeProbeKey));
+
+	key->databaseId = MyDatabaseId;
+	key->nodeId = nodeId;
+}
+
+
+/*
+ * node_probes returns the latest probe of each node of the current database:
+ * when it happened, whether the node was in recovery, and its current and
+ * replayed WAL positions. The replayed position is NULL on a primary.
+ */
+Datum
+node_probes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (NodeProbeHash == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	LWLockAcquire(&NodeProbeControl->lock, LW_SHARED);
+
+	hash_seq_init(&status, NodeProbeHash);
+
+	NodeProbeEntry *entry = NULL;
+
+	while ((entry = (NodeProbeEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[NODE_PROBES_COLS];
+		bool isNulls[NODE_PROBES_COLS];
+
+		if (entry->key.databaseId != MyDatabaseId)
+		{
+			continue;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+		values[1] = TimestampTzGetDatum(entry->probeTime);
+		values[2] = BoolGetDatum(entry->inRecovery);
+		values[3] = LSNGetDatum(entry->lsn);
+
+		if (entry->replayLSN == InvalidXLogRecPtr)
+		{
+			isNulls[4] = true;
+		}
+		else
+		{
+			values[4] = LSNGetDatum(entry->replayLSN);
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(&NodeProbeControl->lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_probe.h
+ *
+ * Declarations for the shared memory tracking of the WAL positions that the
+ * health check workers probe on the nodes.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
+
+#include "node_metadata.h"
+
+
+/* public function declarations */
+extern void InitializeNodeProbes(void);
+extern size_t NodeProbeShmemSize(void);
+extern void NodeProbeRecord(int64 nodeId, bool inRecovery,
+							XLogRecPtr lsn, XLogRecPtr replayLSN);
+extern XLogRecPtr NodeLatestLSN(AutoFailoverNode *node);
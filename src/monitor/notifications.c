@@ -19,22 +19,149 @@
 #include "node_metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
+#include "state_change_wait.h"
+#include "version_compat.h"
 
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/index.h"
+#include "catalog/indexing.h"
 #include "catalog/pg_type.h"
 #include "commands/async.h"
+#include "commands/sequence.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
+#include "nodes/execnodes.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+#if (PG_VERSION_NUM >= 120000)
+#include "catalog/pg_am.h"
+#endif
+
+
+/*
+ * StateChange is a state change registered in the current transaction, for
+ * which we insert an event and send a notification at commit time.
+ */
+typedef struct StateChange
+{
+	int nestingLevel;
+	TimestampTz eventTime;
+	AutoFailoverNode node;
+	char *description;
+	char *traceId;
+	char *payload;
+} StateChange;
+
+
+/*
+ * The columns of pgautofailover.event that we fill-in for each event, in the
+ * order of the Datum arrays built by EventValues(). The eventid column is
+ * filled-in from its sequence.
+ */
+#define EVENT_ARG_COUNT 16
+
+static const char *EventColumnNames[EVENT_ARG_COUNT] = {
+	"eventtime",
+	"formationid",
+	"nodeid",
+	"groupid",
+	"nodename",
+	"nodehost",
+	"nodeport",
+	"reportedstate",
+	"goalstate",
+	"reportedrepstate",
+	"reportedtli",
+	"reportedlsn",
+	"candidatepriority",
+	"replicationquorum",
+	"description",
+	"traceid"
+};
+
+#define EVENT_ARG_NULL (-1)
+#define EVENT_ARG_EVENTID (-2)
+
+
+/* GUC variable, see STATE_NOTIFICATION_COMPACT_TAG */
+bool CompactStateNotifications = true;
+
+/* state changes of the current transaction, in TopTransactionContext */
+static List *PendingStateChanges = NIL;
+
+/* state changes flushed at pre-commit, waiters are woken-up after commit */
+static List *FlushedStateChanges = NIL;
+
+
+static void NotificationsXactCallback(XactEvent event, void *arg);
+static void NotificationsSubXactCallback(SubXactEvent event,
+										 SubTransactionId mySubid,
+										 SubTransactionId parentSubid,
+										 void *arg);
+static void NotifyLogMessage(LogNotificationLevel level,
+							 const char *formationId,
+							 const char *message);
+static void FlushStateChanges(void);
+static void WakeUpStateChangeWaiters(List *stateChanges);
+static void InsertEvents(List *stateChanges);
+static void EventArgTypes(Oid *argTypes);
+static void EventValues(StateChange *change, Datum *values);
+static bool InsertEventsDirectly(List *stateChanges);
+static bool EventIndexesAreSimple(CatalogIndexState indexState);
+static TupleTableSlot * EventTupleSlot(TupleDesc tupleDescriptor);
+static ExprState ** EventCheckConstraintStates(Relation relation,
+											   EState *estate);
+static void EventCheckConstraints(Relation relation, TupleTableSlot *slot,
+								  ExprState **checkStates,
+								  ExprContext *econtext);
+static void EventIndexInsert(Relation relation, CatalogIndexState indexState,
+							 TupleTableSlot *slot, ItemPointer tid);
+static void InsertEventsWithSPI(List *stateChanges);
+static char * StateChangeJsonPayload(AutoFailoverNode *node,
+									 const char *traceId);
+static char * StateChangeCompactPayload(AutoFailoverNode *node,
+										const char *traceId);
+static void AppendCompactField(StringInfo payload, const char *value);
+static char * GroupTraceId(AutoFailoverNode *node);
+static char * NewTraceId(void);
+static void NotifyStateChannel(const char *payload, const char *fmt, ...)
+__attribute__((format(printf, 2, 3)));
+
+
+/*
+ * InitializeNotifications, called at server start, registers the transaction
+ * callbacks that send the state changes at commit time.
+ */
+void
+InitializeNotifications(void)
+{
+	RegisterXactCallback(NotificationsXactCallback, NULL);
+	RegisterSubXactCallback(NotificationsSubXactCallback, NULL);
+}
+
 
 
 /*
- * LogAndNotifyMessage emits the given message both as a log entry and also as
- * a notification on the CHANNEL_LOG channel.
+ * LogAndNotifyFormationMessage emits the given message about the given
+ * formation both as a log entry and also as a notification for the clients
+ * that subscribed to the log notifications of this level or a lower one,
+ * either for all the formations or for this one.
  */
 void
-LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...)
+LogAndNotifyFormationMessage(LogNotificationLevel level,
+							 const char *formationId,
+							 char *message, size_t size,
+							 const char *fmt, ...)
 {
 	va_list args;
 
@@ -56,24 +183,90 @@ LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...)
 	}
 
 	ereport(LOG, (errmsg("%s", message)));
-	Async_Notify(CHANNEL_LOG, message);
+	NotifyLogMessage(level, formationId, message);
 }
 
 
 /*
- * NotifyStateChange emits a notification message on the CHANNEL_STATE channel
- * about a state change decided by the monitor. This state change is encoded so
- * as to be easy to parse by a machine.
+ * NotifyLogMessage sends the given message on the channels of its level that
+ * have subscribers, if any. Postgres writes every notification to its shared
+ * queue, so we don't notify at all when no client would read the message.
  */
-int64
+static void
+NotifyLogMessage(LogNotificationLevel level, const char *formationId,
+				 const char *message)
+{
+	bool allFormations = false;
+	bool thisFormation = false;
+	char channel[NAMEDATALEN] = { 0 };
+
+	LogSubscriptionLookup(level, formationId, &allFormations, &thisFormation);
+
+	if (allFormations &&
+		LogSubscriptionChannel(channel, sizeof(channel), level, NULL))
+	{
+		Async_Notify(channel, message);
+	}
+
+	if (thisFormation &&
+		LogSubscriptionChannel(channel, sizeof(channel), level, formationId))
+	{
+		Async_Notify(channel, message);
+	}
+}
+
+
+/*
+ * NotifyStateChange registers a notification message on the CHANNEL_STATE
+ * channel about a state change decided by the monitor, along with its event.
+ * This state change is encoded so as to be easy to parse by a machine.
+ *
+ * A single transaction often assigns several goal states in a row, sometimes
+ * to the same node, so the events and notifications are kept in memory until
+ * commit time: the events are then inserted with a single statement, and only
+ * the last notification of each node is sent.
+ */
+void
 NotifyStateChange(AutoFailoverNode *node, char *description)
 {
-	StringInfo payload = makeStringInfo();
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
 
-	/*
-	 * Insert the event in our events table.
-	 */
-	int64 eventid = InsertEvent(node, description);
+	StateChange *change = (StateChange *) palloc0(sizeof(StateChange));
+
+	change->nestingLevel = GetCurrentTransactionNestLevel();
+
+	/* failover timelines need the time of the decision, not of the commit */
+	change->eventTime = GetCurrentTimestamp();
+	change->node = *node;
+	change->node.formationId = pstrdup(node->formationId);
+	change->node.nodeName = pstrdup(node->nodeName);
+	change->node.nodeHost = pstrdup(node->nodeHost);
+	change->node.nodeCluster =
+		node->nodeCluster == NULL ? NULL : pstrdup(node->nodeCluster);
+	change->node.nodeZone =
+		node->nodeZone == NULL ? NULL : pstrdup(node->nodeZone);
+	change->description = pstrdup(description);
+	change->traceId = GroupTraceId(node);
+
+	change->payload =
+		CompactStateNotifications
+		? StateChangeCompactPayload(node, change->traceId)
+		: StateChangeJsonPayload(node, change->traceId);
+
+	PendingStateChanges = lappend(PendingStateChanges, change);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * StateChangeJsonPayload builds the JSON state notification payload of the
+ * given node, allocated in the current memory context.
+ */
+static char *
+StateChangeJsonPayload(AutoFailoverNode *node, const char *traceId)
+{
+	StringInfo payload = makeStringInfo();
 
 	/* build a json object from the notification pieces */
 	appendStringInfoChar(payload, '{');
@@ -103,28 +296,305 @@ NotifyStateChange(AutoFailoverNode *node, char *description)
 	appendStringInfo(payload, ", \"health\":");
 	escape_json(payload, NodeHealthToString(node->health));
 
+	appendStringInfo(payload, ", \"traceId\": ");
+	escape_json(payload, traceId);
+
 	appendStringInfoChar(payload, '}');
 
-	Async_Notify(CHANNEL_STATE, payload->data);
+	return payload->data;
+}
+
+
+/*
+ * StateChangeCompactPayload builds the compact state notification payload of
+ * the given node, allocated in the current memory context. See
+ * STATE_NOTIFICATION_COMPACT_TAG for the format.
+ */
+static char *
+StateChangeCompactPayload(AutoFailoverNode *node, const char *traceId)
+{
+	StringInfo payload = makeStringInfo();
+
+	appendStringInfoString(payload, STATE_NOTIFICATION_COMPACT_TAG);
 
-	pfree(payload->data);
-	pfree(payload);
-	return eventid;
+	AppendCompactField(payload, node->formationId);
+	appendStringInfo(payload, "%c%d",
+					 STATE_NOTIFICATION_SEPARATOR, node->groupId);
+	appendStringInfo(payload, "%c%lld",
+					 STATE_NOTIFICATION_SEPARATOR, (long long) node->nodeId);
+	AppendCompactField(payload, node->nodeName);
+	AppendCompactField(payload, node->nodeHost);
+	appendStringInfo(payload, "%c%d",
+					 STATE_NOTIFICATION_SEPARATOR, node->nodePort);
+	AppendCompactField(payload, ReplicationStateGetName(node->reportedState));
+	AppendCompactField(payload, ReplicationStateGetName(node->goalState));
+	AppendCompactField(payload, NodeHealthToString(node->health));
+	AppendCompactField(payload, traceId);
+
+	return payload->data;
 }
 
 
 /*
- * InsertEvent populates the monitor's pgautofailover.event table with a new
- * entry, and returns the id of the new event.
+ * AppendCompactField appends a separator and then the given text value to
+ * the payload, escaping the separator and the escape character.
  */
-int64
-InsertEvent(AutoFailoverNode *node, char *description)
+static void
+AppendCompactField(StringInfo payload, const char *value)
+{
+	appendStringInfoChar(payload, STATE_NOTIFICATION_SEPARATOR);
+
+	for (const char *ptr = value; ptr != NULL && *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '%')
+		{
+			appendStringInfoString(payload, "%25");
+		}
+		else if (*ptr == STATE_NOTIFICATION_SEPARATOR)
+		{
+			appendStringInfoString(payload, "%7C");
+		}
+		else
+		{
+			appendStringInfoChar(payload, *ptr);
+		}
+	}
+}
+
+
+/*
+ * NotificationsXactCallback inserts the events and sends the notifications of
+ * the state changes of the transaction just before it commits.
+ */
+static void
+NotificationsXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			FlushStateChanges();
+			break;
+		}
+
+		case XACT_EVENT_COMMIT:
+		{
+			/* the new states are visible now */
+			WakeUpStateChangeWaiters(FlushedStateChanges);
+
+			/* the memory is released with TopTransactionContext */
+			PendingStateChanges = NIL;
+			FlushedStateChanges = NIL;
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+		{
+			/* the memory is released with TopTransactionContext */
+			PendingStateChanges = NIL;
+			FlushedStateChanges = NIL;
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * NotificationsSubXactCallback forgets about the state changes registered in
+ * a subtransaction that aborts, and hands over the state changes of a
+ * subtransaction that commits to its parent.
+ */
+static void
+NotificationsSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+							 SubTransactionId parentSubid, void *arg)
+{
+	int nestingLevel = GetCurrentTransactionNestLevel();
+	List *keptChanges = NIL;
+	ListCell *changeCell = NULL;
+
+	if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB)
+	{
+		return;
+	}
+
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+	foreach(changeCell, PendingStateChanges)
+	{
+		StateChange *change = (StateChange *) lfirst(changeCell);
+
+		if (change->nestingLevel >= nestingLevel)
+		{
+			if (event == SUBXACT_EVENT_ABORT_SUB)
+			{
+				continue;
+			}
+
+			change->nestingLevel = nestingLevel - 1;
+		}
+
+		keptChanges = lappend(keptChanges, change);
+	}
+
+	list_free(PendingStateChanges);
+	PendingStateChanges = keptChanges;
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * FlushStateChanges inserts the pending events and sends the pending state
+ * notifications, skipping the notifications that are followed by a more
+ * recent one for the same node.
+ */
+static void
+FlushStateChanges(void)
+{
+	List *stateChanges = PendingStateChanges;
+
+	if (stateChanges == NIL)
+	{
+		return;
+	}
+
+	PendingStateChanges = NIL;
+	FlushedStateChanges = stateChanges;
+
+	InsertEvents(stateChanges);
+
+	int changeCount = list_length(stateChanges);
+
+	for (int changeIndex = 0; changeIndex < changeCount; changeIndex++)
+	{
+		StateChange *change = (StateChange *) list_nth(stateChanges, changeIndex);
+		AutoFailoverNode *node = &(change->node);
+		bool supersededChange = false;
+
+		for (int laterIndex = changeIndex + 1; laterIndex < changeCount; laterIndex++)
+		{
+			StateChange *laterChange =
+				(StateChange *) list_nth(stateChanges, laterIndex);
+
+			if (laterChange->node.nodeId == node->nodeId)
+			{
+				supersededChange = true;
+				break;
+			}
+		}
+
+		if (supersededChange)
+		{
+			continue;
+		}
+
+		Async_Notify(CHANNEL_STATE, change->payload);
+
+		NotifyStateChannel(change->payload,
+						   CHANNEL_STATE_FORMATION, node->formationId);
+		NotifyStateChannel(change->payload,
+						   CHANNEL_STATE_GROUP, node->formationId, node->groupId);
+	}
+}
+
+
+/*
+ * WakeUpStateChangeWaiters bumps the version of every group that the given
+ * state changes concern, and then wakes-up the waiters of
+ * pgautofailover.wait_for_state_change() so that they check their group.
+ */
+static void
+WakeUpStateChangeWaiters(List *stateChanges)
+{
+	ListCell *changeCell = NULL;
+
+	if (stateChanges == NIL)
+	{
+		return;
+	}
+
+	foreach(changeCell, stateChanges)
+	{
+		StateChange *change = (StateChange *) lfirst(changeCell);
+
+		StateChangeWaitBump(change->node.formationId, change->node.groupId);
+	}
+
+	StateChangeWaitBroadcast();
+}
+
+
+/*
+ * NotifyStateChannel sends the given state notification payload on the
+ * channel which name is built from the given format string, unless the name
+ * is too long for a Postgres channel name, in which case clients are expected
+ * to listen to the main CHANNEL_STATE channel instead.
+ */
+static void
+NotifyStateChannel(const char *payload, const char *fmt, ...)
+{
+	char channel[NAMEDATALEN] = { 0 };
+	va_list args;
+
+	va_start(args, fmt);
+
+	/*
+	 * Explanation of IGNORE-BANNED
+	 * Arguments are always non-null and we
+	 * do not write before the allocated buffer.
+	 *
+	 */
+	int n = vsnprintf(channel, sizeof(channel), fmt, args); /* IGNORE-BANNED */
+	va_end(args);
+
+	if (n < 0 || n >= NAMEDATALEN)
+	{
+		return;
+	}
+
+	Async_Notify(channel, payload);
+}
+
+
+/*
+ * InsertEvents populates the monitor's pgautofailover.event table with an
+ * entry per given state change.
+ *
+ * Large failovers and fleet registrations produce many events in a single
+ * transaction, so we form the heap tuples ourselves rather than parsing and
+ * planning an INSERT statement. When the event table doesn't look like what
+ * we expect (say a column was added and then dropped by an extension upgrade,
+ * or someone created a trigger or an expression index on it), we use an SPI
+ * query instead.
+ */
+static void
+InsertEvents(List *stateChanges)
+{
+	if (!InsertEventsDirectly(stateChanges))
+	{
+		InsertEventsWithSPI(stateChanges);
+	}
+}
+
+
+/*
+ * EventArgTypes fills-in the types of the event columns, in the order of
+ * EventColumnNames.
+ */
+static void
+EventArgTypes(Oid *argTypes)
 {
-	Oid goalStateOid = ReplicationStateGetEnum(node->goalState);
-	Oid reportedStateOid = ReplicationStateGetEnum(node->reportedState);
 	Oid replicationStateTypeOid = ReplicationStateTypeOid();
 
-	Oid argTypes[] = {
+	Oid eventArgTypes[EVENT_ARG_COUNT] = {
+		TIMESTAMPTZOID, /* eventtime */
 		TEXTOID, /* formationid */
 		INT8OID, /* nodeid */
 		INT4OID, /* groupid */
@@ -138,10 +608,28 @@ InsertEvent(AutoFailoverNode *node, char *description)
 		LSNOID,  /* reportedLSN */
 		INT4OID, /* candidate_priority */
 		BOOLOID, /* replication_quorum */
-		TEXTOID  /* description */
+		TEXTOID, /* description */
+		TEXTOID  /* traceid */
 	};
 
-	Datum argValues[] = {
+	memcpy(argTypes, eventArgTypes, sizeof(eventArgTypes));
+}
+
+
+/*
+ * EventValues fills-in the values of the event columns for the given state
+ * change, in the order of EventColumnNames.
+ */
+static void
+EventValues(StateChange *change, Datum *values)
+{
+	AutoFailoverNode *node = &(change->node);
+
+	Oid goalStateOid = ReplicationStateGetEnum(node->goalState);
+	Oid reportedStateOid = ReplicationStateGetEnum(node->reportedState);
+
+	Datum eventArgValues[EVENT_ARG_COUNT] = {
+		TimestampTzGetDatum(change->eventTime),   /* eventtime */
 		CStringGetTextDatum(node->formationId),   /* formationid */
 		Int64GetDatum(node->nodeId),              /* nodeid */
 		Int32GetDatum(node->groupId),             /* groupid */
@@ -155,42 +643,616 @@ InsertEvent(AutoFailoverNode *node, char *description)
 		LSNGetDatum(node->reportedLSN),           /* reportedLSN */
 		Int32GetDatum(node->candidatePriority),   /* candidate_priority */
 		BoolGetDatum(node->replicationQuorum),    /* replication_quorum */
-		CStringGetTextDatum(description)          /* description */
+		CStringGetTextDatum(change->description), /* description */
+		CStringGetTextDatum(change->traceId)       /* traceid */
 	};
 
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	int64 eventId = 0;
+	memcpy(values, eventArgValues, sizeof(eventArgValues));
+}
 
-	const char *insertQuery =
-		"INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
-		"(formationid, nodeid, groupid, nodename, nodehost, nodeport,"
-		" reportedstate, goalstate, reportedrepstate, reportedtli, reportedlsn,"
-		" candidatepriority, replicationquorum, description) "
-		"VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14) "
-		"RETURNING eventid";
+
+/*
+ * InsertEventsDirectly inserts the events with heap tuples that we form
+ * ourselves, opening the event table and its indexes only once for all the
+ * events of the transaction, and adding the tuples with a single call to
+ * heap_multi_insert(). It returns false without inserting anything when the
+ * event table has columns, triggers or indexes that we can't maintain here.
+ *
+ * The NOT NULL and CHECK constraints of the event table are verified for
+ * each event before the insert, as ExecConstraints() would.
+ */
+static bool
+InsertEventsDirectly(List *stateChanges)
+{
+	Oid eventArgTypes[EVENT_ARG_COUNT] = { 0 };
+	ListCell *changeCell = NULL;
+
+	Oid sequenceId = get_relname_relid("event_eventid_seq",
+									   pgAutoFailoverSchemaId());
+
+	if (!OidIsValid(sequenceId))
+	{
+		return false;
+	}
+
+	EventArgTypes(eventArgTypes);
+
+	Oid eventRelationId = pgAutoFailoverRelationId("event");
+	Relation eventRelation = heap_open(eventRelationId, RowExclusiveLock);
+	TupleDesc tupleDescriptor = RelationGetDescr(eventRelation);
+	int attributeCount = tupleDescriptor->natts;
+
+	/* map each attribute of the event table to one of our values */
+	int *argIndexes = (int *) palloc0(attributeCount * sizeof(int));
+	bool directInsert = eventRelation->trigdesc == NULL;
+
+#if (PG_VERSION_NUM >= 120000)
+
+	/* heap_multi_insert() only knows about heap tables */
+	directInsert = directInsert &&
+				   eventRelation->rd_rel->relam == HEAP_TABLE_AM_OID;
+#endif
+
+	for (int attIndex = 0; directInsert && attIndex < attributeCount; attIndex++)
+	{
+		Form_pg_attribute attribute = TupleDescAttr(tupleDescriptor, attIndex);
+		const char *attributeName = NameStr(attribute->attname);
+
+		argIndexes[attIndex] = EVENT_ARG_NULL;
+
+		if (attribute->attisdropped)
+		{
+			continue;
+		}
+
+		if (strcmp(attributeName, "eventid") == 0 &&
+			attribute->atttypid == INT8OID)
+		{
+			argIndexes[attIndex] = EVENT_ARG_EVENTID;
+			continue;
+		}
+
+		directInsert = false;
+
+		for (int argIndex = 0; argIndex < EVENT_ARG_COUNT; argIndex++)
+		{
+			if (strcmp(attributeName, EventColumnNames[argIndex]) == 0 &&
+				attribute->atttypid == eventArgTypes[argIndex])
+			{
+				argIndexes[attIndex] = argIndex;
+				directInsert = true;
+				break;
+			}
+		}
+	}
+
+	CatalogIndexState indexState = NULL;
+
+	if (directInsert)
+	{
+		indexState = CatalogOpenIndexes(eventRelation);
+		directInsert = EventIndexesAreSimple(indexState);
+	}
+
+	if (!directInsert)
+	{
+		if (indexState != NULL)
+		{
+			CatalogCloseIndexes(indexState);
+		}
+
+		heap_close(eventRelation, RowExclusiveLock);
+		pfree(argIndexes);
+
+		return false;
+	}
+
+	EState *estate = CreateExecutorState();
+	ExprContext *econtext = GetPerTupleExprContext(estate);
+	ExprState **checkStates = EventCheckConstraintStates(eventRelation, estate);
+
+	int eventCount = list_length(stateChanges);
+	int eventIndex = 0;
+
+	HeapTuple *heapTuples = (HeapTuple *) palloc0(eventCount * sizeof(HeapTuple));
+	TupleTableSlot **slots =
+		(TupleTableSlot **) palloc0(eventCount * sizeof(TupleTableSlot *));
+
+	Datum *values = (Datum *) palloc0(attributeCount * sizeof(Datum));
+	bool *isNulls = (bool *) palloc0(attributeCount * sizeof(bool));
+
+	foreach(changeCell, stateChanges)
+	{
+		StateChange *change = (StateChange *) lfirst(changeCell);
+		Datum eventValues[EVENT_ARG_COUNT] = { 0 };
+
+		EventValues(change, eventValues);
+
+		for (int attIndex = 0; attIndex < attributeCount; attIndex++)
+		{
+			int argIndex = argIndexes[attIndex];
+
+			isNulls[attIndex] = false;
+
+			if (argIndex == EVENT_ARG_EVENTID)
+			{
+				values[attIndex] =
+					Int64GetDatum(nextval_internal(sequenceId, false));
+			}
+			else if (argIndex == EVENT_ARG_NULL)
+			{
+				values[attIndex] = (Datum) 0;
+				isNulls[attIndex] = true;
+			}
+			else
+			{
+				values[attIndex] = eventValues[argIndex];
+			}
+		}
+
+		HeapTuple heapTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
+		TupleTableSlot *slot = EventTupleSlot(tupleDescriptor);
+
+		ExecStoreHeapTuple(heapTuple, slot, false);
+
+		EventCheckConstraints(eventRelation, slot, checkStates, econtext);
+
+		heapTuples[eventIndex] = heapTuple;
+		slots[eventIndex] = slot;
+		eventIndex++;
+	}
+
+	BulkInsertState bulkInsertState = GetBulkInsertState();
+
+#if (PG_VERSION_NUM >= 120000)
+	heap_multi_insert(eventRelation, slots, eventCount,
+					  GetCurrentCommandId(true), 0, bulkInsertState);
+#else
+	heap_multi_insert(eventRelation, heapTuples, eventCount,
+					  GetCurrentCommandId(true), 0, bulkInsertState);
+#endif
+
+	FreeBulkInsertState(bulkInsertState);
+
+	/* heap_multi_insert() has set the tuple ids, now maintain the indexes */
+	for (eventIndex = 0; eventIndex < eventCount; eventIndex++)
+	{
+#if (PG_VERSION_NUM >= 120000)
+		ItemPointer tid = &(slots[eventIndex]->tts_tid);
+#else
+		ItemPointer tid = &(heapTuples[eventIndex]->t_self);
+#endif
+
+		EventIndexInsert(eventRelation, indexState, slots[eventIndex], tid);
+
+		ExecDropSingleTupleTableSlot(slots[eventIndex]);
+		heap_freetuple(heapTuples[eventIndex]);
+	}
+
+	CatalogCloseIndexes(indexState);
+	FreeExecutorState(estate);
+
+	/* keep the lock until the end of the transaction */
+	heap_close(eventRelation, NoLock);
+
+	pfree(slots);
+	pfree(heapTuples);
+	pfree(values);
+	pfree(isNulls);
+	pfree(argIndexes);
+
+	/* make the new events visible to the rest of the transaction */
+	CommandCounterIncrement();
+
+	return true;
+}
+
+
+/*
+ * EventIndexesAreSimple returns true when the indexes of the event table can
+ * be maintained with EventIndexInsert, which only knows about plain column
+ * indexes that are checked immediately.
+ */
+static bool
+EventIndexesAreSimple(CatalogIndexState indexState)
+{
+	for (int i = 0; i < indexState->ri_NumIndices; i++)
+	{
+		IndexInfo *indexInfo = indexState->ri_IndexRelationInfo[i];
+		Relation indexRelation = indexState->ri_IndexRelationDescs[i];
+
+		if (indexInfo->ii_Expressions != NIL ||
+			indexInfo->ii_Predicate != NIL ||
+			indexInfo->ii_ExclusionOps != NULL ||
+			!indexRelation->rd_index->indimmediate)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * EventTupleSlot returns a new slot for the heap tuples of the event table.
+ */
+static TupleTableSlot *
+EventTupleSlot(TupleDesc tupleDescriptor)
+{
+#if (PG_VERSION_NUM >= 120000)
+	return MakeSingleTupleTableSlot(tupleDescriptor, &TTSOpsHeapTuple);
+#else
+	return MakeSingleTupleTableSlot(tupleDescriptor);
+#endif
+}
+
+
+/*
+ * EventCheckConstraintStates prepares the CHECK constraints of the event
+ * table for EventCheckConstraints, or returns NULL when there are none.
+ */
+static ExprState **
+EventCheckConstraintStates(Relation relation, EState *estate)
+{
+	TupleConstr *constraints = RelationGetDescr(relation)->constr;
+
+	if (constraints == NULL || constraints->num_check == 0)
+	{
+		return NULL;
+	}
+
+	ExprState **checkStates =
+		(ExprState **) palloc0(constraints->num_check * sizeof(ExprState *));
+
+	for (int checkIndex = 0; checkIndex < constraints->num_check; checkIndex++)
+	{
+		Expr *checkExpr =
+			(Expr *) stringToNode(constraints->check[checkIndex].ccbin);
+
+		checkStates[checkIndex] = ExecPrepareExpr(checkExpr, estate);
+	}
+
+	return checkStates;
+}
+
+
+/*
+ * EventCheckConstraints raises the same errors as ExecConstraints() does for
+ * an INSERT statement when the event in the given slot violates a NOT NULL
+ * or a CHECK constraint of the event table.
+ */
+static void
+EventCheckConstraints(Relation relation, TupleTableSlot *slot,
+					  ExprState **checkStates, ExprContext *econtext)
+{
+	TupleDesc tupleDescriptor = RelationGetDescr(relation);
+	TupleConstr *constraints = tupleDescriptor->constr;
+
+	if (constraints == NULL)
+	{
+		return;
+	}
+
+	for (int attIndex = 0;
+		 constraints->has_not_null && attIndex < tupleDescriptor->natts;
+		 attIndex++)
+	{
+		Form_pg_attribute attribute = TupleDescAttr(tupleDescriptor, attIndex);
+
+		if (attribute->attnotnull && slot_attisnull(slot, attIndex + 1))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NOT_NULL_VIOLATION),
+					 errmsg("null value in column \"%s\" of relation \"%s\" "
+							"violates not-null constraint",
+							NameStr(attribute->attname),
+							RelationGetRelationName(relation)),
+					 errtablecol(relation, attIndex + 1)));
+		}
+	}
+
+	econtext->ecxt_scantuple = slot;
+
+	for (int checkIndex = 0; checkIndex < constraints->num_check; checkIndex++)
+	{
+		const char *checkName = constraints->check[checkIndex].ccname;
+
+		/* a NULL result satisfies a CHECK constraint, see ExecCheck */
+		if (!ExecCheck(checkStates[checkIndex], econtext))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_CHECK_VIOLATION),
+					 errmsg("new row for relation \"%s\" violates "
+							"check constraint \"%s\"",
+							RelationGetRelationName(relation),
+							checkName),
+					 errtableconstraint(relation, checkName)));
+		}
+	}
+
+	ResetExprContext(econtext);
+}
+
+
+/*
+ * EventIndexInsert adds the index entries of an event that heap_multi_insert
+ * has added to the event table at the given tuple id, the same way that
+ * CatalogTupleInsertWithInfo does it for a single tuple.
+ */
+static void
+EventIndexInsert(Relation relation, CatalogIndexState indexState,
+				 TupleTableSlot *slot, ItemPointer tid)
+{
+	Datum values[INDEX_MAX_KEYS];
+	bool isNulls[INDEX_MAX_KEYS];
+
+	for (int i = 0; i < indexState->ri_NumIndices; i++)
+	{
+		IndexInfo *indexInfo = indexState->ri_IndexRelationInfo[i];
+		Relation indexRelation = indexState->ri_IndexRelationDescs[i];
+
+		if (!indexInfo->ii_ReadyForInserts)
+		{
+			continue;
+		}
+
+		/* no expressions, see EventIndexesAreSimple, so no EState needed */
+		FormIndexDatum(indexInfo, slot, NULL, values, isNulls);
+
+		index_insert(indexRelation, values, isNulls, tid, relation,
+					 indexRelation->rd_index->indisunique
+					 ? UNIQUE_CHECK_YES : UNIQUE_CHECK_NO,
+#if (PG_VERSION_NUM >= 140000)
+					 false,
+#endif
+					 indexInfo);
+	}
+}
+
+
+/*
+ * InsertEventsWithSPI inserts the events using a single INSERT statement.
+ */
+static void
+InsertEventsWithSPI(List *stateChanges)
+{
+	Oid eventArgTypes[EVENT_ARG_COUNT] = { 0 };
+
+	int argCount = EVENT_ARG_COUNT * list_length(stateChanges);
+
+	Oid *argTypes = (Oid *) palloc0(argCount * sizeof(Oid));
+	Datum *argValues = (Datum *) palloc0(argCount * sizeof(Datum));
+
+	StringInfo insertQuery = makeStringInfo();
+	ListCell *changeCell = NULL;
+	int argIndex = 0;
+
+	EventArgTypes(eventArgTypes);
+
+	appendStringInfoString(insertQuery,
+						   "INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
+						   "(eventtime, formationid, nodeid, groupid, nodename, nodehost,"
+						   " nodeport, reportedstate, goalstate, reportedrepstate,"
+						   " reportedtli, reportedlsn, candidatepriority,"
+						   " replicationquorum, description, traceid) "
+						   "VALUES ");
+
+	foreach(changeCell, stateChanges)
+	{
+		StateChange *change = (StateChange *) lfirst(changeCell);
+		Datum eventArgValues[EVENT_ARG_COUNT] = { 0 };
+
+		EventValues(change, eventArgValues);
+
+		appendStringInfoString(insertQuery, argIndex == 0 ? "(" : ", (");
+
+		for (int i = 0; i < EVENT_ARG_COUNT; i++)
+		{
+			argTypes[argIndex] = eventArgTypes[i];
+			argValues[argIndex] = eventArgValues[i];
+			argIndex++;
+
+			appendStringInfo(insertQuery, "%s$%d", i == 0 ? "" : ", ", argIndex);
+		}
+
+		appendStringInfoChar(insertQuery, ')');
+	}
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(insertQuery, argCount, argTypes,
+	int spiStatus = SPI_execute_with_args(insertQuery->data, argCount, argTypes,
 										  argValues, NULL, false, 0);
 
-	if (spiStatus == SPI_OK_INSERT_RETURNING && SPI_processed > 0)
+	if (spiStatus != SPI_OK_INSERT)
 	{
-		bool isNull = false;
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_EVENT_TABLE);
+	}
 
-		Datum eventIdDatum = SPI_getbinval(SPI_tuptable->vals[0],
-										   SPI_tuptable->tupdesc,
-										   1,
-										   &isNull);
+	SPI_finish();
+}
 
-		eventId = DatumGetInt64(eventIdDatum);
+
+
+/*
+ * GroupTraceId returns the trace id of the given state change, allocated in
+ * the current memory context.
+ *
+ * A trace follows a group from the state change that starts a reconfiguration
+ * (a failover, a switchover, a node joining or leaving...) until every node
+ * of the group has reached its goal state again, so that the decisions of the
+ * monitor and the transitions of the keepers can be assembled in a single
+ * trace. The state changes of the current transaction belong to the same
+ * trace, and so does the change when another node of the group has not yet
+ * reached its goal state, or when the node is reporting that it reached its
+ * own goal state. Otherwise a new trace begins.
+ */
+static char *
+GroupTraceId(AutoFailoverNode *node)
+{
+	ListCell *changeCell = NULL;
+
+	foreach(changeCell, PendingStateChanges)
+	{
+		StateChange *change = (StateChange *) lfirst(changeCell);
+
+		if (strcmp(change->node.formationId, node->formationId) == 0 &&
+			change->node.groupId == node->groupId)
+		{
+			return pstrdup(change->traceId);
+		}
 	}
-	else
+
+	Oid argTypes[] = {
+		TEXTOID, /* formationid */
+		INT4OID, /* groupid */
+		INT8OID, /* nodeid */
+		BOOLOID  /* node reached its goal state */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(node->formationId),
+		Int32GetDatum(node->groupId),
+		Int64GetDatum(node->nodeId),
+		BoolGetDatum(node->reportedState == node->goalState)
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+	char *traceId = NULL;
+
+	const char *selectQuery =
+		"SELECT traceid FROM " AUTO_FAILOVER_EVENT_TABLE
+		" WHERE formationid = $1 AND groupid = $2 AND traceid <> ''"
+		"   AND ($4 OR EXISTS (SELECT 1 FROM " AUTO_FAILOVER_NODE_TABLE
+		"                       WHERE formationid = $1 AND groupid = $2"
+		"                         AND nodeid <> $3"
+		"                         AND reportedstate <> goalstate))"
+		" ORDER BY eventid DESC LIMIT 1";
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes,
+										  argValues, NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
 	{
-		elog(ERROR, "could not insert into " AUTO_FAILOVER_EVENT_TABLE);
+		elog(ERROR, "could not select from " AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		char *value =
+			SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		traceId = MemoryContextStrdup(callerContext, value);
 	}
 
 	SPI_finish();
 
-	return eventId;
+	return traceId != NULL ? traceId : NewTraceId();
+}
+
+
+/*
+ * GoalStateTraceId returns the trace id of the decision that assigned the
+ * given goal state to the given node, or an empty string when there is none.
+ */
+char *
+GoalStateTraceId(AutoFailoverNode *node)
+{
+	char *traceId = NULL;
+
+	/* the most recent pending change of the node wins */
+	for (int changeIndex = list_length(PendingStateChanges) - 1;
+		 changeIndex >= 0;
+		 changeIndex--)
+	{
+		StateChange *change =
+			(StateChange *) list_nth(PendingStateChanges, changeIndex);
+
+		if (change->node.nodeId == node->nodeId)
+		{
+			if (change->node.goalState == node->goalState)
+			{
+				return pstrdup(change->traceId);
+			}
+			break;
+		}
+	}
+
+	Oid goalStateOid = ReplicationStateGetEnum(node->goalState);
+
+	Oid argTypes[] = {
+		TEXTOID, /* formationid */
+		INT4OID, /* groupid */
+		INT8OID, /* nodeid */
+		ReplicationStateTypeOid() /* goalstate */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(node->formationId),
+		Int32GetDatum(node->groupId),
+		Int64GetDatum(node->nodeId),
+		ObjectIdGetDatum(goalStateOid)
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT traceid FROM " AUTO_FAILOVER_EVENT_TABLE
+		" WHERE formationid = $1 AND groupid = $2"
+		"   AND nodeid = $3 AND goalstate = $4"
+		" ORDER BY eventid DESC LIMIT 1";
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes,
+										  argValues, NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		char *value =
+			SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		traceId = MemoryContextStrdup(callerContext, value);
+	}
+
+	SPI_finish();
+
+	return traceId != NULL ? traceId : pstrdup("");
+}
+
+
+/*
+ * NewTraceId returns a new random trace id, in the W3C Trace Context format
+ * used by OpenTelemetry: 16 bytes written as 32 lowercase hexadecimal digits.
+ */
+static char *
+NewTraceId(void)
+{
+	const char *hexDigits = "0123456789abcdef";
+	uint8 randomBytes[16] = { 0 };
+	char *traceId = (char *) palloc0(2 * sizeof(randomBytes) + 1);
+
+	if (!pg_strong_random(randomBytes, sizeof(randomBytes)))
+	{
+		ereport(ERROR, (errmsg("could not generate a random trace id")));
+	}
+
+	for (int i = 0; i < (int) sizeof(randomBytes); i++)
+	{
+		traceId[2 * i] = hexDigits[randomBytes[i] >> 4];
+		traceId[2 * i + 1] = hexDigits[randomBytes[i] & 0x0f];
+	}
+
+	return traceId;
 }
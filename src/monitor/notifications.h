@@ -16,6 +16,7 @@
 #include "postgres.h"
 #include "c.h"
 
+#include "log_subscription.h"
 #include "node_metadata.h"
 #include "replication_state.h"
 
@@ -26,18 +27,55 @@
  * - the "state" channel is used when a node's state is assigned to something
  *   new
  *
- * - the "log" channel is used to duplicate message that are sent to the
- *   PostgreSQL logs, in order for a pg_auto_failover monitor client to subscribe to
- *   the chatter without having to actually have the privileges to tail the
- *   PostgreSQL server logs.
+ * - the same state notifications are also sent on the "state.<formation>"
+ *   and "state.<formation>.<group>" channels, so that a client interested in
+ *   a single formation or group is not woken up by changes elsewhere; those
+ *   channels are skipped when their name does not fit in NAMEDATALEN
+ *
+ * - the "log.<level>" and "log.<level>.<formation>" channels are used to
+ *   duplicate message that are sent to the PostgreSQL logs, in order for a
+ *   pg_auto_failover monitor client to subscribe to the chatter without
+ *   having to actually have the privileges to tail the PostgreSQL server
+ *   logs. Clients opt-in with pgautofailover.subscribe_log_notifications(),
+ *   and the monitor skips those channels when nobody subscribed to them, see
+ *   log_subscription.c
  */
 #define CHANNEL_STATE "state"
-#define CHANNEL_LOG "log"
+#define CHANNEL_STATE_FORMATION "state.%s"
+#define CHANNEL_STATE_GROUP "state.%s.%d"
+#define CHANNEL_LOG_LEVEL "log.%s"
+#define CHANNEL_LOG_FORMATION "log.%s.%s"
 #define BUFSIZE 8192
 
+/*
+ * State notifications are sent either as a JSON object, or in a compact
+ * format made of fixed-order fields separated by '|', where '%' and '|' are
+ * escaped as %25 and %7C:
+ *
+ *   S1|formation|groupId|nodeId|name|host|port|reportedState|goalState|health|traceId
+ *
+ * The formation and group come first so that a client can skip messages
+ * about other groups by looking at the prefix only. The "S1" tag is the
+ * version of the format: fields are only ever added at the end, and a new
+ * version tag is used for any other change.
+ *
+ * pg_autoctl knows how to parse both formats. As it refuses to work with a
+ * monitor running another extension version than its own, every pg_autoctl
+ * that receives compact notifications knows the format. The JSON format is
+ * kept for other clients, see pgautofailover.compact_state_notifications.
+ */
+#define STATE_NOTIFICATION_COMPACT_TAG "S1"
+#define STATE_NOTIFICATION_SEPARATOR '|'
+
+extern bool CompactStateNotifications;
+
 
-void LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...) __attribute__(
-	(format(printf, 3, 4)));
+void LogAndNotifyFormationMessage(LogNotificationLevel level,
+								  const char *formationId,
+								  char *message, size_t size,
+								  const char *fmt, ...) __attribute__(
+	(format(printf, 5, 6)));
 
-int64 NotifyStateChange(AutoFailoverNode *node, char *description);
-int64 InsertEvent(AutoFailoverNode *node, char *description);
+void InitializeNotifications(void);
+void NotifyStateChange(AutoFailoverNode *node, char *description);
+char * GoalStateTraceId(AutoFailoverNode *node);
@@ -13,9 +13,21 @@
 #include "postgres.h"
 
 /* these are internal headers */
+#include "admission_control.h"
 #include "health_check.h"
+#include "health_check_latency.h"
+#include "group_state_fingerprint.h"
 #include "group_state_machine.h"
+#include "log_subscription.h"
 #include "metadata.h"
+#include "node_cache.h"
+#include "node_heartbeat.h"
+#include "node_liveness.h"
+#include "node_probe.h"
+#include "notifications.h"
+#include "primary_lease.h"
+#include "protocol_stats.h"
+#include "state_change_wait.h"
 #include "version_compat.h"
 
 /* these are always necessary for a bgworker */
@@ -107,6 +119,17 @@ pgautofailover_shmem_request(void)
 	}
 
 	RequestAddinShmemSpace(HealthCheckWorkerShmemSize());
+	RequestAddinShmemSpace(NodeCacheShmemSize());
+	RequestAddinShmemSpace(NodeLivenessShmemSize());
+	RequestAddinShmemSpace(PrimaryLeaseShmemSize());
+	RequestAddinShmemSpace(NodeHeartbeatShmemSize());
+	RequestAddinShmemSpace(NodeProbeShmemSize());
+	RequestAddinShmemSpace(GroupStateFingerprintShmemSize());
+	RequestAddinShmemSpace(ProtocolStatsShmemSize());
+	RequestAddinShmemSpace(HealthCheckLatencyShmemSize());
+	RequestAddinShmemSpace(StateChangeWaitShmemSize());
+	RequestAddinShmemSpace(LogSubscriptionShmemSize());
+	RequestAddinShmemSpace(AdmissionControlShmemSize());
 }
 
 
@@ -151,18 +174,125 @@ StartMonitorNode(void)
 							NULL, &HealthCheckRetryDelay, 2 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.health_check_workers",
+							"Number of health check workers per monitor database.",
+							NULL, &HealthCheckWorkers, 1, 1, HEALTH_CHECK_MAX_WORKERS,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.health_check_max_period",
+							"Maximum duration between each check of a stable node "
+							"(in milliseconds).",
+							"When greater than health_check_period, nodes that are "
+							"healthy and reporting are checked less and less often, "
+							"up to this period.",
+							&HealthCheckMaxPeriod, 0, 0, INT_MAX, PGC_SIGHUP,
+							GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.health_check_keepalive",
+							 "Keep a connection open to each node and probe it "
+							 "with an empty query.",
+							 NULL, &HealthCheckKeepalive, false, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.health_check_probe_lsn",
+							 "Probe the role and WAL positions of the nodes on "
+							 "the kept health check connections.",
+							 "Only used when health_check_keepalive is on.",
+							 &HealthCheckProbeLSN, false, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.event_retention",
+							"Delete the events older than this (in minutes).",
+							"Zero keeps the events forever.",
+							&EventRetention, 0, 0, INT_MAX / 60, PGC_SIGHUP,
+							GUC_UNIT_MIN, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.notify_queue_warning_threshold",
+							"Log a warning when the notification queue is used "
+							"above this percentage.",
+							"Zero disables the warnings.",
+							&NotifyQueueWarningThreshold, 10, 0, 100, PGC_SIGHUP,
+							0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.notify_queue_terminate_threshold",
+							"Terminate the session that lags the most behind "
+							"the notification queue when the queue is used "
+							"above this percentage.",
+							"Zero never terminates sessions.",
+							&NotifyQueueTerminateThreshold, 0, 0, 100, PGC_SIGHUP,
+							0, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.enable_sync_wal_log_threshold",
 							"Don't enable synchronous replication until secondary xlog"
 							" is within this many bytes of the primary's",
 							NULL, &EnableSyncXlogThreshold, DEFAULT_XLOG_SEG_SIZE, 1,
 							INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.enable_sync_catchup_time",
+							"Also enable synchronous replication when the "
+							"secondary is expected to catch up with the primary "
+							"within this many milliseconds",
+							"Zero only uses pgautofailover.enable_sync_wal_log_threshold.",
+							&EnableSyncCatchupTimeMs, 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.promote_wal_log_threshold",
 							"Don't promote secondary unless xlog is with this many bytes"
 							" of the master",
 							NULL, &PromoteXlogThreshold, DEFAULT_XLOG_SEG_SIZE, 1,
 							INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.promote_replay_margin",
+							"Prefer a failover candidate that is expected to "
+							"replay its WAL this much faster than the most "
+							"advanced one",
+							"Zero disables lag-aware candidate selection.",
+							&PromoteReplayMarginMs, 5 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.candidate_capacity_margin",
+							"Prefer a failover candidate whose host has this "
+							"much more CPUs or memory (in percent) than the "
+							"other candidates with the same priority",
+							"Zero disables capacity-aware candidate selection.",
+							&CandidateCapacityMargin, 0, 0, 1000,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_standby_disconnect_timeout",
+							"Consider a standby node in the replication quorum "
+							"as catching up once the primary has reported it "
+							"disconnected for this long (in milliseconds).",
+							"Zero waits until the standby node is unhealthy.",
+							&SyncStandbyDisconnectTimeoutMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.promotion_catchup_timeout",
+							"How long perform_promotion waits for its target "
+							"to catch up before stopping writes",
+							"Zero starts the failover right away.",
+							&PromotionCatchupTimeoutMs, 30 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_rep_stall_threshold",
+							"Record an event when commits on a primary node "
+							"wait for synchronous replication for this long",
+							"Zero disables the stall events.",
+							&SyncRepStallThresholdMs, 10 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_standby_latency_margin",
+							"Order the synchronous standby nodes by their "
+							"flush lag when it differs by more than this",
+							"Zero disables ordering by measured latency.",
+							&SyncStandbyLatencyMarginMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgautofailover.application_zone",
+							   "Prefer failover candidates placed in this zone",
+							   "Empty disables zone preferences.",
+							   &ApplicationZone, "", PGC_SIGHUP, 0,
+							   NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.primary_demote_timeout",
 							"Give the primary this long to drain before promoting the secondary",
 							NULL, &DrainTimeoutMs, 30 * 1000, 1, INT_MAX,
@@ -173,16 +303,88 @@ StartMonitorNode(void)
 							NULL, &UnhealthyTimeoutMs, 20 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomRealVariable("pgautofailover.node_unhealthy_timeout_factor",
+							 "Derive the unhealthy timeout of each node from "
+							 "the 99.9th percentile of the intervals between "
+							 "its reports, times this factor",
+							 "Zero disables the adaptive unhealthy timeouts.",
+							 &NodeUnhealthyTimeoutFactor, 0, 0, 1000,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_unhealthy_timeout_min",
+							"Lower bound of the adaptive unhealthy timeouts",
+							NULL, &NodeUnhealthyTimeoutMinMs, 5 * 1000, 1,
+							INT_MAX, PGC_SIGHUP, GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.startup_grace_period",
 							"Wait for at least this much time after startup before "
 							"initiating a failover.",
 							NULL, &StartupGracePeriodMs, 10 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.node_cache_size",
+							"Number of formations and groups kept in the shared "
+							"node cache.",
+							"Zero disables the cache.",
+							&NodeCacheSize, 64, 0, 64 * 1024, PGC_POSTMASTER,
+							0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_report_persist_interval",
+							"Only update the node report time and LSN in the node "
+							"table once in this interval when the node state did "
+							"not change (in milliseconds).",
+							"Zero updates the node table at each report.",
+							&NodeReportPersistInterval, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_active_rate_limit",
+							"Maximum number of node_active and register_node "
+							"calls admitted per second.",
+							"Zero disables admission control.",
+							&NodeActiveRateLimit, 0, 0, INT_MAX,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_active_burst",
+							"Number of node_active and register_node calls "
+							"admitted at once before the rate limit applies.",
+							NULL, &NodeActiveBurst, 100, 1, INT_MAX,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.skip_unchanged_group_state",
+							 "Skip the group state machine in node_active when "
+							 "its inputs did not change.",
+							 NULL, &SkipUnchangedGroupState, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.parallel_group_failover",
+							 "Proceed all the failing groups of a Citus formation "
+							 "when one of them reports to the monitor.",
+							 NULL, &ParallelGroupFailover, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.compact_state_notifications",
+							 "Send state notifications in the compact format "
+							 "rather than in JSON.",
+							 NULL, &CompactStateNotifications, true, PGC_SIGHUP,
+							 0, NULL, NULL, NULL);
+
 	PreviousProcessUtility_hook = ProcessUtility_hook;
 	ProcessUtility_hook = pgautofailover_ProcessUtility;
 
 	InitializeHealthCheckWorker();
+	InitializeNodeCache();
+	InitializeNodeLiveness();
+	InitializePrimaryLeases();
+	InitializeNodeHeartbeats();
+	InitializeNodeProbes();
+	InitializeGroupStateFingerprints();
+	InitializeProtocolStats();
+	InitializeHealthCheckLatency();
+	InitializeStateChangeWait();
+	InitializeLogSubscription();
+	InitializeAdmissionControl();
+	InitializeNotifications();
 
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
@@ -243,6 +445,38 @@ pgautofailover_ProcessUtility(PlannedStmt * pstmt,
 		}
 	}
 
+	/*
+	 * Have the health checks start in a new database, or in a database where
+	 * the extension is created, as soon as the transaction commits.
+	 */
+	if (IsA(parsetree, CreatedbStmt) ||
+		IsA(parsetree, AlterDatabaseStmt))
+	{
+		HealthCheckLauncherWakeUpAtCommit();
+	}
+
+	if (IsA(parsetree, CreateExtensionStmt) &&
+		strcmp(((CreateExtensionStmt *) parsetree)->extname,
+			   "pgautofailover") == 0)
+	{
+		HealthCheckWorkersWakeUpAtCommit();
+	}
+
+	/*
+	 * Those commands might drop or re-create the node table, in which case
+	 * the shared node cache must not serve the previous rows anymore.
+	 */
+	if (IsA(parsetree, DropdbStmt) ||
+		IsA(parsetree, DropStmt) ||
+		IsA(parsetree, DropOwnedStmt) ||
+		IsA(parsetree, CreateExtensionStmt) ||
+		IsA(parsetree, AlterExtensionStmt) ||
+		IsA(parsetree, AlterTableStmt) ||
+		IsA(parsetree, RenameStmt))
+	{
+		NodeCacheInvalidateAll();
+	}
+
 	if (PreviousProcessUtility_hook)
 	{
 #if (PG_VERSION_NUM < 140000)
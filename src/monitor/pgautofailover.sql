@@ -121,6 +121,10 @@ CREATE TABLE pgautofailover.node
     candidatepriority	 int not null default 100,
     replicationquorum	 bool not null default true,
     nodecluster          text not null default 'default',
+    upstreamnodeid       bigint,
+    reportedreplaylsn    pg_lsn not null default '0/0',
+    reportedapplyrate    bigint not null default 0,
+    nodezone             text not null default '',
 
     -- node names must be unique in a given formation
     UNIQUE (formationid, nodename),
@@ -160,8 +164,38 @@ CREATE TABLE pgautofailover.node
     PRIMARY KEY (nodeid),
     FOREIGN KEY (formationid) REFERENCES pgautofailover.formation(formationid)
  )
- -- we expect few rows and lots of UPDATE, let's benefit from HOT
- WITH (fillfactor = 25);
+ -- we expect few rows and lots of UPDATE, let's benefit from HOT, and
+ -- vacuum after a fixed number of dead rows rather than a fraction of a
+ -- table that is always tiny
+ WITH (fillfactor = 25,
+       autovacuum_vacuum_scale_factor = 0,
+       autovacuum_vacuum_threshold = 500,
+       autovacuum_analyze_scale_factor = 0,
+       autovacuum_analyze_threshold = 500,
+       autovacuum_vacuum_cost_delay = 0);
+
+-- the monitor scans this index when loading the nodes of a group
+CREATE INDEX node_formationid_groupid_nodeid_idx
+          ON pgautofailover.node (formationid, groupid, nodeid);
+
+CREATE FUNCTION pgautofailover.invalidate_node_cache()
+RETURNS trigger LANGUAGE C
+AS 'MODULE_PATHNAME', $$invalidate_node_cache$$;
+
+comment on function pgautofailover.invalidate_node_cache()
+        is 'invalidate the shared node cache entries of modified groups';
+
+CREATE TRIGGER invalidate_node_cache
+         AFTER INSERT OR UPDATE OR DELETE
+            ON pgautofailover.node
+      FOR EACH ROW
+       EXECUTE PROCEDURE pgautofailover.invalidate_node_cache();
+
+CREATE TRIGGER invalidate_node_cache_on_truncate
+         AFTER TRUNCATE
+            ON pgautofailover.node
+      FOR EACH STATEMENT
+       EXECUTE PROCEDURE pgautofailover.invalidate_node_cache();
 
 CREATE TABLE pgautofailover.event
  (
@@ -181,10 +215,28 @@ CREATE TABLE pgautofailover.event
     candidatepriority int,
     replicationquorum bool,
     description       text,
+    traceid           text not null default '',
 
     PRIMARY KEY (eventid)
  );
 
+CREATE INDEX event_formationid_groupid_eventid_idx
+          ON pgautofailover.event (formationid, groupid, eventid DESC);
+
+CREATE TABLE pgautofailover.node_progress
+ (
+    nodeid      bigint not null,
+    operation   text not null,
+    donebytes   bigint not null,
+    totalbytes  bigint not null,
+    startedat   timestamptz not null default now(),
+    reportedat  timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node(nodeid)
+            ON DELETE CASCADE
+ );
+
 GRANT SELECT ON ALL TABLES IN SCHEMA pgautofailover TO autoctl_node;
 
 CREATE FUNCTION pgautofailover.set_node_system_identifier
@@ -273,6 +325,25 @@ grant execute on function
    to autoctl_node;
 
 
+CREATE FUNCTION pgautofailover.register_nodes
+ (
+    IN nodes                jsonb,
+   OUT assigned_node_id     bigint,
+   OUT assigned_group_id    int,
+   OUT assigned_group_state pgautofailover.replication_state,
+   OUT assigned_candidate_priority 	int,
+   OUT assigned_replication_quorum  bool,
+   OUT assigned_node_name   text
+ )
+RETURNS SETOF record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$register_nodes$$;
+
+comment on function pgautofailover.register_nodes(jsonb)
+        is 'register many nodes at once, given as a JSON array of register_node arguments';
+
+grant execute on function pgautofailover.register_nodes(jsonb)
+   to autoctl_node;
+
 CREATE FUNCTION pgautofailover.node_active
  (
     IN formation_id           		text,
@@ -297,6 +368,37 @@ grant execute on function
                           pgautofailover.replication_state,bool,int,pg_lsn,text)
    to autoctl_node;
 
+CREATE FUNCTION pgautofailover.node_active
+ (
+    IN formation_id           		text,
+    IN node_id        		        bigint,
+    IN group_id       		        int,
+    IN current_group_role     		pgautofailover.replication_state,
+    IN current_pg_is_running  		bool,
+    IN current_tli			  		integer,
+    IN current_lsn			  		pg_lsn,
+    IN current_rep_state      		text,
+    IN known_group_version          bigint,
+    IN current_replay_lsn           pg_lsn,
+    IN current_apply_rate           bigint,
+   OUT assigned_node_id       		bigint,
+   OUT assigned_group_id      		int,
+   OUT assigned_group_state   		pgautofailover.replication_state,
+   OUT assigned_candidate_priority 	int,
+   OUT assigned_replication_quorum  bool,
+   OUT group_version                bigint,
+   OUT group_version_changed        bool,
+   OUT goal_trace_id                text
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$node_active$$;
+
+grant execute on function
+      pgautofailover.node_active(text,bigint,int,
+                          pgautofailover.replication_state,bool,int,pg_lsn,text,
+                          bigint,pg_lsn,bigint)
+   to autoctl_node;
+
 CREATE FUNCTION pgautofailover.get_nodes
  (
     IN formation_id     text default 'default',
@@ -408,18 +510,44 @@ CREATE FUNCTION pgautofailover.get_most_advanced_standby
    OUT node_lsn         pg_lsn,
    OUT node_is_primary  bool
  )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$get_most_advanced_standby$$;
+
+comment on function pgautofailover.get_most_advanced_standby(text,int)
+        is 'get the standby node that reported the most advanced LSN';
+
+grant execute on function pgautofailover.get_most_advanced_standby(text,int)
+   to autoctl_node;
+
+
+CREATE FUNCTION pgautofailover.get_clone_source
+ (
+   IN formationid       text default 'default',
+   IN groupid           int default 0,
+   OUT node_id          bigint,
+   OUT node_name        text,
+   OUT node_host        text,
+   OUT node_port        int,
+   OUT node_lsn         pg_lsn,
+   OUT node_is_primary  bool
+ )
 RETURNS SETOF record LANGUAGE SQL STRICT
 AS $$
    select nodeid, nodename, nodehost, nodeport, reportedlsn, false
      from pgautofailover.node
     where formationid = $1
       and groupid = $2
-      and reportedstate = 'report_lsn'
- order by reportedlsn desc, health desc
+      and reportedstate = 'secondary'
+      and goalstate = 'secondary'
+      and health = 1
+ order by replicationquorum, reportedlsn desc, nodeid
     limit 1;
 $$;
 
-grant execute on function pgautofailover.get_most_advanced_standby(text,int)
+comment on function pgautofailover.get_clone_source(text,int)
+        is 'get a healthy secondary node to copy the data files from';
+
+grant execute on function pgautofailover.get_clone_source(text,int)
    to autoctl_node;
 
 
@@ -452,6 +580,23 @@ comment on function pgautofailover.remove_node(text,int,bool)
 grant execute on function pgautofailover.remove_node(text,int,bool)
    to autoctl_node;
 
+CREATE FUNCTION pgautofailover.remove_nodes
+ (
+    IN node_ids        bigint[],
+    IN force           bool default 'false',
+   OUT node_id         bigint,
+   OUT group_id        int,
+   OUT removed         bool
+ )
+RETURNS SETOF record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$remove_nodes$$;
+
+comment on function pgautofailover.remove_nodes(bigint[],bool)
+        is 'remove many nodes from the monitor at once';
+
+grant execute on function pgautofailover.remove_nodes(bigint[],bool)
+   to autoctl_node;
+
 CREATE FUNCTION pgautofailover.perform_failover
  (
   formation_id text default 'default',
@@ -512,7 +657,7 @@ with last_events as
          nodeid, groupid, nodename, nodehost, nodeport,
          reportedstate, goalstate,
          reportedrepstate, reportedtli, reportedlsn,
-         candidatepriority, replicationquorum, description
+         candidatepriority, replicationquorum, description, traceid
     from pgautofailover.event
 order by eventid desc
    limit count
@@ -539,7 +684,7 @@ with last_events as
            nodeid, groupid, nodename, nodehost, nodeport,
            reportedstate, goalstate,
            reportedrepstate, reportedtli, reportedlsn,
-           candidatepriority, replicationquorum, description
+           candidatepriority, replicationquorum, description, traceid
       from pgautofailover.event
      where formationid = formation_id
   order by eventid desc
@@ -568,7 +713,7 @@ with last_events as
            nodeid, groupid, nodename, nodehost, nodeport,
            reportedstate, goalstate,
            reportedrepstate, reportedtli, reportedlsn,
-           candidatepriority, replicationquorum, description
+           candidatepriority, replicationquorum, description, traceid
       from pgautofailover.event
      where formationid = formation_id
        and groupid = group_id
@@ -584,6 +729,175 @@ comment on function pgautofailover.last_events(text,int,int)
 grant execute on function pgautofailover.last_events(text,int,int)
    to autoctl_node;
 
+CREATE FUNCTION pgautofailover.failover_timeline
+ (
+    IN formation_id    text default 'default',
+    IN group_id        int  default 0,
+   OUT eventid         bigint,
+   OUT eventtime       timestamptz,
+   OUT nodeid          bigint,
+   OUT nodename        text,
+   OUT reportedstate   pgautofailover.replication_state,
+   OUT goalstate       pgautofailover.replication_state,
+   OUT phase           text,
+   OUT elapsed         interval,
+   OUT duration        interval,
+   OUT description     text
+ )
+RETURNS SETOF record LANGUAGE SQL STRICT
+AS $$
+with promotion as
+(
+    select max(event.eventid) as eventid
+      from pgautofailover.event
+     where event.formationid = formation_id
+       and event.groupid = group_id
+       and event.goalstate = 'prepare_promotion'
+),
+promoted as
+(
+    select event.eventid, event.nodeid
+      from pgautofailover.event
+      join promotion on promotion.eventid = event.eventid
+),
+episode_start as
+(
+    select coalesce(max(event.eventid), 0) as eventid
+      from pgautofailover.event, promotion
+     where event.formationid = formation_id
+       and event.groupid = group_id
+       and event.eventid < promotion.eventid
+       and event.reportedstate = event.goalstate
+       and event.reportedstate in ('primary', 'secondary', 'single')
+       and event.description !~ 'is marked as unhealthy'
+),
+episode_end as
+(
+    select min(event.eventid) as eventid
+      from pgautofailover.event, promoted
+     where event.nodeid = promoted.nodeid
+       and event.eventid > promoted.eventid
+       and event.reportedstate = 'primary'
+),
+episode as
+(
+    select event.eventid, event.eventtime, event.nodeid, event.nodename,
+           event.reportedstate, event.goalstate, event.description
+      from pgautofailover.event, episode_start, episode_end
+     where event.formationid = formation_id
+       and event.groupid = group_id
+       and event.eventid > episode_start.eventid
+       and (episode_end.eventid is null
+            or event.eventid <= episode_end.eventid)
+)
+  select episode.eventid, episode.eventtime,
+         episode.nodeid, episode.nodename,
+         episode.reportedstate, episode.goalstate,
+         case when episode.description ~ 'is marked as unhealthy'
+              then 'detection'
+              when episode.goalstate in ('draining', 'demote_timeout', 'demoted')
+                or episode.reportedstate in ('draining', 'demote_timeout')
+              then 'demotion'
+              when episode.goalstate = 'report_lsn'
+              then 'report_lsn'
+              when episode.goalstate = 'fast_forward'
+              then 'fast_forward'
+              when episode.goalstate in ('prepare_promotion', 'stop_replication')
+              then 'promotion'
+              when episode.goalstate in ('wait_primary', 'primary')
+              then 'primary'
+              when episode.goalstate in ('join_secondary', 'catchingup', 'secondary')
+              then 'rejoin'
+              else 'other'
+          end as phase,
+         episode.eventtime - first_value(episode.eventtime)
+                               over (order by episode.eventid) as elapsed,
+         lead(episode.eventtime) over (order by episode.eventid)
+           - episode.eventtime as duration,
+         episode.description
+    from episode
+   where exists (select 1 from promoted)
+order by episode.eventid;
+$$;
+
+comment on function pgautofailover.failover_timeline(text,int)
+        is 'retrieve the events of the last failover of given formation and group';
+
+grant execute on function pgautofailover.failover_timeline(text,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.stat_protocol
+ (
+   OUT function_name   text,
+   OUT formationid     text,
+   OUT groupid         int,
+   OUT calls           bigint,
+   OUT errors          bigint,
+   OUT total_time      double precision,
+   OUT max_time        double precision,
+   OUT lock_wait_time  double precision
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$stat_protocol$$;
+
+comment on function pgautofailover.stat_protocol()
+        is 'get the statistics of the monitor protocol calls';
+
+CREATE VIEW pgautofailover.stat_protocol
+    AS
+    SELECT function_name, formationid, groupid,
+           calls, errors, total_time,
+           total_time / nullif(calls, 0) as mean_time,
+           max_time, lock_wait_time
+      FROM pgautofailover.stat_protocol();
+
+comment on view pgautofailover.stat_protocol
+        is 'statistics of the monitor protocol calls, times in milliseconds';
+
+grant select on pgautofailover.stat_protocol to autoctl_node;
+
+CREATE FUNCTION pgautofailover.stat_protocol_reset()
+RETURNS void LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$stat_protocol_reset$$;
+
+comment on function pgautofailover.stat_protocol_reset()
+        is 'discard the statistics of the monitor protocol calls';
+
+CREATE FUNCTION pgautofailover.health_check_latency
+ (
+   OUT nodeid          bigint,
+   OUT probes          bigint,
+   OUT mean_ms         double precision,
+   OUT max_ms          double precision,
+   OUT last_ms         double precision,
+   OUT bucket_bounds   double precision[],
+   OUT bucket_counts   bigint[]
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$health_check_latency$$;
+
+comment on function pgautofailover.health_check_latency()
+        is 'get the histogram of the health check latencies of each node';
+
+grant execute on function pgautofailover.health_check_latency()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.node_heartbeat_intervals
+ (
+   OUT nodeid                bigint,
+   OUT heartbeats            bigint,
+   OUT p999_interval_ms      int,
+   OUT unhealthy_timeout_ms  int
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$node_heartbeat_intervals$$;
+
+comment on function pgautofailover.node_heartbeat_intervals()
+        is 'get the heartbeat intervals and the unhealthy timeout of each node';
+
+grant execute on function pgautofailover.node_heartbeat_intervals()
+   to autoctl_node;
+
 CREATE FUNCTION pgautofailover.current_state
  (
     IN formation_id         text default 'default',
@@ -600,19 +914,14 @@ CREATE FUNCTION pgautofailover.current_state
    OUT reported_tli         int,
    OUT reported_lsn         pg_lsn,
    OUT health               integer,
-   OUT nodecluster          text
+   OUT nodecluster          text,
+   OUT reachable            text,
+   OUT lag_bytes            bigint,
+   OUT health_lag           double precision,
+   OUT report_lag           double precision
  )
-RETURNS SETOF record LANGUAGE SQL STRICT
-AS $$
-   select kind, nodename, nodehost, nodeport, groupid, nodeid,
-          reportedstate, goalstate,
-   		  candidatepriority, replicationquorum,
-          reportedtli, reportedlsn, health, nodecluster
-     from pgautofailover.node
-     join pgautofailover.formation using(formationid)
-    where formationid = formation_id
- order by groupid, nodeid;
-$$;
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$current_state$$;
 
 comment on function pgautofailover.current_state(text)
         is 'get the current state of both nodes of a formation';
@@ -637,25 +946,240 @@ CREATE FUNCTION pgautofailover.current_state
    OUT reported_tli         int,
    OUT reported_lsn         pg_lsn,
    OUT health               integer,
-   OUT nodecluster          text
+   OUT nodecluster          text,
+   OUT reachable            text,
+   OUT lag_bytes            bigint,
+   OUT health_lag           double precision,
+   OUT report_lag           double precision
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$current_state$$;
+
+comment on function pgautofailover.current_state(text, int)
+        is 'get the current state of both nodes of a group in a formation';
+
+grant execute on function pgautofailover.current_state(text, int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.fleet_state
+ (
+   OUT formation_id         text,
+   OUT group_id             int,
+   OUT nodes                int,
+   OUT primary_name         text,
+   OUT primary_state        pgautofailover.replication_state,
+   OUT standbys             int,
+   OUT healthy_standbys     int,
+   OUT max_lag_bytes        bigint,
+   OUT in_flux              bool
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$fleet_state$$;
+
+comment on function pgautofailover.fleet_state()
+        is 'get a summary of the current state of each group of all formations';
+
+grant execute on function pgautofailover.fleet_state()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_progress
+ (
+    IN node_id      bigint,
+    IN operation    text,
+    IN done_bytes   bigint,
+    IN total_bytes  bigint
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+      insert into pgautofailover.node_progress
+                  (nodeid, operation, donebytes, totalbytes)
+           values (node_id, set_node_progress.operation,
+                   done_bytes, total_bytes)
+      on conflict (nodeid)
+        do update
+              set operation = excluded.operation,
+                  donebytes = excluded.donebytes,
+                  totalbytes = excluded.totalbytes,
+                  reportedat = now(),
+                  startedat =
+                   case when node_progress.operation = excluded.operation
+                         and node_progress.donebytes <= excluded.donebytes
+                        then node_progress.startedat
+                        else now()
+                    end
+        returning true;
+$$;
+
+comment on function pgautofailover.set_node_progress(bigint,text,bigint,bigint)
+        is 'report the progress of a pg_basebackup or pg_rewind operation';
+
+grant execute on function pgautofailover.set_node_progress(bigint,text,bigint,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.clear_node_progress
+ (
+    IN node_id      bigint
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+     with deleted as
+     (
+       delete from pgautofailover.node_progress
+             where nodeid = node_id
+         returning nodeid
+     )
+     select count(*) > 0 from deleted;
+$$;
+
+comment on function pgautofailover.clear_node_progress(bigint)
+        is 'forget about the progress of a node operation';
+
+grant execute on function pgautofailover.clear_node_progress(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.current_progress
+ (
+    IN formation_id  text default 'default',
+   OUT node_id       bigint,
+   OUT group_id      int,
+   OUT node_name     text,
+   OUT operation     text,
+   OUT done_bytes    bigint,
+   OUT total_bytes   bigint,
+   OUT rate          bigint,
+   OUT eta           interval,
+   OUT reported_at   timestamptz
  )
 RETURNS SETOF record LANGUAGE SQL STRICT
 AS $$
-   select kind, nodename, nodehost, nodeport, groupid, nodeid,
-          reportedstate, goalstate,
-   		  candidatepriority, replicationquorum,
-          reportedtli, reportedlsn, health, nodecluster
-     from pgautofailover.node
-     join pgautofailover.formation using(formationid)
-    where formationid = formation_id
-      and groupid = group_id
+   with progress as
+   (
+     select nodeid, groupid, nodename, operation, donebytes, totalbytes,
+            reportedat,
+            extract(epoch from reportedat - startedat)::float8 as elapsed
+       from pgautofailover.node_progress
+       join pgautofailover.node using(nodeid)
+      where formationid = formation_id
+   )
+   select nodeid, groupid, nodename, operation, donebytes, totalbytes,
+          case when elapsed > 0 then (donebytes / elapsed)::bigint end,
+          case when elapsed > 0 and donebytes > 0
+               then make_interval(
+                      secs => round(greatest(totalbytes - donebytes, 0)
+                                    * elapsed / donebytes))
+           end,
+          reportedat
+     from progress
  order by groupid, nodeid;
 $$;
 
-comment on function pgautofailover.current_state(text, int)
-        is 'get the current state of both nodes of a group in a formation';
+comment on function pgautofailover.current_progress(text)
+        is 'get the progress of pg_basebackup and pg_rewind operations';
 
-grant execute on function pgautofailover.current_state(text, int)
+grant execute on function pgautofailover.current_progress(text)
+   to autoctl_node;
+
+CREATE TABLE pgautofailover.replication_report
+ (
+    nodeid      bigint not null,
+    sentlsn     pg_lsn,
+    writelsn    pg_lsn,
+    flushlsn    pg_lsn,
+    replaylsn   pg_lsn,
+    writelag    bigint,
+    flushlag    bigint,
+    retainedbytes bigint,
+    reportedby  bigint,
+    disconnectedat timestamptz,
+    reportedat  timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node(nodeid)
+            ON DELETE CASCADE
+ );
+
+grant select on pgautofailover.replication_report to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_replication_report
+ (
+    IN node_id      bigint,
+    IN standby_ids  bigint[],
+    IN sent_lsns    pg_lsn[],
+    IN write_lsns   pg_lsn[],
+    IN flush_lsns   pg_lsn[],
+    IN replay_lsns  pg_lsn[],
+    IN write_lags   bigint[],
+    IN flush_lags   bigint[],
+    IN retained_bytes bigint[]
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+     with report as
+     (
+       select standby.nodeid, rep.sentlsn, rep.writelsn, rep.flushlsn,
+              rep.replaylsn, rep.writelag, rep.flushlag, rep.retainedbytes,
+              reporter.nodeid as reportedby
+         from unnest(standby_ids, sent_lsns, write_lsns, flush_lsns,
+                     replay_lsns, write_lags, flush_lags, retained_bytes)
+              as rep(nodeid, sentlsn, writelsn, flushlsn,
+                     replaylsn, writelag, flushlag, retainedbytes)
+         join pgautofailover.node as standby
+           on standby.nodeid = rep.nodeid
+         join pgautofailover.node as reporter
+           on reporter.nodeid = node_id
+          and reporter.formationid = standby.formationid
+          and reporter.groupid = standby.groupid
+          and reporter.goalstate in ('primary', 'wait_primary')
+     ),
+     saved as
+     (
+       -- a standby that has a slot but no walsender is disconnected
+       insert into pgautofailover.replication_report as previous
+                   (nodeid, sentlsn, writelsn, flushlsn, replaylsn,
+                    writelag, flushlag, retainedbytes,
+                    reportedby, disconnectedat)
+            select nodeid, sentlsn, writelsn, flushlsn, replaylsn,
+                   writelag, flushlag, retainedbytes,
+                   reportedby,
+                   case when sentlsn is null then now() end
+              from report
+       on conflict (nodeid)
+         do update
+               set sentlsn = excluded.sentlsn,
+                   writelsn = excluded.writelsn,
+                   flushlsn = excluded.flushlsn,
+                   replaylsn = excluded.replaylsn,
+                   writelag = excluded.writelag,
+                   flushlag = excluded.flushlag,
+                   retainedbytes = excluded.retainedbytes,
+                   reportedby = excluded.reportedby,
+                   disconnectedat =
+                     case when excluded.sentlsn is not null
+                          then null
+                          when previous.reportedby = excluded.reportedby
+                          then coalesce(previous.disconnectedat, now())
+                          else now()
+                      end,
+                   reportedat = now()
+         returning nodeid
+     ),
+     advanced as
+     (
+       update pgautofailover.node as standby
+          set reportedlsn = report.flushlsn,
+              walreporttime = now()
+         from report
+        where standby.nodeid = report.nodeid
+          and report.flushlsn > standby.reportedlsn
+    returning standby.nodeid
+     )
+     select count(*) > 0 from saved;
+$$;
+
+comment on function pgautofailover.set_replication_report(bigint,bigint[],pg_lsn[],pg_lsn[],pg_lsn[],pg_lsn[],bigint[],bigint[],bigint[])
+        is 'report the pg_stat_replication view and the replication slots of a primary node';
+
+grant execute on function pgautofailover.set_replication_report(bigint,bigint[],pg_lsn[],pg_lsn[],pg_lsn[],pg_lsn[],bigint[],bigint[],bigint[])
    to autoctl_node;
 
 
@@ -699,6 +1223,88 @@ AS $$
        and nodecluster = cluster_name;
 $$;
 
+CREATE FUNCTION pgautofailover.formation_read_uri
+ (
+    IN formation_id         text DEFAULT 'default',
+    IN max_lag_bytes        bigint DEFAULT 16777216,
+    IN node_zone            text DEFAULT '',
+    IN load_balance         bool DEFAULT false,
+    IN sslmode              text DEFAULT 'prefer',
+    IN sslrootcert          text DEFAULT '',
+    IN sslcrl               text DEFAULT ''
+ )
+RETURNS text LANGUAGE SQL STRICT
+AS $$
+    with nodes as
+    (
+        select nodehost, nodeport, nodeid, nodezone, formation.dbname,
+               reportedstate, goalstate, health, reportedpgisrunning,
+               pg_wal_lsn_diff(
+                   max(reportedlsn) over (),
+                   case when reportedreplaylsn = '0/0'
+                        then reportedlsn
+                        else reportedreplaylsn
+                    end) as lag
+          from pgautofailover.node as node
+               join pgautofailover.formation using(formationid)
+         where formationid = formation_id
+           and groupid = 0
+           and nodecluster = 'default'
+    ),
+    hosts as
+    (
+        -- standby nodes that are close enough to the primary
+        select nodehost, nodeport, dbname,
+               0 as rank,
+               nodezone <> node_zone as otherzone,
+               lag, nodeid
+          from nodes
+         where reportedstate = 'secondary'
+           and goalstate = 'secondary'
+           and reportedpgisrunning
+           and health <> 0
+           and lag <= max_lag_bytes
+
+         union all
+
+        -- and the primary, used when no standby is available
+        select nodehost, nodeport, dbname, 1, false, 0, nodeid
+          from nodes
+         where reportedstate in ('single', 'wait_primary', 'primary',
+                                 'join_primary', 'apply_settings')
+           and goalstate = reportedstate
+    )
+    select case
+           when string_agg(format('%s:%s', nodehost, nodeport),',') is not null
+           then format(
+               'postgres://%s/%s?target_session_attrs=prefer-standby&%ssslmode=%s%s%s',
+               string_agg(format('%s:%s', nodehost, nodeport), ','
+                          order by rank, otherzone, lag, nodeid),
+               min(dbname),
+               case when load_balance
+                    then 'load_balance_hosts=random&'
+                    else ''
+               end,
+               formation_read_uri.sslmode,
+               CASE WHEN formation_read_uri.sslrootcert = ''
+                   THEN ''
+                   ELSE '&sslrootcert=' || formation_read_uri.sslrootcert
+               END,
+               CASE WHEN formation_read_uri.sslcrl = ''
+                   THEN ''
+                   ELSE '&sslcrl=' || formation_read_uri.sslcrl
+               END
+           )
+           end as uri
+      from hosts;
+$$;
+
+comment on function pgautofailover.formation_read_uri(text,bigint,text,bool,text,text,text)
+        is 'get a connection string that spreads reads on the standby nodes';
+
+grant execute on function pgautofailover.formation_read_uri(text,bigint,text,bool,text,text,text)
+   to autoctl_node;
+
 CREATE FUNCTION pgautofailover.enable_secondary
  (
    formation_id text
@@ -795,6 +1401,256 @@ grant execute on function
       pgautofailover.set_node_replication_quorum(text, text, bool)
    to autoctl_node;
 
+CREATE TABLE pgautofailover.node_resources
+ (
+    nodeid        bigint not null,
+    ncpu          int not null,
+    totalram      bigint not null,
+    availableram  bigint not null,
+    loadaverage   float8 not null,
+    cpuusage      float8 not null,
+    diskreadrate  bigint not null,
+    diskwriterate bigint not null,
+    walrate       bigint not null,
+    reportedat    timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node(nodeid)
+            ON DELETE CASCADE
+ );
+
+grant select on pgautofailover.node_resources to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_resources
+ (
+    IN node_id         bigint,
+    IN cpu_count       int,
+    IN total_ram       bigint,
+    IN available_ram   bigint,
+    IN load_average    float8,
+    IN cpu_usage       float8,
+    IN disk_read_rate  bigint,
+    IN disk_write_rate bigint,
+    IN wal_rate        bigint
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+     with saved as
+     (
+       insert into pgautofailover.node_resources
+                   (nodeid, ncpu, totalram, availableram, loadaverage,
+                    cpuusage, diskreadrate, diskwriterate, walrate)
+            select nodeid, cpu_count, total_ram, available_ram, load_average,
+                   cpu_usage, disk_read_rate, disk_write_rate, wal_rate
+              from pgautofailover.node
+             where nodeid = node_id
+       on conflict (nodeid)
+         do update
+               set ncpu = excluded.ncpu,
+                   totalram = excluded.totalram,
+                   availableram = excluded.availableram,
+                   loadaverage = excluded.loadaverage,
+                   cpuusage = excluded.cpuusage,
+                   diskreadrate = excluded.diskreadrate,
+                   diskwriterate = excluded.diskwriterate,
+                   walrate = excluded.walrate,
+                   reportedat = now()
+         returning nodeid
+     )
+     select count(*) > 0 from saved;
+$$;
+
+comment on function pgautofailover.set_node_resources(bigint,int,bigint,bigint,float8,float8,bigint,bigint,bigint)
+        is 'report the CPU, memory, disk and WAL usage of the host of a node';
+
+grant execute on function pgautofailover.set_node_resources(bigint,int,bigint,bigint,float8,float8,bigint,bigint,bigint)
+   to autoctl_node;
+
+CREATE TABLE pgautofailover.node_sync_rep_waits
+ (
+    nodeid        bigint not null,
+    waiting       int not null,
+    oldestwaitms  bigint not null,
+    maxwaitms     bigint not null,
+    stalls        bigint not null default 0,
+    stalledsince  timestamptz,
+    reportedat    timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node(nodeid)
+            ON DELETE CASCADE
+ );
+
+grant select on pgautofailover.node_sync_rep_waits to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_sync_rep_waits
+ (
+    IN node_id         bigint,
+    IN waiting         int,
+    IN oldest_wait_ms  bigint
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_sync_rep_waits$$;
+
+comment on function pgautofailover.set_sync_rep_waits(bigint,int,bigint)
+        is 'report how many commits wait for synchronous replication on a primary node';
+
+grant execute on function pgautofailover.set_sync_rep_waits(bigint,int,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.wait_for_state_change
+ (
+    IN formation_id   text,
+    IN group_id       int,
+    IN since_version  bigint,
+    IN timeout_ms     int
+ )
+RETURNS bigint LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$wait_for_state_change$$;
+
+comment on function pgautofailover.wait_for_state_change(text,int,bigint,int)
+        is 'wait until the states of a group change, and return the group version';
+
+grant execute on function pgautofailover.wait_for_state_change(text,int,bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.subscribe_log_notifications
+ (
+    IN level          text default 'info',
+    IN formation_id   text default NULL
+ )
+RETURNS void LANGUAGE C
+AS 'MODULE_PATHNAME', $$subscribe_log_notifications$$;
+
+comment on function pgautofailover.subscribe_log_notifications(text,text)
+        is 'listen to the monitor log notifications of a level and above';
+
+grant execute on function pgautofailover.subscribe_log_notifications(text,text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.unsubscribe_log_notifications()
+RETURNS bool LANGUAGE C
+AS 'MODULE_PATHNAME', $$unsubscribe_log_notifications$$;
+
+comment on function pgautofailover.unsubscribe_log_notifications()
+        is 'stop listening to the monitor log notifications';
+
+grant execute on function pgautofailover.unsubscribe_log_notifications()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_zone
+ (
+    IN formation_id       text,
+    IN node_name          text,
+    IN node_zone          text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+     with updated as
+     (
+       update pgautofailover.node
+          set nodezone = node_zone
+        where formationid = formation_id
+          and nodename = node_name
+    returning nodeid
+     )
+     select count(*) > 0 from updated;
+$$;
+
+comment on function pgautofailover.set_node_zone(text, text, text)
+        is 'sets the zone of a node, used to prefer nearby nodes';
+
+grant execute on function
+      pgautofailover.set_node_zone(text, text, text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_upstream
+ (
+    IN formation_id       text,
+    IN node_name          text,
+    IN upstream_name      text
+ )
+RETURNS bool LANGUAGE C SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_node_upstream$$;
+
+comment on function pgautofailover.set_node_upstream(text, text, text)
+        is 'sets the standby node a node streams from, NULL to stream from the primary';
+
+grant execute on function
+      pgautofailover.set_node_upstream(text, text, text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_upstream
+ (
+    IN node_id            bigint,
+   OUT upstream_node_id   bigint,
+   OUT upstream_name      text,
+   OUT upstream_host      text,
+   OUT upstream_port      int
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$get_upstream$$;
+
+comment on function pgautofailover.get_upstream(bigint)
+        is 'get the node that a standby node streams from';
+
+grant execute on function pgautofailover.get_upstream(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_node_timeline
+ (
+    IN node_id            bigint,
+   OUT sysidentifier      bigint,
+   OUT timeline           int
+ )
+RETURNS record LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+    select sysidentifier, reportedtli
+      from pgautofailover.node
+     where nodeid = get_node_timeline.node_id
+       and reportedstate in ('single', 'wait_primary', 'primary',
+                             'join_primary', 'apply_settings');
+$$;
+
+comment on function pgautofailover.get_node_timeline(bigint)
+        is 'get the system identifier and timeline last reported by a primary node';
+
+grant execute on function pgautofailover.get_node_timeline(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_cascaded_nodes
+ (
+    IN nodeid           bigint,
+   OUT node_id          bigint,
+   OUT node_name        text,
+   OUT node_host        text,
+   OUT node_port        int,
+   OUT node_lsn         pg_lsn,
+   OUT node_is_primary  bool
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$get_cascaded_nodes$$;
+
+comment on function pgautofailover.get_cascaded_nodes(bigint)
+        is 'get the other nodes in a group that stream from a standby node';
+
+grant execute on function pgautofailover.get_cascaded_nodes(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.renew_primary_lease
+ (
+    IN node_id          bigint,
+    IN lease_timeout    int
+ )
+RETURNS timestamptz LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$renew_primary_lease$$;
+
+comment on function pgautofailover.renew_primary_lease(bigint,int)
+        is 'renew the lease of a primary node, given in milliseconds';
+
+grant execute on function pgautofailover.renew_primary_lease(bigint,int)
+   to autoctl_node;
+
 
 create function pgautofailover.synchronous_standby_names
  (
@@ -874,3 +1730,195 @@ $$;
 
 comment on function pgautofailover.formation_settings(text)
         is 'get the current replication settings a formation';
+
+CREATE FUNCTION pgautofailover.last_report_time(IN node_id bigint)
+RETURNS timestamptz LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$last_report_time$$;
+
+comment on function pgautofailover.last_report_time(bigint)
+        is 'get the last time a node reported to the monitor';
+
+CREATE TABLE pgautofailover.formation_shard
+ (
+    formationid  text not null,
+    monitor_uri  text not null,
+
+    PRIMARY KEY (formationid)
+ );
+
+grant select on pgautofailover.formation_shard to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_formation_shard
+ (
+    IN formation_id  text,
+    IN monitor_uri   text
+ )
+RETURNS pgautofailover.formation_shard LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  insert into pgautofailover.formation_shard(formationid, monitor_uri)
+       values (formation_id, monitor_uri)
+  on conflict (formationid)
+    do update set monitor_uri = excluded.monitor_uri
+    returning formationid, monitor_uri;
+$$;
+
+comment on function pgautofailover.set_formation_shard(text, text)
+        is 'assigns a formation to the monitor shard that owns it';
+
+CREATE FUNCTION pgautofailover.drop_formation_shard
+ (
+    IN formation_id  text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+     with deleted as
+     (
+       delete from pgautofailover.formation_shard
+             where formationid = formation_id
+         returning formationid
+     )
+     select count(*) > 0 from deleted;
+$$;
+
+comment on function pgautofailover.drop_formation_shard(text)
+        is 'removes a formation from the monitor shards directory';
+
+CREATE FUNCTION pgautofailover.current_state_json
+ (
+    IN formation_id  text default 'default',
+    IN group_id      int  default -1
+ )
+RETURNS SETOF text LANGUAGE SQL STRICT
+AS $$
+   select jsonb_pretty(to_jsonb(state)
+          || jsonb_build_object('health_check_latency',
+                                to_jsonb(latency) - 'nodeid')
+          || jsonb_build_object('resources',
+                                to_jsonb(resources) - 'nodeid')
+          || jsonb_build_object('sync_rep_waits',
+                                to_jsonb(syncrep) - 'nodeid'))
+     from pgautofailover.current_state(formation_id) as state
+          left join pgautofailover.health_check_latency() as latency
+                 on latency.nodeid = state.node_id
+          left join pgautofailover.node_resources as resources
+                 on resources.nodeid = state.node_id
+          left join pgautofailover.node_sync_rep_waits as syncrep
+                 on syncrep.nodeid = state.node_id
+    where current_state_json.group_id < 0
+       or state.group_id = current_state_json.group_id
+ order by state.group_id, state.node_id;
+$$;
+
+comment on function pgautofailover.current_state_json(text, int)
+        is 'get the current state of the nodes of a formation, one JSON object per node';
+
+grant execute on function pgautofailover.current_state_json(text, int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.last_events_json
+ (
+    IN formation_id  text default 'default',
+    IN group_id      int  default -1,
+    IN count         int  default 10
+ )
+RETURNS SETOF text LANGUAGE SQL STRICT
+AS $$
+with last_events as
+(
+    select *
+      from pgautofailover.event
+     where formationid = formation_id
+       and (last_events_json.group_id < 0
+            or groupid = last_events_json.group_id)
+  order by eventid desc
+     limit count
+)
+select jsonb_pretty(to_jsonb(last_events))
+  from last_events
+order by eventtime, eventid;
+$$;
+
+comment on function pgautofailover.last_events_json(text, int, int)
+        is 'retrieve last COUNT events, one JSON object per event';
+
+grant execute on function pgautofailover.last_events_json(text, int, int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.formation_settings_json
+ (
+    IN formation_id  text default 'default'
+ )
+RETURNS text LANGUAGE SQL STRICT
+AS $$
+  with settings as
+  (
+    select * from pgautofailover.formation_settings(formation_id)
+  )
+  select jsonb_pretty(jsonb_build_object(
+           'formation', (select jsonb_agg(to_jsonb(settings))
+                           from settings where context = 'formation'),
+           'primary', (select jsonb_agg(to_jsonb(settings))
+                         from settings where context = 'primary'),
+           'nodes', (select jsonb_agg(to_jsonb(settings))
+                       from settings where context = 'node')));
+$$;
+
+comment on function pgautofailover.formation_settings_json(text)
+        is 'get the current replication settings of a formation as JSON';
+
+grant execute on function pgautofailover.formation_settings_json(text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.events_since
+ (
+    IN event_id      bigint,
+    IN count         int  default 100,
+    IN formation_id  text default 'default',
+    IN group_id      int  default -1
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE SQL STRICT
+AS $$
+    select *
+      from pgautofailover.event
+     where eventid > event_id
+       and formationid = formation_id
+       and (events_since.group_id < 0 or groupid = events_since.group_id)
+  order by eventid
+     limit count;
+$$;
+
+comment on function pgautofailover.events_since(bigint, int, text, int)
+        is 'retrieve at most COUNT events that happened after EVENT_ID';
+
+grant execute on function pgautofailover.events_since(bigint, int, text, int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.node_probes
+ (
+   OUT nodeid                bigint,
+   OUT probe_time            timestamptz,
+   OUT in_recovery           bool,
+   OUT lsn                   pg_lsn,
+   OUT replay_lsn            pg_lsn
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$node_probes$$;
+
+comment on function pgautofailover.node_probes()
+        is 'get the role and WAL positions that health checks probed on each node';
+
+grant execute on function pgautofailover.node_probes()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.invalidate_formation_cache()
+RETURNS trigger LANGUAGE C
+AS 'MODULE_PATHNAME', $$invalidate_formation_cache$$;
+
+comment on function pgautofailover.invalidate_formation_cache()
+        is 'invalidate the formation caches of all the backends';
+
+CREATE TRIGGER invalidate_formation_cache
+         AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+            ON pgautofailover.formation
+      FOR EACH STATEMENT
+       EXECUTE PROCEDURE pgautofailover.invalidate_formation_cache();
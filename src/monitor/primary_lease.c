@@ -0,0 +1,208 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/primary_lease.c
+ *
+ * Implementation of the shared memory tracking of primary node leases.
+ *
+ * When the primary node is lost, the monitor assigns it the demote_timeout
+ * state and waits for pgautofailover.primary_demote_timeout before promoting
+ * a standby node, because it can't know whether the primary is still taking
+ * writes on the other side of a network partition.
+ *
+ * When configured with a timeout.primary_lease_timeout, the keeper of a
+ * primary node renews a lease with the monitor after each node_active call,
+ * and makes its Postgres instance read-only by itself when it could not
+ * renew the lease for half of its duration.
+ *
+ * That fence depends on the keeper being alive, and a client session can
+ * still override it, so an expired lease does not prove that the primary
+ * stopped taking writes: the monitor still waits for the whole demote
+ * timeout before promoting a standby node.
+ *
+ * Leases are kept in shared memory only, and start over after a restart of
+ * the monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "primary_lease.h"
+
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+
+/* we fall back to the demote timeout for nodes past that limit */
+#define PRIMARY_LEASE_MAX_NODES 4096
+
+
+typedef struct PrimaryLeaseKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} PrimaryLeaseKey;
+
+
+typedef struct PrimaryLeaseEntry
+{
+	PrimaryLeaseKey key;
+
+	/* when the keeper last renewed its lease, and until when it holds */
+	TimestampTz renewTime;
+	TimestampTz expireTime;
+} PrimaryLeaseEntry;
+
+
+typedef struct PrimaryLeaseControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} PrimaryLeaseControlData;
+
+
+static PrimaryLeaseControlData *PrimaryLeaseControl = NULL;
+static HTAB *PrimaryLeaseHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void PrimaryLeaseShmemInit(void);
+static void BuildPrimaryLeaseKey(PrimaryLeaseKey *key, int64 nodeId);
+
+
+/*
+ * InitializePrimaryLeases, called at server start, requests the shared
+ * memory used to track primary leases.
+ */
+void
+InitializePrimaryLeases(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(PrimaryLeaseShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = PrimaryLeaseShmemInit;
+}
+
+
+/*
+ * PrimaryLeaseShmemSize computes how much shared memory is required.
+ */
+size_t
+PrimaryLeaseShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(PrimaryLeaseControlData)));
+	size = add_size(size, hash_estimate_size(PRIMARY_LEASE_MAX_NODES,
+											 sizeof(PrimaryLeaseEntry)));
+
+	return size;
+}
+
+
+/*
+ * PrimaryLeaseShmemInit initializes the requested shared memory.
+ */
+static void
+PrimaryLeaseShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	PrimaryLeaseControl =
+		(PrimaryLeaseControlData *)
+		ShmemInitStruct("pg_auto_failover Primary Leases",
+						MAXALIGN(sizeof(PrimaryLeaseControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		PrimaryLeaseControl->trancheId = LWLockNewTrancheId();
+		PrimaryLeaseControl->lockTrancheName = "pg_auto_failover Primary Leases";
+		LWLockRegisterTranche(PrimaryLeaseControl->trancheId,
+							  PrimaryLeaseControl->lockTrancheName);
+
+		LWLockInitialize(&PrimaryLeaseControl->lock,
+						 PrimaryLeaseControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(PrimaryLeaseKey);
+	hashInfo.entrysize = sizeof(PrimaryLeaseEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	PrimaryLeaseHash = ShmemInitHash("pg_auto_failover Primary Leases Hash",
+									 PRIMARY_LEASE_MAX_NODES,
+									 PRIMARY_LEASE_MAX_NODES,
+									 &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * PrimaryLeaseRenew renews the lease of the given node for leaseTimeoutMs
+ * milliseconds from now, and returns when the lease expires. When the hash
+ * table is full, the lease is not registered and we return 0: the keeper
+ * then knows that it does not hold a lease.
+ */
+TimestampTz
+PrimaryLeaseRenew(int64 nodeId, int leaseTimeoutMs)
+{
+	PrimaryLeaseKey key;
+	bool found = false;
+	TimestampTz expireTime = 0;
+
+	/* the lease must start after the last report of the node */
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (PrimaryLeaseHash == NULL)
+	{
+		return 0;
+	}
+
+	BuildPrimaryLeaseKey(&key, nodeId);
+
+	LWLockAcquire(&PrimaryLeaseControl->lock, LW_EXCLUSIVE);
+
+	PrimaryLeaseEntry *entry =
+		(PrimaryLeaseEntry *) hash_search(PrimaryLeaseHash, &key,
+										  HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		entry->renewTime = now;
+		entry->expireTime =
+			TimestampTzPlusMilliseconds(now, (int64) leaseTimeoutMs);
+
+		expireTime = entry->expireTime;
+	}
+
+	LWLockRelease(&PrimaryLeaseControl->lock);
+
+	return expireTime;
+}
@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/primary_lease.h
+ *
+ * Declarations for the shared memory tracking of primary node leases.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+#include "node_metadata.h"
+
+
+/* public function declarations */
+extern void InitializePrimaryLeases(void);
+extern size_t PrimaryLeaseShmemSize(void);
+extern TimestampTz PrimaryLeaseRenew(int64 nodeId, int leaseTimeoutMs);
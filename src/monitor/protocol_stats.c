@@ -0,0 +1,520 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_stats.c
+ *
+ * Implementation of the shared memory statistics of the monitor protocol
+ * calls.
+ *
+ * The monitor load is mostly made of the keepers calling the functions of
+ * node_active_protocol.c, and pg_stat_statements can not tell which
+ * formation or group those calls are about, nor how long they waited for the
+ * formation and group locks. We keep counters per protocol function,
+ * formation and group in shared memory instead, and expose them in the
+ * pgautofailover.stat_protocol view.
+ *
+ * A call starts with ProtocolStatsBegin() and ends when the next call starts
+ * or when the transaction ends, so that its duration includes the work done
+ * at commit time, such as the writing of the events.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "protocol_stats.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+
+/* calls past that limit of functions, formations and groups are not counted */
+#define PROTOCOL_STATS_MAX_ENTRIES 1024
+
+#define PROTOCOL_STATS_COLS 8
+
+
+typedef struct ProtocolStatsKey
+{
+	Oid databaseId;
+	ProtocolFunction function;
+	char formationId[NAMEDATALEN];
+	int groupId;
+} ProtocolStatsKey;
+
+
+typedef struct ProtocolStatsEntry
+{
+	ProtocolStatsKey key;
+
+	int64 calls;
+	int64 errors;
+	double totalTime;           /* in milliseconds */
+	double maxTime;             /* in milliseconds */
+	double lockWaitTime;        /* in milliseconds */
+} ProtocolStatsEntry;
+
+
+typedef struct ProtocolStatsControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} ProtocolStatsControlData;
+
+
+/*
+ * ProtocolCall is the protocol call in progress in the current backend.
+ */
+typedef struct ProtocolCall
+{
+	bool inProgress;
+	ProtocolStatsKey key;
+	instr_time startTime;
+	instr_time lockWaitTime;
+} ProtocolCall;
+
+
+static const char *ProtocolFunctionNames[PROTOCOL_FUNCTION_COUNT] = {
+	"register_node",
+	"node_active",
+	"get_nodes",
+	"get_primary",
+	"get_other_nodes",
+	"remove_node",
+	"perform_failover",
+	"perform_promotion",
+	"start_maintenance",
+	"stop_maintenance",
+	"set_node_candidate_priority",
+	"set_node_replication_quorum",
+	"update_node_metadata",
+	"synchronous_standby_names",
+	"set_node_upstream",
+	"get_upstream",
+	"get_cascaded_nodes",
+	"register_nodes",
+	"renew_primary_lease",
+	"get_most_advanced_standby",
+	"remove_nodes"
+};
+
+static ProtocolStatsControlData *ProtocolStatsControl = NULL;
+static HTAB *ProtocolStatsHash = NULL;
+
+static ProtocolCall CurrentProtocolCall = { 0 };
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void ProtocolStatsShmemInit(void);
+static void ProtocolStatsXactCallback(XactEvent event, void *arg);
+static void ProtocolStatsEnd(bool failed);
+
+
+PG_FUNCTION_INFO_V1(stat_protocol);
+PG_FUNCTION_INFO_V1(stat_protocol_reset);
+
+
+/*
+ * InitializeProtocolStats, called at server start, requests the shared memory
+ * used to keep the protocol calls statistics.
+ */
+void
+InitializeProtocolStats(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(ProtocolStatsShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ProtocolStatsShmemInit;
+
+	RegisterXactCallback(ProtocolStatsXactCallback, NULL);
+}
+
+
+/*
+ * ProtocolStatsShmemSize computes how much shared memory is required.
+ */
+size_t
+ProtocolStatsShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(ProtocolStatsControlData)));
+	size = add_size(size, hash_estimate_size(PROTOCOL_STATS_MAX_ENTRIES,
+											 sizeof(ProtocolStatsEntry)));
+
+	return size;
+}
+
+
+/*
+ * ProtocolStatsShmemInit initializes the requested shared memory.
+ */
+static void
+ProtocolStatsShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ProtocolStatsControl =
+		(ProtocolStatsControlData *)
+		ShmemInitStruct("pg_auto_failover Protocol Stats",
+						MAXALIGN(sizeof(ProtocolStatsControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		ProtocolStatsControl->trancheId = LWLockNewTrancheId();
+		ProtocolStatsControl->lockTrancheName = "pg_auto_failover Protocol Stats";
+		LWLockRegisterTranche(ProtocolStatsControl->trancheId,
+							  ProtocolStatsControl->lockTrancheName);
+
+		LWLockInitialize(&ProtocolStatsControl->lock,
+						 ProtocolStatsControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(ProtocolStatsKey);
+	hashInfo.entrysize = sizeof(ProtocolStatsEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	ProtocolStatsHash = ShmemInitHash("pg_auto_failover Protocol Stats Hash",
+									  PROTOCOL_STATS_MAX_ENTRIES,
+									  PROTOCOL_STATS_MAX_ENTRIES,
+									  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * ProtocolStatsBegin registers the start of a protocol call. The formation
+ * and group can be NULL and -1 when they are not known yet, see
+ * ProtocolStatsSetGroup.
+ */
+void
+ProtocolStatsBegin(ProtocolFunction function, char *formationId, int groupId)
+{
+	ProtocolCall *call = &CurrentProtocolCall;
+
+	if (ProtocolStatsHash == NULL)
+	{
+		return;
+	}
+
+	/* a single transaction may contain several protocol calls */
+	if (call->inProgress)
+	{
+		ProtocolStatsEnd(false);
+	}
+
+	/* the key is hashed and compared as a blob */
+	memset(call, 0, sizeof(ProtocolCall));
+
+	call->key.databaseId = MyDatabaseId;
+	call->key.function = function;
+	call->key.groupId = -1;
+
+	if (formationId != NULL)
+	{
+		strlcpy(call->key.formationId, formationId, NAMEDATALEN);
+		call->key.groupId = groupId;
+	}
+
+	INSTR_TIME_SET_CURRENT(call->startTime);
+	INSTR_TIME_SET_ZERO(call->lockWaitTime);
+
+	call->inProgress = true;
+}
+
+
+/*
+ * ProtocolStatsSetGroup registers the formation and group of the protocol
+ * call in progress, when they were not known at the start of the call. It is
+ * called when taking the formation and group locks, so that the first lock
+ * taken decides.
+ */
+void
+ProtocolStatsSetGroup(char *formationId, int groupId)
+{
+	ProtocolCall *call = &CurrentProtocolCall;
+
+	if (!call->inProgress)
+	{
+		return;
+	}
+
+	if (call->key.formationId[0] == '\0')
+	{
+		strlcpy(call->key.formationId, formationId, NAMEDATALEN);
+		call->key.groupId = groupId;
+	}
+	else if (call->key.groupId == -1 &&
+			 strncmp(call->key.formationId, formationId, NAMEDATALEN) == 0)
+	{
+		call->key.groupId = groupId;
+	}
+}
+
+
+/*
+ * ProtocolStatsLockWait adds the time since the given start time, taken just
+ * before acquiring a lock, to the lock wait time of the protocol call in
+ * progress.
+ */
+void
+ProtocolStatsLockWait(instr_time lockStart)
+{
+	ProtocolCall *call = &CurrentProtocolCall;
+	instr_time lockEnd;
+
+	if (!call->inProgress)
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(lockEnd);
+	INSTR_TIME_SUBTRACT(lockEnd, lockStart);
+	INSTR_TIME_ADD(call->lockWaitTime, lockEnd);
+}
+
+
+/*
+ * ProtocolStatsXactCallback ends the protocol call in progress, if any, when
+ * the transaction ends.
+ */
+static void
+ProtocolStatsXactCallback(XactEvent event, void *arg)
+{
+	if (!CurrentProtocolCall.inProgress)
+	{
+		return;
+	}
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+		{
+			ProtocolStatsEnd(false);
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			ProtocolStatsEnd(true);
+			break;
+		}
+
+		default:
+		{
+			/* the call is still in progress */
+			break;
+		}
+	}
+}
+
+
+/*
+ * ProtocolStatsEnd adds the protocol call in progress to its shared memory
+ * entry.
+ */
+static void
+ProtocolStatsEnd(bool failed)
+{
+	ProtocolCall *call = &CurrentProtocolCall;
+	instr_time duration;
+	bool found = false;
+
+	call->inProgress = false;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, call->startTime);
+
+	double durationMs = INSTR_TIME_GET_MILLISEC(duration);
+	double lockWaitMs = INSTR_TIME_GET_MILLISEC(call->lockWaitTime);
+
+	LWLockAcquire(&ProtocolStatsControl->lock, LW_EXCLUSIVE);
+
+	ProtocolStatsEntry *entry =
+		(ProtocolStatsEntry *) hash_search(ProtocolStatsHash, &(call->key),
+										   HASH_ENTER_NULL, &found);
+
+	/* when the hash table is full, we stop counting new groups */
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->calls = 0;
+			entry->errors = 0;
+			entry->totalTime = 0;
+			entry->maxTime = 0;
+			entry->lockWaitTime = 0;
+		}
+
+		entry->calls++;
+		entry->errors += failed ? 1 : 0;
+		entry->totalTime += durationMs;
+		entry->maxTime = Max(entry->maxTime, durationMs);
+		entry->lockWaitTime += lockWaitMs;
+	}
+
+	LWLockRelease(&ProtocolStatsControl->lock);
+}
+
+
+/*
+ * stat_protocol returns the statistics of the protocol calls made to the
+ * current database, one row per function, formation and group.
+ */
+Datum
+stat_protocol(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		(resultInfo->allowedModes & SFRM_Materialize) == 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	MemoryContext perQueryContext = resultInfo->econtext->ecxt_per_query_memory;
+	MemoryContext oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (ProtocolStatsHash == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	LWLockAcquire(&ProtocolStatsControl->lock, LW_SHARED);
+
+	hash_seq_init(&status, ProtocolStatsHash);
+
+	ProtocolStatsEntry *entry = NULL;
+
+	while ((entry = (ProtocolStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[PROTOCOL_STATS_COLS];
+		bool isNulls[PROTOCOL_STATS_COLS];
+
+		if (entry->key.databaseId != MyDatabaseId)
+		{
+			continue;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] =
+			CStringGetTextDatum(ProtocolFunctionNames[entry->key.function]);
+
+		if (entry->key.formationId[0] == '\0')
+		{
+			isNulls[1] = true;
+		}
+		else
+		{
+			values[1] = CStringGetTextDatum(entry->key.formationId);
+		}
+
+		if (entry->key.groupId == -1)
+		{
+			isNulls[2] = true;
+		}
+		else
+		{
+			values[2] = Int32GetDatum(entry->key.groupId);
+		}
+
+		values[3] = Int64GetDatum(entry->calls);
+		values[4] = Int64GetDatum(entry->errors);
+		values[5] = Float8GetDatum(entry->totalTime);
+		values[6] = Float8GetDatum(entry->maxTime);
+		values[7] = Float8GetDatum(entry->lockWaitTime);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(&ProtocolStatsControl->lock);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * stat_protocol_reset discards the statistics of the protocol calls made to
+ * the current database.
+ */
+Datum
+stat_protocol_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+
+	if (ProtocolStatsHash == NULL)
+	{
+		PG_RETURN_VOID();
+	}
+
+	LWLockAcquire(&ProtocolStatsControl->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, ProtocolStatsHash);
+
+	ProtocolStatsEntry *entry = NULL;
+
+	while ((entry = (ProtocolStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.databaseId == MyDatabaseId)
+		{
+			(void) hash_search(ProtocolStatsHash, &(entry->key),
+							   HASH_REMOVE, NULL);
+		}
+	}
+
+	LWLockRelease(&ProtocolStatsControl->lock);
+
+	PG_RETURN_VOID();
+}
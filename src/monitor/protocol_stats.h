@@ -0,0 +1,60 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_stats.h
+ *
+ * Declarations for the shared memory statistics of the monitor protocol
+ * calls.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "portability/instr_time.h"
+
+
+/*
+ * ProtocolFunction lists the protocol functions of node_active_protocol.c
+ * that we keep statistics for.
+ */
+typedef enum ProtocolFunction
+{
+	PROTOCOL_REGISTER_NODE = 0,
+	PROTOCOL_NODE_ACTIVE,
+	PROTOCOL_GET_NODES,
+	PROTOCOL_GET_PRIMARY,
+	PROTOCOL_GET_OTHER_NODES,
+	PROTOCOL_REMOVE_NODE,
+	PROTOCOL_PERFORM_FAILOVER,
+	PROTOCOL_PERFORM_PROMOTION,
+	PROTOCOL_START_MAINTENANCE,
+	PROTOCOL_STOP_MAINTENANCE,
+	PROTOCOL_SET_NODE_CANDIDATE_PRIORITY,
+	PROTOCOL_SET_NODE_REPLICATION_QUORUM,
+	PROTOCOL_UPDATE_NODE_METADATA,
+	PROTOCOL_SYNCHRONOUS_STANDBY_NAMES,
+	PROTOCOL_SET_NODE_UPSTREAM,
+	PROTOCOL_GET_UPSTREAM,
+	PROTOCOL_GET_CASCADED_NODES,
+	PROTOCOL_REGISTER_NODES,
+	PROTOCOL_RENEW_PRIMARY_LEASE,
+	PROTOCOL_GET_MOST_ADVANCED_STANDBY,
+	PROTOCOL_REMOVE_NODES,
+
+	/* must be last */
+	PROTOCOL_FUNCTION_COUNT
+} ProtocolFunction;
+
+
+/* public function declarations */
+extern void InitializeProtocolStats(void);
+extern size_t ProtocolStatsShmemSize(void);
+extern void ProtocolStatsBegin(ProtocolFunction function,
+							   char *formationId, int groupId);
+extern void ProtocolStatsSetGroup(char *formationId, int groupId);
+extern void ProtocolStatsLockWait(instr_time lockStart);
@@ -78,3 +78,127 @@ select *
 
 -- should fail as there's no primary at this point
 select pgautofailover.perform_failover();
+
+select function_name, formationid, groupid, errors > 0 as failed
+  from pgautofailover.stat_protocol
+ where function_name = 'perform_failover';
+
+-- a standby node can't be its own upstream node
+select pgautofailover.set_node_upstream('default', 'node_3', 'node_3');
+
+-- a cascading standby can't participate in the replication quorum
+select pgautofailover.set_node_upstream('default', 'node_3', 'node_2');
+
+-- no secondary node to clone a new standby from at this point
+select * from pgautofailover.get_clone_source('default', 0);
+
+-- node_2 reports pg_basebackup progress
+select pgautofailover.set_node_progress(2, 'basebackup', 1024, 4096);
+select node_id, node_name, operation, done_bytes, total_bytes
+  from pgautofailover.current_progress();
+select pgautofailover.clear_node_progress(2);
+select * from pgautofailover.current_progress();
+
+-- formations can be assigned to monitor shards in a directory
+select * from pgautofailover.set_formation_shard('default', 'postgres://shard1/pg_auto_failover');
+select * from pgautofailover.set_formation_shard('default', 'postgres://shard2/pg_auto_failover');
+select * from pgautofailover.formation_shard;
+select pgautofailover.drop_formation_shard('default');
+select pgautofailover.drop_formation_shard('default');
+
+-- the JSON documents of pg_autoctl show state --json, one per node
+select doc::jsonb->>'node_id' as node_id, doc::jsonb->>'nodename' as nodename
+  from pgautofailover.current_state_json('default') as doc;
+
+-- keepers report the resources of their host, shown with the node state
+select pgautofailover.set_node_resources(2, 4, 8589934592, 4294967296,
+                                         0.5, 12.5, 1024, 2048, 4096);
+select doc::jsonb->'resources'->>'ncpu' as ncpu,
+       doc::jsonb->'resources'->>'walrate' as walrate
+  from pgautofailover.current_state_json('default') as doc
+ where doc::jsonb->>'node_id' = '2';
+
+-- primary keepers report how many commits wait for synchronous replication
+select pgautofailover.set_sync_rep_waits(2, 3, 1500);
+select pgautofailover.set_sync_rep_waits(2, 0, 0);
+select waiting, oldestwaitms, maxwaitms, stalls
+  from pgautofailover.node_sync_rep_waits
+ where nodeid = 2;
+
+-- current_state() also computes reachability and lag for each node
+select node_id, nodename, reachable in ('yes', 'no', 'unknown') as reachable,
+       health_lag >= 0 as health_lag, report_lag >= 0 as report_lag
+  from pgautofailover.current_state('default');
+
+-- events can be paginated with their eventid
+select count(*) from pgautofailover.events_since(0, count => 2);
+select count(*) = (select count(*) from pgautofailover.event) as all_events
+  from pgautofailover.events_since(0, count => 100000);
+select count(*)
+  from pgautofailover.events_since((select max(eventid) from pgautofailover.event));
+
+-- only a node that takes writes can renew its primary lease
+select pgautofailover.renew_primary_lease(2, 10000) is null as refused;
+select pgautofailover.renew_primary_lease(2, 0);
+
+-- keepers behind a transaction pooler long-poll the version of their group
+select pgautofailover.wait_for_state_change('default', 0, 0, 0) > 0 as changed;
+select pgautofailover.wait_for_state_change('unknown formation', 0, 0, 10) as version;
+select pgautofailover.wait_for_state_change('default', 0, 0, -1);
+
+-- log notifications are only sent to clients that subscribed to them
+begin;
+select pgautofailover.subscribe_log_notifications('warning', 'default') is not null as subscribed;
+select pgautofailover.unsubscribe_log_notifications() as unsubscribed;
+commit;
+select pgautofailover.unsubscribe_log_notifications() as unsubscribed;
+select pgautofailover.subscribe_log_notifications('debug');
+
+-- fleet_state() summarizes the groups of all the formations
+select formation_id, group_id, nodes, primary_name is null as no_primary,
+       standbys, healthy_standbys, max_lag_bytes is null as unknown_lag,
+       in_flux
+  from pgautofailover.fleet_state()
+ where formation_id = 'default';
+
+-- remove_nodes() removes many nodes at once, and checks them all first
+select * from pgautofailover.remove_nodes('{}');
+select * from pgautofailover.remove_nodes('{2, 1000}');
+
+-- events are checked against the constraints of the event table
+alter table pgautofailover.event
+  add constraint event_test_check check (nodeport <> 9879) not valid;
+
+select count(*) as reported
+  from pgautofailover.node_active('default', 3, 0,
+                                  current_group_role => 'report_lsn');
+
+alter table pgautofailover.event drop constraint event_test_check;
+
+-- the events of a transaction are inserted together, and indexed
+select max(eventid) as last_eventid from pgautofailover.event \gset
+
+begin;
+select count(*) as reported
+  from pgautofailover.node_active('default', 3, 0,
+                                  current_group_role => 'report_lsn');
+select count(*) as reported
+  from pgautofailover.node_active('default', 2, 0,
+                                  current_group_role => 'report_lsn');
+commit;
+
+set enable_seqscan to off;
+
+  select nodename
+    from pgautofailover.event
+   where eventid > :last_eventid
+     and description like 'New state is reported%'
+order by eventid;
+
+select count(*) >= 2 as batch,
+       count(distinct eventid) = count(*) as distinct_ids,
+       bool_and(reportedtli > 0) as valid_tli
+  from pgautofailover.event
+ where eventid > :last_eventid;
+
+reset enable_seqscan;
@@ -30,3 +30,13 @@ select *
                                     dbname => 'citus',
                                     desired_group_id => 1,
                                     node_kind => 'worker');
+
+-- register two more workers at once
+select *
+  from pgautofailover.register_nodes(
+         '[{"formation_id": "citus", "node_host": "localhost",
+            "node_port": 9879, "dbname": "citus",
+            "desired_group_id": 2, "node_kind": "worker"},
+           {"formation_id": "citus", "node_host": "localhost",
+            "node_port": 9880, "dbname": "citus",
+            "desired_group_id": 3, "node_kind": "worker"}]');
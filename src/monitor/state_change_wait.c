@@ -0,0 +1,382 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/state_change_wait.c
+ *
+ * Implementation of the long-poll waits on group state changes.
+ *
+ * The keepers LISTEN to the state notifications of their group, so as to
+ * wake-up as soon as the monitor assigns a new goal state. That requires a
+ * session that stays attached to the same monitor backend between two
+ * node_active calls, which a connection pooler in transaction pooling mode
+ * does not provide.
+ *
+ * Instead, a keeper can call pgautofailover.wait_for_state_change() with the
+ * version of its group that it last saw. The function returns as soon as
+ * a transaction that changed the states of that group has committed, or
+ * when the given timeout is elapsed, along with the current version of the
+ * group. Every call is then a short transaction of its own.
+ *
+ * Versions are kept in shared memory only, and start again from zero when
+ * the monitor restarts. A waiter returns as soon as the version differs from
+ * the one it knows about, so that keepers refresh their view of the group
+ * after a restart of the monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "metadata.h"
+#include "state_change_wait.h"
+
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+
+/* groups past that limit are never woken-up, waiters sleep until timeout */
+#define STATE_CHANGE_WAIT_MAX_GROUPS 4096
+
+
+typedef struct StateChangeWaitKey
+{
+	Oid databaseId;
+	char formationId[NAMEDATALEN];
+	int groupId;
+} StateChangeWaitKey;
+
+
+typedef struct StateChangeWaitEntry
+{
+	StateChangeWaitKey key;
+
+	/* incremented each time a transaction changed the group states */
+	int64 version;
+} StateChangeWaitEntry;
+
+
+typedef struct StateChangeWaitControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* all the waiters share a single condition variable */
+	ConditionVariable stateChanged;
+} StateChangeWaitControlData;
+
+
+static StateChangeWaitControlData *StateChangeWaitControl = NULL;
+static HTAB *StateChangeWaitHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static void StateChangeWaitShmemInit(void);
+static void BuildStateChangeWaitKey(StateChangeWaitKey *key,
+									const char *formationId, int groupId);
+static int64 StateChangeWaitVersion(StateChangeWaitKey *key);
+
+
+PG_FUNCTION_INFO_V1(wait_for_state_change);
+
+
+/*
+ * InitializeStateChangeWait, called at server start, requests the shared
+ * memory used to keep the group versions.
+ */
+void
+InitializeStateChangeWait(void)
+{
+	/* on PG 15, we use shmem_request_hook_type */
+#if PG_VERSION_NUM < 150000
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(StateChangeWaitShmemSize());
+	}
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = StateChangeWaitShmemInit;
+}
+
+
+/*
+ * StateChangeWaitShmemSize computes how much shared memory is required.
+ */
+size_t
+StateChangeWaitShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, MAXALIGN(sizeof(StateChangeWaitControlData)));
+	size = add_size(size, hash_estimate_size(STATE_CHANGE_WAIT_MAX_GROUPS,
+											 sizeof(StateChangeWaitEntry)));
+
+	return size;
+}
+
+
+/*
+ * StateChangeWaitShmemInit initializes the requested shared memory.
+ */
+static void
+StateChangeWaitShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	StateChangeWaitControl =
+		(StateChangeWaitControlData *)
+		ShmemInitStruct("pg_auto_failover State Change Wait",
+						MAXALIGN(sizeof(StateChangeWaitControlData)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		StateChangeWaitControl->trancheId = LWLockNewTrancheId();
+		StateChangeWaitControl->lockTrancheName =
+			"pg_auto_failover State Change Wait";
+		LWLockRegisterTranche(StateChangeWaitControl->trancheId,
+							  StateChangeWaitControl->lockTrancheName);
+
+		LWLockInitialize(&StateChangeWaitControl->lock,
+						 StateChangeWaitControl->trancheId);
+
+		ConditionVariableInit(&StateChangeWaitControl->stateChanged);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(StateChangeWaitKey);
+	hashInfo.entrysize = sizeof(StateChangeWaitEntry);
+	int hashFlags = (HASH_ELEM | HASH_BLOBS);
+
+	StateChangeWaitHash = ShmemInitHash("pg_auto_failover State Change Wait Hash",
+										STATE_CHANGE_WAIT_MAX_GROUPS,
+										STATE_CHANGE_WAIT_MAX_GROUPS,
+										&hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * StateChangeWaitBump increments the version of the given group. It is
+ * called once the transaction that changed the group states has committed,
+ * so that the waiters we wake-up see the new states.
+ */
+void
+StateChangeWaitBump(const char *formationId, int groupId)
+{
+	StateChangeWaitKey key;
+	bool found = false;
+
+	if (StateChangeWaitHash == NULL)
+	{
+		return;
+	}
+
+	BuildStateChangeWaitKey(&key, formationId, groupId);
+
+	LWLockAcquire(&StateChangeWaitControl->lock, LW_EXCLUSIVE);
+
+	StateChangeWaitEntry *entry =
+		(StateChangeWaitEntry *) hash_search(StateChangeWaitHash, &key,
+											 HASH_ENTER_NULL, &found);
+
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			entry->version = 0;
+		}
+
+		++entry->version;
+	}
+
+	LWLockRelease(&StateChangeWaitControl->lock);
+}
+
+
+/*
+ * StateChangeWaitBroadcast wakes-up all the waiters, which then check the
+ * version of the group they are interested in.
+ */
+void
+StateChangeWaitBroadcast(void)
+{
+	if (StateChangeWaitControl == NULL)
+	{
+		return;
+	}
+
+	ConditionVariableBroadcast(&StateChangeWaitControl->stateChanged);
+}
+
+
+/*
+ * wait_for_state_change waits until the version of the given group differs
+ * from the given one, or until the timeout is elapsed, and returns the
+ * current version of the group.
+ */
+Datum
+wait_for_state_change(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+	int32 groupId = PG_GETARG_INT32(1);
+	int64 sinceVersion = PG_GETARG_INT64(2);
+	int32 timeoutMs = PG_GETARG_INT32(3);
+
+	StateChangeWaitKey key;
+	int64 version = 0;
+
+	if (timeoutMs < 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("timeout_ms must not be negative")));
+	}
+
+	if (StateChangeWaitControl == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover.wait_for_state_change() requires "
+						"pgautofailover to be in shared_preload_libraries")));
+	}
+
+	BuildStateChangeWaitKey(&key, formationId, groupId);
+
+	TimestampTz deadline =
+		TimestampTzPlusMilliseconds(GetCurrentTimestamp(), (int64) timeoutMs);
+
+	/* register before checking the version, so as to not miss a wake-up */
+	ConditionVariablePrepareToSleep(&StateChangeWaitControl->stateChanged);
+
+	for (;;)
+	{
+		long secs = 0;
+		int microsecs = 0;
+
+		version = StateChangeWaitVersion(&key);
+
+		if (version != sinceVersion)
+		{
+			break;
+		}
+
+		TimestampTz now = GetCurrentTimestamp();
+
+		if (now >= deadline)
+		{
+			break;
+		}
+
+		TimestampDifference(now, deadline, &secs, &microsecs);
+
+		long remainingMs = secs * 1000 + microsecs / 1000;
+
+		if (remainingMs <= 0)
+		{
+			remainingMs = 1;
+		}
+
+#if PG_VERSION_NUM >= 130000
+		(void) ConditionVariableTimedSleep(&StateChangeWaitControl->stateChanged,
+										   remainingMs,
+										   PG_WAIT_EXTENSION);
+#else
+
+		/*
+		 * Before Postgres 13 a condition variable can't be waited on with a
+		 * timeout. A broadcast sets the latch of the processes that prepared
+		 * to sleep on it though, so we wait on our latch, and then prepare
+		 * to sleep again as the broadcast removed us from the wait list.
+		 */
+		int rc = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   remainingMs,
+						   PG_WAIT_EXTENSION);
+
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+		{
+			proc_exit(1);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		ConditionVariablePrepareToSleep(&StateChangeWaitControl->stateChanged);
+#endif
+	}
+
+	ConditionVariableCancelSleep();
+
+	PG_RETURN_INT64(version);
+}
+
+
+/*
+ * StateChangeWaitVersion returns the current version of the given group, or
+ * zero when no state change has been registered for it yet.
+ */
+static int64
+StateChangeWaitVersion(StateChangeWaitKey *key)
+{
+	bool found = false;
+	int64 version = 0;
+
+	LWLockAcquire(&StateChangeWaitControl->lock, LW_SHARED);
+
+	StateChangeWaitEntry *entry =
+		(StateChangeWaitEntry *) hash_search(StateChangeWaitHash, key,
+											 HASH_FIND, &found);
+
+	if (found)
+	{
+		version = entry->version;
+	}
+
+	LWLockRelease(&StateChangeWaitControl->lock);
+
+	return version;
+}
+
+
+/*
+ * BuildStateChangeWaitKey fills-in the given key.
+ */
+static void
+BuildStateChangeWaitKey(StateChangeWaitKey *key,
+						const char *formationId, int groupId)
+{
+	/* the key is hashed and compared as a blob */
+	memset(key, 0, sizeof(StateChangeWaitKey));
+
+	key->databaseId = MyDatabaseId;
+	strlcpy(key->formationId, formationId, NAMEDATALEN);
+	key->groupId = groupId;
+}
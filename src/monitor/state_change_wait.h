@@ -0,0 +1,22 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/state_change_wait.h
+ *
+ * Declarations for the long-poll waits on group state changes.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* public function declarations */
+extern void InitializeStateChangeWait(void);
+extern size_t StateChangeWaitShmemSize(void);
+extern void StateChangeWaitBump(const char *formationId, int groupId);
+extern void StateChangeWaitBroadcast(void);
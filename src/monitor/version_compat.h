@@ -44,6 +44,9 @@ extern List * list_qsort(const List *list, list_qsort_comparator cmp);
 #define table_beginscan_catalog heap_beginscan_catalog
 #define TableScanDesc HeapScanDesc
 
+#define ExecStoreHeapTuple(tuple, slot, shouldFree) \
+	ExecStoreTuple(tuple, slot, InvalidBuffer, shouldFree)
+
 #endif
 
 #if (PG_VERSION_NUM >= 120000)
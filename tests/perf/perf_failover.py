@@ -0,0 +1,97 @@
+import tests.pgautofailover_utils as pgautofailover
+import tests.perf_utils as perf
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+recorder = perf.PerfRecorder("failover")
+
+# scenarios may run in parallel, each in its own network namespaces
+NETWORK_PREFIX = "pgperf1"
+NETWORK_SUBNET = "172.27.11.0/24"
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster(NETWORK_PREFIX, NETWORK_SUBNET)
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/perf_failover/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/perf_failover/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+
+def test_002_add_standbys():
+    global node2, node3
+
+    node2 = cluster.create_datanode("/tmp/perf_failover/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+
+    node3 = cluster.create_datanode("/tmp/perf_failover/node3")
+    node3.create()
+    node3.run()
+    assert node3.wait_until_state(target_state="secondary")
+
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_003_manual_failover():
+    with perf.Stopwatch() as sw:
+        monitor.failover()
+        newPrimary = perf.wait_until_new_primary([node2, node3])
+
+    recorder.record("manual_failover_to_writes", sw.seconds)
+
+    with perf.Stopwatch() as sw:
+        others = [n for n in [node1, node2, node3] if n is not newPrimary]
+        perf.wait_until_states(
+            [(newPrimary, "primary")] + [(n, "secondary") for n in others]
+        )
+
+    recorder.record("manual_failover_to_stable", sw.seconds)
+
+
+def test_004_primary_failure():
+    primary = [
+        n for n in [node1, node2, node3] if n.get_state()[0] == "primary"
+    ]
+    assert len(primary) == 1
+
+    primary = primary[0]
+    others = [n for n in [node1, node2, node3] if n is not primary]
+
+    with perf.Stopwatch() as sw:
+        primary.fail()
+        newPrimary = perf.wait_until_new_primary(others, timeout=180)
+
+    recorder.record("primary_failure_to_writes", sw.seconds)
+
+    # bring the failed node back, and time how long it takes to rejoin
+    with perf.Stopwatch() as sw:
+        primary.run()
+        perf.wait_until_states(
+            [(newPrimary, "primary")]
+            + [(n, "secondary") for n in others if n is not newPrimary]
+            + [(primary, "secondary")],
+            timeout=180,
+        )
+
+    recorder.record("failed_primary_rejoin", sw.seconds)
@@ -0,0 +1,40 @@
+import tests.perf_scenarios as scenarios
+
+# no standby takes part in the replication quorum: commits are acknowledged
+# without waiting for any standby
+formation = scenarios.FormationScenarios(
+    "rto_rpo_async",
+    "pgperf3",
+    "172.27.13.0/24",
+    "/tmp/perf_rto_rpo_async",
+    number_sync_standbys=0,
+    replication_quorum=(False, False),
+)
+
+
+def setup_module():
+    formation.setup()
+
+
+def teardown_module():
+    formation.teardown()
+
+
+def test_000_create_formation():
+    formation.create_formation()
+
+
+def test_001_primary_crash():
+    formation.primary_crash()
+
+
+def test_002_primary_isolation():
+    formation.primary_isolation()
+
+
+def test_003_monitor_loss():
+    formation.monitor_loss()
+
+
+def test_004_standby_loss():
+    formation.standby_loss()
@@ -0,0 +1,40 @@
+import tests.perf_scenarios as scenarios
+
+# both standbys take part in the replication quorum, and with
+# number_sync_standbys 0 commits wait for any one of them
+formation = scenarios.FormationScenarios(
+    "rto_rpo_quorum",
+    "pgperf4",
+    "172.27.14.0/24",
+    "/tmp/perf_rto_rpo_quorum",
+    number_sync_standbys=0,
+    replication_quorum=(True, True),
+)
+
+
+def setup_module():
+    formation.setup()
+
+
+def teardown_module():
+    formation.teardown()
+
+
+def test_000_create_formation():
+    formation.create_formation()
+
+
+def test_001_primary_crash():
+    formation.primary_crash()
+
+
+def test_002_primary_isolation():
+    formation.primary_isolation()
+
+
+def test_003_monitor_loss():
+    formation.monitor_loss()
+
+
+def test_004_standby_loss():
+    formation.standby_loss()
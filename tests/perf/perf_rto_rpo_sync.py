@@ -0,0 +1,40 @@
+import tests.perf_scenarios as scenarios
+
+# both standbys take part in the replication quorum, with number_sync_standbys
+# set to 1
+formation = scenarios.FormationScenarios(
+    "rto_rpo_sync",
+    "pgperf5",
+    "172.27.15.0/24",
+    "/tmp/perf_rto_rpo_sync",
+    number_sync_standbys=1,
+    replication_quorum=(True, True),
+)
+
+
+def setup_module():
+    formation.setup()
+
+
+def teardown_module():
+    formation.teardown()
+
+
+def test_000_create_formation():
+    formation.create_formation()
+
+
+def test_001_primary_crash():
+    formation.primary_crash()
+
+
+def test_002_primary_isolation():
+    formation.primary_isolation()
+
+
+def test_003_monitor_loss():
+    formation.monitor_loss()
+
+
+def test_004_standby_loss():
+    formation.standby_loss()
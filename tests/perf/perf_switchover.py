@@ -0,0 +1,70 @@
+import tests.pgautofailover_utils as pgautofailover
+import tests.perf_utils as perf
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+recorder = perf.PerfRecorder("switchover")
+
+# scenarios may run in parallel, each in its own network namespaces
+NETWORK_PREFIX = "pgperf2"
+NETWORK_SUBNET = "172.27.12.0/24"
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster(NETWORK_PREFIX, NETWORK_SUBNET)
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/perf_switchover/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_nodes():
+    global node1, node2
+
+    node1 = cluster.create_datanode("/tmp/perf_switchover/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/perf_switchover/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_002_promotion():
+    with perf.Stopwatch() as sw:
+        node2.perform_promotion()
+        perf.wait_until_states([(node2, "primary"), (node1, "secondary")])
+
+    recorder.record("promotion", sw.seconds)
+
+
+def test_003_promotion_back():
+    with perf.Stopwatch() as sw:
+        node1.perform_promotion()
+        perf.wait_until_states([(node1, "primary"), (node2, "secondary")])
+
+    recorder.record("promotion_back", sw.seconds)
+
+
+def test_004_maintenance_switchover():
+    with perf.Stopwatch() as sw:
+        node1.enable_maintenance(allowFailover=True)
+        perf.wait_until_states([(node2, "primary"), (node1, "maintenance")])
+
+    recorder.record("maintenance_switchover", sw.seconds)
+
+    node1.disable_maintenance()
+    assert node1.wait_until_state(target_state="secondary")
@@ -0,0 +1,348 @@
+import os
+import signal
+import time
+
+import tests.pgautofailover_utils as pgautofailover
+import tests.perf_utils as perf
+
+"""
+Failover RTO/RPO scenarios for the performance tests of tests/perf.
+
+A FormationScenarios object creates a formation made of a monitor and three
+data nodes, with the given number_sync_standbys and replication_quorum
+settings, and then drives a write load with the clients of pg_autoctl do
+demo run while injecting one of the following faults at a time:
+
+  primary_crash       SIGKILL the primary keeper and Postgres, then restart
+                      the node once a standby has been promoted,
+
+  primary_isolation   bring the primary network interface down, then back up
+                      once a standby has been promoted,
+
+  monitor_loss        bring the monitor network interface down for a while,
+
+  standby_loss        bring the network interfaces of all the standby nodes
+                      down at the same time, then back up.
+
+The demo clients run from their own network namespace and record every write
+for which they received a commit acknowledgement. The scenario registers its
+fault in the demo.fault table, so that the demo.fault_recovery and
+demo.lost_writes views give us:
+
+  <fault>_time_to_writable  seconds from the fault injection to the first
+                            write acknowledged after the outage, or zero when
+                            the clients did not see an outage,
+
+  <fault>_lost_writes       how many acknowledged writes can't be found
+                            anymore on the primary node after the fault.
+
+Both measures are recorded with a PerfRecorder, so that they end-up in the
+results directory next to the failover and switchover measures.
+"""
+
+# how long the demo clients run before and after the fault injection
+WARMUP_TIME = 10
+COOLDOWN_TIME = 10
+
+DEMO_CLIENTS = 4
+
+
+class FormationScenarios:
+    def __init__(
+        self,
+        scenario,
+        networkNamePrefix,
+        networkSubnet,
+        directory,
+        number_sync_standbys=0,
+        replication_quorum=(True, True),
+    ):
+        self.scenario = scenario
+        self.networkNamePrefix = networkNamePrefix
+        self.networkSubnet = networkSubnet
+        self.directory = directory
+        self.number_sync_standbys = number_sync_standbys
+        self.replication_quorum = replication_quorum
+        self.recorder = perf.PerfRecorder(scenario)
+
+        self.cluster = None
+        self.monitor = None
+        self.nodes = []
+        self.app = None
+
+    @property
+    def synchronous(self):
+        """
+        Returns True when the primary waits for at least one standby to
+        acknowledge each commit, in which case a failover must not lose any
+        acknowledged write.
+        """
+        return any(self.replication_quorum)
+
+    def setup(self):
+        self.cluster = pgautofailover.Cluster(
+            self.networkNamePrefix, self.networkSubnet
+        )
+
+    def teardown(self):
+        self.cluster.destroy()
+
+    def create_formation(self):
+        """
+        Creates the monitor and the data nodes, applies the replication
+        settings, and waits until the formation is stable.
+        """
+        self.monitor = self.cluster.create_monitor(
+            os.path.join(self.directory, "monitor")
+        )
+        self.monitor.run()
+        self.monitor.wait_until_pg_is_running()
+
+        for i in range(3):
+            node = self.cluster.create_datanode(
+                os.path.join(self.directory, "node%d" % (i + 1))
+            )
+            node.create()
+            node.run()
+            assert node.wait_until_state(
+                target_state="single" if i == 0 else "secondary"
+            )
+            self.nodes.append(node)
+
+        primary = self.nodes[0]
+        assert primary.wait_until_state(target_state="primary")
+
+        standbys = self.nodes[1:]
+
+        for node, quorum in zip(standbys, self.replication_quorum):
+            if not quorum:
+                assert node.set_replication_quorum("false")
+
+        assert primary.set_number_sync_standbys(self.number_sync_standbys)
+
+        # the demo clients get their own network namespace
+        self.app = self.cluster.vlan.create_node()
+
+        self.wait_until_stable(primary, standbys)
+
+    def primary_crash(self):
+        primary, standbys = self.current_roles()
+
+        def fault():
+            crash_node(primary)
+            return perf.wait_until_new_primary(standbys, timeout=180)
+
+        def heal(newPrimary):
+            primary.run()
+            return newPrimary
+
+        self.run_scenario("primary_crash", primary, fault, heal, 240)
+
+    def primary_isolation(self):
+        primary, standbys = self.current_roles()
+
+        def fault():
+            primary.ifdown()
+            return perf.wait_until_new_primary(standbys, timeout=180)
+
+        def heal(newPrimary):
+            primary.ifup()
+            return newPrimary
+
+        self.run_scenario("primary_isolation", primary, fault, heal, 240)
+
+    def monitor_loss(self):
+        primary, standbys = self.current_roles()
+
+        def fault():
+            self.monitor.ifdown()
+            time.sleep(30)
+            return None
+
+        def heal(newPrimary):
+            self.monitor.ifup()
+            return primary
+
+        self.run_scenario("monitor_loss", primary, fault, heal, 90)
+
+    def standby_loss(self):
+        primary, standbys = self.current_roles()
+
+        def fault():
+            for node in standbys:
+                node.ifdown()
+
+            # with synchronous replication the writes are blocked until the
+            # monitor assigns the wait_primary state to the primary
+            if self.synchronous:
+                perf.wait_until_states([(primary, "wait_primary")], timeout=180)
+            else:
+                time.sleep(30)
+
+            return None
+
+        def heal(newPrimary):
+            for node in standbys:
+                node.ifup()
+            return primary
+
+        self.run_scenario("standby_loss", primary, fault, heal, 90)
+
+    def run_scenario(self, fault_kind, primary, fault, heal, duration):
+        """
+        Runs the demo clients for duration seconds while injecting a fault,
+        waits until the formation is stable again, and records the RTO and
+        RPO measures. The fault function returns the new primary node when
+        the fault causes a failover, None otherwise.
+        """
+        demo = DemoLoad(self.monitor, self.app, duration)
+        demo.start()
+
+        time.sleep(WARMUP_TIME)
+
+        injected = time.time()
+        promoted = None
+
+        newPrimary = fault()
+
+        if newPrimary is not None:
+            promoted = time.time()
+
+        healed = time.time()
+        newPrimary = heal(newPrimary)
+
+        others = [n for n in self.nodes if n is not newPrimary]
+        self.wait_until_stable(newPrimary, others)
+
+        time.sleep(COOLDOWN_TIME)
+        demo.wait()
+
+        faultId = newPrimary.run_sql_query(
+            "insert into demo.fault(kind, primary_node, "
+            "injected, promoted, healed) "
+            "values (%s, %s, to_timestamp(%s), to_timestamp(%s), "
+            "to_timestamp(%s)) returning id",
+            fault_kind,
+            primary.get_nodename(),
+            injected,
+            promoted,
+            healed,
+        )[0][0]
+
+        rto = newPrimary.run_sql_query(
+            "select rto_s from demo.fault_recovery where id = %s", faultId
+        )[0][0]
+
+        lost = newPrimary.run_sql_query(
+            "select count(*) from demo.lost_writes"
+        )[0][0]
+
+        # a failover is an outage, the clients must have seen the end of it
+        assert promoted is None or rto is not None, (
+            "%s: no write was acknowledged after the failover" % fault_kind
+        )
+
+        # without an outage, the clients kept writing all along
+        self.recorder.record(
+            "%s_time_to_writable" % fault_kind,
+            float(rto) if rto is not None else 0.0,
+        )
+        self.recorder.record_count("%s_lost_writes" % fault_kind, lost)
+
+        if self.synchronous:
+            assert lost == 0, (
+                "%s lost %d acknowledged writes with synchronous replication"
+                % (fault_kind, lost)
+            )
+
+    def current_roles(self):
+        """
+        Returns the current primary node and the list of standby nodes.
+        """
+        primary = [n for n in self.nodes if n.get_state()[0] == "primary"]
+        assert len(primary) == 1
+
+        primary = primary[0]
+        standbys = [n for n in self.nodes if n is not primary]
+
+        return primary, standbys
+
+    def wait_until_stable(self, primary, standbys, timeout=180):
+        perf.wait_until_states(
+            [(primary, "primary")] + [(n, "secondary") for n in standbys],
+            timeout=timeout,
+        )
+
+
+class DemoLoad:
+    """
+    Runs pg_autoctl do demo run in the background from the given virtual
+    node, without letting the demo application inject faults itself. The
+    clients register their acknowledged writes when the duration is elapsed.
+    """
+
+    def __init__(self, monitor, vnode, duration, clients=DEMO_CLIENTS):
+        self.monitor = monitor
+        self.vnode = vnode
+        self.duration = duration
+        self.clients = clients
+        self.program = pgautofailover.PGAutoCtl(monitor).program
+        self.proc = None
+
+    def start(self):
+        command = [
+            self.program,
+            "do",
+            "demo",
+            "run",
+            "--monitor",
+            self.monitor.connection_string(),
+            "--clients",
+            str(self.clients),
+            "--duration",
+            str(self.duration),
+            "--no-failover",
+        ]
+        self.proc = self.vnode.run_unmanaged(command)
+
+    def wait(self):
+        """
+        Waits until the demo application is done.
+        """
+        out, err = self.proc.communicate(
+            timeout=self.duration + pgautofailover.COMMAND_TIMEOUT
+        )
+        returncode = self.proc.returncode
+        self.proc.release()
+        self.proc = None
+
+        assert returncode == 0, "demo application failed:\n%s\n%s" % (
+            out,
+            err,
+        )
+
+
+def crash_node(node):
+    """
+    Simulates a host crash: SIGKILL the keeper process group and Postgres,
+    so that nothing gets a chance to restart or clean-up.
+    """
+    postmaster = None
+
+    with open(os.path.join(node.datadir, "postmaster.pid")) as f:
+        postmaster = int(f.readline())
+
+    if node.pg_autoctl and node.pg_autoctl.run_proc:
+        try:
+            os.killpg(node.pg_autoctl.run_proc.pid, signal.SIGKILL)
+        except ProcessLookupError:
+            pass
+
+        node.pg_autoctl.run_proc.communicate()
+        node.pg_autoctl.run_proc.release()
+        node.pg_autoctl.run_proc = None
+
+    try:
+        os.kill(postmaster, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
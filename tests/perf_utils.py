@@ -0,0 +1,201 @@
+import datetime as dt
+import json
+import os
+import os.path
+import time
+
+"""
+Helpers for the performance tests of tests/perf, which measure how long
+failovers and switchovers take, and compare the measures against the
+baselines stored in tests/perf/baselines.json.
+
+The following environment variables change how the measures are used:
+
+  PG_AUTOCTL_PERF_RESULTS           directory where each scenario writes its
+                                    measures as JSON, /tmp/pgaf_perf_results
+                                    by default.
+
+  PG_AUTOCTL_PERF_TOLERANCE         how much slower than its baseline a
+                                    measure may be, 0.5 (50%) by default.
+
+  PG_AUTOCTL_PERF_UPDATE_BASELINES  when set, store the measures as the new
+                                    baselines rather than checking them.
+
+  PG_AUTOCTL_PERF_WAIVE_MISSING     when set, a measure without a baseline is
+                                    recorded and not checked, rather than
+                                    failing the scenario.
+"""
+
+BASELINES_FILE = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "perf", "baselines.json"
+)
+DEFAULT_RESULTS_DIR = "/tmp/pgaf_perf_results"
+DEFAULT_TOLERANCE = 0.5
+
+POLLING_INTERVAL = 0.1
+
+
+class Stopwatch:
+    """
+    Measures the duration of a block of code, in seconds, using a monotonic
+    clock:
+
+        with Stopwatch() as sw:
+            ...
+        print(sw.seconds)
+    """
+
+    def __enter__(self):
+        self.start = time.monotonic()
+        self.seconds = None
+        return self
+
+    def __exit__(self, *args):
+        self.seconds = time.monotonic() - self.start
+        return False
+
+
+class PerfRecorder:
+    """
+    Records the measures of a performance scenario, writes them to the
+    results directory, and checks them against the stored baselines.
+    """
+
+    def __init__(self, scenario):
+        self.scenario = scenario
+        self.measures = {}
+        self.tolerance = float(
+            os.getenv("PG_AUTOCTL_PERF_TOLERANCE", DEFAULT_TOLERANCE)
+        )
+        self.resultsDir = os.getenv(
+            "PG_AUTOCTL_PERF_RESULTS", DEFAULT_RESULTS_DIR
+        )
+
+    def record(self, metric, seconds):
+        """
+        Records a measure in seconds, then checks it against its baseline.
+        """
+        self.measures[metric] = round(seconds, 3)
+        print("perf: %s/%s took %.3fs" % (self.scenario, metric, seconds))
+        self.write_results()
+
+        if os.getenv("PG_AUTOCTL_PERF_UPDATE_BASELINES"):
+            self.update_baseline(metric, self.measures[metric])
+        else:
+            self.check_baseline(metric, seconds)
+
+    def record_count(self, metric, count):
+        """
+        Records a measure that is a count of events, such as lost writes.
+        Counts are reported only, they are not checked against baselines.
+        """
+        self.measures[metric] = count
+        print("perf: %s/%s is %d" % (self.scenario, metric, count))
+        self.write_results()
+
+    def write_results(self):
+        os.makedirs(self.resultsDir, exist_ok=True)
+        path = os.path.join(self.resultsDir, "%s.json" % self.scenario)
+
+        with open(path, "w") as f:
+            json.dump(
+                {
+                    "scenario": self.scenario,
+                    "time": dt.datetime.now().isoformat(),
+                    "measures": self.measures,
+                },
+                f,
+                indent=2,
+                sort_keys=True,
+            )
+
+    def check_baseline(self, metric, seconds):
+        baseline = read_baselines().get(self.scenario, {}).get(metric)
+
+        if baseline is None:
+            assert os.getenv("PG_AUTOCTL_PERF_WAIVE_MISSING"), (
+                "no baseline for %s/%s in %s, record one with "
+                "PG_AUTOCTL_PERF_UPDATE_BASELINES=1"
+                % (self.scenario, metric, BASELINES_FILE)
+            )
+
+            print(
+                "perf: no baseline for %s/%s, not checking (waived)"
+                % (self.scenario, metric)
+            )
+            return
+
+        limit = baseline * (1 + self.tolerance)
+
+        assert seconds <= limit, (
+            "%s/%s took %.3fs, baseline is %.3fs (limit %.3fs)"
+            % (self.scenario, metric, seconds, baseline, limit)
+        )
+
+    def update_baseline(self, metric, seconds):
+        # scenarios may run in parallel, re-read the file right before
+        baselines = read_baselines()
+        baselines.setdefault(self.scenario, {})[metric] = seconds
+
+        tmpfile = "%s.%d" % (BASELINES_FILE, os.getpid())
+
+        with open(tmpfile, "w") as f:
+            json.dump(baselines, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+        os.rename(tmpfile, BASELINES_FILE)
+
+
+def read_baselines():
+    try:
+        with open(BASELINES_FILE) as f:
+            return json.load(f)
+    except FileNotFoundError:
+        return {}
+
+
+def wait_until_states(nodes_states, timeout=90):
+    """
+    Waits until each node of the given (node, state) pairs has reached its
+    target state, polling more often than wait_until_state() does so that
+    the measures are more precise. Returns the nodes in the same order.
+    """
+    wait_until = time.monotonic() + timeout
+
+    while time.monotonic() < wait_until:
+        if all(node.get_state()[0] == state for (node, state) in nodes_states):
+            return [node for (node, state) in nodes_states]
+
+        nodes_states[0][0].sleep(POLLING_INTERVAL)
+
+    raise Exception(
+        "nodes failed to reach their target states after %ds: %s"
+        % (
+            timeout,
+            ", ".join(
+                "%s is %s, expected %s"
+                % (node.logger_name(), node.get_state()[0], state)
+                for (node, state) in nodes_states
+            ),
+        )
+    )
+
+
+def wait_until_new_primary(nodes, timeout=90):
+    """
+    Waits until one of the given nodes has reached the primary state, and
+    returns it.
+    """
+    wait_until = time.monotonic() + timeout
+
+    while time.monotonic() < wait_until:
+        for node in nodes:
+            if node.get_state()[0] in ("primary", "wait_primary"):
+                return node
+
+        nodes[0].sleep(POLLING_INTERVAL)
+
+    raise Exception(
+        "none of %s reached the primary state after %ds"
+        % (", ".join(node.logger_name() for node in nodes), timeout)
+    )
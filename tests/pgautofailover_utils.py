@@ -60,6 +60,7 @@ class Cluster:
         self.networkSubnet = networkSubnet
         self.vlan = network.VirtualLAN(networkNamePrefix, networkSubnet)
         self.monitor = None
+        self.standby_monitors = []
         self.datanodes = []
 
     def create_monitor(
@@ -96,6 +97,39 @@ class Cluster:
         self.monitor.create()
         return self.monitor
 
+    def create_standby_monitor(
+        self, datadir, primary, port=5432, hostname=None, authMethod=None
+    ):
+        """
+        Initializes a hot standby of the given monitor and returns an instance
+        of MonitorNode.
+        """
+        vnode = self.vlan.create_node()
+        monitor = MonitorNode(
+            self,
+            datadir,
+            vnode,
+            port,
+            hostname,
+            authMethod,
+            standbyOf=primary.connection_string(),
+        )
+        monitor.create()
+        self.standby_monitors.append(monitor)
+        return monitor
+
+    def set_primary_monitor(self, monitor):
+        """
+        After a takeover, makes the given monitor standby the monitor of the
+        cluster and of its data nodes.
+        """
+        self.standby_monitors.remove(monitor)
+        self.standby_monitors.append(self.monitor)
+        self.monitor = monitor
+
+        for datanode in self.datanodes:
+            datanode.monitor = monitor
+
     # TODO group should auto sense for normal operations and passed to the
     # create cli as an argument when explicitly set by the test
     def create_datanode(
@@ -192,6 +226,8 @@ class Cluster:
         """
         for datanode in list(reversed(self.datanodes)):
             datanode.destroy(force=force, ignore_failure=True, timeout=3)
+        for monitor in list(reversed(self.standby_monitors)):
+            monitor.destroy()
         if self.monitor:
             self.monitor.destroy()
         self.vlan.destroy()
@@ -204,6 +240,7 @@ class Cluster:
         can be stopped in order safely.
         """
         nodes = self.datanodes.copy()
+        nodes += self.standby_monitors
         if self.monitor:
             nodes.append(self.monitor)
         return nodes
@@ -589,6 +626,7 @@ class PGNode(QueryRunner):
             "postgresql.auto.conf",
             "postgresql-auto-failover.conf",
             "postgresql-auto-failover-standby.conf",
+            "postgresql-auto-failover-role.conf",
         ]:
             conf = os.path.join(self.datadir, inc)
             if os.path.isfile(conf):
@@ -1075,6 +1113,7 @@ class DataNode(PGNode, StatefulNode):
         nodeId=None,
         citusSecondary=False,
         citusClusterName="default",
+        monitorUri=None,
     ):
         """
         Runs "pg_autoctl create"
@@ -1113,7 +1152,9 @@ class DataNode(PGNode, StatefulNode):
             create_args += ["--auth", self.authMethod]
 
         if not self.monitorDisabled:
-            create_args += ["--monitor", self.monitor.connection_string()]
+            if not monitorUri:
+                monitorUri = self.monitor.connection_string()
+            create_args += ["--monitor", monitorUri]
 
         if self.sslMode:
             create_args += ["--ssl-mode", self.sslMode]
@@ -1647,6 +1688,7 @@ class MonitorNode(PGNode):
         sslCAFile=None,
         sslServerKey=None,
         sslServerCert=None,
+        standbyOf=None,
     ):
 
         super().__init__(
@@ -1671,6 +1713,9 @@ class MonitorNode(PGNode):
         else:
             self.hostname = str(self.vnode.address)
 
+        # the connection string of the primary monitor of a standby
+        self.standbyOf = standbyOf
+
     def create(self, level="-v", run=False):
         """
         Initializes and runs the monitor process.
@@ -1707,6 +1752,9 @@ class MonitorNode(PGNode):
         if not self.sslSelfSigned and not self.sslCAFile:
             create_args += ["--no-ssl"]
 
+        if self.standbyOf:
+            create_args += ["--standby-of", self.standbyOf]
+
         if run:
             create_args += ["--run"]
 
@@ -1766,7 +1814,11 @@ class MonitorNode(PGNode):
 
         # Set self to None in cluster to avoid errors in future calls to
         # cluster.destroy()
-        self.cluster.monitor = None
+        if self.cluster.monitor is self:
+            self.cluster.monitor = None
+
+        if self in self.cluster.standby_monitors:
+            self.cluster.standby_monitors.remove(self)
 
     def create_formation(
         self, formation_name, kind="pgsql", secondary=None, dbname=None
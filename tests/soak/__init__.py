@@ -0,0 +1,2 @@
+# Initialize the tests package
+# https://docs.python.org/3/tutorial/modules.html#packages
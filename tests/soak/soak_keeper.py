@@ -0,0 +1,90 @@
+import os
+
+import tests.pgautofailover_utils as pgautofailover
+import tests.perf_utils as perf
+import tests.soak_utils as soak
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+tracker = soak.SoakTracker("keeper")
+
+NETWORK_PREFIX = "pgsoak1"
+NETWORK_SUBNET = "172.27.21.0/24"
+
+# call node_active every 20ms rather than every 5s: an hour of heartbeats
+# of a stable group takes about 15s
+KEEPER_SLEEP_TIME_MS = 20
+
+# how often we switchover, and how long we let the keepers run in between
+SWITCHOVER_EVERY = 20
+ITERATION_SLEEP = 1
+
+
+def setup_module():
+    global cluster
+
+    os.environ["PG_AUTOCTL_KEEPER_SLEEP_TIME_MS"] = str(KEEPER_SLEEP_TIME_MS)
+    cluster = pgautofailover.Cluster(NETWORK_PREFIX, NETWORK_SUBNET)
+
+
+def teardown_module():
+    cluster.destroy()
+    del os.environ["PG_AUTOCTL_KEEPER_SLEEP_TIME_MS"]
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/soak_keeper/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_nodes():
+    global node1, node2
+
+    node1 = cluster.create_datanode("/tmp/soak_keeper/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/soak_keeper/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_002_soak():
+    primary, secondary = node1, node2
+
+    for iteration in range(soak.iterations()):
+        # have every keeper reconnect to the monitor, LISTEN included
+        monitor.run_sql_query(
+            """
+            select pg_terminate_backend(pid)
+              from pg_stat_activity
+             where usename = 'autoctl_node'
+               and pid <> pg_backend_pid()
+            """
+        )
+
+        # have every pg_autoctl process reload its configuration
+        for node in [node1, node2]:
+            node.pg_autoctl.sighup()
+
+        if iteration > 0 and iteration % SWITCHOVER_EVERY == 0:
+            secondary.perform_promotion()
+            perf.wait_until_states(
+                [(secondary, "primary"), (primary, "secondary")]
+            )
+            primary, secondary = secondary, primary
+
+        cluster.sleep(ITERATION_SLEEP)
+
+        tracker.sample([node1, node2], iteration)
+
+
+def test_003_check_growth():
+    tracker.check()
@@ -0,0 +1,199 @@
+import datetime as dt
+import json
+import os
+import os.path
+import statistics
+import time
+
+import tests.pgautofailover_utils as pgautofailover
+
+"""
+Helpers for the soak tests of tests/soak, which drive pg_autoctl through
+many heartbeats, reconnections, reloads and switchovers in a compressed
+amount of time, and check that the memory and file descriptors used by each
+pg_autoctl process do not grow.
+
+The following environment variables change how the soak tests run:
+
+  PG_AUTOCTL_SOAK_ITERATIONS  how many rounds of reconnections and reloads
+                              to drive, 200 by default.
+
+  PG_AUTOCTL_SOAK_RESULTS     directory where each scenario writes its
+                              samples as JSON, /tmp/pgaf_soak_results by
+                              default.
+
+  PG_AUTOCTL_SOAK_RSS_GROWTH  how much the RSS and the heap of a process may
+                              grow, in kB, 2048 by default.
+
+  PG_AUTOCTL_SOAK_FD_GROWTH   how many more file descriptors a process may
+                              have open at the end, 0 by default.
+"""
+
+DEFAULT_ITERATIONS = 200
+DEFAULT_RESULTS_DIR = "/tmp/pgaf_soak_results"
+DEFAULT_RSS_GROWTH = 2048
+DEFAULT_FD_GROWTH = 0
+
+# the first samples are taken while caches and connections are set up
+WARMUP_RATIO = 0.2
+
+# we compare the median of the first and last windows of samples
+WINDOW_SIZE = 5
+
+
+def iterations():
+    return int(os.getenv("PG_AUTOCTL_SOAK_ITERATIONS", DEFAULT_ITERATIONS))
+
+
+def read_process_usage(pid):
+    """
+    Returns the RSS and the heap size of the given process, in kB, and its
+    count of open file descriptors, as found in /proc.
+    """
+    rss = 0
+    heap = 0
+
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                rss = int(line.split()[1])
+                break
+
+    with open("/proc/%d/smaps" % pid) as f:
+        inHeap = False
+
+        for line in f:
+            fields = line.split()
+
+            # mappings start with an address range, such as 0123-4567
+            if "-" in fields[0] and not fields[0].endswith(":"):
+                inHeap = fields[-1] == "[heap]"
+
+            elif inHeap and fields[0] == "Rss:":
+                heap += int(fields[1])
+
+    fds = len(os.listdir("/proc/%d/fd" % pid))
+
+    return rss, heap, fds
+
+
+def pg_autoctl_processes(node):
+    """
+    Returns a dict of the pg_autoctl processes of the given node, from its
+    pidfile: the supervisor and each of its services, by name.
+    """
+    command = pgautofailover.PGAutoCtl(node)
+    out, err, ret = command.execute(
+        "show file --pid", "show", "file", "--pid", "--contents", "--json"
+    )
+    pidfile = json.loads(out)
+
+    processes = {"supervisor": int(pidfile["pid"])}
+
+    for service in pidfile.get("services", []):
+        processes[service["name"]] = int(service["pid"])
+
+    return processes
+
+
+class SoakTracker:
+    """
+    Samples the memory and file descriptors used by the pg_autoctl processes
+    of a set of nodes over time, writes the samples to the results directory,
+    and checks that they do not grow.
+
+    A process that is restarted by the supervisor gets a new pid, and is
+    then tracked as a new process.
+    """
+
+    def __init__(self, scenario):
+        self.scenario = scenario
+        self.series = {}
+        self.rssGrowth = int(
+            os.getenv("PG_AUTOCTL_SOAK_RSS_GROWTH", DEFAULT_RSS_GROWTH)
+        )
+        self.fdGrowth = int(
+            os.getenv("PG_AUTOCTL_SOAK_FD_GROWTH", DEFAULT_FD_GROWTH)
+        )
+        self.resultsDir = os.getenv(
+            "PG_AUTOCTL_SOAK_RESULTS", DEFAULT_RESULTS_DIR
+        )
+        self.start = time.monotonic()
+
+    def sample(self, nodes, iteration):
+        for node in nodes:
+            for name, pid in pg_autoctl_processes(node).items():
+                try:
+                    rss, heap, fds = read_process_usage(pid)
+                except FileNotFoundError:
+                    # the process exited in the meantime
+                    continue
+
+                key = "%s/%s/%d" % (node.logger_name(), name, pid)
+
+                self.series.setdefault(key, []).append(
+                    {
+                        "iteration": iteration,
+                        "time": round(time.monotonic() - self.start, 3),
+                        "rss": rss,
+                        "heap": heap,
+                        "fds": fds,
+                    }
+                )
+
+        self.write_results()
+
+    def write_results(self):
+        os.makedirs(self.resultsDir, exist_ok=True)
+        path = os.path.join(self.resultsDir, "%s.json" % self.scenario)
+
+        with open(path, "w") as f:
+            json.dump(
+                {
+                    "scenario": self.scenario,
+                    "time": dt.datetime.now().isoformat(),
+                    "series": self.series,
+                },
+                f,
+                indent=2,
+                sort_keys=True,
+            )
+
+    def check(self):
+        """
+        Compares, for each process, the median usage of a window of samples
+        taken after the warmup with the median usage of the last window of
+        samples. Processes that have not been sampled long enough are not
+        checked.
+        """
+        errors = []
+
+        for key, samples in sorted(self.series.items()):
+            warmup = int(len(samples) * WARMUP_RATIO)
+
+            if len(samples) - warmup < 2 * WINDOW_SIZE:
+                print("soak: %s has too few samples, not checking" % key)
+                continue
+
+            first = samples[warmup : warmup + WINDOW_SIZE]
+            last = samples[-WINDOW_SIZE:]
+
+            for metric, limit in [
+                ("rss", self.rssGrowth),
+                ("heap", self.rssGrowth),
+                ("fds", self.fdGrowth),
+            ]:
+                before = statistics.median(s[metric] for s in first)
+                after = statistics.median(s[metric] for s in last)
+
+                print(
+                    "soak: %s %s from %d to %d" % (key, metric, before, after)
+                )
+
+                if after - before > limit:
+                    errors.append(
+                        "%s %s grew from %d to %d (limit +%d)"
+                        % (key, metric, before, after, limit)
+                    )
+
+        assert not errors, "\n".join(errors)
@@ -195,6 +195,18 @@ def test_012_start_node1_again():
     assert node1.wait_until_state(target_state="secondary")
 
 
+def test_012_001_failover_timeline():
+    timeline = monitor.run_sql_query(
+        "select nodeid, phase "
+        "from pgautofailover.failover_timeline('default', 0)"
+    )
+    phases = [phase for (nodeid, phase) in timeline]
+
+    assert "detection" in phases
+    assert "promotion" in phases
+    eq_(timeline[-1], (node2.nodeid, "primary"))
+
+
 def test_013_read_from_new_secondary():
     results = node1.run_sql_query("SELECT * FROM t1 ORDER BY a")
     eq_(results, [(1,), (2,), (3,), (4,)])
@@ -0,0 +1,213 @@
+import tests.pgautofailover_utils as pgautofailover
+import os.path
+import time
+
+from nose.tools import eq_
+
+cluster = None
+monitor = None
+standby1 = None
+standby2 = None
+node1 = None
+node2 = None
+peers = None
+takeover = None
+follower = None
+
+QUORUM = "ANY 1 (pgautofailover_monitor_standby)"
+TAKEOVER_TIMEOUT = 15
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def is_in_recovery(node):
+    return node.run_sql_query("select pg_is_in_recovery()")[0][0]
+
+
+def synchronous_standby_names(node):
+    return node.run_sql_query("show synchronous_standby_names")[0][0]
+
+
+def stop_and_get_logs(node):
+    out, err, ret = node.stop_pg_autoctl()
+    return "%s\n%s" % (out, err)
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/monitor_cluster/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_create_standby_monitors():
+    global standby1, standby2, peers
+
+    standby1 = cluster.create_standby_monitor(
+        "/tmp/monitor_cluster/standby1", monitor
+    )
+    standby2 = cluster.create_standby_monitor(
+        "/tmp/monitor_cluster/standby2", monitor
+    )
+
+    hosts = ",".join(
+        "%s:%d" % (m.vnode.address, m.port)
+        for m in [monitor, standby1, standby2]
+    )
+    peers = (
+        "postgres://autoctl_node@%s/pg_auto_failover"
+        "?target_session_attrs=read-write&sslmode=prefer" % hosts
+    )
+
+    for standby in [standby1, standby2]:
+        standby.config_set("cluster.peers", peers)
+        standby.config_set("cluster.quorum", "1")
+        standby.config_set("standby.takeover_timeout", str(TAKEOVER_TIMEOUT))
+        standby.run()
+
+        assert is_in_recovery(standby)
+
+
+def test_002_commit_quorum():
+    monitor.config_set("cluster.peers", peers)
+    monitor.config_set("cluster.quorum", "1")
+    monitor.pg_autoctl.sighup()
+
+    for i in range(30):
+        if synchronous_standby_names(monitor) == QUORUM:
+            break
+        time.sleep(1)
+
+    eq_(synchronous_standby_names(monitor), QUORUM)
+
+    # the standby monitors have been cloned before the quorum was set
+    eq_(synchronous_standby_names(standby1), "")
+    eq_(synchronous_standby_names(standby2), "")
+
+
+def test_003_init_nodes():
+    global node1, node2
+
+    node1 = cluster.create_datanode("/tmp/monitor_cluster/node1")
+    node1.create(monitorUri=peers)
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/monitor_cluster/node2")
+    node2.create(monitorUri=peers)
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_004_veto():
+    # standby2 can't query the primary monitor anymore, but still streams
+    # from it, and standby1 still hears from the primary monitor
+    hba = os.path.join(monitor.datadir, "pg_hba.conf")
+
+    with open(hba) as f:
+        rules = f.read()
+
+    with open(hba, "w") as f:
+        f.write(
+            "host pg_auto_failover autoctl_node %s/32 reject\n%s"
+            % (standby2.vnode.address, rules)
+        )
+    monitor.reload_postgres()
+
+    time.sleep(TAKEOVER_TIMEOUT + 15)
+
+    assert is_in_recovery(standby1)
+    assert is_in_recovery(standby2)
+
+    logs = stop_and_get_logs(standby2)
+
+    assert "Failed to contact the primary monitor" in logs
+    assert "not promoting this monitor standby" in logs
+    assert "heard from its primary" in logs
+    assert "agree that the primary monitor is lost" not in logs
+
+    with open(hba, "w") as f:
+        f.write(rules)
+    monitor.reload_postgres()
+
+    standby2.run()
+    assert is_in_recovery(standby2)
+
+
+def test_005_split_vote():
+    # standby2 can't reach any other monitor, it is the minority
+    standby2.ifdown()
+    time.sleep(TAKEOVER_TIMEOUT + 20)
+    standby2.ifup()
+
+    assert is_in_recovery(standby2)
+
+    logs = stop_and_get_logs(standby2)
+
+    assert "Only 1 of 3 monitors agree that the primary monitor is lost" in logs
+
+    standby2.run()
+    assert is_in_recovery(standby1)
+    assert is_in_recovery(standby2)
+
+
+def test_006_primary_monitor_lost():
+    global takeover, follower
+
+    monitor.stop_pg_autoctl()
+
+    for i in range(120):
+        promoted = [m for m in [standby1, standby2] if not is_in_recovery(m)]
+
+        if promoted:
+            break
+        time.sleep(1)
+
+    # give a second standby the time to be promoted too, if it would
+    time.sleep(2 * TAKEOVER_TIMEOUT)
+
+    promoted = [m for m in [standby1, standby2] if not is_in_recovery(m)]
+    eq_(len(promoted), 1)
+
+    takeover = promoted[0]
+    follower = standby2 if takeover is standby1 else standby1
+
+    cluster.set_primary_monitor(takeover)
+
+
+def test_007_quorum_rewritten():
+    eq_(synchronous_standby_names(takeover), QUORUM)
+
+    # the other standby monitor streams from the new primary monitor
+    lsn = takeover.run_sql_query("select pg_current_wal_flush_lsn()")[0][0]
+
+    for i in range(60):
+        caught_up = follower.run_sql_query(
+            "select pg_last_wal_replay_lsn() >= %s::pg_lsn", lsn
+        )[0][0]
+
+        if caught_up:
+            break
+        time.sleep(1)
+
+    assert caught_up
+    assert is_in_recovery(follower)
+
+
+def test_008_keepers_follow_takeover():
+    # the switchover commits on the new primary monitor, with its quorum
+    takeover.failover()
+
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+    assert node1.has_needed_replication_slots()
+    assert node2.has_needed_replication_slots()
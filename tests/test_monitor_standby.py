@@ -0,0 +1,102 @@
+import tests.pgautofailover_utils as pgautofailover
+import time
+
+cluster = None
+monitor = None
+standby = None
+node1 = None
+node2 = None
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def is_in_recovery(node):
+    return node.run_sql_query("select pg_is_in_recovery()")[0][0]
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/monitor_standby/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_create_standby_monitor():
+    global standby
+    standby = cluster.create_standby_monitor(
+        "/tmp/monitor_standby/standby", monitor
+    )
+    standby.config_set("standby.takeover_timeout", "20")
+    standby.run()
+
+    assert is_in_recovery(standby)
+
+
+def test_002_init_nodes():
+    global node1, node2
+
+    # the monitor URI of a standby lists both monitors
+    uri = standby.get_monitor_uri().strip()
+
+    node1 = cluster.create_datanode("/tmp/monitor_standby/node1")
+    node1.create(monitorUri=uri)
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/monitor_standby/node2")
+    node2.create(monitorUri=uri)
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_003_primary_monitor_briefly_unreachable():
+    monitor.stop_pg_autoctl()
+    time.sleep(5)
+    monitor.run()
+
+    # wait past the takeover_timeout from the start of the outage
+    time.sleep(25)
+
+    assert is_in_recovery(standby)
+    assert not is_in_recovery(monitor)
+
+    out, err, ret = standby.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    assert "Failed to contact the primary monitor" in logs
+    assert "promoting this monitor standby" not in logs
+
+    standby.run()
+    assert is_in_recovery(standby)
+
+
+def test_004_primary_monitor_lost():
+    monitor.stop_pg_autoctl()
+
+    for i in range(90):
+        if not is_in_recovery(standby):
+            break
+        time.sleep(1)
+
+    assert not is_in_recovery(standby)
+
+    cluster.set_primary_monitor(standby)
+
+
+def test_005_keepers_follow_takeover():
+    # a switchover needs both keepers to talk to the new primary monitor
+    standby.failover()
+
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+    assert node1.has_needed_replication_slots()
+    assert node2.has_needed_replication_slots()
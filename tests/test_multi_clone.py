@@ -0,0 +1,200 @@
+import tests.pgautofailover_utils as pgautofailover
+import os
+import re
+import signal
+import time
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+node4 = None
+node5 = None
+
+
+def clone_state_file(node):
+    return node.config_get("replication.backup_directory") + ".clone"
+
+
+def kill_pg_basebackup(backup_dir):
+    """
+    Kills the pg_basebackup processes that write to the given directory, in
+    case they survived the pg_autoctl process that started them.
+    """
+    for pid in [p for p in os.listdir("/proc") if p.isdigit()]:
+        try:
+            with open("/proc/%s/cmdline" % pid, "rb") as f:
+                argv = f.read().decode(errors="replace").split("\0")
+        except OSError:
+            continue
+
+        if os.path.basename(argv[0]) == "pg_basebackup" and backup_dir in argv:
+            os.kill(int(pid), signal.SIGKILL)
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/multi_clone/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/multi_clone/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+
+def test_002_create_t1():
+    # a table large enough to be split in several chunks of 8MB
+    node1.run_sql_query(
+        "CREATE TABLE t1 AS "
+        "SELECT x, md5(x::text) AS m FROM generate_series(1, 500000) x"
+    )
+    node1.run_sql_query("CHECKPOINT")
+
+
+def test_003_parallel_clone():
+    global node2
+    node2 = cluster.create_datanode("/tmp/multi_clone/node2")
+    node2.create()
+
+    # clone node2 without pg_basebackup, over several connections
+    node2.config_set("replication.clone_streams", "4")
+    node2.run()
+
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_004_read_from_parallel_clone():
+    results = node2.run_sql_query("SELECT count(*), sum(x) FROM t1")
+    assert results == [(500000, 125000250000)]
+
+
+def test_005_parallel_clone_logs():
+    out, err, ret = node2.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    # those come from the parallel clone engine, not from pg_basebackup
+    assert "using 4 stream(s)" in logs
+    assert "Cloned node" in logs
+
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node2.has_needed_replication_slots()
+
+
+def test_006_interrupt_clone():
+    global node3
+    node3 = cluster.create_datanode("/tmp/multi_clone/node3")
+    node3.create()
+
+    # slow pg_basebackup down enough to interrupt it
+    node3.config_set("replication.maximum_backup_rate", "1M")
+    node3.run()
+
+    backup_dir = node3.config_get("replication.backup_directory")
+    base_dir = os.path.join(backup_dir, "base")
+
+    for i in range(60):
+        if os.path.isfile(backup_dir + ".clone") and os.path.isdir(base_dir):
+            break
+        time.sleep(1)
+
+    assert os.path.isdir(base_dir)
+
+    node3.stop_pg_autoctl()
+    kill_pg_basebackup(backup_dir)
+
+    # the partial clone is kept for the next attempt
+    assert os.path.isfile(backup_dir + ".clone")
+    assert os.path.isdir(base_dir)
+
+
+def test_007_resume_clone():
+    node3.run()
+    assert node3.wait_until_state(target_state="secondary")
+
+    out, err, ret = node3.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    # the clone has been resumed, not started over
+    assert "starting a new base backup" not in logs
+
+    kept = re.search(r"Cloned node .*: kept (\d+) files", logs)
+    assert kept is not None
+    assert int(kept.group(1)) > 0
+
+    results = node3.run_sql_query("SELECT count(*), sum(x) FROM t1")
+    assert results == [(500000, 125000250000)]
+
+    node3.run()
+    assert node3.wait_until_state(target_state="secondary")
+    assert node3.has_needed_replication_slots()
+
+
+def test_008_mismatched_clone_state():
+    global node4
+    node4 = cluster.create_datanode("/tmp/multi_clone/node4")
+    node4.create()
+
+    # an interrupted clone of another system is not resumed
+    backup_dir = node4.config_get("replication.backup_directory")
+    os.makedirs(backup_dir, exist_ok=True)
+
+    with open(os.path.join(backup_dir, "junk"), "w") as f:
+        f.write("not from node1\n")
+
+    with open(backup_dir + ".clone", "w") as f:
+        f.write("system_identifier 1\nstarted_at 0\n")
+
+    node4.run()
+    assert node4.wait_until_state(target_state="secondary")
+
+    out, err, ret = node4.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    assert "is from system identifier 1" in logs
+    assert "starting a new base backup" in logs
+    assert not os.path.exists(os.path.join(node4.datadir, "junk"))
+
+    node4.run()
+    assert node4.wait_until_state(target_state="secondary")
+
+
+def test_009_corrupt_clone_state():
+    global node5
+    node5 = cluster.create_datanode("/tmp/multi_clone/node5")
+    node5.create()
+
+    # a clone state file that we can't read is not resumed either
+    backup_dir = node5.config_get("replication.backup_directory")
+    os.makedirs(backup_dir, exist_ok=True)
+
+    with open(backup_dir + ".clone", "w") as f:
+        f.write("system_identifier not-a-number\n")
+
+    node5.run()
+    assert node5.wait_until_state(target_state="secondary")
+
+    out, err, ret = node5.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    assert "Failed to read clone state file" in logs
+
+    node5.run()
+    assert node5.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
@@ -0,0 +1,97 @@
+import tests.pgautofailover_utils as pgautofailover
+import time
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+
+GET_OTHER_NODES = [
+    "pgautofailover.get_other_nodes(bigint)",
+    "pgautofailover.get_other_nodes"
+    "(bigint, pgautofailover.replication_state)",
+]
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/other_nodes_cache/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/other_nodes_cache/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+
+def test_002_init_secondaries():
+    global node2, node3
+    node2 = cluster.create_datanode("/tmp/other_nodes_cache/node2")
+    node2.create()
+    node2.run()
+
+    node3 = cluster.create_datanode("/tmp/other_nodes_cache/node3")
+    node3.create()
+    node3.run()
+
+    assert node2.wait_until_state(target_state="secondary")
+    assert node3.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_003_fail_get_other_nodes():
+    # node_active keeps working, only the list of other nodes fails
+    for function in GET_OTHER_NODES:
+        monitor.run_sql_query(
+            "revoke execute on function %s from public, autoctl_node"
+            % function
+        )
+
+
+def test_004_change_group():
+    # a new node name is a new version of the group on the monitor
+    node3.set_metadata(name="node3b")
+
+    node2.pg_autoctl.sighup()  # wake up from the node_active delay
+    time.sleep(10)
+
+
+def test_005_stale_list_not_used():
+    out, err, ret = node2.stop_pg_autoctl()
+    logs = "%s\n%s" % (out, err)
+
+    # the monitor told node2 that its list is out of date: never use it
+    assert "Failed to update our list of other nodes" in logs
+    assert "using our list of other nodes" not in logs
+
+
+def test_006_restore_get_other_nodes():
+    for function in GET_OTHER_NODES:
+        monitor.run_sql_query(
+            "grant execute on function %s to public, autoctl_node" % function
+        )
+
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+
+    node1.pg_autoctl.sighup()
+    node3.pg_autoctl.sighup()
+    time.sleep(6)
+
+    assert node1.has_needed_replication_slots()
+    assert node2.has_needed_replication_slots()
+    assert node3.has_needed_replication_slots()
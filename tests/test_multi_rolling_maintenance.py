@@ -0,0 +1,155 @@
+import tests.pgautofailover_utils as pgautofailover
+from nose.tools import eq_
+import subprocess
+
+import os
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+primary = None
+
+HOOK_LOG = "/tmp/multi_rolling_maintenance/hook.log"
+
+# one line per node in maintenance: its port, how many nodes are in the
+# maintenance state at the time, and whether the node is still a primary
+HOOK = (
+    "psql '%s' -Atc \"select $PG_AUTOCTL_NODE_PORT, "
+    "count(*) filter (where reportedstate = 'maintenance'), "
+    "bool_or(nodeport = $PG_AUTOCTL_NODE_PORT "
+    "and reportedstate = 'primary') "
+    'from pgautofailover.node" >> ' + HOOK_LOG
+)
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def rolling_maintenance(node, hook):
+    command = pgautofailover.PGAutoCtl(node)
+    return command.execute(
+        "perform rolling-maintenance",
+        "perform",
+        "rolling-maintenance",
+        "--hook",
+        hook,
+        "--wait",
+        "120",
+        timeout=600,
+    )
+
+
+def read_hook_log():
+    with open(HOOK_LOG) as f:
+        return [line.strip().split("|") for line in f if line.strip()]
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/multi_rolling_maintenance/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_nodes():
+    global node1, node2, node3
+
+    node1 = cluster.create_datanode("/tmp/multi_rolling_maintenance/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/multi_rolling_maintenance/node2")
+    node2.create()
+    node2.run()
+
+    node3 = cluster.create_datanode("/tmp/multi_rolling_maintenance/node3")
+    node3.create()
+    node3.run()
+
+    assert node2.wait_until_state(target_state="secondary")
+    assert node3.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_002_rolling_maintenance():
+    hook = HOOK % monitor.connection_string()
+    rolling_maintenance(node1, hook)
+
+    steps = read_hook_log()
+    ports = [int(step[0]) for step in steps]
+
+    # each node went through maintenance once, one node at a time
+    eq_(len(steps), 3)
+    eq_(sorted(ports[:2]), sorted([node2.port, node3.port]))
+    eq_(ports[2], node1.port)
+
+    for port, count, is_primary in steps:
+        eq_(count, "1")
+        eq_(is_primary, "f")
+
+
+def test_003_group_is_healthy():
+    global primary
+
+    # the old primary went last, after the one switchover
+    assert node1.wait_until_state(target_state="secondary")
+
+    primaries = [
+        n for n in [node2, node3] if n.get_state().reported == "primary"
+    ]
+    eq_(len(primaries), 1)
+    primary = primaries[0]
+
+    for node in [node1, node2, node3]:
+        if node is not primary:
+            assert node.wait_until_state(target_state="secondary")
+
+    assert node1.has_needed_replication_slots()
+    assert node2.has_needed_replication_slots()
+    assert node3.has_needed_replication_slots()
+
+
+def test_004_rolling_maintenance_hook_fails():
+    os.remove(HOOK_LOG)
+
+    # the hook fails on node1, now a standby node
+    hook = "test $PG_AUTOCTL_NODE_PORT -ne %d && %s" % (
+        node1.port,
+        HOOK % monitor.connection_string(),
+    )
+
+    try:
+        rolling_maintenance(node1, hook)
+        assert False, "rolling maintenance should have failed"
+    except subprocess.CalledProcessError as e:
+        assert "Maintenance hook failed for node" in e.stderr
+
+    # the rollout stopped at node1, before the switchover
+    steps = read_hook_log() if os.path.exists(HOOK_LOG) else []
+    ports = [int(step[0]) for step in steps]
+
+    assert len(steps) <= 1
+    assert node1.port not in ports
+    assert primary.port not in ports
+
+
+def test_005_group_is_healthy_after_failure():
+    # node1 left maintenance, and the primary has not changed
+    assert primary.wait_until_state(target_state="primary")
+
+    for node in [node1, node2, node3]:
+        if node is not primary:
+            assert node.wait_until_state(target_state="secondary")
+
+    assert node1.has_needed_replication_slots()
+    assert node2.has_needed_replication_slots()
+    assert node3.has_needed_replication_slots()